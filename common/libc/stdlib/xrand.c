@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * This file is shared between libc and the kernel, so don't put anything
+ * in here that won't work in both contexts.
+ */
+
+#ifdef _KERNEL
+#include <types.h>
+#include <lib.h>
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#endif
+
+/*
+ * Fast pseudo-random numbers with explicit state: xoshiro128**, by
+ * Blackman and Vigna. Each step is a handful of shifts and xors on
+ * four words, with no divide and no table, so it's far cheaper than
+ * random(); and since the state is the caller's, threads can each
+ * keep their own without locking. Not for anything that needs to be
+ * unpredictable.
+ */
+
+#define ROTL(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+/*
+ * Scramble one word (the finalizer from MurmurHash3). It's a
+ * bijection, so distinct inputs give distinct outputs.
+ */
+static
+uint32_t
+xrand_scramble(uint32_t z)
+{
+	z = (z ^ (z >> 16)) * 0x85ebca6b;
+	z = (z ^ (z >> 13)) * 0xc2b2ae35;
+	return z ^ (z >> 16);
+}
+
+/*
+ * Seed XR. Nearby seeds give unrelated sequences, and the four state
+ * words come out distinct, so never all zero (which would stick).
+ */
+void
+xrand_seed(struct xrand *xr, unsigned long seed)
+{
+	unsigned i;
+
+	for (i=0; i<4; i++) {
+		seed += 0x9e3779b9;
+		xr->xr_s[i] = xrand_scramble(seed);
+	}
+}
+
+/*
+ * Return the next 32 random bits.
+ */
+uint32_t
+xrand(struct xrand *xr)
+{
+	uint32_t *s = xr->xr_s;
+	uint32_t result, t;
+
+	result = ROTL(s[1] * 5, 7) * 9;
+	t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = ROTL(s[3], 11);
+	return result;
+}
+
+/*
+ * Fill BUF with N random words, the same ones N calls to xrand
+ * would give. The state stays in registers for the whole run.
+ */
+void
+xrand_fill(struct xrand *xr, uint32_t *buf, size_t n)
+{
+	uint32_t s0, s1, s2, s3, t;
+	size_t i;
+
+	s0 = xr->xr_s[0];
+	s1 = xr->xr_s[1];
+	s2 = xr->xr_s[2];
+	s3 = xr->xr_s[3];
+	for (i=0; i<n; i++) {
+		buf[i] = ROTL(s1 * 5, 7) * 9;
+		t = s1 << 9;
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = ROTL(s3, 11);
+	}
+	xr->xr_s[0] = s0;
+	xr->xr_s[1] = s1;
+	xr->xr_s[2] = s2;
+	xr->xr_s[3] = s3;
+}
@@ -35,9 +35,24 @@
 #ifdef _KERNEL
 #include <types.h>
 #include <lib.h>
+#include <kern/endian.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
+#endif
+
+/*
+ * Merge two adjacent aligned words into the word that starts SHIFT
+ * bits into the first. (Bytes at lower addresses are at the top of
+ * a word on big-endian machines, at the bottom on little-endian.)
+ */
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define MERGE(w0, w1, shift) \
+	(((w0) << (shift)) | ((w1) >> (sizeof(long) * 8 - (shift))))
+#else
+#define MERGE(w0, w1, shift) \
+	(((w0) >> (shift)) | ((w1) << (sizeof(long) * 8 - (shift))))
 #endif
 
 /*
@@ -47,39 +62,90 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned long *dw;
+	const unsigned long *sw;
+	unsigned long w0, w1;
+	unsigned shift;
+	size_t n;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * Short copies go by bytes. Otherwise, copy bytes until the
+	 * destination is word-aligned, then whole words: eight per
+	 * loop iteration when the source is aligned too, and when it
+	 * isn't, by loading aligned source words and shifting each
+	 * adjacent pair together. Either way every load and store is
+	 * aligned. The misaligned case never loads a source word that
+	 * has no bytes in the range. Finish with bytes.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (len >= 4 * sizeof(long)) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		long *d = dst;
-		const long *s = src;
+		dw = (unsigned long *)d;
+		n = len / sizeof(long);
+		shift = ((uintptr_t)s % sizeof(long)) * 8;
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		if (shift == 0) {
+			sw = (const unsigned long *)s;
+			for (; n >= 8; n -= 8) {
+				dw[0] = sw[0];
+				dw[1] = sw[1];
+				dw[2] = sw[2];
+				dw[3] = sw[3];
+				dw[4] = sw[4];
+				dw[5] = sw[5];
+				dw[6] = sw[6];
+				dw[7] = sw[7];
+				dw += 8;
+				sw += 8;
+			}
+			for (; n > 0; n--) {
+				*dw++ = *sw++;
+			}
+		}
+		else {
+			sw = (const unsigned long *)
+				((uintptr_t)s - shift / 8);
+			w0 = *sw++;
+			for (; n >= 4; n -= 4) {
+				w1 = sw[0];
+				dw[0] = MERGE(w0, w1, shift);
+				w0 = sw[1];
+				dw[1] = MERGE(w1, w0, shift);
+				w1 = sw[2];
+				dw[2] = MERGE(w0, w1, shift);
+				w0 = sw[3];
+				dw[3] = MERGE(w1, w0, shift);
+				dw += 4;
+				sw += 4;
+			}
+			for (; n > 0; n--) {
+				w1 = *sw++;
+				*dw++ = MERGE(w0, w1, shift);
+				w0 = w1;
+			}
 		}
+
+		s += (unsigned char *)dw - d;
+		len -= (unsigned char *)dw - d;
+		d = (unsigned char *)dw;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
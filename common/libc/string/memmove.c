@@ -35,9 +35,20 @@
 #ifdef _KERNEL
 #include <types.h>
 #include <lib.h>
+#include <kern/endian.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
+#endif
+
+/* See memcpy.c. */
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define MERGE(w0, w1, shift) \
+	(((w0) << (shift)) | ((w1) >> (sizeof(long) * 8 - (shift))))
+#else
+#define MERGE(w0, w1, shift) \
+	(((w0) >> (shift)) | ((w1) << (sizeof(long) * 8 - (shift))))
 #endif
 
 /*
@@ -48,7 +59,13 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d;
+	const unsigned char *s;
+	unsigned long *dw;
+	const unsigned long *sw;
+	unsigned long w0, w1;
+	unsigned shift;
+	size_t n;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,33 +101,67 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Copy backwards the same way memcpy copies forwards: align the
+	 * end of the destination, then whole words (unrolled, or
+	 * shifted together from aligned loads if the source is
+	 * misaligned), then the bytes left at the front. Look in
+	 * memcpy.c for more information.
+	 *
+	 * Within each step every word is loaded before any store that
+	 * could overwrite it, so overlap is safe here too.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (unsigned char *)dst + len;
+	s = (const unsigned char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (len >= 4 * sizeof(long)) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		dw = (unsigned long *)d;
+		n = len / sizeof(long);
+		shift = ((uintptr_t)s % sizeof(long)) * 8;
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		if (shift == 0) {
+			sw = (const unsigned long *)s;
+			for (; n >= 8; n -= 8) {
+				dw -= 8;
+				sw -= 8;
+				dw[7] = sw[7];
+				dw[6] = sw[6];
+				dw[5] = sw[5];
+				dw[4] = sw[4];
+				dw[3] = sw[3];
+				dw[2] = sw[2];
+				dw[1] = sw[1];
+				dw[0] = sw[0];
+			}
+			for (; n > 0; n--) {
+				*--dw = *--sw;
+			}
+		}
+		else {
+			/* sw points at the word holding s[-1] and s[0] */
+			sw = (const unsigned long *)
+				((uintptr_t)s - shift / 8);
+			w1 = *sw;
+			for (; n > 0; n--) {
+				w0 = *--sw;
+				*--dw = MERGE(w0, w1, shift);
+				w1 = w0;
+			}
 		}
+
+		s -= d - (unsigned char *)dw;
+		len -= d - (unsigned char *)dw;
+		d = (unsigned char *)dw;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -31,6 +31,7 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
@@ -41,11 +42,54 @@
 void *
 memset(void *ptr, int ch, size_t len)
 {
-	char *p = ptr;
-	size_t i;
+	unsigned char *p = ptr;
+	unsigned long *pw;
+	unsigned long w;
+	size_t n;
 
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	/*
+	 * Store bytes until the pointer is word-aligned, then whole
+	 * words of the fill byte, eight per loop iteration, then the
+	 * bytes left over. Short runs just go by bytes.
+	 */
+
+	if (len >= 4 * sizeof(long)) {
+		while ((uintptr_t)p % sizeof(long) != 0) {
+			*p++ = ch;
+			len--;
+		}
+
+		/* replicate the byte into every byte of the word */
+		w = (unsigned char)ch;
+		w |= w << 8;
+		w |= w << 16;
+		if (sizeof(long) > 4) {
+			w |= w << 16 << 16;
+		}
+
+		pw = (unsigned long *)p;
+		for (n = len / sizeof(long); n >= 8; n -= 8) {
+			pw[0] = w;
+			pw[1] = w;
+			pw[2] = w;
+			pw[3] = w;
+			pw[4] = w;
+			pw[5] = w;
+			pw[6] = w;
+			pw[7] = w;
+			pw += 8;
+		}
+		for (; n > 0; n--) {
+			*pw++ = w;
+		}
+
+		len -= (unsigned char *)pw - p;
+		p = (unsigned char *)pw;
+	}
+
+	while (len > 0) {
+		*p++ = ch;
+		len--;
 	}
 
 	return ptr;
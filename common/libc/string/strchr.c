@@ -36,9 +36,15 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+/* See strlen.c. */
+#define ONES	((unsigned long)-1 / 0xff)	/* 0x0101...01 */
+#define HIGHS	(ONES << 7)			/* 0x8080...80 */
+#define HASZERO(w) ((((w) - ONES) & ~(w) & HIGHS) != 0)
+
 /*
  * C standard string function: find leftmost instance of a character
  * in a string.
@@ -48,16 +54,38 @@ strchr(const char *s, int ch_arg)
 {
 	/* avoid sign-extension problems */
 	const char ch = ch_arg;
+	const unsigned long *w;
+	unsigned long pat;
 
-	/* scan from left to right */
-	while (*s) {
-		/* if we hit it, return it */
+	/* scan from left to right, by bytes until aligned */
+	while ((uintptr_t)s % sizeof(long) != 0) {
 		if (*s == ch) {
 			return (char *)s;
 		}
+		if (*s == 0) {
+			return NULL;
+		}
 		s++;
 	}
 
+	/*
+	 * Then by words, until one holds either the 0 or CH. (A byte
+	 * of W ^ PAT is zero where W has CH.)
+	 */
+	pat = (unsigned char)ch * ONES;
+	for (w = (const unsigned long *)s;
+	     !HASZERO(*w) && !HASZERO(*w ^ pat); w++) {
+		/* nothing */
+	}
+
+	/* then by bytes within that word */
+	for (s = (const char *)w; *s; s++) {
+		/* if we hit it, return it */
+		if (*s == ch) {
+			return (char *)s;
+		}
+	}
+
 	/* if we were looking for the 0, return that */
 	if (*s == ch) {
 		return (char *)s;
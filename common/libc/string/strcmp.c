@@ -36,9 +36,15 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+/* See strlen.c. */
+#define ONES	((unsigned long)-1 / 0xff)	/* 0x0101...01 */
+#define HIGHS	(ONES << 7)			/* 0x8080...80 */
+#define HASZERO(w) ((((w) - ONES) & ~(w) & HIGHS) != 0)
+
 /*
  * Standard C string function: compare two strings and return their
  * sort order.
@@ -47,8 +53,35 @@
 int
 strcmp(const char *a, const char *b)
 {
+	const unsigned long *wa, *wb;
 	size_t i;
 
+	/*
+	 * If A and B are equally misaligned, compare a word at a time
+	 * once they're aligned, for as long as the words match and A
+	 * hasn't ended. Then (or otherwise) finish by bytes. The byte
+	 * loop starts at the first word that differs or holds the end
+	 * of A, so it stops inside that word.
+	 */
+	if ((uintptr_t)a % sizeof(long) == (uintptr_t)b % sizeof(long)) {
+		while ((uintptr_t)a % sizeof(long) != 0) {
+			if (*a == 0 || *a != *b) {
+				goto bytes;
+			}
+			a++;
+			b++;
+		}
+		wa = (const unsigned long *)a;
+		wb = (const unsigned long *)b;
+		while (*wa == *wb && !HASZERO(*wa)) {
+			wa++;
+			wb++;
+		}
+		a = (const char *)wa;
+		b = (const char *)wb;
+	}
+
+ bytes:
 	/*
 	 * Walk down both strings until either they're different
 	 * or we hit the end of A.
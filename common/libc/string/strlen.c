@@ -36,9 +36,22 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+/*
+ * Word-at-a-time scanning. Subtracting 1 from every byte of W borrows
+ * into the top bit of any byte that was zero (or is above such a
+ * byte), and the ~W mask throws out bytes whose top bit was already
+ * set, so HASZERO is true exactly when some byte of W is zero.
+ * Aligned word loads never cross a page boundary, so reading the rest
+ * of the word past the end of a string is safe.
+ */
+#define ONES	((unsigned long)-1 / 0xff)	/* 0x0101...01 */
+#define HIGHS	(ONES << 7)			/* 0x8080...80 */
+#define HASZERO(w) ((((w) - ONES) & ~(w) & HIGHS) != 0)
+
 /*
  * C standard string function: get length of a string
  */
@@ -46,10 +59,23 @@
 size_t
 strlen(const char *str)
 {
-	size_t ret = 0;
+	const char *s = str;
+	const unsigned long *w;
+
+	/* bytes until aligned, then words until one has the 0 */
+	while ((uintptr_t)s % sizeof(long) != 0) {
+		if (*s == 0) {
+			return s - str;
+		}
+		s++;
+	}
+	for (w = (const unsigned long *)s; !HASZERO(*w); w++) {
+		/* nothing */
+	}
 
-	while (str[ret]) {
-		ret++;
+	/* find the 0 within that word */
+	for (s = (const char *)w; *s; s++) {
+		/* nothing */
 	}
-	return ret;
+	return s - str;
 }
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+/*
+ * Atomic operations on the mips, using LL/SC. See spinlock.h for
+ * how LL and SC work; the rule that there may be no other memory
+ * accesses between them applies here too. A failed SC just means
+ * someone else got in first, so we go back and try again.
+ *
+ * The SYNCs on either side make these full memory barriers.
+ *
+ * See include/atomic.h for further information.
+ */
+
+ATOMIC_INLINE
+unsigned
+atomic_cas(volatile unsigned *p, unsigned oldval, unsigned newval)
+{
+	unsigned x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slots */
+		"sync;"			/* barrier */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   if (x != oldval) give up */
+		" move %1, %4;"		/*   y = newval (delay slot) */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if it failed, try again */
+		" nop;"			/*   (delay slot) */
+		"2: sync;"		/* barrier */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (oldval), "r" (newval)
+		: "memory");
+	return x;
+}
+
+ATOMIC_INLINE
+unsigned
+atomic_add(volatile unsigned *p, int delta)
+{
+	unsigned x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slots */
+		"sync;"			/* barrier */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addu %1, %0, %3;"	/*   y = x + delta */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if it failed, try again */
+		" addu %0, %0, %3;"	/*   x += delta (delay slot) */
+		"sync;"			/* barrier */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (delta)
+		: "memory");
+	return x;
+}
+
+
+#endif /* _MIPS_ATOMIC_H_ */
@@ -38,6 +38,13 @@
 #define PAGE_SIZE  4096         /* size of VM page */
 #define PAGE_FRAME 0xfffff000   /* mask for getting page number from addr */
 
+/*
+ * Cache line size to lay out shared data for. This is the largest
+ * found in the MIPS processors we might run on; being too big only
+ * wastes a little space.
+ */
+#define CACHELINE_SIZE 64
+
 /*
  * MIPS-I hardwired memory layout:
  *    0xc0000000 - 0xffffffff   kseg2 (kernel, tlb-mapped)
@@ -66,6 +73,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -103,27 +111,91 @@
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_stealablepages returns how many more pages ram_stealmem can
+ * hand out.
  */
 
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
+unsigned long ram_stealablepages(void);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown names a run of ts_npages pages starting at ts_vaddr in
+ * the address space ts_as. A ts_npages of TLBSHOOTDOWN_ALL asks for
+ * every translation of ts_as to go; if ts_as is also NULL, the whole
+ * TLB is flushed. Requests queued for the same cpu are coalesced, and
+ * we'll take up to 16 of them before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* Address space, or NULL for any */
+	vaddr_t ts_vaddr;		/* First page to invalidate */
+	unsigned ts_npages;		/* Pages, or TLBSHOOTDOWN_ALL */
 };
 
+#define TLBSHOOTDOWN_ALL 0
+
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * TLB access for the machine-independent VM system (not used by
+ * dumbvm, which does this itself). All of these act on the current
+ * cpu only.
+ *
+ *   tlb_load: enter the translation VADDR -> PADDR, replacing any
+ *        existing one for VADDR; writes are allowed if WRITABLE.
+ *
+ *   tlb_unload: drop any translation for VADDR.
+ *
+ *   tlb_flushall: drop every translation.
+ *
+ * Translations are tagged with an address space ID, so the TLB can
+ * keep several address spaces' entries and switching between them
+ * doesn't flush it. tlb_load and tlb_unload act on the current address
+ * space's entries; tlb_flushall drops every entry, whatever its ID.
+ * Each address space has a struct tlbcontext, which holds the ID it has on each cpu. IDs are
+ * handed out per cpu in generations: when a cpu runs out, it flushes
+ * its TLB and starts a new generation, and contexts with an ID from
+ * an older one get a new ID when next used there.
+ *
+ *   tlb_context_init: set up CTX with no IDs.
+ *
+ *   tlb_context_switch: make CTX's ID on this cpu current, assigning
+ *        one if needed. Call at splhigh, after publishing c_tlbas.
+ *
+ *   tlb_context_none: switch to an ID no translation ever has.
+ *
+ *   tlb_context_drop: forget CTX's IDs on every cpu but (if KEEPMINE)
+ *        this one, so the translations tagged with them are dead. For
+ *        shootdowns: a cpu that has CTX current still needs to be told
+ *        to drop its entries. Call after changing the page table, and
+ *        before reading c_tlbas.
+ */
+
+#define TLB_MAXCPUS 32
+
+struct tlbcontext {
+	struct {
+		volatile uint32_t tcc_gen;	/* generation, or 0 */
+		uint32_t tcc_pid;		/* ID in that generation */
+	} tc_cpus[TLB_MAXCPUS];
+};
+
+void tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable);
+void tlb_unload(vaddr_t vaddr);
+void tlb_flushall(void);
+
+void tlb_context_init(struct tlbcontext *ctx);
+void tlb_context_switch(struct tlbcontext *ctx);
+void tlb_context_none(void);
+void tlb_context_drop(struct tlbcontext *ctx, bool keepmine);
+
 
 #endif /* _MIPS_VM_H_ */
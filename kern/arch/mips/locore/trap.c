@@ -128,6 +128,7 @@ mips_trap(struct trapframe *tf)
 	uint32_t code;
 	/*bool isutlb; -- not used */
 	bool iskern;
+	bool charge;
 	int spl;
 
 	/* The trap frame is supposed to be 35 registers long. */
@@ -185,7 +186,14 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		/* Time in the handler is system time. */
+		if (!iskern) {
+			thread_usermode(false);
+		}
 		mainbus_interrupt(tf);
+		if (!iskern) {
+			thread_usermode(true);
+		}
 
 		if (doadjust) {
 			KASSERT(curthread->t_curspl == IPL_HIGH);
@@ -208,8 +216,16 @@ mips_trap(struct trapframe *tf)
 	 * Do this by forcing splhigh(), which may do a redundant
 	 * cpu_irqoff() but forces the stored MI interrupt state into
 	 * sync, then restoring the previous state.
+	 *
+	 * Coming from user mode, the thread switches to system time,
+	 * except for the quick system calls (see syscall_isfast), which
+	 * skip the clock reads that takes and are charged as user time.
 	 */
+	charge = !iskern && !(code == EX_SYS && syscall_isfast(tf->tf_v0));
 	spl = splhigh();
+	if (charge) {
+		thread_usermode(false);
+	}
 	splx(spl);
 
 	/* Syscall? Call the syscall handler and return. */
@@ -315,6 +331,10 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (charge) {
+		thread_usermode(true);
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -375,6 +395,7 @@ mips_usermode(struct trapframe *tf)
 	 * above, we explicitly call spl0() and then call cpu_irqoff().
 	 */
 	spl0();
+	thread_usermode(true);
 	cpu_irqoff();
 
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
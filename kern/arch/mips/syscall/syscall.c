@@ -35,13 +35,741 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <threadprivate.h>
+#include <spl.h>
+#include <membar.h>
+#include <cpu.h>
+#include <clock.h>
 #include <copyinout.h>
+#include <proc.h>
 #include <syscall.h>
+#include <ktrace.h>
+#include "opt-dumbvm.h"
 
 
+/*
+ * What a system call hands back on success: a 32-bit value in
+ * sr_ret, or if sr_is64 is set a 64-bit one in sr_ret64.
+ */
+struct sysret {
+	int sr_ret;
+	off_t sr_ret64;
+	bool sr_is64;
+};
+
+/*
+ * One system call: its name, a function that unpacks its arguments
+ * from the trapframe and calls the sys_ function, and flags.
+ *
+ * SD_FAST marks calls that finish quickly and don't sleep, other than
+ * on a page fault copying out their result. The trap code doesn't
+ * switch the thread to system time for them, so their time is
+ * charged as user time; that saves two clock reads per call, which
+ * matters for calls this short.
+ */
+struct syscalldesc {
+	const char *sd_name;
+	int (*sd_func)(struct trapframe *tf, struct sysret *sr);
+	unsigned sd_flags;
+};
+
+#define SD_FAST		1
+
+/*
+ * Per-syscall counts, and with timing on, the time from entry to
+ * exit, which includes any time spent asleep. Kept per cpu, updated
+ * with interrupts off.
+ */
+struct syscallstat {
+	unsigned ss_calls;
+	unsigned ss_errors;
+	unsigned ss_timed;		/* calls timed */
+	uint64_t ss_nsec;		/* total time of those */
+	uint64_t ss_maxnsec;		/* longest */
+};
+
+#define SYSCALLSTAT_MAXCPUS	32
+
+static struct syscallstat *syscallstats[SYSCALLSTAT_MAXCPUS];
+static unsigned syscallstat_ncpus;
+static volatile bool syscallstat_timing;
+
+////////////////////////////////////////////////////////////
+// argument unpacking
+
+static
+int
+sc_reboot(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_reboot(tf->tf_a0);
+}
+
+static
+int
+sc___time(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_nanosleep(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_nanosleep((const_userptr_t)tf->tf_a0,
+			     (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_setaffinity(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_setaffinity(tf->tf_a0);
+}
+
+static
+int
+sc_ioprio_get(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_ioprio_get(tf->tf_a0, &sr->sr_ret);
+}
+
+static
+int
+sc_ioprio_set(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_ioprio_set(tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_getrlimit(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_setrlimit(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_futex_wait(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_futex_wait((const_userptr_t)tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_futex_wake(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_futex_wake((const_userptr_t)tf->tf_a0, tf->tf_a1,
+			      &sr->sr_ret);
+}
+
+static
+int
+sc_fork(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_fork(tf, &sr->sr_ret);
+}
+
+static
+int
+sc_execv(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_execv((const_userptr_t)tf->tf_a0,
+			 (const_userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_waitpid(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_waitpid(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			   &sr->sr_ret);
+}
+
+static
+int
+sc_getpid(struct trapframe *tf, struct sysret *sr)
+{
+	(void)tf;
+	return sys_getpid(&sr->sr_ret);
+}
+
+static
+int
+sc___spawn(struct trapframe *tf, struct sysret *sr)
+{
+	return sys___spawn((const_userptr_t)tf->tf_a0,
+			   (const_userptr_t)tf->tf_a1,
+			   (const_userptr_t)tf->tf_a2,
+			   tf->tf_a3, &sr->sr_ret);
+}
+
+static
+int
+sc__exit(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	sys__exit(tf->tf_a0);
+	panic("Returning from exit\n");
+}
+
+static
+int
+sc_open(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_open((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			&sr->sr_ret);
+}
+
+static
+int
+sc_read(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_read(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			&sr->sr_ret);
+}
+
+static
+int
+sc_write(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_write(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			 &sr->sr_ret);
+}
+
+/*
+ * For pread and friends the offset is on the stack, 8-byte aligned.
+ */
+static
+int
+sc_getpos(struct trapframe *tf, uint64_t *pos)
+{
+	return copyin((const_userptr_t)(tf->tf_sp + 16), pos, sizeof(*pos));
+}
+
+static
+int
+sc_pread(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t pos;
+	int err;
+
+	err = sc_getpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pread(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, pos,
+			 &sr->sr_ret);
+}
+
+static
+int
+sc_pwrite(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t pos;
+	int err;
+
+	err = sc_getpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pwrite(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, pos,
+			  &sr->sr_ret);
+}
+
+static
+int
+sc_readv(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_readv(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			 &sr->sr_ret);
+}
+
+static
+int
+sc_writev(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_writev(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			  &sr->sr_ret);
+}
+
+static
+int
+sc_preadv(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t pos;
+	int err;
+
+	err = sc_getpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_preadv(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			  pos, &sr->sr_ret);
+}
+
+static
+int
+sc_pwritev(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t pos;
+	int err;
+
+	err = sc_getpos(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pwritev(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			   pos, &sr->sr_ret);
+}
+
+static
+int
+sc_close(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_close(tf->tf_a0, &sr->sr_ret);
+}
+
+static
+int
+sc_pipe(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_pipe((userptr_t)tf->tf_a0, &sr->sr_ret);
+}
+
+static
+int
+sc_poll(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_poll((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			&sr->sr_ret);
+}
+
+static
+int
+sc_fstat(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_fstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_fsync(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_fsync(tf->tf_a0);
+}
+
+static
+int
+sc_fdatasync(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_fdatasync(tf->tf_a0);
+}
+
+static
+int
+sc_fallocate(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t offset, len;
+	int err;
+
+	(void)sr;
+
+	/* the offset is in a2/a3; the length is on the stack */
+	join32to64(tf->tf_a2, tf->tf_a3, &offset);
+	err = sc_getpos(tf, &len);
+	if (err) {
+		return err;
+	}
+	return sys_fallocate(tf->tf_a0, offset, len);
+}
+
+static
+int
+sc_ioctl(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+}
+
+static
+int
+sc_lseek(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t pos;
+	int whence;
+	int err;
+
+	/* the offset is in a2/a3; whence is on the stack */
+	join32to64(tf->tf_a2, tf->tf_a3, &pos);
+	err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		     &whence, sizeof(whence));
+	if (err) {
+		return err;
+	}
+	sr->sr_is64 = true;
+	return sys_lseek(tf->tf_a0, pos, whence, &sr->sr_ret64);
+}
+
+static
+int
+sc_getdirentries(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_getdirentries(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				 &sr->sr_ret);
+}
+
+static
+int
+sc_semop(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_semop(tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_copy_file_range(struct trapframe *tf, struct sysret *sr)
+{
+	uint32_t cfrargs[2];	/* len, flags */
+	int err;
+
+	/* len and flags are on the stack */
+	err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		     &cfrargs, sizeof(cfrargs));
+	if (err) {
+		return err;
+	}
+	return sys_copy_file_range(tf->tf_a0, (userptr_t)tf->tf_a1,
+				   tf->tf_a2, (userptr_t)tf->tf_a3,
+				   cfrargs[0], cfrargs[1], &sr->sr_ret);
+}
+
+static
+int
+sc_meld(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_meld((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+			(userptr_t)tf->tf_a2, &sr->sr_ret);
+}
+
+#if !OPT_DUMBVM
+static
+int
+sc_mmap(struct trapframe *tf, struct sysret *sr)
+{
+	uint64_t pos;
+	int mmapfd;
+	int err;
+
+	/* fd and then the offset, 8-byte aligned, are on the stack */
+	err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		     &mmapfd, sizeof(mmapfd));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 24), &pos, sizeof(pos));
+	if (err) {
+		return err;
+	}
+	return sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			tf->tf_a3, mmapfd, pos, &sr->sr_ret);
+}
+
+static
+int
+sc_munmap(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+}
+
+static
+int
+sc_sbrk(struct trapframe *tf, struct sysret *sr)
+{
+	return sys_sbrk((intptr_t)tf->tf_a0, &sr->sr_ret);
+}
+
+static
+int
+sc_getrusage(struct trapframe *tf, struct sysret *sr)
+{
+	(void)sr;
+	return sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// the table
+
+#define SC(name, flags) [SYS_##name] = { #name, sc_##name, flags }
+
+static const struct syscalldesc syscalltable[] = {
+	SC(fork, 0),
+	SC(execv, 0),
+	SC(_exit, 0),
+	SC(waitpid, 0),
+	SC(getpid, SD_FAST),
+#if !OPT_DUMBVM
+	SC(sbrk, 0),
+	SC(mmap, 0),
+	SC(munmap, 0),
+#endif
+	SC(open, 0),
+	SC(read, 0),
+	SC(write, 0),
+	SC(close, 0),
+	SC(pipe, 0),
+	SC(poll, 0),
+	SC(meld, 0),
+	SC(readv, 0),
+	SC(writev, 0),
+	SC(pread, 0),
+	SC(pwrite, 0),
+	SC(preadv, 0),
+	SC(pwritev, 0),
+	SC(fstat, 0),
+	SC(fsync, 0),
+	SC(fdatasync, 0),
+	SC(fallocate, 0),
+	SC(ioctl, 0),
+	SC(lseek, 0),
+	SC(getdirentries, 0),
+#if !OPT_DUMBVM
+	SC(getrusage, 0),
+#endif
+	SC(__time, SD_FAST),
+	SC(nanosleep, 0),
+	SC(reboot, 0),
+	SC(copy_file_range, 0),
+	SC(setaffinity, 0),
+	SC(ioprio_get, 0),
+	SC(ioprio_set, 0),
+	SC(getrlimit, 0),
+	SC(setrlimit, 0),
+	SC(__spawn, 0),
+	SC(semop, 0),
+	SC(futex_wait, 0),
+	SC(futex_wake, SD_FAST),
+};
+
+#define NSYSCALLS ARRAYCOUNT(syscalltable)
+
+static
+const struct syscalldesc *
+syscall_lookup(int callno)
+{
+	if (callno < 0 || (unsigned)callno >= NSYSCALLS ||
+	    syscalltable[callno].sd_func == NULL) {
+		return NULL;
+	}
+	return &syscalltable[callno];
+}
+
+/*
+ * Whether the trap code can skip the user/system time switch for
+ * CALLNO.
+ */
+bool
+syscall_isfast(int callno)
+{
+	const struct syscalldesc *sd;
+
+	sd = syscall_lookup(callno);
+	return sd != NULL && (sd->sd_flags & SD_FAST) != 0;
+}
+
+////////////////////////////////////////////////////////////
+// statistics
+
+/*
+ * Allocate the counters. Called once all the cpus are attached;
+ * until then (and on any cpu past SYSCALLSTAT_MAXCPUS) nothing is
+ * counted.
+ */
+void
+syscall_bootstrap(void)
+{
+	size_t size = NSYSCALLS * sizeof(struct syscallstat);
+	unsigned i, ncpus;
+
+	ncpus = thread_numcpus();
+	if (ncpus > SYSCALLSTAT_MAXCPUS) {
+		ncpus = SYSCALLSTAT_MAXCPUS;
+	}
+	for (i=0; i<ncpus; i++) {
+		syscallstats[i] = kmalloc(size);
+		if (syscallstats[i] == NULL) {
+			panic("syscall_bootstrap: Out of memory\n");
+		}
+		bzero(syscallstats[i], size);
+	}
+	membar_store_store();
+	syscallstat_ncpus = ncpus;
+}
+
+static
+uint64_t
+syscallstat_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The counters for CALLNO on this cpu, or NULL. */
+static
+struct syscallstat *
+syscallstat_get(int callno)
+{
+	unsigned c;
+
+	c = curcpu->c_number;
+	if (c >= syscallstat_ncpus) {
+		return NULL;
+	}
+	return &syscallstats[c][callno];
+}
+
+static
+void
+syscallstat_enter(int callno)
+{
+	struct syscallstat *ss;
+	int spl;
+
+	spl = splhigh();
+	ss = syscallstat_get(callno);
+	if (ss != NULL) {
+		ss->ss_calls++;
+	}
+	splx(spl);
+}
+
+static
+void
+syscallstat_exit(int callno, int err, uint64_t start)
+{
+	struct syscallstat *ss;
+	uint64_t nsec;
+	int spl;
+
+	nsec = start != 0 ? syscallstat_now() - start : 0;
+
+	spl = splhigh();
+	ss = syscallstat_get(callno);
+	if (ss != NULL) {
+		if (err) {
+			ss->ss_errors++;
+		}
+		if (start != 0) {
+			ss->ss_timed++;
+			ss->ss_nsec += nsec;
+			if (nsec > ss->ss_maxnsec) {
+				ss->ss_maxnsec = nsec;
+			}
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Turn the entry/exit timing on or off. Counts are always kept.
+ */
+void
+syscallstat_enable(bool on)
+{
+	syscallstat_timing = on;
+}
+
+/*
+ * Clear the counters.
+ */
+void
+syscallstat_reset(void)
+{
+	unsigned i;
+	int spl;
+
+	for (i=0; i<syscallstat_ncpus; i++) {
+		/* only protects against our own cpu; others may race */
+		spl = splhigh();
+		bzero(syscallstats[i], NSYSCALLS * sizeof(struct syscallstat));
+		splx(spl);
+	}
+}
+
+/*
+ * Print the counters, summed over all cpus, for the calls that have
+ * been made.
+ */
+void
+syscallstat_report(void)
+{
+	struct syscallstat sum, *ss;
+	unsigned i, c;
+
+	kprintf("syscall              calls   errors  avg usec  max usec\n");
+	for (i=0; i<NSYSCALLS; i++) {
+		if (syscalltable[i].sd_func == NULL) {
+			continue;
+		}
+		bzero(&sum, sizeof(sum));
+		for (c=0; c<syscallstat_ncpus; c++) {
+			ss = &syscallstats[c][i];
+			sum.ss_calls += ss->ss_calls;
+			sum.ss_errors += ss->ss_errors;
+			sum.ss_timed += ss->ss_timed;
+			sum.ss_nsec += ss->ss_nsec;
+			if (ss->ss_maxnsec > sum.ss_maxnsec) {
+				sum.ss_maxnsec = ss->ss_maxnsec;
+			}
+		}
+		if (sum.ss_calls == 0) {
+			continue;
+		}
+		kprintf("%-16s %9u %8u", syscalltable[i].sd_name,
+			sum.ss_calls, sum.ss_errors);
+		if (sum.ss_timed > 0) {
+			kprintf(" %9llu %9llu",
+				(sum.ss_nsec / sum.ss_timed) / 1000,
+				sum.ss_maxnsec / 1000);
+		}
+		kprintf("%s\n", (syscalltable[i].sd_flags & SD_FAST) ?
+			" (fast)" : "");
+	}
+	kprintf("Timing is %s.\n", syscallstat_timing ? "on" : "off");
+}
+
+////////////////////////////////////////////////////////////
+// dispatch
+
 /*
  * System call dispatcher.
  *
+ * System calls are looked up by number in syscalltable, whose entries
+ * unpack the arguments and call the sys_ functions.
+ *
  * A pointer to the trapframe created during exception entry (in
  * exception-*.S) is passed in.
  *
@@ -80,8 +808,10 @@
 void
 syscall(struct trapframe *tf)
 {
+	const struct syscalldesc *sd;
+	struct sysret sr;
+	uint64_t start;
 	int callno;
-	int32_t retval;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -89,76 +819,33 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	KTRACE(KT_SYSCALL, callno, tf->tf_a0);
 
 	/*
-	 * Initialize retval to 0. Many of the system calls don't
-	 * really return a value, just 0 for success and -1 on
-	 * error. Since retval is the value returned on success,
+	 * Initialize the return value to 0. Many of the system calls
+	 * don't really return a value, just 0 for success and -1 on
+	 * error. Since the return value is only used on success,
 	 * initialize it to 0 by default; thus it's not necessary to
 	 * deal with it except for calls that return other values,
 	 * like write.
 	 */
 
-	retval = 0;
-
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
-
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-
-            case SYS__exit:
-                sys__exit(tf->tf_a0);
-                panic("Returning from exit\n");
-                break;
-
-            /* Sample cases: open and read */
-            case SYS_open:
-                err = sys_open(
-                        (userptr_t)tf->tf_a0,
-                        tf->tf_a1,
-                        tf->tf_a2,
-                        &retval);
-                break;
-
-            case SYS_read:
-                err = sys_read(
-                        tf->tf_a0,
-                        (userptr_t)tf->tf_a1,
-                        tf->tf_a2,
-                        &retval);
-                break;
-
-             case SYS_write:
-                err = sys_write(
-                        tf->tf_a0,
-                        (userptr_t)tf->tf_a1,
-                        tf->tf_a2,
-                        &retval);
-                break;
-
-             case SYS_close:
-                err = sys_close(
-                        tf->tf_a0,
-                        &retval);
-                break;
-            
-             case SYS_meld:
-                err = sys_meld(
-                        (userptr_t)tf->tf_a0,
-                        (userptr_t)tf->tf_a1,
-                        (userptr_t)tf->tf_a2,
-                        &retval);
-                break;
-
-	    default:
+	sr.sr_ret = 0;
+	sr.sr_ret64 = 0;
+	sr.sr_is64 = false;
+
+	curthread->t_usage.u_nsyscalls++;
+
+	sd = syscall_lookup(callno);
+	if (sd == NULL) {
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
-		break;
+	}
+	else {
+		syscallstat_enter(callno);
+		start = syscallstat_timing ? syscallstat_now() : 0;
+		err = sd->sd_func(tf, &sr);
+		syscallstat_exit(callno, err, start);
 	}
 
 
@@ -173,9 +860,16 @@ syscall(struct trapframe *tf)
 	}
 	else {
 		/* Success. */
-		tf->tf_v0 = retval;
+		if (sr.sr_is64) {
+			/* 64-bit values come back in v0/v1 */
+			split64to32(sr.sr_ret64, &tf->tf_v0, &tf->tf_v1);
+		}
+		else {
+			tf->tf_v0 = sr.sr_ret;
+		}
 		tf->tf_a3 = 0;      /* signal no error */
 	}
+	KTRACE(KT_SYSRET, callno, err);
 
 	/*
 	 * Now, advance the program counter, to avoid restarting
@@ -184,6 +878,9 @@ syscall(struct trapframe *tf)
 
 	tf->tf_epc += 4;
 
+	/* Pay for any disk transfers over the process's rate limit. */
+	proc_iothrottle();
+
 	/* Make sure the syscall code didn't forget to lower spl */
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
@@ -191,15 +888,25 @@ syscall(struct trapframe *tf)
 }
 
 /*
- * Enter user mode for a newly forked process.
- *
- * This function is provided as a reminder. You need to write
- * both it and the code that calls it.
- *
- * Thus, you can trash it and do things another way if you prefer.
+ * Enter user mode for a newly forked process. TF is the kmalloc'd
+ * copy of the parent's trapframe made by sys_fork; the address space
+ * was already activated when the thread started.
  */
 void
 enter_forked_process(struct trapframe *tf)
 {
-	(void)tf;
+	struct trapframe mytf;
+
+	/* Move the parent's trapframe copy onto our own stack. */
+	mytf = *tf;
+	kfree(tf);
+
+	/* fork returns 0, successfully, in the child */
+	mytf.tf_v0 = 0;
+	mytf.tf_a3 = 0;
+
+	/* Advance the program counter, as syscall() does. */
+	mytf.tf_epc += 4;
+
+	mips_usermode(&mytf);
 }
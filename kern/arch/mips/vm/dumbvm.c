@@ -29,15 +29,21 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
 #include <spl.h>
 #include <cpu.h>
+#include <clock.h>
+#include <membar.h>
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <coremap.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <buf.h>
+#include <ktrace.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -59,15 +65,10 @@
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
 
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
 }
 
 /*
@@ -94,14 +95,7 @@ static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -113,24 +107,78 @@ alloc_kpages(unsigned npages)
 	dumbvm_can_sleep();
 	pa = getppages(npages);
 	if (pa==0) {
-		return 0;
+		/*
+		 * Ask the buffer cache to give some memory back and
+		 * try once more. The pages it frees may not be
+		 * contiguous, or may still be sitting in kmalloc, so
+		 * this can still fail.
+		 */
+		if (buffer_shrink(npages) == 0) {
+			return 0;
+		}
+		pa = getppages(npages);
+		if (pa==0) {
+			return 0;
+		}
 	}
 	return PADDR_TO_KVADDR(pa);
 }
 
+/* Report how many pages are still free */
+unsigned
+vm_freepages(void)
+{
+	return coremap_freepages();
+}
+
+/* Nothing to do; dumbvm zeroes whole regions as they're set up. */
+bool
+vm_idle(void)
+{
+	return false;
+}
+
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-
-	(void)addr;
+	KASSERT(addr >= MIPS_KSEG0);
+	coremap_free(addr - MIPS_KSEG0);
 }
 
+/*
+ * Dumbvm never changes a mapping once made, so it never sends
+ * shootdowns itself; but it can take the generic ones, which name a
+ * range of pages or everything.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	vaddr_t vaddr;
+	unsigned i;
+	int spl, slot;
+
+	if (ts->ts_as != NULL && ts->ts_as != curcpu->c_tlbas) {
+		/* Flushed already when this cpu switched away */
+		return;
+	}
+
+	spl = splhigh();
+	if (ts->ts_npages == TLBSHOOTDOWN_ALL || ts->ts_npages > NUM_TLB) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	else {
+		vaddr = ts->ts_vaddr & PAGE_FRAME;
+		for (i=0; i<ts->ts_npages; i++, vaddr += PAGE_SIZE) {
+			slot = tlb_probe(vaddr, 0);
+			if (slot >= 0) {
+				tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(),
+					  slot);
+			}
+		}
+	}
+	splx(spl);
 }
 
 int
@@ -146,6 +194,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	KTRACE(KT_VMFAULT, faulttype, faultaddress);
+
+	if (faultaddress == TIMEPAGE_ADDR) {
+		/* Read-only, so writes come here as VM_FAULT_READONLY. */
+		if (faulttype != VM_FAULT_READ || timepage_paddr() == 0) {
+			return EFAULT;
+		}
+		spl = splhigh();
+		tlb_random(faultaddress, timepage_paddr() | TLBLO_VALID);
+		splx(spl);
+		return 0;
+	}
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
@@ -257,6 +317,15 @@ void
 as_destroy(struct addrspace *as)
 {
 	dumbvm_can_sleep();
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
@@ -274,6 +343,14 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	/*
+	 * Publish the new address space before flushing, so a
+	 * shootdown broadcast either reaches us or was issued before
+	 * the flush. See ipi_tlbshootdown_broadcast.
+	 */
+	curcpu->c_tlbas = as;
+	membar_any_any();
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
@@ -328,6 +405,20 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return ENOSYS;
 }
 
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+	       struct vnode *vn, off_t offset, size_t filesize)
+{
+	/* dumbvm loads everything up front. */
+	(void)as;
+	(void)vaddr;
+	(void)memsize;
+	(void)vn;
+	(void)offset;
+	(void)filesize;
+	return ENOSYS;
+}
+
 static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
@@ -109,6 +109,17 @@ ram_stealmem(unsigned long npages)
 	return paddr;
 }
 
+/*
+ * Return the number of pages ram_stealmem can still allocate. Like
+ * ram_stealmem this is not synchronized; the answer is only a hint
+ * anyway, as it may change as soon as it's returned.
+ */
+unsigned long
+ram_stealablepages(void)
+{
+	return (lastpaddr - firstpaddr) / PAGE_SIZE;
+}
+
 /*
  * This function is intended to be called by the VM system when it
  * initializes in order to find out what memory it has available to
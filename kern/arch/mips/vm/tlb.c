@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * TLB handling for the machine-independent VM system. dumbvm has its
+ * own copies of these, so this file is only used without it.
+ *
+ * Address space IDs are per cpu. ID 0 is never given out, so it can
+ * be current when no address space is. Everything written to entryhi
+ * carries the current ID (even invalid entries, which being in kseg0
+ * never match anyway), so the register always holds it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <vm.h>
+
+struct tlbcpu {
+	uint32_t tc_gen;		/* current generation, from 1 */
+	uint32_t tc_next;		/* next ID to hand out */
+	uint32_t tc_pid;		/* current ID */
+} __ALIGNED(CACHELINE_SIZE);		/* not shared with the next cpu's */
+
+static struct tlbcpu tlb_cpus[TLB_MAXCPUS];
+
+static
+struct tlbcpu *
+tlb_getcpu(void)
+{
+	struct tlbcpu *tc;
+
+	KASSERT(curcpu->c_number < TLB_MAXCPUS);
+	tc = &tlb_cpus[curcpu->c_number];
+	if (tc->tc_gen == 0) {
+		tc->tc_gen = 1;
+		tc->tc_next = 1;
+	}
+	return tc;
+}
+
+/* The current ID, in place in entryhi */
+static
+uint32_t
+tlb_curpid(void)
+{
+	return tlb_getcpu()->tc_pid << TLBHI_PIDSHIFT;
+}
+
+void
+tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable)
+{
+	uint32_t ehi, elo;
+	int spl, slot;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	ehi = vaddr;
+	elo = paddr | TLBLO_VALID;
+	if (writable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ehi |= tlb_curpid();
+	slot = tlb_probe(ehi, 0);
+	if (slot >= 0) {
+		tlb_write(ehi, elo, slot);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+}
+
+void
+tlb_unload(vaddr_t vaddr)
+{
+	int spl, slot;
+
+	spl = splhigh();
+	slot = tlb_probe((vaddr & PAGE_FRAME) | tlb_curpid(), 0);
+	if (slot >= 0) {
+		tlb_write(TLBHI_INVALID(slot) | tlb_curpid(),
+			  TLBLO_INVALID(), slot);
+	}
+	splx(spl);
+}
+
+void
+tlb_flushall(void)
+{
+	uint32_t pid;
+	int i, spl;
+
+	spl = splhigh();
+	pid = tlb_curpid();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i) | pid, TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+void
+tlb_context_init(struct tlbcontext *ctx)
+{
+	unsigned i;
+
+	for (i=0; i<TLB_MAXCPUS; i++) {
+		ctx->tc_cpus[i].tcc_gen = 0;
+		ctx->tc_cpus[i].tcc_pid = 0;
+	}
+}
+
+void
+tlb_context_switch(struct tlbcontext *ctx)
+{
+	struct tlbcpu *tc;
+	unsigned n;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	tc = tlb_getcpu();
+	n = curcpu->c_number;
+	if (ctx->tc_cpus[n].tcc_gen != tc->tc_gen) {
+		if (tc->tc_next == NUM_TLBPID) {
+			/* Out of IDs: start over with an empty TLB. */
+			tc->tc_gen++;
+			if (tc->tc_gen == 0) {
+				tc->tc_gen = 1;
+			}
+			tc->tc_next = 1;
+			tlb_flushall();
+		}
+		ctx->tc_cpus[n].tcc_pid = tc->tc_next++;
+		ctx->tc_cpus[n].tcc_gen = tc->tc_gen;
+	}
+	tc->tc_pid = ctx->tc_cpus[n].tcc_pid;
+	tlb_setentryhi(tlb_curpid());
+}
+
+void
+tlb_context_none(void)
+{
+	int spl;
+
+	spl = splhigh();
+	tlb_getcpu()->tc_pid = 0;
+	tlb_setentryhi(0);
+	splx(spl);
+}
+
+/*
+ * Pairs with tlb_context_switch, which runs after c_tlbas is set: a
+ * cpu switching to CTX either sees its ID dropped here and gets a new
+ * one, or has already published c_tlbas by the time our caller looks.
+ * (The caller's shootdown broadcast has the barrier.)
+ */
+void
+tlb_context_drop(struct tlbcontext *ctx, bool keepmine)
+{
+	unsigned i, me;
+
+	me = curcpu->c_number;
+	for (i=0; i<TLB_MAXCPUS; i++) {
+		if (i != me || !keepmine) {
+			ctx->tc_cpus[i].tcc_gen = 0;
+		}
+	}
+}
+
+/*
+ * We only ever need to drop translations here; the next fault on
+ * the page reloads whatever the page table then says.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vaddr_t vaddr;
+	unsigned i;
+
+	if (ts->ts_as != NULL && ts->ts_as != curcpu->c_tlbas) {
+		/* Flushed already when this cpu switched away */
+		return;
+	}
+
+	if (ts->ts_npages == TLBSHOOTDOWN_ALL || ts->ts_npages > NUM_TLB) {
+		tlb_flushall();
+		return;
+	}
+
+	vaddr = ts->ts_vaddr & PAGE_FRAME;
+	for (i=0; i<ts->ts_npages; i++, vaddr += PAGE_SIZE) {
+		tlb_unload(vaddr);
+	}
+}
@@ -40,6 +40,7 @@
 #include <membar.h>
 #include <synch.h>
 #include <mainbus.h>
+#include <kprof.h>
 #include <sys161/bus.h>
 #include <lamebus/lamebus.h>
 #include "autoconf.h"
@@ -75,6 +76,22 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Zero the c0_count register.
+ */
+static
+void
+mips_timer_reset(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -275,6 +292,28 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Stop the on-chip timer. There's no way to turn it off, so just put
+ * the next interrupt as far away as it will go (a few minutes); if
+ * it does go off the timer goes back to running at HZ, which is
+ * harmless.
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+/*
+ * Restart the on-chip timer at HZ.
+ */
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_reset();
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -306,7 +345,8 @@ mainbus_interrupt(struct trapframe *tf)
 	if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
 		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
+		/* sample where we were, and call hardclock */
+		KPROF_SAMPLE(tf->tf_epc, (tf->tf_status & CST_KUp) != 0);
 		hardclock();
 		seen = true;
 	}
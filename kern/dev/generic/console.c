@@ -49,15 +49,18 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <lib.h>
 #include <uio.h>
 #include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
+#include <poll.h>
 #include "autoconf.h"
 
 /*
@@ -83,6 +86,9 @@ static struct lock *con_userlock_write = NULL;
 static char delayed_outbuf[DELAYBUFSIZE];
 static size_t delayed_outbuf_pos=0;
 
+/* Bytes con_io copies in from the user at a time when writing. */
+#define CONSOLE_WRITE_CHUNK  128
+
 static
 void
 putch_delayed(int ch)
@@ -109,19 +115,77 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/* Number of characters waiting in the transmit ring. */
+static
+unsigned
+con_txcount(struct con_softc *cs)
+{
+	return (cs->cs_txhead + CONSOLE_OUTPUT_BUFFER_SIZE - cs->cs_txtail)
+		% CONSOLE_OUTPUT_BUFFER_SIZE;
+}
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Anything waiting in the transmit ring goes first, so output stays
+ * in order. (Unless we got here from inside the ring code, e.g. by
+ * panicking; then just print.)
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	if (spinlock_do_i_hold(&cs->cs_txlock)) {
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_txlock);
+	if (cs->cs_txhead != cs->cs_txtail) {
+		while (cs->cs_txhead != cs->cs_txtail) {
+			cs->cs_sendpolled(cs->cs_devdata,
+					  cs->cs_txchars[cs->cs_txtail]);
+			cs->cs_txtail = (cs->cs_txtail + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+		}
+		wchan_wakeall(cs->cs_txwc, &cs->cs_txlock);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * Queue a character for output with interrupts. If the device is
+ * idle, send it now; otherwise put it in the ring, waiting for room
+ * if it's full.
+ */
+static
+void
+con_txqueue(struct con_softc *cs, int ch)
+{
+	KASSERT(spinlock_do_i_hold(&cs->cs_txlock));
+
+	if (!cs->cs_txbusy) {
+		cs->cs_txbusy = true;
+		cs->cs_send(cs->cs_devdata, ch);
+		return;
+	}
+	while (con_txcount(cs) == CONSOLE_OUTPUT_BUFFER_SIZE - 1) {
+		wchan_sleep(cs->cs_txwc, &cs->cs_txlock);
+	}
+	if (!cs->cs_txbusy) {
+		/* it drained while we slept */
+		cs->cs_txbusy = true;
+		cs->cs_send(cs->cs_devdata, ch);
+		return;
+	}
+	cs->cs_txchars[cs->cs_txhead] = ch;
+	cs->cs_txhead = (cs->cs_txhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,8 +193,25 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	spinlock_acquire(&cs->cs_txlock);
+	con_txqueue(cs, ch);
+	spinlock_release(&cs->cs_txlock);
+}
+
+/*
+ * Print LEN characters at once, the same way.
+ */
+static
+void
+putch_intr_many(struct con_softc *cs, const char *data, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_txlock);
+	for (i=0; i<len; i++) {
+		con_txqueue(cs, data[i]);
+	}
+	spinlock_release(&cs->cs_txlock);
 }
 
 /*
@@ -174,17 +255,36 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars_head = nexthead;
 
 	V(cs->cs_rsem);
+	pollq_wakeup(&cs->cs_pollq);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next character from the transmit ring, if there is one.
+ * Writers waiting for room are woken once the ring is half empty, so
+ * they can refill it in bulk rather than a character at a time.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
+	int ch;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_txlock);
+	if (cs->cs_txhead == cs->cs_txtail) {
+		cs->cs_txbusy = false;
+		wchan_wakeall(cs->cs_txwc, &cs->cs_txlock);
+	}
+	else {
+		ch = cs->cs_txchars[cs->cs_txtail];
+		cs->cs_txtail = (cs->cs_txtail + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		cs->cs_send(cs->cs_devdata, ch);
+		if (con_txcount(cs) == CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+			wchan_wakeall(cs->cs_txwc, &cs->cs_txlock);
+		}
+	}
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
@@ -240,6 +340,39 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Write from a uio. Copy in a chunk at a time, adding a carriage
+ * return before each newline, and queue each chunk in one go.
+ */
+static
+int
+con_write(struct con_softc *cs, struct uio *uio)
+{
+	char in[CONSOLE_WRITE_CHUNK], out[CONSOLE_WRITE_CHUNK * 2];
+	size_t len, i, n;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(in)) {
+			len = sizeof(in);
+		}
+		result = uiomove(in, len, uio);
+		if (result) {
+			return result;
+		}
+		n = 0;
+		for (i=0; i<len; i++) {
+			if (in[i] == '\n') {
+				out[n++] = '\r';
+			}
+			out[n++] = in[i];
+		}
+		putch_intr_many(cs, out, n);
+	}
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
@@ -260,31 +393,24 @@ con_io(struct device *dev, struct uio *uio)
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
+	if (uio->uio_rw == UIO_WRITE) {
+		result = con_write(the_console, uio);
+		lock_release(lk);
+		return result;
+	}
+
 	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
+		ch = getch();
+		if (ch=='\r') {
+			ch = '\n';
 		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+		result = uiomove(&ch, 1, uio);
+		if (result) {
+			lock_release(lk);
+			return result;
+		}
+		if (ch=='\n') {
+			break;
 		}
 	}
 	lock_release(lk);
@@ -299,13 +425,32 @@ con_ioctl(struct device *dev, int op, userptr_t data)
 	(void)dev;
 	(void)op;
 	(void)data;
-	return EINVAL;
+	return EIOCTL;
+}
+
+/*
+ * Readable when there's input waiting. Output is always allowed;
+ * a full transmit ring only makes a writer wait briefly.
+ */
+static
+int
+con_poll(struct device *dev, int events, struct pollset *ps, int *revents)
+{
+	struct con_softc *cs = dev->d_data;
+
+	pollq_register(&cs->cs_pollq, ps);
+	*revents = events & POLLOUT;
+	if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		*revents |= events & POLLIN;
+	}
+	return 0;
 }
 
 static const struct device_ops console_devops = {
 	.devop_eachopen = con_eachopen,
 	.devop_io = con_io,
 	.devop_ioctl = con_ioctl,
+	.devop_poll = con_poll,
 };
 
 static
@@ -343,7 +488,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *txwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -363,29 +509,34 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	txwc = wchan_create("console write");
+	if (txwc == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(txwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(txwc);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	pollq_init(&cs->cs_pollq);
+	spinlock_init(&cs->cs_txlock);
+	cs->cs_txwc = txwc;
+	cs->cs_txbusy = false;
+	cs->cs_txhead = 0;
+	cs->cs_txtail = 0;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -30,14 +30,22 @@
 #ifndef _GENERIC_CONSOLE_H_
 #define _GENERIC_CONSOLE_H_
 
+#include <spinlock.h>
+#include <poll.h>
+
 /*
  * Device data for the hardware-independent system console.
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output sent with interrupts goes through the transmit ring: the
+ * first character goes straight to the device and the rest wait in
+ * the ring, and each write-done interrupt (con_start) sends the next.
  */
 
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -47,10 +55,18 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	struct pollq cs_pollq;		/* poll()ers waiting for input */
+
+	/* transmit ring, protected by cs_txlock */
+	struct spinlock cs_txlock;
+	struct wchan *cs_txwc;		/* writers wait here for room */
+	bool cs_txbusy;			/* device is sending a char */
+	unsigned char cs_txchars[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_txhead;		/* next slot to put a char in */
+	unsigned cs_txtail;		/* next slot to take a char out */
 };
 
 /*
@@ -31,6 +31,9 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <uio.h>
 #include <vfs.h>
 #include <generic/random.h>
@@ -42,6 +45,10 @@
  * Remembers something that's a random source, and provides random()
  * and randmax() to the rest of the kernel.
  *
+ * Reading the device costs a bus access, so random() doesn't do it
+ * every time: each cpu runs its own xrand generator, and every
+ * RANDOM_RESEED calls stirs a fresh batch of device words into it.
+ *
  * The kernel config mechanism can be used to explicitly choose which
  * of the available random sources to use, if more than one is
  * available.
@@ -49,6 +56,9 @@
 
 static struct random_softc *the_random = NULL;
 
+/* random() calls per cpu between stirs from the device */
+#define RANDOM_RESEED 256
+
 /*
  * VFS device functions.
  * open: allow reading only.
@@ -139,20 +149,64 @@ config_random(struct random_softc *rs, int unit)
  * Random number functions exported to the rest of the kernel.
  */
 
+/*
+ * Stir four words from the device into C's generator, one for each
+ * state word, and step it so they're mixed together.
+ */
+static
+void
+random_stir(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<4; i++) {
+		c->c_rand.xr_s[i] ^=
+			the_random->rs_random(the_random->rs_devdata);
+	}
+	if ((c->c_rand.xr_s[0] | c->c_rand.xr_s[1] |
+	     c->c_rand.xr_s[2] | c->c_rand.xr_s[3]) == 0) {
+		/* all zero would stick */
+		c->c_rand.xr_s[0] = 1;
+	}
+	(void)xrand(&c->c_rand);
+	c->c_randleft = RANDOM_RESEED;
+}
+
+/*
+ * The spl keeps us on one cpu and out of an interrupt handler's way
+ * while using the cpu's generator.
+ */
 uint32_t
 random(void)
 {
+	struct cpu *c;
+	uint32_t val;
+	int spl;
+
 	if (the_random==NULL) {
 		panic("No random device\n");
 	}
-	return the_random->rs_random(the_random->rs_devdata);
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_randleft == 0) {
+		random_stir(c);
+	}
+	c->c_randleft--;
+	val = xrand(&c->c_rand);
+	splx(spl);
+	return val;
 }
 
+/*
+ * The generator's output is always the full 32 bits, whatever the
+ * device's range.
+ */
 uint32_t
 randmax(void)
 {
 	if (the_random==NULL) {
 		panic("No random device\n");
 	}
-	return the_random->rs_randmax(the_random->rs_devdata);
+	return 0xffffffff;
 }
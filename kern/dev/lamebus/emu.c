@@ -45,6 +45,7 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <array.h>
 #include <uio.h>
 #include <membar.h>
@@ -52,6 +53,7 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <buf.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -262,12 +264,12 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 }
 
 /*
- * Common code for read and readdir.
+ * Read a directory entry from a hardware-level file handle.
  */
 static
 int
-emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	   uint32_t op, struct uio *uio)
+emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	    struct uio *uio)
 {
 	int result;
 
@@ -283,7 +285,7 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
-	emu_wreg(sc, REG_OPER, op);
+	emu_wreg(sc, REG_OPER, EMU_OP_READDIR);
 	result = emu_waitdone(sc);
 	if (result) {
 		goto out;
@@ -300,59 +302,151 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 }
 
 /*
- * Read from a hardware-level file handle.
+ * Read from a hardware-level file handle, as much of UIO as the file
+ * has. The transfer is done in as few operations as the I/O buffer
+ * allows, holding the device throughout, and stops at the first
+ * short read rather than asking again just to be told it's EOF.
  */
 static
 int
-emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	 struct uio *uio)
+emu_read(struct emu_softc *sc, uint32_t handle, struct uio *uio)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READ, uio);
+	uint32_t len, got;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	result = 0;
+	lock_acquire(sc->e_lock);
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	while (uio->uio_resid > 0) {
+		if (uio->uio_offset > (off_t)0xffffffff) {
+			/* beyond the largest size the file can have; EOF */
+			break;
+		}
+		len = uio->uio_resid < EMU_MAXIO ? uio->uio_resid : EMU_MAXIO;
+
+		emu_wreg(sc, REG_IOLEN, len);
+		emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+		emu_wreg(sc, REG_OPER, EMU_OP_READ);
+		result = emu_waitdone(sc);
+		if (result) {
+			break;
+		}
+
+		membar_load_load();
+		got = emu_rreg(sc, REG_IOLEN);
+		result = uiomove(sc->e_iobuf, got, uio);
+		if (result) {
+			break;
+		}
+		uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+
+		if (got < len) {
+			/* EOF */
+			break;
+		}
+	}
+
+	lock_release(sc->e_lock);
+	return result;
 }
 
 /*
- * Read a directory entry from a hardware-level file handle.
+ * Write all of UIO to a hardware-level file handle, holding the
+ * device throughout as emu_read does.
  */
 static
 int
-emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	    struct uio *uio)
+emu_write(struct emu_softc *sc, uint32_t handle, struct uio *uio)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio);
+	uint32_t len;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	result = 0;
+	lock_acquire(sc->e_lock);
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	while (uio->uio_resid > 0) {
+		if (uio->uio_offset > (off_t)0xffffffff) {
+			result = EFBIG;
+			break;
+		}
+		len = uio->uio_resid < EMU_MAXIO ? uio->uio_resid : EMU_MAXIO;
+
+		emu_wreg(sc, REG_IOLEN, len);
+		emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+
+		result = uiomove(sc->e_iobuf, len, uio);
+		membar_store_store();
+		if (result) {
+			break;
+		}
+
+		emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
+		result = emu_waitdone(sc);
+		if (result) {
+			break;
+		}
+	}
+
+	lock_release(sc->e_lock);
+	return result;
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Read NUM pages of LEN bytes each, starting at page PAGE of a
+ * hardware-level file handle, into the buffers in DATAS. The part of
+ * any page past EOF is zeroed. This is the same as emu_read except
+ * for where the data goes.
  */
 static
 int
-emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	  struct uio *uio)
+emu_readpages(struct emu_softc *sc, uint32_t handle, uint32_t page,
+	      unsigned num, void **datas, size_t len)
 {
+	uint32_t offset, got, amt;
+	unsigned i, j, n;
+	char *iobuf = sc->e_iobuf;
 	int result;
 
-	KASSERT(uio->uio_rw == UIO_WRITE);
-
-	if (uio->uio_offset > (off_t)0xffffffff) {
-		return EFBIG;
-	}
+	KASSERT(len <= EMU_MAXIO);
 
+	result = 0;
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	offset = page * len;
+	for (i=0; i<num; i+=n) {
+		n = num - i;
+		if (n > EMU_MAXIO / len) {
+			n = EMU_MAXIO / len;
+		}
 
-	result = uiomove(sc->e_iobuf, len, uio);
-	membar_store_store();
-	if (result) {
-		goto out;
-	}
+		emu_wreg(sc, REG_IOLEN, n * len);
+		emu_wreg(sc, REG_OFFSET, offset);
+		emu_wreg(sc, REG_OPER, EMU_OP_READ);
+		result = emu_waitdone(sc);
+		if (result) {
+			break;
+		}
 
-	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
-	result = emu_waitdone(sc);
+		membar_load_load();
+		got = emu_rreg(sc, REG_IOLEN);
+		for (j=0; j<n; j++) {
+			amt = got > j * len ? got - j * len : 0;
+			if (amt > len) {
+				amt = len;
+			}
+			memcpy(datas[i+j], iobuf + j * len, amt);
+			bzero((char *)datas[i+j] + amt, len - amt);
+		}
+		offset += n * len;
+	}
 
- out:
 	lock_release(sc->e_lock);
 	return result;
 }
@@ -413,6 +507,8 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 
 static int emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   struct emufs_vnode **ret);
+static void emufs_droppages(struct emufs_fs *ef, struct emufs_vnode *ev,
+			    uint32_t first);
 
 /*
  * VOP_EACHOPEN on files
@@ -473,28 +569,24 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks: e_lock to protect the device,
-	 * and vn_countlock for the reference count.
+	 * Need e_lock to protect the device. Since vnodes are only
+	 * found (by emufs_loadvnode) with it held, holding it also
+	 * means nobody can pick up a new reference to this one.
 	 */
 
 	lock_acquire(ef->ef_emu->e_lock);
-	spinlock_acquire(&ev->ev_v.vn_countlock);
-
-	if (ev->ev_v.vn_refcount > 1) {
-		/* consume the reference VOP_DECREF passed us */
-		ev->ev_v.vn_refcount--;
 
-		spinlock_release(&ev->ev_v.vn_countlock);
+	if (!vnode_lastref(&ev->ev_v)) {
+		/* it consumed the reference VOP_DECREF passed us */
 		lock_release(ef->ef_emu->e_lock);
 		return EBUSY;
 	}
-	KASSERT(ev->ev_v.vn_refcount == 1);
 
 	/*
-	 * Since we hold e_lock and are the last ref, nobody can increment
-	 * the refcount, so we can release vn_countlock.
+	 * The handle is going away, so its pages have to. (Nobody
+	 * else can be reading them, as we have the last reference.)
 	 */
-	spinlock_release(&ev->ev_v.vn_countlock);
+	emufs_droppages(ef, ev, 0);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -524,44 +616,212 @@ emufs_reclaim(struct vnode *v)
 
 	lock_release(ef->ef_emu->e_lock);
 
-	kfree(ev);
+	kfree_tagged(ev, sizeof(struct emufs_vnode), &vnode_heaptag);
 	return 0;
 }
 
 /*
- * VOP_READ
+ * Page cache.
+ *
+ * Every exec of a program on emu0 would otherwise read the whole
+ * binary in again through the emulator. So file contents are cached
+ * in the kernel buffer cache, in pages of EMUFS_PAGESIZE. The buffer
+ * cache is indexed by fs and block number; for us the "block number"
+ * is made from the emulator handle and the page number within the
+ * file (see emufs.h), and FSOP_READBLOCK(S) reads the page from the
+ * emulator. Reads go through buffer_read_many, so a cold read still
+ * moves EMU_MAXIO at a time, and the buffer cache takes care of how
+ * much memory all this uses.
+ *
+ * The emulator hands out the same handle for a file as long as it's
+ * open, but handles are reused once closed. So the pages are dropped
+ * when the vnode is reclaimed; and to keep them around from one exec
+ * to the next, the vnodes of the last few files read are kept
+ * referenced on the ef_cached list.
+ *
+ * Writes go straight to the emulator and then drop the pages they
+ * covered; truncate drops the pages past the new end. ev_size caches
+ * the file size and ev_npages bounds the pages that might be cached.
+ * Changes made to the files on the host side while we're running
+ * aren't noticed. Cached pages are never dirty.
+ *
+ * ef_cachelock is held across each file read, write, or truncate, so
+ * reading a page in can't race with changing the file. It comes
+ * before e_lock.
+ */
+
+/*
+ * Drop the cached pages from page FIRST on.
+ */
+static
+void
+emufs_droppages(struct emufs_fs *ef, struct emufs_vnode *ev,
+		uint32_t first)
+{
+	uint32_t i;
+
+	for (i=first; i<ev->ev_npages; i++) {
+		buffer_drop(&ef->ef_fs, EMUFS_BLOCK(ev->ev_handle, i),
+			    EMUFS_PAGESIZE);
+	}
+	if (first < ev->ev_npages) {
+		ev->ev_npages = first;
+	}
+}
+
+/*
+ * Get EV's file size into ev_size if it isn't there already.
  */
 static
 int
-emufs_read(struct vnode *v, struct uio *uio)
+emufs_getsize(struct emufs_vnode *ev)
 {
-	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	if (ev->ev_size < 0) {
+		return emu_getsize(ev->ev_emu, ev->ev_handle, &ev->ev_size);
+	}
+	return 0;
+}
 
-	KASSERT(uio->uio_rw==UIO_READ);
+/*
+ * Put EV at the front of the cached list. If that pushes one off the
+ * end, hand it back; the caller should drop the reference after
+ * releasing ef_cachelock.
+ */
+static
+struct vnode *
+emufs_touch(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	struct emufs_vnode *drop;
+	unsigned i;
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	for (i=0; i<ef->ef_ncached; i++) {
+		if (ef->ef_cached[i] == ev) {
+			break;
+		}
+	}
+	drop = NULL;
+	if (i == ef->ef_ncached) {
+		VOP_INCREF(&ev->ev_v);
+		if (i == EMUFS_CACHE_FILES) {
+			drop = ef->ef_cached[--i];
 		}
+		else {
+			ef->ef_ncached++;
+		}
+	}
+	for (; i>0; i--) {
+		ef->ef_cached[i] = ef->ef_cached[i-1];
+	}
+	ef->ef_cached[0] = ev;
 
-		oldresid = uio->uio_resid;
+	return drop == NULL ? NULL : &drop->ev_v;
+}
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+/*
+ * Read from EV's pages, reading them in as needed.
+ */
+static
+int
+emufs_readpages(struct emufs_fs *ef, struct emufs_vnode *ev,
+		struct uio *uio)
+{
+	daddr_t blocks[BUFFER_MANY_MAX];
+	struct buf *bufs[BUFFER_MANY_MAX];
+	uint32_t page, lastpage, skip;
+	off_t end;
+	size_t amt;
+	unsigned i, n;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+	KASSERT(ev->ev_size >= 0);
+
+	end = uio->uio_offset + uio->uio_resid;
+	if (end > ev->ev_size) {
+		end = ev->ev_size;
+	}
+
+	result = 0;
+	reserve_buffers(EMUFS_PAGESIZE);
+	while (uio->uio_offset < end) {
+		page = uio->uio_offset / EMUFS_PAGESIZE;
+		lastpage = (end - 1) / EMUFS_PAGESIZE;
+		n = lastpage - page + 1;
+		if (n > BUFFER_MANY_MAX) {
+			n = BUFFER_MANY_MAX;
+		}
+		for (i=0; i<n; i++) {
+			blocks[i] = EMUFS_BLOCK(ev->ev_handle, page + i);
+		}
+		if (page + n > ev->ev_npages) {
+			ev->ev_npages = page + n;
 		}
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing read - EOF */
+		result = buffer_read_many(&ef->ef_fs, blocks, n,
+					  EMUFS_PAGESIZE, bufs);
+		if (result) {
+			break;
+		}
+		for (i=0; i<n; i++) {
+			buffer_set_kind(bufs[i], BUFKIND_DATA);
+			if (result == 0) {
+				data = buffer_map(bufs[i]);
+				skip = uio->uio_offset % EMUFS_PAGESIZE;
+				amt = EMUFS_PAGESIZE - skip;
+				if (amt > end - uio->uio_offset) {
+					amt = end - uio->uio_offset;
+				}
+				result = uiomove(data + skip, amt, uio);
+			}
+			buffer_release(bufs[i]);
+		}
+		if (result) {
 			break;
 		}
 	}
+	unreserve_buffers(EMUFS_PAGESIZE);
+	return result;
+}
 
-	return 0;
+/*
+ * VOP_READ
+ */
+static
+int
+emufs_read(struct vnode *v, struct uio *uio)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct vnode *drop;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	if (ev->ev_handle >= EMUFS_MAXCACHEHANDLE) {
+		/* can't make block numbers for it */
+		return emu_read(ev->ev_emu, ev->ev_handle, uio);
+	}
+	if (uio->uio_direct) {
+		/* writes go straight through, so the cache is never newer */
+		return emu_read(ev->ev_emu, ev->ev_handle, uio);
+	}
+
+	drop = NULL;
+	lock_acquire(ef->ef_cachelock);
+	result = emufs_getsize(ev);
+	if (result == 0) {
+		result = emufs_readpages(ef, ev, uio);
+		drop = emufs_touch(ef, ev);
+	}
+	lock_release(ef->ef_cachelock);
+
+	if (drop != NULL) {
+		VOP_DECREF(drop);
+	}
+	return result;
 }
 
 /*
@@ -592,32 +852,39 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	uint32_t page, lastpage;
+	off_t start, end;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
-		}
+	start = uio->uio_offset;
+	end = start + uio->uio_resid;
 
-		oldresid = uio->uio_resid;
+	lock_acquire(ef->ef_cachelock);
+	result = emu_write(ev->ev_emu, ev->ev_handle, uio);
 
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
-		}
-
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
-			break;
+	/* Drop the pages written (or maybe written, on error) */
+	if (end > start && start / EMUFS_PAGESIZE < ev->ev_npages) {
+		lastpage = (end - 1) / EMUFS_PAGESIZE;
+		for (page = start / EMUFS_PAGESIZE;
+		     page <= lastpage && page < ev->ev_npages; page++) {
+			buffer_drop(&ef->ef_fs,
+				    EMUFS_BLOCK(ev->ev_handle, page),
+				    EMUFS_PAGESIZE);
 		}
 	}
+	if (result) {
+		/* the size might be anything now */
+		ev->ev_size = -1;
+	}
+	else if (ev->ev_size >= 0 && end > ev->ev_size) {
+		ev->ev_size = end;
+	}
+	lock_release(ef->ef_cachelock);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -720,7 +987,41 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	/* drop the partial last page too, as it's now zero past LEN */
+	emufs_droppages(ef, ev, len / EMUFS_PAGESIZE);
+	ev->ev_size = result ? -1 : len;
+	lock_release(ef->ef_cachelock);
+
+	return result;
+}
+
+/*
+ * VOP_SEEKHOLE
+ *
+ * The emulator doesn't tell us about holes, so the whole file is data.
+ */
+static
+int
+emufs_seekhole(struct vnode *v, off_t pos, bool data, off_t *ret)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	off_t size;
+	int result;
+
+	result = emu_getsize(ev->ev_emu, ev->ev_handle, &size);
+	if (result) {
+		return result;
+	}
+	if (pos >= size) {
+		return ENXIO;
+	}
+	*ret = data ? pos : size;
+	return 0;
 }
 
 /*
@@ -845,8 +1146,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* Files can be mapped; the VM system does the I/O. */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -1062,6 +1364,17 @@ emufs_truncate_isdir(struct vnode *v, off_t len)
 	return ENOTDIR;
 }
 
+static
+int
+emufs_seekhole_isdir(struct vnode *v, off_t pos, bool data, off_t *ret)
+{
+	(void)v;
+	(void)pos;
+	(void)data;
+	(void)ret;
+	return EISDIR;
+}
+
 //////////////////////////////
 
 /*
@@ -1076,14 +1389,19 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_read = emufs_read,
 	.vop_readlink = emufs_readlink_notlink,
 	.vop_getdirentry = emufs_uio_op_notdir,
+	.vop_getdirentries = emufs_uio_op_notdir,
 	.vop_write = emufs_write,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
 	.vop_gettype = emufs_file_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_fsync,
+	.vop_fdatasync = emufs_fsync,
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = emufs_seekhole,
+	.vop_poll = vnode_poll_ready,
 	.vop_namefile = emufs_uio_op_notdir,
 
 	.vop_creat = emufs_creat_notdir,
@@ -1110,14 +1428,19 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_read = emufs_uio_op_isdir,
 	.vop_readlink = emufs_uio_op_isdir,
 	.vop_getdirentry = emufs_getdirentry,
+	.vop_getdirentries = vopfail_uio_nosys,
 	.vop_write = emufs_uio_op_isdir,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
+	.vop_fdatasync = emufs_void_op_isdir,
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = emufs_seekhole_isdir,
+	.vop_poll = vnode_poll_ready,
 	.vop_namefile = emufs_namefile,
 
 	.vop_creat = emufs_creat,
@@ -1164,7 +1487,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	/* Didn't have one; create it */
 
-	ev = kmalloc(sizeof(struct emufs_vnode));
+	ev = kmalloc_tagged(sizeof(struct emufs_vnode), &vnode_heaptag);
 	if (ev==NULL) {
 		lock_release(ef->ef_emu->e_lock);
 		return ENOMEM;
@@ -1172,12 +1495,14 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_size = -1;
+	ev->ev_npages = 0;
 
 	result = vnode_init(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			    &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		kfree(ev);
+		kfree_tagged(ev, sizeof(struct emufs_vnode), &vnode_heaptag);
 		return result;
 	}
 
@@ -1186,7 +1511,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: vnode_cleanup undoes vnode_init - it does not kfree */
 		vnode_cleanup(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		kfree(ev);
+		kfree_tagged(ev, sizeof(struct emufs_vnode), &vnode_heaptag);
 		return result;
 	}
 
@@ -1260,6 +1585,54 @@ emufs_unmount(struct fs *fs)
 	return EBUSY;
 }
 
+/*
+ * FSOP_READBLOCKS: read pages for the page cache.
+ */
+static
+int
+emufs_readblocks(struct fs *fs, daddr_t block, unsigned num, void **datas,
+		 size_t len)
+{
+	struct emufs_fs *ef = fs->fs_data;
+
+	KASSERT(len == EMUFS_PAGESIZE);
+
+	return emu_readpages(ef->ef_emu, EMUFS_BLOCKHANDLE(block),
+			     EMUFS_BLOCKPAGE(block), num, datas, len);
+}
+
+/*
+ * FSOP_READBLOCK
+ */
+static
+int
+emufs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	return emufs_readblocks(fs, block, 1, &data, len);
+}
+
+/*
+ * FSOP_ATTACHBUF and FSOP_DETACHBUF; we have no per-buffer state.
+ */
+static
+int
+emufs_attachbuf(struct fs *fs, daddr_t block, struct buf *buf)
+{
+	(void)fs;
+	(void)block;
+	(void)buf;
+	return 0;
+}
+
+static
+void
+emufs_detachbuf(struct fs *fs, daddr_t block, struct buf *buf)
+{
+	(void)fs;
+	(void)block;
+	(void)buf;
+}
+
 /*
  * Function table for the emufs file system.
  */
@@ -1268,9 +1641,13 @@ static const struct fs_ops emufs_fsops = {
 	.fsop_getvolname = emufs_getvolname,
 	.fsop_getroot = emufs_getroot,
 	.fsop_unmount = emufs_unmount,
-	/* we don't do block I/O */
-	.fsop_readblock = NULL,
+	/* block "reads" fill the page cache; its pages are never dirty */
+	.fsop_readblock = emufs_readblock,
+	.fsop_readblocks = emufs_readblocks,
 	.fsop_writeblock = NULL,
+	.fsop_writeblocks = NULL,
+	.fsop_attachbuf = emufs_attachbuf,
+	.fsop_detachbuf = emufs_detachbuf,
 };
 
 /*
@@ -1302,6 +1679,13 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 		kfree(ef);
 		return ENOMEM;
 	}
+	ef->ef_cachelock = lock_create("emufs-cache");
+	if (ef->ef_cachelock == NULL) {
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return ENOMEM;
+	}
+	ef->ef_ncached = 0;
 
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
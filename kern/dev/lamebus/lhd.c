@@ -33,10 +33,13 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
+#include <proc.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +99,251 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Function called when we are open()'d.
+ */
+static
+int
+lhd_eachopen(struct device *d, int openflags)
+{
+	/*
+	 * Don't need to do anything.
+	 */
+	(void)d;
+	(void)openflags;
+
+	return 0;
+}
+
+/*
+ * Function for handling ioctls.
+ */
+static
+int
+lhd_ioctl(struct device *d, int op, userptr_t data)
+{
+	/*
+	 * We don't support any ioctls.
+	 */
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+#if 0
+/*
+ * Reset the device.
+ * This could be used, for instance, on timeout, if you implement suitable
+ * facilities.
+ */
+static
+void
+lhd_reset(struct lhd_softc *lh)
+{
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+}
+#endif
+
+/*
+ * Disk scheduling.
+ *
+ * Every transfer is a dev_bio (see device.h); lhd_io makes one for
+ * ordinary reads and writes. Only one transfer can use the disk at a
+ * time, and the ones that come along while it's busy wait in
+ * lh_queue. When the disk comes free the next one is chosen
+ * elevator-style (C-SCAN): the lowest starting sector at or past
+ * where the last transfer ended, or if there is none, the lowest
+ * overall. So concurrent random I/O gets served in sweeps across the
+ * disk, and a transfer that starts where the previous one ended goes
+ * next with no seek, which is as good as merging the two on a disk
+ * that moves one sector per operation anyway.
+ *
+ * Each transfer carries the I/O priority class of the process that
+ * queued it (see proc_curioclass). Only transfers of the best class
+ * waiting are considered, so realtime ones go ahead of best-effort
+ * ones, and idle ones, like a backup run under ionice, only get the
+ * disk when nothing else wants it.
+ *
+ * So nothing waits forever behind a stream of transfers just ahead
+ * of it or of a better class, a transfer that's been passed over
+ * lhd_maxpassed[] times for its class goes next regardless (oldest
+ * such first). The limits are what weight the classes against each
+ * other when all of them are busy: a best-effort transfer waits at
+ * most LHD_MAXPASSED others, a realtime one half that, and an idle
+ * one eight times that.
+ *
+ * Transfers are driven from the interrupt handler: each completion
+ * copies the sector out of the card's buffer (for reads) and starts
+ * the next one, and when a transfer is finished the next transfer
+ * is picked and started right there before the submitter's bio_done
+ * is called. So the disk never waits for a thread to be scheduled,
+ * and any number of transfers can be outstanding without a thread
+ * blocked for each.
+ */
+#define LHD_MAXPASSED	16
+
+static const unsigned lhd_maxpassed[] = {
+	[IOPRIO_CLASS_RT] = LHD_MAXPASSED / 2,
+	[IOPRIO_CLASS_BE] = LHD_MAXPASSED,
+	[IOPRIO_CLASS_IDLE] = LHD_MAXPASSED * 8,
+};
+
+/*
+ * Choose the next transfer to get the disk and take it off the
+ * queue. The queue must not be empty.
+ */
+static
+struct dev_bio *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct dev_bio *bio, **biop, **best, **lowest;
+	int ioclass;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+	KASSERT(lh->lh_queue != NULL);
+
+	/* The best class waiting (lowest number) */
+	ioclass = IOPRIO_CLASS_IDLE;
+	for (bio = lh->lh_queue; bio != NULL; bio = bio->bio_next) {
+		if (bio->bio_ioclass < ioclass) {
+			ioclass = bio->bio_ioclass;
+		}
+	}
+
+	best = lowest = NULL;
+	for (biop = &lh->lh_queue; *biop != NULL; biop = &(*biop)->bio_next) {
+		bio = *biop;
+		if (bio->bio_passed >= lhd_maxpassed[bio->bio_ioclass]) {
+			/* waited long enough; the queue is oldest first */
+			best = biop;
+			break;
+		}
+		if (bio->bio_ioclass != ioclass) {
+			continue;
+		}
+		if (bio->bio_block >= lh->lh_headpos &&
+		    (best == NULL || bio->bio_block < (*best)->bio_block)) {
+			best = biop;
+		}
+		if (lowest == NULL || bio->bio_block < (*lowest)->bio_block) {
+			lowest = biop;
+		}
+	}
+	if (best == NULL) {
+		/* nothing ahead; go back to the start */
+		best = lowest;
+	}
+
+	bio = *best;
+	*best = bio->bio_next;
+	bio->bio_next = NULL;
+
+	for (biop = &lh->lh_queue; *biop != NULL; biop = &(*biop)->bio_next) {
+		(*biop)->bio_passed++;
+	}
+	return bio;
+}
+
+/*
+ * Start the device on the next sector of the transfer in progress.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct dev_bio *bio = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	/* If writing, put the data in the on-card buffer first. */
+	if (bio->bio_write) {
+		memcpy(lh->lh_buf,
+		       (char *)bio->bio_data + lh->lh_curdone * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, bio->bio_block + lh->lh_curdone);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Start a transfer. The caller has the disk.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh, struct dev_bio *bio)
+{
+	KASSERT(lh->lh_cur == NULL);
+	KASSERT(bio->bio_nblocks > 0);
+
+	diskstats_started(&lh->lh_stats, bio);
+	lh->lh_cur = bio;
+	lh->lh_curdone = 0;
+	lhd_startsector(lh);
+}
+
+/*
+ * The disk has come free, having been used up to (not including)
+ * ENDSECTOR; start whatever should go next.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh, uint32_t endsector)
+{
+	struct dev_bio *bio;
+
+	spinlock_acquire(&lh->lh_qlock);
+	KASSERT(lh->lh_busy);
+	lh->lh_headpos = endsector;
+	if (lh->lh_queue == NULL) {
+		lh->lh_busy = false;
+		spinlock_release(&lh->lh_qlock);
+		return;
+	}
+	bio = lhd_pick(lh);
+	spinlock_release(&lh->lh_qlock);
+
+	lhd_start(lh, bio);
+}
+
+/*
+ * Record that an operation has completed (called from the interrupt
+ * handler): finish the sector, and either start the next sector or
+ * finish the transfer.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct dev_bio *bio = lh->lh_cur;
+
+	if (bio == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return;
+	}
+
+	/* If reading, and we succeeded, get the data out of the buffer. */
+	if (err == 0 && !bio->bio_write) {
+		membar_load_load();
+		memcpy((char *)bio->bio_data + lh->lh_curdone * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_curdone++;
+
+	if (err == 0 && lh->lh_curdone < bio->bio_nblocks) {
+		lhd_startsector(lh);
+		return;
+	}
+
+	/* Get the disk going on the next transfer, then report back. */
+	diskstats_done(&lh->lh_stats, bio, err);
+	lh->lh_cur = NULL;
+	lhd_dispatch(lh, bio->bio_block + lh->lh_curdone);
+	bio->bio_done(bio, err);
 }
 
 /*
@@ -134,53 +373,116 @@ lhd_irq(void *vlh)
 }
 
 /*
- * Function called when we are open()'d.
+ * Start an asynchronous transfer.
  */
 static
-int
-lhd_eachopen(struct device *d, int openflags)
+void
+lhd_strategy(struct device *d, struct dev_bio *bio)
 {
-	/*
-	 * Don't need to do anything.
-	 */
-	(void)d;
-	(void)openflags;
+	struct lhd_softc *lh = d->d_data;
+	struct dev_bio **biop;
 
-	return 0;
+	if (bio->bio_nblocks == 0) {
+		bio->bio_done(bio, 0);
+		return;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	if (bio->bio_block >= lh->lh_dev.d_blocks ||
+	    bio->bio_nblocks > lh->lh_dev.d_blocks - bio->bio_block) {
+		bio->bio_done(bio, EINVAL);
+		return;
+	}
+
+	bio->bio_ioclass = proc_curioclass();
+	KASSERT(bio->bio_ioclass >= IOPRIO_CLASS_RT &&
+		bio->bio_ioclass <= IOPRIO_CLASS_IDLE);
+	proc_iocharge(bio->bio_nblocks * LHD_SECTSIZE);
+	bio->bio_next = NULL;
+	bio->bio_passed = 0;
+	diskstats_queued(&lh->lh_stats, bio);
+
+	spinlock_acquire(&lh->lh_qlock);
+	if (!lh->lh_busy) {
+		KASSERT(lh->lh_queue == NULL);
+		lh->lh_busy = true;
+		spinlock_release(&lh->lh_qlock);
+		lhd_start(lh, bio);
+		return;
+	}
+	for (biop = &lh->lh_queue; *biop != NULL; biop = &(*biop)->bio_next) {
+		/* nothing */
+	}
+	*biop = bio;
+	spinlock_release(&lh->lh_qlock);
 }
 
 /*
- * Function for handling ioctls.
+ * For lhd_io to wait for its transfers.
  */
+struct lhd_wait {
+	struct lhd_softc *lw_lh;
+	bool lw_done;
+	int lw_result;
+};
+
 static
-int
-lhd_ioctl(struct device *d, int op, userptr_t data)
+void
+lhd_waitdone(struct dev_bio *bio, int result)
 {
-	/*
-	 * We don't support any ioctls.
-	 */
-	(void)d;
-	(void)op;
-	(void)data;
-	return EIOCTL;
+	struct lhd_wait *lw = bio->bio_arg;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_qlock);
+	lw->lw_result = result;
+	lw->lw_done = true;
+	wchan_wakeall(lh->lh_donewchan, &lh->lh_qlock);
+	spinlock_release(&lh->lh_qlock);
 }
 
-#if 0
 /*
- * Reset the device.
- * This could be used, for instance, on timeout, if you implement suitable
- * facilities.
+ * Do one transfer and wait for it.
  */
 static
-void
-lhd_reset(struct lhd_softc *lh)
+int
+lhd_transfer(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	     void *data, bool write)
 {
-	lhd_wreg(lh, LHD_REG_STAT, 0);
+	struct dev_bio bio;
+	struct lhd_wait lw;
+
+	lw.lw_lh = lh;
+	lw.lw_done = false;
+	lw.lw_result = 0;
+
+	bio.bio_block = sector;
+	bio.bio_nblocks = nsect;
+	bio.bio_data = data;
+	bio.bio_write = write;
+	bio.bio_done = lhd_waitdone;
+	bio.bio_arg = &lw;
+	lhd_strategy(&lh->lh_dev, &bio);
+
+	spinlock_acquire(&lh->lh_qlock);
+	while (!lw.lw_done) {
+		wchan_sleep(lh->lh_donewchan, &lh->lh_qlock);
+	}
+	spinlock_release(&lh->lh_qlock);
+	return lw.lw_result;
 }
-#endif
+
+/*
+ * Most sectors lhd_io copies through a bounce buffer at once.
+ */
+#define LHD_BOUNCE_SECTORS	16
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * A uio that's one piece of kernel memory (which is what the buffer
+ * cache sends) is transferred in place. Anything else, which might
+ * be in user memory we can't touch from the interrupt handler, goes
+ * through a bounce buffer.
  */
 static
 int
@@ -192,8 +494,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	struct iovec *iov;
+	uint32_t n;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -202,72 +506,63 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		KASSERT(iov->iov_len == uio->uio_resid);
+		result = lhd_transfer(lh, sector, len, iov->iov_kbase, write);
+		if (result) {
+			return result;
+		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	n = len < LHD_BOUNCE_SECTORS ? len : LHD_BOUNCE_SECTORS;
+	bounce = kmalloc(n * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCE_SECTORS ? len : LHD_BOUNCE_SECTORS;
+		if (write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_transfer(lh, sector, n, bounce, write);
 		if (result) {
-			return result;
+			break;
+		}
+		if (!write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_strategy = lhd_strategy,
 };
 
 /*
@@ -277,6 +572,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	int result;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,17 +580,17 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_donewchan = wchan_create("lhd-done");
+	if (lh->lh_donewchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_qlock);
+	lh->lh_queue = NULL;
+	lh->lh_busy = false;
+	lh->lh_headpos = 0;
+	lh->lh_cur = NULL;
+	lh->lh_curdone = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -304,5 +600,12 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	result = vfs_adddev(name, &lh->lh_dev, 1);
+	if (result) {
+		return result;
+	}
+
+	/* No I/O can have happened yet, so register the stats now. */
+	diskstats_init(&lh->lh_stats, name);
+	return 0;
 }
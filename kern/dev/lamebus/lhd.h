@@ -30,7 +30,9 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
+#include <diskstat.h>
 
 /*
  * Our sector size
@@ -51,11 +53,19 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	struct spinlock lh_qlock;	/* protects the following */
+	struct wchan *lh_donewchan;	/* for lhd_io to wait on */
+	struct dev_bio *lh_queue;	/* transfers waiting for the disk */
+	bool lh_busy;			/* a transfer has the disk */
+	uint32_t lh_headpos;		/* sector after the last transfer */
+
+	/* Only touched by the transfer that has the disk */
+	struct dev_bio *lh_cur;		/* transfer in progress */
+	unsigned lh_curdone;		/* sectors of it done so far */
 
 	struct device lh_dev;		/* VFS device structure */
+	struct diskstats lh_stats;	/* I/O statistics */
 };
 
 /* Functions called by lower-level drivers */
@@ -27,20 +27,234 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * LAMEbus network card (lnet) driver.
+ *
+ * The card has one receive buffer and one transmit buffer. A packet
+ * that arrives is copied out of the receive buffer into a netbuf at
+ * interrupt time and handed to net_input; writing the receive
+ * interrupt register then gives the buffer back to the card. Packets
+ * to send wait in a queue, and each transmit-done interrupt starts
+ * the next, so senders only wait when the queue is full.
+ */
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-/*#include <lamebus/lnet.h>*/ /* not yet */
+#include <wchan.h>
+#include <platform/bus.h>
+#include <net.h>
+#include <lamebus/lnet.h>
 #include "autoconf.h"
 
-int
-config_lnet(struct lnet_softc *sc, int lnetno)
+/* Registers (offsets within slot) */
+#define LNET_REG_RXINTR		0	/* Receive: packet waiting */
+#define LNET_REG_TXINTR		4	/* Transmit: packet sent */
+#define LNET_REG_CONTROL	8	/* Control */
+#define LNET_REG_STATUS		12	/* Status */
+
+/* Control register bits */
+#define LNET_CTL_PROMISC	0x1	/* receive everything */
+#define LNET_CTL_START		0x2	/* send the transmit buffer */
+
+/* Status register: our hardware address is in the low 16 bits */
+#define LNET_STAT_HWADDR	0xffff
+
+/* Buffers (offsets within slot) */
+#define LNET_RXBUF		32768
+#define LNET_TXBUF		(32768 + 4096)
+#define LNET_BUFSIZE		4096
+
+/*
+ * Link header, at the front of every packet in the card's buffers.
+ */
+struct lnet_header {
+	uint16_t lh_frame;		/* LNET_FRAME */
+	uint16_t lh_from;		/* sender's hardware address */
+	uint16_t lh_len;		/* packet length, with this header */
+	uint16_t lh_to;			/* receiver's, or NET_BROADCAST */
+};
+#define LNET_FRAME		0xa4b3
+
+/* Packets queued to send before senders wait */
+#define LNET_TXQMAX		16
+
+static
+inline
+uint32_t
+lnet_rdreg(struct lnet_softc *ln, uint32_t reg)
+{
+	return bus_read_register(ln->ln_busdata, ln->ln_buspos, reg);
+}
+
+static
+inline
+void
+lnet_wreg(struct lnet_softc *ln, uint32_t reg, uint32_t val)
+{
+	bus_write_register(ln->ln_busdata, ln->ln_buspos, reg, val);
+}
+
+/*
+ * Copy the next queued packet to the card and start sending it.
+ * Called with the transmit lock held, when the card is idle.
+ */
+static
+void
+lnet_txstart(struct lnet_softc *ln)
+{
+	struct lnet_header lh;
+	struct netbuf *nb;
+
+	KASSERT(spinlock_do_i_hold(&ln->ln_txlock));
+	KASSERT(ln->ln_txcur == NULL);
+
+	nb = ln->ln_txhead;
+	if (nb == NULL) {
+		return;
+	}
+	ln->ln_txhead = nb->nb_next;
+	if (ln->ln_txhead == NULL) {
+		ln->ln_txtail = NULL;
+	}
+	ln->ln_txlen--;
+	ln->ln_txcur = nb;
+
+	KASSERT(nb->nb_len + sizeof(lh) <= LNET_BUFSIZE);
+	lh.lh_frame = LNET_FRAME;
+	lh.lh_from = ln->ln_if.if_addr;
+	lh.lh_len = nb->nb_len + sizeof(lh);
+	lh.lh_to = nb->nb_addr;
+	memcpy(ln->ln_txbuf, &lh, sizeof(lh));
+	memcpy((char *)ln->ln_txbuf + sizeof(lh), nb->nb_data + nb->nb_off,
+	       nb->nb_len);
+	lnet_wreg(ln, LNET_REG_CONTROL, LNET_CTL_START);
+}
+
+/*
+ * if_output: queue NB to be sent to TO.
+ */
+static
+void
+lnet_output(struct netif *nif, struct netbuf *nb, uint16_t to)
+{
+	struct lnet_softc *ln = nif->if_data;
+
+	nb->nb_addr = to;
+	nb->nb_next = NULL;
+
+	spinlock_acquire(&ln->ln_txlock);
+	while (ln->ln_txlen >= LNET_TXQMAX) {
+		wchan_sleep(ln->ln_txwchan, &ln->ln_txlock);
+	}
+	if (ln->ln_txtail == NULL) {
+		ln->ln_txhead = nb;
+	}
+	else {
+		ln->ln_txtail->nb_next = nb;
+	}
+	ln->ln_txtail = nb;
+	ln->ln_txlen++;
+	if (ln->ln_txcur == NULL) {
+		lnet_txstart(ln);
+	}
+	spinlock_release(&ln->ln_txlock);
+}
+
+/*
+ * Take the packet in the receive buffer and give the buffer back.
+ */
+static
+void
+lnet_rxpacket(struct lnet_softc *ln)
 {
-	(void)sc;
+	struct lnet_header lh;
+	struct netbuf *nb;
 
-	kprintf("lnet%d: No network support in system\n", lnetno);
+	nb = NULL;
+	memcpy(&lh, ln->ln_rxbuf, sizeof(lh));
+	if (lh.lh_frame != LNET_FRAME || lh.lh_len < sizeof(lh) ||
+	    lh.lh_len > LNET_BUFSIZE) {
+		ln->ln_if.if_ierrors++;
+	}
+	else if ((nb = netbuf_get()) == NULL) {
+		ln->ln_if.if_iqdrops++;
+	}
+	else {
+		nb->nb_len = lh.lh_len - sizeof(lh);
+		nb->nb_addr = lh.lh_from;
+		memcpy(nb->nb_data, (char *)ln->ln_rxbuf + sizeof(lh),
+		       nb->nb_len);
+	}
+	lnet_wreg(ln, LNET_REG_RXINTR, 0);
 
-	return ENODEV;
+	if (nb != NULL) {
+		net_input(&ln->ln_if, nb);
+	}
 }
 
+/*
+ * Interrupt handler.
+ */
+void
+lnet_irq(void *vln)
+{
+	struct lnet_softc *ln = vln;
+	struct netbuf *sent;
+
+	if (lnet_rdreg(ln, LNET_REG_RXINTR) != 0) {
+		lnet_rxpacket(ln);
+	}
+
+	if (lnet_rdreg(ln, LNET_REG_TXINTR) != 0) {
+		lnet_wreg(ln, LNET_REG_TXINTR, 0);
 
+		spinlock_acquire(&ln->ln_txlock);
+		sent = ln->ln_txcur;
+		ln->ln_txcur = NULL;
+		if (sent != NULL) {
+			ln->ln_if.if_opackets++;
+		}
+		lnet_txstart(ln);
+		wchan_wakeone(ln->ln_txwchan, &ln->ln_txlock);
+		spinlock_release(&ln->ln_txlock);
+
+		if (sent != NULL) {
+			netbuf_put(sent);
+		}
+	}
+}
+
+/*
+ * Setup routine called by autoconf stuff when an lnet is found.
+ */
+int
+config_lnet(struct lnet_softc *ln, int lnetno)
+{
+	snprintf(ln->ln_name, sizeof(ln->ln_name), "lnet%d", lnetno);
+
+	ln->ln_rxbuf = bus_map_area(ln->ln_busdata, ln->ln_buspos,
+				    LNET_RXBUF);
+	ln->ln_txbuf = bus_map_area(ln->ln_busdata, ln->ln_buspos,
+				    LNET_TXBUF);
+
+	ln->ln_txwchan = wchan_create("lnet-tx");
+	if (ln->ln_txwchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&ln->ln_txlock);
+	ln->ln_txhead = ln->ln_txtail = NULL;
+	ln->ln_txlen = 0;
+	ln->ln_txcur = NULL;
+
+	ln->ln_if.if_name = ln->ln_name;
+	ln->ln_if.if_addr = lnet_rdreg(ln, LNET_REG_STATUS) & LNET_STAT_HWADDR;
+	ln->ln_if.if_hdrlen = sizeof(struct lnet_header);
+	ln->ln_if.if_data = ln;
+	ln->ln_if.if_output = lnet_output;
+
+	/* Not promiscuous; and nothing to send yet */
+	lnet_wreg(ln, LNET_REG_CONTROL, 0);
+
+	return netif_attach(&ln->ln_if);
+}
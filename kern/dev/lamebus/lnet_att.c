@@ -30,23 +30,37 @@
 #include <types.h>
 #include <lib.h>
 #include <lamebus/lamebus.h>
+#include <lamebus/lnet.h>
 #include "autoconf.h"
 
 /* Lowest revision we support */
 #define LOW_VERSION   1
-/* Highest revision we support */
-#define HIGH_VERSION  1
 
 struct lnet_softc *
 attach_lnet_to_lamebus(int lnetno, struct lamebus_softc *sc)
 {
+	struct lnet_softc *ln;
 	int slot = lamebus_probe(sc, LB_VENDOR_CS161, LBCS161_NET,
-				 LOW_VERSION, HIGH_VERSION);
+				 LOW_VERSION, NULL);
 	if (slot < 0) {
+		/* None found */
 		return NULL;
 	}
 
-	kprintf("lnet%d: No network support in system\n", lnetno);
+	ln = kmalloc(sizeof(struct lnet_softc));
+	if (ln == NULL) {
+		/* Out of memory */
+		return NULL;
+	}
+
+	/* Record what the lnet is attached to */
+	ln->ln_busdata = sc;
+	ln->ln_buspos = slot;
+	ln->ln_unit = lnetno;
+
+	/* Mark the slot in use and collect interrupts */
+	lamebus_mark(sc, slot);
+	lamebus_attach_interrupt(sc, slot, ln, lnet_irq);
 
-	return NULL;
+	return ln;
 }
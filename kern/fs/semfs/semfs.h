@@ -31,6 +31,8 @@
 #define SEMFS_H
 
 #include <array.h>
+#include <hashtable.h>
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -50,11 +52,22 @@
  * We don't use the kernel-level semaphore to implement it (although
  * that would be tidy) because we'd have to violate its abstraction.
  * XXX: or would we? review once all this is done.
+ *
+ * The count is changed with atomic_cas, so P with the count nonzero
+ * and V with nobody waiting take no lock at all. A P that has to
+ * wait takes sems_lock, counts itself in sems_waiters, and sleeps on
+ * sems_wchan; a V that sees waiters takes the lock to wake them.
+ * (Each side changes its own variable, then checks the other's, with
+ * a memory barrier in between, so one of them always sees the other.)
+ *
+ * sems_hasvnode and sems_linked are protected by the fs's table lock.
  */
 struct semfs_sem {
-	struct lock *sems_lock;			/* Lock to protect count */
-	struct cv *sems_cv;			/* CV to wait */
-	unsigned sems_count;			/* Semaphore count */
+	char *sems_name;			/* Name for the wchan */
+	struct spinlock sems_lock;		/* Lock for sleeping */
+	struct wchan *sems_wchan;		/* Where P waits */
+	volatile unsigned sems_count;		/* Semaphore count */
+	volatile unsigned sems_waiters;		/* Threads waiting in P */
 	bool sems_hasvnode;			/* The vnode exists */
 	bool sems_linked;			/* In the directory */
 };
@@ -66,6 +79,8 @@ DECLARRAY(semfs_sem, SEMFS_INLINE);
 struct semfs_direntry {
 	char *semd_name;			/* Name */
 	unsigned semd_semnum;			/* Which semaphore */
+	unsigned semd_slot;			/* Index in semfs_dents */
+	struct hashlink semd_link;		/* In semfs_dirhash */
 };
 DECLARRAY(semfs_direntry, SEMFS_INLINE);
 
@@ -80,6 +95,7 @@ struct semfs_vnode {
 	struct vnode semv_absvn;		/* Abstract vnode */
 	struct semfs *semv_semfs;		/* Back-pointer to fs */
 	unsigned semv_semnum;			/* Which semaphore */
+	struct semfs_sem *semv_sem;		/* It, or NULL for the root */
 };
 
 /*
@@ -95,6 +111,7 @@ struct semfs {
 
 	struct lock *semfs_dirlock;		/* Lock for following */
 	struct semfs_direntryarray *semfs_dents; /* The root directory */
+	struct hashtable *semfs_dirhash;	/* Same, by name */
 };
 
 /*
@@ -118,6 +135,8 @@ void semfs_direntry_destroy(struct semfs_direntry *);
 
 /* in semfs_vnops.c */
 int semfs_getvnode(struct semfs *, unsigned, struct vnode **ret);
+void semfs_sem_p(struct semfs_sem *sem, unsigned num);
+int semfs_sem_v(struct semfs_sem *sem, unsigned num);
 
 
 #endif /* SEMFS_H */
@@ -107,10 +107,15 @@ semfs_destroy(struct semfs *semfs)
 	num = semfs_direntryarray_num(semfs->semfs_dents);
 	for (i=0; i<num; i++) {
 		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		semfs_direntry_destroy(dent);
+		if (dent != NULL) {
+			hashtable_remove(semfs->semfs_dirhash,
+					 &dent->semd_link);
+			semfs_direntry_destroy(dent);
+		}
 	}
 	semfs_direntryarray_setsize(semfs->semfs_dents, 0);
 
+	hashtable_destroy(semfs->semfs_dirhash);
 	semfs_direntryarray_destroy(semfs->semfs_dents);
 	lock_destroy(semfs->semfs_dirlock);
 	semfs_semarray_destroy(semfs->semfs_sems);
@@ -186,11 +191,17 @@ semfs_create(void)
 	if (semfs->semfs_dents == NULL) {
 		goto fail_dirlock;
 	}
+	semfs->semfs_dirhash = hashtable_create("semfs_dir", 0);
+	if (semfs->semfs_dirhash == NULL) {
+		goto fail_dents;
+	}
 
 	semfs->semfs_absfs.fs_data = semfs;
 	semfs->semfs_absfs.fs_ops = &semfs_fsops;
 	return semfs;
 
+ fail_dents:
+	semfs_direntryarray_destroy(semfs->semfs_dents);
  fail_dirlock:
 	lock_destroy(semfs->semfs_dirlock);
  fail_sems:
@@ -29,7 +29,9 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <lib.h>
 #include <synch.h>
+#include <wchan.h>
 
 #define SEMFS_INLINE
 #include "semfs.h"
@@ -44,31 +46,31 @@ struct semfs_sem *
 semfs_sem_create(const char *name)
 {
 	struct semfs_sem *sem;
-	char lockname[32];
-	char cvname[32];
+	char wcname[32];
 
-	snprintf(lockname, sizeof(lockname), "sem:l.%s", name);
-	snprintf(cvname, sizeof(cvname), "sem:%s", name);
+	snprintf(wcname, sizeof(wcname), "sem:%s", name);
 
 	sem = kmalloc(sizeof(*sem));
 	if (sem == NULL) {
 		goto fail_return;
 	}
-	sem->sems_lock = lock_create(lockname);
-	if (sem->sems_lock == NULL) {
+	sem->sems_name = kstrdup(wcname);
+	if (sem->sems_name == NULL) {
 		goto fail_sem;
 	}
-	sem->sems_cv = cv_create(cvname);
-	if (sem->sems_cv == NULL) {
-		goto fail_lock;
+	sem->sems_wchan = wchan_create(sem->sems_name);
+	if (sem->sems_wchan == NULL) {
+		goto fail_name;
 	}
+	spinlock_init(&sem->sems_lock);
 	sem->sems_count = 0;
+	sem->sems_waiters = 0;
 	sem->sems_hasvnode = false;
 	sem->sems_linked = false;
 	return sem;
 
- fail_lock:
-	lock_destroy(sem->sems_lock);
+ fail_name:
+	kfree(sem->sems_name);
  fail_sem:
 	kfree(sem);
  fail_return:
@@ -81,8 +83,10 @@ semfs_sem_create(const char *name)
 void
 semfs_sem_destroy(struct semfs_sem *sem)
 {
-	cv_destroy(sem->sems_cv);
-	lock_destroy(sem->sems_lock);
+	KASSERT(sem->sems_waiters == 0);
+	spinlock_cleanup(&sem->sems_lock);
+	wchan_destroy(sem->sems_wchan);
+	kfree(sem->sems_name);
 	kfree(sem);
 }
 
@@ -131,6 +135,8 @@ semfs_direntry_create(const char *name, unsigned semnum)
 		return NULL;
 	}
 	dent->semd_semnum = semnum;
+	dent->semd_slot = 0;
+	hashlink_init(&dent->semd_link, dent);
 	return dent;
 }
 
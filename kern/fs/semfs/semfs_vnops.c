@@ -33,6 +33,9 @@
 #include <stat.h>
 #include <uio.h>
 #include <synch.h>
+#include <wchan.h>
+#include <atomic.h>
+#include <membar.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -107,50 +110,103 @@ semfs_fsync(struct vnode *vn)
 // semaphore ops
 
 /*
- * XXX fold these two together
+ * The semaphore for a vnode. It can't go away while the vnode exists,
+ * so we keep a pointer to it and don't need the table lock.
  */
-
 static
 struct semfs_sem *
-semfs_getsembynum(struct semfs *semfs, unsigned semnum)
+semfs_getsem(struct semfs_vnode *semv)
 {
-	struct semfs_sem *sem;
-
-	lock_acquire(semfs->semfs_tablelock);
-	sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-	lock_release(semfs->semfs_tablelock);
-
-	return sem;
+	KASSERT(semv->semv_sem != NULL);
+	return semv->semv_sem;
 }
 
+/*
+ * Take up to NUM from the count without waiting; return how many we
+ * got.
+ */
 static
-struct semfs_sem *
-semfs_getsem(struct semfs_vnode *semv)
+unsigned
+semfs_sem_take(struct semfs_sem *sem, unsigned num)
 {
-	struct semfs *semfs = semv->semv_semfs;
+	unsigned old, take;
 
-	return semfs_getsembynum(semfs, semv->semv_semnum);
+	while (1) {
+		old = sem->sems_count;
+		if (old == 0) {
+			return 0;
+		}
+		take = num < old ? num : old;
+		if (atomic_cas(&sem->sems_count, old, old - take) == old) {
+			return take;
+		}
+	}
 }
 
 /*
- * Wakeup helper. We only need to wake up if there are sleepers, which
- * should only be the case if the old count is 0; and we only
- * potentially need to wake more than one sleeper if the new count
- * will be more than 1.
+ * Wakeup helper. We only need to wake up if there are sleepers; they
+ * all recheck the count, so let them sort it out.
  */
 static
 void
-semfs_wakeup(struct semfs_sem *sem, unsigned newcount)
+semfs_wakeup(struct semfs_sem *sem)
 {
-	if (sem->sems_count > 0 || newcount == 0) {
+	membar_any_any();
+	if (sem->sems_waiters == 0) {
 		return;
 	}
-	if (newcount == 1) {
-		cv_signal(sem->sems_cv, sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
+	wchan_wakeall(sem->sems_wchan, &sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
+}
+
+/*
+ * P: decrease the count by NUM, waiting for it to be big enough. As
+ * with reading more than one, take what's there as it comes.
+ */
+void
+semfs_sem_p(struct semfs_sem *sem, unsigned num)
+{
+	num -= semfs_sem_take(sem, num);
+	if (num == 0) {
+		return;
 	}
-	else {
-		cv_broadcast(sem->sems_cv, sem->sems_lock);
+
+	spinlock_acquire(&sem->sems_lock);
+	sem->sems_waiters++;
+	while (1) {
+		membar_any_any();
+		num -= semfs_sem_take(sem, num);
+		if (num == 0) {
+			break;
+		}
+		DEBUG(DB_SEMFS, "semfs: %s: blocking\n", sem->sems_name);
+		wchan_sleep(sem->sems_wchan, &sem->sems_lock);
 	}
+	sem->sems_waiters--;
+	spinlock_release(&sem->sems_lock);
+}
+
+/*
+ * V: increase the count by NUM.
+ */
+int
+semfs_sem_v(struct semfs_sem *sem, unsigned num)
+{
+	unsigned old;
+
+	do {
+		old = sem->sems_count;
+		if (old + num < old) {
+			/* overflow */
+			return EFBIG;
+		}
+	} while (atomic_cas(&sem->sems_count, old, old + num) != old);
+
+	DEBUG(DB_SEMFS, "semfs: %s: V, count %u -> %u\n",
+	      sem->sems_name, old, old + num);
+	semfs_wakeup(sem);
+	return 0;
 }
 
 /*
@@ -167,10 +223,10 @@ semfs_semstat(struct vnode *vn, struct stat *buf)
 
 	bzero(buf, sizeof(*buf));
 
-	lock_acquire(sem->sems_lock);
 	buf->st_size = sem->sems_count;
+	lock_acquire(semv->semv_semfs->semfs_tablelock);
 	buf->st_nlink = sem->sems_linked ? 1 : 0;
-	lock_release(sem->sems_lock);
+	lock_release(semv->semv_semfs->semfs_tablelock);
 
 	buf->st_mode = S_IFREG | 0666;
 	buf->st_blocks = 0;
@@ -194,31 +250,13 @@ semfs_read(struct vnode *vn, struct uio *uio)
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
-	while (uio->uio_resid > 0) {
-		if (sem->sems_count > 0) {
-			consume = uio->uio_resid;
-			if (consume > sem->sems_count) {
-				consume = sem->sems_count;
-			}
-			DEBUG(DB_SEMFS, "semfs: sem%u: P, count %u -> %u\n",
-			      semv->semv_semnum, sem->sems_count,
-			      sem->sems_count - consume);
-			sem->sems_count -= consume;
-			/* don't bother advancing the uio data pointers */
-			uio->uio_offset += consume;
-			uio->uio_resid -= consume;
-		}
-		if (uio->uio_resid == 0) {
-			break;
-		}
-		if (sem->sems_count == 0) {
-			DEBUG(DB_SEMFS, "semfs: sem%u: blocking\n",
-			      semv->semv_semnum);
-			cv_wait(sem->sems_cv, sem->sems_lock);
-		}
+	if (uio->uio_resid > 0) {
+		consume = uio->uio_resid;
+		semfs_sem_p(sem, consume);
+		/* don't bother advancing the uio data pointers */
+		uio->uio_offset += consume;
+		uio->uio_resid = 0;
 	}
-	lock_release(sem->sems_lock);
 	return 0;
 }
 
@@ -232,26 +270,18 @@ semfs_write(struct vnode *vn, struct uio *uio)
 {
 	struct semfs_vnode *semv = vn->vn_data;
 	struct semfs_sem *sem;
-	unsigned newcount;
+	int result;
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
-	while (uio->uio_resid > 0) {
-		newcount = sem->sems_count + uio->uio_resid;
-		if (newcount < sem->sems_count) {
-			/* overflow */
-			lock_release(sem->sems_lock);
-			return EFBIG;
+	if (uio->uio_resid > 0) {
+		result = semfs_sem_v(sem, uio->uio_resid);
+		if (result) {
+			return result;
 		}
-		DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
-		      semv->semv_semnum, sem->sems_count, newcount);
-		semfs_wakeup(sem, newcount);
-		sem->sems_count = newcount;
 		uio->uio_offset += uio->uio_resid;
 		uio->uio_resid = 0;
 	}
-	lock_release(sem->sems_lock);
 	return 0;
 }
 
@@ -283,10 +313,8 @@ semfs_truncate(struct vnode *vn, off_t len)
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
-	semfs_wakeup(sem, newcount);
 	sem->sems_count = newcount;
-	lock_release(sem->sems_lock);
+	semfs_wakeup(sem);
 
 	return 0;
 }
@@ -366,6 +394,29 @@ semfs_namefile(struct vnode *vn, struct uio *uio)
 	return 0;
 }
 
+static
+bool
+semfs_dir_match(void *obj, const void *key)
+{
+	const struct semfs_direntry *dent = obj;
+
+	return !strcmp(dent->semd_name, key);
+}
+
+/*
+ * Find a directory entry by name, or return NULL. The directory lock
+ * must be held.
+ */
+static
+struct semfs_direntry *
+semfs_dir_find(struct semfs *semfs, const char *name)
+{
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+
+	return hashtable_find(semfs->semfs_dirhash, hash_string(name),
+			      semfs_dir_match, name);
+}
+
 /*
  * Create a semaphore.
  */
@@ -378,7 +429,7 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num, empty, semnum;
+	unsigned num, empty, semnum;
 	int result;
 
 	(void)mode;
@@ -387,26 +438,23 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	empty = num;
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			if (empty == num) {
-				empty = i;
-			}
-			continue;
-		}
-		if (!strcmp(dent->semd_name, name)) {
-			/* found */
-			if (excl) {
-				lock_release(semfs->semfs_dirlock);
-				return EEXIST;
-			}
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
+	dent = semfs_dir_find(semfs, name);
+	if (dent != NULL) {
+		if (excl) {
 			lock_release(semfs->semfs_dirlock);
-			return result;
+			return EEXIST;
+		}
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
+		lock_release(semfs->semfs_dirlock);
+		return result;
+	}
+
+	/* reuse the first empty slot, if any */
+	num = semfs_direntryarray_num(semfs->semfs_dents);
+	for (empty=0; empty<num; empty++) {
+		if (semfs_direntryarray_get(semfs->semfs_dents,
+					    empty) == NULL) {
+			break;
 		}
 	}
 
@@ -438,6 +486,9 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 			goto fail_undent;
 		}
 	}
+	dent->semd_slot = empty;
+	hashtable_add(semfs->semfs_dirhash, &dent->semd_link,
+		      hash_string(name));
 
 	result = semfs_getvnode(semfs, semnum, resultvn);
 	if (result) {
@@ -449,6 +500,7 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	return 0;
 
  fail_undir:
+	hashtable_remove(semfs->semfs_dirhash, &dent->semd_link);
 	semfs_direntryarray_set(semfs->semfs_dents, empty, NULL);
  fail_undent:
 	semfs_direntry_destroy(dent);
@@ -475,47 +527,36 @@ semfs_remove(struct vnode *dirvn, const char *name)
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num;
-	int result;
 
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EINVAL;
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(name, dent->semd_name)) {
-			/* found */
-			sem = semfs_getsembynum(semfs, dent->semd_semnum);
-			lock_acquire(sem->sems_lock);
-			KASSERT(sem->sems_linked);
-			sem->sems_linked = false;
-			if (sem->sems_hasvnode == false) {
-				lock_acquire(semfs->semfs_tablelock);
-				semfs_semarray_set(semfs->semfs_sems,
-						   dent->semd_semnum, NULL);
-				lock_release(semfs->semfs_tablelock);
-				lock_release(sem->sems_lock);
-				semfs_sem_destroy(sem);
-			}
-			else {
-				lock_release(sem->sems_lock);
-			}
-			semfs_direntryarray_set(semfs->semfs_dents, i, NULL);
-			semfs_direntry_destroy(dent);
-			result = 0;
-			goto out;
-		}
+	dent = semfs_dir_find(semfs, name);
+	if (dent == NULL) {
+		lock_release(semfs->semfs_dirlock);
+		return ENOENT;
+	}
+
+	lock_acquire(semfs->semfs_tablelock);
+	sem = semfs_semarray_get(semfs->semfs_sems, dent->semd_semnum);
+	KASSERT(sem->sems_linked);
+	sem->sems_linked = false;
+	if (sem->sems_hasvnode == false) {
+		semfs_semarray_set(semfs->semfs_sems, dent->semd_semnum, NULL);
+		lock_release(semfs->semfs_tablelock);
+		semfs_sem_destroy(sem);
 	}
-	result = ENOENT;
- out:
+	else {
+		lock_release(semfs->semfs_tablelock);
+	}
+	hashtable_remove(semfs->semfs_dirhash, &dent->semd_link);
+	semfs_direntryarray_set(semfs->semfs_dents, dent->semd_slot, NULL);
+	semfs_direntry_destroy(dent);
+
 	lock_release(semfs->semfs_dirlock);
-	return result;
+	return 0;
 }
 
 /*
@@ -528,7 +569,6 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	struct semfs_vnode *dirsemv = dirvn->vn_data;
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
-	unsigned i, num;
 	int result;
 
 	if (!strcmp(path, ".") || !strcmp(path, "..")) {
@@ -538,21 +578,14 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(path, dent->semd_name)) {
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
-			lock_release(semfs->semfs_dirlock);
-			return result;
-		}
+	dent = semfs_dir_find(semfs, path);
+	if (dent == NULL) {
+		lock_release(semfs->semfs_dirlock);
+		return ENOENT;
 	}
+	result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
 	lock_release(semfs->semfs_dirlock);
-	return ENOENT;
+	return result;
 }
 
 /*
@@ -603,19 +636,13 @@ semfs_reclaim(struct vnode *vn)
 
 	lock_acquire(semfs->semfs_tablelock);
 
-	/* vnode refcount is protected by the vnode's ->vn_countlock */
-	spinlock_acquire(&vn->vn_countlock);
-	if (vn->vn_refcount > 1) {
-		/* consume the reference VOP_DECREF passed us */
-		vn->vn_refcount--;
-
-		spinlock_release(&vn->vn_countlock);
+	/* semfs_tablelock keeps anyone from finding vn meanwhile */
+	if (!vnode_lastref(vn)) {
+		/* it consumed the reference VOP_DECREF passed us */
 		lock_release(semfs->semfs_tablelock);
 		return EBUSY;
 	}
 
-	spinlock_release(&vn->vn_countlock);
-
 	/* remove from the table */
 	num = vnodearray_num(semfs->semfs_vnodes);
 	for (i=0; i<num; i++) {
@@ -657,14 +684,19 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_isdir,
 	.vop_getdirentry = semfs_getdirentry,
+	.vop_getdirentries = vopfail_uio_nosys,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_dirstat,
 	.vop_gettype = semfs_gettype,
 	.vop_isseekable = semfs_isseekable,
 	.vop_fsync = semfs_fsync,
+	.vop_fdatasync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
+	.vop_poll = vnode_poll_ready,
 	.vop_namefile = semfs_namefile,
 
 	.vop_creat = semfs_creat,
@@ -690,14 +722,19 @@ static const struct vnode_ops semfs_semops = {
 	.vop_read = semfs_read,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = semfs_write,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_semstat,
 	.vop_gettype = semfs_gettype,
 	.vop_isseekable = semfs_isseekable,
 	.vop_fsync = semfs_fsync,
+	.vop_fdatasync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_poll = vnode_poll_ready,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -711,6 +748,31 @@ static const struct vnode_ops semfs_semops = {
 	.vop_lookparent = vopfail_lookparent_notdir,
 };
 
+/*
+ * Direct semaphore operation for the semop() system call: V by COUNT
+ * if positive, P by -COUNT if negative, without going through a uio.
+ */
+int
+semfs_semop(struct vnode *vn, int count)
+{
+	struct semfs_vnode *semv;
+	struct semfs_sem *sem;
+
+	if (vn->vn_ops != &semfs_semops) {
+		return EINVAL;
+	}
+	semv = vn->vn_data;
+	sem = semfs_getsem(semv);
+
+	if (count > 0) {
+		return semfs_sem_v(sem, count);
+	}
+	if (count < 0) {
+		semfs_sem_p(sem, -(unsigned)count);
+	}
+	return 0;
+}
+
 /*
  * Constructor for semfs vnodes.
  */
@@ -736,6 +798,7 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 	semv->semv_semfs = semfs;
 	semv->semv_semnum = semnum;
+	semv->semv_sem = NULL;
 
 	result = vnode_init(&semv->semv_absvn, optable,
 			    &semfs->semfs_absfs, semv);
@@ -791,6 +854,7 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 		KASSERT(sem != NULL);
 		KASSERT(sem->sems_hasvnode == false);
 		sem->sems_hasvnode = true;
+		semv->semv_sem = sem;
 	}
 	lock_release(semfs->semfs_tablelock);
 
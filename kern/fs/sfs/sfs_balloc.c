@@ -33,9 +33,12 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <synch.h>
+#include <cpu.h>
+#include <current.h>
 #include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -74,7 +77,241 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 }
 
 /*
- * Allocate a block.
+ * How far either side of the goal block to look for a free block
+ * before giving up and taking the lowest free block in the group.
+ */
+#define SFS_BALLOC_WINDOW	512
+
+/*
+ * How many blocks to reserve ahead of a file being written, so that
+ * files written at the same time don't end up interleaved.
+ */
+#define SFS_PREALLOC_BLOCKS	8
+
+////////////////////////////////////////////////////////////
+// allocation groups
+
+/*
+ * The volume is divided into allocation groups of SFS_AG_BLOCKS
+ * blocks, each with its own lock for its part of the freemap, so
+ * allocations and frees in different groups don't serialize. (The
+ * group size matches BITMAP_GROUPBITS, so the bitmap's own bookkeeping
+ * for different groups doesn't overlap either.) An allocation with a
+ * goal goes to the goal's group, which for file data means near the
+ * file's other blocks or its inode, and for a new inode near its
+ * directory's inode (see sfs_makeobj); one without a goal starts in a
+ * group picked by the current CPU. Either way, if the group is full
+ * the following ones are tried in turn.
+ *
+ * sfs_lock_freemap locks all the groups, for things that free blocks
+ * all over (truncate) or need the whole freemap to hold still (writing
+ * it out). sfs_freemaplock, which also covers the superblock, comes
+ * before the group locks; the group locks go in ascending order.
+ *
+ * sfs_freemapdirty is only ever set to true by holders of a group
+ * lock, and only tested and cleared with all of them held.
+ */
+
+/* Group BLOCK is in. */
+static
+unsigned
+sfs_agroup(daddr_t block)
+{
+	return block / SFS_AG_BLOCKS;
+}
+
+/* Range of freemap bits in group G. */
+static
+void
+sfs_agroup_range(struct sfs_fs *sfs, unsigned g, daddr_t *start, daddr_t *end)
+{
+	daddr_t nbits = SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks);
+
+	*start = g * SFS_AG_BLOCKS;
+	*end = *start + SFS_AG_BLOCKS;
+	if (*end > nbits) {
+		*end = nbits;
+	}
+}
+
+static
+void
+sfs_agroup_lock(struct sfs_fs *sfs, unsigned g)
+{
+	KASSERT(g < sfs->sfs_ngroups);
+	lock_acquire(sfs->sfs_aglocks[g]);
+}
+
+static
+void
+sfs_agroup_unlock(struct sfs_fs *sfs, unsigned g)
+{
+	KASSERT(g < sfs->sfs_ngroups);
+	lock_release(sfs->sfs_aglocks[g]);
+}
+
+/*
+ * Set up the group locks, once the size of the volume is known.
+ */
+int
+sfs_agroups_create(struct sfs_fs *sfs)
+{
+	unsigned g;
+
+	sfs->sfs_ngroups = DIVROUNDUP(SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks),
+				      SFS_AG_BLOCKS);
+	sfs->sfs_aglocks = kmalloc(sfs->sfs_ngroups * sizeof(struct lock *));
+	if (sfs->sfs_aglocks == NULL) {
+		sfs->sfs_ngroups = 0;
+		return ENOMEM;
+	}
+	for (g=0; g<sfs->sfs_ngroups; g++) {
+		sfs->sfs_aglocks[g] = lock_create("sfs_aglock");
+		if (sfs->sfs_aglocks[g] == NULL) {
+			sfs->sfs_ngroups = g;
+			sfs_agroups_destroy(sfs);
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Tear them down.
+ */
+void
+sfs_agroups_destroy(struct sfs_fs *sfs)
+{
+	unsigned g;
+
+	if (sfs->sfs_aglocks == NULL) {
+		return;
+	}
+	for (g=0; g<sfs->sfs_ngroups; g++) {
+		lock_destroy(sfs->sfs_aglocks[g]);
+	}
+	kfree(sfs->sfs_aglocks);
+	sfs->sfs_aglocks = NULL;
+	sfs->sfs_ngroups = 0;
+}
+
+/*
+ * Check if we hold the lock for BLOCK's group.
+ */
+static
+bool
+sfs_agroup_held(struct sfs_fs *sfs, daddr_t block)
+{
+	return lock_do_i_hold(sfs->sfs_aglocks[sfs_agroup(block)]);
+}
+
+////////////////////////////////////////////////////////////
+// allocation
+
+/*
+ * Find and mark a free block, searching outward from GOAL (a GOAL of
+ * 0 means no preference; block 0 is the superblock) within the
+ * goal's group. At each distance the block after the goal is tried
+ * before the one before it, because files mostly grow forward.
+ *
+ * Returns with the lock for the found block's group held.
+ */
+static
+int
+sfs_bfind(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	daddr_t start, end, d;
+	unsigned g, first, i;
+	int result;
+
+	if (goal != 0 && goal < nblocks) {
+		first = sfs_agroup(goal);
+		sfs_agroup_range(sfs, first, &start, &end);
+		sfs_agroup_lock(sfs, first);
+		for (d=0; d<=SFS_BALLOC_WINDOW; d++) {
+			if (goal + d < end &&
+			    !bitmap_isset(sfs->sfs_freemap, goal + d)) {
+				*diskblock = goal + d;
+				bitmap_mark(sfs->sfs_freemap, *diskblock);
+				return 0;
+			}
+			if (d > 0 && d <= goal - start &&
+			    !bitmap_isset(sfs->sfs_freemap, goal - d)) {
+				*diskblock = goal - d;
+				bitmap_mark(sfs->sfs_freemap, *diskblock);
+				return 0;
+			}
+		}
+		sfs_agroup_unlock(sfs, first);
+	}
+	else {
+		first = curcpu->c_number % sfs->sfs_ngroups;
+	}
+
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		g = (first + i) % sfs->sfs_ngroups;
+		sfs_agroup_range(sfs, g, &start, &end);
+		sfs_agroup_lock(sfs, g);
+		result = bitmap_alloc_range(sfs->sfs_freemap, start, end,
+					    diskblock);
+		if (result == 0) {
+			return 0;
+		}
+		sfs_agroup_unlock(sfs, g);
+	}
+	return ENOSPC;
+}
+
+/*
+ * Get a block that's about to be used for the first time ready:
+ * zero it, or if FILL is set, just get its buffer without zeroing it
+ * (see sfs_balloc_file). Also used for preallocated blocks when
+ * they're first written (sfs_extent.c).
+ *
+ * Uses 1 buffer; returns it if BUFRET is not NULL.
+ */
+int
+sfs_bclear(struct sfs_fs *sfs, daddr_t diskblock, bool fill,
+	   struct buf **bufret)
+{
+	if (fill) {
+		KASSERT(bufret != NULL);
+		return buffer_get(&sfs->sfs_absfs, diskblock,
+				  SFS_BLOCKSIZE, bufret);
+	}
+	return sfs_clearblock(sfs, diskblock, bufret);
+}
+
+/*
+ * Common tail of the allocators: check and zero the block chosen.
+ * If FILL is set, get its buffer without zeroing it instead (see
+ * sfs_balloc_file).
+ */
+static
+int
+sfs_balloc_finish(struct sfs_fs *sfs, daddr_t *diskblock, bool fill,
+		  struct buf **bufret)
+{
+	int result;
+
+	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, *diskblock);
+	}
+
+	/* Clear block (unless it's about to be filled) before returning it */
+	result = sfs_bclear(sfs, *diskblock, fill, bufret);
+	if (result) {
+		sfs_agroup_lock(sfs, sfs_agroup(*diskblock));
+		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_agroup_unlock(sfs, sfs_agroup(*diskblock));
+	}
+	return result;
+}
+
+/*
+ * Allocate a block, preferably GOAL or as close to it as possible.
  *
  * Returns the block number, plus a buffer for it if BUFRET isn't
  * null. The buffer, if any, is marked valid and dirty, and zeroed
@@ -83,43 +320,259 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
  * Uses 1 buffer.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
+sfs_balloc_goal(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock,
+		struct buf **bufret)
 {
 	int result;
 
-	lock_acquire(sfs->sfs_freemaplock);
-
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = sfs_bfind(sfs, goal, diskblock);
 	if (result) {
-		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	sfs_agroup_unlock(sfs, sfs_agroup(*diskblock));
 
-	lock_release(sfs->sfs_freemaplock);
+	return sfs_balloc_finish(sfs, diskblock, false, bufret);
+}
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
-		panic("sfs: %s: balloc: invalid block %u\n",
-		      sfs->sfs_sb.sb_volname, *diskblock);
+/*
+ * Give back the blocks reserved for SV. Must hold the lock for their
+ * group (or the whole freemap).
+ */
+void
+sfs_bunreserve_prelocked(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned i;
+
+	if (sv->sv_reserved == 0) {
+		return;
+	}
+	KASSERT(sfs_agroup_held(sfs, sv->sv_nextblock));
+
+	for (i=0; i<sv->sv_reserved; i++) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_nextblock + i);
+	}
+	sfs->sfs_freemapdirty = true;
+	sv->sv_reserved = 0;
+}
+
+/*
+ * Same, for when we don't have anything locked.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned g;
+
+	if (sv->sv_reserved == 0) {
+		return;
+	}
+	g = sfs_agroup(sv->sv_nextblock);
+	sfs_agroup_lock(sfs, g);
+	sfs_bunreserve_prelocked(sv);
+	sfs_agroup_unlock(sfs, g);
+}
+
+/*
+ * Allocate a block for the file SV, preferably GOAL. A GOAL of 0
+ * means the block after the one last allocated to the file, or for a
+ * file with nothing allocated yet, the blocks after its inode.
+ *
+ * Each file keeps a small run of blocks reserved (marked in use in
+ * the freemap but not yet part of the file) starting at
+ * sv_nextblock. If the goal is the start of that run, the block comes
+ * from it; otherwise the run is given back, and a new block is found
+ * near the goal along with as many of the free blocks right after it
+ * (up to SFS_PREALLOC_BLOCKS in all, or sv_wantblocks if that's more,
+ * when a whole run is being allocated) as can be had for the next run.
+ * The run stays within one allocation group.
+ * The reservation is given back when the file is truncated or its
+ * vnode reclaimed; after a crash it shows up as blocks marked in use
+ * that nothing uses, which sfsck fixes.
+ *
+ * If FILL is set, the caller is about to overwrite the whole block,
+ * so it isn't zeroed first: the buffer (which must be asked for)
+ * comes back busy and not yet valid, and the caller must fill it in
+ * before letting go of it.
+ *
+ * Locking: must hold vnode lock. Acquires/releases allocation group
+ * locks.
+ *
+ * Uses 1 buffer.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, bool fill,
+		daddr_t *diskblock, struct buf **bufret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, start, end;
+	unsigned want, g;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (goal == 0) {
+		goal = sv->sv_nextblock != 0 ? sv->sv_nextblock :
+			sv->sv_ino + 1;
+	}
+
+	if (sv->sv_reserved > 0 && goal == sv->sv_nextblock) {
+		/* take the first reserved block */
+		g = sfs_agroup(sv->sv_nextblock);
+		sfs_agroup_lock(sfs, g);
+		block = sv->sv_nextblock;
+		sv->sv_nextblock++;
+		sv->sv_reserved--;
+	}
+	else {
+		sfs_bunreserve(sv);
+		result = sfs_bfind(sfs, goal, &block);
+		if (result) {
+			return result;
+		}
+		g = sfs_agroup(block);
+		sfs_agroup_range(sfs, g, &start, &end);
+		if (end > sfs->sfs_sb.sb_nblocks) {
+			end = sfs->sfs_sb.sb_nblocks;
+		}
+		want = sv->sv_wantblocks > SFS_PREALLOC_BLOCKS ?
+			sv->sv_wantblocks : SFS_PREALLOC_BLOCKS;
+		sv->sv_nextblock = block + 1;
+		while (sv->sv_reserved < want - 1 &&
+		       sv->sv_nextblock + sv->sv_reserved < end &&
+		       !bitmap_isset(sfs->sfs_freemap,
+				     sv->sv_nextblock + sv->sv_reserved)) {
+			bitmap_mark(sfs->sfs_freemap,
+				    sv->sv_nextblock + sv->sv_reserved);
+			sv->sv_reserved++;
+		}
+	}
+	sfs->sfs_freemapdirty = true;
+	sfs_agroup_unlock(sfs, g);
+
+	*diskblock = block;
+	return sfs_balloc_finish(sfs, diskblock, fill, bufret);
+}
+
+/*
+ * Allocate a run of up to WANT consecutive blocks for the file SV,
+ * starting as close to GOAL as possible (with a GOAL of 0 meaning the
+ * same as for sfs_balloc_file), for fallocate. The first block is
+ * found as sfs_balloc_file finds one and the run is every free block
+ * right after it, within its allocation group, up to WANT in all; so
+ * the whole run is marked with one group lock held. *GOT gets the
+ * length, which is at least 1.
+ *
+ * The blocks are not zeroed; they go into the file as unwritten (see
+ * kern/sfs.h), and are cleared one at a time when they're written.
+ *
+ * Locking: must hold vnode lock. Acquires/releases allocation group
+ * locks.
+ */
+int
+sfs_balloc_run(struct sfs_vnode *sv, daddr_t goal, uint32_t want,
+	       daddr_t *diskblock, uint32_t *got)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, start, end;
+	uint32_t n;
+	unsigned g;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(want > 0);
+
+	if (goal == 0) {
+		goal = sv->sv_nextblock != 0 ? sv->sv_nextblock :
+			sv->sv_ino + 1;
 	}
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock, bufret);
+	/* The file's reservation is where we'd look anyway */
+	sfs_bunreserve(sv);
+
+	result = sfs_bfind(sfs, goal, &block);
 	if (result) {
-		lock_acquire(sfs->sfs_freemaplock);
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
-		lock_release(sfs->sfs_freemaplock);
+		return result;
 	}
-	return result;
+	g = sfs_agroup(block);
+	sfs_agroup_range(sfs, g, &start, &end);
+	if (end > sfs->sfs_sb.sb_nblocks) {
+		end = sfs->sfs_sb.sb_nblocks;
+	}
+	n = 1;
+	while (n < want && block + n < end &&
+	       !bitmap_isset(sfs->sfs_freemap, block + n)) {
+		bitmap_mark(sfs->sfs_freemap, block + n);
+		n++;
+	}
+	sfs->sfs_freemapdirty = true;
+	sfs_agroup_unlock(sfs, g);
+
+	if (block + n > sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid run %u+%u\n",
+		      sfs->sfs_sb.sb_volname, block, n);
+	}
+	sv->sv_nextblock = block + n;
+
+	*diskblock = block;
+	*got = n;
+	return 0;
+}
+
+/*
+ * Allocate NUM consecutive blocks anywhere on the volume, for moving
+ * a file's blocks together (sfs_xdefrag). Unlike sfs_balloc_run this
+ * takes the whole run or nothing, so it has to search the whole
+ * freemap, with every group locked. The blocks are not zeroed.
+ */
+int
+sfs_balloc_contig(struct sfs_fs *sfs, uint32_t num, daddr_t *diskblock)
+{
+	unsigned block;
+	int result;
+
+	KASSERT(num > 0);
+
+	sfs_lock_freemap(sfs);
+	result = bitmap_alloc_run(sfs->sfs_freemap, num, &block);
+	if (result == 0) {
+		sfs->sfs_freemapdirty = true;
+	}
+	sfs_unlock_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	if (block + num > sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid run %u+%u\n",
+		      sfs->sfs_sb.sb_volname, block, num);
+	}
+	*diskblock = block;
+	return 0;
 }
 
 /*
- * Free a block, for when we already have the freemap locked.
+ * Allocate a block anywhere.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
+{
+	return sfs_balloc_goal(sfs, 0, diskblock, bufret);
+}
+
+////////////////////////////////////////////////////////////
+// freeing and checking
+
+/*
+ * Free a block, for when we already have its group (or the whole
+ * freemap) locked.
  */
 void
 sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(sfs_agroup_held(sfs, diskblock));
 
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
@@ -136,9 +589,9 @@ sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	lock_acquire(sfs->sfs_freemaplock);
+	sfs_agroup_lock(sfs, sfs_agroup(diskblock));
 	sfs_bfree_prelocked(sfs, diskblock);
-	lock_release(sfs->sfs_freemaplock);
+	sfs_agroup_unlock(sfs, sfs_agroup(diskblock));
 }
 
 /*
@@ -154,24 +607,48 @@ sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
 
-	lock_acquire(sfs->sfs_freemaplock);
+	sfs_agroup_lock(sfs, sfs_agroup(diskblock));
 	result = bitmap_isset(sfs->sfs_freemap, diskblock);
-	lock_release(sfs->sfs_freemaplock);
+	sfs_agroup_unlock(sfs, sfs_agroup(diskblock));
 
 	return result;
 }
 
 /*
- * Explicitly lock and unlock the freemap.
+ * Explicitly lock and unlock the whole freemap.
  */
 void
 sfs_lock_freemap(struct sfs_fs *sfs)
 {
-	lock_acquire(sfs->sfs_freemaplock);
+	unsigned g;
+
+	for (g=0; g<sfs->sfs_ngroups; g++) {
+		sfs_agroup_lock(sfs, g);
+	}
 }
 
 void
 sfs_unlock_freemap(struct sfs_fs *sfs)
 {
-	lock_release(sfs->sfs_freemaplock);
+	unsigned g;
+
+	for (g=sfs->sfs_ngroups; g-- > 0; ) {
+		sfs_agroup_unlock(sfs, g);
+	}
+}
+
+/*
+ * Check if we have the whole freemap locked.
+ */
+bool
+sfs_freemap_locked(struct sfs_fs *sfs)
+{
+	unsigned g;
+
+	for (g=0; g<sfs->sfs_ngroups; g++) {
+		if (!lock_do_i_hold(sfs->sfs_aglocks[g])) {
+			return false;
+		}
+	}
+	return true;
 }
@@ -314,20 +314,21 @@ sfs_blockobj_get(struct sfs_blockobj *bo, uint32_t offset)
 }
 
 /*
- * Change the block value at offset OFFSET in a blockobj. (The offset
- * must be zero if it's an inode blockobj.)
+ * Change the block value at offset OFFSET in a blockobj of SV. (The
+ * offset must be zero if it's an inode blockobj.)
  */
 static
 void
-sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
+sfs_blockobj_set(struct sfs_vnode *sv, struct sfs_blockobj *bo,
+		 uint32_t offset, uint32_t newval)
 {
 	if (bo->bo_isinode) {
-		struct sfs_vnode *sv = bo->bo_inode.i_sv;
 		struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 		struct sfs_dinode *dino;
 		unsigned indirlevel, indirnum;
 
 		KASSERT(offset == 0);
+		KASSERT(bo->bo_inode.i_sv == sv);
 
 		dino = sfs_dinode_map(bo->bo_inode.i_sv);
 		indirlevel = bo->bo_inode.i_subtree.str_indirlevel;
@@ -356,7 +357,7 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 			      sfs->sfs_sb.sb_volname,
 			      indirlevel);
 		}
-		sfs_dinode_mark_dirty(bo->bo_inode.i_sv);
+		sfs_dinode_mark_mapdirty(sv);
 	}
 	else {
 		uint32_t *idptr;
@@ -366,7 +367,7 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 
 		idptr = buffer_map(bo->bo_idblock.id_buf);
 		idptr[offset] = newval;
-		buffer_mark_dirty(bo->bo_idblock.id_buf);
+		sfs_buffer_dirty(sv, bo->bo_idblock.id_buf);
 	}
 }
 
@@ -375,14 +376,17 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 
 /*
  * Given a pointer to a block slot, return it, allocating a block
- * if necessary.
+ * if necessary. LEAF is true if the slot is for a data block rather
+ * than an indirect block; a new data block is left for the caller to
+ * fill if sfs_bmap_fill asked for that.
  */
 static
 int
-sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
-	     bool doalloc, daddr_t *diskblock_ret)
+sfs_bmap_get(struct sfs_vnode *sv, struct sfs_blockobj *bo, uint32_t offset,
+	     bool leaf, bool doalloc, daddr_t *diskblock_ret)
 {
 	daddr_t block;
+	bool fill;
 	int result;
 
 	/*
@@ -394,13 +398,15 @@ sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
 	 * Do we need to allocate?
 	 */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block, NULL);
+		fill = leaf && sv->sv_fillbuf != NULL;
+		result = sfs_balloc_file(sv, 0, fill, &block,
+					 fill ? sv->sv_fillbuf : NULL);
 		if (result) {
 			return result;
 		}
 
 		/* Remember what we allocated; mark storage dirty */
-		sfs_blockobj_set(bo, offset, block);
+		sfs_blockobj_set(sv, bo, offset, block);
 	}
 
 	/*
@@ -423,29 +429,46 @@ sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
  *
  * DISKBLOCK_RET gets the resulting disk block number.
  *
+ * HOLELEN_RET, if not NULL, gets the number of unmapped blocks
+ * starting at the requested one when that block turns out not to be
+ * mapped: the rest of the pointer slot that was empty plus any empty
+ * slots after it in the same block. (It might be longer; the caller
+ * can look again past the end.)
+ *
  * This function would be somewhat tidier if it were recursive, but
  * recursion in the kernel is generally a bad idea because of the
  * available stack size.
  */
 static
 int
-sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
+sfs_bmap_subtree(struct sfs_vnode *sv, struct sfs_blockobj *inodeobj,
 		 unsigned indir,
 		 uint32_t offset, bool doalloc,
-		 daddr_t *diskblock_ret)
+		 daddr_t *diskblock_ret, uint32_t *holelen_ret)
 {
-	daddr_t block;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, nextblock;
 	struct buf *idbuf;
-	uint32_t idoff;
+	uint32_t idoff, i;
 	uint32_t fileblocks_per_entry;
 	struct sfs_blockobj idobj;
 	int result;
 
+	KASSERT(!doalloc || holelen_ret == NULL);
+
 	/* Get the block inodeobj immediately points to (maybe allocating) */
-	result = sfs_bmap_get(sfs, inodeobj, 0, doalloc, &block);
+	result = sfs_bmap_get(sv, inodeobj, 0, indir == 0, doalloc, &block);
 	if (result) {
 		return result;
 	}
+	if (block == 0 && holelen_ret != NULL) {
+		/* the whole subtree is missing */
+		fileblocks_per_entry = 1;
+		for (i=0; i<indir; i++) {
+			fileblocks_per_entry *= SFS_DBPERIDB;
+		}
+		*holelen_ret = fileblocks_per_entry - offset;
+	}
 
 	while (indir > 0) {
 
@@ -489,7 +512,32 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		sfs_blockobj_init_idblock(&idobj, idbuf);
 
 		/* Get the address of the next layer down (maybe allocating) */
-		result = sfs_bmap_get(sfs, &idobj, idoff, doalloc, &block);
+		result = sfs_bmap_get(sv, &idobj, idoff, indir == 1, doalloc,
+				      &block);
+
+		/* If that's a hole, see how far it goes in this block */
+		if (result == 0 && block == 0 && holelen_ret != NULL) {
+			*holelen_ret = fileblocks_per_entry - offset;
+			for (i = idoff + 1; i < SFS_DBPERIDB &&
+				     sfs_blockobj_get(&idobj, i) == 0; i++) {
+				*holelen_ret += fileblocks_per_entry;
+			}
+		}
+
+		/*
+		 * If the next layer down is also indirect and we're
+		 * past the middle of it, a sequential reader will want
+		 * the one after it soon; start fetching that now.
+		 */
+		if (result == 0 && !doalloc && indir > 1 &&
+		    idoff + 1 < SFS_DBPERIDB &&
+		    offset >= fileblocks_per_entry / 2) {
+			nextblock = sfs_blockobj_get(&idobj, idoff + 1);
+			if (nextblock != 0) {
+				buffer_prefetch(&sfs->sfs_absfs, nextblock,
+						SFS_BLOCKSIZE);
+			}
+		}
 
 		sfs_blockobj_cleanup(&idobj);
 		buffer_release(idbuf);
@@ -504,20 +552,112 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// translation cache
+
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Each vnode caches a few recently used runs of translations
+ * (fileblock to diskblock, as struct sfs_extent) in sv_bmcache, so
+ * repeated or sequential lookups in a hot file don't have to walk
+ * the inode and indirect blocks or take any buffer locks. Blocks
+ * found one at a time extend a run when they're contiguous both in
+ * the file and on disk.
  *
- * Locking: must hold vnode lock. May get/release buffer cache locks
- * and (via sfs_balloc) sfs_freemaplock.
+ * Existing translations only change when blocks are discarded, so
+ * sfs_itrunc empties the cache and allocating blocks doesn't need to
+ * touch it. Holes aren't cached.
+ */
+
+/*
+ * Look up FILEBLOCK in the cache.
+ */
+static
+bool
+sfs_bmcache_lookup(struct sfs_vnode *sv, uint32_t fileblock,
+		   daddr_t *diskblock)
+{
+	const struct sfs_extent *x;
+	unsigned i;
+
+	for (i=0; i<SFS_BMCACHE_SIZE; i++) {
+		x = &sv->sv_bmcache[i];
+		if (x->sx_len != 0 && fileblock >= x->sx_fileblock &&
+		    fileblock - x->sx_fileblock < x->sx_len) {
+			*diskblock = x->sx_diskblock +
+				(fileblock - x->sx_fileblock);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Add the run of LEN blocks at FILEBLOCK, on disk at DISKBLOCK.
  *
- * Requires up to 2 buffers.
+ * Locking: must hold vnode lock.
+ */
+void
+sfs_bmcache_add(struct sfs_vnode *sv, uint32_t fileblock,
+		daddr_t diskblock, uint32_t len)
+{
+	struct sfs_extent *x;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(len > 0);
+
+	for (i=0; i<SFS_BMCACHE_SIZE; i++) {
+		x = &sv->sv_bmcache[i];
+		if (x->sx_len == 0) {
+			continue;
+		}
+		if (x->sx_fileblock + x->sx_len == fileblock &&
+		    x->sx_diskblock + x->sx_len == diskblock) {
+			/* continues this run */
+			x->sx_len += len;
+			return;
+		}
+		if (x->sx_fileblock == fileblock &&
+		    x->sx_diskblock == diskblock) {
+			/* same run (maybe grown since) */
+			if (len > x->sx_len) {
+				x->sx_len = len;
+			}
+			return;
+		}
+	}
+
+	x = &sv->sv_bmcache[sv->sv_bmnext];
+	sv->sv_bmnext = (sv->sv_bmnext + 1) % SFS_BMCACHE_SIZE;
+	x->sx_fileblock = fileblock;
+	x->sx_diskblock = diskblock;
+	x->sx_len = len;
+}
+
+/*
+ * Empty the cache.
  */
+void
+sfs_bmcache_clear(struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BMCACHE_SIZE; i++) {
+		sv->sv_bmcache[i].sx_len = 0;
+	}
+	sv->sv_bmnext = 0;
+}
+
+////////////////////////////////////////////////////////////
+// bmap
+
+/*
+ * Common code for sfs_bmap and sfs_bmap_hole.
+ */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock)
+sfs_bmap_lookup(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock, uint32_t *holelen)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct sfs_subtreeref subtree;
@@ -527,10 +667,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Figure out where to start */
-	result = sfs_get_indirection(fileblock, &subtree, &offset);
-	if (result) {
-		return result;
+	/*
+	 * Try the translation cache first. (What's in it came from
+	 * the inode, so it doesn't need checking against the freemap
+	 * again.)
+	 */
+	if (sfs_bmcache_lookup(sv, fileblock, diskblock)) {
+		return 0;
 	}
 
 	/* Load the inode */
@@ -539,21 +682,44 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		return result;
 	}
 
+	/* Inline files have no blocks; their callers shouldn't be here */
+	KASSERT((sfs_dinode_map(sv)->sfi_flags & SFS_DIF_INLINE) == 0);
+
+	if (sfs_dinode_map(sv)->sfi_flags & SFS_DIF_EXTENTS) {
+		result = sfs_xmap(sv, fileblock, doalloc, diskblock, holelen);
+		sfs_dinode_unload(sv);
+		if (result) {
+			return result;
+		}
+		goto check;
+	}
+
+	/* Figure out where to start */
+	result = sfs_get_indirection(fileblock, &subtree, &offset);
+	if (result) {
+		sfs_dinode_unload(sv);
+		return result;
+	}
+
 	/* Initialize inodeobj to point at the top of this subtree */
 	sfs_blockobj_init_inode(&inodeobj, sv, &subtree);
 
 	/* Do the work in the indicated subtree */
-	result = sfs_bmap_subtree(sfs, &inodeobj,
+	result = sfs_bmap_subtree(sv, &inodeobj,
 				  subtree.str_indirlevel,
 				  offset, doalloc,
-				  diskblock);
+				  diskblock, holelen);
 	sfs_blockobj_cleanup(&inodeobj);
 	sfs_dinode_unload(sv);
 
 	if (result) {
 		return result;
 	}
+	if (*diskblock != 0) {
+		sfs_bmcache_add(sv, fileblock, *diskblock, 1);
+	}
 
+ check:
 	/* Hand back the result and return. */
 	if (*diskblock != 0 && !sfs_bused(sfs, *diskblock)) {
 		panic("sfs: %s: Data block %u (block %u of file %u) "
@@ -564,6 +730,86 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	return 0;
 }
 
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated.
+ *
+ * Locking: must hold vnode lock. May get/release buffer cache locks
+ * and (via sfs_balloc_file) an allocation group lock.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock)
+{
+	return sfs_bmap_lookup(sv, fileblock, doalloc, diskblock, NULL);
+}
+
+/*
+ * Same as sfs_bmap without allocating, but if FILEBLOCK isn't mapped,
+ * also hand back in HOLELEN how many blocks starting there are known
+ * to be unmapped (at least 1), so callers walking a sparse file can
+ * step over a whole missing subtree at once. HOLELEN is not set if
+ * the block is mapped.
+ *
+ * Locking: as for sfs_bmap.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_bmap_hole(struct sfs_vnode *sv, uint32_t fileblock,
+	      daddr_t *diskblock, uint32_t *holelen)
+{
+	int result;
+
+	*holelen = 1;
+	result = sfs_bmap_lookup(sv, fileblock, false, diskblock, holelen);
+	if (result == EFBIG) {
+		/* past the largest possible file; all hole */
+		*diskblock = 0;
+		return 0;
+	}
+	return result;
+}
+
+/*
+ * Same as sfs_bmap with DOALLOC set, for a block the caller is about
+ * to overwrite completely. If the block has to be allocated, there's
+ * no point zeroing it first (and maybe writing the zeros out), so
+ * NEWBUF gets its buffer, busy and not valid; the caller must fill
+ * the whole thing in, mark it valid and dirty, and release it before
+ * letting go of the vnode lock, so nothing can see the block's old
+ * contents. Otherwise NEWBUF is set to NULL.
+ *
+ * Locking: as for sfs_bmap.
+ *
+ * Requires up to 2 buffers, 1 of which may be handed back.
+ */
+int
+sfs_bmap_fill(struct sfs_vnode *sv, uint32_t fileblock,
+	      daddr_t *diskblock, struct buf **newbuf)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_fillbuf == NULL);
+
+	*newbuf = NULL;
+	sv->sv_fillbuf = newbuf;
+	result = sfs_bmap(sv, fileblock, true, diskblock);
+	sv->sv_fillbuf = NULL;
+
+	if (result && *newbuf != NULL) {
+		/* the block was freed again; don't keep its junk */
+		buffer_release_and_invalidate(*newbuf);
+		*newbuf = NULL;
+	}
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // truncate
 
@@ -877,7 +1123,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				sfs_bfree_prelocked(sfs, layers[1].block);
 				if (indir == 1) {
 					*rootptr = 0;
-					sfs_dinode_mark_dirty(sv);
+					sfs_dinode_mark_mapdirty(sv);
 				}
 				if (indir != 1) {
 					layers[2].modified = true;
@@ -890,7 +1136,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				 * The indirect block
 				 * has been modified
 				 */
-				buffer_mark_dirty(layers[1].buf);
+				sfs_buffer_dirty(sv, layers[1].buf);
 				if (indir != 1) {
 					layers[2].hasnonzero = true;
 				}
@@ -930,7 +1176,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 			sfs_bfree_prelocked(sfs, layers[2].block);
 			if (indir == 2) {
 				*rootptr = 0;
-				sfs_dinode_mark_dirty(sv);
+				sfs_dinode_mark_mapdirty(sv);
 			}
 			if (indir == 3) {
 				layers[3].modified = true;
@@ -943,7 +1189,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 			 * The double indirect block
 			 * has been modified
 			 */
-			buffer_mark_dirty(layers[2].buf);
+			sfs_buffer_dirty(sv, layers[2].buf);
 			if (indir == 3) {
 				layers[3].hasnonzero = true;
 			}
@@ -971,7 +1217,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 		 */
 		sfs_bfree_prelocked(sfs, layers[3].block);
 		*rootptr = 0;
-		sfs_dinode_mark_dirty(sv);
+		sfs_dinode_mark_mapdirty(sv);
 		buffer_release_and_invalidate(layers[3].buf);
 	}
 	else if (layers[3].modified) {
@@ -979,7 +1225,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 		 * The triple indirect block has been
 		 * modified
 		 */
-		buffer_mark_dirty(layers[3].buf);
+		sfs_buffer_dirty(sv, layers[3].buf);
 		buffer_release(layers[3].buf);
 	}
 	else {
@@ -1016,7 +1262,7 @@ sfs_discard(struct sfs_vnode *sv,
 		if (i >= startfileblock && i < endfileblock && block != 0) {
 			sfs_bfree_prelocked(sfs, block);
 			inodeptr->sfi_direct[i] = 0;
-			sfs_dinode_mark_dirty(sv);
+			sfs_dinode_mark_mapdirty(sv);
 		}
 	}
 
@@ -1082,15 +1328,61 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/* An inline file has no blocks; it just needs room to grow */
+	if (inodeptr->sfi_flags & SFS_DIF_INLINE) {
+		if (newlen <= (off_t)SFS_INLINE_MAX) {
+			sfs_inline_trunc(sv, newlen);
+			sfs_dinode_unload(sv);
+			return 0;
+		}
+		result = sfs_inline_promote(sv);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+
 	/* Length in blocks (divide rounding up) */
-	oldblocklen = DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE);
+	oldblocklen = DIVROUNDUP(sfs_size(sv), SFS_BLOCKSIZE);
 	newblocklen = DIVROUNDUP(newlen, SFS_BLOCKSIZE);
 
+	/* Pending blocks past the new end never need disk blocks */
+	sfs_dalloc_discard(sv, newblocklen);
+
+	/* Forget what we knew about the directory's free slots */
+	if (sv->sv_type == SFS_TYPE_DIR) {
+		sv->sv_dirfree = 0;
+		sv->sv_dirnfree = -1;
+	}
+
+	/* An emptied directory has no use for its index */
+	if (newlen == 0 && sv->sv_type == SFS_TYPE_DIR) {
+		result = sfs_dirindex_discard(sv);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+
 	/* Lock the freemap for the whole truncate */
 	sfs_lock_freemap(sfs);
 
+	/*
+	 * Translations past the new end are going away, and so is
+	 * any reservation for growing the file from there.
+	 */
+	if (newblocklen < oldblocklen) {
+		sfs_bmcache_clear(sv);
+		sfs_bunreserve_prelocked(sv);
+	}
+
 	if (newblocklen < oldblocklen) {
-		result = sfs_discard(sv, newblocklen, oldblocklen);
+		if (inodeptr->sfi_flags & SFS_DIF_EXTENTS) {
+			result = sfs_xtrunc(sv, newblocklen);
+		}
+		else {
+			result = sfs_discard(sv, newblocklen, oldblocklen);
+		}
 		if (result) {
 			sfs_unlock_freemap(sfs);
 			sfs_dinode_unload(sv);
@@ -1098,11 +1390,8 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 		}
 	}
 
-	/* Set the file size */
-	inodeptr->sfi_size = newlen;
-
-	/* Mark the inode dirty */
-	sfs_dinode_mark_dirty(sv);
+	/* Set the file size (this marks the inode dirty) */
+	sfs_size_set(sv, newlen);
 
 	/* release the freemap */
 	sfs_unlock_freemap(sfs);
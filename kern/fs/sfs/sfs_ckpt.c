@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS journal checkpointing.
+ *
+ * The journal can only be trimmed up to the oldest record whose
+ * change hasn't reached the disk yet. Those changes are sitting in
+ * dirty buffers, so we keep track, for each buffer, of the oldest and
+ * newest LSNs of the changes that are in it but not on disk yet
+ * ("pinning" the journal), and keep the pinned buffers on a list
+ * sorted by oldest LSN.
+ *
+ * The client code (whatever journals changes; see design/jphys.txt)
+ * calls sfs_ckpt_notelsn on a buffer after writing the journal record
+ * that describes a change to it. When the buffer goes to disk,
+ * sfs_writeblock first flushes the journal up to the newest LSN
+ * (write-ahead logging) and then unpins it.
+ *
+ * The checkpointer thread wakes up once a second and commits (see
+ * sfs_jmode.c). If enough of the journal has been used since last
+ * time, it then writes back (oldest first) every buffer that was
+ * already pinning the journal when it last ran, and trims the
+ * journal to the oldest LSN still pinned. So the tail is never more
+ * than two rounds behind the head, and under sustained load the head
+ * doesn't run into it.
+ *
+ * Locking: ck_lock is a spinlock and a leaf; it's taken when holding
+ * buffers busy, so nothing that might wait is done while holding it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <thread.h>
+#include <clock.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* How often the checkpointer wakes up. (seconds) */
+#define SFS_CKPT_INTERVAL	1
+
+/* Fraction of the journal to use up between checkpoints. */
+#define SFS_CKPT_FRACTION	4
+
+/*
+ * Per-buffer pinning state; the fs-specific buffer data. Allocated
+ * the first time a buffer pins the journal, and kept until it's
+ * detached.
+ */
+struct sfs_bufdata {
+	daddr_t sbd_block;		/* disk block of the buffer */
+	sfs_lsn_t sbd_oldlsn;		/* oldest unwritten change, or 0 */
+	sfs_lsn_t sbd_newlsn;		/* newest unwritten change */
+	struct sfs_bufdata *sbd_prev;	/* pinned list */
+	struct sfs_bufdata *sbd_next;
+};
+
+/*
+ * Checkpointer state.
+ */
+struct sfs_ckpt {
+	struct spinlock ck_lock;	/* lock for the following */
+	struct sfs_bufdata *ck_oldest;	/* pinned list, by sbd_oldlsn */
+	struct sfs_bufdata *ck_newest;
+	unsigned ck_npinned;		/* number of pinned buffers */
+	sfs_lsn_t ck_lasttrim;		/* LSN last trimmed to */
+	bool ck_stop;			/* checkpointer should exit */
+
+	/* only used by the checkpointer thread */
+	bool ck_running;		/* thread was started */
+	struct semaphore *ck_done;	/* thread has exited */
+	sfs_lsn_t ck_roundlsn;		/* next LSN as of last round */
+};
+
+////////////////////////////////////////////////////////////
+// pinned list
+
+/*
+ * Put a buffer on the pinned list. The list is sorted by sbd_oldlsn;
+ * LSNs are handed out in order, so a new entry almost always goes at
+ * the newest end, but threads can get here in a different order from
+ * the one they got their LSNs in.
+ */
+static
+void
+sfs_ckpt_pin(struct sfs_ckpt *ck, struct sfs_bufdata *bd)
+{
+	struct sfs_bufdata *after;
+
+	KASSERT(spinlock_do_i_hold(&ck->ck_lock));
+
+	after = ck->ck_newest;
+	while (after != NULL && after->sbd_oldlsn > bd->sbd_oldlsn) {
+		after = after->sbd_prev;
+	}
+
+	bd->sbd_prev = after;
+	if (after == NULL) {
+		bd->sbd_next = ck->ck_oldest;
+		ck->ck_oldest = bd;
+	}
+	else {
+		bd->sbd_next = after->sbd_next;
+		after->sbd_next = bd;
+	}
+	if (bd->sbd_next == NULL) {
+		ck->ck_newest = bd;
+	}
+	else {
+		bd->sbd_next->sbd_prev = bd;
+	}
+	ck->ck_npinned++;
+}
+
+/*
+ * Take a buffer off the pinned list.
+ */
+static
+void
+sfs_ckpt_unpin(struct sfs_ckpt *ck, struct sfs_bufdata *bd)
+{
+	KASSERT(spinlock_do_i_hold(&ck->ck_lock));
+	KASSERT(bd->sbd_oldlsn != 0);
+
+	if (bd->sbd_prev == NULL) {
+		ck->ck_oldest = bd->sbd_next;
+	}
+	else {
+		bd->sbd_prev->sbd_next = bd->sbd_next;
+	}
+	if (bd->sbd_next == NULL) {
+		ck->ck_newest = bd->sbd_prev;
+	}
+	else {
+		bd->sbd_next->sbd_prev = bd->sbd_prev;
+	}
+	bd->sbd_prev = bd->sbd_next = NULL;
+	bd->sbd_oldlsn = bd->sbd_newlsn = 0;
+	KASSERT(ck->ck_npinned > 0);
+	ck->ck_npinned--;
+}
+
+////////////////////////////////////////////////////////////
+// buffer hooks
+
+/*
+ * Record that the busy buffer BUF, for disk block BLOCK, holds a
+ * change described by the journal record LSN. Call this after
+ * sfs_jphys_write returns and before releasing the buffer. (Not for
+ * fsmanaged buffers; the checkpointer couldn't write those back.)
+ */
+int
+sfs_ckpt_notelsn(struct sfs_fs *sfs, struct buf *buf, daddr_t block,
+		 sfs_lsn_t lsn)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	struct sfs_bufdata *bd;
+
+	KASSERT(lsn != 0);
+
+	bd = buffer_get_fsdata(buf);
+	if (bd == NULL) {
+		bd = kmalloc(sizeof(*bd));
+		if (bd == NULL) {
+			return ENOMEM;
+		}
+		bd->sbd_block = block;
+		bd->sbd_oldlsn = 0;
+		bd->sbd_newlsn = 0;
+		bd->sbd_prev = bd->sbd_next = NULL;
+		buffer_set_fsdata(buf, bd);
+	}
+
+	spinlock_acquire(&ck->ck_lock);
+	if (lsn > bd->sbd_newlsn) {
+		bd->sbd_newlsn = lsn;
+	}
+	if (bd->sbd_oldlsn == 0) {
+		bd->sbd_oldlsn = lsn;
+		sfs_ckpt_pin(ck, bd);
+	}
+	spinlock_release(&ck->ck_lock);
+	return 0;
+}
+
+/*
+ * Called from sfs_writeblock(s) before writing NUM buffers with
+ * fs-specific data FSBUFDATA[] (entries may be NULL): flush the
+ * journal far enough that the records describing their changes are
+ * on disk first. Each buffer's sbd_newlsn is the last record that
+ * touched it, so that's as far as it needs; for a cluster one flush
+ * to the newest of them covers all. Buffers nothing was logged for
+ * don't wait for the journal at all, and sfs_jphys_flush returns
+ * right away if the records went out earlier.
+ */
+int
+sfs_ckpt_prewrite(struct sfs_fs *sfs, void **fsbufdata, unsigned num)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	struct sfs_bufdata *bd;
+	sfs_lsn_t lsn;
+	unsigned i;
+
+	lsn = 0;
+	spinlock_acquire(&ck->ck_lock);
+	for (i=0; i<num; i++) {
+		bd = fsbufdata[i];
+		if (bd != NULL && bd->sbd_newlsn > lsn) {
+			lsn = bd->sbd_newlsn;
+		}
+	}
+	spinlock_release(&ck->ck_lock);
+
+	return lsn == 0 ? 0 : sfs_jphys_flush(sfs, lsn);
+}
+
+/*
+ * Called from sfs_writeblock after successfully writing a buffer:
+ * its changes are on disk, so it no longer pins the journal.
+ */
+void
+sfs_ckpt_postwrite(struct sfs_fs *sfs, void *fsbufdata)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	struct sfs_bufdata *bd = fsbufdata;
+
+	if (bd == NULL) {
+		return;
+	}
+	spinlock_acquire(&ck->ck_lock);
+	if (bd->sbd_oldlsn != 0) {
+		sfs_ckpt_unpin(ck, bd);
+	}
+	spinlock_release(&ck->ck_lock);
+}
+
+/*
+ * Called from sfs_detachbuf to get rid of a buffer's fs-specific
+ * data. A buffer that's detached while still pinning the journal is
+ * being invalidated (its changes are being thrown away on purpose),
+ * so just forget about it.
+ */
+void
+sfs_ckpt_detach(struct sfs_fs *sfs, void *fsbufdata)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	struct sfs_bufdata *bd = fsbufdata;
+
+	if (bd == NULL) {
+		return;
+	}
+	spinlock_acquire(&ck->ck_lock);
+	if (bd->sbd_oldlsn != 0) {
+		sfs_ckpt_unpin(ck, bd);
+	}
+	spinlock_release(&ck->ck_lock);
+	kfree(bd);
+}
+
+////////////////////////////////////////////////////////////
+// checkpointing
+
+/*
+ * Trim the journal as far as the pinned buffers allow. Anyone may
+ * call this; the checkpointer does after each round of writeback.
+ */
+void
+sfs_checkpoint(struct sfs_fs *sfs)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	sfs_lsn_t taillsn;
+
+	/*
+	 * Get the next LSN first; if anything gets pinned after we
+	 * look at the list, its LSN will be at least this.
+	 */
+	taillsn = sfs_jphys_peeknextlsn(sfs);
+
+	spinlock_acquire(&ck->ck_lock);
+	if (ck->ck_oldest != NULL && ck->ck_oldest->sbd_oldlsn < taillsn) {
+		taillsn = ck->ck_oldest->sbd_oldlsn;
+	}
+	if (taillsn <= ck->ck_lasttrim) {
+		spinlock_release(&ck->ck_lock);
+		return;
+	}
+	ck->ck_lasttrim = taillsn;
+	spinlock_release(&ck->ck_lock);
+
+	sfs_jphys_trim(sfs, taillsn);
+}
+
+/*
+ * Write back the pinned buffers whose oldest change is before
+ * TARGETLSN, oldest first. Gives up on a buffer that's still at the
+ * front of the list after writing it (e.g. because the write failed
+ * or someone dirtied it again straight away).
+ */
+static
+void
+sfs_ckpt_writeback(struct sfs_fs *sfs, sfs_lsn_t targetlsn)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	struct sfs_bufdata *bd;
+	daddr_t block;
+	sfs_lsn_t oldlsn;
+	int result;
+
+	while (1) {
+		spinlock_acquire(&ck->ck_lock);
+		bd = ck->ck_oldest;
+		if (bd == NULL || bd->sbd_oldlsn >= targetlsn) {
+			spinlock_release(&ck->ck_lock);
+			return;
+		}
+		block = bd->sbd_block;
+		oldlsn = bd->sbd_oldlsn;
+		spinlock_release(&ck->ck_lock);
+
+		result = buffer_flush(&sfs->sfs_absfs, block, SFS_BLOCKSIZE);
+		if (result) {
+			kprintf("sfs: %s: checkpoint: block %u: %s\n",
+				sfs->sfs_sb.sb_volname, (unsigned)block,
+				strerror(result));
+		}
+
+		spinlock_acquire(&ck->ck_lock);
+		bd = ck->ck_oldest;
+		if (bd != NULL && bd->sbd_block == block &&
+		    bd->sbd_oldlsn == oldlsn) {
+			/* no progress */
+			spinlock_release(&ck->ck_lock);
+			return;
+		}
+		spinlock_release(&ck->ck_lock);
+	}
+}
+
+/*
+ * One round of the checkpointer.
+ */
+static
+void
+sfs_ckpt_round(struct sfs_fs *sfs)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	sfs_lsn_t targetlsn;
+
+	/* The odometer counts journal blocks used since the last round. */
+	if (sfs_jphys_getodometer(sfs->sfs_jphys) <
+	    sfs->sfs_sb.sb_journalblocks / SFS_CKPT_FRACTION) {
+		return;
+	}
+	sfs_jphys_clearodometer(sfs->sfs_jphys);
+
+	targetlsn = ck->ck_roundlsn;
+	ck->ck_roundlsn = sfs_jphys_peeknextlsn(sfs);
+
+	reserve_buffers(SFS_BLOCKSIZE);
+	sfs_ckpt_writeback(sfs, targetlsn);
+	sfs_checkpoint(sfs);
+	unreserve_buffers(SFS_BLOCKSIZE);
+}
+
+/*
+ * Checkpointer thread.
+ */
+static
+void
+sfs_ckpt_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	bool stop;
+	int result;
+
+	(void)data2;
+
+	/* So the journal doesn't fill up under cpu load. */
+	thread_setclass(SCHED_HIGH);
+
+	while (1) {
+		clocksleep(SFS_CKPT_INTERVAL);
+
+		spinlock_acquire(&ck->ck_lock);
+		stop = ck->ck_stop;
+		spinlock_release(&ck->ck_lock);
+		if (stop) {
+			break;
+		}
+
+		/* Flush delayed allocations (see sfs_dalloc.c) */
+		result = sfs_dalloc_flushall(sfs, false);
+		if (result) {
+			kprintf("sfs: %s: delayed allocation: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+
+		/* Commit (see sfs_jmode.c) */
+		result = sfs_jmode_commit(sfs);
+		if (result) {
+			kprintf("sfs: %s: commit: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+
+		sfs_ckpt_round(sfs);
+	}
+	V(ck->ck_done);
+}
+
+////////////////////////////////////////////////////////////
+// setup and shutdown
+
+/*
+ * Create the checkpointer state.
+ */
+struct sfs_ckpt *
+sfs_ckpt_create(void)
+{
+	struct sfs_ckpt *ck;
+
+	ck = kmalloc(sizeof(*ck));
+	if (ck == NULL) {
+		return NULL;
+	}
+	ck->ck_done = sem_create("sfs_ckpt", 0);
+	if (ck->ck_done == NULL) {
+		kfree(ck);
+		return NULL;
+	}
+	spinlock_init(&ck->ck_lock);
+	ck->ck_oldest = ck->ck_newest = NULL;
+	ck->ck_npinned = 0;
+	ck->ck_lasttrim = 0;
+	ck->ck_stop = false;
+	ck->ck_running = false;
+	ck->ck_roundlsn = 0;
+	return ck;
+}
+
+/*
+ * Destroy the checkpointer state. By now every buffer has been
+ * detached, so nothing can be pinned.
+ */
+void
+sfs_ckpt_destroy(struct sfs_ckpt *ck)
+{
+	KASSERT(!ck->ck_running);
+	KASSERT(ck->ck_npinned == 0);
+	sem_destroy(ck->ck_done);
+	spinlock_cleanup(&ck->ck_lock);
+	kfree(ck);
+}
+
+/*
+ * Start the checkpointer once the journal is live. If we can't, the
+ * volume still works, but the journal only gets trimmed by explicit
+ * calls to sfs_checkpoint.
+ */
+void
+sfs_ckpt_start(struct sfs_fs *sfs)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+	int result;
+
+	KASSERT(!ck->ck_running);
+
+	ck->ck_lasttrim = sfs_jphys_peeknextlsn(sfs) - 1;
+	ck->ck_roundlsn = ck->ck_lasttrim;
+	sfs_jphys_clearodometer(sfs->sfs_jphys);
+
+	result = thread_fork("sfs_ckpt", NULL, sfs_ckpt_thread, sfs, 0);
+	if (result) {
+		kprintf("sfs: %s: cannot start checkpointer: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+		return;
+	}
+	ck->ck_running = true;
+}
+
+/*
+ * Stop the checkpointer, for unmount. Waits for the thread to exit.
+ */
+void
+sfs_ckpt_stop(struct sfs_fs *sfs)
+{
+	struct sfs_ckpt *ck = sfs->sfs_ckpt;
+
+	if (!ck->ck_running) {
+		return;
+	}
+	spinlock_acquire(&ck->ck_lock);
+	ck->ck_stop = true;
+	spinlock_release(&ck->ck_lock);
+	P(ck->ck_done);
+	ck->ck_running = false;
+}
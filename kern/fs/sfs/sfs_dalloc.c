@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS delayed allocation.
+ *
+ * Writing to a block of a regular file that has no disk block yet
+ * doesn't allocate one right away. Instead the data goes into a
+ * buffer held by the vnode (in sv_dalloc), tagged with its block
+ * number in the file, and the disk block is chosen when the vnode's
+ * pending blocks are flushed: when it has SFS_DALLOC_PERFILE of them,
+ * when the volume runs out of pending buffers, before the file is
+ * read, at sync or fsync time, from the checkpointer once a second,
+ * and when the vnode is reclaimed. The flush allocates each run of
+ * consecutive file blocks together, so they land together on disk.
+ * Blocks truncated away before they're flushed are never allocated
+ * at all.
+ *
+ * The pending buffers are fsmanaged (so the syncer leaves them alone)
+ * and are never written; they're copied into the real block's buffer
+ * at flush time and then invalidated. Each is keyed by a slot number
+ * past the end of everything on the volume, which the buffer cache
+ * won't otherwise see; there are SFS_DALLOC_MAX slots per volume,
+ * and that many fsmanaged buffers are reserved at mount time.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <array.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Per-volume state: which slots are in use.
+ */
+struct sfs_dalloc {
+	struct spinlock sd_lock;	/* lock for sd_slots */
+	uint32_t sd_slots;		/* one bit per slot in use */
+};
+
+/*
+ * Block number for slot SLOT: past the volume and, if the journal is
+ * on a separate device, past the journal too.
+ */
+static
+daddr_t
+sfs_dalloc_slotblock(struct sfs_fs *sfs, unsigned slot)
+{
+	const struct sfs_superblock *sb = &sfs->sfs_sb;
+
+	if (sb->sb_flags & SFS_SBF_EXTJOURNAL) {
+		return sb->sb_journalstart + sb->sb_journalblocks + slot;
+	}
+	return sb->sb_nblocks + slot;
+}
+
+/*
+ * Get a free slot. Returns false if they're all taken.
+ */
+static
+bool
+sfs_dalloc_getslot(struct sfs_dalloc *sd, unsigned *ret)
+{
+	unsigned i;
+
+	spinlock_acquire(&sd->sd_lock);
+	for (i=0; i<SFS_DALLOC_MAX; i++) {
+		if ((sd->sd_slots & ((uint32_t)1 << i)) == 0) {
+			sd->sd_slots |= (uint32_t)1 << i;
+			spinlock_release(&sd->sd_lock);
+			*ret = i;
+			return true;
+		}
+	}
+	spinlock_release(&sd->sd_lock);
+	return false;
+}
+
+/*
+ * Give back a slot.
+ */
+static
+void
+sfs_dalloc_putslot(struct sfs_dalloc *sd, unsigned slot)
+{
+	spinlock_acquire(&sd->sd_lock);
+	KASSERT(sd->sd_slots & ((uint32_t)1 << slot));
+	sd->sd_slots &= ~((uint32_t)1 << slot);
+	spinlock_release(&sd->sd_lock);
+}
+
+/*
+ * Find pending block FILEBLOCK of SV. Returns sv_danum if it isn't
+ * there.
+ */
+static
+unsigned
+sfs_dalloc_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	unsigned i;
+
+	for (i=0; i<sv->sv_danum; i++) {
+		if (sv->sv_dalloc[i].da_fileblock == fileblock) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Throw away pending entry IX of SV, preserving the order of the
+ * rest.
+ */
+static
+void
+sfs_dalloc_drop(struct sfs_vnode *sv, unsigned ix)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned i;
+
+	KASSERT(ix < sv->sv_danum);
+
+	buffer_release_and_invalidate(sv->sv_dalloc[ix].da_buf);
+	sfs_dalloc_putslot(sfs->sfs_dalloc, sv->sv_dalloc[ix].da_slot);
+	for (i=ix+1; i<sv->sv_danum; i++) {
+		sv->sv_dalloc[i-1] = sv->sv_dalloc[i];
+	}
+	sv->sv_danum--;
+}
+
+/*
+ * Start a new pending block FILEBLOCK of SV, zeroed. Returns EAGAIN
+ * if there's no slot for it.
+ */
+static
+int
+sfs_dalloc_new(struct sfs_vnode *sv, uint32_t fileblock, struct buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dabuf *da;
+	struct buf *buf;
+	unsigned slot;
+	int result;
+
+	KASSERT(sv->sv_danum < SFS_DALLOC_PERFILE);
+
+	if (!sfs_dalloc_getslot(sfs->sfs_dalloc, &slot)) {
+		return EAGAIN;
+	}
+	result = buffer_get_fsmanaged(&sfs->sfs_absfs,
+				      sfs_dalloc_slotblock(sfs, slot),
+				      SFS_BLOCKSIZE, &buf);
+	if (result) {
+		sfs_dalloc_putslot(sfs->sfs_dalloc, slot);
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_valid(buf);
+	buffer_set_kind(buf, BUFKIND_DATA);
+
+	da = &sv->sv_dalloc[sv->sv_danum++];
+	da->da_fileblock = fileblock;
+	da->da_slot = slot;
+	da->da_buf = buf;
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Give pending block DA of SV a disk block and move its contents
+ * there. Sets COPIED once the contents have been moved, after which
+ * the pending buffer isn't needed even if there's an error.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_dalloc_place(struct sfs_vnode *sv, struct sfs_dabuf *da, bool *copied)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t diskblock;
+	int result;
+
+	*copied = false;
+	result = sfs_bmap_fill(sv, da->da_fileblock, &diskblock, &buf);
+	if (result) {
+		return result;
+	}
+	if (buf == NULL) {
+		result = buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
+				    &buf);
+		if (result) {
+			return result;
+		}
+	}
+	buffer_set_kind(buf, BUFKIND_DATA);
+	memcpy(buffer_map(buf), buffer_map(da->da_buf), SFS_BLOCKSIZE);
+	buffer_mark_valid(buf);
+	buffer_mark_dirty(buf);
+	*copied = true;
+	return sfs_data_release(sv, buf, diskblock, 0, SFS_BLOCKSIZE);
+}
+
+/*
+ * Allocate disk blocks for all of SV's pending blocks, then write
+ * back the file size if it's only in the vnode (see sfs_size_extend)
+ * so the blocks and the size reach the inode together.
+ *
+ * Locking: must hold vnode lock. Gets/releases freemap locks.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dalloc_flush(struct sfs_vnode *sv)
+{
+	struct sfs_dabuf tmp;
+	unsigned i, j;
+	bool copied;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Sort by file block, so runs show up as runs */
+	for (i=1; i<sv->sv_danum; i++) {
+		tmp = sv->sv_dalloc[i];
+		for (j=i; j>0 &&
+			     sv->sv_dalloc[j-1].da_fileblock > tmp.da_fileblock;
+		     j--) {
+			sv->sv_dalloc[j] = sv->sv_dalloc[j-1];
+		}
+		sv->sv_dalloc[j] = tmp;
+	}
+
+	result = 0;
+	while (sv->sv_danum > 0) {
+		/* Ask the allocator for room for the whole run */
+		for (j=1; j<sv->sv_danum; j++) {
+			if (sv->sv_dalloc[j].da_fileblock !=
+			    sv->sv_dalloc[0].da_fileblock + j) {
+				break;
+			}
+		}
+		sv->sv_wantblocks = j;
+
+		result = sfs_dalloc_place(sv, &sv->sv_dalloc[0], &copied);
+		if (copied) {
+			sfs_dalloc_drop(sv, 0);
+		}
+		if (result) {
+			/* leave the rest pending */
+			break;
+		}
+	}
+	sv->sv_wantblocks = 0;
+	if (result == 0) {
+		result = sfs_size_sync(sv);
+	}
+	return result;
+}
+
+/*
+ * Look up FILEBLOCK of SV for writing. If it has a disk block, hand
+ * that back in DISKBLOCK and set DABUF to NULL. Otherwise hand back
+ * the pending buffer for it in DABUF (creating it if necessary) and
+ * set DISKBLOCK to 0; the caller writes into it and does not release
+ * it. If it can't be made pending, allocate it after all.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dalloc_bmap(struct sfs_vnode *sv, uint32_t fileblock,
+		daddr_t *diskblock, struct buf **dabuf)
+{
+	unsigned ix;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_type == SFS_TYPE_FILE);
+
+	*dabuf = NULL;
+
+	result = sfs_bmap(sv, fileblock, false, diskblock);
+	if (result || *diskblock != 0) {
+		return result;
+	}
+
+	ix = sfs_dalloc_find(sv, fileblock);
+	if (ix < sv->sv_danum) {
+		*dabuf = sv->sv_dalloc[ix].da_buf;
+		return 0;
+	}
+
+	if (sv->sv_danum == SFS_DALLOC_PERFILE) {
+		result = sfs_dalloc_flush(sv);
+		if (result) {
+			return result;
+		}
+	}
+	result = sfs_dalloc_new(sv, fileblock, dabuf);
+	if (result == EAGAIN && sv->sv_danum > 0) {
+		/* Other files have the rest of the slots; free ours */
+		result = sfs_dalloc_flush(sv);
+		if (result) {
+			return result;
+		}
+		result = sfs_dalloc_new(sv, fileblock, dabuf);
+	}
+	if (result == EAGAIN) {
+		return sfs_bmap(sv, fileblock, true, diskblock);
+	}
+	return result;
+}
+
+/*
+ * Throw away SV's pending blocks from FILEBLOCK on, for truncate.
+ *
+ * Locking: must hold vnode lock.
+ */
+void
+sfs_dalloc_discard(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	i = 0;
+	while (i < sv->sv_danum) {
+		if (sv->sv_dalloc[i].da_fileblock >= fileblock) {
+			sfs_dalloc_drop(sv, i);
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+/*
+ * Flush the pending blocks of every file on the volume. If WAIT is
+ * false (for the checkpointer), skip files that are locked, and the
+ * whole thing if the vnode table is; they'll keep for next time.
+ *
+ * Locking: gets/releases sfs_vnlock and vnode locks, but not at the
+ * same time.
+ */
+int
+sfs_dalloc_flushall(struct sfs_fs *sfs, bool wait)
+{
+	struct vnodearray *pending;
+	struct vnode *v;
+	struct sfs_vnode *sv;
+	unsigned i, num;
+	int result, ret;
+
+	pending = NULL;
+	ret = 0;
+
+	/*
+	 * Collect (and hold references to) the vnodes with anything
+	 * pending, or a size not yet in the inode. We can't look at
+	 * sv_danum properly without the vnode lock, which comes before
+	 * sfs_vnlock, so this is only a hint; but anything written
+	 * before we got here is in it.
+	 */
+	if (wait) {
+		lock_acquire(sfs->sfs_vnlock);
+	}
+	else if (!lock_tryacquire(sfs->sfs_vnlock)) {
+		return 0;
+	}
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num; i++) {
+		v = vnodearray_get(sfs->sfs_vnodes, i);
+		sv = v->vn_data;
+		if (sv->sv_danum == 0 && !sv->sv_sizedirty) {
+			continue;
+		}
+		if (pending == NULL) {
+			pending = vnodearray_create();
+			if (pending == NULL) {
+				ret = ENOMEM;
+				break;
+			}
+		}
+		result = vnodearray_add(pending, v, NULL);
+		if (result) {
+			ret = result;
+			break;
+		}
+		VOP_INCREF(v);
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	if (pending == NULL) {
+		return ret;
+	}
+
+	reserve_buffers(SFS_BLOCKSIZE);
+	num = vnodearray_num(pending);
+	for (i=0; i<num; i++) {
+		v = vnodearray_get(pending, i);
+		sv = v->vn_data;
+		if (wait) {
+			lock_acquire(sv->sv_lock);
+		}
+		else if (!lock_tryacquire(sv->sv_lock)) {
+			VOP_DECREF(v);
+			continue;
+		}
+		result = sfs_dalloc_flush(sv);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
+	}
+	unreserve_buffers(SFS_BLOCKSIZE);
+
+	vnodearray_setsize(pending, 0);
+	vnodearray_destroy(pending);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// setup and shutdown
+
+/*
+ * Create the per-volume state.
+ */
+struct sfs_dalloc *
+sfs_dalloc_create(void)
+{
+	struct sfs_dalloc *sd;
+
+	COMPILE_ASSERT(SFS_DALLOC_MAX <= 32);
+
+	sd = kmalloc(sizeof(*sd));
+	if (sd == NULL) {
+		return NULL;
+	}
+	spinlock_init(&sd->sd_lock);
+	sd->sd_slots = 0;
+	return sd;
+}
+
+/*
+ * Destroy it. Everything must have been flushed.
+ */
+void
+sfs_dalloc_destroy(struct sfs_dalloc *sd)
+{
+	KASSERT(sd->sd_slots == 0);
+	spinlock_cleanup(&sd->sd_lock);
+	kfree(sd);
+}
@@ -37,14 +37,19 @@
 #include <lib.h>
 #include <synch.h>
 #include <buf.h>
+#include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Number of directory entries in one block */
+#define SFS_DIRENTRIESPERBLOCK \
+	((int)(SFS_BLOCKSIZE / sizeof(struct sfs_direntry)))
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
  *
- * Locking: Must hold the vnode lock. May get/release sfs_freemaplock.
+ * Locking: Must hold the vnode lock. May get/release freemap locks.
  *
  * Requires up to 3 buffers.
  */
@@ -115,12 +120,37 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
 	return 0;
 }
 
+/*
+ * Start fetching block FILEBLOCK of a directory, which a scan is
+ * about to reach. Only a hint, so errors are ignored.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+void
+sfs_dir_prefetch(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock;
+	int result;
+
+	result = sfs_bmap(sv, fileblock, false, &diskblock);
+	if (result == 0 && diskblock != 0) {
+		buffer_prefetch(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE);
+	}
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Uses the directory's hash index if it has one; otherwise scans all
+ * the entries.
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
  *
  * Requires up to 3 buffers.
  */
@@ -129,10 +159,15 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	int found, nentries, lowfree, nfree, i, result;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	result = sfs_dirindex_lookup(sv, name, ino, slot, emptyslot);
+	if (result != ENOSYS) {
+		return result;
+	}
+
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
 		return result;
@@ -140,8 +175,16 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 
 	/* For each slot... */
 	found = 0;
+	lowfree = nentries;
+	nfree = 0;
 	for (i=0; i<nentries; i++) {
 
+		/* Entering a new block: get the next one coming */
+		if (i % SFS_DIRENTRIESPERBLOCK == 0 &&
+		    i + SFS_DIRENTRIESPERBLOCK < nentries) {
+			sfs_dir_prefetch(sv, i / SFS_DIRENTRIESPERBLOCK + 1);
+		}
+
 		/* Read the entry from that slot */
 		result = sfs_readdir(sv, i, &tsd);
 		if (result) {
@@ -152,6 +195,9 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 			if (emptyslot != NULL) {
 				*emptyslot = i;
 			}
+			if (nfree++ == 0) {
+				lowfree = i;
+			}
 		}
 		else {
 			/* Ensure null termination, just in case */
@@ -172,9 +218,73 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
+	/* Having seen every slot, remember where the free ones are */
+	sv->sv_dirfree = lowfree;
+	sv->sv_dirnfree = nfree;
+
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Find an empty slot in a directory, or if there are none, hand back
+ * the slot just past the end. The vnode remembers how many empty
+ * slots there are and a point below which there are none, so this
+ * only scans the whole directory the first time; after that it scans
+ * from the hint, and not at all if there are no empty slots.
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_dir_findfree(struct sfs_vnode *sv, int *ret)
+{
+	struct sfs_direntry tsd;
+	int nentries, lowfree, nfree, i, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dir_nentries(sv, &nentries);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_dirnfree == 0) {
+		*ret = nentries;
+		return 0;
+	}
+
+	lowfree = nentries;
+	nfree = 0;
+	for (i = sv->sv_dirnfree < 0 ? 0 : sv->sv_dirfree; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino != SFS_NOINO) {
+			continue;
+		}
+		if (nfree++ == 0) {
+			lowfree = i;
+		}
+		if (sv->sv_dirnfree > 0) {
+			/* Already know the count; the first one will do */
+			break;
+		}
+	}
+
+	if (sv->sv_dirnfree < 0) {
+		sv->sv_dirnfree = nfree;
+	}
+	/* Counted ones mean there's a free slot; the scan must find it */
+	KASSERT(sv->sv_dirnfree == 0 || lowfree < nentries);
+	sv->sv_dirfree = lowfree;
+
+	*ret = lowfree;
+	return 0;
+}
+
 /*
  * Search a directory for a particular inode number in a directory, and
  * return the directory entry and/or its slot.
@@ -223,11 +333,68 @@ sfs_dir_findino(struct sfs_vnode *sv, uint32_t ino,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Write a link to inode INO with name NAME into slot SLOT of a
+ * directory, which should be empty (or past the end), and update the
+ * directory's index and the name cache. The name must not already
+ * exist.
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dir_linkslot(struct sfs_vnode *sv, int slot, const char *name,
+		 uint32_t ino)
+{
+	struct sfs_direntry sd;
+	int nentries, result;
+	bool filling;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	/* Forget any cached negative entry for the name. */
+	vfs_cache_remove(&sv->sv_absvn, name);
+
+	/* Filling an empty slot, as opposed to appending? */
+	result = sfs_dir_nentries(sv, &nentries);
+	if (result) {
+		return result;
+	}
+	filling = slot < nentries;
+	KASSERT(!filling || sv->sv_dirnfree != 0);
+	KASSERT(!filling || sv->sv_dirnfree < 0 || slot >= sv->sv_dirfree);
+
+	/* Set up the entry. */
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = ino;
+	strcpy(sd.sfd_name, name);
+
+	/* Write the entry. */
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	if (filling && sv->sv_dirnfree > 0) {
+		sv->sv_dirnfree--;
+		if (slot == sv->sv_dirfree) {
+			sv->sv_dirfree++;
+		}
+	}
+
+	return sfs_dirindex_add(sv, name, slot);
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: must hold vnode lock. May get/release freemap locks.
  *
  * Requires up to 3 buffers.
  */
@@ -253,32 +420,29 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/*
+	 * If we didn't get an empty slot (the index only keeps a few),
+	 * find one, or add the entry at the end.
+	 */
 	if (emptyslot < 0) {
-		result = sfs_dir_nentries(sv, &emptyslot);
+		result = sfs_dir_findfree(sv, &emptyslot);
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Set up the entry. */
-	bzero(&sd, sizeof(sd));
-	sd.sfd_ino = ino;
-	strcpy(sd.sfd_name, name);
-
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	return sfs_dir_linkslot(sv, emptyslot, name, ino);
 }
 
 /*
  * Unlink a name in a directory, by slot number.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: must hold vnode lock. May get/release freemap locks.
  *
  * Requires up to 3 buffers.
  */
@@ -286,15 +450,38 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	char name[SFS_NAMELEN];
+	int result;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	/* Get the name, to take it out of the index and the name cache */
+	result = sfs_readdir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+	sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+	strcpy(name, sd.sfd_name);
+	vfs_cache_remove(&sv->sv_absvn, name);
+
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_dirnfree >= 0) {
+		sv->sv_dirnfree++;
+	}
+	if (slot < sv->sv_dirfree) {
+		sv->sv_dirfree = slot;
+	}
+
+	return sfs_dirindex_remove(sv, name, slot);
 }
 
 /*
@@ -304,7 +491,7 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
  *
  * Returns the vnode with its inode unloaded.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: must hold vnode lock. May get/release freemap locks.
  *    Also gets/releases sfs_vnlock.
  *    Returns the result vnode locked.
  *
@@ -352,7 +539,7 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
  * Look for a name in a directory and hand back a vnode for the
  * file, if there is one.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: must hold vnode lock. May get/release freemap locks.
  *    Also gets/releases sfs_vnlock.
  *
  * Requires up to 3 buffers.
@@ -373,7 +560,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 		*ret = NULL;
 		if (slot != NULL) {
 			if (emptyslot < 0) {
-				result2 = sfs_dir_nentries(sv, &emptyslot);
+				result2 = sfs_dir_findfree(sv, &emptyslot);
 				if (result2) {
 					return result2;
 				}
@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Hashed directory index.
+ *
+ * On volumes with SFS_SBF_DIRINDEX, a directory gets an index (see
+ * kern/sfs.h for the layout) once it grows to SFS_DIRINDEX_MINSLOTS
+ * slots, and from then on name lookups read the index root, one
+ * bucket chain (usually one block), and the entries whose hashes
+ * match, instead of every entry in the directory. Directories without
+ * an index, including all directories on older volumes, are still
+ * scanned linearly by sfs_dir.c.
+ *
+ * sfs_dir_link and sfs_dir_unlink keep the index up to date, and all
+ * changes to index blocks are logged as SFS_JREC_DIRINDEX records.
+ * Because the index is redundant, if anything goes wrong updating it
+ * we throw it away rather than fail the directory operation; it gets
+ * rebuilt on the next link.
+ *
+ * All functions here must be called with the directory's vnode lock
+ * held, and none of them hold more than 2 buffers at a time besides
+ * the inode, plus what sfs_readdir needs.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Directories get an index once they have this many slots. */
+#define SFS_DIRINDEX_MINSLOTS	64
+
+/* Matching slots collected from a bucket block before checking them. */
+#define SFS_DIRINDEX_CANDS	8
+
+/*
+ * Hash a name (32-bit FNV-1a).
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *name != 0; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Get the block number of SV's index root, or 0 if it has no index.
+ */
+static
+int
+sfs_dirindex_getroot(struct sfs_vnode *sv, daddr_t *ret)
+{
+	int result;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	*ret = sfs_dinode_map(sv)->sfi_dirindex;
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+/*
+ * Log a change of LEN bytes at PTR in the busy index buffer BUF (for
+ * disk block BLOCK), and mark it dirty.
+ */
+static
+int
+sfs_dirindex_log(struct sfs_fs *sfs, struct buf *buf, daddr_t block,
+		 const void *ptr, size_t len)
+{
+	unsigned offset;
+	sfs_lsn_t lsn;
+
+	offset = (const char *)ptr - (const char *)buffer_map(buf);
+	KASSERT(offset + len <= SFS_BLOCKSIZE);
+
+	buffer_mark_dirty(buf);
+	lsn = sfs_jrec_dirindex(sfs, block, ptr, offset, len);
+	return sfs_ckpt_notelsn(sfs, buf, block, lsn);
+}
+
+/*
+ * Note that fsync on SV has to flush the index changes just logged.
+ * They are the newest records, so that's everything up to the next
+ * LSN to be issued.
+ */
+static
+void
+sfs_dirindex_notesync(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	sfs_lsn_t lsn;
+
+	lsn = sfs_jphys_peeknextlsn(sfs);
+	if (lsn > 0) {
+		sfs_synclsn_note(sv, lsn - 1);
+	}
+}
+
+/*
+ * Read a bucket block, and check it isn't garbage.
+ */
+static
+int
+sfs_dirindex_readbucket(struct sfs_fs *sfs, daddr_t block,
+			struct buf **ret)
+{
+	struct sfs_dirbucket *sdb;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, ret);
+	if (result) {
+		return result;
+	}
+	sdb = buffer_map(*ret);
+	if (sdb->sdb_num > SFS_DIRBUCKET_NENTRIES) {
+		panic("sfs: %s: directory index block %u: invalid count %u\n",
+		      sfs->sfs_sb.sb_volname, block, sdb->sdb_num);
+	}
+	return 0;
+}
+
+/*
+ * Take SLOT off the free slot stack in index ROOT, if it's there.
+ */
+static
+int
+sfs_dirindex_takefree(struct sfs_fs *sfs, daddr_t root, int slot)
+{
+	struct buf *buf;
+	struct sfs_dirindex *sdi;
+	unsigned i;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, root, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	sdi = buffer_map(buf);
+	for (i=0; i<sdi->sdi_nfree; i++) {
+		if (sdi->sdi_free[i] == (uint32_t)slot) {
+			sdi->sdi_nfree--;
+			sdi->sdi_free[i] = sdi->sdi_free[sdi->sdi_nfree];
+			result = sfs_dirindex_log(sfs, buf, root,
+						  &sdi->sdi_free[i],
+						  sizeof(sdi->sdi_free[i]));
+			if (result == 0) {
+				result = sfs_dirindex_log(sfs, buf, root,
+						  &sdi->sdi_nfree,
+						  sizeof(sdi->sdi_nfree));
+			}
+			break;
+		}
+	}
+	buffer_release(buf);
+	return result;
+}
+
+/*
+ * Push SLOT onto the free slot stack in index ROOT. If the stack is
+ * full the slot is forgotten; new entries then go at the end of the
+ * directory until slots are freed again.
+ */
+static
+int
+sfs_dirindex_putfree(struct sfs_fs *sfs, daddr_t root, int slot)
+{
+	struct buf *buf;
+	struct sfs_dirindex *sdi;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, root, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	sdi = buffer_map(buf);
+	if (sdi->sdi_nfree < SFS_DIRINDEX_NFREE) {
+		sdi->sdi_free[sdi->sdi_nfree] = slot;
+		result = sfs_dirindex_log(sfs, buf, root,
+					  &sdi->sdi_free[sdi->sdi_nfree],
+					  sizeof(sdi->sdi_free[0]));
+		sdi->sdi_nfree++;
+		if (result == 0) {
+			result = sfs_dirindex_log(sfs, buf, root,
+						  &sdi->sdi_nfree,
+						  sizeof(sdi->sdi_nfree));
+		}
+	}
+	buffer_release(buf);
+	return result;
+}
+
+/*
+ * Add (HASH, SLOT) to index ROOT. It goes in the first block of its
+ * bucket's chain with room; if there isn't one, a new block goes on
+ * the front of the chain.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_fs *sfs, daddr_t root, uint32_t hash,
+		    int slot)
+{
+	struct buf *rootbuf, *buf;
+	struct sfs_dirindex *sdi;
+	struct sfs_dirbucket *sdb;
+	struct sfs_dirhash *sdh;
+	daddr_t block, next;
+	uint32_t *head;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, root, SFS_BLOCKSIZE, &rootbuf);
+	if (result) {
+		return result;
+	}
+	sdi = buffer_map(rootbuf);
+	head = &sdi->sdi_buckets[hash % SFS_DIRINDEX_NBUCKETS];
+
+	for (block = *head; block != 0; block = next) {
+		result = sfs_dirindex_readbucket(sfs, block, &buf);
+		if (result) {
+			buffer_release(rootbuf);
+			return result;
+		}
+		sdb = buffer_map(buf);
+		if (sdb->sdb_num < SFS_DIRBUCKET_NENTRIES) {
+			sdh = &sdb->sdb_entries[sdb->sdb_num++];
+			sdh->sdh_hash = hash;
+			sdh->sdh_slot = slot;
+			result = sfs_dirindex_log(sfs, buf, block, sdb,
+					(char *)(sdh + 1) - (char *)sdb);
+			buffer_release(buf);
+			buffer_release(rootbuf);
+			return result;
+		}
+		next = sdb->sdb_next;
+		buffer_release(buf);
+	}
+
+	/* No room anywhere in the chain; start a new block. */
+	result = sfs_balloc_goal(sfs, root, &block, &buf);
+	if (result) {
+		buffer_release(rootbuf);
+		return result;
+	}
+	sdb = buffer_map(buf);
+	sdb->sdb_next = *head;
+	sdb->sdb_num = 1;
+	sdb->sdb_entries[0].sdh_hash = hash;
+	sdb->sdb_entries[0].sdh_slot = slot;
+	result = sfs_dirindex_log(sfs, buf, block, sdb,
+				  (char *)&sdb->sdb_entries[1] - (char *)sdb);
+	buffer_release(buf);
+	if (result) {
+		/* Not linked in, so just give it back */
+		sfs_bfree(sfs, block);
+		buffer_release(rootbuf);
+		return result;
+	}
+
+	*head = block;
+	result = sfs_dirindex_log(sfs, rootbuf, root, head, sizeof(*head));
+	buffer_release(rootbuf);
+	return result;
+}
+
+/*
+ * Remove (HASH, SLOT) from index ROOT; the last pair in its block
+ * takes its place. Empty blocks stay on the chain. Returns ENOENT if
+ * it isn't there.
+ */
+static
+int
+sfs_dirindex_delete(struct sfs_fs *sfs, daddr_t root, uint32_t hash,
+		    int slot)
+{
+	struct buf *buf;
+	struct sfs_dirindex *sdi;
+	struct sfs_dirbucket *sdb;
+	struct sfs_dirhash *sdh;
+	daddr_t block;
+	unsigned i;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, root, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	sdi = buffer_map(buf);
+	block = sdi->sdi_buckets[hash % SFS_DIRINDEX_NBUCKETS];
+	buffer_release(buf);
+
+	while (block != 0) {
+		result = sfs_dirindex_readbucket(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		sdb = buffer_map(buf);
+		for (i=0; i<sdb->sdb_num; i++) {
+			sdh = &sdb->sdb_entries[i];
+			if (sdh->sdh_hash != hash ||
+			    sdh->sdh_slot != (uint32_t)slot) {
+				continue;
+			}
+			sdb->sdb_num--;
+			*sdh = sdb->sdb_entries[sdb->sdb_num];
+			result = sfs_dirindex_log(sfs, buf, block, sdh,
+						  sizeof(*sdh));
+			if (result == 0) {
+				result = sfs_dirindex_log(sfs, buf, block,
+						&sdb->sdb_num,
+						sizeof(sdb->sdb_num));
+			}
+			buffer_release(buf);
+			return result;
+		}
+		block = sdb->sdb_next;
+		buffer_release(buf);
+	}
+	return ENOENT;
+}
+
+/*
+ * Free an index's blocks. Errors just leak blocks (marked in use but
+ * not used, which sfsck fixes), as the index is already detached.
+ */
+static
+void
+sfs_dirindex_freeblocks(struct sfs_fs *sfs, daddr_t root)
+{
+	struct buf *rootbuf, *buf;
+	struct sfs_dirindex *sdi;
+	daddr_t block, next;
+	unsigned i;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, root, SFS_BLOCKSIZE, &rootbuf);
+	if (result) {
+		return;
+	}
+	sdi = buffer_map(rootbuf);
+	for (i=0; i<SFS_DIRINDEX_NBUCKETS; i++) {
+		for (block = sdi->sdi_buckets[i]; block != 0; block = next) {
+			result = sfs_dirindex_readbucket(sfs, block, &buf);
+			if (result) {
+				break;
+			}
+			next = ((struct sfs_dirbucket *)buffer_map(buf))
+				->sdb_next;
+			buffer_release_and_invalidate(buf);
+			sfs_bfree(sfs, block);
+		}
+	}
+	buffer_release_and_invalidate(rootbuf);
+	sfs_bfree(sfs, root);
+}
+
+/*
+ * Throw away SV's index, if it has one.
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dirindex_discard(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	daddr_t root;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	root = inodeptr->sfi_dirindex;
+	if (root != 0) {
+		inodeptr->sfi_dirindex = 0;
+		sfs_dinode_mark_dirty(sv);
+	}
+	sfs_dinode_unload(sv);
+
+	if (root != 0) {
+		sfs_dirindex_freeblocks(sfs, root);
+	}
+	return 0;
+}
+
+/*
+ * Build an index for SV from its entries.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry sd;
+	struct buf *buf;
+	daddr_t root;
+	int nentries, i, result;
+
+	result = sfs_dir_nentries(sv, &nentries);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+
+	/* The new root is all zeros: no buckets, no free slots */
+	result = sfs_balloc_goal(sfs, sv->sv_ino, &root, &buf);
+	if (result) {
+		sfs_dinode_unload(sv);
+		return result;
+	}
+	result = sfs_dirindex_log(sfs, buf, root, buffer_map(buf),
+				  sizeof(struct sfs_dirindex));
+	buffer_release(buf);
+	if (result) {
+		sfs_bfree(sfs, root);
+		sfs_dinode_unload(sv);
+		return result;
+	}
+	sfs_dinode_map(sv)->sfi_dirindex = root;
+	sfs_dinode_mark_dirty(sv);
+	sfs_dinode_unload(sv);
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &sd);
+		if (result) {
+			break;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			result = sfs_dirindex_putfree(sfs, root, i);
+		}
+		else {
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			result = sfs_dirindex_insert(sfs, root,
+						     sfs_dirhash(sd.sfd_name),
+						     i);
+		}
+		if (result) {
+			break;
+		}
+	}
+	if (result) {
+		return sfs_dirindex_discard(sv);
+	}
+	return 0;
+}
+
+/*
+ * Look NAME up in SV's index. Returns ENOSYS if SV has no index, in
+ * which case the caller should scan the directory. Otherwise behaves
+ * like sfs_dir_findname, except that *EMPTYSLOT is only set if the
+ * index knows of a free slot.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dirindex_lookup(struct sfs_vnode *sv, const char *name, uint32_t *ino,
+		    int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry sd;
+	struct buf *buf;
+	struct sfs_dirindex *sdi;
+	struct sfs_dirbucket *sdb;
+	struct sfs_dirhash *sdh;
+	uint32_t cands[SFS_DIRINDEX_CANDS];
+	unsigned ncands, pos, num, i;
+	daddr_t root, block, next;
+	uint32_t hash;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dirindex_getroot(sv, &root);
+	if (result) {
+		return result;
+	}
+	if (root == 0) {
+		return ENOSYS;
+	}
+
+	hash = sfs_dirhash(name);
+	result = buffer_read(&sfs->sfs_absfs, root, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	sdi = buffer_map(buf);
+	block = sdi->sdi_buckets[hash % SFS_DIRINDEX_NBUCKETS];
+	if (emptyslot != NULL && sdi->sdi_nfree > 0) {
+		*emptyslot = sdi->sdi_free[sdi->sdi_nfree - 1];
+	}
+	buffer_release(buf);
+
+	/*
+	 * Walk the chain, collecting slots whose hashes match a few
+	 * at a time so as not to hold the bucket block while reading
+	 * the directory.
+	 */
+	pos = 0;
+	while (block != 0) {
+		result = sfs_dirindex_readbucket(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		sdb = buffer_map(buf);
+		ncands = 0;
+		for (; pos < sdb->sdb_num && ncands < SFS_DIRINDEX_CANDS;
+		     pos++) {
+			sdh = &sdb->sdb_entries[pos];
+			if (sdh->sdh_hash == hash) {
+				cands[ncands++] = sdh->sdh_slot;
+			}
+		}
+		num = sdb->sdb_num;
+		next = sdb->sdb_next;
+		buffer_release(buf);
+
+		for (i=0; i<ncands; i++) {
+			result = sfs_readdir(sv, cands[i], &sd);
+			if (result) {
+				return result;
+			}
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			if (sd.sfd_ino != SFS_NOINO &&
+			    !strcmp(sd.sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = cands[i];
+				}
+				if (ino != NULL) {
+					*ino = sd.sfd_ino;
+				}
+				return 0;
+			}
+		}
+
+		if (pos == num) {
+			block = next;
+			pos = 0;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Note in SV's index that NAME has been entered in slot SLOT. If SV
+ * has no index but should have one now, build it (which picks up the
+ * new entry from the directory).
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dirindex_add(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t root;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dirindex_getroot(sv, &root);
+	if (result) {
+		return result;
+	}
+	if (root == 0) {
+		if ((sfs->sfs_sb.sb_flags & SFS_SBF_DIRINDEX) == 0 ||
+		    slot + 1 < SFS_DIRINDEX_MINSLOTS) {
+			return 0;
+		}
+		result = sfs_dirindex_build(sv);
+		if (result) {
+			kprintf("sfs: %s: directory %u: building index: %s\n",
+				sfs->sfs_sb.sb_volname, sv->sv_ino,
+				strerror(result));
+		}
+		sfs_dirindex_notesync(sv);
+		return result;
+	}
+
+	result = sfs_dirindex_takefree(sfs, root, slot);
+	if (result == 0) {
+		result = sfs_dirindex_insert(sfs, root, sfs_dirhash(name),
+					     slot);
+	}
+	sfs_dirindex_notesync(sv);
+	if (result) {
+		return sfs_dirindex_discard(sv);
+	}
+	return 0;
+}
+
+/*
+ * Note in SV's index that NAME has been removed from slot SLOT.
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dirindex_remove(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t root;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dirindex_getroot(sv, &root);
+	if (result) {
+		return result;
+	}
+	if (root == 0) {
+		return 0;
+	}
+
+	result = sfs_dirindex_delete(sfs, root, sfs_dirhash(name), slot);
+	if (result == 0) {
+		result = sfs_dirindex_putfree(sfs, root, slot);
+	}
+	sfs_dirindex_notesync(sv);
+	if (result) {
+		/* including ENOENT: the index was wrong */
+		return sfs_dirindex_discard(sv);
+	}
+	return 0;
+}
@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Extent-based block mapping.
+ *
+ * An extent-mapped inode (SFS_DIF_EXTENTS; see kern/sfs.h) maps its
+ * blocks with a sorted list of (fileblock, diskblock, length) runs
+ * instead of the indirect block tree. The list is logically one
+ * array: entries 0 through SFS_NIEXTENTS-1 are in the inode, and the
+ * rest continue through a chain of extent blocks, SFS_EXTPERBLOCK
+ * to a block.
+ *
+ * Allocation tries to put a new block right after the previous one
+ * in the file, so that a file written sequentially grows its last
+ * extent rather than adding new ones. A large file then maps with
+ * one lookup per run instead of one indirect block per lookup.
+ *
+ * Extents looked up or grown go into the vnode's translation cache
+ * (see sfs_bmap.c) whole, so access anywhere within a run doesn't
+ * need to look at the inode again.
+ *
+ * fallocate (sfs_xprealloc) fills holes with unwritten extents (see
+ * kern/sfs.h), allocated a run at a time and not zeroed. They look
+ * like holes to lookups that don't allocate, so reads see zeros and
+ * they never go in the translation cache; writing a block splits it
+ * out of its unwritten extent (sfs_xconvert), clearing it then.
+ *
+ * The IOC_DEFRAG ioctl (sfs_xdefrag) moves a file that has ended up
+ * in pieces into one run of free blocks, so that reading it through
+ * is sequential again without reformatting.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+////////////////////////////////////////////////////////////
+// extent list access
+
+/*
+ * Get the buffer for extent block number K (counting from 0) of the
+ * inode DINO in vnode SV. If DOALLOC is set, the chain is extended
+ * as needed; otherwise K must exist.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_xblock(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t k,
+	   bool doalloc, struct buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf, *newbuf;
+	struct sfs_extblock *xb;
+	daddr_t block;
+	uint32_t i;
+	int result;
+
+	block = dino->sfi_extblock;
+	if (block == 0) {
+		KASSERT(doalloc);
+		result = sfs_balloc(sfs, &block, NULL);
+		if (result) {
+			return result;
+		}
+		dino->sfi_extblock = block;
+		sfs_dinode_mark_mapdirty(sv);
+	}
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<k; i++) {
+		xb = buffer_map(buf);
+		block = xb->sxb_next;
+		if (block == 0) {
+			KASSERT(doalloc);
+			result = sfs_balloc(sfs, &block, &newbuf);
+			if (result) {
+				buffer_release(buf);
+				return result;
+			}
+			xb->sxb_next = block;
+			sfs_buffer_dirty(sv, buf);
+			buffer_release(buf);
+			buf = newbuf;
+			continue;
+		}
+		buffer_release(buf);
+		result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+				     &buf);
+		if (result) {
+			return result;
+		}
+	}
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Read extent number IDX into X.
+ */
+static
+int
+sfs_xget(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t idx,
+	 struct sfs_extent *x)
+{
+	struct buf *buf;
+	struct sfs_extblock *xb;
+	int result;
+
+	KASSERT(idx < dino->sfi_nextents);
+
+	if (idx < SFS_NIEXTENTS) {
+		*x = dino->sfi_extents[idx];
+		return 0;
+	}
+	idx -= SFS_NIEXTENTS;
+	result = sfs_xblock(sv, dino, idx / SFS_EXTPERBLOCK, false, &buf);
+	if (result) {
+		return result;
+	}
+	xb = buffer_map(buf);
+	*x = xb->sxb_extents[idx % SFS_EXTPERBLOCK];
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Write X as extent number IDX, which can be one past the current
+ * last one (the caller updates sfi_nextents).
+ */
+static
+int
+sfs_xput(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t idx,
+	 const struct sfs_extent *x)
+{
+	struct buf *buf;
+	struct sfs_extblock *xb;
+	uint32_t off;
+	int result;
+
+	KASSERT(idx <= dino->sfi_nextents);
+
+	if (idx < SFS_NIEXTENTS) {
+		dino->sfi_extents[idx] = *x;
+		sfs_dinode_mark_mapdirty(sv);
+		return 0;
+	}
+	idx -= SFS_NIEXTENTS;
+	result = sfs_xblock(sv, dino, idx / SFS_EXTPERBLOCK, true, &buf);
+	if (result) {
+		return result;
+	}
+	xb = buffer_map(buf);
+	off = idx % SFS_EXTPERBLOCK;
+	xb->sxb_extents[off] = *x;
+	if (xb->sxb_num < off + 1) {
+		xb->sxb_num = off + 1;
+	}
+	sfs_buffer_dirty(sv, buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Cut the extent list down to NUM entries, freeing extent blocks
+ * that are no longer needed. The freemap must be locked.
+ */
+static
+int
+sfs_xsetcount(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t num)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf, *prevbuf;
+	struct sfs_extblock *xb;
+	daddr_t block, next;
+	uint32_t base, i;
+	int result;
+
+	KASSERT(sfs_freemap_locked(sfs));
+	KASSERT(num <= dino->sfi_nextents);
+
+	/* keep the unused part of the inode zeroed */
+	for (i=num; i<dino->sfi_nextents && i<SFS_NIEXTENTS; i++) {
+		bzero(&dino->sfi_extents[i], sizeof(dino->sfi_extents[i]));
+	}
+	dino->sfi_nextents = num;
+	sfs_dinode_mark_mapdirty(sv);
+
+	prevbuf = NULL;
+	block = dino->sfi_extblock;
+	base = SFS_NIEXTENTS;
+	while (block != 0) {
+		result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+				     &buf);
+		if (result) {
+			if (prevbuf != NULL) {
+				buffer_release(prevbuf);
+			}
+			return result;
+		}
+		xb = buffer_map(buf);
+		next = xb->sxb_next;
+
+		if (num > base) {
+			/* still in use; maybe partly */
+			if (num - base < xb->sxb_num) {
+				xb->sxb_num = num - base;
+				sfs_buffer_dirty(sv, buf);
+			}
+			if (prevbuf != NULL) {
+				buffer_release(prevbuf);
+			}
+			prevbuf = buf;
+		}
+		else {
+			/* not needed; unlink and free it */
+			if (prevbuf == NULL) {
+				dino->sfi_extblock = 0;
+			}
+			else {
+				xb = buffer_map(prevbuf);
+				xb->sxb_next = 0;
+				sfs_buffer_dirty(sv, prevbuf);
+			}
+			buffer_release_and_invalidate(buf);
+			sfs_bfree_prelocked(sfs, block);
+		}
+		block = next;
+		base += SFS_EXTPERBLOCK;
+	}
+	if (prevbuf != NULL) {
+		buffer_release(prevbuf);
+	}
+	return 0;
+}
+
+/*
+ * Insert X as extent number IDX, moving the later ones up.
+ */
+static
+int
+sfs_xinsert(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t idx,
+	    const struct sfs_extent *x)
+{
+	struct sfs_extent tmp;
+	uint32_t i;
+	int result;
+
+	for (i = dino->sfi_nextents; i > idx; i--) {
+		result = sfs_xget(sv, dino, i - 1, &tmp);
+		if (result) {
+			return result;
+		}
+		result = sfs_xput(sv, dino, i, &tmp);
+		if (result) {
+			return result;
+		}
+	}
+	result = sfs_xput(sv, dino, idx, x);
+	if (result) {
+		return result;
+	}
+	dino->sfi_nextents++;
+	sfs_dinode_mark_dirty(sv);
+	return 0;
+}
+
+/*
+ * Remove extent number IDX, moving the later ones down.
+ */
+static
+int
+sfs_xremove(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t idx)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent tmp;
+	uint32_t i;
+	int result;
+
+	for (i = idx; i + 1 < dino->sfi_nextents; i++) {
+		result = sfs_xget(sv, dino, i + 1, &tmp);
+		if (result) {
+			return result;
+		}
+		result = sfs_xput(sv, dino, i, &tmp);
+		if (result) {
+			return result;
+		}
+	}
+	sfs_lock_freemap(sfs);
+	result = sfs_xsetcount(sv, dino, dino->sfi_nextents - 1);
+	sfs_unlock_freemap(sfs);
+	return result;
+}
+
+/*
+ * Check if X is an unwritten extent.
+ */
+static
+bool
+sfs_xunwritten(const struct sfs_extent *x)
+{
+	return (x->sx_len & SFS_XUNWRITTEN) != 0;
+}
+
+////////////////////////////////////////////////////////////
+// mapping
+
+/*
+ * Block FILEBLOCK, in the unwritten extent X (number IDX), is being
+ * written: make it an ordinary block, clearing it first (or getting
+ * the buffer for sfs_bmap_fill), and hand back its disk block.
+ *
+ * The usual case is writing an unwritten extent front to back, where
+ * the block just continues the written extent before it; then that
+ * grows and X shrinks, so the extent count doesn't go up. Otherwise
+ * X is split around the block.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_xconvert(struct sfs_vnode *sv, struct sfs_dinode *dino, uint32_t idx,
+	     struct sfs_extent *x, uint32_t fileblock, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent prev, mid, after, *run;
+	uint32_t off, len;
+	daddr_t block;
+	int result;
+
+	KASSERT(sfs_xunwritten(x));
+
+	len = SFS_XLEN(x);
+	off = fileblock - x->sx_fileblock;
+	KASSERT(off < len);
+	block = x->sx_diskblock + off;
+
+	/* Do this first, so on failure nothing has changed */
+	result = sfs_bclear(sfs, block, sv->sv_fillbuf != NULL,
+			    sv->sv_fillbuf);
+	if (result) {
+		return result;
+	}
+
+	mid.sx_fileblock = fileblock;
+	mid.sx_diskblock = block;
+	mid.sx_len = 1;
+	run = &mid;
+
+	if (off == 0) {
+		prev.sx_len = 0;
+		if (idx > 0) {
+			result = sfs_xget(sv, dino, idx - 1, &prev);
+			if (result) {
+				return result;
+			}
+		}
+		if (prev.sx_len != 0 && !sfs_xunwritten(&prev) &&
+		    prev.sx_fileblock + prev.sx_len == fileblock &&
+		    prev.sx_diskblock + prev.sx_len == block) {
+			/* grow the previous extent over it */
+			prev.sx_len++;
+			result = sfs_xput(sv, dino, idx - 1, &prev);
+			run = &prev;
+			idx--;
+		}
+		else if (len == 1) {
+			/* the whole extent is written now */
+			result = sfs_xput(sv, dino, idx, &mid);
+			len = 0;
+		}
+		else {
+			result = sfs_xinsert(sv, dino, idx, &mid);
+		}
+		if (result) {
+			return result;
+		}
+		/* now shrink X from the front, if anything is left */
+		if (len == 0) {
+			goto done;
+		}
+		idx++;
+		x->sx_fileblock++;
+		x->sx_diskblock++;
+		x->sx_len--;
+		if (len == 1) {
+			result = sfs_xremove(sv, dino, idx);
+		}
+		else {
+			result = sfs_xput(sv, dino, idx, x);
+		}
+	}
+	else {
+		/* split: the part before, the block, the part after */
+		after.sx_fileblock = fileblock + 1;
+		after.sx_diskblock = block + 1;
+		after.sx_len = (len - off - 1) | SFS_XUNWRITTEN;
+		x->sx_len = off | SFS_XUNWRITTEN;
+		result = sfs_xput(sv, dino, idx, x);
+		if (result == 0) {
+			result = sfs_xinsert(sv, dino, idx + 1, &mid);
+		}
+		if (result == 0 && off + 1 < len) {
+			result = sfs_xinsert(sv, dino, idx + 2, &after);
+		}
+	}
+	if (result) {
+		return result;
+	}
+
+ done:
+	sfs_bmcache_add(sv, run->sx_fileblock, run->sx_diskblock,
+			run->sx_len);
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Extent version of sfs_bmap. The inode must be loaded. If the block
+ * isn't mapped and HOLELEN isn't NULL, it gets the number of
+ * unmapped blocks starting at FILEBLOCK (all the rest of the file's
+ * block range if there's no extent after it).
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_xmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock, uint32_t *holelen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino;
+	struct sfs_extent x, prev, *run;
+	bool haveprev, prevadj, nextadj;
+	daddr_t block, goal;
+	uint32_t i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_EXTENTS);
+
+	/* Find the extent with the block in it, or the one after it */
+	n = dino->sfi_nextents;
+	haveprev = false;
+	for (i=0; i<n; i++) {
+		result = sfs_xget(sv, dino, i, &x);
+		if (result) {
+			return result;
+		}
+		if (fileblock < x.sx_fileblock) {
+			break;
+		}
+		if (fileblock - x.sx_fileblock >= SFS_XLEN(&x)) {
+			prev = x;
+			haveprev = true;
+			continue;
+		}
+		if (sfs_xunwritten(&x)) {
+			if (doalloc) {
+				return sfs_xconvert(sv, dino, i, &x,
+						    fileblock, diskblock);
+			}
+			/* reads as a hole */
+			*diskblock = 0;
+			if (holelen != NULL) {
+				*holelen = x.sx_fileblock + SFS_XLEN(&x) -
+					fileblock;
+			}
+			return 0;
+		}
+		sfs_bmcache_add(sv, x.sx_fileblock, x.sx_diskblock,
+				x.sx_len);
+		*diskblock = x.sx_diskblock + (fileblock - x.sx_fileblock);
+		return 0;
+	}
+
+	if (!doalloc) {
+		*diskblock = 0;
+		if (holelen != NULL) {
+			*holelen = i < n ? x.sx_fileblock - fileblock :
+				(uint32_t)-1 - fileblock;
+		}
+		return 0;
+	}
+
+	/*
+	 * Not mapped. Allocate a block, preferably one that continues
+	 * the previous extent or comes right before the next one, or
+	 * failing that wherever the file's last allocation left off.
+	 * Now extent I (if it exists) is the next one, and is in X.
+	 * Unwritten extents can't take the new block.
+	 */
+	prevadj = haveprev && !sfs_xunwritten(&prev) &&
+		prev.sx_fileblock + prev.sx_len == fileblock;
+	nextadj = i < n && !sfs_xunwritten(&x) &&
+		x.sx_fileblock == fileblock + 1;
+	goal = 0;
+	if (prevadj) {
+		goal = prev.sx_diskblock + prev.sx_len;
+	}
+	else if (nextadj) {
+		goal = x.sx_diskblock - 1;
+	}
+	result = sfs_balloc_file(sv, goal, sv->sv_fillbuf != NULL, &block,
+				 sv->sv_fillbuf);
+	if (result) {
+		return result;
+	}
+	prevadj = prevadj && block == prev.sx_diskblock + prev.sx_len;
+	nextadj = nextadj && block + 1 == x.sx_diskblock;
+
+	if (prevadj) {
+		/* grow the previous extent, and maybe join the next */
+		prev.sx_len++;
+		if (nextadj) {
+			prev.sx_len += x.sx_len;
+		}
+		result = sfs_xput(sv, dino, i - 1, &prev);
+		if (result == 0 && nextadj) {
+			result = sfs_xremove(sv, dino, i);
+		}
+		run = &prev;
+	}
+	else if (nextadj) {
+		/* grow the next extent backwards */
+		x.sx_fileblock--;
+		x.sx_diskblock--;
+		x.sx_len++;
+		result = sfs_xput(sv, dino, i, &x);
+		run = &x;
+	}
+	else {
+		/* new extent */
+		x.sx_fileblock = fileblock;
+		x.sx_diskblock = block;
+		x.sx_len = 1;
+		result = sfs_xinsert(sv, dino, i, &x);
+		run = &x;
+	}
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+
+	sfs_bmcache_add(sv, run->sx_fileblock, run->sx_diskblock,
+			run->sx_len);
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Extent version of the block discarding in sfs_itrunc: free every
+ * block from NEWBLOCKLEN on. The inode must be loaded and the
+ * freemap locked.
+ */
+int
+sfs_xtrunc(struct sfs_vnode *sv, uint32_t newblocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino;
+	struct sfs_extent x;
+	uint32_t n, len, keep, b;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sfs_freemap_locked(sfs));
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_EXTENTS);
+
+	/* The extents past the new end are all at the end of the list */
+	n = dino->sfi_nextents;
+	while (n > 0) {
+		result = sfs_xget(sv, dino, n - 1, &x);
+		if (result) {
+			return result;
+		}
+		len = SFS_XLEN(&x);
+		if (x.sx_fileblock + len <= newblocklen) {
+			break;
+		}
+		keep = x.sx_fileblock >= newblocklen ? 0 :
+			newblocklen - x.sx_fileblock;
+		for (b = keep; b < len; b++) {
+			sfs_bfree_prelocked(sfs, x.sx_diskblock + b);
+		}
+		if (keep > 0) {
+			x.sx_len = keep | (x.sx_len & SFS_XUNWRITTEN);
+			result = sfs_xput(sv, dino, n - 1, &x);
+			if (result) {
+				return result;
+			}
+			break;
+		}
+		n--;
+	}
+
+	return sfs_xsetcount(sv, dino, n);
+}
+
+/*
+ * Allocate the blocks NUM blocks starting at FILEBLOCK that aren't
+ * mapped yet, as unwritten extents, for fallocate. Each hole is
+ * filled with as few runs as the freemap allows, each starting where
+ * the file's previous extent ends on disk if possible; a run that
+ * continues an unwritten extent both in the file and on disk is
+ * merged into it. The blocks aren't zeroed. The inode must be loaded.
+ *
+ * On failure, what was allocated before it stays allocated.
+ *
+ * Locking: must hold vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_xprealloc(struct sfs_vnode *sv, uint32_t fileblock, uint32_t num)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino;
+	struct sfs_extent x, prev;
+	bool haveprev;
+	uint32_t pos, end, holeend, got, i, b;
+	daddr_t block, goal;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_EXTENTS);
+
+	pos = fileblock;
+	end = fileblock + num;
+	KASSERT(end >= pos);
+
+	i = 0;
+	haveprev = false;
+	while (pos < end) {
+		/* Find the first extent that ends past POS */
+		for (; i < dino->sfi_nextents; i++) {
+			result = sfs_xget(sv, dino, i, &x);
+			if (result) {
+				return result;
+			}
+			if (x.sx_fileblock + SFS_XLEN(&x) > pos) {
+				break;
+			}
+			prev = x;
+			haveprev = true;
+		}
+
+		if (i < dino->sfi_nextents && x.sx_fileblock <= pos) {
+			/* already mapped; skip over it */
+			pos = x.sx_fileblock + SFS_XLEN(&x);
+			prev = x;
+			haveprev = true;
+			i++;
+			continue;
+		}
+
+		/* Fill the hole from POS to the next extent (or END) */
+		holeend = end;
+		if (i < dino->sfi_nextents && x.sx_fileblock < end) {
+			holeend = x.sx_fileblock;
+		}
+		goal = 0;
+		if (haveprev) {
+			goal = prev.sx_diskblock + SFS_XLEN(&prev);
+		}
+		result = sfs_balloc_run(sv, goal, holeend - pos, &block,
+					&got);
+		if (result) {
+			return result;
+		}
+
+		if (haveprev && sfs_xunwritten(&prev) &&
+		    prev.sx_fileblock + SFS_XLEN(&prev) == pos &&
+		    prev.sx_diskblock + SFS_XLEN(&prev) == block &&
+		    SFS_XLEN(&prev) + got < SFS_XUNWRITTEN) {
+			prev.sx_len += got;
+			result = sfs_xput(sv, dino, i - 1, &prev);
+		}
+		else {
+			prev.sx_fileblock = pos;
+			prev.sx_diskblock = block;
+			prev.sx_len = got | SFS_XUNWRITTEN;
+			result = sfs_xinsert(sv, dino, i, &prev);
+			i++;
+		}
+		if (result) {
+			sfs_lock_freemap(sfs);
+			for (b = 0; b < got; b++) {
+				sfs_bfree_prelocked(sfs, block + b);
+			}
+			sfs_unlock_freemap(sfs);
+			return result;
+		}
+		haveprev = true;
+		pos += got;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// defragmentation
+
+/*
+ * Move all of SV's blocks into one run of consecutive disk blocks, in
+ * file order, for the IOC_DEFRAG ioctl, and replace its extent list
+ * with the shorter one that maps them there. *BEFORE and *AFTER get
+ * the number of extents the file had and has. A file that wouldn't
+ * come out with fewer extents is left alone, as is one whose new
+ * list wouldn't fit in the inode (which takes a lot of holes).
+ *
+ * There is no journal record for the switch. It is safe because the
+ * new list is all in the inode: the blocks are copied through the
+ * buffer cache and written out first, then the inode is written, in
+ * one block write, and only after that are the old blocks and extent
+ * blocks freed. A crash before the inode goes out leaves the old map
+ * and the new run marked in use with nothing in it; after, the new
+ * map and the old blocks still marked. Either way sfsck's freemap
+ * check puts it right. Unwritten extents are moved without being
+ * copied, and stay unwritten.
+ *
+ * The file's pending blocks must already be placed (sfs_dalloc_flush)
+ * and its inode loaded.
+ *
+ * Locking: must hold the vnode lock, and the I/O lock for writing so
+ * no reads of the old blocks are going on. Gets/releases freemap
+ * locks.
+ *
+ * Requires 2 buffers.
+ */
+int
+sfs_xdefrag(struct sfs_vnode *sv, uint32_t *before, uint32_t *after)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino;
+	struct sfs_extent *old, *x;
+	struct sfs_extblock *xb;
+	struct buf *from, *to;
+	uint32_t num, newnum, total, len, i, b;
+	daddr_t start, block, next;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_EXTENTS);
+
+	num = dino->sfi_nextents;
+	*before = *after = num;
+	if (num < 2) {
+		return 0;
+	}
+
+	old = kmalloc(num * sizeof(*old));
+	if (old == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<num; i++) {
+		result = sfs_xget(sv, dino, i, &old[i]);
+		if (result) {
+			kfree(old);
+			return result;
+		}
+	}
+
+	/*
+	 * Once the blocks are consecutive on disk, extents only stay
+	 * apart where there's a hole between them in the file or one
+	 * is unwritten and the other isn't.
+	 */
+	newnum = 1;
+	total = SFS_XLEN(&old[0]);
+	for (i=1; i<num; i++) {
+		if (old[i].sx_fileblock !=
+		    old[i-1].sx_fileblock + SFS_XLEN(&old[i-1]) ||
+		    sfs_xunwritten(&old[i]) != sfs_xunwritten(&old[i-1])) {
+			newnum++;
+		}
+		total += SFS_XLEN(&old[i]);
+	}
+	if (newnum >= num || newnum > SFS_NIEXTENTS) {
+		kfree(old);
+		return 0;
+	}
+
+	/* The reservation would only be in the way */
+	sfs_bunreserve(sv);
+
+	result = sfs_balloc_contig(sfs, total, &start);
+	if (result) {
+		kfree(old);
+		return result;
+	}
+
+	/* Copy the data and write it out */
+	block = start;
+	for (i=0; i<num; i++) {
+		len = SFS_XLEN(&old[i]);
+		if (sfs_xunwritten(&old[i])) {
+			block += len;
+			continue;
+		}
+		for (b=0; b<len; b++) {
+			result = buffer_read(&sfs->sfs_absfs,
+					     old[i].sx_diskblock + b,
+					     SFS_BLOCKSIZE, &from);
+			if (result) {
+				goto fail;
+			}
+			buffer_set_kind(from, BUFKIND_DATA);
+			buffer_set_streaming(from);
+			result = buffer_get(&sfs->sfs_absfs, block,
+					    SFS_BLOCKSIZE, &to);
+			if (result) {
+				buffer_release(from);
+				goto fail;
+			}
+			buffer_set_kind(to, BUFKIND_DATA);
+			memcpy(buffer_map(to), buffer_map(from),
+			       SFS_BLOCKSIZE);
+			buffer_release(from);
+			buffer_mark_valid(to);
+			buffer_mark_dirty(to);
+			result = buffer_writeout(to);
+			buffer_release(to);
+			if (result) {
+				goto fail;
+			}
+			block++;
+		}
+	}
+
+	/* Switch the inode over to the new run */
+	next = dino->sfi_extblock;
+	bzero(dino->sfi_extents, sizeof(dino->sfi_extents));
+	block = start;
+	x = NULL;
+	for (i=0; i<num; i++) {
+		len = SFS_XLEN(&old[i]);
+		if (x != NULL && sfs_xunwritten(x) == sfs_xunwritten(&old[i]) &&
+		    x->sx_fileblock + SFS_XLEN(x) == old[i].sx_fileblock) {
+			x->sx_len += len;
+		}
+		else {
+			x = (x == NULL) ? &dino->sfi_extents[0] : x + 1;
+			x->sx_fileblock = old[i].sx_fileblock;
+			x->sx_diskblock = block;
+			x->sx_len = old[i].sx_len;
+		}
+		block += len;
+	}
+	KASSERT(x == &dino->sfi_extents[newnum - 1]);
+	dino->sfi_nextents = newnum;
+	dino->sfi_extblock = 0;
+	sfs_dinode_mark_mapdirty(sv);
+	sfs_bmcache_clear(sv);
+	sv->sv_nextblock = start + total;
+	*after = newnum;
+
+	result = buffer_writeout(sv->sv_dinobuf);
+	if (result) {
+		/*
+		 * The old map may still be all that's on disk, so its
+		 * blocks can't be given back; they stay marked in use
+		 * until sfsck finds nothing uses them.
+		 */
+		kfree(old);
+		return result;
+	}
+
+	/* Now the old blocks can go */
+	for (i=0; i<num; i++) {
+		for (b=0; b<SFS_XLEN(&old[i]); b++) {
+			buffer_drop(&sfs->sfs_absfs, old[i].sx_diskblock + b,
+				    SFS_BLOCKSIZE);
+		}
+	}
+	while (next != 0) {
+		block = next;
+		if (buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+				&from)) {
+			/* leave the rest of the chain for sfsck */
+			break;
+		}
+		xb = buffer_map(from);
+		next = xb->sxb_next;
+		buffer_release_and_invalidate(from);
+		sfs_bfree(sfs, block);
+	}
+	sfs_lock_freemap(sfs);
+	for (i=0; i<num; i++) {
+		for (b=0; b<SFS_XLEN(&old[i]); b++) {
+			sfs_bfree_prelocked(sfs, old[i].sx_diskblock + b);
+		}
+	}
+	sfs_unlock_freemap(sfs);
+	kfree(old);
+	return 0;
+
+ fail:
+	for (b=0; b<total; b++) {
+		buffer_drop(&sfs->sfs_absfs, start + b, SFS_BLOCKSIZE);
+	}
+	sfs_lock_freemap(sfs);
+	for (b=0; b<total; b++) {
+		sfs_bfree_prelocked(sfs, start + b);
+	}
+	sfs_unlock_freemap(sfs);
+	kfree(old);
+	return result;
+}
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <synch.h>
+#include <clock.h>
 #include <uio.h>
 #include <vfs.h>
 #include <buf.h>
@@ -60,16 +61,16 @@
  * optimization. (But that would require a total rewrite of the way
  * it's handled, so not now.)
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of
+ * SFS_BLOCKSIZE*8. (This rounded number is SFS_FREEMAPBITS.) This
+ * means that the bitmap will (in general) contain space for some
+ * number of invalid blocks that are actually beyond the end of the
+ * disk device. This is ok. These blocks are supposed to be marked
  * "in use" by mksfs and never get marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
+ * The blocks used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
  */
 static
@@ -111,6 +112,11 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 			return result;
 		}
 	}
+
+	/* We read in behind the bitmap's back; update its summary. */
+	if (rw == UIO_READ) {
+		bitmap_rescan(sfs->sfs_freemap);
+	}
 	return 0;
 }
 
@@ -136,7 +142,8 @@ sfs_sync_vnodes(struct sfs_fs *sfs)
 #endif
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. Holds all the allocation group locks
+ * so the freemap doesn't change while it's being written.
  */
 static
 int
@@ -145,16 +152,19 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 	int result;
 
 	lock_acquire(sfs->sfs_freemaplock);
+	sfs_lock_freemap(sfs);
 
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			sfs_unlock_freemap(sfs);
 			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
 
+	sfs_unlock_freemap(sfs);
 	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
@@ -230,6 +240,12 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	/* Give the files' pending blocks somewhere to go */
+	result = sfs_dalloc_flushall(sfs, true);
+	if (result) {
+		return result;
+	}
+
 	/* Sync the buffer cache */
 	result = sync_fs_buffers(fs);
 	if (result) {
@@ -248,7 +264,8 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
-	result = sfs_jphys_flushall(sfs);
+	/* Commit (the ordered data is all written by now, though) */
+	result = sfs_jmode_commit(sfs);
 	if (result) {
 		return result;
 	}
@@ -258,8 +275,9 @@ sfs_sync(struct fs *fs)
 
 /*
  * Code called when buffers are attached to and detached from the fs.
- * This can allocate and destroy fs-specific buffer data. We don't
- * currently have any, but later changes might want to.
+ * This can allocate and destroy fs-specific buffer data. The only
+ * such data is the checkpointer's pinning state (see sfs_ckpt.c),
+ * which is created on demand, so buffers start out with none.
  */
 static
 int
@@ -287,14 +305,13 @@ sfs_detachbuf(struct fs *fs, daddr_t diskblock, struct buf *buf)
 	struct sfs_fs *sfs = fs->fs_data;
 	void *bufdata;
 
-	(void)sfs;
 	(void)diskblock;
 
 	/* Clear the fs-specific metadata by installing null. */
 	bufdata = buffer_set_fsdata(buf, NULL);
 
-	/* The fs-specific buffer data we installed before was just NULL. */
-	KASSERT(bufdata == NULL);
+	/* Free whatever the checkpointer attached, if anything. */
+	sfs_ckpt_detach(sfs, bufdata);
 }
 
 /*
@@ -326,13 +343,19 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_reaper_destroy(sfs->sfs_reaper);
+	sfs_dalloc_destroy(sfs->sfs_dalloc);
+	sfs_ordered_destroy(sfs->sfs_ordered);
+	sfs_ckpt_destroy(sfs->sfs_ckpt);
 	sfs_jphys_destroy(sfs->sfs_jphys);
 	lock_destroy(sfs->sfs_renamelock);
 	lock_destroy(sfs->sfs_freemaplock);
 	lock_destroy(sfs->sfs_vnlock);
+	sfs_agroups_destroy(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	hashtable_destroy(sfs->sfs_vnhash);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -348,11 +371,25 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
+	/*
+	 * Finish erasing deleted files (see sfs_reap.c), and sync
+	 * again if that changed anything.
+	 */
+	if (sfs_reap_drain(sfs)) {
+		result = sfs_sync(fs);
+		if (result) {
+			return result;
+		}
+	}
 
 	lock_acquire(sfs->sfs_vnlock);
 	lock_acquire(sfs->sfs_freemaplock);
 
+	/* Let go of the vnodes kept around for reuse */
+	sfs_vncache_trim(sfs, 0);
+
 	/* Do we have any files open? If so, can't unmount. */
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
 		lock_release(sfs->sfs_freemaplock);
@@ -360,9 +397,40 @@ sfs_unmount(struct fs *fs)
 		return EBUSY;
 	}
 
+	/*
+	 * Stop the checkpointer, then trim the journal all the way
+	 * (we were just synced, so nothing should be pinning it) and
+	 * flush out the trim record. (Stop the reaper too; it has
+	 * nothing left to do.)
+	 */
+	sfs_reap_stop(sfs);
+	sfs_ckpt_stop(sfs);
+	sfs_checkpoint(sfs);
+	result = sfs_jphys_flushall(sfs);
+	if (result) {
+		kprintf("sfs: %s: flushing journal: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+	}
+
 	sfs_jphys_stopwriting(sfs);
 
-	unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+	/*
+	 * Everything's on disk, so tell the next mount where the
+	 * journal is and that it needn't look. If this fails, the
+	 * next mount just scans.
+	 */
+	if (result == 0) {
+		sfs_jphys_markclean(sfs);
+		result = sfs_writeblock(&sfs->sfs_absfs, SFS_SUPER_BLOCK,
+					NULL,
+					&sfs->sfs_sb, sizeof(sfs->sfs_sb));
+		if (result) {
+			kprintf("sfs: %s: writing superblock: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+	}
+
+	unreserve_fsmanaged_buffers(SFS_MANAGED_BUFS, SFS_BLOCKSIZE);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
@@ -394,7 +462,9 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
 	.fsop_readblock = sfs_readblock,
+	.fsop_readblocks = sfs_readblocks,
 	.fsop_writeblock = sfs_writeblock,
+	.fsop_writeblocks = sfs_writeblocks,
 	.fsop_attachbuf = sfs_attachbuf,
 	.fsop_detachbuf = sfs_detachbuf,
 };
@@ -437,21 +507,30 @@ sfs_fs_create(void)
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
+	sfs->sfs_jdevice = NULL;
 
 	/* vnode table */
 	sfs->sfs_vnodes = vnodearray_create();
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnhash = hashtable_create("sfs_vnhash", 0);
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnodes;
+	}
+	sfs->sfs_vnlru = sfs->sfs_vnlrutail = NULL;
+	sfs->sfs_vncached = 0;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_aglocks = NULL;	/* created once we know the size */
+	sfs->sfs_ngroups = 0;
 
 	/* locks */
 	sfs->sfs_vnlock = lock_create("sfs_vnlock");
 	if (sfs->sfs_vnlock == NULL) {
-		goto cleanup_vnodes;
+		goto cleanup_vnhash;
 	}
 	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
 	if (sfs->sfs_freemaplock == NULL) {
@@ -468,14 +547,49 @@ sfs_fs_create(void)
 		goto cleanup_renamelock;
 	}
 
+	/* checkpointer */
+	sfs->sfs_ckpt = sfs_ckpt_create();
+	if (sfs->sfs_ckpt == NULL) {
+		goto cleanup_jphys;
+	}
+
+	/* journaling mode */
+	sfs->sfs_jmode = SFS_JMODE_ORDERED;
+	sfs->sfs_ordered = sfs_ordered_create();
+	if (sfs->sfs_ordered == NULL) {
+		goto cleanup_ckpt;
+	}
+
+	/* delayed allocation */
+	sfs->sfs_dalloc = sfs_dalloc_create();
+	if (sfs->sfs_dalloc == NULL) {
+		goto cleanup_ordered;
+	}
+
+	/* reaper */
+	sfs->sfs_reaper = sfs_reaper_create();
+	if (sfs->sfs_reaper == NULL) {
+		goto cleanup_dalloc;
+	}
+
 	return sfs;
 
+cleanup_dalloc:
+	sfs_dalloc_destroy(sfs->sfs_dalloc);
+cleanup_ordered:
+	sfs_ordered_destroy(sfs->sfs_ordered);
+cleanup_ckpt:
+	sfs_ckpt_destroy(sfs->sfs_ckpt);
+cleanup_jphys:
+	sfs_jphys_destroy(sfs->sfs_jphys);
 cleanup_renamelock:
 	lock_destroy(sfs->sfs_renamelock);
 cleanup_freemaplock:
 	lock_destroy(sfs->sfs_freemaplock);
 cleanup_vnlock:
 	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnhash:
+	hashtable_destroy(sfs->sfs_vnhash);
 cleanup_vnodes:
 	vnodearray_destroy(sfs->sfs_vnodes);
 cleanup_object:
@@ -484,6 +598,112 @@ fail:
 	return NULL;
 }
 
+/*
+ * Check that a device's sectors evenly divide our blocks.
+ */
+static
+bool
+sfs_blocksize_ok(struct device *dev)
+{
+	return dev->d_blocksize <= SFS_BLOCKSIZE &&
+		SFS_BLOCKSIZE % dev->d_blocksize == 0;
+}
+
+/*
+ * Size of a device in our blocks.
+ */
+static
+uint32_t
+sfs_devblocks(struct device *dev)
+{
+	return dev->d_blocks / (SFS_BLOCKSIZE / dev->d_blocksize);
+}
+
+/*
+ * Check that the journal is where the superblock says it is: on the
+ * volume, in which case JDEV must be NULL, or on the device JDEV, in
+ * which case we check its header and start using it.
+ */
+static
+int
+sfs_checkjournal(struct sfs_fs *sfs, struct device *jdev)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_jsuperblock *jsb;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	if ((sb->sb_flags & SFS_SBF_EXTJOURNAL) == 0) {
+		if (jdev != NULL) {
+			kprintf("sfs: %s: Journal is not on a separate "
+				"device\n", sb->sb_volname);
+			return EINVAL;
+		}
+		return 0;
+	}
+
+	if (jdev == NULL) {
+		kprintf("sfs: %s: Journal is on a separate device; "
+			"mount with it\n", sb->sb_volname);
+		return EINVAL;
+	}
+	if (!sfs_blocksize_ok(jdev)) {
+		kprintf("sfs: %s: Journal device has blocksize %zu\n",
+			sb->sb_volname, jdev->d_blocksize);
+		return ENXIO;
+	}
+	if (sb->sb_journalstart != sb->sb_nblocks) {
+		kprintf("sfs: %s: External journal starts at %u, "
+			"should be %u\n", sb->sb_volname,
+			sb->sb_journalstart, sb->sb_nblocks);
+		return EINVAL;
+	}
+
+	/* a whole block is too big for the stack with 4K blocks */
+	jsb = kmalloc(sizeof(*jsb));
+	if (jsb == NULL) {
+		return ENOMEM;
+	}
+	SFSUIO(&iov, &ku, jsb, SFS_JSUPER_BLOCK, UIO_READ);
+	result = DEVOP_IO(jdev, &ku);
+	if (result) {
+		goto out;
+	}
+	result = EINVAL;
+	if (jsb->jsb_magic != SFS_JMAGIC) {
+		kprintf("sfs: %s: Wrong magic number on journal device "
+			"(0x%x, should be 0x%x)\n", sb->sb_volname,
+			jsb->jsb_magic, SFS_JMAGIC);
+		goto out;
+	}
+	if ((jsb->jsb_blocksize == 0 ? 512 : jsb->jsb_blocksize) !=
+	    SFS_BLOCKSIZE) {
+		kprintf("sfs: %s: Journal device has the wrong block size\n",
+			sb->sb_volname);
+		goto out;
+	}
+	jsb->jsb_volname[sizeof(jsb->jsb_volname)-1] = 0;
+	if (strcmp(jsb->jsb_volname, sb->sb_volname) != 0) {
+		kprintf("sfs: %s: Journal device belongs to %s\n",
+			sb->sb_volname, jsb->jsb_volname);
+		goto out;
+	}
+	if (jsb->jsb_journalblocks != sb->sb_journalblocks ||
+	    SFS_JDEV_JOURNALSTART + jsb->jsb_journalblocks >
+	    sfs_devblocks(jdev)) {
+		kprintf("sfs: %s: Journal device has the wrong size\n",
+			sb->sb_volname);
+		goto out;
+	}
+
+	sfs->sfs_jdevice = jdev;
+	result = 0;
+ out:
+	kfree(jsb);
+	return result;
+}
+
 /*
  * Mount routine.
  *
@@ -496,26 +716,26 @@ fail:
  * be easier to synchronize correctly; it is important not to get two
  * filesystems with the same name mounted at once, or two filesystems
  * mounted on the same device at once.
+ *
+ * JDEV is the device the journal is on, if it has one of its own,
+ * and otherwise NULL.
  */
 static
 int
-sfs_domount(void *options, struct device *dev, struct fs **ret)
+sfs_domount_common(struct device *dev, struct device *jdev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	/* We don't pass any options through mount */
-	(void)options;
+	uint32_t blocksize;
+	bool clean;
+	struct timespec before, after, duration;
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors don't fit evenly in
+	 * our blocks. (With the sfs4k option each block is eight
+	 * 512-byte sectors; otherwise blocks and sectors are the same.)
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
+	if (!sfs_blocksize_ok(dev)) {
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -558,18 +778,54 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_journalblocks >= sfs->sfs_sb.sb_nblocks) {
+	/* Older volumes have 512-byte blocks and don't say so */
+	blocksize = sfs->sfs_sb.sb_blocksize;
+	if (blocksize == 0) {
+		blocksize = 512;
+	}
+	if (blocksize != SFS_BLOCKSIZE) {
+		kprintf("sfs: Volume has blocksize %u, not %u\n",
+			blocksize, SFS_BLOCKSIZE);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if ((sfs->sfs_sb.sb_flags & ~SFS_SBF_ALL) != 0) {
+		kprintf("sfs: Unknown superblock flags 0x%x\n",
+			sfs->sfs_sb.sb_flags);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if ((sfs->sfs_sb.sb_flags & SFS_SBF_EXTJOURNAL) == 0 &&
+	    sfs->sfs_sb.sb_journalblocks >= sfs->sfs_sb.sb_nblocks) {
 		kprintf("sfs: warning - journal takes up whole volume\n");
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
+	if (sfs->sfs_sb.sb_nblocks > sfs_devblocks(dev)) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+			sfs->sfs_sb.sb_nblocks, sfs_devblocks(dev));
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Find the journal */
+	result = sfs_checkjournal(sfs, jdev);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
@@ -579,6 +835,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
+	result = sfs_agroups_create(sfs);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		lock_release(sfs->sfs_vnlock);
@@ -594,16 +858,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	lock_release(sfs->sfs_vnlock);
 	lock_release(sfs->sfs_freemaplock);
 
-	reserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+	reserve_fsmanaged_buffers(SFS_MANAGED_BUFS, SFS_BLOCKSIZE);
 
 	/*
 	 * Load up the journal container. (basically, recover it)
 	 */
 
 	SAY("*** Loading up the jphys container ***\n");
-	result = sfs_jphys_loadup(sfs);
+	gettime(&before);
+	/*
+	 * If it was unmounted cleanly, take the journal head and tail
+	 * from the superblock instead of scanning for them. Either way,
+	 * mark it not clean on disk before anything else gets written.
+	 */
+	clean = sfs->sfs_sb.sb_clean == SFS_SB_CLEAN;
+	result = EFTYPE;
+	if (clean) {
+		result = sfs_jphys_loadclean(sfs);
+	}
+	if (result == EFTYPE) {
+		/* not clean, or the recorded state is garbage */
+		result = sfs_jphys_loadup(sfs);
+	}
+	if (result == 0 && clean) {
+		sfs->sfs_sb.sb_clean = 0;
+		result = sfs_writeblock(&sfs->sfs_absfs, SFS_SUPER_BLOCK,
+					NULL,
+					&sfs->sfs_sb, sizeof(sfs->sfs_sb));
+	}
 	if (result) {
-		unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+		unreserve_fsmanaged_buffers(SFS_MANAGED_BUFS, SFS_BLOCKSIZE);
 		drop_fs_buffers(&sfs->sfs_absfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
@@ -632,7 +916,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	SAY("*** Starting up ***\n");
 	result = sfs_jphys_startwriting(sfs);
 	if (result) {
-		unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+		unreserve_fsmanaged_buffers(SFS_MANAGED_BUFS, SFS_BLOCKSIZE);
 		drop_fs_buffers(&sfs->sfs_absfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
@@ -647,9 +931,114 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	kprintf("sfs: %s: recovery took %llu.%03u seconds "
+		"(%u journal blocks)\n", sfs->sfs_sb.sb_volname,
+		(unsigned long long)duration.tv_sec,
+		(unsigned)(duration.tv_nsec / 1000000),
+		sfs->sfs_sb.sb_journalblocks);
+
+	/* Now the journal is live, start trimming it. */
+	sfs_ckpt_start(sfs);
+	sfs_reap_start(sfs);
+
+	return 0;
+}
+
+/*
+ * Mount functions for vfs_mount and vfs_mount_aux.
+ */
+static
+int
+sfs_domount(void *options, struct device *dev, struct fs **ret)
+{
+	/* We don't pass any options through mount */
+	(void)options;
+
+	return sfs_domount_common(dev, NULL, ret);
+}
+
+static
+int
+sfs_domount_journal(void *options, struct device *dev, struct device *jdev,
+		    struct fs **ret)
+{
+	(void)options;
+
+	return sfs_domount_common(dev, jdev, ret);
+}
+
+/*
+ * Print the journal statistics for a mounted volume (for the menu).
+ */
+int
+sfs_printjstats(const char *devname)
+{
+	struct vnode *root;
+	struct fs *fs;
+	int result;
+
+	/* getting the root vnode keeps the volume from being unmounted */
+	result = vfs_getroot(devname, &root);
+	if (result) {
+		return result;
+	}
+	fs = root->vn_fs;
+	if (fs == NULL || fs->fs_ops != &sfs_fsops) {
+		VOP_DECREF(root);
+		return EINVAL;
+	}
+	sfs_jphys_printstats(fs->fs_data);
+	VOP_DECREF(root);
 	return 0;
 }
 
+/*
+ * Set or print the journaling mode of an sfs, for the jmode menu
+ * command. Leaving ordered mode commits first, so the data written
+ * under it isn't left unordered.
+ */
+int
+sfs_setjmode(const char *devname, const char *modename)
+{
+	struct vnode *root;
+	struct fs *fs;
+	struct sfs_fs *sfs;
+	unsigned mode;
+	int result;
+
+	result = vfs_getroot(devname, &root);
+	if (result) {
+		return result;
+	}
+	fs = root->vn_fs;
+	if (fs == NULL || fs->fs_ops != &sfs_fsops) {
+		VOP_DECREF(root);
+		return EINVAL;
+	}
+	sfs = fs->fs_data;
+
+	if (modename == NULL) {
+		kprintf("%s: journaling mode %s\n", sfs->sfs_sb.sb_volname,
+			sfs_jmode_name(sfs->sfs_jmode));
+		VOP_DECREF(root);
+		return 0;
+	}
+
+	result = sfs_jmode_byname(modename, &mode);
+	if (result) {
+		VOP_DECREF(root);
+		return result;
+	}
+	sfs->sfs_jmode = mode;
+	if (mode != SFS_JMODE_ORDERED) {
+		result = sfs_jmode_commit(sfs);
+	}
+	VOP_DECREF(root);
+	return result;
+}
+
 /*
  * Actual function called from high-level code to mount an sfs.
  */
@@ -658,3 +1047,12 @@ sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+/*
+ * Same, with the journal on the device JDEVICE.
+ */
+int
+sfs_mount_journal(const char *device, const char *jdevice)
+{
+	return vfs_mount_aux(device, jdevice, NULL, sfs_domount_journal);
+}
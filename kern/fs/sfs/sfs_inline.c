@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS inline files.
+ *
+ * On a volume with SFS_SBF_INLINE, a new regular file starts out
+ * with SFS_DIF_INLINE set and keeps its contents in the inode itself,
+ * in the space the extents would otherwise use (see kern/sfs.h). The
+ * many tiny files shells and scripts write then cost no data block,
+ * and reading one costs only the inode read rather than that plus a
+ * block map lookup and a data block read.
+ *
+ * The first write or truncate that would take the file past
+ * SFS_INLINE_MAX bytes moves its data out to an ordinary block 0 and
+ * clears the flag; from then on the file is mapped as usual. Files
+ * never move back inline.
+ *
+ * Inline data is part of the inode buffer, so it's locked by the
+ * vnode lock rather than by range locks. sfs_write sends every write
+ * to an inline file through sfs_io, with the I/O lock held for
+ * writing; so while readers hold the I/O lock for reading, nothing
+ * changes the data or the flag under them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Where the data lives.
+ */
+static
+char *
+sfs_inline_data(struct sfs_dinode *dino)
+{
+	return (char *)dino->sfi_extents;
+}
+
+/*
+ * Check if a file's data is inline. The inode must be loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+bool
+sfs_inline_is(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	return (sfs_dinode_map(sv)->sfi_flags & SFS_DIF_INLINE) != 0;
+}
+
+/*
+ * Read from an inline file, stopping at EOF. The inode must be
+ * loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+int
+sfs_inline_read(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_dinode *dino;
+	off_t size;
+	size_t len;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_INLINE);
+	size = sfs_size(sv);
+	KASSERT(size <= (off_t)SFS_INLINE_MAX);
+
+	if (uio->uio_offset >= size) {
+		return 0;
+	}
+	len = size - uio->uio_offset;
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	return uiomove(sfs_inline_data(dino) + uio->uio_offset, len, uio);
+}
+
+/*
+ * Write to an inline file. The write must end within SFS_INLINE_MAX;
+ * the caller (sfs_io) updates the size afterwards. The inode must be
+ * loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+int
+sfs_inline_write(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_dinode *dino;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_INLINE_MAX);
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_INLINE);
+
+	result = uiomove(sfs_inline_data(dino) + uio->uio_offset,
+			 uio->uio_resid, uio);
+	/* even if it failed partway, some of it may have been copied */
+	sfs_dinode_mark_mapdirty(sv);
+	return result;
+}
+
+/*
+ * Cut an inline file down (or extend it) to NEWLEN, which must be
+ * within SFS_INLINE_MAX. The inode must be loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+void
+sfs_inline_trunc(struct sfs_vnode *sv, off_t newlen)
+{
+	struct sfs_dinode *dino;
+	off_t oldlen;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(newlen >= 0 && newlen <= (off_t)SFS_INLINE_MAX);
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_INLINE);
+
+	/* keep the space past EOF zero, so extending reads zeros */
+	oldlen = sfs_size(sv);
+	if (newlen < oldlen) {
+		bzero(sfs_inline_data(dino) + newlen, oldlen - newlen);
+	}
+	sfs_size_set(sv, newlen);
+}
+
+/*
+ * Move an inline file's data out to block 0 so it can grow. On
+ * failure the file is left inline and unchanged. The inode must be
+ * loaded.
+ *
+ * Locking: must hold the vnode lock. May get/release freemap locks.
+ *
+ * Requires up to 3 buffers (including the inode's).
+ */
+int
+sfs_inline_promote(struct sfs_vnode *sv)
+{
+	struct sfs_dinode *dino;
+	struct buf *newbuf;
+	daddr_t diskblock;
+	char *copy, *ioptr;
+	uint32_t size;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DIF_INLINE);
+	size = sfs_size(sv);
+	KASSERT(size <= SFS_INLINE_MAX);
+
+	if (size == 0) {
+		dino->sfi_flags &= ~SFS_DIF_INLINE;
+		sfs_dinode_mark_mapdirty(sv);
+		return 0;
+	}
+
+	/*
+	 * Get the data out of the way first, since mapping the block
+	 * may put an extent where it is.
+	 */
+	copy = kmalloc(size);
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+	memcpy(copy, sfs_inline_data(dino), size);
+	bzero(sfs_inline_data(dino), size);
+	dino->sfi_flags &= ~SFS_DIF_INLINE;
+	sfs_dinode_mark_mapdirty(sv);
+
+	result = sfs_bmap_fill(sv, 0, &diskblock, &newbuf);
+	if (result) {
+		/* put it back */
+		memcpy(sfs_inline_data(dino), copy, size);
+		dino->sfi_flags |= SFS_DIF_INLINE;
+		kfree(copy);
+		return result;
+	}
+	/* an inline file has no blocks, so this one is new */
+	KASSERT(newbuf != NULL);
+
+	ioptr = buffer_map(newbuf);
+	memcpy(ioptr, copy, size);
+	bzero(ioptr + size, SFS_BLOCKSIZE - size);
+	kfree(copy);
+
+	buffer_set_kind(newbuf, BUFKIND_DATA);
+	buffer_mark_valid(newbuf);
+	buffer_mark_dirty(newbuf);
+	return sfs_data_release(sv, newbuf, diskblock, 0, SFS_BLOCKSIZE);
+}
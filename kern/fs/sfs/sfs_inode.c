@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <synch.h>
 #include <thread.h>
 #include <current.h>
@@ -43,6 +44,14 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Deleted files with more blocks than this are erased by the reaper
+ * (see sfs_reap.c) rather than in sfs_reclaim, and it frees their
+ * blocks this many at a time.
+ */
+#define SFS_REAP_MINBLOCKS	SFS_NDIRECT
+#define SFS_REAP_BATCH		1024
+
 
 /*
  * Constructor for sfs_vnode.
@@ -53,19 +62,61 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 {
 	struct sfs_vnode *sv;
 
-	sv = kmalloc(sizeof(*sv));
+	sv = kmalloc_tagged(sizeof(*sv), &vnode_heaptag);
 	if (sv == NULL) {
 		return NULL;
 	}
 	sv->sv_lock = lock_create("sfs_vnode");
 	if (sv->sv_lock == NULL) {
-		kfree(sv);
+		kfree_tagged(sv, sizeof(*sv), &vnode_heaptag);
+		return NULL;
+	}
+	sv->sv_rwlock = rwlock_create("sfs_vnode io");
+	if (sv->sv_rwlock == NULL) {
+		lock_destroy(sv->sv_lock);
+		kfree_tagged(sv, sizeof(*sv), &vnode_heaptag);
+		return NULL;
+	}
+	if (sfs_range_init(sv)) {
+		rwlock_destroy(sv->sv_rwlock);
+		lock_destroy(sv->sv_lock);
+		kfree_tagged(sv, sizeof(*sv), &vnode_heaptag);
+		return NULL;
+	}
+	sv->sv_bufowner = bufowner_create();
+	if (sv->sv_bufowner == NULL) {
+		sfs_range_cleanup(sv);
+		rwlock_destroy(sv->sv_rwlock);
+		lock_destroy(sv->sv_lock);
+		kfree_tagged(sv, sizeof(*sv), &vnode_heaptag);
 		return NULL;
 	}
 	sv->sv_ino = ino;
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+	sfs_bmcache_clear(sv);
+	sv->sv_nextblock = 0;
+	sv->sv_reserved = 0;
+	sv->sv_wantblocks = 0;
+	sv->sv_fillbuf = NULL;
+	sv->sv_danum = 0;
+	sv->sv_size = 0;
+	sv->sv_sizedirty = false;
+	sv->sv_dirfree = 0;
+	sv->sv_dirnfree = -1;
+	sv->sv_synclsn = 0;
+	sv->sv_mapdirty = false;
+	sv->sv_parentino = SFS_NOINO;
+	sv->sv_name[0] = 0;
+	hashlink_init(&sv->sv_hashlink, sv);
+	sv->sv_tableix = 0;
+	sv->sv_cached = false;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_reapnext = NULL;
 	return sv;
 }
 
@@ -76,8 +127,199 @@ static
 void
 sfs_vnode_destroy(struct sfs_vnode *victim)
 {
+	KASSERT(victim->sv_danum == 0);
+	KASSERT(!victim->sv_sizedirty);
+	bufowner_destroy(victim->sv_bufowner);
+	sfs_range_cleanup(victim);
+	rwlock_destroy(victim->sv_rwlock);
 	lock_destroy(victim->sv_lock);
-	kfree(victim);
+	kfree_tagged(victim, sizeof(*victim), &vnode_heaptag);
+}
+
+////////////////////////////////////////////////////////////
+// Vnode table
+
+/*
+ * The vnode table is the sfs_vnodes array, for going over all the
+ * loaded vnodes, plus a hash table on the inode number for finding
+ * one. Each vnode remembers its index in the array so it can be
+ * taken out without searching.
+ *
+ * Vnodes whose last reference goes away are not destroyed right away
+ * if the file still exists; instead the table keeps the reference and
+ * puts them on a list, most recently used first, so that using the
+ * file again soon finds it already loaded. The list holds at most
+ * SFS_VNCACHE_MAX vnodes; beyond that the least recently used are
+ * destroyed.
+ *
+ * All of this is protected by sfs_vnlock.
+ */
+
+static
+bool
+sfs_vntable_match(void *obj, const void *key)
+{
+	const struct sfs_vnode *sv = obj;
+
+	return sv->sv_ino == *(const uint32_t *)key;
+}
+
+/*
+ * Find a loaded vnode by inode number, or return NULL.
+ */
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	return hashtable_find(sfs->sfs_vnhash, ino, sfs_vntable_match, &ino);
+}
+
+/*
+ * Add a vnode to the table.
+ */
+static
+int
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn,
+				&sv->sv_tableix);
+	if (result) {
+		return result;
+	}
+	hashtable_add(sfs->sfs_vnhash, &sv->sv_hashlink, sv->sv_ino);
+	return 0;
+}
+
+/*
+ * Remove a vnode from the table. The last vnode in the array moves
+ * into its place.
+ */
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode *last;
+	unsigned num;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_cached);
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	if (sv->sv_tableix >= num ||
+	    vnodearray_get(sfs->sfs_vnodes, sv->sv_tableix) != &sv->sv_absvn) {
+		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	last = vnodearray_get(sfs->sfs_vnodes, num - 1)->vn_data;
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_tableix, &last->sv_absvn);
+	last->sv_tableix = sv->sv_tableix;
+	result = vnodearray_setsize(sfs->sfs_vnodes, num - 1);
+	/* shrinking doesn't fail */
+	KASSERT(result == 0);
+
+	hashtable_remove(sfs->sfs_vnhash, &sv->sv_hashlink);
+}
+
+/*
+ * Put an unused vnode on the front of the list, or take one off.
+ */
+static
+void
+sfs_vncache_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_cached);
+
+	sv->sv_cached = true;
+	sv->sv_lruprev = NULL;
+	sv->sv_lrunext = sfs->sfs_vnlru;
+	if (sfs->sfs_vnlru != NULL) {
+		sfs->sfs_vnlru->sv_lruprev = sv;
+	}
+	else {
+		sfs->sfs_vnlrutail = sv;
+	}
+	sfs->sfs_vnlru = sv;
+	sfs->sfs_vncached++;
+}
+
+static
+void
+sfs_vncache_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_cached);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_vnlru = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_vnlrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_cached = false;
+	KASSERT(sfs->sfs_vncached > 0);
+	sfs->sfs_vncached--;
+}
+
+/*
+ * Destroy unused vnodes, least recently used first, until there are
+ * no more than MAX left. Because the vnode table lock comes after
+ * vnode locks, we can only trylock the vnodes; any that are locked
+ * (or that someone has a reference to, which means they're also
+ * about to lock them) are skipped.
+ *
+ * Nothing needs to be written out: vnodes go on the list only after
+ * sfs_reclaim has flushed their pending blocks, and nobody can write
+ * to them without getting them off it first.
+ *
+ * Locking: must hold sfs_vnlock. Trylocks vnode locks.
+ */
+void
+sfs_vncache_trim(struct sfs_fs *sfs, unsigned max)
+{
+	struct sfs_vnode *sv, *prev;
+	struct vnode *v;
+	bool busy;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnlrutail; sv != NULL && sfs->sfs_vncached > max;
+	     sv = prev) {
+		prev = sv->sv_lruprev;
+		v = &sv->sv_absvn;
+
+		if (!lock_tryacquire(sv->sv_lock)) {
+			continue;
+		}
+		/* We hold sfs_vnlock, so it can't go up from 1 */
+		busy = v->vn_refcount != 1;
+		if (busy) {
+			lock_release(sv->sv_lock);
+			continue;
+		}
+
+		KASSERT(sv->sv_dinobufcount == 0);
+		KASSERT(sv->sv_danum == 0);
+		sfs_vncache_remove(sfs, sv);
+		sfs_vntable_remove(sfs, sv);
+		vnode_cleanup(v);
+		lock_release(sv->sv_lock);
+		sfs_vnode_destroy(sv);
+	}
 }
 
 /*
@@ -171,13 +413,205 @@ sfs_dinode_mark_dirty(struct sfs_vnode *sv)
 	buffer_mark_dirty(sv->sv_dinobuf);
 }
 
+/*
+ * Same, for changes that fdatasync has to write: the size, the block
+ * map, or an inline file's data. (Link counts and the like can wait.)
+ *
+ * Locking: must hold the vnode lock.
+ */
+void
+sfs_dinode_mark_mapdirty(struct sfs_vnode *sv)
+{
+	sfs_dinode_mark_dirty(sv);
+	sv->sv_mapdirty = true;
+}
+
+/*
+ * File size.
+ *
+ * Writes that extend a file only note the new size in the vnode
+ * (sfs_size_extend), so a stream of small appends doesn't dirty the
+ * inode buffer once per write. The size is folded into the on-disk
+ * inode by sfs_size_sync, which is called when pending blocks are
+ * flushed (sfs_dalloc_flush): that is, by the checkpointer, by sync
+ * and fsync, and at reclaim. Anything that sets the size outright
+ * (truncate) writes the inode directly with sfs_size_set.
+ *
+ * Always use sfs_size rather than looking at sfi_size.
+ */
+
+/*
+ * Return the current size of the file. The inode must be loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+off_t
+sfs_size(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_sizedirty) {
+		return sv->sv_size;
+	}
+	return sfs_dinode_map(sv)->sfi_size;
+}
+
+/*
+ * Grow the file to SIZE, if it's smaller, without touching the
+ * on-disk inode. The inode must be loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+void
+sfs_size_extend(struct sfs_vnode *sv, off_t size)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (size > sfs_size(sv)) {
+		sv->sv_size = size;
+		sv->sv_sizedirty = true;
+	}
+}
+
+/*
+ * Set the file size to SIZE in the on-disk inode. The inode must be
+ * loaded.
+ *
+ * Locking: must hold the vnode lock.
+ */
+void
+sfs_size_set(struct sfs_vnode *sv, off_t size)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(size >= 0);
+
+	sfs_dinode_map(sv)->sfi_size = size;
+	sfs_dinode_mark_mapdirty(sv);
+	sv->sv_sizedirty = false;
+}
+
+/*
+ * Write a size noted by sfs_size_extend back to the on-disk inode.
+ *
+ * Locking: must hold the vnode lock.
+ *
+ * Requires 1 buffer.
+ */
+int
+sfs_size_sync(struct sfs_vnode *sv)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (!sv->sv_sizedirty) {
+		return 0;
+	}
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	sfs_size_set(sv, sv->sv_size);
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+/*
+ * Finish off an erased file: free its inode (unless FREEINO is
+ * false), take the vnode out of the table, and destroy it.
+ *
+ * Locking: must hold the vnode lock and sfs_vnlock; releases both.
+ */
+static
+void
+sfs_vnode_discard(struct sfs_fs *sfs, struct sfs_vnode *sv, bool freeino)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (freeino) {
+		buffer_drop(&sfs->sfs_absfs, sv->sv_ino, SFS_BLOCKSIZE);
+		sfs_bfree(sfs, sv->sv_ino);
+	}
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vntable_remove(sfs, sv);
+
+	vnode_cleanup(&sv->sv_absvn);
+
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+
+	sfs_vnode_destroy(sv);
+}
+
+/*
+ * Erase a deleted file handed to the reaper by sfs_reclaim: free its
+ * blocks, SFS_REAP_BATCH at a time so the freemap isn't held for the
+ * whole file at once, then its inode, and destroy the vnode. The
+ * reaper owns its one reference and nothing else can find it, so
+ * there's no hurry.
+ *
+ * If freeing the blocks fails, the inode is left allocated (with no
+ * links) for sfsck to clean up, as after a crash.
+ *
+ * Locking: gets/releases the vnode lock and sfs_vnlock, and freemap
+ *    locks.
+ *
+ * Requires 4 buffers.
+ */
+void
+sfs_reap_vnode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *iptr;
+	uint32_t size;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	size = 0;
+	result = sfs_dinode_load(sv);
+	if (result == 0) {
+		iptr = sfs_dinode_map(sv);
+		KASSERT(iptr->sfi_linkcount == 0);
+		size = sfs_size(sv);
+		sfs_dinode_unload(sv);
+	}
+
+	/* Cut it down from the end, one batch per truncate */
+	while (result == 0 && size > 0) {
+		if (size > SFS_REAP_BATCH * SFS_BLOCKSIZE) {
+			size -= SFS_REAP_BATCH * SFS_BLOCKSIZE;
+		}
+		else {
+			size = 0;
+		}
+		result = sfs_itrunc(sv, size);
+	}
+	if (result) {
+		kprintf("sfs: %s: erasing inode %u: %s\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, strerror(result));
+	}
+
+	sfs_bunreserve(sv);
+	unreserve_buffers(SFS_BLOCKSIZE);
+
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnode_discard(sfs, sv, result == 0);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
+ * If the file has been deleted, erase it and destroy the vnode, or
+ * for a big file hand it to the reaper to do that in the background;
+ * otherwise keep the vnode in the table for reuse (see above).
  *
  * This function should try to avoid returning errors other than EBUSY.
  *
  * Locking: gets/releases vnode lock. Gets/releases sfs_vnlock, and
- *    possibly also sfs_freemaplock, while holding the vnode lock.
+ *    possibly also freemap locks, while holding the vnode lock.
  *
  * Requires 1 buffer locally but may also afterward call sfs_itrunc,
  * which takes 4.
@@ -188,8 +622,7 @@ sfs_reclaim(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_dinode *iptr;
-	unsigned ix, i, num;
-	bool buffers_needed;
+	bool buffers_needed, erased;
 	int result;
 
 	lock_acquire(sv->sv_lock);
@@ -200,19 +633,12 @@ sfs_reclaim(struct vnode *v)
 	 * decision was made to reclaim it. (This must interact
 	 * properly with sfs_loadvnode.)
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		spinlock_release(&v->vn_countlock);
+	if (!vnode_lastref(v)) {
+		/* it consumed the reference VOP_DECREF gave us */
 		lock_release(sfs->sfs_vnlock);
 		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
-	spinlock_release(&v->vn_countlock);
 
 	/*
 	 * This grossness arises because reclaim gets called via
@@ -241,8 +667,30 @@ sfs_reclaim(struct vnode *v)
 	}
 	iptr = sfs_dinode_map(sv);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (iptr->sfi_linkcount == 0) {
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it. Otherwise it goes on the list of vnodes kept for reuse.
+	 *
+	 * A big file goes to the reaper instead, which takes over the
+	 * reference VOP_DECREF gave us; it stays in the table until
+	 * it's gone, so its inode number isn't reused meanwhile.
+	 */
+	erased = false;
+	if (iptr->sfi_linkcount == 0 &&
+	    DIVROUNDUP(sfs_size(sv), SFS_BLOCKSIZE) > SFS_REAP_MINBLOCKS &&
+	    sfs_reap_add(sfs, sv)) {
+		/* Blocks waiting for delayed allocation never need one */
+		sfs_dalloc_discard(sv, 0);
+		sfs_dinode_unload(sv);
+		sfs_bunreserve(sv);
+		if (buffers_needed) {
+			unreserve_buffers(SFS_BLOCKSIZE);
+		}
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return 0;
+	}
+	else if (iptr->sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
 			sfs_dinode_unload(sv);
@@ -254,41 +702,44 @@ sfs_reclaim(struct vnode *v)
 			return result;
 		}
 		sfs_dinode_unload(sv);
-		/* Discard the inode */
-		buffer_drop(&sfs->sfs_absfs, sv->sv_ino, SFS_BLOCKSIZE);
-		sfs_bfree(sfs, sv->sv_ino);
+		erased = true;
 	}
 	else {
+		/* Place any blocks still waiting for delayed allocation */
+		result = sfs_dalloc_flush(sv);
 		sfs_dinode_unload(sv);
+		if (result) {
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
+			if (buffers_needed) {
+				unreserve_buffers(SFS_BLOCKSIZE);
+			}
+			return result;
+		}
 	}
 
+	/* Give back any blocks set aside for the file to grow into */
+	sfs_bunreserve(sv);
+
 	if (buffers_needed) {
 		unreserve_buffers(SFS_BLOCKSIZE);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	if (!erased) {
+		/*
+		 * Keep it for reuse. The table now owns the reference
+		 * VOP_DECREF gave us. Make room first so as not to
+		 * throw this one straight back out.
+		 */
+		sfs_vncache_trim(sfs, SFS_VNCACHE_MAX - 1);
+		sfs_vncache_add(sfs, sv);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return 0;
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
-	vnode_cleanup(&sv->sv_absvn);
 
-	lock_release(sfs->sfs_vnlock);
-	lock_release(sv->sv_lock);
-
-	sfs_vnode_destroy(sv);
+	/* Discard the inode and the vnode */
+	sfs_vnode_discard(sfs, sv, true);
 
 	/* Done */
 	return 0;
@@ -308,43 +759,38 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	struct buf *dinobuf;
 	struct sfs_dinode *dino;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
 	/* sfs_vnlock protects the vnodes table */
 	lock_acquire(sfs->sfs_vnlock);
 
 	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_cached) {
+			/* Unused; take over the table's reference */
+			sfs_vncache_remove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			lock_release(sfs->sfs_vnlock);
-
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -380,6 +826,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(dino->sfi_type == SFS_TYPE_INVAL);
 		dino->sfi_type = forcetype;
+		if (sfs->sfs_sb.sb_flags & SFS_SBF_EXTENTS) {
+			dino->sfi_flags = SFS_DIF_EXTENTS;
+		}
+		if (forcetype == SFS_TYPE_FILE &&
+		    (sfs->sfs_sb.sb_flags & SFS_SBF_INLINE)) {
+			dino->sfi_flags |= SFS_DIF_INLINE;
+		}
 		buffer_mark_dirty(dinobuf);
 	}
 
@@ -413,6 +866,10 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
+	if (forcetype != SFS_TYPE_INVAL) {
+		/* a new inode has to be written for its data to be found */
+		sv->sv_mapdirty = true;
+	}
 
 	buffer_release(dinobuf);
 
@@ -425,7 +882,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	result = sfs_vntable_add(sfs, sv);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
 		sfs_vnode_destroy(sv);
@@ -440,19 +897,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
- * Always hands back vnode "locked and loaded"
+ * Create a new filesystem object in the directory DIR and hand back
+ * its vnode. Always hands back vnode "locked and loaded"
+ *
+ * The inode goes as close as it can to DIR's own inode, so it's in
+ * DIR's allocation group, near its siblings; the object's first data
+ * blocks then go right after the inode (see sfs_balloc_file). Walking
+ * a directory and statting what's in it thus stays mostly within one
+ * stretch of the disk.
  *
  * As a matter of convenience, returns the vnode with its inode loaded.
  *
- * Locking: Gets/release sfs_freemaplock.
+ * Locking: Gets/releases an allocation group lock.
  *    Also gets/releases sfs_vnlock, but does not hold them together.
  *
  * Requires up to 3 buffers as sfs_loadvnode might trigger reclaim and
  * truncate.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	struct sfs_dinode *dino;
@@ -463,7 +927,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino, NULL);
+	result = sfs_balloc_goal(sfs, dir->sv_ino, &ino, NULL);
 	if (result) {
 		return result;
 	}
@@ -56,11 +56,16 @@
 
 /*
  * Read or write a block, retrying I/O errors.
+ *
+ * If the journal is on a device of its own, journal blocks go there
+ * instead; see kern/sfs.h for how they're numbered.
  */
 static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
+	struct device *dev;
+	daddr_t block;
 	int result;
 	int tries=0;
 
@@ -68,8 +73,19 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
 
+	dev = sfs->sfs_device;
+	block = uio->uio_offset / SFS_BLOCKSIZE;
+	if (sfs->sfs_jdevice != NULL && sfs_block_is_journal(sfs, block)) {
+		KASSERT(sfs_block_is_journal(sfs, block +
+				uio->uio_resid / SFS_BLOCKSIZE - 1));
+		uio->uio_offset += ((off_t)SFS_JDEV_JOURNALSTART -
+				    sfs->sfs_sb.sb_journalstart) *
+			SFS_BLOCKSIZE;
+		dev = sfs->sfs_jdevice;
+	}
+
  retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
+	result = DEVOP_IO(dev, uio);
 	if (result == EINVAL) {
 		/*
 		 * This means the sector we requested was out of range,
@@ -102,7 +118,9 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block. LEN may be any multiple of the block size, in which
+ * case we read that many contiguous blocks starting at BLOCK in one
+ * transfer.
  */
 int
 sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
@@ -111,14 +129,16 @@ sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIOLEN(&iov, &ku, data, block, len, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block. As with sfs_readblock, LEN may cover several
+ * contiguous blocks; but journal blocks have to be written one at a
+ * time, so that they can be written in order.
  */
 int
 sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
@@ -130,11 +150,12 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	bool isjournal;
 	int result;
 
-	(void)fsbufdata;
-
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
 	isjournal = sfs_block_is_journal(sfs, block);
+	KASSERT(!isjournal || len == SFS_BLOCKSIZE);
+	KASSERT(isjournal || !sfs_block_is_journal(sfs,
+				block + len / SFS_BLOCKSIZE - 1));
 
 	if (isjournal) {
 		/*
@@ -160,8 +181,15 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 			return result;
 		}
 	}
+	else {
+		/* Write-ahead: the journal records go to disk first. */
+		result = sfs_ckpt_prewrite(sfs, &fsbufdata, 1);
+		if (result) {
+			return result;
+		}
+	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIOLEN(&iov, &ku, data, block, len, UIO_WRITE);
 	result = sfs_rwblock(sfs, &ku);
 	if (result) {
 		return result;
@@ -170,7 +198,101 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	if (isjournal) {
 		sfs_wrote_journal_block(sfs, block);
 	}
+	else {
+		sfs_ckpt_postwrite(sfs, fsbufdata);
+	}
+
+	return 0;
+}
+
+/*
+ * Read several consecutive blocks into separate buffers in one
+ * transfer. As with sfs_writeblocks, buffers bigger than a block
+ * aren't contiguous, so refuse them.
+ */
+int
+sfs_readblocks(struct fs *fs, daddr_t block, unsigned nblocks,
+	       void **data, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct iovec iov[FS_READBLOCKS_MAX];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(nblocks > 0 && nblocks <= FS_READBLOCKS_MAX);
+
+	if (len != SFS_BLOCKSIZE) {
+		return ENOSYS;
+	}
+	for (i=0; i<nblocks; i++) {
+		iov[i].iov_kbase = data[i];
+		iov[i].iov_len = len;
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = nblocks;
+	ku.uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku.uio_resid = nblocks * len;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+	ku.uio_direct = false;
+	ku.uio_dsync = false;
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Write a cluster of consecutive blocks in one transfer.
+ *
+ * Journal blocks have to go through sfs_writeblock so they get
+ * written in order, and buffers bigger than a block aren't
+ * contiguous when their block numbers are consecutive; refuse both
+ * and let the buffer cache write them individually.
+ */
+int
+sfs_writeblocks(struct fs *fs, daddr_t block, unsigned nblocks,
+		void **fsbufdata, void **data, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct iovec iov[FS_WRITEBLOCKS_MAX];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(nblocks > 0 && nblocks <= FS_WRITEBLOCKS_MAX);
+
+	if (len != SFS_BLOCKSIZE) {
+		return ENOSYS;
+	}
+	for (i=0; i<nblocks; i++) {
+		if (sfs_block_is_journal(sfs, block + i)) {
+			return ENOSYS;
+		}
+		iov[i].iov_kbase = data[i];
+		iov[i].iov_len = len;
+	}
+	result = sfs_ckpt_prewrite(sfs, fsbufdata, nblocks);
+	if (result) {
+		return result;
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = nblocks;
+	ku.uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku.uio_resid = nblocks * len;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+	ku.uio_direct = false;
+	ku.uio_dsync = false;
+	result = sfs_rwblock(sfs, &ku);
+	if (result) {
+		return result;
+	}
 
+	for (i=0; i<nblocks; i++) {
+		sfs_ckpt_postwrite(sfs, fsbufdata[i]);
+	}
 	return 0;
 }
 
@@ -178,6 +300,111 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 //
 // File-level I/O
 
+/*
+ * Mark BUF, which holds part of SV or of its block map, dirty, and
+ * put it on SV's list of dirty buffers so fsync will write it.
+ */
+void
+sfs_buffer_dirty(struct sfs_vnode *sv, struct buf *buf)
+{
+	buffer_mark_dirty(buf);
+	buffer_set_owner(buf, sv->sv_bufowner);
+}
+
+/*
+ * Note that fsync on SV has to flush the journal through LSN.
+ */
+void
+sfs_synclsn_note(struct sfs_vnode *sv, sfs_lsn_t lsn)
+{
+	spinlock_acquire(&sv->sv_rangelock);
+	if (lsn > sv->sv_synclsn) {
+		sv->sv_synclsn = lsn;
+	}
+	spinlock_release(&sv->sv_rangelock);
+}
+
+/*
+ * Most blocks an O_DIRECT read moves in one transfer.
+ */
+#define SFS_DIRECT_MAX	32
+
+/*
+ * Whether a whole-block transfer can skip the buffer cache and go
+ * straight between the disk and the uio. That's only for files
+ * opened with O_DIRECT, and not in data journaling mode, where file
+ * data has to go through the journal.
+ */
+static
+bool
+sfs_direct_ok(struct sfs_fs *sfs, struct uio *uio)
+{
+	return uio->uio_direct && sfs->sfs_jmode != SFS_JMODE_DATA;
+}
+
+/*
+ * Transfer NBLOCKS whole file blocks, which are the consecutive disk
+ * blocks starting at DISKBLOCK, directly between the disk and the
+ * uio, for O_DIRECT. This saves copying the data through the buffer
+ * cache, and keeps it from displacing blocks that are cached.
+ *
+ * A cached copy of a block being read may be newer than the disk, so
+ * it's written out first. Cached copies of blocks being written are
+ * about to be stale, so they're dropped, both before (so no pending
+ * write-back of one lands after ours) and after (in case a reader
+ * brought the old contents back in meanwhile).
+ *
+ * Locking: as for whatever would otherwise have done the I/O through
+ *    the buffer cache.
+ *
+ * Requires 0 buffers.
+ */
+static
+int
+sfs_directio(struct sfs_fs *sfs, daddr_t diskblock, uint32_t nblocks,
+	     struct uio *uio)
+{
+	off_t fileoffset;
+	size_t len, rest;
+	uint32_t i;
+	int result;
+
+	len = nblocks * SFS_BLOCKSIZE;
+	KASSERT(uio->uio_resid >= len);
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+
+	for (i=0; i<nblocks; i++) {
+		if (uio->uio_rw == UIO_READ) {
+			result = buffer_flush(&sfs->sfs_absfs, diskblock + i,
+					      SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			buffer_drop(&sfs->sfs_absfs, diskblock + i,
+				    SFS_BLOCKSIZE);
+		}
+	}
+
+	/* Point the uio at the disk for the transfer, then back */
+	fileoffset = uio->uio_offset;
+	rest = uio->uio_resid - len;
+	uio->uio_offset = ((off_t)diskblock) * SFS_BLOCKSIZE;
+	uio->uio_resid = len;
+	result = sfs_rwblock(sfs, uio);
+	uio->uio_offset = fileoffset + (len - uio->uio_resid);
+	uio->uio_resid += rest;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		for (i=0; i<nblocks; i++) {
+			buffer_drop(&sfs->sfs_absfs, diskblock + i,
+				    SFS_BLOCKSIZE);
+		}
+	}
+	return result;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -188,6 +415,10 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
  * the sector; LEN is the number of bytes to actually read or write.
  * UIO is the area to do the I/O into.
  *
+ * Locking: for writes, must hold the vnode lock. For reads, must hold
+ *    the vnode's I/O lock for reading instead, and gets/releases the
+ *    vnode lock around mapping the block.
+ *
  * Requires up to 2 buffers.
  */
 static
@@ -196,23 +427,45 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	struct buf *iobuffer;
+	struct buf *iobuffer, *dabuf;
 	char *ioptr;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	bool streaming;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(doalloc ? lock_do_i_hold(sv->sv_lock) :
+		rwlock_do_i_hold(sv->sv_rwlock));
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Get the disk block number; or, for a new block of a file,
+	 * maybe a buffer to hold it until it gets one (see sfs_dalloc.c).
+	 */
+	if (doalloc && sv->sv_type == SFS_TYPE_FILE) {
+		result = sfs_dalloc_bmap(sv, fileblock, &diskblock, &dabuf);
+		if (result == 0 && dabuf != NULL) {
+			ioptr = buffer_map(dabuf);
+			return uiomove(ioptr+skipstart, len, uio);
+		}
+		streaming = false;
+	}
+	else if (doalloc) {
+		result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+		streaming = false;
+	}
+	else {
+		lock_acquire(sv->sv_lock);
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		streaming = sv->sv_rawindow != 0;
+		lock_release(sv->sv_lock);
+	}
 	if (result) {
 		return result;
 	}
@@ -237,6 +490,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 			return result;
 		}
 	}
+	buffer_set_kind(iobuffer, BUFKIND_DATA);
+	if (streaming) {
+		buffer_set_streaming(iobuffer);
+	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
@@ -249,10 +506,13 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	}
 
 	/*
-	 * If it was a write, mark the modified block dirty.
+	 * If it was a write, mark the modified block dirty, and let
+	 * the journaling mode have at it.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
 		buffer_mark_dirty(iobuffer);
+		return sfs_data_release(sv, iobuffer, diskblock,
+					skipstart, len);
 	}
 
 	buffer_release(iobuffer);
@@ -262,7 +522,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 /*
  * Do I/O (either read or write) of a single whole block.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: must hold vnode lock. May get/release freemap locks.
  *
  * Requires up to 2 buffers.
  */
@@ -271,7 +531,7 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	struct buf *iobuf;
+	struct buf *iobuf, *dabuf, *newbuf;
 	void *ioptr;
 	daddr_t diskblock;
 	uint32_t fileblock;
@@ -283,8 +543,24 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number (or delay allocating it). A
+	 * new block doesn't need zeroing, as we're overwriting it all.
+	 */
+	newbuf = NULL;
+	if (doalloc && sv->sv_type == SFS_TYPE_FILE) {
+		result = sfs_dalloc_bmap(sv, fileblock, &diskblock, &dabuf);
+		if (result == 0 && dabuf != NULL) {
+			ioptr = buffer_map(dabuf);
+			return uiomove(ioptr, SFS_BLOCKSIZE, uio);
+		}
+	}
+	else if (doalloc) {
+		result = sfs_bmap_fill(sv, fileblock, &diskblock, &newbuf);
+	}
+	else {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+	}
 	if (result) {
 		return result;
 	}
@@ -300,7 +576,15 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	if (uio->uio_rw == UIO_READ) {
+	if (newbuf == NULL && sfs_direct_ok(sfs, uio)) {
+		return sfs_directio(sfs, diskblock, 1, uio);
+	}
+
+	if (newbuf != NULL) {
+		iobuf = newbuf;
+		result = 0;
+	}
+	else if (uio->uio_rw == UIO_READ) {
 		result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
 				     &iobuf);
 	}
@@ -311,6 +595,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	if (result) {
 		return result;
 	}
+	buffer_set_kind(iobuf, BUFKIND_DATA);
 
 	/*
 	 * Do the I/O into the buffer.
@@ -318,6 +603,12 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	ioptr = buffer_map(iobuf);
 	result = uiomove(ioptr, SFS_BLOCKSIZE, uio);
 	if (result) {
+		if (newbuf != NULL) {
+			/* the block is in the file now; it can't be junk */
+			bzero(ioptr, SFS_BLOCKSIZE);
+			buffer_mark_valid(iobuf);
+			buffer_mark_dirty(iobuf);
+		}
 		buffer_release(iobuf);
 		return result;
 	}
@@ -325,18 +616,348 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	if (uio->uio_rw == UIO_WRITE) {
 		buffer_mark_valid(iobuf);
 		buffer_mark_dirty(iobuf);
+		return sfs_data_release(sv, iobuf, diskblock,
+					0, SFS_BLOCKSIZE);
 	}
 
 	buffer_release(iobuf);
 	return 0;
 }
 
+/*
+ * Read some of the next NBLOCKS whole blocks, handing back in DONE
+ * how many. If the first block is in a hole, the whole hole (as far
+ * as it goes within NBLOCKS) reads as zeros in one step without
+ * looking at the blocks one at a time. Otherwise this reads the run
+ * of mapped blocks that starts there, up to BUFFER_MANY_MAX, getting
+ * all the buffers at once so that consecutive disk blocks that
+ * aren't cached are read in one transfer. If the file is being read
+ * sequentially, tell the buffer cache so it can keep the blocks from
+ * displacing more useful ones. For O_DIRECT, the run goes only as
+ * far as the blocks are consecutive on disk (up to SFS_DIRECT_MAX)
+ * and is read straight into the uio without the buffer cache.
+ *
+ * Locking: must hold the vnode's I/O lock for reading. Gets/releases
+ *    the vnode lock while mapping the blocks; the reads themselves
+ *    happen without it, so readers of the same file can overlap.
+ *
+ * Requires up to BUFFER_MANY_MAX buffers (2 at a time for sfs_bmap
+ * beforehand).
+ */
+static
+int
+sfs_blockreads(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks,
+	       uint32_t *done)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblocks[BUFFER_MANY_MAX];
+	struct buf *iobufs[BUFFER_MANY_MAX];
+	uint32_t fileblock, holelen, i, n;
+	daddr_t diskblock, nextblock;
+	bool streaming;
+	int result;
+
+	KASSERT(rwlock_do_i_hold(sv->sv_rwlock));
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(nblocks > 0);
+
+	lock_acquire(sv->sv_lock);
+
+	/* an open read-ahead window means we're in a sequential pass */
+	streaming = sv->sv_rawindow != 0;
+
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	result = sfs_bmap_hole(sv, fileblock, &diskblock, &holelen);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	if (diskblock == 0) {
+		lock_release(sv->sv_lock);
+		n = holelen < nblocks ? holelen : nblocks;
+		*done = n;
+		return uiomovezeros(n * SFS_BLOCKSIZE, uio);
+	}
+
+	if (sfs_direct_ok(sfs, uio)) {
+		/* as much of the run as is contiguous on disk, too */
+		if (nblocks > SFS_DIRECT_MAX) {
+			nblocks = SFS_DIRECT_MAX;
+		}
+		for (n=1; n<nblocks; n++) {
+			result = sfs_bmap(sv, fileblock + n, false,
+					  &nextblock);
+			if (result) {
+				lock_release(sv->sv_lock);
+				return result;
+			}
+			if (nextblock != diskblock + n) {
+				break;
+			}
+		}
+		lock_release(sv->sv_lock);
+		*done = n;
+		return sfs_directio(sfs, diskblock, n, uio);
+	}
+
+	if (nblocks > BUFFER_MANY_MAX) {
+		nblocks = BUFFER_MANY_MAX;
+	}
+	diskblocks[0] = diskblock;
+	for (n=1; n<nblocks; n++) {
+		result = sfs_bmap(sv, fileblock + n, false, &diskblocks[n]);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+		if (diskblocks[n] == 0) {
+			/* leave the hole for next time */
+			break;
+		}
+	}
+
+	lock_release(sv->sv_lock);
+
+	result = buffer_read_many(&sfs->sfs_absfs, diskblocks, n,
+				  SFS_BLOCKSIZE, iobufs);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		buffer_set_kind(iobufs[i], BUFKIND_DATA);
+		if (streaming) {
+			buffer_set_streaming(iobufs[i]);
+		}
+		if (result == 0) {
+			result = uiomove(buffer_map(iobufs[i]), SFS_BLOCKSIZE,
+					 uio);
+		}
+		buffer_release(iobufs[i]);
+	}
+	*done = n;
+	return result;
+}
+
+/*
+ * Start read-ahead after a read of the file blocks from FIRSTBLOCK
+ * up to the uio's current offset. SIZE is the file size.
+ *
+ * A read is sequential if it starts in the block where the previous
+ * one left off. Sequential reads grow the window; we then queue
+ * whatever part of the window past the end of this read hasn't
+ * been queued already. Anything else resets the window.
+ *
+ * Holes and bmap failures are skipped; read-ahead is only a hint.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers (for sfs_bmap).
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t firstblock, struct uio *uio,
+	      off_t size)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t nextblock, start, end, eofblock, fileblock;
+	daddr_t diskblock;
+	bool sequential;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sequential = (firstblock == sv->sv_ranext);
+	nextblock = uio->uio_offset / SFS_BLOCKSIZE;
+	sv->sv_ranext = nextblock;
+	sv->sv_rawindow = buffer_readahead_window(sv->sv_rawindow,
+						  sequential);
+	if (sv->sv_rawindow == 0) {
+		sv->sv_raend = 0;
+		return;
+	}
+
+	/* Start at the first block this read didn't touch */
+	start = DIVROUNDUP(uio->uio_offset, SFS_BLOCKSIZE);
+	if (start < sv->sv_raend) {
+		start = sv->sv_raend;
+	}
+	end = nextblock + sv->sv_rawindow;
+	eofblock = DIVROUNDUP(size, SFS_BLOCKSIZE);
+	if (end > eofblock) {
+		end = eofblock;
+	}
+
+	for (fileblock = start; fileblock < end; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(&sfs->sfs_absfs, diskblock,
+					 SFS_BLOCKSIZE);
+		}
+	}
+	if (fileblock > sv->sv_raend) {
+		sv->sv_raend = fileblock;
+	}
+}
+
+/*
+ * Read a whole region of data, whether or not it's block-aligned.
+ *
+ * The I/O lock (held for reading) keeps the file from being truncated
+ * or extended meanwhile, so the blocks found by mapping stay the
+ * file's and the size found at the start stays right. The vnode lock
+ * covers only the inode and the block map; the data is read and
+ * copied out without it.
+ *
+ * Locking: must hold the vnode's I/O lock for reading but not the
+ *    vnode lock, which it gets/releases. May get/release freemap
+ *    locks.
+ *
+ * Requires up to 1 + BUFFER_MANY_MAX buffers.
+ */
+static
+int
+sfs_readio(struct sfs_vnode *sv, struct uio *uio)
+{
+	uint32_t blkoff;
+	uint32_t nblocks, i, n;
+	int result = 0;
+	uint32_t extraresid = 0;
+	uint32_t firstblock;
+	struct sfs_dinode *inodeptr;
+	off_t size, endpos;
+
+	KASSERT(rwlock_do_i_hold(sv->sv_rwlock));
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
+
+	lock_acquire(sv->sv_lock);
+
+	/* Reads only look on disk, so place any pending blocks first */
+	if (sv->sv_danum > 0) {
+		result = sfs_dalloc_flush(sv);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	size = sfs_size(sv);
+
+	/* An inline file's data is right here */
+	if (inodeptr->sfi_flags & SFS_DIF_INLINE) {
+		result = sfs_inline_read(sv, uio);
+		sfs_dinode_unload(sv);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+	sfs_dinode_unload(sv);
+
+	lock_release(sv->sv_lock);
+
+	/*
+	 * Check for EOF. If we can read a partial area, remember how
+	 * much extra there was in EXTRARESID so we can add it back to
+	 * uio_resid at the end.
+	 */
+	endpos = uio->uio_offset + uio->uio_resid;
+	if (uio->uio_offset >= size) {
+		/* At or past EOF - just return */
+		return 0;
+	}
+	if (endpos > size) {
+		extraresid = endpos - size;
+		KASSERT(uio->uio_resid > extraresid);
+		uio->uio_resid -= extraresid;
+	}
+
+	/*
+	 * First, do any leading partial block.
+	 */
+	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	if (blkoff != 0) {
+		/* Number of bytes at beginning of block to skip */
+		uint32_t skip = blkoff;
+
+		/* Number of bytes to read after that point */
+		uint32_t len = SFS_BLOCKSIZE - blkoff;
+
+		/* ...which might be less than the rest of the block */
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		result = sfs_partialio(sv, uio, skip, len);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* If we're done, quit. */
+	if (uio->uio_resid==0) {
+		goto out;
+	}
+
+	/*
+	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 */
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	for (i=0; i<nblocks; i+=n) {
+		result = sfs_blockreads(sv, uio, nblocks - i, &n);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/*
+	 * Now do any remaining partial block at the end.
+	 */
+	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+
+	if (uio->uio_resid > 0) {
+		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
+		if (result) {
+			goto out;
+		}
+	}
+
+ out:
+
+	/* If it worked, start read-ahead (O_DIRECT doesn't want it) */
+	if (result == 0 && !uio->uio_direct) {
+		lock_acquire(sv->sv_lock);
+		sfs_readahead(sv, firstblock, uio, size);
+		lock_release(sv->sv_lock);
+	}
+
+	/* Add in any extra amount we couldn't read because of EOF */
+	uio->uio_resid += extraresid;
+
+	/* Done */
+	return result;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: for reads, see sfs_readio. For writes, must hold the vnode
+ *    lock, and the I/O lock: for writing if the write might extend
+ *    the file, otherwise for reading. (sfs_write uses sfs_overwrite
+ *    for the latter.) May get/release freemap locks.
  *
- * Requires up to 3 buffers.
+ * Requires up to 1 + BUFFER_MANY_MAX buffers.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
@@ -344,9 +965,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
-	uint32_t origresid, extraresid = 0;
+	uint32_t origresid;
 	struct sfs_dinode *inodeptr;
 
+	if (uio->uio_rw == UIO_READ) {
+		return sfs_readio(sv, uio);
+	}
+
+	KASSERT(rwlock_do_i_hold(sv->sv_rwlock));
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
@@ -357,27 +983,20 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 	inodeptr = sfs_dinode_map(sv);
 
-	/*
-	 * If reading, check for EOF. If we can read a partial area,
-	 * remember how much extra there was in EXTRARESID so we can
-	 * add it back to uio_resid at the end.
-	 */
-	if (uio->uio_rw == UIO_READ) {
-		off_t size, endpos;
-
-		size = inodeptr->sfi_size;
-		endpos = uio->uio_offset + uio->uio_resid;
+	/* Growing the file needs the I/O lock to ourselves */
+	KASSERT(uio->uio_offset + uio->uio_resid <= sfs_size(sv) ||
+		rwlock_do_i_hold_write(sv->sv_rwlock));
 
-		if (uio->uio_offset >= size) {
-			/* At or past EOF - just return */
-			sfs_dinode_unload(sv);
-			return 0;
+	/* Small enough to keep inline? If not, move the data out. */
+	if (inodeptr->sfi_flags & SFS_DIF_INLINE) {
+		KASSERT(rwlock_do_i_hold_write(sv->sv_rwlock));
+		if (uio->uio_offset + uio->uio_resid <= SFS_INLINE_MAX) {
+			result = sfs_inline_write(sv, uio);
+			goto out;
 		}
-
-		if (endpos > size) {
-			extraresid = endpos - size;
-			KASSERT(uio->uio_resid > extraresid);
-			uio->uio_resid -= extraresid;
+		result = sfs_inline_promote(sv);
+		if (result) {
+			goto out;
 		}
 	}
 
@@ -389,7 +1008,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
-		/* Number of bytes to read/write after that point */
+		/* Number of bytes to write after that point */
 		uint32_t len = SFS_BLOCKSIZE - blkoff;
 
 		/* ...which might be less than the rest of the block */
@@ -435,22 +1054,126 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
-	/* If writing and we did anything, adjust file length */
-	if (uio->uio_resid != origresid &&
-	    uio->uio_rw == UIO_WRITE &&
-	    uio->uio_offset > (off_t)inodeptr->sfi_size) {
-		inodeptr->sfi_size = uio->uio_offset;
-		sfs_dinode_mark_dirty(sv);
+	/*
+	 * If we did anything, adjust file length. This only goes in
+	 * the vnode; the inode gets it when the file is flushed.
+	 */
+	if (uio->uio_resid != origresid) {
+		sfs_size_extend(sv, uio->uio_offset);
 	}
 	sfs_dinode_unload(sv);
 
-	/* Add in any extra amount we couldn't read because of EOF */
-	uio->uio_resid += extraresid;
-
 	/* Done */
 	return result;
 }
 
+/*
+ * Write LEN bytes at offset SKIP within one block of the file, for
+ * sfs_overwrite. The vnode lock is held only while finding the block
+ * (and, for a block waiting for delayed allocation, while filling its
+ * pending buffer, which belongs to the vnode); the block itself is
+ * written without it.
+ *
+ * Locking: must hold the I/O lock for reading and a range lock on
+ *    the block. Gets/releases the vnode lock; may get/release freemap
+ *    locks.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_overwriteblock(struct sfs_vnode *sv, struct uio *uio,
+		   uint32_t skip, uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf, *dabuf;
+	daddr_t diskblock;
+	uint32_t fileblock;
+	int result;
+
+	KASSERT(skip + len <= SFS_BLOCKSIZE);
+
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dalloc_bmap(sv, fileblock, &diskblock, &dabuf);
+	if (result == 0 && dabuf != NULL) {
+		result = uiomove((char *)buffer_map(dabuf) + skip, len, uio);
+	}
+	lock_release(sv->sv_lock);
+	if (result || dabuf != NULL) {
+		return result;
+	}
+	KASSERT(diskblock != 0);
+
+	if (len == SFS_BLOCKSIZE && sfs_direct_ok(sfs, uio)) {
+		return sfs_directio(sfs, diskblock, 1, uio);
+	}
+
+	/* As in sfs_partialio and sfs_blockio */
+	if (len < SFS_BLOCKSIZE) {
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     SFS_BLOCKSIZE, &iobuf);
+	}
+	else {
+		result = buffer_get(&sfs->sfs_absfs, diskblock,
+				    SFS_BLOCKSIZE, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
+	buffer_set_kind(iobuf, BUFKIND_DATA);
+
+	result = uiomove((char *)buffer_map(iobuf) + skip, len, uio);
+	if (result) {
+		buffer_release(iobuf);
+		return result;
+	}
+
+	if (len == SFS_BLOCKSIZE) {
+		buffer_mark_valid(iobuf);
+	}
+	buffer_mark_dirty(iobuf);
+	return sfs_data_release(sv, iobuf, diskblock, skip, len);
+}
+
+/*
+ * Write to a regular file entirely within its current size. Unlike
+ * sfs_io, this doesn't hold the vnode lock throughout, so writes to
+ * different blocks of one file (under different range locks) can
+ * proceed at the same time. The size doesn't change, so the inode
+ * isn't touched except by block allocation.
+ *
+ * Locking: must hold the I/O lock for reading and a range lock on
+ *    all the blocks being written, but not the vnode lock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_overwrite(struct sfs_vnode *sv, struct uio *uio)
+{
+	uint32_t skip, len;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(sv->sv_type == SFS_TYPE_FILE);
+	KASSERT(rwlock_do_i_hold(sv->sv_rwlock));
+	KASSERT(!lock_do_i_hold(sv->sv_lock));
+
+	while (uio->uio_resid > 0) {
+		skip = uio->uio_offset % SFS_BLOCKSIZE;
+		len = SFS_BLOCKSIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		result = sfs_overwriteblock(sv, uio, skip, len);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 // Metadata I/O
 
@@ -530,13 +1253,13 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	else {
 		/* Update the selected region */
 		memcpy(ioptr + blockoffset, data, len);
-		buffer_mark_dirty(iobuf);
+		sfs_buffer_dirty(sv, iobuf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)dino->sfi_size) {
 			dino->sfi_size = endpos;
-			sfs_dinode_mark_dirty(sv);
+			sfs_dinode_mark_mapdirty(sv);
 		}
 	}
 
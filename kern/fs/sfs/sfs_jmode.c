@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS journaling modes.
+ *
+ * Metadata always goes through the journal; the mode says what
+ * happens to file data, which on its own reaches the disk whenever
+ * the buffer cache gets around to writing it:
+ *
+ *    writeback  Nothing more. Cheapest, but after a crash a file can
+ *               have blocks that were allocated and recovered from
+ *               the journal but whose contents never got written.
+ *
+ *    ordered    Data blocks written since the last commit are
+ *               remembered, and written back as one batch, in block
+ *               order, right before the journal is flushed to commit.
+ *               Recovered metadata then never points at stale data.
+ *               (This is the default.)
+ *
+ *    data       Data writes are logged like metadata, as
+ *               SFS_JREC_DATA records, and the buffers pin the
+ *               journal until they're written back. Safest and most
+ *               expensive: everything is written twice.
+ *
+ * The mode is per mount and can be changed while mounted.
+ *
+ * Commits happen at sync time and once a second from the
+ * checkpointer thread.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Most data blocks remembered for ordered mode before writing them. */
+#define SFS_ORDERED_MAX	64
+
+/*
+ * Data blocks to write back at the next commit (ordered mode).
+ */
+struct sfs_ordered {
+	struct spinlock so_lock;		/* lock for the following */
+	daddr_t so_blocks[SFS_ORDERED_MAX];	/* blocks, unsorted */
+	unsigned so_num;			/* number of blocks */
+	sfs_lsn_t so_commitlsn;			/* next LSN at last commit */
+};
+
+static const char *const sfs_jmode_names[] = {
+	[SFS_JMODE_WRITEBACK] = "writeback",
+	[SFS_JMODE_ORDERED] = "ordered",
+	[SFS_JMODE_DATA] = "data",
+};
+
+/*
+ * Look up a mode by name.
+ */
+int
+sfs_jmode_byname(const char *name, unsigned *ret)
+{
+	unsigned i;
+
+	for (i=0; i<ARRAYCOUNT(sfs_jmode_names); i++) {
+		if (!strcmp(name, sfs_jmode_names[i])) {
+			*ret = i;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/*
+ * Get a mode's name.
+ */
+const char *
+sfs_jmode_name(unsigned mode)
+{
+	KASSERT(mode < ARRAYCOUNT(sfs_jmode_names));
+	return sfs_jmode_names[mode];
+}
+
+////////////////////////////////////////////////////////////
+// ordered mode
+
+/*
+ * Remember BLOCK for the next commit. Returns true if the list is
+ * full and should be written back now.
+ */
+static
+bool
+sfs_ordered_add(struct sfs_ordered *so, daddr_t block)
+{
+	unsigned i;
+	bool full;
+
+	spinlock_acquire(&so->so_lock);
+	for (i=0; i<so->so_num; i++) {
+		if (so->so_blocks[i] == block) {
+			spinlock_release(&so->so_lock);
+			return false;
+		}
+	}
+	KASSERT(so->so_num < SFS_ORDERED_MAX);
+	so->so_blocks[so->so_num++] = block;
+	full = so->so_num == SFS_ORDERED_MAX;
+	spinlock_release(&so->so_lock);
+	return full;
+}
+
+/*
+ * Write back the data blocks remembered for ordered mode.
+ *
+ * Locking: may be called holding a vnode lock, but no buffers.
+ */
+int
+sfs_ordered_flush(struct sfs_fs *sfs)
+{
+	struct sfs_ordered *so = sfs->sfs_ordered;
+	daddr_t blocks[SFS_ORDERED_MAX];
+	daddr_t tmp;
+	unsigned num, i, j;
+	int result, ret;
+
+	spinlock_acquire(&so->so_lock);
+	num = so->so_num;
+	memcpy(blocks, so->so_blocks, num * sizeof(blocks[0]));
+	so->so_num = 0;
+	spinlock_release(&so->so_lock);
+
+	/* Sort them so the writes go in disk order (insertion sort). */
+	for (i=1; i<num; i++) {
+		tmp = blocks[i];
+		for (j=i; j>0 && blocks[j-1] > tmp; j--) {
+			blocks[j] = blocks[j-1];
+		}
+		blocks[j] = tmp;
+	}
+
+	/* Buffers that were evicted or already written back are skipped. */
+	ret = 0;
+	for (i=0; i<num; i++) {
+		result = buffer_flush(&sfs->sfs_absfs, blocks[i],
+				      SFS_BLOCKSIZE);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// hooks
+
+/*
+ * Release the busy buffer BUF, for data block BLOCK of SV, after
+ * writing LEN bytes into it at offset OFFSET and marking it dirty,
+ * doing whatever the journaling mode calls for. The buffer is put on
+ * SV's dirty list first, for fsync.
+ *
+ * Locking: must hold the vnode lock, or a range lock covering the
+ * block, so the mode can't change out from under anything important
+ * while data is being written; a race with sfs_setjmode only affects
+ * which mode this one write gets.
+ */
+int
+sfs_data_release(struct sfs_vnode *sv, struct buf *buf, daddr_t block,
+		 unsigned offset, unsigned len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	sfs_lsn_t lsn;
+	int result;
+
+	buffer_set_owner(buf, sv->sv_bufowner);
+	switch (sfs->sfs_jmode) {
+	    case SFS_JMODE_WRITEBACK:
+		buffer_release(buf);
+		return 0;
+	    case SFS_JMODE_ORDERED:
+		buffer_release(buf);
+		if (sfs_ordered_add(sfs->sfs_ordered, block)) {
+			return sfs_ordered_flush(sfs);
+		}
+		return 0;
+	    case SFS_JMODE_DATA:
+		lsn = sfs_jrec_data(sfs, block,
+				    (char *)buffer_map(buf) + offset,
+				    offset, len);
+		result = sfs_ckpt_notelsn(sfs, buf, block, lsn);
+		buffer_release(buf);
+		sfs_synclsn_note(sv, lsn);
+		return result;
+	}
+	panic("sfs: invalid journaling mode %u\n", sfs->sfs_jmode);
+}
+
+/*
+ * Commit: write back the ordered-mode data, then flush the journal.
+ * (The ordered list is empty in the other modes, unless the mode was
+ * just changed.)
+ */
+int
+sfs_jmode_commit(struct sfs_fs *sfs)
+{
+	struct sfs_ordered *so = sfs->sfs_ordered;
+	sfs_lsn_t nextlsn;
+	int result;
+
+	result = sfs_ordered_flush(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Skip the flush if nothing's been logged since last time. */
+	nextlsn = sfs_jphys_peeknextlsn(sfs);
+	spinlock_acquire(&so->so_lock);
+	if (nextlsn == so->so_commitlsn) {
+		spinlock_release(&so->so_lock);
+		return 0;
+	}
+	spinlock_release(&so->so_lock);
+
+	result = sfs_jphys_flushall(sfs);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&so->so_lock);
+	if (nextlsn > so->so_commitlsn) {
+		so->so_commitlsn = nextlsn;
+	}
+	spinlock_release(&so->so_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// setup and shutdown
+
+struct sfs_ordered *
+sfs_ordered_create(void)
+{
+	struct sfs_ordered *so;
+
+	so = kmalloc(sizeof(*so));
+	if (so == NULL) {
+		return NULL;
+	}
+	spinlock_init(&so->so_lock);
+	so->so_num = 0;
+	so->so_commitlsn = 0;
+	return so;
+}
+
+/*
+ * Destroy the ordered-mode state. Blocks still listed (if the last
+ * sync failed) are forgotten; their buffers are gone by now anyway.
+ */
+void
+sfs_ordered_destroy(struct sfs_ordered *so)
+{
+	spinlock_cleanup(&so->so_lock);
+	kfree(so);
+}
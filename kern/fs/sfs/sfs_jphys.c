@@ -34,8 +34,11 @@
 #include <synch.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
+#include <clock.h>
 #include <buf.h>
 #include <sfs.h>
+#include <ktrace.h>
 #include "sfsprivate.h"
 
 /*
@@ -57,6 +60,41 @@ struct sfs_jposition {
 	uint32_t jp_blockoffset;/* position in block */
 };
 
+/*
+ * Number of buffers for the journal blocks after the head to keep
+ * ready, so that writers can go on to the next block while the last
+ * one is on its way to disk without waiting for a buffer.
+ */
+#define SFS_JPHYS_NEXTBUFS	2
+
+/* Number of flush latency histogram buckets (powers of two, usec). */
+#define SFS_JSTATS_LATBUCKETS	16
+
+/*
+ * Journal statistics, for sfs_jphys_printstats. The record counts
+ * are protected by jp_lock, since that's held when writing records
+ * anyway; the rest by jp_lsnmaplock. They start from zero when the
+ * journal goes live.
+ */
+struct sfs_jstats {
+	struct timespec js_start;	/* when counting started */
+
+	/* protected by jp_lock */
+	uint64_t js_records;		/* records written, not counting pad */
+	uint64_t js_bytes;		/* bytes in those records */
+	uint64_t js_padbytes;		/* bytes of padding */
+
+	/* protected by jp_lsnmaplock */
+	unsigned js_flushes;		/* calls to sfs_jphys_flush */
+	unsigned js_ondisk;		/* ...that found it already written */
+	uint64_t js_flushusec;		/* total time spent in them */
+	unsigned js_flushlat[SFS_JSTATS_LATBUCKETS]; /* latency histogram */
+	unsigned js_forced;		/* journal writes forced by eviction */
+	unsigned js_distmax;		/* most jblocks from tail to head */
+	uint64_t js_distsum;		/* total over the samples */
+	unsigned js_distsamples;	/* samples (one per head advance) */
+};
+
 /*
  * Physical journal (container-level) state
  *
@@ -89,9 +127,10 @@ struct sfs_jphys {
 	struct lock *jp_lock;		/* lock for the physical journal */
 
 	struct buf *jp_headbuf;		/* buffer for journal head */
-	struct buf *jp_nextbuf;		/* buffer for next journal head */
-	struct thread *jp_gettingnext;	/* who's going to fetch jp_nextbuf */
-	struct cv *jp_nextcv;		/* to wait for jp_nextbuf */
+	struct buf *jp_nextbufs[SFS_JPHYS_NEXTBUFS]; /* next heads, in order */
+	unsigned jp_numnext;		/* # of jp_nextbufs ready */
+	struct thread *jp_gettingnext;	/* who's fetching more nextbufs */
+	struct cv *jp_nextcv;		/* to wait for jp_nextbufs */
 
 	uint32_t jp_headjblock;		/* journal block number of head */
 	unsigned jp_headbyte;		/* byte offset for journal head */
@@ -101,6 +140,13 @@ struct sfs_jphys {
 
 	uint32_t jp_odometer;		/* counter of jblocks used */
 
+	struct thread *jp_flusher;	/* thread leading a group flush */
+	struct cv *jp_flushcv;		/* to wait for jp_flusher */
+	sfs_lsn_t jp_flushedlsn;	/* everything up to here is on disk */
+	unsigned jp_flushwaiters;	/* threads waiting for jp_flusher */
+
+	struct sfs_jstats jp_stats;	/* statistics (see above) */
+
 	struct spinlock jp_lsnmaplock;	/* lock for the following */
 	sfs_lsn_t *jp_firstlsns;	/* first lsn in each journal block */
 	uint32_t jp_oldestjblock;	/* oldest journal block in memory */
@@ -162,6 +208,73 @@ sfs_jposition_eq(const struct sfs_jposition *a, const struct sfs_jposition *b)
 		a->jp_blockoffset == b->jp_blockoffset;
 }
 
+////////////////////////////////////////////////////////////
+// statistics
+
+/*
+ * Reset the statistics, when the journal goes live.
+ */
+static
+void
+sfs_jstats_init(struct sfs_jstats *js)
+{
+	bzero(js, sizeof(*js));
+	gettime(&js->js_start);
+}
+
+/*
+ * Sample the distance from the in-memory tail to the head, in
+ * journal blocks. Called with jp_lsnmaplock held.
+ */
+static
+void
+sfs_jstats_distance(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	struct sfs_jstats *js = &jp->jp_stats;
+	uint32_t nblocks = sfs->sfs_sb.sb_journalblocks;
+	unsigned dist;
+
+	KASSERT(spinlock_do_i_hold(&jp->jp_lsnmaplock));
+
+	dist = (jp->jp_headjblock + nblocks - jp->jp_memtailjblock) % nblocks;
+	if (dist > js->js_distmax) {
+		js->js_distmax = dist;
+	}
+	js->js_distsum += dist;
+	js->js_distsamples++;
+}
+
+/*
+ * Record that a call to sfs_jphys_flush took from START until now.
+ */
+static
+void
+sfs_jstats_flushed(struct sfs_jphys *jp, const struct timespec *start)
+{
+	struct sfs_jstats *js = &jp->jp_stats;
+	struct timespec now, diff;
+	uint64_t usec, val;
+	unsigned bucket;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	usec = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+	/* bucket N is [2^N, 2^(N+1)) usec, except the ends are open */
+	bucket = 0;
+	for (val = usec; val > 1 && bucket < SFS_JSTATS_LATBUCKETS - 1;
+	     val >>= 1) {
+		bucket++;
+	}
+
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	js->js_flushes++;
+	js->js_flushusec += usec;
+	js->js_flushlat[bucket]++;
+	spinlock_release(&jp->jp_lsnmaplock);
+}
+
 ////////////////////////////////////////////////////////////
 // writer interface
 
@@ -169,10 +282,10 @@ sfs_jposition_eq(const struct sfs_jposition *a, const struct sfs_jposition *b)
  * Move to the next journal block. (If we don't need another journal
  * block yet, return without doing anything.)
  *
- * This releases jp_headbuf and switches in jp_nextbuf, and notes that
- * we're the thread that's going to replace jp_nextbuf later. We can't
- * do buffer_get() here, as if it evicts a buffer that might generate
- * a journal entry, which would have no place to go. (And in fact, it
+ * This releases jp_headbuf and switches in the first of jp_nextbufs;
+ * replacing it is left for sfs_jphys_refill afterwards. We can't do
+ * buffer_get() here, as if it evicts a buffer that might generate a
+ * journal entry, which would have no place to go. (And in fact, it
  * would deadlock on the jphys lock before it got that far.)
  */
 static
@@ -180,6 +293,7 @@ void
 sfs_advance_journal(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
+	unsigned i;
 
 	/*
 	 * XXX we have to make sure here that the journal head never
@@ -213,22 +327,22 @@ sfs_advance_journal(struct sfs_fs *sfs)
 	jp->jp_headfirstlsn = jp->jp_nextlsn;
 
 	/*
-	 * Take jp_nextbuf and promise to replace it.
+	 * Take the first of jp_nextbufs.
 	 *
-	 * If you are seeing jp_nextbuf == NULL here and you are
-	 * flushing the journal very aggressively, you probably need
-	 * to enable the current disabled early sfs_getnextbuf call in
-	 * sfs_jphys_write_internal below. (q.v.) That or flush less
-	 * aggressively. If this is the problem, when you die here the
-	 * call stack will include sfs_jphys_flush and the current
-	 * journal head buffer to be replaced (jp_headbuf) will have
-	 * exactly one record in it and the rest padding.
+	 * If you are seeing none here, the thread fetching them got
+	 * here recursively (from an eviction in sfs_getnextbuf) and
+	 * used them all up; that takes more than SFS_JPHYS_NEXTBUFS
+	 * blocks' worth of journal records generated by evicting
+	 * buffers, or flushing the journal very aggressively. When
+	 * you die here the call stack will include sfs_getnextbuf.
 	 */
-	KASSERT(jp->jp_nextbuf != NULL);
-	KASSERT(jp->jp_gettingnext == NULL);
-	jp->jp_headbuf = jp->jp_nextbuf;
-	jp->jp_nextbuf = NULL;
-	jp->jp_gettingnext = curthread;
+	KASSERT(jp->jp_numnext > 0);
+	jp->jp_headbuf = jp->jp_nextbufs[0];
+	for (i=1; i<jp->jp_numnext; i++) {
+		jp->jp_nextbufs[i-1] = jp->jp_nextbufs[i];
+	}
+	jp->jp_numnext--;
+	jp->jp_nextbufs[jp->jp_numnext] = NULL;
 	buffer_mark_valid(jp->jp_headbuf);
 
 	/* Update the LSN map. */
@@ -238,11 +352,13 @@ sfs_advance_journal(struct sfs_fs *sfs)
 		      sfs->sfs_sb.sb_volname);
 	}
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
+	sfs_jstats_distance(sfs);
 	spinlock_release(&jp->jp_lsnmaplock);
 }
 
 /*
- * Fetch the next journal head buffer.
+ * Fetch buffers for the next journal heads, until there are
+ * SFS_JPHYS_NEXTBUFS of them.
  *
  * This releases the jphys lock while it's working, because it's
  * unsafe to call buffer_get while holding it. (See note above.) This
@@ -250,21 +366,25 @@ sfs_advance_journal(struct sfs_fs *sfs)
  * (not in the middle of sfs_advance_journal) and second, we need to
  * make sure only one thread tries to do it at once.
  *
- * The way this works is that the thread that turns over the head
- * buffer in sfs_advance_journal is the thread responsible for
- * replacing jp_nextbuf; it says so by setting jp_gettingnext. Then
- * after it finishes the journaling that it's doing, it calls
- * sfs_getnextbuf.
+ * The way this works is that whoever finishes journaling and finds
+ * jp_nextbufs short, with nobody fetching, becomes the fetcher by
+ * setting jp_gettingnext (see sfs_jphys_refill). Meanwhile other
+ * threads go on writing records: the head only needs a new buffer
+ * when it fills up, and there's normally another one ready, so
+ * nobody waits for the fetch (or for the eviction it may cause).
+ * Only if they're all used up does anyone entering sfs_jphys_write
+ * sleep until we add one.
  *
- * Also, in order to prevent running off the end of the current
- * journal head buffer before a new jp_nextbuf is ready, anyone
- * entering sfs_jphys_write while jp_nextbuf is NULL sleeps until we
- * finish here. If we get back there recursively somehow, we'll panic;
- * currently that can't happen, but if it becomes possible we'll need
- * to allow ourselves through there without waiting. If it becomes
- * possible to generate more than a whole block's worth of journal
- * entries from buffer writes triggered by buffer_get... this whole
- * scheme fails and needs to be redesigned.
+ * Each buffer is for the block after the last one already ready.
+ * While the lock is released the head can only advance by taking
+ * buffers off the front of jp_nextbufs, so that block doesn't change.
+ *
+ * If we get back to sfs_jphys_write recursively (an eviction here
+ * writes a record) we go ahead without waiting, and use up the
+ * buffers that are ready if need be; if they run out we'll panic. If
+ * it becomes possible to generate more than SFS_JPHYS_NEXTBUFS
+ * blocks' worth of journal entries from buffer writes triggered by
+ * buffer_get... this whole scheme fails and needs to be redesigned.
  */
 static
 void
@@ -275,75 +395,118 @@ sfs_getnextbuf(struct sfs_fs *sfs)
 	struct buf *buf;
 	int result;
 
-	nextjblock = jp->jp_headjblock + 1;
-	if (nextjblock == sfs->sfs_sb.sb_journalblocks) {
-		nextjblock = 0;
-	}
-	nextdiskblock = nextjblock + sfs->sfs_sb.sb_journalstart;
-	lock_release(jp->jp_lock);
+	KASSERT(lock_do_i_hold(jp->jp_lock));
+	KASSERT(jp->jp_gettingnext == NULL);
+	jp->jp_gettingnext = curthread;
 
-	result = buffer_get_fsmanaged(&sfs->sfs_absfs, nextdiskblock,
-				      SFS_BLOCKSIZE, &buf);
-	if (result) {
-		/*
-		 * XXX this really won't do. However, it can only
-		 * happen in the following cases:
-		 *    - kmalloc failure in sfs_attachbuf
-		 *    - kmalloc failure in bufhash_add in buf.c
-		 *
-		 * The problem is not so much that we couldn't report
-		 * an error to the caller; we could (although it's
-		 * much nicer if writing to the journal doesn't fail)
-		 * ... the problem is that if we can't get the buffer
-		 * we have no way to continue operating. If we leave
-		 * jp_nextblock NULL, we'll hang and/or panic as soon
-		 * as the current journal head buffer fills up.
-		 *
-		 * We can rig the buffer cache so it doesn't fail in
-		 * bufhash_add; IIRC at least some of that logic is
-		 * already in place. And we could probably avoid
-		 * needing to kmalloc in sfs_attachbuf for journal
-		 * buffers; it's convenient to use the same structure
-		 * and same flushing mechanism as for regular buffers,
-		 * but not necessary. However, these changes will be a
-		 * good bit of further hacking, so not yet. XXX.
-		 */
-		panic("sfs: %s: turning over journal: %s\n",
-		      sfs->sfs_sb.sb_volname, strerror(result));
+	while (jp->jp_numnext < SFS_JPHYS_NEXTBUFS) {
+		nextjblock = (jp->jp_headjblock + 1 + jp->jp_numnext) %
+			sfs->sfs_sb.sb_journalblocks;
+		nextdiskblock = nextjblock + sfs->sfs_sb.sb_journalstart;
+		lock_release(jp->jp_lock);
+
+		result = buffer_get_fsmanaged(&sfs->sfs_absfs, nextdiskblock,
+					      SFS_BLOCKSIZE, &buf);
+		if (result) {
+			/*
+			 * XXX this really won't do. However, it can
+			 * only happen in the following cases:
+			 *    - kmalloc failure in sfs_attachbuf
+			 *    - kmalloc failure in bufhash_add in buf.c
+			 *
+			 * The problem is not so much that we couldn't
+			 * report an error to the caller; we could
+			 * (although it's much nicer if writing to the
+			 * journal doesn't fail) ... the problem is
+			 * that if we can't get the buffer we have no
+			 * way to continue operating. If we leave
+			 * jp_nextbufs empty, we'll hang and/or panic
+			 * as soon as the current journal head buffer
+			 * fills up.
+			 *
+			 * We can rig the buffer cache so it doesn't
+			 * fail in bufhash_add; IIRC at least some of
+			 * that logic is already in place. And we
+			 * could probably avoid needing to kmalloc in
+			 * sfs_attachbuf for journal buffers; it's
+			 * convenient to use the same structure and
+			 * same flushing mechanism as for regular
+			 * buffers, but not necessary. However, these
+			 * changes will be a good bit of further
+			 * hacking, so not yet. XXX.
+			 */
+			panic("sfs: %s: turning over journal: %s\n",
+			      sfs->sfs_sb.sb_volname, strerror(result));
+		}
+		buffer_mark_valid(buf);
+		lock_acquire(jp->jp_lock);
+		KASSERT(jp->jp_numnext < SFS_JPHYS_NEXTBUFS);
+		jp->jp_nextbufs[jp->jp_numnext++] = buf;
+		jp->jp_odometer++;
+		cv_broadcast(jp->jp_nextcv, jp->jp_lock);
 	}
-	buffer_mark_valid(buf);
-	lock_acquire(jp->jp_lock);
-	jp->jp_nextbuf = buf;
 	jp->jp_gettingnext = NULL;
-	jp->jp_odometer++;
-	cv_broadcast(jp->jp_nextcv, jp->jp_lock);
 }
 
 /*
- * Write some data directly into the journal.
+ * After journaling: if the head has used up any of jp_nextbufs, and
+ * nobody is already fetching more, fetch them. Releases and
+ * reacquires jp_lock if it does anything, so this must come after
+ * all the work that needs to be atomic.
+ */
+static
+void
+sfs_jphys_refill(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+
+	KASSERT(lock_do_i_hold(jp->jp_lock));
+	if (jp->jp_numnext < SFS_JPHYS_NEXTBUFS &&
+	    jp->jp_gettingnext == NULL) {
+		sfs_getnextbuf(sfs);
+	}
+}
+
+/*
+ * Write a record header, and the LEN bytes of record data REC that
+ * follow it, directly into the journal.
+ *
+ * This is the part of every journal write that's done with jp_lock
+ * held, so it does as little as it can: the head buffer is fsmanaged,
+ * so nobody else can clean it while it's the head, and it only needs
+ * to be marked dirty (which takes a buffer cache lock) the first
+ * time around.
  */
 static
 void
-sfs_put_journal(struct sfs_fs *sfs, sfs_lsn_t lsn, const void *rec, size_t len)
+sfs_put_journal(struct sfs_fs *sfs, sfs_lsn_t lsn,
+		const struct sfs_jphys_header *hdr, const void *rec, size_t len)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	char *buf;
 
 	KASSERT(lock_do_i_hold(jp->jp_lock));
-	KASSERT(jp->jp_headbyte + len <= SFS_BLOCKSIZE);
+	KASSERT(jp->jp_headbyte + sizeof(*hdr) + len <= SFS_BLOCKSIZE);
 
 	KASSERT(lsn >= jp->jp_headfirstlsn);
 
 	buf = buffer_map(jp->jp_headbuf);
-	memcpy(buf + jp->jp_headbyte, rec, len);
-	buffer_mark_dirty(jp->jp_headbuf);
-	jp->jp_headbyte += len;
+	memcpy(buf + jp->jp_headbyte, hdr, sizeof(*hdr));
+	jp->jp_headbyte += sizeof(*hdr);
+	if (len > 0) {
+		memcpy(buf + jp->jp_headbyte, rec, len);
+		jp->jp_headbyte += len;
+	}
+	if (!buffer_is_dirty(jp->jp_headbuf)) {
+		buffer_mark_dirty(jp->jp_headbuf);
+	}
 
 	sfs_advance_journal(sfs);
 }
 
 /*
- * Write a pad record to the end of the current journal block.
+ * Write pad records to the end of the current journal block. One is
+ * enough unless the block is bigger than SFS_JPHYS_MAXLEN.
  */
 static
 void
@@ -352,22 +515,23 @@ sfs_pad_journal(struct sfs_fs *sfs)
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	struct sfs_jphys_header hdr;
 	sfs_lsn_t lsn;
-	size_t len;
+	size_t len, padlen;
 
 	KASSERT(lock_do_i_hold(jp->jp_lock));
 	KASSERT(jp->jp_headbyte < SFS_BLOCKSIZE);
 
 	len = SFS_BLOCKSIZE - jp->jp_headbyte;
-	if (len >= sizeof(hdr)) {
+	jp->jp_stats.js_padbytes += len;
+	while (len >= sizeof(hdr)) {
+		padlen = len < SFS_JPHYS_MAXLEN ? len : SFS_JPHYS_MAXLEN;
 		lsn = jp->jp_nextlsn++;
 		hdr.jh_coninfo = SFS_MKCONINFO(SFS_JPHYS_CONTAINER,
-					       SFS_JPHYS_PAD, len, lsn);
-		sfs_put_journal(sfs, lsn, &hdr, sizeof(hdr));
-		len -= sizeof(hdr);
-	}
-	else {
-		/* padding is implicit; do nothing */
+					       SFS_JPHYS_PAD, padlen, lsn);
+		sfs_put_journal(sfs, lsn, &hdr, NULL, 0);
+		jp->jp_headbyte += padlen - sizeof(hdr);
+		len -= padlen;
 	}
+	/* anything shorter than a header is padding implicitly */
 
 	jp->jp_headbyte += len;
 	sfs_advance_journal(sfs);
@@ -416,82 +580,52 @@ sfs_jphys_write_internal(struct sfs_fs *sfs,
 	lock_acquire(jp->jp_lock);
 
 	/*
-	 * If we are already marked responsible for getting the next
-	 * journal head buffer, we must be here recursively. This
-	 * happens when e.g. sfs_getnextbuf triggers an eviction that
-	 * triggers a journal write. We need to *not* get the next
-	 * journal head buffer in this call, because we're already
+	 * If we are the thread fetching journal head buffers, we must
+	 * be here recursively. This happens when e.g. sfs_getnextbuf
+	 * triggers an eviction that triggers a journal write. We need
+	 * to *not* fetch buffers in this call, because we're already
 	 * doing so up the call stack and doing it here would make a
 	 * mess. And we must not wait for ourselves.
 	 */
-	already_gettingnext = jp->jp_nextbuf == NULL && 
-		jp->jp_gettingnext == curthread;
+	already_gettingnext = jp->jp_gettingnext == curthread;
 
 	/*
-	 * If the journal head is turning over, wait until it
-	 * finishes. If we're the thread that was supposed to fetch
-	 * the next head buffer, though, we can't.
+	 * If the head has used up all the buffers after it, wait for
+	 * another. If we're the thread fetching them, though, we
+	 * can't; we have to hope this record fits.
 	 */
 	if (already_gettingnext == false) {
-		while (jp->jp_nextbuf == NULL) {
-			KASSERT(jp->jp_gettingnext != curthread);
+		while (jp->jp_numnext == 0) {
 			cv_wait(jp->jp_nextcv, jp->jp_lock);
 		}
 	}
 
 	/* If we aren't going to fit, pad the current block and get a new one */
 	if (jp->jp_headbyte + totallen > SFS_BLOCKSIZE) {
-		if (already_gettingnext) {
+		if (jp->jp_numnext == 0) {
 			/* We need another buffer and can't get one */
+			KASSERT(already_gettingnext);
 			panic("sfs: %s: Journal head block full while "
 			      "already getting the next one\n",
 			      sfs->sfs_sb.sb_volname);
 		}
-
 		sfs_pad_journal(sfs);
-		/*
-		 * We just turned over the journal head, so we must be
-		 * responsible for fetching the next journal head
-		 * buffer.
-		 */
-		KASSERT(jp->jp_nextbuf == NULL &&
-			jp->jp_gettingnext == curthread);
-#if 0
-		/*
-		 * Do it immediately (instead of writing out our
-		 * record first and waiting until the end of this
-		 * function) -- this behavior is disabled by default
-		 * because it has been found to interact badly with
-		 * as-yet-poorly-understood dynamic behavior issues.
-		 * However, you may need to enable it if you are
-		 * flushing the journal out very aggressively.
-		 *
-		 * In that case calling sfs_getnextbuf at the end of
-		 * this function may trigger an eviction that in turn
-		 * causes a flush that tries to flush out the record
-		 * this function just wrote. That pads out the current
-		 * journal head block and goes to the next one; but
-		 * that will happen before jp_nextbuf can be set, so
-		 * sfs_advance_journal asserts because jp_nextbuf is
-		 * null.
-		 */
-		sfs_getnextbuf(sfs);
-#endif
 	}
 
 	/* Check some limits required by the container logic */
 	KASSERT(class == SFS_JPHYS_CONTAINER || class == SFS_JPHYS_CLIENT);
 	KASSERT(type < 128);
-	KASSERT(totallen <= SFS_BLOCKSIZE);
+	KASSERT(totallen <= SFS_JPHYS_MAXLEN);
 	KASSERT(totallen % 2 == 0);
 
 	/* Get a LSN and initialize the record header. */
 	lsn = jp->jp_nextlsn++;
 	hdr.jh_coninfo = SFS_MKCONINFO(class, type, totallen, lsn);
+	jp->jp_stats.js_records++;
+	jp->jp_stats.js_bytes += totallen;
 
 	/* Write the header and the actual log entry. */
-	sfs_put_journal(sfs, lsn, &hdr, sizeof(hdr));
-	sfs_put_journal(sfs, lsn, rec, len);
+	sfs_put_journal(sfs, lsn, &hdr, rec, len);
 
 	/* Call the callback, if any */
 	if (callback != NULL) {
@@ -499,17 +633,11 @@ sfs_jphys_write_internal(struct sfs_fs *sfs,
 	}
 
 	/*
-	 * If we turned over the head buffer, get a new nextbuf.
-	 * (Unless we're already doing so up the call stack.)
-	 * This releases the jphys lock while working so it must come
-	 * after all the work that needs to be atomic.
+	 * If we turned over the head buffer, replace the next buffer
+	 * we used. (Unless we're already doing so up the call stack.)
 	 */
 	if (already_gettingnext == false) {
-		if (jp->jp_nextbuf == NULL &&
-		    jp->jp_gettingnext == curthread) {
-			sfs_getnextbuf(sfs);
-		}
-		KASSERT(jp->jp_nextbuf != NULL);
+		sfs_jphys_refill(sfs);
 	}
 
 	/* done with the jphys lock */
@@ -532,12 +660,15 @@ sfs_jphys_write(struct sfs_fs *sfs,
 		unsigned code, const void *rec, size_t len)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
+	sfs_lsn_t lsn;
 
 	/* Must be in writing mode before adding journal entries. */
 	KASSERT(jp->jp_writermode);
 
-	return sfs_jphys_write_internal(sfs, callback, ctx, SFS_JPHYS_CLIENT,
-					code, rec, len);
+	lsn = sfs_jphys_write_internal(sfs, callback, ctx, SFS_JPHYS_CLIENT,
+				       code, rec, len);
+	KTRACE(KT_JWRITE, code, lsn);
+	return lsn;
 }
 
 ////////////////////////////////////////////////////////////
@@ -685,34 +816,35 @@ sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
  * - If the LSN we want to write out is in the current journal head
  * block, we need to pad the current head block and get a new one.
  * We do this first.
+ *
+ * Called with jp_lock held; releases it.
  */
-int
-sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
+static
+void
+sfs_jphys_flush_internal(struct sfs_fs *sfs, sfs_lsn_t lsn)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	uint32_t jblock, headjblock;
 	sfs_lsn_t headfirstlsn;
 
-	if (lsn == 0) {
-		/*
-		 * This can reasonably happen during recovery; don't
-		 * choke on it.
-		 */
-		return 0;
-	}
-
-	lock_acquire(jp->jp_lock);
-
+	KASSERT(lock_do_i_hold(jp->jp_lock));
 	KASSERT(lsn < jp->jp_nextlsn);
 
-	if (lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0) {
+	while (lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0) {
 		/*
 		 * We will need to flush out the current journal head;
-		 * advance the head.
+		 * advance the head. As in sfs_jphys_write_internal,
+		 * that needs a next buffer, unless we're the thread
+		 * fetching them. (While we wait someone else might
+		 * advance the head for us; hence the loop.)
 		 */
+		if (jp->jp_numnext == 0 && jp->jp_gettingnext != curthread) {
+			cv_wait(jp->jp_nextcv, jp->jp_lock);
+			continue;
+		}
 		sfs_pad_journal(sfs);
-		if (jp->jp_nextbuf == NULL && jp->jp_gettingnext == curthread){
-			sfs_getnextbuf(sfs);
+		if (jp->jp_gettingnext != curthread) {
+			sfs_jphys_refill(sfs);
 		}
 	}
 
@@ -751,6 +883,135 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	KASSERT(lsn < headfirstlsn);
 
 	spinlock_release(&jp->jp_lsnmaplock);
+}
+
+/*
+ * Check if the journal records up to and including LSN are already
+ * on disk: journal blocks are written in order, so that's everything
+ * before the first LSN of the oldest block still in memory. This
+ * only takes jp_lsnmaplock, so it doesn't wait behind a flush in
+ * progress the way looking at jp_flushedlsn would; records written
+ * by eviction or the syncer count too.
+ */
+static
+bool
+sfs_jphys_ondisk(struct sfs_fs *sfs, sfs_lsn_t lsn)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	sfs_lsn_t firstlsn;
+	bool ret;
+
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	if (jp->jp_firstlsns == NULL) {
+		/* not set up yet */
+		spinlock_release(&jp->jp_lsnmaplock);
+		return false;
+	}
+	firstlsn = jp->jp_firstlsns[jp->jp_oldestjblock];
+	ret = firstlsn != 0 && lsn < firstlsn;
+	if (ret) {
+		jp->jp_stats.js_ondisk++;
+	}
+	spinlock_release(&jp->jp_lsnmaplock);
+	return ret;
+}
+
+/*
+ * Make sure the journal records up to and including the given LSN
+ * are written to disk. This is the group commit layer on top of
+ * sfs_jphys_flush_internal.
+ *
+ * Often, as when a buffer being evicted was last changed a while
+ * ago, the records are out already; sfs_jphys_ondisk checks for
+ * that before anything else.
+ *
+ * Only one thread (jp_flusher) flushes at a time, and it flushes
+ * everything in the journal when it starts, not just what it was
+ * asked for. Anyone who asks for a flush while it's working waits
+ * for it and then either finds their records already on disk or
+ * becomes the next flusher, taking everyone else who turned up in
+ * the meantime along in the same I/O. That way the number of
+ * flushes (and padded-out journal blocks) under concurrent commits
+ * tracks the number of disk writes the journal can do rather than
+ * the number of commits.
+ *
+ * If other threads were waiting the last time around, a new flusher
+ * yields once before starting so that threads about to commit can
+ * get their records in too. With only one thread committing nobody
+ * waits and this costs nothing.
+ *
+ * The flusher can come back in here itself (getting the next
+ * journal buffer can evict a dirty buffer, whose write flushes the
+ * journal for write-ahead logging); that just flushes directly, and
+ * so does the thread fetching journal buffers in sfs_getnextbuf.
+ */
+int
+sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	struct timespec start;
+	sfs_lsn_t grouplsn;
+
+	if (lsn == 0) {
+		/*
+		 * This can reasonably happen during recovery; don't
+		 * choke on it.
+		 */
+		return 0;
+	}
+	if (sfs_jphys_ondisk(sfs, lsn)) {
+		return 0;
+	}
+
+	KTRACE(KT_JFLUSH, lsn, 0);
+	gettime(&start);
+	lock_acquire(jp->jp_lock);
+
+	KASSERT(lsn < jp->jp_nextlsn);
+
+	if (jp->jp_flusher == curthread || jp->jp_gettingnext == curthread) {
+		/*
+		 * Recursive; see above. Or we're fetching journal
+		 * buffers and evicted something; the flusher might be
+		 * waiting for those buffers, so don't wait for it.
+		 */
+		sfs_jphys_flush_internal(sfs, lsn);
+		return 0;
+	}
+
+	while (jp->jp_flusher != NULL && lsn > jp->jp_flushedlsn) {
+		jp->jp_flushwaiters++;
+		cv_wait(jp->jp_flushcv, jp->jp_lock);
+		jp->jp_flushwaiters--;
+	}
+	if (lsn <= jp->jp_flushedlsn) {
+		/* someone else's flush covered us */
+		lock_release(jp->jp_lock);
+		sfs_jstats_flushed(jp, &start);
+		return 0;
+	}
+
+	jp->jp_flusher = curthread;
+	if (jp->jp_flushwaiters > 0) {
+		lock_release(jp->jp_lock);
+		thread_yield();
+		lock_acquire(jp->jp_lock);
+	}
+	grouplsn = jp->jp_nextlsn - 1;
+	KASSERT(grouplsn >= lsn);
+
+	/* releases jp_lock */
+	sfs_jphys_flush_internal(sfs, grouplsn);
+
+	lock_acquire(jp->jp_lock);
+	KASSERT(jp->jp_flusher == curthread);
+	if (grouplsn > jp->jp_flushedlsn) {
+		jp->jp_flushedlsn = grouplsn;
+	}
+	jp->jp_flusher = NULL;
+	cv_broadcast(jp->jp_flushcv, jp->jp_lock);
+	lock_release(jp->jp_lock);
+	sfs_jstats_flushed(jp, &start);
 	return 0;
 }
 
@@ -776,6 +1037,10 @@ sfs_jphys_flushforjournalblock(struct sfs_fs *sfs, daddr_t diskblock)
 	KASSERT(jblock < sfs->sfs_sb.sb_journalblocks);
 
 	spinlock_acquire(&jp->jp_lsnmaplock);
+	if (jblock != jp->jp_oldestjblock) {
+		/* the cache is writing the block before its turn */
+		jp->jp_stats.js_forced++;
+	}
 	sfs_jphys_flush_upto_jblock(sfs, jblock);
 	spinlock_release(&jp->jp_lsnmaplock);
 
@@ -923,6 +1188,86 @@ sfs_jphys_clearodometer(struct sfs_jphys *jp)
 	lock_release(jp->jp_lock);
 }
 
+/*
+ * Print the journal statistics. Rates are averaged since the journal
+ * went live; the p99 flush latency is the top of the histogram bucket
+ * it falls in.
+ */
+void
+sfs_jphys_printstats(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t nblocks = sfs->sfs_sb.sb_journalblocks;
+	struct sfs_jstats js;
+	struct timespec now, diff;
+	uint64_t msec;
+	unsigned dist, i, count, p99;
+	bool last;
+
+	lock_acquire(jp->jp_lock);
+	if (!jp->jp_writermode) {
+		lock_release(jp->jp_lock);
+		kprintf("sfs: %s: journal is not live\n",
+			sfs->sfs_sb.sb_volname);
+		return;
+	}
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	js = jp->jp_stats;
+	dist = (jp->jp_headjblock + nblocks - jp->jp_memtailjblock) % nblocks;
+	spinlock_release(&jp->jp_lsnmaplock);
+	lock_release(jp->jp_lock);
+
+	gettime(&now);
+	timespec_sub(&now, &js.js_start, &diff);
+	msec = (uint64_t)diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+	if (msec == 0) {
+		msec = 1;
+	}
+
+	/* find the bucket the 99th percentile flush is in */
+	p99 = 0;
+	count = 0;
+	for (i=0; i<SFS_JSTATS_LATBUCKETS; i++) {
+		count += js.js_flushlat[i];
+		if (count * (uint64_t)100 >= js.js_flushes * (uint64_t)99) {
+			p99 = i;
+			break;
+		}
+	}
+
+	kprintf("sfs: %s: journal (%u blocks), live %llu.%03u seconds\n",
+		sfs->sfs_sb.sb_volname, nblocks,
+		(unsigned long long)diff.tv_sec,
+		(unsigned)(diff.tv_nsec / 1000000));
+	kprintf("   %llu records, %llu bytes (%llu bytes padding)\n",
+		(unsigned long long)js.js_records,
+		(unsigned long long)js.js_bytes,
+		(unsigned long long)js.js_padbytes);
+	kprintf("   %llu records/sec, %llu bytes/sec\n",
+		(unsigned long long)(js.js_records * 1000 / msec),
+		(unsigned long long)(js.js_bytes * 1000 / msec));
+	if (js.js_flushes == 0) {
+		kprintf("   no flushes\n");
+	}
+	else {
+		/* the last bucket is open-ended */
+		last = p99 == SFS_JSTATS_LATBUCKETS - 1;
+		kprintf("   %u flushes, average %llu usec, p99 %s %u usec\n",
+			js.js_flushes,
+			(unsigned long long)(js.js_flushusec / js.js_flushes),
+			last ? "at least" : "under",
+			last ? 1U << p99 : 2U << p99);
+	}
+	kprintf("   %u flush requests found the records already on disk\n",
+		js.js_ondisk);
+	kprintf("   %u journal writes forced out of order\n", js.js_forced);
+	kprintf("   tail to head: %u blocks now, %llu average, %u most\n",
+		dist,
+		(unsigned long long)(js.js_distsamples == 0 ? dist :
+				     js.js_distsum / js.js_distsamples),
+		js.js_distmax);
+}
+
 ////////////////////////////////////////////////////////////
 // journal iterator (reader mode) interface
 
@@ -972,6 +1317,10 @@ struct sfs_jiter {
 	/* buffer for current journal block */
 	struct buf *ji_buf;
 
+	/* read-ahead state */
+	bool ji_forward;	/* direction of the last move */
+	bool ji_rastarted;	/* read-ahead queued for current run */
+
 	/* current record (valid if ji_read is true) */
 	unsigned ji_class;
 	unsigned ji_type;
@@ -979,6 +1328,12 @@ struct sfs_jiter {
 	sfs_lsn_t ji_lsn;
 };
 
+/*
+ * Number of journal blocks the iterator keeps queued for read-ahead
+ * in the direction it's moving.
+ */
+#define SFS_JITER_READAHEAD	8
+
 /*
  * Create an iterator.
  *
@@ -1010,6 +1365,9 @@ sfs_jiter_create(struct sfs_fs *sfs,
 
 	ji->ji_buf = NULL;
 
+	ji->ji_forward = true;
+	ji->ji_rastarted = false;
+
 	ji->ji_read = false;
 	ji->ji_done = false;
 	ji->ji_seeall = seeall;
@@ -1118,19 +1476,59 @@ sfs_jiter_rec(struct sfs_jiter *ji, size_t *len_ret)
 	return (char *)buffer_map(ji->ji_buf) + offset;
 }
 
+/*
+ * Queue read-ahead for the journal block DIST blocks past the
+ * current one in the direction we're moving. Internal.
+ */
+static
+void
+sfs_jiter_readahead(struct sfs_fs *sfs, struct sfs_jiter *ji, unsigned dist)
+{
+	uint32_t nblocks, jblock;
+
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	if (dist >= nblocks) {
+		return;
+	}
+	if (ji->ji_forward) {
+		jblock = (ji->ji_pos.jp_jblock + dist) % nblocks;
+	}
+	else {
+		jblock = (ji->ji_pos.jp_jblock + nblocks - dist) % nblocks;
+	}
+	buffer_readahead(&sfs->sfs_absfs, sfs->sfs_sb.sb_journalstart + jblock,
+			 SFS_BLOCKSIZE);
+}
+
 /*
  * Ensure that we have a buffer for the current journal block.
  * Internal.
+ *
+ * The scans at mount time go through the whole journal a block at a
+ * time, so keep the next several blocks in the direction of travel
+ * coming in the background. At the start of a run (after creation,
+ * a seek, or a change of direction) queue the whole window; after
+ * that each new block only needs to queue the one at the far end.
  */
 static
 int
 sfs_jiter_getbuf(struct sfs_fs *sfs, struct sfs_jiter *ji)
 {
+	unsigned i;
 	int result;
 
 	if (ji->ji_buf != NULL) {
 		return 0;
 	}
+	if (!ji->ji_rastarted) {
+		for (i=1; i<=SFS_JITER_READAHEAD; i++) {
+			sfs_jiter_readahead(sfs, ji, i);
+		}
+		ji->ji_rastarted = true;
+	}
+	else {
+		sfs_jiter_readahead(sfs, ji, SFS_JITER_READAHEAD);
+	}
 	result = buffer_read(&sfs->sfs_absfs,
 			     sfs->sfs_sb.sb_journalstart +
 			     ji->ji_pos.jp_jblock,
@@ -1227,6 +1625,11 @@ sfs_jiter_one_next(struct sfs_fs *sfs, struct sfs_jiter *ji)
 	pos = ji->ji_pos;
 	changebuf = false;
 
+	if (!ji->ji_forward) {
+		ji->ji_forward = true;
+		ji->ji_rastarted = false;
+	}
+
 	/* Compute the new position */
 
 	pos.jp_blockoffset += ji->ji_len;
@@ -1321,6 +1724,11 @@ sfs_jiter_one_prev(struct sfs_fs *sfs, struct sfs_jiter *ji)
 	/* make gcc happy */
 	prevoffset = 0;
 
+	if (ji->ji_forward) {
+		ji->ji_forward = false;
+		ji->ji_rastarted = false;
+	}
+
 	if (ji->ji_pos.jp_blockoffset == 0) {
 		ji->ji_pos.jp_blockoffset = SFS_BLOCKSIZE;
 		if (ji->ji_pos.jp_jblock == 0) {
@@ -1432,6 +1840,7 @@ sfs_jiter_seekhead(struct sfs_fs *sfs, struct sfs_jiter *ji)
 	int result;
 
 	ji->ji_pos = ji->ji_headpos;
+	ji->ji_rastarted = false;
 
 	/* We are no longer done. */
 	ji->ji_done = false;
@@ -1468,6 +1877,8 @@ sfs_jiter_seektail(struct sfs_fs *sfs, struct sfs_jiter *ji)
 	int result;
 
 	ji->ji_pos = ji->ji_tailpos;
+	ji->ji_forward = true;
+	ji->ji_rastarted = false;
 
 	/* We are no longer done. */
 	ji->ji_done = false;
@@ -1894,19 +2305,14 @@ sfs_scan_for_tail(struct sfs_fs *sfs,
 }
 
 /*
- * Overall function to load up the container, which is basically
- * recovery for the container-level information.
+ * Allocate the jp_firstlsns array, with nothing in memory yet.
  */
+static
 int
-sfs_jphys_loadup(struct sfs_fs *sfs)
+sfs_jphys_makefirstlsns(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
-	struct sfs_jposition tailsearchpos;
-	sfs_lsn_t headlsn, taillsn;
 	unsigned i, journalblocks;
-	int result;
-
-	KASSERT(!jp->jp_physrecovered);
 
 	KASSERT(jp->jp_firstlsns == NULL);
 	journalblocks = sfs->sfs_sb.sb_journalblocks;
@@ -1917,6 +2323,27 @@ sfs_jphys_loadup(struct sfs_fs *sfs)
 	for (i=0; i<journalblocks; i++) {
 		jp->jp_firstlsns[i] = 0;
 	}
+	return 0;
+}
+
+/*
+ * Overall function to load up the container, which is basically
+ * recovery for the container-level information.
+ */
+int
+sfs_jphys_loadup(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	struct sfs_jposition tailsearchpos;
+	sfs_lsn_t headlsn, taillsn;
+	int result;
+
+	KASSERT(!jp->jp_physrecovered);
+
+	result = sfs_jphys_makefirstlsns(sfs);
+	if (result) {
+		return result;
+	}
 
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -1981,6 +2408,53 @@ out:
 	return result;
 }
 
+/*
+ * Load up the container from the head and tail recorded in the
+ * superblock at the last clean unmount (see sfs_jphys_markclean),
+ * instead of scanning for them. There's nothing to recover, so the
+ * recovery range is empty: both ends are at the head.
+ */
+int
+sfs_jphys_loadclean(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	const struct sfs_superblock *sb = &sfs->sfs_sb;
+	int result;
+
+	KASSERT(!jp->jp_physrecovered);
+	KASSERT(sb->sb_clean == SFS_SB_CLEAN);
+
+	if (sb->sb_cleanheadjblock >= sb->sb_journalblocks ||
+	    sb->sb_cleantailjblock >= sb->sb_journalblocks ||
+	    sb->sb_cleanheadlsn == 0 || sb->sb_cleantaillsn == 0 ||
+	    sb->sb_cleantaillsn > sb->sb_cleanheadlsn) {
+		kprintf("sfs: %s: invalid clean journal state; scanning\n",
+			sb->sb_volname);
+		return EFTYPE;
+	}
+
+	result = sfs_jphys_makefirstlsns(sfs);
+	if (result) {
+		return result;
+	}
+
+	jp->jp_recov_headpos.jp_jblock = sb->sb_cleanheadjblock;
+	jp->jp_recov_headpos.jp_blockoffset = 0;
+	jp->jp_recov_tailpos = jp->jp_recov_headpos;
+
+	jp->jp_headjblock = sb->sb_cleanheadjblock;
+	jp->jp_headbyte = 0;
+	jp->jp_headfirstlsn = sb->sb_cleanheadlsn;
+
+	jp->jp_memtailjblock = sb->sb_cleantailjblock;
+	jp->jp_memtaillsn = sb->sb_cleantaillsn;
+
+	jp->jp_nextlsn = sb->sb_cleanheadlsn;
+
+	jp->jp_physrecovered = true;
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 // startup, shutdown, and state transition
 
@@ -1993,6 +2467,7 @@ struct sfs_jphys *
 sfs_jphys_create(void)
 {
 	struct sfs_jphys *jp;
+	unsigned i;
 
 	jp = kmalloc(sizeof(*jp));
 	if (jp == NULL) {
@@ -2009,7 +2484,10 @@ sfs_jphys_create(void)
 	}
 
 	jp->jp_headbuf = NULL;
-	jp->jp_nextbuf = NULL;
+	for (i=0; i<SFS_JPHYS_NEXTBUFS; i++) {
+		jp->jp_nextbufs[i] = NULL;
+	}
+	jp->jp_numnext = 0;
 	jp->jp_gettingnext = NULL;
 	jp->jp_nextcv = cv_create("sfs_nextbuf");
 	if (jp->jp_nextcv == NULL) {
@@ -2026,6 +2504,17 @@ sfs_jphys_create(void)
 
 	jp->jp_odometer = 0;
 
+	jp->jp_flusher = NULL;
+	jp->jp_flushcv = cv_create("sfs_jflush");
+	if (jp->jp_flushcv == NULL) {
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+	jp->jp_flushedlsn = 0;
+	jp->jp_flushwaiters = 0;
+
 	spinlock_init(&jp->jp_lsnmaplock);
 	jp->jp_firstlsns = NULL;
 	jp->jp_oldestjblock = 0;
@@ -2053,7 +2542,9 @@ sfs_jphys_destroy(struct sfs_jphys *jp)
 	spinlock_cleanup(&jp->jp_lsnmaplock);
 	kfree(jp->jp_firstlsns);
 	KASSERT(jp->jp_headbuf == NULL);
-	KASSERT(jp->jp_nextbuf == NULL);
+	KASSERT(jp->jp_numnext == 0);
+	KASSERT(jp->jp_flusher == NULL);
+	cv_destroy(jp->jp_flushcv);
 	cv_destroy(jp->jp_nextcv);
 	lock_destroy(jp->jp_lock);
 	kfree(jp);
@@ -2085,6 +2576,23 @@ sfs_jphys_stopreading(struct sfs_fs *sfs)
 	jp->jp_readermode = false;
 }
 
+/*
+ * Release the buffers in jp_nextbufs, which should be clean.
+ */
+static
+void
+sfs_jphys_dropnext(struct sfs_jphys *jp)
+{
+	unsigned i;
+
+	for (i=0; i<jp->jp_numnext; i++) {
+		KASSERT(!buffer_is_dirty(jp->jp_nextbufs[i]));
+		buffer_release_and_invalidate(jp->jp_nextbufs[i]);
+		jp->jp_nextbufs[i] = NULL;
+	}
+	jp->jp_numnext = 0;
+}
+
 /*
  * Enable writer mode.
  */
@@ -2093,6 +2601,7 @@ sfs_jphys_startwriting(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	uint32_t nextjblock;
+	unsigned i;
 	int result;
 
 	KASSERT(jp->jp_physrecovered);
@@ -2118,22 +2627,28 @@ sfs_jphys_startwriting(struct sfs_fs *sfs)
 	}
 	buffer_mark_valid(jp->jp_headbuf);
 
-	nextjblock = jp->jp_headjblock + 1;
-	if (nextjblock == sfs->sfs_sb.sb_journalblocks) {
-		nextjblock = 0;
-	}
-	result = buffer_get_fsmanaged(&sfs->sfs_absfs,
-				      sfs->sfs_sb.sb_journalstart + nextjblock,
-				      SFS_BLOCKSIZE, &jp->jp_nextbuf);
-	if (result) {
-		buffer_release_and_invalidate(jp->jp_headbuf);
-		return result;
+	KASSERT(jp->jp_numnext == 0);
+	for (i=0; i<SFS_JPHYS_NEXTBUFS; i++) {
+		nextjblock = (jp->jp_headjblock + 1 + i) %
+			sfs->sfs_sb.sb_journalblocks;
+		result = buffer_get_fsmanaged(&sfs->sfs_absfs,
+					      sfs->sfs_sb.sb_journalstart +
+						nextjblock, SFS_BLOCKSIZE,
+					      &jp->jp_nextbufs[i]);
+		if (result) {
+			sfs_jphys_dropnext(jp);
+			buffer_release_and_invalidate(jp->jp_headbuf);
+			jp->jp_headbuf = NULL;
+			return result;
+		}
+		buffer_mark_valid(jp->jp_nextbufs[i]);
+		jp->jp_numnext++;
 	}
-	buffer_mark_valid(jp->jp_nextbuf);
 
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
 	jp->jp_oldestjblock = jp->jp_headjblock;
 
+	sfs_jstats_init(&jp->jp_stats);
 	jp->jp_writermode = true;
 	return 0;
 }
@@ -2155,10 +2670,9 @@ sfs_jphys_unstartwriting(struct sfs_fs *sfs)
 	 */
 
 	buffer_release_and_invalidate(jp->jp_headbuf);
-	buffer_release_and_invalidate(jp->jp_nextbuf);
+	sfs_jphys_dropnext(jp);
 
 	jp->jp_headbuf = NULL;
-	jp->jp_nextbuf = NULL;
 
 	jp->jp_writermode = false;
 }
@@ -2191,15 +2705,37 @@ sfs_jphys_stopwriting(struct sfs_fs *sfs)
 	buffer_release_and_invalidate(jp->jp_headbuf);
 	jp->jp_headbuf = NULL;
 
-	/* should not get here without nextbuf existing */
-	KASSERT(jp->jp_nextbuf != NULL);
+	/* should not get here without the nextbufs existing */
+	KASSERT(jp->jp_numnext == SFS_JPHYS_NEXTBUFS);
 	KASSERT(jp->jp_gettingnext == NULL);
 
-	/* and nextbuf should never be dirty... */
-	KASSERT(!buffer_is_dirty(jp->jp_nextbuf));
-	buffer_release_and_invalidate(jp->jp_nextbuf);
-	jp->jp_nextbuf = NULL;
+	/* and nextbufs should never be dirty... */
+	sfs_jphys_dropnext(jp);
 
 	jp->jp_writermode = false;
 	lock_release(jp->jp_lock);
 }
+
+/*
+ * Record the journal head and tail in the in-memory superblock so
+ * the next mount can skip the scan in sfs_jphys_loadup. Called at
+ * unmount after sfs_jphys_stopwriting; the caller writes the
+ * superblock. (It's only correct once everything is on disk.)
+ */
+void
+sfs_jphys_markclean(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+
+	KASSERT(jp->jp_physrecovered);
+	KASSERT(!jp->jp_writermode);
+	KASSERT(jp->jp_headbyte == 0);
+	KASSERT(jp->jp_memtaillsn != 0);
+
+	sb->sb_clean = SFS_SB_CLEAN;
+	sb->sb_cleanheadlsn = jp->jp_nextlsn;
+	sb->sb_cleantaillsn = jp->jp_memtaillsn;
+	sb->sb_cleanheadjblock = jp->jp_headjblock;
+	sb->sb_cleantailjblock = jp->jp_memtailjblock;
+}
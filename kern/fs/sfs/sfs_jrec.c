@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS journal records (the client-level ones; see kern/sfs.h).
+ *
+ * These encode freemap and inode changes compactly. Because inode
+ * updates usually touch only a field or two (the size, a block
+ * pointer), sfs_jrec_dinode compares the old and new inode and logs
+ * only the byte ranges that differ, instead of the whole inode.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Largest record body the container can hold. */
+#define SFS_JREC_MAXLEN	(SFS_JPHYS_MAXLEN - sizeof(struct sfs_jphys_header))
+
+/* Inode deltas are computed in units of this type. */
+typedef uint16_t sfs_jrec_unit_t;
+#define SFS_JREC_UNITS	(sizeof(struct sfs_dinode) / sizeof(sfs_jrec_unit_t))
+
+/*
+ * Unchanged units between two changed runs cost less to log than
+ * another delta header if there are fewer than this many of them, so
+ * shorter gaps are swallowed into the run.
+ */
+#define SFS_JREC_MAXGAP \
+	(sizeof(struct sfs_jrec_delta) / sizeof(sfs_jrec_unit_t))
+
+/*
+ * Names for the record types, for verbose recovery.
+ */
+#ifdef SFS_VERBOSE_RECOVERY
+const char *
+sfs_jphys_client_recname(unsigned type)
+{
+	switch (type) {
+	    case SFS_JREC_BITSET: return "bitset";
+	    case SFS_JREC_BITCLEAR: return "bitclear";
+	    case SFS_JREC_DINODE: return "dinode";
+	    case SFS_JREC_DATA: return "data";
+	    case SFS_JREC_DIRINDEX: return "dirindex";
+	    default: return "<unknown>";
+	}
+}
+#endif /* SFS_VERBOSE_RECOVERY */
+
+/*
+ * Log the freemap bit for BLOCK being set (allocated) or cleared
+ * (freed). Returns the LSN.
+ */
+sfs_lsn_t
+sfs_jrec_bitflip(struct sfs_fs *sfs, daddr_t block, bool set)
+{
+	struct sfs_jrec_bitflip rec;
+
+	rec.jbf_block = block;
+	return sfs_jphys_write(sfs, NULL, NULL,
+			       set ? SFS_JREC_BITSET : SFS_JREC_BITCLEAR,
+			       &rec, sizeof(rec));
+}
+
+/*
+ * Log the change to inode INO from OLDINODE to NEWINODE, as deltas of
+ * the ranges that differ. Returns the LSN of the last record written,
+ * or 0 if nothing changed.
+ */
+sfs_lsn_t
+sfs_jrec_dinode(struct sfs_fs *sfs, uint32_t ino,
+		const struct sfs_dinode *oldinode,
+		const struct sfs_dinode *newinode)
+{
+	const sfs_jrec_unit_t *o = (const sfs_jrec_unit_t *)oldinode;
+	const sfs_jrec_unit_t *n = (const sfs_jrec_unit_t *)newinode;
+	char rec[SFS_JREC_MAXLEN];
+	struct sfs_jrec_dinode *jd = (struct sfs_jrec_dinode *)rec;
+	struct sfs_jrec_delta dd;
+	unsigned i, start, end, gap, room, take;
+	size_t pos;
+	sfs_lsn_t lsn;
+
+	COMPILE_ASSERT(sizeof(struct sfs_dinode) % sizeof(*o) == 0);
+
+	jd->jd_ino = ino;
+	pos = sizeof(*jd);
+	lsn = 0;
+
+	i = 0;
+	while (i < SFS_JREC_UNITS) {
+		if (o[i] == n[i]) {
+			i++;
+			continue;
+		}
+
+		/* Find the end of the run, swallowing short gaps. */
+		start = i;
+		end = i + 1;
+		while (end < SFS_JREC_UNITS) {
+			for (gap = 0; end + gap < SFS_JREC_UNITS &&
+				     gap < SFS_JREC_MAXGAP &&
+				     o[end + gap] == n[end + gap]; gap++) {
+			}
+			if (gap == SFS_JREC_MAXGAP ||
+			    end + gap == SFS_JREC_UNITS) {
+				break;
+			}
+			end += gap + 1;
+		}
+		i = end;
+
+		/* Put it in the record, spilling into more as needed. */
+		while (start < end) {
+			if (pos + sizeof(dd) + sizeof(*o) > SFS_JREC_MAXLEN) {
+				lsn = sfs_jphys_write(sfs, NULL, NULL,
+						      SFS_JREC_DINODE,
+						      rec, pos);
+				pos = sizeof(*jd);
+				continue;
+			}
+			room = (SFS_JREC_MAXLEN - pos - sizeof(dd)) /
+				sizeof(*o);
+			take = end - start < room ? end - start : room;
+			dd.jdd_offset = start * sizeof(*o);
+			dd.jdd_len = take * sizeof(*o);
+			memcpy(rec + pos, &dd, sizeof(dd));
+			pos += sizeof(dd);
+			memcpy(rec + pos, &n[start], dd.jdd_len);
+			pos += dd.jdd_len;
+			start += take;
+		}
+	}
+
+	if (pos > sizeof(*jd)) {
+		lsn = sfs_jphys_write(sfs, NULL, NULL, SFS_JREC_DINODE,
+				      rec, pos);
+	}
+	return lsn;
+}
+
+/*
+ * Log LEN bytes written at offset OFFSET of disk block BLOCK, as
+ * records of type TYPE, splitting it across records as needed. DATA
+ * points at the bytes written (not the start of the block). Returns
+ * the LSN of the last record.
+ */
+static
+sfs_lsn_t
+sfs_jrec_bytes(struct sfs_fs *sfs, unsigned type, daddr_t block,
+	       const void *data, unsigned offset, unsigned len)
+{
+	char rec[SFS_JREC_MAXLEN];
+	struct sfs_jrec_data *jdt = (struct sfs_jrec_data *)rec;
+	const char *p = data;
+	unsigned take;
+	sfs_lsn_t lsn;
+
+	KASSERT(len > 0);
+	KASSERT(offset + len <= SFS_BLOCKSIZE);
+
+	lsn = 0;
+	while (len > 0) {
+		take = SFS_JREC_MAXLEN - sizeof(*jdt);
+		if (take > len) {
+			take = len;
+		}
+		jdt->jdt_block = block;
+		jdt->jdt_offset = offset;
+		jdt->jdt_len = take;
+		memcpy(rec + sizeof(*jdt), p, take);
+		lsn = sfs_jphys_write(sfs, NULL, NULL, type,
+				      rec, sizeof(*jdt) + take);
+		p += take;
+		offset += take;
+		len -= take;
+	}
+	return lsn;
+}
+
+/*
+ * Log file data written to a block (data journaling mode).
+ */
+sfs_lsn_t
+sfs_jrec_data(struct sfs_fs *sfs, daddr_t block, const void *data,
+	      unsigned offset, unsigned len)
+{
+	return sfs_jrec_bytes(sfs, SFS_JREC_DATA, block, data, offset, len);
+}
+
+/*
+ * Log a change to a directory index block.
+ */
+sfs_lsn_t
+sfs_jrec_dirindex(struct sfs_fs *sfs, daddr_t block, const void *data,
+		  unsigned offset, unsigned len)
+{
+	return sfs_jrec_bytes(sfs, SFS_JREC_DIRINDEX, block, data, offset,
+			      len);
+}
+
+/*
+ * Apply the deltas of an SFS_JREC_DINODE record of length LEN to
+ * the inode DINO. (The caller finds the inode from jd_ino.) Returns
+ * EINVAL if the record is malformed; in that case DINO may have been
+ * partly updated.
+ */
+int
+sfs_jrec_dinode_redo(const void *rec, size_t len, struct sfs_dinode *dino)
+{
+	const char *p = rec;
+	struct sfs_jrec_delta dd;
+	size_t pos;
+
+	if (len < sizeof(struct sfs_jrec_dinode)) {
+		return EINVAL;
+	}
+	pos = sizeof(struct sfs_jrec_dinode);
+	while (pos < len) {
+		if (len - pos < sizeof(dd)) {
+			return EINVAL;
+		}
+		memcpy(&dd, p + pos, sizeof(dd));
+		pos += sizeof(dd);
+		if (dd.jdd_len > len - pos ||
+		    dd.jdd_offset > sizeof(*dino) ||
+		    dd.jdd_len > sizeof(*dino) - dd.jdd_offset) {
+			return EINVAL;
+		}
+		memcpy((char *)dino + dd.jdd_offset, p + pos, dd.jdd_len);
+		pos += dd.jdd_len;
+	}
+	return 0;
+}
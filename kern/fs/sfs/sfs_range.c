@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS range locks.
+ *
+ * Writes that stay within a file's current size hold the file's I/O
+ * lock only for reading, so several can run at once. They lock the
+ * range of file blocks they write here instead, so writes to the same
+ * blocks still happen one at a time and don't interleave, while writes
+ * to different parts of the file proceed in parallel.
+ *
+ * Ranges are in whole blocks, since that's the unit the buffer cache
+ * works in: two writes to different bytes of one block conflict. The
+ * ranges held are kept on a short list in the vnode, and each range
+ * is owned by the caller (normally on its stack), so locking one
+ * doesn't allocate. Waiters all sleep on one wait channel and recheck
+ * when any range is released; the list is only as long as the number
+ * of concurrent writers, so that's cheap enough.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Set up a vnode's range list.
+ */
+int
+sfs_range_init(struct sfs_vnode *sv)
+{
+	sv->sv_rangewchan = wchan_create("sfs range");
+	if (sv->sv_rangewchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sv->sv_rangelock);
+	sv->sv_ranges = NULL;
+	return 0;
+}
+
+/*
+ * Tear down a vnode's range list, which should be empty.
+ */
+void
+sfs_range_cleanup(struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_ranges == NULL);
+	spinlock_cleanup(&sv->sv_rangelock);
+	wchan_destroy(sv->sv_rangewchan);
+}
+
+/*
+ * Check if blocks START through END-1 overlap a range already held.
+ */
+static
+bool
+sfs_range_busy(struct sfs_vnode *sv, uint32_t start, uint32_t end)
+{
+	struct sfs_range *r;
+
+	KASSERT(spinlock_do_i_hold(&sv->sv_rangelock));
+
+	for (r = sv->sv_ranges; r != NULL; r = r->sr_next) {
+		if (start < r->sr_end && r->sr_start < end) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Lock blocks START through END-1 of a file, using R to record it,
+ * waiting until nobody else holds any of them. An empty range locks
+ * nothing and doesn't wait.
+ *
+ * Locking: must hold the I/O lock for reading, and not the vnode
+ *    lock, since the holders we wait for need it.
+ */
+void
+sfs_range_lock(struct sfs_vnode *sv, struct sfs_range *r,
+	       uint32_t start, uint32_t end)
+{
+	KASSERT(start <= end);
+
+	r->sr_start = start;
+	r->sr_end = end;
+
+	spinlock_acquire(&sv->sv_rangelock);
+	while (sfs_range_busy(sv, start, end)) {
+		wchan_sleep(sv->sv_rangewchan, &sv->sv_rangelock);
+	}
+	r->sr_next = sv->sv_ranges;
+	sv->sv_ranges = r;
+	spinlock_release(&sv->sv_rangelock);
+}
+
+/*
+ * Unlock a range locked with sfs_range_lock.
+ */
+void
+sfs_range_unlock(struct sfs_vnode *sv, struct sfs_range *r)
+{
+	struct sfs_range **p;
+
+	spinlock_acquire(&sv->sv_rangelock);
+	for (p = &sv->sv_ranges; *p != r; p = &(*p)->sr_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = r->sr_next;
+	r->sr_next = NULL;
+	wchan_wakeall(sv->sv_rangewchan, &sv->sv_rangelock);
+	spinlock_release(&sv->sv_rangelock);
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS reaper: background erasing of deleted files.
+ *
+ * When the last reference to a file with no links goes away, all its
+ * blocks have to be freed. For a big file that means walking every
+ * indirect block (or extent) with the freemap locked, and doing it in
+ * sfs_reclaim makes whoever dropped the reference (close, or unlink
+ * of a file nobody has open) wait for all of it. So instead
+ * sfs_reclaim hands files with more than a few blocks to a thread
+ * that frees them in the background, a batch of blocks at a time
+ * (see sfs_reap_vnode).
+ *
+ * A file waiting here is still in the vnode table, holding the one
+ * reference, so its inode number can't be reused until it's gone;
+ * nothing else can find it, since it has no links. Its link count of
+ * zero is already on disk, so if we crash first the inode is simply
+ * left allocated with nothing pointing at it, which sfsck cleans up,
+ * the same as after a crash partway through freeing it inline.
+ *
+ * Unmount drains the list first, so files waiting here don't make
+ * the volume look busy.
+ *
+ * Locking: rp_lock is a spinlock protecting the list. rp_busy is
+ * held while erasing a file, so sfs_reap_drain can wait for the
+ * thread to finish the one it's on; it comes before vnode locks.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <thread.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Reaper state.
+ */
+struct sfs_reaper {
+	struct spinlock rp_lock;	/* lock for the following */
+	struct wchan *rp_wchan;		/* thread waits here for work */
+	struct sfs_vnode *rp_head;	/* files to erase, oldest first */
+	struct sfs_vnode *rp_tail;
+	bool rp_running;		/* thread was started */
+	bool rp_stop;			/* thread should exit */
+
+	struct lock *rp_busy;		/* held while erasing a file */
+	struct semaphore *rp_done;	/* thread has exited */
+};
+
+/*
+ * Take the oldest file off the list and erase it. Returns false if
+ * there wasn't one.
+ */
+static
+bool
+sfs_reap_one(struct sfs_fs *sfs)
+{
+	struct sfs_reaper *rp = sfs->sfs_reaper;
+	struct sfs_vnode *sv;
+
+	lock_acquire(rp->rp_busy);
+
+	spinlock_acquire(&rp->rp_lock);
+	sv = rp->rp_head;
+	if (sv != NULL) {
+		rp->rp_head = sv->sv_reapnext;
+		if (rp->rp_head == NULL) {
+			rp->rp_tail = NULL;
+		}
+		sv->sv_reapnext = NULL;
+	}
+	spinlock_release(&rp->rp_lock);
+
+	if (sv != NULL) {
+		sfs_reap_vnode(sv);
+	}
+
+	lock_release(rp->rp_busy);
+	return sv != NULL;
+}
+
+/*
+ * Hand a file to the reaper. SV must have no links and the reference
+ * being dropped in sfs_reclaim, which the reaper takes over. Returns
+ * false, without taking it, if there's no reaper thread; then the
+ * caller must erase the file itself.
+ *
+ * Locking: may be called holding the vnode lock and sfs_vnlock.
+ */
+bool
+sfs_reap_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_reaper *rp = sfs->sfs_reaper;
+
+	KASSERT(sv->sv_reapnext == NULL);
+
+	spinlock_acquire(&rp->rp_lock);
+	if (!rp->rp_running) {
+		spinlock_release(&rp->rp_lock);
+		return false;
+	}
+	if (rp->rp_tail == NULL) {
+		rp->rp_head = sv;
+	}
+	else {
+		rp->rp_tail->sv_reapnext = sv;
+	}
+	rp->rp_tail = sv;
+	wchan_wakeone(rp->rp_wchan, &rp->rp_lock);
+	spinlock_release(&rp->rp_lock);
+	return true;
+}
+
+/*
+ * Erase every file waiting for the reaper, and wait for the one it's
+ * working on, if any. Returns true if anything was erased (by us).
+ *
+ * Locking: must not hold any vnode locks or sfs_vnlock.
+ */
+bool
+sfs_reap_drain(struct sfs_fs *sfs)
+{
+	bool any;
+
+	any = false;
+	while (sfs_reap_one(sfs)) {
+		any = true;
+	}
+	return any;
+}
+
+/*
+ * Reaper thread.
+ */
+static
+void
+sfs_reap_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct sfs_reaper *rp = sfs->sfs_reaper;
+	bool stop;
+
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&rp->rp_lock);
+		while (rp->rp_head == NULL && !rp->rp_stop) {
+			wchan_sleep(rp->rp_wchan, &rp->rp_lock);
+		}
+		stop = rp->rp_stop;
+		spinlock_release(&rp->rp_lock);
+		if (stop) {
+			break;
+		}
+
+		sfs_reap_one(sfs);
+	}
+	V(rp->rp_done);
+}
+
+////////////////////////////////////////////////////////////
+// setup and shutdown
+
+/*
+ * Create the reaper state.
+ */
+struct sfs_reaper *
+sfs_reaper_create(void)
+{
+	struct sfs_reaper *rp;
+
+	rp = kmalloc(sizeof(*rp));
+	if (rp == NULL) {
+		return NULL;
+	}
+	rp->rp_wchan = wchan_create("sfs_reap");
+	if (rp->rp_wchan == NULL) {
+		kfree(rp);
+		return NULL;
+	}
+	rp->rp_busy = lock_create("sfs_reap");
+	if (rp->rp_busy == NULL) {
+		wchan_destroy(rp->rp_wchan);
+		kfree(rp);
+		return NULL;
+	}
+	rp->rp_done = sem_create("sfs_reap", 0);
+	if (rp->rp_done == NULL) {
+		lock_destroy(rp->rp_busy);
+		wchan_destroy(rp->rp_wchan);
+		kfree(rp);
+		return NULL;
+	}
+	spinlock_init(&rp->rp_lock);
+	rp->rp_head = rp->rp_tail = NULL;
+	rp->rp_running = false;
+	rp->rp_stop = false;
+	return rp;
+}
+
+/*
+ * Destroy the reaper state.
+ */
+void
+sfs_reaper_destroy(struct sfs_reaper *rp)
+{
+	KASSERT(!rp->rp_running);
+	KASSERT(rp->rp_head == NULL);
+	sem_destroy(rp->rp_done);
+	lock_destroy(rp->rp_busy);
+	wchan_destroy(rp->rp_wchan);
+	spinlock_cleanup(&rp->rp_lock);
+	kfree(rp);
+}
+
+/*
+ * Start the reaper thread at mount time. If we can't, deleted files
+ * are just erased in sfs_reclaim.
+ */
+void
+sfs_reap_start(struct sfs_fs *sfs)
+{
+	struct sfs_reaper *rp = sfs->sfs_reaper;
+	int result;
+
+	KASSERT(!rp->rp_running);
+
+	result = thread_fork("sfs_reap", NULL, sfs_reap_thread, sfs, 0);
+	if (result) {
+		kprintf("sfs: %s: cannot start reaper: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+		return;
+	}
+	spinlock_acquire(&rp->rp_lock);
+	rp->rp_running = true;
+	spinlock_release(&rp->rp_lock);
+}
+
+/*
+ * Stop the reaper thread, for unmount. There must be nothing left
+ * for it to do. Waits for the thread to exit.
+ */
+void
+sfs_reap_stop(struct sfs_fs *sfs)
+{
+	struct sfs_reaper *rp = sfs->sfs_reaper;
+
+	spinlock_acquire(&rp->rp_lock);
+	if (!rp->rp_running) {
+		spinlock_release(&rp->rp_lock);
+		return;
+	}
+	KASSERT(rp->rp_head == NULL);
+	rp->rp_stop = true;
+	rp->rp_running = false;
+	wchan_wakeall(rp->rp_wchan, &rp->rp_lock);
+	spinlock_release(&rp->rp_lock);
+	P(rp->rp_done);
+}
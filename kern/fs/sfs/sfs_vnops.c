@@ -35,10 +35,13 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/dirent.h>
+#include <kern/ioctl.h>
 #include <limits.h>
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <synch.h>
 #include <vfs.h>
 #include <buf.h>
@@ -48,25 +51,46 @@
 /*
  * Locking protocol for sfs:
  *    The following locks exist:
+ *       vnode I/O locks (sv_rwlock, reader-writer)
  *       vnode locks (sv_lock)
  *       vnode table lock (sfs_vnlock)
  *       freemap lock (sfs_freemaplock)
- *       rename lock (sfs_renamelock)
+ *       allocation group locks (sfs_aglocks)
+ *       rename lock (sfs_renamelock, cross-directory renames only)
+ *       reaper lock (see sfs_reap.c)
  *       buffer lock
  *
  *    Ordering constraints:
  *       rename lock       before  vnode locks
+ *       reaper lock       before  vnode locks
+ *       vnode I/O lock    before  range locks (of the same file)
+ *       range locks       before  vnode lock (of the same file)
  *       vnode locks       before  vnode table lock
  *       vnode locks       before  buffer locks
  *       vnode table lock  before  freemap lock
  *       buffer lock       before  freemap lock
+ *       freemap lock      before  allocation group locks
+ *       vnode table lock  before  allocation group locks
+ *       buffer lock       before  allocation group locks
  *
  *    I believe the vnode table lock and the buffer locks are
  *    independent.
  *
+ *    The I/O lock is only taken by read, write, and truncate on
+ *    regular files. Reads hold it for reading and take the vnode lock
+ *    only around looking at the inode and block map, so reads of one
+ *    file can run together. Writes within the file's size do the
+ *    same, also holding a range lock (sfs_range.c) on the blocks they
+ *    write. Writes that extend the file and truncates hold it for
+ *    writing, so the size and the blocks a reader has mapped can't
+ *    change under it.
+ *
  *    Ordering among vnode locks:
  *       directory lock    before  lock of a file within the directory
  *
+ *    Ordering among allocation group locks:
+ *       Ascending group number.
+ *
  *    Ordering among directory locks:
  *       Parent first, then child.
  */
@@ -129,7 +153,8 @@ sfs_eachopendir(struct vnode *v, int openflags)
 /*
  * Called for read(). sfs_io() does the work.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases the I/O lock for reading; sfs_io gets the
+ *    vnode lock as needed.
  *
  * Requires up to 3 buffers.
  */
@@ -142,19 +167,32 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_read(sv->sv_rwlock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_io(sv, uio);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_read(sv->sv_rwlock);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Write back one file, for fsync and fdatasync.
+ *
+ * Only this file is written: first its pending blocks get disk
+ * blocks, then the dirty buffers it owns (data, indirect and extent
+ * blocks) are written, then its inode, and last the journal is
+ * flushed as far as the newest record logged on its behalf. The
+ * freemap and the superblock are left to the syncer; after a crash
+ * sfsck rebuilds the freemap from the inodes anyway.
+ *
+ * If DATAONLY, the inode and the journal are skipped unless the
+ * size or block map changed (see sfs_dinode_mark_mapdirty), so
+ * overwriting in place costs just the data writes. Data-mode
+ * journal records don't need the journal flush: the journal is
+ * written ahead of the blocks they cover, which we just wrote.
  *
  * Locking: gets/releases vnode lock.
  *
@@ -162,21 +200,169 @@ sfs_read(struct vnode *v, struct uio *uio)
  */
 static
 int
-sfs_write(struct vnode *v, struct uio *uio)
+sfs_sync_file(struct sfs_vnode *sv, bool dataonly)
 {
-	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	bool mapdirty;
+	sfs_lsn_t lsn;
 	int result;
 
-	KASSERT(uio->uio_rw==UIO_WRITE);
+	reserve_buffers(SFS_BLOCKSIZE);
+	lock_acquire(sv->sv_lock);
+	result = sfs_dalloc_flush(sv);
+	mapdirty = sv->sv_mapdirty;
+	if (result == 0) {
+		sv->sv_mapdirty = false;
+	}
+	lock_release(sv->sv_lock);
+	unreserve_buffers(SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+
+	result = sync_owner_buffers(&sfs->sfs_absfs, sv->sv_bufowner);
+	if (result) {
+		goto fail;
+	}
+	if (dataonly && !mapdirty) {
+		return 0;
+	}
+	result = buffer_flush(&sfs->sfs_absfs, sv->sv_ino, SFS_BLOCKSIZE);
+	if (result) {
+		goto fail;
+	}
+
+	spinlock_acquire(&sv->sv_rangelock);
+	lsn = sv->sv_synclsn;
+	spinlock_release(&sv->sv_rangelock);
+	if (lsn == 0) {
+		return 0;
+	}
+
+	/* Other files' ordered data has to go out before the commit */
+	result = sfs_ordered_flush(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_jphys_flush(sfs, lsn);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&sv->sv_rangelock);
+	if (sv->sv_synclsn == lsn) {
+		sv->sv_synclsn = 0;
+	}
+	spinlock_release(&sv->sv_rangelock);
+	return 0;
+
+ fail:
+	/* the inode may not have gone out; leave that for the next try */
+	if (mapdirty) {
+		lock_acquire(sv->sv_lock);
+		sv->sv_mapdirty = true;
+		lock_release(sv->sv_lock);
+	}
+	return result;
+}
+
+/*
+ * Check whether a write would extend the file, for sfs_write. Writes
+ * to an inline file count, as they change the inode.
+ *
+ * Locking: gets/releases the vnode lock.
+ *
+ * Requires 1 buffer.
+ */
+static
+int
+sfs_write_extends(struct sfs_vnode *sv, struct uio *uio, bool *ret)
+{
+	struct sfs_dinode *inodeptr;
+	int result;
 
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
-	result = sfs_io(sv, uio);
+	result = sfs_dinode_load(sv);
+	if (result == 0) {
+		inodeptr = sfs_dinode_map(sv);
+		*ret = uio->uio_offset + uio->uio_resid > sfs_size(sv) ||
+			(inodeptr->sfi_flags & SFS_DIF_INLINE) != 0;
+		sfs_dinode_unload(sv);
+	}
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
+	return result;
+}
+
+/*
+ * Called for write().
+ *
+ * Writes within the current size only need the I/O lock for reading,
+ * so they don't hold up readers. They lock the blocks they cover with
+ * a range lock and go through sfs_overwrite, so writes to different
+ * parts of the file can run together. Writes that extend the file
+ * need the I/O lock for writing and go through sfs_io holding the
+ * vnode lock. There's no upgrading, so if it turns out we need that
+ * we let go and start over.
+ *
+ * For O_DSYNC, once the write is done its data goes to disk the same
+ * way as for fdatasync.
+ *
+ * Locking: gets/releases the I/O lock and the vnode lock, and for
+ *    writes within the file a range lock.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_write(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_range range;
+	bool extends;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_WRITE);
+
+	rwlock_acquire_read(sv->sv_rwlock);
+
+	result = sfs_write_extends(sv, uio, &extends);
+	if (result) {
+		rwlock_release_read(sv->sv_rwlock);
+		return result;
+	}
+
+	if (!extends) {
+		sfs_range_lock(sv, &range, uio->uio_offset / SFS_BLOCKSIZE,
+			       DIVROUNDUP(uio->uio_offset + uio->uio_resid,
+					  SFS_BLOCKSIZE));
+		reserve_buffers(SFS_BLOCKSIZE);
+
+		result = sfs_overwrite(sv, uio);
+
+		unreserve_buffers(SFS_BLOCKSIZE);
+		sfs_range_unlock(sv, &range);
+		rwlock_release_read(sv->sv_rwlock);
+	}
+	else {
+		rwlock_release_read(sv->sv_rwlock);
+		rwlock_acquire_write(sv->sv_rwlock);
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(SFS_BLOCKSIZE);
+
+		result = sfs_io(sv, uio);
+
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_rwlock);
+	}
 
+	if (result == 0 && uio->uio_dsync) {
+		result = sfs_sync_file(sv, true);
+	}
 	return result;
 }
 
@@ -259,22 +445,244 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 }
 
 /*
- * Called for ioctl()
- * Locking: not needed.
+ * Most directory entries getdirentries takes in at once.
+ */
+#define SFS_GETDIRENTRIES_BATCH	16
+
+/*
+ * Fill in DP (but not its name or lengths) for the vnode SV.
+ *
+ * Locking: gets/releases the vnode lock of SV.
+ *
+ * Requires 1 buffer.
  */
 static
 int
-sfs_ioctl(struct vnode *v, int op, userptr_t data)
+sfs_direntplus_fill(struct sfs_vnode *sv, struct direntplus *dp)
 {
-	/*
-	 * No ioctls.
-	 */
+	struct sfs_dinode *inodeptr;
+	int result;
 
-	(void)v;
-	(void)op;
-	(void)data;
+	result = VOP_GETTYPE(&sv->sv_absvn, &dp->dp_type);
+	if (result) {
+		return result;
+	}
 
-	return EINVAL;
+	lock_acquire(sv->sv_lock);
+	result = sfs_dinode_load(sv);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	dp->dp_ino = sv->sv_ino;
+	dp->dp_size = sfs_size(sv);
+	dp->dp_nlink = inodeptr->sfi_linkcount;
+	sfs_dinode_unload(sv);
+	lock_release(sv->sv_lock);
+	return 0;
+}
+
+/*
+ * Called for getdirentries()
+ *
+ * This goes through the directory a batch of entries at a time.
+ * Under the directory's lock, it reads the entries and gets their
+ * vnodes (as lookup would, so none can be removed out from under
+ * us); then, without that lock, it gets each one's inode and copies
+ * out its record. Not holding the directory's lock while locking its
+ * entries keeps us from getting them in the wrong order (for "..",
+ * and for rename). Like getdirentry, this uses uio_offset as the
+ * slot index. It stops at the first record that doesn't fit, to be
+ * picked up there by the next call.
+ *
+ * Locking: gets/releases the vnode lock, then those of the entries.
+ *
+ * Requires up to 4 buffers.
+ */
+static
+int
+sfs_getdirentries(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_direntry tsd;
+	struct sfs_vnode *batch[SFS_GETDIRENTRIES_BATCH];
+	int slots[SFS_GETDIRENTRIES_BATCH];
+	char *names;
+	struct direntplus *dp;
+	off_t pos;
+	size_t namelen, reclen;
+	unsigned n, i;
+	int nentries;
+	bool any, full;
+	int result;
+
+	KASSERT(uio->uio_offset >= 0);
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	/* the names of the batch, then room for one record */
+	names = kmalloc(SFS_GETDIRENTRIES_BATCH * SFS_NAMELEN +
+			DIRENTPLUS_RECLEN(SFS_NAMELEN));
+	if (names == NULL) {
+		return ENOMEM;
+	}
+	dp = (struct direntplus *)(names +
+				   SFS_GETDIRENTRIES_BATCH * SFS_NAMELEN);
+
+	pos = uio->uio_offset;
+	any = full = false;
+	result = 0;
+	while (!full) {
+		/* Read the next batch of entries and get their vnodes */
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(SFS_BLOCKSIZE);
+		result = sfs_dinode_load(sv);
+		if (result) {
+			unreserve_buffers(SFS_BLOCKSIZE);
+			lock_release(sv->sv_lock);
+			break;
+		}
+		result = sfs_dir_nentries(sv, &nentries);
+		for (n=0; result == 0 && n < SFS_GETDIRENTRIES_BATCH &&
+			     pos < nentries; pos++) {
+			result = sfs_readdir(sv, pos, &tsd);
+			if (result || tsd.sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			result = sfs_loadvnode(sfs, tsd.sfd_ino,
+					       SFS_TYPE_INVAL, &batch[n]);
+			if (result) {
+				continue;
+			}
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			strcpy(names + n * SFS_NAMELEN, tsd.sfd_name);
+			slots[n] = pos;
+			n++;
+		}
+		sfs_dinode_unload(sv);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+
+		if (result == 0 && n == 0) {
+			/* EOF */
+			break;
+		}
+
+		/* Make and copy out the records, until one doesn't fit */
+		reserve_buffers(SFS_BLOCKSIZE);
+		for (i=0; i<n; i++) {
+			if (result == 0 && !full) {
+				namelen = strlen(names + i * SFS_NAMELEN);
+				reclen = DIRENTPLUS_RECLEN(namelen);
+				if (reclen > uio->uio_resid) {
+					/* resume here next time */
+					full = true;
+					pos = slots[i];
+				}
+			}
+			if (result == 0 && !full) {
+				bzero(dp, reclen);
+				result = sfs_direntplus_fill(batch[i], dp);
+			}
+			if (result == 0 && !full) {
+				dp->dp_reclen = reclen;
+				dp->dp_namelen = namelen;
+				strcpy(dp->dp_name, names + i * SFS_NAMELEN);
+				result = uiomove(dp, reclen, uio);
+				any = true;
+			}
+			VOP_DECREF(&batch[i]->sv_absvn);
+		}
+		unreserve_buffers(SFS_BLOCKSIZE);
+
+		if (result) {
+			break;
+		}
+	}
+	kfree(names);
+
+	if (result == 0 && full && !any) {
+		/* the buffer's too small for even one */
+		result = EINVAL;
+	}
+
+	/* Update the offset the way we want it */
+	uio->uio_offset = pos;
+
+	return result;
+}
+
+/*
+ * Move a file's blocks together, for IOC_DEFRAG. Only extent-mapped
+ * files can be moved (see sfs_xdefrag); inline files have no blocks
+ * and for ones mapped with block pointers both counts come back 0.
+ *
+ * Locking: gets/releases the I/O lock for writing and the vnode lock.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_defrag(struct sfs_vnode *sv, struct defragstat *ds)
+{
+	struct sfs_dinode *inodeptr;
+	int result;
+
+	ds->ds_before = ds->ds_after = 0;
+
+	rwlock_acquire_write(sv->sv_rwlock);
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	/* Pending blocks have to be placed before they can be moved */
+	result = sfs_dalloc_flush(sv);
+	if (result) {
+		goto out;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		goto out;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if ((inodeptr->sfi_flags & SFS_DIF_EXTENTS) &&
+	    !(inodeptr->sfi_flags & SFS_DIF_INLINE)) {
+		result = sfs_xdefrag(sv, &ds->ds_before, &ds->ds_after);
+	}
+	sfs_dinode_unload(sv);
+
+ out:
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_rwlock);
+	return result;
+}
+
+/*
+ * Called for ioctl().
+ * Locking: as for the operation.
+ */
+static
+int
+sfs_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct defragstat ds;
+	int result;
+
+	switch (op) {
+	    case IOC_DEFRAG:
+		if (sv->sv_type != SFS_TYPE_FILE) {
+			return EISDIR;
+		}
+		result = sfs_defrag(sv, &ds);
+		if (result) {
+			return result;
+		}
+		return copyout(&ds, data, sizeof(ds));
+	}
+	return EIOCTL;
 }
 
 /*
@@ -313,8 +721,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 	inodeptr = sfs_dinode_map(sv);
 
-	statbuf->st_size = inodeptr->sfi_size;
+	statbuf->st_size = sfs_size(sv);
 	statbuf->st_nlink = inodeptr->sfi_linkcount;
+	statbuf->st_blksize = SFS_BLOCKSIZE;
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -366,11 +775,6 @@ sfs_isseekable(struct vnode *v)
 
 /*
  * Called for fsync().
- *
- * Since for now the buffer cache can't sync just one file, sync the
- * whole fs. This is lame.
- *
- * Locking: gets/releases vnode lock. (XXX: really?)
  */
 static
 int
@@ -378,24 +782,39 @@ sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	return FSOP_SYNC(sv->sv_absvn.vn_fs);
+	return sfs_sync_file(sv, false);
 }
 
 /*
- * Called for mmap().
+ * Called for fdatasync(), and after each write to a file opened with
+ * O_DSYNC.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_fdatasync(struct vnode *v)
+{
+	struct sfs_vnode *sv = v->vn_data;
+
+	return sfs_sync_file(sv, true);
+}
+
+/*
+ * Called for mmap(). Regular files can be mapped; the VM system pages
+ * them in and out with VOP_READ and VOP_WRITE.
+ */
+static
+int
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
  * Truncate a file.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases the I/O lock for writing, so no reads are
+ *    in progress, and the vnode lock.
  *
  * Requires up to 4 buffers.
  */
@@ -406,6 +825,7 @@ sfs_truncate(struct vnode *v, off_t len)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
+	rwlock_acquire_write(sv->sv_rwlock);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -413,37 +833,232 @@ sfs_truncate(struct vnode *v, off_t len)
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_rwlock);
 	return result;
 }
 
 /*
- * Helper function for sfs_namefile.
+ * Called for fallocate.
+ *
+ * For an extent-mapped file, the missing blocks are allocated in
+ * runs and recorded as unwritten extents (sfs_xprealloc), so nothing
+ * is zeroed or written now besides the block map. A file mapped with
+ * block pointers has no way to say a block is unwritten, so its
+ * missing blocks are allocated and zeroed the ordinary way, but all
+ * asked for at once so they come out contiguous. An inline file that
+ * would still fit inline just gets longer.
+ *
+ * The size is set in the inode right away rather than noted in the
+ * vnode, so the new blocks and the size that covers them go out to
+ * disk together.
  *
- * Locking: must hold vnode lock on parent.
+ * Locking: gets/releases the I/O lock for writing and the vnode lock.
  *
  * Requires up to 3 buffers.
  */
 static
 int
-sfs_getonename(struct sfs_vnode *parent, uint32_t targetino,
-	       char *buf, size_t *bufpos)
+sfs_fallocate(struct vnode *v, off_t pos, off_t len)
 {
-	size_t bp = *bufpos;
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_dinode *inodeptr;
+	uint32_t fileblock, endblock, b;
+	daddr_t diskblock;
+	off_t end;
+	int result;
 
-	struct sfs_direntry sd;
-	size_t namelen;
+	KASSERT(pos >= 0);
+	KASSERT(len > 0);
+
+	/* sfi_size is 32 bits */
+	if (pos > 0xffffffff || len > 0xffffffff - pos) {
+		return EFBIG;
+	}
+	end = pos + len;
+
+	rwlock_acquire_write(sv->sv_rwlock);
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		goto out;
+	}
+	inodeptr = sfs_dinode_map(sv);
+
+	if (inodeptr->sfi_flags & SFS_DIF_INLINE) {
+		if (end <= (off_t)SFS_INLINE_MAX) {
+			if (end > sfs_size(sv)) {
+				sfs_inline_trunc(sv, end);
+			}
+			goto out_unload;
+		}
+		result = sfs_inline_promote(sv);
+		if (result) {
+			goto out_unload;
+		}
+	}
+
+	fileblock = pos / SFS_BLOCKSIZE;
+	endblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+
+	if (inodeptr->sfi_flags & SFS_DIF_EXTENTS) {
+		result = sfs_xprealloc(sv, fileblock, endblock - fileblock);
+	}
+	else {
+		for (b = fileblock; b < endblock; b++) {
+			sv->sv_wantblocks = endblock - b;
+			result = sfs_bmap(sv, b, true, &diskblock);
+			if (result) {
+				break;
+			}
+		}
+		sv->sv_wantblocks = 0;
+	}
+	if (result) {
+		goto out_unload;
+	}
+
+	if (end > sfs_size(sv)) {
+		sfs_size_set(sv, end);
+	}
+
+ out_unload:
+	sfs_dinode_unload(sv);
+ out:
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_rwlock);
+	return result;
+}
+
+/*
+ * Find the next data (DATA true) or hole (DATA false) at or after
+ * POS, for lseek. Blocks are the unit: a partly written block is all
+ * data. Pending delayed-allocation blocks are placed first so they
+ * don't look like holes.
+ *
+ * Locking: gets/releases the vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_seekhole(struct vnode *v, off_t pos, bool data, off_t *ret)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	uint32_t fileblock, endblock, holelen;
+	daddr_t diskblock;
+	off_t size;
+	bool inlined;
 	int result;
 
-	KASSERT(lock_do_i_hold(parent->sv_lock));
-	KASSERT(targetino != SFS_NOINO);
+	KASSERT(pos >= 0);
+
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
 
-	result = sfs_dir_findino(parent, targetino, &sd, NULL);
+	if (sv->sv_danum > 0) {
+		result = sfs_dalloc_flush(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
+	result = sfs_dinode_load(sv);
 	if (result) {
-		return result;
+		goto out;
+	}
+	size = sfs_size(sv);
+	inlined = sfs_inline_is(sv);
+	sfs_dinode_unload(sv);
+
+	if (pos >= size) {
+		result = ENXIO;
+		goto out;
+	}
+
+	/* an inline file is all data */
+	if (inlined) {
+		*ret = data ? pos : size;
+		goto out;
+	}
+
+	endblock = DIVROUNDUP(size, SFS_BLOCKSIZE);
+	fileblock = pos / SFS_BLOCKSIZE;
+	while (fileblock < endblock) {
+		result = sfs_bmap_hole(sv, fileblock, &diskblock, &holelen);
+		if (result) {
+			goto out;
+		}
+		if ((diskblock != 0) == data) {
+			break;
+		}
+		if (diskblock != 0) {
+			fileblock++;
+		}
+		else if (holelen >= endblock - fileblock) {
+			fileblock = endblock;
+		}
+		else {
+			fileblock += holelen;
+		}
+	}
+
+	if (fileblock >= endblock) {
+		/* no more data; the end of the file counts as a hole */
+		if (data) {
+			result = ENXIO;
+			goto out;
+		}
+		*ret = size;
+	}
+	else {
+		*ret = (off_t)fileblock * SFS_BLOCKSIZE;
+		if (*ret < pos) {
+			*ret = pos;
+		}
 	}
 
+ out:
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+	return result;
+}
+
+/*
+ * Remember where a directory lives: the inode number of its parent
+ * and its name there. This lets sfs_namefile walk up the tree
+ * without scanning each parent for the child's entry. Anything that
+ * moves or removes a directory must update or clear this.
+ *
+ * Locking: must hold vnode lock on the directory.
+ */
+static
+void
+sfs_setparent(struct sfs_vnode *sv, uint32_t parentino, const char *name)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_type == SFS_TYPE_DIR);
+	KASSERT(strlen(name) < sizeof(sv->sv_name));
+
+	sv->sv_parentino = parentino;
+	strcpy(sv->sv_name, name);
+}
+
+/*
+ * Helper function for sfs_namefile: add NAME and a slash in front of
+ * what's already at BUF+*BUFPOS.
+ */
+static
+int
+sfs_prependname(const char *name, char *buf, size_t *bufpos)
+{
+	size_t bp = *bufpos;
+	size_t namelen;
+
 	/* include a trailing slash in the length */
-	namelen = strlen(sd.sfd_name)+1;
+	namelen = strlen(name)+1;
 	if (namelen > bp) {
 		/*
 		 * Doesn't fit. ERANGE is the error from the BSD man page,
@@ -452,15 +1067,54 @@ sfs_getonename(struct sfs_vnode *parent, uint32_t targetino,
 		return ERANGE;
 	}
 	buf[bp-1] = '/';
-	memmove(buf+bp-namelen, sd.sfd_name, namelen-1);
+	memmove(buf+bp-namelen, name, namelen-1);
 	*bufpos = bp-namelen;
 	return 0;
 }
 
+/*
+ * Helper function for sfs_namefile, for when CHILD's place in the
+ * tree isn't cached: find its name in PARENT, record it in the cache,
+ * and add it to the buffer.
+ *
+ * Locking: must hold vnode lock on parent. Gets/releases the lock
+ *    on the child, which is legal since it's in the parent.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_getonename(struct sfs_vnode *parent, struct sfs_vnode *child,
+	       char *buf, size_t *bufpos)
+{
+	struct sfs_direntry sd;
+	int result;
+
+	KASSERT(lock_do_i_hold(parent->sv_lock));
+	KASSERT(child->sv_ino != SFS_NOINO);
+
+	result = sfs_dir_findino(parent, child->sv_ino, &sd, NULL);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(child->sv_lock);
+	sfs_setparent(child, parent->sv_ino, sd.sfd_name);
+	lock_release(child->sv_lock);
+
+	return sfs_prependname(sd.sfd_name, buf, bufpos);
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  *
- * Locking: Gets/releases vnode locks, but only one at a time.
+ * Each directory remembers its parent and its name there (see
+ * sfs_setparent), so usually this is just a walk of those; the
+ * directory scans are only needed the first time through a
+ * directory that hasn't been looked up that way yet.
+ *
+ * Locking: Gets/releases vnode locks; never holds more than a
+ *    directory and one of its children.
  *
  * Requires up to 3 buffers.
  */
@@ -468,8 +1122,10 @@ static
 int
 sfs_namefile(struct vnode *vv, struct uio *uio)
 {
+	struct sfs_fs *sfs = vv->vn_fs->fs_data;
 	struct sfs_vnode *sv = vv->vn_data;
 	struct sfs_vnode *parent = NULL;
+	uint32_t parentino;
 	int result;
 	char *buf;
 	size_t bufpos, bufmax, len;
@@ -492,32 +1148,35 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 
 	VOP_INCREF(&sv->sv_absvn);
 
-	while (1) {
+	while (sv->sv_ino != SFS_ROOTDIR_INO) {
 		lock_acquire(sv->sv_lock);
-		/* not allowed to lock child since we're going up the tree */
-		result = sfs_lookonce(sv, "..", &parent, NULL);
-		lock_release(sv->sv_lock);
-
-		if (result) {
-			VOP_DECREF(&sv->sv_absvn);
-			kfree(buf);
-			unreserve_buffers(SFS_BLOCKSIZE);
-			return result;
+		parentino = sv->sv_parentino;
+		if (parentino != SFS_NOINO) {
+			result = sfs_prependname(sv->sv_name, buf, &bufpos);
+			lock_release(sv->sv_lock);
+			if (result == 0) {
+				result = sfs_loadvnode(sfs, parentino,
+						       SFS_TYPE_INVAL,
+						       &parent);
+			}
 		}
-
-		if (parent == sv) {
-			/* .. was equal to . - must be root, so we're done */
-			VOP_DECREF(&parent->sv_absvn);
-			VOP_DECREF(&sv->sv_absvn);
-			break;
+		else {
+			/* not allowed to lock child going up the tree */
+			result = sfs_lookonce(sv, "..", &parent, NULL);
+			lock_release(sv->sv_lock);
+			if (result == 0) {
+				KASSERT(parent != sv);
+				lock_acquire(parent->sv_lock);
+				result = sfs_getonename(parent, sv,
+							buf, &bufpos);
+				lock_release(parent->sv_lock);
+			}
 		}
 
-		lock_acquire(parent->sv_lock);
-		result = sfs_getonename(parent, sv->sv_ino, buf, &bufpos);
-		lock_release(parent->sv_lock);
-
 		if (result) {
-			VOP_DECREF(&parent->sv_absvn);
+			if (parent != NULL) {
+				VOP_DECREF(&parent->sv_absvn);
+			}
 			VOP_DECREF(&sv->sv_absvn);
 			kfree(buf);
 			unreserve_buffers(SFS_BLOCKSIZE);
@@ -528,6 +1187,7 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 		sv = parent;
 		parent = NULL;
 	}
+	VOP_DECREF(&sv->sv_absvn);
 
 	/* Done looking, now send back the string */
 
@@ -621,7 +1281,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
@@ -786,7 +1446,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 		      sfs->sfs_sb.sb_volname, name, sv->sv_ino);
 	}
 
-	result = sfs_makeobj(sfs, SFS_TYPE_DIR, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_DIR, &newguy);
 	if (result) {
 		goto die_simple;
 	}
@@ -822,6 +1482,8 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	sfs_dinode_mark_dirty(newguy);
 	sfs_dinode_mark_dirty(sv);
 
+	sfs_setparent(newguy, sv->sv_ino, name);
+
 	sfs_dinode_unload(newguy);
 	sfs_dinode_unload(sv);
 	lock_release(newguy->sv_lock);
@@ -942,6 +1604,10 @@ sfs_rmdir(struct vnode *v, const char *name)
 		goto die_total;
 	}
 
+	/* Drop any cached negative entries for the dead directory */
+	vfs_cache_purgedir(&victim->sv_absvn);
+	victim->sv_parentino = SFS_NOINO;
+
 die_total:
 	sfs_dinode_unload(victim);
 die_loadvictim:
@@ -1106,9 +1772,10 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
  * Rename a file.
  *
  * Locking:
- *    Locks sfs_renamelock.
- *    Calls check_parent, which locks various directories one at a
- *       time.
+ *    For renames between two different directories, locks
+ *       sfs_renamelock and calls check_parent, which locks various
+ *       directories one at a time. Renames within one directory
+ *       skip both.
  *    Locks the target vnodes and their parents in a complex fashion
  *       (described in detail below) which is carefully arranged so
  *       it won't deadlock with rmdir. Or at least I hope so.
@@ -1133,6 +1800,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	int result, result2;
 	struct sfs_direntry sd;
 	int found_dir1;
+	bool samedir;
 
 	/* make gcc happy */
 	obj2_inodeptr = NULL;
@@ -1150,24 +1818,39 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
 	/*
-	 * We only allow one rename to occur at a time. This appears
-	 * to be necessary to preserve the consistency of the
-	 * filesystem: once you do the parent check (that n1 is not an
-	 * ancestor of d2/n2) nothing may be allowed to happen that
-	 * might invalidate that result until all of the
-	 * rearrangements are complete. If other renames are allowed
-	 * to proceed, we'd need to lock every descendent of n1 to
-	 * make sure that some ancestor of d2/n2 doesn't get inserted
-	 * at some point deep down. This is impractical, so we use one
-	 * global lock.
+	 * We only allow one cross-directory rename to occur at a
+	 * time. This appears to be necessary to preserve the
+	 * consistency of the filesystem: once you do the parent check
+	 * (that n1 is not an ancestor of d2/n2) nothing may be allowed
+	 * to happen that might invalidate that result until all of
+	 * the rearrangements are complete. If other renames are
+	 * allowed to proceed, we'd need to lock every descendent of
+	 * n1 to make sure that some ancestor of d2/n2 doesn't get
+	 * inserted at some point deep down. This is impractical, so
+	 * we use one global lock.
+	 *
+	 * A rename within one directory doesn't change which
+	 * directory anything lives in, so it can't invalidate anyone
+	 * else's parent check and it needs no parent check of its
+	 * own. (The object we end up moving is whatever name1 refers
+	 * to once we hold the directory lock, and that is a child of
+	 * dir1 by construction.) So these renames serialize only on
+	 * the directory's own vnode lock, and the objects inside are
+	 * locked after it in the usual parent-before-child order.
+	 * This is by far the common case (editors, mail spools,
+	 * write-then-rename updates) and keeps unrelated renames in
+	 * different directories from queueing up behind each other.
 	 *
 	 * To prevent certain deadlocks while locking the vnodes we
 	 * need, the rename lock goes outside all the vnode locks.
 	 */
+	samedir = (dir1 == dir2);
 
 	reserve_buffers(SFS_BLOCKSIZE);
 
-	lock_acquire(sfs->sfs_renamelock);
+	if (!samedir) {
+		lock_acquire(sfs->sfs_renamelock);
+	}
 
 	/*
 	 * Get the objects we're moving.
@@ -1211,10 +1894,18 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 *
 	 * To prevent deadlocks, the parent check must be done without
 	 * holding locks on any other directories.
+	 *
+	 * For a rename within one directory there is nothing to
+	 * check; dir1 is trivially "found".
 	 */
-	result = check_parent(dir1, obj1, dir2, &found_dir1);
-	if (result) {
-		goto out0;
+	if (samedir) {
+		found_dir1 = 1;
+	}
+	else {
+		result = check_parent(dir1, obj1, dir2, &found_dir1);
+		if (result) {
+			goto out0;
+		}
 	}
 
 	/*
@@ -1316,10 +2007,12 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 *
 	 * Note that we must redo the lookup and get a new obj2, as it
 	 * may have changed under us. Since we hold the rename lock
-	 * for the whole fs, the fs structure cannot have changed, so
-	 * we don't need to redo the parent check or any of the checks
-	 * for vnode aliasing with dir1 or dir2 above. Note however
-	 * that obj1 and obj2 may now be the same even if they weren't
+	 * for the whole fs (or, within one directory, that
+	 * directory's lock, and the names in it are all that
+	 * matter), the fs structure cannot have changed, so we don't
+	 * need to redo the parent check or any of the checks for
+	 * vnode aliasing with dir1 or dir2 above. Note however that
+	 * obj1 and obj2 may now be the same even if they weren't
 	 * before.
 	 */
 	KASSERT(lock_do_i_hold(dir2->sv_lock));
@@ -1455,6 +2148,8 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 			/* ignore errors on this */
 			sfs_itrunc(obj2, 0);
+			vfs_cache_purgedir(&obj2->sv_absvn);
+			obj2->sv_parentino = SFS_NOINO;
 		}
 		else {
 			KASSERT(obj1->sv_type == SFS_TYPE_FILE);
@@ -1485,15 +2180,12 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	/*
 	 * At this point the target should be nonexistent and we have
 	 * a slot in the target directory we can use. Create a link
-	 * there. Do it by hand instead of using sfs_dir_link to avoid
-	 * duplication of effort.
+	 * there. Use sfs_dir_linkslot instead of sfs_dir_link to
+	 * avoid duplication of effort.
 	 */
 	KASSERT(obj2==NULL);
 
-	bzero(&sd, sizeof(sd));
-	sd.sfd_ino = obj1->sv_ino;
-	strcpy(sd.sfd_name, name2);
-	result = sfs_writedir(dir2, slot2, &sd);
+	result = sfs_dir_linkslot(dir2, slot2, name2, obj1->sv_ino);
 	if (result) {
 		goto out4;
 	}
@@ -1535,6 +2227,10 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	obj1_inodeptr->sfi_linkcount--;
 	sfs_dinode_mark_dirty(obj1);
 
+	if (obj1->sv_type == SFS_TYPE_DIR) {
+		sfs_setparent(obj1, dir2->sv_ino, name2);
+	}
+
 	KASSERT(result==0);
 
 	if (0) {
@@ -1588,11 +2284,63 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
-	lock_release(sfs->sfs_renamelock);
+	if (!samedir) {
+		lock_release(sfs->sfs_renamelock);
+	}
+
+	return result;
+}
+
+/*
+ * Look up one name in a directory for lookup/lookparent, going
+ * through the VFS name cache. The cache is consulted without the
+ * directory lock; entries are only added and removed with it held
+ * (see sfs_dir_linkslot and sfs_dir_unlink), so a hit is an answer we
+ * could have gotten by taking the lock.
+ *
+ * Locking: gets the vnode lock on a cache miss.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_lookonce_cached(struct sfs_vnode *sv, const char *name,
+		    struct sfs_vnode **ret)
+{
+	struct vnode *vn;
+	int result;
+
+	if (vfs_cache_lookup(&sv->sv_absvn, name, &vn)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn->vn_data;
+		return 0;
+	}
 
+	lock_acquire(sv->sv_lock);
+	result = sfs_lookonce(sv, name, ret, NULL);
+	if (result == 0) {
+		vfs_cache_enter(&sv->sv_absvn, name, &(*ret)->sv_absvn);
+	}
+	else if (result == ENOENT) {
+		vfs_cache_enter(&sv->sv_absvn, name, NULL);
+	}
+	lock_release(sv->sv_lock);
 	return result;
 }
 
+/*
+ * Walk all but the last component of PATH, handing back the directory
+ * reached and the last component.
+ *
+ * As many components at a time as possible are taken from the name
+ * cache with vfs_cache_walk, which takes no locks and only references
+ * where it ends up; only on a miss do we fall back to looking up one
+ * component the slow way. A component the walk stopped on that turns
+ * out to be cached as missing fails in sfs_lookonce_cached without
+ * touching the directory either.
+ */
 static
 int
 sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
@@ -1600,6 +2348,7 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *next;
+	struct vnode *vn;
 	char *s;
 	int result;
 
@@ -1612,6 +2361,15 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 			return ENOTDIR;
 		}
 
+		if (vfs_cache_walk(&sv->sv_absvn, &path, &vn) > 0) {
+			VOP_DECREF(&sv->sv_absvn);
+			sv = vn->vn_data;
+			if (sv->sv_type != SFS_TYPE_DIR) {
+				VOP_DECREF(&sv->sv_absvn);
+				return ENOTDIR;
+			}
+		}
+
 		s = strchr(path, '/');
 		if (!s) {
 			/* Last component. */
@@ -1620,9 +2378,7 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 		*s = 0;
 		s++;
 
-		lock_acquire(sv->sv_lock);
-		result = sfs_lookonce(sv, path, &next, NULL);
-		lock_release(sv->sv_lock);
+		result = sfs_lookonce_cached(sv, path, &next);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -1649,7 +2405,7 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
  * lookparent returns the last path component as a string and the
  * directory it's in as a vnode.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
+ * Locking: gets the vnode lock while calling sfs_lookonce_cached. Doesn't
  *   lock the new vnode, but does hand back a reference to it (so it
  *   won't evaporate).
  *
@@ -1671,7 +2427,7 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 /*
  * Lookup gets a vnode for a pathname.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
+ * Locking: gets the vnode lock while calling sfs_lookonce_cached. Doesn't
  *   lock the new vnode, but does hand back a reference to it (so it
  *   won't evaporate).
  *
@@ -1697,11 +2453,7 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	}
 
 	dir = dirv->vn_data;
-	lock_acquire(dir->sv_lock);
-
-	result = sfs_lookonce(dir, name, &final, NULL);
-
-	lock_release(dir->sv_lock);
+	result = sfs_lookonce_cached(dir, name, &final);
 	VOP_DECREF(dirv);
 
 	if (result) {
@@ -1730,14 +2482,19 @@ const struct vnode_ops sfs_fileops = {
 	.vop_read = sfs_read,
 	.vop_readlink = vopfail_uio_notdir,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = sfs_write,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
 	.vop_gettype = sfs_gettype,
 	.vop_isseekable = sfs_isseekable,
 	.vop_fsync = sfs_fsync,
+	.vop_fdatasync = sfs_fdatasync,
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
+	.vop_fallocate = sfs_fallocate,
+	.vop_seekhole = sfs_seekhole,
+	.vop_poll = vnode_poll_ready,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -1764,14 +2521,19 @@ const struct vnode_ops sfs_dirops = {
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = sfs_getdirentry,
+	.vop_getdirentries = sfs_getdirentries,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
 	.vop_gettype = sfs_gettype,
 	.vop_isseekable = sfs_isseekable,
 	.vop_fsync = sfs_fsync,
+	.vop_fdatasync = sfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_fallocate = vopfail_fallocate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
+	.vop_poll = vnode_poll_ready,
 	.vop_namefile = sfs_namefile,
 
 	.vop_creat = sfs_creat,
@@ -46,14 +46,24 @@ struct sfs_jphys_writecontext;
 /* journal iterator, used during recovery */
 struct sfs_jiter; /* opaque */
 
+/* Pending buffers for delayed allocation, per volume (sfs_dalloc.c) */
+#define SFS_DALLOC_MAX		32
+
+/* Fsmanaged buffers per volume: the journal head, plus the above */
+#define SFS_MANAGED_BUFS	(2 + SFS_DALLOC_MAX)
+
+/* Blocks per allocation group (sfs_balloc.c) */
+#define SFS_AG_BLOCKS		BITMAP_GROUPBITS
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
-/* Macro for initializing a uio structure */
+/* Macros for initializing a uio structure */
 #define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+    SFSUIOLEN(iov, uio, ptr, block, SFS_BLOCKSIZE, rw)
+#define SFSUIOLEN(iov, uio, ptr, block, len, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 /* Print macros for verbose recovery */
 #ifdef SFS_VERBOSE_RECOVERY
@@ -66,17 +76,68 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
+int sfs_balloc_goal(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock,
+		    struct buf **bufret);
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret);
+int sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, bool fill,
+		    daddr_t *diskblock, struct buf **bufret);
+int sfs_balloc_run(struct sfs_vnode *sv, daddr_t goal, uint32_t want,
+		   daddr_t *diskblock, uint32_t *got);
+int sfs_balloc_contig(struct sfs_fs *sfs, uint32_t num, daddr_t *diskblock);
+int sfs_bclear(struct sfs_fs *sfs, daddr_t diskblock, bool fill,
+	       struct buf **bufret);
+void sfs_bunreserve(struct sfs_vnode *sv);
+void sfs_bunreserve_prelocked(struct sfs_vnode *sv);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_lock_freemap(struct sfs_fs *sfs);
 void sfs_unlock_freemap(struct sfs_fs *sfs);
+bool sfs_freemap_locked(struct sfs_fs *sfs);
+int sfs_agroups_create(struct sfs_fs *sfs);
+void sfs_agroups_destroy(struct sfs_fs *sfs);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock,
 		bool doalloc, daddr_t *diskblock);
+int sfs_bmap_fill(struct sfs_vnode *sv, uint32_t fileblock,
+		  daddr_t *diskblock, struct buf **newbuf);
+int sfs_bmap_hole(struct sfs_vnode *sv, uint32_t fileblock,
+		  daddr_t *diskblock, uint32_t *holelen);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+void sfs_bmcache_add(struct sfs_vnode *sv, uint32_t fileblock,
+		     daddr_t diskblock, uint32_t len);
+void sfs_bmcache_clear(struct sfs_vnode *sv);
+
+/* Functions in sfs_extent.c */
+int sfs_xmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     daddr_t *diskblock, uint32_t *holelen);
+int sfs_xtrunc(struct sfs_vnode *sv, uint32_t newblocklen);
+int sfs_xprealloc(struct sfs_vnode *sv, uint32_t fileblock, uint32_t num);
+int sfs_xdefrag(struct sfs_vnode *sv, uint32_t *before, uint32_t *after);
+
+/* Functions in sfs_inline.c */
+bool sfs_inline_is(struct sfs_vnode *sv);
+int sfs_inline_read(struct sfs_vnode *sv, struct uio *uio);
+int sfs_inline_write(struct sfs_vnode *sv, struct uio *uio);
+void sfs_inline_trunc(struct sfs_vnode *sv, off_t newlen);
+int sfs_inline_promote(struct sfs_vnode *sv);
+
+/* Functions in sfs_dalloc.c */
+int sfs_dalloc_bmap(struct sfs_vnode *sv, uint32_t fileblock,
+		    daddr_t *diskblock, struct buf **dabuf);
+int sfs_dalloc_flush(struct sfs_vnode *sv);
+int sfs_dalloc_flushall(struct sfs_fs *sfs, bool wait);
+void sfs_dalloc_discard(struct sfs_vnode *sv, uint32_t fileblock);
+struct sfs_dalloc *sfs_dalloc_create(void);
+void sfs_dalloc_destroy(struct sfs_dalloc *sd);
+
+/* Functions in sfs_dirindex.c */
+int sfs_dirindex_lookup(struct sfs_vnode *sv, const char *name,
+			uint32_t *ino, int *slot, int *emptyslot);
+int sfs_dirindex_add(struct sfs_vnode *sv, const char *name, int slot);
+int sfs_dirindex_remove(struct sfs_vnode *sv, const char *name, int slot);
+int sfs_dirindex_discard(struct sfs_vnode *sv);
 
 /* Functions in sfs_dir.c */
 int sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd);
@@ -86,6 +147,8 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot);
 int sfs_dir_findino(struct sfs_vnode *sv, uint32_t ino,
 		struct sfs_direntry *retsd, int *slot);
+int sfs_dir_linkslot(struct sfs_vnode *sv, int slot, const char *name,
+		     uint32_t ino);
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
@@ -99,25 +162,74 @@ int sfs_dinode_load(struct sfs_vnode *sv);
 void sfs_dinode_unload(struct sfs_vnode *sv);
 struct sfs_dinode *sfs_dinode_map(struct sfs_vnode *sv);
 void sfs_dinode_mark_dirty(struct sfs_vnode *sv);
+void sfs_dinode_mark_mapdirty(struct sfs_vnode *sv);
+off_t sfs_size(struct sfs_vnode *sv);
+void sfs_size_extend(struct sfs_vnode *sv, off_t size);
+void sfs_size_set(struct sfs_vnode *sv, off_t size);
+int sfs_size_sync(struct sfs_vnode *sv);
+void sfs_vncache_trim(struct sfs_fs *sfs, unsigned max);
+void sfs_reap_vnode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
 int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
+int sfs_readblocks(struct fs *fs, daddr_t block, unsigned nblocks,
+		   void **data, size_t len);
 int sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		   void *data, size_t len);
+int sfs_writeblocks(struct fs *fs, daddr_t block, unsigned nblocks,
+		    void **fsbufdata, void **data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_overwrite(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
+void sfs_buffer_dirty(struct sfs_vnode *sv, struct buf *buf);
+void sfs_synclsn_note(struct sfs_vnode *sv, sfs_lsn_t lsn);
 
-/* Function used by sfs_jphys.c - you write this */
-/* XXX: there should be a template; but we don't ship the file it belongs in */
+/* Functions in sfs_jrec.c */
 #ifdef SFS_VERBOSE_RECOVERY
 const char *sfs_jphys_client_recname(unsigned type);
 #endif
+sfs_lsn_t sfs_jrec_bitflip(struct sfs_fs *sfs, daddr_t block, bool set);
+sfs_lsn_t sfs_jrec_dinode(struct sfs_fs *sfs, uint32_t ino,
+			  const struct sfs_dinode *oldinode,
+			  const struct sfs_dinode *newinode);
+int sfs_jrec_dinode_redo(const void *rec, size_t len,
+			 struct sfs_dinode *dino);
+sfs_lsn_t sfs_jrec_data(struct sfs_fs *sfs, daddr_t block, const void *data,
+			unsigned offset, unsigned len);
+sfs_lsn_t sfs_jrec_dirindex(struct sfs_fs *sfs, daddr_t block,
+			    const void *data, unsigned offset, unsigned len);
+
+/* Functions in sfs_range.c */
+int sfs_range_init(struct sfs_vnode *sv);
+void sfs_range_cleanup(struct sfs_vnode *sv);
+void sfs_range_lock(struct sfs_vnode *sv, struct sfs_range *r,
+		    uint32_t start, uint32_t end);
+void sfs_range_unlock(struct sfs_vnode *sv, struct sfs_range *r);
+
+/* Functions in sfs_reap.c */
+bool sfs_reap_add(struct sfs_fs *sfs, struct sfs_vnode *sv);
+bool sfs_reap_drain(struct sfs_fs *sfs);
+struct sfs_reaper *sfs_reaper_create(void);
+void sfs_reaper_destroy(struct sfs_reaper *rp);
+void sfs_reap_start(struct sfs_fs *sfs);
+void sfs_reap_stop(struct sfs_fs *sfs);
+
+/* Functions in sfs_jmode.c */
+int sfs_jmode_byname(const char *name, unsigned *ret);
+const char *sfs_jmode_name(unsigned mode);
+int sfs_data_release(struct sfs_vnode *sv, struct buf *buf, daddr_t block,
+		     unsigned offset, unsigned len);
+int sfs_ordered_flush(struct sfs_fs *sfs);
+int sfs_jmode_commit(struct sfs_fs *sfs);
+struct sfs_ordered *sfs_ordered_create(void);
+void sfs_ordered_destroy(struct sfs_ordered *so);
 
 /* Functions in sfs_jphys.c */
 bool sfs_block_is_journal(struct sfs_fs *sfs, uint32_t block);
@@ -138,6 +250,7 @@ sfs_lsn_t sfs_jphys_peeknextlsn(struct sfs_fs *sfs);
 void sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn);
 uint32_t sfs_jphys_getodometer(struct sfs_jphys *jp);
 void sfs_jphys_clearodometer(struct sfs_jphys *jp);
+void sfs_jphys_printstats(struct sfs_fs *sfs);
 /* reader interface */
 bool sfs_jiter_done(struct sfs_jiter *ji);
 unsigned sfs_jiter_type(struct sfs_jiter *ji);
@@ -152,6 +265,7 @@ int sfs_jiter_revcreate(struct sfs_fs *sfs, struct sfs_jiter **ji);
 void sfs_jiter_destroy(struct sfs_jiter *ji);
 /* load up the physical journal (already deployed in mount) */
 int sfs_jphys_loadup(struct sfs_fs *sfs);
+int sfs_jphys_loadclean(struct sfs_fs *sfs);
 /* control and mode changes (already deployed in sfs_fsops.c) */
 struct sfs_jphys *sfs_jphys_create(void);
 void sfs_jphys_destroy(struct sfs_jphys *jp);
@@ -160,6 +274,18 @@ void sfs_jphys_stopreading(struct sfs_fs *sfs);
 int sfs_jphys_startwriting(struct sfs_fs *sfs);
 void sfs_jphys_unstartwriting(struct sfs_fs *sfs);
 void sfs_jphys_stopwriting(struct sfs_fs *sfs);
+void sfs_jphys_markclean(struct sfs_fs *sfs);
 
+/* Functions in sfs_ckpt.c */
+int sfs_ckpt_notelsn(struct sfs_fs *sfs, struct buf *buf, daddr_t block,
+		     sfs_lsn_t lsn);
+int sfs_ckpt_prewrite(struct sfs_fs *sfs, void **fsbufdata, unsigned num);
+void sfs_ckpt_postwrite(struct sfs_fs *sfs, void *fsbufdata);
+void sfs_ckpt_detach(struct sfs_fs *sfs, void *fsbufdata);
+void sfs_checkpoint(struct sfs_fs *sfs);
+struct sfs_ckpt *sfs_ckpt_create(void);
+void sfs_ckpt_destroy(struct sfs_ckpt *ck);
+void sfs_ckpt_start(struct sfs_fs *sfs);
+void sfs_ckpt_stop(struct sfs_fs *sfs);
 
 #endif /* _SFSPRIVATE_H_ */
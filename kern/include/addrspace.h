@@ -39,6 +39,37 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pagetable;
+
+/*
+ * A region is a page-aligned range of user virtual addresses that may
+ * be touched, with its permissions. Pages in a region are only
+ * allocated when first touched; the page table says which ones exist.
+ * They're zero-filled, or for a region mapping a file (from mmap or
+ * an executable's segment), the first VR_FILESIZE bytes come from the
+ * page cache starting at VR_OFFSET in VR_VNODE and the rest is zero.
+ * In a shared mapping writes go to the cached page; in a private one,
+ * it's copied on the first write as after fork.
+ */
+struct vm_region {
+	vaddr_t vr_base;		/* first address, page-aligned */
+	size_t vr_npages;		/* length */
+	unsigned vr_perms;		/* VR_* flags */
+	struct vnode *vr_vnode;		/* mapped file, or NULL */
+	off_t vr_offset;		/* file offset of vr_base */
+	size_t vr_filesize;		/* bytes backed by the file */
+	bool vr_shared;			/* MAP_SHARED */
+	vaddr_t vr_nextfault;		/* where a sequential fault would be */
+	struct vm_region *vr_next;	/* next region in address space */
+};
+
+#define VR_READ		0x4
+#define VR_WRITE	0x2
+#define VR_EXEC		0x1
+
+/* Size of the (lazily filled) user stack, in pages */
+#define VM_STACKPAGES	256
 
 
 /*
@@ -58,7 +89,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct vm_region *as_regions;	/* defined regions */
+        struct pagetable *as_pt;	/* pages that exist */
+        struct lock *as_lock;		/* protects the page table */
+        struct vm_region *as_heap;	/* grows with sbrk */
+        vaddr_t as_heaptop;		/* the break; may not be aligned */
+        struct tlbcontext as_tlbctx;	/* TLB address space IDs */
+        bool as_loading;		/* between prepare/complete_load */
 #endif
 };
 
@@ -89,16 +126,56 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - arrange for the region just defined for a
+ *                segment at VADDR of size MEMSIZE to be paged in on
+ *                demand from FILESIZE bytes of VN at OFFSET, rather
+ *                than loaded. Fails (and the segment must be loaded)
+ *                if the VM system can't do that for this segment.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. The demand-paged VM sets up the (empty)
+ *                heap above the image here.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_getperms - return the VR_* permissions for the page at VADDR,
+ *                or 0 if it's not in any region. Not used by dumbvm.
+ *
+ *    as_shootdown - drop any TLB entries for NPAGES pages at VADDR in
+ *                the address space, on every cpu, after their PTEs
+ *                have changed. NPAGES may be TLBSHOOTDOWN_ALL. Not
+ *                used by dumbvm.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL. Not
+ *                used by dumbvm.
+ *
+ *    as_mmap   - add a region of NPAGES pages with permissions PERMS
+ *                mapping VN (or zero-fill if VN is NULL) from OFFSET.
+ *                If FIXED, it goes at *VADDR, which must be unused;
+ *                otherwise at the highest free range below the stack
+ *                and *VADDR is set. Not used by dumbvm.
+ *
+ *    as_munmap - remove NPAGES pages at VADDR from whatever regions
+ *                they're in, splitting regions as needed, and drop
+ *                their pages. The heap can't be unmapped. Not used by
+ *                dumbvm.
+ *
+ *    as_sbrk   - move the top of the heap by AMOUNT bytes, returning
+ *                the old top in *RET. Not used by dumbvm.
+ *
+ *    as_loanpage - lend out the physical page behind VADDR in the
+ *                current address space, faulting it in first if
+ *                needed; the frame keeps its contents until it's
+ *                returned with as_unloanpage, even if the page is
+ *                paged out or unmapped meanwhile. The caller has to
+ *                make sure the process doesn't write to it while it's
+ *                lent. Not used by dumbvm.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -114,9 +191,27 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 size_t memsize, struct vnode *vn,
+                                 off_t offset, size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+unsigned          as_getperms(struct addrspace *as, vaddr_t vaddr);
+void              as_shootdown(struct addrspace *as, vaddr_t vaddr,
+                               unsigned npages);
+struct vm_region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_mmap(struct addrspace *as, vaddr_t *vaddr,
+                          size_t npages, unsigned perms, bool fixed,
+                          struct vnode *vn, off_t offset, bool shared);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t npages);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *ret);
+int               as_loanpage(struct addrspace *as, vaddr_t vaddr,
+                              paddr_t *ret);
+void              as_unloanpage(struct addrspace *as, vaddr_t vaddr,
+                                paddr_t pa);
 
 
 /*
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic operations on single machine words, for simple counters
+ * that are updated often enough that taking a spinlock for each
+ * update would be the main cost. Anything more involved than one
+ * word should use a lock.
+ *
+ * atomic_cas compares *P to OLDVAL and, if they are equal, stores
+ * NEWVAL. It returns the value that was in *P, so the store happened
+ * exactly when the return value equals OLDVAL.
+ *
+ * atomic_add adds DELTA to *P and returns the new value.
+ *
+ * Both are full memory barriers, like spinlock_acquire and
+ * spinlock_release together.
+ */
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+ATOMIC_INLINE unsigned atomic_cas(volatile unsigned *p,
+				  unsigned oldval, unsigned newval);
+ATOMIC_INLINE unsigned atomic_add(volatile unsigned *p, int delta);
+
+/* Get the machine-dependent bits. */
+#include <machine/atomic.h>
+
+
+#endif /* _ATOMIC_H_ */
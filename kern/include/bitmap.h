@@ -37,19 +37,39 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_rescan  - recompute the free-space summary after the raw
+ *                      bit data has been changed directly.
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_run - locate a run of NUM cleared bits, set them,
+ *                      and return the index of the first.
+ *     bitmap_alloc_range - like bitmap_alloc, but only looks at bits
+ *                      from START up to END, which must be a multiple
+ *                      of BITMAP_GROUPBITS or the size of the bitmap.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
+ *
+ * Operations on bits in different aligned groups of BITMAP_GROUPBITS
+ * bits don't touch any of the same state (bitmap_alloc_range confined
+ * to one group included), so a caller can lock such groups
+ * separately. bitmap_alloc, bitmap_alloc_run, and bitmap_rescan look
+ * at the whole thing.
  */
 
+#define BITMAP_GROUPBITS 16384
+
 
 struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_rescan(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_run(struct bitmap *, unsigned num,
+                                unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned start,
+                                  unsigned end, unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
@@ -39,16 +39,20 @@ struct fs;  /* fs.h */
  * virtually indexed, where the key is a vnode and block offset within
  * the vnode.)
  *
- * In the real world you'd want buffers to be able to be different
- * sizes (since not every FS in existence uses the same block size,
- * and some can use different block sizes as a formatting option) but
- * to reduce complexity here we'll require all buffers to be the
- * ONE_TRUE_BUFFER_SIZE, which is defined in buf.c.
+ * Buffers can be different sizes (since not every FS in existence
+ * uses the same block size, and some can use different block sizes
+ * as a formatting option, and bigger buffers covering several
+ * contiguous blocks can be used to cluster I/O). The size can be any
+ * power of two from 512 bytes to 8K; the limits are in buf.c. The
+ * size is passed to FSOP_READBLOCK and FSOP_WRITEBLOCK, and the file
+ * system decides what range of the disk the block number and size
+ * cover.
  *
- * In any event each FS should use buffers of only one size, or at
- * least of a consistent size for any particular disk offset, because
- * handling partial or overlapping buffers would be extremely
- * problematic.
+ * However, each FS should use buffers of a consistent size for any
+ * particular disk offset, because handling partial or overlapping
+ * buffers would be extremely problematic. The cache checks that a
+ * buffer found for a block has the size asked for, but it cannot
+ * detect overlaps.
  */
 
 struct buf; /* Opaque. */
@@ -93,6 +97,27 @@ int buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int buffer_flush(struct fs *fs, daddr_t block, size_t size);
 void buffer_drop(struct fs *fs, daddr_t block, size_t size);
 
+/*
+ * Multi-block get operations.
+ *
+ * buffer_get_many and buffer_read_many are the same as calling
+ * buffer_get or buffer_read on each of the NUM blocks in BLOCKS, in
+ * order, storing the buffers in RET; but buffer_read_many reads all
+ * the blocks that aren't already cached in as few transfers as
+ * possible, so runs of consecutive block numbers are best. On error
+ * none of the buffers are returned.
+ *
+ * NUM may be at most BUFFER_MANY_MAX, so that the caller stays
+ * within its buffer reservation; callers using these should count
+ * BUFFER_MANY_MAX buffers in what they need.
+ */
+#define BUFFER_MANY_MAX	4
+
+int buffer_get_many(struct fs *fs, const daddr_t *blocks, unsigned num,
+		    size_t size, struct buf **ret);
+int buffer_read_many(struct fs *fs, const daddr_t *blocks, unsigned num,
+		     size_t size, struct buf **ret);
+
 /*
  * Release-a-buffer operations.
  *
@@ -147,10 +172,78 @@ void buffer_mark_dirty(struct buf *buf);
 void buffer_mark_valid(struct buf *buf);
 int buffer_writeout(struct buf *buf);
 
+/*
+ * Buffer kinds, for the statistics. A buffer counts as metadata
+ * unless the file system calls buffer_set_kind to say otherwise; this
+ * has to be done each time the buffer is gotten. The buffer must be
+ * busy.
+ */
+#define BUFKIND_META	0	/* inodes, directories, bitmaps, etc. */
+#define BUFKIND_DATA	1	/* file contents */
+#define BUFKIND_NUM	2
+
+void buffer_set_kind(struct buf *buf, unsigned kind);
+
+/*
+ * Scan resistance. A file system doing a one-shot sequential pass
+ * over data calls buffer_set_streaming on each buffer it gets for
+ * it. Blocks that had to be read in for such a use are kept on
+ * probation, in a small part of the cache, unless and until they're
+ * used again, so the pass doesn't push everything else out. Like
+ * buffer_set_kind this applies to the current use only, and the
+ * buffer must be busy.
+ */
+void buffer_set_streaming(struct buf *buf);
+
+/*
+ * Per-file dirty lists.
+ *
+ * The cache is indexed by block, so on its own it can't tell which
+ * dirty buffers belong to which file. A file system that wants to
+ * sync one file keeps a struct bufowner for it, and after marking a
+ * buffer dirty on the file's behalf (its data, or blocks that map
+ * it) calls buffer_set_owner; the buffer stays on the owner's list
+ * until it's next clean. The buffer must be busy and dirty.
+ *
+ * bufowner_create returns NULL if out of memory. bufowner_destroy
+ * may be called with buffers still on the list; they stay dirty and
+ * are written by the syncer as usual.
+ */
+struct bufowner; /* Opaque. */
+
+struct bufowner *bufowner_create(void);
+void bufowner_destroy(struct bufowner *bo);
+void buffer_set_owner(struct buf *buf, struct bufowner *bo);
+
 /*
  * Sync.
+ *
+ * sync_fs_buffers writes all of a file system's dirty buffers;
+ * sync_owner_buffers only those on an owner's list.
  */
 int sync_fs_buffers(struct fs *fs);
+int sync_owner_buffers(struct fs *fs, struct bufowner *bo);
+
+/*
+ * Read-ahead.
+ *
+ * buffer_readahead asks for a block to be read into the cache in the
+ * background, so that a later buffer_read of it doesn't have to wait
+ * for the disk. It never blocks for I/O and may drop the request.
+ *
+ * buffer_prefetch is the same, but for blocks the file system knows
+ * it will need shortly (such as the next indirect or directory
+ * block); these are read before any queued read-ahead.
+ *
+ * buffer_readahead_window computes how many blocks to read ahead of
+ * a stream of reads, given the previous window and whether the
+ * latest read continued sequentially from the one before. The file
+ * system keeps the window (and whatever it needs to detect
+ * sequential access) for each open file.
+ */
+void buffer_readahead(struct fs *fs, daddr_t block, size_t size);
+void buffer_prefetch(struct fs *fs, daddr_t block, size_t size);
+unsigned buffer_readahead_window(unsigned window, bool sequential);
 
 /*
  * For unmounting.
@@ -183,10 +276,28 @@ void unreserve_buffers(size_t size);
 void reserve_fsmanaged_buffers(unsigned count, size_t size);
 void unreserve_fsmanaged_buffers(unsigned count, size_t size);
 
+/*
+ * Memory pressure.
+ *
+ * The cache grows by itself while the VM system reports plenty of
+ * free memory (see vm_freepages). When the VM system runs short, it
+ * can call buffer_shrink to get up to NPAGES pages' worth of memory
+ * back; clean buffers are given up first. The return value is the
+ * number of pages' worth of buffers actually freed, which may be 0.
+ */
+unsigned buffer_shrink(unsigned npages);
+
 /*
  * Print stats.
+ *
+ * buffer_printstats prints the stats report on the console.
+ * buffer_formatstats writes the same report into BUF, of size LEN,
+ * and returns the length of the full report; if that isn't less
+ * than LEN the report was truncated. The report includes per-fs
+ * counts split by buffer kind, and eviction latency histograms.
  */
 void buffer_printstats(void);
+size_t buffer_formatstats(char *buf, size_t len);
 
 /*
  * Bootup.
@@ -48,6 +48,17 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * The user-readable time page (see <kern/time.h>). timepage_bootstrap
+ * allocates it once the VM system is up; timepage_paddr returns its
+ * physical address for the VM system to map, or 0 if there isn't one.
+ * The scheduler calls timepage_tickless when a cpu stops (true) or
+ * restarts (false) its hardclock.
+ */
+void timepage_bootstrap(void);
+paddr_t timepage_paddr(void);
+void timepage_tickless(bool stopped);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -55,9 +66,11 @@ void hardclock(void);
 void timerclock(void);
 
 /*
- * gettime() may be used to fetch the current time of day.
+ * gettime() may be used to fetch the current time of day, once
+ * gettime_ready() says the clock device has been attached.
  */
 void gettime(struct timespec *ret);
+bool gettime_ready(void);
 
 /*
  * arithmetic on times
@@ -79,5 +92,11 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * clocknanosleep() is the same with a struct timespec, like
+ * nanosleep(2). The time is rounded up to whole hardclocks.
+ */
+void clocknanosleep(const struct timespec *len);
+
 
 #endif /* _CLOCK_H_ */
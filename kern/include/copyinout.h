@@ -50,6 +50,14 @@
  * returns the actual length of string found in GOT. DEST is always
  * null-terminated on success. LEN and GOT include the null terminator.
  *
+ * copyuio moves up to LEN bytes between a kernel-space address and
+ * the user-space buffers of a uio, exactly as uiomove does, but with
+ * the fault protection set up once for the whole transfer rather than
+ * once per buffer. uiomove uses it for user-space uios.
+ *
+ * copyuiozeros is the same, but fills the user-space buffers of a
+ * read uio with LEN bytes of zeros; uiomovezeros uses it.
+ *
  * All of these functions return 0 on success, EFAULT if a memory
  * addressing error was encountered, or (for the string versions)
  * ENAMETOOLONG if the space available was insufficient.
@@ -64,10 +72,14 @@
  * vm/copyinout.c.
  */
 
+struct uio;
+
 int copyin(const_userptr_t usersrc, void *dest, size_t len);
 int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
+int copyuio(void *ptr, size_t len, struct uio *uio);
+int copyuiozeros(size_t len, struct uio *uio);
 
 
 #endif /* _COPYINOUT_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator (coremap).
+ *
+ * The coremap keeps one entry per physical page. Free memory is kept
+ * on binary buddy free lists, one per block order, so multi-page
+ * requests get physically contiguous memory and freed blocks coalesce
+ * with their buddies. Single pages, which are by far the most common
+ * request, go through a small per-cpu cache in front of the buddy
+ * lists so the common case neither takes the global lock nor pays
+ * for splitting and merging.
+ *
+ *   coremap_bootstrap: set up the coremap; takes over from
+ *        ram_stealmem. Memory stolen before this point is never
+ *        reclaimed.
+ *
+ *   coremap_alloc: allocate NPAGES physically contiguous pages.
+ *        Returns 0 if there's no block large enough. May be called
+ *        before coremap_bootstrap, in which case it steals memory.
+ *
+ *   coremap_free: drop a reference to a block returned by
+ *        coremap_alloc, freeing it when the last one goes. Blocks
+ *        from before coremap_bootstrap are silently ignored.
+ *
+ *   coremap_share: add a reference to an allocated block, so that
+ *        it can be mapped in more than one place (copy-on-write).
+ *        A new block has one reference.
+ *
+ *   coremap_refcount: return the number of references to a block.
+ *        A caller holding the only reference can rely on the answer
+ *        staying 1.
+ *
+ *   coremap_freepages: return the number of free pages. Like
+ *        ram_stealablepages this is only a hint.
+ *
+ *   coremap_totalpages: return the number of pages of RAM.
+ *
+ * For paging, a user page can be recorded as belonging to a page of
+ * an address space. Only pages with a single reference have an owner;
+ * sharing a page disowns it.
+ *
+ *   coremap_setowner: record that AS maps the page at VADDR.
+ *
+ *   coremap_clock: advance the clock hand over at most *BUDGET pages
+ *        (decrementing it) to the next owned page that isn't busy,
+ *        mark it busy and return it. Returns false if the budget
+ *        runs out first.
+ *
+ *   coremap_trybusy: mark an owned page busy if it isn't already.
+ *
+ *   coremap_unbusy: clear the busy mark. coremap_free of a busy page
+ *        waits for this, so a page (and the address space that owns
+ *        it) stays put while the pageout daemon looks at it.
+ */
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+void coremap_free(paddr_t pa);
+void coremap_share(paddr_t pa);
+unsigned coremap_refcount(paddr_t pa);
+unsigned long coremap_freepages(void);
+unsigned long coremap_totalpages(void);
+
+struct addrspace;
+void coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+bool coremap_clock(unsigned *budget, struct addrspace **as, vaddr_t *vaddr,
+		   paddr_t *pa);
+bool coremap_trybusy(paddr_t pa);
+void coremap_unbusy(paddr_t pa);
+
+#endif /* _COREMAP_H_ */
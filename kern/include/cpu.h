@@ -33,8 +33,24 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <timeout.h>
+#include <schedstat.h>
+#include <percpu.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Scheduling classes. Each of SCHED_REALTIME and SCHED_HIGH has one
+ * priority level of its own; SCHED_NORMAL has the SCHED_NORMAL_LEVELS
+ * levels below them. See the scheduler notes in thread.c.
+ */
+#define SCHED_REALTIME	0	/* Interrupt bottom halves, log drains */
+#define SCHED_HIGH	1	/* Background I/O daemons */
+#define SCHED_NORMAL	2	/* Everything else, including user code */
+
+/* Number of scheduling priority levels */
+#define SCHED_NORMAL_LEVELS	4
+#define SCHED_LEVELS	(SCHED_NORMAL + SCHED_NORMAL_LEVELS)
+
 
 /*
  * Per-cpu structure
@@ -44,6 +60,11 @@
  * cpu->c_self should always be used when *using* the address of curcpu
  * (as opposed to merely dereferencing it) in case curcpu is defined as
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
+ *
+ * The fields are grouped by who writes them, and each group that
+ * other cpus write starts on a new cache line, so a remote wakeup or
+ * IPI doesn't steal the line holding the fields this cpu uses on
+ * every context switch and spinlock, and vice versa.
  */
 
 struct cpu {
@@ -59,15 +80,27 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_spares;	/* Reaped threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct spinlock *c_spinwait;	/* Long-awaited spinlock (hangman) */
+	HANGMAN_ACTOR(c_hangman);	/* For exact deadlock detection */
+	struct xrand c_rand;		/* State for random() */
+	unsigned c_randleft;		/* random() calls until reseed */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * There is one run queue per priority level; level 0 is the
+	 * highest. Threads that have used up their process's cpu
+	 * share wait on c_throttled behind all of them. See the
+	 * scheduler notes in thread.c.
 	 */
-	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	bool c_isidle __ALIGNED(CACHELINE_SIZE); /* True if cpu is idle */
+	bool c_tickless;		/* True if hardclock is stopped */
+	struct threadlist c_runqueue[SCHED_LEVELS]; /* Run queues */
+	struct threadlist c_throttled;	/* Over their cpu share */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -80,13 +113,41 @@ struct cpu {
 	 * be queued at once, which is machine-dependent.
 	 *
 	 * The contents of struct tlbshootdown are also machine-
-	 * dependent and might reasonably be either an address space
-	 * and vaddr pair, or a paddr, or something else.
+	 * dependent, but must provide the ts_as, ts_vaddr and
+	 * ts_npages fields used to coalesce requests; see
+	 * ipi_tlbshootdown. One IPI is sent per batch: while any bit
+	 * is pending, further requests just join the queue.
+	 *
+	 * c_tlbas is the address space whose translations this cpu's
+	 * TLB may hold, or NULL if none. It is written only by this
+	 * cpu, in as_activate, before the TLB is flushed or switched
+	 * to another address space ID; it is read without a lock by
+	 * ipi_tlbshootdown_broadcast to skip cpus that cannot have the
+	 * mapping cached.
 	 */
-	uint32_t c_ipi_pending;		/* One bit for each IPI number */
+	uint32_t c_ipi_pending __ALIGNED(CACHELINE_SIZE); /* Bit per IPI */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
 	struct spinlock c_ipi_lock;
+	struct addrspace *volatile c_tlbas; /* Address space in the TLB */
+
+	/*
+	 * Accessed by other cpus.
+	 * Protected by its own lock.
+	 */
+	struct timerwheel c_timers __ALIGNED(CACHELINE_SIZE); /* Timeouts */
+
+	/*
+	 * Scheduler statistics; see schedstat.h for the locking.
+	 * Written mostly by this cpu, like the counters after them.
+	 */
+	struct schedstats c_stats __ALIGNED(CACHELINE_SIZE);
+
+	/*
+	 * Statistics counters; see percpu.h. Only this cpu changes
+	 * them, with interrupts off; anyone may read them unlocked.
+	 */
+	unsigned c_counters[PERCPU_SLOTS];
 };
 
 /*
@@ -150,6 +211,13 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends a shootdown to all other CPUs that
+ * may have mapping->ts_as in their TLB. The caller must have changed
+ * the page tables first.
+ *
+ * IPIs are batched: a CPU that already has an IPI pending is not
+ * interrupted again, and the new request is picked up by the same
+ * interprocessor_interrupt call.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -164,6 +232,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
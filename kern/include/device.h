@@ -34,8 +34,11 @@
  * Devices.
  */
 
+#include <kern/time.h>	/* for struct timespec */
 
 struct uio;  /* in <uio.h> */
+struct dev_bio;  /* below */
+struct pollset;  /* in <poll.h> */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +59,19 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_strategy - start an asynchronous block transfer (optional)
+ *      devop_poll - readiness for poll(), as for VOP_POLL (optional)
+ *
+ * devop_strategy may be NULL; use dev_bio_submit rather than calling
+ * it directly. Devices without a devop_poll are always ready.
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	void (*devop_strategy)(struct device *, struct dev_bio *);
+	int (*devop_poll)(struct device *, int events, struct pollset *ps,
+			  int *revents);
 };
 
 /*
@@ -69,6 +80,40 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_STRATEGY(d, b)	((d)->d_ops->devop_strategy(d, b))
+#define DEVOP_POLL(d, e, ps, r)	((d)->d_ops->devop_poll(d, e, ps, r))
+
+/*
+ * Asynchronous block I/O.
+ *
+ * A dev_bio describes a transfer of bio_nblocks device blocks
+ * starting at bio_block, to or from the kernel memory at bio_data.
+ * Hand it to dev_bio_submit; when the transfer is finished,
+ * successfully or not, bio_done is called with the result. bio_done
+ * may be called from an interrupt handler, so it must not sleep, and
+ * it may be called before dev_bio_submit returns. The bio belongs to
+ * the caller but must be left alone until bio_done is called.
+ *
+ * Devices that can't do this natively (devop_strategy is NULL) get
+ * the transfer done synchronously with devop_io instead.
+ */
+struct dev_bio {
+	daddr_t bio_block;		/* first block */
+	unsigned bio_nblocks;		/* number of blocks */
+	void *bio_data;			/* kernel buffer */
+	bool bio_write;			/* write (otherwise read) */
+	void (*bio_done)(struct dev_bio *, int result);
+	void *bio_arg;			/* for bio_done */
+
+	/* For the driver */
+	int bio_ioclass;		/* submitter's IOPRIO_CLASS_* */
+	struct dev_bio *bio_next;	/* request queue */
+	unsigned bio_passed;		/* times passed over in the queue */
+	struct timespec bio_queued;	/* for diskstats */
+	struct timespec bio_started;	/* for diskstats */
+};
+
+void dev_bio_submit(struct device *dev, struct dev_bio *bio);
 
 
 /* Create vnode for a vfs-level device. */
@@ -79,6 +124,16 @@ void dev_uncreate_vnode(struct vnode *vn);
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
+void devbufstat_create(void);
+void devdiskstat_create(void);
+void devschedstat_create(void);
+
+/* Create a striping device over the named devices. */
+int devstripe_create(unsigned stripeblocks, char **members,
+		     unsigned nmembers);
+
+/* Create a mirroring device over the named devices. */
+int devmirror_create(char **members, unsigned nmembers);
 
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _DISKSTAT_H_
+#define _DISKSTAT_H_
+
+#include <spinlock.h>
+
+struct dev_bio;  /* from device.h */
+
+/*
+ * Per-disk I/O statistics.
+ *
+ * A disk driver embeds a struct diskstats in its softc, registers it
+ * with diskstats_init, and calls diskstats_queued when a transfer is
+ * handed to it, diskstats_started when the transfer gets the disk,
+ * and diskstats_done when it's finished. All three may be called from
+ * an interrupt handler. From these we keep request and block counts
+ * split by direction, the number of transfers outstanding (queued or
+ * in service) seen by each new arrival, and histograms of how long
+ * transfers waited for the disk and how long the disk then took. A
+ * slow disk shows long service times; a contended one shows long
+ * waits and deep queues with ordinary service times.
+ *
+ * The "diskstat" menu command and the "diskstat:" device report the
+ * statistics for all registered disks.
+ */
+
+/* Histogram buckets, powers of two (usec for times) */
+#define DISKSTAT_LATBUCKETS	20
+#define DISKSTAT_DEPTHBUCKETS	8
+
+struct diskstats {
+	char ds_name[16];
+	struct diskstats *ds_next;	/* list of all disks */
+
+	struct spinlock ds_lock;	/* protects the rest */
+	unsigned ds_requests[2];	/* by bio_write */
+	unsigned ds_blocks[2];		/* by bio_write */
+	unsigned ds_errors;
+	unsigned ds_outstanding;	/* queued or in service now */
+	unsigned ds_maxdepth;
+	unsigned ds_depth[DISKSTAT_DEPTHBUCKETS];
+	uint64_t ds_waittotal;		/* usec */
+	uint64_t ds_servicetotal;	/* usec */
+	unsigned ds_wait[DISKSTAT_LATBUCKETS];
+	unsigned ds_service[DISKSTAT_LATBUCKETS];
+};
+
+void diskstats_init(struct diskstats *ds, const char *name);
+void diskstats_queued(struct diskstats *ds, struct dev_bio *bio);
+void diskstats_started(struct diskstats *ds, struct dev_bio *bio);
+void diskstats_done(struct diskstats *ds, struct dev_bio *bio, int result);
+
+void diskstats_printall(void);
+size_t diskstats_formatall(char *buf, size_t len);
+
+#endif /* _DISKSTAT_H_ */
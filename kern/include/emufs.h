@@ -37,6 +37,8 @@
 #include <fs.h>
 #include <vnode.h>
 
+struct lock; /* from synch.h */
+
 /*
  * Our structures
  */
@@ -45,13 +47,34 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	off_t ev_size;			/* file size, or -1 if not known */
+	uint32_t ev_npages;		/* pages that may be cached */
 };
 
+/*
+ * Page cache parameters (see emu.c): page size, most files kept
+ * loaded so their pages stay cached, and how block numbers for the
+ * buffer cache are made out of a handle and a page number.
+ */
+#define EMUFS_PAGESIZE		4096
+#define EMUFS_CACHE_FILES	8
+#define EMUFS_PAGEBITS		20	/* 4G of 4k pages */
+#define EMUFS_MAXCACHEHANDLE	(1U << (32 - EMUFS_PAGEBITS))
+#define EMUFS_BLOCK(handle, page) \
+	(((daddr_t)(handle) << EMUFS_PAGEBITS) | (page))
+#define EMUFS_BLOCKHANDLE(block)	((block) >> EMUFS_PAGEBITS)
+#define EMUFS_BLOCKPAGE(block)	((block) & ((1U << EMUFS_PAGEBITS) - 1))
+
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+
+	/* Page cache; files recently read, most recent first */
+	struct lock *ef_cachelock;
+	struct emufs_vnode *ef_cached[EMUFS_CACHE_FILES];
+	unsigned ef_ncached;
 };
 
 
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _EXECARGS_H_
+#define _EXECARGS_H_
+
+/*
+ * Program arguments on their way from one user image to a new one,
+ * for execv and __spawn.
+ *
+ * execargs_copyin copies in the null-terminated argv array UARGV and
+ * its strings, in one pass, into a single ARG_MAX buffer laid out
+ * just as the arguments will be on the new stack (the argv array
+ * followed by the strings). The pointer array comes in by the chunk
+ * rather than one pointer at a time. Fails with E2BIG if the whole
+ * thing doesn't fit in ARG_MAX.
+ *
+ * execargs_copyout, called once the new address space is current,
+ * puts the arguments on its stack below STACKPTR with one copyout,
+ * moves STACKPTR down past them, and hands back the user address of
+ * the argv array.
+ *
+ * execargs_free gives the buffer back. Buffers are kept in a small
+ * pool so the exec path doesn't usually go to kmalloc.
+ */
+struct execargs {
+	char *ea_buf;		/* ARG_MAX buffer */
+	size_t ea_len;		/* bytes used */
+	int ea_argc;		/* number of arguments */
+};
+
+int execargs_copyin(const_userptr_t uargv, struct execargs *ea);
+int execargs_copyout(struct execargs *ea, vaddr_t *stackptr,
+		     userptr_t *argv_ret);
+void execargs_free(struct execargs *ea);
+
+
+#endif /* _EXECARGS_H_ */
@@ -40,25 +40,28 @@
 /*
  * The file table is an array of open files.
  *
- * There is no particular reason to use a fixed size array (of size
- * OPEN_MAX) instead of a dynamically sized array (using array.h) --
- * the code was just written this way years ago and there's no
- * compelling reason to change it that outweighs this benefit: you can
- * look through the code to see what it would take to make it dynamic,
- * or even to make it dynamic with the limit being user-settable. (See
- * setrlimit(2) on a Unix machine.)
+ * The array starts with FILETABLE_INITSIZE slots and doubles as
+ * needed, up to OPEN_MAX, so a process pays for the descriptors it
+ * uses rather than the most it might. That makes a large OPEN_MAX
+ * cheap.
  *
  * Because we only have single-threaded processes, the file table is
- * never shared and so it doesn't require synchronization. On fork,
- * the table is copied. Another exercise: what would you need to do to
- * make this code safe for multithreaded processes? What happens if
- * one thread calls close() while another one is in the middle of e.g.
- * read() using the same file handle?
+ * never shared and so it doesn't require synchronization: looking up
+ * a descriptor is just an index into the array, with no lock and no
+ * reference count traffic. On fork, the table is copied. Another
+ * exercise: what would you need to do to make this code safe for
+ * multithreaded processes? What happens if one thread calls close()
+ * while another one is in the middle of e.g. read() using the same
+ * file handle? Or if one thread's open() grows the table while
+ * another is looking in it?
  */
 struct filetable {
-	struct openfile *ft_openfiles[OPEN_MAX];
+	struct openfile **ft_openfiles;	/* the table */
+	unsigned ft_size;		/* number of slots in ft_openfiles */
 };
 
+#define FILETABLE_INITSIZE	16
+
 /*
  * Filetable ops:
  *
@@ -71,7 +74,8 @@ struct filetable {
  *           is not NULL.) Call put with the file returned from get.
  * place -   Insert a file and return the fd.
  * placeat - Insert a file at a specific slot and return the file
- *           previously there.
+ *           previously there. Fails only if the table has to grow
+ *           and can't.
  */
 
 struct filetable *filetable_create(void);
@@ -83,8 +87,8 @@ int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
 void filetable_put(struct filetable *ft, int fd, struct openfile *file);
 
 int filetable_place(struct filetable *ft, struct openfile *file, int *fd);
-void filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
-		       struct openfile **oldfile_ret);
+int filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
+		      struct openfile **oldfile_ret);
 
 
 #endif /* _FILETABLE_H_ */
@@ -45,6 +45,13 @@ struct fs {
 	const struct fs_ops *fs_ops;
 };
 
+/*
+ * Most blocks that will be passed to fsop_readblocks or
+ * fsop_writeblocks at once.
+ */
+#define FS_READBLOCKS_MAX	16
+#define FS_WRITEBLOCKS_MAX	16
+
 /*
  * Abstract operations on a file system:
  *
@@ -53,7 +60,9 @@ struct fs {
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
  *      fsop_readblock  - Read block from storage.
+ *      fsop_readblocks - Read several consecutive blocks from storage.
  *      fsop_writeblock - Write block to storage.
+ *      fsop_writeblocks - Write several consecutive blocks to storage.
  *      fsop_attachbuf  - Hook for initializing fs-specific buffer state.
  *      fsop_detachbuf  - Hook for cleaning up fs-specific buffer state.
  *
@@ -77,6 +86,14 @@ struct fs {
  * fsop_readblock and fsop_writeblock are called by the buffer cache to
  * read in and write out (respectively) blocks to physical storage.
  *
+ * fsop_readblocks is optional (it may be NULL) and is used by the
+ * buffer cache to read several buffers for consecutive blocks that
+ * were asked for together (see buffer_read_many). It reads NBLOCKS
+ * blocks of LEN bytes each, starting at the given block, into the
+ * buffers whose data pointers are passed in the array; NBLOCKS is at
+ * most FS_READBLOCKS_MAX. As with fsop_writeblocks, it may return
+ * ENOSYS to have the buffers read one at a time instead.
+ *
  * fsop_attachbuf is called when a new buffer is attached to the file
  * system, and can use buffer_set_fsdata to attach FS-specific
  * metadata to the buffer and perform any other desired setup.
@@ -87,6 +104,16 @@ struct fs {
  * The third argument (bufdata) to fsop_writeblock is the FS-specific
  * metadata previously set with buffer_set_fsdata, or NULL if none was
  * ever set.
+ *
+ * fsop_writeblocks is optional (it may be NULL) and is used by the
+ * buffer cache to write clusters of dirty buffers. It writes NBLOCKS
+ * buffers of LEN bytes each, belonging to consecutive block numbers
+ * starting at the given block, ideally in one transfer; the bufdata
+ * and data pointers for the buffers are passed in arrays. NBLOCKS is
+ * at most FS_WRITEBLOCKS_MAX. If the file system can't write those
+ * particular blocks together, it should return ENOSYS without writing
+ * anything, and the buffer cache will write them one at a time with
+ * fsop_writeblock instead.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
@@ -94,8 +121,12 @@ struct fs_ops {
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
 	int           (*fsop_readblock)(struct fs *, daddr_t, void *, size_t);
+	int           (*fsop_readblocks)(struct fs *, daddr_t, unsigned,
+					void **, size_t);
 	int           (*fsop_writeblock)(struct fs *, daddr_t, void *bufdata,
 					void *, size_t);
+	int           (*fsop_writeblocks)(struct fs *, daddr_t, unsigned,
+					 void **bufdata, void **, size_t);
 	int           (*fsop_attachbuf)(struct fs *, daddr_t, struct buf *);
 	void          (*fsop_detachbuf)(struct fs *, daddr_t, struct buf *);
 };
@@ -109,14 +140,22 @@ struct fs_ops {
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
 #define FSOP_READBLOCK(fs,bn,ptr,sz) \
 				((fs)->fs_ops->fsop_readblock(fs,bn,ptr,sz))
+#define FSOP_READBLOCKS(fs,bn,n,ptrs,sz) \
+				((fs)->fs_ops->fsop_readblocks(fs,bn,n,ptrs,sz))
 #define FSOP_WRITEBLOCK(fs,bn,fsdata,ptr,sz) \
 				((fs)->fs_ops->fsop_writeblock(fs,bn,fsdata, \
 							       ptr,sz))
+#define FSOP_WRITEBLOCKS(fs,bn,n,fsdatas,ptrs,sz) \
+				((fs)->fs_ops->fsop_writeblocks(fs,bn,n, \
+								fsdatas,ptrs,sz))
 #define FSOP_ATTACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_attachbuf(fs,blk,buf))
 #define FSOP_DETACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_detachbuf(fs,blk,buf))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
 
+/* Direct P (COUNT < 0) or V (COUNT > 0) on a semfs semaphore vnode. */
+int semfs_semop(struct vnode *vn, int count);
+
 
 #endif /* _FS_H_ */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/*
+ * Futexes: sleeping and waking on a word of user memory.
+ *
+ * A user-level lock keeps its state in an ordinary int and only
+ * calls into the kernel when it has to wait or has waiters to wake.
+ * futex_wait sleeps as long as the word at UADDR still holds VAL,
+ * checking after it has queued itself so a wakeup can't be missed;
+ * futex_wake wakes up to COUNT threads waiting on UADDR. Waiters are
+ * kept in a small hash table keyed by (address space, user address),
+ * so only threads sharing an address space meet; there's no keying
+ * on the underlying page for shared mappings between processes.
+ *
+ * As with futexes elsewhere, futex_wait may return without a matching
+ * wake; callers recheck the word and loop.
+ */
+
+struct addrspace;
+
+void futex_bootstrap(void);
+int futex_wait(struct addrspace *as, const_userptr_t uaddr, int val);
+int futex_wake(struct addrspace *as, const_userptr_t uaddr, unsigned count,
+	       unsigned *ret);
+
+#endif /* _FUTEX_H_ */
@@ -31,12 +31,51 @@
 #define HANGMAN_H
 
 /*
- * Simple deadlock detector. Enable with "options hangman" in the
- * kernel config.
+ * Simple deadlock detectors.
+ *
+ * The exact detector, enabled with "options hangman" in the kernel
+ * config, keeps its own waits-for graph of actors (cpus) and
+ * lockables (spinlocks) and walks it on every wait. That catches a
+ * deadlock the moment it happens, but puts a global lock on every
+ * spinlock acquire, so it is too slow to leave on.
+ *
+ * The sampled detector is always on. It keeps no graph of its own;
+ * it uses the ownership the locks track anyway (splk_holder and
+ * c_spinwait for spinlocks, lk_holder and t_pilock for sleep locks;
+ * see synch.c) and only looks for a cycle once a wait has lasted
+ * HANGMAN_SPINS spins on a spinlock or HANGMAN_SLEEP_SECS on a sleep
+ * lock, so waits that end sooner cost next to nothing. Because the
+ * graph is read while it may be changing, a cycle has to be seen on
+ * two checks in a row before it is reported.
+ *
+ * hangman_spincheck - Look for a cycle through spinlock SPLK, which
+ *                     the current cpu has been spinning on, and if
+ *                     REPORT report it; returns whether there was one.
+ * hangman_report    - Print a cycle and panic. LINKS[0] is who found
+ *                     it and what it waits for; each later link is
+ *                     the holder of the previous link's lockable and
+ *                     what that holder in turn waits for. The last
+ *                     one waits for a lockable LINKS[0] holds.
  */
 
 #include "opt-hangman.h"
 
+#define HANGMAN_SPINS		(1U << 20)	/* must be a power of 2 */
+#define HANGMAN_SLEEP_SECS	1
+#define HANGMAN_MAXDEPTH	16		/* longest cycle reported */
+
+struct spinlock;
+
+struct hangman_link {
+	const char *hl_actor;
+	const void *hl_actorp;
+	const char *hl_lockable;
+	const void *hl_lockablep;
+};
+
+bool hangman_spincheck(const struct spinlock *splk, bool report);
+void hangman_report(const struct hangman_link *links, unsigned num);
+
 #if OPT_HANGMAN
 
 struct hangman_actor {
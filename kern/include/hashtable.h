@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _HASHTABLE_H_
+#define _HASHTABLE_H_
+
+/*
+ * Hash table of objects, for finding things by key: processes by
+ * pid, vnodes by inode number, and so on.
+ *
+ * Each object embeds a struct hashlink, so adding never allocates
+ * per object; the caller supplies the hash of the key, and a match
+ * function that says whether an object has the key being looked for.
+ *
+ * Functions:
+ *     hashtable_create  - allocate a new table. NLOCKS is 0 for a
+ *                         table the caller locks itself; otherwise
+ *                         it's a power of two, and the table is
+ *                         split into that many parts with a lock
+ *                         each (see below). Returns NULL on error.
+ *     hashtable_destroy - destroy a table. It should be empty.
+ *     hashtable_lock    - take the lock for the part holding HASH.
+ *     hashtable_unlock  - release it.
+ *     hashtable_add     - add an object with hash HASH.
+ *     hashtable_find    - return an object with hash HASH for which
+ *                         MATCH(obj, KEY) is true, or NULL.
+ *     hashtable_remove  - take an object out.
+ *     hashtable_count   - return the number of objects.
+ *     hashlink_init     - set up the link in object OBJ.
+ *     hash_string       - a hash function for strings.
+ *
+ * The table grows as it fills and shrinks as it empties. Rather than
+ * rehashing everything at once, which would make one unlucky add
+ * take time in proportion to the table size, it keeps the old bucket
+ * array alongside the new one and moves a few buckets across on
+ * each add and remove. There's no limit on how full it gets; if
+ * memory to grow can't be had, it just gets slower.
+ *
+ * Adds and removes may allocate or free the bucket arrays, so they
+ * must be called where sleeping is allowed -- in particular, not
+ * with a spinlock held. Lookups don't change anything, so several
+ * can run at once under a shared lock.
+ *
+ * With NLOCKS > 0, objects are spread over the parts by hash, each
+ * part being a separate table (with its own resizing) under its own
+ * sleep lock; the caller holds hashtable_lock(table, hash) around
+ * operations on HASH, which lets lookups of different keys proceed
+ * in parallel. hashtable_count then looks at every part without the
+ * locks and is only a snapshot.
+ */
+
+struct hashlink {
+	struct hashlink *hl_next;	/* next in bucket */
+	unsigned hl_hash;		/* hash it was added with */
+	void *hl_obj;			/* the object it's embedded in */
+};
+
+typedef bool (*hashtable_matchfn)(void *obj, const void *key);
+
+struct hashtable;	/* Opaque. */
+
+struct hashtable *hashtable_create(const char *name, unsigned nlocks);
+void  hashtable_destroy(struct hashtable *);
+void  hashtable_lock(struct hashtable *, unsigned hash);
+void  hashtable_unlock(struct hashtable *, unsigned hash);
+void  hashtable_add(struct hashtable *, struct hashlink *, unsigned hash);
+void *hashtable_find(struct hashtable *, unsigned hash,
+		     hashtable_matchfn match, const void *key);
+void  hashtable_remove(struct hashtable *, struct hashlink *);
+unsigned hashtable_count(struct hashtable *);
+
+void hashlink_init(struct hashlink *, void *obj);
+unsigned hash_string(const char *);
+
+#endif /* _HASHTABLE_H_ */
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+/*
+ * Records returned by getdirentries(), which lists many entries of a
+ * directory in one call along with what ls -l wants to know about
+ * each one, saving a lookup and a stat per entry.
+ *
+ * Each record is dp_reclen bytes long, including the name and its
+ * null terminator and padding out to an 8-byte boundary, and the
+ * next record follows it directly. dp_type is the file type part of
+ * st_mode (see kern/stattypes.h).
+ */
+struct direntplus {
+	off_t dp_size;		/* file size in bytes */
+	ino_t dp_ino;		/* inode number */
+	mode_t dp_type;		/* file type */
+	nlink_t dp_nlink;	/* number of hard links */
+	__u16 dp_reclen;	/* length of this record */
+	__u16 dp_namelen;	/* length of dp_name, not counting the null */
+	char dp_name[];		/* name, null-terminated */
+};
+
+/* Length of a record holding a name of NAMELEN characters */
+#define DIRENTPLUS_RECLEN(namelen) \
+	((sizeof(struct direntplus) + (namelen) + 1 + 7) & ~7)
+
+#endif /* _KERN_DIRENT_H_ */
@@ -34,6 +34,17 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * Move a regular file's blocks together on disk (SFS, extent-mapped
+ * files only). The argument is a struct defragstat, which gets the
+ * number of extents the file had before and has after; both are 0
+ * if the file can't be moved.
+ */
+#define IOC_DEFRAG	1
+
+struct defragstat {
+	__u32 ds_before;
+	__u32 ds_after;
+};
 
 #endif /* _KERN_IOCTL_H_*/
@@ -46,6 +46,16 @@
 #define PRIO_PGRP	1
 #define PRIO_USER	2
 
+/*
+ * I/O priority classes for ioprio_get() and ioprio_set(), numbered
+ * as for ionice. Disk transfers are served realtime first, then
+ * best-effort, then idle, except that ones that have waited long
+ * enough go regardless. New processes get their parent's class.
+ */
+#define IOPRIO_CLASS_RT		1	/* realtime */
+#define IOPRIO_CLASS_BE		2	/* best-effort (the default) */
+#define IOPRIO_CLASS_IDLE	3	/* idle */
+
 /* flags for getrusage() */
 #define RUSAGE_SELF	0
 #define RUSAGE_CHILDREN	(-1)
@@ -67,6 +77,7 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+	__counter_t ru_nsyscalls;	/* system calls (count; OS/161) */
 };
 
 /* limit codes for getrusage/setrusage */
@@ -80,7 +91,15 @@ struct rusage {
 #define RLIMIT_RSS		6	/* max RSS (bytes) */
 #define RLIMIT_CORE		7	/* core file size (bytes) */
 #define RLIMIT_FSIZE		8	/* max file size (bytes) */
-#define __RLIMIT_NUM		9	/* number of limits */
+#define RLIMIT_CPUSHARE		9	/* cpu when contended (percent) */
+#define RLIMIT_IORATE		10	/* disk transfers (bytes/sec) */
+#define __RLIMIT_NUM		11	/* number of limits */
+
+/*
+ * Of these only RLIMIT_CPUSHARE and RLIMIT_IORATE, which are OS/161's
+ * own, are enforced. A cpu share of 100 or more and a rate of more
+ * than 4G are the same as RLIM_INFINITY.
+ */
 
 struct rlimit {
 	__rlim_t rlim_cur;	/* soft limit */
@@ -34,21 +34,32 @@
 /*
  * SFS definitions visible to userspace. This covers the on-disk format
  * and is used by tools that work on SFS volumes, such as mksfs.
+ *
+ * The block size is 512 unless SFS_BLOCKSIZE is defined first (the
+ * kernel's sfs4k option and the tools' SFS_BLOCKSIZE make variable
+ * set it to 4096). It must be a multiple of the 512-byte sector, and a
+ * volume can only be used by a kernel and tools built for its block
+ * size, which the superblock records. The superblock, journal device
+ * superblock, and inodes each fill a whole block; everything that
+ * matters in them fits in the first sector, so writing them is atomic.
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
+#ifndef SFS_BLOCKSIZE
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
+#endif
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
 #define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
 #define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_DBPERIDB      (SFS_BLOCKSIZE/4) /* # direct blks per indir blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
+#define SFS_NIEXTENTS     32            /* # of extents in inode */
 
 /* Number of bits in a block */
 #define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
@@ -76,11 +87,99 @@ struct sfs_superblock {
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
 	uint32_t sb_journalstart;		/* First block in journal */
 	uint32_t sb_journalblocks;		/* # of blocks in journal */
-	uint32_t reserved[116];			/* unused, set to 0 */
+	uint32_t sb_flags;			/* SFS_SBF_* below */
+	uint32_t sb_clean;			/* SFS_SB_CLEAN or 0 */
+	uint64_t sb_cleanheadlsn;		/* journal head LSN */
+	uint64_t sb_cleantaillsn;		/* journal tail LSN */
+	uint32_t sb_cleanheadjblock;		/* journal head block */
+	uint32_t sb_cleantailjblock;		/* journal tail block */
+	uint32_t sb_blocksize;			/* SFS_BLOCKSIZE, or 0 */
+	uint32_t reserved[SFS_BLOCKSIZE/4-21];	/* unused, set to 0 */
+};
+
+/*
+ * sb_blocksize (and jsb_blocksize, below) is 0 on volumes made before
+ * it was recorded, whose blocks are 512 bytes.
+ */
+
+/*
+ * Clean-unmount state. At unmount, once the journal has been trimmed
+ * and flushed, the kernel sets sb_clean to SFS_SB_CLEAN and records
+ * where the journal head and tail are; the next mount then takes
+ * them from here instead of scanning the journal, and sets sb_clean
+ * back to 0 before writing anything. A crashed volume has sb_clean 0
+ * and gets the full scan (and the sb_clean* fields are ignored).
+ */
+#define SFS_SB_CLEAN		0x5c1ea400
+
+/* Superblock flags */
+#define SFS_SBF_EXTJOURNAL	0x1	/* Journal is on a separate device */
+#define SFS_SBF_EXTENTS		0x2	/* New inodes are extent-mapped */
+#define SFS_SBF_DIRINDEX	0x4	/* Large directories are indexed */
+#define SFS_SBF_INLINE		0x8	/* Small files are stored inline */
+#define SFS_SBF_ALL \
+	(SFS_SBF_EXTJOURNAL | SFS_SBF_EXTENTS | SFS_SBF_DIRINDEX | \
+	 SFS_SBF_INLINE)
+
+/*
+ * External journal device.
+ *
+ * With SFS_SBF_EXTJOURNAL set, sb_journalstart is sb_nblocks: the
+ * journal blocks are numbered as if they came right after the end
+ * of the volume, but they live on a device of their own, whose first
+ * block is a struct sfs_jsuperblock and whose journal block N is
+ * device block SFS_JDEV_JOURNALSTART + N.
+ */
+#define SFS_JMAGIC		0xabadf002	/* magic for jsuperblock */
+#define SFS_JSUPER_BLOCK	0		/* where the jsuperblock is */
+#define SFS_JDEV_JOURNALSTART	1		/* first journal block */
+
+struct sfs_jsuperblock {
+	uint32_t jsb_magic;		/* Magic number; should be SFS_JMAGIC */
+	uint32_t jsb_journalblocks;		/* # of blocks in journal */
+	char jsb_volname[SFS_VOLNAME_SIZE];	/* Volume it belongs to */
+	uint32_t jsb_blocksize;			/* SFS_BLOCKSIZE, or 0 */
+	uint32_t reserved[SFS_BLOCKSIZE/4-11];	/* unused, set to 0 */
 };
 
+/*
+ * Extent: a run of file blocks stored in consecutive disk blocks.
+ *
+ * If SFS_XUNWRITTEN is set in sx_len, the blocks were allocated ahead
+ * of time (by fallocate) and have never been written: they read as
+ * zeros, whatever is on disk, and become an ordinary extent a block
+ * at a time as they're written. Use SFS_XLEN for the length.
+ */
+struct sfs_extent {
+	uint32_t sx_fileblock;			/* First file block */
+	uint32_t sx_diskblock;			/* Where it is on disk */
+	uint32_t sx_len;			/* Number of blocks */
+};
+
+#define SFS_XUNWRITTEN		0x80000000	/* in sx_len: not written */
+#define SFS_XLEN(x)		((x)->sx_len & ~(uint32_t)SFS_XUNWRITTEN)
+
 /*
  * On-disk inode
+ *
+ * An inode is mapped either with the block pointers (direct through
+ * triple indirect) or, if SFS_DIF_EXTENTS is set in sfi_flags, with
+ * extents, in which case the block pointers are all 0. The extents,
+ * sfi_nextents of them, are sorted by sx_fileblock and don't overlap;
+ * the first SFS_NIEXTENTS are in the inode and the rest are in a
+ * chain of extent blocks starting at sfi_extblock, each full except
+ * perhaps the last.
+ *
+ * A regular file with SFS_DIF_INLINE set has no blocks at all: its
+ * contents (sfi_size bytes, at most SFS_INLINE_MAX) are kept in the
+ * space of sfi_extents, and sfi_nextents, sfi_extblock, and the block
+ * pointers are all 0. The rest of that space is zero. A file that
+ * grows past SFS_INLINE_MAX moves its data to an ordinary block and
+ * loses the flag for good (keeping SFS_DIF_EXTENTS, if set, for the
+ * mapping it gets then).
+ *
+ * A directory may also have a hash index (see below), whose root
+ * block is sfi_dirindex; 0 means none.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -90,7 +189,32 @@ struct sfs_dinode {
 	uint32_t sfi_indirect;			/* Indirect block */
 	uint32_t sfi_dindirect;   /* Double indirect block */
 	uint32_t sfi_tindirect;   /* Triple indirect block */
-	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_flags;			/* SFS_DIF_* below */
+	uint32_t sfi_nextents;			/* Total # of extents */
+	uint32_t sfi_extblock;			/* First extent block */
+	struct sfs_extent sfi_extents[SFS_NIEXTENTS]; /* First extents */
+	uint32_t sfi_dirindex;			/* Directory index root */
+	uint32_t sfi_waste[SFS_BLOCKSIZE/4-9-SFS_NDIRECT-3*SFS_NIEXTENTS];
+						/* unused space, set to 0 */
+};
+
+/* Inode flags */
+#define SFS_DIF_EXTENTS		0x1	/* Mapped with extents */
+#define SFS_DIF_INLINE		0x2	/* Data is in the inode */
+
+/* Most data an inline file can hold */
+#define SFS_INLINE_MAX		(SFS_NIEXTENTS * sizeof(struct sfs_extent))
+
+/*
+ * Extent block (overflow extents)
+ */
+#define SFS_EXTPERBLOCK \
+	((SFS_BLOCKSIZE - 2*sizeof(uint32_t)) / sizeof(struct sfs_extent))
+
+struct sfs_extblock {
+	uint32_t sxb_next;			/* Next extent block, or 0 */
+	uint32_t sxb_num;			/* Extents used in this block */
+	struct sfs_extent sxb_extents[SFS_EXTPERBLOCK];
 };
 
 /*
@@ -101,6 +225,45 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Directory hash index
+ *
+ * On a volume with SFS_SBF_DIRINDEX, a directory that grows large
+ * gets an index so names can be found without reading every entry.
+ * The directory entries themselves are unchanged; the index maps the
+ * 32-bit FNV-1a hash of each name to the entry's slot. Its root block
+ * holds the heads of SFS_DIRINDEX_NBUCKETS bucket chains (the bucket
+ * for a name is its hash modulo that) and a stack of up to
+ * SFS_DIRINDEX_NFREE empty slots to reuse. Each bucket block holds
+ * unordered (hash, slot) pairs and the next block in the chain.
+ *
+ * The index must list every entry, but it's redundant: it can be
+ * discarded at any time by freeing its blocks and clearing
+ * sfi_dirindex, and the kernel builds a new one when next needed.
+ * (sfsck does this rather than check it.)
+ */
+#define SFS_DIRINDEX_NBUCKETS	64
+#define SFS_DIRINDEX_NFREE	63
+#define SFS_DIRBUCKET_NENTRIES \
+	((SFS_BLOCKSIZE - 2*sizeof(uint32_t)) / sizeof(struct sfs_dirhash))
+
+struct sfs_dirindex {
+	uint32_t sdi_buckets[SFS_DIRINDEX_NBUCKETS]; /* Bucket chains */
+	uint32_t sdi_nfree;			/* Number of free slots */
+	uint32_t sdi_free[SFS_DIRINDEX_NFREE];	/* Free slots (a stack) */
+};
+
+struct sfs_dirhash {
+	uint32_t sdh_hash;			/* Hash of the name */
+	uint32_t sdh_slot;			/* Slot it's in */
+};
+
+struct sfs_dirbucket {
+	uint32_t sdb_next;			/* Next bucket block, or 0 */
+	uint32_t sdb_num;			/* Pairs used in this block */
+	struct sfs_dirhash sdb_entries[SFS_DIRBUCKET_NENTRIES];
+};
+
 /*
  * On-disk journal container types and constants
  */
@@ -118,7 +281,8 @@ struct sfs_direntry {
  * level code.
  *
  * The length is stored in 2-octet units so we only need 8 bits for a
- * record of up to one whole block.
+ * record of up to SFS_JPHYS_MAXLEN octets, which is a little short of
+ * a 512-byte block. Bigger gaps are filled with several pad records.
  *
  * The length includes the header. (struct sfs_jphys_header)
  *
@@ -136,6 +300,7 @@ struct sfs_direntry {
 		((uint64_t)((len + 1) / 2) << 48) |	\
 		(lsn)					\
 	)
+#define SFS_JPHYS_MAXLEN	510	/* longest record, with its header */
 
 /* symbolic names for the type code classes */
 #define SFS_JPHYS_CONTAINER	0
@@ -156,5 +321,48 @@ struct sfs_jphys_trim {
 	uint64_t jt_taillsn;			/* Tail LSN */
 };
 
+/*
+ * Client-level (file system) journal records.
+ *
+ * These are kept small so the journal holds as many changes as
+ * possible between checkpoints. A freemap change is just the block
+ * number whose bit flipped. An inode change records only the parts
+ * of the inode that changed: the inode number, then one or more
+ * deltas, each a struct sfs_jrec_delta followed by the new contents
+ * of jdd_len bytes of the inode starting at jdd_offset. Offsets and
+ * lengths are multiples of 2. A change too big for one record is
+ * split across several. A directory index change, like a data-mode
+ * write, is the block number, offset, and bytes written.
+ */
+
+/* client-level record types (allowable range 0-127) */
+#define SFS_JREC_BITSET		1		/* Freemap bit set */
+#define SFS_JREC_BITCLEAR	2		/* Freemap bit cleared */
+#define SFS_JREC_DINODE		3		/* Inode field deltas */
+#define SFS_JREC_DATA		4		/* File data (data mode) */
+#define SFS_JREC_DIRINDEX	5		/* Directory index bytes */
+
+/* Contents for SFS_JREC_BITSET and SFS_JREC_BITCLEAR */
+struct sfs_jrec_bitflip {
+	uint32_t jbf_block;			/* Block whose bit flipped */
+};
+
+/* Contents for SFS_JREC_DINODE (followed by the deltas) */
+struct sfs_jrec_dinode {
+	uint32_t jd_ino;			/* Inode number */
+};
+
+struct sfs_jrec_delta {
+	uint16_t jdd_offset;			/* Byte offset in inode */
+	uint16_t jdd_len;			/* Bytes of data following */
+};
+
+/* Contents for SFS_JREC_DATA and SFS_JREC_DIRINDEX (followed by the data) */
+struct sfs_jrec_data {
+	uint32_t jdt_block;			/* Disk block written */
+	uint16_t jdt_offset;			/* Byte offset in block */
+	uint16_t jdt_len;			/* Bytes of data following */
+};
+
 
 #endif /* _KERN_SFS_H_ */
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KERN_SPAWN_H_
+#define _KERN_SPAWN_H_
+
+/*
+ * Definitions for __spawn(), the system call underneath posix_spawn().
+ *
+ * The new process starts with a copy of the caller's file table and
+ * then the file actions are carried out on it, in order, before the
+ * program is loaded. A failing action fails the whole call.
+ */
+
+/* File action codes */
+#define SPAWN_OPEN	0	/* open sa_path (sa_flags, sa_mode) as sa_fd */
+#define SPAWN_CLOSE	1	/* close sa_fd */
+#define SPAWN_DUP2	2	/* make sa_fd a copy of sa_srcfd */
+
+/* Most file actions one call can carry */
+#define SPAWN_MAXACTIONS	16
+
+struct spawn_action {
+	int sa_op;		/* SPAWN_* */
+	int sa_fd;		/* descriptor acted on */
+	int sa_srcfd;		/* for SPAWN_DUP2 */
+	int sa_flags;		/* for SPAWN_OPEN */
+	__mode_t sa_mode;	/* for SPAWN_OPEN */
+	const char *sa_path;	/* for SPAWN_OPEN */
+};
+
+
+#endif /* _KERN_SPAWN_H_ */
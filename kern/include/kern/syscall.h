@@ -86,10 +86,10 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage  35
 //                              (resource limits)
-//#define SYS_getrlimit  36
-//#define SYS_setrlimit  37
+#define SYS_getrlimit  36
+#define SYS_setrlimit  37
 //                              (process priority control)
 //#define SYS_getpriority 38
 //#define SYS_setpriority 39
@@ -109,13 +109,13 @@
 #define SYS_close        49
 #define SYS_read         50
 #define SYS_pread        51
-//#define SYS_readv      52
-//#define SYS_preadv     53
+#define SYS_readv        52
+#define SYS_preadv       53
 #define SYS_getdirentry  54
 #define SYS_write        55
 #define SYS_pwrite       56
-//#define SYS_writev     57
-//#define SYS_pwritev    58
+#define SYS_writev       57
+#define SYS_pwritev      58
 #define SYS_lseek        59
 #define SYS_flock        60
 #define SYS_ftruncate    61
@@ -198,6 +198,17 @@
 //#define SYS___sysctl   120
 
 #define SYS_meld         121
+#define SYS_copy_file_range 122
+#define SYS_getdirentries 123
+#define SYS_setaffinity  124
+#define SYS___spawn      125
+#define SYS_semop        126
+#define SYS_futex_wait   127
+#define SYS_futex_wake   128
+#define SYS_fdatasync    129
+#define SYS_fallocate    130
+#define SYS_ioprio_get   131
+#define SYS_ioprio_set   132
 /*CALLEND*/
 
 
@@ -51,6 +51,31 @@ struct timespec {
 };
 
 
+/* Clocks for clock_gettime. Both are the time of day in OS/161. */
+#define CLOCK_REALTIME	0
+#define CLOCK_MONOTONIC	1
+
+/*
+ * The time page. The kernel maps this read-only at TIMEPAGE_ADDR in
+ * every process, just below the stack, and updates it on each
+ * hardclock, so the time can be read without a system call; it's
+ * good to 1/HZ seconds.
+ *
+ * To read it, wait for tp_seq to be even, copy the time, and check
+ * that tp_seq hasn't changed; if it has, an update came in between,
+ * so try again. If tp_valid is 0, no cpu has its hardclock running
+ * to keep the time current, and the __time system call has to be
+ * used instead.
+ */
+#define TIMEPAGE_ADDR	0x7feff000
+
+struct timepage {
+	volatile __u32 tp_seq;		/* odd while being updated */
+	volatile __u32 tp_valid;	/* time is current */
+	volatile __time_t tp_sec;	/* seconds */
+	volatile __i32 tp_nsec;		/* nanoseconds */
+};
+
 /*
  * Bits for interval timers. Obscure and not really that important.
  */
@@ -63,6 +63,7 @@
 
 typedef __u32 __blkcnt_t;  /* Count of blocks */
 typedef __u32 __blksize_t; /* Size of an I/O block */
+typedef __i32 __clockid_t; /* Clock for clock_gettime */
 typedef __u64 __counter_t; /* Event counter */
 typedef __u32 __daddr_t;   /* Disk block number */
 typedef __u32 __dev_t;     /* Hardware device ID */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KHEAPTAG_H_
+#define _KHEAPTAG_H_
+
+/*
+ * Kernel heap accounting by subsystem.
+ *
+ * A kheap_tag counts the objects, and the heap bytes they take up,
+ * that one subsystem has from kmalloc, so we can see what is eating
+ * the heap. Allocations made with kmalloc_tagged are charged to the
+ * tag at the size of the block kmalloc really uses for them (a
+ * subpage block size or whole pages), and kfree_tagged takes the
+ * same size and tag back off. The counts are per-cpu (see percpu.h),
+ * so accounting costs no shared cache lines.
+ *
+ * kheap_tag_init    - Set up TAG, with a NAME that must outlive it,
+ *                     and add it to the report. Until then the tag
+ *                     counts nothing, so objects allocated before
+ *                     then and freed after pull its counts down.
+ * kmalloc_tagged    - kmalloc, charged to TAG.
+ * kfree_tagged      - kfree of a block from kmalloc_tagged; SIZE and
+ *                     TAG must be what it was allocated with.
+ * kheap_printtags   - Print the MAX tags with the most bytes, biggest
+ *                     first.
+ *
+ * Tags are never removed, so should be static.
+ */
+
+#include <percpu.h>
+
+struct kheap_tag {
+	const char *kt_name;
+	bool kt_ready;			/* counters are set up */
+	struct percpu_counter kt_objects;	/* blocks allocated */
+	struct percpu_counter kt_bytes;	/* total size of the blocks */
+	struct kheap_tag *kt_next;	/* list of all tags */
+};
+
+void kheap_tag_init(struct kheap_tag *tag, const char *name);
+void *kmalloc_tagged(size_t size, struct kheap_tag *tag);
+void kfree_tagged(void *ptr, size_t size, struct kheap_tag *tag);
+void kheap_printtags(unsigned max);
+
+
+#endif /* _KHEAPTAG_H_ */
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one size, carved from whole pages
+ * ("slabs"). Each object is set up by the constructor when its slab
+ * is made, and is returned to the cache still constructed, so that
+ * the constructor's work (creating wchans, say) is only done once
+ * per object rather than once per use. The destructor is run when a
+ * slab is given back to the VM system.
+ *
+ * kmem_cache_create - Make a cache of objects of SIZE bytes, which
+ *                     must be no more than KMEM_CACHE_MAXSIZE. CTOR
+ *                     returns 0 or an error code; CTOR and DTOR may
+ *                     be NULL. The name is copied.
+ * kmem_cache_destroy - Destroy a cache. All its objects must have been
+ *                     freed.
+ * kmem_cache_alloc  - Get a constructed object, or NULL if out of
+ *                     memory or the constructor failed.
+ * kmem_cache_free   - Give back an object from kmem_cache_alloc. It
+ *                     must be in its constructed state again.
+ * kmem_cache_reap   - Give back every slab with no objects in use.
+ *
+ * Allocation and freeing may be done with spinlocks held or in
+ * interrupt handlers if the constructor allows it, as with kmalloc.
+ * At most KMEM_CACHE_MAXEMPTY unused slabs are kept per cache.
+ */
+
+#define KMEM_CACHE_MAXSIZE	512
+#define KMEM_CACHE_MAXEMPTY	1
+
+struct kmem_cache;	/* Opaque. */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_reap(struct kmem_cache *kc);
+
+
+#endif /* _KMEMCACHE_H_ */
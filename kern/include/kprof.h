@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KPROF_H_
+#define _KPROF_H_
+
+/*
+ * Sampling kernel profiler. Enable with "options kprof" in the kernel
+ * config.
+ *
+ * On each hardclock, the clock interrupt handler calls KPROF_SAMPLE
+ * with the program counter from the interrupted context's trapframe.
+ * Each cpu has a histogram of the kernel text, one counter for each
+ * KPROF_BUCKET bytes of code, and counts samples taken in user mode
+ * and outside the kernel text separately. Only the cpu itself updates
+ * its counters, in the interrupt handler, so no locks are needed.
+ *
+ * Idle cpus stop their hardclock, so idle time isn't sampled; the
+ * profile shows where the time went while the cpus were busy.
+ *
+ * Sampling is off until turned on. The "kprof" menu command turns it
+ * on and off, clears it, prints the busiest parts of the kernel, and
+ * with "kprof dump [cpu]" prints every nonzero bucket, for one cpu or
+ * all of them, as an address and a count. The kernel has no symbol
+ * table of its own, so symbolize those addresses on the host against
+ * the kernel ELF file, with addr2line -f -e kernel, or by looking them
+ * up in the output of nm -n.
+ */
+
+#include "opt-kprof.h"
+
+/* Bytes of code per histogram bucket (a power of two) */
+#define KPROF_BUCKET	16
+
+#if OPT_KPROF
+
+void kprof_bootstrap(void);
+void kprof_sample(vaddr_t pc, bool user);
+void kprof_enable(bool on);
+void kprof_reset(void);
+void kprof_report(void);
+void kprof_dump(int cpu);
+
+#define KPROF_SAMPLE(pc, user) kprof_sample(pc, user)
+
+#else
+
+#define KPROF_SAMPLE(pc, user)
+
+#endif
+
+#endif /* _KPROF_H_ */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+/*
+ * Kernel event tracing. Enable with "options ktrace" in the kernel
+ * config.
+ *
+ * KTRACE(type, a, b) records an event of one of the types below, with
+ * two 32-bit arguments whose meaning depends on the type, along with
+ * the time and the current thread. Each cpu has its own ring of the
+ * most recent KTRACE_NEVENTS events, written only by that cpu with
+ * interrupts off, so recording takes no locks and never waits; once
+ * a ring is full the oldest events are overwritten.
+ *
+ * Times come from gettime, so nothing is recorded before
+ * ktrace_bootstrap is called, since the clock appears during device
+ * probe.
+ *
+ * ktrace_dump merges the rings by time and prints them, oldest first;
+ * tracing stops while it does. It is the "ktrace" menu command, which
+ * can also turn tracing off and on and clear the rings.
+ *
+ * Without the option, KTRACE expands to nothing and its arguments
+ * are not evaluated.
+ */
+
+#include "opt-ktrace.h"
+
+/* Event types; the arguments are given for each. */
+enum ktrace_type {
+	KT_SWITCH,	/* old thread, new thread */
+	KT_SLEEP,	/* wchan, 0 */
+	KT_WAKEONE,	/* wchan, thread woken */
+	KT_READIN,	/* block, size */
+	KT_READDONE,	/* block, error */
+	KT_WRITEOUT,	/* block, size */
+	KT_WRITEDONE,	/* block, error */
+	KT_JWRITE,	/* record code, low 32 bits of lsn */
+	KT_JFLUSH,	/* low 32 bits of lsn, 0 */
+	KT_VMFAULT,	/* fault type, address */
+	KT_SYSCALL,	/* call number, first argument */
+	KT_SYSRET,	/* call number, error */
+	KT_NTYPES
+};
+
+#if OPT_KTRACE
+
+void ktrace_bootstrap(void);
+void ktrace_record(unsigned type, uint32_t a, uint32_t b);
+void ktrace_enable(bool on);
+void ktrace_reset(void);
+void ktrace_dump(void);
+
+#define KTRACE(type, a, b) \
+	ktrace_record(type, (uint32_t)(a), (uint32_t)(b))
+
+#else
+
+#define KTRACE(type, a, b)
+
+#endif
+
+#endif /* _KTRACE_H_ */
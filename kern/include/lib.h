@@ -113,18 +113,33 @@ extern uint32_t dbflags;
 /*
  * Random number generator, using the random device.
  *
- * random() returns a number between 0 and randmax() inclusive.
+ * random() returns a number between 0 and randmax() inclusive. It
+ * comes from a per-cpu xrand generator that the random device
+ * reseeds now and then, so most calls don't touch the device.
  */
 #define RANDOM_MAX (randmax())
 uint32_t randmax(void);
 uint32_t random(void);
 
+/*
+ * Fast pseudo-random numbers with caller-supplied state (see
+ * xrand.c), for code that wants its own repeatable sequence.
+ */
+struct xrand {
+	uint32_t xr_s[4];
+};
+void xrand_seed(struct xrand *xr, unsigned long seed);
+uint32_t xrand(struct xrand *xr);
+void xrand_fill(struct xrand *xr, uint32_t *buf, size_t n);
+
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * kheap_getusage and kheap_getlockstat are for benchmarks. For
+ * accounting of heap use by subsystem, see <kheaptag.h>.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +147,8 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_getusage(size_t *inuse, size_t *total);
+void kheap_getlockstat(uint64_t *acquires, uint64_t *spins);
 
 /*
  * C string functions.
@@ -176,7 +193,10 @@ void beep(void);
  *
  * kprintf_bootstrap sets up a lock for kprintf and should be called
  * during boot once malloc is available and before any additional
- * threads are created.
+ * threads are created. It also starts the kernel log thread; from
+ * then on kprintf only adds to a buffer (see kprintf.c) and the log
+ * thread prints it. kprintf_flush waits until it has all been
+ * printed; kprintf_sync flushes and goes back to printing directly.
  */
 int kprintf(const char *format, ...) __PF(1,2);
 __DEAD void panic(const char *format, ...) __PF(1,2);
@@ -186,6 +206,8 @@ __DEAD void badassert(const char *expr, const char *file,
 void kgets(char *buf, size_t maxbuflen);
 
 void kprintf_bootstrap(void);
+void kprintf_flush(void);
+void kprintf_sync(void);
 
 /*
  * Other miscellaneous stuff
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics. Enable with "options lockstat" in the
+ * kernel config.
+ *
+ * Each lock and semaphore carries a struct lockstat, and is on a list
+ * of all of them from creation to destruction. lock_acquire and P
+ * count acquisitions, the ones that had to wait, and the total and
+ * longest waits; lock_release adds up how long the lock was held.
+ * The counters are updated under the lock's own spinlock.
+ *
+ * Spinlocks carry one too, in which waits are counted in spins
+ * rather than nanoseconds, and nothing is timed. Because spinlocks
+ * are mostly static and have no names, they are only listed once
+ * given a name with LOCKSTAT_SPINLOCK.
+ *
+ * Times come from gettime, and are only kept after lockstat_bootstrap
+ * is called, since the clock appears during device probe.
+ *
+ * lockstat_report prints the locks with the most waiting, and
+ * lockstat_reset clears the counters; both are under the "lockstat"
+ * menu command.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+struct lockstat {
+	const char *ls_name;		/* NULL if not listed */
+	struct lockstat *ls_next;	/* list of all listed */
+	struct lockstat **ls_prevp;
+	bool ls_spin;			/* waits are in spins */
+	uint64_t ls_acquires;		/* times acquired */
+	uint64_t ls_contended;		/* times that had to wait */
+	uint64_t ls_wait;		/* total wait (ns or spins) */
+	uint64_t ls_maxwait;		/* longest wait */
+	uint64_t ls_hold;		/* total time held (ns) */
+	uint64_t ls_heldsince;		/* when last acquired */
+};
+
+struct spinlock;	/* from <spinlock.h> */
+
+void lockstat_bootstrap(void);
+uint64_t lockstat_now(void);
+void lockstat_add(struct lockstat *ls, const char *name, bool spin);
+void lockstat_remove(struct lockstat *ls);
+void lockstat_spinlock(struct spinlock *splk, const char *name);
+void lockstat_report(void);
+void lockstat_reset(void);
+
+/*
+ * Record an acquisition, which had to wait since WAITSTART if WAITED,
+ * and a release; or for a spinlock, an acquisition after SPINS spins.
+ */
+void lockstat_acquired(struct lockstat *ls, bool waited, uint64_t waitstart);
+void lockstat_released(struct lockstat *ls);
+void lockstat_spun(struct lockstat *ls, unsigned spins);
+
+#define LOCKSTAT(sym)		struct lockstat sym
+#define LOCKSTAT_INITIALIZER	{ NULL, NULL, NULL, false, 0, 0, 0, 0, 0, 0 }
+#define LOCKSTAT_ADD(ls, name)	lockstat_add(ls, name, false)
+#define LOCKSTAT_REMOVE(ls)	lockstat_remove(ls)
+#define LOCKSTAT_SPINLOCK(splk, name) lockstat_spinlock(splk, name)
+#define LOCKSTAT_NOW()		lockstat_now()
+#define LOCKSTAT_ACQUIRED(ls, waited, start) \
+	lockstat_acquired(ls, waited, start)
+#define LOCKSTAT_RELEASED(ls)	lockstat_released(ls)
+#define LOCKSTAT_SPUN(ls, spins) lockstat_spun(ls, spins)
+
+#else
+
+#define LOCKSTAT(sym)
+#define LOCKSTAT_ADD(ls, name)
+#define LOCKSTAT_REMOVE(ls)
+#define LOCKSTAT_SPINLOCK(splk, name)
+#define LOCKSTAT_NOW()		0
+#define LOCKSTAT_ACQUIRED(ls, waited, start) ((void)(waited), (void)(start))
+#define LOCKSTAT_RELEASED(ls)
+#define LOCKSTAT_SPUN(ls, spins) ((void)(spins))
+
+#endif
+
+#endif /* _LOCKSTAT_H_ */
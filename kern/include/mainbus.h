@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Stop and restart the current CPU's hardclock timer, for tickless
+ * operation. After mainbus_hardclock_start the next hardclock is a
+ * full period away.
+ */
+void mainbus_hardclock_stop(void);
+void mainbus_hardclock_start(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _NET_H_
+#define _NET_H_
+
+/*
+ * A minimal network stack.
+ *
+ * Packets travel in netbufs, taken from a fixed pool that's filled
+ * when the first interface attaches. netbuf_get and netbuf_put only
+ * take a spinlock, so drivers use them at interrupt time; when the
+ * pool is empty, received packets are dropped rather than waited for.
+ *
+ * An interface (struct netif) is a link-level device with a 16-bit
+ * address, such as lnet. It hands each received packet to net_input
+ * (also at interrupt time), and sends with if_output, which queues
+ * the packet and returns; it only sleeps if its queue is full.
+ *
+ * On top of that there are datagrams: unreliable messages between
+ * 16-bit ports. A dgsock is bound to a port and has a short queue of
+ * received datagrams; when it's full, more are dropped.
+ */
+
+#include <spinlock.h>
+
+struct timespec;	/* in kern/time.h */
+struct wchan;		/* in wchan.h */
+
+/* Largest packet, including all headers */
+#define NETBUF_SIZE	4096
+
+struct netbuf {
+	struct netbuf *nb_next;		/* in whatever queue it's in */
+	char *nb_data;			/* NETBUF_SIZE bytes */
+	unsigned nb_off;		/* start of the current layer */
+	unsigned nb_len;		/* bytes from nb_off on */
+	uint16_t nb_addr;		/* link address from, or to */
+};
+
+struct netbuf *netbuf_get(void);
+void netbuf_put(struct netbuf *nb);
+
+/*
+ * A network interface, provided by its driver.
+ */
+struct netif {
+	const char *if_name;
+	uint16_t if_addr;		/* our link address */
+	unsigned if_hdrlen;		/* link header size */
+	void *if_data;			/* for the driver */
+
+	/* Send NB (payload from nb_off) to link address TO; takes NB */
+	void (*if_output)(struct netif *, struct netbuf *nb, uint16_t to);
+
+	/* Counters */
+	volatile unsigned if_ipackets;	/* packets received */
+	volatile unsigned if_ierrors;	/* bad packets received */
+	volatile unsigned if_iqdrops;	/* received and dropped */
+	volatile unsigned if_opackets;	/* packets sent */
+};
+
+/* Link address for everyone on the network */
+#define NET_BROADCAST	0xffff
+
+void net_bootstrap(void);
+int netif_attach(struct netif *nif);
+void net_input(struct netif *nif, struct netbuf *nb);
+
+/* The interface datagrams go out on, or NULL if there isn't one */
+struct netif *net_getif(void);
+
+/*
+ * Datagram sockets.
+ *
+ * dgsock_open binds a socket to PORT, or to an unused port if PORT is
+ * 0. dgsock_sendto sends a datagram of LEN bytes (at most DGRAM_MAX)
+ * from kernel memory; dgsock_recvfrom waits for one (for at most
+ * TIMEOUT unless that's NULL) and copies up to LEN bytes of it,
+ * discarding any more, and says who sent it.
+ */
+
+/* Room kept for headers in front of a datagram, and the largest one */
+#define NET_HDRROOM	64
+#define DGRAM_MAX	(NETBUF_SIZE - NET_HDRROOM)
+
+struct dgsock;
+
+int dgsock_open(uint16_t port, struct dgsock **ret);
+void dgsock_close(struct dgsock *ds);
+uint16_t dgsock_port(struct dgsock *ds);
+int dgsock_sendto(struct dgsock *ds, uint16_t addr, uint16_t port,
+		  const void *buf, size_t len);
+int dgsock_recvfrom(struct dgsock *ds, void *buf, size_t len,
+		    size_t *gotlen, uint16_t *addr, uint16_t *port,
+		    const struct timespec *timeout);
+
+#endif /* _NET_H_ */
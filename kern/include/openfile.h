@@ -46,11 +46,15 @@
  *
  * Open files are reference-counted because they get shared via fork
  * and dup2 calls. And they need locking because that sharing can be
- * among multiple concurrent processes.
+ * among multiple concurrent processes. The positional calls (pread,
+ * pwrite, preadv, pwritev) never touch of_offset, so they don't take
+ * of_offsetlock and can run concurrently on one open file.
  */
 struct openfile {
 	struct vnode *of_vnode;
 	int of_accmode;	/* from open: O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_direct;	/* from open: O_DIRECT */
+	bool of_dsync;	/* from open: O_DSYNC */
 
 	struct lock *of_offsetlock;	/* lock for of_offset */
 	off_t of_offset;
@@ -63,6 +67,9 @@ struct openfile {
 int openfile_open(char *filename, int openflags, mode_t mode,
 		  struct openfile **ret);
 
+/* wrap a vnode with no name (e.g. a pipe end); takes over its reference */
+int openfile_fromvnode(struct vnode *vn, int accmode, struct openfile **ret);
+
 /* adjust the refcount on an openfile */
 void openfile_incref(struct openfile *);
 void openfile_decref(struct openfile *);
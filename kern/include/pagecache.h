@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for mapped files.
+ *
+ * Pages of files that are mmap'd or executed are kept here, keyed by
+ * vnode and page-aligned file offset, so every mapping of the same
+ * file page uses the same physical page; every process running a
+ * program shares its text, and its data until written. Pages stay
+ * cached after the last mapping goes, so running the program again
+ * doesn't read it again, until memory runs short.
+ *
+ * The cache holds one coremap reference on each page and one vnode
+ * reference per page; each mapping holds another coremap reference.
+ *
+ * Pages are filled with VOP_READ (so through the buffer cache) and
+ * written back with VOP_WRITE. A page written through a MAP_SHARED
+ * mapping is dirty; it stays dirty for as long as it's mapped (we
+ * can't tell when a mapping writes again) and is written back by
+ * pagecache_flush and periodically by the pageout daemon.
+ *
+ * Writes through write() don't update cached pages; mapping a file
+ * and writing it with write() at the same time is incoherent.
+ *
+ *   pagecache_bootstrap: initialize.
+ *
+ *   pagecache_get: return the page for OFFSET in VN in *RET, reading
+ *        it in if necessary, with a coremap reference for the caller.
+ *        The read is done without holding the cache lock; others
+ *        wanting the same page wait for it.
+ *
+ *   pagecache_lookup: like pagecache_get, but only if the page is
+ *        already cached; returns ENOENT otherwise.
+ *
+ *   pagecache_setdirty: mark the cached page for OFFSET in VN dirty.
+ *
+ *   pagecache_flush: write back VN's dirty pages.
+ *
+ *   pagecache_sync: write back all dirty pages. Doesn't wait for the
+ *        cache lock; returns without doing anything if it's busy or
+ *        held by the caller.
+ *
+ *   pagecache_reclaim: drop up to NPAGES clean pages that are no
+ *        longer mapped, for the pageout daemon. Doesn't wait for the
+ *        cache lock either. Returns the number of pages freed.
+ */
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+int pagecache_get(struct vnode *vn, off_t offset, paddr_t *ret);
+int pagecache_lookup(struct vnode *vn, off_t offset, paddr_t *ret);
+void pagecache_setdirty(struct vnode *vn, off_t offset);
+int pagecache_flush(struct vnode *vn);
+void pagecache_sync(void);
+unsigned pagecache_reclaim(unsigned npages);
+
+#endif /* _PAGECACHE_H_ */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page tables for user address spaces.
+ *
+ * The top level has one slot per 4M of user space and points to a
+ * page-sized leaf of 1024 page table entries, so empty parts of the
+ * address space cost nothing. A PTE holds the physical page and a few
+ * flag bits in the low bits where the page offset would be. A page
+ * that has been paged out instead has PTE_SWAP set and its swap slot
+ * in place of the physical page.
+ *
+ *   pt_create: make an empty page table. Returns NULL when out of
+ *        memory.
+ *
+ *   pt_destroy: destroy a page table and drop its references to the
+ *        pages and swap slots it maps.
+ *
+ *   pt_lookup: return the PTE for VADDR. If there's no leaf for it,
+ *        returns NULL, or if CREATE is set makes one (returning NULL
+ *        only when out of memory). The PTE is zero if nothing is
+ *        mapped there.
+ *
+ *   pt_copy: make a new page table that shares every page mapped in
+ *        SRC copy-on-write: each page gets another coremap reference
+ *        and loses PTE_WRITE in both tables, and the fault handler
+ *        copies it on the first write. Swapped-out pages share their
+ *        swap slot the same way. The caller must flush any TLB
+ *        entries that still allow writes through SRC.
+ *
+ * Page tables aren't synchronized; the address space lock covers
+ * them.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	PAGE_FRAME	/* physical page */
+#define PTE_VALID	0x001		/* something is mapped */
+#define PTE_WRITE	0x002		/* writes allowed */
+#define PTE_REF		0x004		/* used since the clock last looked */
+#define PTE_SWAP	0x008		/* paged out */
+
+#define PTE_SLOT(pte)		(((pte) & PTE_FRAME) / PAGE_SIZE)
+#define PTE_MKSWAP(slot)	((pte_t)(slot) * PAGE_SIZE | PTE_SWAP)
+
+struct pagetable;
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_copy(struct pagetable *src, struct pagetable **ret);
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PATHNAME_H_
+#define _PATHNAME_H_
+
+struct thread;
+
+/*
+ * Pathnames passed in from user programs.
+ *
+ * pathname_copyin copies the user pathname UPATH into a PATH_MAX
+ * kernel buffer, handing it back in RET. Fails with EFAULT if UPATH
+ * is a bad pointer, ENAMETOOLONG if the name doesn't fit, and ENOENT
+ * if it's empty (as POSIX says). The copy may be handed to the VFS
+ * lookup functions, which write on it.
+ *
+ * pathname_free gives back a buffer from pathname_copyin.
+ *
+ * Each thread keeps one buffer from call to call, so the usual
+ * system call that takes a single pathname doesn't go to kmalloc.
+ * Extra buffers wanted at the same time come from kmalloc.
+ */
+
+int pathname_copyin(const_userptr_t upath, char **ret);
+void pathname_free(char *path);
+
+/* Called when a thread is destroyed. */
+void pathname_threadcleanup(struct thread *t);
+
+#endif /* _PATHNAME_H_ */
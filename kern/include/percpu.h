@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PERCPU_H_
+#define _PERCPU_H_
+
+/*
+ * Per-cpu statistics counters.
+ *
+ * A counter bumped on every operation by every cpu makes all the
+ * cpus fight over its cache line. A percpu_counter instead names a
+ * slot in each cpu's c_counters array; percpu_counter_add updates
+ * the current cpu's copy, with interrupts off, and reading one adds
+ * up all the copies. Reads and resets are unlocked, so a read taken
+ * while the counter is being bumped elsewhere is only approximately
+ * current, which is fine for statistics.
+ *
+ * There are PERCPU_SLOTS slots in all; percpu_counter_init claims one
+ * (returning ENOSPC if there are none left) and zeroes it, and
+ * percpu_counter_cleanup gives it back. Counters may be set up any
+ * time after thread_bootstrap, and are counted on cpus that attach
+ * later.
+ */
+
+/* Number of counters that can exist at once. */
+#define PERCPU_SLOTS	512
+
+struct percpu_counter {
+	unsigned pc_slot;
+};
+
+int percpu_counter_init(struct percpu_counter *pc);
+void percpu_counter_cleanup(struct percpu_counter *pc);
+void percpu_counter_add(struct percpu_counter *pc, unsigned amount);
+unsigned percpu_counter_read(struct percpu_counter *pc);
+void percpu_counter_reset(struct percpu_counter *pc);
+
+#define percpu_counter_inc(pc) percpu_counter_add(pc, 1)
+
+
+#endif /* _PERCPU_H_ */
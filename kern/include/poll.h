@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _POLL_H_
+#define _POLL_H_
+
+/*
+ * Wait queues for poll().
+ *
+ * Anything poll can wait on (a pipe end, the console) has a pollq,
+ * and a thread in poll has a pollset. VOP_POLL registers the pollset
+ * on the object's pollq and then reports what's ready; registering
+ * first means a wakeup after the check isn't lost. Whenever the
+ * object might have become ready it calls pollq_wakeup, which marks
+ * every registered pollset ready and wakes its thread, which then
+ * polls everything again.
+ *
+ * pollq_wakeup takes only spinlocks, so interrupt handlers may call
+ * it. The pollq must outlive any pollset registered on it; poll keeps
+ * a reference to each vnode it's polling until it's done.
+ */
+
+#include <spinlock.h>
+
+struct timespec;	/* in kern/time.h */
+struct wchan;		/* in wchan.h */
+struct pollset;
+
+/* One pollset registered on one pollq */
+struct pollent {
+	struct pollset *pe_set;
+	struct pollq *pe_q;
+	struct pollent *pe_next;	/* in the pollq's list */
+};
+
+struct pollq {
+	struct spinlock pq_lock;
+	struct pollent *pq_ents;
+};
+
+struct pollset {
+	struct spinlock ps_lock;
+	struct wchan *ps_wchan;
+	bool ps_ready;			/* woken since pollset_reset */
+	struct pollent *ps_ents;	/* one per registration */
+	unsigned ps_nents;
+	unsigned ps_maxents;
+};
+
+void pollq_init(struct pollq *pq);
+void pollq_cleanup(struct pollq *pq);
+void pollq_register(struct pollq *pq, struct pollset *ps);
+void pollq_wakeup(struct pollq *pq);
+
+/* A pollset can be registered MAXENTS times */
+int pollset_init(struct pollset *ps, unsigned maxents);
+void pollset_cleanup(struct pollset *ps);
+void pollset_reset(struct pollset *ps);
+
+/*
+ * Sleep unless woken since the last pollset_reset; TIMEOUT NULL means
+ * no time limit. Returns ETIMEDOUT if the time ran out.
+ */
+int pollset_wait(struct pollset *ps, const struct timespec *timeout);
+
+#endif /* _POLL_H_ */
@@ -36,9 +36,14 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <spinlock.h>
+#include <thread.h>
+#include <hashtable.h>
 
 struct addrspace;
+struct cv;
 struct thread;
 struct vnode;
 
@@ -64,6 +69,30 @@ struct proc {
 	struct spinlock p_lock;		/* Lock for this structure */
 	unsigned p_numthreads;		/* Number of threads in this process */
 
+	/* Process table; all protected by the table lock (see proc.c) */
+	pid_t p_pid;			/* Process ID */
+	struct hashlink p_hashlink;	/* in the pid hash table */
+	struct proc *p_parent;		/* parent, or NULL if orphaned */
+	struct proc *p_children;	/* first child */
+	struct proc *p_sibnext;		/* next child of p_parent */
+	struct proc *p_sibprev;		/* previous child of p_parent */
+	struct cv *p_waitcv;		/* signaled when a child exits */
+	bool p_exited;			/* has called _exit */
+	int p_exitstatus;		/* wait status, once exited */
+
+	/* Resource usage; protected by p_lock */
+	struct usage p_usage;		/* of threads that have left */
+	struct usage p_cusage;		/* of children we've waited for */
+
+	/* I/O priority class (IOPRIO_CLASS_*); protected by p_lock */
+	int p_ioclass;
+
+	/* Resource limits; protected by p_lock */
+	struct rlimit p_rlimit[__RLIMIT_NUM];
+	unsigned p_cpushare;		/* RLIMIT_CPUSHARE, 0-100 */
+	int64_t p_iocredit;		/* bytes it may transfer now */
+	uint64_t p_iotime;		/* when p_iocredit was (nsec) */
+
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
 
@@ -83,11 +112,48 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+/* Create a copy of the current process, for fork(). */
+int proc_fork(struct proc **ret);
+
+/* Wait for a child of the current process; see proc.c. */
+int proc_waitpid(pid_t pid, int options, pid_t *ret, int *status);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
-/* terminate a process */
-void proc__exit(int status);
+/* Terminate the current process with wait status STATUS. */
+__DEAD void proc__exit(int status);
+
+/* Add up the current process's usage, or its children's, into U. */
+void proc_getusage(bool children, struct usage *u);
+
+/*
+ * I/O priority classes:
+ *    proc_getioclass - get the class of process PID (0 for the current
+ *                      process) into RET.
+ *    proc_setioclass - set the class of process PID (0 for the
+ *                      current process) to IOCLASS.
+ *    proc_curioclass - return the class disk transfers started now
+ *                      should get: the current process's, or
+ *                      best-effort in an interrupt handler.
+ */
+int proc_getioclass(pid_t pid, int *ret);
+int proc_setioclass(pid_t pid, int ioclass);
+int proc_curioclass(void);
+
+/*
+ * Resource limits, for the current process:
+ *    proc_getrlimit  - get limit RESOURCE into RL.
+ *    proc_setrlimit  - set limit RESOURCE to RL.
+ *    proc_iocharge   - charge a disk transfer of BYTES; called by
+ *                      disk drivers as transfers are queued.
+ *    proc_iothrottle - sleep off any transfers over RLIMIT_IORATE.
+ *                      Must not hold any locks.
+ */
+int proc_getrlimit(int resource, struct rlimit *rl);
+int proc_setrlimit(int resource, const struct rlimit *rl);
+void proc_iocharge(size_t bytes);
+void proc_iothrottle(void);
 
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _RING_H_
+#define _RING_H_
+
+/*
+ * Bounded lock-free ring (FIFO queue) of pointers.
+ *
+ * Functions:
+ *     ring_create  - allocate a ring holding up to SIZE items, which
+ *                    must be a power of two. Returns NULL on error.
+ *     ring_destroy - destroy a ring. It should be empty.
+ *     ring_put     - add an item at the tail; returns false if full.
+ *                    Only one producer at a time may use this.
+ *     ring_put_mp  - the same, for any number of concurrent producers.
+ *     ring_get     - take the item at the head; returns false if
+ *                    empty. Only one consumer at a time.
+ *     ring_count   - a snapshot of how many items are in the ring.
+ *
+ * Nothing here sleeps or takes locks, so interrupt handlers can be
+ * producers or consumers. Each slot carries a sequence number saying
+ * whether it's ready to be filled or emptied; the producer publishes
+ * an item by setting it after the item (membar_store_store), and the
+ * consumer reads the item only after seeing it (membar_load_load).
+ * ring_put_mp claims its slot with atomic_cas on the tail first, so
+ * producers never wait for each other.
+ *
+ * The head and the tail are on separate cache lines so the producer
+ * and consumer don't keep stealing one line from each other.
+ */
+
+struct ring;	/* Opaque. */
+
+struct ring *ring_create(unsigned size);
+void         ring_destroy(struct ring *);
+bool         ring_put(struct ring *, void *item);
+bool         ring_put_mp(struct ring *, void *item);
+bool         ring_get(struct ring *, void **item);
+unsigned     ring_count(struct ring *);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SCHEDSTAT_H_
+#define _SCHEDSTAT_H_
+
+#include <kern/time.h>
+
+/*
+ * Per-cpu scheduler statistics, kept in struct cpu.
+ *
+ * thread_switch counts context switches, split into voluntary ones
+ * (the thread slept, exited or yielded) and ones forced by the
+ * hardclock, and the time the cpu spends in cpu_idle; it also charges
+ * each thread's t_cputime with the time it ran. thread_tick samples
+ * the number of threads waiting in the run queues on each hardclock,
+ * so when the clock is stopped (idle, or one thread running alone)
+ * nothing is sampled. ss_migrations counts threads moved off the cpu,
+ * by work stealing or to honor affinity.
+ *
+ * Only the cpu itself changes its counters, with interrupts off,
+ * except ss_migrations, which is protected by the run queue lock.
+ * Reports read them unlocked. Times come from gettime() and are only
+ * kept once thread_start_cpus has turned them on, since the clock
+ * device isn't attached before then.
+ *
+ * The "schedstat" menu command and the "schedstat:" device report the
+ * statistics for all cpus, along with the threads on each.
+ */
+struct schedstats {
+	unsigned ss_vswitches;		/* slept, exited, or yielded */
+	unsigned ss_ivswitches;		/* preempted */
+	unsigned ss_migrations;		/* threads moved elsewhere */
+	uint64_t ss_idleusec;		/* time in cpu_idle */
+	unsigned ss_rqsamples;		/* run queue samples */
+	unsigned ss_rqtotal;		/* sum of the samples */
+	unsigned ss_rqmax;		/* largest sample */
+	struct timespec ss_since;	/* when curthread was last charged */
+};
+
+void schedstats_printall(void);
+size_t schedstats_formatall(char *buf, size_t len);
+
+#endif /* _SCHEDSTAT_H_ */
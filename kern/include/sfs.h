@@ -37,19 +37,61 @@
 
 
 struct buf; /* in buf.h */
+struct bufowner; /* in buf.h */
 
 /*
  * Get abstract structure definitions
  */
 #include <fs.h>
 #include <vnode.h>
+#include <hashtable.h>
 
 /*
  * Get on-disk structures and constants that are made available to
- * userland for the benefit of mksfs, dumpsfs, etc.
+ * userland for the benefit of mksfs, dumpsfs, etc. The block size
+ * comes from the sfs4k option.
  */
+#include "opt-sfs4k.h"
+#if OPT_SFS4K
+#define SFS_BLOCKSIZE	4096
+#endif
 #include <kern/sfs.h>
 
+/*
+ * Number of block map runs each vnode caches (see sfs_bmap.c)
+ */
+#define SFS_BMCACHE_SIZE	4
+
+/*
+ * Most blocks of a file that can wait for delayed allocation (see
+ * sfs_dalloc.c)
+ */
+#define SFS_DALLOC_PERFILE	16
+
+/*
+ * Most unused vnodes the vnode table keeps around for reuse (see
+ * sfs_inode.c)
+ */
+#define SFS_VNCACHE_MAX		64
+
+/*
+ * A file block waiting for delayed allocation
+ */
+struct sfs_dabuf {
+	uint32_t da_fileblock;		/* block number in file */
+	unsigned da_slot;		/* slot the buffer is keyed by */
+	struct buf *da_buf;		/* the data (fsmanaged buffer) */
+};
+
+/*
+ * A range of file blocks locked by a writer (see sfs_range.c)
+ */
+struct sfs_range {
+	uint32_t sr_start;		/* first block */
+	uint32_t sr_end;		/* block past the last */
+	struct sfs_range *sr_next;	/* next range held on the file */
+};
+
 /*
  * In-memory inode
  */
@@ -60,8 +102,46 @@ struct sfs_vnode {
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
 	struct lock *sv_lock;		/* lock for vnode */
+	struct rwlock *sv_rwlock;	/* file I/O lock (see sfs_vnops.c) */
+	struct spinlock sv_rangelock;	/* protects sv_ranges, sv_synclsn */
+	struct wchan *sv_rangewchan;	/* for waiting on ranges */
+	struct sfs_range *sv_ranges;	/* block ranges being written */
+	uint32_t sv_ranext;		/* block where next read should start */
+	uint32_t sv_raend;		/* end of blocks read ahead so far */
+	unsigned sv_rawindow;		/* current read-ahead window */
+	struct sfs_extent sv_bmcache[SFS_BMCACHE_SIZE]; /* recent runs */
+	unsigned sv_bmnext;		/* next sv_bmcache slot to replace */
+	daddr_t sv_nextblock;		/* where to allocate next */
+	unsigned sv_reserved;		/* blocks reserved at sv_nextblock */
+	unsigned sv_wantblocks;		/* size of run being allocated */
+	struct buf **sv_fillbuf;	/* for sfs_bmap_fill */
+	struct sfs_dabuf sv_dalloc[SFS_DALLOC_PERFILE]; /* pending blocks */
+	unsigned sv_danum;		/* number of pending blocks */
+	off_t sv_size;			/* file size, if sv_sizedirty */
+	bool sv_sizedirty;		/* sv_size newer than sfi_size */
+	int sv_dirfree;			/* no free dir slots below this */
+	int sv_dirnfree;		/* # free dir slots; -1 if unknown */
+	struct bufowner *sv_bufowner;	/* its dirty buffers, for fsync */
+	uint64_t sv_synclsn;		/* journal fsync must flush to */
+	bool sv_mapdirty;		/* inode has size/map changes */
+	uint32_t sv_parentino;		/* dir: parent's ino, or SFS_NOINO */
+	char sv_name[SFS_NAMELEN];	/* dir: its name in sv_parentino */
+	struct hashlink sv_hashlink;	/* in vnode table hash */
+	unsigned sv_tableix;		/* index in sfs_vnodes */
+	bool sv_cached;			/* unused, kept for reuse */
+	struct sfs_vnode *sv_lruprev;	/* list of unused vnodes */
+	struct sfs_vnode *sv_lrunext;
+	struct sfs_vnode *sv_reapnext;	/* list of files to erase */
 };
 
+/*
+ * Journaling modes, which say what happens to file data (see
+ * sfs_jmode.c). Metadata is journaled in all of them.
+ */
+#define SFS_JMODE_WRITEBACK	0	/* data goes to disk whenever */
+#define SFS_JMODE_ORDERED	1	/* data goes to disk before commit */
+#define SFS_JMODE_DATA		2	/* data is journaled too */
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -70,14 +150,26 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	struct device *sfs_jdevice;	/* external journal device or NULL */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct hashtable *sfs_vnhash;	/* same, by inode */
+	struct sfs_vnode *sfs_vnlru;	/* unused vnodes, most recent first */
+	struct sfs_vnode *sfs_vnlrutail;
+	unsigned sfs_vncached;		/* number of unused vnodes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 	struct lock *sfs_vnlock;	/* lock for vnode table */
-	struct lock *sfs_freemaplock;	/* lock for freemap/superblock */
-	struct lock *sfs_renamelock;	/* lock for sfs_rename() */
+	struct lock *sfs_freemaplock;	/* lock for freemap I/O/superblock */
+	struct lock **sfs_aglocks;	/* per-allocation-group freemap locks */
+	unsigned sfs_ngroups;		/* number of allocation groups */
+	struct lock *sfs_renamelock;	/* cross-dir sfs_rename() */
 
 	struct sfs_jphys *sfs_jphys;	/* physical journal container */
+	struct sfs_ckpt *sfs_ckpt;	/* journal checkpointer */
+	unsigned sfs_jmode;		/* journaling mode (SFS_JMODE_*) */
+	struct sfs_ordered *sfs_ordered; /* data blocks to write at commit */
+	struct sfs_dalloc *sfs_dalloc;	/* delayed allocation slots */
+	struct sfs_reaper *sfs_reaper;	/* erases deleted files */
 };
 
 /*
@@ -85,5 +177,21 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Same, for a sfs whose journal is on the separate device JDEVICE.
+ */
+int sfs_mount_journal(const char *device, const char *jdevice);
+
+/*
+ * Print journal statistics for the sfs mounted as DEVNAME.
+ */
+int sfs_printjstats(const char *devname);
+
+/*
+ * Set the journaling mode ("writeback", "ordered", or "data") of the
+ * sfs mounted as DEVNAME, or if MODE is NULL print the current one.
+ */
+int sfs_setjmode(const char *devname, const char *mode);
+
 
 #endif /* _SFS_H_ */
@@ -45,11 +45,21 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+#include <lockstat.h>
+#include <hangman.h>
+
 /*
  * Basic spinlock.
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A spinlock is either test-and-set, the default, or FIFO (a ticket
+ * lock), chosen when it is initialized. A test-and-set lock goes to
+ * whichever waiter happens to win the race for it, which is cheapest
+ * when it is rarely contended. A FIFO lock hands out tickets with an
+ * atomic add and is granted in ticket order, so a busy lock is shared
+ * fairly; waiters only read the lock while they spin.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
@@ -57,17 +67,38 @@
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	bool splk_fifo;			    /* Ticket lock? */
+	volatile unsigned splk_next;	    /* FIFO: next ticket to give */
+	volatile unsigned splk_serving;	    /* FIFO: ticket now served */
+	LOCKSTAT(splk_stat);		    /* Contention statistics. */
+	HANGMAN_LOCKABLE(splk_hangman);	    /* Exact deadlock detection. */
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_STAT_INITIALIZER	, LOCKSTAT_INITIALIZER
+#else
+#define SPINLOCK_STAT_INITIALIZER
+#endif
+#if OPT_HANGMAN
+#define SPINLOCK_HANGMAN_INITIALIZER	, HANGMAN_LOCKABLE_INITIALIZER
+#else
+#define SPINLOCK_HANGMAN_INITIALIZER
+#endif
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, false, 0, 0 \
+	  SPINLOCK_STAT_INITIALIZER SPINLOCK_HANGMAN_INITIALIZER }
+#define SPINLOCK_FIFO_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, true, 0, 0 \
+	  SPINLOCK_STAT_INITIALIZER SPINLOCK_HANGMAN_INITIALIZER }
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_fifo	Same, but make it a FIFO (ticket) lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
@@ -77,6 +108,7 @@ struct spinlock {
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_fifo(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space and the pageout daemon.
+ *
+ * Swap lives on the raw disk SWAP_DEVICE, divided into page-sized
+ * slots. Slots are reference counted like coremap pages so that fork
+ * can share paged-out pages too. If the device isn't there the system
+ * runs without swap and the pageout daemon isn't started.
+ *
+ *   swap_bootstrap: open the swap device and start the daemon.
+ *
+ *   swap_alloc: find NSLOTS consecutive free slots and return the
+ *        first, with one reference each, or SWAP_NOSLOT.
+ *
+ *   swap_share/swap_free: add/drop a reference to a slot.
+ *
+ *   swap_io: read or write NPAGES consecutive slots starting at SLOT
+ *        from or to the physical pages in PAGES, in one transfer.
+ *
+ * The pageout daemon runs a CLOCK sweep over the coremap when free
+ * memory gets low, evicting pages that haven't been used since the
+ * previous sweep. Runs of unused pages that are adjacent in an
+ * address space are written out together to consecutive slots, and
+ * swapping one of them back in reads its neighbours too. Each pass
+ * first drops unmapped pages from the page cache. The daemon also
+ * wakes up every few seconds to write back dirty mapped file pages
+ * (pagecache_sync); without swap, that only happens at munmap/exit.
+ *
+ *   pageout_poke: wake the daemon if free memory is below the low
+ *        watermark. Cheap; call after allocating.
+ *
+ *   pageout_wait: ask the daemon for a pass and wait for it. Returns
+ *        true if that freed anything and it's worth trying the
+ *        allocation again. Must not be called holding spinlocks; a
+ *        caller holding an address space lock can wait, but pages
+ *        of that address space won't be evicted for it.
+ */
+
+#include <kern/iovec.h>
+#include <uio.h>
+
+#define SWAP_DEVICE	"lhd1raw:"
+#define SWAP_NOSLOT	((unsigned)-1)
+#define SWAP_CLUSTER	8	/* max pages per transfer */
+
+void swap_bootstrap(void);
+unsigned swap_alloc(unsigned nslots);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int swap_io(unsigned slot, const paddr_t *pages, unsigned npages,
+	    enum uio_rw rw);
+
+void pageout_bootstrap(void);
+void pageout_poke(void);
+bool pageout_wait(void);
+
+#endif /* _SWAP_H_ */
@@ -37,6 +37,21 @@
 
 #include <spinlock.h>
 
+struct timespec;	/* from <kern/time.h> */
+
+/*
+ * Set up the object caches semaphores, locks and CVs come from. Must
+ * be called before any of them are created.
+ */
+void synch_bootstrap(void);
+
+/*
+ * If true, V and lock_release hand what they release directly to the
+ * thread they wake rather than letting it compete for it. Off by
+ * default; see synch.c.
+ */
+extern bool synch_handoff;
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -48,6 +63,8 @@ struct semaphore {
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile unsigned sem_count;
+	unsigned sem_handoff;		/* counts handed to woken waiters */
+	LOCKSTAT(sem_stat);
 };
 
 struct semaphore *sem_create(const char *name, unsigned initial_count);
@@ -77,7 +94,7 @@ struct lock {
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
-
+	LOCKSTAT(lk_stat);
 };
 
 struct lock *lock_create(const char *name);
@@ -91,12 +108,21 @@ void lock_destroy(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
+ *    lock_tryacquire - Get the lock if nobody holds it, without waiting.
+ *                   Returns true if the lock was acquired.
+ *    lock_acquire_timeout - Like lock_acquire, but give up after DELAY.
+ *                   Returns 0 if the lock was acquired, or ETIMEDOUT.
+ *
+ * lock_acquire and lock_acquire_timeout spin briefly instead of
+ * sleeping while the holder is running on another cpu.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
+bool lock_tryacquire(struct lock *);
+int lock_acquire_timeout(struct lock *, const struct timespec *delay);
 
 
 /*
@@ -115,8 +141,8 @@ bool lock_do_i_hold(struct lock *);
 
 struct cv {
         char *cv_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *cv_wchan;
+	struct spinlock cv_lock;
 };
 
 struct cv *cv_create(const char *name);
@@ -127,7 +153,12 @@ void cv_destroy(struct cv *);
  *    cv_wait      - Release the supplied lock, go to sleep, and, after
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
- *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_broadcast - Wake up all threads sleeping on this CV. They are
+ *                   moved onto the lock's wait queue, not woken at
+ *                   once, and run one at a time as it's released.
+ *    cv_wait_timeout - Like cv_wait, but stop sleeping after DELAY if
+ *                   not woken. Returns ETIMEDOUT if the time ran out,
+ *                   otherwise 0; either way the lock is held again.
  *
  * For all three operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
@@ -138,6 +169,62 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_wait_timeout(struct cv *cv, struct lock *lock,
+		    const struct timespec *delay);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads can hold the lock for reading at once, or
+ * one thread can hold it for writing. Writers are preferred: once a
+ * writer is waiting, new readers wait too, so a steady stream of
+ * readers can't keep writers out forever. A consequence is that a
+ * thread must not acquire the lock for reading again while it already
+ * holds it, since a writer arriving in between would deadlock them.
+ *
+ * As with locks, nobody should hold it when it's created or
+ * destroyed, and the name is copied.
+ */
+struct rwlock {
+        char *rwl_name;
+	struct wchan *rwl_rwchan;	/* readers wait here */
+	struct wchan *rwl_wwchan;	/* writers wait here */
+	struct spinlock rwl_lock;
+	volatile unsigned rwl_readers;	/* number holding it for reading */
+	volatile unsigned rwl_wwaiting;	/* number of writers waiting */
+	struct thread *volatile rwl_writer; /* holder for writing */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading (shared).
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing (exclusive).
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding the lock for writing may do this.
+ *    rwlock_downgrade     - Turn the current thread's write hold into a
+ *                           read hold, without letting a writer in
+ *                           between. Release it with
+ *                           rwlock_release_read.
+ *    rwlock_do_i_hold     - Return true if the current thread holds the
+ *                           lock for writing, or if anyone holds it for
+ *                           reading. (Readers aren't tracked
+ *                           individually, so this is only good for
+ *                           assertions.)
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
 
 
 #endif /* _SYNCH_H_ */
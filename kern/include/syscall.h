@@ -40,6 +40,19 @@ struct trapframe; /* from <machine/trapframe.h> */
 
 void syscall(struct trapframe *tf);
 
+/* True for the short calls that skip time accounting; see syscall.c. */
+bool syscall_isfast(int callno);
+
+/*
+ * Per-syscall counts and latencies, reported by the "sysstat" menu
+ * command. Counting is always on; timing each call costs two clock
+ * reads and is off until syscallstat_enable(true).
+ */
+void syscall_bootstrap(void);
+void syscallstat_enable(bool on);
+void syscallstat_reset(void);
+void syscallstat_report(void);
+
 /*
  * Support functions.
  */
@@ -47,6 +60,9 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+/* Load a program into a fresh address space for the current process. */
+int runprogram_load(char *progname, vaddr_t *entrypoint, vaddr_t *stackptr);
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
@@ -58,14 +74,55 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
+int sys_setaffinity(uint32_t mask);
+int sys_ioprio_get(pid_t pid, int *retval);
+int sys_ioprio_set(pid_t pid, int ioclass);
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
+int sys_futex_wait(const_userptr_t uaddr, int val);
+int sys_futex_wake(const_userptr_t uaddr, int count, int *retval);
 void sys__exit(int code);
+int sys___spawn(const_userptr_t prog, const_userptr_t args,
+                const_userptr_t actions, int nactions, int *retval);
+int sys_fork(struct trapframe *tf, int *retval);
+int sys_execv(const_userptr_t prog, const_userptr_t args);
+int sys_waitpid(pid_t pid, userptr_t status, int options, int *retval);
+int sys_getpid(int *retval);
 
 int sys_open(const_userptr_t filename, int flags, mode_t mode, int *retval);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
+int sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+               int *retval);
+int sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+                int *retval);
 int sys_close(int fd, int *retval);
+int sys_pipe(userptr_t fds, int *retval);
+int sys_poll(userptr_t fds, unsigned nfds, int timeout, int *retval);
+int sys_fstat(int fd, userptr_t statbuf);
+int sys_fsync(int fd);
+int sys_fdatasync(int fd);
+int sys_fallocate(int fd, off_t offset, off_t len);
+int sys_ioctl(int fd, int code, userptr_t data);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, int *retval);
+int sys_semop(int fd, int count);
+int sys_copy_file_range(int infd, userptr_t inpos, int outfd, userptr_t outpos,
+                        size_t len, unsigned flags, int *retval);
 int sys_meld(const_userptr_t upath1, const_userptr_t upath2, const_userptr_t upathmerge, int *retval);
 
+/* Not in dumbvm kernels */
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_getrusage(int who, userptr_t usage);
+
 
 /* You need to add more for sys_meld, sys_write, and sys_close */
 
@@ -48,16 +48,28 @@ int airballoon(int, char **);
 int arraytest(int, char **);
 int arraytest2(int, char **);
 int bitmaptest(int, char **);
+int hashtest(int, char **);
+int ringtest(int, char **);
 int threadlisttest(int, char **);
 
+/* string function tests */
+int strtest(int, char **);
+int strbench(int, char **);
+
 /* thread tests */
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int wqtest(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int timedtest(int, char **);
+int lockbench(int, char **);
+int rwbench(int, char **);
+int spinbench(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -90,13 +102,26 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int overwritestress(int, char **);
+int lookupbench(int, char **);
+int fsbench(int, char **);
 int printfile(int, char **);
 
+/* buffer cache tests */
+struct fs;
+int bufhitbench(int, char **);
+struct fs *buftest_fs(void);
+
+/* microbenchmarks */
+int bench(int, char **);
+
 /* other tests */
 int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int kmalloctest6(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
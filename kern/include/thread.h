@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -64,6 +65,28 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/* CPU affinity masks. */
+#define CPUMASK(n)		((uint32_t)1 << (n))
+#define CPUMASK_ALL		0xffffffffU
+#define CPUMASK_ISSET(m, n)	(((m) & CPUMASK(n)) != 0)
+
+/*
+ * Resource usage, counted on the thread while it runs and added to
+ * its process's total (see proc.h) when it leaves the process. The
+ * times are in microseconds and only counted once the clock is up.
+ */
+struct usage {
+	uint64_t u_utime;		/* Time in user mode */
+	uint64_t u_stime;		/* Time in the kernel */
+	unsigned u_minflt;		/* Faults handled without I/O */
+	unsigned u_majflt;		/* Faults that read from swap */
+	unsigned u_inblock;		/* File system blocks read */
+	unsigned u_oublock;		/* File system blocks written */
+	unsigned u_nvcsw;		/* Voluntary context switches */
+	unsigned u_nivcsw;		/* Preemptions */
+	unsigned u_nsyscalls;		/* System calls */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -72,6 +95,7 @@ struct thread {
 	 */
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	struct wchan *t_sleepwc;	/* Wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
@@ -84,6 +108,36 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduler fields, protected by the run queue lock of t_cpu.
+	 *
+	 * t_class is the thread's scheduling class, which is also the
+	 * best level it can reach on its own. t_prio is the thread's
+	 * priority level (0 is highest, up to SCHED_LEVELS-1) and
+	 * t_ticks the number of hardclocks it has run for since it
+	 * last got a fresh quantum. t_lastran is
+	 * t_cpu's hardclock count when the thread last stopped running.
+	 * t_cpumask has a bit (CPUMASK(c_number)) for each cpu the
+	 * thread may run on. t_inherit is the best priority lent it by
+	 * threads waiting for locks it holds (SCHED_LEVELS if none);
+	 * it runs at whichever of t_prio and t_inherit is better.
+	 * t_shareticks is the number of hardclocks it has run for
+	 * against its process's cpu share since t_sharestart, and
+	 * t_throttled is set when that's more than the share.
+	 */
+	unsigned t_class;		/* Scheduling class */
+	unsigned t_prio;		/* Priority level */
+	unsigned t_inherit;		/* Priority lent by lock waiters */
+	unsigned t_ticks;		/* Hardclocks used of quantum */
+	unsigned t_lastran;		/* When it last ran */
+	unsigned t_shareticks;		/* Hardclocks used of cpu share */
+	unsigned t_sharestart;		/* When the share period began */
+	bool t_throttled;		/* Used up its cpu share */
+	uint32_t t_cpumask;		/* CPUs it may run on */
+	uint64_t t_cputime;		/* Usec run, charged at switches */
+	bool t_inuser;			/* Running in user mode */
+	struct usage t_usage;		/* Usage not yet added to t_proc */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -107,6 +161,12 @@ struct thread {
 
 	/* VFS */
 	bool t_did_reserve_buffers;	/* reserve_buffers() in effect */
+	char *t_pathbuf;		/* spare buffer for pathname.c */
+
+	/* Synchronization */
+	struct lock *t_wantlock;	/* Lock sleeping for, see synch.c */
+	struct lock *t_pilock;		/* Lock lending priority for */
+	unsigned t_nlocks;		/* Number of locks held */
 
 	/* add more here as needed */
 };
@@ -124,8 +184,13 @@ DEFARRAY(thread, THREADINLINE);
 /* Call once during system startup to allocate data structures. */
 void thread_bootstrap(void);
 
-/* Call late in system startup to get secondary CPUs running. */
+/*
+ * Call late in system startup to get secondary CPUs running; they
+ * start while the rest of startup goes on, and thread_wait_cpus
+ * waits until they're all up.
+ */
 void thread_start_cpus(void);
+void thread_wait_cpus(void);
 
 /* Call during panic to stop other threads in their tracks */
 void thread_panic(void);
@@ -160,16 +225,66 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Restrict the current thread to the cpus whose CPUMASK() bits are
+ * set in MASK, moving it to one if necessary. New threads inherit
+ * the mask of the thread that forks them. Returns EINVAL if MASK
+ * names no cpus that exist.
+ */
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Charge a hardclock to the current thread, and yield if it has used
+ * up its quantum or a higher-priority thread is ready. Called from the
+ * timer interrupt.
+ */
+void thread_tick(void);
+
+/*
+ * Charge the current thread for its time since it was last charged,
+ * to user or system time as it was running, and note that it's now
+ * going to user mode (TOUSER) or coming into the kernel. Called on
+ * each trap from user mode and each return to it.
+ */
+void thread_usermode(bool touser);
+
+/*
+ * Bring the current thread's t_cputime and t_usage times up to date,
+ * for code about to read them.
+ */
+void thread_charge(void);
+
+/*
+ * Restart the current cpu's hardclock if it's been stopped. Called
+ * with interrupts off by timeout_set, which needs the clock to run.
+ */
+void thread_clockneeded(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Put the current thread in scheduling class CLASS (SCHED_REALTIME,
+ * SCHED_HIGH, or SCHED_NORMAL). New threads are SCHED_NORMAL; kernel
+ * daemons call this when they start.
+ */
+void thread_setclass(unsigned class);
+
+/*
+ * Priority inheritance, for locks:
+ *    thread_curprio    - return the current thread's priority level.
+ *    thread_inherit    - raise T to priority level PRIO (lower is
+ *                        better) if it is below that, until it calls
+ *                        thread_disinherit. The caller must keep T
+ *                        from exiting.
+ *    thread_disinherit - give up any priority the current thread has
+ *                        been lent.
  */
-void thread_consider_migration(void);
+unsigned thread_curprio(void);
+void thread_inherit(struct thread *t, unsigned prio);
+void thread_disinherit(void);
 
 
 #endif /* _THREAD_H_ */
@@ -55,6 +55,10 @@ struct switchframe;	/* from <machine/switchframe.h> */
 void thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 		    void *data1, unsigned long data2);
 
+/* Access to the cpus, for the scheduler statistics report */
+unsigned thread_numcpus(void);
+struct cpu *thread_getcpu(unsigned index);
+
 /* Initialize or clean up the machine-dependent portion of struct thread */
 void thread_machdep_init(struct thread_machdep *tm);
 void thread_machdep_cleanup(struct thread_machdep *tm);
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+/*
+ * Timeouts: callbacks run from the timer interrupt after a delay.
+ *
+ * Each cpu keeps its pending timeouts on a timer wheel, in the style
+ * of the hierarchical wheels of Varghese and Lauck: TW_LEVELS levels
+ * of TW_SLOTS buckets each, level n being TW_SLOTS^n hardclocks per
+ * bucket. Setting or cancelling a timeout is O(1); each hardclock
+ * runs the level-0 bucket that has come due, and every TW_SLOTS
+ * hardclocks one higher-level bucket is cascaded down a level.
+ *
+ * A timeout goes on the wheel of the cpu that sets it and runs there,
+ * so timeouts set on different cpus don't contend with each other.
+ * Delays are given as struct timespec and rounded up to whole
+ * hardclocks, plus one so a partial tick never shortens the delay;
+ * delays longer than TW_SLOTS^TW_LEVELS-1 hardclocks are clamped.
+ */
+
+#include <spinlock.h>
+
+struct timespec;	/* from <kern/time.h> */
+
+#define TW_LEVELS	4
+#define TW_SLOTBITS	6
+#define TW_SLOTS	(1 << TW_SLOTBITS)
+#define TW_SLOTMASK	(TW_SLOTS - 1)
+#define TW_MAXTICKS	((1U << (TW_LEVELS * TW_SLOTBITS)) - 1)
+
+/*
+ * One timeout. The fields are private to timeout.c; callers allocate
+ * the structure (usually on the stack or inside some other object)
+ * and set it up with timeout_init.
+ */
+struct timeout {
+	struct timeout *to_next;	/* Next in bucket */
+	struct timeout **to_prevp;	/* Pointer to us in bucket */
+	struct timerwheel *to_wheel;	/* Wheel last set on */
+	unsigned to_expires;		/* Hardclock it runs on */
+	bool to_pending;		/* True if on to_wheel */
+	void (*to_func)(void *);	/* Callback */
+	void *to_arg;			/* Argument for callback */
+};
+
+/*
+ * Per-cpu timer wheel, in struct cpu. tw_now is the next hardclock
+ * to be processed; it only advances while the cpu's hardclock runs,
+ * and the clock is kept running while tw_count is nonzero.
+ * tw_running is the timeout whose callback is running, if any.
+ */
+struct timerwheel {
+	struct spinlock tw_lock;
+	unsigned tw_now;
+	unsigned tw_count;
+	struct timeout *tw_running;
+	struct timeout *tw_slots[TW_LEVELS][TW_SLOTS];
+};
+
+/*
+ * Functions.
+ *
+ * timerwheel_init - set up a cpu's wheel. Called from cpu_create.
+ *
+ * timerwheel_busy - return true if the wheel has pending timeouts.
+ *                   Not locked; for use by the tickless logic.
+ *
+ * timeout_init    - set up TO to call FUNC(ARG) when it expires.
+ *
+ * timeout_set     - arrange for TO to be run after DELAY. If it is
+ *                   already pending it is rescheduled.
+ *
+ * timeout_cancel  - remove TO if it's pending. Returns true if it was
+ *                   removed before running. If its callback is running
+ *                   on another cpu, waits for it to finish, so after
+ *                   this returns TO may be freed.
+ *
+ * timeout_tick    - advance the current cpu's wheel by one hardclock
+ *                   and run what's due. Called from hardclock.
+ *
+ * The callback runs in interrupt context with no locks held. It may
+ * take spinlocks and wake threads, but must not sleep.
+ */
+void timerwheel_init(struct timerwheel *tw);
+bool timerwheel_busy(struct timerwheel *tw);
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_set(struct timeout *to, const struct timespec *delay);
+bool timeout_cancel(struct timeout *to);
+void timeout_tick(void);
+
+
+#endif /* _TIMEOUT_H_ */
@@ -78,6 +78,8 @@ struct uio {
 	enum uio_seg      uio_segflg;	/* What kind of pointer we have */
 	enum uio_rw       uio_rw;	/* Whether op is a read or write */
 	struct addrspace *uio_space;	/* Address space for user pointer */
+	bool              uio_direct;	/* Bypass caches if possible */
+	bool              uio_dsync;	/* Make written data durable */
 };
 
 
@@ -95,14 +97,17 @@ struct uio {
  *   (4) set up uio_seg and uio_rw correctly;
  *   (5) if uio_seg is UIO_SYSSPACE, set uio_space to NULL; otherwise,
  *       initialize uio_space to the address space in which the buffer
- *       should be found.
+ *       should be found;
+ *   (6) set uio_direct to false, unless the I/O is for a file opened
+ *       with O_DIRECT, and likewise uio_dsync for O_DSYNC.
  *
  * After calling,
  *   (1) the contents of uio_iov and uio_iovcnt may be altered and
  *       should not be interpreted;
  *   (2) uio_offset will have been incremented by the amount transferred;
  *   (3) uio_resid will have been decremented by the amount transferred;
- *   (4) uio_segflg, uio_rw, and uio_space will be unchanged.
+ *   (4) uio_segflg, uio_rw, uio_space, uio_direct, and uio_dsync will
+ *       be unchanged.
  *
  * uiomove() may be called repeatedly on the same uio to transfer
  * additional data until the available buffer space the uio refers to
@@ -157,6 +157,11 @@ int vfs_getcwd(struct uio *buf);
  *                    MOUNTFUNC, which should create a struct fs and
  *                    return it in RESULT.
  *
+ *    vfs_mount_aux - Like vfs_mount, but for a filesystem that also
+ *                    uses a second device AUXNAME (e.g. for an
+ *                    external journal), which is marked in use until
+ *                    the filesystem is unmounted.
+ *
  *    vfs_unmount   - Unmount the filesystem presently mounted on the
  *                    specified device.
  *
@@ -167,6 +172,13 @@ int vfs_getcwd(struct uio *buf);
  *                    previously returned by vfs_swapon should be
  *                    decref'd first. Similar to vfs_unmount.
  *
+ *    vfs_claimdevs - Look up several devices by name and mark them
+ *                    as permanently parts of another device (e.g. a
+ *                    stripe set), returning their device objects.
+ *
+ *    vfs_unclaimdevs - Give back devices taken by vfs_claimdevs, if
+ *                    the device they were for couldn't be made.
+ *
  *    vfs_unmountall - Unmount all mounted filesystems.
  */
 
@@ -183,11 +195,70 @@ int vfs_mount(const char *devname, void *data,
 	      int (*mountfunc)(void *data,
 			       struct device *dev,
 			       struct fs **result));
+int vfs_mount_aux(const char *devname, const char *auxname, void *data,
+		  int (*mountfunc)(void *data,
+				   struct device *dev,
+				   struct device *auxdev,
+				   struct fs **result));
 int vfs_unmount(const char *devname);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
+int vfs_claimdevs(char **devnames, unsigned num, struct device **result);
+void vfs_unclaimdevs(struct device **devs, unsigned num);
 int vfs_unmountall(void);
 
+/*
+ * Name cache (vfscache.c). Remembers the vnodes found when looking
+ * up names in directories, and which names weren't found, so file
+ * systems can skip searching the directory. It is up to each file
+ * system to use it, and to keep it consistent.
+ *
+ *    vfs_cache_bootstrap - Initialize; called from vfs_bootstrap.
+ *
+ *    vfs_cache_lookup   - Look up NAME in directory DIR. Returns true if
+ *                         the answer is cached: then *RET is the vnode,
+ *                         incref'd, or NULL if NAME doesn't exist. On a
+ *                         miss, may recycle an entry and thus reclaim
+ *                         a vnode, so call it without vnode locks held.
+ *
+ *    vfs_cache_walk     - Follow as many leading components of PATH
+ *                         from DIR as are cached, leaving the last
+ *                         component alone. Returns how many it took;
+ *                         if nonzero, *RET is where it got to,
+ *                         incref'd, and *PATH points past them.
+ *                         Takes no vnode locks, so it's safe to call
+ *                         with DIR locked or not.
+ *
+ *    vfs_cache_enter    - Record that NAME in DIR is VN, or, if VN is
+ *                         NULL, that it doesn't exist. "." and ".."
+ *                         and very long names are silently not cached.
+ *                         Call with DIR locked, after a miss.
+ *
+ *    vfs_cache_remove   - Forget NAME in DIR. Must be called, with DIR
+ *                         locked, whenever a name is created or
+ *                         removed. The caller should hold its own
+ *                         reference to whatever NAME referred to.
+ *
+ *    vfs_cache_purgedir - Forget all names in DIR; for when DIR is
+ *                         removed.
+ *
+ *    vfs_cache_purgefs  - Forget everything on FS. Because the cache
+ *                         holds vnode references, vfs_unmount calls
+ *                         this before unmounting.
+ *
+ *    vfs_cache_printstats - Print hit rates.
+ */
+
+void vfs_cache_bootstrap(void);
+bool vfs_cache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret);
+unsigned vfs_cache_walk(struct vnode *dir, char **path, struct vnode **ret);
+void vfs_cache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void vfs_cache_remove(struct vnode *dir, const char *name);
+void vfs_cache_purgedir(struct vnode *dir);
+void vfs_cache_purgefs(struct fs *fs);
+void vfs_cache_printstats(void);
+
 /*
  * Array of vnodes.
  */
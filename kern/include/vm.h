@@ -55,6 +55,12 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Number of physical pages currently free (used to size the buffer cache) */
+unsigned vm_freepages(void);
+
+/* Do a little background work from the idle loop; true if it did any */
+bool vm_idle(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct pollset;
 
 
 /*
@@ -49,8 +50,7 @@ struct stat;
  * Note: vn_fs may be null if the vnode refers to a device.
  */
 struct vnode {
-	int vn_refcount;                /* Reference count */
-	struct spinlock vn_countlock;   /* Lock for vn_refcount */
+	volatile unsigned vn_refcount;  /* Reference count (atomic) */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -98,6 +98,14 @@ struct vnode {
  *                      handled in the normal fashion.
  *                      On non-directory objects, return ENOTDIR.
  *
+ *    vop_getdirentries - Like vop_getdirentry, but fill the uio with
+ *                      as many struct direntplus records (see
+ *                      kern/dirent.h) as will fit, each with the
+ *                      entry's type, size, and link count. Return
+ *                      EINVAL if not even one fits. Filesystems
+ *                      that don't go in for this may return ENOSYS.
+ *                      On non-directory objects, return ENOTDIR.
+ *
  *    vop_write       - Write data from uio to file at offset specified
  *                      in the uio, updating uio_resid to reflect the
  *                      amount written, and updating uio_offset to match.
@@ -120,13 +128,44 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_fdatasync   - Like vop_fsync, but only the file's data and
+ *                      what's needed to read it back (its size and
+ *                      block map) need to reach stable storage; other
+ *                      metadata may be left for later.
+ *
+ *    vop_mmap        - Check if the file can be mapped into memory.
+ *                      The VM system does the mapping itself, using
+ *                      vop_read and vop_write to fill and write back
+ *                      pages, so a file system only needs to say
+ *                      yes (return 0) for files where that works.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
  *
+ *    vop_fallocate   - Allocate storage for the LEN bytes at POS that
+ *                      don't have any yet, so writing them later
+ *                      can't fail for lack of space, and extend the
+ *                      file to POS+LEN if it's shorter. The new parts
+ *                      read as zeros. Filesystems that can't do this
+ *                      return ENOSYS.
+ *
+ *    vop_seekhole    - Find the first offset at or after POS that is in
+ *                      a data region (if DATA is true) or a hole (if
+ *                      DATA is false), for lseek's SEEK_DATA and
+ *                      SEEK_HOLE. The end of the file counts as a hole.
+ *                      Fails with ENXIO if POS is at or past the end of
+ *                      the file, or if looking for data and there is
+ *                      none. Filesystems that don't track holes may
+ *                      report the whole file as data.
+ *
+ *    vop_poll        - Report in *REVENTS which of the poll() EVENTS
+ *                      (kern/poll.h) wouldn't block now, plus POLLERR
+ *                      and POLLHUP if they apply. If PS isn't NULL,
+ *                      first register it (pollq_register) on whatever
+ *                      wait queue gets woken when that might change.
+ *                      Objects that never block may use
+ *                      vnode_poll_ready.
+ *
  *    vop_namefile    - Compute pathname relative to filesystem root
  *                      of the file and copy to the specified
  *                      uio. Need not work on objects that are not
@@ -187,14 +226,21 @@ struct vnode_ops {
 	int (*vop_read)(struct vnode *file, struct uio *uio);
 	int (*vop_readlink)(struct vnode *link, struct uio *uio);
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
+	int (*vop_getdirentries)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
 	int (*vop_ioctl)(struct vnode *object, int op, userptr_t data);
 	int (*vop_stat)(struct vnode *object, struct stat *statbuf);
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	bool (*vop_isseekable)(struct vnode *object);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_fdatasync)(struct vnode *object);
+	int (*vop_mmap)(struct vnode *file);
 	int (*vop_truncate)(struct vnode *file, off_t len);
+	int (*vop_fallocate)(struct vnode *file, off_t pos, off_t len);
+	int (*vop_seekhole)(struct vnode *file, off_t pos, bool data,
+			    off_t *ret);
+	int (*vop_poll)(struct vnode *object, int events,
+			struct pollset *ps, int *revents);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
 
@@ -231,14 +277,19 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
+#define VOP_GETDIRENTRIES(vn, uio)      (__VOP(vn,getdirentries)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_FDATASYNC(vn)               (__VOP(vn, fdatasync)(vn))
+#define VOP_MMAP(vn)                    (__VOP(vn, mmap)(vn))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_FALLOCATE(vn, pos, len)     (__VOP(vn, fallocate)(vn, pos, len))
+#define VOP_SEEKHOLE(vn, pos, data, ret) (__VOP(vn, seekhole)(vn,pos,data,ret))
+#define VOP_POLL(vn, ev, ps, ret)       (__VOP(vn, poll)(vn, ev, ps, ret))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -257,11 +308,28 @@ struct vnode_ops {
  */
 void vnode_check(struct vnode *, const char *op);
 
+/*
+ * VOP_POLL for objects that are always ready, like regular files.
+ */
+int vnode_poll_ready(struct vnode *vn, int events, struct pollset *ps,
+		     int *revents);
+
 /*
  * Reference count manipulation (handled above filesystem level)
+ *
+ * The count is updated with atomic operations. Only dropping the
+ * last reference involves the file system: vnode_decref then hands
+ * that reference to VOP_RECLAIM instead of dropping it, and
+ * VOP_RECLAIM, holding whatever lock the file system uses to find
+ * vnodes (so nobody can pick this one up), calls vnode_lastref. That
+ * returns true if that reference is still the only one, so the
+ * vnode can be destroyed; otherwise someone got a reference in the
+ * meantime, and vnode_lastref drops ours and returns false, and
+ * VOP_RECLAIM should fail with EBUSY.
  */
 void vnode_incref(struct vnode *);
 void vnode_decref(struct vnode *);
+bool vnode_lastref(struct vnode *);
 
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
@@ -279,6 +347,13 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * Heap accounting tag (see kheaptag.h) for filesystem code to charge
+ * its vnodes to, with kmalloc_tagged and kfree_tagged.
+ */
+struct kheap_tag;
+extern struct kheap_tag vnode_heaptag;
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
@@ -286,10 +361,16 @@ int vopfail_uio_notdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_isdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_inval(struct vnode *vn, struct uio *uio);
 int vopfail_uio_nosys(struct vnode *vn, struct uio *uio);
-int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
-int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
-int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
+int vopfail_mmap_isdir(struct vnode *vn);
+int vopfail_mmap_perm(struct vnode *vn);
+int vopfail_mmap_nosys(struct vnode *vn);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
+int vopfail_fallocate_isdir(struct vnode *vn, off_t pos, off_t len);
+int vopfail_fallocate_nosys(struct vnode *vn, off_t pos, off_t len);
+int vopfail_seekhole_isdir(struct vnode *vn, off_t pos, bool data,
+			   off_t *ret);
+int vopfail_seekhole_nosys(struct vnode *vn, off_t pos, bool data,
+			   off_t *ret);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
 int vopfail_symlink_notdir(struct vnode *vn, const char *contents,
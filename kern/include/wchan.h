@@ -36,6 +36,8 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct timespec; /* in kern/time.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -50,6 +52,11 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Change the symbolic name of a wait channel, as for wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -66,15 +73,37 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Same as wchan_sleep, but give up and return ETIMEDOUT if not
+ * awakened within DELAY. Returns 0 if awakened.
+ */
+int wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk,
+			const struct timespec *delay);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL. That thread
+ * cannot get out of wchan_sleep until LK is released, so until then
+ * the caller may look at it or hand it something (see synch.c).
  */
-void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
+struct thread *wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Move one thread, or all threads, sleeping on FROM onto TO without
+ * waking them; they wake up when TO is woken, and then return from
+ * sleeping on FROM as usual. Both spinlocks must be locked, FROMLK
+ * first. Used by CVs to move waiters onto the lock (wait morphing).
+ */
+void wchan_morphone(struct wchan *from, struct spinlock *fromlk,
+		    struct wchan *to, struct spinlock *tolk);
+void wchan_morphall(struct wchan *from, struct spinlock *fromlk,
+		    struct wchan *to, struct spinlock *tolk);
+
 
 #endif /* _WCHAN_H_ */
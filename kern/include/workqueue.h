@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Workqueues: deferred work run by kernel threads.
+ *
+ * A workqueue has a small fixed pool of worker threads on each cpu,
+ * each bound to its cpu, and a queue of pending work per cpu. Work is
+ * queued on the cpu that queues it and run by that cpu's workers, so
+ * posting work takes one uncontended spinlock and the work runs where
+ * its data is likely to be cached. Delayed work sits on the timer
+ * wheel (see timeout.h) of the cpu that queued it and is queued there
+ * when the timeout goes off.
+ *
+ * Unlike a timeout callback, work runs in an ordinary thread and may
+ * sleep. Work on one cpu runs in the order queued, but with more than
+ * one worker per cpu, items may run concurrently.
+ *
+ * system_wq is a general-purpose workqueue for things that don't need
+ * their own; anything that might sleep for a long time should have a
+ * workqueue of its own so it doesn't hold up everyone else. Its
+ * workers are SCHED_REALTIME, as its work is mostly the second half
+ * of interrupt handling, so keep what goes on it short.
+ */
+
+#include <timeout.h>
+
+struct workqueue;	/* Opaque */
+struct wqcpu;		/* Private to workqueue.c */
+
+/* Most worker threads per cpu in a workqueue */
+#define WQ_MAXWORKERS	4
+
+/*
+ * One piece of work. As with struct timeout, the caller allocates it
+ * and sets it up with work_init. The fields are private to
+ * workqueue.c.
+ */
+struct work {
+	struct work *w_next;		/* Next on its queue */
+	struct wqcpu *w_queue;		/* Queue last put on */
+	struct workqueue *w_wq;		/* Workqueue last queued to */
+	volatile unsigned w_pending;	/* 1 if queued or delayed */
+	bool w_queued;			/* True if on w_queue's list */
+	unsigned w_seq;			/* Position in w_queue */
+	struct timeout w_timeout;	/* For delayed work */
+	void (*w_func)(void *);		/* Function to run */
+	void *w_arg;			/* Argument for it */
+};
+
+/*
+ * Functions.
+ *
+ * workqueue_bootstrap - create system_wq. Called from boot() once the
+ *                       other cpus are up.
+ *
+ * workqueue_create    - create a workqueue with NWORKERS threads per
+ *                       cpu, named NAME, in scheduling class
+ *                       SCHEDCLASS (see cpu.h). Returns NULL on
+ *                       failure.
+ *
+ * workqueue_destroy   - run everything queued on WQ, stop its
+ *                       threads, and free it. Delayed work must have
+ *                       been cancelled first.
+ *
+ * work_init           - set up W to call FUNC(ARG) when it runs.
+ *
+ * queue_work          - queue W on WQ to run soon. Returns false,
+ *                       doing nothing, if W is already pending.
+ *
+ * queue_delayed_work  - queue W on WQ after DELAY. Returns false,
+ *                       doing nothing, if W is already pending.
+ *
+ * cancel_work         - remove W if it's pending, whether delayed or
+ *                       queued. Returns true if it was removed before
+ *                       running. It doesn't wait for W if it's already
+ *                       running; use flush_workqueue for that.
+ *
+ * flush_workqueue     - wait until all work queued on WQ before the
+ *                       call has finished running. Delayed work whose
+ *                       delay hasn't run out isn't waited for. Must
+ *                       not be called from WQ's own work.
+ *
+ * queue_work, queue_delayed_work, and cancel_work may be called from
+ * interrupt handlers (including timeout callbacks) and with spinlocks
+ * held. W is no longer touched once its function is called, so the
+ * function may free it or queue it again.
+ */
+void workqueue_bootstrap(void);
+
+struct workqueue *workqueue_create(const char *name, unsigned nworkers,
+				   unsigned schedclass);
+void workqueue_destroy(struct workqueue *wq);
+
+void work_init(struct work *w, void (*func)(void *), void *arg);
+bool queue_work(struct workqueue *wq, struct work *w);
+bool queue_delayed_work(struct workqueue *wq, struct work *w,
+			const struct timespec *delay);
+bool cancel_work(struct work *w);
+void flush_workqueue(struct workqueue *wq);
+
+extern struct workqueue *system_wq;
+
+
+#endif /* _WORKQUEUE_H_ */
@@ -29,6 +29,13 @@
 
 /*
  * Fixed-size array of bits. (Intended for storage management.)
+ *
+ * Besides the bits themselves we keep a two-level summary: the number
+ * of clear bits in each chunk of CHUNK_BITS bits, and in each group
+ * of CHUNKS_PER_GROUP chunks. Searches skip full groups and full
+ * chunks using the summary, and look through the chunks that are left
+ * 32 bits at a time, so finding a clear bit in a large, nearly full
+ * bitmap doesn't mean looking at every byte.
  */
 
 #include <types.h>
@@ -41,34 +48,229 @@
  * or unsigned long as the base type for holding bits. But we don't,
  * because if one uses any data type more than a single byte wide,
  * bitmap data saved on disk becomes endian-dependent, which is a
- * severe nuisance.
+ * severe nuisance. (The searches assemble 32-bit words out of four
+ * bytes at a time instead, which doesn't care about byte order.)
  */
 #define BITS_PER_WORD   (CHAR_BIT)
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/* Summary sizes; a chunk is 8 32-bit search words. */
+#define CHUNK_BYTES             32
+#define CHUNK_BITS              (CHUNK_BYTES * BITS_PER_WORD)
+#define CHUNKS_PER_GROUP        64
+#define GROUP_BITS              (CHUNK_BITS * CHUNKS_PER_GROUP)
+#if GROUP_BITS != BITMAP_GROUPBITS
+#error "bitmap.h doesn't match"
+#endif
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned nchunks;
+        uint16_t *chunkfree;    /* clear bits per chunk */
+        unsigned *groupfree;    /* clear bits per group of chunks */
 };
 
+/*
+ * Get the 32 bits starting at bit 32*IX.
+ */
+static
+inline
+uint32_t
+bitmap_word32(struct bitmap *b, unsigned ix)
+{
+        const WORD_TYPE *p = &b->v[ix * 4];
+
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Index of the lowest set bit of X, which must not be 0.
+ */
+static
+unsigned
+bitmap_ctz32(uint32_t x)
+{
+        unsigned n = 0;
+
+        KASSERT(x != 0);
+        if ((x & 0xffff) == 0) {
+                n += 16;
+                x >>= 16;
+        }
+        if ((x & 0xff) == 0) {
+                n += 8;
+                x >>= 8;
+        }
+        if ((x & 0xf) == 0) {
+                n += 4;
+                x >>= 4;
+        }
+        if ((x & 0x3) == 0) {
+                n += 2;
+                x >>= 2;
+        }
+        if ((x & 0x1) == 0) {
+                n += 1;
+        }
+        return n;
+}
+
+/*
+ * Number of set bits in X.
+ */
+static
+unsigned
+bitmap_popcount32(uint32_t x)
+{
+        x = x - ((x >> 1) & 0x55555555);
+        x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+        x = (x + (x >> 4)) & 0x0f0f0f0f;
+        return (x * 0x01010101) >> 24;
+}
+
+/*
+ * Update the summary for a bit at INDEX becoming set (DELTA -1) or
+ * clear (DELTA 1).
+ */
+static
+inline
+void
+bitmap_count(struct bitmap *b, unsigned index, int delta)
+{
+        b->chunkfree[index / CHUNK_BITS] += delta;
+        b->groupfree[index / GROUP_BITS] += delta;
+}
+
+/*
+ * Find the first clear bit in [START, LIMIT). Returns false if there
+ * isn't one. LIMIT must be a multiple of GROUP_BITS or the end of the
+ * bitmap, so we only look at the summary for that range.
+ */
+static
+bool
+bitmap_findclear(struct bitmap *b, unsigned start, unsigned limit,
+                 unsigned *ret)
+{
+        unsigned ch, endch, wx, endwx;
+        uint32_t x;
+        bool partial;
+
+        KASSERT(limit == b->nbits || limit % GROUP_BITS == 0);
+        if (limit > b->nbits) {
+                limit = b->nbits;
+        }
+        if (start >= limit) {
+                return false;
+        }
+
+        ch = start / CHUNK_BITS;
+        endch = DIVROUNDUP(limit, CHUNK_BITS);
+        partial = true;
+        while (ch < endch) {
+                if (ch % CHUNKS_PER_GROUP == 0 && !partial &&
+                    b->groupfree[ch / CHUNKS_PER_GROUP] == 0) {
+                        ch += CHUNKS_PER_GROUP;
+                        continue;
+                }
+                if (b->chunkfree[ch] == 0) {
+                        ch++;
+                        partial = false;
+                        continue;
+                }
+
+                /* Something's clear in this chunk; look for it */
+                wx = partial ? start / 32 : ch * (CHUNK_BITS / 32);
+                endwx = (ch + 1) * (CHUNK_BITS / 32);
+                x = ~bitmap_word32(b, wx);
+                if (partial) {
+                        x &= ~(uint32_t)0 << (start % 32);
+                }
+                while (x == 0 && ++wx < endwx) {
+                        x = ~bitmap_word32(b, wx);
+                }
+                if (x != 0) {
+                        *ret = wx * 32 + bitmap_ctz32(x);
+                        KASSERT(*ret < b->nbits);
+                        return *ret < limit;
+                }
+                /* (only possible in a partial chunk) */
+                KASSERT(partial);
+                ch++;
+                partial = false;
+        }
+        return false;
+}
+
+/*
+ * Find the first set bit in [START, LIMIT); returns LIMIT if none.
+ */
+static
+unsigned
+bitmap_findset(struct bitmap *b, unsigned start, unsigned limit)
+{
+        unsigned wx, pos;
+        uint32_t x;
+
+        KASSERT(limit <= b->nchunks * CHUNK_BITS);
+
+        wx = start / 32;
+        x = bitmap_word32(b, wx) & (~(uint32_t)0 << (start % 32));
+        while (x == 0) {
+                wx++;
+                if (wx * 32 >= limit) {
+                        return limit;
+                }
+                if (wx % (CHUNK_BITS / 32) == 0 &&
+                    b->chunkfree[wx / (CHUNK_BITS / 32)] == CHUNK_BITS &&
+                    (wx + CHUNK_BITS / 32) * 32 <= limit) {
+                        /* whole chunk clear */
+                        wx += CHUNK_BITS / 32 - 1;
+                        continue;
+                }
+                x = bitmap_word32(b, wx);
+        }
+        pos = wx * 32 + bitmap_ctz32(x);
+        return pos < limit ? pos : limit;
+}
 
 struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b;
-        unsigned words;
+        unsigned words, allocwords, ngroups;
 
         words = DIVROUNDUP(nbits, BITS_PER_WORD);
         b = kmalloc(sizeof(struct bitmap));
         if (b == NULL) {
                 return NULL;
         }
-        b->v = kmalloc(words*sizeof(WORD_TYPE));
+
+        /* Round the storage up to whole chunks, for the searches */
+        b->nchunks = DIVROUNDUP(words, CHUNK_BYTES);
+        allocwords = b->nchunks * CHUNK_BYTES;
+        ngroups = DIVROUNDUP(b->nchunks, CHUNKS_PER_GROUP);
+
+        b->v = kmalloc(allocwords*sizeof(WORD_TYPE));
         if (b->v == NULL) {
                 kfree(b);
                 return NULL;
         }
+        b->chunkfree = kmalloc(b->nchunks*sizeof(uint16_t));
+        if (b->chunkfree == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
+        b->groupfree = kmalloc(ngroups*sizeof(unsigned));
+        if (b->groupfree == NULL) {
+                kfree(b->chunkfree);
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
@@ -85,7 +287,10 @@ bitmap_create(unsigned nbits)
                         b->v[ix] |= ((WORD_TYPE)1 << j);
                 }
         }
+        /* ...and the padding out to the end of the last chunk */
+        memset(b->v + words, WORD_ALLBITS, allocwords - words);
 
+        bitmap_rescan(b);
         return b;
 }
 
@@ -95,27 +300,63 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+void
+bitmap_rescan(struct bitmap *b)
+{
+        unsigned ch, g, i, n;
+
+        for (g=0; g<DIVROUNDUP(b->nchunks, CHUNKS_PER_GROUP); g++) {
+                b->groupfree[g] = 0;
+        }
+        for (ch=0; ch<b->nchunks; ch++) {
+                n = CHUNK_BITS;
+                for (i=0; i<CHUNK_BITS / 32; i++) {
+                        n -= bitmap_popcount32(
+                                bitmap_word32(b, ch * (CHUNK_BITS / 32) + i));
+                }
+                b->chunkfree[ch] = n;
+                b->groupfree[ch / CHUNKS_PER_GROUP] += n;
+        }
+}
+
 int
 bitmap_alloc(struct bitmap *b, unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        return bitmap_alloc_range(b, 0, b->nbits, index);
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned start, unsigned end,
+                   unsigned *index)
+{
+        if (!bitmap_findclear(b, start, end, index)) {
+                return ENOSPC;
+        }
+        bitmap_mark(b, *index);
+        return 0;
+}
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+int
+bitmap_alloc_run(struct bitmap *b, unsigned num, unsigned *index)
+{
+        unsigned start, end, i;
+
+        KASSERT(num > 0);
+
+        start = 0;
+        while (bitmap_findclear(b, start, b->nbits, &start)) {
+                if (start + num > b->nbits) {
+                        break;
+                }
+                end = bitmap_findset(b, start, start + num);
+                if (end == start + num) {
+                        for (i=start; i<end; i++) {
+                                bitmap_mark(b, i);
                         }
-                        KASSERT(0);
+                        *index = start;
+                        return 0;
                 }
+                start = end;
         }
         return ENOSPC;
 }
@@ -142,6 +383,7 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        bitmap_count(b, index, -1);
 }
 
 void
@@ -155,6 +397,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        bitmap_count(b, index, 1);
 }
 
 
@@ -171,6 +414,8 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->groupfree);
+        kfree(b->chunkfree);
         kfree(b->v);
         kfree(b);
 }
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Resizable hash table; see hashtable.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <hashtable.h>
+
+/*
+ * Bucket array sizes, per part. The largest is a page of pointers;
+ * past that, chains just get longer, rather than needing larger
+ * blocks of contiguous memory that may not be there.
+ */
+#define HT_MINSIZE	8
+#define HT_MAXSIZE	1024
+
+/*
+ * Grow when there are more than twice as many objects as buckets.
+ * Shrink, by half, when there are fewer than an eighth as many; that
+ * leaves it a quarter full, well away from growing again.
+ */
+#define HT_GROWLOAD	2
+#define HT_SHRINKLOAD	8
+
+/* Old buckets to move across on each add or remove */
+#define HT_MOVESTEP	2
+
+/*
+ * One part of a table. While it's resizing, hp_old is the previous
+ * bucket array; old buckets below hp_moved have been emptied into
+ * the new one and the rest haven't yet, so each object is in exactly
+ * one place, which ht_bucket works out.
+ */
+struct htpart {
+	struct lock *hp_lock;		/* NULL if the caller locks */
+	struct hashlink **hp_buckets;
+	unsigned hp_mask;		/* number of buckets - 1 */
+	struct hashlink **hp_old;	/* old buckets, or NULL */
+	unsigned hp_oldmask;
+	unsigned hp_moved;		/* old buckets already moved */
+	unsigned hp_count;		/* objects in this part */
+};
+
+struct hashtable {
+	unsigned ht_nparts;		/* a power of two */
+	unsigned ht_partshift;		/* log2(ht_nparts) */
+	struct htpart *ht_parts;
+};
+
+/*
+ * Scramble a caller's hash, so that keys that differ only in their
+ * high bits, or that are sequential, still spread over the buckets.
+ */
+static
+unsigned
+ht_mix(unsigned h)
+{
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+static
+struct htpart *
+ht_part(struct hashtable *ht, unsigned hash)
+{
+	struct htpart *hp;
+
+	hp = &ht->ht_parts[ht_mix(hash) & (ht->ht_nparts - 1)];
+	if (hp->hp_lock != NULL) {
+		KASSERT(lock_do_i_hold(hp->hp_lock));
+	}
+	return hp;
+}
+
+/*
+ * Return the bucket in part HP where objects with hash HASH go.
+ */
+static
+struct hashlink **
+ht_bucket(struct hashtable *ht, struct htpart *hp, unsigned hash)
+{
+	unsigned m;
+
+	m = ht_mix(hash) >> ht->ht_partshift;
+	if (hp->hp_old != NULL && (m & hp->hp_oldmask) >= hp->hp_moved) {
+		return &hp->hp_old[m & hp->hp_oldmask];
+	}
+	return &hp->hp_buckets[m & hp->hp_mask];
+}
+
+static
+struct hashlink **
+ht_allocbuckets(unsigned size)
+{
+	struct hashlink **buckets;
+	unsigned i;
+
+	buckets = kmalloc(size * sizeof(buckets[0]));
+	if (buckets == NULL) {
+		return NULL;
+	}
+	for (i=0; i<size; i++) {
+		buckets[i] = NULL;
+	}
+	return buckets;
+}
+
+/*
+ * Move up to NUM old buckets into the new array.
+ */
+static
+void
+ht_move(struct hashtable *ht, struct htpart *hp, unsigned num)
+{
+	struct hashlink *hl, *next, **bucket;
+
+	while (hp->hp_old != NULL && num-- > 0) {
+		hl = hp->hp_old[hp->hp_moved];
+		hp->hp_old[hp->hp_moved] = NULL;
+		for (; hl != NULL; hl = next) {
+			next = hl->hl_next;
+			bucket = &hp->hp_buckets[(ht_mix(hl->hl_hash) >>
+						  ht->ht_partshift) &
+						 hp->hp_mask];
+			hl->hl_next = *bucket;
+			*bucket = hl;
+		}
+		hp->hp_moved++;
+		if (hp->hp_moved > hp->hp_oldmask) {
+			kfree(hp->hp_old);
+			hp->hp_old = NULL;
+		}
+	}
+}
+
+/*
+ * Start moving part HP to a bucket array of SIZE buckets. If the last
+ * resize hasn't finished, finish it first; that's rare, because it
+ * takes many adds or removes to need another. If there's no memory,
+ * stay as we are.
+ */
+static
+void
+ht_resize(struct hashtable *ht, struct htpart *hp, unsigned size)
+{
+	struct hashlink **buckets;
+
+	ht_move(ht, hp, hp->hp_oldmask + 1);
+	KASSERT(hp->hp_old == NULL);
+
+	buckets = ht_allocbuckets(size);
+	if (buckets == NULL) {
+		return;
+	}
+	hp->hp_old = hp->hp_buckets;
+	hp->hp_oldmask = hp->hp_mask;
+	hp->hp_moved = 0;
+	hp->hp_buckets = buckets;
+	hp->hp_mask = size - 1;
+}
+
+struct hashtable *
+hashtable_create(const char *name, unsigned nlocks)
+{
+	struct hashtable *ht;
+	struct htpart *hp;
+	unsigned i;
+
+	KASSERT((nlocks & (nlocks - 1)) == 0);
+
+	ht = kmalloc(sizeof(*ht));
+	if (ht == NULL) {
+		return NULL;
+	}
+	ht->ht_nparts = nlocks > 0 ? nlocks : 1;
+	for (ht->ht_partshift = 0; (1U << ht->ht_partshift) < ht->ht_nparts;
+	     ht->ht_partshift++) {
+		/* nothing */
+	}
+	ht->ht_parts = kmalloc(ht->ht_nparts * sizeof(ht->ht_parts[0]));
+	if (ht->ht_parts == NULL) {
+		kfree(ht);
+		return NULL;
+	}
+
+	for (i=0; i<ht->ht_nparts; i++) {
+		hp = &ht->ht_parts[i];
+		hp->hp_lock = NULL;
+		hp->hp_old = NULL;
+		hp->hp_oldmask = 0;
+		hp->hp_moved = 0;
+		hp->hp_count = 0;
+		hp->hp_mask = HT_MINSIZE - 1;
+		hp->hp_buckets = ht_allocbuckets(HT_MINSIZE);
+		if (hp->hp_buckets == NULL) {
+			goto fail;
+		}
+		if (nlocks > 0) {
+			hp->hp_lock = lock_create(name);
+			if (hp->hp_lock == NULL) {
+				kfree(hp->hp_buckets);
+				goto fail;
+			}
+		}
+	}
+	return ht;
+
+ fail:
+	while (i-- > 0) {
+		hp = &ht->ht_parts[i];
+		if (hp->hp_lock != NULL) {
+			lock_destroy(hp->hp_lock);
+		}
+		kfree(hp->hp_buckets);
+	}
+	kfree(ht->ht_parts);
+	kfree(ht);
+	return NULL;
+}
+
+void
+hashtable_destroy(struct hashtable *ht)
+{
+	struct htpart *hp;
+	unsigned i;
+
+	for (i=0; i<ht->ht_nparts; i++) {
+		hp = &ht->ht_parts[i];
+		KASSERT(hp->hp_count == 0);
+		if (hp->hp_lock != NULL) {
+			lock_destroy(hp->hp_lock);
+		}
+		kfree(hp->hp_old);
+		kfree(hp->hp_buckets);
+	}
+	kfree(ht->ht_parts);
+	kfree(ht);
+}
+
+void
+hashtable_lock(struct hashtable *ht, unsigned hash)
+{
+	struct htpart *hp;
+
+	hp = &ht->ht_parts[ht_mix(hash) & (ht->ht_nparts - 1)];
+	KASSERT(hp->hp_lock != NULL);
+	lock_acquire(hp->hp_lock);
+}
+
+void
+hashtable_unlock(struct hashtable *ht, unsigned hash)
+{
+	struct htpart *hp;
+
+	hp = &ht->ht_parts[ht_mix(hash) & (ht->ht_nparts - 1)];
+	KASSERT(hp->hp_lock != NULL);
+	lock_release(hp->hp_lock);
+}
+
+void
+hashtable_add(struct hashtable *ht, struct hashlink *hl, unsigned hash)
+{
+	struct htpart *hp;
+	struct hashlink **bucket;
+	unsigned size;
+
+	hp = ht_part(ht, hash);
+	ht_move(ht, hp, HT_MOVESTEP);
+
+	hl->hl_hash = hash;
+	bucket = ht_bucket(ht, hp, hash);
+	hl->hl_next = *bucket;
+	*bucket = hl;
+	hp->hp_count++;
+
+	size = hp->hp_mask + 1;
+	if (hp->hp_count > size * HT_GROWLOAD && size < HT_MAXSIZE) {
+		ht_resize(ht, hp, size * 2);
+	}
+}
+
+void *
+hashtable_find(struct hashtable *ht, unsigned hash,
+	       hashtable_matchfn match, const void *key)
+{
+	struct htpart *hp;
+	struct hashlink *hl;
+
+	hp = ht_part(ht, hash);
+	for (hl = *ht_bucket(ht, hp, hash); hl != NULL; hl = hl->hl_next) {
+		if (hl->hl_hash == hash && match(hl->hl_obj, key)) {
+			return hl->hl_obj;
+		}
+	}
+	return NULL;
+}
+
+void
+hashtable_remove(struct hashtable *ht, struct hashlink *hl)
+{
+	struct htpart *hp;
+	struct hashlink **p;
+	unsigned size;
+
+	hp = ht_part(ht, hl->hl_hash);
+	for (p = ht_bucket(ht, hp, hl->hl_hash); *p != hl;
+	     p = &(*p)->hl_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = hl->hl_next;
+	hl->hl_next = NULL;
+	KASSERT(hp->hp_count > 0);
+	hp->hp_count--;
+
+	ht_move(ht, hp, HT_MOVESTEP);
+	size = hp->hp_mask + 1;
+	if (hp->hp_count < size / HT_SHRINKLOAD && size > HT_MINSIZE) {
+		ht_resize(ht, hp, size / 2);
+	}
+}
+
+unsigned
+hashtable_count(struct hashtable *ht)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<ht->ht_nparts; i++) {
+		count += ht->ht_parts[i].hp_count;
+	}
+	return count;
+}
+
+void
+hashlink_init(struct hashlink *hl, void *obj)
+{
+	hl->hl_next = NULL;
+	hl->hl_hash = 0;
+	hl->hl_obj = obj;
+}
+
+/*
+ * FNV-1a.
+ */
+unsigned
+hash_string(const char *s)
+{
+	unsigned h;
+
+	h = 2166136261U;
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619;
+	}
+	return h;
+}
@@ -36,6 +36,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
+#include <membar.h>
 #include <mainbus.h>
 #include <vfs.h>          // for vfs_sync()
 #include <lamebus/ltrace.h> // for ltrace_stop()
@@ -50,20 +52,101 @@ static struct lock *kprintf_lock;
 /* Lock for polled kprintfs */
 static struct spinlock kprintf_spinlock;
 
+/*
+ * The kernel log. Once kprintf_bootstrap has started the log thread,
+ * kprintf formats into this ring instead of going to the console,
+ * and the log thread sends it on from there. The ring is protected
+ * by klog_spinlock; klog_head and klog_tail count characters ever
+ * added and ever sent, so klog_head - klog_tail are waiting, and the
+ * log thread only moves klog_tail once its characters are out. When
+ * the ring is full, new output is dropped and counted in klog_lost.
+ *
+ * Code holding spinlocks still prints directly: it can't wake the log
+ * thread (that takes the run queue lock, which could be the very lock
+ * held) and so would leave its output stranded. Its output may thus
+ * come out ahead of buffered output. Once klog_sync is set, by panic
+ * or by kprintf_sync at shutdown, everything prints directly again.
+ */
+#define KLOG_SIZE	16384	/* a power of two */
+#define KLOG_CHUNK	256	/* most the log thread sends at once */
+
+static char klog_buf[KLOG_SIZE];
+static unsigned klog_head, klog_tail, klog_lost;
+static struct spinlock klog_spinlock;
+static struct wchan *klog_datawc;	/* log thread waits for output */
+static struct wchan *klog_flushwc;	/* kprintf_flush waits for it */
+static bool klog_running;
+static volatile bool klog_sync;
+
 
 /*
  * Warning: all this has to work from interrupt handlers and when
  * interrupts are disabled.
  */
 
+static void console_send(void *junk, const char *data, size_t len);
+
+/*
+ * The log thread: send whatever is in the ring to the console.
+ */
+static
+void
+klog_thread(void *junk1, unsigned long junk2)
+{
+	char chunk[KLOG_CHUNK];
+	char msg[64];
+	unsigned i, n, lost;
+
+	(void)junk1;
+	(void)junk2;
+
+	/* Drain the ring before it overflows. */
+	thread_setclass(SCHED_REALTIME);
+
+	spinlock_acquire(&klog_spinlock);
+	while (1) {
+		if (klog_sync ||
+		    (klog_head == klog_tail && klog_lost == 0)) {
+			wchan_wakeall(klog_flushwc, &klog_spinlock);
+			wchan_sleep(klog_datawc, &klog_spinlock);
+			continue;
+		}
+		n = klog_head - klog_tail;
+		if (n > KLOG_CHUNK) {
+			n = KLOG_CHUNK;
+		}
+		for (i=0; i<n; i++) {
+			chunk[i] = klog_buf[(klog_tail + i) % KLOG_SIZE];
+		}
+		lost = klog_lost;
+		klog_lost = 0;
+		spinlock_release(&klog_spinlock);
+
+		lock_acquire(kprintf_lock);
+		if (lost > 0) {
+			snprintf(msg, sizeof(msg),
+				 "[%u characters of kprintf output lost]\n",
+				 lost);
+			console_send(NULL, msg, strlen(msg));
+		}
+		console_send(NULL, chunk, n);
+		lock_release(kprintf_lock);
+
+		spinlock_acquire(&klog_spinlock);
+		klog_tail += n;
+		wchan_wakeall(klog_flushwc, &klog_spinlock);
+	}
+}
 
 /*
- * Create the kprintf lock. Must be called before creating a second
- * thread or enabling a second CPU.
+ * Create the kprintf lock and start the log thread. Must be called
+ * before creating a second thread or enabling a second CPU.
  */
 void
 kprintf_bootstrap(void)
 {
+	int result;
+
 	KASSERT(kprintf_lock == NULL);
 
 	kprintf_lock = lock_create("kprintf_lock");
@@ -71,6 +154,75 @@ kprintf_bootstrap(void)
 		panic("Could not create kprintf_lock\n");
 	}
 	spinlock_init(&kprintf_spinlock);
+
+	spinlock_init(&klog_spinlock);
+	klog_datawc = wchan_create("klog");
+	klog_flushwc = wchan_create("klogflush");
+	if (klog_datawc == NULL || klog_flushwc == NULL) {
+		panic("Could not create kernel log wchans\n");
+	}
+	result = thread_fork("klog", NULL, klog_thread, NULL, 0);
+	if (result) {
+		panic("Could not start kernel log thread: %s\n",
+		      strerror(result));
+	}
+	klog_running = true;
+}
+
+/*
+ * Wait until everything kprintf'd so far has reached the console.
+ * Does nothing where we can't sleep.
+ */
+void
+kprintf_flush(void)
+{
+	unsigned target;
+
+	if (!klog_running || curthread->t_in_interrupt ||
+	    curthread->t_curspl > 0 || curcpu->c_spinlocks > 0) {
+		return;
+	}
+
+	spinlock_acquire(&klog_spinlock);
+	target = klog_head;
+	while (!klog_sync && (int)(target - klog_tail) > 0) {
+		wchan_sleep(klog_flushwc, &klog_spinlock);
+	}
+	spinlock_release(&klog_spinlock);
+}
+
+/*
+ * Flush the log and go back to printing directly, for shutdown, when
+ * the log thread's cpu may stop.
+ */
+void
+kprintf_sync(void)
+{
+	kprintf_flush();
+	klog_sync = true;
+	membar_any_any();
+}
+
+/*
+ * Add characters to the log. Backend for __printf; called with
+ * klog_spinlock held.
+ */
+static
+void
+klog_send(void *junk, const char *data, size_t len)
+{
+	size_t i;
+
+	(void)junk;
+
+	for (i=0; i<len; i++) {
+		if (klog_head - klog_tail >= KLOG_SIZE) {
+			klog_lost += len - i;
+			break;
+		}
+		klog_buf[klog_head % KLOG_SIZE] = data[i];
+		klog_head++;
+	}
 }
 
 /*
@@ -99,6 +251,16 @@ kprintf(const char *fmt, ...)
 	va_list ap;
 	bool dolock;
 
+	if (klog_running && !klog_sync && curcpu->c_spinlocks == 0) {
+		spinlock_acquire(&klog_spinlock);
+		va_start(ap, fmt);
+		chars = __vprintf(klog_send, NULL, fmt, ap);
+		va_end(ap);
+		wchan_wakeone(klog_datawc, &klog_spinlock);
+		spinlock_release(&klog_spinlock);
+		return chars;
+	}
+
 	dolock = kprintf_lock != NULL
 		&& curthread->t_in_interrupt == false
 		&& curthread->t_curspl == 0
@@ -158,6 +320,9 @@ panic(const char *fmt, ...)
 		 * switches. So turn interrupts off on this CPU.
 		 */
 		splhigh();
+
+		/* ...and stop buffering it. */
+		klog_sync = true;
 	}
 
 	if (evil == 1) {
@@ -170,6 +335,21 @@ panic(const char *fmt, ...)
 	if (evil == 2) {
 		evil = 3;
 
+		/*
+		 * Print what was still in the log. The other cpus are
+		 * stopped, so nobody else is touching it; but one of
+		 * them may have stopped holding the lock, so don't
+		 * take it.
+		 */
+		while (klog_tail != klog_head) {
+			putch(klog_buf[klog_tail % KLOG_SIZE]);
+			klog_tail++;
+		}
+	}
+
+	if (evil == 3) {
+		evil = 4;
+
 		/* Print the message. */
 		kprintf("panic: ");
 		va_start(ap, fmt);
@@ -177,22 +357,22 @@ panic(const char *fmt, ...)
 		va_end(ap);
 	}
 
-	if (evil == 3) {
-		evil = 4;
+	if (evil == 4) {
+		evil = 5;
 
 		/* Drop to the debugger. */
 		ltrace_stop(0);
 	}
 
-	if (evil == 4) {
-		evil = 5;
+	if (evil == 5) {
+		evil = 6;
 
 		/* Try to sync the disks. */
 		vfs_sync();
 	}
 
-	if (evil == 5) {
-		evil = 6;
+	if (evil == 6) {
+		evil = 7;
 
 		/* Shut down or reboot the system. */
 		mainbus_panic();
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Lock-free ring; see ring.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <atomic.h>
+#include <membar.h>
+#include <ring.h>
+
+/*
+ * Cache line size to keep the two ends apart. The structure is
+ * kmalloc'd, and kmalloc aligns small blocks to their size, so
+ * rounding it up to a multiple of this is enough.
+ */
+#define RING_CACHELINE	64
+
+/*
+ * A slot is ready to be filled at position POS when its sequence
+ * number is POS, and ready to be emptied when it's POS + 1. Emptying
+ * it sets it to POS + size, for the next time around.
+ */
+struct ring_slot {
+	volatile unsigned rs_seq;
+	void *rs_item;
+};
+
+struct ring {
+	/* Consumer's cache line */
+	volatile unsigned r_head;	/* next position to take */
+	char r_pad0[RING_CACHELINE - sizeof(unsigned)];
+
+	/* Producers' cache line */
+	volatile unsigned r_tail;	/* next position to fill */
+	char r_pad1[RING_CACHELINE - sizeof(unsigned)];
+
+	/* Read-only after ring_create */
+	unsigned r_mask;		/* size - 1 */
+	struct ring_slot *r_slots;
+	char r_pad2[RING_CACHELINE - sizeof(unsigned) - sizeof(void *)];
+};
+
+struct ring *
+ring_create(unsigned size)
+{
+	struct ring *r;
+	unsigned i;
+
+	KASSERT(size > 0 && (size & (size - 1)) == 0);
+
+	r = kmalloc(sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->r_slots = kmalloc(size * sizeof(r->r_slots[0]));
+	if (r->r_slots == NULL) {
+		kfree(r);
+		return NULL;
+	}
+	for (i=0; i<size; i++) {
+		r->r_slots[i].rs_seq = i;
+		r->r_slots[i].rs_item = NULL;
+	}
+	r->r_head = 0;
+	r->r_tail = 0;
+	r->r_mask = size - 1;
+	membar_store_store();
+	return r;
+}
+
+void
+ring_destroy(struct ring *r)
+{
+	kfree(r->r_slots);
+	kfree(r);
+}
+
+/*
+ * Fill slot S at position POS, which belongs to this producer.
+ */
+static
+inline
+void
+ring_fill(struct ring_slot *s, unsigned pos, void *item)
+{
+	s->rs_item = item;
+	/* the item must be there before the consumer can see the slot */
+	membar_store_store();
+	s->rs_seq = pos + 1;
+}
+
+bool
+ring_put(struct ring *r, void *item)
+{
+	struct ring_slot *s;
+	unsigned pos;
+
+	pos = r->r_tail;
+	s = &r->r_slots[pos & r->r_mask];
+	if (s->rs_seq != pos) {
+		/* the consumer hasn't emptied it yet */
+		return false;
+	}
+	/* and don't overwrite the item until it has */
+	membar_any_store();
+	ring_fill(s, pos, item);
+	r->r_tail = pos + 1;
+	return true;
+}
+
+bool
+ring_put_mp(struct ring *r, void *item)
+{
+	struct ring_slot *s;
+	unsigned pos, prev;
+	int diff;
+
+	pos = r->r_tail;
+	while (1) {
+		s = &r->r_slots[pos & r->r_mask];
+		diff = (int)(s->rs_seq - pos);
+		if (diff < 0) {
+			/* not emptied since last time around: full */
+			return false;
+		}
+		if (diff > 0) {
+			/* someone else filled it; catch up */
+			pos = r->r_tail;
+			continue;
+		}
+		prev = atomic_cas(&r->r_tail, pos, pos + 1);
+		if (prev == pos) {
+			break;
+		}
+		pos = prev;
+	}
+	/* atomic_cas is a full barrier, so the seq check is done */
+	ring_fill(s, pos, item);
+	return true;
+}
+
+bool
+ring_get(struct ring *r, void **item)
+{
+	struct ring_slot *s;
+	unsigned pos;
+
+	pos = r->r_head;
+	s = &r->r_slots[pos & r->r_mask];
+	if (s->rs_seq != pos + 1) {
+		return false;
+	}
+	/* see the item the producer stored before the sequence number */
+	membar_load_load();
+	*item = s->rs_item;
+	/* finish reading it before handing the slot back */
+	membar_any_store();
+	s->rs_seq = pos + r->r_mask + 1;
+	r->r_head = pos + 1;
+	return true;
+}
+
+unsigned
+ring_count(struct ring *r)
+{
+	return r->r_tail - r->r_head;
+}
@@ -38,22 +38,20 @@
  * See uio.h for a description.
  */
 
-int
-uiomove(void *ptr, size_t n, struct uio *uio)
+/*
+ * Move up to N bytes between PTR and the kernel buffers of UIO, or
+ * if PTR is NULL, fill them with zeros. This is one memcpy (or
+ * memset) per buffer; the kernel never hands uiomove a uio whose
+ * buffers overlap PTR, so memmove's direction check isn't needed.
+ */
+static
+void
+uiomove_kernel(void *ptr, size_t n, struct uio *uio)
 {
 	struct iovec *iov;
 	size_t size;
-	int result;
 
-	if (uio->uio_rw != UIO_READ && uio->uio_rw != UIO_WRITE) {
-		panic("uiomove: Invalid uio_rw %d\n", (int) uio->uio_rw);
-	}
-	if (uio->uio_segflg==UIO_SYSSPACE) {
-		KASSERT(uio->uio_space == NULL);
-	}
-	else {
-		KASSERT(uio->uio_space == proc_getas());
-	}
+	KASSERT(uio->uio_space == NULL);
 
 	while (n > 0 && uio->uio_resid > 0) {
 		/* get the first iovec */
@@ -80,68 +78,72 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 			continue;
 		}
 
-		switch (uio->uio_segflg) {
-		    case UIO_SYSSPACE:
-			    if (uio->uio_rw == UIO_READ) {
-				    memmove(iov->iov_kbase, ptr, size);
-			    }
-			    else {
-				    memmove(ptr, iov->iov_kbase, size);
-			    }
-			    iov->iov_kbase = ((char *)iov->iov_kbase+size);
-			    break;
-		    case UIO_USERSPACE:
-		    case UIO_USERISPACE:
-			    if (uio->uio_rw == UIO_READ) {
-				    result = copyout(ptr, iov->iov_ubase,size);
-			    }
-			    else {
-				    result = copyin(iov->iov_ubase, ptr, size);
-			    }
-			    if (result) {
-				    return result;
-			    }
-			    iov->iov_ubase += size;
-			    break;
-		    default:
-			    panic("uiomove: Invalid uio_segflg %d\n",
-				  (int)uio->uio_segflg);
+		if (ptr == NULL) {
+			memset(iov->iov_kbase, 0, size);
+		}
+		else if (uio->uio_rw == UIO_READ) {
+			memcpy(iov->iov_kbase, ptr, size);
 		}
+		else {
+			memcpy(ptr, iov->iov_kbase, size);
+		}
+		iov->iov_kbase = ((char *)iov->iov_kbase+size);
 
 		iov->iov_len -= size;
 		uio->uio_resid -= size;
 		uio->uio_offset += size;
-		ptr = ((char *)ptr + size);
+		if (ptr != NULL) {
+			ptr = ((char *)ptr + size);
+		}
 		n -= size;
 	}
+}
 
-	return 0;
+int
+uiomove(void *ptr, size_t n, struct uio *uio)
+{
+	if (uio->uio_rw != UIO_READ && uio->uio_rw != UIO_WRITE) {
+		panic("uiomove: Invalid uio_rw %d\n", (int) uio->uio_rw);
+	}
+	KASSERT(ptr != NULL || n == 0);
+
+	switch (uio->uio_segflg) {
+	    case UIO_SYSSPACE:
+		uiomove_kernel(ptr, n, uio);
+		return 0;
+	    case UIO_USERSPACE:
+	    case UIO_USERISPACE:
+		/* copyuio does the whole transfer under one setjmp */
+		KASSERT(uio->uio_space == proc_getas());
+		return copyuio(ptr, n, uio);
+	    default:
+		panic("uiomove: Invalid uio_segflg %d\n",
+		      (int)uio->uio_segflg);
+	}
 }
 
+/*
+ * Zero fills, as for holes in sparse files and the bss, go straight
+ * to memset rather than copying from a buffer of zeros.
+ */
 int
 uiomovezeros(size_t n, struct uio *uio)
 {
-	/* static, so initialized as zero */
-	static char zeros[16];
-	size_t amt;
-	int result;
-
 	/* This only makes sense when reading */
 	KASSERT(uio->uio_rw == UIO_READ);
 
-	while (n > 0) {
-		amt = sizeof(zeros);
-		if (amt > n) {
-			amt = n;
-		}
-		result = uiomove(zeros, amt, uio);
-		if (result) {
-			return result;
-		}
-		n -= amt;
+	switch (uio->uio_segflg) {
+	    case UIO_SYSSPACE:
+		uiomove_kernel(NULL, n, uio);
+		return 0;
+	    case UIO_USERSPACE:
+	    case UIO_USERISPACE:
+		KASSERT(uio->uio_space == proc_getas());
+		return copyuiozeros(n, uio);
+	    default:
+		panic("uiomovezeros: Invalid uio_segflg %d\n",
+		      (int)uio->uio_segflg);
 	}
-
-	return 0;
 }
 
 /*
@@ -161,4 +163,6 @@ uio_kinit(struct iovec *iov, struct uio *u,
 	u->uio_segflg = UIO_SYSSPACE;
 	u->uio_rw = rw;
 	u->uio_space = NULL;
+	u->uio_direct = false;
+	u->uio_dsync = false;
 }
@@ -43,6 +43,8 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <futex.h>
+#include <workqueue.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -50,8 +52,15 @@
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
+#include <lockstat.h>
+#include <ktrace.h>
+#include <kprof.h>
+#include <swap.h>
+#include <net.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-dumbvm.h"
+#include "opt-net.h"
 
 
 /*
@@ -74,6 +83,66 @@ static const char harvard_copyright[] =
     "   President and Fellows of Harvard College.  All rights reserved.\n";
 
 
+/*
+ * Boot phase timing. boot_phase records when each phase of boot()
+ * ends and boot_report prints how long each took. There's no clock
+ * until the device probe attaches one, so the phases before it can't
+ * be told apart from it and it isn't timed; the others are.
+ */
+#define BOOT_MAXPHASES	16
+
+static struct {
+	const char *bp_name;
+	struct timespec bp_end;
+} bootphases[BOOT_MAXPHASES];
+static unsigned numbootphases;
+
+static
+void
+boot_phase(const char *name)
+{
+	if (!gettime_ready()) {
+		return;
+	}
+	KASSERT(numbootphases < BOOT_MAXPHASES);
+	bootphases[numbootphases].bp_name = name;
+	gettime(&bootphases[numbootphases].bp_end);
+	numbootphases++;
+}
+
+static
+void
+boot_report_one(const struct timespec *start, const struct timespec *end,
+		const char *name)
+{
+	struct timespec ts;
+	uint64_t usec;
+
+	timespec_sub(end, start, &ts);
+	usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	kprintf("%8llu.%03llu ms  %s\n", (unsigned long long)(usec / 1000),
+		(unsigned long long)(usec % 1000), name);
+}
+
+static
+void
+boot_report(void)
+{
+	unsigned i;
+
+	if (numbootphases < 2) {
+		return;
+	}
+	kprintf("Boot times, after %s:\n", bootphases[0].bp_name);
+	for (i=1; i<numbootphases; i++) {
+		boot_report_one(&bootphases[i-1].bp_end,
+				&bootphases[i].bp_end, bootphases[i].bp_name);
+	}
+	boot_report_one(&bootphases[0].bp_end,
+			&bootphases[numbootphases-1].bp_end, "total");
+	kprintf("\n");
+}
+
 /*
  * Initial boot sequence.
  */
@@ -109,10 +178,15 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
+	futex_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+#if OPT_NET
+	net_bootstrap();
+#endif
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -120,23 +194,57 @@ boot(void)
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+	boot_phase("early setup and device probe");
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKSTAT
+	/* The clock is attached now. */
+	lockstat_bootstrap();
+#endif
+#if OPT_KTRACE
+	ktrace_bootstrap();
+#endif
+#if OPT_KPROF
+	kprof_bootstrap();
+#endif
+	syscall_bootstrap();
 	kheap_nextgeneration();
+	boot_phase("pseudo-devices and statistics");
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	timepage_bootstrap();
 	kprintf_bootstrap();
+	boot_phase("VM system");
+
+	/*
+	 * The other cpus come up while we get on with the rest, which
+	 * doesn't care which cpus are running yet.
+	 */
 	thread_start_cpus();
+	workqueue_bootstrap();
+	boot_phase("cpu startup and workqueues");
 
 	/* Buffer cache */
 	buffer_bootstrap();
+	boot_phase("buffer cache");
+
+#if !OPT_DUMBVM
+	/* Swap and the pageout daemon */
+	swap_bootstrap();
+	boot_phase("swap");
+#endif
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
+	boot_phase("bootfs");
+
+	thread_wait_cpus();
+	boot_phase("waiting for cpus");
 
 	kheap_nextgeneration();
+	boot_report();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -159,6 +267,8 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+	/* The log thread's cpu is about to stop. */
+	kprintf_sync();
 	thread_shutdown();
 
 	splhigh();
@@ -31,14 +31,23 @@
 #include <kern/errno.h>
 #include <kern/reboot.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
+#include <synch.h>
 #include <proc.h>
 #include <vfs.h>
+#include <device.h>
 #include <buf.h>
+#include <diskstat.h>
+#include <schedstat.h>
+#include <lockstat.h>
+#include <ktrace.h>
+#include <kprof.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -92,7 +101,8 @@ cmd_progthread(void *ptr, unsigned long nargs)
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
-		return;
+		/* exit, so the menu's waitpid sees it */
+		proc__exit(_MKWAIT_EXIT(255));
 	}
 
 	/* NOTREACHED: runprogram only returns on error. */
@@ -101,27 +111,25 @@ cmd_progthread(void *ptr, unsigned long nargs)
 /*
  * Common code for cmd_prog and cmd_shell.
  *
- * Note that this does not wait for the subprogram to finish, but
- * returns immediately to the menu. This is usually not what you want,
- * so you should have it call your system-calls-assignment waitpid
- * code after forking.
- *
- * Also note that because the subprogram's thread uses the "args"
- * array and strings, until you do this a race condition exists
- * between that code and the menu input code.
+ * This waits for the subprogram to finish before returning to the
+ * menu, which also keeps the "args" array and strings, which the
+ * subprogram's thread uses, from being overwritten by the menu input
+ * code.
  */
 static
 int
 common_prog(int nargs, char **args)
 {
 	struct proc *proc;
-	int result;
+	pid_t pid;
+	int result, status;
 
 	/* Create a process for the new program to run in. */
 	proc = proc_create_runprogram(args[0] /* name */);
 	if (proc == NULL) {
 		return ENOMEM;
 	}
+	pid = proc->p_pid;
 
 	result = thread_fork(args[0] /* thread name */,
 			proc /* new process */,
@@ -133,10 +141,19 @@ common_prog(int nargs, char **args)
 		return result;
 	}
 
-	/*
-	 * The new process will be destroyed when the program exits...
-	 * once you write the code for handling that.
-	 */
+	/* The new process is destroyed when we collect it here. */
+	result = proc_waitpid(pid, 0, &pid, &status);
+	if (result) {
+		kprintf("waitpid failed: %s\n", strerror(result));
+		return result;
+	}
+	if (WIFSIGNALED(status)) {
+		kprintf("Program exited with signal %d\n", WTERMSIG(status));
+	}
+	else if (WEXITSTATUS(status) != 0) {
+		kprintf("Program exited with status %d\n",
+			WEXITSTATUS(status));
+	}
 
 	return 0;
 }
@@ -273,13 +290,17 @@ cmd_quit(int nargs, char **args)
  * Command for mounting a filesystem.
  */
 
-/* Table of mountable filesystem types. */
+/*
+ * Table of mountable filesystem types. AUXFUNC, if not NULL, mounts
+ * with a second device (for sfs, an external journal).
+ */
 static const struct {
 	const char *name;
 	int (*func)(const char *device);
+	int (*auxfunc)(const char *device, const char *auxdevice);
 } mounttable[] = {
 #if OPT_SFS
-	{ "sfs", sfs_mount },
+	{ "sfs", sfs_mount, sfs_mount_journal },
 #endif
 };
 
@@ -289,24 +310,37 @@ cmd_mount(int nargs, char **args)
 {
 	char *fstype;
 	char *device;
+	char *auxdevice;
 	unsigned i;
 
-	if (nargs != 3) {
-		kprintf("Usage: mount fstype device:\n");
+	if (nargs != 3 && nargs != 4) {
+		kprintf("Usage: mount fstype device: [journaldevice:]\n");
 		return EINVAL;
 	}
 
 	fstype = args[1];
 	device = args[2];
+	auxdevice = nargs == 4 ? args[3] : NULL;
 
 	/* Allow (but do not require) colon after device name */
 	if (device[strlen(device)-1]==':') {
 		device[strlen(device)-1] = 0;
 	}
+	if (auxdevice != NULL && auxdevice[strlen(auxdevice)-1]==':') {
+		auxdevice[strlen(auxdevice)-1] = 0;
+	}
 
 	for (i=0; i<ARRAYCOUNT(mounttable); i++) {
 		if (!strcmp(mounttable[i].name, fstype)) {
-			return mounttable[i].func(device);
+			if (auxdevice == NULL) {
+				return mounttable[i].func(device);
+			}
+			if (mounttable[i].auxfunc == NULL) {
+				kprintf("%s does not use a second device\n",
+					fstype);
+				return EINVAL;
+			}
+			return mounttable[i].auxfunc(device, auxdevice);
 		}
 	}
 	kprintf("Unknown filesystem type %s\n", fstype);
@@ -334,6 +368,65 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command for making a stripe set.
+ */
+static
+int
+cmd_stripe(int nargs, char **args)
+{
+	char *device;
+	int i, blocks;
+
+	if (nargs < 4) {
+		kprintf("Usage: stripe unitblocks device: device: "
+			"[device: ...]\n");
+		return EINVAL;
+	}
+
+	blocks = atoi(args[1]);
+	if (blocks <= 0) {
+		kprintf("stripe: invalid stripe unit %s\n", args[1]);
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device names */
+	for (i=2; i<nargs; i++) {
+		device = args[i];
+		if (device[strlen(device)-1]==':') {
+			device[strlen(device)-1] = 0;
+		}
+	}
+
+	return devstripe_create(blocks, &args[2], nargs - 2);
+}
+
+/*
+ * Command for making a mirror.
+ */
+static
+int
+cmd_mirror(int nargs, char **args)
+{
+	char *device;
+	int i;
+
+	if (nargs < 3) {
+		kprintf("Usage: mirror device: device: [device: ...]\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device names */
+	for (i=1; i<nargs; i++) {
+		device = args[i];
+		if (device[strlen(device)-1]==':') {
+			device[strlen(device)-1] = 0;
+		}
+	}
+
+	return devmirror_create(&args[1], nargs - 1);
+}
+
 /*
  * Command to set the "boot fs".
  *
@@ -404,6 +497,28 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for showing which subsystems are using the kernel heap.
+ */
+static
+int
+cmd_kheaptags(int nargs, char **args)
+{
+	int max = 10;
+
+	if (nargs == 2) {
+		max = atoi(args[1]);
+	}
+	if (nargs > 2 || max <= 0) {
+		kprintf("Usage: khtags [count]\n");
+		return EINVAL;
+	}
+
+	kheap_printtags(max);
+
+	return 0;
+}
+
 static
 int
 cmd_bufstats(int nargs, char **args)
@@ -411,6 +526,7 @@ cmd_bufstats(int nargs, char **args)
 	if (nargs == 1) {
 		(void)args;
 		buffer_printstats();
+		vfs_cache_printstats();
 	}
 	else {
 		kprintf("Usage: buf\n");
@@ -419,6 +535,194 @@ cmd_bufstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		diskstats_printall();
+	}
+	else {
+		kprintf("Usage: diskstat\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		schedstats_printall();
+	}
+	else {
+		kprintf("Usage: schedstat\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_sysstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		syscallstat_report();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		syscallstat_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		syscallstat_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		syscallstat_reset();
+	}
+	else {
+		kprintf("Usage: sysstat [on | off | reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_report();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else {
+		kprintf("Usage: lockstat [reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
+#if OPT_KTRACE
+static
+int
+cmd_ktrace(int nargs, char **args)
+{
+	if (nargs == 1) {
+		ktrace_dump();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		ktrace_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		ktrace_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		ktrace_reset();
+	}
+	else {
+		kprintf("Usage: ktrace [on | off | reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
+#if OPT_KPROF
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprof_report();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		kprof_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kprof_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kprof_reset();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "dump")) {
+		kprof_dump(-1);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "dump")) {
+		kprof_dump(atoi(args[2]));
+	}
+	else {
+		kprintf("Usage: kprof [on | off | reset | dump [cpu]]\n");
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_handoff(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		synch_handoff = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		synch_handoff = false;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: handoff [on | off]\n");
+		return EINVAL;
+	}
+
+	kprintf("Semaphore and lock handoff is %s\n",
+		synch_handoff ? "on" : "off");
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_jstats(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: jstat device:\n");
+		return EINVAL;
+	}
+
+	result = sfs_printjstats(args[1]);
+	if (result) {
+		kprintf("jstat: %s: %s\n", args[1], strerror(result));
+		return result;
+	}
+	return 0;
+}
+
+static
+int
+cmd_jmode(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: jmode device: [writeback|ordered|data]\n");
+		return EINVAL;
+	}
+
+	result = sfs_setjmode(args[1], nargs == 3 ? args[2] : NULL);
+	if (result) {
+		kprintf("jmode: %s: %s\n", args[1], strerror(result));
+		return result;
+	}
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -453,6 +757,8 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[stripe]  Make a stripe set         ",
+	"[mirror]  Make a mirror             ",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -478,14 +784,21 @@ static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[at2] Large array test              ",
 	"[bt]  Bitmap test                   ",
+	"[ht]  Hash table test               ",
+	"[rt]  Lock-free ring test           ",
 	"[tlt] Threadlist test               ",
+	"[str1] String function test         ",
+	"[str2] String function benchmark    ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc trace benchmark       ",
+	"[km6] kmalloc accounting test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[wq]  Workqueue test                ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -493,6 +806,11 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] Reader-writer lock test       ",
+	"[sy6] Timed wait test               ",
+	"[sy7] Lock contention benchmark     ",
+	"[sy8] RW lock contention benchmark  ",
+	"[sy9] Spinlock fairness benchmark   ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -500,6 +818,11 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS parallel overwrite         ",
+	"[fs8] FS path lookup benchmark      ",
+	"[fs9] FS I/O benchmark              ",
+	"[bc1] Buffer cache hit benchmark    ",
+	"[bench] Kernel microbenchmarks      ",
 	NULL
 };
 
@@ -524,7 +847,25 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khtags] Kernel heap by subsystem   ",
 	"[buf] Print buffer cache stats      ",
+	"[diskstat] Print disk I/O stats     ",
+	"[schedstat] Print scheduler stats   ",
+	"[sysstat] Print system call stats   ",
+	"[handoff] Set synch direct handoff  ",
+#if OPT_LOCKSTAT
+	"[lockstat] Print lock contention    ",
+#endif
+#if OPT_KTRACE
+	"[ktrace] Print kernel event trace   ",
+#endif
+#if OPT_KPROF
+	"[kprof] Print kernel profile        ",
+#endif
+#if OPT_SFS
+	"[jstat] Print sfs journal stats     ",
+	"[jmode] Set sfs journaling mode     ",
+#endif
 #if OPT_SYNCHPROBS
     "[sp1] Elves                         ",
     "[sp2] Air Balloon                   ",
@@ -564,6 +905,8 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "stripe",	cmd_stripe },
+	{ "mirror",	cmd_mirror },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -578,29 +921,59 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khtags",     cmd_kheaptags },
 	{ "buf",        cmd_bufstats },
+	{ "diskstat",   cmd_diskstats },
+	{ "schedstat",  cmd_schedstats },
+	{ "sysstat",    cmd_sysstat },
+	{ "handoff",    cmd_handoff },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstats },
+#endif
+#if OPT_KTRACE
+	{ "ktrace",     cmd_ktrace },
+#endif
+#if OPT_KPROF
+	{ "kprof",      cmd_kprof },
+#endif
+#if OPT_SFS
+	{ "jstat",      cmd_jstats },
+	{ "jmode",      cmd_jmode },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "at2",	arraytest2 },
 	{ "bt",		bitmaptest },
+	{ "ht",		hashtest },
+	{ "rt",		ringtest },
 	{ "tlt",	threadlisttest },
+	{ "str1",	strtest },
+	{ "str2",	strbench },
 	{ "km1",	kmalloctest },
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "wq",		wqtest },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	timedtest },
+	{ "sy7",	lockbench },
+	{ "sy8",	rwbench },
+	{ "sy9",	spinbench },
 #if OPT_SYNCHPROBS
     { "sp1",    elves },
     { "sp2",    airballoon },
@@ -637,6 +1010,11 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	overwritestress },
+	{ "fs8",	lookupbench },
+	{ "fs9",	fsbench },
+	{ "bc1",	bufhitbench },
+	{ "bench",	bench },
 
 	{ NULL, NULL }
 };
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Network buffers, interfaces, and datagram sockets; see net.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <net.h>
+
+/* Number of netbufs in the pool */
+#define NETBUF_POOLSIZE	32
+
+/* Datagrams a socket holds before dropping more */
+#define DGSOCK_QMAX	8
+
+/* Hash chains in the port table (a power of two) */
+#define DGSOCK_NBUCKETS	16
+
+/* Ports dgsock_open picks from when asked for port 0 */
+#define DGPORT_FIRST	49152
+#define DGPORT_LAST	65535
+
+/*
+ * Datagram header, after the link header. Big-endian on the wire,
+ * like everything else here.
+ */
+struct dgram_header {
+	uint16_t dh_srcport;
+	uint16_t dh_dstport;
+	uint16_t dh_len;		/* of the data, after this */
+	uint16_t dh_unused;
+};
+
+struct dgsock {
+	struct dgsock *ds_next;		/* in the port table */
+	uint16_t ds_port;
+	struct wchan *ds_wchan;		/* for dgsock_recvfrom */
+	struct netbuf *ds_qhead;	/* received datagrams */
+	struct netbuf *ds_qtail;
+	unsigned ds_qlen;
+};
+
+/* The pool */
+static struct spinlock netbuf_lock;
+static struct netbuf *netbuf_free;
+
+/* The interface; only one for now */
+static struct netif *net_theif;
+
+/*
+ * The port table, and the sockets' queues and wchans, are protected
+ * by dgsock_lock, which net_input takes at interrupt time.
+ */
+static struct spinlock dgsock_lock;
+static struct dgsock *dgsock_table[DGSOCK_NBUCKETS];
+static uint16_t dgsock_nextport = DGPORT_FIRST;
+
+void
+net_bootstrap(void)
+{
+	spinlock_init(&netbuf_lock);
+	spinlock_init(&dgsock_lock);
+}
+
+////////////////////////////////////////////////////////////
+// netbufs
+
+/*
+ * Fill the pool. Whatever can't be allocated just makes it smaller.
+ */
+static
+void
+netbuf_fillpool(void)
+{
+	struct netbuf *nb;
+	unsigned i;
+
+	for (i=0; i<NETBUF_POOLSIZE; i++) {
+		nb = kmalloc(sizeof(*nb));
+		if (nb == NULL) {
+			break;
+		}
+		nb->nb_data = kmalloc(NETBUF_SIZE);
+		if (nb->nb_data == NULL) {
+			kfree(nb);
+			break;
+		}
+		netbuf_put(nb);
+	}
+}
+
+/*
+ * Take a buffer from the pool, or NULL if it's empty.
+ */
+struct netbuf *
+netbuf_get(void)
+{
+	struct netbuf *nb;
+
+	spinlock_acquire(&netbuf_lock);
+	nb = netbuf_free;
+	if (nb != NULL) {
+		netbuf_free = nb->nb_next;
+	}
+	spinlock_release(&netbuf_lock);
+
+	if (nb != NULL) {
+		nb->nb_next = NULL;
+		nb->nb_off = 0;
+		nb->nb_len = 0;
+		nb->nb_addr = 0;
+	}
+	return nb;
+}
+
+void
+netbuf_put(struct netbuf *nb)
+{
+	spinlock_acquire(&netbuf_lock);
+	nb->nb_next = netbuf_free;
+	netbuf_free = nb;
+	spinlock_release(&netbuf_lock);
+}
+
+////////////////////////////////////////////////////////////
+// interfaces
+
+/*
+ * Called by a driver once its device is ready.
+ */
+int
+netif_attach(struct netif *nif)
+{
+	if (net_theif != NULL) {
+		kprintf("%s: Only one network interface is supported\n",
+			nif->if_name);
+		return EBUSY;
+	}
+	KASSERT(nif->if_hdrlen + sizeof(struct dgram_header) <= NET_HDRROOM);
+
+	netbuf_fillpool();
+	nif->if_ipackets = 0;
+	nif->if_ierrors = 0;
+	nif->if_iqdrops = 0;
+	nif->if_opackets = 0;
+	net_theif = nif;
+	kprintf("%s: address %u\n", nif->if_name, nif->if_addr);
+	return 0;
+}
+
+struct netif *
+net_getif(void)
+{
+	return net_theif;
+}
+
+static
+struct dgsock **
+dgsock_bucket(uint16_t port)
+{
+	return &dgsock_table[port & (DGSOCK_NBUCKETS - 1)];
+}
+
+/* Call with dgsock_lock held */
+static
+struct dgsock *
+dgsock_lookup(uint16_t port)
+{
+	struct dgsock *ds;
+
+	for (ds = *dgsock_bucket(port); ds != NULL; ds = ds->ds_next) {
+		if (ds->ds_port == port) {
+			return ds;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * A packet arrived on NIF, with the link header already stripped.
+ * Called from interrupt handlers; takes NB.
+ */
+void
+net_input(struct netif *nif, struct netbuf *nb)
+{
+	struct dgram_header dh;
+	struct dgsock *ds;
+
+	if (nb->nb_len < sizeof(dh)) {
+		nif->if_ierrors++;
+		netbuf_put(nb);
+		return;
+	}
+	memcpy(&dh, nb->nb_data + nb->nb_off, sizeof(dh));
+	if (dh.dh_len > nb->nb_len - sizeof(dh)) {
+		nif->if_ierrors++;
+		netbuf_put(nb);
+		return;
+	}
+	nif->if_ipackets++;
+
+	spinlock_acquire(&dgsock_lock);
+	ds = dgsock_lookup(dh.dh_dstport);
+	if (ds == NULL || ds->ds_qlen >= DGSOCK_QMAX) {
+		spinlock_release(&dgsock_lock);
+		nif->if_iqdrops++;
+		netbuf_put(nb);
+		return;
+	}
+	/* leave the header on; recvfrom wants the port from it */
+	nb->nb_next = NULL;
+	if (ds->ds_qtail == NULL) {
+		ds->ds_qhead = nb;
+	}
+	else {
+		ds->ds_qtail->nb_next = nb;
+	}
+	ds->ds_qtail = nb;
+	ds->ds_qlen++;
+	wchan_wakeone(ds->ds_wchan, &dgsock_lock);
+	spinlock_release(&dgsock_lock);
+}
+
+////////////////////////////////////////////////////////////
+// datagram sockets
+
+int
+dgsock_open(uint16_t port, struct dgsock **ret)
+{
+	struct dgsock *ds, **bucket;
+	unsigned tries;
+
+	ds = kmalloc(sizeof(*ds));
+	if (ds == NULL) {
+		return ENOMEM;
+	}
+	ds->ds_wchan = wchan_create("dgsock");
+	if (ds->ds_wchan == NULL) {
+		kfree(ds);
+		return ENOMEM;
+	}
+	ds->ds_qhead = ds->ds_qtail = NULL;
+	ds->ds_qlen = 0;
+
+	spinlock_acquire(&dgsock_lock);
+	if (port == 0) {
+		tries = DGPORT_LAST - DGPORT_FIRST + 1;
+		do {
+			port = dgsock_nextport;
+			dgsock_nextport = port == DGPORT_LAST ?
+				DGPORT_FIRST : port + 1;
+		} while (dgsock_lookup(port) != NULL && --tries > 0);
+		if (tries == 0) {
+			spinlock_release(&dgsock_lock);
+			wchan_destroy(ds->ds_wchan);
+			kfree(ds);
+			return EADDRNOTAVAIL;
+		}
+	}
+	else if (dgsock_lookup(port) != NULL) {
+		spinlock_release(&dgsock_lock);
+		wchan_destroy(ds->ds_wchan);
+		kfree(ds);
+		return EADDRINUSE;
+	}
+	ds->ds_port = port;
+	bucket = dgsock_bucket(port);
+	ds->ds_next = *bucket;
+	*bucket = ds;
+	spinlock_release(&dgsock_lock);
+
+	*ret = ds;
+	return 0;
+}
+
+/*
+ * Unbind and destroy DS, dropping anything still queued. Nobody may
+ * be waiting in dgsock_recvfrom.
+ */
+void
+dgsock_close(struct dgsock *ds)
+{
+	struct dgsock **pp;
+	struct netbuf *nb;
+
+	spinlock_acquire(&dgsock_lock);
+	for (pp = dgsock_bucket(ds->ds_port); *pp != ds;
+	     pp = &(*pp)->ds_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = ds->ds_next;
+	spinlock_release(&dgsock_lock);
+
+	while (ds->ds_qhead != NULL) {
+		nb = ds->ds_qhead;
+		ds->ds_qhead = nb->nb_next;
+		netbuf_put(nb);
+	}
+	wchan_destroy(ds->ds_wchan);
+	kfree(ds);
+}
+
+uint16_t
+dgsock_port(struct dgsock *ds)
+{
+	return ds->ds_port;
+}
+
+int
+dgsock_sendto(struct dgsock *ds, uint16_t addr, uint16_t port,
+	      const void *buf, size_t len)
+{
+	struct netif *nif;
+	struct netbuf *nb;
+	struct dgram_header dh;
+
+	nif = net_theif;
+	if (nif == NULL) {
+		return ENETDOWN;
+	}
+	if (len > DGRAM_MAX) {
+		return EMSGSIZE;
+	}
+	nb = netbuf_get();
+	if (nb == NULL) {
+		return EAGAIN;
+	}
+
+	dh.dh_srcport = ds->ds_port;
+	dh.dh_dstport = port;
+	dh.dh_len = len;
+	dh.dh_unused = 0;
+	nb->nb_off = NET_HDRROOM - sizeof(dh);
+	memcpy(nb->nb_data + nb->nb_off, &dh, sizeof(dh));
+	memcpy(nb->nb_data + NET_HDRROOM, buf, len);
+	nb->nb_len = sizeof(dh) + len;
+
+	nif->if_output(nif, nb, addr);
+	return 0;
+}
+
+int
+dgsock_recvfrom(struct dgsock *ds, void *buf, size_t len,
+		size_t *gotlen, uint16_t *addr, uint16_t *port,
+		const struct timespec *timeout)
+{
+	struct netbuf *nb;
+	struct dgram_header dh;
+	int result;
+
+	spinlock_acquire(&dgsock_lock);
+	while (ds->ds_qhead == NULL) {
+		if (timeout == NULL) {
+			wchan_sleep(ds->ds_wchan, &dgsock_lock);
+		}
+		else {
+			result = wchan_sleep_timeout(ds->ds_wchan,
+						     &dgsock_lock, timeout);
+			if (result && ds->ds_qhead == NULL) {
+				spinlock_release(&dgsock_lock);
+				return result;
+			}
+		}
+	}
+	nb = ds->ds_qhead;
+	ds->ds_qhead = nb->nb_next;
+	if (ds->ds_qhead == NULL) {
+		ds->ds_qtail = NULL;
+	}
+	ds->ds_qlen--;
+	spinlock_release(&dgsock_lock);
+
+	memcpy(&dh, nb->nb_data + nb->nb_off, sizeof(dh));
+	if (len > dh.dh_len) {
+		len = dh.dh_len;
+	}
+	memcpy(buf, nb->nb_data + nb->nb_off + sizeof(dh), len);
+	*gotlen = len;
+	if (addr != NULL) {
+		*addr = nb->nb_addr;
+	}
+	if (port != NULL) {
+		*port = dh.dh_srcport;
+	}
+	netbuf_put(nb);
+	return 0;
+}
@@ -44,7 +44,15 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kern/wait.h>
+#include <limits.h>
 #include <spl.h>
+#include <bitmap.h>
+#include <hashtable.h>
+#include <synch.h>
+#include <clock.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -56,6 +64,43 @@
  */
 struct proc *kproc;
 
+/*
+ * The process table. Every process but kproc gets a pid from a bitmap
+ * (the lowest free one) and goes in a hash table by pid, so waitpid
+ * can find it without looking at every process. Each process also
+ * keeps a list of its children, so exit and WAIT_ANY only look at
+ * those.
+ *
+ * A process that exits stays in the table, holding only its exit
+ * status, until its parent collects it with waitpid. One whose parent
+ * has already exited is destroyed as soon as it exits.
+ *
+ * All of this is protected by proc_tablelock; it's a sleep lock so
+ * waitpid can wait with it on the parent's p_waitcv, which its
+ * children signal when they exit.
+ */
+static struct lock *proc_tablelock;
+static struct bitmap *proc_pids;
+static struct hashtable *proc_hash;
+
+/*
+ * Add the usage FROM into TO.
+ */
+static
+void
+usage_add(struct usage *to, const struct usage *from)
+{
+	to->u_utime += from->u_utime;
+	to->u_stime += from->u_stime;
+	to->u_minflt += from->u_minflt;
+	to->u_majflt += from->u_majflt;
+	to->u_inblock += from->u_inblock;
+	to->u_oublock += from->u_oublock;
+	to->u_nvcsw += from->u_nvcsw;
+	to->u_nivcsw += from->u_nivcsw;
+	to->u_nsyscalls += from->u_nsyscalls;
+}
+
 /*
  * Create a proc structure.
  */
@@ -64,6 +109,7 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	unsigned i;
 
 	proc = kmalloc(sizeof(*proc));
 	if (proc == NULL) {
@@ -75,9 +121,36 @@ proc_create(const char *name)
 		return NULL;
 	}
 
+	proc->p_waitcv = cv_create(name);
+	if (proc->p_waitcv == NULL) {
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+
 	proc->p_numthreads = 0;
 	spinlock_init(&proc->p_lock);
 
+	/* Process table fields; no pid until proc_table_add */
+	proc->p_pid = 0;
+	hashlink_init(&proc->p_hashlink, proc);
+	proc->p_parent = NULL;
+	proc->p_children = NULL;
+	proc->p_sibnext = NULL;
+	proc->p_sibprev = NULL;
+	proc->p_exited = false;
+	proc->p_exitstatus = 0;
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_cusage, sizeof(proc->p_cusage));
+	proc->p_ioclass = IOPRIO_CLASS_BE;
+	for (i=0; i<__RLIMIT_NUM; i++) {
+		proc->p_rlimit[i].rlim_cur = RLIM_INFINITY;
+		proc->p_rlimit[i].rlim_max = RLIM_INFINITY;
+	}
+	proc->p_cpushare = 100;
+	proc->p_iocredit = 0;
+	proc->p_iotime = 0;
+
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -89,10 +162,103 @@ proc_create(const char *name)
 }
 
 /*
- * Destroy a proc structure.
- *
- * Note: nothing currently calls this. Your wait/exit code will
- * probably want to do so.
+ * Give PROC a pid and put it in the table as a child of PARENT.
+ */
+static
+int
+proc_table_add(struct proc *proc, struct proc *parent)
+{
+	unsigned pid;
+
+	lock_acquire(proc_tablelock);
+	if (bitmap_alloc(proc_pids, &pid)) {
+		lock_release(proc_tablelock);
+		return ENPROC;
+	}
+	proc->p_pid = pid;
+	hashtable_add(proc_hash, &proc->p_hashlink, pid);
+
+	proc->p_parent = parent;
+	proc->p_sibprev = NULL;
+	proc->p_sibnext = parent->p_children;
+	if (parent->p_children != NULL) {
+		parent->p_children->p_sibprev = proc;
+	}
+	parent->p_children = proc;
+	lock_release(proc_tablelock);
+
+	return 0;
+}
+
+/*
+ * Take PROC off its parent's list of children, leaving it an orphan.
+ * The table lock must be held.
+ */
+static
+void
+proc_unlink(struct proc *proc)
+{
+	KASSERT(lock_do_i_hold(proc_tablelock));
+
+	if (proc->p_sibprev != NULL) {
+		proc->p_sibprev->p_sibnext = proc->p_sibnext;
+	}
+	else if (proc->p_parent != NULL) {
+		KASSERT(proc->p_parent->p_children == proc);
+		proc->p_parent->p_children = proc->p_sibnext;
+	}
+	if (proc->p_sibnext != NULL) {
+		proc->p_sibnext->p_sibprev = proc->p_sibprev;
+	}
+	proc->p_parent = NULL;
+	proc->p_sibnext = NULL;
+	proc->p_sibprev = NULL;
+}
+
+/*
+ * Take PROC out of the table altogether and free its pid.
+ */
+static
+void
+proc_table_remove(struct proc *proc)
+{
+	lock_acquire(proc_tablelock);
+	KASSERT(proc->p_children == NULL);
+
+	hashtable_remove(proc_hash, &proc->p_hashlink);
+	proc_unlink(proc);
+	bitmap_unmark(proc_pids, proc->p_pid);
+	proc->p_pid = 0;
+	lock_release(proc_tablelock);
+}
+
+static
+bool
+proc_haspid(void *obj, const void *key)
+{
+	const struct proc *proc = obj;
+
+	return proc->p_pid == *(const pid_t *)key;
+}
+
+/*
+ * Find the process with pid PID. The table lock must be held.
+ */
+static
+struct proc *
+proc_lookup(pid_t pid)
+{
+	KASSERT(lock_do_i_hold(proc_tablelock));
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	return hashtable_find(proc_hash, pid, proc_haspid, &pid);
+}
+
+/*
+ * Destroy a proc structure: one that never ran, or one that has
+ * exited. Takes it out of the process table too.
  */
 void
 proc_destroy(struct proc *proc)
@@ -114,6 +280,10 @@ proc_destroy(struct proc *proc)
 	 * incorrect to destroy it.)
 	 */
 
+	if (proc->p_pid != 0) {
+		proc_table_remove(proc);
+	}
+
 	/* VFS fields */
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
@@ -174,6 +344,7 @@ proc_destroy(struct proc *proc)
 
 	KASSERT(proc->p_numthreads == 0);
 	spinlock_cleanup(&proc->p_lock);
+	cv_destroy(proc->p_waitcv);
 
 	kfree(proc->p_name);
 	kfree(proc);
@@ -185,6 +356,25 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	unsigned pid;
+
+	proc_tablelock = lock_create("proctable");
+	if (proc_tablelock == NULL) {
+		panic("proc_bootstrap: lock_create failed\n");
+	}
+	proc_pids = bitmap_create(PID_MAX + 1);
+	if (proc_pids == NULL) {
+		panic("proc_bootstrap: bitmap_create failed\n");
+	}
+	proc_hash = hashtable_create("proctable", 0);
+	if (proc_hash == NULL) {
+		panic("proc_bootstrap: hashtable_create failed\n");
+	}
+	/* pids below PID_MIN are never handed out */
+	for (pid = 0; pid < PID_MIN; pid++) {
+		bitmap_mark(proc_pids, pid);
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -195,7 +385,8 @@ proc_bootstrap(void)
  * Create a fresh proc for use by runprogram.
  *
  * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * process's (that is, the kernel menu's or the spawning process's)
+ * current directory. It is a child of the current process.
  */
 struct proc *
 proc_create_runprogram(const char *name)
@@ -223,34 +414,452 @@ proc_create_runprogram(const char *name)
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
+	newproc->p_ioclass = curproc->p_ioclass;
+	memcpy(newproc->p_rlimit, curproc->p_rlimit,
+	       sizeof(newproc->p_rlimit));
+	newproc->p_cpushare = curproc->p_cpushare;
 	spinlock_release(&curproc->p_lock);
 
+	if (proc_table_add(newproc, curproc)) {
+		proc_destroy(newproc);
+		return NULL;
+	}
+
 	return newproc;
 }
 
 /*
- * Make the current process exit.
+ * Create a copy of the current process for fork: a copy of its
+ * address space and file table, and its current directory. The new
+ * process is a child of the current one. It has no thread yet.
+ */
+int
+proc_fork(struct proc **ret)
+{
+	struct proc *newproc;
+	int result;
+
+	newproc = proc_create(curproc->p_name);
+	if (newproc == NULL) {
+		return ENOMEM;
+	}
+
+	/* VM fields */
+	result = as_copy(proc_getas(), &newproc->p_addrspace);
+	if (result) {
+		proc_destroy(newproc);
+		return result;
+	}
+
+	/* VFS fields */
+	result = filetable_copy(curproc->p_filetable, &newproc->p_filetable);
+	if (result) {
+		proc_destroy(newproc);
+		return result;
+	}
+	spinlock_acquire(&curproc->p_lock);
+	if (curproc->p_cwd != NULL) {
+		VOP_INCREF(curproc->p_cwd);
+		newproc->p_cwd = curproc->p_cwd;
+	}
+	newproc->p_ioclass = curproc->p_ioclass;
+	memcpy(newproc->p_rlimit, curproc->p_rlimit,
+	       sizeof(newproc->p_rlimit));
+	newproc->p_cpushare = curproc->p_cpushare;
+	spinlock_release(&curproc->p_lock);
+
+	result = proc_table_add(newproc, curproc);
+	if (result) {
+		proc_destroy(newproc);
+		return result;
+	}
+
+	*ret = newproc;
+	return 0;
+}
+
+/*
+ * Wait for the child PID of the current process (any child, if PID
+ * is WAIT_ANY) to exit, then destroy it; hand back its pid in RET and
+ * its wait status in STATUS. With WNOHANG, if no such child has
+ * exited yet, RET is 0 instead.
+ */
+int
+proc_waitpid(pid_t pid, int options, pid_t *ret, int *status)
+{
+	struct proc *proc = curproc;
+	struct proc *child;
+
+	if (options & ~WNOHANG) {
+		return EINVAL;
+	}
+
+	lock_acquire(proc_tablelock);
+	while (1) {
+		if (pid == WAIT_ANY) {
+			if (proc->p_children == NULL) {
+				lock_release(proc_tablelock);
+				return ECHILD;
+			}
+			for (child = proc->p_children; child != NULL;
+			     child = child->p_sibnext) {
+				if (child->p_exited) {
+					break;
+				}
+			}
+		}
+		else {
+			child = proc_lookup(pid);
+			if (child == NULL) {
+				lock_release(proc_tablelock);
+				return ESRCH;
+			}
+			if (child->p_parent != proc) {
+				lock_release(proc_tablelock);
+				return ECHILD;
+			}
+			if (!child->p_exited) {
+				child = NULL;
+			}
+		}
+		if (child != NULL) {
+			break;
+		}
+		if (options & WNOHANG) {
+			lock_release(proc_tablelock);
+			*ret = 0;
+			return 0;
+		}
+		cv_wait(proc->p_waitcv, proc_tablelock);
+	}
+	*ret = child->p_pid;
+	*status = child->p_exitstatus;
+	lock_release(proc_tablelock);
+
+	/* Its thread has left, so its usage is all in p_usage. */
+	spinlock_acquire(&proc->p_lock);
+	usage_add(&proc->p_cusage, &child->p_usage);
+	usage_add(&proc->p_cusage, &child->p_cusage);
+	spinlock_release(&proc->p_lock);
+
+	/* Nobody else can reap it: only we are its parent */
+	proc_destroy(child);
+	return 0;
+}
+
+/*
+ * Make the current process exit with wait status STATUS.
+ *
+ * Everything but the proc structure goes now. If the parent is still
+ * around, the structure stays in the table holding STATUS until the
+ * parent's waitpid collects it; otherwise it's destroyed here. Our
+ * children become orphans, and those that have already exited, which
+ * nobody can collect now, are destroyed.
  */
 void
 proc__exit(int status)
 {
        struct proc *proc = curproc;
+       struct proc *child, *zombies;
+       struct addrspace *as;
+       bool orphan;
 
        /* The kernel isn't supposed to exit. */
        KASSERT(proc != kproc);
 
-       kprintf("Proc exit status %d \n", status);
+       /* As in proc_destroy: unhook the address space, then drop it. */
+       as = proc_setas(NULL);
+       as_deactivate();
+       if (as != NULL) {
+               as_destroy(as);
+       }
+       if (proc->p_filetable != NULL) {
+               filetable_destroy(proc->p_filetable);
+               proc->p_filetable = NULL;
+       }
+       if (proc->p_cwd != NULL) {
+               VOP_DECREF(proc->p_cwd);
+               proc->p_cwd = NULL;
+       }
+
        /* Detach from the process and attach to the kernel process. */
        KASSERT(curthread->t_proc == proc);
        proc_remthread(curthread);
        proc_addthread(kproc, curthread);
 
-       /* Now we can destroy the process. */
-       proc_destroy(proc);
+       lock_acquire(proc_tablelock);
+
+       /* Orphan the children, collecting the dead ones on ZOMBIES. */
+       zombies = NULL;
+       while ((child = proc->p_children) != NULL) {
+               proc_unlink(child);
+               if (child->p_exited) {
+                       child->p_sibnext = zombies;
+                       zombies = child;
+               }
+       }
+
+       proc->p_exitstatus = status;
+       proc->p_exited = true;
+       orphan = (proc->p_parent == NULL);
+       if (!orphan) {
+               cv_broadcast(proc->p_parent->p_waitcv, proc_tablelock);
+       }
+       lock_release(proc_tablelock);
+
+       while (zombies != NULL) {
+               child = zombies;
+               zombies = child->p_sibnext;
+               child->p_sibnext = NULL;
+               proc_destroy(child);
+       }
+       if (orphan) {
+               proc_destroy(proc);
+       }
 
        thread_exit();
 }
 
+/*
+ * Collect the current process's resource usage in U: that of its
+ * threads, or with CHILDREN, that of the children it has waited for.
+ */
+void
+proc_getusage(bool children, struct usage *u)
+{
+	struct proc *proc = curproc;
+
+	if (!children) {
+		thread_charge();
+	}
+	spinlock_acquire(&proc->p_lock);
+	if (children) {
+		*u = proc->p_cusage;
+	}
+	else {
+		*u = proc->p_usage;
+		usage_add(u, &curthread->t_usage);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * I/O priority classes. The class is another process's business only
+ * while it's in the process table, so other processes are looked up
+ * with the table lock held.
+ */
+
+int
+proc_getioclass(pid_t pid, int *ret)
+{
+	struct proc *proc;
+
+	lock_acquire(proc_tablelock);
+	proc = pid == 0 ? curproc : proc_lookup(pid);
+	if (proc == NULL) {
+		lock_release(proc_tablelock);
+		return ESRCH;
+	}
+	spinlock_acquire(&proc->p_lock);
+	*ret = proc->p_ioclass;
+	spinlock_release(&proc->p_lock);
+	lock_release(proc_tablelock);
+	return 0;
+}
+
+int
+proc_setioclass(pid_t pid, int ioclass)
+{
+	struct proc *proc;
+
+	if (ioclass != IOPRIO_CLASS_RT && ioclass != IOPRIO_CLASS_BE &&
+	    ioclass != IOPRIO_CLASS_IDLE) {
+		return EINVAL;
+	}
+	lock_acquire(proc_tablelock);
+	proc = pid == 0 ? curproc : proc_lookup(pid);
+	if (proc == NULL) {
+		lock_release(proc_tablelock);
+		return ESRCH;
+	}
+	spinlock_acquire(&proc->p_lock);
+	proc->p_ioclass = ioclass;
+	spinlock_release(&proc->p_lock);
+	lock_release(proc_tablelock);
+	return 0;
+}
+
+/*
+ * This is called by disk drivers as transfers are queued, possibly
+ * with spinlocks held, so it doesn't lock; a stale class only
+ * matters for the one transfer.
+ */
+int
+proc_curioclass(void)
+{
+	if (curthread->t_in_interrupt || curproc == NULL) {
+		return IOPRIO_CLASS_BE;
+	}
+	return curproc->p_ioclass;
+}
+
+/*
+ * Resource limits. These are only set on the current process, so
+ * they can be read without the table lock.
+ *
+ * RLIMIT_IORATE is a token bucket: p_iocredit fills up at the rate,
+ * to at most one second's worth, and each disk transfer takes its
+ * size out of it. Transfers go ahead regardless (the driver can't
+ * wait) and the process sleeps off the debt on its way back to user
+ * mode, so it averages out to the rate.
+ */
+
+/* Rates above this are unlimited, which keeps the arithmetic in 64 bits. */
+#define IORATE_MAX	((rlim_t)1 << 32)
+
+static
+uint64_t
+proc_ionow(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Add the credit earned since p_iotime. Returns the rate, or 0 if
+ * there's no limit. Call with p_lock held.
+ */
+static
+rlim_t
+proc_iorefill(struct proc *proc, uint64_t now)
+{
+	rlim_t rate;
+	uint64_t secs, nsecs;
+
+	KASSERT(spinlock_do_i_hold(&proc->p_lock));
+
+	rate = proc->p_rlimit[RLIMIT_IORATE].rlim_cur;
+	if (rate > IORATE_MAX) {
+		return 0;
+	}
+	secs = (now - proc->p_iotime) / 1000000000;
+	nsecs = (now - proc->p_iotime) % 1000000000;
+	if (secs >= 1000000) {
+		/* Including the first time */
+		proc->p_iocredit = rate;
+	}
+	else {
+		proc->p_iocredit += rate * secs + rate * nsecs / 1000000000;
+		if (proc->p_iocredit > (int64_t)rate) {
+			proc->p_iocredit = rate;
+		}
+	}
+	proc->p_iotime = now;
+	return rate;
+}
+
+int
+proc_getrlimit(int resource, struct rlimit *rl)
+{
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+	spinlock_acquire(&curproc->p_lock);
+	*rl = curproc->p_rlimit[resource];
+	spinlock_release(&curproc->p_lock);
+	return 0;
+}
+
+int
+proc_setrlimit(int resource, const struct rlimit *rl)
+{
+	struct proc *proc = curproc;
+	uint64_t now;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM ||
+	    rl->rlim_cur > rl->rlim_max) {
+		return EINVAL;
+	}
+	if (resource == RLIMIT_IORATE && rl->rlim_cur == 0) {
+		/* Could never transfer anything */
+		return EINVAL;
+	}
+	now = proc_ionow();
+
+	spinlock_acquire(&proc->p_lock);
+	if (rl->rlim_max > proc->p_rlimit[resource].rlim_max) {
+		/* There are no privileges, so nobody may raise it. */
+		spinlock_release(&proc->p_lock);
+		return EPERM;
+	}
+	if (resource == RLIMIT_IORATE) {
+		/* Settle up at the old rate; keep any debt, not credit. */
+		proc_iorefill(proc, now);
+		if (proc->p_iocredit > 0) {
+			proc->p_iocredit = 0;
+		}
+	}
+	proc->p_rlimit[resource] = *rl;
+	if (resource == RLIMIT_CPUSHARE) {
+		proc->p_cpushare = rl->rlim_cur >= 100 ? 100 : rl->rlim_cur;
+	}
+	spinlock_release(&proc->p_lock);
+	return 0;
+}
+
+/*
+ * Like proc_curioclass, this is called by disk drivers, so it only
+ * takes p_lock. Transfers from interrupt handlers and kernel threads
+ * (the syncer's writeback, mostly) aren't charged to anyone.
+ */
+void
+proc_iocharge(size_t bytes)
+{
+	struct proc *proc = curproc;
+	uint64_t now;
+
+	if (curthread->t_in_interrupt || proc == NULL || proc == kproc) {
+		return;
+	}
+	now = proc_ionow();
+	spinlock_acquire(&proc->p_lock);
+	if (proc_iorefill(proc, now) > 0) {
+		proc->p_iocredit -= bytes;
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+void
+proc_iothrottle(void)
+{
+	struct proc *proc = curproc;
+	struct timespec ts;
+	uint64_t now, nsec;
+	rlim_t rate;
+
+	KASSERT(curthread->t_nlocks == 0);
+
+	/* Only we change it, so this doesn't need the lock. */
+	if (proc->p_rlimit[RLIMIT_IORATE].rlim_cur > IORATE_MAX) {
+		return;
+	}
+	now = proc_ionow();
+	spinlock_acquire(&proc->p_lock);
+	rate = proc_iorefill(proc, now);
+	if (rate == 0 || proc->p_iocredit >= 0) {
+		spinlock_release(&proc->p_lock);
+		return;
+	}
+	nsec = (uint64_t)-proc->p_iocredit * 1000000000 / rate;
+	spinlock_release(&proc->p_lock);
+
+	ts.tv_sec = nsec / 1000000000;
+	ts.tv_nsec = nsec % 1000000000;
+	clocknanosleep(&ts);
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -296,9 +905,15 @@ proc_remthread(struct thread *t)
 	proc = t->t_proc;
 	KASSERT(proc != NULL);
 
+	if (t == curthread) {
+		thread_charge();
+	}
+
 	spinlock_acquire(&proc->p_lock);
 	KASSERT(proc->p_numthreads > 0);
 	proc->p_numthreads--;
+	usage_add(&proc->p_usage, &t->t_usage);
+	bzero(&t->t_usage, sizeof(t->t_usage));
 	spinlock_release(&proc->p_lock);
 
 	spl = splhigh();
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Copying program arguments in for execv and __spawn, and out onto
+ * the new process's stack. See execargs.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <execargs.h>
+
+/* Most argv pointers copied in at once; never crosses a page, though */
+#define EXECARGS_CHUNK		64
+
+/* Most spare ARG_MAX buffers kept around */
+#define EXECARGS_POOLSIZE	4
+
+static struct spinlock execargs_poollock = SPINLOCK_INITIALIZER;
+static char *execargs_pool[EXECARGS_POOLSIZE];
+static unsigned execargs_npool;
+
+/*
+ * Get an ARG_MAX buffer, from the pool if there's one there.
+ */
+static
+char *
+execargs_alloc(void)
+{
+	char *buf = NULL;
+
+	spinlock_acquire(&execargs_poollock);
+	if (execargs_npool > 0) {
+		buf = execargs_pool[--execargs_npool];
+	}
+	spinlock_release(&execargs_poollock);
+
+	if (buf == NULL) {
+		buf = kmalloc(ARG_MAX);
+	}
+	return buf;
+}
+
+void
+execargs_free(struct execargs *ea)
+{
+	char *buf = ea->ea_buf;
+
+	if (buf == NULL) {
+		return;
+	}
+	ea->ea_buf = NULL;
+
+	spinlock_acquire(&execargs_poollock);
+	if (execargs_npool < EXECARGS_POOLSIZE) {
+		execargs_pool[execargs_npool++] = buf;
+		buf = NULL;
+	}
+	spinlock_release(&execargs_poollock);
+
+	kfree(buf);
+}
+
+/*
+ * Copy in the argv array itself, to the front of EA's buffer, up to
+ * and including the null pointer. Each copyin is at most a chunk and
+ * stops at the end of a user page: the page holding the null pointer
+ * is known to be there, but the one after it might not be.
+ */
+static
+int
+execargs_copyinptrs(const_userptr_t uargv, struct execargs *ea)
+{
+	userptr_t *argv = (userptr_t *)ea->ea_buf;
+	const unsigned max = ARG_MAX / sizeof(userptr_t);
+	vaddr_t uaddr;
+	unsigned n, i, num;
+	int result;
+
+	n = 0;
+	while (1) {
+		uaddr = (vaddr_t)uargv + n * sizeof(userptr_t);
+		num = (PAGE_SIZE - (uaddr % PAGE_SIZE)) / sizeof(userptr_t);
+		if (num == 0) {
+			/* misaligned pointer straddling pages */
+			num = 1;
+		}
+		if (num > EXECARGS_CHUNK) {
+			num = EXECARGS_CHUNK;
+		}
+		if (num > max - n) {
+			num = max - n;
+		}
+		if (num == 0) {
+			return E2BIG;
+		}
+
+		result = copyin((const_userptr_t)uaddr, &argv[n],
+				num * sizeof(userptr_t));
+		if (result) {
+			return result;
+		}
+		for (i = n; i < n + num; i++) {
+			if (argv[i] == NULL) {
+				ea->ea_argc = i;
+				return 0;
+			}
+		}
+		n += num;
+	}
+}
+
+int
+execargs_copyin(const_userptr_t uargv, struct execargs *ea)
+{
+	userptr_t *argv;
+	size_t len;
+	int i, result;
+
+	ea->ea_buf = execargs_alloc();
+	if (ea->ea_buf == NULL) {
+		return ENOMEM;
+	}
+	argv = (userptr_t *)ea->ea_buf;
+
+	result = execargs_copyinptrs(uargv, ea);
+	if (result) {
+		goto fail;
+	}
+
+	/*
+	 * Now the strings, packed right after the array. Each pointer
+	 * in the array is replaced by its string's offset in the
+	 * buffer, which becomes an address in execargs_copyout.
+	 */
+	ea->ea_len = (ea->ea_argc + 1) * sizeof(userptr_t);
+	for (i = 0; i < ea->ea_argc; i++) {
+		result = copyinstr(argv[i], ea->ea_buf + ea->ea_len,
+				   ARG_MAX - ea->ea_len, &len);
+		if (result == ENAMETOOLONG) {
+			result = E2BIG;
+		}
+		if (result) {
+			goto fail;
+		}
+		argv[i] = (userptr_t)ea->ea_len;
+		ea->ea_len += len;
+	}
+	return 0;
+
+ fail:
+	execargs_free(ea);
+	return result;
+}
+
+int
+execargs_copyout(struct execargs *ea, vaddr_t *stackptr, userptr_t *argv_ret)
+{
+	userptr_t *argv = (userptr_t *)ea->ea_buf;
+	vaddr_t base;
+	int i, result;
+
+	/* Keep the stack 8-byte aligned */
+	base = *stackptr - ROUNDUP(ea->ea_len, 8);
+
+	for (i = 0; i < ea->ea_argc; i++) {
+		argv[i] = (userptr_t)(base + (vaddr_t)argv[i]);
+	}
+
+	result = copyout(ea->ea_buf, (userptr_t)base, ea->ea_len);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = base;
+	*argv_ret = (userptr_t)base;
+	return 0;
+}
@@ -6,28 +6,36 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/limits.h>
+#include <kern/poll.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <fs.h>
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <poll.h>
+#include <clock.h>
 #include <openfile.h>
+#include <pipe.h>
 #include <filetable.h>
+#include <pathname.h>
 #include <syscall.h>
 
 /*
- * open() - get the path with copyinstr, then use openfile_open and
+ * open() - get the path with pathname_copyin, then use openfile_open and
  * filetable_place to do the real work.
  */
 int
 sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 {
-	const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_NOCTTY;
+	const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND |
+		O_NOCTTY | O_DIRECT | O_DSYNC;
 
 	char *kpath;
 	struct openfile *file;
@@ -36,131 +44,623 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
      // Validate flags
      if(flags < 0 || flags > allflags) { return EINVAL; }
 
-     if(upath == NULL) { return EINVAL; }
-
-     kpath  = (char *) kmalloc(sizeof(char)*PATH_MAX);
-     // copy over path to kernel, plus 1 to work around an issue with copyintostr
-     result = copyinstr(upath, kpath, strlen(((char *)upath)) + 1, NULL);
+     result = pathname_copyin(upath, &kpath);
      if(result) { return result; }
 
      /* open a file (args must be kernel pointers; destroys filename) */
      result = openfile_open(kpath, flags, mode, &file);
-     kfree(kpath);
+     pathname_free(kpath);
      if(result) { return result; }
 
      return filetable_place(curproc->p_filetable, file, retval);
 }
 
+/* Most bytes one read or write call can report transferring */
+#define FILE_RWMAX 0x7fffffff
+
 /*
- * read() - read data from a file
+ * Common code for all the read and write calls: transfer between the
+ * open file FD and the IOVCNT user buffers described by IOVS (which
+ * is in the kernel). If POSITIONAL, the transfer is at POS and the
+ * file's own offset is neither used nor locked; otherwise it's at
+ * the file's offset, which is advanced past it.
  */
+static
 int
-sys_read(int fd, userptr_t buf, size_t size, int *retval)
+file_rw(int fd, struct iovec *iovs, int iovcnt, enum uio_rw rw,
+        bool positional, off_t pos, int *retval)
 {
-     int result = 0;
      struct openfile *thefile;
      struct uio theuio;
-     struct iovec iov;
-     void *kbuf;     
-     
-     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     size_t total;
+     int i, result;
+
+     // the total has to fit in the return value
+     total = 0;
+     for (i = 0; i < iovcnt; i++) {
+          if (iovs[i].iov_len > FILE_RWMAX - total) { return EINVAL; }
+          total += iovs[i].iov_len;
+     }
 
-     // errors
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
      if(result) { return result; }
-     if (thefile->of_accmode == O_WRONLY) { return EBADF; }
 
-     // initialize the kernel buffer
-     kbuf = kmalloc(sizeof(*buf)*size);
-     if(kbuf == NULL) { return EINVAL; }
+     if ((rw == UIO_READ && thefile->of_accmode == O_WRONLY) ||
+         (rw == UIO_WRITE && thefile->of_accmode == O_RDONLY)) {
+          result = EBADF;
+          goto out;
+     }
+     if (positional) {
+          if (!VOP_ISSEEKABLE(thefile->of_vnode)) {
+               result = ESPIPE;
+               goto out;
+          }
+          if (pos < 0) {
+               result = EINVAL;
+               goto out;
+          }
+     }
 
-     lock_acquire(thefile->of_offsetlock);
-     int oldOffset = thefile->of_offset;
+     theuio.uio_iov = iovs;
+     theuio.uio_iovcnt = iovcnt;
+     theuio.uio_resid = total;
+     theuio.uio_segflg = UIO_USERSPACE;
+     theuio.uio_rw = rw;
+     theuio.uio_space = curproc->p_addrspace;
+     theuio.uio_direct = thefile->of_direct;
+     theuio.uio_dsync = thefile->of_dsync;
+
+     if (positional) {
+          theuio.uio_offset = pos;
+     }
+     else {
+          lock_acquire(thefile->of_offsetlock);
+          theuio.uio_offset = thefile->of_offset;
+     }
+
+     if (rw == UIO_READ) {
+          result = VOP_READ(thefile->of_vnode, &theuio);
+     }
+     else {
+          result = VOP_WRITE(thefile->of_vnode, &theuio);
+     }
+
+     if (!positional) {
+          if (!result) { thefile->of_offset = theuio.uio_offset; }
+          lock_release(thefile->of_offsetlock);
+     }
+
+     // number of bytes transferred
+     if (!result) { *retval = total - theuio.uio_resid; }
+
+ out:
+     filetable_put(curproc->p_filetable, fd, thefile);
+     return result;
+}
+
+/*
+ * Copy in the array of IOVCNT iovecs from user address UIOV, for
+ * readv and friends. The caller frees it.
+ */
+static
+int
+file_copyiniov(const_userptr_t uiov, int iovcnt, struct iovec **ret)
+{
+     struct iovec *iovs;
+     int result;
+
+     if (iovcnt <= 0 || iovcnt > IOV_MAX) { return EINVAL; }
+
+     iovs = kmalloc(iovcnt * sizeof(*iovs));
+     if (iovs == NULL) { return ENOMEM; }
+
+     result = copyin(uiov, iovs, iovcnt * sizeof(*iovs));
+     if (result) {
+          kfree(iovs);
+          return result;
+     }
+     *ret = iovs;
+     return 0;
+}
+
+/*
+ * read() - read data from a file
+ */
+int
+sys_read(int fd, userptr_t buf, size_t size, int *retval)
+{
+     struct iovec iov;
+
+     iov.iov_ubase = buf;
+     iov.iov_len = size;
+     return file_rw(fd, &iov, 1, UIO_READ, false, 0, retval);
+}
+
+/*
+ * write() - write data to a file
+ */
+int
+sys_write(int fd, userptr_t buf, size_t size, int *retval)
+{
+     struct iovec iov;
+
+     iov.iov_ubase = buf;
+     iov.iov_len = size;
+     return file_rw(fd, &iov, 1, UIO_WRITE, false, 0, retval);
+}
+
+/*
+ * pread() - read data from a file at a given offset, without using
+ * or changing the file's own offset. Since of_offsetlock isn't taken,
+ * threads or processes sharing the open file can do these at the
+ * same time.
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+     struct iovec iov;
 
-     iov.iov_ubase = (userptr_t)buf;
+     iov.iov_ubase = buf;
      iov.iov_len = size;
+     return file_rw(fd, &iov, 1, UIO_READ, true, pos, retval);
+}
+
+/*
+ * pwrite() - write data to a file at a given offset; as for pread.
+ */
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+     struct iovec iov;
+
+     iov.iov_ubase = buf;
+     iov.iov_len = size;
+     return file_rw(fd, &iov, 1, UIO_WRITE, true, pos, retval);
+}
+
+/*
+ * readv(), writev(), preadv(), pwritev() - scatter/gather versions
+ * of read and write. The whole batch is one VOP_READ or VOP_WRITE,
+ * and for the non-positional ones it's atomic with respect to the
+ * file offset.
+ */
+static
+int
+file_rwv(int fd, const_userptr_t uiov, int iovcnt, enum uio_rw rw,
+         bool positional, off_t pos, int *retval)
+{
+     struct iovec *iovs;
+     int result;
+
+     result = file_copyiniov(uiov, iovcnt, &iovs);
+     if (result) { return result; }
+
+     result = file_rw(fd, iovs, iovcnt, rw, positional, pos, retval);
+     kfree(iovs);
+     return result;
+}
+
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+     return file_rwv(fd, iov, iovcnt, UIO_READ, false, 0, retval);
+}
+
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+     return file_rwv(fd, iov, iovcnt, UIO_WRITE, false, 0, retval);
+}
+
+int
+sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+     return file_rwv(fd, iov, iovcnt, UIO_READ, true, pos, retval);
+}
+
+int
+sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+     return file_rwv(fd, iov, iovcnt, UIO_WRITE, true, pos, retval);
+}
+
+/*
+ * getdirentries() - list a directory, many entries at a time. The
+ * file offset is the file system's own position in the directory,
+ * as for getdirentry.
+ */
+int
+sys_getdirentries(int fd, userptr_t buf, size_t buflen, int *retval)
+{
+     struct openfile *thefile;
+     struct iovec iov;
+     struct uio theuio;
+     int result;
+
+     if (buflen > FILE_RWMAX) { buflen = FILE_RWMAX; }
+
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
+
+     if (thefile->of_accmode == O_WRONLY) {
+          filetable_put(curproc->p_filetable, fd, thefile);
+          return EBADF;
+     }
+
+     iov.iov_ubase = buf;
+     iov.iov_len = buflen;
      theuio.uio_iov = &iov;
      theuio.uio_iovcnt = 1;
-     theuio.uio_offset = thefile->of_offset;
-     theuio.uio_resid = size;
+     theuio.uio_resid = buflen;
      theuio.uio_segflg = UIO_USERSPACE;
      theuio.uio_rw = UIO_READ;
      theuio.uio_space = curproc->p_addrspace;
+     theuio.uio_direct = false;
+     theuio.uio_dsync = false;
+
+     lock_acquire(thefile->of_offsetlock);
+     theuio.uio_offset = thefile->of_offset;
+     result = VOP_GETDIRENTRIES(thefile->of_vnode, &theuio);
+     if (!result) { thefile->of_offset = theuio.uio_offset; }
+     lock_release(thefile->of_offsetlock);
+
+     if (!result) { *retval = buflen - theuio.uio_resid; }
 
-     result = VOP_READ(thefile->of_vnode, &theuio);
+     filetable_put(curproc->p_filetable, fd, thefile);
+     return result;
+}
 
-     if(result) 
+/*
+ * lseek() - move the file offset. SEEK_DATA and SEEK_HOLE ask the
+ * file system for the next data region or hole at or after POS.
+ */
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+     struct openfile *thefile;
+     struct stat st;
+     off_t newpos;
+     int result = 0;
+
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
+
+     if(!VOP_ISSEEKABLE(thefile->of_vnode))
      {
-          kfree(kbuf);
-          lock_release(thefile->of_offsetlock);
-          return result;
+          filetable_put(curproc->p_filetable, fd, thefile);
+          return ESPIPE;
      }
 
-     // number of bytes read
-     *retval = theuio.uio_offset - oldOffset;
+     lock_acquire(thefile->of_offsetlock);
 
-     thefile->of_offset = theuio.uio_offset;
+     switch(whence)
+     {
+          case SEEK_SET:
+               newpos = pos;
+               break;
+          case SEEK_CUR:
+               newpos = thefile->of_offset + pos;
+               break;
+          case SEEK_END:
+               result = VOP_STAT(thefile->of_vnode, &st);
+               newpos = st.st_size + pos;
+               break;
+          case SEEK_DATA:
+          case SEEK_HOLE:
+               if(pos < 0) { result = ENXIO; break; }
+               result = VOP_SEEKHOLE(thefile->of_vnode, pos,
+                                     whence == SEEK_DATA, &newpos);
+               break;
+          default:
+               result = EINVAL;
+               break;
+     }
+
+     if(result == 0 && newpos < 0) { result = EINVAL; }
+     if(result == 0)
+     {
+          thefile->of_offset = newpos;
+          *retval = newpos;
+     }
 
-     kfree(kbuf);
      lock_release(thefile->of_offsetlock);
+     filetable_put(curproc->p_filetable, fd, thefile);
+
+     return result;
+}
+
+/*
+ * fstat() - get the file's attributes with VOP_STAT.
+ */
+int
+sys_fstat(int fd, userptr_t statbuf)
+{
+     struct openfile *thefile;
+     struct stat st;
+     int result;
+
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
 
+     result = VOP_STAT(thefile->of_vnode, &st);
      filetable_put(curproc->p_filetable, fd, thefile);
+     if(result) { return result; }
+
+     return copyout(&st, statbuf, sizeof(st));
+}
+
+/*
+ * fsync() - write the file back with VOP_FSYNC.
+ */
+int
+sys_fsync(int fd)
+{
+     struct openfile *thefile;
+     int result;
+
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
 
+     result = VOP_FSYNC(thefile->of_vnode);
+     filetable_put(curproc->p_filetable, fd, thefile);
      return result;
 }
 
 /*
- * write() - write data to a file
+ * fdatasync() - write back just the file's data with VOP_FDATASYNC.
  */
 int
-sys_write(int fd, userptr_t buf, size_t size, int *retval)
+sys_fdatasync(int fd)
 {
-     int result = 0;
      struct openfile *thefile;
-     struct uio theuio;
-     struct iovec iov;
-     void *kbuf;     
-     
+     int result;
+
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
+
+     result = VOP_FDATASYNC(thefile->of_vnode);
+     filetable_put(curproc->p_filetable, fd, thefile);
+     return result;
+}
+
+/*
+ * fallocate() - allocate space for part of a file ahead of writing
+ * it, with VOP_FALLOCATE. Needs the file open for writing.
+ */
+int
+sys_fallocate(int fd, off_t offset, off_t len)
+{
+     struct openfile *thefile;
+     int result;
+
+     if (offset < 0 || len <= 0) {
+          return EINVAL;
+     }
+
      result = filetable_get(curproc->p_filetable, fd, &thefile);
      if(result) { return result; }
 
-     // initialize the kernel buffer
-     kbuf = kmalloc(sizeof(*buf)*size);
-     if(kbuf == NULL) { return EINVAL; }
+     if (thefile->of_accmode == O_RDONLY) {
+          filetable_put(curproc->p_filetable, fd, thefile);
+          return EBADF;
+     }
 
-     lock_acquire(thefile->of_offsetlock);
+     result = VOP_FALLOCATE(thefile->of_vnode, offset, len);
+     filetable_put(curproc->p_filetable, fd, thefile);
+     return result;
+}
 
-     int oldOffset = thefile->of_offset;
+/*
+ * ioctl() - hand the operation to the file with VOP_IOCTL. What the
+ * codes are and what DATA points to is up to the file system or
+ * device (see kern/ioctl.h).
+ */
+int
+sys_ioctl(int fd, int code, userptr_t data)
+{
+     struct openfile *thefile;
+     int result;
 
-     iov.iov_ubase = (userptr_t)buf;
-     iov.iov_len = size;
-     theuio.uio_iov = &iov;
-     theuio.uio_iovcnt = 1;
-     theuio.uio_offset = thefile->of_offset;
-     theuio.uio_resid = size;
-     theuio.uio_segflg = UIO_USERSPACE;
-     theuio.uio_rw = UIO_WRITE;
-     theuio.uio_space = curproc->p_addrspace;
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
+
+     result = VOP_IOCTL(thefile->of_vnode, code, data);
+     filetable_put(curproc->p_filetable, fd, thefile);
+     return result;
+}
 
-     result = VOP_WRITE(thefile->of_vnode, &theuio);
+/*
+ * semop() - P (count < 0) or V (count > 0) on a semfs semaphore
+ * without the uio and offset handling of read and write. P needs
+ * the file open for reading and V for writing, as with read/write.
+ */
+int
+sys_semop(int fd, int count)
+{
+     struct openfile *thefile;
+     int result;
 
-     if(result) 
-     {
-          kfree(kbuf);
-          lock_release(thefile->of_offsetlock);
+     result = filetable_get(curproc->p_filetable, fd, &thefile);
+     if(result) { return result; }
+
+     if ((count < 0 && thefile->of_accmode == O_WRONLY) ||
+         (count > 0 && thefile->of_accmode == O_RDONLY)) {
+          filetable_put(curproc->p_filetable, fd, thefile);
+          return EBADF;
+     }
+
+     result = semfs_semop(thefile->of_vnode, count);
+     filetable_put(curproc->p_filetable, fd, thefile);
+     return result;
+}
+
+/*
+ * pipe() - make a pipe and put its read and write ends in the file
+ * table, returning the two descriptors in FDS.
+ */
+int
+sys_pipe(userptr_t fds, int *retval)
+{
+     struct vnode *readvn, *writevn;
+     struct openfile *readfile, *writefile, *junk;
+     int kfds[2];
+     int result;
+
+     result = pipe_create(&readvn, &writevn);
+     if(result) { return result; }
+
+     result = openfile_fromvnode(readvn, O_RDONLY, &readfile);
+     if(result) {
+          VOP_DECREF(readvn);
+          VOP_DECREF(writevn);
+          return result;
+     }
+     result = openfile_fromvnode(writevn, O_WRONLY, &writefile);
+     if(result) {
+          openfile_decref(readfile);
+          VOP_DECREF(writevn);
           return result;
      }
 
-     // number of bytes written
-     *retval = theuio.uio_offset - oldOffset;
-     thefile->of_offset = theuio.uio_offset;
+     result = filetable_place(curproc->p_filetable, readfile, &kfds[0]);
+     if(result) {
+          openfile_decref(readfile);
+          openfile_decref(writefile);
+          return result;
+     }
+     result = filetable_place(curproc->p_filetable, writefile, &kfds[1]);
+     if(result) {
+          filetable_placeat(curproc->p_filetable, NULL, kfds[0], &junk);
+          openfile_decref(readfile);
+          openfile_decref(writefile);
+          return result;
+     }
 
-     kfree(kbuf);
-     lock_release(thefile->of_offsetlock);
+     result = copyout(kfds, fds, sizeof(kfds));
+     if(result) {
+          filetable_placeat(curproc->p_filetable, NULL, kfds[1], &junk);
+          filetable_placeat(curproc->p_filetable, NULL, kfds[0], &junk);
+          openfile_decref(writefile);
+          openfile_decref(readfile);
+          return result;
+     }
 
-     filetable_put(curproc->p_filetable, fd, thefile);
+     *retval = 0;
+     return 0;
+}
+
+/*
+ * poll() - wait for any of NFDS descriptors to be ready.
+ *
+ * Each vnode is looked up once, and referenced so it can't go away
+ * while the pollset is registered on it. The first pass registers;
+ * after a wakeup everything is looked at again (without registering)
+ * since there's no telling which one it was.
+ */
+int
+sys_poll(userptr_t ufds, unsigned nfds, int timeout, int *retval)
+{
+     struct pollfd *kfds;
+     struct vnode **vns;
+     struct openfile *thefile;
+     struct pollset ps;
+     struct timespec now, deadline, left;
+     unsigned i, nready;
+     int revents;
+     bool first;
+     int result;
+
+     if (nfds > OPEN_MAX) { return EINVAL; }
+
+     kfds = NULL;
+     vns = NULL;
+     if (nfds > 0) {
+          kfds = kmalloc(nfds * sizeof(kfds[0]));
+          vns = kmalloc(nfds * sizeof(vns[0]));
+          if (kfds == NULL || vns == NULL) {
+               result = ENOMEM;
+               goto out_free;
+          }
+          result = copyin(ufds, kfds, nfds * sizeof(kfds[0]));
+          if (result) { goto out_free; }
+     }
+
+     result = pollset_init(&ps, nfds);
+     if (result) { goto out_free; }
+
+     for (i=0; i<nfds; i++) {
+          vns[i] = NULL;
+          if (kfds[i].fd < 0) { continue; }
+          if (filetable_get(curproc->p_filetable, kfds[i].fd,
+                            &thefile) == 0) {
+               vns[i] = thefile->of_vnode;
+               VOP_INCREF(vns[i]);
+               filetable_put(curproc->p_filetable, kfds[i].fd, thefile);
+          }
+     }
+
+     if (timeout > 0) {
+          gettime(&now);
+          left.tv_sec = timeout / 1000;
+          left.tv_nsec = (timeout % 1000) * 1000000;
+          timespec_add(&now, &left, &deadline);
+     }
+
+     first = true;
+     while (1) {
+          pollset_reset(&ps);
+          nready = 0;
+          for (i=0; i<nfds; i++) {
+               revents = 0;
+               if (vns[i] != NULL) {
+                    if (VOP_POLL(vns[i], kfds[i].events,
+                                 first ? &ps : NULL, &revents)) {
+                         revents = POLLERR;
+                    }
+               }
+               else if (kfds[i].fd >= 0) {
+                    revents = POLLNVAL;
+               }
+               kfds[i].revents = revents;
+               if (revents != 0) { nready++; }
+          }
+          first = false;
+
+          if (nready > 0 || timeout == 0) { break; }
+
+          if (timeout < 0) {
+               pollset_wait(&ps, NULL);
+               continue;
+          }
+          gettime(&now);
+          if (now.tv_sec > deadline.tv_sec ||
+              (now.tv_sec == deadline.tv_sec &&
+               now.tv_nsec >= deadline.tv_nsec)) {
+               break;
+          }
+          timespec_sub(&deadline, &now, &left);
+          if (pollset_wait(&ps, &left) == ETIMEDOUT) {
+               /* look once more, without waiting */
+               timeout = 0;
+          }
+     }
+
+     pollset_cleanup(&ps);
+     for (i=0; i<nfds; i++) {
+          if (vns[i] != NULL) { VOP_DECREF(vns[i]); }
+     }
+
+     if (nfds > 0) {
+          result = copyout(kfds, ufds, nfds * sizeof(kfds[0]));
+     }
+     if (!result) { *retval = nready; }
 
+ out_free:
+     if (vns != NULL) { kfree(vns); }
+     if (kfds != NULL) { kfree(kfds); }
      return result;
 }
+
 /*
  * close() - remove from the file table.
  */
@@ -173,10 +673,16 @@ sys_close(int fd, int *retval)
      result = filetable_get(curproc->p_filetable, fd, &thefile);
      if(result) { return result;}
 
-     if(thefile->of_refcount == 1) 
-     {
-          filetable_placeat(curproc->p_filetable, NULL, fd, &thefile);
-     } 
+     filetable_put(curproc->p_filetable, fd, thefile);
+
+     /*
+      * Always empty the slot, even if the file is still open through
+      * other descriptors or processes (after fork); the reference
+      * that goes away is this slot's.
+      */
+     result = filetable_placeat(curproc->p_filetable, NULL, fd, &thefile);
+     // the slot exists, so this can't fail
+     KASSERT(result == 0);
 
      openfile_decref(thefile);
 
@@ -184,130 +690,313 @@ sys_close(int fd, int *retval)
      return 0;
 }
 
+/* Size of the kernel buffer copy_file_range moves data through */
+#define FILE_COPYCHUNK 4096
+
 /*
- * meld() 
+ * Move up to LEN bytes from INFILE at *INPOS to OUTFILE at *OUTPOS
+ * through a kernel buffer, advancing both positions past what was
+ * copied and handing back the count in DONE. Stops at EOF or after
+ * a short read on the input, or on a short write. An error after
+ * some data has moved isn't reported; the caller gets the short
+ * count instead, as with write.
  */
+static
 int
-sys_meld(const_userptr_t upath1, const_userptr_t upath2, const_userptr_t upathmerge, int *retval)
+file_copy(struct openfile *infile, off_t *inpos,
+          struct openfile *outfile, off_t *outpos,
+          size_t len, size_t *done)
 {
-     char *kpath1, *kpath2, *kpathmerge;
-     struct openfile *file1, *file2, *filemerge;
-     struct uio read1uio, read2uio, writeuio;
      struct iovec iov;
+     struct uio ku;
+     char *buf;
+     size_t chunk, got, put;
      int result = 0;
-     void *kbuf1,*kbuf2; 
 
-     // paths not null
-     if(upath1 == NULL || upath2 == NULL || upathmerge == NULL) { return EINVAL; }
+     buf = kmalloc(FILE_COPYCHUNK);
+     if (buf == NULL) { return ENOMEM; }
+
+     *done = 0;
+     while (*done < len) {
+          chunk = len - *done;
+          if (chunk > FILE_COPYCHUNK) { chunk = FILE_COPYCHUNK; }
+
+          uio_kinit(&iov, &ku, buf, chunk, *inpos, UIO_READ);
+          result = VOP_READ(infile->of_vnode, &ku);
+          if (result) { break; }
+          got = chunk - ku.uio_resid;
+          if (got == 0) { break; }
+
+          uio_kinit(&iov, &ku, buf, got, *outpos, UIO_WRITE);
+          result = VOP_WRITE(outfile->of_vnode, &ku);
+          put = got - ku.uio_resid;
+
+          // only what reached the output counts as read
+          *inpos += put;
+          *outpos += put;
+          *done += put;
+          // a short read is EOF for a file; for a device, don't wait
+          if (result || put < got || got < chunk) { break; }
+     }
 
-     // convert to kernel
-     kpath1 = (char *) kmalloc(sizeof(char) * PATH_MAX);
-     kpath2 = (char *) kmalloc(sizeof(char) * PATH_MAX);
-     kpathmerge = (char *) kmalloc(sizeof(char) * PATH_MAX);
+     kfree(buf);
+     return *done > 0 ? 0 : result;
+}
 
-     // copy over path to kernel
-     result = copyinstr(upath1, kpath1, strlen(((char *)upath1)) + 1, NULL);
-     if(result) { return result; }
+/*
+ * Check an open file for copy_file_range and get its position: from
+ * the user pointer UPOS if given (in which case the file has to be
+ * seekable), or from the file's own offset, whose lock is then held.
+ */
+static
+int
+file_copystart(struct openfile *file, userptr_t upos, off_t *pos)
+{
+     int result;
 
-     result = copyinstr(upath2, kpath2, strlen(((char *)upath2)) + 1, NULL);
-     if(result) { return result; }
+     if (upos == NULL) {
+          lock_acquire(file->of_offsetlock);
+          *pos = file->of_offset;
+          return 0;
+     }
 
-     result = copyinstr(upathmerge, kpathmerge, strlen(((char *)upathmerge)) + 1, NULL);
-     if(result) { return result; }
+     if (!VOP_ISSEEKABLE(file->of_vnode)) { return ESPIPE; }
+     result = copyin((const_userptr_t)upos, pos, sizeof(*pos));
+     if (result) { return result; }
+     if (*pos < 0) { return EINVAL; }
+     return 0;
+}
 
-     /* open the file (args must be kernel pointers; destroys filename) */
-     result = openfile_open(kpath1, O_RDONLY, 055, &file1);
-     if(result) { return result; }
+/*
+ * Undo file_copystart, storing back the position POS if the copy
+ * got anywhere (MOVED).
+ */
+static
+int
+file_copyfinish(struct openfile *file, userptr_t upos, off_t pos,
+                bool moved)
+{
+     if (upos == NULL) {
+          if (moved) { file->of_offset = pos; }
+          lock_release(file->of_offsetlock);
+          return 0;
+     }
+     return moved ? copyout(&pos, upos, sizeof(pos)) : 0;
+}
 
-     result = openfile_open(kpath2, O_RDONLY, 055, &file2);
-     if(result) { return result; }
+/*
+ * copy_file_range() - copy data from one open file to another inside
+ * the kernel, saving the trip through user memory that read and
+ * write would take. Each position comes from the user pointer if
+ * it's not NULL (and is updated there), and from the file's offset
+ * otherwise. No flags are defined yet.
+ *
+ * Copying within one open file through its shared offset makes no
+ * sense, and neither does copying a range of a file onto itself, so
+ * those fail with EINVAL. When both files use their own offsets,
+ * the offset locks are taken in address order so two processes
+ * copying in opposite directions between shared files can't
+ * deadlock.
+ */
+int
+sys_copy_file_range(int infd, userptr_t uinpos, int outfd, userptr_t uoutpos,
+                    size_t len, unsigned flags, int *retval)
+{
+     struct openfile *infile, *outfile, *first, *second;
+     userptr_t ufirst, usecond;
+     off_t inpos, outpos, *firstpos, *secondpos;
+     size_t done = 0;
+     int result, result2;
+
+     if (flags != 0) { return EINVAL; }
+     if (len > FILE_RWMAX) { len = FILE_RWMAX; }
 
-     result = openfile_open(kpathmerge, O_WRONLY|O_CREAT|O_EXCL, 0664, &filemerge);
+     result = filetable_get(curproc->p_filetable, infd, &infile);
      if(result) { return result; }
+     result = filetable_get(curproc->p_filetable, outfd, &outfile);
+     if(result) {
+          filetable_put(curproc->p_filetable, infd, infile);
+          return result;
+     }
 
-     kbuf1 = kmalloc(sizeof(char) * 4); // four bytes
-     kbuf2 = kmalloc(sizeof(char) * 4); // four bytes
+     if (infile->of_accmode == O_WRONLY || outfile->of_accmode == O_RDONLY) {
+          result = EBADF;
+          goto out;
+     }
+     if (infile == outfile && (uinpos == NULL || uoutpos == NULL)) {
+          result = EINVAL;
+          goto out;
+     }
 
-     // loop assistants
-     int file1LastOffset = 0, file2LastOffset = 0;
-     int loopcnt = 0, file1Read = -1, file2Read = -1;
+     if ((uintptr_t)infile <= (uintptr_t)outfile) {
+          first = infile; ufirst = uinpos; firstpos = &inpos;
+          second = outfile; usecond = uoutpos; secondpos = &outpos;
+     }
+     else {
+          first = outfile; ufirst = uoutpos; firstpos = &outpos;
+          second = infile; usecond = uinpos; secondpos = &inpos;
+     }
 
-     while(file1Read != 0 && file2Read != 0)
-     {
-         // read from file 1
-         lock_acquire(file1->of_offsetlock);
-
-         uio_kinit(&iov, &read1uio, kbuf1, 4, file1->of_offset, UIO_READ);
-         result = VOP_READ(file1->of_vnode, &read1uio);
-         file1Read = read1uio.uio_offset - file1LastOffset;
-         file1->of_offset = read1uio.uio_offset;
-         file1LastOffset = read1uio.uio_offset;
-
-         lock_release(file1->of_offsetlock);
-
-         // Read from file 2
-         lock_acquire(file2->of_offsetlock);
-
-         uio_kinit(&iov, &read2uio, kbuf2, 4, file2->of_offset, UIO_READ);
-         result = VOP_READ(file2->of_vnode, &read2uio); 
-         file2Read = read2uio.uio_offset - file2LastOffset;
-         file2->of_offset = read2uio.uio_offset;
-         file2LastOffset = file2->of_offset;
-
-         lock_release(file2->of_offsetlock);
-
-         if((file1Read > 0 && file1Read < 4) || (file2Read > 0 && file1Read == 0))
-         {
-               char * ptr = (char *)kbuf1;
-               int start = file1Read;
-               if(file1Read == 0) { start = 1; }
-               for(loopcnt = start - 1; loopcnt < 4; loopcnt ++)
-               {
-                    ptr[loopcnt] = ' ';
-               }
-         }
-
-         if((file2Read > 0 && file2Read < 4) || (file1Read > 0 && file2Read == 0))
-         {
-               char * ptr = (char *)kbuf2;
-               int start = file2Read;
-               if(file2Read == 0) { start = 1; }
-               for(loopcnt = start - 1; loopcnt < 4; loopcnt ++)
-               {
-                    ptr[loopcnt] = ' ';
-               }
-         }
-
-         if(file1Read != 0 || file2Read != 0)
-         {
-              // write the bytes to the new file
-              lock_acquire(filemerge->of_offsetlock);
-              uio_kinit(&iov, &writeuio, kbuf1, 4, filemerge->of_offset, UIO_WRITE);
-              result = VOP_WRITE(filemerge->of_vnode, &writeuio);
-              filemerge->of_offset = writeuio.uio_offset;
-              lock_release(filemerge->of_offsetlock);
-
-              // write to the new file
-              lock_acquire(filemerge->of_offsetlock);
-              uio_kinit(&iov, &writeuio, kbuf2, 4, filemerge->of_offset, UIO_WRITE);
-              result = VOP_WRITE(filemerge->of_vnode, &writeuio);
-              filemerge->of_offset = writeuio.uio_offset;
-              lock_release(filemerge->of_offsetlock);
-         }
-     }
-
-     // number of bytes written
-     *retval = filemerge->of_offset;
-
-     openfile_decref(file1);
-     openfile_decref(file2);
-     openfile_decref(filemerge);
-
-     kfree(kpath1);
-     kfree(kpath2);
-     kfree(kpathmerge);
-     kfree(kbuf1);
-     kfree(kbuf2);
+     result = file_copystart(first, ufirst, firstpos);
+     if (result) { goto out; }
+     result = file_copystart(second, usecond, secondpos);
+     if (result) {
+          file_copyfinish(first, ufirst, *firstpos, false);
+          goto out;
+     }
+
+     if (infile->of_vnode == outfile->of_vnode &&
+         inpos < outpos + (off_t)len && outpos < inpos + (off_t)len) {
+          result = EINVAL;
+     }
+     else {
+          result = file_copy(infile, &inpos, outfile, &outpos, len, &done);
+     }
 
+     result2 = file_copyfinish(second, usecond, *secondpos, done > 0);
+     if (!result) { result = result2; }
+     result2 = file_copyfinish(first, ufirst, *firstpos, done > 0);
+     if (!result) { result = result2; }
+
+     if (!result) { *retval = done; }
+
+ out:
+     filetable_put(curproc->p_filetable, outfd, outfile);
+     filetable_put(curproc->p_filetable, infd, infile);
+     return result;
+}
+
+/* Bytes meld takes from each source per pass; a multiple of 4 */
+#define MELD_CHUNK 2048
+
+/*
+ * Interleave the NA bytes in A with the NB bytes in B into OUT, four
+ * at a time, padding whichever runs short to four with spaces.
+ * Returns the number of bytes placed in OUT.
+ */
+static
+size_t
+meld_merge(const char *a, size_t na, const char *b, size_t nb, char *out)
+{
+     size_t pos, n, i;
+     char *p = out;
+
+     for (pos = 0; pos < na || pos < nb; pos += 4) {
+          n = pos < na ? na - pos : 0;
+          for (i = 0; i < 4; i++) { *p++ = i < n ? a[pos + i] : ' '; }
+          n = pos < nb ? nb - pos : 0;
+          for (i = 0; i < 4; i++) { *p++ = i < n ? b[pos + i] : ' '; }
+     }
+     return p - out;
+}
+
+/*
+ * Read up to MELD_CHUNK bytes from VN at *POS into BUF, advancing
+ * *POS; the count read goes in *GOT.
+ */
+static
+int
+meld_read(struct vnode *vn, off_t *pos, char *buf, size_t *got)
+{
+     struct iovec iov;
+     struct uio ku;
+     int result;
+
+     uio_kinit(&iov, &ku, buf, MELD_CHUNK, *pos, UIO_READ);
+     result = VOP_READ(vn, &ku);
+     if (result) { return result; }
+     *got = MELD_CHUNK - ku.uio_resid;
+     *pos = ku.uio_offset;
      return 0;
 }
+
+/*
+ * meld() - interleave two files four bytes at a time into a new
+ * third file, padding the shorter one with spaces, until both are
+ * used up. Returns the size of the new file.
+ *
+ * This works through the files in fixed-size pieces, so it uses the
+ * same small amount of memory however big they are. Reading each
+ * source straight through lets the file system's read-ahead fetch
+ * the next piece while this one is merged and written, and the
+ * writes go to the buffer cache to be written back behind us.
+ */
+int
+sys_meld(const_userptr_t upath1, const_userptr_t upath2, const_userptr_t upathmerge, int *retval)
+{
+     char *kpath1, *kpath2, *kpathmerge;
+     struct vnode *vn1, *vn2, *vnmerge;
+     char *buf1, *buf2, *outbuf;
+     off_t pos1 = 0, pos2 = 0, posmerge = 0;
+     size_t got1, got2, len;
+     struct iovec iov;
+     struct uio ku;
+     int result;
+
+     vn1 = vn2 = vnmerge = NULL;
+     buf1 = buf2 = outbuf = NULL;
+
+     // copy over paths to kernel
+     result = pathname_copyin(upath1, &kpath1);
+     if(result) { return result; }
+
+     result = pathname_copyin(upath2, &kpath2);
+     if(result) {
+          pathname_free(kpath1);
+          return result;
+     }
+
+     result = pathname_copyin(upathmerge, &kpathmerge);
+     if(result) {
+          pathname_free(kpath2);
+          pathname_free(kpath1);
+          return result;
+     }
+
+     /* open the files (vfs_open destroys the names) */
+     result = vfs_open(kpath1, O_RDONLY, 0, &vn1);
+     if(result) { goto out; }
+
+     result = vfs_open(kpath2, O_RDONLY, 0, &vn2);
+     if(result) { goto out; }
+
+     result = vfs_open(kpathmerge, O_WRONLY|O_CREAT|O_EXCL, 0664, &vnmerge);
+     if(result) { goto out; }
+
+     buf1 = kmalloc(MELD_CHUNK);
+     buf2 = kmalloc(MELD_CHUNK);
+     outbuf = kmalloc(2 * MELD_CHUNK);
+     if(buf1 == NULL || buf2 == NULL || outbuf == NULL) {
+          result = ENOMEM;
+          goto out;
+     }
+
+     while (1) {
+          result = meld_read(vn1, &pos1, buf1, &got1);
+          if(result) { goto out; }
+          result = meld_read(vn2, &pos2, buf2, &got2);
+          if(result) { goto out; }
+          if(got1 == 0 && got2 == 0) { break; }
+
+          len = meld_merge(buf1, got1, buf2, got2, outbuf);
+          uio_kinit(&iov, &ku, outbuf, len, posmerge, UIO_WRITE);
+          result = VOP_WRITE(vnmerge, &ku);
+          if(result) { goto out; }
+          posmerge = ku.uio_offset;
+     }
+
+     // size of the new file
+     *retval = posmerge;
+
+ out:
+     if(outbuf != NULL) { kfree(outbuf); }
+     if(buf2 != NULL) { kfree(buf2); }
+     if(buf1 != NULL) { kfree(buf1); }
+     if(vnmerge != NULL) { vfs_close(vnmerge); }
+     if(vn2 != NULL) { vfs_close(vn2); }
+     if(vn1 != NULL) { vfs_close(vn1); }
+     pathname_free(kpathmerge);
+     pathname_free(kpath2);
+     pathname_free(kpath1);
+     return result;
+}
@@ -39,47 +39,102 @@
 
 
 /*
- * Construct a filetable.
+ * Construct a filetable with SIZE slots.
  */
+static
 struct filetable *
-filetable_create(void)
+filetable_create_sized(unsigned size)
 {
 	struct filetable *ft;
-	int fd;
+	unsigned fd;
 
 	ft = kmalloc(sizeof(struct filetable));
 	if (ft == NULL) {
 		return NULL;
 	}
+	ft->ft_openfiles = kmalloc(size * sizeof(struct openfile *));
+	if (ft->ft_openfiles == NULL) {
+		kfree(ft);
+		return NULL;
+	}
+	ft->ft_size = size;
 
 	/* the table starts empty */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd < size; fd++) {
 		ft->ft_openfiles[fd] = NULL;
 	}
 
 	return ft;
 }
 
+/*
+ * Construct a filetable.
+ */
+struct filetable *
+filetable_create(void)
+{
+	return filetable_create_sized(FILETABLE_INITSIZE);
+}
+
 /*
  * Destroy a filetable.
  */
 void
 filetable_destroy(struct filetable *ft)
 {
-	int fd;
+	unsigned fd;
 
 	KASSERT(ft != NULL);
 
 	/* Close any open files. */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd < ft->ft_size; fd++) {
 		if (ft->ft_openfiles[fd] != NULL) {
 			openfile_decref(ft->ft_openfiles[fd]);
 			ft->ft_openfiles[fd] = NULL;
 		}
 	}
+	kfree(ft->ft_openfiles);
 	kfree(ft);
 }
 
+/*
+ * Grow a filetable so it has a slot FD, by doubling it as many times
+ * as that takes (but not past OPEN_MAX).
+ */
+static
+int
+filetable_grow(struct filetable *ft, int fd)
+{
+	struct openfile **newfiles;
+	unsigned newsize, i;
+
+	KASSERT(filetable_okfd(ft, fd));
+
+	newsize = ft->ft_size;
+	while (newsize <= (unsigned)fd) {
+		newsize *= 2;
+	}
+	if (newsize > OPEN_MAX) {
+		newsize = OPEN_MAX;
+	}
+
+	newfiles = kmalloc(newsize * sizeof(struct openfile *));
+	if (newfiles == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < ft->ft_size; i++) {
+		newfiles[i] = ft->ft_openfiles[i];
+	}
+	for (; i < newsize; i++) {
+		newfiles[i] = NULL;
+	}
+
+	kfree(ft->ft_openfiles);
+	ft->ft_openfiles = newfiles;
+	ft->ft_size = newsize;
+	return 0;
+}
+
 /*
  * Clone a filetable, for use in fork.
  *
@@ -100,7 +155,7 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 {
 	struct filetable *dest;
 	struct openfile *file;
-	int fd;
+	unsigned fd;
 
 	/* Copying the nonexistent table avoids special cases elsewhere */
 	if (src == NULL) {
@@ -108,13 +163,13 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 		return 0;
 	}
 
-	dest = filetable_create();
+	dest = filetable_create_sized(src->ft_size);
 	if (dest == NULL) {
 		return ENOMEM;
 	}
 
 	/* share the entries */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd < src->ft_size; fd++) {
 		file = src->ft_openfiles[fd];
 		if (file != NULL) {
 			openfile_incref(file);
@@ -132,7 +187,7 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 bool
 filetable_okfd(struct filetable *ft, int fd)
 {
-	/* We have a fixed-size table so we don't need to check the size */
+	/* The table can grow to OPEN_MAX, so that's the limit */
 	(void)ft;
 
 	return (fd >= 0 && fd < OPEN_MAX);
@@ -151,7 +206,7 @@ filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 {
 	struct openfile *file;
 
-	if (!filetable_okfd(ft, fd)) {
+	if (!filetable_okfd(ft, fd) || (unsigned)fd >= ft->ft_size) {
 		return EBADF;
 	}
 
@@ -200,17 +255,28 @@ filetable_put(struct filetable *ft, int fd, struct openfile *file)
 int
 filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
 {
-	int fd;
+	unsigned fd;
+	int result;
 
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd < ft->ft_size; fd++) {
 		if (ft->ft_openfiles[fd] == NULL) {
-			ft->ft_openfiles[fd] = file;
-			*fd_ret = fd;
-			return 0;
+			break;
+		}
+	}
+	if (fd == OPEN_MAX) {
+		return EMFILE;
+	}
+	if (fd == ft->ft_size) {
+		/* full; the first new slot is the one */
+		result = filetable_grow(ft, fd);
+		if (result) {
+			return result;
 		}
 	}
 
-	return EMFILE;
+	ft->ft_openfiles[fd] = file;
+	*fd_ret = fd;
+	return 0;
 }
 
 /*
@@ -221,17 +287,33 @@ filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
  * reference to the old openfile object (if not NULL); this should
  * generally be decref'd.
  *
- * Doesn't fail.
+ * Fails only if the table needs to grow to reach FD and there's no
+ * memory for it; then nothing is consumed or returned.
  *
  * Note that you can use this to place NULL in the filetable, which is
  * potentially handy.
  */
-void
+int
 filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		  struct openfile **oldfile_ret)
 {
+	int result;
+
 	KASSERT(filetable_okfd(ft, fd));
 
+	if ((unsigned)fd >= ft->ft_size) {
+		if (newfile == NULL) {
+			/* no need to make room for nothing */
+			*oldfile_ret = NULL;
+			return 0;
+		}
+		result = filetable_grow(ft, fd);
+		if (result) {
+			return result;
+		}
+	}
+
 	*oldfile_ret = ft->ft_openfiles[fd];
 	ft->ft_openfiles[fd] = newfile;
+	return 0;
 }
@@ -42,8 +42,10 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Before loading a segment we offer it to as_define_file, which with
+ * a demand-paged VM system maps it from the file instead, so pages are
+ * only read when the program touches them. Segments it refuses are
+ * loaded as usual.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -102,6 +104,8 @@ load_segment(struct addrspace *as, struct vnode *v,
 	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
 	u.uio_rw = UIO_READ;
 	u.uio_space = as;
+	u.uio_direct = false;
+	u.uio_dsync = false;
 
 	result = VOP_READ(v, &u);
 	if (result) {
@@ -288,6 +292,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		if (as_define_file(as, ph.p_vaddr, ph.p_memsz, v,
+				   ph.p_offset, ph.p_filesz) == 0) {
+			continue;
+		}
+
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
@@ -44,7 +44,7 @@
  */
 static
 struct openfile *
-openfile_create(struct vnode *vn, int accmode)
+openfile_create(struct vnode *vn, int accmode, bool direct, bool dsync)
 {
 	struct openfile *file;
 
@@ -68,6 +68,8 @@ openfile_create(struct vnode *vn, int accmode)
 
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
+	file->of_direct = direct;
+	file->of_dsync = dsync;
 	file->of_offset = 0;
 	file->of_refcount = 1;
 
@@ -106,7 +108,9 @@ openfile_open(char *filename, int openflags, mode_t mode,
 		return result;
 	}
 
-	file = openfile_create(vn, openflags & O_ACCMODE);
+	file = openfile_create(vn, openflags & O_ACCMODE,
+			       (openflags & O_DIRECT) != 0,
+			       (openflags & O_DSYNC) != 0);
 	if (file == NULL) {
 		vfs_close(vn);
 		return ENOMEM;
@@ -116,6 +120,25 @@ openfile_open(char *filename, int openflags, mode_t mode,
 	return 0;
 }
 
+/*
+ * Wrap an already-referenced vnode that didn't come from vfs_open
+ * (e.g. a pipe end) in an openfile object. On success the openfile
+ * takes over the caller's reference.
+ */
+int
+openfile_fromvnode(struct vnode *vn, int accmode, struct openfile **ret)
+{
+	struct openfile *file;
+
+	file = openfile_create(vn, accmode, false, false);
+	if (file == NULL) {
+		return ENOMEM;
+	}
+
+	*ret = file;
+	return 0;
+}
+
 /*
  * Increment the reference count on an openfile.
  */
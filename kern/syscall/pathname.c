@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Copying in pathnames from user programs.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <copyinout.h>
+#include <pathname.h>
+
+/*
+ * Get a PATH_MAX buffer: the current thread's spare one if it has
+ * it, or a new one. Only the thread itself touches its spare, so
+ * no locking is needed.
+ */
+static
+char *
+pathname_alloc(void)
+{
+	char *buf;
+
+	buf = curthread->t_pathbuf;
+	if (buf != NULL) {
+		curthread->t_pathbuf = NULL;
+		return buf;
+	}
+	return kmalloc(PATH_MAX);
+}
+
+/*
+ * Give back a buffer: it becomes the thread's spare if there isn't
+ * one already.
+ */
+void
+pathname_free(char *path)
+{
+	if (curthread->t_pathbuf == NULL) {
+		curthread->t_pathbuf = path;
+	}
+	else {
+		kfree(path);
+	}
+}
+
+/*
+ * Copy in and check a pathname.
+ */
+int
+pathname_copyin(const_userptr_t upath, char **ret)
+{
+	char *path;
+	int result;
+
+	path = pathname_alloc();
+	if (path == NULL) {
+		return ENOMEM;
+	}
+
+	result = copyinstr(upath, path, PATH_MAX, NULL);
+	if (result == 0 && path[0] == '\0') {
+		result = ENOENT;
+	}
+	if (result) {
+		pathname_free(path);
+		return result;
+	}
+
+	*ret = path;
+	return 0;
+}
+
+/*
+ * Free a thread's spare buffer.
+ */
+void
+pathname_threadcleanup(struct thread *t)
+{
+	if (t->t_pathbuf != NULL) {
+		kfree(t->t_pathbuf);
+		t->t_pathbuf = NULL;
+	}
+}
@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Process system calls: fork, execv, waitpid, getpid, ioprio_get,
+ * ioprio_set, getrlimit, setrlimit, and __spawn, which posix_spawn()
+ * is built on. The
+ * process table itself is in proc.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/spawn.h>
+#include <kern/wait.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <machine/trapframe.h>
+#include <copyinout.h>
+#include <pathname.h>
+#include <execargs.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+/*
+ * The new process's thread for fork: TF is a copy of the parent's
+ * trapframe, which enter_forked_process frees.
+ */
+static
+void
+fork_thread(void *tf, unsigned long junk)
+{
+	(void)junk;
+	enter_forked_process(tf);
+}
+
+/*
+ * fork: copy the current process. The child returns 0 from the same
+ * system call; the parent gets the child's pid.
+ */
+int
+sys_fork(struct trapframe *tf, int *retval)
+{
+	struct trapframe *newtf;
+	struct proc *newproc;
+	pid_t pid;
+	int result;
+
+	newtf = kmalloc(sizeof(*newtf));
+	if (newtf == NULL) {
+		return ENOMEM;
+	}
+	*newtf = *tf;
+
+	result = proc_fork(&newproc);
+	if (result) {
+		kfree(newtf);
+		return result;
+	}
+	pid = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc, fork_thread,
+			     newtf, 0);
+	if (result) {
+		proc_destroy(newproc);
+		kfree(newtf);
+		return result;
+	}
+
+	*retval = pid;
+	return 0;
+}
+
+/*
+ * execv: replace the current program with UPATH, with arguments UARGV.
+ * The old address space is kept until the new program is loaded and
+ * its arguments are in place, so that on failure we can go back to it
+ * and return the error.
+ */
+int
+sys_execv(const_userptr_t upath, const_userptr_t uargv)
+{
+	struct execargs args;
+	struct addrspace *oldas, *newas;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	char *path;
+	int result;
+
+	result = pathname_copyin(upath, &path);
+	if (result) {
+		return result;
+	}
+	result = execargs_copyin(uargv, &args);
+	if (result) {
+		pathname_free(path);
+		return result;
+	}
+
+	oldas = proc_setas(NULL);
+	as_deactivate();
+
+	result = runprogram_load(path, &entrypoint, &stackptr);
+	pathname_free(path);
+	if (result == 0) {
+		result = execargs_copyout(&args, &stackptr, &argv);
+	}
+	if (result) {
+		newas = proc_setas(oldas);
+		as_activate();
+		if (newas != NULL) {
+			as_destroy(newas);
+		}
+		execargs_free(&args);
+		return result;
+	}
+
+	execargs_free(&args);
+	as_destroy(oldas);
+
+	enter_new_process(args.ea_argc, argv, NULL /* env */,
+			  stackptr, entrypoint);
+}
+
+/*
+ * waitpid: see proc_waitpid.
+ */
+int
+sys_waitpid(pid_t pid, userptr_t ustatus, int options, int *retval)
+{
+	pid_t gotpid;
+	int status, result;
+
+	/*
+	 * Check the status pointer first, by writing to it, so that a
+	 * bad one fails without collecting the child.
+	 */
+	if (ustatus != NULL) {
+		status = 0;
+		result = copyout(&status, ustatus, sizeof(status));
+		if (result) {
+			return result;
+		}
+	}
+
+	result = proc_waitpid(pid, options, &gotpid, &status);
+	if (result) {
+		return result;
+	}
+	if (ustatus != NULL && gotpid != 0) {
+		result = copyout(&status, ustatus, sizeof(status));
+		if (result) {
+			return result;
+		}
+	}
+
+	*retval = gotpid;
+	return 0;
+}
+
+/*
+ * getpid
+ */
+int
+sys_getpid(int *retval)
+{
+	*retval = curproc->p_pid;
+	return 0;
+}
+
+/*
+ * ioprio_get and ioprio_set: the I/O priority class of process PID,
+ * or of the current process if PID is 0.
+ */
+int
+sys_ioprio_get(pid_t pid, int *retval)
+{
+	return proc_getioclass(pid, retval);
+}
+
+int
+sys_ioprio_set(pid_t pid, int ioclass)
+{
+	return proc_setioclass(pid, ioclass);
+}
+
+/*
+ * getrlimit and setrlimit: the current process's resource limits.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	result = proc_getrlimit(resource, &rl);
+	if (result) {
+		return result;
+	}
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+	return proc_setrlimit(resource, &rl);
+}
+
+/*
+ * What the parent hands the new process's thread, and what comes
+ * back. The parent waits on si_sem until the child has loaded its
+ * program and copied out its arguments, so everything here can live
+ * on the parent's stack and the load error can be returned to the
+ * caller.
+ */
+struct spawninfo {
+	char *si_path;			/* program to run */
+	struct execargs si_args;	/* program arguments */
+	struct semaphore *si_sem;	/* child is done with this */
+	int si_result;			/* child's load result */
+};
+
+/*
+ * Carry out the file actions at UACTS on FT, the new process's file
+ * table.
+ */
+static
+int
+spawn_doactions(struct filetable *ft, const_userptr_t uacts, int nacts)
+{
+	struct spawn_action act;
+	struct openfile *file, *oldfile;
+	char *path;
+	int i, result;
+
+	for (i = 0; i < nacts; i++) {
+		result = copyin(uacts + i * sizeof(act), &act, sizeof(act));
+		if (result) {
+			return result;
+		}
+		if (!filetable_okfd(ft, act.sa_fd)) {
+			return EBADF;
+		}
+
+		switch (act.sa_op) {
+		    case SPAWN_OPEN:
+			result = pathname_copyin((const_userptr_t)act.sa_path,
+						 &path);
+			if (result) {
+				return result;
+			}
+			result = openfile_open(path, act.sa_flags,
+					       act.sa_mode, &file);
+			pathname_free(path);
+			if (result) {
+				return result;
+			}
+			break;
+		    case SPAWN_CLOSE:
+			result = filetable_get(ft, act.sa_fd, &file);
+			if (result) {
+				return result;
+			}
+			filetable_put(ft, act.sa_fd, file);
+			file = NULL;
+			break;
+		    case SPAWN_DUP2:
+			result = filetable_get(ft, act.sa_srcfd, &file);
+			if (result) {
+				return result;
+			}
+			openfile_incref(file);
+			filetable_put(ft, act.sa_srcfd, file);
+			break;
+		    default:
+			return EINVAL;
+		}
+
+		result = filetable_placeat(ft, file, act.sa_fd, &oldfile);
+		if (result) {
+			if (file != NULL) {
+				openfile_decref(file);
+			}
+			return result;
+		}
+		if (oldfile != NULL) {
+			openfile_decref(oldfile);
+		}
+	}
+	return 0;
+}
+
+/*
+ * The new process's thread: load the program, set up the arguments,
+ * tell the parent how that went, and go to user mode. On failure,
+ * take the process apart again; the parent only reports the error.
+ */
+static
+void
+spawn_thread(void *data, unsigned long junk)
+{
+	struct spawninfo *si = data;
+	struct proc *proc = curproc;
+	struct addrspace *as;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int argc, result;
+
+	(void)junk;
+
+	result = runprogram_load(si->si_path, &entrypoint, &stackptr);
+	if (result == 0) {
+		result = execargs_copyout(&si->si_args, &stackptr, &argv);
+	}
+	argc = si->si_args.ea_argc;
+	si->si_result = result;
+
+	if (result) {
+		/* As in proc_destroy: unhook the address space first. */
+		as = proc_setas(NULL);
+		as_deactivate();
+		if (as != NULL) {
+			as_destroy(as);
+		}
+		proc_remthread(curthread);
+		proc_addthread(kproc, curthread);
+		proc_destroy(proc);
+		V(si->si_sem);
+		return;
+	}
+
+	/* Don't touch si after this; the parent is about to free it. */
+	V(si->si_sem);
+
+	enter_new_process(argc, argv, NULL /* env */, stackptr, entrypoint);
+}
+
+/*
+ * __spawn: start the program UPATH with arguments UARGV in a new
+ * process, without copying the caller's address space the way fork
+ * followed by execv does. The new process gets a copy of the caller's
+ * file table with the NACTS file actions at UACTS applied.
+ */
+int
+sys___spawn(const_userptr_t upath, const_userptr_t uargv,
+	    const_userptr_t uacts, int nacts, int *retval)
+{
+	struct spawninfo si;
+	struct filetable *ft;
+	struct proc *newproc;
+	pid_t pid;
+	int result;
+
+	if (nacts < 0 || nacts > SPAWN_MAXACTIONS) {
+		return EINVAL;
+	}
+
+	result = pathname_copyin(upath, &si.si_path);
+	if (result) {
+		return result;
+	}
+
+	result = execargs_copyin(uargv, &si.si_args);
+	if (result) {
+		goto fail_path;
+	}
+
+	result = filetable_copy(curproc->p_filetable, &ft);
+	if (result) {
+		goto fail_args;
+	}
+	result = spawn_doactions(ft, uacts, nacts);
+	if (result) {
+		filetable_destroy(ft);
+		goto fail_args;
+	}
+
+	newproc = proc_create_runprogram(si.si_path);
+	if (newproc == NULL) {
+		filetable_destroy(ft);
+		result = ENOMEM;
+		goto fail_args;
+	}
+	newproc->p_filetable = ft;
+	pid = newproc->p_pid;
+
+	si.si_sem = sem_create("spawn", 0);
+	if (si.si_sem == NULL) {
+		proc_destroy(newproc);
+		result = ENOMEM;
+		goto fail_args;
+	}
+
+	result = thread_fork(newproc->p_name, newproc, spawn_thread, &si, 0);
+	if (result) {
+		proc_destroy(newproc);
+		goto fail_sem;
+	}
+
+	/* Wait for the child to load; it destroys itself if that fails. */
+	P(si.si_sem);
+	result = si.si_result;
+	if (result == 0) {
+		*retval = pid;
+	}
+
+ fail_sem:
+	sem_destroy(si.si_sem);
+ fail_args:
+	execargs_free(&si.si_args);
+ fail_path:
+	pathname_free(si.si_path);
+	return result;
+}
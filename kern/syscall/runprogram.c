@@ -73,7 +73,12 @@ placed_open(const char *path, int openflags, int fd)
        }
 
        /* place the file in the filetable in the right slot */
-       filetable_placeat(curproc->p_filetable, newfile, fd, &oldfile);
+       result = filetable_placeat(curproc->p_filetable, newfile, fd,
+                                  &oldfile);
+       if (result) {
+               openfile_decref(newfile);
+               return result;
+       }
 
        /* the table should previously have been empty */
        KASSERT(oldfile == NULL);
@@ -113,17 +118,18 @@ open_stdfds(const char *inpath, const char *outpath, const char *errpath)
 }
 
 /*
- * Load program "progname" and start running it in usermode.
- * Does not return except on error.
+ * Load program "progname" into a new address space for the current
+ * process, which must not have one yet, and define its stack. Hands
+ * back the entry point and initial stack pointer; the rest of the
+ * process (such as its file table) is up to the caller.
  *
  * Calls vfs_open on progname and thus may destroy it.
  */
 int
-runprogram(char *progname)
+runprogram_load(char *progname, vaddr_t *entrypoint, vaddr_t *stackptr)
 {
 	struct addrspace *as;
 	struct vnode *v;
-	vaddr_t entrypoint, stackptr;
 	int result;
 
 	/* Open the file. */
@@ -135,25 +141,6 @@ runprogram(char *progname)
 	/* We should be a new process. */
 	KASSERT(proc_getas() == NULL);
 
-        /*
-	 * Added for Project 3
-	 *
-	 * Set up stdin/stdout/stderr if necessary.
-	 */
-        if (curproc->p_filetable == NULL) {
-                curproc->p_filetable = filetable_create();
-                if (curproc->p_filetable == NULL) {
-                        vfs_close(v);
-                        return ENOMEM;
-                }
-
-                result = open_stdfds("con:", "con:", "con:");
-                if (result) {
-                        vfs_close(v);
-                        return result;
-                }
-        }
-
 	/* Create a new address space. */
 	as = as_create();
 	if (as == NULL) {
@@ -166,7 +153,7 @@ runprogram(char *progname)
 	as_activate();
 
 	/* Load the executable. */
-	result = load_elf(v, &entrypoint);
+	result = load_elf(v, entrypoint);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		vfs_close(v);
@@ -177,12 +164,49 @@ runprogram(char *progname)
 	vfs_close(v);
 
 	/* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
+	result = as_define_stack(as, stackptr);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		return result;
 	}
 
+	return 0;
+}
+
+/*
+ * Load program "progname" and start running it in usermode.
+ * Does not return except on error.
+ *
+ * Calls vfs_open on progname and thus may destroy it.
+ */
+int
+runprogram(char *progname)
+{
+	vaddr_t entrypoint, stackptr;
+	int result;
+
+        /*
+	 * Added for Project 3
+	 *
+	 * Set up stdin/stdout/stderr if necessary.
+	 */
+        if (curproc->p_filetable == NULL) {
+                curproc->p_filetable = filetable_create();
+                if (curproc->p_filetable == NULL) {
+                        return ENOMEM;
+                }
+
+                result = open_stdfds("con:", "con:", "con:");
+                if (result) {
+                        return result;
+                }
+        }
+
+	result = runprogram_load(progname, &entrypoint, &stackptr);
+	if (result) {
+		return result;
+	}
+
 	/* Warp to user mode. */
 	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
 			  NULL /*userspace addr of environment*/,
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <kern/errno.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <futex.h>
+#include <syscall.h>
+
+/*
+ * Restrict the calling thread to the cpus in MASK, one bit per cpu
+ * number. See thread_setaffinity.
+ */
+int
+sys_setaffinity(uint32_t mask)
+{
+	return thread_setaffinity(mask);
+}
+
+/*
+ * Sleep while the int at UADDR holds VAL; see futex.h.
+ */
+int
+sys_futex_wait(const_userptr_t uaddr, int val)
+{
+	return futex_wait(proc_getas(), uaddr, val);
+}
+
+/*
+ * Wake up to COUNT threads sleeping on UADDR; return how many.
+ */
+int
+sys_futex_wake(const_userptr_t uaddr, int count, int *retval)
+{
+	unsigned n;
+	int result;
+
+	if (count < 0) {
+		return EINVAL;
+	}
+	result = futex_wake(proc_getas(), uaddr, count, &n);
+	if (result) {
+		return result;
+	}
+	*retval = n;
+	return 0;
+}
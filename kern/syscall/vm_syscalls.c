@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Memory system calls: mmap, munmap, sbrk, and getrusage. (Not in
+ * dumbvm kernels.)
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Map a file, or with MAP_ANON zero-filled memory. Anonymous memory
+ * is always private; MAP_SHARED only matters for files.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct openfile *file;
+	struct vnode *vn;
+	unsigned perms;
+	bool shared;
+	vaddr_t va;
+	int result;
+
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+	    (flags & (MAP_SHARED | MAP_PRIVATE)) ==
+	    (MAP_SHARED | MAP_PRIVATE)) {
+		return EINVAL;
+	}
+	if (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) {
+		return EINVAL;
+	}
+
+	perms = 0;
+	if (prot & PROT_READ) {
+		perms |= VR_READ;
+	}
+	if (prot & PROT_WRITE) {
+		perms |= VR_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perms |= VR_EXEC;
+	}
+	shared = (flags & MAP_SHARED) != 0;
+	va = (vaddr_t)addr;
+
+	if (flags & MAP_ANON) {
+		result = as_mmap(proc_getas(), &va, DIVROUNDUP(len, PAGE_SIZE),
+				 perms, (flags & MAP_FIXED) != 0,
+				 NULL, 0, false);
+		if (result) {
+			return result;
+		}
+		*retval = (int)va;
+		return 0;
+	}
+
+	if (offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	vn = file->of_vnode;
+
+	/* Mapped pages are read in, so the file must be readable. */
+	if (file->of_accmode == O_WRONLY ||
+	    (shared && (prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		result = EACCES;
+		goto out;
+	}
+	result = VOP_MMAP(vn);
+	if (result) {
+		goto out;
+	}
+
+	/* The region takes its own vnode reference. */
+	result = as_mmap(proc_getas(), &va, DIVROUNDUP(len, PAGE_SIZE),
+			 perms, (flags & MAP_FIXED) != 0, vn, offset, shared);
+	if (result) {
+		goto out;
+	}
+	*retval = (int)va;
+
+ out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	vaddr_t oldtop;
+	int result;
+
+	result = as_sbrk(proc_getas(), amount, &oldtop);
+	if (result) {
+		return result;
+	}
+	*retval = (int)oldtop;
+	return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	return as_munmap(proc_getas(), (vaddr_t)addr,
+			 DIVROUNDUP(len, PAGE_SIZE));
+}
+
+/* Convert USEC microseconds to a struct timeval. */
+static
+void
+usec_to_timeval(uint64_t usec, struct timeval *tv)
+{
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+/*
+ * Report the times and counts the kernel keeps in struct usage (see
+ * thread.h); the rest of struct rusage is zero.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct usage u;
+	struct rusage ru;
+
+	if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN) {
+		return EINVAL;
+	}
+	proc_getusage(who == RUSAGE_CHILDREN, &u);
+
+	bzero(&ru, sizeof(ru));
+	usec_to_timeval(u.u_utime, &ru.ru_utime);
+	usec_to_timeval(u.u_stime, &ru.ru_stime);
+	ru.ru_minflt = u.u_minflt;
+	ru.ru_majflt = u.u_majflt;
+	ru.ru_inblock = u.u_inblock;
+	ru.ru_oublock = u.u_oublock;
+	ru.ru_nvcsw = u.u_nvcsw;
+	ru.ru_nivcsw = u.u_nivcsw;
+	ru.ru_nsyscalls = u.u_nsyscalls;
+	return copyout(&ru, usage, sizeof(ru));
+}
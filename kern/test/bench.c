@@ -0,0 +1,817 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel microbenchmarks.
+ *
+ * Each benchmark is one small operation (a semaphore round trip, a
+ * kmalloc/kfree pair, a block read...) that a number of threads, one
+ * per cpu, do over and over. Each thread takes BENCH_SAMPLES samples,
+ * each the time for BENCH_BATCH operations in a row divided by the
+ * batch size; then all the samples are sorted and we report the
+ * minimum, median, and 99th percentile time per operation, along
+ * with the overall throughput. This is done for 1, 2, 4, ... cpus
+ * up to however many there are.
+ *
+ * The output is one line per benchmark and cpu count, with fields
+ * of the form key=value, so it's easy to pick apart with a script:
+ *
+ *    bench name=sem cpus=2 samples=200 min=1540 median=1610 \
+ *          p99=2950 ops/s=1230000
+ *
+ * Times are in nanoseconds, from gettime(); the batches are there so
+ * that the cost and granularity of reading the clock don't swamp
+ * operations that take only a few hundred cycles.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <threadprivate.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <buf.h>
+#include <test.h>
+
+#define BENCH_SAMPLES	100	/* samples per thread */
+#define BENCH_BATCH	16	/* operations per sample */
+#define BENCH_MAXCPUS	32	/* as many as a cpu mask has room for */
+
+#define BENCH_NBUFS	64	/* blocks the buffer benchmark uses */
+#define BENCH_BUFSIZE	512
+#define BENCH_IOSIZE	4096	/* bytes per VOP_READ */
+#define BENCH_IOCOUNT	16	/* BENCH_IOSIZE chunks in the file */
+#define BENCH_DEPTH	4	/* directories deep for the lookups */
+
+struct bench {
+	const char *b_name;
+	unsigned b_arg;		/* size, for the ones that have one */
+	bool b_needfs;		/* needs a file system to run on */
+	int (*b_setup)(const struct bench *b, unsigned nthreads);
+	void (*b_op)(const struct bench *b, unsigned long num);
+	void (*b_cleanup)(const struct bench *b, unsigned nthreads);
+};
+
+/* state for the run in progress */
+static struct semaphore *bench_readysem, *bench_gosem, *bench_donesem;
+static uint32_t *bench_samples;
+static unsigned bench_ncpus;
+static volatile unsigned bench_errors;
+static const char *bench_fs;
+
+/* per-thread state for the benchmarks themselves */
+static struct semaphore *bench_sems1[BENCH_MAXCPUS];
+static struct semaphore *bench_sems2[BENCH_MAXCPUS];
+static unsigned bench_count[BENCH_MAXCPUS];
+static void *bench_iobufs[BENCH_MAXCPUS];
+static volatile bool bench_stop;
+static struct lock *bench_lock;
+static volatile unsigned long bench_lockcount;
+static struct vnode *bench_vn;
+
+/*
+ * Make and destroy semaphores for each of NTHREADS threads.
+ */
+static
+void
+bench_makesems(unsigned nthreads, bool both)
+{
+	unsigned i;
+
+	for (i=0; i<nthreads; i++) {
+		bench_sems1[i] = sem_create("bench1", 0);
+		bench_sems2[i] = both ? sem_create("bench2", 0) : NULL;
+		if (bench_sems1[i] == NULL ||
+		    (both && bench_sems2[i] == NULL)) {
+			panic("bench: sem_create failed\n");
+		}
+	}
+}
+
+static
+void
+bench_destroysems(unsigned nthreads)
+{
+	unsigned i;
+
+	for (i=0; i<nthreads; i++) {
+		sem_destroy(bench_sems1[i]);
+		if (bench_sems2[i] != NULL) {
+			sem_destroy(bench_sems2[i]);
+		}
+		bench_sems1[i] = bench_sems2[i] = NULL;
+	}
+}
+
+/*
+ * Pin the current thread to a cpu; NUM can be more than the number
+ * of cpus.
+ */
+static
+void
+bench_pin(unsigned long num)
+{
+	if (thread_setaffinity(CPUMASK(num % bench_ncpus))) {
+		panic("bench: thread_setaffinity failed\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+// semaphore handoff
+
+/*
+ * Each benchmark thread has a partner on the next cpu over that
+ * waits on one semaphore and posts the other; an operation is one
+ * round trip.
+ */
+
+static
+void
+bench_echothread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	bench_pin(num + 1);
+	while (1) {
+		P(bench_sems1[num]);
+		if (bench_stop) {
+			break;
+		}
+		V(bench_sems2[num]);
+	}
+	V(bench_donesem);
+}
+
+static
+int
+bench_sem_setup(const struct bench *b, unsigned nthreads)
+{
+	unsigned i;
+	int result;
+
+	(void)b;
+	bench_makesems(nthreads, true);
+	bench_stop = false;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("bench echo", NULL, bench_echothread,
+				     NULL, i);
+		if (result) {
+			panic("bench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	return 0;
+}
+
+static
+void
+bench_sem_op(const struct bench *b, unsigned long num)
+{
+	(void)b;
+	V(bench_sems1[num]);
+	P(bench_sems2[num]);
+}
+
+static
+void
+bench_sem_cleanup(const struct bench *b, unsigned nthreads)
+{
+	unsigned i;
+
+	(void)b;
+	bench_stop = true;
+	for (i=0; i<nthreads; i++) {
+		V(bench_sems1[i]);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(bench_donesem);
+	}
+	bench_destroysems(nthreads);
+}
+
+////////////////////////////////////////////////////////////
+// lock
+
+/*
+ * Every thread takes the same lock, so with more than one cpu most
+ * acquires wait for another cpu to hand the lock over.
+ */
+
+static
+int
+bench_lock_setup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	(void)nthreads;
+	bench_lock = lock_create("bench");
+	if (bench_lock == NULL) {
+		return ENOMEM;
+	}
+	bench_lockcount = 0;
+	return 0;
+}
+
+static
+void
+bench_lock_op(const struct bench *b, unsigned long num)
+{
+	(void)b;
+	(void)num;
+	lock_acquire(bench_lock);
+	bench_lockcount++;
+	lock_release(bench_lock);
+}
+
+static
+void
+bench_lock_cleanup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	if (bench_lockcount != (unsigned long)nthreads * BENCH_SAMPLES *
+	    BENCH_BATCH) {
+		kprintf("bench: lock: lost updates\n");
+		bench_errors++;
+	}
+	lock_destroy(bench_lock);
+	bench_lock = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// thread fork and exit
+
+/*
+ * An operation is forking a thread that does nothing but tell us
+ * it ran, and waiting for that.
+ */
+
+static
+void
+bench_forkchild(void *junk, unsigned long num)
+{
+	(void)junk;
+	V(bench_sems1[num]);
+}
+
+static
+int
+bench_fork_setup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	bench_makesems(nthreads, false);
+	return 0;
+}
+
+static
+void
+bench_fork_op(const struct bench *b, unsigned long num)
+{
+	int result;
+
+	(void)b;
+	result = thread_fork("bench child", NULL, bench_forkchild, NULL, num);
+	if (result) {
+		panic("bench: thread_fork failed: %s\n", strerror(result));
+	}
+	P(bench_sems1[num]);
+}
+
+static
+void
+bench_fork_cleanup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	bench_destroysems(nthreads);
+}
+
+////////////////////////////////////////////////////////////
+// kmalloc
+
+/*
+ * An operation is allocating and freeing one block of the size
+ * class B_ARG.
+ */
+
+static
+int
+bench_none_setup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	(void)nthreads;
+	return 0;
+}
+
+static
+void
+bench_none_cleanup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	(void)nthreads;
+}
+
+static
+void
+bench_kmalloc_op(const struct bench *b, unsigned long num)
+{
+	void *p;
+
+	(void)num;
+	p = kmalloc(b->b_arg);
+	if (p == NULL) {
+		bench_errors++;
+		return;
+	}
+	kfree(p);
+}
+
+////////////////////////////////////////////////////////////
+// buffer cache
+
+/*
+ * An operation is getting and releasing one buffer from a set of
+ * BENCH_NBUFS on the buffer test's fake file system, which are all
+ * in the cache after the first time through. Each thread starts at
+ * a different offset, as in bc1.
+ */
+
+static
+int
+bench_buf_setup(const struct bench *b, unsigned nthreads)
+{
+	unsigned i;
+
+	(void)b;
+	for (i=0; i<nthreads; i++) {
+		bench_count[i] = 0;
+	}
+	return 0;
+}
+
+static
+void
+bench_buf_op(const struct bench *b, unsigned long num)
+{
+	struct buf *buf;
+	daddr_t block;
+	int result;
+
+	(void)b;
+	block = (num * 7 + bench_count[num]++) % BENCH_NBUFS;
+	reserve_buffers(BENCH_BUFSIZE);
+	result = buffer_get(buftest_fs(), block, BENCH_BUFSIZE, &buf);
+	if (result) {
+		bench_errors++;
+	}
+	else {
+		buffer_release(buf);
+	}
+	unreserve_buffers(BENCH_BUFSIZE);
+}
+
+static
+void
+bench_buf_cleanup(const struct bench *b, unsigned nthreads)
+{
+	(void)b;
+	(void)nthreads;
+	drop_fs_buffers(buftest_fs());
+}
+
+////////////////////////////////////////////////////////////
+// VOP_READ
+
+/*
+ * An operation is one BENCH_IOSIZE VOP_READ from a file of
+ * BENCH_IOCOUNT such chunks, which (being small) stays in the buffer
+ * cache, so this measures the file system's read path and not the
+ * disk. Each thread walks through the file from a different place.
+ */
+
+static
+void
+bench_filename(char *buf, size_t len)
+{
+	snprintf(buf, len, "%s:benchfile", bench_fs);
+}
+
+static
+int
+bench_read_setup(const struct bench *b, unsigned nthreads)
+{
+	char name[64];
+	struct iovec iov;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	(void)b;
+
+	for (i=0; i<nthreads; i++) {
+		bench_count[i] = 0;
+		bench_iobufs[i] = kmalloc(BENCH_IOSIZE);
+		if (bench_iobufs[i] == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		memset(bench_iobufs[i], 'b', BENCH_IOSIZE);
+	}
+
+	/* vfs_open destroys the string it's passed */
+	bench_filename(name, sizeof(name));
+	result = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &bench_vn);
+	if (result) {
+		goto fail;
+	}
+	for (i=0; i<BENCH_IOCOUNT; i++) {
+		uio_kinit(&iov, &ku, bench_iobufs[0], BENCH_IOSIZE,
+			  (off_t)i * BENCH_IOSIZE, UIO_WRITE);
+		result = VOP_WRITE(bench_vn, &ku);
+		if (result) {
+			vfs_close(bench_vn);
+			bench_vn = NULL;
+			bench_filename(name, sizeof(name));
+			vfs_remove(name);
+			goto fail;
+		}
+	}
+	return 0;
+
+ fail:
+	for (i=0; i<nthreads; i++) {
+		kfree(bench_iobufs[i]);
+		bench_iobufs[i] = NULL;
+	}
+	return result;
+}
+
+static
+void
+bench_read_op(const struct bench *b, unsigned long num)
+{
+	struct iovec iov;
+	struct uio ku;
+	unsigned chunk;
+	int result;
+
+	(void)b;
+	chunk = (num * 7 + bench_count[num]++) % BENCH_IOCOUNT;
+	uio_kinit(&iov, &ku, bench_iobufs[num], BENCH_IOSIZE,
+		  (off_t)chunk * BENCH_IOSIZE, UIO_READ);
+	result = VOP_READ(bench_vn, &ku);
+	if (result || ku.uio_resid != 0) {
+		bench_errors++;
+	}
+}
+
+static
+void
+bench_read_cleanup(const struct bench *b, unsigned nthreads)
+{
+	char name[64];
+	unsigned i;
+
+	(void)b;
+	vfs_close(bench_vn);
+	bench_vn = NULL;
+	bench_filename(name, sizeof(name));
+	vfs_remove(name);
+	for (i=0; i<nthreads; i++) {
+		kfree(bench_iobufs[i]);
+		bench_iobufs[i] = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// path lookup
+
+/*
+ * An operation is looking up a path BENCH_DEPTH directories deep,
+ * like fs8 but from several cpus at once.
+ */
+
+static
+void
+bench_dirname(char *buf, size_t len, unsigned depth)
+{
+	size_t pos;
+	unsigned i;
+
+	snprintf(buf, len, "%s:benchdir", bench_fs);
+	for (i=0; i<depth; i++) {
+		pos = strlen(buf);
+		snprintf(buf + pos, len - pos, "/%c", 'a' + i);
+	}
+}
+
+static
+int
+bench_lookup_setup(const struct bench *b, unsigned nthreads)
+{
+	char name[64];
+	unsigned depth;
+	int result;
+
+	(void)b;
+	(void)nthreads;
+	for (depth=0; depth<=BENCH_DEPTH; depth++) {
+		bench_dirname(name, sizeof(name), depth);
+		result = vfs_mkdir(name, 0775);
+		if (result) {
+			while (depth-- > 0) {
+				bench_dirname(name, sizeof(name), depth);
+				vfs_rmdir(name);
+			}
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+void
+bench_lookup_op(const struct bench *b, unsigned long num)
+{
+	char name[64];
+	struct vnode *vn;
+	int result;
+
+	(void)b;
+	(void)num;
+	/* vfs_lookup destroys the string it's passed */
+	bench_dirname(name, sizeof(name), BENCH_DEPTH);
+	result = vfs_lookup(name, &vn);
+	if (result) {
+		bench_errors++;
+		return;
+	}
+	VOP_DECREF(vn);
+}
+
+static
+void
+bench_lookup_cleanup(const struct bench *b, unsigned nthreads)
+{
+	char name[64];
+	unsigned depth;
+
+	(void)b;
+	(void)nthreads;
+	for (depth = BENCH_DEPTH + 1; depth-- > 0; ) {
+		bench_dirname(name, sizeof(name), depth);
+		vfs_rmdir(name);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// framework
+
+static const struct bench benches[] = {
+	{ "sem", 0, false,
+	  bench_sem_setup, bench_sem_op, bench_sem_cleanup },
+	{ "lock", 0, false,
+	  bench_lock_setup, bench_lock_op, bench_lock_cleanup },
+	{ "fork", 0, false,
+	  bench_fork_setup, bench_fork_op, bench_fork_cleanup },
+	{ "kmalloc", 16, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "kmalloc", 64, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "kmalloc", 256, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "kmalloc", 1024, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "kmalloc", 2048, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "kmalloc", 4096, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "kmalloc", 16384, false,
+	  bench_none_setup, bench_kmalloc_op, bench_none_cleanup },
+	{ "buf", 0, false,
+	  bench_buf_setup, bench_buf_op, bench_buf_cleanup },
+	{ "read", BENCH_IOSIZE, true,
+	  bench_read_setup, bench_read_op, bench_read_cleanup },
+	{ "lookup", 0, true,
+	  bench_lookup_setup, bench_lookup_op, bench_lookup_cleanup },
+};
+
+static
+void
+bench_thread(void *bv, unsigned long num)
+{
+	const struct bench *b = bv;
+	struct timespec start, end;
+	uint64_t nsecs;
+	unsigned i, j;
+
+	bench_pin(num);
+	V(bench_readysem);
+	P(bench_gosem);
+
+	for (i=0; i<BENCH_SAMPLES; i++) {
+		gettime(&start);
+		for (j=0; j<BENCH_BATCH; j++) {
+			b->b_op(b, num);
+		}
+		gettime(&end);
+		timespec_sub(&end, &start, &end);
+		nsecs = (uint64_t)end.tv_sec * 1000000000 + end.tv_nsec;
+		bench_samples[num * BENCH_SAMPLES + i] = nsecs / BENCH_BATCH;
+	}
+	V(bench_donesem);
+}
+
+/*
+ * Sort the samples. There are at most a few thousand of them, so a
+ * shell sort is plenty.
+ */
+static
+void
+bench_sort(uint32_t *v, unsigned n)
+{
+	unsigned gap, i, j;
+	uint32_t t;
+
+	for (gap = n / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			t = v[i];
+			for (j = i; j >= gap && v[j - gap] > t; j -= gap) {
+				v[j] = v[j - gap];
+			}
+			v[j] = t;
+		}
+	}
+}
+
+static
+void
+bench_run(const struct bench *b, unsigned nthreads)
+{
+	struct timespec start, end;
+	char name[32];
+	uint64_t nsecs, rate;
+	unsigned i, n;
+	int result;
+
+	if (b->b_arg != 0) {
+		snprintf(name, sizeof(name), "%s.%u", b->b_name, b->b_arg);
+	}
+	else {
+		strcpy(name, b->b_name);
+	}
+
+	bench_errors = 0;
+	result = b->b_setup(b, nthreads);
+	if (result) {
+		kprintf("bench name=%s cpus=%u error=%s\n", name, nthreads,
+			strerror(result));
+		return;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("bench", NULL, bench_thread,
+				     (void *)b, i);
+		if (result) {
+			panic("bench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(bench_readysem);
+	}
+	gettime(&start);
+	for (i=0; i<nthreads; i++) {
+		V(bench_gosem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(bench_donesem);
+	}
+	gettime(&end);
+
+	b->b_cleanup(b, nthreads);
+
+	timespec_sub(&end, &start, &end);
+	nsecs = (uint64_t)end.tv_sec * 1000000000 + end.tv_nsec;
+	n = nthreads * BENCH_SAMPLES;
+	rate = nsecs == 0 ? 0 :
+		(uint64_t)n * BENCH_BATCH * 1000000000 / nsecs;
+	bench_sort(bench_samples, n);
+	kprintf("bench name=%s cpus=%u samples=%u min=%u median=%u p99=%u "
+		"ops/s=%llu", name, nthreads, n, bench_samples[0],
+		bench_samples[n / 2], bench_samples[n * 99 / 100],
+		(unsigned long long)rate);
+	if (bench_errors > 0) {
+		kprintf(" errors=%u", bench_errors);
+	}
+	kprintf("\n");
+}
+
+/*
+ * Command: bench [name] [filesystem:]
+ *
+ * With a name, run only the benchmarks of that name (e.g. "kmalloc"
+ * runs all the size classes); otherwise run them all. The read and
+ * lookup benchmarks only run if a file system is given to run them
+ * on.
+ */
+int
+bench(int nargs, char **args)
+{
+	const char *which = NULL;
+	unsigned i, nthreads;
+	size_t len;
+	bool ran = false;
+
+	bench_fs = NULL;
+	for (i=1; i<(unsigned)nargs; i++) {
+		len = strlen(args[i]);
+		if (len > 0 && args[i][len-1] == ':') {
+			args[i][len-1] = 0;
+			bench_fs = args[i];
+		}
+		else if (which == NULL) {
+			which = args[i];
+		}
+		else {
+			kprintf("Usage: bench [name] [filesystem:]\n");
+			return EINVAL;
+		}
+	}
+
+	bench_ncpus = thread_numcpus();
+	if (bench_ncpus > BENCH_MAXCPUS) {
+		bench_ncpus = BENCH_MAXCPUS;
+	}
+
+	bench_readysem = sem_create("bench ready", 0);
+	bench_gosem = sem_create("bench go", 0);
+	bench_donesem = sem_create("bench done", 0);
+	bench_samples = kmalloc(bench_ncpus * BENCH_SAMPLES *
+				sizeof(bench_samples[0]));
+	if (bench_readysem == NULL || bench_gosem == NULL ||
+	    bench_donesem == NULL || bench_samples == NULL) {
+		panic("bench: out of memory\n");
+	}
+
+	for (i=0; i<ARRAYCOUNT(benches); i++) {
+		if (which != NULL && strcmp(which, benches[i].b_name)) {
+			continue;
+		}
+		if (benches[i].b_needfs && bench_fs == NULL) {
+			if (which != NULL) {
+				kprintf("bench: %s needs a filesystem\n",
+					which);
+			}
+			continue;
+		}
+		ran = true;
+		for (nthreads = 1; nthreads <= bench_ncpus; nthreads *= 2) {
+			bench_run(&benches[i], nthreads);
+			if (nthreads < bench_ncpus &&
+			    nthreads * 2 > bench_ncpus) {
+				/* also do the total if it's not a power of 2 */
+				bench_run(&benches[i], bench_ncpus);
+			}
+		}
+	}
+	if (!ran && which != NULL) {
+		kprintf("bench: no benchmark %s\n", which);
+	}
+
+	kfree(bench_samples);
+	bench_samples = NULL;
+	sem_destroy(bench_readysem);
+	sem_destroy(bench_gosem);
+	sem_destroy(bench_donesem);
+	bench_readysem = bench_gosem = bench_donesem = NULL;
+	return 0;
+}
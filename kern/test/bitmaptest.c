@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -89,6 +90,24 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	/* Runs: find the first run of 3 clear bits the slow way */
+	for (i=0; i+3 <= TESTSIZE; i++) {
+		if (data[i] && data[i+1] && data[i+2]) {
+			break;
+		}
+	}
+	if (i+3 <= TESTSIZE) {
+		KASSERT(bitmap_alloc_run(b, 3, &x)==0);
+		KASSERT(x == (uint32_t)i);
+		for (i=x; i<(int)x+3; i++) {
+			KASSERT(bitmap_isset(b, i));
+			data[i] = 0;
+		}
+	}
+	else {
+		KASSERT(bitmap_alloc_run(b, 3, &x)==ENOSPC);
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -100,6 +119,18 @@ bitmaptest(int nargs, char **args)
 		KASSERT(bitmap_isset(b, i));
 		KASSERT(data[i]==0);
 	}
+	KASSERT(bitmap_alloc_run(b, 1, &x)==ENOSPC);
+
+	/* Freeing a run makes it allocatable as a run again */
+	for (i=200; i<300; i++) {
+		bitmap_unmark(b, i);
+	}
+	KASSERT(bitmap_alloc_run(b, 101, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_run(b, 100, &x)==0);
+	KASSERT(x == 200);
+	KASSERT(bitmap_alloc(b, &x)==ENOSPC);
+
+	bitmap_destroy(b);
 
 	kprintf("Bitmap test complete\n");
 	return 0;
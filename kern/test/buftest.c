@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache tests.
+ *
+ * These run against a fake file system whose blocks are all zeros
+ * and which throws writes away, so they don't need a disk and
+ * measure only the cache itself.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <fs.h>
+#include <buf.h>
+#include <test.h>
+
+#define BT_BLOCKSIZE	512
+#define BT_NBLOCKS	64
+#define BT_MAXTHREADS	16
+#define BT_HITS		20000
+
+////////////////////////////////////////////////////////////
+// fake fs
+
+static
+int
+bt_sync(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+static
+const char *
+bt_getvolname(struct fs *fs)
+{
+	(void)fs;
+	return "buftest";
+}
+
+static
+int
+bt_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	(void)fs;
+	(void)block;
+	bzero(data, len);
+	return 0;
+}
+
+static
+int
+bt_writeblock(struct fs *fs, daddr_t block, void *bufdata,
+	      void *data, size_t len)
+{
+	(void)fs;
+	(void)block;
+	(void)bufdata;
+	(void)data;
+	(void)len;
+	return 0;
+}
+
+static
+int
+bt_attachbuf(struct fs *fs, daddr_t block, struct buf *buf)
+{
+	(void)fs;
+	(void)block;
+	(void)buf;
+	return 0;
+}
+
+static
+void
+bt_detachbuf(struct fs *fs, daddr_t block, struct buf *buf)
+{
+	(void)fs;
+	(void)block;
+	(void)buf;
+}
+
+static const struct fs_ops bt_fsops = {
+	.fsop_sync = bt_sync,
+	.fsop_getvolname = bt_getvolname,
+	.fsop_getroot = NULL,
+	.fsop_unmount = NULL,
+	.fsop_readblock = bt_readblock,
+	.fsop_writeblock = bt_writeblock,
+	.fsop_writeblocks = NULL,
+	.fsop_attachbuf = bt_attachbuf,
+	.fsop_detachbuf = bt_detachbuf,
+};
+
+static struct fs bt_fs = {
+	.fs_data = NULL,
+	.fs_ops = &bt_fsops,
+};
+
+/*
+ * Hand out the fake file system, for the benchmarks in bench.c.
+ */
+struct fs *
+buftest_fs(void)
+{
+	return &bt_fs;
+}
+
+////////////////////////////////////////////////////////////
+// bc1
+
+/*
+ * Hit throughput benchmark. Reads BT_NBLOCKS blocks into the cache,
+ * then for each thread count from 1 to the maximum has that many
+ * threads each read BT_HITS blocks out of that set, which should
+ * all be cache hits, and reports the total hits per second.
+ *
+ * The blocks each thread reads start at a different offset, so
+ * threads mostly hit different partitions at any given time, as
+ * they would in a real read-mostly workload.
+ */
+
+static struct semaphore *bt_donesem;
+static volatile unsigned bt_errors;
+
+static
+void
+bt_hitthread(void *x, unsigned long num)
+{
+	struct buf *b;
+	daddr_t block;
+	unsigned i;
+	int result;
+
+	(void)x;
+
+	for (i=0; i<BT_HITS; i++) {
+		block = (num * 7 + i) % BT_NBLOCKS;
+		reserve_buffers(BT_BLOCKSIZE);
+		result = buffer_read(&bt_fs, block, BT_BLOCKSIZE, &b);
+		if (result) {
+			kprintf("bc1: thread %lu: buffer_read: %s\n",
+				num, strerror(result));
+			bt_errors++;
+		}
+		else {
+			buffer_release(b);
+		}
+		unreserve_buffers(BT_BLOCKSIZE);
+	}
+	V(bt_donesem);
+}
+
+int
+bufhitbench(int nargs, char **args)
+{
+	struct timespec start, end, diff;
+	struct buf *b;
+	unsigned maxthreads, nthreads, i;
+	uint64_t nsecs, rate;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: bc1 [maxthreads]\n");
+		return EINVAL;
+	}
+	maxthreads = nargs == 2 ? atoi(args[1]) : 4;
+	if (maxthreads < 1 || maxthreads > BT_MAXTHREADS) {
+		kprintf("bc1: maxthreads must be from 1 to %u\n",
+			BT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	bt_donesem = sem_create("bc1", 0);
+	if (bt_donesem == NULL) {
+		panic("bc1: sem_create failed\n");
+	}
+	bt_errors = 0;
+
+	/* Warm up the cache */
+	for (i=0; i<BT_NBLOCKS; i++) {
+		reserve_buffers(BT_BLOCKSIZE);
+		result = buffer_read(&bt_fs, i, BT_BLOCKSIZE, &b);
+		if (result) {
+			kprintf("bc1: buffer_read: %s\n", strerror(result));
+			unreserve_buffers(BT_BLOCKSIZE);
+			goto done;
+		}
+		buffer_release(b);
+		unreserve_buffers(BT_BLOCKSIZE);
+	}
+
+	kprintf("Buffer cache hit benchmark (%u hits per thread)\n",
+		BT_HITS);
+	for (nthreads = 1; nthreads <= maxthreads; nthreads++) {
+		gettime(&start);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("bc1", NULL, bt_hitthread,
+					     NULL, i);
+			if (result) {
+				panic("bc1: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(bt_donesem);
+		}
+		gettime(&end);
+
+		timespec_sub(&end, &start, &diff);
+		nsecs = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+		rate = nsecs == 0 ? 0 :
+			(uint64_t)nthreads * BT_HITS * 1000000000 / nsecs;
+		kprintf("   %2u threads: %llu.%03u sec, %llu hits/sec\n",
+			nthreads,
+			(unsigned long long)diff.tv_sec,
+			(unsigned)(diff.tv_nsec / 1000000),
+			(unsigned long long)rate);
+	}
+
+	if (bt_errors > 0) {
+		kprintf("bc1: %u errors\n", bt_errors);
+	}
+	else {
+		kprintf("bc1: done\n");
+	}
+
+ done:
+	drop_fs_buffers(&bt_fs);
+	sem_destroy(bt_donesem);
+	bt_donesem = NULL;
+	return 0;
+}
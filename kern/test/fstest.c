@@ -43,6 +43,7 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <uio.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vfs.h>
@@ -56,6 +57,13 @@
 #define NTHREADS 12
 #define NLONG    32
 #define NCREATE  24
+#define OWCHUNK  512
+#define OWCHUNKS 16
+#define OWPASSES 4
+#define LBDEPTH  6
+#define LBLOOKUPS 20000
+#define FBMAXTHREADS 32
+#define FBBUCKETS 24
 
 static struct semaphore *threadsem = NULL;
 
@@ -674,6 +682,636 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Parallel overwrite test: threads overwrite their own parts of one
+ * existing file. Since the file doesn't grow, the writes don't need
+ * to exclude each other, and on a multiprocessor this should go
+ * faster than one thread doing all the writing. Print both times so
+ * the scaling can be seen.
+ */
+
+/*
+ * Overwrite chunks FIRST through FIRST+NUM-1 of a file with a
+ * pattern based on the chunk number and GEN.
+ */
+static
+int
+overwrite_region(struct vnode *vn, unsigned first, unsigned num,
+		 unsigned gen)
+{
+	char buf[OWCHUNK];
+	struct iovec iov;
+	struct uio ku;
+	unsigned i;
+	int err;
+
+	for (i=first; i<first+num; i++) {
+		memset(buf, (int)((i + gen) & 0xff), sizeof(buf));
+		uio_kinit(&iov, &ku, buf, sizeof(buf), i * OWCHUNK,
+			  UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err) {
+			kprintf("Chunk %u: Write error: %s\n", i,
+				strerror(err));
+			return err;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("Chunk %u: Short write\n", i);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check that each chunk has the pattern overwrite_region wrote.
+ */
+static
+int
+overwrite_check(struct vnode *vn, unsigned gen)
+{
+	char buf[OWCHUNK];
+	struct iovec iov;
+	struct uio ku;
+	unsigned i, j;
+	int err;
+
+	for (i=0; i<NTHREADS*OWCHUNKS; i++) {
+		uio_kinit(&iov, &ku, buf, sizeof(buf), i * OWCHUNK,
+			  UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("Chunk %u: Read error: %s\n", i,
+				strerror(err));
+			return err;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("Chunk %u: Short read\n", i);
+			return EIO;
+		}
+		for (j=0; j<sizeof(buf); j++) {
+			if (buf[j] != (char)((i + gen) & 0xff)) {
+				kprintf("Chunk %u: Test failed: byte %u "
+					"mismatched\n", i, j);
+				return EIO;
+			}
+		}
+	}
+	return 0;
+}
+
+static unsigned overwrite_gen;
+static int overwrite_err;
+
+static
+void
+overwritestress_thread(void *vn, unsigned long num)
+{
+	unsigned pass;
+	int err;
+
+	for (pass=0; pass<OWPASSES; pass++) {
+		err = overwrite_region(vn, num * OWCHUNKS, OWCHUNKS,
+				       overwrite_gen);
+		if (err) {
+			kprintf("*** Thread %lu: failed\n", num);
+			overwrite_err = err;
+			break;
+		}
+	}
+	V(threadsem);
+}
+
+static
+void
+dooverwritestress(const char *filesys)
+{
+	struct timespec start, end, onetime, manytime;
+	char name[32];
+	struct vnode *vn;
+	unsigned pass;
+	int i, err;
+
+	init_threadsem();
+
+	kprintf("*** Starting fs parallel overwrite test on %s:\n", filesys);
+
+	fstest_makename(name, sizeof(name), filesys, "");
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	/* Fill in the whole file first, so the timed writes overwrite. */
+	err = overwrite_region(vn, 0, NTHREADS*OWCHUNKS, 0);
+	if (err) {
+		goto fail;
+	}
+
+	/* One thread writing the whole file OWPASSES times */
+	gettime(&start);
+	for (pass=0; pass<OWPASSES; pass++) {
+		err = overwrite_region(vn, 0, NTHREADS*OWCHUNKS, 1);
+		if (err) {
+			goto fail;
+		}
+	}
+	gettime(&end);
+	timespec_sub(&end, &start, &onetime);
+
+	/* NTHREADS threads each writing their own part OWPASSES times */
+	overwrite_gen = 2;
+	overwrite_err = 0;
+	gettime(&start);
+	for (i=0; i<NTHREADS; i++) {
+		err = thread_fork("overwritestress", NULL,
+				  overwritestress_thread, vn, i);
+		if (err) {
+			panic("overwritestress: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(threadsem);
+	}
+	gettime(&end);
+	timespec_sub(&end, &start, &manytime);
+	if (overwrite_err) {
+		goto fail;
+	}
+
+	kprintf("   1 thread: %llu.%03u sec\n",
+		(unsigned long long) onetime.tv_sec,
+		(unsigned)(onetime.tv_nsec / 1000000));
+	kprintf("   %d threads: %llu.%03u sec\n", NTHREADS,
+		(unsigned long long) manytime.tv_sec,
+		(unsigned)(manytime.tv_nsec / 1000000));
+
+	if (overwrite_check(vn, 2)) {
+		goto fail;
+	}
+
+	vfs_close(vn);
+	if (fstest_remove(filesys, "")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+	kprintf("*** fs parallel overwrite test done\n");
+	return;
+
+ fail:
+	vfs_close(vn);
+	fstest_remove(filesys, "");
+	kprintf("*** Test failed\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Path lookup benchmark: makes fstest.tmp/a/b/c/d/e/f and then looks
+ * up the deepest directory LBLOOKUPS times, reporting lookups per
+ * second. After the first time everything should come out of the
+ * name cache, so this measures the lookup path itself.
+ */
+
+static
+void
+lookupbench_name(char *buf, size_t buflen, const char *filesys,
+		 unsigned depth)
+{
+	size_t len;
+	unsigned i;
+
+	snprintf(buf, buflen, "%s:%s", filesys, FILENAME);
+	for (i=0; i<depth; i++) {
+		len = strlen(buf);
+		snprintf(buf + len, buflen - len, "/%c", 'a' + i);
+	}
+	KASSERT(strlen(buf) < buflen - 1);
+}
+
+static
+void
+dolookupbench(const char *filesys)
+{
+	struct timespec start, end, diff;
+	char name[64], buf[64];
+	struct vnode *vn;
+	uint64_t nsecs, rate;
+	unsigned depth, made, i;
+	bool failed = true;
+	int err;
+
+	kprintf("*** Starting path lookup benchmark on %s:\n", filesys);
+
+	for (made=0; made<=LBDEPTH; made++) {
+		lookupbench_name(name, sizeof(name), filesys, made);
+		err = vfs_mkdir(name, 0775);
+		if (err) {
+			kprintf("Could not create %s: %s\n", name,
+				strerror(err));
+			goto done;
+		}
+	}
+
+	lookupbench_name(name, sizeof(name), filesys, LBDEPTH);
+	gettime(&start);
+	for (i=0; i<LBLOOKUPS; i++) {
+		strcpy(buf, name);
+		err = vfs_lookup(buf, &vn);
+		if (err) {
+			kprintf("Could not look up %s: %s\n", name,
+				strerror(err));
+			goto done;
+		}
+		VOP_DECREF(vn);
+	}
+	gettime(&end);
+
+	timespec_sub(&end, &start, &diff);
+	nsecs = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	rate = nsecs == 0 ? 0 : (uint64_t)LBLOOKUPS * 1000000000 / nsecs;
+	kprintf("   %u lookups of depth %u: %llu.%03u sec, %llu lookups/sec\n",
+		LBLOOKUPS, LBDEPTH + 1,
+		(unsigned long long) diff.tv_sec,
+		(unsigned)(diff.tv_nsec / 1000000),
+		(unsigned long long) rate);
+	failed = false;
+
+ done:
+	for (depth = made; depth-- > 0; ) {
+		lookupbench_name(name, sizeof(name), filesys, depth);
+		err = vfs_rmdir(name);
+		if (err) {
+			kprintf("Could not remove %s: %s\n", name,
+				strerror(err));
+		}
+	}
+	if (failed) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+	kprintf("*** path lookup benchmark done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * fs9: I/O benchmark, in the manner of fio. Each of THREADS threads
+ * has its own file of SIZE bytes and does SIZE/BS * PASSES operations
+ * of BS bytes on it, at sequential or random block-aligned offsets,
+ * each a read with probability READPCT percent and otherwise a
+ * write. Files that will be read are written out whole first, and
+ * that isn't timed. Options are given as key=value:
+ *
+ *    threads=N size=N bs=N passes=N rw=read|write|N pattern=seq|rand
+ *
+ * where sizes can have k or m on the end. Reports the total MB/s
+ * and a histogram of read and of write latencies, in power-of-two
+ * microsecond buckets.
+ */
+
+struct fsbench_conf {
+	unsigned fb_threads;
+	unsigned fb_size;
+	unsigned fb_bs;
+	unsigned fb_passes;
+	unsigned fb_readpct;
+	bool fb_random;
+};
+
+static struct fsbench_conf fsbench_conf;
+static const char *fsbench_fs;
+static struct semaphore *fsbench_gosem;
+static unsigned fsbench_hist[FBMAXTHREADS][2][FBBUCKETS];
+static unsigned fsbench_errors[FBMAXTHREADS];
+
+static
+void
+fsbench_makename(char *buf, size_t buflen, unsigned long num)
+{
+	snprintf(buf, buflen, "%s:fsbench.%lu", fsbench_fs, num);
+}
+
+/*
+ * Return the histogram bucket for a latency: bucket 0 is under 1us,
+ * bucket B is [2^(B-1), 2^B) us, and the last bucket gets the rest.
+ */
+static
+unsigned
+fsbench_bucket(const struct timespec *ts)
+{
+	uint64_t usecs;
+	unsigned b;
+
+	usecs = (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+	for (b = 0; usecs > 0 && b < FBBUCKETS - 1; b++) {
+		usecs >>= 1;
+	}
+	return b;
+}
+
+static
+int
+fsbench_io(struct vnode *vn, char *buf, off_t pos, bool isread)
+{
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	uio_kinit(&iov, &ku, buf, fsbench_conf.fb_bs, pos,
+		  isread ? UIO_READ : UIO_WRITE);
+	err = isread ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+	if (err == 0 && ku.uio_resid != 0) {
+		err = EIO;
+	}
+	return err;
+}
+
+static
+void
+fsbench_thread(void *junk, unsigned long num)
+{
+	const struct fsbench_conf *fc = &fsbench_conf;
+	struct timespec start, end;
+	struct vnode *vn;
+	char name[32];
+	char *buf;
+	unsigned nblocks, nops, i, block;
+	bool isread;
+	int err;
+
+	(void)junk;
+
+	bzero(fsbench_hist[num], sizeof(fsbench_hist[num]));
+	fsbench_errors[num] = 0;
+	nblocks = fc->fb_size / fc->fb_bs;
+	nops = nblocks * fc->fb_passes;
+
+	buf = kmalloc(fc->fb_bs);
+	if (buf == NULL) {
+		kprintf("fs9: thread %lu: Out of memory\n", num);
+		fsbench_errors[num]++;
+		V(threadsem);
+		P(fsbench_gosem);
+		V(threadsem);
+		return;
+	}
+	memset(buf, 'a' + num % 26, fc->fb_bs);
+
+	/* vfs_open destroys the string it's passed */
+	fsbench_makename(name, sizeof(name), num);
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("fs9: thread %lu: %s: %s\n", num, name,
+			strerror(err));
+		fsbench_errors[num]++;
+		vn = NULL;
+	}
+	for (i=0; vn != NULL && fc->fb_readpct > 0 && i<nblocks; i++) {
+		err = fsbench_io(vn, buf, (off_t)i * fc->fb_bs, false);
+		if (err) {
+			kprintf("fs9: thread %lu: prefill: %s\n", num,
+				strerror(err));
+			fsbench_errors[num]++;
+			break;
+		}
+	}
+
+	/* tell the main thread we're ready, and wait for everyone */
+	V(threadsem);
+	P(fsbench_gosem);
+
+	for (i=0; vn != NULL && i<nops; i++) {
+		block = fc->fb_random ? random() % nblocks : i % nblocks;
+		isread = random() % 100 < fc->fb_readpct;
+
+		gettime(&start);
+		err = fsbench_io(vn, buf, (off_t)block * fc->fb_bs, isread);
+		gettime(&end);
+		if (err) {
+			kprintf("fs9: thread %lu: %s: %s\n", num,
+				isread ? "read" : "write", strerror(err));
+			fsbench_errors[num]++;
+			break;
+		}
+		timespec_sub(&end, &start, &end);
+		fsbench_hist[num][isread ? 0 : 1][fsbench_bucket(&end)]++;
+	}
+
+	if (vn != NULL) {
+		vfs_close(vn);
+		fsbench_makename(name, sizeof(name), num);
+		vfs_remove(name);
+	}
+	kfree(buf);
+	V(threadsem);
+}
+
+static
+void
+fsbench_printhist(const char *what, unsigned which)
+{
+	unsigned total[FBBUCKETS];
+	unsigned b, t, n, first, last;
+
+	n = 0;
+	for (b=0; b<FBBUCKETS; b++) {
+		total[b] = 0;
+		for (t=0; t<fsbench_conf.fb_threads; t++) {
+			total[b] += fsbench_hist[t][which][b];
+		}
+		n += total[b];
+	}
+	if (n == 0) {
+		return;
+	}
+	for (first = 0; total[first] == 0; first++) ;
+	for (last = FBBUCKETS - 1; total[last] == 0; last--) ;
+
+	kprintf("   %s latency (%u ops):\n", what, n);
+	for (b=first; b<=last; b++) {
+		if (b == 0) {
+			kprintf("      [0, 1) us: %u\n", total[b]);
+		}
+		else if (b == FBBUCKETS - 1) {
+			kprintf("      [%u, ...) us: %u\n", 1U << (b - 1),
+				total[b]);
+		}
+		else {
+			kprintf("      [%u, %u) us: %u\n", 1U << (b - 1),
+				1U << b, total[b]);
+		}
+	}
+}
+
+/*
+ * Parse a size, which can end in k or m.
+ */
+static
+unsigned
+fsbench_num(const char *s)
+{
+	unsigned val;
+	size_t len;
+
+	val = atoi(s);
+	len = strlen(s);
+	if (len > 0 && (s[len-1] == 'k' || s[len-1] == 'K')) {
+		val *= 1024;
+	}
+	else if (len > 0 && (s[len-1] == 'm' || s[len-1] == 'M')) {
+		val *= 1024*1024;
+	}
+	return val;
+}
+
+static
+int
+fsbench_parse(struct fsbench_conf *fc, int nargs, char **args)
+{
+	char *val;
+	int i;
+
+	fc->fb_threads = 4;
+	fc->fb_size = 64*1024;
+	fc->fb_bs = 4096;
+	fc->fb_passes = 4;
+	fc->fb_readpct = 100;
+	fc->fb_random = false;
+
+	for (i=0; i<nargs; i++) {
+		val = strchr(args[i], '=');
+		if (val == NULL) {
+			return EINVAL;
+		}
+		*val++ = 0;
+		if (!strcmp(args[i], "threads")) {
+			fc->fb_threads = atoi(val);
+		}
+		else if (!strcmp(args[i], "size")) {
+			fc->fb_size = fsbench_num(val);
+		}
+		else if (!strcmp(args[i], "bs")) {
+			fc->fb_bs = fsbench_num(val);
+		}
+		else if (!strcmp(args[i], "passes")) {
+			fc->fb_passes = atoi(val);
+		}
+		else if (!strcmp(args[i], "rw")) {
+			if (!strcmp(val, "read")) {
+				fc->fb_readpct = 100;
+			}
+			else if (!strcmp(val, "write")) {
+				fc->fb_readpct = 0;
+			}
+			else {
+				fc->fb_readpct = atoi(val);
+			}
+		}
+		else if (!strcmp(args[i], "pattern")) {
+			if (!strcmp(val, "seq")) {
+				fc->fb_random = false;
+			}
+			else if (!strcmp(val, "rand")) {
+				fc->fb_random = true;
+			}
+			else {
+				return EINVAL;
+			}
+		}
+		else {
+			return EINVAL;
+		}
+	}
+
+	if (fc->fb_threads < 1 || fc->fb_threads > FBMAXTHREADS ||
+	    fc->fb_bs == 0 || fc->fb_size < fc->fb_bs ||
+	    fc->fb_passes == 0 || fc->fb_readpct > 100) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+void
+dofsbench(const char *filesys)
+{
+	const struct fsbench_conf *fc = &fsbench_conf;
+	struct timespec start, end;
+	uint64_t bytes, nsecs, kbps;
+	unsigned i, ops, errors;
+	int err;
+
+	init_threadsem();
+	fsbench_gosem = sem_create("fsbench", 0);
+	if (fsbench_gosem == NULL) {
+		panic("fs9: sem_create failed\n");
+	}
+	fsbench_fs = filesys;
+
+	kprintf("*** Starting fs I/O benchmark on %s:\n", filesys);
+	kprintf("   %u threads, %u bytes each, %u-byte %s I/O, "
+		"%u%% reads, %u passes\n",
+		fc->fb_threads, fc->fb_size, fc->fb_bs,
+		fc->fb_random ? "random" : "sequential", fc->fb_readpct,
+		fc->fb_passes);
+
+	for (i=0; i<fc->fb_threads; i++) {
+		err = thread_fork("fsbench", NULL, fsbench_thread, NULL, i);
+		if (err) {
+			panic("fs9: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+	for (i=0; i<fc->fb_threads; i++) {
+		P(threadsem);
+	}
+	gettime(&start);
+	for (i=0; i<fc->fb_threads; i++) {
+		V(fsbench_gosem);
+	}
+	for (i=0; i<fc->fb_threads; i++) {
+		P(threadsem);
+	}
+	gettime(&end);
+	sem_destroy(fsbench_gosem);
+	fsbench_gosem = NULL;
+
+	ops = 0;
+	errors = 0;
+	for (i=0; i<fc->fb_threads; i++) {
+		errors += fsbench_errors[i];
+	}
+	for (i=0; i<FBBUCKETS * fc->fb_threads; i++) {
+		ops += fsbench_hist[i / FBBUCKETS][0][i % FBBUCKETS] +
+			fsbench_hist[i / FBBUCKETS][1][i % FBBUCKETS];
+	}
+
+	timespec_sub(&end, &start, &end);
+	nsecs = (uint64_t)end.tv_sec * 1000000000 + end.tv_nsec;
+	bytes = (uint64_t)ops * fc->fb_bs;
+	kbps = nsecs == 0 ? 0 : bytes * 1000000000 / 1024 / nsecs;
+	kprintf("   %llu bytes in %llu.%03u sec: %llu.%02llu MB/s\n",
+		(unsigned long long)bytes,
+		(unsigned long long)end.tv_sec,
+		(unsigned)(end.tv_nsec / 1000000),
+		(unsigned long long)(kbps / 1024),
+		(unsigned long long)(kbps % 1024 * 100 / 1024));
+	fsbench_printhist("read", 0);
+	fsbench_printhist("write", 1);
+
+	if (errors > 0) {
+		kprintf("*** Test failed (%u errors)\n", errors);
+		return;
+	}
+	kprintf("*** fs I/O benchmark done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +1319,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[12345678] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +1352,31 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(overwritestress);
+DEFTEST(lookupbench);
+
+int
+fsbench(int nargs, char **args)
+{
+	int result;
+
+	result = EINVAL;
+	if (nargs >= 2) {
+		result = fsbench_parse(&fsbench_conf, nargs - 2, args + 2);
+	}
+	if (result == 0) {
+		result = checkfilesystem(2, args);
+	}
+	if (result) {
+		kprintf("Usage: fs9 filesystem: [threads=N] [size=N] "
+			"[bs=N] [passes=N]\n"
+			"           [rw=read|write|read-percent] "
+			"[pattern=seq|rand]\n");
+		return EINVAL;
+	}
+	dofsbench(args[1]);
+	return 0;
+}
 
 ////////////////////////////////////////////////////////////
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Test code for the hash table.
+ *
+ * First enough objects in a caller-locked table to make it grow
+ * several times, found, removed in an order that makes it shrink
+ * while still growing, and checked at each step; then several
+ * threads at once on a table with its own locks, each adding,
+ * finding, and removing its own keys.
+ */
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <hashtable.h>
+#include <test.h>
+
+#define HT_NOBJS	3000
+#define HT_THREADS	4
+#define HT_LOCKS	4
+#define HT_ROUNDS	20
+
+struct htobj {
+	unsigned ho_key;
+	struct hashlink ho_link;
+};
+
+static struct htobj ht_objs[HT_NOBJS];
+static struct hashtable *ht_table;
+static struct semaphore *ht_donesem;
+
+static
+bool
+ht_match(void *obj, const void *key)
+{
+	const struct htobj *ho = obj;
+
+	return ho->ho_key == *(const unsigned *)key;
+}
+
+static
+struct htobj *
+ht_find(unsigned key)
+{
+	return hashtable_find(ht_table, key, ht_match, &key);
+}
+
+static
+void
+ht_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<HT_NOBJS; i++) {
+		/* spread out, and far from sequential */
+		ht_objs[i].ho_key = i * 7919 + 1;
+		hashlink_init(&ht_objs[i].ho_link, &ht_objs[i]);
+	}
+}
+
+static
+void
+ht_basic(void)
+{
+	unsigned i, key;
+	const char *s1, *s2;
+
+	ht_table = hashtable_create("hashtest", 0);
+	if (ht_table == NULL) {
+		panic("hashtest: hashtable_create failed\n");
+	}
+
+	KASSERT(ht_find(ht_objs[0].ho_key) == NULL);
+	for (i=0; i<HT_NOBJS; i++) {
+		hashtable_add(ht_table, &ht_objs[i].ho_link,
+			      ht_objs[i].ho_key);
+		KASSERT(hashtable_count(ht_table) == i + 1);
+		/* something added earlier, possibly already moved */
+		key = ht_objs[i / 2].ho_key;
+		KASSERT(ht_find(key) == &ht_objs[i / 2]);
+	}
+	for (i=0; i<HT_NOBJS; i++) {
+		KASSERT(ht_find(ht_objs[i].ho_key) == &ht_objs[i]);
+	}
+	KASSERT(ht_find(2) == NULL);
+
+	/* remove the odd ones, then the even ones */
+	for (i=1; i<HT_NOBJS; i+=2) {
+		hashtable_remove(ht_table, &ht_objs[i].ho_link);
+		KASSERT(ht_find(ht_objs[i].ho_key) == NULL);
+	}
+	for (i=0; i<HT_NOBJS; i++) {
+		KASSERT(ht_find(ht_objs[i].ho_key) ==
+			(i % 2 ? NULL : &ht_objs[i]));
+	}
+	for (i=0; i<HT_NOBJS; i+=2) {
+		hashtable_remove(ht_table, &ht_objs[i].ho_link);
+		if (i + 2 < HT_NOBJS) {
+			KASSERT(ht_find(ht_objs[i + 2].ho_key) ==
+				&ht_objs[i + 2]);
+		}
+	}
+	KASSERT(hashtable_count(ht_table) == 0);
+	hashtable_destroy(ht_table);
+	ht_table = NULL;
+
+	s1 = "semaphore";
+	s2 = "semaphorf";
+	KASSERT(hash_string(s1) == hash_string("semaphore"));
+	KASSERT(hash_string(s1) != hash_string(s2));
+
+	kprintf("hashtest: basic tests passed\n");
+}
+
+/*
+ * Thread NUM owns every HT_THREADS'th object starting at NUM.
+ */
+static
+void
+ht_thread(void *junk, unsigned long num)
+{
+	unsigned round, i, key;
+
+	(void)junk;
+	for (round=0; round<HT_ROUNDS; round++) {
+		for (i=num; i<HT_NOBJS; i+=HT_THREADS) {
+			key = ht_objs[i].ho_key;
+			hashtable_lock(ht_table, key);
+			KASSERT(ht_find(key) == NULL);
+			hashtable_add(ht_table, &ht_objs[i].ho_link, key);
+			hashtable_unlock(ht_table, key);
+		}
+		thread_yield();
+		for (i=num; i<HT_NOBJS; i+=HT_THREADS) {
+			key = ht_objs[i].ho_key;
+			hashtable_lock(ht_table, key);
+			KASSERT(ht_find(key) == &ht_objs[i]);
+			hashtable_remove(ht_table, &ht_objs[i].ho_link);
+			hashtable_unlock(ht_table, key);
+		}
+	}
+	V(ht_donesem);
+}
+
+static
+void
+ht_threads(void)
+{
+	unsigned i;
+	int result;
+
+	ht_table = hashtable_create("hashtest", HT_LOCKS);
+	if (ht_table == NULL) {
+		panic("hashtest: hashtable_create failed\n");
+	}
+	for (i=0; i<HT_THREADS; i++) {
+		result = thread_fork("hashtest", NULL, ht_thread, NULL, i);
+		if (result) {
+			panic("hashtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<HT_THREADS; i++) {
+		P(ht_donesem);
+	}
+	KASSERT(hashtable_count(ht_table) == 0);
+	hashtable_destroy(ht_table);
+	ht_table = NULL;
+
+	kprintf("hashtest: %u threads, %u rounds passed\n",
+		HT_THREADS, HT_ROUNDS);
+}
+
+int
+hashtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	ht_donesem = sem_create("hashtest", 0);
+	if (ht_donesem == NULL) {
+		panic("hashtest: sem_create failed\n");
+	}
+
+	ht_init();
+	ht_basic();
+	ht_threads();
+
+	sem_destroy(ht_donesem);
+	kprintf("hashtest done\n");
+	return 0;
+}
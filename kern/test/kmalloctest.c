@@ -33,7 +33,10 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kheaptag.h>
+#include <clock.h>
 #include <thread.h>
+#include <threadprivate.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
@@ -378,3 +381,340 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Allocation throughput and fragmentation benchmark.
+ *
+ * Each thread, pinned to its own cpu, replays a synthetic trace of
+ * kernel allocations: each step picks one of the sites in km5sites[]
+ * by weight, allocates a block of about that size, and frees it
+ * again after about that site's lifetime in steps. The sizes,
+ * proportions, and lifetimes are rough models of the kernel's own
+ * traffic: small short-lived pathname pieces and uio bits, longer
+ * lived vnodes and files, and now and then a page of something.
+ *
+ * Lifetimes are kept in a ring of KM5_RING slots indexed by the step
+ * number at which the block is to be freed, so each step frees at
+ * most one block and there are at most KM5_RING live per thread.
+ *
+ * Every KM5_SAMPLE steps thread 0 samples kheap_getusage() and the
+ * bytes the threads have actually asked for, and the averages of the
+ * samples are reported along with allocations per second and (with
+ * lockstat) the average spins per acquisition of kmalloc_spinlock.
+ * This is done for 1, 2, 4, ... cpus.
+ */
+
+#define KM5_STEPS	16384	/* allocations per thread */
+#define KM5_RING	512	/* must be a power of two */
+#define KM5_SAMPLE	256
+#define KM5_MAXCPUS	32
+
+struct km5site {
+	size_t size;		/* typical size */
+	unsigned weight;	/* relative frequency */
+	unsigned lifetime;	/* typical steps until freed */
+};
+
+static const struct km5site km5sites[] = {
+	{ 16,   20,   4 },	/* iovecs, small strings */
+	{ 24,   15,  64 },	/* arrays */
+	{ 48,   12,  16 },	/* path components */
+	{ 96,    8, 200 },	/* vnodes, open files */
+	{ 200,   6, 300 },	/* fs-specific vnodes */
+	{ 400,   4,  32 },	/* threads, proc bits */
+	{ 1024,  3,   2 },	/* PATH_MAX buffers */
+	{ 2000,  1,   8 },	/* odd large structures */
+	{ 4096,  1,  40 },	/* a whole page */
+};
+
+struct km5slot {
+	void *ptr;
+	size_t size;
+};
+
+static struct km5slot *km5rings[KM5_MAXCPUS];
+static volatile size_t km5asked[KM5_MAXCPUS];
+static unsigned km5nthreads;
+static struct semaphore *km5gosem, *km5donesem;
+
+/* samples, collected by thread 0 */
+static unsigned km5nsamples;
+static uint64_t km5inuse, km5total, km5requested;
+
+static
+void
+km5sample(void)
+{
+	size_t inuse, total, asked;
+	unsigned i;
+
+	kheap_getusage(&inuse, &total);
+	asked = 0;
+	for (i=0; i<km5nthreads; i++) {
+		asked += km5asked[i];
+	}
+	km5inuse += inuse;
+	km5total += total;
+	km5requested += asked;
+	km5nsamples++;
+}
+
+static
+void
+km5thread(void *junk, unsigned long num)
+{
+	struct xrand xr;
+	struct km5slot *ring, *slot;
+	unsigned totweight, step, pick, i, life, pos;
+	size_t size;
+
+	(void)junk;
+
+	if (thread_setaffinity(CPUMASK(num))) {
+		panic("km5: thread_setaffinity failed\n");
+	}
+	xrand_seed(&xr, num + 1);
+	ring = km5rings[num];
+
+	totweight = 0;
+	for (i=0; i<ARRAYCOUNT(km5sites); i++) {
+		totweight += km5sites[i].weight;
+	}
+
+	P(km5gosem);
+
+	for (step=0; step<KM5_STEPS; step++) {
+		/* free whatever was due now */
+		slot = &ring[step % KM5_RING];
+		if (slot->ptr != NULL) {
+			kfree(slot->ptr);
+			km5asked[num] -= slot->size;
+			slot->ptr = NULL;
+		}
+
+		/* pick a site */
+		pick = xrand(&xr) % totweight;
+		for (i=0; pick >= km5sites[i].weight; i++) {
+			pick -= km5sites[i].weight;
+		}
+
+		/* vary the size and lifetime by up to half either way */
+		size = km5sites[i].size / 2 +
+			xrand(&xr) % (km5sites[i].size + 1);
+		life = km5sites[i].lifetime / 2 +
+			xrand(&xr) % (km5sites[i].lifetime + 1);
+		if (life < 1) {
+			life = 1;
+		}
+		if (life >= KM5_RING) {
+			life = KM5_RING - 1;
+		}
+
+		/* find a free slot at or after the due step */
+		pos = (step + life) % KM5_RING;
+		while (ring[pos].ptr != NULL) {
+			pos = (pos + 1) % KM5_RING;
+		}
+
+		ring[pos].ptr = kmalloc(size);
+		if (ring[pos].ptr == NULL) {
+			panic("km5: thread %lu: kmalloc(%zu) failed\n",
+			      num, size);
+		}
+		ring[pos].size = size;
+		km5asked[num] += size;
+
+		if (num == 0 && step % KM5_SAMPLE == 0) {
+			km5sample();
+		}
+	}
+
+	for (i=0; i<KM5_RING; i++) {
+		if (ring[i].ptr != NULL) {
+			kfree(ring[i].ptr);
+			km5asked[num] -= ring[i].size;
+			ring[i].ptr = NULL;
+		}
+	}
+
+	V(km5donesem);
+}
+
+/*
+ * Run the trace on NTHREADS cpus and print the results.
+ */
+static
+void
+km5run(unsigned nthreads)
+{
+	struct timespec start, end;
+	uint64_t acq0, spins0, acq1, spins1, ns, rate;
+	unsigned i, used, asked;
+	int result;
+
+	km5nthreads = nthreads;
+	km5nsamples = 0;
+	km5inuse = km5total = km5requested = 0;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("km5", NULL, km5thread, NULL, i);
+		if (result) {
+			panic("km5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	kheap_getlockstat(&acq0, &spins0);
+	gettime(&start);
+	for (i=0; i<nthreads; i++) {
+		V(km5gosem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(km5donesem);
+	}
+	gettime(&end);
+	kheap_getlockstat(&acq1, &spins1);
+
+	timespec_sub(&end, &start, &end);
+	ns = end.tv_sec * 1000000000ULL + end.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	rate = (uint64_t)KM5_STEPS * nthreads * 1000000000ULL / ns;
+
+	/* in tenths of a percent */
+	used = asked = 0;
+	if (km5total > 0) {
+		used = km5inuse * 1000 / km5total;
+		asked = km5requested * 1000 / km5total;
+	}
+
+	kprintf("km5: cpus=%u allocs/s=%llu used=%u.%u%% "
+		"requested=%u.%u%%", nthreads, (unsigned long long)rate,
+		used / 10, used % 10, asked / 10, asked % 10);
+	if (acq1 > acq0) {
+		kprintf(" spins/acquire=%llu.%02llu",
+			(unsigned long long)((spins1 - spins0) /
+					     (acq1 - acq0)),
+			(unsigned long long)((spins1 - spins0) * 100 /
+					     (acq1 - acq0) % 100));
+	}
+	kprintf("\n");
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	unsigned ncpus, n, i;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = thread_numcpus();
+	if (ncpus > KM5_MAXCPUS) {
+		ncpus = KM5_MAXCPUS;
+	}
+
+	kprintf("Starting kmalloc trace benchmark...\n");
+
+	km5gosem = sem_create("km5go", 0);
+	km5donesem = sem_create("km5done", 0);
+	if (km5gosem == NULL || km5donesem == NULL) {
+		panic("km5: sem_create failed\n");
+	}
+	for (i=0; i<ncpus; i++) {
+		km5rings[i] = kmalloc(KM5_RING * sizeof(struct km5slot));
+		if (km5rings[i] == NULL) {
+			panic("km5: out of memory\n");
+		}
+		bzero(km5rings[i], KM5_RING * sizeof(struct km5slot));
+		km5asked[i] = 0;
+	}
+
+	for (n=1; n<=ncpus; n*=2) {
+		km5run(n);
+		if (n < ncpus && n * 2 > ncpus) {
+			km5run(ncpus);
+		}
+	}
+
+	for (i=0; i<ncpus; i++) {
+		kfree(km5rings[i]);
+		km5rings[i] = NULL;
+	}
+	sem_destroy(km5gosem);
+	sem_destroy(km5donesem);
+
+	kprintf("kmalloc trace benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Check the heap accounting in kheaptag.h: a tag's counts should go
+ * up by at least what we ask for, and come back down when we free.
+ */
+
+#define KM6_NUM 64
+
+/* Tags can't be removed, so we set ours up once and keep it. */
+static struct kheap_tag km6tag;
+static bool km6tagready;
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	static const size_t sizes[] = { 1, 16, 17, 100, 2000, 3 * PAGE_SIZE };
+	void *ptrs[KM6_NUM];
+	unsigned objects0, bytes0, objects, bytes, asked, i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc accounting test...\n");
+
+	if (!km6tagready) {
+		kheap_tag_init(&km6tag, "km6");
+		if (!km6tag.kt_ready) {
+			kprintf("km6: No counters for the tag\n");
+			return ENOSPC;
+		}
+		km6tagready = true;
+	}
+	objects0 = percpu_counter_read(&km6tag.kt_objects);
+	bytes0 = percpu_counter_read(&km6tag.kt_bytes);
+
+	asked = 0;
+	for (i=0; i<KM6_NUM; i++) {
+		ptrs[i] = kmalloc_tagged(sizes[i % ARRAYCOUNT(sizes)], &km6tag);
+		if (ptrs[i] == NULL) {
+			panic("km6: kmalloc_tagged failed\n");
+		}
+		asked += sizes[i % ARRAYCOUNT(sizes)];
+	}
+
+	objects = percpu_counter_read(&km6tag.kt_objects) - objects0;
+	bytes = percpu_counter_read(&km6tag.kt_bytes) - bytes0;
+	kprintf("km6: %u objects, %u bytes for %u asked\n",
+		objects, bytes, asked);
+	if (objects != KM6_NUM || bytes < asked) {
+		panic("km6: Wrong counts\n");
+	}
+	kheap_printtags(5);
+
+	for (i=0; i<KM6_NUM; i++) {
+		kfree_tagged(ptrs[i], sizes[i % ARRAYCOUNT(sizes)], &km6tag);
+	}
+	if (percpu_counter_read(&km6tag.kt_objects) != objects0 ||
+	    percpu_counter_read(&km6tag.kt_bytes) != bytes0) {
+		panic("km6: Counts not back where they started\n");
+	}
+
+	kprintf("kmalloc accounting test done\n");
+	return 0;
+}
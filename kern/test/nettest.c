@@ -28,17 +28,202 @@
  */
 
 /*
- * Network test code.
+ * Network test code: a datagram request/response benchmark.
+ *
+ *    net                          show the interface and its counters
+ *    net echo [port [secs]]       answer requests, until none come
+ *                                 for SECS seconds
+ *    net rr addr [port [count [size]]]
+ *                                 send COUNT requests of SIZE bytes to
+ *                                 the echo server at ADDR, each waiting
+ *                                 for its reply, and report round trips
  */
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
+#include <clock.h>
+#include <net.h>
 #include <test.h>
 
+#define NETTEST_PORT	7
+#define NETTEST_IDLE	10	/* seconds */
+#define NETTEST_COUNT	1000
+#define NETTEST_SIZE	64
+#define NETTEST_WAIT	1	/* seconds to wait for a reply */
+
+static char nettest_buf[DGRAM_MAX];
+
+static
+void
+nettest_stats(struct netif *nif)
+{
+	kprintf("%s: address %u\n", nif->if_name, nif->if_addr);
+	kprintf("    %u packets in, %u errors, %u dropped\n",
+		nif->if_ipackets, nif->if_ierrors, nif->if_iqdrops);
+	kprintf("    %u packets out\n", nif->if_opackets);
+}
+
+static
+int
+nettest_echo(uint16_t port, unsigned idle)
+{
+	struct dgsock *ds;
+	struct timespec wait;
+	uint16_t from, fromport;
+	size_t len;
+	unsigned count;
+	int result;
+
+	result = dgsock_open(port, &ds);
+	if (result) {
+		kprintf("net: port %u: %s\n", port, strerror(result));
+		return result;
+	}
+	kprintf("net: echoing on port %u\n", port);
+
+	wait.tv_sec = idle;
+	wait.tv_nsec = 0;
+	count = 0;
+	while (1) {
+		result = dgsock_recvfrom(ds, nettest_buf, sizeof(nettest_buf),
+					 &len, &from, &fromport, &wait);
+		if (result) {
+			break;
+		}
+		result = dgsock_sendto(ds, from, fromport, nettest_buf, len);
+		if (result) {
+			kprintf("net: reply to %u: %s\n", from,
+				strerror(result));
+			break;
+		}
+		count++;
+	}
+	if (result == ETIMEDOUT) {
+		result = 0;
+	}
+	kprintf("net: answered %u requests\n", count);
+	dgsock_close(ds);
+	return result;
+}
+
+static
+int
+nettest_rr(uint16_t addr, uint16_t port, unsigned count, size_t size)
+{
+	struct dgsock *ds;
+	struct timespec wait, start, end, total;
+	uint64_t nsecs, minns, maxns, sumns;
+	uint16_t from, fromport;
+	size_t len;
+	unsigned i, seq, ok, lost;
+	int result;
+
+	if (size > DGRAM_MAX || size < sizeof(uint32_t)) {
+		kprintf("net: size must be %u to %u\n",
+			(unsigned)sizeof(uint32_t), (unsigned)DGRAM_MAX);
+		return EINVAL;
+	}
+	result = dgsock_open(0, &ds);
+	if (result) {
+		kprintf("net: dgsock_open: %s\n", strerror(result));
+		return result;
+	}
+
+	wait.tv_sec = NETTEST_WAIT;
+	wait.tv_nsec = 0;
+	memset(nettest_buf, 'x', size);
+	ok = lost = 0;
+	minns = ~(uint64_t)0;
+	maxns = sumns = 0;
+
+	gettime(&total);
+	for (i=0; i<count; i++) {
+		/* number the requests so a late reply isn't miscounted */
+		memcpy(nettest_buf, &i, sizeof(i));
+
+		gettime(&start);
+		result = dgsock_sendto(ds, addr, port, nettest_buf, size);
+		if (result) {
+			kprintf("net: sendto: %s\n", strerror(result));
+			break;
+		}
+		do {
+			result = dgsock_recvfrom(ds, nettest_buf,
+						 sizeof(nettest_buf), &len,
+						 &from, &fromport, &wait);
+			seq = i + 1;
+			if (result == 0 && len >= sizeof(seq)) {
+				memcpy(&seq, nettest_buf, sizeof(seq));
+			}
+		} while (result == 0 && seq != i);
+		gettime(&end);
+		if (result == ETIMEDOUT) {
+			lost++;
+			continue;
+		}
+		if (result) {
+			kprintf("net: recvfrom: %s\n", strerror(result));
+			break;
+		}
+
+		timespec_sub(&end, &start, &end);
+		nsecs = (uint64_t)end.tv_sec * 1000000000 + end.tv_nsec;
+		if (nsecs < minns) {
+			minns = nsecs;
+		}
+		if (nsecs > maxns) {
+			maxns = nsecs;
+		}
+		sumns += nsecs;
+		ok++;
+	}
+	gettime(&end);
+	timespec_sub(&end, &total, &total);
+	dgsock_close(ds);
+
+	kprintf("net: %u requests of %u bytes to %u port %u: "
+		"%u answered, %u lost\n",
+		i, (unsigned)size, addr, port, ok, lost);
+	if (ok > 0) {
+		kprintf("net: round trip min %llu avg %llu max %llu us\n",
+			minns / 1000, sumns / ok / 1000, maxns / 1000);
+		kprintf("net: %llu requests/sec\n",
+			ok * 1000000000ULL /
+			((uint64_t)total.tv_sec * 1000000000 +
+			 total.tv_nsec + 1));
+	}
+	return result == ETIMEDOUT ? 0 : result;
+}
+
 int
 nettest(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
-	kprintf("No network support available\n");
-	return 1;
+	struct netif *nif;
+	unsigned port, count, size;
+
+	nif = net_getif();
+	if (nif == NULL) {
+		kprintf("net: No network interface\n");
+		return ENETDOWN;
+	}
+
+	if (nargs == 1) {
+		nettest_stats(nif);
+		return 0;
+	}
+	port = nargs > 2 ? atoi(args[2]) : NETTEST_PORT;
+	if (!strcmp(args[1], "echo") && nargs <= 4) {
+		return nettest_echo(port,
+				    nargs > 3 ? atoi(args[3]) : NETTEST_IDLE);
+	}
+	if (!strcmp(args[1], "rr") && nargs >= 3 && nargs <= 6) {
+		port = nargs > 3 ? atoi(args[3]) : NETTEST_PORT;
+		count = nargs > 4 ? atoi(args[4]) : NETTEST_COUNT;
+		size = nargs > 5 ? atoi(args[5]) : NETTEST_SIZE;
+		return nettest_rr(atoi(args[2]), port, count, size);
+	}
+	kprintf("Usage: net [echo [port [secs]] | "
+		"rr addr [port [count [size]]]]\n");
+	return EINVAL;
 }
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Test code for the lock-free ring.
+ *
+ * First the basics in one thread; then a producer thread feeding
+ * the menu thread (single producer) and several producer threads at
+ * once (ring_put_mp), checking that each producer's items arrive in
+ * order and none are lost, and reporting items per second. When the
+ * ring is full or empty the waiting side yields, so this works on
+ * one cpu as well as several.
+ */
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <ring.h>
+#include <test.h>
+
+#define RT_SMALL	8
+#define RT_SIZE		256
+#define RT_ITEMS	200000
+#define RT_PRODUCERS	4
+
+/* Items are nonzero: producer number in the top byte, count below */
+#define RT_ITEM(p, n)	((void *)(((p) << 24) | ((n) + 1)))
+#define RT_PROD(v)	((uintptr_t)(v) >> 24)
+#define RT_SEQ(v)	(((uintptr_t)(v) & 0xffffff) - 1)
+
+static struct ring *rt_ring;
+static struct semaphore *rt_donesem;
+
+static
+void
+rt_basic(void)
+{
+	struct ring *r;
+	void *item;
+	unsigned i;
+
+	r = ring_create(RT_SMALL);
+	if (r == NULL) {
+		panic("ringtest: ring_create failed\n");
+	}
+
+	KASSERT(ring_count(r) == 0);
+	KASSERT(!ring_get(r, &item));
+	for (i=0; i<RT_SMALL; i++) {
+		KASSERT(ring_put(r, RT_ITEM(0, i)));
+	}
+	KASSERT(ring_count(r) == RT_SMALL);
+	KASSERT(!ring_put(r, RT_ITEM(0, i)));
+	KASSERT(!ring_put_mp(r, RT_ITEM(0, i)));
+
+	/* go around a few times, half full */
+	for (i=0; i<RT_SMALL/2; i++) {
+		KASSERT(ring_get(r, &item));
+		KASSERT(item == RT_ITEM(0, i));
+	}
+	for (i=RT_SMALL; i<RT_SMALL*4; i++) {
+		KASSERT(ring_put_mp(r, RT_ITEM(0, i)));
+		KASSERT(ring_get(r, &item));
+		KASSERT(item == RT_ITEM(0, i - RT_SMALL/2));
+	}
+	while (ring_get(r, &item)) {
+		/* nothing */
+	}
+	KASSERT(ring_count(r) == 0);
+
+	ring_destroy(r);
+	kprintf("ringtest: basic tests passed\n");
+}
+
+static
+void
+rt_producer(void *junk, unsigned long num)
+{
+	unsigned long n, count;
+	bool mp;
+
+	(void)junk;
+	mp = num > 0;
+	count = mp ? RT_ITEMS / RT_PRODUCERS : RT_ITEMS;
+	for (n=0; n<count; n++) {
+		while (!(mp ? ring_put_mp(rt_ring, RT_ITEM(num, n)) :
+			 ring_put(rt_ring, RT_ITEM(num, n)))) {
+			thread_yield();
+		}
+	}
+	V(rt_donesem);
+}
+
+/*
+ * Start NPROD producers (numbered from 1 if they're to use
+ * ring_put_mp, else just number 0), take everything, and report.
+ */
+static
+void
+rt_run(const char *name, unsigned nprod, bool mp)
+{
+	unsigned long next[RT_PRODUCERS + 1];
+	struct timespec start, end;
+	uint64_t nsecs;
+	unsigned i, total, p;
+	void *item;
+	int result;
+
+	rt_ring = ring_create(RT_SIZE);
+	if (rt_ring == NULL) {
+		panic("ringtest: ring_create failed\n");
+	}
+	for (i=0; i<=RT_PRODUCERS; i++) {
+		next[i] = 0;
+	}
+
+	gettime(&start);
+	for (i=0; i<nprod; i++) {
+		result = thread_fork("ringtest", NULL, rt_producer, NULL,
+				     mp ? i + 1 : 0);
+		if (result) {
+			panic("ringtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	total = mp ? (RT_ITEMS / RT_PRODUCERS) * nprod : RT_ITEMS;
+	for (i=0; i<total; i++) {
+		while (!ring_get(rt_ring, &item)) {
+			thread_yield();
+		}
+		p = RT_PROD(item);
+		KASSERT(p <= RT_PRODUCERS);
+		if (RT_SEQ(item) != next[p]) {
+			panic("ringtest: producer %u: got item %lu, "
+			      "expected %lu\n", p,
+			      (unsigned long)RT_SEQ(item), next[p]);
+		}
+		next[p]++;
+	}
+	gettime(&end);
+
+	for (i=0; i<nprod; i++) {
+		P(rt_donesem);
+	}
+	KASSERT(!ring_get(rt_ring, &item));
+	ring_destroy(rt_ring);
+	rt_ring = NULL;
+
+	timespec_sub(&end, &start, &end);
+	nsecs = (uint64_t)end.tv_sec * 1000000000 + end.tv_nsec;
+	kprintf("ringtest: %s: %u items in %llu us, %llu items/sec\n",
+		name, total, nsecs / 1000,
+		total * 1000000000ULL / (nsecs + 1));
+}
+
+int
+ringtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	rt_donesem = sem_create("ringtest", 0);
+	if (rt_donesem == NULL) {
+		panic("ringtest: sem_create failed\n");
+	}
+
+	rt_basic();
+	rt_run("single producer", 1, false);
+	rt_run("many producers", RT_PRODUCERS, true);
+
+	sem_destroy(rt_donesem);
+	kprintf("ringtest done\n");
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Tests for the word-at-a-time string functions in common/libc.
+ *
+ * str1 checks strlen, strcmp, and strchr against plain byte loops on
+ * strings of every alignment and a range of lengths, with bytes of
+ * both signs. str2 times the two against each other.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <test.h>
+
+#define ST_MAXLEN	80
+#define ST_ALIGNS	8
+#define ST_BENCHLEN	256
+#define ST_BENCHREPS	20000
+#define ST_BUFSIZE	(ST_BENCHLEN + 8)	/* >= ST_MAXLEN + 2*ST_ALIGNS */
+
+static char st_a[ST_BUFSIZE], st_b[ST_BUFSIZE];
+static uint32_t st_seed;
+
+/*
+ * Cheap deterministic pseudo-random numbers, so failures repeat.
+ */
+static
+uint32_t
+st_rand(void)
+{
+	st_seed = st_seed * 1103515245 + 12345;
+	return st_seed >> 8;
+}
+
+/*
+ * The byte loops to check against (and race).
+ */
+static
+size_t
+ref_strlen(const char *s)
+{
+	size_t i;
+
+	for (i=0; s[i]; i++) {
+		/* nothing */
+	}
+	return i;
+}
+
+static
+int
+ref_strcmp(const char *a, const char *b)
+{
+	size_t i;
+
+	for (i=0; a[i]!=0 && a[i]==b[i]; i++) {
+		/* nothing */
+	}
+	if ((unsigned char)a[i] > (unsigned char)b[i]) {
+		return 1;
+	}
+	else if (a[i] == b[i]) {
+		return 0;
+	}
+	return -1;
+}
+
+static
+char *
+ref_strchr(const char *s, int ch_arg)
+{
+	const char ch = ch_arg;
+
+	for (; *s != ch; s++) {
+		if (*s == 0) {
+			return NULL;
+		}
+	}
+	return (char *)s;
+}
+
+static
+int
+st_sign(int x)
+{
+	return x > 0 ? 1 : x < 0 ? -1 : 0;
+}
+
+/*
+ * Fill BUF+OFF with a LEN-byte string (nonzero bytes from 1 to
+ * RANGE) and its terminator, and the rest of BUF with junk that
+ * mustn't be looked at.
+ */
+static
+void
+st_fill(char *buf, unsigned off, unsigned len, unsigned range)
+{
+	unsigned i;
+
+	for (i=0; i<ST_BUFSIZE; i++) {
+		buf[i] = 1 + st_rand() % 255;
+	}
+	for (i=0; i<len; i++) {
+		buf[off + i] = 1 + st_rand() % range;
+	}
+	buf[off + len] = 0;
+}
+
+int
+strtest(int nargs, char **args)
+{
+	unsigned oa, ob, len, i, ch, errors;
+	char *a, *b;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Testing strlen, strcmp, strchr...\n");
+	st_seed = 1;
+	errors = 0;
+
+	for (oa = 0; oa < ST_ALIGNS; oa++) {
+		for (len = 0; len <= ST_MAXLEN; len++) {
+			a = st_a + oa;
+			st_fill(st_a, oa, len, len % 2 ? 3 : 255);
+
+			if (strlen(a) != len) {
+				kprintf("str1: strlen +%u len %u: got %u\n",
+					oa, len, (unsigned)strlen(a));
+				errors++;
+			}
+
+			for (i=0; i<4; i++) {
+				ch = i == 0 ? 0 : i == 3 ? 0x80 + oa :
+					len == 0 ? 1 :
+					(unsigned char)a[st_rand() % len];
+				if (strchr(a, ch) != ref_strchr(a, ch)) {
+					kprintf("str1: strchr +%u len %u "
+						"ch %u: wrong\n", oa, len, ch);
+					errors++;
+				}
+			}
+
+			for (ob = 0; ob < ST_ALIGNS; ob++) {
+				/* same string, then one byte changed */
+				st_fill(st_b, ob, len, 255);
+				b = st_b + ob;
+				memcpy(b, a, len + 1);
+				for (i=0; i<2; i++) {
+					if (st_sign(strcmp(a, b)) !=
+					    ref_strcmp(a, b) ||
+					    st_sign(strcmp(b, a)) !=
+					    ref_strcmp(b, a)) {
+						kprintf("str1: strcmp +%u +%u "
+							"len %u: wrong\n",
+							oa, ob, len);
+						errors++;
+					}
+					if (len == 0) {
+						break;
+					}
+					ch = 1 + st_rand() % 255;
+					b[st_rand() % len] = ch;
+				}
+			}
+		}
+	}
+
+	if (errors > 0) {
+		kprintf("str1: %u errors\n", errors);
+		return EINVAL;
+	}
+	kprintf("str1: passed\n");
+	return 0;
+}
+
+/*
+ * Time ST_BENCHREPS runs of one function, by name, over ST_BENCHLEN
+ * byte strings, and report the rate.
+ */
+static
+void
+st_time(const char *name, int which, int ref)
+{
+	struct timespec start, end, diff;
+	uint64_t nsecs, rate;
+	volatile unsigned sink = 0;
+	unsigned i;
+
+	gettime(&start);
+	for (i=0; i<ST_BENCHREPS; i++) {
+		switch (which) {
+		    case 0:
+			sink += ref ? ref_strlen(st_a) : strlen(st_a);
+			break;
+		    case 1:
+			sink += ref ? ref_strcmp(st_a, st_b) :
+				strcmp(st_a, st_b);
+			break;
+		    default:
+			sink += (ref ? ref_strchr(st_a, '/') :
+				 strchr(st_a, '/')) != NULL;
+			break;
+		}
+	}
+	gettime(&end);
+	(void)sink;
+
+	timespec_sub(&end, &start, &diff);
+	nsecs = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	rate = nsecs == 0 ? 0 :
+		(uint64_t)ST_BENCHREPS * ST_BENCHLEN * 1000 / nsecs;
+	kprintf("   %-6s %s: %llu.%03u sec, %llu MB/s\n",
+		name, ref ? "bytes" : "words",
+		(unsigned long long)diff.tv_sec,
+		(unsigned)(diff.tv_nsec / 1000000),
+		(unsigned long long)rate);
+}
+
+int
+strbench(int nargs, char **args)
+{
+	static const char *const names[] = { "strlen", "strcmp", "strchr" };
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	/* aligned strings with no '/'; strcmp runs to the end */
+	for (i=0; i<ST_BENCHLEN; i++) {
+		st_a[i] = 'a' + i % 26;
+	}
+	st_a[ST_BENCHLEN] = 0;
+	memcpy(st_b, st_a, ST_BENCHLEN + 1);
+
+	kprintf("String function benchmark (%u runs of %u bytes)\n",
+		ST_BENCHREPS, ST_BENCHLEN);
+	for (i=0; i<3; i++) {
+		st_time(names[i], i, 1);
+		st_time(names[i], i, 0);
+	}
+	kprintf("str2: done\n");
+	return 0;
+}
@@ -32,9 +32,12 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <threadprivate.h>
 #include <synch.h>
 #include <test.h>
 
@@ -399,3 +402,635 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// reader-writer lock test
+
+#define NRWLOOPS      200
+
+static struct rwlock *testrwlock;
+static struct spinlock rwtest_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwtest_readers;	/* readers inside now */
+static volatile unsigned rwtest_maxreaders;	/* most ever at once */
+static volatile bool rwtest_writing;
+static volatile bool rwtest_failed;
+
+static
+void
+rwtest_fail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwtest_failed = true;
+}
+
+/*
+ * Every fourth thread writes; the rest read. Writers set the testvals
+ * to match each other, yielding in the middle; readers check that
+ * they see matching values and no writer.
+ */
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long val;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrwlock);
+			KASSERT(rwlock_do_i_hold_write(testrwlock));
+			spinlock_acquire(&rwtest_lock);
+			if (rwtest_readers > 0 || rwtest_writing) {
+				rwtest_fail(num, "writer not alone");
+			}
+			rwtest_writing = true;
+			spinlock_release(&rwtest_lock);
+
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+
+			spinlock_acquire(&rwtest_lock);
+			rwtest_writing = false;
+			if (i % 2 == 0) {
+				/* no writer may get in on the downgrade */
+				rwtest_readers++;
+			}
+			spinlock_release(&rwtest_lock);
+			if (i % 2 == 1) {
+				rwlock_release_write(testrwlock);
+				continue;
+			}
+
+			rwlock_downgrade(testrwlock);
+			KASSERT(!rwlock_do_i_hold_write(testrwlock));
+			thread_yield();
+			if (testval1 != num || testval2 != num*num) {
+				rwtest_fail(num, "write lost on downgrade");
+			}
+			spinlock_acquire(&rwtest_lock);
+			rwtest_readers--;
+			spinlock_release(&rwtest_lock);
+			rwlock_release_read(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			KASSERT(rwlock_do_i_hold(testrwlock));
+			KASSERT(!rwlock_do_i_hold_write(testrwlock));
+			spinlock_acquire(&rwtest_lock);
+			if (rwtest_writing) {
+				rwtest_fail(num, "reader ran with a writer");
+			}
+			rwtest_readers++;
+			if (rwtest_readers > rwtest_maxreaders) {
+				rwtest_maxreaders = rwtest_readers;
+			}
+			spinlock_release(&rwtest_lock);
+
+			val = testval1;
+			thread_yield();
+			if (testval2 != val*val || testval1 != val) {
+				rwtest_fail(num, "testval mismatch");
+			}
+
+			spinlock_acquire(&rwtest_lock);
+			rwtest_readers--;
+			spinlock_release(&rwtest_lock);
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrwlock == NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	testval1 = testval2 = 0;
+	rwtest_readers = rwtest_maxreaders = 0;
+	rwtest_writing = rwtest_failed = false;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Up to %u readers at once\n", rwtest_maxreaders);
+	if (rwtest_maxreaders < 2) {
+		kprintf("Readers never shared the lock\n");
+		rwtest_failed = true;
+	}
+	kprintf("rwlock test %s.\n", rwtest_failed ? "FAILED" : "done");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// timed wait test
+
+#define TIMEDSTEP_NS	10000000	/* 10 ms */
+
+static volatile bool timedtest_failed;
+static volatile bool timedtest_signalled;
+
+/*
+ * Wait on testcv, which nobody signals, for (num % 8 + 1) steps, and
+ * check that we time out no sooner than asked.
+ */
+static
+void
+timedthread(void *junk, unsigned long num)
+{
+	struct timespec delay, start, end, took;
+	int result;
+
+	(void)junk;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = (num % 8 + 1) * TIMEDSTEP_NS;
+
+	lock_acquire(testlock);
+	gettime(&start);
+	result = cv_wait_timeout(testcv, testlock, &delay);
+	gettime(&end);
+	KASSERT(lock_do_i_hold(testlock));
+	lock_release(testlock);
+
+	timespec_sub(&end, &start, &took);
+	if (result != ETIMEDOUT) {
+		kprintf("thread %lu: woke without a signal\n", num);
+		timedtest_failed = true;
+	}
+	else if (took.tv_sec == 0 && took.tv_nsec < delay.tv_nsec) {
+		kprintf("thread %lu: timed out early (%lu ns of %lu)\n", num,
+			(unsigned long)took.tv_nsec,
+			(unsigned long)delay.tv_nsec);
+		timedtest_failed = true;
+	}
+	V(donesem);
+}
+
+/*
+ * Wait on testcv for a long time; the main thread signals us.
+ */
+static
+void
+timedsignalthread(void *junk, unsigned long num)
+{
+	struct timespec delay;
+	int result = 0;
+
+	(void)junk;
+	(void)num;
+
+	delay.tv_sec = 10;
+	delay.tv_nsec = 0;
+
+	lock_acquire(testlock);
+	V(donesem);
+	while (!timedtest_signalled && result == 0) {
+		result = cv_wait_timeout(testcv, testlock, &delay);
+	}
+	lock_release(testlock);
+	if (result != 0) {
+		kprintf("Signalled waiter timed out\n");
+		timedtest_failed = true;
+	}
+	V(donesem);
+}
+
+/*
+ * Try for testlock, which the main thread is holding.
+ */
+static
+void
+timedlockthread(void *junk, unsigned long num)
+{
+	struct timespec delay;
+
+	(void)junk;
+	(void)num;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = 5 * TIMEDSTEP_NS;
+	if (lock_acquire_timeout(testlock, &delay) != ETIMEDOUT) {
+		kprintf("Got a lock that was held\n");
+		timedtest_failed = true;
+		lock_release(testlock);
+	}
+	V(donesem);
+}
+
+int
+timedtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	timedtest_failed = timedtest_signalled = false;
+
+	kprintf("Starting timed wait test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("timedtest", NULL, timedthread, NULL, i);
+		if (result) {
+			panic("timedtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	result = thread_fork("timedtest", NULL, timedsignalthread, NULL, 0);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	P(donesem);
+	lock_acquire(testlock);
+	timedtest_signalled = true;
+	cv_signal(testcv, testlock);
+	lock_release(testlock);
+	P(donesem);
+
+	lock_acquire(testlock);
+	result = thread_fork("timedtest", NULL, timedlockthread, NULL, 0);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	P(donesem);
+	lock_release(testlock);
+
+	kprintf("Timed wait test %s.\n",
+		timedtest_failed ? "FAILED" : "done");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Lock contention benchmark: threads take turns at a short critical
+ * section, first under testlock, which spins while the holder runs,
+ * then under a semaphore used as a mutex, which always sleeps. The
+ * difference is what the adaptive lock saves.
+ */
+
+#define NBENCHTHREADS	8
+#define NBENCHLOOPS	2000
+#define BENCHWORK	50
+
+static volatile unsigned long benchcount;
+static struct semaphore *benchsem;
+
+static
+void
+benchwork(void)
+{
+	unsigned i;
+
+	for (i=0; i<BENCHWORK; i++) {
+		benchcount++;
+	}
+}
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(testlock);
+		benchwork();
+		lock_release(testlock);
+	}
+	V(donesem);
+}
+
+static
+void
+sembenchthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		P(benchsem);
+		benchwork();
+		V(benchsem);
+	}
+	V(donesem);
+}
+
+/*
+ * Run NBENCHTHREADS copies of FUNC and report how long they took.
+ * EXPECT is what benchcount should come to. Also report the gap
+ * between the first and last threads finishing: if threads are
+ * served fairly they all finish at about the same time, while if
+ * one can keep getting the lock back it finishes long before the
+ * others. Compare with "handoff on" and "handoff off".
+ */
+static
+void
+lockbench_run(const char *name, void (*func)(void *, unsigned long),
+	      unsigned long expect)
+{
+	struct timespec start, first, end;
+	uint64_t ns;
+	int i, result;
+
+	benchcount = 0;
+	gettime(&start);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("lockbench", NULL, func, NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(donesem);
+		if (i == 0) {
+			gettime(&first);
+		}
+	}
+	gettime(&end);
+
+	timespec_sub(&end, &first, &first);
+	timespec_sub(&end, &start, &end);
+	ns = end.tv_sec * 1000000000ULL + end.tv_nsec;
+	kprintf("%s: %llu.%09lu seconds, %lu ns per acquire\n", name,
+		(unsigned long long)end.tv_sec, (unsigned long)end.tv_nsec,
+		(unsigned long)(ns / (NBENCHTHREADS * NBENCHLOOPS)));
+	kprintf("%s: last thread finished %llu.%09lu seconds after first\n",
+		name, (unsigned long long)first.tv_sec,
+		(unsigned long)first.tv_nsec);
+	if (benchcount != expect) {
+		kprintf("%s: lost updates (%lu)\n", name, benchcount);
+	}
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+
+	kprintf("Starting lock contention benchmark...\n");
+	lockbench_run("lock", lockbenchthread,
+		      NBENCHTHREADS * NBENCHLOOPS * BENCHWORK);
+
+	benchsem = sem_create("benchsem", 1);
+	if (benchsem == NULL) {
+		panic("lockbench: sem_create failed\n");
+	}
+	lockbench_run("semaphore", sembenchthread,
+		      NBENCHTHREADS * NBENCHLOOPS * BENCHWORK);
+	sem_destroy(benchsem);
+	benchsem = NULL;
+
+	kprintf("Lock contention benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Reader-writer lock benchmark: the same threads, but one pass in
+ * RWBENCHWRITES updates benchcount and the rest only read it. Under
+ * testrwlock the readers can overlap; under testlock they can't.
+ */
+
+#define RWBENCHWRITES	16
+
+static
+void
+benchread(void)
+{
+	unsigned long total = 0;
+	unsigned i;
+
+	for (i=0; i<BENCHWORK; i++) {
+		total += benchcount;
+	}
+	(void)total;
+}
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		if (i % RWBENCHWRITES == 0) {
+			rwlock_acquire_write(testrwlock);
+			benchwork();
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			benchread();
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwlockbenchthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(testlock);
+		if (i % RWBENCHWRITES == 0) {
+			benchwork();
+		}
+		else {
+			benchread();
+		}
+		lock_release(testlock);
+	}
+	V(donesem);
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	unsigned long expect;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrwlock == NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("rwbench: rwlock_create failed\n");
+		}
+	}
+
+	expect = NBENCHTHREADS * DIVROUNDUP(NBENCHLOOPS, RWBENCHWRITES) *
+		BENCHWORK;
+
+	kprintf("Starting rwlock contention benchmark...\n");
+	lockbench_run("rwlock", rwbenchthread, expect);
+	lockbench_run("lock", rwlockbenchthread, expect);
+	kprintf("Rwlock contention benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Spinlock benchmark: one thread pinned to each cpu takes the same
+ * spinlock over and over for SPINBENCH_SECS, first as a test-and-set
+ * lock and then as a FIFO lock. Reports the total acquisitions and
+ * the fewest and most any one cpu got, which shows how fairly the
+ * lock is shared.
+ */
+
+#define SPINBENCH_SECS	2
+#define SPINBENCH_MAXCPUS 32
+
+static struct spinlock spinbench_lock;
+static volatile bool spinbench_go, spinbench_stop;
+static volatile unsigned long spinbench_count[SPINBENCH_MAXCPUS];
+
+static
+void
+spinbenchthread(void *junk, unsigned long num)
+{
+	unsigned long n = 0;
+
+	(void)junk;
+
+	if (thread_setaffinity(CPUMASK(num))) {
+		panic("spinbench: thread_setaffinity failed\n");
+	}
+	V(donesem);
+	while (!spinbench_go) {
+		/* wait for everyone to get into place */
+	}
+	while (!spinbench_stop) {
+		spinlock_acquire(&spinbench_lock);
+		benchcount++;
+		spinlock_release(&spinbench_lock);
+		n++;
+	}
+	spinbench_count[num] = n;
+	V(donesem);
+}
+
+static
+void
+spinbench_run(const char *name, unsigned ncpus)
+{
+	struct timespec delay;
+	unsigned long total, min, max;
+	unsigned i;
+	int result;
+
+	spinbench_go = spinbench_stop = false;
+	benchcount = 0;
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("spinbench", NULL, spinbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		P(donesem);
+	}
+
+	delay.tv_sec = SPINBENCH_SECS;
+	delay.tv_nsec = 0;
+	spinbench_go = true;
+	clocknanosleep(&delay);
+	spinbench_stop = true;
+	for (i=0; i<ncpus; i++) {
+		P(donesem);
+	}
+
+	total = 0;
+	min = max = spinbench_count[0];
+	for (i=0; i<ncpus; i++) {
+		total += spinbench_count[i];
+		if (spinbench_count[i] < min) {
+			min = spinbench_count[i];
+		}
+		if (spinbench_count[i] > max) {
+			max = spinbench_count[i];
+		}
+	}
+	kprintf("%s: %lu acquires, per cpu %lu to %lu\n", name, total,
+		min, max);
+	if (benchcount != total) {
+		kprintf("%s: lost updates (%lu)\n", name, benchcount);
+	}
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned ncpus;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	ncpus = thread_numcpus();
+	if (ncpus > SPINBENCH_MAXCPUS) {
+		ncpus = SPINBENCH_MAXCPUS;
+	}
+
+	kprintf("Starting spinlock benchmark on %u cpus...\n", ncpus);
+	spinlock_init(&spinbench_lock);
+	spinbench_run("test-and-set", ncpus);
+	spinlock_cleanup(&spinbench_lock);
+
+	spinlock_init_fifo(&spinbench_lock);
+	spinbench_run("fifo", ncpus);
+	spinlock_cleanup(&spinbench_lock);
+
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
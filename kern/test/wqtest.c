@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Test code for workqueues.
+ *
+ * One thread per cpu queues a batch of work on its own cpu, and each
+ * item checks that it runs there; then flush_workqueue must wait for
+ * all of it. Then delayed work, cancelling, and work that queues
+ * itself again. Works on one cpu as well as several.
+ */
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <threadprivate.h>
+#include <current.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define WQT_WORKERS	2
+#define WQT_ITEMS	64		/* per cpu */
+#define WQT_REQUEUES	10
+#define WQT_DELAY_NS	50000000	/* 50 ms */
+
+struct wqt_item {
+	struct work wi_work;
+	unsigned wi_cpu;		/* cpu it was queued on */
+	unsigned wi_runs;		/* times it has run */
+};
+
+static struct workqueue *wqt_wq;
+static struct semaphore *wqt_sem;
+static struct wqt_item *wqt_items;
+static struct spinlock wqt_lock = SPINLOCK_INITIALIZER;
+static unsigned wqt_count;
+
+static
+void
+wqt_func(void *arg)
+{
+	struct wqt_item *wi = arg;
+
+	if (curcpu->c_number != wi->wi_cpu) {
+		panic("wqtest: work queued on cpu %u ran on cpu %u\n",
+		      wi->wi_cpu, curcpu->c_number);
+	}
+	/* yield now and then, so the workers overlap */
+	if (wi->wi_runs == 0 && (wi - wqt_items) % 8 == 0) {
+		thread_yield();
+	}
+	spinlock_acquire(&wqt_lock);
+	wi->wi_runs++;
+	wqt_count++;
+	spinlock_release(&wqt_lock);
+}
+
+static
+void
+wqt_queuer(void *junk, unsigned long num)
+{
+	struct wqt_item *wi;
+	unsigned i;
+
+	(void)junk;
+
+	if (thread_setaffinity(CPUMASK(num))) {
+		panic("wqtest: thread_setaffinity failed\n");
+	}
+	for (i=0; i<WQT_ITEMS; i++) {
+		wi = &wqt_items[num * WQT_ITEMS + i];
+		wi->wi_cpu = num;
+		wi->wi_runs = 0;
+		work_init(&wi->wi_work, wqt_func, wi);
+		KASSERT(queue_work(wqt_wq, &wi->wi_work));
+	}
+	V(wqt_sem);
+}
+
+/*
+ * Queue work on every cpu and flush.
+ */
+static
+void
+wqt_percpu(void)
+{
+	unsigned ncpus, i;
+	int result;
+
+	ncpus = thread_numcpus();
+	wqt_items = kmalloc(ncpus * WQT_ITEMS * sizeof(*wqt_items));
+	if (wqt_items == NULL) {
+		panic("wqtest: Out of memory\n");
+	}
+	wqt_count = 0;
+
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("wqtest", NULL, wqt_queuer, NULL, i);
+		if (result) {
+			panic("wqtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		P(wqt_sem);
+	}
+	flush_workqueue(wqt_wq);
+
+	if (wqt_count != ncpus * WQT_ITEMS) {
+		panic("wqtest: %u of %u items ran\n", wqt_count,
+		      ncpus * WQT_ITEMS);
+	}
+	for (i=0; i<ncpus * WQT_ITEMS; i++) {
+		KASSERT(wqt_items[i].wi_runs == 1);
+	}
+	kfree(wqt_items);
+	wqt_items = NULL;
+	kprintf("wqtest: %u items on %u cpus ran where queued\n",
+		ncpus * WQT_ITEMS, ncpus);
+}
+
+static
+void
+wqt_post(void *arg)
+{
+	(void)arg;
+	V(wqt_sem);
+}
+
+/*
+ * Delayed work, and cancelling it.
+ */
+static
+void
+wqt_delayed(void)
+{
+	struct work w;
+	struct timespec delay, start, end;
+
+	work_init(&w, wqt_post, NULL);
+	delay.tv_sec = 0;
+	delay.tv_nsec = WQT_DELAY_NS;
+
+	gettime(&start);
+	KASSERT(queue_delayed_work(wqt_wq, &w, &delay));
+	KASSERT(!queue_work(wqt_wq, &w));
+	P(wqt_sem);
+	gettime(&end);
+	timespec_sub(&end, &start, &end);
+	if (end.tv_sec == 0 && end.tv_nsec < WQT_DELAY_NS) {
+		panic("wqtest: delayed work ran after only %lu ns\n",
+		      (unsigned long)end.tv_nsec);
+	}
+	flush_workqueue(wqt_wq);
+	KASSERT(!cancel_work(&w));
+
+	/* cancel it before it's due; then it must not run */
+	delay.tv_sec = 1;
+	KASSERT(queue_delayed_work(wqt_wq, &w, &delay));
+	KASSERT(cancel_work(&w));
+	KASSERT(!cancel_work(&w));
+	KASSERT(queue_work(wqt_wq, &w));
+	P(wqt_sem);
+	flush_workqueue(wqt_wq);
+	KASSERT(!cancel_work(&w));
+	kprintf("wqtest: delayed work and cancel passed\n");
+}
+
+static struct work wqt_again;
+static unsigned wqt_againcount;
+
+static
+void
+wqt_requeue(void *arg)
+{
+	(void)arg;
+	if (++wqt_againcount < WQT_REQUEUES) {
+		KASSERT(queue_work(wqt_wq, &wqt_again));
+	}
+	else {
+		V(wqt_sem);
+	}
+}
+
+/*
+ * Work that queues itself again from its own function.
+ */
+static
+void
+wqt_self(void)
+{
+	wqt_againcount = 0;
+	work_init(&wqt_again, wqt_requeue, NULL);
+	KASSERT(queue_work(wqt_wq, &wqt_again));
+	P(wqt_sem);
+	flush_workqueue(wqt_wq);
+	KASSERT(wqt_againcount == WQT_REQUEUES);
+	kprintf("wqtest: self-requeueing work passed\n");
+}
+
+int
+wqtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	wqt_sem = sem_create("wqtest", 0);
+	if (wqt_sem == NULL) {
+		panic("wqtest: sem_create failed\n");
+	}
+	wqt_wq = workqueue_create("wqtest", WQT_WORKERS, SCHED_NORMAL);
+	if (wqt_wq == NULL) {
+		panic("wqtest: workqueue_create failed\n");
+	}
+
+	wqt_percpu();
+	wqt_delayed();
+	wqt_self();
+
+	workqueue_destroy(wqt_wq);
+	wqt_wq = NULL;
+	sem_destroy(wqt_sem);
+	kprintf("wqtest done\n");
+	return 0;
+}
@@ -28,36 +28,53 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <timeout.h>
+#include <atomic.h>
+#include <membar.h>
+#include <threadprivate.h>
+#include <vm.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Callbacks at points in the future are scheduled with timeouts (see
+ * timeout.c), which run off the hardclock, so their resolution is
+ * 1/HZ seconds.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
- * skimp on that because we have a known-good hardware clock.
+ * skimp on that because we have a known-good hardware clock. We do
+ * copy it to the time page on each hardclock for user programs.
  */
 
 /*
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	100	/* Reschedule every 100 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Threads in clocksleep wait here, each with its own timeout, so
+ * each one is woken only when its own time is up. Nothing else
+ * wakes the channel.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static struct wchan *sleep_wchan;
+static struct spinlock sleep_lock;
+
+/*
+ * The time page, and the number of cpus with their hardclocks
+ * stopped. When they all are the page goes stale, so it's marked
+ * invalid until one starts again.
+ */
+static struct timepage *timepage;
+static volatile unsigned timepage_stopped;
 
 /*
  * Setup.
@@ -65,10 +82,81 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&sleep_lock);
+	sleep_wchan = wchan_create("clocksleep");
+	if (sleep_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
+	}
+}
+
+/*
+ * Copy the time to the time page. Writers take the page by making
+ * tp_seq odd; if another cpu has it, skip this update, as that one
+ * is writing the time already.
+ */
+static
+void
+timepage_update(bool valid)
+{
+	struct timespec ts;
+	unsigned seq;
+
+	seq = timepage->tp_seq;
+	if ((seq & 1) != 0 ||
+	    atomic_cas((volatile unsigned *)&timepage->tp_seq,
+		       seq, seq + 1) != seq) {
+		return;
+	}
+	gettime(&ts);
+	timepage->tp_sec = ts.tv_sec;
+	timepage->tp_nsec = ts.tv_nsec;
+	timepage->tp_valid = valid;
+	membar_store_store();
+	timepage->tp_seq = seq + 2;
+}
+
+/*
+ * Allocate the time page. Called once the VM system is up.
+ */
+void
+timepage_bootstrap(void)
+{
+	vaddr_t va;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		panic("Couldn't allocate the time page\n");
+	}
+	bzero((void *)va, PAGE_SIZE);
+	timepage = (struct timepage *)va;
+	timepage_update(true);
+}
+
+paddr_t
+timepage_paddr(void)
+{
+	if (timepage == NULL) {
+		return 0;
+	}
+	return KVADDR_TO_PADDR((vaddr_t)timepage);
+}
+
+/*
+ * Track cpus stopping and starting their hardclocks. Restarting needs
+ * nothing more; the next hardclock revalidates the page.
+ */
+void
+timepage_tickless(bool stopped)
+{
+	unsigned n;
+
+	if (!stopped) {
+		atomic_add(&timepage_stopped, -1);
+		return;
+	}
+	n = atomic_add(&timepage_stopped, 1);
+	if (n == thread_numcpus() && timepage != NULL) {
+		timepage_update(false);
 	}
 }
 
@@ -79,10 +167,7 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	/* Nothing to do; sleeps are timed by timeouts. */
 }
 
 /*
@@ -97,13 +182,15 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	if (timepage != NULL) {
+		timepage_update(true);
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	/* Run timeouts first so the threads they wake are considered. */
+	timeout_tick();
+	thread_tick();
 }
 
 /*
@@ -112,10 +199,27 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	struct timespec ts;
+
+	ts.tv_sec = num_secs;
+	ts.tv_nsec = 0;
+	clocknanosleep(&ts);
+}
+
+/*
+ * Suspend execution for the time given.
+ */
+void
+clocknanosleep(const struct timespec *len)
+{
+	int result;
+
+	if (len->tv_sec == 0 && len->tv_nsec == 0) {
+		return;
 	}
-	spinlock_release(&lbolt_lock);
+
+	spinlock_acquire(&sleep_lock);
+	result = wchan_sleep_timeout(sleep_wchan, &sleep_lock, len);
+	KASSERT(result == ETIMEDOUT);
+	spinlock_release(&sleep_lock);
 }
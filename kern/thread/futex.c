@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Futex wait table; see futex.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <copyinout.h>
+#include <futex.h>
+
+/* Number of hash chains (a power of two) */
+#define FUTEX_NBUCKETS	64
+
+/*
+ * One waiting thread. These live on the waiter's stack and are
+ * linked into the chain for their key while the thread waits.
+ */
+struct futex_waiter {
+	struct futex_waiter *fw_next;
+	struct addrspace *fw_as;
+	const_userptr_t fw_uaddr;
+	bool fw_woken;
+};
+
+/*
+ * A hash chain. Threads waiting on any key in the chain sleep on the
+ * same wchan; futex_wake marks the ones it means and wakes them all,
+ * and the others go back to sleep. Each has its own cache line, so
+ * cpus using different chains don't contend for the locks' line.
+ */
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_waiters;
+} __ALIGNED(CACHELINE_SIZE);
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+/*
+ * Set up the table.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		spinlock_init(&futex_table[i].fb_lock);
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+/*
+ * Choose the chain for a key.
+ */
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, const_userptr_t uaddr)
+{
+	uintptr_t h;
+
+	h = (uintptr_t)uaddr >> 2;
+	h ^= (uintptr_t)as >> 4;
+	h ^= h >> 7;
+	return &futex_table[h & (FUTEX_NBUCKETS - 1)];
+}
+
+/*
+ * Take a waiter off its chain. Call with the chain locked.
+ */
+static
+void
+futex_unlink(struct futex_bucket *fb, struct futex_waiter *fw)
+{
+	struct futex_waiter **p;
+
+	for (p = &fb->fb_waiters; *p != NULL; p = &(*p)->fw_next) {
+		if (*p == fw) {
+			*p = fw->fw_next;
+			return;
+		}
+	}
+	panic("futex: waiter not on its chain\n");
+}
+
+/*
+ * Sleep on UADDR if it holds VAL. We can't copyin with the chain's
+ * spinlock held, so queue ourselves first and check the word after;
+ * a futex_wake that comes in between marks us and we don't sleep.
+ */
+int
+futex_wait(struct addrspace *as, const_userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter fw, **p;
+	int cur, result;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	fb = futex_hash(as, uaddr);
+	fw.fw_as = as;
+	fw.fw_uaddr = uaddr;
+	fw.fw_woken = false;
+	fw.fw_next = NULL;
+
+	/* go on the end, so wakeups are first come first served */
+	spinlock_acquire(&fb->fb_lock);
+	for (p = &fb->fb_waiters; *p != NULL; p = &(*p)->fw_next) {
+		/* nothing */
+	}
+	*p = &fw;
+	spinlock_release(&fb->fb_lock);
+
+	result = copyin(uaddr, &cur, sizeof(cur));
+	if (result == 0 && cur != val) {
+		result = EAGAIN;
+	}
+
+	spinlock_acquire(&fb->fb_lock);
+	if (result == 0) {
+		while (!fw.fw_woken) {
+			wchan_sleep(fb->fb_wchan, &fb->fb_lock);
+		}
+	}
+	else if (fw.fw_woken) {
+		/* the wake was meant for us; don't lose it */
+		result = 0;
+	}
+	futex_unlink(fb, &fw);
+	spinlock_release(&fb->fb_lock);
+
+	return result;
+}
+
+/*
+ * Wake up to COUNT threads waiting on UADDR; return how many in RET.
+ */
+int
+futex_wake(struct addrspace *as, const_userptr_t uaddr, unsigned count,
+	   unsigned *ret)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw;
+	unsigned n;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	fb = futex_hash(as, uaddr);
+	n = 0;
+
+	spinlock_acquire(&fb->fb_lock);
+	for (fw = fb->fb_waiters; fw != NULL && n < count; fw = fw->fw_next) {
+		if (fw->fw_as == as && fw->fw_uaddr == uaddr &&
+		    !fw->fw_woken) {
+			fw->fw_woken = true;
+			n++;
+		}
+	}
+	if (n > 0) {
+		wchan_wakeall(fb->fb_wchan, &fb->fb_lock);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	*ret = n;
+	return 0;
+}
@@ -28,15 +28,103 @@
  */
 
 /*
- * Simple deadlock detector.
+ * Simple deadlock detectors (see hangman.h).
  */
 
 #include <types.h>
 #include <lib.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <spinlock.h>
 #include <hangman.h>
 
+////////////////////////////////////////////////////////////
+// sampled detector
+
+/*
+ * Print a cycle found by the sampled detector, and panic. As in
+ * hangman_check below, nothing in the cycle can change while we
+ * print, since it's deadlocked.
+ */
+void
+hangman_report(const struct hangman_link *links, unsigned num)
+{
+	unsigned i;
+
+	KASSERT(num > 0);
+
+	splhigh();
+	kprintf("hangman: Detected lock cycle!\n");
+	kprintf("hangman: in %s (%p);\n", links[0].hl_actor,
+		links[0].hl_actorp);
+	kprintf("hangman: waiting for %s (%p), but:\n",
+		links[0].hl_lockable, links[0].hl_lockablep);
+	kprintf("   lockable %s (%p)\n", links[0].hl_lockable,
+		links[0].hl_lockablep);
+	for (i=1; i<num; i++) {
+		kprintf("   held by actor %s (%p)\n", links[i].hl_actor,
+			links[i].hl_actorp);
+		kprintf("   waiting for lockable %s (%p)\n",
+			links[i].hl_lockable, links[i].hl_lockablep);
+	}
+	kprintf("   held by actor %s (%p)\n", links[0].hl_actor,
+		links[0].hl_actorp);
+	panic("Deadlock.\n");
+}
+
+/*
+ * Follow the spinlocks from SPLK: its holder, the spinlock that cpu
+ * is spinning on, and so on, to see if we get back to ourselves.
+ *
+ * We hold no lock while we look, so the spinlocks we look at may be
+ * released or even freed under us; but they're only read, a cpu
+ * structure never goes away, and a cycle that isn't really there
+ * won't still be there at the next check.
+ */
+bool
+hangman_spincheck(const struct spinlock *splk, bool report)
+{
+	struct hangman_link links[HANGMAN_MAXDEPTH];
+	const struct cpu *me, *cur;
+	const struct spinlock *next;
+	unsigned num;
+
+	me = curcpu->c_self;
+	links[0].hl_actor = "cpu";
+	links[0].hl_actorp = me;
+	links[0].hl_lockable = "spinlock";
+	links[0].hl_lockablep = splk;
+	num = 1;
+
+	cur = splk->splk_holder;
+	while (cur != me) {
+		if (cur == NULL || num == HANGMAN_MAXDEPTH) {
+			return false;
+		}
+		next = cur->c_spinwait;
+		if (next == NULL) {
+			return false;
+		}
+		links[num].hl_actor = "cpu";
+		links[num].hl_actorp = cur;
+		links[num].hl_lockable = "spinlock";
+		links[num].hl_lockablep = next;
+		num++;
+		cur = next->splk_holder;
+	}
+
+	if (report) {
+		hangman_report(links, num);
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// exact detector
+
+#if OPT_HANGMAN
+
 static struct spinlock hangman_lock = SPINLOCK_INITIALIZER;
 
 /*
@@ -180,3 +268,5 @@ hangman_release(struct hangman_actor *a,
 
 	spinlock_release(&hangman_lock);
 }
+
+#endif /* OPT_HANGMAN */
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Sampling kernel profiler; see kprof.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <membar.h>
+#include <cpu.h>
+#include <current.h>
+#include <threadprivate.h>
+#include <vm.h>
+#include <kprof.h>
+
+/* Cpus profiled, and how many buckets the report lists */
+#define KPROF_MAXCPUS	32
+#define KPROF_TOP	20
+
+/* The kernel text is from the base of kseg0 to _etext. */
+#define KPROF_TEXTBASE	PADDR_TO_KVADDR(0)
+extern char _etext[];
+
+struct kprof_cpu {
+	uint32_t *kp_hist;		/* one count per bucket */
+	unsigned kp_total;		/* all samples */
+	unsigned kp_user;		/* samples in user mode */
+	unsigned kp_other;		/* kernel, but not in the text */
+} __ALIGNED(CACHELINE_SIZE);		/* not shared with the next cpu's */
+
+static struct kprof_cpu kprof_cpus[KPROF_MAXCPUS];
+static unsigned kprof_ncpus;
+static unsigned kprof_nbuckets;
+static volatile bool kprof_on;
+
+struct kprof_top {
+	vaddr_t kt_addr;
+	unsigned kt_count;
+};
+
+/*
+ * Allocate the histograms. Called once all the cpus are attached.
+ */
+void
+kprof_bootstrap(void)
+{
+	unsigned i;
+
+	kprof_nbuckets = ((vaddr_t)_etext - KPROF_TEXTBASE + KPROF_BUCKET - 1)
+		/ KPROF_BUCKET;
+	kprof_ncpus = thread_numcpus();
+	if (kprof_ncpus > KPROF_MAXCPUS) {
+		kprof_ncpus = KPROF_MAXCPUS;
+	}
+	for (i=0; i<kprof_ncpus; i++) {
+		kprof_cpus[i].kp_hist =
+			kmalloc(kprof_nbuckets * sizeof(uint32_t));
+		if (kprof_cpus[i].kp_hist == NULL) {
+			panic("kprof: out of memory\n");
+		}
+	}
+	kprof_reset();
+}
+
+/*
+ * Count a sample at PC. Called from the clock interrupt.
+ */
+void
+kprof_sample(vaddr_t pc, bool user)
+{
+	struct kprof_cpu *kp;
+
+	if (!kprof_on || curcpu->c_number >= kprof_ncpus) {
+		return;
+	}
+	kp = &kprof_cpus[curcpu->c_number];
+	kp->kp_total++;
+	if (user) {
+		kp->kp_user++;
+	}
+	else if (pc >= KPROF_TEXTBASE &&
+		 pc < KPROF_TEXTBASE + kprof_nbuckets * KPROF_BUCKET) {
+		kp->kp_hist[(pc - KPROF_TEXTBASE) / KPROF_BUCKET]++;
+	}
+	else {
+		kp->kp_other++;
+	}
+}
+
+/*
+ * Start or stop sampling.
+ */
+void
+kprof_enable(bool on)
+{
+	if (kprof_ncpus > 0) {
+		membar_any_any();
+		kprof_on = on;
+	}
+}
+
+/*
+ * Clear all the counts; sampling is paused while we do.
+ */
+void
+kprof_reset(void)
+{
+	struct kprof_cpu *kp;
+	bool wason;
+	unsigned i;
+
+	wason = kprof_on;
+	kprof_enable(false);
+	for (i=0; i<kprof_ncpus; i++) {
+		kp = &kprof_cpus[i];
+		bzero(kp->kp_hist, kprof_nbuckets * sizeof(uint32_t));
+		kp->kp_total = kp->kp_user = kp->kp_other = 0;
+	}
+	kprof_enable(wason);
+}
+
+/*
+ * Total count for bucket B across all cpus.
+ */
+static
+unsigned
+kprof_bucket(unsigned b)
+{
+	unsigned i, n;
+
+	n = 0;
+	for (i=0; i<kprof_ncpus; i++) {
+		n += kprof_cpus[i].kp_hist[b];
+	}
+	return n;
+}
+
+/*
+ * Insert bucket B with COUNT samples into TOP, which holds *NUM
+ * entries sorted by decreasing count, keeping at most KPROF_TOP.
+ */
+static
+void
+kprof_rank(struct kprof_top *top, unsigned *num, unsigned b, unsigned count)
+{
+	unsigned i;
+
+	for (i = *num; i > 0 && top[i-1].kt_count < count; i--) {
+		if (i < KPROF_TOP) {
+			top[i] = top[i-1];
+		}
+	}
+	if (i < KPROF_TOP) {
+		top[i].kt_addr = KPROF_TEXTBASE + b * KPROF_BUCKET;
+		top[i].kt_count = count;
+		if (*num < KPROF_TOP) {
+			(*num)++;
+		}
+	}
+}
+
+/*
+ * Print each cpu's totals and the busiest buckets. Counts are read
+ * while sampling may go on, so they're only approximately consistent.
+ */
+void
+kprof_report(void)
+{
+	struct kprof_top top[KPROF_TOP];
+	struct kprof_cpu *kp;
+	unsigned i, b, n, num, total, kernel;
+
+	if (kprof_ncpus == 0) {
+		kprintf("kprof: not started\n");
+		return;
+	}
+
+	total = 0;
+	for (i=0; i<kprof_ncpus; i++) {
+		kp = &kprof_cpus[i];
+		kprintf("cpu%u: %u samples, %u kernel, %u user, %u other\n",
+			i, kp->kp_total,
+			kp->kp_total - kp->kp_user - kp->kp_other,
+			kp->kp_user, kp->kp_other);
+		total += kp->kp_total;
+	}
+	if (total == 0) {
+		return;
+	}
+
+	num = 0;
+	kernel = 0;
+	for (b=0; b<kprof_nbuckets; b++) {
+		n = kprof_bucket(b);
+		if (n > 0) {
+			kernel += n;
+			kprof_rank(top, &num, b, n);
+		}
+	}
+
+	kprintf("%u of %u samples in kernel text; busiest %u-byte pieces:\n",
+		kernel, total, KPROF_BUCKET);
+	for (i=0; i<num; i++) {
+		kprintf("  0x%08lx %8u %3u.%u%%\n",
+			(unsigned long)top[i].kt_addr, top[i].kt_count,
+			top[i].kt_count * 100 / total,
+			top[i].kt_count * 1000 / total % 10);
+	}
+}
+
+/*
+ * Print every nonzero bucket, address and count, for symbolizing;
+ * for cpu CPU only, or for all of them if CPU is -1.
+ */
+void
+kprof_dump(int cpu)
+{
+	unsigned b, n;
+
+	if (cpu >= (int)kprof_ncpus) {
+		kprintf("kprof: no cpu%d\n", cpu);
+		return;
+	}
+	for (b=0; b<kprof_nbuckets; b++) {
+		n = cpu < 0 ? kprof_bucket(b) : kprof_cpus[cpu].kp_hist[b];
+		if (n > 0) {
+			kprintf("0x%08lx %u\n",
+				(unsigned long)(KPROF_TEXTBASE +
+						b * KPROF_BUCKET), n);
+		}
+	}
+}
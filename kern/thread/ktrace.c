@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Kernel event tracing; see ktrace.h.
+ */
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <membar.h>
+#include <cpu.h>
+#include <current.h>
+#include <threadprivate.h>
+#include <ktrace.h>
+
+/* Events kept per cpu (a power of two) and cpus traced */
+#define KTRACE_NEVENTS	2048
+#define KTRACE_MAXCPUS	32
+
+struct ktrace_event {
+	uint64_t ke_time;		/* nanoseconds */
+	struct thread *ke_thread;
+	uint32_t ke_type;
+	uint32_t ke_a, ke_b;
+};
+
+struct ktrace_ring {
+	struct ktrace_event kr_events[KTRACE_NEVENTS];
+	unsigned kr_next;		/* total events ever recorded */
+};
+
+static struct ktrace_ring *ktrace_rings[KTRACE_MAXCPUS];
+static unsigned ktrace_ncpus;
+static volatile bool ktrace_on;
+
+/* How to print each type; the flags say which arguments are in hex */
+static const struct {
+	const char *name;
+	bool hexa, hexb;
+} ktrace_types[KT_NTYPES] = {
+	[KT_SWITCH] =    { "switch",    true,  true  },
+	[KT_SLEEP] =     { "sleep",     true,  false },
+	[KT_WAKEONE] =   { "wakeone",   true,  true  },
+	[KT_READIN] =    { "readin",    false, false },
+	[KT_READDONE] =  { "readdone",  false, false },
+	[KT_WRITEOUT] =  { "writeout",  false, false },
+	[KT_WRITEDONE] = { "writedone", false, false },
+	[KT_JWRITE] =    { "jwrite",    false, false },
+	[KT_JFLUSH] =    { "jflush",    false, false },
+	[KT_VMFAULT] =   { "vmfault",   false, true  },
+	[KT_SYSCALL] =   { "syscall",   false, true  },
+	[KT_SYSRET] =    { "sysret",    false, false },
+};
+
+/*
+ * Allocate the rings and start tracing. Called once the clock device
+ * and all the cpus are attached.
+ */
+void
+ktrace_bootstrap(void)
+{
+	unsigned i;
+
+	ktrace_ncpus = thread_numcpus();
+	if (ktrace_ncpus > KTRACE_MAXCPUS) {
+		ktrace_ncpus = KTRACE_MAXCPUS;
+	}
+	for (i=0; i<ktrace_ncpus; i++) {
+		ktrace_rings[i] = kmalloc(sizeof(struct ktrace_ring));
+		if (ktrace_rings[i] == NULL) {
+			panic("ktrace: out of memory\n");
+		}
+		ktrace_rings[i]->kr_next = 0;
+	}
+	membar_store_store();
+	ktrace_on = true;
+}
+
+/*
+ * Record an event in this cpu's ring.
+ */
+void
+ktrace_record(unsigned type, uint32_t a, uint32_t b)
+{
+	struct ktrace_ring *kr;
+	struct ktrace_event *ke;
+	struct timespec ts;
+	int spl;
+
+	KASSERT(type < KT_NTYPES);
+
+	if (!ktrace_on || !CURCPU_EXISTS()) {
+		return;
+	}
+
+	spl = splhigh();
+	if (curcpu->c_number < ktrace_ncpus) {
+		kr = ktrace_rings[curcpu->c_number];
+		gettime(&ts);
+		ke = &kr->kr_events[kr->kr_next % KTRACE_NEVENTS];
+		ke->ke_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		ke->ke_thread = curthread;
+		ke->ke_type = type;
+		ke->ke_a = a;
+		ke->ke_b = b;
+		kr->kr_next++;
+	}
+	splx(spl);
+}
+
+/*
+ * Turn tracing on or off.
+ */
+void
+ktrace_enable(bool on)
+{
+	if (ktrace_ncpus > 0) {
+		membar_any_any();
+		ktrace_on = on;
+	}
+}
+
+/*
+ * Throw away everything recorded so far.
+ */
+void
+ktrace_reset(void)
+{
+	bool wason;
+	unsigned i;
+
+	wason = ktrace_on;
+	ktrace_enable(false);
+	for (i=0; i<ktrace_ncpus; i++) {
+		ktrace_rings[i]->kr_next = 0;
+	}
+	ktrace_enable(wason);
+}
+
+static
+void
+ktrace_printarg(bool hex, uint32_t val)
+{
+	if (hex) {
+		kprintf(" 0x%x", val);
+	}
+	else {
+		kprintf(" %u", val);
+	}
+}
+
+/*
+ * Print all the rings, merged by time. Times are printed in seconds
+ * since the oldest event shown.
+ *
+ * Tracing is off while we print, so the rings hold still; an event
+ * another cpu was in the middle of recording when we turned it off
+ * may come out garbled.
+ */
+void
+ktrace_dump(void)
+{
+	unsigned pos[KTRACE_MAXCPUS], end[KTRACE_MAXCPUS];
+	const struct ktrace_event *ke, *best;
+	unsigned i, bestcpu, total;
+	uint64_t start, t;
+	bool wason;
+
+	if (ktrace_ncpus == 0) {
+		kprintf("ktrace: not started\n");
+		return;
+	}
+
+	wason = ktrace_on;
+	ktrace_enable(false);
+
+	total = 0;
+	for (i=0; i<ktrace_ncpus; i++) {
+		end[i] = ktrace_rings[i]->kr_next;
+		pos[i] = end[i] > KTRACE_NEVENTS ? end[i] - KTRACE_NEVENTS : 0;
+		total += end[i] - pos[i];
+	}
+	kprintf("ktrace: %u events\n", total);
+
+	start = 0;
+	bestcpu = 0;
+	while (1) {
+		best = NULL;
+		for (i=0; i<ktrace_ncpus; i++) {
+			if (pos[i] == end[i]) {
+				continue;
+			}
+			ke = &ktrace_rings[i]->kr_events[pos[i] %
+							 KTRACE_NEVENTS];
+			if (best == NULL || ke->ke_time < best->ke_time) {
+				best = ke;
+				bestcpu = i;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		pos[bestcpu]++;
+
+		if (start == 0) {
+			start = best->ke_time;
+		}
+		t = best->ke_time - start;
+		kprintf("%4llu.%06llu cpu%u %p %-9s",
+			(unsigned long long)(t / 1000000000),
+			(unsigned long long)(t % 1000000000 / 1000),
+			bestcpu, best->ke_thread,
+			ktrace_types[best->ke_type].name);
+		ktrace_printarg(ktrace_types[best->ke_type].hexa, best->ke_a);
+		ktrace_printarg(ktrace_types[best->ke_type].hexb, best->ke_b);
+		kprintf("\n");
+	}
+
+	ktrace_enable(wason);
+}
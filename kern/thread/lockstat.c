@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Lock contention statistics; see lockstat.h.
+ */
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockstat.h>
+
+/* How many locks of each kind the report lists */
+#define LOCKSTAT_TOP	16
+
+/* All listed lockstats, and the lock for the list. */
+static struct lockstat *lockstat_all;
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+
+/* Nonzero once the clock is available. */
+static bool lockstat_timing;
+
+/*
+ * Turn on timing. Called once the clock device is attached.
+ */
+void
+lockstat_bootstrap(void)
+{
+	lockstat_timing = true;
+}
+
+/*
+ * Current time in nanoseconds, or 0 if it isn't known yet.
+ */
+uint64_t
+lockstat_now(void)
+{
+	struct timespec ts;
+
+	if (!lockstat_timing) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+void
+lockstat_clear(struct lockstat *ls)
+{
+	ls->ls_acquires = 0;
+	ls->ls_contended = 0;
+	ls->ls_wait = 0;
+	ls->ls_maxwait = 0;
+	ls->ls_hold = 0;
+	ls->ls_heldsince = 0;
+}
+
+/*
+ * Start keeping statistics in LS under the name NAME, which must last
+ * until lockstat_remove.
+ */
+void
+lockstat_add(struct lockstat *ls, const char *name, bool spin)
+{
+	lockstat_clear(ls);
+	ls->ls_spin = spin;
+
+	spinlock_acquire(&lockstat_lock);
+	ls->ls_name = name;
+	ls->ls_next = lockstat_all;
+	ls->ls_prevp = &lockstat_all;
+	if (lockstat_all != NULL) {
+		lockstat_all->ls_prevp = &ls->ls_next;
+	}
+	lockstat_all = ls;
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_remove(struct lockstat *ls)
+{
+	spinlock_acquire(&lockstat_lock);
+	KASSERT(ls->ls_name != NULL);
+	*ls->ls_prevp = ls->ls_next;
+	if (ls->ls_next != NULL) {
+		ls->ls_next->ls_prevp = ls->ls_prevp;
+	}
+	ls->ls_name = NULL;
+	spinlock_release(&lockstat_lock);
+}
+
+/*
+ * List a spinlock. Spinlocks are never destroyed often enough to be
+ * worth removing again, so this is meant for ones that last.
+ */
+void
+lockstat_spinlock(struct spinlock *splk, const char *name)
+{
+	KASSERT(splk != &lockstat_lock);
+	lockstat_add(&splk->splk_stat, name, true);
+}
+
+void
+lockstat_acquired(struct lockstat *ls, bool waited, uint64_t waitstart)
+{
+	uint64_t now, wait;
+
+	now = lockstat_now();
+	ls->ls_acquires++;
+	if (waited) {
+		ls->ls_contended++;
+		wait = (waitstart == 0) ? 0 : now - waitstart;
+		ls->ls_wait += wait;
+		if (wait > ls->ls_maxwait) {
+			ls->ls_maxwait = wait;
+		}
+	}
+	ls->ls_heldsince = now;
+}
+
+void
+lockstat_released(struct lockstat *ls)
+{
+	if (ls->ls_heldsince != 0) {
+		ls->ls_hold += lockstat_now() - ls->ls_heldsince;
+		ls->ls_heldsince = 0;
+	}
+}
+
+void
+lockstat_spun(struct lockstat *ls, unsigned spins)
+{
+	ls->ls_acquires++;
+	if (spins > 0) {
+		ls->ls_contended++;
+		ls->ls_wait += spins;
+		if (spins > ls->ls_maxwait) {
+			ls->ls_maxwait = spins;
+		}
+	}
+}
+
+/*
+ * Insert a copy of LS into TOP, which holds *NUM entries sorted by
+ * decreasing wait, keeping at most LOCKSTAT_TOP.
+ */
+static
+void
+lockstat_rank(struct lockstat *top, unsigned *num,
+	      const struct lockstat *ls)
+{
+	unsigned i;
+
+	for (i = *num; i > 0 && top[i-1].ls_wait < ls->ls_wait; i--) {
+		if (i < LOCKSTAT_TOP) {
+			top[i] = top[i-1];
+		}
+	}
+	if (i < LOCKSTAT_TOP) {
+		top[i] = *ls;
+		if (*num < LOCKSTAT_TOP) {
+			(*num)++;
+		}
+	}
+}
+
+static
+void
+lockstat_print(const struct lockstat *top, unsigned num, const char *unit)
+{
+	unsigned i;
+
+	kprintf("%-16s %10s %10s %14s %12s %12s\n", "name", "acquires",
+		"contended", unit, "max", "held ms");
+	for (i=0; i<num; i++) {
+		kprintf("%-16s %10llu %10llu %14llu %12llu %12llu\n",
+			top[i].ls_name,
+			(unsigned long long)top[i].ls_acquires,
+			(unsigned long long)top[i].ls_contended,
+			(unsigned long long)top[i].ls_wait,
+			(unsigned long long)top[i].ls_maxwait,
+			(unsigned long long)(top[i].ls_hold / 1000000));
+	}
+}
+
+/*
+ * Print the sleeping locks and the spinlocks that waited the longest.
+ * The counters are copied under the list lock, so the locks can't be
+ * destroyed meanwhile, but without each lock's own spinlock, so they
+ * may be slightly inconsistent.
+ */
+void
+lockstat_report(void)
+{
+	/* static: too big for the stack, and only the menu calls this */
+	static struct lockstat locks[LOCKSTAT_TOP], spins[LOCKSTAT_TOP];
+	unsigned nlocks = 0, nspins = 0;
+	struct lockstat *ls;
+
+	spinlock_acquire(&lockstat_lock);
+	for (ls = lockstat_all; ls != NULL; ls = ls->ls_next) {
+		if (ls->ls_spin) {
+			lockstat_rank(spins, &nspins, ls);
+		}
+		else {
+			lockstat_rank(locks, &nlocks, ls);
+		}
+	}
+	spinlock_release(&lockstat_lock);
+
+	kprintf("Locks and semaphores, by total wait:\n");
+	lockstat_print(locks, nlocks, "wait ns");
+	kprintf("Spinlocks, by total spins:\n");
+	lockstat_print(spins, nspins, "spins");
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+
+	spinlock_acquire(&lockstat_lock);
+	for (ls = lockstat_all; ls != NULL; ls = ls->ls_next) {
+		lockstat_clear(ls);
+	}
+	spinlock_release(&lockstat_lock);
+}
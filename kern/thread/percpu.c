@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Per-cpu statistics counters (see percpu.h).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <threadprivate.h>
+#include <percpu.h>
+
+/*
+ * Which slots are in use; protected by percpu_lock. (The counts
+ * themselves are in struct cpu.)
+ */
+static uint32_t percpu_used[PERCPU_SLOTS / 32];
+static unsigned percpu_hint;
+static struct spinlock percpu_lock = SPINLOCK_INITIALIZER;
+
+int
+percpu_counter_init(struct percpu_counter *pc)
+{
+	unsigned i, slot;
+
+	spinlock_acquire(&percpu_lock);
+	for (i=0; i<PERCPU_SLOTS; i++) {
+		slot = (percpu_hint + i) % PERCPU_SLOTS;
+		if ((percpu_used[slot / 32] & (1U << (slot % 32))) == 0) {
+			break;
+		}
+	}
+	if (i == PERCPU_SLOTS) {
+		spinlock_release(&percpu_lock);
+		return ENOSPC;
+	}
+	percpu_used[slot / 32] |= 1U << (slot % 32);
+	percpu_hint = slot + 1;
+	spinlock_release(&percpu_lock);
+
+	pc->pc_slot = slot;
+	percpu_counter_reset(pc);
+	return 0;
+}
+
+void
+percpu_counter_cleanup(struct percpu_counter *pc)
+{
+	unsigned slot = pc->pc_slot;
+
+	KASSERT(slot < PERCPU_SLOTS);
+
+	spinlock_acquire(&percpu_lock);
+	KASSERT(percpu_used[slot / 32] & (1U << (slot % 32)));
+	percpu_used[slot / 32] &= ~(1U << (slot % 32));
+	spinlock_release(&percpu_lock);
+
+	pc->pc_slot = PERCPU_SLOTS;
+}
+
+void
+percpu_counter_add(struct percpu_counter *pc, unsigned amount)
+{
+	int spl;
+
+	DEBUGASSERT(pc->pc_slot < PERCPU_SLOTS);
+
+	/* Interrupts off keeps us on this cpu and its copy to ourselves */
+	spl = splhigh();
+	curcpu->c_counters[pc->pc_slot] += amount;
+	splx(spl);
+}
+
+unsigned
+percpu_counter_read(struct percpu_counter *pc)
+{
+	unsigned i, num, total;
+
+	KASSERT(pc->pc_slot < PERCPU_SLOTS);
+
+	total = 0;
+	num = thread_numcpus();
+	for (i=0; i<num; i++) {
+		total += thread_getcpu(i)->c_counters[pc->pc_slot];
+	}
+	return total;
+}
+
+void
+percpu_counter_reset(struct percpu_counter *pc)
+{
+	unsigned i, num;
+
+	KASSERT(pc->pc_slot < PERCPU_SLOTS);
+
+	num = thread_numcpus();
+	for (i=0; i<num; i++) {
+		thread_getcpu(i)->c_counters[pc->pc_slot] = 0;
+	}
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Scheduler statistics report (see schedstat.h), and the "schedstat:"
+ * device that provides it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <cpu.h>
+#include <thread.h>
+#include <threadlist.h>
+#include <threadprivate.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <schedstat.h>
+
+/* Initial size for the report; it's regrown if necessary. */
+#define SCHEDSTAT_INITSIZE	2048
+
+/* Threads listed per cpu, and how much of each name */
+#define SCHEDSTAT_MAXTHREADS	8
+#define SCHEDSTAT_NAMELEN	24
+
+/*
+ * Where a report goes: the console if sr_buf is NULL, otherwise the
+ * buffer SR_BUF of size SR_LEN, truncating if necessary. SR_POS
+ * counts the length of the whole report either way. (This is the
+ * same scheme as the disk stats report.)
+ */
+struct schedreport {
+	char *sr_buf;
+	size_t sr_len;
+	size_t sr_pos;
+};
+
+static
+void
+schedreport(struct schedreport *sr, const char *fmt, ...)
+{
+	char line[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	if (sr->sr_buf == NULL) {
+		len = vsnprintf(line, sizeof(line), fmt, ap);
+		kprintf("%s", line);
+	}
+	else if (sr->sr_pos < sr->sr_len) {
+		len = vsnprintf(sr->sr_buf + sr->sr_pos,
+				sr->sr_len - sr->sr_pos, fmt, ap);
+	}
+	else {
+		len = vsnprintf(NULL, 0, fmt, ap);
+	}
+	va_end(ap);
+
+	sr->sr_pos += len;
+}
+
+/* A thread as captured for the report. */
+struct schedthread {
+	char st_name[SCHEDSTAT_NAMELEN];
+	unsigned st_prio;
+	uint64_t st_cputime;
+};
+
+static
+void
+schedthread_copy(struct schedthread *st, struct thread *t)
+{
+	snprintf(st->st_name, sizeof(st->st_name), "%s", t->t_name);
+	st->st_prio = t->t_prio;
+	st->st_cputime = t->t_cputime;
+}
+
+/*
+ * Report on one cpu.
+ */
+static
+void
+schedreport_cpu(struct schedreport *sr, struct cpu *c)
+{
+	struct schedstats copy;
+	struct schedthread cur, ready[SCHEDSTAT_MAXTHREADS];
+	struct thread *t;
+	unsigned i, nready, total, avg;
+	bool idle;
+
+	/*
+	 * Copy what we need under the run queue lock, so the threads
+	 * can't go away, and print after releasing it.
+	 */
+	nready = total = 0;
+	spinlock_acquire(&c->c_runqueue_lock);
+	copy = c->c_stats;
+	idle = c->c_isidle;
+	schedthread_copy(&cur, c->c_curthread);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		THREADLIST_FORALL(t, c->c_runqueue[i]) {
+			if (nready < SCHEDSTAT_MAXTHREADS) {
+				schedthread_copy(&ready[nready++], t);
+			}
+			total++;
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+
+	schedreport(sr, "cpu%u: %u switches (%u voluntary, %u preempted), "
+		    "%u threads moved off\n", c->c_number,
+		    copy.ss_vswitches + copy.ss_ivswitches,
+		    copy.ss_vswitches, copy.ss_ivswitches,
+		    copy.ss_migrations);
+	schedreport(sr, "   %llu usec idle\n",
+		    (unsigned long long)copy.ss_idleusec);
+	if (copy.ss_rqsamples > 0) {
+		/* Hundredths */
+		avg = (unsigned)((uint64_t)copy.ss_rqtotal * 100 /
+				 copy.ss_rqsamples);
+		schedreport(sr, "   run queue: %u.%02u waiting on average "
+			    "over %u hardclocks, at most %u\n",
+			    avg / 100, avg % 100, copy.ss_rqsamples,
+			    copy.ss_rqmax);
+	}
+	schedreport(sr, "   %s %s (level %u, %llu usec)\n",
+		    idle ? "idle in" : "running", cur.st_name, cur.st_prio,
+		    (unsigned long long)cur.st_cputime);
+	for (i=0; i<nready; i++) {
+		schedreport(sr, "   ready %s (level %u, %llu usec)\n",
+			    ready[i].st_name, ready[i].st_prio,
+			    (unsigned long long)ready[i].st_cputime);
+	}
+	if (total > nready) {
+		schedreport(sr, "   and %u more ready\n", total - nready);
+	}
+}
+
+static
+void
+schedreport_all(struct schedreport *sr)
+{
+	unsigned i, numcpus;
+
+	/* Cpus are never removed. */
+	numcpus = thread_numcpus();
+	for (i=0; i<numcpus; i++) {
+		schedreport_cpu(sr, thread_getcpu(i));
+	}
+}
+
+void
+schedstats_printall(void)
+{
+	struct schedreport sr;
+
+	sr.sr_buf = NULL;
+	sr.sr_len = 0;
+	sr.sr_pos = 0;
+	schedreport_all(&sr);
+}
+
+/*
+ * Write the report into BUF, which is LEN bytes long. Returns the
+ * length of the whole report; if that's LEN or more, the report was
+ * truncated.
+ */
+size_t
+schedstats_formatall(char *buf, size_t len)
+{
+	struct schedreport sr;
+
+	KASSERT(len > 0);
+
+	sr.sr_buf = buf;
+	sr.sr_len = len;
+	sr.sr_pos = 0;
+	buf[0] = 0;
+	schedreport_all(&sr);
+	return sr.sr_pos;
+}
+
+////////////////////////////////////////////////////////////
+// schedstat: device
+
+/* For open() */
+static
+int
+schedstatopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if (openflags != O_RDONLY) {
+		return EIO;
+	}
+	return 0;
+}
+
+/* For d_io(); as for bufstat: */
+static
+int
+schedstatio(struct device *dev, struct uio *uio)
+{
+	char *report;
+	size_t size, len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EIO;
+	}
+
+	size = SCHEDSTAT_INITSIZE;
+	report = kmalloc(size);
+	if (report == NULL) {
+		return ENOMEM;
+	}
+	len = schedstats_formatall(report, size);
+	if (len >= size) {
+		kfree(report);
+		size = len + 1;
+		report = kmalloc(size);
+		if (report == NULL) {
+			return ENOMEM;
+		}
+		len = schedstats_formatall(report, size);
+		if (len >= size) {
+			len = size - 1;
+		}
+	}
+
+	if (uio->uio_offset < 0) {
+		result = EINVAL;
+	}
+	else if ((size_t)uio->uio_offset >= len) {
+		/* EOF */
+		result = 0;
+	}
+	else {
+		result = uiomove(report + uio->uio_offset,
+				 len - uio->uio_offset, uio);
+	}
+
+	kfree(report);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+schedstatioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops schedstat_devops = {
+	.devop_eachopen = schedstatopen,
+	.devop_io = schedstatio,
+	.devop_ioctl = schedstatioctl,
+};
+
+/*
+ * Function to create and attach schedstat:
+ */
+void
+devschedstat_create(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev==NULL) {
+		panic("Could not add schedstat device: out of memory\n");
+	}
+
+	dev->d_ops = &schedstat_devops;
+
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = NULL;
+
+	result = vfs_adddev("schedstat", dev, 0);
+	if (result) {
+		panic("Could not add schedstat device: %s\n",
+		      strerror(result));
+	}
+}
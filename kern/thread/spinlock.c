@@ -30,6 +30,7 @@
 /* Make sure to build out-of-line versions of inline functions */
 #define SPINLOCK_INLINE   /* empty */
 #define MEMBAR_INLINE     /* empty */
+#define ATOMIC_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
@@ -37,6 +38,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <membar.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
 
 /*
@@ -52,6 +54,23 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+	splk->splk_fifo = false;
+	splk->splk_next = 0;
+	splk->splk_serving = 0;
+#if OPT_LOCKSTAT
+	bzero(&splk->splk_stat, sizeof(splk->splk_stat));
+#endif
+	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+}
+
+/*
+ * Initialize a FIFO spinlock.
+ */
+void
+spinlock_init_fifo(struct spinlock *splk)
+{
+	spinlock_init(splk);
+	splk->splk_fifo = true;
 }
 
 /*
@@ -62,6 +81,7 @@ spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
 	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(splk->splk_next == splk->splk_serving);
 }
 
 /*
@@ -70,11 +90,30 @@ spinlock_cleanup(struct spinlock *splk)
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
  * atomic operation to wait for the lock to be free.
+ *
+ * A FIFO lock instead takes a ticket with atomic_add and waits for
+ * splk_serving to reach it; only the holder changes splk_serving.
+ * Interrupts must already be off when the ticket is taken, or a
+ * holder of a ticket could be kept from its turn and stall everyone
+ * queued behind it.
+ *
+ * Every HANGMAN_SPINS spins we note in c_spinwait what we're waiting
+ * for and look for a deadlock (see hangman.h).
  */
+#define SPINLOCK_SPIN(splk, mycpu, spins, suspect)			\
+	do {								\
+		if (++(spins) % HANGMAN_SPINS == 0 && (mycpu) != NULL) { \
+			(mycpu)->c_spinwait = (splk);			\
+			(suspect) = hangman_spincheck(splk, suspect);	\
+		}							\
+	} while (0)
+
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	unsigned spins = 0;
+	bool suspect = false;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -85,33 +124,53 @@ spinlock_acquire(struct spinlock *splk)
 			panic("Deadlock on spinlock %p\n", splk);
 		}
 		mycpu->c_spinlocks++;
+		HANGMAN_WAIT(&mycpu->c_hangman, &splk->splk_hangman);
 	}
 	else {
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+	if (splk->splk_fifo) {
+		unsigned ticket;
+
+		ticket = atomic_add(&splk->splk_next, 1) - 1;
+		while (splk->splk_serving != ticket) {
+			SPINLOCK_SPIN(splk, mycpu, spins, suspect);
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+	}
+	else {
+		while (1) {
+			/*
+			 * Do test-test-and-set, that is, read first before
+			 * doing test-and-set, to reduce bus contention.
+			 *
+			 * Test-and-set is a machine-level atomic operation
+			 * that writes 1 into the lock word and returns the
+			 * previous value. If that value was 0, the lock was
+			 * previously unheld and we now own it. If it was 1,
+			 * we don't.
+			 */
+			if (spinlock_data_get(&splk->splk_lock) != 0) {
+				SPINLOCK_SPIN(splk, mycpu, spins, suspect);
+				continue;
+			}
+			if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+				SPINLOCK_SPIN(splk, mycpu, spins, suspect);
+				continue;
+			}
+			break;
 		}
-		break;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	if (mycpu != NULL) {
+		HANGMAN_ACQUIRE(&mycpu->c_hangman, &splk->splk_hangman);
+		if (spins >= HANGMAN_SPINS) {
+			mycpu->c_spinwait = NULL;
+		}
+	}
+	LOCKSTAT_SPUN(&splk->splk_stat, spins);
 }
 
 /*
@@ -125,11 +184,17 @@ spinlock_release(struct spinlock *splk)
 		KASSERT(splk->splk_holder == curcpu->c_self);
 		KASSERT(curcpu->c_spinlocks > 0);
 		curcpu->c_spinlocks--;
+		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	if (splk->splk_fifo) {
+		splk->splk_serving++;
+	}
+	else {
+		spinlock_data_set(&splk->splk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -33,13 +33,146 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <kmemcache.h>
 #include <synch.h>
 
+/*
+ * Semaphores, locks and CVs are kept in object caches, with their
+ * wchan and spinlock set up once by the constructor rather than on
+ * every create. While an object is cached its wchan is renamed to
+ * the generic name, as the object's own name is freed.
+ */
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+/*
+ * Direct handoff. Normally V and lock_release make the count or the
+ * lock available and wake a waiter, which then has to compete for it
+ * with everyone else; a thread that comes along before the waiter
+ * gets to run can take it, and the waiter goes back to sleep having
+ * paid for two context switches for nothing. With handoff on, what's
+ * released goes straight to the thread woken, so it can't be lost
+ * and waiters are served in order, at the price of newcomers waiting
+ * for a thread that is not yet running. Settable from the menu.
+ */
+bool synch_handoff = false;
+
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("semaphore");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&cv->cv_lock);
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	spinlock_cleanup(&cv->cv_lock);
+	wchan_destroy(cv->cv_wchan);
+}
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor, lock_dtor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv),
+				     cv_ctor, cv_dtor);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
+
+/*
+ * Set LEFT to the time remaining until DEADLINE; returns false if
+ * there is none.
+ */
+static
+bool
+synch_timeleft(const struct timespec *deadline, struct timespec *left)
+{
+	struct timespec now;
+
+	gettime(&now);
+	if (now.tv_sec > deadline->tv_sec ||
+	    (now.tv_sec == deadline->tv_sec &&
+	     now.tv_nsec >= deadline->tv_nsec)) {
+		return false;
+	}
+	timespec_sub(deadline, &now, left);
+	return true;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
@@ -49,26 +182,21 @@ sem_create(const char *name, unsigned initial_count)
 {
         struct semaphore *sem;
 
-        sem = kmalloc(sizeof(*sem));
+        sem = kmem_cache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(sem_cache, sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, sem->sem_name);
         sem->sem_count = initial_count;
+	sem->sem_handoff = 0;
+	LOCKSTAT_ADD(&sem->sem_stat, sem->sem_name);
 
         return sem;
 }
@@ -78,16 +206,22 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	LOCKSTAT_REMOVE(&sem->sem_stat);
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	KASSERT(sem->sem_handoff == 0);
+	spinlock_release(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, "semaphore");
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(sem_cache, sem);
 }
 
 void
 P(struct semaphore *sem)
 {
+	bool waited, handed = false;
+	uint64_t waitstart = 0;
+
         KASSERT(sem != NULL);
 
         /*
@@ -100,6 +234,10 @@ P(struct semaphore *sem)
 
 	/* Use the semaphore spinlock to protect the wchan as well. */
 	spinlock_acquire(&sem->sem_lock);
+	waited = (sem->sem_count == 0);
+	if (waited) {
+		waitstart = LOCKSTAT_NOW();
+	}
         while (sem->sem_count == 0) {
 		/*
 		 *
@@ -114,9 +252,19 @@ P(struct semaphore *sem)
 		 * ordering?
 		 */
 		wchan_sleep(sem->sem_wchan, &sem->sem_lock);
+
+		/* A V in handoff mode leaves its count for a waiter. */
+		if (sem->sem_handoff > 0) {
+			sem->sem_handoff--;
+			handed = true;
+			break;
+		}
         }
-        KASSERT(sem->sem_count > 0);
-        sem->sem_count--;
+	if (!handed) {
+		KASSERT(sem->sem_count > 0);
+		sem->sem_count--;
+	}
+	LOCKSTAT_ACQUIRED(&sem->sem_stat, waited, waitstart);
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -127,9 +275,17 @@ V(struct semaphore *sem)
 
 	spinlock_acquire(&sem->sem_lock);
 
-        sem->sem_count++;
-        KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan, &sem->sem_lock);
+	if (synch_handoff &&
+	    wchan_wakeone(sem->sem_wchan, &sem->sem_lock) != NULL) {
+		/* Kept away from sem_count, which newcomers look at. */
+		sem->sem_handoff++;
+		KASSERT(sem->sem_handoff > 0);
+	}
+	else {
+		sem->sem_count++;
+		KASSERT(sem->sem_count > 0);
+		wchan_wakeone(sem->sem_wchan, &sem->sem_lock);
+	}
 
 	spinlock_release(&sem->sem_lock);
 }
@@ -138,30 +294,60 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks are adaptive: if the holder is running on another cpu it is
+ * probably about to let go, so we spin for a while before sleeping,
+ * which saves two context switches for short critical sections. At
+ * most LOCK_SPINS polls are made per acquire; a holder that is not
+ * running (S_RUN) will not let go soon, so we sleep at once.
+ *
+ * A thread sleeping on lk_wchan has t_wantlock set to the lock it
+ * wants. That is normally this one, but a CV waiter that was moved
+ * here by cv_signal or cv_broadcast wants the lock it passed to
+ * cv_wait, which might be some other lock; lock_release wakes such
+ * strays without counting them. In handoff mode the lock is given
+ * to the waiter it wakes by setting lk_holder before that thread
+ * runs, so callers of lock_acquire must check for having been given
+ * it as well as for lk_holder becoming NULL.
+ *
+ * Before sleeping, a waiter lends its priority to the holder (see
+ * thread_inherit), and, if the holder is itself waiting for a lock,
+ * to that lock's holder, and so on for up to LOCK_PI_DEPTH locks.
+ * The links are t_pilock, which a thread sets only while lending
+ * and clears before lock_acquire returns, so the lock it names
+ * can't be destroyed while pi_lock is held. pi_lock comes before
+ * every lk_lock and is never taken while holding one.
+ *
+ * The same links are the waits-for graph for the sampled deadlock
+ * detector (see hangman.h): lock_acquire sleeps for at most
+ * HANGMAN_SLEEP_SECS at a time, and each time it runs out follows
+ * them looking for a way back to itself.
+ */
+#define LOCK_SPINS	2000
+#define LOCK_PI_DEPTH	4
+
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+static const struct timespec lock_hangwait = { HANGMAN_SLEEP_SECS, 0 };
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(*lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
 
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
+	wchan_setname(lock->lk_wchan, lock->lk_name);
+	KASSERT(lock->lk_holder == NULL);
+	LOCKSTAT_ADD(&lock->lk_stat, lock->lk_name);
 
         return lock;
 }
@@ -172,40 +358,278 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
+	LOCKSTAT_REMOVE(&lock->lk_stat);
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(wchan_isempty(lock->lk_wchan, &lock->lk_lock));
+	spinlock_release(&lock->lk_lock);
+	wchan_setname(lock->lk_wchan, "lock");
 
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
+}
+
+/*
+ * Wait without sleeping for the current holder of LOCK to release it,
+ * if it is running. Called and returns with lk_lock held; *SPINS is
+ * the polling budget left for this acquire. Returns true if it is
+ * worth looking at the lock again, false if the caller should sleep.
+ *
+ * The holder's state can only be looked at under lk_lock, as that
+ * keeps it from releasing the lock and exiting; while polling we
+ * only compare the lk_holder pointer.
+ */
+static
+bool
+lock_spin(struct lock *lock, unsigned *spins)
+{
+	struct thread *holder;
+
+	holder = lock->lk_holder;
+	if (*spins == 0 || holder->t_state != S_RUN) {
+		return false;
+	}
+
+	spinlock_release(&lock->lk_lock);
+	while (lock->lk_holder == holder && *spins > 0) {
+		(*spins)--;
+	}
+	spinlock_acquire(&lock->lk_lock);
+	return true;
+}
+
+/*
+ * Lend our priority along the chain of holders starting from LOCK,
+ * which we are waiting for. Called with nothing locked.
+ */
+static
+void
+lock_lend(struct lock *lock)
+{
+	struct thread *holder;
+	struct lock *next;
+	unsigned prio, depth;
+
+	prio = thread_curprio();
+
+	spinlock_acquire(&pi_lock);
+	curthread->t_pilock = lock;
+	for (depth = 0; lock != NULL && depth < LOCK_PI_DEPTH; depth++) {
+		spinlock_acquire(&lock->lk_lock);
+		holder = lock->lk_holder;
+		if (holder == NULL || holder == curthread) {
+			/* Released, or a deadlock cycle back to us */
+			spinlock_release(&lock->lk_lock);
+			break;
+		}
+		/* lk_lock keeps the holder from releasing and exiting */
+		thread_inherit(holder, prio);
+		next = holder->t_pilock;
+		spinlock_release(&lock->lk_lock);
+		lock = next;
+	}
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * Called with LOCK's lk_lock held before sleeping on it. If we
+ * haven't yet lent our priority to the current holder (*LENT), let
+ * go of lk_lock, do so, and return true, as the lock must then be
+ * looked at again.
+ */
+static
+bool
+lock_inherit(struct lock *lock, struct thread **lent)
+{
+	if (lock->lk_holder == *lent) {
+		return false;
+	}
+	*lent = lock->lk_holder;
+	spinlock_release(&lock->lk_lock);
+	lock_lend(lock);
+	spinlock_acquire(&lock->lk_lock);
+	return true;
+}
+
+/*
+ * Stop lending priority, at the end of an acquire that did so.
+ */
+static
+void
+lock_unlend(void)
+{
+	spinlock_acquire(&pi_lock);
+	curthread->t_pilock = NULL;
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * Called when a wait for LOCK has run out of lock_hangwait. Follow
+ * the t_pilock links, as lock_lend does, and see if they come back
+ * to us; if so, and REPORT, report a deadlock. Returns whether they
+ * came back. LOCK's lk_lock must not be held.
+ */
+static
+bool
+lock_hangcheck(struct lock *lock, bool report)
+{
+	struct hangman_link links[HANGMAN_MAXDEPTH];
+	struct thread *holder;
+	struct lock *next;
+	unsigned num;
+	bool found = false;
+
+	links[0].hl_actor = curthread->t_name;
+	links[0].hl_actorp = curthread;
+	links[0].hl_lockable = lock->lk_name;
+	links[0].hl_lockablep = lock;
+	num = 1;
+
+	spinlock_acquire(&pi_lock);
+	while (lock != NULL && num < HANGMAN_MAXDEPTH) {
+		spinlock_acquire(&lock->lk_lock);
+		holder = lock->lk_holder;
+		if (holder == NULL || holder == curthread) {
+			/* Back to us is a cycle unless we just got it */
+			found = (holder == curthread && num > 1);
+			spinlock_release(&lock->lk_lock);
+			break;
+		}
+		next = holder->t_pilock;
+		if (next != NULL) {
+			links[num].hl_actor = holder->t_name;
+			links[num].hl_actorp = holder;
+			links[num].hl_lockable = next->lk_name;
+			links[num].hl_lockablep = next;
+			num++;
+		}
+		spinlock_release(&lock->lk_lock);
+		lock = next;
+	}
+	spinlock_release(&pi_lock);
+
+	if (found && report) {
+		hangman_report(links, num);
+	}
+	return found;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *lent = NULL;
+	unsigned spins = LOCK_SPINS;
+	bool waited, suspect = false;
+	uint64_t waitstart = 0;
+
         DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 
         spinlock_acquire(&lock->lk_lock);
         KASSERT(lock->lk_holder != curthread);
-        while (lock->lk_holder != NULL) {
+	waited = (lock->lk_holder != NULL);
+	if (waited) {
+		waitstart = LOCKSTAT_NOW();
+	}
+        while (lock->lk_holder != NULL && lock->lk_holder != curthread) {
+		if (lock_spin(lock, &spins) || lock_inherit(lock, &lent)) {
+			continue;
+		}
                 /* As in the semaphore. */
-                wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		curthread->t_wantlock = lock;
+		if (wchan_sleep_timeout(lock->lk_wchan, &lock->lk_lock,
+					&lock_hangwait) == 0) {
+			suspect = false;
+			continue;
+		}
+		/* Been waiting a while; check for deadlock */
+		spinlock_release(&lock->lk_lock);
+		suspect = lock_hangcheck(lock, suspect);
+		spinlock_acquire(&lock->lk_lock);
         }
 
         lock->lk_holder = curthread;
+	curthread->t_nlocks++;
+	LOCKSTAT_ACQUIRED(&lock->lk_stat, waited, waitstart);
         spinlock_release(&lock->lk_lock);
+	if (lent != NULL) {
+		lock_unlend();
+	}
+}
+
+int
+lock_acquire_timeout(struct lock *lock, const struct timespec *delay)
+{
+	struct timespec deadline, left;
+	struct thread *lent = NULL;
+	unsigned spins = LOCK_SPINS;
+	bool waited;
+	uint64_t waitstart = 0;
+	int result = 0;
+
+	DEBUGASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	gettime(&deadline);
+	timespec_add(&deadline, delay, &deadline);
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder != curthread);
+	waited = (lock->lk_holder != NULL);
+	if (waited) {
+		waitstart = LOCKSTAT_NOW();
+	}
+	while (lock->lk_holder != NULL && lock->lk_holder != curthread) {
+		if (lock_spin(lock, &spins) || lock_inherit(lock, &lent)) {
+			continue;
+		}
+		/* Sleep only for what's left after earlier wakeups. */
+		if (!synch_timeleft(&deadline, &left)) {
+			result = ETIMEDOUT;
+			break;
+		}
+		curthread->t_wantlock = lock;
+		wchan_sleep_timeout(lock->lk_wchan, &lock->lk_lock, &left);
+	}
+	if (result == 0) {
+		lock->lk_holder = curthread;
+		curthread->t_nlocks++;
+		LOCKSTAT_ACQUIRED(&lock->lk_stat, waited, waitstart);
+	}
+	spinlock_release(&lock->lk_lock);
+	if (lent != NULL) {
+		lock_unlend();
+	}
+	return result;
 }
 
 void
 lock_release(struct lock *lock)
 {
+	struct thread *target;
+
         DEBUGASSERT(lock != NULL);
 
         spinlock_acquire(&lock->lk_lock);
         KASSERT(lock->lk_holder == curthread);
+	LOCKSTAT_RELEASED(&lock->lk_stat);
         lock->lk_holder = NULL;
-        wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	while ((target = wchan_wakeone(lock->lk_wchan,
+				       &lock->lk_lock)) != NULL) {
+		if (target->t_wantlock == lock) {
+			if (synch_handoff) {
+				lock->lk_holder = target;
+			}
+			break;
+		}
+	}
         spinlock_release(&lock->lk_lock);
+
+	/* Keep anything lent until we have no locks left to finish. */
+	KASSERT(curthread->t_nlocks > 0);
+	curthread->t_nlocks--;
+	if (curthread->t_nlocks == 0) {
+		thread_disinherit();
+	}
 }
 
 bool
@@ -221,28 +645,67 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool ret;
+
+	DEBUGASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder != curthread);
+	ret = (lock->lk_holder == NULL);
+	if (ret) {
+		lock->lk_holder = curthread;
+		curthread->t_nlocks++;
+		LOCKSTAT_ACQUIRED(&lock->lk_stat, false, 0);
+	}
+	spinlock_release(&lock->lk_lock);
+	return ret;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
 
+/*
+ * Get LOCK back after waiting on a CV. If we were moved onto the
+ * lock's wchan and it was released in handoff mode, we already hold
+ * it.
+ */
+static
+void
+cv_relock(struct lock *lock)
+{
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		curthread->t_nlocks++;
+		LOCKSTAT_ACQUIRED(&lock->lk_stat, false, 0);
+		spinlock_release(&lock->lk_lock);
+		return;
+	}
+	spinlock_release(&lock->lk_lock);
+	lock_acquire(lock);
+}
 
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(*cv));
+        cv = kmem_cache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(cv_cache, cv);
                 return NULL;
         }
 
-        // add stuff here as needed
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 
         return cv;
 }
@@ -252,32 +715,249 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
+	spinlock_acquire(&cv->cv_lock);
+	KASSERT(wchan_isempty(cv->cv_wchan, &cv->cv_lock));
+	spinlock_release(&cv->cv_lock);
+	wchan_setname(cv->cv_wchan, "cv");
 
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
-        (void)cv;    // suppress warning until code gets written
-        (void)lock;  // suppress warning until code gets written
+	DEBUGASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Get onto the channel before letting go of the lock, so a
+	 * signal sent as soon as it's released isn't missed.
+	 */
+	spinlock_acquire(&cv->cv_lock);
+	lock_release(lock);
+	curthread->t_wantlock = lock;
+	wchan_sleep(cv->cv_wchan, &cv->cv_lock);
+	spinlock_release(&cv->cv_lock);
+	cv_relock(lock);
+}
+
+int
+cv_wait_timeout(struct cv *cv, struct lock *lock,
+		const struct timespec *delay)
+{
+	int result;
+
+	DEBUGASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	spinlock_acquire(&cv->cv_lock);
+	lock_release(lock);
+	curthread->t_wantlock = lock;
+	result = wchan_sleep_timeout(cv->cv_wchan, &cv->cv_lock, delay);
+	spinlock_release(&cv->cv_lock);
+	cv_relock(lock);
+	return result;
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	DEBUGASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/* The waiter would only block on LOCK; put it there directly. */
+	spinlock_acquire(&cv->cv_lock);
+	spinlock_acquire(&lock->lk_lock);
+	wchan_morphone(cv->cv_wchan, &cv->cv_lock,
+		       lock->lk_wchan, &lock->lk_lock);
+	spinlock_release(&lock->lk_lock);
+	spinlock_release(&cv->cv_lock);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	DEBUGASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Wait morphing: rather than waking everyone to fight over
+	 * LOCK, which we hold, move them all to its wait channel.
+	 * Each release of LOCK then wakes just the next one, so a
+	 * broadcast costs one context switch per waiter. (A waiter
+	 * that used some other lock still works; lock_release wakes
+	 * it without giving it LOCK and it goes to get its own.)
+	 */
+	spinlock_acquire(&cv->cv_lock);
+	spinlock_acquire(&lock->lk_lock);
+	wchan_morphall(cv->cv_wchan, &cv->cv_lock,
+		       lock->lk_wchan, &lock->lk_lock);
+	spinlock_release(&lock->lk_lock);
+	spinlock_release(&cv->cv_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rwl;
+
+	rwl = kmalloc(sizeof(*rwl));
+	if (rwl == NULL) {
+		return NULL;
+	}
+
+	rwl->rwl_name = kstrdup(name);
+	if (rwl->rwl_name == NULL) {
+		kfree(rwl);
+		return NULL;
+	}
+
+	rwl->rwl_rwchan = wchan_create(rwl->rwl_name);
+	if (rwl->rwl_rwchan == NULL) {
+		kfree(rwl->rwl_name);
+		kfree(rwl);
+		return NULL;
+	}
+	rwl->rwl_wwchan = wchan_create(rwl->rwl_name);
+	if (rwl->rwl_wwchan == NULL) {
+		wchan_destroy(rwl->rwl_rwchan);
+		kfree(rwl->rwl_name);
+		kfree(rwl);
+		return NULL;
+	}
+	spinlock_init(&rwl->rwl_lock);
+	rwl->rwl_readers = 0;
+	rwl->rwl_wwaiting = 0;
+	rwl->rwl_writer = NULL;
+
+	return rwl;
+}
+
+void
+rwlock_destroy(struct rwlock *rwl)
+{
+	KASSERT(rwl != NULL);
+
+	KASSERT(rwl->rwl_readers == 0);
+	KASSERT(rwl->rwl_wwaiting == 0);
+	KASSERT(rwl->rwl_writer == NULL);
+	spinlock_cleanup(&rwl->rwl_lock);
+	wchan_destroy(rwl->rwl_wwchan);
+	wchan_destroy(rwl->rwl_rwchan);
+
+	kfree(rwl->rwl_name);
+	kfree(rwl);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer != curthread);
+	/* Wait out writers, including ones waiting for other readers */
+	while (rwl->rwl_writer != NULL || rwl->rwl_wwaiting > 0) {
+		wchan_sleep(rwl->rwl_rwchan, &rwl->rwl_lock);
+	}
+	rwl->rwl_readers++;
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_readers > 0);
+	rwl->rwl_readers--;
+	if (rwl->rwl_readers == 0) {
+		wchan_wakeone(rwl->rwl_wwchan, &rwl->rwl_lock);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer != curthread);
+	rwl->rwl_wwaiting++;
+	while (rwl->rwl_writer != NULL || rwl->rwl_readers > 0) {
+		wchan_sleep(rwl->rwl_wwchan, &rwl->rwl_lock);
+	}
+	rwl->rwl_wwaiting--;
+	rwl->rwl_writer = curthread;
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer == curthread);
+	rwl->rwl_writer = NULL;
+	/* Readers would only wait again behind a waiting writer */
+	if (rwl->rwl_wwaiting > 0) {
+		wchan_wakeone(rwl->rwl_wwchan, &rwl->rwl_lock);
+	}
+	else {
+		wchan_wakeall(rwl->rwl_rwchan, &rwl->rwl_lock);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_downgrade(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer == curthread);
+	rwl->rwl_writer = NULL;
+	rwl->rwl_readers++;
+	/* As in release, readers can only join if no writer waits */
+	if (rwl->rwl_wwaiting == 0) {
+		wchan_wakeall(rwl->rwl_rwchan, &rwl->rwl_lock);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+bool
+rwlock_do_i_hold(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = rwl->rwl_writer == curthread || rwl->rwl_readers > 0;
+	spinlock_release(&rwl->rwl_lock);
+	return ret;
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = (rwl->rwl_writer == curthread);
+	spinlock_release(&rwl->rwl_lock);
+	return ret;
 }
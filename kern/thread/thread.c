@@ -35,7 +35,9 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <array.h>
 #include <cpu.h>
 #include <spl.h>
@@ -44,12 +46,18 @@
 #include <thread.h>
 #include <threadlist.h>
 #include <threadprivate.h>
+#include <timeout.h>
+#include <clock.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <atomic.h>
+#include <membar.h>
 #include <vnode.h>
+#include <pathname.h>
+#include <ktrace.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -69,6 +77,16 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Set once gettime() is usable, for the scheduler statistics. */
+static bool schedstats_timing;
+
+/* Threads changing cpus in thread_setaffinity wait here. */
+static struct wchan *migrate_wchan;
+static struct spinlock migrate_lock;
+
+/* Heap accounting for wchans; ones made before it's set up aren't counted. */
+static struct kheap_tag wchan_heaptag;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -109,37 +127,40 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Set up the fields of a new thread, apart from the ones that survive
+ * being kept as a spare (see below): the stack, the list node, the
+ * machine-dependent part, and the spare pathname buffer.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_sleepwc = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_class = SCHED_NORMAL;
+	thread->t_prio = SCHED_NORMAL;
+	thread->t_inherit = SCHED_LEVELS;
+	thread->t_ticks = 0;
+	thread->t_lastran = 0;
+	thread->t_shareticks = 0;
+	thread->t_sharestart = 0;
+	thread->t_throttled = false;
+	thread->t_cpumask = CPUMASK_ALL;
+	thread->t_cputime = 0;
+	thread->t_inuser = false;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -149,11 +170,106 @@ thread_create(const char *name)
 	/* VFS fields */
 	thread->t_did_reserve_buffers = false;
 
+	/* Synchronization */
+	thread->t_wantlock = NULL;
+	thread->t_pilock = NULL;
+	thread->t_nlocks = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_stack = NULL;
+	thread->t_pathbuf = NULL;
+
+	if (thread_init(thread, name)) {
+		threadlistnode_cleanup(&thread->t_listnode);
+		thread_machdep_cleanup(&thread->t_machdep);
+		kfree(thread);
+		return NULL;
+	}
 	return thread;
 }
 
+/*
+ * Spare threads.
+ *
+ * Instead of freeing a reaped thread, thread_destroy keeps up to
+ * THREAD_SPARES per cpu, with their stacks (guard band still in place)
+ * and spare pathname buffers, and thread_fork reuses them, so forking
+ * and reaping usually don't go to the page allocator at all. Spares
+ * are kept on the c_spares list of the cpu that reaped them, and only
+ * that cpu touches it; interrupts are kept off while doing so so we
+ * can't be preempted and moved to another cpu midway.
+ */
+#define THREAD_SPARES	8
+
+/* Take a spare thread, if there is one, and set it up as NAME. */
+static
+struct thread *
+thread_getspare(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_spares);
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+	KASSERT(thread->t_stack != NULL);
+	thread_checkstack(thread);
+
+	if (thread_init(thread, name)) {
+		spl = splhigh();
+		threadlist_addhead(&curcpu->c_spares, thread);
+		splx(spl);
+		return NULL;
+	}
+	return thread;
+}
+
+/* Keep a dead thread as a spare. Returns false if we have enough. */
+static
+bool
+thread_putspare(struct thread *thread)
+{
+	bool ret;
+	int spl;
+
+	if (thread->t_stack == NULL) {
+		/* The boot stack can't be reused. */
+		return false;
+	}
+
+	spl = splhigh();
+	ret = curcpu->c_spares.tl_count < THREAD_SPARES;
+	if (ret) {
+		threadlist_addtail(&curcpu->c_spares, thread);
+	}
+	splx(spl);
+	return ret;
+}
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -166,6 +282,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -179,21 +296,38 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_spares);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_spinwait = NULL;
+	HANGMAN_ACTORINIT(&c->c_hangman, "cpu");
+	bzero(&c->c_rand, sizeof(c->c_rand));
+	c->c_randleft = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	c->c_tickless = false;
+	bzero(&c->c_stats, sizeof(c->c_stats));
+	bzero(c->c_counters, sizeof(c->c_counters));
+	for (i=0; i<SCHED_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	threadlist_init(&c->c_throttled);
+	spinlock_init_fifo(&c->c_runqueue_lock);
+	LOCKSTAT_SPINLOCK(&c->c_runqueue_lock, "runqueue");
+	timerwheel_init(&c->c_timers);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	LOCKSTAT_SPINLOCK(&c->c_ipi_lock, "ipi");
+	c->c_tlbas = NULL;
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	/* Affinity masks have one bit per cpu. */
+	KASSERT(c->c_number < 32);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -277,16 +411,25 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	if (thread_putspare(thread)) {
+		return;
+	}
+
+	/* Spare pathname buffer */
+	pathname_threadcleanup(thread);
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
 	kfree(thread);
 }
 
@@ -317,6 +460,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -331,9 +477,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<=SCHED_LEVELS; i++) {
+		rq = i < SCHED_LEVELS ? &curcpu->c_runqueue[i] :
+			&curcpu->c_throttled;
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -394,6 +544,15 @@ thread_bootstrap(void)
 	KASSERT(curthread->t_proc != NULL);
 	KASSERT(curthread->t_proc == kproc);
 
+	spinlock_init(&migrate_lock);
+	migrate_wchan = wchan_create("migrate");
+	if (migrate_wchan == NULL) {
+		panic("Couldn't create migrate wchan\n");
+	}
+
+	/* Only now can the per-cpu counters it uses work. */
+	kheap_tag_init(&wchan_heaptag, "wchan");
+
 	/* Done */
 }
 
@@ -401,7 +560,7 @@ thread_bootstrap(void)
  * New CPUs come here once MD initialization is finished. curthread
  * and curcpu should already be initialized.
  *
- * Other than clearing thread_start_cpus() to continue, we don't need
+ * Other than letting thread_wait_cpus() know we are up, we don't need
  * to do anything. The startup thread can just exit; we only need it
  * to be able to get into thread_switch() properly.
  */
@@ -414,6 +573,9 @@ cpu_hatch(unsigned software_number)
 	KASSERT(curthread != NULL);
 	KASSERT(curcpu->c_number == software_number);
 
+	/* Start charging time to our threads from now. */
+	gettime(&curcpu->c_stats.ss_since);
+
 	spl0();
 	cpu_identify(buf, sizeof(buf));
 
@@ -430,13 +592,30 @@ void
 thread_start_cpus(void)
 {
 	char buf[64];
-	unsigned i;
 
 	cpu_identify(buf, sizeof(buf));
 	kprintf("cpu0: %s\n", buf);
 
+	/* The clock is attached now, so we can keep time statistics. */
+	gettime(&curcpu->c_stats.ss_since);
+	schedstats_timing = true;
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
+	if (cpu_startup_sem == NULL) {
+		panic("thread_start_cpus: Out of memory\n");
+	}
 	mainbus_start_cpus();
+}
+
+/*
+ * Wait for the cpus thread_start_cpus started to finish coming up.
+ * Until then, threads made runnable on them just wait in their run
+ * queues.
+ */
+void
+thread_wait_cpus(void)
+{
+	unsigned i;
 
 	for (i=0; i<cpuarray_num(&allcpus) - 1; i++) {
 		P(cpu_startup_sem);
@@ -445,16 +624,497 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+thread_getcpu(unsigned index)
+{
+	return cpuarray_get(&allcpus, index);
+}
+
+/*
+ * Scheduler statistics (see schedstat.h).
+ */
+
+/* Microseconds from START to END. */
+static
+uint64_t
+schedstats_usec(const struct timespec *start, const struct timespec *end)
+{
+	struct timespec diff;
+
+	timespec_sub(end, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * Charge T, which is leaving the cpu or changing modes, for the time
+ * it's been on it since it was last charged.
+ */
+static
+void
+schedstats_charge(struct thread *t)
+{
+	struct schedstats *ss = &curcpu->c_stats;
+	struct timespec now;
+	uint64_t usec;
+
+	if (schedstats_timing) {
+		gettime(&now);
+		usec = schedstats_usec(&ss->ss_since, &now);
+		ss->ss_since = now;
+		t->t_cputime += usec;
+		if (t->t_inuser) {
+			t->t_usage.u_utime += usec;
+		}
+		else {
+			t->t_usage.u_stime += usec;
+		}
+	}
+}
+
+/* Call cpu_idle, counting the time spent there. */
+static
+void
+schedstats_idle(void)
+{
+	struct schedstats *ss = &curcpu->c_stats;
+	struct timespec before;
+
+	if (!schedstats_timing) {
+		cpu_idle();
+		return;
+	}
+	gettime(&before);
+	cpu_idle();
+	gettime(&ss->ss_since);
+	ss->ss_idleusec += schedstats_usec(&before, &ss->ss_since);
+}
+
+/*
+ * Switch the current thread between user and system time. The spl
+ * keeps a context switch from charging it at the same moment.
+ */
+void
+thread_usermode(bool touser)
+{
+	int spl;
+
+	spl = splhigh();
+	schedstats_charge(curthread);
+	curthread->t_inuser = touser;
+	splx(spl);
+}
+
+/* Charge the current thread up to now. */
+void
+thread_charge(void)
+{
+	int spl;
+
+	spl = splhigh();
+	schedstats_charge(curthread);
+	splx(spl);
+}
+
+/*
+ * Run queue access. Each cpu has one run queue per priority level;
+ * threads are taken from the highest-priority nonempty one, and
+ * from c_throttled only if they're all empty. Callers hold the cpu's
+ * run queue lock.
+ */
+
+/* The level T runs at: its own, or one lent it, whichever is better. */
+static
+unsigned
+thread_prio(const struct thread *t)
+{
+	return t->t_inherit < t->t_prio ? t->t_inherit : t->t_prio;
+}
+
+/* Total number of threads on C's run queues. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	count = c->c_throttled.tl_count;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/* Number of threads on C's run queues with priority better than PRIO. */
+static
+unsigned
+runqueue_count_above(struct cpu *c, unsigned prio)
+{
+	unsigned i, count;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	count = 0;
+	for (i=0; i<prio; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/* Take the next thread to run off C's run queues, or NULL if none. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_LEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return threadlist_remhead(&c->c_throttled);
+}
+
+/*
+ * Thread migration.
+ *
+ * A cpu that runs out of threads to run steals one from the cpu with
+ * the most threads waiting (thread_steal, called from the idle loop
+ * in thread_switch) rather than busy cpus pushing work away. Busy
+ * cpus thus do no balancing work at all, and an idle one only looks
+ * at the others' run queue counts, unlocked, and then locks the one
+ * run queue it takes from.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. So a thread is only taken if it hasn't run
+ * for STEAL_COLD_HARDCLOCKS of its cpu's hardclocks, by which time
+ * its cache footprint is likely gone anyway, and the lowest-priority
+ * threads, which run least often, are taken first. (System/161 does
+ * not (yet) model such cache effects, so this is kept short.)
+ */
+
+#define STEAL_COLD_HARDCLOCKS	2
+
+/*
+ * Find a thread on C's run queues that can be taken for another cpu
+ * and take it off. Returns NULL if there isn't one.
+ */
+static
+struct thread *
+runqueue_remstealable(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_LEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			/*
+			 * Ordinarily the cpu's current thread will not
+			 * appear on its run queue. However, it can if it
+			 * went to sleep, the cpu went idle so it stayed
+			 * curthread, and it was woken before the cpu
+			 * got around to switching to it. Migrating it
+			 * would be bad, so skip it.
+			 */
+			if (t == c->c_curthread) {
+				continue;
+			}
+			/* Only take threads that may run on this cpu. */
+			if (!CPUMASK_ISSET(t->t_cpumask, curcpu->c_number)) {
+				continue;
+			}
+			/* Cache warmth doesn't matter if it can't stay. */
+			if (CPUMASK_ISSET(t->t_cpumask, c->c_number) &&
+			    c->c_hardclocks - t->t_lastran <
+			    STEAL_COLD_HARDCLOCKS) {
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Steal a thread for the current cpu, which has nothing to run.
+ * Called with the current cpu's run queue unlocked, so that two idle
+ * cpus looking at each other can't deadlock. Returns the thread,
+ * which is on no list and now belongs to this cpu, or NULL.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, j, numcpus, count, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		/* Not locked, so only a hint; checked again below. */
+		count = 0;
+		for (j=0; j<SCHED_LEVELS; j++) {
+			count += c->c_runqueue[j].tl_count;
+		}
+		if (count > most) {
+			most = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remstealable(victim);
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+		victim->c_stats.ss_migrations++;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * Tickless operation.
+ *
+ * The hardclock is only needed to end quanta, so a cpu stops it when
+ * it goes idle and when the thread it's running is the only one it
+ * has, and restarts it when another thread is put on its run queue:
+ * directly if that happens on the cpu itself, otherwise by way of
+ * the IPI_UNIDLE that thread_make_runnable sends. It also keeps
+ * running while the cpu has timeouts pending, and timeout_set
+ * restarts it through thread_clockneeded.
+ *
+ * An idle cpu with its clock stopped no longer wakes up by itself to
+ * look for work to steal, so busy cpus with threads waiting kick one
+ * of them on each hardclock. idle_cpus counts the cpus sleeping in
+ * the idle loop so busy ones don't have to look when there are none.
+ */
+
+static volatile unsigned idle_cpus;
+
+/* Stop the current cpu's hardclock. */
+static
+void
+thread_clockstop(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (!curcpu->c_tickless && !timerwheel_busy(&curcpu->c_timers)) {
+		mainbus_hardclock_stop();
+		curcpu->c_tickless = true;
+		timepage_tickless(true);
+	}
+}
+
+/* Restart the current cpu's hardclock if it's stopped and needed. */
+static
+void
+thread_clockcheck(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (curcpu->c_tickless && runqueue_count(curcpu->c_self) > 0) {
+		mainbus_hardclock_start();
+		curcpu->c_tickless = false;
+		timepage_tickless(false);
+	}
+}
+
+/* Restart the current cpu's hardclock for a new timeout. */
+void
+thread_clockneeded(void)
+{
+	KASSERT(curthread->t_curspl > 0);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_tickless) {
+		mainbus_hardclock_start();
+		curcpu->c_tickless = false;
+		timepage_tickless(false);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/* Wake an idle cpu, if there is one, so it can steal from us. */
+static
+void
+thread_kickidle(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* Not locked; at worst we send a useless interrupt. */
+		if (c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Pick a cpu in MASK for a thread that has to move: the one with the
+ * fewest ready threads. The counts aren't locked; it's a hint.
+ */
+static
+struct cpu *
+thread_affinecpu(uint32_t mask)
+{
+	struct cpu *c, *best;
+	unsigned i, j, numcpus, count, fewest;
+
+	best = NULL;
+	fewest = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!CPUMASK_ISSET(mask, c->c_number)) {
+			continue;
+		}
+		count = 0;
+		for (j=0; j<SCHED_LEVELS; j++) {
+			count += c->c_runqueue[j].tl_count;
+		}
+		if (best == NULL || count < fewest) {
+			best = c;
+			fewest = count;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Decide where a thread being woken should go, given that it last
+ * ran on C, whose run queue lock we hold (so the switch away from it
+ * is complete). Returns NULL to leave it on C.
+ *
+ *   - If C is still idling on its stack (see runqueue_remstealable)
+ *     it can't go anywhere else.
+ *   - If it isn't allowed on C, it goes to a cpu where it is.
+ *   - If C has threads waiting already and the waker's cpu has none,
+ *     it comes to the waker's cpu, where it will run sooner; this is
+ *     typical of a waker that's about to block itself. Otherwise it
+ *     stays put, where its cache state is.
+ */
+static
+struct cpu *
+thread_wakecpu(struct thread *t, struct cpu *c)
+{
+	struct cpu *here;
+	unsigned i, herecount;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_curthread == t) {
+		return NULL;
+	}
+	if (!CPUMASK_ISSET(t->t_cpumask, c->c_number)) {
+		return thread_affinecpu(t->t_cpumask);
+	}
+
+	here = curcpu->c_self;
+	if (here == c || !CPUMASK_ISSET(t->t_cpumask, here->c_number)) {
+		return NULL;
+	}
+	if (c->c_isidle || runqueue_count(c) == 0) {
+		return NULL;
+	}
+	/* Not locked; only a hint. */
+	herecount = 0;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		herecount += here->c_runqueue[i].tl_count;
+	}
+	return herecount == 0 ? here : NULL;
+}
+
+/*
+ * Put a thread on C's run queue. C must be locked.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_cpu == c);
+
+	t->t_state = S_READY;
+	if (t->t_throttled && t->t_inherit == SCHED_LEVELS) {
+		/* A lock holder others wait for isn't held back. */
+		threadlist_addtail(&c->c_throttled, t);
+	}
+	else {
+		threadlist_addtail(&c->c_runqueue[thread_prio(t)], t);
+	}
+}
+
+/*
+ * Make sure C notices threads just put on its run queue, which is
+ * locked.
+ */
+static
+void
+runqueue_notify(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c == curcpu->c_self) {
+		/* Our clock may need to run again. */
+		thread_clockcheck();
+	}
+	else if (c->c_isidle || c->c_tickless) {
+		/*
+		 * Other processor is idle, or has its clock stopped;
+		 * send interrupt to make sure it unidles and restarts
+		 * the clock.
+		 */
+		ipi_send(c, IPI_UNIDLE);
+	}
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * targetcpu might be curcpu; it might not be, too. Unless we already
+ * have the lock (when a thread is yielding), thread_wakecpu may move
+ * the thread elsewhere.
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
+	struct cpu *targetcpu, *newcpu;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -465,25 +1125,76 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		newcpu = thread_wakecpu(target, targetcpu);
+		if (newcpu != NULL) {
+			targetcpu->c_stats.ss_migrations++;
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = newcpu;
+			target->t_cpu = targetcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
-	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+	runqueue_add(targetcpu, target);
+	runqueue_notify(targetcpu);
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Make all the threads on LIST runnable, taking each cpu's run queue
+ * lock once for all the threads on that cpu. If MOVING is not NULL,
+ * thread_wakecpu is consulted and threads it moves are put on MOVING
+ * with their new cpu, for the caller to pass back in with MOVING
+ * NULL; otherwise every thread goes where it is.
+ */
+static
+void
+thread_make_runnable_list(struct threadlist *list, struct threadlist *moving)
+{
+	struct threadlist rest;
+	struct thread *t;
+	struct cpu *c, *newcpu;
+	bool added;
+
+	threadlist_init(&rest);
+	while ((t = threadlist_remhead(list)) != NULL) {
+		/* Do everyone on the first thread's cpu. */
+		c = t->t_cpu;
+		added = false;
+		spinlock_acquire(&c->c_runqueue_lock);
+		do {
+			if (t->t_cpu != c) {
+				threadlist_addtail(&rest, t);
+				continue;
+			}
+			newcpu = moving != NULL ? thread_wakecpu(t, c) : NULL;
+			if (newcpu != NULL) {
+				c->c_stats.ss_migrations++;
+				t->t_cpu = newcpu;
+				threadlist_addtail(moving, t);
+			}
+			else {
+				runqueue_add(c, t);
+				added = true;
+			}
+		} while ((t = threadlist_remhead(list)) != NULL);
+		if (added) {
+			runqueue_notify(c);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+
+		/* Then go around again for the others. */
+		while ((t = threadlist_remhead(&rest)) != NULL) {
+			threadlist_addtail(list, t);
+		}
+	}
+	threadlist_cleanup(&rest);
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -503,18 +1214,22 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse a spare thread, stack and all, if we have one */
+	newthread = thread_getspare(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -522,6 +1237,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpumask = curthread->t_cpumask;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -550,6 +1266,89 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * CPU affinity.
+ *
+ * A thread's affinity mask is honored whenever it's put on a run
+ * queue: thread_make_runnable moves it to an allowed cpu if need be,
+ * and thread_steal only takes threads that may run on the thief.
+ *
+ * What it can't do is move a thread that's running, or one whose cpu
+ * went idle on its stack after it went to sleep. So to move itself,
+ * a thread forks a helper pinned to the cpu it's leaving and goes to
+ * sleep; the helper can only run there once we've switched away, and
+ * then wakes us, which puts us on an allowed cpu. This is slow but
+ * affinity changes are rare.
+ */
+
+/* The helper. T is the thread to move; HERE is the cpu it's on. */
+static
+void
+thread_migrator(void *t, unsigned long here)
+{
+	struct thread *target = t;
+
+	KASSERT(curcpu->c_number == here);
+
+	spinlock_acquire(&migrate_lock);
+	while (target->t_sleepwc != migrate_wchan) {
+		/* It got preempted before it could sleep. */
+		spinlock_release(&migrate_lock);
+		thread_yield();
+		spinlock_acquire(&migrate_lock);
+	}
+	threadlist_remove(&migrate_wchan->wc_threads, target);
+	target->t_sleepwc = NULL;
+	thread_make_runnable(target, false);
+	spinlock_release(&migrate_lock);
+}
+
+/*
+ * Restrict the current thread to the cpus in MASK, moving it if it
+ * isn't on one of them. Bits for cpus that don't exist are ignored.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	struct thread *cur = curthread;
+	uint32_t oldmask;
+	unsigned here;
+	int spl, result;
+
+	if (cpuarray_num(&allcpus) < 32) {
+		mask &= CPUMASK(cpuarray_num(&allcpus)) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	spl = splhigh();
+	here = curcpu->c_number;
+	if (CPUMASK_ISSET(mask, here)) {
+		cur->t_cpumask = mask;
+		splx(spl);
+		return 0;
+	}
+	/* Pin ourselves here meanwhile; the helper inherits it. */
+	oldmask = cur->t_cpumask;
+	cur->t_cpumask = CPUMASK(here);
+	splx(spl);
+
+	result = thread_fork("migrate", kproc, thread_migrator, cur, here);
+	if (result) {
+		cur->t_cpumask = oldmask;
+		return result;
+	}
+
+	spinlock_acquire(&migrate_lock);
+	cur->t_cpumask = mask;
+	wchan_sleep(migrate_wchan, &migrate_lock);
+	spinlock_release(&migrate_lock);
+
+	KASSERT(CPUMASK_ISSET(mask, curcpu->c_number));
+	return 0;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -565,6 +1364,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	bool counted;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -591,12 +1391,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu->c_self) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Remember when it last ran, for migration, and for how long. */
+	cur->t_lastran = curcpu->c_hardclocks;
+	schedstats_charge(cur);
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -606,6 +1410,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		cur->t_sleepwc = wc;
+		/*
+		 * A thread that blocks is waiting for I/O or for
+		 * another thread rather than computing; move it up a
+		 * level and give it a fresh quantum.
+		 */
+		if (cur->t_prio > cur->t_class) {
+			cur->t_prio--;
+		}
+		cur->t_ticks = 0;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -643,15 +1457,44 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	counted = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
+			thread_clockstop();
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			/* Not idle while there's background work. */
+			if (next == NULL && !vm_idle()) {
+				if (!counted) {
+					atomic_add(&idle_cpus, 1);
+					counted = true;
+				}
+				schedstats_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (counted) {
+		atomic_add(&idle_cpus, -1);
+	}
+
+	if (next != cur) {
+		/* Switches from the hardclock are preemptions. */
+		if (cur->t_in_interrupt) {
+			curcpu->c_stats.ss_ivswitches++;
+			cur->t_usage.u_nivcsw++;
+		}
+		else {
+			curcpu->c_stats.ss_vswitches++;
+			cur->t_usage.u_nvcsw++;
+		}
+		KTRACE(KT_SWITCH, cur, next);
+	}
+
+	/* If anything else is waiting, we need the clock. */
+	thread_clockcheck();
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -819,139 +1662,285 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. There are SCHED_LEVELS
+ * priority levels, each with its own run queue on each cpu, and a
+ * thread at level L gets a quantum of SCHED_QUANTUM(L) hardclocks, so
+ * the lower levels run less often but for longer at a time.
+ *
+ * The levels are divided among scheduling classes. SCHED_REALTIME
+ * and SCHED_HIGH have one level each, at the top, and their threads
+ * stay there; they round-robin among themselves a hardclock at a
+ * time and always run ahead of SCHED_NORMAL. That is for kernel
+ * daemons that have to keep up whatever the user load, like the
+ * syncer, which otherwise falls behind when the cpus are busy and
+ * leaves writers to clean buffers synchronously. Such daemons mostly
+ * sleep, so they don't starve the rest. SCHED_NORMAL threads move
+ * among the rest of the levels, starting at the top of them:
+ *
+ *    - New threads start at the top SCHED_NORMAL level.
+ *    - A thread that uses up its quantum drops a level (thread_tick).
+ *    - A thread that goes to sleep on a wait channel, which usually
+ *      means waiting for I/O, moves up a level (thread_switch).
+ *    - Every SCHEDULE_HARDCLOCKS, everything ready to run on the cpu
+ *      is put back at the top of its class (schedule), so threads
+ *      stuck at the bottom behind a stream of interactive ones
+ *      aren't starved.
+ *
+ * The running thread is preempted when its quantum runs out or, at
+ * the next hardclock, when a thread of higher priority is ready.
+ *
+ * A process may also have a cpu share (RLIMIT_CPUSHARE), a
+ * percentage of each SCHED_SHAREPERIOD hardclocks its threads may
+ * run for while other threads are waiting for the cpu. A thread that
+ * goes over is throttled: it's put on c_throttled, which is only
+ * looked at when the run queues are empty, until the next schedule()
+ * lets it back. So a runaway process can't crowd out the rest, but
+ * still gets whatever cpu time nobody else wants. Ticks with nothing
+ * else waiting aren't counted against the share.
  */
 
-void
-schedule(void)
+#define SCHED_QUANTUM(prio) \
+	((prio) < SCHED_NORMAL ? 1U : 1U << ((prio) - SCHED_NORMAL))
+
+/* Same as SCHEDULE_HARDCLOCKS in clock.c, so schedule() ends each. */
+#define SCHED_SHAREPERIOD	100
+
+/*
+ * Charge a hardclock against the current thread's cpu share. Returns
+ * true if that puts it over. This reads p_cpushare without p_lock;
+ * a stale share only matters for the one tick.
+ */
+static
+bool
+thread_sharetick(struct thread *cur)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	unsigned share;
+
+	share = cur->t_proc == NULL ? 100 : cur->t_proc->p_cpushare;
+	if (share >= 100) {
+		return false;
+	}
+	if (curcpu->c_hardclocks - cur->t_sharestart >= SCHED_SHAREPERIOD) {
+		/* It slept through the end of the last period. */
+		cur->t_sharestart = curcpu->c_hardclocks;
+		cur->t_shareticks = 0;
+	}
+	cur->t_shareticks++;
+	return cur->t_shareticks * 100 > share * SCHED_SHAREPERIOD;
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called from hardclock() on every tick.
  */
 void
-thread_consider_migration(void)
+thread_tick(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur;
+	struct schedstats *ss;
+	unsigned count;
+	bool yield;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* The timer interrupted the idle loop; nothing to charge */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	ss = &curcpu->c_stats;
+	count = runqueue_count(curcpu->c_self);
+	ss->ss_rqsamples++;
+	ss->ss_rqtotal += count;
+	if (count > ss->ss_rqmax) {
+		ss->ss_rqmax = count;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (count == 0) {
+		/* Nothing else to run; no quantum to enforce. */
+		thread_clockstop();
+		spinlock_release(&curcpu->c_runqueue_lock);
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	cur->t_ticks++;
+	if (thread_sharetick(cur)) {
+		cur->t_throttled = true;
+		yield = true;
+	}
+	else if (cur->t_ticks >= SCHED_QUANTUM(cur->t_prio)) {
+		if (cur->t_class == SCHED_NORMAL &&
+		    cur->t_prio < SCHED_LEVELS - 1) {
+			cur->t_prio++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	else {
+		yield = runqueue_count_above(curcpu->c_self,
+					     thread_prio(cur)) > 0;
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	if (idle_cpus > 0) {
+		thread_kickidle();
+	}
+	if (yield) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It puts all the
+ * threads on the current CPU's run queues, and the current thread,
+ * back at the top priority level of their class. Only SCHED_NORMAL
+ * threads are ever below it. It also starts a new cpu share period,
+ * letting the throttled threads back on the run queues.
+ */
+void
+schedule(void)
+{
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&curcpu->c_throttled)) != NULL) {
+		t->t_throttled = false;
+		t->t_shareticks = 0;
+		t->t_sharestart = curcpu->c_hardclocks;
+		t->t_prio = t->t_class;
+		t->t_ticks = 0;
+		threadlist_addtail(&curcpu->c_runqueue[thread_prio(t)], t);
+	}
+	for (i=SCHED_NORMAL+1; i<SCHED_LEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			KASSERT(t->t_class == SCHED_NORMAL);
+			t->t_prio = SCHED_NORMAL;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[SCHED_NORMAL],
+					   t);
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_prio = curthread->t_class;
+		curthread->t_ticks = 0;
+		curthread->t_throttled = false;
+		curthread->t_shareticks = 0;
+		curthread->t_sharestart = curcpu->c_hardclocks;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+/*
+ * Priority inheritance. A thread holding a lock that a higher-priority
+ * thread is waiting for is lent that thread's priority by synch.c,
+ * so middling threads that keep it from running can't hold up the
+ * waiter indefinitely. The lent level is kept in t_inherit, apart
+ * from t_prio, so the holder keeps it even if it uses up quanta;
+ * it lasts until the holder has let go of all its locks.
+ */
+
+/*
+ * Lock T's cpu's run queue and return the cpu. T's cpu might change
+ * until it is locked.
+ */
+static
+struct cpu *
+thread_lockcpu(struct thread *t)
+{
+	struct cpu *c;
+
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			return c;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
+}
+
+unsigned
+thread_curprio(void)
+{
+	/* Only we and our own cpu's clock change this; no lock needed. */
+	return thread_prio(curthread);
+}
+
+void
+thread_inherit(struct thread *t, unsigned prio)
+{
+	struct cpu *c;
+	struct thread *t2;
+	struct threadlist *rq;
+	unsigned i;
+
+	KASSERT(prio < SCHED_LEVELS);
+
+	c = thread_lockcpu(t);
+	if (prio >= thread_prio(t)) {
+		/* Already at least that good. */
+		spinlock_release(&c->c_runqueue_lock);
+		return;
+	}
+	t->t_inherit = prio;
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	if (t->t_state == S_READY) {
+		/*
+		 * Move it to the queue for its new level. Look for it
+		 * rather than trusting its old level, as that might
+		 * have changed while it was being put on the queue.
+		 */
+		for (i=0; i<=SCHED_LEVELS; i++) {
+			rq = i < SCHED_LEVELS ? &c->c_runqueue[i] :
+				&c->c_throttled;
+			THREADLIST_FORALL(t2, *rq) {
+				if (t2 == t) {
+					break;
+				}
+			}
+			if (t2 == t) {
+				threadlist_remove(rq, t);
+				threadlist_addtail(&c->c_runqueue[prio], t);
+				break;
+			}
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+void
+thread_disinherit(void)
+{
+	struct cpu *c;
+
+	if (curthread->t_inherit == SCHED_LEVELS) {
+		/* The usual case; only other threads ever set it. */
+		return;
+	}
+	c = thread_lockcpu(curthread);
+	curthread->t_inherit = SCHED_LEVELS;
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Scheduling class changes. A thread only changes its own class, so
+ * it isn't on a run queue that would have to be fixed.
+ */
+void
+thread_setclass(unsigned class)
+{
+	struct cpu *c;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	KASSERT(class <= SCHED_NORMAL);
+
+	c = thread_lockcpu(curthread);
+	curthread->t_class = class;
+	curthread->t_prio = class;
+	curthread->t_ticks = 0;
+	spinlock_release(&c->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -973,7 +1962,7 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmalloc_tagged(sizeof(*wc), &wchan_heaptag);
 	if (wc == NULL) {
 		return NULL;
 	}
@@ -991,7 +1980,16 @@ void
 wchan_destroy(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kfree_tagged(wc, sizeof(*wc), &wchan_heaptag);
+}
+
+/*
+ * Rename a wait channel; for objects that keep theirs between uses.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1013,14 +2011,84 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	/* must not hold other spinlocks */
 	KASSERT(curcpu->c_spinlocks == 1);
 
+	KTRACE(KT_SLEEP, wc, 0);
 	thread_switch(S_SLEEP, wc, lk);
 	spinlock_acquire(lk);
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * State shared between wchan_sleep_timeout and its timeout callback.
+ */
+struct wchan_timeout {
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	struct spinlock *wt_lock;
+	bool wt_timedout;
+};
+
+/*
+ * Timeout callback for wchan_sleep_timeout: if the thread is still
+ * asleep on the channel, take it off and wake it. Wakers clear
+ * t_sleepwc, under the same lock, when they take a thread off, so
+ * there's no doubt about who got there first.
  */
+static
 void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct thread *target = wt->wt_thread;
+
+	spinlock_acquire(wt->wt_lock);
+	if (target->t_sleepwc == wt->wt_wchan) {
+		threadlist_remove(&wt->wt_wchan->wc_threads, target);
+		target->t_sleepwc = NULL;
+		wt->wt_timedout = true;
+		thread_make_runnable(target, false);
+	}
+	spinlock_release(wt->wt_lock);
+}
+
+/*
+ * Like wchan_sleep, but give up after DELAY if nobody has woken us.
+ * Returns 0 if woken, ETIMEDOUT if the delay ran out.
+ *
+ * The timeout is set while LK is held, so it can't fire before we're
+ * on the channel; it's cancelled (waiting for the callback if it's
+ * running elsewhere) before LK is retaken, so WT and TO don't outlive
+ * this call.
+ */
+int
+wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk,
+		    const struct timespec *delay)
+{
+	struct wchan_timeout wt;
+	struct timeout to;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	wt.wt_thread = curthread;
+	wt.wt_wchan = wc;
+	wt.wt_lock = lk;
+	wt.wt_timedout = false;
+	timeout_init(&to, wchan_timeout, &wt);
+	timeout_set(&to, delay);
+
+	KTRACE(KT_SLEEP, wc, 0);
+	thread_switch(S_SLEEP, wc, lk);
+
+	timeout_cancel(&to);
+	spinlock_acquire(lk);
+	return wt.wt_timedout ? ETIMEDOUT : 0;
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel. Returns the thread
+ * woken, or NULL if there was none.
+ */
+struct thread *
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
@@ -1032,8 +2100,10 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
+	target->t_sleepwc = NULL;
+	KTRACE(KT_WAKEONE, wc, target);
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1044,6 +2114,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 */
 
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1053,32 +2124,75 @@ void
 wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct threadlist list, moving;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
 	threadlist_init(&list);
+	threadlist_init(&moving);
 
 	/*
 	 * Grab all the threads from the channel, moving them to a
 	 * private list.
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_sleepwc = NULL;
 		threadlist_addtail(&list, target);
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Make them runnable a cpu at a time, so each run queue lock
+	 * is taken and each IPI sent once per cpu rather than once per
+	 * thread. Those wakeup placement moves go around again.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
-	}
+	thread_make_runnable_list(&list, &moving);
+	thread_make_runnable_list(&moving, NULL);
 
+	threadlist_cleanup(&moving);
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move one thread, or all threads, sleeping on FROM to the end of TO
+ * without waking them; they wake when TO is woken. When they do, they
+ * return from their sleep as usual, relocking the spinlock they slept
+ * with (FROMLK). A wchan_sleep_timeout timeout stops applying once a
+ * thread has been moved, as it counts as woken.
+ */
+void
+wchan_morphone(struct wchan *from, struct spinlock *fromlk,
+	       struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	target = threadlist_remhead(&from->wc_threads);
+	if (target == NULL) {
+		return;
+	}
+	target->t_sleepwc = to;
+	target->t_wchan_name = to->wc_name;
+	threadlist_addtail(&to->wc_threads, target);
+}
+
+void
+wchan_morphall(struct wchan *from, struct spinlock *fromlk,
+	       struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_sleepwc = to;
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1101,16 +2215,37 @@ wchan_isempty(struct wchan *wc, struct spinlock *lk)
  */
 
 /*
- * Send an IPI (inter-processor interrupt) to the specified CPU.
+ * Mark an IPI pending on the target CPU, whose IPI lock must be held.
+ *
+ * The hardware interrupt is only raised if nothing was pending yet.
+ * Otherwise one is already on its way, and since the handler reads
+ * and clears c_ipi_pending under the same lock it will see this bit
+ * too.
  */
+static
 void
-ipi_send(struct cpu *target, int code)
+ipi_post(struct cpu *target, int code)
 {
+	uint32_t was;
+
 	KASSERT(code >= 0 && code < 32);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
-	spinlock_acquire(&target->c_ipi_lock);
+	was = target->c_ipi_pending;
 	target->c_ipi_pending |= (uint32_t)1 << code;
-	mainbus_send_ipi(target);
+	if (was == 0) {
+		mainbus_send_ipi(target);
+	}
+}
+
+/*
+ * Send an IPI (inter-processor interrupt) to the specified CPU.
+ */
+void
+ipi_send(struct cpu *target, int code)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_post(target, code);
 	spinlock_release(&target->c_ipi_lock);
 }
 
@@ -1131,40 +2266,123 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Try to fold the shootdown TS into the queued shootdown INTO.
+ * Returns true if INTO now covers TS as well.
+ *
+ * A whole-TLB flush covers everything. Otherwise requests only merge
+ * within one address space: a flush of the whole space absorbs any
+ * range, and two ranges merge if they overlap or touch.
+ */
+static
+bool
+tlbshootdown_merge(struct tlbshootdown *into, const struct tlbshootdown *ts)
+{
+	vaddr_t start, end, tsend;
+
+	if (into->ts_as == NULL && into->ts_npages == TLBSHOOTDOWN_ALL) {
+		return true;
+	}
+	if (into->ts_as != ts->ts_as || ts->ts_as == NULL) {
+		return false;
+	}
+	if (into->ts_npages == TLBSHOOTDOWN_ALL) {
+		return true;
+	}
+	if (ts->ts_npages == TLBSHOOTDOWN_ALL) {
+		into->ts_vaddr = 0;
+		into->ts_npages = TLBSHOOTDOWN_ALL;
+		return true;
+	}
+
+	end = into->ts_vaddr + into->ts_npages * PAGE_SIZE;
+	tsend = ts->ts_vaddr + ts->ts_npages * PAGE_SIZE;
+	if (ts->ts_vaddr > end || tsend < into->ts_vaddr) {
+		return false;
+	}
+	start = ts->ts_vaddr < into->ts_vaddr ? ts->ts_vaddr : into->ts_vaddr;
+	end = tsend > end ? tsend : end;
+	into->ts_vaddr = start;
+	into->ts_npages = (end - start) / PAGE_SIZE;
+	return true;
+}
+
 /*
  * Send a TLB shootdown IPI to the specified CPU.
+ *
+ * The request is merged into one already queued if possible, and if
+ * the queue is full it is collapsed into a single whole-TLB flush;
+ * this is never wrong, only slower. A whole-TLB flush likewise
+ * replaces everything queued.
  */
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	unsigned i, n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+	for (i=0; i<n; i++) {
+		if (tlbshootdown_merge(&target->c_shootdown[i], mapping)) {
+			break;
+		}
+	}
+	if (i < n) {
+		/* merged */
+	}
+	else if (n == TLBSHOOTDOWN_MAX ||
+		 (mapping->ts_as == NULL &&
+		  mapping->ts_npages == TLBSHOOTDOWN_ALL)) {
+		target->c_shootdown[0].ts_as = NULL;
+		target->c_shootdown[0].ts_vaddr = 0;
+		target->c_shootdown[0].ts_npages = TLBSHOOTDOWN_ALL;
+		target->c_numshootdown = 1;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	ipi_post(target, IPI_TLBSHOOTDOWN);
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown to every other CPU that may have the mapping
+ * cached.
+ *
+ * CPUs whose c_tlbas is some other address space are skipped: they
+ * flushed their TLB when they last switched address spaces, and will
+ * flush it again before they can load mapping->ts_as. (With address
+ * space IDs, the VM system invalidates the ID on those cpus instead,
+ * before calling this.) The barrier
+ * orders the caller's page table changes before the c_tlbas reads,
+ * pairing with the one in as_activate, so that a CPU switching to the
+ * address space as we look either is seen here or sees the new page
+ * tables.
+ */
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	membar_any_any();
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		if (mapping->ts_as != NULL && c->c_tlbas != mapping->ts_as) {
+			continue;
+		}
+		ipi_tlbshootdown(c, mapping);
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1197,7 +2415,7 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; the clock is checked below.
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1214,4 +2432,16 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		/*
+		 * Restart the clock if a thread was put on our run
+		 * queue while it was stopped. This can't be done with
+		 * the IPI lock held, because thread_make_runnable
+		 * sends IPIs with a run queue lock held.
+		 */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		thread_clockcheck();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
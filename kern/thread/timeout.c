@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Timeouts, kept on per-cpu hierarchical timer wheels. See timeout.h.
+ */
+
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <timeout.h>
+
+#define NS_PER_TICK	(1000000000 / HZ)
+
+/*
+ * Convert DELAY to hardclocks.
+ */
+static
+unsigned
+timeout_ticks(const struct timespec *delay)
+{
+	unsigned ticks;
+
+	KASSERT(delay->tv_sec >= 0);
+	KASSERT(delay->tv_nsec >= 0 && delay->tv_nsec < 1000000000);
+
+	if (delay->tv_sec >= TW_MAXTICKS / HZ) {
+		return TW_MAXTICKS;
+	}
+	ticks = (unsigned)delay->tv_sec * HZ;
+	ticks += DIVROUNDUP((unsigned)delay->tv_nsec, NS_PER_TICK) + 1;
+	return ticks > TW_MAXTICKS ? TW_MAXTICKS : ticks;
+}
+
+/*
+ * Put TO in the bucket for its expiry time. Level n holds timeouts
+ * due within TW_SLOTS^(n+1) hardclocks, indexed by the level-n digit
+ * of the expiry time, so a bucket comes up for cascading just as the
+ * timeouts in it come within range of the level below.
+ */
+static
+void
+timerwheel_add(struct timerwheel *tw, struct timeout *to)
+{
+	struct timeout **head;
+	unsigned delta, level, index;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	delta = to->to_expires - tw->tw_now;
+	if ((int)delta < 0) {
+		/* Overdue; run it on this hardclock. */
+		level = 0;
+		index = tw->tw_now & TW_SLOTMASK;
+	}
+	else {
+		for (level = 0; level < TW_LEVELS - 1; level++) {
+			if (delta < 1U << ((level + 1) * TW_SLOTBITS)) {
+				break;
+			}
+		}
+		index = (to->to_expires >> (level * TW_SLOTBITS)) &
+			TW_SLOTMASK;
+	}
+
+	head = &tw->tw_slots[level][index];
+	to->to_next = *head;
+	to->to_prevp = head;
+	if (*head != NULL) {
+		(*head)->to_prevp = &to->to_next;
+	}
+	*head = to;
+	to->to_pending = true;
+}
+
+/*
+ * Take TO off its bucket.
+ */
+static
+void
+timerwheel_remove(struct timerwheel *tw, struct timeout *to)
+{
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+	KASSERT(to->to_pending);
+
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_pending = false;
+	KASSERT(tw->tw_count > 0);
+	tw->tw_count--;
+}
+
+/*
+ * Redistribute the current bucket of LEVEL into the levels below.
+ * Returns the index of that bucket; if it's 0, the level above is
+ * due for cascading too.
+ */
+static
+unsigned
+timerwheel_cascade(struct timerwheel *tw, unsigned level)
+{
+	struct timeout *to, *list;
+	unsigned index;
+
+	index = (tw->tw_now >> (level * TW_SLOTBITS)) & TW_SLOTMASK;
+	list = tw->tw_slots[level][index];
+	tw->tw_slots[level][index] = NULL;
+	while ((to = list) != NULL) {
+		list = to->to_next;
+		timerwheel_add(tw, to);
+	}
+	return index;
+}
+
+void
+timerwheel_init(struct timerwheel *tw)
+{
+	unsigned i, j;
+
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 0;
+	tw->tw_count = 0;
+	tw->tw_running = NULL;
+	for (i=0; i<TW_LEVELS; i++) {
+		for (j=0; j<TW_SLOTS; j++) {
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+}
+
+bool
+timerwheel_busy(struct timerwheel *tw)
+{
+	return tw->tw_count > 0;
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_wheel = NULL;
+	to->to_expires = 0;
+	to->to_pending = false;
+	to->to_func = func;
+	to->to_arg = arg;
+}
+
+void
+timeout_set(struct timeout *to, const struct timespec *delay)
+{
+	struct timerwheel *tw;
+	unsigned ticks;
+	int spl;
+
+	ticks = timeout_ticks(delay);
+	timeout_cancel(to);
+
+	/* Stay on this cpu until the timeout is on its wheel. */
+	spl = splhigh();
+	tw = &curcpu->c_timers;
+
+	spinlock_acquire(&tw->tw_lock);
+	to->to_wheel = tw;
+	to->to_expires = tw->tw_now + ticks;
+	timerwheel_add(tw, to);
+	tw->tw_count++;
+	spinlock_release(&tw->tw_lock);
+
+	/* If our hardclock is stopped, it's needed again. */
+	thread_clockneeded();
+	splx(spl);
+}
+
+bool
+timeout_cancel(struct timeout *to)
+{
+	struct timerwheel *tw;
+	bool removed;
+
+	tw = to->to_wheel;
+	if (tw == NULL) {
+		/* Never set. */
+		return false;
+	}
+
+	spinlock_acquire(&tw->tw_lock);
+	removed = to->to_pending;
+	if (removed) {
+		timerwheel_remove(tw, to);
+	}
+	else if (tw != &curcpu->c_timers) {
+		/*
+		 * If the callback is running on its cpu, wait for it.
+		 * (On our own cpu, it can only be running if we're
+		 * being called from it, as callbacks run in the timer
+		 * interrupt.)
+		 */
+		while (tw->tw_running == to) {
+			spinlock_release(&tw->tw_lock);
+			spinlock_acquire(&tw->tw_lock);
+		}
+	}
+	spinlock_release(&tw->tw_lock);
+	return removed;
+}
+
+/*
+ * Process one hardclock on the current cpu's wheel. The wheel lock
+ * is dropped around each callback so callbacks can set and cancel
+ * timeouts, including their own.
+ */
+void
+timeout_tick(void)
+{
+	struct timerwheel *tw;
+	struct timeout *to, **head;
+	unsigned level;
+
+	tw = &curcpu->c_timers;
+
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count > 0) {
+		if ((tw->tw_now & TW_SLOTMASK) == 0) {
+			level = 1;
+			while (level < TW_LEVELS &&
+			       timerwheel_cascade(tw, level) == 0) {
+				level++;
+			}
+		}
+
+		head = &tw->tw_slots[0][tw->tw_now & TW_SLOTMASK];
+		while ((to = *head) != NULL) {
+			timerwheel_remove(tw, to);
+			tw->tw_running = to;
+			spinlock_release(&tw->tw_lock);
+
+			to->to_func(to->to_arg);
+
+			spinlock_acquire(&tw->tw_lock);
+			tw->tw_running = NULL;
+		}
+	}
+	tw->tw_now++;
+	spinlock_release(&tw->tw_lock);
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Workqueues. See workqueue.h.
+ */
+
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <vm.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <threadprivate.h>
+#include <current.h>
+#include <workqueue.h>
+
+/* Worker threads per cpu in system_wq */
+#define WQ_SYSWORKERS	2
+
+/*
+ * Per-cpu part of a workqueue.
+ *
+ * The pending work is a FIFO list. Each item gets a sequence number
+ * when it's queued (never 0), and wc_busy[i] is the number of the
+ * item worker i is running, or 0 if it's idle; flush_workqueue uses
+ * these to tell when everything queued before it has run. Each is
+ * on its own cache lines, as the cpus mostly use their own.
+ */
+struct wqcpu {
+	struct spinlock wc_lock;
+	struct work *wc_head;		/* First pending work */
+	struct work **wc_tailp;		/* Where to put the next */
+	unsigned wc_seq;		/* Number of the last work queued */
+	unsigned wc_busy[WQ_MAXWORKERS]; /* What each worker is running */
+	unsigned wc_nworkers;		/* Worker threads alive */
+	bool wc_dying;			/* Workers should exit */
+	struct wchan *wc_wchan;		/* Idle workers sleep here */
+	struct wchan *wc_flushwchan;	/* Flushers sleep here */
+	unsigned wc_cpu;		/* Which cpu */
+	unsigned wc_class;		/* Scheduling class of workers */
+} __ALIGNED(CACHELINE_SIZE);
+
+struct workqueue {
+	char *wq_name;
+	unsigned wq_ncpus;
+	struct wqcpu *wq_cpus;		/* One per cpu */
+};
+
+struct workqueue *system_wq;
+
+/*
+ * Return true if any work numbered SEQ or earlier is still queued or
+ * running on WC. Sequence numbers wrap, so they're compared by
+ * difference.
+ */
+static
+bool
+wqcpu_busy_through(struct wqcpu *wc, unsigned seq)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	if (wc->wc_head != NULL && (int)(wc->wc_head->w_seq - seq) <= 0) {
+		return true;
+	}
+	for (i=0; i<WQ_MAXWORKERS; i++) {
+		if (wc->wc_busy[i] != 0 && (int)(wc->wc_busy[i] - seq) <= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Worker thread. DATA1 is its struct wqcpu and DATA2 its slot in
+ * wc_busy.
+ */
+static
+void
+wq_worker(void *data1, unsigned long data2)
+{
+	struct wqcpu *wc = data1;
+	unsigned slot = data2;
+	struct work *w;
+	void (*func)(void *);
+	void *arg;
+
+	/* Move to our cpu for good. */
+	if (thread_setaffinity(CPUMASK(wc->wc_cpu))) {
+		panic("workqueue: no cpu %u\n", wc->wc_cpu);
+	}
+	thread_setclass(wc->wc_class);
+
+	spinlock_acquire(&wc->wc_lock);
+	while (1) {
+		w = wc->wc_head;
+		if (w == NULL) {
+			if (wc->wc_dying) {
+				break;
+			}
+			wchan_sleep(wc->wc_wchan, &wc->wc_lock);
+			continue;
+		}
+
+		wc->wc_head = w->w_next;
+		if (wc->wc_head == NULL) {
+			wc->wc_tailp = &wc->wc_head;
+		}
+		w->w_next = NULL;
+		w->w_queued = false;
+		wc->wc_busy[slot] = w->w_seq;
+
+		/* Not pending any more, so it can queue itself again. */
+		func = w->w_func;
+		arg = w->w_arg;
+		atomic_cas(&w->w_pending, 1, 0);
+		spinlock_release(&wc->wc_lock);
+
+		func(arg);
+
+		spinlock_acquire(&wc->wc_lock);
+		wc->wc_busy[slot] = 0;
+		wchan_wakeall(wc->wc_flushwchan, &wc->wc_lock);
+	}
+	KASSERT(wc->wc_nworkers > 0);
+	wc->wc_nworkers--;
+	wchan_wakeall(wc->wc_flushwchan, &wc->wc_lock);
+	spinlock_release(&wc->wc_lock);
+	thread_exit();
+}
+
+/*
+ * Put W, already marked pending, on the current cpu's queue.
+ */
+static
+void
+work_enqueue(struct workqueue *wq, struct work *w)
+{
+	struct wqcpu *wc;
+	int spl;
+
+	KASSERT(w->w_pending == 1);
+
+	/* Stay on this cpu until W is on its queue. */
+	spl = splhigh();
+	KASSERT(curcpu->c_number < wq->wq_ncpus);
+	wc = &wq->wq_cpus[curcpu->c_number];
+
+	spinlock_acquire(&wc->wc_lock);
+	KASSERT(!w->w_queued);
+	w->w_next = NULL;
+	w->w_queue = wc;
+	w->w_queued = true;
+	if (++wc->wc_seq == 0) {
+		wc->wc_seq = 1;
+	}
+	w->w_seq = wc->wc_seq;
+	*wc->wc_tailp = w;
+	wc->wc_tailp = &w->w_next;
+	wchan_wakeone(wc->wc_wchan, &wc->wc_lock);
+	spinlock_release(&wc->wc_lock);
+	splx(spl);
+}
+
+/*
+ * Timeout callback for delayed work; runs on the cpu that queued it.
+ */
+static
+void
+work_timeout(void *data)
+{
+	struct work *w = data;
+
+	work_enqueue(w->w_wq, w);
+}
+
+////////////////////////////////////////////////////////////
+
+void
+workqueue_bootstrap(void)
+{
+	system_wq = workqueue_create("system_wq", WQ_SYSWORKERS,
+				     SCHED_REALTIME);
+	if (system_wq == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+}
+
+struct workqueue *
+workqueue_create(const char *name, unsigned nworkers, unsigned schedclass)
+{
+	struct workqueue *wq;
+	struct wqcpu *wc;
+	unsigned i, j;
+	int result;
+
+	KASSERT(nworkers > 0 && nworkers <= WQ_MAXWORKERS);
+	KASSERT(schedclass <= SCHED_NORMAL);
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_name = kstrdup(name);
+	if (wq->wq_name == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_ncpus = thread_numcpus();
+	wq->wq_cpus = kmalloc(wq->wq_ncpus * sizeof(wq->wq_cpus[0]));
+	if (wq->wq_cpus == NULL) {
+		kfree(wq->wq_name);
+		kfree(wq);
+		return NULL;
+	}
+
+	/* Set up all the queues first so that destroy can clean up. */
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wc = &wq->wq_cpus[i];
+		spinlock_init(&wc->wc_lock);
+		wc->wc_head = NULL;
+		wc->wc_tailp = &wc->wc_head;
+		wc->wc_seq = 0;
+		for (j=0; j<WQ_MAXWORKERS; j++) {
+			wc->wc_busy[j] = 0;
+		}
+		wc->wc_nworkers = 0;
+		wc->wc_dying = false;
+		wc->wc_wchan = wchan_create(wq->wq_name);
+		wc->wc_flushwchan = wchan_create(wq->wq_name);
+		wc->wc_cpu = i;
+		wc->wc_class = schedclass;
+	}
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wc = &wq->wq_cpus[i];
+		if (wc->wc_wchan == NULL || wc->wc_flushwchan == NULL) {
+			workqueue_destroy(wq);
+			return NULL;
+		}
+	}
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wc = &wq->wq_cpus[i];
+		for (j=0; j<nworkers; j++) {
+			spinlock_acquire(&wc->wc_lock);
+			wc->wc_nworkers++;
+			spinlock_release(&wc->wc_lock);
+			result = thread_fork(wq->wq_name, NULL, wq_worker,
+					     wc, j);
+			if (result) {
+				spinlock_acquire(&wc->wc_lock);
+				wc->wc_nworkers--;
+				spinlock_release(&wc->wc_lock);
+				workqueue_destroy(wq);
+				return NULL;
+			}
+		}
+	}
+	return wq;
+}
+
+void
+workqueue_destroy(struct workqueue *wq)
+{
+	struct wqcpu *wc;
+	unsigned i;
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wc = &wq->wq_cpus[i];
+		if (wc->wc_wchan == NULL || wc->wc_flushwchan == NULL) {
+			/* Failed create; no workers, so nothing to stop */
+			KASSERT(wc->wc_nworkers == 0);
+			continue;
+		}
+
+		/* The workers run what's left before exiting. */
+		spinlock_acquire(&wc->wc_lock);
+		wc->wc_dying = true;
+		wchan_wakeall(wc->wc_wchan, &wc->wc_lock);
+		while (wc->wc_nworkers > 0) {
+			wchan_sleep(wc->wc_flushwchan, &wc->wc_lock);
+		}
+		KASSERT(wc->wc_head == NULL);
+		spinlock_release(&wc->wc_lock);
+	}
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wc = &wq->wq_cpus[i];
+		if (wc->wc_wchan != NULL) {
+			wchan_destroy(wc->wc_wchan);
+		}
+		if (wc->wc_flushwchan != NULL) {
+			wchan_destroy(wc->wc_flushwchan);
+		}
+		spinlock_cleanup(&wc->wc_lock);
+	}
+	kfree(wq->wq_cpus);
+	kfree(wq->wq_name);
+	kfree(wq);
+}
+
+void
+work_init(struct work *w, void (*func)(void *), void *arg)
+{
+	w->w_next = NULL;
+	w->w_queue = NULL;
+	w->w_wq = NULL;
+	w->w_pending = 0;
+	w->w_queued = false;
+	w->w_seq = 0;
+	timeout_init(&w->w_timeout, work_timeout, w);
+	w->w_func = func;
+	w->w_arg = arg;
+}
+
+bool
+queue_work(struct workqueue *wq, struct work *w)
+{
+	if (atomic_cas(&w->w_pending, 0, 1) != 0) {
+		return false;
+	}
+	w->w_wq = wq;
+	work_enqueue(wq, w);
+	return true;
+}
+
+bool
+queue_delayed_work(struct workqueue *wq, struct work *w,
+		   const struct timespec *delay)
+{
+	if (atomic_cas(&w->w_pending, 0, 1) != 0) {
+		return false;
+	}
+	w->w_wq = wq;
+	timeout_set(&w->w_timeout, delay);
+	return true;
+}
+
+bool
+cancel_work(struct work *w)
+{
+	struct wqcpu *wc;
+	struct work **wp;
+	bool removed;
+
+	/*
+	 * If the timeout's callback is running, this waits for it,
+	 * so afterwards W is either on a queue or not pending.
+	 */
+	if (timeout_cancel(&w->w_timeout)) {
+		atomic_cas(&w->w_pending, 1, 0);
+		return true;
+	}
+
+	wc = w->w_queue;
+	if (wc == NULL) {
+		/* Never queued. */
+		return false;
+	}
+
+	removed = false;
+	spinlock_acquire(&wc->wc_lock);
+	if (w->w_queue == wc && w->w_queued) {
+		for (wp = &wc->wc_head; *wp != w; wp = &(*wp)->w_next) {
+			KASSERT(*wp != NULL);
+		}
+		*wp = w->w_next;
+		if (wc->wc_tailp == &w->w_next) {
+			wc->wc_tailp = wp;
+		}
+		w->w_next = NULL;
+		w->w_queued = false;
+		atomic_cas(&w->w_pending, 1, 0);
+		removed = true;
+		/* A flusher may have been waiting for it. */
+		wchan_wakeall(wc->wc_flushwchan, &wc->wc_lock);
+	}
+	spinlock_release(&wc->wc_lock);
+	return removed;
+}
+
+void
+flush_workqueue(struct workqueue *wq)
+{
+	struct wqcpu *wc;
+	unsigned i, seq;
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wc = &wq->wq_cpus[i];
+		spinlock_acquire(&wc->wc_lock);
+		seq = wc->wc_seq;
+		while (wqcpu_busy_through(wc, seq)) {
+			wchan_sleep(wc->wc_flushwchan, &wc->wc_lock);
+		}
+		spinlock_release(&wc->wc_lock);
+	}
+}
@@ -29,16 +29,24 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <stdarg.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <array.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
+#include <spinlock.h>
+#include <membar.h>
 #include <synch.h>
+#include <percpu.h>
 #include <mainbus.h>
+#include <vm.h>
 #include <vfs.h>
 #include <fs.h>
 #include <buf.h>
+#include <ktrace.h>
 
 /* Uncomment this to enable printouts of the syncer state. */
 //#define SYNCER_VERBOSE
@@ -47,12 +55,19 @@ DECLARRAY(buf, static __UNUSED inline);
 DEFARRAY(buf, static __UNUSED inline);
 
 /*
- * The required size for all buffers. This is the size SFS uses. In a
- * real system you wouldn't have this restriction, but for us managing
- * buffers of different sizes just creates complications and would
- * serve no purpose.
+ * Buffer sizes. A buffer can be any power of two from BUFFER_MINSIZE
+ * (which is the size SFS uses) to BUFFER_MAXSIZE. Memory is accounted
+ * in units of BUFFER_MINSIZE, so a buffer of size S counts as
+ * BUFFER_UNITS(S) units against the limit and against reservations.
+ *
+ * Detached buffers are kept in one pool per size, so that a buffer
+ * can be reused for another block of the same size without going
+ * back to kmalloc.
  */
-#define ONE_TRUE_BUFFER_SIZE		512
+#define BUFFER_MINSIZE		512
+#define BUFFER_MAXSIZE		8192
+#define BUFFER_SIZECLASSES	5	/* 512, 1k, 2k, 4k, 8k */
+#define BUFFER_UNITS(size)	((size) / BUFFER_MINSIZE)
 
 /*
  * Illegal array index.
@@ -74,34 +89,83 @@ DEFARRAY(buf, static __UNUSED inline);
  */
 #define EDEADBUF EBADF
 
+/*
+ * AmigaOS-style linked list of buffers, along the lines of
+ * threadlist. The head and tail nodes are always on the list as
+ * bookends.
+ *
+ * A node whose bn_buf is NULL that isn't a bookend is a marker: code
+ * that walks a list and needs to let go of the lock partway through
+ * leaves a marker behind to hold its place. Anyone else walking the
+ * list should skip over markers. Markers don't count in bl_count.
+ */
+struct bufnode {
+	struct bufnode *bn_prev;
+	struct bufnode *bn_next;
+	struct buf *bn_buf;
+};
+
+struct buflist {
+	struct bufnode bl_head;
+	struct bufnode bl_tail;
+	unsigned bl_count;
+};
+
 /*
  * One buffer.
+ *
+ * The key fields, which lookups read while walking the hash chains,
+ * come first so a lookup that doesn't match touches only the start
+ * of the buffer. Buffers aren't padded out to cache lines, as there
+ * are thousands of them; the shared, often-written state (the LRU
+ * queue heads and counters) is in struct bufpart, which is.
  */
 struct buf {
+	/* key */
+	struct fs *b_fs;	/* file system buffer belongs to */
+	daddr_t b_physblock;	/* physical block number */
+	struct bufpart *b_part;	/* partition we're attached in */
+	bool b_attached;	/* key fields are valid */
+
+	/* value */
+	void *b_data;
+	size_t b_size;
+
+	void *b_fsdata;		/* fs-specific metadata */
+
 	/* maintenance */
-	unsigned b_tableindex;	/* index into {de,at}tached_buffers */
-	unsigned b_dirtyindex;	/* index into dirty_buffers */
+	struct bufnode b_lrunode;	/* link for LRU queue or free pool */
+	struct bufnode b_dirtynode;	/* link for bp_dirty */
+	struct bufnode b_ownernode;	/* link for b_owner's list */
+	struct bufowner *b_owner;	/* file it was dirtied for, or NULL */
 	unsigned b_bucketindex;	/* index into buffer_hash bucket */
 	unsigned b_dirtyepoch;	/* when we became dirty */
+	unsigned b_lrustamp;	/* bp_lrutick when last used */
 
 	/* status flags */
-	unsigned b_attached:1;	/* key fields are valid */
 	unsigned b_busy:1;	/* currently in use */
 	unsigned b_valid:1;	/* contains real data */
 	unsigned b_dirty:1;	/* data needs to be written to disk */
 	unsigned b_fsmanaged:1;	/* managed by file system */
+	unsigned b_readahead:1;	/* read ahead, not used yet */
+	unsigned b_kind:1;	/* BUFKIND_*, for stats */
+	unsigned b_statget:1;	/* get not yet charged to fs stats */
+	unsigned b_stathit:1;	/* ...and it was a hit */
+	unsigned b_probation:1;	/* on bp_probq when clean */
+	unsigned b_streamuse:1;	/* current use is streaming */
 	struct thread *b_holder; /* who did buffer_mark_busy() */
 	struct timespec b_timestamp; /* when it became dirty */
+};
 
-	/* key */
-	struct fs *b_fs;	/* file system buffer belongs to */
-	daddr_t b_physblock;	/* physical block number */
-
-	/* value */
-	void *b_data;
-	size_t b_size;
-
-	void *b_fsdata;		/* fs-specific metadata */
+/*
+ * A file's dirty buffers (see buffer_set_owner). The list is in the
+ * order the buffers were first dirtied, like bp_dirty. All owner
+ * lists, and b_owner, are protected by buffer_owner_lock, which is
+ * taken while holding a partition lock (never the other way around)
+ * and covers no I/O.
+ */
+struct bufowner {
+	struct buflist bo_dirty;
 };
 
 /*
@@ -113,92 +177,90 @@ struct bufhash {
 };
 
 /*
- * Global state.
+ * Buffer cache partition.
  *
- * The main table of buffers is attached_buffers[]. This is an
- * LRU-ordered array. All buffers in attached_buffers[] should be
- * attached (that is, they are associated with a specific fs and
- * block), and should also be in buffer_hash.
+ * The attached buffers are split into BUFFER_PARTITIONS independent
+ * partitions, chosen by hashing the key (see buffer_partition()).
+ * Each partition has its own lock, hash table, and replacement
+ * queues.
  *
- * Buffers that are dirty *also* appear in dirty_buffers[]; this array
- * is ordered by how recently the buffer was *first* modified.
+ * Every attached buffer is on exactly one of three LRU queues: the
+ * dirty queue (bp_dirtyq) if b_dirty is set, and otherwise the
+ * probationary queue (bp_probq) or the clean queue (bp_cleanq),
+ * according to b_probation. Each queue runs from least to most
+ * recently used, so the eviction candidate is at the head of one of
+ * them and replacement doesn't have to search. Buffers stay on their queue
+ * while busy; since getting a buffer moves it to the tail, busy
+ * buffers are rarely near the head and skipping them is cheap.
  *
- * Buffers that are not attached appear (only) in detached_buffers[],
- * which is not ordered.
+ * The probationary queue is for scan resistance. Blocks read in for
+ * a streaming use (see buffer_set_streaming) and blocks read ahead
+ * start out there, and move to the clean queue only if used again
+ * (or used for the first time, for read-ahead) by someone who isn't
+ * streaming. When the probationary queue holds more than its share
+ * of the partition it is evicted from first, so a single large
+ * sequential read recycles a small set of buffers instead of
+ * flushing the rest of the cache.
  *
- * Space in all three arrays is preallocated when buffers are created
- * so insert ops won't fail on the fly.
+ * Dirty buffers are also on bp_dirty, which is ordered by how
+ * recently they were *first* modified; the syncer uses this to find
+ * buffers that have been dirty too long.
  *
- * The ordered arrays (attached_buffers and dirty_buffers) are
- * preallocated with extra space (and may contain NULL entries) and
- * are compacted only when the extra space runs out.
- */
-
-static struct bufhash buffer_hash;
-
-static struct bufarray attached_buffers;
-static unsigned attached_buffers_first;   /* hint for first empty element */
-static unsigned attached_buffers_thresh;  /* size limit before compacting */
-
-static struct bufarray dirty_buffers;
-static unsigned dirty_buffers_first;      /* hint for first empty element */
-static unsigned dirty_buffers_thresh;     /* size limit before compacting */
-
-static struct bufarray detached_buffers;
-
-/*
- * Epochs and generations.
+ * b_lrustamp records the value of the partition's bp_lrutick when
+ * the buffer was last moved to the tail of its queue. This lets us
+ * compare the recency of buffers on different queues, and estimate
+ * how far from the cold end of the (notional) merged LRU order a
+ * buffer is.
  *
- * The dirty_epoch is incremented whenever an explicit sync call is
- * made, and is used to know when to stop syncing. The
- * dirty_buffers_generation, conversely, is incremented whenever the
- * dirty_buffers table is compacted so syncs in progress know they
- * need to restart from the beginning of it. The attached_buffers
- * generation is the same, but for the attached_buffers table.
+ * Because the partition is a function of the key, a buffer can only
+ * be attached to a given fs and block in one particular partition.
+ * This means that code holding a partition lock can safely recheck
+ * the key of a buffer it was waiting for, even though once detached
+ * the buffer might have been reused in some other partition.
  */
+struct bufpart {
+	struct lock *bp_lock;
+	struct cv *bp_busy_cv;
+	struct bufhash bp_hash;
 
-static unsigned dirty_epoch;
-static unsigned dirty_buffers_generation;
-static unsigned attached_buffers_generation;
-
-/*
- * Counters.
- */
-
-static unsigned attached_buffers_count;
-static unsigned busy_buffers_count;
-static unsigned dirty_buffers_count;
-
-static unsigned num_reserved_buffers;
-static unsigned num_total_buffers;
-static unsigned max_total_buffers;
-
-static unsigned num_total_gets;
-static unsigned num_valid_gets;
-static unsigned num_read_gets;
-static unsigned num_total_writeouts;
-static unsigned num_total_evictions;
-static unsigned num_dirty_evictions;
+	struct buflist bp_cleanq;	/* clean buffers, LRU first */
+	struct buflist bp_probq;	/* probationary buffers, LRU first */
+	struct buflist bp_dirtyq;	/* dirty buffers, LRU first */
+	struct buflist bp_dirty;	/* dirty buffers, oldest first */
+	unsigned bp_lrutick;
 
-/*
- * Syncer state. (This is file-static so it's easily visible from the
- * debugger.)
- */
-static bool syncer_under_load;
-static bool syncer_needs_help;
-static struct thread *syncer_thread;
+	unsigned bp_busy_count;
+	unsigned bp_dirty_units;	/* total size of bp_dirty */
 
-/*
- * Lock
- */
-
-static struct lock *buffer_lock;
+	/* for the syncer's inflow estimate */
+	unsigned bp_dirtied_units;
+} __ALIGNED(CACHELINE_SIZE);		/* not sharing lines with neighbors */
 
 /*
- * CVs
+ * Operation counters. These are bumped on every get, eviction, and
+ * so on, so they are kept per cpu (see percpu.h) to keep counting
+ * from bouncing cache lines between cpus.
  */
-static struct cv *buffer_busy_cv;
-static struct cv *buffer_reserve_cv;
+enum {
+	BC_TOTAL_GETS,
+	BC_VALID_GETS,
+	BC_READ_GETS,
+	BC_TOTAL_WRITEOUTS,
+	BC_CLUSTER_WRITES,
+	BC_CLUSTER_BLOCKS,
+	BC_TOTAL_EVICTIONS,
+	BC_DIRTY_EVICTIONS,
+	BC_READAHEAD_HITS,
+	BC_READAHEAD_WASTED,
+	BC_THROTTLED_GETS,
+	BC_FAST_GETS,
+	BC_BATCH_READS,
+	BC_BATCH_BLOCKS,
+	BC_PROBATION_ADMITS,
+	BC_PROBATION_PROMOTIONS,
+	BC_PROBATION_EVICTIONS,
+	BC_NUM
+};
 
 /*
  * Magic numbers (also search the code for "voodoo:")
@@ -209,16 +271,25 @@ static struct cv *buffer_reserve_cv;
  * factor buffer reservation calls into some of these decisions somehow.
  */
 
+/* Number of independently locked partitions of the cache. */
+#define BUFFER_PARTITIONS	8
+
 /* Number of buffers to reserve for each file system operation. */
 #define RESERVE_BUFFERS		8
 
-/* Factor for choosing attached_buffers_thresh. */
-#define ATTACHED_THRESH_NUM	3
-#define ATTACHED_THRESH_DENOM	2
+/* Blocks per batch in sync_owner_buffers. */
+#define SYNC_OWNER_BATCH	32
+
+/* Number of file systems we keep separate stats for. */
+#define BUFSTATS_MAXFS		8
 
-/* Factor for choosing dirty_buffers_thresh. */
-#define DIRTY_THRESH_NUM	5
-#define DIRTY_THRESH_DENOM	4
+/* Number of eviction latency histogram buckets (powers of two, usec). */
+#define BUFSTATS_LATBUCKETS	16
+
+/* Read-ahead window bounds (blocks) and queue length. */
+#define READAHEAD_MIN		2
+#define READAHEAD_MAX		16
+#define READAHEAD_QUEUE		64
 
 /* Proportion of buffers we want to keep always clean. */
 #define SYNCER_ALWAYS_NUM	1
@@ -237,27 +308,169 @@ static struct cv *buffer_reserve_cv;
 /* Buffer age at which the syncer considers itself in trouble. (seconds) */
 #define SYNCER_HELP_AGE		8
 
-#if 0
-/* Threshold proportion (of bufs dirty) for starting the syncer */
+/* Proportion of buffer space dirty at which the syncer ignores age. */
 #define SYNCER_DIRTY_NUM	1
-#define SYNCER_DIRTY_DENOM	2
+#define SYNCER_DIRTY_DENOM	4
 
-/* Target proportion (of total bufs) for syncer to clean in one run */
-#define SYNCER_TARGET_NUM	1
-#define SYNCER_TARGET_DENOM	4
+/* Proportion of buffer space dirty at which writers are throttled. */
+#define THROTTLE_DIRTY_NUM	1
+#define THROTTLE_DIRTY_DENOM	2
 
-/* Limit on the previous proportion, as proportion of dirty buffers */
-#define SYNCER_LIMIT_NUM	1
-#define SYNCER_LIMIT_DENOM	2
-#endif
+/* Proportion of a partition the probationary queue may use up. */
+#define PROBATION_NUM		1
+#define PROBATION_DENOM		8
 
 /* Overall limit on fraction of main memory to use for buffers */
 #define BUFFER_MAXMEM_NUM	1
 #define BUFFER_MAXMEM_DENOM	4
 
+/* Fraction of main memory the cache starts with and shrinks back to */
+#define BUFFER_MINMEM_NUM	1
+#define BUFFER_MINMEM_DENOM	16
+
+/* Fraction of main memory that must stay free for the cache to grow */
+#define BUFFER_FREEMEM_NUM	1
+#define BUFFER_FREEMEM_DENOM	8
+
+/* How much to grow the cache by at once. (bytes) */
+#define BUFFER_GROWSIZE		(64*1024)
+
 /* Macro for applying a NUM/DENOM pair. */
 #define SCALE(x, K) (((x) * K##_NUM) / K##_DENOM)
 
+/*
+ * Global state.
+ *
+ * The partitions hold all the attached buffers; see above.
+ *
+ * Buffers that are not attached are kept (only) on detached_buffers,
+ * one list per size class, which are not ordered. They are protected
+ * by buffer_pool_lock, as are the total and reserved buffer counts.
+ *
+ * buffer_pool_lock is a leaf: it may be acquired while holding a
+ * partition lock, but not the other way around, and no partition
+ * lock may be acquired while holding another.
+ */
+
+static struct bufpart buffer_parts[BUFFER_PARTITIONS];
+
+static struct buflist detached_buffers[BUFFER_SIZECLASSES];
+
+static struct lock *buffer_pool_lock;
+
+static struct spinlock buffer_owner_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Epoch.
+ *
+ * The dirty_epoch is incremented whenever an explicit sync call is
+ * made, and is used to know when to stop syncing. It is only changed
+ * while holding buffer_pool_lock; buffer_mark_dirty reads it while
+ * holding only the partition lock, which is enough to keep each
+ * partition's dirty list in epoch order.
+ */
+
+static unsigned dirty_epoch;
+
+/*
+ * Counters. The _units ones are in units of BUFFER_MINSIZE.
+ *
+ * max_total_units is the current limit on the size of the cache. It
+ * grows (up to cap_total_units) when the cache fills up and the VM
+ * system says there's memory to spare, and buffer_shrink lowers it
+ * (down to min_total_units) when the VM system needs memory back.
+ * After shrinking, num_total_units can be over the limit until
+ * enough buffers have been destroyed.
+ */
+
+static unsigned num_detached_buffers;
+static unsigned num_total_buffers;
+static unsigned num_reserved_units;
+static unsigned num_total_units;
+static unsigned max_total_units;
+static unsigned min_total_units;
+static unsigned cap_total_units;
+static unsigned num_grown_units;
+static unsigned num_shrunk_units;
+
+static struct percpu_counter buffer_counters[BC_NUM];
+
+/* Heap accounting for the buffers and their data. */
+static struct kheap_tag buffer_heaptag;
+static struct kheap_tag bufdata_heaptag;
+
+/*
+ * Syncer state. (This is file-static so it's easily visible from the
+ * debugger.) Only the syncer changes these; everyone else just peeks.
+ */
+static volatile bool syncer_under_load;
+static volatile bool syncer_needs_help;
+static struct thread *syncer_thread;
+
+/*
+ * Dirty inflow: how much buffer space (in units) gets marked dirty
+ * per syncer round, as a decaying average. Only the syncer uses it.
+ */
+static unsigned syncer_inflow;
+static unsigned syncer_lastdirtied;
+
+/*
+ * CVs
+ */
+static struct cv *buffer_reserve_cv;
+
+/*
+ * Per-filesystem statistics. There's a slot for each of the first
+ * BUFSTATS_MAXFS file systems to use the cache; the last slot
+ * (with bs_fs NULL) collects everything else. Slots are given back
+ * by drop_fs_buffers. Claiming and giving back slots is protected by
+ * buffer_stats_lock, which is a leaf; the counters, and the global
+ * eviction latency histogram, are per cpu and need no lock. A file
+ * system's slot is looked for without the lock first, which is safe
+ * because it can't be given back while the file system has buffers.
+ *
+ * Gets are charged when the buffer is released, so the file system
+ * has had a chance to say what kind of block it is. Eviction latency
+ * is the time buffer_get spent making room for a new buffer, charged
+ * to the file system doing the get; the evictions themselves are
+ * charged to the file system whose buffer was evicted.
+ */
+struct bufstats {
+	struct fs *bs_fs;
+	volatile bool bs_inuse;
+	struct percpu_counter bs_gets[BUFKIND_NUM];
+	struct percpu_counter bs_hits[BUFKIND_NUM];
+	struct percpu_counter bs_evictions[BUFKIND_NUM];
+	struct percpu_counter bs_dirty_evictions[BUFKIND_NUM];
+	struct percpu_counter bs_evict_latency[BUFSTATS_LATBUCKETS];
+};
+
+static struct bufstats buffer_fsstats[BUFSTATS_MAXFS + 1];
+static struct percpu_counter buffer_evict_latency[BUFSTATS_LATBUCKETS];
+static struct lock *buffer_stats_lock;
+
+/*
+ * Read-ahead state. The queue is a ring of blocks the read-ahead
+ * thread should bring into the cache. All of this is protected by
+ * readahead_lock, which is a leaf.
+ */
+struct readahead {
+	struct fs *ra_fs;
+	daddr_t ra_block;
+	size_t ra_size;
+};
+
+static struct readahead readahead_queue[READAHEAD_QUEUE];
+static unsigned readahead_head;
+static unsigned readahead_count;
+static struct fs *readahead_busyfs;	/* fs of block being read */
+static unsigned readahead_queued;
+static unsigned readahead_dropped;
+static unsigned readahead_prefetched;
+static struct lock *readahead_lock;
+static struct cv *readahead_cv;		/* queue became nonempty */
+static struct cv *readahead_done_cv;	/* readahead_busyfs changed */
+
 /*
  * Forward declaration (XXX: reorg to make this go away)
  */
@@ -266,28 +479,196 @@ static void buffer_release_internal(struct buf *b);
 ////////////////////////////////////////////////////////////
 // state invariants
 
+/*
+ * Check consistency of the state of one partition.
+ */
+static
+void
+bufcheck(struct bufpart *p)
+{
+	KASSERT(lock_do_i_hold(p->bp_lock));
+
+	KASSERT(p->bp_dirty.bl_count == p->bp_dirtyq.bl_count);
+	KASSERT(p->bp_cleanq.bl_count + p->bp_probq.bl_count
+		+ p->bp_dirtyq.bl_count <= cap_total_units);
+	KASSERT(p->bp_busy_count <= p->bp_cleanq.bl_count
+		+ p->bp_probq.bl_count + p->bp_dirtyq.bl_count);
+}
+
 /*
  * Check consistency of the global state.
  */
 static
 void
-bufcheck(void)
+poolcheck(void)
+{
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
+
+	KASSERT(num_detached_buffers <= num_total_buffers);
+	KASSERT(num_total_buffers <= num_total_units);
+	KASSERT(min_total_units <= max_total_units);
+	KASSERT(max_total_units <= cap_total_units);
+	KASSERT(num_reserved_units <= max_total_units);
+	/* may be over max_total_units after buffer_shrink */
+	KASSERT(num_total_units <= cap_total_units);
+}
+
+/*
+ * Check that a buffer size is one we support.
+ */
+static
+bool
+buffer_size_ok(size_t size)
+{
+	return size >= BUFFER_MINSIZE && size <= BUFFER_MAXSIZE &&
+		(size & (size - 1)) == 0;
+}
+
+/*
+ * Get the size class (index into detached_buffers) for a size.
+ */
+static
+unsigned
+buffer_sizeclass(size_t size)
+{
+	unsigned sc;
+
+	KASSERT(buffer_size_ok(size));
+	for (sc = 0; ((size_t)BUFFER_MINSIZE << sc) < size; sc++) {
+		/* nothing */
+	}
+	KASSERT(sc < BUFFER_SIZECLASSES);
+	return sc;
+}
+
+////////////////////////////////////////////////////////////
+// buflist
+
+static
+void
+bufnode_init(struct bufnode *bn, struct buf *b)
+{
+	bn->bn_prev = NULL;
+	bn->bn_next = NULL;
+	bn->bn_buf = b;
+}
+
+static
+void
+buflist_init(struct buflist *bl)
+{
+	bl->bl_head.bn_next = &bl->bl_tail;
+	bl->bl_head.bn_prev = NULL;
+	bl->bl_tail.bn_next = NULL;
+	bl->bl_tail.bn_prev = &bl->bl_head;
+	bl->bl_head.bn_buf = NULL;
+	bl->bl_tail.bn_buf = NULL;
+	bl->bl_count = 0;
+}
+
+/*
+ * Link ADDEE in after ONLIST. Doesn't update bl_count.
+ */
+static
+void
+buflist_insertafternode(struct bufnode *onlist, struct bufnode *addee)
+{
+	KASSERT(addee->bn_prev == NULL);
+	KASSERT(addee->bn_next == NULL);
+
+	addee->bn_prev = onlist;
+	addee->bn_next = onlist->bn_next;
+	addee->bn_prev->bn_next = addee;
+	addee->bn_next->bn_prev = addee;
+}
+
+/*
+ * Unlink BN. Doesn't update bl_count.
+ */
+static
+void
+buflist_removenode(struct bufnode *bn)
+{
+	KASSERT(bn->bn_prev != NULL);
+	KASSERT(bn->bn_next != NULL);
+
+	bn->bn_prev->bn_next = bn->bn_next;
+	bn->bn_next->bn_prev = bn->bn_prev;
+	bn->bn_prev = NULL;
+	bn->bn_next = NULL;
+}
+
+static
+void
+buflist_addhead(struct buflist *bl, struct bufnode *bn)
+{
+	KASSERT(bn->bn_buf != NULL);
+	buflist_insertafternode(&bl->bl_head, bn);
+	bl->bl_count++;
+}
+
+static
+void
+buflist_addtail(struct buflist *bl, struct bufnode *bn)
+{
+	KASSERT(bn->bn_buf != NULL);
+	buflist_insertafternode(bl->bl_tail.bn_prev, bn);
+	bl->bl_count++;
+}
+
+static
+void
+buflist_remove(struct buflist *bl, struct bufnode *bn)
+{
+	KASSERT(bn->bn_buf != NULL);
+	KASSERT(bl->bl_count > 0);
+	buflist_removenode(bn);
+	bl->bl_count--;
+}
+
+/*
+ * Return the first buffer on the list, skipping markers, or NULL.
+ */
+static
+struct buf *
+buflist_first(struct buflist *bl)
+{
+	struct bufnode *bn;
+
+	for (bn = bl->bl_head.bn_next; bn != &bl->bl_tail; bn = bn->bn_next) {
+		if (bn->bn_buf != NULL) {
+			return bn->bn_buf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Leave MARKER on the list just after BN.
+ */
+static
+void
+buflist_placemarker(struct bufnode *marker, struct bufnode *bn)
 {
-	KASSERT(attached_buffers_count <= bufarray_num(&attached_buffers));
-	KASSERT(attached_buffers_first <= bufarray_num(&attached_buffers));
-	KASSERT(bufarray_num(&attached_buffers) <= attached_buffers_thresh);
+	KASSERT(marker->bn_buf == NULL);
+	buflist_insertafternode(bn, marker);
+}
 
-	KASSERT(dirty_buffers_count <= bufarray_num(&dirty_buffers));
-	KASSERT(dirty_buffers_first <= bufarray_num(&dirty_buffers));
-	KASSERT(bufarray_num(&dirty_buffers) <= dirty_buffers_thresh);
+/*
+ * Take MARKER back off the list. Returns the node that now precedes
+ * where it was, so that a loop that steps to ->bn_next carries on
+ * from the right place.
+ */
+static
+struct bufnode *
+buflist_takemarker(struct bufnode *marker)
+{
+	struct bufnode *prev;
 
-	KASSERT(bufarray_num(&detached_buffers) + attached_buffers_count
-		== num_total_buffers);
-	// This is not true any more, because busy_buffers_count now
-	// includes buffers marked busy by syncing.
-	//KASSERT(busy_buffers_count <= num_reserved_buffers);
-	KASSERT(num_reserved_buffers <= max_total_buffers);
-	KASSERT(num_total_buffers <= max_total_buffers);
+	KASSERT(marker->bn_buf == NULL);
+	prev = marker->bn_prev;
+	buflist_removenode(marker);
+	return prev;
 }
 
 ////////////////////////////////////////////////////////////
@@ -322,43 +703,7 @@ bufarray_remove_unordered(struct bufarray *a, unsigned index,
 }
 
 /*
- * Remove null entries from a bufarray, preserving order.
- *
- * Use fixup() to correct the index stored in the objects that get
- * moved.
- */
-static
-void
-bufarray_compact(struct bufarray *a,
-		 unsigned *firstp,
-		 void (*fixup)(struct buf *, unsigned oldix, unsigned newix))
-{
-	unsigned i, j, num;
-	struct buf *b;
-	int result;
-
-	num = bufarray_num(a);
-	for (i = j = *firstp; i<num; i++) {
-		b = bufarray_get(a, i);
-		if (b != NULL) {
-			if (j < i) {
-				fixup(b, i, j);
-				bufarray_set(a, j++, b);
-			}
-			else {
-				j++;
-			}
-		}
-	}
-	KASSERT(j <= num);
-	result = bufarray_setsize(a, j);
-	/* shrinking, shouldn't fail */
-	KASSERT(result == 0);
-	*firstp = j;
-}
-
-/*
- * Routines for that fixup()...
+ * Routine for that fixup()...
  */
 static
 void
@@ -368,22 +713,6 @@ buf_fixup_bucketindex(struct buf *b, unsigned oldix, unsigned newix)
 	b->b_bucketindex = newix;
 }
 
-static
-void
-buf_fixup_dirtyindex(struct buf *b, unsigned oldix, unsigned newix)
-{
-	KASSERT(b->b_dirtyindex == oldix);
-	b->b_dirtyindex = newix;
-}
-
-static
-void
-buf_fixup_tableindex(struct buf *b, unsigned oldix, unsigned newix)
-{
-	KASSERT(b->b_tableindex == oldix);
-	b->b_tableindex = newix;
-}
-
 ////////////////////////////////////////////////////////////
 // bufhash
 
@@ -435,6 +764,20 @@ buffer_hashfunc(struct fs *fs, daddr_t physblock)
 	return val;
 }
 
+/*
+ * Choose the hash bucket for a key. The low bits of the hash pick
+ * the partition (see buffer_partition) so use the rest here.
+ */
+static
+unsigned
+bufhash_bucket(struct bufhash *bh, struct fs *fs, daddr_t physblock)
+{
+	unsigned hash;
+
+	hash = buffer_hashfunc(fs, physblock);
+	return (hash / BUFFER_PARTITIONS) % bh->bh_numbuckets;
+}
+
 /*
  * Add a buffer to a bufhash.
  */
@@ -442,12 +785,11 @@ static
 int
 bufhash_add(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
 	KASSERT(b->b_bucketindex == INVALID_INDEX);
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 	return bufarray_add(&bh->bh_buckets[bn], b, &b->b_bucketindex);
 }
 
@@ -458,10 +800,9 @@ static
 void
 bufhash_remove(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 
 	KASSERT(bufarray_get(&bh->bh_buckets[bn], b->b_bucketindex) == b);
 	bufarray_set(&bh->bh_buckets[bn], b->b_bucketindex, NULL);
@@ -477,12 +818,11 @@ static
 struct buf *
 bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 {
-	unsigned hash, bn;
+	unsigned bn;
 	unsigned num, i;
 	struct buf *b;
 
-	hash = buffer_hashfunc(fs, physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, fs, physblock);
 
 	num = bufarray_num(&bh->bh_buckets[bn]);
 	for (i=0; i<num; i++) {
@@ -497,96 +837,331 @@ bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 }
 
 ////////////////////////////////////////////////////////////
-// buffer tables
+// partitions
 
 /*
- * Preallocate the buffer lists so adding things to them on the fly
- * can't blow up.
+ * Get the partition a key belongs in.
  */
 static
-int
-preallocate_buffer_arrays(unsigned newtotal)
+struct bufpart *
+buffer_partition(struct fs *fs, daddr_t physblock)
 {
-	int result;
-	unsigned newathresh, newdthresh;
+	unsigned hash;
 
-	newathresh = (newtotal*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
-	newdthresh = (newtotal*DIRTY_THRESH_NUM)/DIRTY_THRESH_DENOM;
+	hash = buffer_hashfunc(fs, physblock);
+	return &buffer_parts[hash % BUFFER_PARTITIONS];
+}
 
-	result = bufarray_preallocate(&detached_buffers, newtotal);
-	if (result) {
-		return result;
-	}
+/*
+ * Look up a buffer in partition P, which must be the key's partition.
+ */
+static
+struct buf *
+buffer_find(struct bufpart *p, struct fs *fs, daddr_t physblock)
+{
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	return bufhash_get(&p->bp_hash, fs, physblock);
+}
 
-	result = bufarray_preallocate(&attached_buffers, newathresh);
+/*
+ * Set up a partition.
+ */
+static
+int
+bufpart_init(struct bufpart *p, unsigned numbuckets)
+{
+	int result;
+
+	result = bufhash_init(&p->bp_hash, numbuckets);
 	if (result) {
 		return result;
 	}
-	attached_buffers_thresh = newathresh;
 
-	result = bufarray_preallocate(&dirty_buffers, newdthresh);
-	if (result) {
-		return result;
+	p->bp_lock = lock_create("buffer cache lock");
+	if (p->bp_lock == NULL) {
+		return ENOMEM;
+	}
+
+	p->bp_busy_cv = cv_create("bufbusy");
+	if (p->bp_busy_cv == NULL) {
+		return ENOMEM;
 	}
-	dirty_buffers_thresh = newdthresh;
+
+	buflist_init(&p->bp_cleanq);
+	buflist_init(&p->bp_probq);
+	buflist_init(&p->bp_dirtyq);
+	buflist_init(&p->bp_dirty);
+	p->bp_lrutick = 0;
+
+	p->bp_busy_count = 0;
+	p->bp_dirty_units = 0;
+
+	p->bp_dirtied_units = 0;
 
 	return 0;
 }
 
 /*
- * Go through the attached_buffers array and close up gaps.
+ * Number of buffers attached in a partition.
+ */
+static
+unsigned
+bufpart_attached(struct bufpart *p)
+{
+	return p->bp_cleanq.bl_count + p->bp_probq.bl_count +
+		p->bp_dirtyq.bl_count;
+}
+
+/*
+ * Get the total size of the dirty buffers, in units. This peeks at
+ * each partition's count without taking its lock, so the answer is
+ * only approximate; that's good enough for the pacing decisions that
+ * use it, and lets them be made while holding some other partition
+ * lock.
+ */
+static
+unsigned
+buffer_dirty_units(void)
+{
+	unsigned i, total;
+
+	total = 0;
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		total += buffer_parts[i].bp_dirty_units;
+	}
+	return total;
+}
+
+////////////////////////////////////////////////////////////
+// statistics
+
+/*
+ * Add AMOUNT to operation counter WHICH (a BC_* value).
+ */
+static
+void
+bufcount(unsigned which, unsigned amount)
+{
+	percpu_counter_add(&buffer_counters[which], amount);
+}
+
+/*
+ * Set up NUM per-cpu counters (at bootstrap).
+ */
+static
+void
+bufstats_initcounters(struct percpu_counter *pcs, unsigned num)
+{
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		if (percpu_counter_init(&pcs[i])) {
+			panic("buffer_bootstrap: Out of percpu counters\n");
+		}
+	}
+}
+
+/*
+ * Zero the counters in stats slot BS.
+ */
+static
+void
+bufstats_reset(struct bufstats *bs)
+{
+	unsigned i;
+
+	for (i=0; i<BUFKIND_NUM; i++) {
+		percpu_counter_reset(&bs->bs_gets[i]);
+		percpu_counter_reset(&bs->bs_hits[i]);
+		percpu_counter_reset(&bs->bs_evictions[i]);
+		percpu_counter_reset(&bs->bs_dirty_evictions[i]);
+	}
+	for (i=0; i<BUFSTATS_LATBUCKETS; i++) {
+		percpu_counter_reset(&bs->bs_evict_latency[i]);
+	}
+}
+
+/*
+ * Find the stats slot for FS, claiming a free one if it has none.
+ */
+static
+struct bufstats *
+bufstats_get(struct fs *fs)
+{
+	struct bufstats *bs, *avail;
+	unsigned i;
+
+	/* Usually it has one already; look without the lock. */
+	for (i=0; i<BUFSTATS_MAXFS; i++) {
+		bs = &buffer_fsstats[i];
+		if (bs->bs_inuse) {
+			membar_load_load();
+			if (bs->bs_fs == fs) {
+				return bs;
+			}
+		}
+	}
+
+	lock_acquire(buffer_stats_lock);
+	avail = NULL;
+	for (i=0; i<BUFSTATS_MAXFS; i++) {
+		bs = &buffer_fsstats[i];
+		if (bs->bs_inuse && bs->bs_fs == fs) {
+			lock_release(buffer_stats_lock);
+			return bs;
+		}
+		if (!bs->bs_inuse && avail == NULL) {
+			avail = bs;
+		}
+	}
+	if (avail == NULL) {
+		/* the overflow slot */
+		lock_release(buffer_stats_lock);
+		return &buffer_fsstats[BUFSTATS_MAXFS];
+	}
+	bufstats_reset(avail);
+	avail->bs_fs = fs;
+	membar_store_store();
+	avail->bs_inuse = true;
+	lock_release(buffer_stats_lock);
+	return avail;
+}
+
+/*
+ * Give back FS's stats slot (for unmount).
+ */
+static
+void
+bufstats_drop(struct fs *fs)
+{
+	unsigned i;
+
+	lock_acquire(buffer_stats_lock);
+	for (i=0; i<BUFSTATS_MAXFS; i++) {
+		if (buffer_fsstats[i].bs_inuse &&
+		    buffer_fsstats[i].bs_fs == fs) {
+			buffer_fsstats[i].bs_inuse = false;
+			buffer_fsstats[i].bs_fs = NULL;
+		}
+	}
+	lock_release(buffer_stats_lock);
+}
+
+/*
+ * Charge a get to the buffer's file system, if it hasn't been yet.
+ */
+static
+void
+bufstats_chargeget(struct buf *b)
+{
+	struct bufstats *bs;
+
+	KASSERT(b->b_attached);
+	if (!b->b_statget) {
+		return;
+	}
+
+	bs = bufstats_get(b->b_fs);
+	percpu_counter_inc(&bs->bs_gets[b->b_kind]);
+	if (b->b_stathit) {
+		percpu_counter_inc(&bs->bs_hits[b->b_kind]);
+	}
+
+	b->b_statget = 0;
+	b->b_stathit = 0;
+}
+
+/*
+ * Charge an eviction to the file system of the buffer being evicted.
  */
 static
 void
-compact_attached_buffers(void)
+bufstats_chargeevict(struct buf *b)
 {
-	bufarray_compact(&attached_buffers, &attached_buffers_first,
-			 buf_fixup_tableindex);
-	KASSERT(attached_buffers_count == bufarray_num(&attached_buffers));
+	struct bufstats *bs;
+
+	KASSERT(b->b_attached);
 
-	/* it does not matter if this overflows */
-	attached_buffers_generation++;
+	bs = bufstats_get(b->b_fs);
+	percpu_counter_inc(&bs->bs_evictions[b->b_kind]);
+	if (b->b_dirty) {
+		percpu_counter_inc(&bs->bs_dirty_evictions[b->b_kind]);
+	}
 }
 
 /*
- * Go through the dirty_buffers array and close up gaps.
+ * Record that making room for a buffer for FS took from START until
+ * now.
  */
 static
 void
-compact_dirty_buffers(void)
+bufstats_evictlatency(struct fs *fs, const struct timespec *start)
 {
-	bufarray_compact(&dirty_buffers, &dirty_buffers_first,
-			 buf_fixup_dirtyindex);
-	KASSERT(dirty_buffers_count == bufarray_num(&dirty_buffers));
+	struct timespec now, diff;
+	struct bufstats *bs;
+	uint64_t usec;
+	unsigned bucket;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	usec = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+	/* bucket N is [2^N, 2^(N+1)) usec, except the ends are open */
+	bucket = 0;
+	while (usec > 1 && bucket < BUFSTATS_LATBUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
 
-	/* it does not matter if this overflows */
-	dirty_buffers_generation++;
+	bs = bufstats_get(fs);
+	percpu_counter_inc(&bs->bs_evict_latency[bucket]);
+	percpu_counter_inc(&buffer_evict_latency[bucket]);
 }
 
+////////////////////////////////////////////////////////////
+// buffer queues
+
 /*
- * Get a buffer from the pool of detached buffers.
+ * Get a buffer of size SIZE from the pool of detached buffers.
  */
 static
 struct buf *
-buffer_remove_detached(void)
+buffer_remove_detached(size_t size)
 {
+	struct buflist *bl;
 	struct buf *b;
-	unsigned num;
-	int result;
 
-	num = bufarray_num(&detached_buffers);
-	if (num > 0) {
-		b = bufarray_get(&detached_buffers, num-1);
-		KASSERT(b->b_tableindex == num-1);
-		b->b_tableindex = INVALID_INDEX;
-
-		/* shrink array (should not fail) */
-		result = bufarray_setsize(&detached_buffers, num-1);
-		KASSERT(result == 0);
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
 
-		return b;
+	bl = &detached_buffers[buffer_sizeclass(size)];
+	b = buflist_first(bl);
+	if (b != NULL) {
+		buflist_remove(bl, &b->b_lrunode);
+		num_detached_buffers--;
 	}
+	return b;
+}
+
+/*
+ * Get a detached buffer of any size, preferring the smallest.
+ */
+static
+struct buf *
+buffer_remove_any_detached(void)
+{
+	struct buf *b;
+	unsigned sc;
+
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
 
+	for (sc = 0; sc < BUFFER_SIZECLASSES; sc++) {
+		b = buflist_first(&detached_buffers[sc]);
+		if (b != NULL) {
+			buflist_remove(&detached_buffers[sc], &b->b_lrunode);
+			num_detached_buffers--;
+			return b;
+		}
+	}
 	return NULL;
 }
 
@@ -597,67 +1172,121 @@ static
 void
 buffer_insert_detached(struct buf *b)
 {
-	int result;
-
-	KASSERT(b->b_attached == 0);
+	KASSERT(!b->b_attached);
 	KASSERT(b->b_busy == 0);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
 
-	result = bufarray_add(&detached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
+	lock_acquire(buffer_pool_lock);
+	buflist_addtail(&detached_buffers[buffer_sizeclass(b->b_size)],
+			&b->b_lrunode);
+	num_detached_buffers++;
+	lock_release(buffer_pool_lock);
+}
+
+/*
+ * Get the LRU queue a buffer belongs on.
+ */
+static
+struct buflist *
+buffer_queue(struct buf *b)
+{
+	if (b->b_dirty) {
+		return &b->b_part->bp_dirtyq;
+	}
+	return b->b_probation ? &b->b_part->bp_probq : &b->b_part->bp_cleanq;
 }
 
 /*
- * Remove a buffer from the attached (LRU) list.
+ * Take a buffer off its LRU queue.
  */
 static
 void
-buffer_remove_attached(struct buf *b, unsigned expected_busy)
+buffer_remove_attached(struct buf *b)
 {
-	unsigned ix;
+	KASSERT(b->b_attached);
+	buflist_remove(buffer_queue(b), &b->b_lrunode);
+}
 
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == expected_busy);
+/*
+ * Put a buffer on the tail (most recently used end) of its LRU
+ * queue. This is how we note that a buffer's been used.
+ */
+static
+void
+buffer_insert_attached(struct buf *b)
+{
+	struct bufpart *p = b->b_part;
 
-	ix = b->b_tableindex;
+	KASSERT(b->b_attached);
 
-	KASSERT(bufarray_get(&attached_buffers, ix) == b);
+	b->b_lrustamp = ++p->bp_lrutick;
+	buflist_addtail(buffer_queue(b), &b->b_lrunode);
+}
 
-	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&attached_buffers, ix, NULL);
-	b->b_tableindex = INVALID_INDEX;
+/*
+ * Move a buffer to the tail of its LRU queue.
+ */
+static
+void
+buffer_touch(struct buf *b)
+{
+	buffer_remove_attached(b);
+	buffer_insert_attached(b);
+}
 
-	/* cache the first empty slot  */
-	if (ix < attached_buffers_first) {
-		attached_buffers_first = ix;
-	}
+/*
+ * True if buffer A was used less recently than buffer B. (This is
+ * written to be safe against bp_lrutick wrapping around.)
+ */
+static
+bool
+buffer_older(struct buf *a, struct buf *b)
+{
+	return (int)(a->b_lrustamp - b->b_lrustamp) < 0;
+}
+
+/*
+ * Estimate how many buffers in the partition have been used less
+ * recently than B; that is, roughly, its distance from the cold end
+ * of the merged LRU order of both queues. Each tick moves one buffer
+ * to the tail, so at most (tick - stamp) buffers can be newer than B.
+ */
+static
+unsigned
+buffer_lrudepth(struct buf *b)
+{
+	struct bufpart *p = b->b_part;
+	unsigned newer, count;
 
-	attached_buffers_count--;
+	newer = p->bp_lrutick - b->b_lrustamp;
+	count = bufpart_attached(p);
+	return newer + 1 < count ? count - newer - 1 : 0;
 }
 
 /*
- * Put a buffer into the attached (LRU) list, always at the end.
+ * Move a buffer that just got cleaned from the dirty queue to the
+ * clean queue. We don't want to move it to the tail, because
+ * writing it out isn't a use -- the syncer picks buffers from the
+ * cold end precisely so that they'll be ready for eviction. So put
+ * it back among the oldest clean buffers if it's at least as old as
+ * they are, and at the tail otherwise.
  */
 static
 void
-buffer_insert_attached(struct buf *b)
+buffer_requeue_cleaned(struct buf *b)
 {
-	unsigned num;
-	int result;
+	struct buflist *q;
+	struct buf *first;
 
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
+	KASSERT(b->b_dirty == 0);
 
-	num = bufarray_num(&attached_buffers);
-	if (num >= attached_buffers_thresh) {
-		compact_attached_buffers();
+	q = buffer_queue(b);
+	first = buflist_first(q);
+	if (first == NULL || !buffer_older(first, b)) {
+		buflist_addhead(q, &b->b_lrunode);
+	}
+	else {
+		buflist_addtail(q, &b->b_lrunode);
 	}
-
-	result = bufarray_add(&attached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
-	attached_buffers_count++;
 }
 
 /*
@@ -667,23 +1296,25 @@ static
 void
 buffer_remove_dirty(struct buf *b)
 {
-	unsigned ix;
-
-	KASSERT(b->b_attached == 1);
+	KASSERT(b->b_attached);
 	// not necessarily true, e.g. in buffer_drop()
 	//KASSERT(b->b_busy == 1);
 
-	ix = b->b_dirtyindex;
-
-	KASSERT(bufarray_get(&dirty_buffers, ix) == b);
-
-	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&dirty_buffers, ix, NULL);
-	b->b_dirtyindex = INVALID_INDEX;
+	buflist_remove(&b->b_part->bp_dirty, &b->b_dirtynode);
+	KASSERT(b->b_part->bp_dirty_units >= BUFFER_UNITS(b->b_size));
+	b->b_part->bp_dirty_units -= BUFFER_UNITS(b->b_size);
 
-	/* cache the first empty slot  */
-	if (ix < dirty_buffers_first) {
-		dirty_buffers_first = ix;
+	/*
+	 * Only the holder of a busy buffer sets an owner, and
+	 * bufowner_destroy only clears it, so if it looks NULL it is.
+	 */
+	if (b->b_owner != NULL) {
+		spinlock_acquire(&buffer_owner_lock);
+		if (b->b_owner != NULL) {
+			buflist_remove(&b->b_owner->bo_dirty, &b->b_ownernode);
+			b->b_owner = NULL;
+		}
+		spinlock_release(&buffer_owner_lock);
 	}
 }
 
@@ -694,97 +1325,193 @@ static
 void
 buffer_insert_dirty(struct buf *b)
 {
-	unsigned num;
-	int result;
-
-	KASSERT(b->b_attached == 1);
+	KASSERT(b->b_attached);
 	KASSERT(b->b_busy == 1);
-	KASSERT(b->b_dirtyindex == INVALID_INDEX);
-
-	num = bufarray_num(&dirty_buffers);
-	if (num >= dirty_buffers_thresh) {
-		compact_dirty_buffers();
-	}
 
-	result = bufarray_add(&dirty_buffers, b, &b->b_dirtyindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
+	buflist_addtail(&b->b_part->bp_dirty, &b->b_dirtynode);
+	b->b_part->bp_dirty_units += BUFFER_UNITS(b->b_size);
+	b->b_part->bp_dirtied_units += BUFFER_UNITS(b->b_size);
 }
 
 ////////////////////////////////////////////////////////////
 // ops on buffers
 
 /*
- * Create a fresh buffer.
+ * Create a fresh buffer of size SIZE.
  */
 static
 struct buf *
-buffer_create(void)
+buffer_create(size_t size)
 {
 	struct buf *b;
-	int result;
 
-	result = preallocate_buffer_arrays(num_total_buffers+1);
-	if (result) {
-		return NULL;
-	}
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
+	KASSERT(num_total_units + BUFFER_UNITS(size) <= max_total_units);
+	KASSERT(max_total_units <= cap_total_units);
 
-	b = kmalloc(sizeof(*b));
+	b = kmalloc_tagged(sizeof(*b), &buffer_heaptag);
 	if (b == NULL) {
 		return NULL;
 	}
 
-	b->b_data = kmalloc(ONE_TRUE_BUFFER_SIZE);
+	b->b_data = kmalloc_tagged(size, &bufdata_heaptag);
 	if (b->b_data == NULL) {
-		kfree(b);
+		kfree_tagged(b, sizeof(*b), &buffer_heaptag);
 		return NULL;
 	}
 
-	b->b_tableindex = INVALID_INDEX;
-	b->b_dirtyindex = INVALID_INDEX;
+	bufnode_init(&b->b_lrunode, b);
+	bufnode_init(&b->b_dirtynode, b);
+	bufnode_init(&b->b_ownernode, b);
+	b->b_owner = NULL;
 	b->b_bucketindex = INVALID_INDEX;
 	b->b_dirtyepoch = 0;
-	b->b_attached = 0;
+	b->b_lrustamp = 0;
+	b->b_part = NULL;
+	b->b_attached = false;
 	b->b_busy = 0;
 	b->b_valid = 0;
 	b->b_dirty = 0;
 	b->b_fsmanaged = 0;
+	b->b_readahead = 0;
+	b->b_kind = BUFKIND_META;
+	b->b_statget = 0;
+	b->b_stathit = 0;
+	b->b_probation = 0;
+	b->b_streamuse = 0;
 	b->b_holder = NULL;
 	b->b_timestamp.tv_sec = 0;
 	b->b_timestamp.tv_nsec = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	b->b_size = ONE_TRUE_BUFFER_SIZE;
+	b->b_size = size;
 	b->b_fsdata = NULL;
 	num_total_buffers++;
+	num_total_units += BUFFER_UNITS(size);
+	return b;
+}
+
+/*
+ * Destroy a detached buffer, to make room for one of another size.
+ */
+static
+void
+buffer_destroy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
+	KASSERT(!b->b_attached);
+	KASSERT(b->b_busy == 0);
+	KASSERT(b->b_lrunode.bn_prev == NULL);
+
+	KASSERT(num_total_buffers > 0);
+	KASSERT(num_total_units >= BUFFER_UNITS(b->b_size));
+	num_total_buffers--;
+	num_total_units -= BUFFER_UNITS(b->b_size);
+
+	kfree_tagged(b->b_data, b->b_size, &bufdata_heaptag);
+	kfree_tagged(b, sizeof(*b), &buffer_heaptag);
+}
+
+/*
+ * Try to raise the cache size limit to at least NEEDED units. We go
+ * up in steps of BUFFER_GROWSIZE, and only if the VM system says
+ * there's enough memory free that taking another step leaves at
+ * least BUFFER_FREEMEM of it. Returns true if the limit is now high
+ * enough.
+ */
+static
+bool
+buffer_grow(unsigned needed)
+{
+	unsigned step, reserve;
+
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
+
+	step = BUFFER_GROWSIZE / BUFFER_MINSIZE;
+	reserve = SCALE(mainbus_ramsize(), BUFFER_FREEMEM) / PAGE_SIZE;
+
+	while (max_total_units < needed) {
+		if (max_total_units >= cap_total_units) {
+			return false;
+		}
+		if (vm_freepages() < reserve + BUFFER_GROWSIZE / PAGE_SIZE) {
+			return false;
+		}
+		if (step > cap_total_units - max_total_units) {
+			step = cap_total_units - max_total_units;
+		}
+		max_total_units += step;
+		num_grown_units += step;
+	}
+	return true;
+}
+
+/*
+ * Get a detached buffer of size SIZE: reuse one from the pool if
+ * possible, and otherwise create one, if necessary first growing the
+ * cache or destroying detached buffers of other sizes to make room.
+ * Returns NULL if the caller needs to evict something.
+ */
+static
+struct buf *
+buffer_alloc(size_t size)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_pool_lock));
+	poolcheck();
+
+	b = buffer_remove_detached(size);
+	while (b == NULL) {
+		if (num_total_units + BUFFER_UNITS(size) <= max_total_units ||
+		    buffer_grow(num_total_units + BUFFER_UNITS(size))) {
+			/* Can create a new buffer... */
+			b = buffer_create(size);
+			break;
+		}
+		b = buffer_remove_any_detached();
+		if (b == NULL) {
+			break;
+		}
+		/* it can't be the right size, or we'd have found it */
+		KASSERT(b->b_size != size);
+		buffer_destroy(b);
+		b = NULL;
+	}
 	return b;
 }
 
 /*
- * Attach a buffer to a given key (fs and block number)
+ * Attach a buffer to a given key (fs and block number) in partition P,
+ * which must be the partition for that key.
  */
 static
 int
-buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
+buffer_attach(struct bufpart *p, struct buf *b, struct fs *fs, daddr_t block)
 {
 	int result;
 
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	KASSERT(p == buffer_partition(fs, block));
+
 	KASSERT(b->b_busy == 0);
-	KASSERT(b->b_attached == 0);
+	KASSERT(!b->b_attached);
 	KASSERT(b->b_valid == 0);
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_fsdata == NULL);
-	b->b_attached = 1;
+	KASSERT(b->b_part == NULL);
+	b->b_attached = true;
 	b->b_fs = fs;
 	b->b_physblock = block;
 
-	result = bufhash_add(&buffer_hash, b);
+	result = bufhash_add(&p->bp_hash, b);
 	if (result) {
-		b->b_attached = 0;
+		b->b_attached = false;
 		b->b_fs = NULL;
 		b->b_physblock = 0;
 		return result;
 	}
+	b->b_part = p;
 	return 0;
 }
 
@@ -795,37 +1522,46 @@ static
 void
 buffer_detach(struct buf *b)
 {
-	KASSERT(b->b_attached == 1);
+	struct bufpart *p = b->b_part;
+
+	KASSERT(b->b_attached);
 	KASSERT(b->b_busy == 0);
-	bufhash_remove(&buffer_hash, b);
+	bufhash_remove(&p->bp_hash, b);
 
 	if (b->b_fsdata != NULL) {
 		kprintf("vfs: %s left behind fs-specific buffer data\n",
 			FSOP_GETVOLNAME(b->b_fs));
 		b->b_fsdata = NULL;
 	}
-	b->b_attached = 0;
+	b->b_attached = false;
+	b->b_probation = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	b->b_part = NULL;
+	cv_broadcast(p->bp_busy_cv, p->bp_lock);
 }
 
 /*
- * Mark a buffer busy, waiting if necessary.
+ * Mark a buffer busy, waiting if necessary. The caller must hold the
+ * lock for the buffer's partition, P.
  *
  * Returns EDEADBUF if the buffer gets detached (or worse, detached
  * and reattached) under us, which can happen if it gets released and
  * then gets evicted before we wake up. If it gets detached and
  * reattached to the same block, we won't notice, but in that case we
- * probably don't care either.
+ * probably don't care either. (And since the partition is a function
+ * of the key, in that case it's been reattached in P, under the lock
+ * we hold, so looking at it is safe.)
  */
 static
 int
-buffer_mark_busy(struct buf *b)
+buffer_mark_busy(struct bufpart *p, struct buf *b)
 {
 	struct fs *fs;
 	daddr_t block;
 
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	KASSERT(b->b_part == p);
 	KASSERT(b->b_holder != curthread);
 	fs = b->b_fs;
 	block = b->b_physblock;
@@ -834,15 +1570,16 @@ buffer_mark_busy(struct buf *b)
 		    block != b->b_physblock) {
 			return EDEADBUF;
 		}
-		cv_wait(buffer_busy_cv, buffer_lock);
+		cv_wait(p->bp_busy_cv, p->bp_lock);
 	}
 	if (!b->b_attached || fs != b->b_fs || block != b->b_physblock) {
 		return EDEADBUF;
 	}
+	KASSERT(b->b_part == p);
 	b->b_busy = 1;
 	KASSERT(b->b_fsmanaged == 0);
 	b->b_holder = curthread;
-	busy_buffers_count++;
+	p->bp_busy_count++;
 	return 0;
 }
 
@@ -853,6 +1590,8 @@ static
 void
 buffer_unmark_busy(struct buf *b)
 {
+	struct bufpart *p = b->b_part;
+
 	KASSERT(b->b_busy != 0);
 	b->b_busy = 0;
 	if (b->b_fsmanaged) {
@@ -862,8 +1601,8 @@ buffer_unmark_busy(struct buf *b)
 		KASSERT(b->b_holder == curthread);
 	}
 	b->b_holder = NULL;
-	busy_buffers_count--;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	p->bp_busy_count--;
+	cv_broadcast(p->bp_busy_cv, p->bp_lock);
 }
 
 /*
@@ -873,9 +1612,10 @@ static
 int
 buffer_readin(struct buf *b)
 {
+	struct bufpart *p = b->b_part;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(p->bp_lock));
 	KASSERT(b->b_attached);
 	KASSERT(b->b_busy);
 	KASSERT(b->b_fs != NULL);
@@ -884,15 +1624,35 @@ buffer_readin(struct buf *b)
 		return 0;
 	}
 
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
+	KTRACE(KT_READIN, b->b_physblock, b->b_size);
 	result = FSOP_READBLOCK(b->b_fs, b->b_physblock, b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	KTRACE(KT_READDONE, b->b_physblock, result);
+	lock_acquire(p->bp_lock);
 	if (result == 0) {
 		b->b_valid = 1;
+		curthread->t_usage.u_inblock++;
 	}
 	return result;
 }
 
+/*
+ * Update a buffer's state after it's been written out successfully.
+ */
+static
+void
+buffer_wrote(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_part->bp_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	buffer_remove_attached(b);
+	buffer_remove_dirty(b);
+	b->b_dirty = 0;
+	buffer_requeue_cleaned(b);
+}
+
 /*
  * I/O: buffer to disk
  *
@@ -908,10 +1668,11 @@ static
 int
 buffer_writeout_internal(struct buf *b)
 {
+	struct bufpart *p = b->b_part;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	bufcheck(p);
 
 	KASSERT(b->b_attached);
 	KASSERT(b->b_valid);
@@ -922,15 +1683,16 @@ buffer_writeout_internal(struct buf *b)
 		return 0;
 	}
 
-	num_total_writeouts++;
-	lock_release(buffer_lock);
+	bufcount(BC_TOTAL_WRITEOUTS, 1);
+	lock_release(p->bp_lock);
+	KTRACE(KT_WRITEOUT, b->b_physblock, b->b_size);
 	result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, b->b_fsdata,
 				 b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	KTRACE(KT_WRITEDONE, b->b_physblock, result);
+	lock_acquire(p->bp_lock);
 	if (result == 0) {
-		dirty_buffers_count--;
-		b->b_dirty = 0;
-		buffer_remove_dirty(b);
+		buffer_wrote(b);
+		curthread->t_usage.u_oublock++;
 	}
 	return result;
 }
@@ -938,11 +1700,12 @@ buffer_writeout_internal(struct buf *b)
 int
 buffer_writeout(struct buf *b)
 {
+	struct bufpart *p = b->b_part;
 	int result;
 
-	lock_acquire(buffer_lock);
+	lock_acquire(p->bp_lock);
 	result = buffer_writeout_internal(b);
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
 	return result;
 }
 
@@ -987,26 +1750,31 @@ buffer_is_valid(struct buf *b)
 void
 buffer_mark_dirty(struct buf *b)
 {
+	struct bufpart *p = b->b_part;
+
 	KASSERT(b->b_busy);
 	KASSERT(b->b_valid);
 
-	lock_acquire(buffer_lock);
+	lock_acquire(p->bp_lock);
 	if (b->b_dirty) {
 		/* nothing to do */
-		lock_release(buffer_lock);
+		lock_release(p->bp_lock);
 		return;
 	}
 
+	/* switch queues; it's in use, so it goes at the tail */
+	buffer_remove_attached(b);
 	b->b_dirty = 1;
+	buffer_insert_attached(b);
+
 	b->b_dirtyepoch = dirty_epoch;
 	gettime(&b->b_timestamp);
 
 	/* XXX: should we avoid putting fsmanaged buffers on the dirty list? */
 
 	buffer_insert_dirty(b);
-	dirty_buffers_count++;
 	/* Here we might prod the syncer, but currently it doesn't need it */
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
 }
 
 /*
@@ -1019,6 +1787,86 @@ buffer_mark_valid(struct buf *b)
 	b->b_valid = 1;
 }
 
+/*
+ * Say what kind of block the buffer holds (external op, for stats).
+ * This lasts until the buffer is next gotten.
+ */
+void
+buffer_set_kind(struct buf *b, unsigned kind)
+{
+	KASSERT(b->b_busy);
+	KASSERT(kind < BUFKIND_NUM);
+	b->b_kind = kind;
+}
+
+/*
+ * Say that the current use of the buffer is part of a one-shot
+ * sequential pass (external op). This lasts until the buffer is
+ * released.
+ */
+void
+buffer_set_streaming(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_streamuse = 1;
+}
+
+/*
+ * Say which file the dirty buffer was dirtied for (external op), so
+ * that sync_owner_buffers can write it. This lasts until the buffer
+ * is next clean. If it already belongs to another file (a block
+ * freed by one and reused by the other before being written) it
+ * moves over.
+ */
+void
+buffer_set_owner(struct buf *b, struct bufowner *bo)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	spinlock_acquire(&buffer_owner_lock);
+	if (b->b_owner != bo) {
+		if (b->b_owner != NULL) {
+			buflist_remove(&b->b_owner->bo_dirty, &b->b_ownernode);
+		}
+		buflist_addtail(&bo->bo_dirty, &b->b_ownernode);
+		b->b_owner = bo;
+	}
+	spinlock_release(&buffer_owner_lock);
+}
+
+struct bufowner *
+bufowner_create(void)
+{
+	struct bufowner *bo;
+
+	bo = kmalloc(sizeof(*bo));
+	if (bo == NULL) {
+		return NULL;
+	}
+	buflist_init(&bo->bo_dirty);
+	return bo;
+}
+
+/*
+ * Destroy an owner. Its buffers may still be dirty (the syncer will
+ * get them); they just stop belonging to it.
+ */
+void
+bufowner_destroy(struct bufowner *bo)
+{
+	struct buf *b;
+
+	spinlock_acquire(&buffer_owner_lock);
+	while ((b = buflist_first(&bo->bo_dirty)) != NULL) {
+		KASSERT(b->b_owner == bo);
+		buflist_remove(&bo->bo_dirty, &b->b_ownernode);
+		b->b_owner = NULL;
+	}
+	spinlock_release(&buffer_owner_lock);
+	kfree(bo);
+}
+
 ////////////////////////////////////////////////////////////
 // buffer get/release
 
@@ -1033,7 +1881,7 @@ buffer_mark_valid(struct buf *b)
  */
 static
 int
-buffer_sync(struct buf *b)
+buffer_sync(struct bufpart *p, struct buf *b)
 {
 	int result;
 
@@ -1049,7 +1897,7 @@ buffer_sync(struct buf *b)
 	/*
 	 * Mark it busy while we do I/O.
 	 */
-	result = buffer_mark_busy(b);
+	result = buffer_mark_busy(p, b);
 	if (result) {
 		/* may be EDEADBUF */
 		return result;
@@ -1076,11 +1924,179 @@ buffer_sync(struct buf *b)
 }
 
 /*
- * Write out one buffer from the dirty_buffers queue.
+ * Try to grab a buffer to add to a write cluster: the buffer for
+ * BLOCK, if there is one and it's dirty, the right size, and not
+ * busy. Marks it busy and returns it, or returns NULL. Never waits.
+ *
+ * The caller must not hold any partition lock.
+ */
+static
+struct buf *
+buffer_cluster_grab(struct fs *fs, daddr_t block, size_t size)
+{
+	struct bufpart *q;
+	struct buf *c;
+	int result;
+
+	q = buffer_partition(fs, block);
+	lock_acquire(q->bp_lock);
+	c = buffer_find(q, fs, block);
+	if (c == NULL || c->b_busy || !c->b_dirty || c->b_size != size) {
+		lock_release(q->bp_lock);
+		return NULL;
+	}
+	KASSERT(c->b_valid);
+	/* fsmanaged buffers are always busy */
+	KASSERT(c->b_fsmanaged == 0);
+	result = buffer_mark_busy(q, c);
+	/* not busy, won't sleep, can't fail */
+	KASSERT(result == 0);
+	lock_release(q->bp_lock);
+	return c;
+}
+
+/*
+ * Let go of a buffer grabbed by buffer_cluster_grab, marking it clean
+ * if WRITTEN is true.
+ */
+static
+void
+buffer_cluster_release(struct buf *c, bool written)
+{
+	struct bufpart *q = c->b_part;
+
+	lock_acquire(q->bp_lock);
+	if (written) {
+		bufcount(BC_TOTAL_WRITEOUTS, 1);
+		buffer_wrote(c);
+	}
+	buffer_unmark_busy(c);
+	lock_release(q->bp_lock);
+}
+
+/*
+ * Write a buffer out, along with any dirty buffers for the blocks
+ * either side of it, in one transfer. Otherwise the same as
+ * buffer_sync; use this in the syncer, where dirty buffers are
+ * likely to be found in runs.
+ *
+ * Starting from B, we look down and then up for buffers that are
+ * dirty and idle and for consecutive blocks, so the cluster comes
+ * out in block order. Neighbors are only taken if we can mark them
+ * busy without waiting; since they may be in other partitions we
+ * work on them one at a time with only their own partition locked.
+ */
+static
+int
+buffer_sync_cluster(struct bufpart *p, struct buf *b)
+{
+	struct buf *cluster[FS_WRITEBLOCKS_MAX];
+	void *fsdatas[FS_WRITEBLOCKS_MAX];
+	void *datas[FS_WRITEBLOCKS_MAX];
+	struct buf *c;
+	struct fs *fs;
+	daddr_t block;
+	size_t size;
+	unsigned back, n, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	KASSERT(b->b_valid == 1);
+	KASSERT(b->b_dirty == 1);
+
+	if (b->b_fsmanaged || b->b_fs->fs_ops->fsop_writeblocks == NULL) {
+		return buffer_sync(p, b);
+	}
+
+	result = buffer_mark_busy(p, b);
+	if (result) {
+		/* may be EDEADBUF */
+		return result;
+	}
+	KASSERT(b->b_valid == 1);
+	if (!b->b_dirty) {
+		/* Someone else wrote it out while we were waiting */
+		buffer_unmark_busy(b);
+		return 0;
+	}
+
+	fs = b->b_fs;
+	block = b->b_physblock;
+	size = b->b_size;
+	lock_release(p->bp_lock);
+
+	/* Collect neighbors below, nearest first, then reverse them. */
+	for (back = 0; back < FS_WRITEBLOCKS_MAX / 2 && block > back; back++) {
+		c = buffer_cluster_grab(fs, block - back - 1, size);
+		if (c == NULL) {
+			break;
+		}
+		cluster[back] = c;
+	}
+	for (i=0; i<back/2; i++) {
+		c = cluster[i];
+		cluster[i] = cluster[back - i - 1];
+		cluster[back - i - 1] = c;
+	}
+	cluster[back] = b;
+
+	/* Now neighbors above. */
+	for (n = back + 1; n < FS_WRITEBLOCKS_MAX; n++) {
+		c = buffer_cluster_grab(fs, block + (n - back), size);
+		if (c == NULL) {
+			break;
+		}
+		cluster[n] = c;
+	}
+
+	if (n > 1) {
+		for (i=0; i<n; i++) {
+			fsdatas[i] = cluster[i]->b_fsdata;
+			datas[i] = cluster[i]->b_data;
+		}
+		result = FSOP_WRITEBLOCKS(fs, block - back, n, fsdatas, datas,
+					  size);
+	}
+	else {
+		/* nothing to cluster with */
+		result = ENOSYS;
+	}
+
+	for (i=0; i<n; i++) {
+		if (cluster[i] != b) {
+			buffer_cluster_release(cluster[i], result == 0);
+		}
+	}
+
+	lock_acquire(p->bp_lock);
+	if (result == ENOSYS) {
+		/* write it by itself */
+		result = buffer_writeout_internal(b);
+	}
+	else {
+		bufcount(BC_TOTAL_WRITEOUTS, 1);
+		if (result == 0) {
+			bufcount(BC_CLUSTER_WRITES, 1);
+			bufcount(BC_CLUSTER_BLOCKS, n);
+			buffer_wrote(b);
+			curthread->t_usage.u_oublock += n;
+		}
+	}
+	/* as per the call in buffer_sync */
+	KASSERT(result != EDEADBUF);
+
+	buffer_unmark_busy(b);
+
+	return result;
+}
+
+/*
+ * Write out one buffer from a partition's dirty queue.
  *
- * If the syncer has signalled for help, this is called on every
- * buffer_get until the dirty_buffers queue gets back to a manageable
- * state.
+ * If the syncer has signalled for help, or the dirty buffers exceed
+ * the throttling threshold, this is called on every buffer_get until
+ * the dirty queues get back to a manageable state. Each caller helps
+ * out in the partition it's already working in.
  *
  * We don't attempt to sync buffers that are currently busy, because
  * that might deadlock; we'll let the syncer deal with those.
@@ -1090,15 +2106,18 @@ buffer_sync(struct buf *b)
  */
 static
 void
-sync_one_old_buffer(void)
+sync_one_old_buffer(struct bufpart *p)
 {
-	unsigned i;
+	struct bufnode *bn;
 	struct buf *b;
 	int result;
 
-	for (i=0; i < bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
+	for (bn = p->bp_dirty.bl_head.bn_next;
+	     bn != &p->bp_dirty.bl_tail;
+	     bn = bn->bn_next) {
+		b = bn->bn_buf;
 		if (b == NULL) {
+			/* someone's marker */
 			continue;
 		}
 		if (b->b_fsmanaged) {
@@ -1111,7 +2130,7 @@ sync_one_old_buffer(void)
 
 		/* could check the buffer age here, but let's not bother */
 
-		result = buffer_sync(b);
+		result = buffer_sync(p, b);
 		if (result) {
 			/* wasn't busy -> didn't wait -> can't disappear */
 			KASSERT(result != EDEADBUF);
@@ -1130,94 +2149,137 @@ sync_one_old_buffer(void)
  */
 static
 void
-buffer_clean(struct buf *b)
+buffer_clean(struct bufpart *p, struct buf *b)
 {
 	int result;
 
 	KASSERT(b->b_busy == 0);
-	result = buffer_mark_busy(b);
+	result = buffer_mark_busy(p, b);
 	/* not busy, won't sleep, can't fail */
 	KASSERT(result == 0);
 
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
 	FSOP_DETACHBUF(b->b_fs, b->b_physblock, b);
-	lock_acquire(buffer_lock);
+	lock_acquire(p->bp_lock);
 	buffer_unmark_busy(b);
 
-	buffer_remove_attached(b, 0);
+	buffer_remove_attached(b);
+	if (b->b_readahead) {
+		/* read in ahead and never used */
+		b->b_readahead = 0;
+		bufcount(BC_READAHEAD_WASTED, 1);
+	}
 	b->b_valid = 0;
 	if (b->b_dirty) {
 		b->b_dirty = 0;
-		dirty_buffers_count--;
 		buffer_remove_dirty(b);
 	}
 	buffer_detach(b);
 }
 
 /*
- * Evict a buffer.
+ * Return the least recently used buffer on Q that isn't busy, or
+ * NULL.
+ */
+static
+struct buf *
+buffer_coldest(struct buflist *q)
+{
+	struct bufnode *bn;
+	struct buf *b;
+
+	for (bn = q->bl_head.bn_next; bn != &q->bl_tail; bn = bn->bn_next) {
+		b = bn->bn_buf;
+		if (b == NULL || b->b_busy) {
+			continue;
+		}
+		/* fsmanaged buffers are always busy */
+		KASSERT(b->b_fsmanaged == 0);
+		return b;
+	}
+	return NULL;
+}
+
+/*
+ * Return the clean buffer in partition P that should go first, or
+ * NULL. This is the older of the coldest clean and coldest
+ * probationary buffers, except that once the probationary queue is
+ * over its share it goes first regardless.
+ */
+static
+struct buf *
+buffer_coldest_clean(struct bufpart *p)
+{
+	struct buf *b, *pb;
+
+	b = buffer_coldest(&p->bp_cleanq);
+	pb = buffer_coldest(&p->bp_probq);
+	if (pb == NULL) {
+		return b;
+	}
+	if (b == NULL || buffer_older(pb, b) ||
+	    p->bp_probq.bl_count > SCALE(bufpart_attached(p), PROBATION)) {
+		return pb;
+	}
+	return b;
+}
+
+/*
+ * Evict a buffer from partition P.
+ *
+ * The victim is the least recently used clean buffer (probationary
+ * buffers first, if there are too many), if there is one, as it can
+ * be reused without I/O; otherwise it's the least recently used
+ * dirty buffer, which we write out first.
+ *
+ * Returns EAGAIN if the partition has nothing that can be evicted;
+ * the caller should then look elsewhere.
  */
 static
 int
-buffer_evict(struct buf **ret)
+buffer_evict(struct bufpart *p, struct buf **ret)
 {
-	unsigned num, i;
 	struct buf *b, *db;
 	int result;
 
+	KASSERT(lock_do_i_hold(p->bp_lock));
+
 	/*
 	 * Find a target buffer.
 	 */
 
  tryagain:
-	num = bufarray_num(&attached_buffers);
-	b = db = NULL;
-	for (i=0; i<num; i++) {
-		if (i >= num/2 && db != NULL) {
-			/*
-			 * voodoo: avoid preferring very recent clean
-			 * buffers to older dirty buffers.
-			 */
-			break;
-		}
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL) {
-			continue;
-		}
-		if (b->b_busy == 1) {
-			b = NULL;
-			continue;
-		}
-		/* fsmanaged buffers are always busy */
-		KASSERT(b->b_fsmanaged == 0);
-		if (b->b_dirty == 1) {
-			if (db == NULL) {
-				/* remember first dirty buffer we saw */
-				db = b;
-			}
-			b = NULL;
-			continue;
-		}
-		break;
+	b = buffer_coldest_clean(p);
+	db = buffer_coldest(&p->bp_dirtyq);
+	if (b != NULL && db != NULL && buffer_older(db, b) &&
+	    buffer_lrudepth(b) >= bufpart_attached(p) / 2) {
+		/*
+		 * voodoo: avoid preferring very recent clean
+		 * buffers to older dirty buffers.
+		 */
+		b = NULL;
 	}
 	if (b == NULL && db != NULL) {
 		b = db;
 	}
 	if (b == NULL) {
-		/* No buffers at all...? */
-		kprintf("buffer_evict: no targets!?\n");
+		/* Nothing evictable here */
 		return EAGAIN;
 	}
 
 	/*
 	 * Flush the buffer out if necessary.
 	 */
-	num_total_evictions++;
+	bufcount(BC_TOTAL_EVICTIONS, 1);
+	if (b->b_probation && !b->b_dirty) {
+		bufcount(BC_PROBATION_EVICTIONS, 1);
+	}
+	bufstats_chargeevict(b);
 	if (b->b_dirty) {
-		num_dirty_evictions++;
+		bufcount(BC_DIRTY_EVICTIONS, 1);
 		KASSERT(b->b_busy == 0);
 		/* lock may be released here */
-		result = buffer_sync(b);
+		result = buffer_sync(p, b);
 		if (result) {
 			/* it wasn't busy, so it can't disappear */
 			KASSERT(result != EDEADBUF);
@@ -1225,8 +2287,7 @@ buffer_evict(struct buf **ret)
 			/* urgh... get another buffer */
 			kprintf("buffer_evict: warning: %s\n",
 				strerror(result));
-			buffer_remove_attached(b, 0);
-			buffer_insert_attached(b);
+			buffer_touch(b);
 			goto tryagain;
 		}
 	}
@@ -1237,94 +2298,307 @@ buffer_evict(struct buf **ret)
 	 * Detach it from its old key, and return it in a state where
 	 * it can be reattached properly.
 	 */
-	buffer_clean(b);
+	buffer_clean(p, b);
 
 	*ret = b;
 	return 0;
 }
 
+/*
+ * Evict a buffer from some partition other than P, which the caller
+ * has already tried, and put it in the detached pool. The caller must
+ * not hold any partition lock.
+ */
+static
+int
+buffer_evict_elsewhere(struct bufpart *p)
+{
+	struct bufpart *q;
+	struct buf *b;
+	unsigned i, start;
+	int result;
+
+	start = p - buffer_parts;
+	for (i=1; i<BUFFER_PARTITIONS; i++) {
+		q = &buffer_parts[(start + i) % BUFFER_PARTITIONS];
+		lock_acquire(q->bp_lock);
+		result = buffer_evict(q, &b);
+		lock_release(q->bp_lock);
+		if (result == 0) {
+			buffer_insert_detached(b);
+			return 0;
+		}
+		KASSERT(result == EAGAIN);
+	}
+
+	/* No buffers at all...? */
+	kprintf("buffer_evict: no targets!?\n");
+	return EAGAIN;
+}
+
+/*
+ * Check if writers should be throttled; see the syncer section.
+ */
+static
+bool
+buffer_over_dirty_limit(void)
+{
+	return buffer_dirty_units() > SCALE(max_total_units, THROTTLE_DIRTY);
+}
+
+/*
+ * Bookkeeping for finding an existing buffer in buffer_get.
+ */
+static
+void
+buffer_hit(struct bufpart *p, struct buf *b)
+{
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	KASSERT(b->b_busy);
+
+	bufcount(BC_VALID_GETS, 1);
+
+	/* move it to the tail (recent end) of the LRU list */
+	buffer_remove_attached(b);
+	if (b->b_readahead) {
+		b->b_readahead = 0;
+		bufcount(BC_READAHEAD_HITS, 1);
+		/* first real use; buffer_admit decides */
+	}
+	else if (b->b_probation) {
+		/* second use; it's not one-shot after all */
+		b->b_probation = 0;
+		bufcount(BC_PROBATION_PROMOTIONS, 1);
+	}
+	buffer_insert_attached(b);
+}
+
+/*
+ * Final bookkeeping for a buffer buffer_get is about to return.
+ */
+static
+void
+buffer_got(struct buf *b, bool hit, bool fsmanaged)
+{
+	KASSERT(b->b_busy);
+
+	/* the kind is per use; the fs sets it again if it's not metadata */
+	b->b_kind = BUFKIND_META;
+	b->b_statget = 1;
+	b->b_stathit = hit;
+	b->b_streamuse = 0;
+
+	if (fsmanaged) {
+		b->b_fsmanaged = 1;
+	}
+}
+
+/*
+ * Fast path for buffer_get and buffer_read: if the buffer is already
+ * in the cache (and valid, if NEEDVALID), and we can have it right
+ * away, mark it busy and return it. Otherwise return NULL and let
+ * the caller take the slow path, which can wait.
+ *
+ * "Right away" means without waiting for anything: the partition
+ * lock is only tried, not waited for, and a busy buffer counts as a
+ * miss here. Nothing else that buffer_get might have to do (syncing
+ * for the syncer, or throttling) is done here either, so we also
+ * bail out if any of that is called for.
+ *
+ * There's no RCU or other safe memory reclamation in this kernel
+ * (buffers and hash buckets can be freed at any time), so a truly
+ * lockless reader isn't safe. But the partition lock is held only
+ * for the lookup, never across a sleep, so trying it fails only if
+ * someone else is in the middle of the same few instructions or is
+ * doing real work in the partition, in which case we'd have waited.
+ */
 static
 struct buf *
-buffer_find(struct fs *fs, daddr_t physblock)
+buffer_get_fast(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
+		bool needvalid)
 {
-	return bufhash_get(&buffer_hash, fs, physblock);
+	struct bufpart *p;
+	struct buf *b;
+	int result;
+
+	KASSERT(buffer_size_ok(size));
+	if (!fsmanaged) {
+		KASSERT(curthread->t_did_reserve_buffers == true);
+	}
+
+	if (!fsmanaged && (syncer_needs_help || buffer_over_dirty_limit())) {
+		return NULL;
+	}
+
+	p = buffer_partition(fs, block);
+	if (!lock_tryacquire(p->bp_lock)) {
+		return NULL;
+	}
+
+	b = buffer_find(p, fs, block);
+	if (b == NULL || b->b_busy || (needvalid && !b->b_valid)) {
+		lock_release(p->bp_lock);
+		return NULL;
+	}
+	/* buffers for the same block must all be the same size */
+	KASSERT(b->b_size == size);
+
+	result = buffer_mark_busy(p, b);
+	/* wasn't busy, so didn't wait, so can't fail */
+	KASSERT(result == 0);
+
+	bufcount(BC_TOTAL_GETS, 1);
+	bufcount(BC_FAST_GETS, 1);
+	buffer_hit(p, b);
+	lock_release(p->bp_lock);
+
+	buffer_got(b, true, fsmanaged);
+	return b;
 }
 
 /*
  * Find a buffer for the given block, if one already exists; otherwise
  * attach one but don't bother to read it in. Set fsmanaged mode if
- * FSMANAGED is true.
+ * FSMANAGED is true. The caller must hold the lock for the block's
+ * partition, P; it may be released and reacquired.
  */
 static
 int
-buffer_get_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		    struct buf **ret)
+buffer_get_internal(struct bufpart *p, struct fs *fs, daddr_t block,
+		    size_t size, bool fsmanaged, struct buf **ret)
 {
 	struct buf *b;
+	struct timespec evictstart;
+	bool evicting, hit;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	KASSERT(p == buffer_partition(fs, block));
+	bufcheck(p);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(buffer_size_ok(size));
 	if (!fsmanaged) {
 		KASSERT(curthread->t_did_reserve_buffers == true);
 	}
 
-	if (!fsmanaged && syncer_needs_help) {
-		sync_one_old_buffer();
+	if (!fsmanaged) {
+		if (syncer_needs_help) {
+			sync_one_old_buffer(p);
+		}
+		else if (buffer_over_dirty_limit()) {
+			/*
+			 * Too much of the cache is dirty; make this
+			 * thread pay for a write before it can get
+			 * (and maybe dirty) another buffer. This
+			 * paces writers to the rate the disk can
+			 * take, instead of letting them fill the
+			 * cache and then stall in buffer_evict.
+			 */
+			bufcount(BC_THROTTLED_GETS, 1);
+			sync_one_old_buffer(p);
+		}
 	}
 
-	num_total_gets++;
+	bufcount(BC_TOTAL_GETS, 1);
+	evicting = false;
+	hit = false;
 
 again:
-	b = buffer_find(fs, block);
+	b = buffer_find(p, fs, block);
 	if (b != NULL) {
-		result = buffer_mark_busy(b);
+		result = buffer_mark_busy(p, b);
 		if (result) {
 			KASSERT(result == EDEADBUF);
 			goto again;
 		}
-		num_valid_gets++;
-		buffer_remove_attached(b, 1);
-
-		/* move it to the tail (recent end) of the LRU list */
-		buffer_insert_attached(b);
+		/* buffers for the same block must all be the same size */
+		KASSERT(b->b_size == size);
+		buffer_hit(p, b);
+		hit = true;
 	}
 	else {
-		b = buffer_remove_detached();
-		if (b == NULL && num_total_buffers < max_total_buffers) {
-			/* Can create a new buffer... */
-			b = buffer_create();
-		}
+		lock_acquire(buffer_pool_lock);
+		b = buffer_alloc(size);
+		lock_release(buffer_pool_lock);
+
 		if (b == NULL) {
-			result = buffer_evict(&b);
+			if (!evicting) {
+				evicting = true;
+				gettime(&evictstart);
+			}
+			result = buffer_evict(p, &b);
+			if (result == EAGAIN) {
+				/*
+				 * Nothing to evict in this partition;
+				 * push something from another one
+				 * into the pool and look again. We
+				 * have to let go of our lock for
+				 * that, so somebody else might
+				 * attach the block meanwhile.
+				 */
+				lock_release(p->bp_lock);
+				result = buffer_evict_elsewhere(p);
+				lock_acquire(p->bp_lock);
+				if (result) {
+					return result;
+				}
+				goto again;
+			}
 			if (result) {
 				return result;
 			}
 			KASSERT(b != NULL);
+			if (buffer_find(p, fs, block) != NULL) {
+				/*
+				 * Evicting can release the lock, so
+				 * somebody else might have beaten us
+				 * to it. Use theirs.
+				 */
+				buffer_insert_detached(b);
+				goto again;
+			}
+			lock_acquire(buffer_pool_lock);
+			if (b->b_size != size ||
+			    num_total_units > max_total_units) {
+				/*
+				 * Wrong size, or the cache has been
+				 * shrunk and is still too big; free
+				 * it up to make room and look again.
+				 * If it was smaller than we want we
+				 * may have to evict more than one.
+				 */
+				buffer_destroy(b);
+				lock_release(buffer_pool_lock);
+				goto again;
+			}
+			lock_release(buffer_pool_lock);
+		}
+
+		if (evicting) {
+			bufstats_evictlatency(fs, &evictstart);
 		}
 
-		KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
-		result = buffer_attach(b, fs, block);
+		KASSERT(b->b_size == size);
+		result = buffer_attach(p, b, fs, block);
 		if (result) {
 			buffer_insert_detached(b);
 			return result;
 		}
 		KASSERT(b->b_busy == 0);
-		result = buffer_mark_busy(b);
+		result = buffer_mark_busy(p, b);
 		/* b wasn't busy, so we didn't wait and it didn't disappear */
 		KASSERT(result == 0);
 
-		/* move it to the tail (recent end) of the LRU list */
+		/* put it at the tail (recent end) of the LRU list */
 		buffer_insert_attached(b);
 
 		/*
 		 * Call the FS's buffer attach routine. We do this
 		 * after buffer_attach (rather than in it) so we can
 		 * do it safely with the buffer marked busy and
-		 * without holding buffer_lock, as buffer_lock isn't
-		 * supposed to be exposed to file system code.
+		 * without holding the partition lock, as buffer cache
+		 * locks aren't supposed to be exposed to file system
+		 * code.
 		 *
 		 * Note: b_fsmanaged, if requested, hasn't been set
 		 * yet.  There's some chance that this might confuse
@@ -1333,11 +2607,13 @@ again:
 		 * duplicating the code.
 		 */
 
-		lock_release(buffer_lock);
+		lock_release(p->bp_lock);
 		result = FSOP_ATTACHBUF(b->b_fs, block, b);
-		lock_acquire(buffer_lock);
+		lock_acquire(p->bp_lock);
 		if (result) {
 			buffer_unmark_busy(b);
+			buffer_remove_attached(b);
+			buffer_detach(b);
 			buffer_insert_detached(b);
 			return result;
 		}
@@ -1346,11 +2622,7 @@ again:
 	/* crosscheck that we got what we asked for */
 	KASSERT(b->b_fs == fs && b->b_physblock == block);
 
-
-	if (fsmanaged) {
-		b->b_fsmanaged = 1;
-	}
-
+	buffer_got(b, hit, fsmanaged);
 	*ret = b;
 	return 0;
 }
@@ -1361,22 +2633,21 @@ again:
  */
 static
 int
-buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		     struct buf **ret)
+buffer_read_internal(struct bufpart *p, struct fs *fs, daddr_t block,
+		     size_t size, bool fsmanaged, struct buf **ret)
 {
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(p->bp_lock));
 
-	result = buffer_get_internal(fs, block, size, fsmanaged, ret);
+	result = buffer_get_internal(p, fs, block, size, fsmanaged, ret);
 	if (result) {
-		lock_release(buffer_lock);
 		*ret = NULL;
 		return result;
 	}
 
 	if (!(*ret)->b_valid) {
-		num_read_gets++;
+		bufcount(BC_READ_GETS, 1);
 		/* may lose (and then re-acquire) lock here */
 		result = buffer_readin(*ret);
 		if (result) {
@@ -1396,11 +2667,20 @@ buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 int
 buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufpart *p;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, false/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	*ret = buffer_get_fast(fs, block, size, false/*fsmanaged*/,
+			       false/*needvalid*/);
+	if (*ret != NULL) {
+		return 0;
+	}
+
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	result = buffer_get_internal(p, fs, block, size, false/*fsmanaged*/,
+				     ret);
+	lock_release(p->bp_lock);
 
 	return result;
 }
@@ -1412,11 +2692,20 @@ buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 int
 buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufpart *p;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, false/*fsmanaged*/,ret);
-	lock_release(buffer_lock);
+	*ret = buffer_get_fast(fs, block, size, false/*fsmanaged*/,
+			       true/*needvalid*/);
+	if (*ret != NULL) {
+		return 0;
+	}
+
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	result = buffer_read_internal(p, fs, block, size, false/*fsmanaged*/,
+				      ret);
+	lock_release(p->bp_lock);
 
 	return result;
 }
@@ -1428,11 +2717,20 @@ int
 buffer_get_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		     struct buf **ret)
 {
+	struct bufpart *p;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	*ret = buffer_get_fast(fs, block, size, true/*fsmanaged*/,
+			       false/*needvalid*/);
+	if (*ret != NULL) {
+		return 0;
+	}
+
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	result = buffer_get_internal(p, fs, block, size, true/*fsmanaged*/,
+				     ret);
+	lock_release(p->bp_lock);
 
 	return result;
 }
@@ -1444,15 +2742,183 @@ int
 buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		      struct buf **ret)
 {
+	struct bufpart *p;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	*ret = buffer_get_fast(fs, block, size, true/*fsmanaged*/,
+			       true/*needvalid*/);
+	if (*ret != NULL) {
+		return 0;
+	}
+
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	result = buffer_read_internal(p, fs, block, size, true/*fsmanaged*/,
+				      ret);
+	lock_release(p->bp_lock);
 
 	return result;
 }
 
+/*
+ * Read in the NUM buffers in BUFS, which are busy and not valid, and
+ * are for consecutive blocks. Use one FSOP_READBLOCKS call if the fs
+ * has it and will take them; otherwise read them one at a time. No
+ * locks are held on entry or exit.
+ */
+static
+int
+buffer_readin_run(struct buf **bufs, unsigned num)
+{
+	struct fs *fs = bufs[0]->b_fs;
+	void *datas[FS_READBLOCKS_MAX];
+	struct bufpart *p;
+	unsigned i;
+	int result;
+
+	KASSERT(num > 0 && num <= FS_READBLOCKS_MAX);
+
+	result = ENOSYS;
+	if (num > 1 && fs->fs_ops->fsop_readblocks != NULL) {
+		for (i=0; i<num; i++) {
+			KASSERT(bufs[i]->b_busy);
+			KASSERT(!bufs[i]->b_valid);
+			KASSERT(bufs[i]->b_physblock ==
+				bufs[0]->b_physblock + i);
+			datas[i] = bufs[i]->b_data;
+		}
+		result = FSOP_READBLOCKS(fs, bufs[0]->b_physblock, num,
+					 datas, bufs[0]->b_size);
+		if (result == 0) {
+			for (i=0; i<num; i++) {
+				p = bufs[i]->b_part;
+				lock_acquire(p->bp_lock);
+				bufs[i]->b_valid = 1;
+				bufcount(BC_READ_GETS, 1);
+				if (i == 0) {
+					bufcount(BC_BATCH_READS, 1);
+					bufcount(BC_BATCH_BLOCKS, num);
+				}
+				lock_release(p->bp_lock);
+			}
+			curthread->t_usage.u_inblock += num;
+			return 0;
+		}
+	}
+	if (result != ENOSYS) {
+		return result;
+	}
+
+	for (i=0; i<num; i++) {
+		p = bufs[i]->b_part;
+		lock_acquire(p->bp_lock);
+		bufcount(BC_READ_GETS, 1);
+		/* may lose (and then re-acquire) lock here */
+		result = buffer_readin(bufs[i]);
+		lock_release(p->bp_lock);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Common code for buffer_get_many and buffer_read_many.
+ *
+ * First get all the buffers, in order, with the same logic as
+ * buffer_get (including the fast path for hits). Then, if reading,
+ * go over them again and read in the ones that aren't valid,
+ * grouping runs of consecutive blocks.
+ */
+static
+int
+buffer_get_many_internal(struct fs *fs, const daddr_t *blocks, unsigned num,
+			 size_t size, bool doread, struct buf **ret)
+{
+	struct bufpart *p;
+	unsigned i, j;
+	int result;
+
+	KASSERT(num <= BUFFER_MANY_MAX);
+
+	for (i=0; i<num; i++) {
+		for (j=0; j<i; j++) {
+			/* getting the same buffer twice would deadlock */
+			KASSERT(blocks[j] != blocks[i]);
+		}
+
+		ret[i] = buffer_get_fast(fs, blocks[i], size,
+					 false/*fsmanaged*/,
+					 false/*needvalid*/);
+		if (ret[i] != NULL) {
+			continue;
+		}
+
+		p = buffer_partition(fs, blocks[i]);
+		lock_acquire(p->bp_lock);
+		result = buffer_get_internal(p, fs, blocks[i], size,
+					     false/*fsmanaged*/, &ret[i]);
+		lock_release(p->bp_lock);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	if (!doread) {
+		return 0;
+	}
+
+	for (i=0; i<num; i=j) {
+		if (ret[i]->b_valid) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < num && j - i < FS_READBLOCKS_MAX; j++) {
+			if (ret[j]->b_valid || blocks[j] != blocks[j-1] + 1) {
+				break;
+			}
+		}
+		result = buffer_readin_run(&ret[i], j - i);
+		if (result) {
+			/* releasing invalid buffers detaches them */
+			i = num;
+			goto fail;
+		}
+	}
+	return 0;
+
+ fail:
+	for (j=0; j<i; j++) {
+		buffer_release(ret[j]);
+		ret[j] = NULL;
+	}
+	return result;
+}
+
+/*
+ * Get buffers for several blocks at once.
+ */
+int
+buffer_get_many(struct fs *fs, const daddr_t *blocks, unsigned num,
+		size_t size, struct buf **ret)
+{
+	return buffer_get_many_internal(fs, blocks, num, size,
+					false/*doread*/, ret);
+}
+
+/*
+ * Get buffers for several blocks at once, and read in the ones that
+ * aren't cached in as few transfers as possible.
+ */
+int
+buffer_read_many(struct fs *fs, const daddr_t *blocks, unsigned num,
+		 size_t size, struct buf **ret)
+{
+	return buffer_get_many_internal(fs, blocks, num, size,
+					true/*doread*/, ret);
+}
+
 /*
  * Shortcut combination of buffer_get and buffer_writeout that writes
  * out any existing buffer if it's dirty and otherwise does nothing.
@@ -1464,18 +2930,21 @@ buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int
 buffer_flush(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufpart *p;
 	struct buf *b;
 	int result = 0;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	bufcheck(p);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(buffer_size_ok(size));
 
-	b = buffer_find(fs, block);
+	b = buffer_find(p, fs, block);
 	if (b == NULL) {
 		goto done;
 	}
+	KASSERT(b->b_size == size);
 	KASSERT(b->b_valid);
 
 	if (!b->b_dirty) {
@@ -1483,7 +2952,7 @@ buffer_flush(struct fs *fs, daddr_t block, size_t size)
 		goto done;
 	}
 
-	result = buffer_mark_busy(b);
+	result = buffer_mark_busy(p, b);
 	if (result) {
 		KASSERT(result == EDEADBUF);
 		/* Buffer disappeared; no longer need to write it */
@@ -1506,7 +2975,7 @@ buffer_flush(struct fs *fs, daddr_t block, size_t size)
 
 	buffer_unmark_busy(b);
 done:
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
 	return result;
 }
 
@@ -1517,61 +2986,93 @@ done:
 void
 buffer_drop(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufpart *p;
 	struct buf *b;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	bufcheck(p);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(buffer_size_ok(size));
 
-	b = buffer_find(fs, block);
+	b = buffer_find(p, fs, block);
 	if (b != NULL) {
+		KASSERT(b->b_size == size);
 		/*
 		 * While the FS shouldn't ever drop a buffer that it's also
 		 * actively using, the buffer might be getting synced. So
 		 * wait for it, then release it again. Because we're locked,
 		 * nobody else can get it at that point until we finish.
 		 */
-		result = buffer_mark_busy(b);
+		result = buffer_mark_busy(p, b);
 		if (result == EDEADBUF) {
 			/* someone else already dropped it */
-			lock_release(buffer_lock);
+			lock_release(p->bp_lock);
 			return;
 		}
 		KASSERT(result == 0);
 		buffer_unmark_busy(b);
 
-		buffer_clean(b);
+		buffer_clean(p, b);
 		buffer_insert_detached(b);
 	}
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
+}
+
+/*
+ * Choose which clean queue a buffer goes on as it's released: a
+ * block just read in for a streaming use goes on probation, and any
+ * use that isn't streaming ends probation. (A second use of a
+ * probationary buffer already ended it in buffer_hit.) The buffer
+ * must be off its queue.
+ */
+static
+void
+buffer_admit(struct buf *b)
+{
+	if (!b->b_streamuse) {
+		if (b->b_probation) {
+			b->b_probation = 0;
+			bufcount(BC_PROBATION_PROMOTIONS, 1);
+		}
+	}
+	else if (!b->b_stathit && !b->b_probation) {
+		b->b_probation = 1;
+		bufcount(BC_PROBATION_ADMITS, 1);
+	}
+	b->b_streamuse = 0;
 }
 
 static
 void
 buffer_release_internal(struct buf *b)
 {
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	struct bufpart *p = b->b_part;
+
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	bufcheck(p);
 
 	if (!b->b_fsmanaged) {
 		/* buffers must be released while still reserved */
 		KASSERT(curthread->t_did_reserve_buffers == true);
 	}
 
+	if (b->b_valid) {
+		/* move it to the end of the LRU list it now belongs on */
+		buffer_remove_attached(b);
+		buffer_admit(b);
+		buffer_insert_attached(b);
+	}
+
+	bufstats_chargeget(b);
 	buffer_unmark_busy(b);
 
 	if (!b->b_valid) {
 		/* detach it */
-		buffer_clean(b);
+		buffer_clean(p, b);
 		buffer_insert_detached(b);
 	}
-	else {
-		/* move it to the end of the LRU list */
-		buffer_remove_attached(b, 0);
-		buffer_insert_attached(b);
-	}
 }
 
 /*
@@ -1580,9 +3081,11 @@ buffer_release_internal(struct buf *b)
 void
 buffer_release(struct buf *b)
 {
-	lock_acquire(buffer_lock);
+	struct bufpart *p = b->b_part;
+
+	lock_acquire(p->bp_lock);
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
 }
 
 /*
@@ -1591,12 +3094,14 @@ buffer_release(struct buf *b)
 void
 buffer_release_and_invalidate(struct buf *b)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	struct bufpart *p = b->b_part;
+
+	lock_acquire(p->bp_lock);
+	bufcheck(p);
 
 	b->b_valid = 0;
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(p->bp_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1621,32 +3126,27 @@ buffer_set_fsdata(struct buf *buf, void *newfsd)
 ////////////////////////////////////////////////////////////
 // explicit sync
 
+/*
+ * Sync one partition's share of a file system's buffers, up to
+ * MY_EPOCH.
+ */
+static
 int
-sync_fs_buffers(struct fs *fs)
+sync_part_buffers(struct bufpart *p, struct fs *fs, unsigned my_epoch)
 {
-	unsigned i;
+	struct bufnode marker, *bn;
 	struct buf *b;
-	unsigned my_epoch, my_generation;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	bufnode_init(&marker, NULL);
 
-	my_epoch = dirty_epoch++;
-	if (dirty_epoch == 0) {
-		/*
-		 * Handling this instead of dying is not that
-		 * difficult, but for OS/161 it's not really worth the
-		 * trouble.
-		 */
-		panic("vfs: buffer cache syncer epoch wrapped around\n");
-	}
-
-	my_generation = dirty_buffers_generation;
+	lock_acquire(p->bp_lock);
+	bufcheck(p);
 
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
+	for (bn = p->bp_dirty.bl_head.bn_next;
+	     bn != &p->bp_dirty.bl_tail;
+	     bn = bn->bn_next) {
+		b = bn->bn_buf;
 		if (b == NULL || b->b_fs != fs) {
 			continue;
 		}
@@ -1664,7 +3164,9 @@ sync_fs_buffers(struct fs *fs)
 		KASSERT(b->b_dirty);
 
 		/* lock may be released (and then re-acquired) here */
-		result = buffer_sync(b);
+		buflist_placemarker(&marker, bn);
+		result = buffer_sync_cluster(p, b);
+		bn = buflist_takemarker(&marker);
 		if (result == EDEADBUF) {
 			/*
 			 * The buffer was invalidated/evicted while we
@@ -1673,73 +3175,555 @@ sync_fs_buffers(struct fs *fs)
 			 */
 		}
 		else if (result) {
-			lock_release(buffer_lock);
+			lock_release(p->bp_lock);
 			return result;
 		}
+	}
 
-		if (my_generation != dirty_buffers_generation) {
-			/* compact_dirty_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+	lock_release(p->bp_lock);
+	return 0;
+}
+
+/*
+ * Count (if BLOCKS is NULL) or collect into BLOCKS, up to MAX of
+ * them, the block numbers of a file system's buffers that need
+ * syncing up to MY_EPOCH. Returns how many there were.
+ */
+static
+unsigned
+sync_gather_blocks(struct fs *fs, unsigned my_epoch,
+		   daddr_t *blocks, unsigned max)
+{
+	struct bufpart *p;
+	struct bufnode *bn;
+	struct buf *b;
+	unsigned i, num;
+
+	num = 0;
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		p = &buffer_parts[i];
+		lock_acquire(p->bp_lock);
+		for (bn = p->bp_dirty.bl_head.bn_next;
+		     bn != &p->bp_dirty.bl_tail;
+		     bn = bn->bn_next) {
+			b = bn->bn_buf;
+			if (b == NULL || b->b_fs != fs) {
+				continue;
+			}
+			if (b->b_dirtyepoch > my_epoch) {
+				/* as in sync_part_buffers */
+				break;
+			}
+			if (blocks != NULL) {
+				if (num == max) {
+					break;
+				}
+				blocks[num] = b->b_physblock;
+			}
+			num++;
 		}
+		lock_release(p->bp_lock);
 	}
+	return num;
+}
+
+/*
+ * Sort block numbers. (Shell sort; there are too many for insertion
+ * sort, and we don't have qsort.)
+ */
+static
+void
+sync_sort_blocks(daddr_t *blocks, unsigned num)
+{
+	unsigned gap, i, j;
+	daddr_t tmp;
+
+	gap = 1;
+	while (gap < num / 3) {
+		gap = gap * 3 + 1;
+	}
+	for (; gap > 0; gap /= 3) {
+		for (i=gap; i<num; i++) {
+			tmp = blocks[i];
+			for (j=i; j>=gap && blocks[j-gap] > tmp; j -= gap) {
+				blocks[j] = blocks[j-gap];
+			}
+			blocks[j] = tmp;
+		}
+	}
+}
+
+/*
+ * Sync the buffers for a list of blocks, in the order given, up to
+ * MY_EPOCH.
+ */
+static
+int
+sync_listed_buffers(struct fs *fs, unsigned my_epoch,
+		    const daddr_t *blocks, unsigned num)
+{
+	struct bufpart *p;
+	struct buf *b;
+	unsigned i;
+	int result;
 
-	lock_release(buffer_lock);
+	for (i=0; i<num; i++) {
+		p = buffer_partition(fs, blocks[i]);
+		lock_acquire(p->bp_lock);
+		b = buffer_find(p, fs, blocks[i]);
+		if (b == NULL || !b->b_valid || !b->b_dirty ||
+		    b->b_dirtyepoch > my_epoch) {
+			/* gone, or already swept up in an earlier cluster */
+			lock_release(p->bp_lock);
+			continue;
+		}
+		result = buffer_sync_cluster(p, b);
+		lock_release(p->bp_lock);
+		if (result == EDEADBUF) {
+			/* as in sync_part_buffers */
+		}
+		else if (result) {
+			return result;
+		}
+	}
 	return 0;
 }
 
+/*
+ * Start a sync: take a new epoch, so buffers dirtied from now on are
+ * newer than it.
+ */
+static
+unsigned
+sync_start_epoch(void)
+{
+	unsigned my_epoch;
+
+	lock_acquire(buffer_pool_lock);
+	poolcheck();
+
+	my_epoch = dirty_epoch++;
+	if (dirty_epoch == 0) {
+		/*
+		 * Handling this instead of dying is not that
+		 * difficult, but for OS/161 it's not really worth the
+		 * trouble.
+		 */
+		panic("vfs: buffer cache syncer epoch wrapped around\n");
+	}
+	lock_release(buffer_pool_lock);
+	return my_epoch;
+}
+
+/*
+ * Sync all of a file system's buffers that were dirty when we were
+ * called.
+ *
+ * Rather than going through each partition's dirty queue in turn,
+ * which visits the blocks in the order they were dirtied, we collect
+ * all the block numbers first and write them in ascending order; with
+ * buffer_sync_cluster sweeping up the neighbors of each, this turns a
+ * full sync into a mostly sequential pass over the disk. Buffers
+ * dirtied while we're working aren't in the list; they can't be
+ * added to the dirty queues with an old epoch, so the count we take
+ * first is an upper bound. If we can't get memory for the list we
+ * fall back to the queue order.
+ */
+int
+sync_fs_buffers(struct fs *fs)
+{
+	daddr_t *blocks;
+	unsigned my_epoch;
+	unsigned i, num;
+	int result;
+
+	my_epoch = sync_start_epoch();
+
+	num = sync_gather_blocks(fs, my_epoch, NULL, 0);
+	if (num == 0) {
+		return 0;
+	}
+	blocks = kmalloc(num * sizeof(blocks[0]));
+	if (blocks != NULL) {
+		num = sync_gather_blocks(fs, my_epoch, blocks, num);
+		sync_sort_blocks(blocks, num);
+		result = sync_listed_buffers(fs, my_epoch, blocks, num);
+		kfree(blocks);
+		return result;
+	}
+
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		result = sync_part_buffers(&buffer_parts[i], fs, my_epoch);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Collect into BLOCKS, up to MAX of them, the block numbers of BO's
+ * buffers that need syncing up to MY_EPOCH, starting from MARKER and
+ * leaving MARKER after the last one looked at. Returns how many.
+ */
+static
+unsigned
+sync_gather_owner(struct bufowner *bo, struct bufnode *marker,
+		  unsigned my_epoch, daddr_t *blocks, unsigned max)
+{
+	struct bufnode *bn;
+	struct buf *b;
+	unsigned num;
+
+	num = 0;
+	spinlock_acquire(&buffer_owner_lock);
+	for (bn = buflist_takemarker(marker)->bn_next;
+	     bn != &bo->bo_dirty.bl_tail && num < max;
+	     bn = bn->bn_next) {
+		b = bn->bn_buf;
+		if (b == NULL) {
+			/* someone else's marker */
+			continue;
+		}
+		if (b->b_dirtyepoch > my_epoch) {
+			/* dirtied since we started */
+			continue;
+		}
+		/* it's dirty, so it's attached and the key can't change */
+		blocks[num++] = b->b_physblock;
+	}
+	buflist_placemarker(marker, bn->bn_prev);
+	spinlock_release(&buffer_owner_lock);
+	return num;
+}
+
+/*
+ * Sync the buffers of one file (on FS) that were dirty when we were
+ * called: the ones tagged with BO by buffer_set_owner. This is for
+ * fsync, so the cost depends on how much that file has dirty, not
+ * on the rest of the cache.
+ *
+ * They're done in batches, each sorted and written like a full sync,
+ * so runs still go out as clusters. A marker on the owner list holds
+ * our place between batches, so each buffer is looked at once; one
+ * that stays dirty anyway (fsmanaged, or rewritten and redirtied
+ * meanwhile) is left behind it.
+ */
+int
+sync_owner_buffers(struct fs *fs, struct bufowner *bo)
+{
+	daddr_t blocks[SYNC_OWNER_BATCH];
+	struct bufnode marker;
+	unsigned my_epoch, num;
+	int result;
+
+	my_epoch = sync_start_epoch();
+
+	bufnode_init(&marker, NULL);
+	spinlock_acquire(&buffer_owner_lock);
+	buflist_placemarker(&marker, &bo->bo_dirty.bl_head);
+	spinlock_release(&buffer_owner_lock);
+
+	result = 0;
+	while ((num = sync_gather_owner(bo, &marker, my_epoch, blocks,
+					SYNC_OWNER_BATCH)) > 0) {
+		sync_sort_blocks(blocks, num);
+		result = sync_listed_buffers(fs, my_epoch, blocks, num);
+		if (result) {
+			break;
+		}
+	}
+
+	spinlock_acquire(&buffer_owner_lock);
+	buflist_takemarker(&marker);
+	spinlock_release(&buffer_owner_lock);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
-// for unmounting
+// read-ahead
 
 /*
- * Invalidate and detach all buffers belonging to a filesystem. Every
- * fs should do this as part of its unmount routine once it's sure
- * that the fs is idle.
+ * Choose the next read-ahead window for a stream of reads, given the
+ * previous window. A sequential access opens or doubles the window,
+ * up to READAHEAD_MAX; anything else closes it.
+ */
+unsigned
+buffer_readahead_window(unsigned window, bool sequential)
+{
+	if (!sequential) {
+		return 0;
+	}
+	if (window < READAHEAD_MIN) {
+		return READAHEAD_MIN;
+	}
+	window *= 2;
+	if (window > READAHEAD_MAX) {
+		window = READAHEAD_MAX;
+	}
+	return window;
+}
+
+/*
+ * Queue a block to be brought into the cache in the background.
  *
- * Panic if we hit a dirty buffer, as sync should just have been
- * called and no buffers should get dirty again after that.
+ * This never waits: if the block is already cached there is nothing
+ * to do, and if the queue is full the request is dropped, since
+ * read-ahead is only ever a hint.
+ *
+ * If URGENT is set the block goes on the front of the queue instead
+ * of the back, so it gets read before any file read-ahead already
+ * waiting.
  */
+static
 void
-drop_fs_buffers(struct fs *fs)
+readahead_enqueue(struct fs *fs, daddr_t block, size_t size, bool urgent)
 {
-	unsigned i;
+	struct bufpart *p;
+	struct readahead *ra;
+	bool cached;
+
+	KASSERT(buffer_size_ok(size));
+
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	cached = buffer_find(p, fs, block) != NULL;
+	lock_release(p->bp_lock);
+	if (cached) {
+		return;
+	}
+
+	lock_acquire(readahead_lock);
+	if (readahead_count == READAHEAD_QUEUE) {
+		readahead_dropped++;
+		lock_release(readahead_lock);
+		return;
+	}
+	if (urgent) {
+		readahead_head = (readahead_head + READAHEAD_QUEUE - 1)
+			% READAHEAD_QUEUE;
+		ra = &readahead_queue[readahead_head];
+		readahead_prefetched++;
+	}
+	else {
+		ra = &readahead_queue[(readahead_head + readahead_count)
+				      % READAHEAD_QUEUE];
+	}
+	ra->ra_fs = fs;
+	ra->ra_block = block;
+	ra->ra_size = size;
+	readahead_count++;
+	readahead_queued++;
+	cv_signal(readahead_cv, readahead_lock);
+	lock_release(readahead_lock);
+}
+
+/*
+ * File data read-ahead: queue in order behind whatever's waiting.
+ */
+void
+buffer_readahead(struct fs *fs, daddr_t block, size_t size)
+{
+	readahead_enqueue(fs, block, size, false/*urgent*/);
+}
+
+/*
+ * Prefetch: the fs is about to need this block (typically metadata)
+ * and wants it in flight while it does something else. Same as
+ * read-ahead, but jumps the queue.
+ */
+void
+buffer_prefetch(struct fs *fs, daddr_t block, size_t size)
+{
+	readahead_enqueue(fs, block, size, true/*urgent*/);
+}
+
+/*
+ * Read one block in for read-ahead. The buffer is left valid and
+ * idle in the cache with b_readahead set, so we can tell later
+ * whether it was worth reading.
+ *
+ * If the block turns up in the cache in the meantime, leave it
+ * alone; someone else has already read (or is reading) it.
+ */
+static
+void
+readahead_block(struct fs *fs, daddr_t block, size_t size)
+{
+	struct bufpart *p;
+	struct buf *b;
+	int result;
+
+	reserve_buffers(size);
+
+	p = buffer_partition(fs, block);
+	lock_acquire(p->bp_lock);
+	if (buffer_find(p, fs, block) != NULL) {
+		goto done;
+	}
+
+	result = buffer_get_internal(p, fs, block, size, false/*fsmanaged*/,
+				     &b);
+	if (result) {
+		goto done;
+	}
+	if (!b->b_valid) {
+		bufcount(BC_READ_GETS, 1);
+		/* may lose (and then re-acquire) lock here */
+		result = buffer_readin(b);
+		if (result == 0) {
+			b->b_readahead = 1;
+		}
+	}
+	/* this isn't a use as far as the per-fs stats are concerned */
+	b->b_statget = 0;
+	/* nor for admission: wait for a real use to promote it */
+	b->b_streamuse = 1;
+	/* if the read failed this invalidates and detaches the buffer */
+	buffer_release_internal(b);
+
+ done:
+	lock_release(p->bp_lock);
+	unreserve_buffers(size);
+}
+
+/*
+ * Forget any queued read-ahead for a file system, and wait for any
+ * read in progress on it to finish.
+ */
+static
+void
+readahead_drop_fs(struct fs *fs)
+{
+	unsigned i, j, n;
+
+	lock_acquire(readahead_lock);
+	n = 0;
+	for (i=0; i<readahead_count; i++) {
+		j = (readahead_head + i) % READAHEAD_QUEUE;
+		if (readahead_queue[j].ra_fs == fs) {
+			continue;
+		}
+		readahead_queue[(readahead_head + n) % READAHEAD_QUEUE] =
+			readahead_queue[j];
+		n++;
+	}
+	readahead_count = n;
+	while (readahead_busyfs == fs) {
+		cv_wait(readahead_done_cv, readahead_lock);
+	}
+	lock_release(readahead_lock);
+}
+
+/*
+ * Read-ahead thread. Pulls blocks off the queue and reads them in,
+ * one at a time.
+ */
+static
+void
+readahead_thread(void *x1, unsigned long x2)
+{
+	struct readahead ra;
+
+	(void)x1;
+	(void)x2;
+
+	while (1) {
+		lock_acquire(readahead_lock);
+		while (readahead_count == 0) {
+			cv_wait(readahead_cv, readahead_lock);
+		}
+		ra = readahead_queue[readahead_head];
+		readahead_head = (readahead_head + 1) % READAHEAD_QUEUE;
+		readahead_count--;
+		readahead_busyfs = ra.ra_fs;
+		lock_release(readahead_lock);
+
+		readahead_block(ra.ra_fs, ra.ra_block, ra.ra_size);
+
+		lock_acquire(readahead_lock);
+		readahead_busyfs = NULL;
+		cv_broadcast(readahead_done_cv, readahead_lock);
+		lock_release(readahead_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// for unmounting
+
+/*
+ * Invalidate and detach all buffers on clean queue Q of partition P
+ * that belong to FS.
+ */
+static
+void
+drop_fs_queue(struct bufpart *p, struct buflist *q, struct fs *fs)
+{
+	struct bufnode marker, *bn;
 	struct buf *b;
-	unsigned my_generation;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	bufnode_init(&marker, NULL);
 
-	my_generation = attached_buffers_generation;
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers); i++) {
-		b = bufarray_get(&attached_buffers, i);
+	for (bn = q->bl_head.bn_next; bn != &q->bl_tail; bn = bn->bn_next) {
+		b = bn->bn_buf;
 		if (b == NULL || b->b_fs != fs) {
 			continue;
 		}
 
 		KASSERT(b->b_valid);
-		if (b->b_dirty) {
-			panic("drop_fs_buffers: buffer did not get synced\n");
-		}
 		if (b->b_busy) {
 			panic("drop_fs_buffers: buffer is busy\n");
 		}
 
-		buffer_clean(b);
+		/* buffer_clean releases the lock */
+		buflist_placemarker(&marker, bn);
+		buffer_clean(p, b);
 		buffer_insert_detached(b);
+		bn = buflist_takemarker(&marker);
+	}
+}
 
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			i = 0;
-			my_generation = attached_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+/*
+ * Invalidate and detach all buffers belonging to a filesystem. Every
+ * fs should do this as part of its unmount routine once it's sure
+ * that the fs is idle.
+ *
+ * Panic if we hit a dirty buffer, as sync should just have been
+ * called and no buffers should get dirty again after that.
+ */
+void
+drop_fs_buffers(struct fs *fs)
+{
+	struct bufpart *p;
+	struct bufnode *bn;
+	struct buf *b;
+	unsigned j;
+
+	/* make sure nothing new gets read in behind our back */
+	readahead_drop_fs(fs);
+
+	for (j=0; j<BUFFER_PARTITIONS; j++) {
+		p = &buffer_parts[j];
+		lock_acquire(p->bp_lock);
+		bufcheck(p);
+
+		for (bn = p->bp_dirtyq.bl_head.bn_next;
+		     bn != &p->bp_dirtyq.bl_tail;
+		     bn = bn->bn_next) {
+			b = bn->bn_buf;
+			if (b != NULL && b->b_fs == fs) {
+				panic("drop_fs_buffers: buffer did not "
+				      "get synced\n");
+			}
 		}
+
+		drop_fs_queue(p, &p->bp_cleanq, fs);
+		drop_fs_queue(p, &p->bp_probq, fs);
+
+		lock_release(p->bp_lock);
 	}
 
-	lock_release(buffer_lock);
+	bufstats_drop(fs);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1752,102 +3736,115 @@ drop_fs_buffers(struct fs *fs)
  * avoid data loss in a crash.
  *
  * Pursuant to this, there are two work functions, one for working
- * the queue of least-recently-used buffers (attached_buffers) and
- * one for working the queue of old dirty buffers (dirty_buffers).
+ * the cold end of the LRU order (bp_dirtyq) and one for working the
+ * queue of old dirty buffers (bp_dirty). The syncer applies them to
+ * each partition in turn, holding only that partition's lock.
  *
  * We balance work between them as follows:
- *    - Under normal circumstances, we work attached_buffers first and
- *      then dirty_buffers.
+ *    - Under normal circumstances, we work bp_dirtyq first and
+ *      then bp_dirty.
  *    - Each of the work functions has a goal after which it stops;
  *      but it limits itself to some fixed maximum number of buffers
  *      before returning, in order to bound the amount of time before
  *      the outer loop reconsiders the situation.
- *    - Under write load, we switch to working dirty_buffers first, in
+ *    - Under write load, we switch to working bp_dirty first, in
  *      order to attempt to bound data loss in a crash. Because client
  *      threads will fall back to synchronous evictions from the LRU
- *      list, under these conditions the syncer should concentrate on
- *      old buffers.
+ *      queues, under these conditions the syncer should concentrate
+ *      on old buffers.
  *    - Under heavy write load, we set a flag to make client threads
  *      write out old buffers.
  *    - "Write load" and "heavy write load" are defined by whether the
  *      syncer is managing to keep up with the dirty buffer load; or
- *      more precisely, by how far behind it is on dirty_buffers
+ *      more precisely, by how far behind it is on bp_dirty
  *      relative to where it wants to be.
+ *
+ * On top of the age-based schedule, the syncer watches how much of
+ * the cache is dirty:
+ *    - Once more than SYNCER_DIRTY of the buffer space is dirty, it
+ *      also writes out the oldest dirty buffers regardless of age,
+ *      at least as fast as buffers are being dirtied (the measured
+ *      inflow per round), and keeps going without sleeping until it
+ *      gets back under the threshold.
+ *    - Once more than THROTTLE_DIRTY is dirty, the syncer is evidently
+ *      not keeping up, and buffer_get makes each writer write out a
+ *      buffer itself before proceeding. This bounds the number of
+ *      dirty buffers, and therefore how often buffer_evict has to
+ *      wait for a write.
  */
 
 /*
- * Sync buffers from the LRU list (attached_buffers)
+ * Sync buffers from the cold end of a partition's LRU order.
  *
  * When activated, we write out:
  *    - any of the N least recently used buffers that are dirty;
  *    - any of the N+K least recently used buffers that are dirty and
  *      are older than one second.
  *
- * Any buffers that can still be allocated (max_total_buffers -
- * num_total_buffers) are counted as very old clean buffers, so at
+ * N and K are scaled down to the partition's share of the cache. We
+ * only need to look at bp_dirtyq, since that has all the dirty
+ * buffers in LRU order; buffer_lrudepth tells us roughly where each
+ * one falls among all the buffers, clean ones included.
+ *
+ * Any buffer space that can still be allocated (max_total_units -
+ * num_total_units) is counted as very old clean buffers, so at
  * first we don't sync anything at all until one of the time limits
- * kicks in.
+ * kicks in. (We read num_total_units without buffer_pool_lock;
+ * it's only a heuristic. Also, N and K are in units rather than
+ * buffers, which is only exact when all buffers are the minimum
+ * size; that's close enough for this.)
  *
  * Note that "age" (via b_timestamp) is the time since the buffer
- * means was first marked dirty, which may differ substantially
- * from how recently it has been used.
+ * was first marked dirty, which may differ substantially from how
+ * recently it has been used.
  */
 static
 bool
-sync_lru_buffers(void)
+sync_lru_buffers(struct bufpart *p)
 {
 	struct timespec started, now, age;
 	unsigned sync_always; /* N */
 	unsigned sync_ifold; /* N + K */
-	unsigned seenbuffers;
-	unsigned my_generation;
-	unsigned loops;
-	unsigned i;
+	unsigned unallocated;
+	unsigned depth;
+	struct bufnode marker, *bn;
 	struct buf *b;
 	bool finished;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
-	KASSERT(dirty_buffers_count > 0);
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	bufcheck(p);
+	KASSERT(p->bp_dirty.bl_count > 0);
 
 	gettime(&started);
 	finished = false;
+	bufnode_init(&marker, NULL);
 
-	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS);
-	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD);
-	seenbuffers = 0;
+	sync_always = SCALE(max_total_units, SYNCER_ALWAYS)
+		/ BUFFER_PARTITIONS;
+	sync_ifold = SCALE(max_total_units, SYNCER_IFOLD)
+		/ BUFFER_PARTITIONS;
 
 	/*
 	 * Buffers not allocated yet are buffers we have effectively
 	 * already processed.
 	 */
-	seenbuffers += max_total_buffers - num_total_buffers;
-
-	my_generation = attached_buffers_generation;
-	loops = 0;
-	i = 0;
-	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&attached_buffers)) {
-			/* no more buffers to look at */
-			finished = true;
-			break;
-		}
-		if (seenbuffers >= sync_ifold) {
-			/* checked enough */
-			finished = true;
-			break;
-		}
+	unallocated = num_total_units < max_total_units ?
+		(max_total_units - num_total_units) / BUFFER_PARTITIONS : 0;
 
-		b = bufarray_get(&attached_buffers, i);
-		i++;
+	for (bn = p->bp_dirtyq.bl_head.bn_next;
+	     bn != &p->bp_dirtyq.bl_tail;
+	     bn = bn->bn_next) {
+		b = bn->bn_buf;
 		if (b == NULL) {
 			continue;
 		}
-		seenbuffers++;
-		if (!b->b_dirty) {
-			continue;
+
+		depth = unallocated + buffer_lrudepth(b);
+		if (depth >= sync_ifold) {
+			/* checked enough; the rest are more recent */
+			finished = true;
+			break;
 		}
 
 		gettime(&now);
@@ -1860,7 +3857,7 @@ sync_lru_buffers(void)
 			break;
 		}
 
-		if (seenbuffers >= sync_always) {
+		if (depth >= sync_always) {
 			timespec_sub(&now, &b->b_timestamp, &age);
 			if (age.tv_sec < 1) {
 				/* buffer is less than a second old */
@@ -1869,7 +3866,9 @@ sync_lru_buffers(void)
 		}
 
 		/* This can sleep */
-		result = buffer_sync(b);
+		buflist_placemarker(&marker, bn);
+		result = buffer_sync_cluster(p, b);
+		bn = buflist_takemarker(&marker);
 		if (result == EDEADBUF) {
 			/*
 			 * The buffer was invalidated/evicted while we
@@ -1886,20 +3885,10 @@ sync_lru_buffers(void)
 				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
 				strerror(result));
 		}
-
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			loops++;
-			if (loops > 15) {
-				/* limit 15 tries, then go on */
-				break;
-			}
-			i = 0;
-			seenbuffers = 0;
-			seenbuffers += max_total_buffers - num_total_buffers;
-			my_generation = attached_buffers_generation;
-			continue;
-		}
+	}
+	if (bn == &p->bp_dirtyq.bl_tail) {
+		/* no more buffers to look at */
+		finished = true;
 	}
 	return finished;
 }
@@ -1960,38 +3949,32 @@ syncer_adjust_state(unsigned age)
 }
 
 /*
- * Sync buffers from the age-sorted list of dirty buffers.
+ * Sync buffers from a partition's age-sorted list of dirty buffers.
  *
  * We write out any dirty buffers that are older than two seconds.
  */
 static
 bool
-sync_old_buffers(void)
+sync_old_buffers(struct bufpart *p)
 {
 	struct timespec started, now, age;
-	unsigned my_generation;
-	unsigned i;
+	struct bufnode marker, *bn;
 	struct buf *b;
 	bool finished;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
-	KASSERT(dirty_buffers_count > 0);
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	bufcheck(p);
+	KASSERT(p->bp_dirty.bl_count > 0);
 
 	gettime(&started);
 	finished = false;
+	bufnode_init(&marker, NULL);
 
-	my_generation = dirty_buffers_generation;
-	i = 0;
-	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&dirty_buffers)) {
-			finished = true;
-			break;
-		}
-		b = bufarray_get(&dirty_buffers, i);
-		i++;
+	for (bn = p->bp_dirty.bl_head.bn_next;
+	     bn != &p->bp_dirty.bl_tail;
+	     bn = bn->bn_next) {
+		b = bn->bn_buf;
 		if (b == NULL) {
 			continue;
 		}
@@ -2008,7 +3991,7 @@ sync_old_buffers(void)
 		timespec_sub(&now, &b->b_timestamp, &age);
 		if (age.tv_sec < SYNCER_TARGET_AGE) {
 			/*
-			 * Because buffers are added to dirty[] in
+			 * Because buffers are added to bp_dirty in
 			 * order and it's never reshuffled, once we
 			 * see one buffer newer than we need to force
 			 * out, all the rest will be newer too. So we
@@ -2021,7 +4004,9 @@ sync_old_buffers(void)
 		/* If we're seeing sufficiently old buffers, take steps */
 		syncer_adjust_state(age.tv_sec);
 
-		result = buffer_sync(b);
+		buflist_placemarker(&marker, bn);
+		result = buffer_sync_cluster(p, b);
+		bn = buflist_takemarker(&marker);
 		if (result == EDEADBUF) {
 			/* as above */
 		}
@@ -2034,67 +4019,319 @@ sync_old_buffers(void)
 				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
 				strerror(result));
 		}
+	}
+	if (bn == &p->bp_dirty.bl_tail) {
+		finished = true;
+	}
+	return finished;
+}
 
-		if (my_generation != dirty_buffers_generation) {
-			/* compact_dirty_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
+/*
+ * Sync buffers from a partition's age-sorted list of dirty buffers
+ * regardless of their age, until QUOTA units have been written.
+ * This is for when too much of the cache is dirty. Adds the number
+ * of units written to *FLUSHED.
+ *
+ * Only the buffers we pick are counted; anything buffer_sync_cluster
+ * sweeps up along with them is a bonus.
+ */
+static
+void
+sync_excess_buffers(struct bufpart *p, unsigned quota, unsigned *flushed)
+{
+	struct bufnode marker, *bn;
+	struct buf *b;
+	unsigned done;
+	size_t size;
+	int result;
+
+	KASSERT(lock_do_i_hold(p->bp_lock));
+	bufcheck(p);
+
+	done = 0;
+	bufnode_init(&marker, NULL);
+
+	for (bn = p->bp_dirty.bl_head.bn_next;
+	     bn != &p->bp_dirty.bl_tail && done < quota;
+	     bn = bn->bn_next) {
+		b = bn->bn_buf;
+		if (b == NULL || b->b_fsmanaged) {
 			continue;
 		}
+		KASSERT(b->b_dirty);
+		size = b->b_size;
+
+		buflist_placemarker(&marker, bn);
+		result = buffer_sync_cluster(p, b);
+		bn = buflist_takemarker(&marker);
+		if (result == EDEADBUF) {
+			/* as above */
+		}
+		else if (result) {
+			kprintf("syncer: %s: block %u: Warning: %s\n",
+				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
+				strerror(result));
+		}
+		else {
+			done += BUFFER_UNITS(size);
+		}
 	}
-	if (finished && syncer_under_load) {
-		/* If we finished, the age of the "next" buffer is 0. */
-		syncer_adjust_state(0);
+	*flushed += done;
+}
+
+/*
+ * Update the dirty inflow estimate. This reads the partitions'
+ * counters without their locks; it's only an estimate.
+ */
+static
+void
+syncer_measure_inflow(void)
+{
+	unsigned dirtied, i;
+
+	dirtied = 0;
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		dirtied += buffer_parts[i].bp_dirtied_units;
 	}
-	return finished;
+
+	/* voodoo: weight the latest round and the history equally */
+	syncer_inflow = (syncer_inflow + (dirtied - syncer_lastdirtied)) / 2;
+	syncer_lastdirtied = dirtied;
+}
+
+/*
+ * If more than SYNCER_DIRTY of the buffer space is dirty, write out
+ * the excess, or the current inflow if that's larger, spread across
+ * the partitions. Returns true if there's nothing more to do for now:
+ * either we're under the threshold or we couldn't make any progress.
+ */
+static
+bool
+syncer_flush_excess(void)
+{
+	unsigned dirty, background, quota, flushed;
+	unsigned i;
+
+	dirty = buffer_dirty_units();
+	background = SCALE(max_total_units, SYNCER_DIRTY);
+	if (dirty <= background) {
+		return true;
+	}
+
+	quota = dirty - background;
+	if (quota < syncer_inflow) {
+		quota = syncer_inflow;
+	}
+	quota = quota / BUFFER_PARTITIONS + 1;
+
+	flushed = 0;
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		lock_acquire(buffer_parts[i].bp_lock);
+		sync_excess_buffers(&buffer_parts[i], quota, &flushed);
+		lock_release(buffer_parts[i].bp_lock);
+	}
+
+#ifdef SYNCER_VERBOSE
+	kprintf("syncer: %uk dirty, inflow %uk, flushed %uk\n",
+		dirty * BUFFER_MINSIZE / 1024,
+		syncer_inflow * BUFFER_MINSIZE / 1024,
+		flushed * BUFFER_MINSIZE / 1024);
+#endif
+
+	return flushed == 0 || buffer_dirty_units() <= background;
+}
+
+/*
+ * Do one round of syncer work on one partition. Sets *LRU_FINISHED
+ * and *OLD_FINISHED false if the respective work function didn't
+ * finish.
+ */
+static
+void
+syncer_work_partition(struct bufpart *p, bool *lru_finished,
+		      bool *old_finished)
+{
+	lock_acquire(p->bp_lock);
+	if (p->bp_dirty.bl_count == 0) {
+		/* nothing to do */
+	}
+	else if (syncer_needs_help) {
+		if (!sync_old_buffers(p)) {
+			*old_finished = false;
+		}
+		*lru_finished = false;
+	}
+	else if (syncer_under_load) {
+		if (!sync_old_buffers(p)) {
+			*old_finished = false;
+		}
+		if (p->bp_dirty.bl_count > 0 && !sync_lru_buffers(p)) {
+			*lru_finished = false;
+		}
+	}
+	else {
+		if (!sync_lru_buffers(p)) {
+			*lru_finished = false;
+		}
+		if (p->bp_dirty.bl_count > 0 && !sync_old_buffers(p)) {
+			*old_finished = false;
+		}
+	}
+	lock_release(p->bp_lock);
 }
 
 /*
  * If OS/161 had a more powerful clock system, we might arrange to run
  * the syncer either when enough buffers become dirty or every second
  * or two when dirty buffers exist. But we don't really have the
- * facilities for that, so instead we'll just run once a second.
+ * facilities for that, so instead we'll just run once a second, and
+ * not sleep at all while too much of the cache is dirty.
  */
 static
 void
 syncer(void *x1, unsigned long x2)
 {
-	bool lru_finished, old_finished;
+	bool lru_finished, old_finished, excess_finished;
+	unsigned i;
 
 	(void)x1;
 	(void)x2;
 
-	lock_acquire(buffer_lock);
 	syncer_thread = curthread;
+	/* Keep up with the writers however busy the cpus are. */
+	thread_setclass(SCHED_HIGH);
 
 	lru_finished = true;
 	old_finished = true;
+	excess_finished = true;
 	while (1) {
-		if (lru_finished && old_finished) {
-			lock_release(buffer_lock);
+		if (lru_finished && old_finished && excess_finished) {
 			clocksleep(1);
-			lock_acquire(buffer_lock);
 		}
+		syncer_measure_inflow();
 
-		if (syncer_needs_help) {
-			old_finished = sync_old_buffers();
-			lru_finished = false;
+		lru_finished = true;
+		old_finished = true;
+		for (i=0; i<BUFFER_PARTITIONS; i++) {
+			syncer_work_partition(&buffer_parts[i],
+					      &lru_finished, &old_finished);
 		}
-		else if (syncer_under_load) {
-			old_finished = sync_old_buffers();
-			lru_finished = sync_lru_buffers();
+		excess_finished = syncer_flush_excess();
+
+		if (old_finished && syncer_under_load) {
+			/*
+			 * If we finished everywhere, the age of the
+			 * "next" buffer is 0.
+			 */
+			syncer_adjust_state(0);
 		}
-		else if (dirty_buffers_count > 0) {
-			lru_finished = sync_lru_buffers();
-			old_finished = sync_old_buffers();
+	}
+	syncer_thread = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// memory pressure
+
+/*
+ * Give memory back to the VM system: lower the cache size limit by
+ * up to NPAGES pages, and get rid of buffers until we're under it.
+ * Detached buffers go first, then the coldest clean attached buffers.
+ * Dirty buffers aren't touched here; the syncer will clean them and
+ * buffer_get will then destroy rather than reuse them until the
+ * cache size is back under the limit. Returns the number of pages'
+ * worth of buffers freed.
+ *
+ * This is meant to be called by the VM system when it runs short of
+ * pages. It can't do anything if called from inside the buffer cache
+ * (e.g. because allocating a new buffer ran out of memory), so it
+ * checks for that and just returns 0.
+ */
+unsigned
+buffer_shrink(unsigned npages)
+{
+	struct bufpart *p;
+	struct buf *b;
+	unsigned want, floor, startunits, freed;
+	unsigned i, idle;
+
+	if (buffer_pool_lock == NULL) {
+		/* not bootstrapped yet */
+		return 0;
+	}
+	if (lock_do_i_hold(buffer_pool_lock)) {
+		return 0;
+	}
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		if (lock_do_i_hold(buffer_parts[i].bp_lock)) {
+			return 0;
 		}
-		else {
-			lru_finished = true;
-			old_finished = true;
+	}
+
+	want = npages * (PAGE_SIZE / BUFFER_MINSIZE);
+
+	lock_acquire(buffer_pool_lock);
+	poolcheck();
+	startunits = num_total_units;
+
+	/* Never go below the minimum, or what's already reserved. */
+	floor = min_total_units;
+	if (floor < num_reserved_units) {
+		floor = num_reserved_units;
+	}
+	if (max_total_units > floor) {
+		if (want > max_total_units - floor) {
+			want = max_total_units - floor;
 		}
+		max_total_units -= want;
 	}
-	syncer_thread = NULL;
-	lock_release(buffer_lock);
+
+	while (num_total_units > max_total_units) {
+		b = buffer_remove_any_detached();
+		if (b == NULL) {
+			break;
+		}
+		buffer_destroy(b);
+	}
+	lock_release(buffer_pool_lock);
+
+	/*
+	 * Now evict clean buffers a partition at a time until we're
+	 * under the limit or no partition has anything to give up.
+	 * (We peek at the totals without the pool lock; it doesn't
+	 * matter if we do one too many or too few.)
+	 */
+	i = 0;
+	idle = 0;
+	while (num_total_units > max_total_units && idle < BUFFER_PARTITIONS) {
+		p = &buffer_parts[i];
+		i = (i + 1) % BUFFER_PARTITIONS;
+
+		lock_acquire(p->bp_lock);
+		b = buffer_coldest_clean(p);
+		if (b == NULL) {
+			lock_release(p->bp_lock);
+			idle++;
+			continue;
+		}
+		idle = 0;
+		bufcount(BC_TOTAL_EVICTIONS, 1);
+		bufstats_chargeevict(b);
+		/* lock is released and reacquired here */
+		buffer_clean(p, b);
+		lock_release(p->bp_lock);
+
+		lock_acquire(buffer_pool_lock);
+		buffer_destroy(b);
+		lock_release(buffer_pool_lock);
+	}
+
+	lock_acquire(buffer_pool_lock);
+	freed = startunits > num_total_units ?
+		startunits - num_total_units : 0;
+	num_shrunk_units += freed;
+	lock_release(buffer_pool_lock);
+
+	return freed / (PAGE_SIZE / BUFFER_MINSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -2116,27 +4353,31 @@ syncer(void *x1, unsigned long x2)
  *
  * The number of buffers to reserve is fixed; we could pass in the
  * number (and in fact used to) but counting the exact numbers of
- * buffers required is not worthwhile.
+ * buffers required is not worthwhile. What gets reserved is the
+ * space for that many buffers of size SIZE, so unreserve_buffers
+ * must be passed the same size.
  */
 void
 reserve_buffers(size_t size)
 {
-	unsigned count = RESERVE_BUFFERS;
+	unsigned count;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(buffer_size_ok(size));
+	count = RESERVE_BUFFERS * BUFFER_UNITS(size);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	lock_acquire(buffer_pool_lock);
+	poolcheck();
 
 	/* All buffer reservations must be done up front, all at once. */
 	KASSERT(curthread->t_did_reserve_buffers == false);
 
-	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+	while (num_reserved_units + count > max_total_units &&
+	       !buffer_grow(num_reserved_units + count)) {
+		cv_wait(buffer_reserve_cv, buffer_pool_lock);
 	}
-	num_reserved_buffers += count;
+	num_reserved_units += count;
 	curthread->t_did_reserve_buffers = true;
-	lock_release(buffer_lock);
+	lock_release(buffer_pool_lock);
 }
 
 /*
@@ -2145,78 +4386,368 @@ reserve_buffers(size_t size)
 void
 unreserve_buffers(size_t size)
 {
-	unsigned count = RESERVE_BUFFERS;
+	unsigned count;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(buffer_size_ok(size));
+	count = RESERVE_BUFFERS * BUFFER_UNITS(size);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	lock_acquire(buffer_pool_lock);
+	poolcheck();
 
 	KASSERT(curthread->t_did_reserve_buffers == true);
-	KASSERT(count <= num_reserved_buffers);
+	KASSERT(count <= num_reserved_units);
 
 	curthread->t_did_reserve_buffers = false;
-	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	num_reserved_units -= count;
+	cv_broadcast(buffer_reserve_cv, buffer_pool_lock);
 
-	lock_release(buffer_lock);
+	lock_release(buffer_pool_lock);
 }
 
 void
 reserve_fsmanaged_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(buffer_size_ok(size));
+	count *= BUFFER_UNITS(size);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	lock_acquire(buffer_pool_lock);
+	poolcheck();
 
-	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+	while (num_reserved_units + count > max_total_units &&
+	       !buffer_grow(num_reserved_units + count)) {
+		cv_wait(buffer_reserve_cv, buffer_pool_lock);
 	}
-	num_reserved_buffers += count;
-	lock_release(buffer_lock);
+	num_reserved_units += count;
+	lock_release(buffer_pool_lock);
 }
 
 void
 unreserve_fsmanaged_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(buffer_size_ok(size));
+	count *= BUFFER_UNITS(size);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
-	KASSERT(count <= num_reserved_buffers);
+	lock_acquire(buffer_pool_lock);
+	poolcheck();
 
-	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	KASSERT(count <= num_reserved_units);
 
-	lock_release(buffer_lock);
+	num_reserved_units -= count;
+	cv_broadcast(buffer_reserve_cv, buffer_pool_lock);
+
+	lock_release(buffer_pool_lock);
 }
 
 ////////////////////////////////////////////////////////////
 // print stats
 
+/*
+ * Where a stats report goes: the console if BR_BUF is NULL, otherwise
+ * the buffer BR_BUF of size BR_LEN, truncating if necessary. BR_POS
+ * counts the length of the whole report either way.
+ */
+struct bufreport {
+	char *br_buf;
+	size_t br_len;
+	size_t br_pos;
+};
+
+static
+void
+bufreport(struct bufreport *br, const char *fmt, ...)
+{
+	char line[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	if (br->br_buf == NULL) {
+		/* report lines are short; truncate anything silly */
+		len = vsnprintf(line, sizeof(line), fmt, ap);
+		kprintf("%s", line);
+	}
+	else if (br->br_pos < br->br_len) {
+		len = vsnprintf(br->br_buf + br->br_pos,
+				br->br_len - br->br_pos, fmt, ap);
+	}
+	else {
+		/* out of space; just measure it */
+		len = vsnprintf(NULL, 0, fmt, ap);
+	}
+	va_end(ap);
+
+	br->br_pos += len;
+}
+
+/*
+ * Percentage, avoiding division by zero.
+ */
+static
+unsigned
+bufreport_pct(unsigned num, unsigned denom)
+{
+	return denom == 0 ? 0 : num * 100 / denom;
+}
+
+/*
+ * Print an eviction latency histogram, skipping empty buckets.
+ */
+static
+void
+bufreport_latency(struct bufreport *br, const unsigned *hist)
+{
+	unsigned i, total;
+
+	total = 0;
+	for (i=0; i<BUFSTATS_LATBUCKETS; i++) {
+		total += hist[i];
+	}
+	if (total == 0) {
+		bufreport(br, "      no evictions\n");
+		return;
+	}
+	for (i=0; i<BUFSTATS_LATBUCKETS; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			bufreport(br, "      %7s  <2 usec:", "");
+		}
+		else if (i == BUFSTATS_LATBUCKETS - 1) {
+			bufreport(br, "      %7u+    usec:", 1U << i);
+		}
+		else {
+			bufreport(br, "      %7u-%-6u usec:",
+				  1U << i, (1U << (i+1)) - 1);
+		}
+		bufreport(br, " %u (%u%%)\n", hist[i],
+			  bufreport_pct(hist[i], total));
+	}
+}
+
+/*
+ * Read an array of NUM per-cpu counters into VALS.
+ */
+static
+void
+bufreport_read(struct percpu_counter *pcs, unsigned *vals, unsigned num)
+{
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		vals[i] = percpu_counter_read(&pcs[i]);
+	}
+}
+
+/*
+ * Report the per-filesystem stats.
+ */
+static
+void
+bufreport_fsstats(struct bufreport *br)
+{
+	struct bufstats *bs;
+	struct fs *fs;
+	const char *name;
+	unsigned gets[BUFKIND_NUM], hits[BUFKIND_NUM];
+	unsigned evictions[BUFKIND_NUM], dirtyevictions[BUFKIND_NUM];
+	unsigned latency[BUFSTATS_LATBUCKETS];
+	unsigned i, k;
+	bool inuse;
+
+	bufreport(br, "Per filesystem:\n");
+	for (i=0; i<=BUFSTATS_MAXFS; i++) {
+		bs = &buffer_fsstats[i];
+
+		/* Don't hold the lock while looking up the name. */
+		lock_acquire(buffer_stats_lock);
+		inuse = bs->bs_inuse;
+		fs = bs->bs_fs;
+		bufreport_read(bs->bs_gets, gets, BUFKIND_NUM);
+		bufreport_read(bs->bs_hits, hits, BUFKIND_NUM);
+		bufreport_read(bs->bs_evictions, evictions, BUFKIND_NUM);
+		bufreport_read(bs->bs_dirty_evictions, dirtyevictions,
+			       BUFKIND_NUM);
+		bufreport_read(bs->bs_evict_latency, latency,
+			       BUFSTATS_LATBUCKETS);
+		lock_release(buffer_stats_lock);
+
+		if (i < BUFSTATS_MAXFS && !inuse) {
+			continue;
+		}
+		if (i == BUFSTATS_MAXFS) {
+			if (gets[BUFKIND_META] == 0 &&
+			    gets[BUFKIND_DATA] == 0 &&
+			    evictions[BUFKIND_META] == 0 &&
+			    evictions[BUFKIND_DATA] == 0) {
+				continue;
+			}
+			name = "(others)";
+		}
+		else {
+			name = vfs_getdevname(fs);
+			if (name == NULL) {
+				name = "(unmounted)";
+			}
+		}
+		bufreport(br, "   %s:\n", name);
+		for (k=0; k<BUFKIND_NUM; k++) {
+			bufreport(br, "      %-8s %u gets, %u hits "
+				  "(%u%% hit rate), %u evictions "
+				  "(%u when dirty)\n",
+				  k == BUFKIND_META ? "metadata" : "data",
+				  gets[k], hits[k],
+				  bufreport_pct(hits[k], gets[k]),
+				  evictions[k], dirtyevictions[k]);
+		}
+		bufreport(br, "      eviction latency:\n");
+		bufreport_latency(br, latency);
+	}
+}
+
+/*
+ * Produce the whole stats report.
+ */
+static
+void
+bufreport_all(struct bufreport *br)
+{
+	struct bufpart *p;
+	unsigned attached, busy, dirty;
+	unsigned gets, hits, reads, writeouts, evictions, dirtyevictions;
+	unsigned clusters, clusterblocks;
+	unsigned rahits, rawasted, raqueued, radropped, raprefetched;
+	unsigned dirtyunits, throttled, fastgets;
+	unsigned batchreads, batchblocks;
+	unsigned probation, admits, promotions, probevictions;
+	unsigned counts[BC_NUM];
+	unsigned latency[BUFSTATS_LATBUCKETS];
+	unsigned i;
+
+	attached = busy = dirty = 0;
+	dirtyunits = 0;
+	probation = 0;
+
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		p = &buffer_parts[i];
+		lock_acquire(p->bp_lock);
+		attached += bufpart_attached(p);
+		busy += p->bp_busy_count;
+		dirty += p->bp_dirty.bl_count;
+		dirtyunits += p->bp_dirty_units;
+		probation += p->bp_probq.bl_count;
+		lock_release(p->bp_lock);
+	}
+
+	bufreport_read(buffer_counters, counts, BC_NUM);
+	throttled = counts[BC_THROTTLED_GETS];
+	gets = counts[BC_TOTAL_GETS];
+	hits = counts[BC_VALID_GETS];
+	fastgets = counts[BC_FAST_GETS];
+	batchreads = counts[BC_BATCH_READS];
+	batchblocks = counts[BC_BATCH_BLOCKS];
+	reads = counts[BC_READ_GETS];
+	writeouts = counts[BC_TOTAL_WRITEOUTS];
+	clusters = counts[BC_CLUSTER_WRITES];
+	clusterblocks = counts[BC_CLUSTER_BLOCKS];
+	evictions = counts[BC_TOTAL_EVICTIONS];
+	dirtyevictions = counts[BC_DIRTY_EVICTIONS];
+	rahits = counts[BC_READAHEAD_HITS];
+	rawasted = counts[BC_READAHEAD_WASTED];
+	admits = counts[BC_PROBATION_ADMITS];
+	promotions = counts[BC_PROBATION_PROMOTIONS];
+	probevictions = counts[BC_PROBATION_EVICTIONS];
+
+	lock_acquire(readahead_lock);
+	raqueued = readahead_queued;
+	radropped = readahead_dropped;
+	raprefetched = readahead_prefetched;
+	lock_release(readahead_lock);
+
+	bufreport_read(buffer_evict_latency, latency, BUFSTATS_LATBUCKETS);
+
+	lock_acquire(buffer_pool_lock);
+
+	bufreport(br, "Buffers: %u allocated, %uk of %uk\n", num_total_buffers,
+		  num_total_units * BUFFER_MINSIZE / 1024,
+		  max_total_units * BUFFER_MINSIZE / 1024);
+	bufreport(br, "   limit %uk-%uk; grown %uk, shrunk %uk\n",
+		  min_total_units * BUFFER_MINSIZE / 1024,
+		  cap_total_units * BUFFER_MINSIZE / 1024,
+		  num_grown_units * BUFFER_MINSIZE / 1024,
+		  num_shrunk_units * BUFFER_MINSIZE / 1024);
+	bufreport(br, "   %u detached, %u attached\n",
+		  num_detached_buffers, attached);
+	bufreport(br, "   %uk reserved\n",
+		  num_reserved_units * BUFFER_MINSIZE / 1024);
+	bufreport(br, "   %u busy\n", busy);
+	bufreport(br, "   %u dirty (%uk; syncer flushes above %uk, "
+		  "throttles above %uk)\n", dirty,
+		  dirtyunits * BUFFER_MINSIZE / 1024,
+		  SCALE(max_total_units, SYNCER_DIRTY) * BUFFER_MINSIZE / 1024,
+		  SCALE(max_total_units, THROTTLE_DIRTY) * BUFFER_MINSIZE
+		  / 1024);
+
+	lock_release(buffer_pool_lock);
+
+	bufreport(br, "Buffer operations:\n");
+	bufreport(br, "   %u gets (%u hits, %u%% hit rate; %u reads)\n",
+		  gets, hits, bufreport_pct(hits, gets), reads);
+	bufreport(br, "   %u hits on the fast path\n", fastgets);
+	bufreport(br, "   %u batched reads (%u blocks)\n",
+		  batchreads, batchblocks);
+	bufreport(br, "   %u writeouts (%u buffers clustered into %u writes)\n",
+		  writeouts, clusterblocks, clusters);
+	bufreport(br, "   %u evictions (%u when dirty)\n",
+		  evictions, dirtyevictions);
+	bufreport(br, "   %u throttled gets; syncer inflow %uk per round\n",
+		  throttled, syncer_inflow * BUFFER_MINSIZE / 1024);
+	bufreport(br, "   eviction latency:\n");
+	bufreport_latency(br, latency);
+	bufreport(br, "Read-ahead (window %u-%u blocks):\n",
+		  READAHEAD_MIN, READAHEAD_MAX);
+	bufreport(br, "   %u queued (%u prefetches; %u dropped)\n",
+		  raqueued, raprefetched, radropped);
+	bufreport(br, "   %u hits, %u wasted (%u%% hit rate)\n",
+		  rahits, rawasted, bufreport_pct(rahits, raqueued));
+	bufreport(br, "Probation (up to %u%% of each partition):\n",
+		  bufreport_pct(PROBATION_NUM, PROBATION_DENOM));
+	bufreport(br, "   %u buffers now, %u admitted, %u promoted, "
+		  "%u evicted\n", probation, admits, promotions,
+		  probevictions);
+
+	bufreport_fsstats(br);
+}
+
 void
 buffer_printstats(void)
 {
-	lock_acquire(buffer_lock);
+	struct bufreport br;
+
+	br.br_buf = NULL;
+	br.br_len = 0;
+	br.br_pos = 0;
+	bufreport_all(&br);
+}
 
-	kprintf("Buffers: %u of %u allocated\n",
-		num_total_buffers, max_total_buffers);
-	kprintf("   %u detached, %u attached\n",
-		bufarray_num(&detached_buffers), attached_buffers_count);
-	kprintf("   %u reserved\n", num_reserved_buffers);
-	kprintf("   %u busy\n", busy_buffers_count);
-	kprintf("   %u dirty\n", dirty_buffers_count);
+/*
+ * Write the stats report into BUF, which is LEN bytes long. Returns
+ * the length of the whole report; if that's LEN or more, the report
+ * was truncated. (For bufstat:)
+ */
+size_t
+buffer_formatstats(char *buf, size_t len)
+{
+	struct bufreport br;
 
-	kprintf("Buffer operations:\n");
-	kprintf("   %u gets (%u hits, %u reads)\n",
-		num_total_gets, num_valid_gets, num_read_gets);
-	kprintf("   %u writeouts\n",
-		num_total_writeouts);
-	kprintf("   %u evictions (%u when dirty)\n",
-		num_total_evictions, num_dirty_evictions);
+	KASSERT(len > 0);
 
-	lock_release(buffer_lock);
+	br.br_buf = buf;
+	br.br_len = len;
+	br.br_pos = 0;
+	buf[0] = 0;
+	bufreport_all(&br);
+	return br.br_pos;
 }
 
 ////////////////////////////////////////////////////////////
@@ -2225,52 +4756,68 @@ buffer_printstats(void)
 void
 buffer_bootstrap(void)
 {
+	struct bufstats *bs;
 	size_t max_buffer_mem;
+	unsigned floor, numbuckets;
+	unsigned i;
 	int result;
 
-	attached_buffers_count = 0;
-	dirty_buffers_count = 0;
+	COMPILE_ASSERT(BUFFER_MAXSIZE ==
+		       BUFFER_MINSIZE << (BUFFER_SIZECLASSES - 1));
 
-	num_reserved_buffers = 0;
+	num_detached_buffers = 0;
 	num_total_buffers = 0;
+	num_reserved_units = 0;
+	num_total_units = 0;
+
+	kheap_tag_init(&buffer_heaptag, "buf");
+	kheap_tag_init(&bufdata_heaptag, "buffer data");
 
 	/* Limit total memory usage for buffers */
 	max_buffer_mem =
 		(mainbus_ramsize() * BUFFER_MAXMEM_NUM) / BUFFER_MAXMEM_DENOM;
-	max_total_buffers = max_buffer_mem / ONE_TRUE_BUFFER_SIZE;
-
-	kprintf("buffers: max count %lu; max size %luk\n",
-		(unsigned long) max_total_buffers,
-		(unsigned long) max_buffer_mem/1024);
-
-	num_total_gets = 0;
-	num_valid_gets = 0;
-	num_read_gets = 0;
-	num_total_writeouts = 0;
-	num_total_evictions = 0;
-	num_dirty_evictions = 0;
-
-	bufarray_init(&detached_buffers);
-	bufarray_init(&attached_buffers);
-	bufarray_init(&dirty_buffers);
-	attached_buffers_first = 0;
-	attached_buffers_thresh = 0;
-	dirty_buffers_first = 0;
-	dirty_buffers_thresh = 0;
-
-	result = bufhash_init(&buffer_hash, max_total_buffers/16);
-	if (result) {
-		panic("Creating buffer_hash failed\n");
+	cap_total_units = max_buffer_mem / BUFFER_MINSIZE;
+
+	/*
+	 * Start small and grow on demand. Even the minimum must have
+	 * room for a couple of reservations of the biggest buffers.
+	 */
+	min_total_units = SCALE(mainbus_ramsize(), BUFFER_MINMEM)
+		/ BUFFER_MINSIZE;
+	floor = 2 * RESERVE_BUFFERS * BUFFER_UNITS(BUFFER_MAXSIZE);
+	if (min_total_units < floor) {
+		min_total_units = floor;
+	}
+	if (min_total_units > cap_total_units) {
+		min_total_units = cap_total_units;
+	}
+	max_total_units = min_total_units;
+	num_grown_units = 0;
+	num_shrunk_units = 0;
+
+	kprintf("buffers: size %luk to %luk; %u partitions\n",
+		(unsigned long) min_total_units * BUFFER_MINSIZE / 1024,
+		(unsigned long) max_buffer_mem/1024,
+		BUFFER_PARTITIONS);
+
+	for (i=0; i<BUFFER_SIZECLASSES; i++) {
+		buflist_init(&detached_buffers[i]);
 	}
 
-	buffer_lock = lock_create("buffer cache lock");
-	if (buffer_lock == NULL) {
-		panic("Creating buffer cache lock failed\n");
+	numbuckets = cap_total_units / 16 / BUFFER_PARTITIONS;
+	if (numbuckets == 0) {
+		numbuckets = 1;
+	}
+	for (i=0; i<BUFFER_PARTITIONS; i++) {
+		result = bufpart_init(&buffer_parts[i], numbuckets);
+		if (result) {
+			panic("Creating buffer cache partition failed\n");
+		}
 	}
 
-	buffer_busy_cv = cv_create("bufbusy");
-	if (buffer_busy_cv == NULL) {
-		panic("Creating buffer_busy_cv failed\n");
+	buffer_pool_lock = lock_create("buffer pool lock");
+	if (buffer_pool_lock == NULL) {
+		panic("Creating buffer pool lock failed\n");
 	}
 
 	buffer_reserve_cv = cv_create("bufreserve");
@@ -2278,8 +4825,44 @@ buffer_bootstrap(void)
 		panic("Creating buffer_reserve_cv failed\n");
 	}
 
+	buffer_stats_lock = lock_create("buffer stats lock");
+	if (buffer_stats_lock == NULL) {
+		panic("Creating buffer stats lock failed\n");
+	}
+	bufstats_initcounters(buffer_counters, BC_NUM);
+	bufstats_initcounters(buffer_evict_latency, BUFSTATS_LATBUCKETS);
+	for (i=0; i<=BUFSTATS_MAXFS; i++) {
+		bs = &buffer_fsstats[i];
+		bufstats_initcounters(bs->bs_gets, BUFKIND_NUM);
+		bufstats_initcounters(bs->bs_hits, BUFKIND_NUM);
+		bufstats_initcounters(bs->bs_evictions, BUFKIND_NUM);
+		bufstats_initcounters(bs->bs_dirty_evictions, BUFKIND_NUM);
+		bufstats_initcounters(bs->bs_evict_latency,
+				      BUFSTATS_LATBUCKETS);
+	}
+
 	result = thread_fork("syncer", NULL, syncer, NULL, 0);
 	if (result) {
 		panic("Starting syncer failed\n");
 	}
+
+	readahead_lock = lock_create("readahead");
+	if (readahead_lock == NULL) {
+		panic("Creating readahead lock failed\n");
+	}
+
+	readahead_cv = cv_create("readahead");
+	if (readahead_cv == NULL) {
+		panic("Creating readahead_cv failed\n");
+	}
+
+	readahead_done_cv = cv_create("readahead_done");
+	if (readahead_done_cv == NULL) {
+		panic("Creating readahead_done_cv failed\n");
+	}
+
+	result = thread_fork("readahead", NULL, readahead_thread, NULL, 0);
+	if (result) {
+		panic("Starting read-ahead thread failed\n");
+	}
 }
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * The buffer cache statistics device, "bufstat:". Reading it yields
+ * the same report as the "buf" menu command, taken fresh on each
+ * read call; it can't be written.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <buf.h>
+#include <device.h>
+
+/* Initial size for the report; it's regrown if necessary. */
+#define BUFSTAT_INITSIZE	4096
+
+/* For open() */
+static
+int
+bufstatopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if (openflags != O_RDONLY) {
+		return EIO;
+	}
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+bufstatio(struct device *dev, struct uio *uio)
+{
+	char *report;
+	size_t size, len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EIO;
+	}
+
+	/*
+	 * Generate the report, and if it didn't fit, try again with
+	 * enough room. It might have grown in between; if so, what
+	 * we have the second time is good enough.
+	 */
+	size = BUFSTAT_INITSIZE;
+	report = kmalloc(size);
+	if (report == NULL) {
+		return ENOMEM;
+	}
+	len = buffer_formatstats(report, size);
+	if (len >= size) {
+		kfree(report);
+		size = len + 1;
+		report = kmalloc(size);
+		if (report == NULL) {
+			return ENOMEM;
+		}
+		len = buffer_formatstats(report, size);
+		if (len >= size) {
+			len = size - 1;
+		}
+	}
+
+	if (uio->uio_offset < 0) {
+		result = EINVAL;
+	}
+	else if ((size_t)uio->uio_offset >= len) {
+		/* EOF */
+		result = 0;
+	}
+	else {
+		result = uiomove(report + uio->uio_offset,
+				 len - uio->uio_offset, uio);
+	}
+
+	kfree(report);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+bufstatioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops bufstat_devops = {
+	.devop_eachopen = bufstatopen,
+	.devop_io = bufstatio,
+	.devop_ioctl = bufstatioctl,
+};
+
+/*
+ * Function to create and attach bufstat:
+ */
+void
+devbufstat_create(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev==NULL) {
+		panic("Could not add bufstat device: out of memory\n");
+	}
+
+	dev->d_ops = &bufstat_devops;
+
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = NULL;
+
+	result = vfs_adddev("bufstat", dev, 0);
+	if (result) {
+		panic("Could not add bufstat device: %s\n", strerror(result));
+	}
+}
@@ -38,6 +38,7 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <uio.h>
 #include <synch.h>
 #include <vnode.h>
@@ -237,15 +238,14 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. None of our devices make sense to map.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -267,6 +267,22 @@ dev_truncate(struct vnode *v, off_t len)
 	return EINVAL;
 }
 
+/*
+ * For poll(). Devices that can't block (disks, null) don't have a
+ * devop_poll and are always ready.
+ */
+static
+int
+dev_poll(struct vnode *v, int events, struct pollset *ps, int *revents)
+{
+	struct device *d = v->vn_data;
+
+	if (d->d_ops->devop_poll == NULL) {
+		return vnode_poll_ready(v, events, ps, revents);
+	}
+	return DEVOP_POLL(d, events, ps, revents);
+}
+
 /*
  * For namefile (which implements "pwd")
  *
@@ -330,14 +346,19 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_read = dev_read,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = dev_write,
 	.vop_ioctl = dev_ioctl,
 	.vop_stat = dev_stat,
 	.vop_gettype = dev_gettype,
 	.vop_isseekable = dev_isseekable,
 	.vop_fsync = null_fsync,
+	.vop_fdatasync = null_fsync,
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_poll = dev_poll,
 	.vop_namefile = dev_namefile,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -359,7 +380,7 @@ dev_create_vnode(struct device *dev)
 	int result;
 	struct vnode *v;
 
-	v = kmalloc(sizeof(struct vnode));
+	v = kmalloc_tagged(sizeof(struct vnode), &vnode_heaptag);
 	if (v==NULL) {
 		return NULL;
 	}
@@ -384,5 +405,35 @@ dev_uncreate_vnode(struct vnode *vn)
 {
 	KASSERT(vn->vn_ops == &dev_vnode_ops);
 	vnode_cleanup(vn);
-	kfree(vn);
+	kfree_tagged(vn, sizeof(struct vnode), &vnode_heaptag);
+}
+
+/*
+ * Start an asynchronous block transfer (see device.h). If the device
+ * can't do them, do it synchronously and call bio_done before
+ * returning.
+ */
+void
+dev_bio_submit(struct device *dev, struct dev_bio *bio)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(bio->bio_done != NULL);
+
+	if (dev->d_ops->devop_strategy != NULL) {
+		DEVOP_STRATEGY(dev, bio);
+		return;
+	}
+
+	uio_kinit(&iov, &ku, bio->bio_data,
+		  bio->bio_nblocks * dev->d_blocksize,
+		  (off_t)bio->bio_block * dev->d_blocksize,
+		  bio->bio_write ? UIO_WRITE : UIO_READ);
+	result = DEVOP_IO(dev, &ku);
+	if (result == 0 && ku.uio_resid > 0) {
+		result = EIO;
+	}
+	bio->bio_done(bio, result);
 }
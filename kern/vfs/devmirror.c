@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Mirroring (RAID-1) device, "mirrorN:", made with devmirror_create
+ * (the "mirror" menu command) out of two or more mountable devices
+ * that all hold the same data.
+ *
+ * Writes go to every member at once, and finish when they all have.
+ * Each read goes to just one member: whichever has the fewest
+ * transfers outstanding, and among those, the one whose last
+ * transfer ended nearest where this one starts. With several
+ * threads reading, the members thus work on different reads at the
+ * same time, and the one that's already in the right place takes
+ * the next read of a sequential run.
+ *
+ * If a write to a member fails, that member is dropped and the
+ * mirror carries on without it; a read that fails is tried again on
+ * another member. Only when no members are left do I/O errors show
+ * through. A dropped member stays dropped until reboot.
+ *
+ * As with stripe sets, nothing is recorded on the members: after
+ * each boot the mirror has to be made again before it's mounted,
+ * and the members have to have been copied (e.g. by making the
+ * file system on the mirror) to begin with. Once a device is part
+ * of a mirror it can't be used on its own any more (see
+ * vfs_claimdevs).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Most members in a mirror */
+#define MIRROR_MAXMEMBERS	4
+
+/* Most blocks copied through a bounce buffer at once */
+#define MIRROR_BOUNCE_BLOCKS	32
+
+struct mirror {
+	struct device md_dev;		/* what the VFS layer sees */
+	char md_name[16];		/* our name, for messages */
+	struct device *md_members[MIRROR_MAXMEMBERS];
+	unsigned md_nmembers;
+
+	/* Protected by md_lock */
+	struct spinlock md_lock;
+	struct wchan *md_wchan;		/* for waiting for transfers */
+	bool md_failed[MIRROR_MAXMEMBERS];	/* member dropped */
+	unsigned md_pending[MIRROR_MAXMEMBERS];	/* transfers on member */
+	uint32_t md_lastblock[MIRROR_MAXMEMBERS]; /* where last one ended */
+};
+
+/* One member transfer */
+struct mirror_xfer {
+	struct dev_bio mx_bio;
+	struct mirror_wait *mx_wait;
+	unsigned mx_member;
+	int mx_result;
+};
+
+/* To wait for a batch of member transfers */
+struct mirror_wait {
+	struct mirror *mw_md;
+	unsigned mw_pending;		/* transfers not yet done */
+};
+
+/* Number of mirrors made so far, for naming them */
+static unsigned mirror_count;
+
+/* For open() */
+static
+int
+mirror_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+/*
+ * Completion for one member transfer.
+ */
+static
+void
+mirror_biodone(struct dev_bio *bio, int result)
+{
+	struct mirror_xfer *mx = bio->bio_arg;
+	struct mirror_wait *mw = mx->mx_wait;
+	struct mirror *md = mw->mw_md;
+
+	spinlock_acquire(&md->md_lock);
+	mx->mx_result = result;
+	KASSERT(md->md_pending[mx->mx_member] > 0);
+	md->md_pending[mx->mx_member]--;
+	KASSERT(mw->mw_pending > 0);
+	mw->mw_pending--;
+	if (mw->mw_pending == 0) {
+		wchan_wakeall(md->md_wchan, &md->md_lock);
+	}
+	spinlock_release(&md->md_lock);
+}
+
+/*
+ * Set up MX for a transfer on member MEMBER. Call with md_lock held.
+ */
+static
+void
+mirror_setup(struct mirror *md, struct mirror_wait *mw,
+	     struct mirror_xfer *mx, unsigned member,
+	     uint32_t block, uint32_t nblocks, char *data, bool write)
+{
+	KASSERT(spinlock_do_i_hold(&md->md_lock));
+
+	mx->mx_bio.bio_block = block;
+	mx->mx_bio.bio_nblocks = nblocks;
+	mx->mx_bio.bio_data = data;
+	mx->mx_bio.bio_write = write;
+	mx->mx_bio.bio_done = mirror_biodone;
+	mx->mx_bio.bio_arg = mx;
+	mx->mx_wait = mw;
+	mx->mx_member = member;
+	mx->mx_result = 0;
+
+	md->md_pending[member]++;
+	md->md_lastblock[member] = block + nblocks;
+	mw->mw_pending++;
+}
+
+/*
+ * Wait for all of a batch of transfers. Call with md_lock held.
+ */
+static
+void
+mirror_wait(struct mirror *md, struct mirror_wait *mw)
+{
+	KASSERT(spinlock_do_i_hold(&md->md_lock));
+
+	while (mw->mw_pending > 0) {
+		wchan_sleep(md->md_wchan, &md->md_lock);
+	}
+}
+
+/*
+ * Drop member M after an error. Call with md_lock held.
+ */
+static
+void
+mirror_fail(struct mirror *md, unsigned m, int result)
+{
+	KASSERT(spinlock_do_i_hold(&md->md_lock));
+
+	if (!md->md_failed[m]) {
+		md->md_failed[m] = true;
+		kprintf("%s: member %u: %s; dropped\n", md->md_name, m,
+			strerror(result));
+	}
+}
+
+/*
+ * Choose the member to read BLOCK from: the one with the fewest
+ * transfers outstanding, and then the one nearest BLOCK; skip any
+ * that have failed or that are flagged in TRIED. Returns
+ * MIRROR_MAXMEMBERS if there's none left. Call with md_lock held.
+ */
+static
+unsigned
+mirror_pick(struct mirror *md, uint32_t block, const bool *tried)
+{
+	unsigned i, best;
+	uint32_t dist, bestdist;
+
+	KASSERT(spinlock_do_i_hold(&md->md_lock));
+
+	best = MIRROR_MAXMEMBERS;
+	bestdist = 0;
+	for (i=0; i<md->md_nmembers; i++) {
+		if (md->md_failed[i] || tried[i]) {
+			continue;
+		}
+		if (md->md_lastblock[i] > block) {
+			dist = md->md_lastblock[i] - block;
+		}
+		else {
+			dist = block - md->md_lastblock[i];
+		}
+		if (best == MIRROR_MAXMEMBERS ||
+		    md->md_pending[i] < md->md_pending[best] ||
+		    (md->md_pending[i] == md->md_pending[best] &&
+		     dist < bestdist)) {
+			best = i;
+			bestdist = dist;
+		}
+	}
+	return best;
+}
+
+/*
+ * Read NBLOCKS blocks starting at block BLOCK into the kernel memory
+ * at DATA, from whichever member suits, falling back to the others
+ * on error.
+ */
+static
+int
+mirror_read(struct mirror *md, uint32_t block, uint32_t nblocks,
+	    char *data)
+{
+	bool tried[MIRROR_MAXMEMBERS];
+	struct mirror_xfer mx;
+	struct mirror_wait mw;
+	unsigned i, m;
+	int result;
+
+	for (i=0; i<MIRROR_MAXMEMBERS; i++) {
+		tried[i] = false;
+	}
+	mw.mw_md = md;
+	mw.mw_pending = 0;
+
+	result = EIO;
+	spinlock_acquire(&md->md_lock);
+	while (1) {
+		m = mirror_pick(md, block, tried);
+		if (m == MIRROR_MAXMEMBERS) {
+			break;
+		}
+		tried[m] = true;
+		mirror_setup(md, &mw, &mx, m, block, nblocks, data, false);
+		spinlock_release(&md->md_lock);
+
+		dev_bio_submit(md->md_members[m], &mx.mx_bio);
+
+		spinlock_acquire(&md->md_lock);
+		mirror_wait(md, &mw);
+		result = mx.mx_result;
+		if (result == 0) {
+			break;
+		}
+		mirror_fail(md, m, result);
+	}
+	spinlock_release(&md->md_lock);
+	return result;
+}
+
+/*
+ * Write NBLOCKS blocks starting at block BLOCK from the kernel memory
+ * at DATA to all the members at once.
+ */
+static
+int
+mirror_write(struct mirror *md, uint32_t block, uint32_t nblocks,
+	     char *data)
+{
+	struct mirror_xfer mxs[MIRROR_MAXMEMBERS];
+	struct mirror_wait mw;
+	unsigned i, n, ok;
+	int result;
+
+	mw.mw_md = md;
+	mw.mw_pending = 0;
+
+	n = 0;
+	spinlock_acquire(&md->md_lock);
+	for (i=0; i<md->md_nmembers; i++) {
+		if (!md->md_failed[i]) {
+			mirror_setup(md, &mw, &mxs[n++], i, block, nblocks,
+				     data, true);
+		}
+	}
+	spinlock_release(&md->md_lock);
+
+	if (n == 0) {
+		return EIO;
+	}
+
+	for (i=0; i<n; i++) {
+		dev_bio_submit(md->md_members[mxs[i].mx_member],
+			       &mxs[i].mx_bio);
+	}
+
+	/* It worked if it got onto at least one member. */
+	ok = 0;
+	result = 0;
+	spinlock_acquire(&md->md_lock);
+	mirror_wait(md, &mw);
+	for (i=0; i<n; i++) {
+		if (mxs[i].mx_result == 0) {
+			ok++;
+		}
+		else {
+			mirror_fail(md, mxs[i].mx_member, mxs[i].mx_result);
+			if (result == 0) {
+				result = mxs[i].mx_result;
+			}
+		}
+	}
+	spinlock_release(&md->md_lock);
+	return ok > 0 ? 0 : result;
+}
+
+/*
+ * Transfer, in either direction.
+ */
+static
+int
+mirror_transfer(struct mirror *md, uint32_t block, uint32_t nblocks,
+		char *data, bool write)
+{
+	if (write) {
+		return mirror_write(md, block, nblocks, data);
+	}
+	return mirror_read(md, block, nblocks, data);
+}
+
+/*
+ * I/O function (for both reads and writes)
+ *
+ * As in lhd_io, a uio that's one piece of kernel memory is
+ * transferred in place, and anything else goes through a bounce
+ * buffer.
+ */
+static
+int
+mirror_io(struct device *dev, struct uio *uio)
+{
+	struct mirror *md = dev->d_data;
+	blksize_t bsize = dev->d_blocksize;
+	bool write = uio->uio_rw == UIO_WRITE;
+	uint32_t block, len, n;
+	struct iovec *iov;
+	char *bounce;
+	int result;
+
+	/* Don't allow I/O that isn't block-aligned. */
+	if (uio->uio_offset % bsize != 0 || uio->uio_resid % bsize != 0) {
+		return EINVAL;
+	}
+	block = uio->uio_offset / bsize;
+	len = uio->uio_resid / bsize;
+
+	/* Don't allow I/O past the end of the device. */
+	if (block > dev->d_blocks || len > dev->d_blocks - block) {
+		return EINVAL;
+	}
+
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		KASSERT(iov->iov_len == uio->uio_resid);
+		result = mirror_transfer(md, block, len, iov->iov_kbase,
+					 write);
+		if (result) {
+			return result;
+		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
+
+	n = len < MIRROR_BOUNCE_BLOCKS ? len : MIRROR_BOUNCE_BLOCKS;
+	bounce = kmalloc(n * bsize);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (len > 0) {
+		n = len < MIRROR_BOUNCE_BLOCKS ? len : MIRROR_BOUNCE_BLOCKS;
+		if (write) {
+			result = uiomove(bounce, n * bsize, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = mirror_transfer(md, block, n, bounce, write);
+		if (result) {
+			break;
+		}
+		if (!write) {
+			result = uiomove(bounce, n * bsize, uio);
+			if (result) {
+				break;
+			}
+		}
+		block += n;
+		len -= n;
+	}
+
+	kfree(bounce);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+mirror_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops mirror_devops = {
+	.devop_eachopen = mirror_eachopen,
+	.devop_io = mirror_io,
+	.devop_ioctl = mirror_ioctl,
+};
+
+/*
+ * Make a mirror out of the devices named MEMBERS[0..NMEMBERS-1] and
+ * attach it as the next mirrorN:. The members must all have the same
+ * block size; the mirror is as big as the smallest of them.
+ */
+int
+devmirror_create(char **members, unsigned nmembers)
+{
+	struct device *devs[MIRROR_MAXMEMBERS];
+	struct mirror *md;
+	unsigned i;
+	int result;
+
+	if (nmembers < 2 || nmembers > MIRROR_MAXMEMBERS) {
+		return EINVAL;
+	}
+
+	md = kmalloc(sizeof(*md));
+	if (md == NULL) {
+		return ENOMEM;
+	}
+	md->md_wchan = wchan_create("mirror");
+	if (md->md_wchan == NULL) {
+		kfree(md);
+		return ENOMEM;
+	}
+	spinlock_init(&md->md_lock);
+
+	result = vfs_claimdevs(members, nmembers, devs);
+	if (result) {
+		goto fail;
+	}
+
+	md->md_dev.d_blocks = devs[0]->d_blocks;
+	for (i=0; i<nmembers; i++) {
+		if (devs[i]->d_blocksize != devs[0]->d_blocksize) {
+			kprintf("mirror: %s: block size doesn't match %s\n",
+				members[i], members[0]);
+			result = EINVAL;
+			goto unclaim;
+		}
+		if (devs[i]->d_blocks < md->md_dev.d_blocks) {
+			md->md_dev.d_blocks = devs[i]->d_blocks;
+		}
+		md->md_members[i] = devs[i];
+		md->md_failed[i] = false;
+		md->md_pending[i] = 0;
+		md->md_lastblock[i] = 0;
+	}
+	md->md_nmembers = nmembers;
+
+	md->md_dev.d_ops = &mirror_devops;
+	md->md_dev.d_blocksize = devs[0]->d_blocksize;
+	md->md_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	md->md_dev.d_data = md;
+
+	snprintf(md->md_name, sizeof(md->md_name), "mirror%u",
+		 mirror_count);
+	result = vfs_adddev(md->md_name, &md->md_dev, 1);
+	if (result) {
+		goto unclaim;
+	}
+	mirror_count++;
+
+	kprintf("%s: %u members, %u blocks\n", md->md_name, nmembers,
+		(unsigned)md->md_dev.d_blocks);
+	return 0;
+
+ unclaim:
+	vfs_unclaimdevs(devs, nmembers);
+ fail:
+	spinlock_cleanup(&md->md_lock);
+	wchan_destroy(md->md_wchan);
+	kfree(md);
+	return result;
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Striping (RAID-0) device, "stripeN:", made with devstripe_create
+ * (the "stripe" menu command) out of two or more mountable devices.
+ *
+ * The device is divided into stripe units of sd_stripeblocks blocks,
+ * which go to the members in turn: unit U is unit U / nmembers on
+ * member U % nmembers. A transfer is split into one dev_bio per
+ * unit, and they are all submitted before waiting for any, so the
+ * members work on them at the same time; a large sequential
+ * transfer thus gets the bandwidth of all the members together.
+ *
+ * Nothing about the layout is recorded on the members, so a stripe
+ * set has to be made again the same way (same members, same order,
+ * same stripe size) after each boot before it's mounted.
+ *
+ * Once a device is made part of a stripe set it can't be used on
+ * its own any more (see vfs_claimdevs).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Most members in a stripe set */
+#define STRIPE_MAXMEMBERS	8
+
+/* Most stripe units transferred at once */
+#define STRIPE_MAXBIOS		16
+
+/* Most blocks copied through a bounce buffer at once */
+#define STRIPE_BOUNCE_BLOCKS	32
+
+struct stripe {
+	struct device sd_dev;		/* what the VFS layer sees */
+	struct device *sd_members[STRIPE_MAXMEMBERS];
+	unsigned sd_nmembers;
+	uint32_t sd_stripeblocks;	/* blocks per stripe unit */
+
+	struct spinlock sd_lock;	/* for waiting for transfers */
+	struct wchan *sd_wchan;
+};
+
+/* To wait for a batch of member transfers */
+struct stripe_wait {
+	struct stripe *sw_sd;
+	unsigned sw_pending;		/* transfers not yet done */
+	int sw_result;			/* first error */
+};
+
+/* Number of stripe sets made so far, for naming them */
+static unsigned stripe_count;
+
+/* For open() */
+static
+int
+stripe_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+/*
+ * Completion for one member transfer.
+ */
+static
+void
+stripe_biodone(struct dev_bio *bio, int result)
+{
+	struct stripe_wait *sw = bio->bio_arg;
+	struct stripe *sd = sw->sw_sd;
+
+	spinlock_acquire(&sd->sd_lock);
+	if (result && sw->sw_result == 0) {
+		sw->sw_result = result;
+	}
+	KASSERT(sw->sw_pending > 0);
+	sw->sw_pending--;
+	if (sw->sw_pending == 0) {
+		wchan_wakeall(sd->sd_wchan, &sd->sd_lock);
+	}
+	spinlock_release(&sd->sd_lock);
+}
+
+/*
+ * Transfer NBLOCKS blocks starting at block BLOCK of the stripe set
+ * to or from the kernel memory at DATA.
+ */
+static
+int
+stripe_transfer(struct stripe *sd, uint32_t block, uint32_t nblocks,
+		char *data, bool write)
+{
+	struct dev_bio bios[STRIPE_MAXBIOS];
+	struct device *devs[STRIPE_MAXBIOS];
+	struct stripe_wait sw;
+	uint32_t unit, offset, count;
+	unsigned i, n;
+
+	sw.sw_sd = sd;
+	while (nblocks > 0) {
+		/* Split the next part up by stripe unit */
+		for (n=0; n<STRIPE_MAXBIOS && nblocks > 0; n++) {
+			unit = block / sd->sd_stripeblocks;
+			offset = block % sd->sd_stripeblocks;
+			count = sd->sd_stripeblocks - offset;
+			if (count > nblocks) {
+				count = nblocks;
+			}
+
+			devs[n] = sd->sd_members[unit % sd->sd_nmembers];
+			bios[n].bio_block = (unit / sd->sd_nmembers) *
+				sd->sd_stripeblocks + offset;
+			bios[n].bio_nblocks = count;
+			bios[n].bio_data = data;
+			bios[n].bio_write = write;
+			bios[n].bio_done = stripe_biodone;
+			bios[n].bio_arg = &sw;
+
+			block += count;
+			nblocks -= count;
+			data += count * sd->sd_dev.d_blocksize;
+		}
+
+		/* Start them all, then wait for them all */
+		sw.sw_pending = n;
+		sw.sw_result = 0;
+		for (i=0; i<n; i++) {
+			dev_bio_submit(devs[i], &bios[i]);
+		}
+		spinlock_acquire(&sd->sd_lock);
+		while (sw.sw_pending > 0) {
+			wchan_sleep(sd->sd_wchan, &sd->sd_lock);
+		}
+		spinlock_release(&sd->sd_lock);
+
+		if (sw.sw_result) {
+			return sw.sw_result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * I/O function (for both reads and writes)
+ *
+ * As in lhd_io, a uio that's one piece of kernel memory is
+ * transferred in place, and anything else goes through a bounce
+ * buffer.
+ */
+static
+int
+stripe_io(struct device *dev, struct uio *uio)
+{
+	struct stripe *sd = dev->d_data;
+	blksize_t bsize = dev->d_blocksize;
+	bool write = uio->uio_rw == UIO_WRITE;
+	uint32_t block, len, n;
+	struct iovec *iov;
+	char *bounce;
+	int result;
+
+	/* Don't allow I/O that isn't block-aligned. */
+	if (uio->uio_offset % bsize != 0 || uio->uio_resid % bsize != 0) {
+		return EINVAL;
+	}
+	block = uio->uio_offset / bsize;
+	len = uio->uio_resid / bsize;
+
+	/* Don't allow I/O past the end of the device. */
+	if (block > dev->d_blocks || len > dev->d_blocks - block) {
+		return EINVAL;
+	}
+
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		KASSERT(iov->iov_len == uio->uio_resid);
+		result = stripe_transfer(sd, block, len, iov->iov_kbase,
+					 write);
+		if (result) {
+			return result;
+		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
+
+	n = len < STRIPE_BOUNCE_BLOCKS ? len : STRIPE_BOUNCE_BLOCKS;
+	bounce = kmalloc(n * bsize);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (len > 0) {
+		n = len < STRIPE_BOUNCE_BLOCKS ? len : STRIPE_BOUNCE_BLOCKS;
+		if (write) {
+			result = uiomove(bounce, n * bsize, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = stripe_transfer(sd, block, n, bounce, write);
+		if (result) {
+			break;
+		}
+		if (!write) {
+			result = uiomove(bounce, n * bsize, uio);
+			if (result) {
+				break;
+			}
+		}
+		block += n;
+		len -= n;
+	}
+
+	kfree(bounce);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+stripe_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops stripe_devops = {
+	.devop_eachopen = stripe_eachopen,
+	.devop_io = stripe_io,
+	.devop_ioctl = stripe_ioctl,
+};
+
+/*
+ * Make a stripe set out of the devices named MEMBERS[0..NMEMBERS-1],
+ * with stripe units of STRIPEBLOCKS blocks, and attach it as the next
+ * stripeN:. The members must all have the same block size; if they
+ * aren't the same size, the extra space on the bigger ones goes
+ * unused.
+ */
+int
+devstripe_create(unsigned stripeblocks, char **members, unsigned nmembers)
+{
+	struct device *devs[STRIPE_MAXMEMBERS];
+	struct stripe *sd;
+	blkcnt_t units, u;
+	char name[32];
+	unsigned i;
+	int result;
+
+	if (nmembers < 2 || nmembers > STRIPE_MAXMEMBERS ||
+	    stripeblocks == 0) {
+		return EINVAL;
+	}
+
+	sd = kmalloc(sizeof(*sd));
+	if (sd == NULL) {
+		return ENOMEM;
+	}
+	sd->sd_wchan = wchan_create("stripe");
+	if (sd->sd_wchan == NULL) {
+		kfree(sd);
+		return ENOMEM;
+	}
+	spinlock_init(&sd->sd_lock);
+
+	result = vfs_claimdevs(members, nmembers, devs);
+	if (result) {
+		goto fail;
+	}
+
+	units = 0;
+	for (i=0; i<nmembers; i++) {
+		if (devs[i]->d_blocksize != devs[0]->d_blocksize) {
+			kprintf("stripe: %s: block size doesn't match %s\n",
+				members[i], members[0]);
+			result = EINVAL;
+			goto unclaim;
+		}
+		u = devs[i]->d_blocks / stripeblocks;
+		if (i == 0 || u < units) {
+			units = u;
+		}
+		sd->sd_members[i] = devs[i];
+	}
+	if (units == 0) {
+		kprintf("stripe: members are smaller than a stripe unit\n");
+		result = EINVAL;
+		goto unclaim;
+	}
+	sd->sd_nmembers = nmembers;
+	sd->sd_stripeblocks = stripeblocks;
+
+	sd->sd_dev.d_ops = &stripe_devops;
+	sd->sd_dev.d_blocks = units * stripeblocks * nmembers;
+	sd->sd_dev.d_blocksize = devs[0]->d_blocksize;
+	sd->sd_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	sd->sd_dev.d_data = sd;
+
+	snprintf(name, sizeof(name), "stripe%u", stripe_count);
+	result = vfs_adddev(name, &sd->sd_dev, 1);
+	if (result) {
+		goto unclaim;
+	}
+	stripe_count++;
+
+	kprintf("%s: %u members, %u-block stripe units, %u blocks\n",
+		name, nmembers, stripeblocks, (unsigned)sd->sd_dev.d_blocks);
+	return 0;
+
+ unclaim:
+	vfs_unclaimdevs(devs, nmembers);
+ fail:
+	spinlock_cleanup(&sd->sd_lock);
+	wchan_destroy(sd->sd_wchan);
+	kfree(sd);
+	return result;
+}
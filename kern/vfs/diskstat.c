@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Per-disk I/O statistics (see diskstat.h), and the "diskstat:"
+ * device that reports them.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <diskstat.h>
+
+/* Initial size for the report; it's regrown if necessary. */
+#define DISKSTAT_INITSIZE	2048
+
+/* All registered disks. Disks are added but never removed. */
+static struct spinlock diskstats_listlock = SPINLOCK_INITIALIZER;
+static struct diskstats *diskstats_list;
+
+/*
+ * Register a disk, called NAME.
+ */
+void
+diskstats_init(struct diskstats *ds, const char *name)
+{
+	struct diskstats **dsp;
+
+	bzero(ds, sizeof(*ds));
+	snprintf(ds->ds_name, sizeof(ds->ds_name), "%s", name);
+	spinlock_init(&ds->ds_lock);
+
+	/* Keep them in the order they attached */
+	spinlock_acquire(&diskstats_listlock);
+	for (dsp = &diskstats_list; *dsp != NULL; dsp = &(*dsp)->ds_next) {
+		/* nothing */
+	}
+	*dsp = ds;
+	spinlock_release(&diskstats_listlock);
+}
+
+/*
+ * Histogram bucket for N: bucket K holds [2^(K-1), 2^K), and bucket
+ * 0 holds 0; the last bucket is open-ended.
+ */
+static
+unsigned
+diskstats_bucket(uint64_t n, unsigned nbuckets)
+{
+	unsigned bucket;
+
+	bucket = 0;
+	while (n > 0 && bucket < nbuckets - 1) {
+		n >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/*
+ * Microseconds from START to END.
+ */
+static
+uint64_t
+diskstats_usec(const struct timespec *start, const struct timespec *end)
+{
+	struct timespec diff;
+
+	timespec_sub(end, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * A transfer has been handed to the driver.
+ */
+void
+diskstats_queued(struct diskstats *ds, struct dev_bio *bio)
+{
+	unsigned depth;
+
+	gettime(&bio->bio_queued);
+
+	spinlock_acquire(&ds->ds_lock);
+	depth = ds->ds_outstanding++;
+	if (depth > ds->ds_maxdepth) {
+		ds->ds_maxdepth = depth;
+	}
+	ds->ds_depth[diskstats_bucket(depth, DISKSTAT_DEPTHBUCKETS)]++;
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * A transfer has gotten the disk.
+ */
+void
+diskstats_started(struct diskstats *ds, struct dev_bio *bio)
+{
+	uint64_t usec;
+
+	gettime(&bio->bio_started);
+	usec = diskstats_usec(&bio->bio_queued, &bio->bio_started);
+
+	spinlock_acquire(&ds->ds_lock);
+	ds->ds_waittotal += usec;
+	ds->ds_wait[diskstats_bucket(usec, DISKSTAT_LATBUCKETS)]++;
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * A transfer has finished with RESULT.
+ */
+void
+diskstats_done(struct diskstats *ds, struct dev_bio *bio, int result)
+{
+	struct timespec now;
+	uint64_t usec;
+	unsigned rw;
+
+	gettime(&now);
+	usec = diskstats_usec(&bio->bio_started, &now);
+	rw = bio->bio_write ? 1 : 0;
+
+	spinlock_acquire(&ds->ds_lock);
+	KASSERT(ds->ds_outstanding > 0);
+	ds->ds_outstanding--;
+	ds->ds_requests[rw]++;
+	ds->ds_blocks[rw] += bio->bio_nblocks;
+	if (result) {
+		ds->ds_errors++;
+	}
+	ds->ds_servicetotal += usec;
+	ds->ds_service[diskstats_bucket(usec, DISKSTAT_LATBUCKETS)]++;
+	spinlock_release(&ds->ds_lock);
+}
+
+////////////////////////////////////////////////////////////
+// report
+
+/*
+ * Where a report goes: the console if dr_buf is NULL, otherwise the
+ * buffer DR_BUF of size DR_LEN, truncating if necessary. DR_POS
+ * counts the length of the whole report either way. (This is the
+ * same scheme as the buffer cache stats report.)
+ */
+struct diskreport {
+	char *dr_buf;
+	size_t dr_len;
+	size_t dr_pos;
+};
+
+static
+void
+diskreport(struct diskreport *dr, const char *fmt, ...)
+{
+	char line[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	if (dr->dr_buf == NULL) {
+		len = vsnprintf(line, sizeof(line), fmt, ap);
+		kprintf("%s", line);
+	}
+	else if (dr->dr_pos < dr->dr_len) {
+		len = vsnprintf(dr->dr_buf + dr->dr_pos,
+				dr->dr_len - dr->dr_pos, fmt, ap);
+	}
+	else {
+		len = vsnprintf(NULL, 0, fmt, ap);
+	}
+	va_end(ap);
+
+	dr->dr_pos += len;
+}
+
+/*
+ * Print a histogram, skipping empty buckets.
+ */
+static
+void
+diskreport_hist(struct diskreport *dr, const char *what,
+		const unsigned *hist, unsigned nbuckets, const char *units)
+{
+	unsigned i, total;
+
+	total = 0;
+	for (i=0; i<nbuckets; i++) {
+		total += hist[i];
+	}
+	diskreport(dr, "   %s:\n", what);
+	if (total == 0) {
+		diskreport(dr, "      none\n");
+		return;
+	}
+	for (i=0; i<nbuckets; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			diskreport(dr, "      %7u        %s:", 0, units);
+		}
+		else if (i == nbuckets - 1) {
+			diskreport(dr, "      %7u+       %s:", 1U << (i-1),
+				   units);
+		}
+		else {
+			diskreport(dr, "      %7u-%-7u%s:", 1U << (i-1),
+				   (1U << i) - 1, units);
+		}
+		diskreport(dr, " %u (%u%%)\n", hist[i], hist[i] * 100 / total);
+	}
+}
+
+/*
+ * Report on one disk.
+ */
+static
+void
+diskreport_disk(struct diskreport *dr, struct diskstats *ds)
+{
+	struct diskstats copy;
+	unsigned total;
+
+	/* Copy it so as not to print while holding a spinlock. */
+	spinlock_acquire(&ds->ds_lock);
+	copy = *ds;
+	spinlock_release(&ds->ds_lock);
+
+	total = copy.ds_requests[0] + copy.ds_requests[1];
+	diskreport(dr, "%s: %u requests (%u reads, %u writes, %u errors)\n",
+		   copy.ds_name, total, copy.ds_requests[0],
+		   copy.ds_requests[1], copy.ds_errors);
+	diskreport(dr, "   %u blocks read, %u blocks written\n",
+		   copy.ds_blocks[0], copy.ds_blocks[1]);
+	diskreport(dr, "   %u outstanding now, at most %u seen on arrival\n",
+		   copy.ds_outstanding, copy.ds_maxdepth);
+	if (total > 0) {
+		diskreport(dr, "   average wait %u usec, "
+			   "average service %u usec\n",
+			   (unsigned)(copy.ds_waittotal / total),
+			   (unsigned)(copy.ds_servicetotal / total));
+	}
+	diskreport_hist(dr, "queue depth on arrival", copy.ds_depth,
+			DISKSTAT_DEPTHBUCKETS, "");
+	diskreport_hist(dr, "wait time", copy.ds_wait,
+			DISKSTAT_LATBUCKETS, "usec");
+	diskreport_hist(dr, "service time", copy.ds_service,
+			DISKSTAT_LATBUCKETS, "usec");
+}
+
+static
+void
+diskreport_all(struct diskreport *dr)
+{
+	struct diskstats *ds;
+
+	spinlock_acquire(&diskstats_listlock);
+	ds = diskstats_list;
+	spinlock_release(&diskstats_listlock);
+
+	if (ds == NULL) {
+		diskreport(dr, "No disks\n");
+	}
+	/* Disks are never removed, so we can walk the list unlocked */
+	for (; ds != NULL; ds = ds->ds_next) {
+		diskreport_disk(dr, ds);
+	}
+}
+
+void
+diskstats_printall(void)
+{
+	struct diskreport dr;
+
+	dr.dr_buf = NULL;
+	dr.dr_len = 0;
+	dr.dr_pos = 0;
+	diskreport_all(&dr);
+}
+
+/*
+ * Write the report into BUF, which is LEN bytes long. Returns the
+ * length of the whole report; if that's LEN or more, the report was
+ * truncated.
+ */
+size_t
+diskstats_formatall(char *buf, size_t len)
+{
+	struct diskreport dr;
+
+	KASSERT(len > 0);
+
+	dr.dr_buf = buf;
+	dr.dr_len = len;
+	dr.dr_pos = 0;
+	buf[0] = 0;
+	diskreport_all(&dr);
+	return dr.dr_pos;
+}
+
+////////////////////////////////////////////////////////////
+// diskstat: device
+
+/* For open() */
+static
+int
+diskstatopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if (openflags != O_RDONLY) {
+		return EIO;
+	}
+	return 0;
+}
+
+/* For d_io(); as for bufstat: */
+static
+int
+diskstatio(struct device *dev, struct uio *uio)
+{
+	char *report;
+	size_t size, len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EIO;
+	}
+
+	size = DISKSTAT_INITSIZE;
+	report = kmalloc(size);
+	if (report == NULL) {
+		return ENOMEM;
+	}
+	len = diskstats_formatall(report, size);
+	if (len >= size) {
+		kfree(report);
+		size = len + 1;
+		report = kmalloc(size);
+		if (report == NULL) {
+			return ENOMEM;
+		}
+		len = diskstats_formatall(report, size);
+		if (len >= size) {
+			len = size - 1;
+		}
+	}
+
+	if (uio->uio_offset < 0) {
+		result = EINVAL;
+	}
+	else if ((size_t)uio->uio_offset >= len) {
+		/* EOF */
+		result = 0;
+	}
+	else {
+		result = uiomove(report + uio->uio_offset,
+				 len - uio->uio_offset, uio);
+	}
+
+	kfree(report);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+diskstatioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops diskstat_devops = {
+	.devop_eachopen = diskstatopen,
+	.devop_io = diskstatio,
+	.devop_ioctl = diskstatioctl,
+};
+
+/*
+ * Function to create and attach diskstat:
+ */
+void
+devdiskstat_create(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev==NULL) {
+		panic("Could not add diskstat device: out of memory\n");
+	}
+
+	dev->d_ops = &diskstat_devops;
+
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = NULL;
+
+	result = vfs_adddev("diskstat", dev, 0);
+	if (result) {
+		panic("Could not add diskstat device: %s\n",
+		      strerror(result));
+	}
+}
@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Pipes; see pipe.h.
+ *
+ * Small writes go through a ring buffer: one copy in, one copy out.
+ * A large write from user memory instead lends the reader the pages
+ * it's writing from (see as_loanpage) and waits while the reader
+ * copies straight out of them, so the data is only copied once. The
+ * writer is asleep in write() all that time, so its buffer can't
+ * change underneath. Only one loan is out at a time, and it waits for
+ * the ring to drain first, so the bytes come out in order.
+ *
+ * Writes of up to PIPE_BUF bytes go into the ring whole or not at
+ * all, so they aren't mixed with other writers' data.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <limits.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <poll.h>
+#include <pipe.h>
+#include "opt-dumbvm.h"
+
+/* Size of the ring */
+#define PIPE_SIZE	4096
+
+/* Smallest write that lends its pages, and pages lent at once */
+#define PIPE_LOANMIN	(2 * PAGE_SIZE)
+#define PIPE_LOANPAGES	16
+
+struct pipe {
+	struct vnode p_readvn;		/* read end */
+	struct vnode p_writevn;		/* write end */
+	bool p_reader;			/* read end still open */
+	bool p_writer;			/* write end still open */
+
+	struct lock *p_lock;		/* protects everything else */
+	struct cv *p_readcv;		/* there's data, or EOF */
+	struct cv *p_writecv;		/* there's space, or no loan */
+	struct pollq p_readpq;		/* poll()ers of the read end */
+	struct pollq p_writepq;		/* poll()ers of the write end */
+
+	char *p_buf;			/* the ring */
+	unsigned p_start;		/* first byte in it */
+	unsigned p_count;		/* bytes in it */
+
+	paddr_t p_loan[PIPE_LOANPAGES];	/* pages lent by a writer */
+	unsigned p_loanoff;		/* next byte, from p_loan[0] */
+	size_t p_loanlen;		/* bytes left to read */
+};
+
+static const struct vnode_ops pipe_readops;
+static const struct vnode_ops pipe_writeops;
+
+////////////////////////////////////////////////////////////
+// setup and teardown
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	KASSERT(!p->p_reader && !p->p_writer);
+	KASSERT(p->p_loanlen == 0);
+
+	pollq_cleanup(&p->p_writepq);
+	pollq_cleanup(&p->p_readpq);
+	cv_destroy(p->p_writecv);
+	cv_destroy(p->p_readcv);
+	lock_destroy(p->p_lock);
+	kfree(p->p_buf);
+	kfree(p);
+}
+
+int
+pipe_create(struct vnode **readvn, struct vnode **writevn)
+{
+	struct pipe *p;
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	p->p_buf = kmalloc(PIPE_SIZE);
+	if (p->p_buf == NULL) {
+		goto fail;
+	}
+	p->p_lock = lock_create("pipe");
+	if (p->p_lock == NULL) {
+		goto fail_buf;
+	}
+	p->p_readcv = cv_create("piperead");
+	if (p->p_readcv == NULL) {
+		goto fail_lock;
+	}
+	p->p_writecv = cv_create("pipewrite");
+	if (p->p_writecv == NULL) {
+		goto fail_readcv;
+	}
+	pollq_init(&p->p_readpq);
+	pollq_init(&p->p_writepq);
+	p->p_start = 0;
+	p->p_count = 0;
+	p->p_loanoff = 0;
+	p->p_loanlen = 0;
+
+	/* vnode_init doesn't actually fail */
+	vnode_init(&p->p_readvn, &pipe_readops, NULL, p);
+	vnode_init(&p->p_writevn, &pipe_writeops, NULL, p);
+	p->p_reader = true;
+	p->p_writer = true;
+
+	*readvn = &p->p_readvn;
+	*writevn = &p->p_writevn;
+	return 0;
+
+ fail_readcv:
+	cv_destroy(p->p_readcv);
+ fail_lock:
+	lock_destroy(p->p_lock);
+ fail_buf:
+	kfree(p->p_buf);
+ fail:
+	kfree(p);
+	return ENOMEM;
+}
+
+/*
+ * Wake up everyone waiting to read, or to write, including in poll.
+ * Called with the lock held.
+ */
+static
+void
+pipe_wakereaders(struct pipe *p)
+{
+	cv_broadcast(p->p_readcv, p->p_lock);
+	pollq_wakeup(&p->p_readpq);
+}
+
+static
+void
+pipe_wakewriters(struct pipe *p)
+{
+	cv_broadcast(p->p_writecv, p->p_lock);
+	pollq_wakeup(&p->p_writepq);
+}
+
+/*
+ * Reclaim for either end: the last reference to it is gone. Wake up
+ * the other side so it sees EOF or EPIPE, and if both ends are gone,
+ * so is the pipe.
+ */
+static
+int
+pipe_reclaim(struct vnode *vn)
+{
+	struct pipe *p = vn->vn_data;
+	bool done;
+
+	lock_acquire(p->p_lock);
+	if (!vnode_lastref(vn)) {
+		lock_release(p->p_lock);
+		return EBUSY;
+	}
+	if (vn == &p->p_readvn) {
+		KASSERT(p->p_reader);
+		p->p_reader = false;
+		pipe_wakewriters(p);
+	}
+	else {
+		KASSERT(vn == &p->p_writevn);
+		KASSERT(p->p_writer);
+		p->p_writer = false;
+		pipe_wakereaders(p);
+	}
+	vnode_cleanup(vn);
+	done = !p->p_reader && !p->p_writer;
+	lock_release(p->p_lock);
+
+	if (done) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Copy from the lent pages to UIO. Called with the lock held.
+ */
+static
+int
+pipe_readloan(struct pipe *p, struct uio *uio)
+{
+	unsigned page, off;
+	size_t len, before;
+	int result;
+
+	result = 0;
+	while (p->p_loanlen > 0 && uio->uio_resid > 0) {
+		page = p->p_loanoff / PAGE_SIZE;
+		off = p->p_loanoff % PAGE_SIZE;
+		len = PAGE_SIZE - off;
+		if (len > p->p_loanlen) {
+			len = p->p_loanlen;
+		}
+
+		before = uio->uio_resid;
+		result = uiomove((char *)PADDR_TO_KVADDR(p->p_loan[page]) + off,
+				 len, uio);
+		len = before - uio->uio_resid;
+		p->p_loanoff += len;
+		p->p_loanlen -= len;
+		if (result) {
+			break;
+		}
+	}
+	if (p->p_loanlen == 0) {
+		pipe_wakewriters(p);
+	}
+	return result;
+}
+
+/*
+ * Copy from the ring to UIO. Called with the lock held.
+ */
+static
+int
+pipe_readring(struct pipe *p, struct uio *uio)
+{
+	size_t len, before;
+	int result;
+
+	result = 0;
+	while (p->p_count > 0 && uio->uio_resid > 0) {
+		/* up to the end of the ring, then around */
+		len = PIPE_SIZE - p->p_start;
+		if (len > p->p_count) {
+			len = p->p_count;
+		}
+
+		before = uio->uio_resid;
+		result = uiomove(p->p_buf + p->p_start, len, uio);
+		len = before - uio->uio_resid;
+		p->p_start = (p->p_start + len) % PIPE_SIZE;
+		p->p_count -= len;
+		if (result) {
+			break;
+		}
+	}
+	if (p->p_count == 0) {
+		/* keep later writes in one piece */
+		p->p_start = 0;
+	}
+	pipe_wakewriters(p);
+	return result;
+}
+
+/*
+ * Read: wait for something to be there, then take as much as fits.
+ * Returns 0 bytes at EOF.
+ */
+static
+int
+pipe_read(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *p = vn->vn_data;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	lock_acquire(p->p_lock);
+	while (p->p_count == 0 && p->p_loanlen == 0 && p->p_writer) {
+		cv_wait(p->p_readcv, p->p_lock);
+	}
+	if (p->p_count > 0) {
+		result = pipe_readring(p, uio);
+	}
+	else {
+		result = pipe_readloan(p, uio);
+	}
+	lock_release(p->p_lock);
+	return result;
+}
+
+/*
+ * Copy from UIO into the ring, as much as there's room for. Called
+ * with the lock held.
+ */
+static
+int
+pipe_writering(struct pipe *p, struct uio *uio)
+{
+	size_t len, before, end;
+	int result;
+
+	result = 0;
+	while (p->p_count < PIPE_SIZE && uio->uio_resid > 0) {
+		/* from the end of the data up to the end of the ring */
+		end = (p->p_start + p->p_count) % PIPE_SIZE;
+		len = (end < p->p_start ? p->p_start : PIPE_SIZE) - end;
+
+		before = uio->uio_resid;
+		result = uiomove(p->p_buf + end, len, uio);
+		p->p_count += before - uio->uio_resid;
+		if (result) {
+			break;
+		}
+	}
+	pipe_wakereaders(p);
+	return result;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Skip LEN bytes of UIO without moving them.
+ */
+static
+void
+pipe_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov;
+	size_t size;
+
+	while (len > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len < len ? iov->iov_len : len;
+		if (size == 0) {
+			KASSERT(uio->uio_iovcnt > 1);
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+		iov->iov_ubase += size;
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		len -= size;
+	}
+}
+
+/*
+ * Lend the reader the pages under the next piece of UIO, as much as
+ * PIPE_LOANPAGES pages of it, and wait until it's been read. Called
+ * with the lock held, and with the ring empty and no other loan out.
+ */
+static
+int
+pipe_writeloan(struct pipe *p, struct uio *uio)
+{
+	struct iovec *iov;
+	vaddr_t base;
+	size_t len, done;
+	unsigned npages, i;
+	int result;
+
+	KASSERT(p->p_count == 0 && p->p_loanlen == 0);
+
+	iov = uio->uio_iov;
+	while (iov->iov_len == 0) {
+		KASSERT(uio->uio_iovcnt > 1);
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+		iov = uio->uio_iov;
+	}
+	base = (vaddr_t)iov->iov_ubase;
+	len = iov->iov_len;
+	if (len > PIPE_LOANPAGES * PAGE_SIZE - base % PAGE_SIZE) {
+		len = PIPE_LOANPAGES * PAGE_SIZE - base % PAGE_SIZE;
+	}
+	npages = (base % PAGE_SIZE + len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	for (i=0; i<npages; i++) {
+		result = as_loanpage(uio->uio_space,
+				     base + i * PAGE_SIZE, &p->p_loan[i]);
+		if (result) {
+			while (i-- > 0) {
+				as_unloanpage(uio->uio_space,
+					      base + i * PAGE_SIZE,
+					      p->p_loan[i]);
+			}
+			return result;
+		}
+	}
+
+	p->p_loanoff = base % PAGE_SIZE;
+	p->p_loanlen = len;
+	pipe_wakereaders(p);
+	while (p->p_loanlen > 0 && p->p_reader) {
+		cv_wait(p->p_writecv, p->p_lock);
+	}
+	done = len - p->p_loanlen;
+	p->p_loanlen = 0;
+	/* wake any other writers waiting for the loan to be done */
+	pipe_wakewriters(p);
+
+	for (i=0; i<npages; i++) {
+		as_unloanpage(uio->uio_space, base + i * PAGE_SIZE,
+			      p->p_loan[i]);
+	}
+	pipe_uioskip(uio, done);
+	return 0;
+}
+#endif
+
+/*
+ * Write: all of it, waiting for room as needed, unless the read end
+ * goes away, which gives EPIPE.
+ */
+static
+int
+pipe_write(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *p = vn->vn_data;
+	size_t space;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	result = 0;
+	lock_acquire(p->p_lock);
+	while (uio->uio_resid > 0) {
+		if (!p->p_reader) {
+			result = EPIPE;
+			break;
+		}
+		space = PIPE_SIZE - p->p_count;
+		if (p->p_loanlen > 0 || space == 0 ||
+		    (uio->uio_resid <= PIPE_BUF && space < uio->uio_resid)) {
+			cv_wait(p->p_writecv, p->p_lock);
+			continue;
+		}
+#if !OPT_DUMBVM
+		if (uio->uio_segflg == UIO_USERSPACE &&
+		    uio->uio_resid >= PIPE_LOANMIN) {
+			if (p->p_count > 0) {
+				/* let the ring drain first */
+				cv_wait(p->p_writecv, p->p_lock);
+				continue;
+			}
+			result = pipe_writeloan(p, uio);
+		}
+		else
+#endif
+		{
+			result = pipe_writering(p, uio);
+		}
+		if (result) {
+			break;
+		}
+	}
+	lock_release(p->p_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// other ops
+
+static
+int
+pipe_eachopen(struct vnode *vn, int flags)
+{
+	/* pipes aren't in any directory, so can't be opened by name */
+	(void)vn;
+	(void)flags;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_gettype(struct vnode *vn, mode_t *ret)
+{
+	(void)vn;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+/*
+ * Stat: the size is what's waiting to be read.
+ */
+static
+int
+pipe_stat(struct vnode *vn, struct stat *statbuf)
+{
+	struct pipe *p = vn->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	lock_acquire(p->p_lock);
+	statbuf->st_size = p->p_count + p->p_loanlen;
+	lock_release(p->p_lock);
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_SIZE;
+	return 0;
+}
+
+/*
+ * Poll: the read end is readable when there's data, and hung up when
+ * there's no writer; the write end is writable when a PIPE_BUF write
+ * would fit, and in error when there's no reader.
+ */
+static
+int
+pipe_poll(struct vnode *vn, int events, struct pollset *ps, int *revents)
+{
+	struct pipe *p = vn->vn_data;
+	int ready;
+
+	ready = 0;
+	lock_acquire(p->p_lock);
+	if (vn == &p->p_readvn) {
+		pollq_register(&p->p_readpq, ps);
+		if (p->p_count > 0 || p->p_loanlen > 0) {
+			ready |= POLLIN;
+		}
+		if (!p->p_writer) {
+			ready |= POLLHUP;
+		}
+	}
+	else {
+		pollq_register(&p->p_writepq, ps);
+		if (!p->p_reader) {
+			ready |= POLLERR;
+		}
+		else if (p->p_loanlen == 0 &&
+			 PIPE_SIZE - p->p_count >= PIPE_BUF) {
+			ready |= POLLOUT;
+		}
+	}
+	lock_release(p->p_lock);
+
+	*revents = ready & (events | POLLERR | POLLHUP);
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *vn)
+{
+	(void)vn;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+static
+int
+pipe_truncate(struct vnode *vn, off_t len)
+{
+	(void)vn;
+	(void)len;
+	return EINVAL;
+}
+
+/*
+ * Vnode ops tables for the two ends.
+ */
+static const struct vnode_ops pipe_readops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
+	.vop_write = vopfail_uio_inval,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_fdatasync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_nosys,
+	.vop_truncate = pipe_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_poll = pipe_poll,
+	.vop_namefile = vopfail_uio_notdir,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+static const struct vnode_ops pipe_writeops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+
+	.vop_read = vopfail_uio_inval,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_fdatasync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_nosys,
+	.vop_truncate = pipe_truncate,
+	.vop_fallocate = vopfail_fallocate_nosys,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_poll = pipe_poll,
+	.vop_namefile = vopfail_uio_notdir,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Wait queues for poll(); see poll.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <poll.h>
+
+void
+pollq_init(struct pollq *pq)
+{
+	spinlock_init(&pq->pq_lock);
+	pq->pq_ents = NULL;
+}
+
+void
+pollq_cleanup(struct pollq *pq)
+{
+	KASSERT(pq->pq_ents == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+/*
+ * Register PS on PQ. Does nothing if PS is NULL, so VOP_POLL can be
+ * used to look without waiting.
+ */
+void
+pollq_register(struct pollq *pq, struct pollset *ps)
+{
+	struct pollent *pe;
+
+	if (ps == NULL) {
+		return;
+	}
+	KASSERT(ps->ps_nents < ps->ps_maxents);
+	pe = &ps->ps_ents[ps->ps_nents++];
+	pe->pe_set = ps;
+	pe->pe_q = pq;
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_next = pq->pq_ents;
+	pq->pq_ents = pe;
+	spinlock_release(&pq->pq_lock);
+}
+
+/*
+ * Wake every pollset registered on PQ. They stay registered; poll
+ * takes them off when it returns.
+ */
+void
+pollq_wakeup(struct pollq *pq)
+{
+	struct pollent *pe;
+	struct pollset *ps;
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_ents; pe != NULL; pe = pe->pe_next) {
+		ps = pe->pe_set;
+		spinlock_acquire(&ps->ps_lock);
+		ps->ps_ready = true;
+		wchan_wakeall(ps->ps_wchan, &ps->ps_lock);
+		spinlock_release(&ps->ps_lock);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+int
+pollset_init(struct pollset *ps, unsigned maxents)
+{
+	ps->ps_wchan = wchan_create("poll");
+	if (ps->ps_wchan == NULL) {
+		return ENOMEM;
+	}
+	ps->ps_ents = NULL;
+	if (maxents > 0) {
+		ps->ps_ents = kmalloc(maxents * sizeof(ps->ps_ents[0]));
+		if (ps->ps_ents == NULL) {
+			wchan_destroy(ps->ps_wchan);
+			return ENOMEM;
+		}
+	}
+	spinlock_init(&ps->ps_lock);
+	ps->ps_ready = false;
+	ps->ps_nents = 0;
+	ps->ps_maxents = maxents;
+	return 0;
+}
+
+/*
+ * Take PS off every pollq it's registered on, and destroy it.
+ */
+void
+pollset_cleanup(struct pollset *ps)
+{
+	struct pollent *pe, **pp;
+	struct pollq *pq;
+	unsigned i;
+
+	for (i=0; i<ps->ps_nents; i++) {
+		pe = &ps->ps_ents[i];
+		pq = pe->pe_q;
+		spinlock_acquire(&pq->pq_lock);
+		for (pp = &pq->pq_ents; *pp != pe; pp = &(*pp)->pe_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = pe->pe_next;
+		spinlock_release(&pq->pq_lock);
+	}
+
+	spinlock_cleanup(&ps->ps_lock);
+	wchan_destroy(ps->ps_wchan);
+	if (ps->ps_ents != NULL) {
+		kfree(ps->ps_ents);
+	}
+}
+
+/*
+ * Forget earlier wakeups, before polling everything again.
+ */
+void
+pollset_reset(struct pollset *ps)
+{
+	spinlock_acquire(&ps->ps_lock);
+	ps->ps_ready = false;
+	spinlock_release(&ps->ps_lock);
+}
+
+int
+pollset_wait(struct pollset *ps, const struct timespec *timeout)
+{
+	int result;
+
+	result = 0;
+	spinlock_acquire(&ps->ps_lock);
+	if (!ps->ps_ready) {
+		if (timeout == NULL) {
+			wchan_sleep(ps->ps_wchan, &ps->ps_lock);
+		}
+		else {
+			result = wchan_sleep_timeout(ps->ps_wchan,
+						     &ps->ps_lock, timeout);
+		}
+	}
+	spinlock_release(&ps->ps_lock);
+	return result;
+}
@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Name cache.
+ *
+ * Remembers the results of looking up names in directories, keyed on
+ * (directory vnode, name), so that repeated lookups of the same path
+ * components (/bin, sh, ...) don't have to go through the file
+ * system's directory code and the buffer cache. Negative results
+ * (the name isn't there) are cached too.
+ *
+ * A file system opts in by calling vfs_cache_lookup before searching
+ * a directory and vfs_cache_enter afterwards, and it must invalidate
+ * the entry for a name with vfs_cache_remove whenever it adds or
+ * removes that name, and a directory's entries with vfs_cache_purgedir
+ * when the directory is removed. "." and ".." aren't cached, so moving
+ * a directory doesn't need any special handling.
+ *
+ * Each entry holds a reference to its directory and, if positive, to
+ * the vnode found, so neither can be reclaimed (and its address
+ * reused) while the entry exists. That means cached vnodes stay in
+ * memory; vfs_unmount purges a file system's entries first so they
+ * don't make it busy. References are dropped only after the cache
+ * lock is released, since dropping the last one reclaims the vnode.
+ *
+ * The cache is a fixed pool of entries, hashed into chains, and
+ * recycled in LRU order. Unused entries are kept at the LRU tail, so
+ * the cache is full exactly when the tail is in use. Reclaiming a
+ * vnode locks it, and a file system calls vfs_cache_enter with the
+ * directory locked, so recycling an arbitrary entry there could
+ * deadlock; instead vfs_cache_lookup, which is called without locks,
+ * frees the tail entry on a miss when the cache is full, and
+ * vfs_cache_enter only ever uses a free entry.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries. */
+#define NCACHE_SIZE	256
+
+/* Number of hash chains; must be a power of 2. */
+#define NCACHE_HASHSIZE	128
+
+/* Longest name cached; longer names are just looked up each time. */
+#define NCACHE_NAMELEN	31
+
+struct ncentry {
+	struct ncentry *nc_hashnext;	/* next on hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list; head is most recent */
+	struct ncentry *nc_lrunext;
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* what the name is, NULL if absent */
+	uint32_t nc_hash;		/* hash of (dir, name) */
+	char nc_name[NCACHE_NAMELEN + 1];
+};
+
+static struct spinlock ncache_lock = SPINLOCK_INITIALIZER;
+static struct ncentry ncache_entries[NCACHE_SIZE];
+static struct ncentry *ncache_hash[NCACHE_HASHSIZE];
+static struct ncentry *ncache_lruhead, *ncache_lrutail;
+
+/* Statistics, counted per cpu and outside ncache_lock. */
+static struct percpu_counter ncache_hits, ncache_neghits, ncache_misses;
+
+/*
+ * Hash a (directory, name) pair.
+ */
+static
+uint32_t
+ncache_hashname(struct vnode *dir, const char *name)
+{
+	uint32_t h = 2166136261U ^ (uint32_t)(uintptr_t)dir;
+
+	for (; *name != 0; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * LRU list manipulation.
+ */
+static
+void
+ncache_lru_unlink(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		ncache_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		ncache_lrutail = nc->nc_lruprev;
+	}
+}
+
+static
+void
+ncache_lru_front(struct ncentry *nc)
+{
+	ncache_lru_unlink(nc);
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = ncache_lruhead;
+	if (ncache_lruhead != NULL) {
+		ncache_lruhead->nc_lruprev = nc;
+	}
+	else {
+		ncache_lrutail = nc;
+	}
+	ncache_lruhead = nc;
+}
+
+static
+void
+ncache_lru_back(struct ncentry *nc)
+{
+	ncache_lru_unlink(nc);
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = ncache_lrutail;
+	if (ncache_lrutail != NULL) {
+		ncache_lrutail->nc_lrunext = nc;
+	}
+	else {
+		ncache_lruhead = nc;
+	}
+	ncache_lrutail = nc;
+}
+
+/*
+ * Find an entry. Returns NULL if there isn't one.
+ */
+static
+struct ncentry *
+ncache_find(struct vnode *dir, const char *name, uint32_t hash)
+{
+	struct ncentry *nc;
+
+	KASSERT(spinlock_do_i_hold(&ncache_lock));
+
+	for (nc = ncache_hash[hash % NCACHE_HASHSIZE]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_hash == hash && nc->nc_dir == dir &&
+		    !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of use, handing back the references it held for
+ * the caller to drop once the lock is released. The entry goes to
+ * the back of the LRU list to be reused first.
+ */
+static
+void
+ncache_drop(struct ncentry *nc, struct vnode **dir, struct vnode **vn)
+{
+	struct ncentry **p;
+
+	KASSERT(spinlock_do_i_hold(&ncache_lock));
+	KASSERT(nc->nc_dir != NULL);
+
+	for (p = &ncache_hash[nc->nc_hash % NCACHE_HASHSIZE]; *p != nc;
+	     p = &(*p)->nc_hashnext) {
+		KASSERT(*p != NULL);
+	}
+	*p = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dir = nc->nc_dir;
+	*vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	ncache_lru_back(nc);
+}
+
+/*
+ * Drop references handed back by ncache_drop.
+ */
+static
+void
+ncache_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Set up the LRU list.
+ */
+void
+vfs_cache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<NCACHE_SIZE; i++) {
+		ncache_entries[i].nc_lruprev =
+			i > 0 ? &ncache_entries[i-1] : NULL;
+		ncache_entries[i].nc_lrunext =
+			i < NCACHE_SIZE-1 ? &ncache_entries[i+1] : NULL;
+	}
+	ncache_lruhead = &ncache_entries[0];
+	ncache_lrutail = &ncache_entries[NCACHE_SIZE-1];
+
+	if (percpu_counter_init(&ncache_hits) ||
+	    percpu_counter_init(&ncache_neghits) ||
+	    percpu_counter_init(&ncache_misses)) {
+		panic("vfs_cache_bootstrap: Out of percpu counters\n");
+	}
+}
+
+/*
+ * Look up NAME in directory DIR. Returns true if the cache knows the
+ * answer, in which case *RET is either the vnode, with a reference
+ * added for the caller, or NULL if the name doesn't exist.
+ */
+bool
+vfs_cache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	uint32_t hash;
+
+	if (strlen(name) > NCACHE_NAMELEN) {
+		return false;
+	}
+	hash = ncache_hashname(dir, name);
+
+	spinlock_acquire(&ncache_lock);
+	nc = ncache_find(dir, name, hash);
+	if (nc == NULL) {
+		/* Make room for the vfs_cache_enter that should follow */
+		if (ncache_lrutail->nc_dir != NULL) {
+			ncache_drop(ncache_lrutail, &olddir, &oldvn);
+		}
+		spinlock_release(&ncache_lock);
+		percpu_counter_inc(&ncache_misses);
+		ncache_release(olddir, oldvn);
+		return false;
+	}
+	ncache_lru_front(nc);
+	*ret = nc->nc_vn;
+	if (*ret != NULL) {
+		VOP_INCREF(*ret);
+	}
+	spinlock_release(&ncache_lock);
+	percpu_counter_inc(*ret != NULL ? &ncache_hits : &ncache_neghits);
+	return true;
+}
+
+/*
+ * Walk as much of PATH, starting from directory DIR, as the cache can
+ * answer in one go. Only components followed by a slash are looked
+ * at, so the last one is always left for the caller (lookparent
+ * wants it as a string, and lookup wants to check it itself). Stops
+ * at the first component that isn't cached, is cached as missing,
+ * or is too long to have been cached.
+ *
+ * The intermediate vnodes are kept alive by their cache entries,
+ * which can't go away while we hold the lock, so only the vnode the
+ * walk ends on gets a reference: one count update for the whole
+ * walk instead of an incref and decref per component.
+ *
+ * Returns the number of components consumed. If that's nonzero, *RET
+ * is the vnode reached, with a reference added, and *PATH is advanced
+ * past the components consumed.
+ */
+unsigned
+vfs_cache_walk(struct vnode *dir, char **path, struct vnode **ret)
+{
+	struct ncentry *nc;
+	char name[NCACHE_NAMELEN + 1];
+	char *s, *slash;
+	size_t len;
+	unsigned count;
+
+	s = *path;
+	count = 0;
+
+	spinlock_acquire(&ncache_lock);
+	while ((slash = strchr(s, '/')) != NULL) {
+		len = slash - s;
+		if (len > NCACHE_NAMELEN) {
+			break;
+		}
+		memcpy(name, s, len);
+		name[len] = 0;
+		nc = ncache_find(dir, name, ncache_hashname(dir, name));
+		if (nc == NULL || nc->nc_vn == NULL) {
+			break;
+		}
+		ncache_lru_front(nc);
+		dir = nc->nc_vn;
+		s = slash + 1;
+		count++;
+	}
+	if (count > 0) {
+		VOP_INCREF(dir);
+		*ret = dir;
+		*path = s;
+	}
+	spinlock_release(&ncache_lock);
+	if (count > 0) {
+		percpu_counter_add(&ncache_hits, count);
+	}
+	return count;
+}
+
+/*
+ * Remember that NAME in directory DIR is VN, or doesn't exist if VN
+ * is NULL. Takes its own references. Never drops the last reference
+ * to anything, so it's safe to call with vnode locks held.
+ */
+void
+vfs_cache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *nc;
+	uint32_t hash;
+
+	if (strlen(name) > NCACHE_NAMELEN ||
+	    !strcmp(name, ".") || !strcmp(name, "..")) {
+		return;
+	}
+	hash = ncache_hashname(dir, name);
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&ncache_lock);
+	nc = ncache_find(dir, name, hash);
+	if (nc != NULL) {
+		/*
+		 * Someone else got here first. Since entries only
+		 * change with the directory locked, it's the same
+		 * answer; drop the extra references. (The caller has
+		 * its own, so this isn't the last one.)
+		 */
+		KASSERT(nc->nc_vn == vn);
+		ncache_lru_front(nc);
+		spinlock_release(&ncache_lock);
+		ncache_release(dir, vn);
+		return;
+	}
+	nc = ncache_lrutail;
+	if (nc->nc_dir != NULL) {
+		/* Full, and we can't safely evict anything here. */
+		spinlock_release(&ncache_lock);
+		ncache_release(dir, vn);
+		return;
+	}
+	nc->nc_hash = hash;
+	strcpy(nc->nc_name, name);
+	nc->nc_hashnext = ncache_hash[hash % NCACHE_HASHSIZE];
+	ncache_hash[hash % NCACHE_HASHSIZE] = nc;
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	ncache_lru_front(nc);
+	spinlock_release(&ncache_lock);
+}
+
+/*
+ * Forget NAME in directory DIR.
+ */
+void
+vfs_cache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) > NCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&ncache_lock);
+	nc = ncache_find(dir, name, ncache_hashname(dir, name));
+	if (nc != NULL) {
+		ncache_drop(nc, &olddir, &oldvn);
+	}
+	spinlock_release(&ncache_lock);
+
+	ncache_release(olddir, oldvn);
+}
+
+/*
+ * Forget everything for which MATCH returns true, one entry at a time
+ * so the references can be dropped without the lock held.
+ */
+static
+void
+ncache_purge(bool (*match)(struct ncentry *, const void *), const void *arg)
+{
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	for (i=0; i<NCACHE_SIZE; i++) {
+		olddir = oldvn = NULL;
+		spinlock_acquire(&ncache_lock);
+		if (ncache_entries[i].nc_dir != NULL &&
+		    match(&ncache_entries[i], arg)) {
+			ncache_drop(&ncache_entries[i], &olddir, &oldvn);
+		}
+		spinlock_release(&ncache_lock);
+		ncache_release(olddir, oldvn);
+	}
+}
+
+static
+bool
+ncache_matchdir(struct ncentry *nc, const void *dir)
+{
+	return nc->nc_dir == dir;
+}
+
+static
+bool
+ncache_matchfs(struct ncentry *nc, const void *fs)
+{
+	return nc->nc_dir->vn_fs == fs;
+}
+
+/*
+ * Forget all names in directory DIR (which is being removed).
+ */
+void
+vfs_cache_purgedir(struct vnode *dir)
+{
+	ncache_purge(ncache_matchdir, dir);
+}
+
+/*
+ * Forget everything on file system FS (which is being unmounted).
+ */
+void
+vfs_cache_purgefs(struct fs *fs)
+{
+	ncache_purge(ncache_matchfs, fs);
+}
+
+/*
+ * Print the statistics. (For the "buf" menu command.)
+ */
+void
+vfs_cache_printstats(void)
+{
+	unsigned hits, neghits, misses, inuse, i;
+
+	hits = percpu_counter_read(&ncache_hits);
+	neghits = percpu_counter_read(&ncache_neghits);
+	misses = percpu_counter_read(&ncache_misses);
+
+	inuse = 0;
+	spinlock_acquire(&ncache_lock);
+	for (i=0; i<NCACHE_SIZE; i++) {
+		if (ncache_entries[i].nc_dir != NULL) {
+			inuse++;
+		}
+	}
+	spinlock_release(&ncache_lock);
+
+	kprintf("Name cache: %u of %u entries in use\n", inuse, NCACHE_SIZE);
+	kprintf("   %u hits, %u negative hits, %u misses\n",
+		hits, neghits, misses);
+}
@@ -83,21 +83,21 @@ vopfail_uio_nosys(struct vnode *vn, struct uio *uio)
 // mmap
 
 int
-vopfail_mmap_isdir(struct vnode *vn /*add stuff */)
+vopfail_mmap_isdir(struct vnode *vn)
 {
 	(void)vn;
 	return EISDIR;
 }
 
 int
-vopfail_mmap_perm(struct vnode *vn /*add stuff */)
+vopfail_mmap_perm(struct vnode *vn)
 {
 	(void)vn;
 	return EPERM;
 }
 
 int
-vopfail_mmap_nosys(struct vnode *vn /*add stuff */)
+vopfail_mmap_nosys(struct vnode *vn)
 {
 	(void)vn;
 	return ENOSYS;
@@ -114,6 +114,50 @@ vopfail_truncate_isdir(struct vnode *vn, off_t pos)
 	return EISDIR;
 }
 
+////////////////////////////////////////////////////////////
+// fallocate
+
+int
+vopfail_fallocate_isdir(struct vnode *vn, off_t pos, off_t len)
+{
+	(void)vn;
+	(void)pos;
+	(void)len;
+	return EISDIR;
+}
+
+int
+vopfail_fallocate_nosys(struct vnode *vn, off_t pos, off_t len)
+{
+	(void)vn;
+	(void)pos;
+	(void)len;
+	return ENOSYS;
+}
+
+////////////////////////////////////////////////////////////
+// seekhole
+
+int
+vopfail_seekhole_isdir(struct vnode *vn, off_t pos, bool data, off_t *ret)
+{
+	(void)vn;
+	(void)pos;
+	(void)data;
+	(void)ret;
+	return EISDIR;
+}
+
+int
+vopfail_seekhole_nosys(struct vnode *vn, off_t pos, bool data, off_t *ret)
+{
+	(void)vn;
+	(void)pos;
+	(void)data;
+	(void)ret;
+	return ENOSYS;
+}
+
 ////////////////////////////////////////////////////////////
 // creat
 
@@ -37,6 +37,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kheaptag.h>
 #include <array.h>
 #include <synch.h>
 #include <vfs.h>
@@ -60,6 +61,15 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem.
  *
+ * kd_auxof   - If kd_fs is AUX_FS, the filesystem using this device.
+ *
+ * kd_root    - If kd_fs is a real filesystem, its root vnode, once
+ *              someone has asked for it; NULL otherwise. The
+ *              reference is dropped when the filesystem is unmounted.
+ *
+ * kd_names   - Entries in the name hash table for kd_name, kd_rawname,
+ *              and the volume name of kd_fs, for those that exist.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -74,23 +84,164 @@
  * device, returns the device itself.
  */
 
+/*
+ * Entry in the name hash table. Device names and raw device names
+ * stay for good, since devices are never removed; volume names come
+ * and go as filesystems are mounted and unmounted. The names are all
+ * distinct, as vfs_doadd checks, except that a volume name is not
+ * checked against the names of devices added later.
+ */
+struct kdname {
+	struct kdname *kn_next;		/* next on hash chain */
+	const char *kn_name;		/* the name; NULL if not in table */
+	unsigned kn_hash;		/* hash chain it's on */
+	struct knowndev *kn_kd;		/* device it belongs to */
+};
+
+/* Which of kd_names is which */
+#define KDN_NAME	0
+#define KDN_RAWNAME	1
+#define KDN_VOLNAME	2
+#define KDN_NUM		3
+
 struct knowndev {
 	char *kd_name;
 	char *kd_rawname;
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	struct fs *kd_auxof;
+	struct vnode *kd_root;
+	struct kdname kd_names[KDN_NUM];
 };
 
 /* A placeholder for kd_fs for devices used as swap */
 #define SWAP_FS	((struct fs *)-1)
 
+/*
+ * A placeholder for kd_fs for devices a filesystem mounted elsewhere
+ * uses as well as its own (such as an external journal).
+ */
+#define AUX_FS	((struct fs *)-2)
+
+/*
+ * A placeholder for kd_fs for devices that have been made part of
+ * another device (such as a stripe set). This is permanent.
+ */
+#define MEMBER_FS	((struct fs *)-3)
+
+/* True if kd_fs is a real mounted filesystem. */
+#define KD_HASFS(kd) \
+	((kd)->kd_fs != NULL && (kd)->kd_fs != SWAP_FS && \
+	 (kd)->kd_fs != AUX_FS && (kd)->kd_fs != MEMBER_FS)
+
 DECLARRAY(knowndev, static __UNUSED inline);
 DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 static struct lock *knowndevs_lock;
 
+/* Name hash table; must be a power of 2. Protected by knowndevs_lock. */
+#define KD_HASHSIZE	32
+static struct kdname *knowndevs_hash[KD_HASHSIZE];
+
+/*
+ * Hash a name.
+ */
+static
+unsigned
+kdname_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *name != 0; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619U;
+	}
+	return h % KD_HASHSIZE;
+}
+
+/*
+ * Find the entry for a name. Returns NULL if there isn't one.
+ */
+static
+struct kdname *
+kdname_find(const char *name)
+{
+	struct kdname *kn;
+
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	for (kn = knowndevs_hash[kdname_hash(name)]; kn != NULL;
+	     kn = kn->kn_next) {
+		if (!strcmp(kn->kn_name, name)) {
+			return kn;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Enter NAME as name WHICH of KD. Does nothing if NAME is NULL.
+ */
+static
+void
+kdname_add(struct knowndev *kd, unsigned which, const char *name)
+{
+	struct kdname *kn = &kd->kd_names[which];
+
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+	KASSERT(kn->kn_name == NULL);
+
+	if (name == NULL) {
+		return;
+	}
+	kn->kn_name = name;
+	kn->kn_hash = kdname_hash(name);
+	kn->kn_next = knowndevs_hash[kn->kn_hash];
+	knowndevs_hash[kn->kn_hash] = kn;
+}
+
+/*
+ * Take name WHICH of KD out of the table, if it's there. Doesn't
+ * look at the string, which for a volume name may already be gone.
+ */
+static
+void
+kdname_remove(struct knowndev *kd, unsigned which)
+{
+	struct kdname *kn = &kd->kd_names[which];
+	struct kdname **p;
+
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	if (kn->kn_name == NULL) {
+		return;
+	}
+	for (p = &knowndevs_hash[kn->kn_hash]; *p != kn;
+	     p = &(*p)->kn_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kn->kn_next;
+	kn->kn_next = NULL;
+	kn->kn_name = NULL;
+}
+
+/*
+ * Drop the cached root vnode of a filesystem that's being unmounted.
+ */
+static
+void
+kd_droproot(struct knowndev *kd)
+{
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	if (kd->kd_root != NULL) {
+		VOP_DECREF(kd->kd_root);
+		kd->kd_root = NULL;
+	}
+}
+
 /*
  * Setup function
  */
@@ -107,8 +258,14 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs lock\n");
 	}
 
+	kheap_tag_init(&vnode_heaptag, "vnode");
+
 	vfs_initbootfs();
+	vfs_cache_bootstrap();
 	devnull_create();
+	devbufstat_create();
+	devdiskstat_create();
+	devschedstat_create();
 	semfs_bootstrap();
 }
 
@@ -126,7 +283,7 @@ vfs_sync(void)
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS) {
+		if (KD_HASFS(dev)) {
 			/*result =*/ FSOP_SYNC(dev->kd_fs);
 		}
 	}
@@ -139,87 +296,83 @@ vfs_sync(void)
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
+ *
+ * The name is looked up in the hash table, and the root of a mounted
+ * filesystem is remembered after the first time, so this doesn't
+ * depend on how many devices there are.
  */
 int
 vfs_getroot(const char *devname, struct vnode **ret)
 {
+	struct kdname *kn;
 	struct knowndev *kd;
-	unsigned i, num;
+	unsigned which;
 	int error;
 
 	lock_acquire(knowndevs_lock);
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
+	kn = kdname_find(devname);
+	if (kn == NULL) {
+		/* The device specified by devname doesn't exist. */
+		lock_release(knowndevs_lock);
+		return ENODEV;
+	}
+	kd = kn->kn_kd;
+	which = kn - kd->kd_names;
+
+	/*
+	 * If DEVNAME names the raw device, return the device itself.
+	 */
+	if (which == KDN_RAWNAME) {
+		KASSERT(kd->kd_device != NULL);
+		VOP_INCREF(kd->kd_vnode);
+		*ret = kd->kd_vnode;
+		lock_release(knowndevs_lock);
+		return 0;
+	}
 
-		/*
-		 * If this device has a mounted filesystem, and
-		 * DEVNAME names either the filesystem or the device,
-		 * return the root of the filesystem.
-		 *
-		 * If it has no mounted filesystem, it's mountable,
-		 * and DEVNAME names the device, return ENXIO.
-		 */
-
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
-			const char *volname;
-			volname = FSOP_GETVOLNAME(kd->kd_fs);
-
-			if (!strcmp(kd->kd_name, devname) ||
-			    (volname!=NULL && !strcmp(volname, devname))) {
-				error = FSOP_GETROOT(kd->kd_fs, ret);
+	/*
+	 * If this device has a mounted filesystem, and DEVNAME names
+	 * either the filesystem or the device, return the root of the
+	 * filesystem.
+	 */
+	if (KD_HASFS(kd)) {
+		if (kd->kd_root == NULL) {
+			error = FSOP_GETROOT(kd->kd_fs, &kd->kd_root);
+			if (error) {
+				kd->kd_root = NULL;
 				lock_release(knowndevs_lock);
 				return error;
 			}
 		}
-		else {
-			if (kd->kd_rawname!=NULL &&
-			    !strcmp(kd->kd_name, devname)) {
-			    lock_release(knowndevs_lock);
-				return ENXIO;
-			}
-		}
-
-		/*
-		 * If DEVNAME names the device, and we get here, it
-		 * must have no fs and not be mountable. In this case,
-		 * we return the device itself.
-		 */
-		if (!strcmp(kd->kd_name, devname)) {
-			KASSERT(kd->kd_fs==NULL);
-			KASSERT(kd->kd_rawname==NULL);
-			KASSERT(kd->kd_device != NULL);
-			VOP_INCREF(kd->kd_vnode);
-			*ret = kd->kd_vnode;
-			lock_release(knowndevs_lock);
-			return 0;
-		}
+		VOP_INCREF(kd->kd_root);
+		*ret = kd->kd_root;
+		lock_release(knowndevs_lock);
+		return 0;
+	}
 
-		/*
-		 * If the device has a rawname and DEVNAME names that,
-		 * return the device itself.
-		 */
-		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
-			KASSERT(kd->kd_device != NULL);
-			VOP_INCREF(kd->kd_vnode);
-			*ret = kd->kd_vnode;
-			lock_release(knowndevs_lock);
-			return 0;
-		}
+	/* Volume names are only in the table while mounted. */
+	KASSERT(which == KDN_NAME);
 
-		/*
-		 * If none of the above tests matched, we didn't name
-		 * any of the names of this device, so go on to the
-		 * next one.
-		 */
+	/*
+	 * If it has no mounted filesystem, it's mountable, and
+	 * DEVNAME names the device, return ENXIO.
+	 */
+	if (kd->kd_rawname != NULL) {
+		lock_release(knowndevs_lock);
+		return ENXIO;
 	}
 
 	/*
-	 * If we got here, the device specified by devname doesn't exist.
+	 * Otherwise it must have no fs and not be mountable. In this
+	 * case, we return the device itself.
 	 */
+	KASSERT(kd->kd_fs==NULL);
+	KASSERT(kd->kd_device != NULL);
+	VOP_INCREF(kd->kd_vnode);
+	*ret = kd->kd_vnode;
 	lock_release(knowndevs_lock);
-	return ENODEV;
+	return 0;
 }
 
 /*
@@ -273,33 +426,6 @@ mkrawname(const char *name)
 }
 
 
-/*
- * Check if the two strings passed in are the same, if they're both
- * not NULL (the latter part being significant).
- */
-static
-inline
-int
-samestring(const char *a, const char *b)
-{
-	if (a==NULL || b==NULL) {
-		return 0;
-	}
-	return !strcmp(a, b);
-}
-
-/*
- * Check if the first string passed is the same as any of the three others,
- * if they're not NULL.
- */
-static
-inline
-int
-samestring3(const char *a, const char *b, const char *c, const char *d)
-{
-	return samestring(a,b) || samestring(a,c) || samestring(a,d);
-}
-
 /*
  * Check if any of the three names passed in already exists as a device
  * name.
@@ -309,30 +435,11 @@ static
 int
 badnames(const char *n1, const char *n2, const char *n3)
 {
-	const char *volname;
-	unsigned i, num;
-	struct knowndev *kd;
-
 	KASSERT(lock_do_i_hold(knowndevs_lock));
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
-
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
-			volname = FSOP_GETVOLNAME(kd->kd_fs);
-			if (samestring3(volname, n1, n2, n3)) {
-				return 1;
-			}
-		}
-
-		if (samestring3(kd->kd_rawname, n1, n2, n3) ||
-		    samestring3(kd->kd_name, n1, n2, n3)) {
-			return 1;
-		}
-	}
-
-	return 0;
+	return (n1 != NULL && kdname_find(n1) != NULL) ||
+		(n2 != NULL && kdname_find(n2) != NULL) ||
+		(n3 != NULL && kdname_find(n3) != NULL);
 }
 
 /*
@@ -350,7 +457,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	struct knowndev *kd=NULL;
 	struct vnode *vnode=NULL;
 	const char *volname=NULL;
-	unsigned index;
+	unsigned index, i;
 	int result;
 
 	name = kstrdup(dname);
@@ -383,6 +490,13 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_auxof = NULL;
+	kd->kd_root = NULL;
+	for (i=0; i<KDN_NUM; i++) {
+		kd->kd_names[i].kn_next = NULL;
+		kd->kd_names[i].kn_name = NULL;
+		kd->kd_names[i].kn_kd = kd;
+	}
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -405,6 +519,10 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
+	kdname_add(kd, KDN_NAME, name);
+	kdname_add(kd, KDN_RAWNAME, rawname);
+	kdname_add(kd, KDN_VOLNAME, volname);
+
 	lock_release(knowndevs_lock);
 	return 0;
 
@@ -459,27 +577,19 @@ static
 int
 findmount(const char *devname, struct knowndev **result)
 {
-	struct knowndev *dev;
-	unsigned i, num;
-	bool found = false;
+	struct kdname *kn;
 
 	KASSERT(lock_do_i_hold(knowndevs_lock));
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; !found && i<num; i++) {
-		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_rawname==NULL) {
-			/* not mountable/unmountable */
-			continue;
-		}
-
-		if (!strcmp(devname, dev->kd_name)) {
-			*result = dev;
-			found = true;
-		}
+	kn = kdname_find(devname);
+	if (kn == NULL || kn != &kn->kn_kd->kd_names[KDN_NAME] ||
+	    kn->kn_kd->kd_rawname == NULL) {
+		/* not a device, or not mountable/unmountable */
+		return ENODEV;
 	}
 
-	return found ? 0 : ENODEV;
+	*result = kn->kn_kd;
+	return 0;
 }
 
 /*
@@ -523,6 +633,7 @@ vfs_mount(const char *devname, void *data,
 	kd->kd_fs = fs;
 
 	volname = FSOP_GETVOLNAME(fs);
+	kdname_add(kd, KDN_VOLNAME, volname);
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
@@ -533,6 +644,94 @@ vfs_mount(const char *devname, void *data,
 	return result;
 }
 
+/*
+ * Mount a filesystem that uses a second device, AUXNAME, as well
+ * (e.g. for an external journal). Like vfs_mount, but MOUNTFUNC gets
+ * both devices, and the second one is marked in use until the
+ * filesystem is unmounted.
+ */
+int
+vfs_mount_aux(const char *devname, const char *auxname, void *data,
+	      int (*mountfunc)(void *data, struct device *dev,
+			       struct device *auxdev, struct fs **ret))
+{
+	const char *volname;
+	struct knowndev *kd, *auxkd;
+	struct fs *fs;
+	int result;
+
+	lock_acquire(knowndevs_lock);
+
+	result = findmount(devname, &kd);
+	if (result) {
+		goto fail;
+	}
+	result = findmount(auxname, &auxkd);
+	if (result) {
+		goto fail;
+	}
+	if (kd == auxkd) {
+		result = EINVAL;
+		goto fail;
+	}
+
+	if (kd->kd_fs != NULL || auxkd->kd_fs != NULL) {
+		result = EBUSY;
+		goto fail;
+	}
+	KASSERT(kd->kd_rawname != NULL);
+	KASSERT(kd->kd_device != NULL);
+	KASSERT(auxkd->kd_rawname != NULL);
+	KASSERT(auxkd->kd_device != NULL);
+
+	result = mountfunc(data, kd->kd_device, auxkd->kd_device, &fs);
+	if (result) {
+		goto fail;
+	}
+
+	KASSERT(fs != NULL);
+	KASSERT(fs != SWAP_FS && fs != AUX_FS);
+
+	kd->kd_fs = fs;
+	auxkd->kd_fs = AUX_FS;
+	auxkd->kd_auxof = fs;
+
+	volname = FSOP_GETVOLNAME(fs);
+	kdname_add(kd, KDN_VOLNAME, volname);
+	kprintf("vfs: Mounted %s: on %s (and %s)\n",
+		volname ? volname : kd->kd_name, kd->kd_name,
+		auxkd->kd_name);
+
+	KASSERT(result==0);
+
+ fail:
+	lock_release(knowndevs_lock);
+	return result;
+}
+
+/*
+ * Release any auxiliary devices of FS, after unmounting it.
+ * Should already hold knowndevs_lock.
+ */
+static
+void
+dropaux(struct fs *fs)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_fs == AUX_FS && dev->kd_auxof == fs) {
+			dev->kd_fs = NULL;
+			dev->kd_auxof = NULL;
+		}
+	}
+}
+
 /*
  * Like mount, but for attaching swap. Hands back the raw device
  * vnode. Unlike mount tolerates a trailing colon on the device name,
@@ -585,6 +784,90 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	return result;
 }
 
+/*
+ * Take the mountable devices NAMES[0..NUM-1] for use as parts of
+ * another device (e.g. a stripe set), and hand back their device
+ * objects in RET. Either all of them are taken or none are. After
+ * this they can't be mounted or used for swap on their own. Once the
+ * other device exists this can't be undone; until then, failures can
+ * give them back with vfs_unclaimdevs.
+ */
+int
+vfs_claimdevs(char **names, unsigned num, struct device **ret)
+{
+	struct knowndev *kd, *other;
+	unsigned i, j;
+	int result;
+
+	if (num == 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(knowndevs_lock);
+
+	/* Check them all first */
+	for (i=0; i<num; i++) {
+		result = findmount(names[i], &kd);
+		if (result) {
+			goto out;
+		}
+		if (kd->kd_fs != NULL) {
+			result = EBUSY;
+			goto out;
+		}
+		for (j=0; j<i; j++) {
+			result = findmount(names[j], &other);
+			KASSERT(result == 0);
+			if (other == kd) {
+				/* named twice */
+				result = EINVAL;
+				goto out;
+			}
+		}
+		KASSERT(kd->kd_rawname != NULL);
+		KASSERT(kd->kd_device != NULL);
+	}
+
+	for (i=0; i<num; i++) {
+		result = findmount(names[i], &kd);
+		KASSERT(result == 0);
+		kd->kd_fs = MEMBER_FS;
+		ret[i] = kd->kd_device;
+	}
+
+ out:
+	lock_release(knowndevs_lock);
+	return result;
+}
+
+/*
+ * Give back the devices DEVS[0..NUM-1] claimed by vfs_claimdevs, for
+ * when the device they were to be parts of couldn't be set up.
+ */
+void
+vfs_unclaimdevs(struct device **devs, unsigned num)
+{
+	struct knowndev *kd;
+	unsigned i, j, numkd;
+
+	lock_acquire(knowndevs_lock);
+
+	numkd = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		for (j=0; j<numkd; j++) {
+			kd = knowndevarray_get(knowndevs, j);
+			if (kd->kd_device == devs[i]) {
+				KASSERT(kd->kd_fs == MEMBER_FS);
+				kd->kd_fs = NULL;
+				break;
+			}
+		}
+		KASSERT(j < numkd);
+	}
+
+	lock_release(knowndevs_lock);
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -603,13 +886,17 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
-	if (kd->kd_fs == NULL || kd->kd_fs == SWAP_FS) {
+	if (!KD_HASFS(kd)) {
 		result = EINVAL;
 		goto fail;
 	}
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* the name cache holds vnodes; let go of them */
+	vfs_cache_purgefs(kd->kd_fs);
+	kd_droproot(kd);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -624,6 +911,8 @@ vfs_unmount(const char *devname)
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
 
 	/* now drop the filesystem */
+	kdname_remove(kd, KDN_VOLNAME);
+	dropaux(kd->kd_fs);
 	kd->kd_fs = NULL;
 
 	KASSERT(result==0);
@@ -698,9 +987,20 @@ vfs_unmountall(void)
 			dev->kd_fs = NULL;
 			continue;
 		}
+		if (dev->kd_fs == AUX_FS) {
+			/* dropped along with the fs using it */
+			continue;
+		}
+		if (dev->kd_fs == MEMBER_FS) {
+			/* belongs to another device for good */
+			continue;
+		}
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_cache_purgefs(dev->kd_fs);
+		kd_droproot(dev);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -733,6 +1033,8 @@ vfs_unmountall(void)
 		}
 
 		/* now drop the filesystem */
+		kdname_remove(dev, KDN_VOLNAME);
+		dropaux(dev->kd_fs);
 		dev->kd_fs = NULL;
 	}
 
@@ -32,11 +32,16 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <lib.h>
-#include <synch.h>
+#include <atomic.h>
+#include <kheaptag.h>
 #include <vfs.h>
 #include <vnode.h>
 
+/* Set up by vfs_bootstrap. */
+struct kheap_tag vnode_heaptag;
+
 /*
  * Initialize an abstract vnode.
  */
@@ -49,7 +54,6 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
-	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -63,8 +67,6 @@ vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount == 1);
 
-	spinlock_cleanup(&vn->vn_countlock);
-
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_fs = NULL;
@@ -81,9 +83,32 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	spinlock_acquire(&vn->vn_countlock);
-	vn->vn_refcount++;
-	spinlock_release(&vn->vn_countlock);
+	atomic_add(&vn->vn_refcount, 1);
+}
+
+/*
+ * Drop one reference unless it's the last one. Returns true if it
+ * is. Called by VOP_RECLAIM, and by vnode_decref to decide whether
+ * to call VOP_RECLAIM.
+ */
+bool
+vnode_lastref(struct vnode *vn)
+{
+	unsigned count, prev;
+
+	KASSERT(vn != NULL);
+
+	count = vn->vn_refcount;
+	while (count > 1) {
+		prev = atomic_cas(&vn->vn_refcount, count, count - 1);
+		if (prev == count) {
+			return false;
+		}
+		/* Changed under us; try again with the new value. */
+		count = prev;
+	}
+	KASSERT(count == 1);
+	return true;
 }
 
 /*
@@ -94,25 +119,10 @@ vnode_incref(struct vnode *vn)
 void
 vnode_decref(struct vnode *vn)
 {
-	bool destroy;
 	int result;
 
-	KASSERT(vn != NULL);
-
-	spinlock_acquire(&vn->vn_countlock);
-
-	KASSERT(vn->vn_refcount > 0);
-	if (vn->vn_refcount > 1) {
-		vn->vn_refcount--;
-		destroy = false;
-	}
-	else {
+	if (vnode_lastref(vn)) {
 		/* Don't decrement; pass the reference to VOP_RECLAIM. */
-		destroy = true;
-	}
-	spinlock_release(&vn->vn_countlock);
-
-	if (destroy) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -122,6 +132,20 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+/*
+ * VOP_POLL for objects that never block: whatever was asked for is
+ * ready, and there's nothing to wait on.
+ */
+int
+vnode_poll_ready(struct vnode *vn, int events, struct pollset *ps,
+		 int *revents)
+{
+	(void)vn;
+	(void)ps;
+	*revents = events & (POLLIN | POLLOUT);
+	return 0;
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
@@ -129,6 +153,8 @@ vnode_decref(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
+	unsigned count;
+
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -156,19 +182,16 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
-	spinlock_acquire(&v->vn_countlock);
-
-	if (v->vn_refcount < 0) {
-		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
-		      v->vn_refcount);
-	}
-	else if (v->vn_refcount == 0) {
+	count = v->vn_refcount;
+	if (count == 0) {
 		panic("vnode_check: vop_%s: zero refcount\n", opstr);
 	}
-	else if (v->vn_refcount > 0x100000) {
-		kprintf("vnode_check: vop_%s: warning: large refcount %d\n",
-			opstr, v->vn_refcount);
+	else if (count >= 0x80000000) {
+		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
+		      (int)count);
+	}
+	else if (count > 0x100000) {
+		kprintf("vnode_check: vop_%s: warning: large refcount %u\n",
+			opstr, count);
 	}
-
-	spinlock_release(&v->vn_countlock);
 }
@@ -29,8 +29,19 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <membar.h>
+#include <synch.h>
+#include <current.h>
 #include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <vnode.h>
 #include <vm.h>
 #include <proc.h>
 
@@ -50,28 +61,128 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_heaptop = 0;
+	tlb_context_init(&as->as_tlbctx);
+	as->as_loading = false;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
 
+static
+int
+as_addregion(struct addrspace *as, vaddr_t base, size_t npages,
+	     unsigned perms)
+{
+	struct vm_region *vr;
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	vr->vr_base = base;
+	vr->vr_npages = npages;
+	vr->vr_perms = perms;
+	vr->vr_vnode = NULL;
+	vr->vr_offset = 0;
+	vr->vr_filesize = 0;
+	vr->vr_shared = false;
+	vr->vr_nextfault = base;
+	vr->vr_next = as->as_regions;
+	as->as_regions = vr;
+	return 0;
+}
+
+/*
+ * Set the file a new region (from as_addregion) maps.
+ */
+static
+void
+as_setfile(struct vm_region *vr, struct vnode *vn, off_t offset,
+	   size_t filesize, bool shared)
+{
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	vr->vr_vnode = vn;
+	vr->vr_offset = offset;
+	vr->vr_filesize = filesize;
+	vr->vr_shared = shared;
+}
+
+/*
+ * Free a region that's no longer in any address space, writing back
+ * what was written through it first.
+ */
+static
+void
+as_freeregion(struct vm_region *vr)
+{
+	if (vr->vr_vnode != NULL) {
+		if (vr->vr_shared) {
+			pagecache_flush(vr->vr_vnode);
+		}
+		VOP_DECREF(vr->vr_vnode);
+	}
+	kfree(vr);
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct vm_region *vr;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next) {
+		result = as_addregion(newas, vr->vr_base, vr->vr_npages,
+				      vr->vr_perms);
+		if (result) {
+			as_destroy(newas);
+			return result;
+		}
+		as_setfile(newas->as_regions, vr->vr_vnode, vr->vr_offset,
+			   vr->vr_filesize, vr->vr_shared);
+		if (vr == old->as_heap) {
+			newas->as_heap = newas->as_regions;
+		}
+	}
+	newas->as_heaptop = old->as_heaptop;
+
 	/*
-	 * Write this.
+	 * Share the pages copy-on-write. This write-protects them in
+	 * the old address space too, so its TLB entries have to go,
+	 * here and on any other cpu running it.
 	 */
-
-	(void)old;
+	pt_destroy(newas->as_pt);
+	newas->as_pt = NULL;
+	lock_acquire(old->as_lock);
+	result = pt_copy(old->as_pt, &newas->as_pt);
+	if (result == 0) {
+		as_shootdown(old, 0, TLBSHOOTDOWN_ALL);
+	}
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
 
 	*ret = newas;
 	return 0;
@@ -80,10 +191,25 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	struct vm_region *vr;
+
 	/*
-	 * Clean up as needed.
+	 * Hold the lock while the pages go, so the pageout daemon,
+	 * which only ever tries for it, leaves them alone.
 	 */
+	if (as->as_pt != NULL) {
+		lock_acquire(as->as_lock);
+		pt_destroy(as->as_pt);
+		as->as_pt = NULL;
+		lock_release(as->as_lock);
+	}
 
+	while (as->as_regions != NULL) {
+		vr = as->as_regions;
+		as->as_regions = vr->vr_next;
+		as_freeregion(vr);
+	}
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -91,6 +217,7 @@ void
 as_activate(void)
 {
 	struct addrspace *as;
+	int spl;
 
 	as = proc_getas();
 	if (as == NULL) {
@@ -102,18 +229,32 @@ as_activate(void)
 	}
 
 	/*
-	 * Write this.
+	 * Switch to the address space's ID; the TLB keeps whatever
+	 * translations it still has under it. Publish the new address
+	 * space first, so a shootdown broadcast either reaches us or
+	 * dropped the ID before we look at it. See tlb_context_drop.
 	 */
+	spl = splhigh();
+	curcpu->c_tlbas = as;
+	membar_any_any();
+	tlb_context_switch(&as->as_tlbctx);
+	splx(spl);
 }
 
 void
 as_deactivate(void)
 {
+	int spl;
+
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * The address space is about to go away (see proc.c). Its
+	 * translations can stay in the TLB: its ID isn't handed out
+	 * again on this cpu until the TLB has been flushed.
 	 */
+	spl = splhigh();
+	curcpu->c_tlbas = NULL;
+	tlb_context_none();
+	splx(spl);
 }
 
 /*
@@ -122,61 +263,578 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * outside a writeable segment fault; MIPS can't enforce the other
+ * two, so they're only recorded.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
+	vaddr_t top;
+	unsigned perms;
+
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	/* Align the region to whole pages. */
+	top = ROUNDUP(vaddr + memsize, PAGE_SIZE);
+	vaddr &= PAGE_FRAME;
+
+	perms = 0;
+	if (readable) {
+		perms |= VR_READ;
+	}
+	if (writeable) {
+		perms |= VR_WRITE;
+	}
+	if (executable) {
+		perms |= VR_EXEC;
+	}
+
+	return as_addregion(as, vaddr, (top - vaddr) / PAGE_SIZE, perms);
+}
+
+/*
+ * The segment is mapped from the file at its page-aligned base, so it
+ * must lie at the same offset within a page in the file as in memory.
+ * The bytes before VADDR in the first page and after the file part in
+ * the last aren't the segment's, so no other region may share them.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+	       struct vnode *vn, off_t offset, size_t filesize)
+{
+	struct vm_region *vr, *other;
+	size_t skew;
+
+	skew = vaddr % PAGE_SIZE;
+	if (offset < 0 || offset % PAGE_SIZE != (off_t)skew) {
+		return EINVAL;
+	}
+	if (filesize > memsize) {
+		filesize = memsize;
+	}
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_base == vaddr - skew && vr->vr_vnode == NULL &&
+		    vr->vr_npages == DIVROUNDUP(memsize + skew, PAGE_SIZE)) {
+			break;
+		}
+	}
+	if (vr == NULL) {
+		return EINVAL;
+	}
+	for (other = as->as_regions; other != NULL; other = other->vr_next) {
+		if (other != vr &&
+		    other->vr_base < vr->vr_base + vr->vr_npages * PAGE_SIZE &&
+		    vr->vr_base < other->vr_base +
+		    other->vr_npages * PAGE_SIZE) {
+			return EINVAL;
+		}
+	}
+
 	/*
-	 * Write this.
+	 * A read-only segment without bss can take its last page
+	 * straight from the file as well, so all of it is shared; the
+	 * rest of that page is just more of the file.
 	 */
+	filesize += skew;
+	if ((vr->vr_perms & VR_WRITE) == 0 && filesize == memsize + skew) {
+		filesize = ROUNDUP(filesize, PAGE_SIZE);
+	}
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+	as_setfile(vr, vn, offset - skew, filesize, false);
+	return 0;
 }
 
+/*
+ * Regions can share a page at their edges (text ending where data
+ * starts); such a page gets the union of their permissions.
+ */
+unsigned
+as_getperms(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+	unsigned perms;
+
+	perms = 0;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vaddr >= vr->vr_base &&
+		    vaddr - vr->vr_base < vr->vr_npages * PAGE_SIZE) {
+			perms |= vr->vr_perms;
+		}
+	}
+	return perms;
+}
+
+struct vm_region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vaddr >= vr->vr_base &&
+		    vaddr - vr->vr_base < vr->vr_npages * PAGE_SIZE) {
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The time page isn't a region, but nothing else can go there.
+ */
+#if TIMEPAGE_ADDR != USERSTACK - (VM_STACKPAGES + 1) * PAGE_SIZE
+#error "The time page should be just below the stack"
+#endif
+static struct vm_region as_timeregion = {
+	.vr_base = TIMEPAGE_ADDR,
+	.vr_npages = 1,
+	.vr_perms = VR_READ,
+};
+
+/*
+ * Return a region that overlaps LEN bytes at VADDR, or NULL.
+ */
+static
+struct vm_region *
+as_overlap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_region *vr;
+
+	if (TIMEPAGE_ADDR < vaddr + len && vaddr < TIMEPAGE_ADDR + PAGE_SIZE) {
+		return &as_timeregion;
+	}
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_base < vaddr + len &&
+		    vaddr < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the highest free LEN bytes below the stack and the time page,
+ * which is just under it. Each region in the
+ * way moves the top down to its base, so this ends.
+ */
+static
 int
-as_prepare_load(struct addrspace *as)
+as_findspace(struct addrspace *as, size_t len, vaddr_t *ret)
+{
+	struct vm_region *vr;
+	vaddr_t top;
+
+	top = TIMEPAGE_ADDR;
+	while (top > len) {
+		vr = as_overlap(as, top - len, len);
+		if (vr == NULL) {
+			*ret = top - len;
+			return 0;
+		}
+		top = vr->vr_base;
+	}
+	return ENOMEM;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t *vaddr, size_t npages,
+	unsigned perms, bool fixed, struct vnode *vn, off_t offset,
+	bool shared)
 {
+	vaddr_t base;
+	size_t len;
+	int result;
+
+	if (npages == 0 || npages > USERSPACETOP / PAGE_SIZE) {
+		return EINVAL;
+	}
+	len = npages * PAGE_SIZE;
+
+	lock_acquire(as->as_lock);
+	if (fixed) {
+		base = *vaddr;
+		if (base % PAGE_SIZE != 0 || base == 0 ||
+		    base >= USERSPACETOP || len > USERSPACETOP - base ||
+		    as_overlap(as, base, len) != NULL) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+	}
+	else {
+		result = as_findspace(as, len, &base);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+
+	result = as_addregion(as, base, npages, perms);
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+	as_setfile(as->as_regions, vn, offset, vn != NULL ? len : 0,
+		   shared);
+	lock_release(as->as_lock);
+
+	*vaddr = base;
+	return 0;
+}
+
+/*
+ * Drop the NPAGES pages at VADDR, with the address space lock held.
+ * Faults wait for the lock, so once the TLBs are flushed nothing can
+ * reach the pages any more and they can go.
+ */
+static
+void
+as_droppages(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	pte_t *pte;
+	size_t i;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	as_shootdown(as, vaddr, npages);
+	for (i=0; i<npages; i++) {
+		pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE, false);
+		if (pte == NULL) {
+			continue;
+		}
+		if (*pte & PTE_VALID) {
+			coremap_free(*pte & PTE_FRAME);
+		}
+		else if (*pte & PTE_SWAP) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		*pte = 0;
+	}
+}
+
+/*
+ * How much of VR's file part is left after its first SKIP bytes.
+ */
+static
+size_t
+as_filetail(struct vm_region *vr, size_t skip)
+{
+	return vr->vr_filesize > skip ? vr->vr_filesize - skip : 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct vm_region *vr, **vrp, *spare, *dead;
+	vaddr_t end, vrend;
+
+	if (vaddr % PAGE_SIZE != 0 || npages == 0 || vaddr >= USERSPACETOP ||
+	    npages > (USERSPACETOP - vaddr) / PAGE_SIZE) {
+		return EINVAL;
+	}
+	end = vaddr + npages * PAGE_SIZE;
+
+	/* Unmapping the middle of a region splits it in two. */
+	spare = kmalloc(sizeof(*spare));
+	if (spare == NULL) {
+		return ENOMEM;
+	}
+	dead = NULL;
+
+	lock_acquire(as->as_lock);
+	if (as->as_heap != NULL && as->as_heap->vr_base < end &&
+	    vaddr < as->as_heap->vr_base + as->as_heap->vr_npages * PAGE_SIZE) {
+		/* the heap only shrinks through sbrk */
+		lock_release(as->as_lock);
+		kfree(spare);
+		return EINVAL;
+	}
+	as_droppages(as, vaddr, npages);
+
+	vrp = &as->as_regions;
+	while ((vr = *vrp) != NULL) {
+		vrend = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (vrend <= vaddr || vr->vr_base >= end) {
+			/* untouched */
+			vrp = &vr->vr_next;
+		}
+		else if (vr->vr_base >= vaddr && vrend <= end) {
+			/* all of it goes */
+			*vrp = vr->vr_next;
+			vr->vr_next = dead;
+			dead = vr;
+		}
+		else if (vr->vr_base < vaddr && vrend > end) {
+			/*
+			 * The tail becomes a new region. Regions only
+			 * overlap at an edge page, so this happens once.
+			 */
+			KASSERT(spare != NULL);
+			*spare = *vr;
+			as_setfile(spare, vr->vr_vnode,
+				   vr->vr_offset + (end - vr->vr_base),
+				   as_filetail(vr, end - vr->vr_base),
+				   vr->vr_shared);
+			spare->vr_base = end;
+			spare->vr_nextfault = end;
+			spare->vr_npages = (vrend - end) / PAGE_SIZE;
+			vr->vr_npages = (vaddr - vr->vr_base) / PAGE_SIZE;
+			vr->vr_next = spare;
+			vrp = &spare->vr_next;
+			spare = NULL;
+		}
+		else if (vr->vr_base < vaddr) {
+			/* the end goes */
+			vr->vr_npages = (vaddr - vr->vr_base) / PAGE_SIZE;
+			vrp = &vr->vr_next;
+		}
+		else {
+			/* the start goes */
+			vr->vr_filesize = as_filetail(vr, end - vr->vr_base);
+			vr->vr_offset += end - vr->vr_base;
+			vr->vr_npages = (vrend - end) / PAGE_SIZE;
+			vr->vr_base = end;
+			vrp = &vr->vr_next;
+		}
+	}
+	lock_release(as->as_lock);
+
+	/* Writing back can sleep for a while; not with the lock held. */
+	while (dead != NULL) {
+		vr = dead;
+		dead = vr->vr_next;
+		as_freeregion(vr);
+	}
+	if (spare != NULL) {
+		kfree(spare);
+	}
+	return 0;
+}
+
+void
+as_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown ts;
+	unsigned i;
+	int spl;
+
 	/*
-	 * Write this.
+	 * Stay on this cpu while checking what it has loaded. Other
+	 * cpus (and this one, if it's not running AS) may still hold
+	 * translations under AS's ID there, so those IDs go; the cpus
+	 * running it now are sent the shootdown.
 	 */
+	spl = splhigh();
+	if (curcpu->c_tlbas == as && npages != TLBSHOOTDOWN_ALL) {
+		tlb_context_drop(&as->as_tlbctx, true);
+		for (i=0; i<npages; i++) {
+			tlb_unload(vaddr + i * PAGE_SIZE);
+		}
+	}
+	else {
+		tlb_context_drop(&as->as_tlbctx, false);
+		if (curcpu->c_tlbas == as) {
+			/* A new ID is cheaper than flushing everything. */
+			tlb_context_switch(&as->as_tlbctx);
+		}
+	}
+	splx(spl);
+
+	ts.ts_as = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = npages;
+	ipi_tlbshootdown_broadcast(&ts);
+}
 
-	(void)as;
+/*
+ * While loading, every region is writeable, so load_elf can copy the
+ * image into read-only segments.
+ */
+int
+as_prepare_load(struct addrspace *as)
+{
+	as->as_loading = true;
 	return 0;
 }
 
+/*
+ * Loading is done: take write permission back from the pages of
+ * read-only regions, and drop any TLB entries that still allow it.
+ * The heap starts out empty at the first page above the image.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+	struct vm_region *vr;
+	vaddr_t va, heapbase;
+	pte_t *pte;
+	size_t i;
+	int result;
 
-	(void)as;
+	lock_acquire(as->as_lock);
+	as->as_loading = false;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_perms & VR_WRITE) {
+			continue;
+		}
+		for (i=0; i<vr->vr_npages; i++) {
+			va = vr->vr_base + i * PAGE_SIZE;
+			if (as_getperms(as, va) & VR_WRITE) {
+				continue;
+			}
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte != NULL) {
+				*pte &= ~PTE_WRITE;
+			}
+		}
+	}
+
+	KASSERT(as->as_heap == NULL);
+	heapbase = 0;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		va = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (va > heapbase) {
+			heapbase = va;
+		}
+	}
+	result = as_addregion(as, heapbase, 0, VR_READ | VR_WRITE);
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+	as->as_heap = as->as_regions;
+	as->as_heaptop = heapbase;
+	lock_release(as->as_lock);
+
+	tlb_flushall();
 	return 0;
 }
 
+/*
+ * Growing the heap only needs the region to get longer; the pages
+ * are zero-filled on first touch like any others. Shrinking it gives
+ * the pages that are no longer in it back.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *ret)
+{
+	struct vm_region *heap, *vr;
+	vaddr_t oldtop, newtop, oldend, newend;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return ENOSYS;
+	}
+
+	lock_acquire(as->as_lock);
+	oldtop = as->as_heaptop;
+	if (amount < 0 && (vaddr_t)-amount > oldtop - heap->vr_base) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	if (amount > 0 && (vaddr_t)amount >= USERSPACETOP - oldtop) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	newtop = oldtop + amount;
+
+	oldend = heap->vr_base + heap->vr_npages * PAGE_SIZE;
+	newend = ROUNDUP(newtop, PAGE_SIZE);
+	if (newend > oldend) {
+		for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+			if (vr != heap && vr->vr_base < newend &&
+			    oldend < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+		}
+		if (oldend <= TIMEPAGE_ADDR && newend > TIMEPAGE_ADDR) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+	}
+	else if (newend < oldend) {
+		as_droppages(as, newend, (oldend - newend) / PAGE_SIZE);
+	}
+	heap->vr_npages = (newend - heap->vr_base) / PAGE_SIZE;
+	as->as_heaptop = newtop;
+	lock_release(as->as_lock);
+
+	*ret = oldtop;
+	return 0;
+}
+
+/*
+ * Taking a reference to the frame keeps it allocated whatever happens
+ * to the mapping, and disowns it, so the pageout daemon leaves it be.
+ * Only resident pages can be lent, so fault the page in and look
+ * again until it stays put.
+ */
+int
+as_loanpage(struct addrspace *as, vaddr_t vaddr, paddr_t *ret)
+{
+	pte_t *pte;
+	int result;
+
+	KASSERT(as == proc_getas());
+	vaddr &= PAGE_FRAME;
+
+	while (1) {
+		lock_acquire(as->as_lock);
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte != NULL && (*pte & PTE_VALID) != 0) {
+			*ret = *pte & PTE_FRAME;
+			coremap_share(*ret);
+			lock_release(as->as_lock);
+			return 0;
+		}
+		lock_release(as->as_lock);
+
+		result = vm_fault(VM_FAULT_READ, vaddr);
+		if (result) {
+			return result;
+		}
+	}
+}
+
+/*
+ * Give back a page lent by as_loanpage. If it's still mapped where it
+ * was and nobody else shares it, it belongs to us again.
+ */
+void
+as_unloanpage(struct addrspace *as, vaddr_t vaddr, paddr_t pa)
+{
+	pte_t *pte;
+
+	vaddr &= PAGE_FRAME;
+
+	lock_acquire(as->as_lock);
+	coremap_free(pa);
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte != NULL && (*pte & PTE_VALID) != 0 &&
+	    (*pte & PTE_FRAME) == pa && coremap_refcount(pa) == 1) {
+		coremap_setowner(pa, as, vaddr);
+	}
+	lock_release(as->as_lock);
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = as_addregion(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+			      VM_STACKPAGES, VR_READ | VR_WRITE);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 
 	return 0;
 }
-
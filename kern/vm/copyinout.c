@@ -34,6 +34,7 @@
 #include <thread.h>
 #include <current.h>
 #include <vm.h>
+#include <uio.h>
 #include <copyinout.h>
 
 /*
@@ -214,6 +215,116 @@ copyout(const void *src, userptr_t userdest, size_t len)
 	return 0;
 }
 
+/*
+ * copyuio
+ *
+ * Move up to N bytes between kernel address PTR and the user buffers
+ * of UIO, the way uiomove does, or if PTR is NULL, fill them with
+ * zeros. The fault recovery is set up once for the whole transfer
+ * instead of once per buffer. The uio is only ever advanced past data
+ * that has actually been moved, and that is done before the next copy
+ * starts, so if a fault occurs it describes exactly what is left,
+ * just as in the copyin/copyout loop.
+ */
+static
+int
+copyuio_common(void *ptr, size_t n, struct uio *uio)
+{
+	char *volatile kptr = ptr;
+	volatile size_t left = n;
+	struct iovec *iov;
+	size_t size, stoplen;
+	int result;
+
+	KASSERT(uio->uio_segflg == UIO_USERSPACE ||
+		uio->uio_segflg == UIO_USERISPACE);
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	while (left > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+		if (size > left) {
+			size = left;
+		}
+
+		if (size == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			if (uio->uio_iovcnt == 0) {
+				panic("copyuio: ran out of buffers\n");
+			}
+			continue;
+		}
+
+		result = copycheck(iov->iov_ubase, size, &stoplen);
+		if (result == 0 && stoplen != size) {
+			result = EFAULT;
+		}
+		if (result) {
+			curthread->t_machdep.tm_badfaultfunc = NULL;
+			return result;
+		}
+
+		if (kptr == NULL) {
+			memset((void *)iov->iov_ubase, 0, size);
+		}
+		else if (uio->uio_rw == UIO_READ) {
+			memcpy((void *)iov->iov_ubase, kptr, size);
+		}
+		else {
+			memcpy(kptr, (const void *)iov->iov_ubase, size);
+		}
+
+		iov->iov_ubase += size;
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		if (kptr != NULL) {
+			kptr += size;
+		}
+		left -= size;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return 0;
+}
+
+int
+copyuio(void *ptr, size_t n, struct uio *uio)
+{
+	KASSERT(ptr != NULL);
+	return copyuio_common(ptr, n, uio);
+}
+
+/*
+ * copyuiozeros
+ *
+ * Fill up to N bytes of the user buffers of UIO, which must be a
+ * read, with zeros, the way uiomovezeros does, with one memset per
+ * buffer under one fault recovery setup.
+ */
+int
+copyuiozeros(size_t n, struct uio *uio)
+{
+	KASSERT(uio->uio_rw == UIO_READ);
+	return copyuio_common(NULL, n, uio);
+}
+
+/*
+ * True if any of the four bytes of W is zero: subtracting one from
+ * each byte only borrows into the top bit of a byte that was zero
+ * (or is the first byte above such a byte), and the ~W mask throws
+ * out bytes whose top bit was already set.
+ */
+#define HASZERO(w) ((((w) - 0x01010101U) & ~(w) & 0x80808080U) != 0)
+
 /*
  * Common string copying function that behaves the way that's desired
  * for copyinstr and copyoutstr.
@@ -235,15 +346,38 @@ int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
-
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	size_t i, limit;
+	uint32_t w;
+
+	limit = maxlen < stoplen ? maxlen : stoplen;
+
+	/*
+	 * Go a byte at a time until the source is word-aligned, then a
+	 * word at a time for as long as a whole word fits and has no
+	 * null in it. An aligned word never straddles a page, so this
+	 * touches no user memory the byte loop wouldn't. The word is
+	 * stored with memcpy because the destination need not be
+	 * aligned. Whatever is left, including the word holding the
+	 * null, is finished off by the byte loop.
+	 */
+	for (i=0; i<limit && ((vaddr_t)(src+i) & 3) != 0; i++) {
 		dest[i] = src[i];
 		if (src[i] == 0) {
-			if (gotlen != NULL) {
-				*gotlen = i+1;
-			}
-			return 0;
+			goto done;
+		}
+	}
+	while (i+4 <= limit) {
+		w = *(const uint32_t *)(src+i);
+		if (HASZERO(w)) {
+			break;
+		}
+		memcpy(dest+i, &w, 4);
+		i += 4;
+	}
+	for (; i<limit; i++) {
+		dest[i] = src[i];
+		if (src[i] == 0) {
+			goto done;
 		}
 	}
 	if (stoplen < maxlen) {
@@ -252,6 +386,12 @@ copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	}
 	/* otherwise just ran out of space */
 	return ENAMETOOLONG;
+
+ done:
+	if (gotlen != NULL) {
+		*gotlen = i+1;
+	}
+	return 0;
 }
 
 /*
@@ -0,0 +1,650 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Physical page allocator. See <coremap.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+
+/*
+ * Buddy orders run from 0 (one page) to CM_ORDERS-1 (4M).
+ */
+#define CM_ORDERS	11
+
+/*
+ * Per-cpu page cache. A cpu keeps up to CM_CACHEMAX free pages; it
+ * refills from and drains to the buddy lists CM_BATCH pages at a time
+ * so the global lock is taken once per batch rather than per page.
+ */
+#define CM_MAXCPUS	32
+#define CM_CACHEMAX	16
+#define CM_BATCH	8
+
+#define CM_NONE		((uint32_t)-1)
+
+/* Values for cme_state */
+#define CME_FIXED	0	/* kernel image, coremap, or stolen early */
+#define CME_FREE	1	/* head of a free block of order cme_order */
+#define CME_ALLOC	2	/* head of an allocation of cme_npages */
+#define CME_INNER	3	/* not the head of anything */
+
+/*
+ * cme_as and cme_vaddr say which user page a CME_ALLOC page holds, if
+ * any, for the pageout daemon. They're only meaningful while the page
+ * has one reference, and are changed only with the lock held.
+ */
+struct coremap_entry {
+	uint32_t cme_next;		/* free list links (page numbers) */
+	uint32_t cme_prev;
+	struct addrspace *cme_as;	/* owner, or NULL */
+	vaddr_t cme_vaddr;		/* where the owner maps it */
+	uint16_t cme_npages;		/* allocation size, if CME_ALLOC */
+	uint16_t cme_refs;		/* references, if CME_ALLOC */
+	uint8_t cme_state;
+	uint8_t cme_order;		/* block order, if CME_FREE */
+	bool cme_busy;			/* being paged out */
+};
+
+struct coremap_cpu {
+	unsigned cc_count;
+	uint32_t cc_pages[CM_CACHEMAX];
+} __ALIGNED(CACHELINE_SIZE);		/* not shared with the next cpu's */
+
+/*
+ * Until coremap_bootstrap runs, allocation goes to ram_stealmem;
+ * the lock wraps that as well as the buddy lists.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static bool coremap_ready;
+
+static struct coremap_entry *coremap;
+static uint32_t coremap_npages;
+static uint32_t coremap_freelist[CM_ORDERS];
+static unsigned long coremap_nfree;		/* on the buddy lists */
+static uint32_t coremap_hand;			/* clock hand */
+static struct wchan *coremap_busywchan;		/* for cme_busy */
+
+/* Pages in per-cpu caches; these are CME_ALLOC of size 1. */
+static struct coremap_cpu coremap_cpus[CM_MAXCPUS];
+
+////////////////////////////////////////////////////////////
+// buddy lists
+
+static
+void
+cm_list_add(uint32_t pg, unsigned order)
+{
+	struct coremap_entry *e;
+	uint32_t head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	e = &coremap[pg];
+	head = coremap_freelist[order];
+	e->cme_state = CME_FREE;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = head;
+	if (head != CM_NONE) {
+		coremap[head].cme_prev = pg;
+	}
+	coremap_freelist[order] = pg;
+}
+
+static
+void
+cm_list_remove(uint32_t pg)
+{
+	struct coremap_entry *e;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	e = &coremap[pg];
+	KASSERT(e->cme_state == CME_FREE);
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		KASSERT(coremap_freelist[e->cme_order] == pg);
+		coremap_freelist[e->cme_order] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_state = CME_INNER;
+}
+
+/*
+ * Put the block of order ORDER at PG on the free lists, merging it
+ * with its buddy for as long as the buddy is also entirely free.
+ */
+static
+void
+cm_free_block(uint32_t pg, unsigned order)
+{
+	uint32_t buddy;
+
+	KASSERT((pg & ((1U << order) - 1)) == 0);
+	coremap_nfree += 1U << order;
+
+	while (order < CM_ORDERS - 1) {
+		buddy = pg ^ (1U << order);
+		if (buddy >= coremap_npages ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		cm_list_remove(buddy);
+		if (buddy < pg) {
+			coremap[pg].cme_state = CME_INNER;
+			pg = buddy;
+		}
+		order++;
+	}
+	cm_list_add(pg, order);
+}
+
+/*
+ * Free NPAGES pages at PG, which need not be a power of two or
+ * aligned, by feeding it to cm_free_block in the largest aligned
+ * pieces that fit.
+ */
+static
+void
+cm_free_range(uint32_t pg, uint32_t npages)
+{
+	unsigned order;
+	uint32_t i;
+
+	for (i=0; i<npages; i++) {
+		coremap[pg + i].cme_state = CME_INNER;
+	}
+
+	while (npages > 0) {
+		order = 0;
+		while (order < CM_ORDERS - 1 &&
+		       (pg & (1U << order)) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		cm_free_block(pg, order);
+		pg += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Take a block of order ORDER off the free lists, splitting a larger
+ * one if need be. Returns CM_NONE if nothing is big enough.
+ */
+static
+uint32_t
+cm_alloc_block(unsigned order)
+{
+	unsigned o;
+	uint32_t pg;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (o = order; o < CM_ORDERS; o++) {
+		if (coremap_freelist[o] != CM_NONE) {
+			break;
+		}
+	}
+	if (o == CM_ORDERS) {
+		return CM_NONE;
+	}
+
+	pg = coremap_freelist[o];
+	cm_list_remove(pg);
+	while (o > order) {
+		o--;
+		cm_list_add(pg + (1U << o), o);
+	}
+	coremap_nfree -= 1U << order;
+	return pg;
+}
+
+static
+void
+cm_markalloc(uint32_t pg, uint32_t npages)
+{
+	KASSERT(npages <= (1U << (CM_ORDERS - 1)));
+	coremap[pg].cme_state = CME_ALLOC;
+	coremap[pg].cme_npages = npages;
+	coremap[pg].cme_refs = 1;
+	coremap[pg].cme_as = NULL;
+	coremap[pg].cme_busy = false;
+}
+
+////////////////////////////////////////////////////////////
+// per-cpu cache
+
+/*
+ * Refill the current cpu's cache. Called at splhigh.
+ */
+static
+void
+cm_cache_refill(struct coremap_cpu *cc)
+{
+	uint32_t pg;
+
+	spinlock_acquire(&coremap_lock);
+	while (cc->cc_count < CM_BATCH) {
+		pg = cm_alloc_block(0);
+		if (pg == CM_NONE) {
+			break;
+		}
+		cm_markalloc(pg, 1);
+		cc->cc_pages[cc->cc_count++] = pg;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return a batch of the current cpu's cached pages to the buddy
+ * lists. Called at splhigh.
+ */
+static
+void
+cm_cache_drain(struct coremap_cpu *cc)
+{
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<CM_BATCH; i++) {
+		KASSERT(cc->cc_count > 0);
+		cm_free_block(cc->cc_pages[--cc->cc_count], 0);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+static
+struct coremap_cpu *
+cm_cache_get(void)
+{
+	KASSERT(curcpu->c_number < CM_MAXCPUS);
+	return &coremap_cpus[curcpu->c_number];
+}
+
+static
+uint32_t
+cm_alloc_one(void)
+{
+	struct coremap_cpu *cc;
+	uint32_t pg;
+	int spl;
+
+	spl = splhigh();
+	cc = cm_cache_get();
+	if (cc->cc_count == 0) {
+		cm_cache_refill(cc);
+	}
+	pg = cc->cc_count > 0 ? cc->cc_pages[--cc->cc_count] : CM_NONE;
+	splx(spl);
+
+	if (pg != CM_NONE) {
+		/* The page is ours alone, so no lock is needed. */
+		coremap[pg].cme_refs = 1;
+	}
+	return pg;
+}
+
+static
+void
+cm_free_one(uint32_t pg)
+{
+	struct coremap_cpu *cc;
+	int spl;
+
+	spl = splhigh();
+	cc = cm_cache_get();
+	if (cc->cc_count == CM_CACHEMAX) {
+		cm_cache_drain(cc);
+	}
+	cc->cc_pages[cc->cc_count++] = pg;
+	splx(spl);
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t size, cmpaddr, firstfree;
+	uint32_t i, firstpage;
+
+	KASSERT(!coremap_ready);
+
+	coremap_npages = ram_getsize() / PAGE_SIZE;
+	size = coremap_npages * sizeof(struct coremap_entry);
+	cmpaddr = ram_stealmem(DIVROUNDUP(size, PAGE_SIZE));
+	if (cmpaddr == 0) {
+		panic("coremap: no memory for %u-page coremap\n",
+		      (unsigned)coremap_npages);
+	}
+	firstfree = ram_getfirstfree();
+	firstpage = firstfree / PAGE_SIZE;
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cme_next = coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_state = CME_FIXED;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_refs = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_busy = false;
+	}
+	for (i=0; i<CM_ORDERS; i++) {
+		coremap_freelist[i] = CM_NONE;
+	}
+	coremap_busywchan = wchan_create("coremap");
+	if (coremap_busywchan == NULL) {
+		panic("coremap: wchan_create failed\n");
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_free_range(firstpage, coremap_npages - firstpage);
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %lu of %u pages free\n", coremap_nfree,
+		(unsigned)coremap_npages);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	paddr_t pa;
+	uint32_t pg;
+	unsigned order;
+
+	if (npages == 0) {
+		npages = 1;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (!coremap_ready) {
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (npages == 1) {
+		pg = cm_alloc_one();
+		return pg == CM_NONE ? 0 : (paddr_t)pg * PAGE_SIZE;
+	}
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+		if (order == CM_ORDERS) {
+			return 0;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	pg = cm_alloc_block(order);
+	if (pg == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	/* give back the part of the block we don't need */
+	if (npages < (1UL << order)) {
+		cm_free_range(pg + npages, (1U << order) - npages);
+	}
+	cm_markalloc(pg, npages);
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)pg * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t pa)
+{
+	uint32_t pg, npages;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pg = pa / PAGE_SIZE;
+
+	if (!coremap_ready) {
+		/* stolen memory; leak it */
+		return;
+	}
+
+	KASSERT(pg < coremap_npages);
+	if (coremap[pg].cme_state == CME_FIXED) {
+		/* stolen before the coremap existed; leak it */
+		return;
+	}
+	if (coremap[pg].cme_state != CME_ALLOC) {
+		panic("coremap_free: 0x%x not allocated\n", pa);
+	}
+
+	/*
+	 * A user page may be in the middle of being paged out. Wait
+	 * for that to finish, then disown it so the daemon won't pick
+	 * it up again. (The caller's reference keeps it from being
+	 * freed under the daemon.)
+	 */
+	if (coremap[pg].cme_as != NULL) {
+		spinlock_acquire(&coremap_lock);
+		while (coremap[pg].cme_busy) {
+			wchan_sleep(coremap_busywchan, &coremap_lock);
+		}
+		if (coremap[pg].cme_refs == 1) {
+			coremap[pg].cme_as = NULL;
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	/*
+	 * If we hold the only reference nobody else can add one, so
+	 * the lock is only needed while the block is shared.
+	 */
+	if (coremap[pg].cme_refs > 1) {
+		spinlock_acquire(&coremap_lock);
+		KASSERT(coremap[pg].cme_refs > 0);
+		if (--coremap[pg].cme_refs > 0) {
+			spinlock_release(&coremap_lock);
+			return;
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	npages = coremap[pg].cme_npages;
+	if (npages == 1) {
+		cm_free_one(pg);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_free_range(pg, npages);
+	spinlock_release(&coremap_lock);
+}
+
+static
+struct coremap_entry *
+cm_getentry(paddr_t pa)
+{
+	uint32_t pg;
+
+	KASSERT(coremap_ready);
+	KASSERT(pa % PAGE_SIZE == 0);
+	pg = pa / PAGE_SIZE;
+	KASSERT(pg < coremap_npages);
+	KASSERT(coremap[pg].cme_state == CME_ALLOC);
+	return &coremap[pg];
+}
+
+void
+coremap_share(paddr_t pa)
+{
+	struct coremap_entry *e;
+
+	e = cm_getentry(pa);
+	spinlock_acquire(&coremap_lock);
+	KASSERT(e->cme_refs > 0 && e->cme_refs < 0xffff);
+	e->cme_refs++;
+	/* Shared pages have no single owner to page them out for. */
+	e->cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t pa)
+{
+	return cm_getentry(pa)->cme_refs;
+}
+
+void
+coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+
+	e = cm_getentry(pa);
+	if (e->cme_as == as && e->cme_vaddr == vaddr) {
+		/* Usual case; don't bother with the lock. */
+		return;
+	}
+	spinlock_acquire(&coremap_lock);
+	if (e->cme_refs == 1) {
+		e->cme_as = as;
+		e->cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Check if page PG can be paged out, and if so mark it busy.
+ */
+static
+bool
+cm_trybusy(uint32_t pg)
+{
+	struct coremap_entry *e;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	e = &coremap[pg];
+	if (e->cme_state != CME_ALLOC || e->cme_npages != 1 ||
+	    e->cme_refs != 1 || e->cme_as == NULL || e->cme_busy) {
+		return false;
+	}
+	e->cme_busy = true;
+	return true;
+}
+
+bool
+coremap_trybusy(paddr_t pa)
+{
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	ret = cm_trybusy(cm_getentry(pa) - coremap);
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+void
+coremap_unbusy(paddr_t pa)
+{
+	struct coremap_entry *e;
+
+	e = cm_getentry(pa);
+	spinlock_acquire(&coremap_lock);
+	KASSERT(e->cme_busy);
+	e->cme_busy = false;
+	wchan_wakeall(coremap_busywchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_clock(unsigned *budget, struct addrspace **as, vaddr_t *vaddr,
+	      paddr_t *pa)
+{
+	uint32_t pg;
+
+	spinlock_acquire(&coremap_lock);
+	while (*budget > 0) {
+		(*budget)--;
+		pg = coremap_hand;
+		coremap_hand = (coremap_hand + 1) % coremap_npages;
+		if (cm_trybusy(pg)) {
+			*as = coremap[pg].cme_as;
+			*vaddr = coremap[pg].cme_vaddr;
+			*pa = (paddr_t)pg * PAGE_SIZE;
+			spinlock_release(&coremap_lock);
+			return true;
+		}
+	}
+	spinlock_release(&coremap_lock);
+	return false;
+}
+
+unsigned long
+coremap_totalpages(void)
+{
+	return coremap_npages;
+}
+
+unsigned long
+coremap_freepages(void)
+{
+	unsigned long npages;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	if (!coremap_ready) {
+		npages = ram_stealablepages();
+		spinlock_release(&coremap_lock);
+		return npages;
+	}
+	npages = coremap_nfree;
+	spinlock_release(&coremap_lock);
+
+	for (i=0; i<CM_MAXCPUS; i++) {
+		npages += coremap_cpus[i].cc_count;
+	}
+	return npages;
+}
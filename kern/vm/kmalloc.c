@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
 #include <spinlock.h>
+#include <current.h>
 #include <vm.h>
+#include <kheaptag.h>
 
 /*
  * Kernel malloc.
@@ -121,6 +125,15 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * The per-cpu magazines (see below) hand out blocks without going
+ * through the code that sets up guard bands and labels, so they're
+ * only used without those.
+ */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -166,7 +179,7 @@ struct pageref {
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_FIFO_INITIALIZER;
 
 ////////////////////////////////////////
 
@@ -345,6 +358,43 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Page map: a two-level radix table from virtual page number to the
+ * pageref of a subpage heap page, so kfree can find a block's pageref
+ * without searching allbase. Each leaf is one page of pointers; they
+ * are made as needed and never freed, and there can only be a few as
+ * the kernel heap is direct-mapped. Entries are protected by
+ * kmalloc_spinlock, but a leaf pointer, once set, never changes.
+ */
+#define PAGEMAP_LEAFSIZE	(PAGE_SIZE / sizeof(struct pageref *))
+#define PAGEMAP_VPN(va)		((va) / PAGE_SIZE)
+#define PAGEMAP_TOP(va)		(PAGEMAP_VPN(va) / PAGEMAP_LEAFSIZE)
+#define PAGEMAP_LEAF(va)	(PAGEMAP_VPN(va) % PAGEMAP_LEAFSIZE)
+#define PAGEMAP_NTOP		(PAGEMAP_TOP((vaddr_t)-1) + 1)
+
+static struct pageref **pagemap[PAGEMAP_NTOP];
+
+#ifdef MAGAZINES
+/* Per-cpu magazines; see below. */
+#define KMAG_ROUNDS	16
+#define KMAG_BYTES	4096
+#define KMAG_MAXCPUS	32
+
+struct kmagazine {
+	unsigned km_count;
+	void *km_rounds[KMAG_ROUNDS];
+};
+
+/* Each on its own cache lines, as each cpu is forever changing its own */
+struct kmalloc_cpu {
+	struct kmagazine kc_mags[NSIZES];
+	unsigned kc_npending;
+	void *kc_pending[KMAG_ROUNDS];
+} __ALIGNED(CACHELINE_SIZE);
+
+static struct kmalloc_cpu kmalloc_cpus[KMAG_MAXCPUS];
+#endif
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -801,6 +851,17 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+#ifdef MAGAZINES
+	unsigned i, j, cached = 0, pending = 0;
+
+	/* Other cpus' counts are read unlocked, so this is approximate */
+	for (i=0; i<KMAG_MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			cached += kmalloc_cpus[i].kc_mags[j].km_count;
+		}
+		pending += kmalloc_cpus[i].kc_npending;
+	}
+#endif
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -812,6 +873,71 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	kprintf("Per-cpu magazines: %u blocks cached, %u frees pending\n",
+		cached, pending);
+#endif
+}
+
+/*
+ * Report how much of the subpage heap is in use: *TOTAL gets the
+ * bytes in all subpage pages, and *INUSE the bytes in blocks that are
+ * allocated. Blocks cached in magazines aren't counted as in use;
+ * pending frees are, since we can't tell their sizes. Whole-page
+ * allocations aren't included in either.
+ */
+void
+kheap_getusage(size_t *inuse, size_t *total)
+{
+	struct pageref *pr;
+	unsigned blktype;
+	size_t used, all, cached;
+#ifdef MAGAZINES
+	unsigned i;
+#endif
+
+	used = all = cached = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		blktype = PR_BLOCKTYPE(pr);
+		KASSERT(blktype < NSIZES);
+		all += PAGE_SIZE;
+		used += (PAGE_SIZE / sizes[blktype] - pr->nfree) *
+			sizes[blktype];
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	/* As in kheap_printstats, this is approximate */
+	for (i=0; i<KMAG_MAXCPUS; i++) {
+		for (blktype=0; blktype<NSIZES; blktype++) {
+			cached += kmalloc_cpus[i].kc_mags[blktype].km_count *
+				sizes[blktype];
+		}
+	}
+#endif
+
+	*inuse = used > cached ? used - cached : 0;
+	*total = all;
+}
+
+/*
+ * Report how many times kmalloc_spinlock has been acquired and how
+ * many spins were spent waiting for it. Both are zero unless the
+ * kernel has lockstat.
+ */
+void
+kheap_getlockstat(uint64_t *acquires, uint64_t *spins)
+{
+#if OPT_LOCKSTAT
+	*acquires = kmalloc_spinlock.splk_stat.ls_acquires;
+	*spins = kmalloc_spinlock.splk_stat.ls_wait;
+#else
+	*acquires = 0;
+	*spins = 0;
+#endif
 }
 
 ////////////////////////////////////////
@@ -844,6 +970,268 @@ remove_lists(struct pageref *pr, int blktype)
 	}
 }
 
+/*
+ * Take a block off the free list of PR, which must have one.
+ */
+static
+void *
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage;			// PR_PAGEADDR(pr)
+	vaddr_t fla;			// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Find the pageref for the subpage block at PTRADDR, or NULL if the
+ * address is not on a subpage heap page.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref **leaf;
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	leaf = pagemap[PAGEMAP_TOP(ptraddr)];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	pr = leaf[PAGEMAP_LEAF(ptraddr)];
+	if (pr != NULL) {
+		/* check for corruption */
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+	}
+	return pr;
+}
+
+/*
+ * Make sure the page map has a leaf for PAGE. Called without
+ * kmalloc_spinlock, since it may need to allocate one. Returns false
+ * if out of memory.
+ */
+static
+bool
+pagemap_reserve(vaddr_t page)
+{
+	unsigned top = PAGEMAP_TOP(page);
+	vaddr_t leaf;
+
+	if (pagemap[top] != NULL) {
+		return true;
+	}
+
+	leaf = alloc_kpages(1);
+	if (leaf == 0) {
+		return false;
+	}
+	bzero((void *)leaf, PAGE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagemap[top] == NULL) {
+		pagemap[top] = (struct pageref **)leaf;
+		leaf = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (leaf != 0) {
+		/* Someone else got there first */
+		free_kpages(leaf);
+	}
+	return true;
+}
+
+/*
+ * Enter or clear the page map entry for PAGE, whose leaf must exist.
+ */
+static
+void
+pagemap_set(vaddr_t page, struct pageref *pr)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pagemap[PAGEMAP_TOP(page)] != NULL);
+	pagemap[PAGEMAP_TOP(page)][PAGEMAP_LEAF(page)] = pr;
+}
+
+#ifdef MAGAZINES
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each block size, a magazine of free blocks that
+ * kmalloc hands out without kmalloc_spinlock. A magazine holds up to
+ * KMAG_ROUNDS blocks and KMAG_BYTES bytes. When it's empty, kmalloc
+ * takes the lock once and refills it halfway from the page it
+ * allocates from.
+ *
+ * kfree can't tell what size a block is, or even whether it is a
+ * subpage block, without searching the page list under the lock, so
+ * it only adds blocks to the cpu's pending array. When that fills,
+ * the whole batch is sorted out under a single lock acquisition. Each
+ * block goes back into this cpu's magazine if it has room, or onto
+ * its page otherwise; whole-page allocations are freed then too. A
+ * freed page allocation can thus linger for up to KMAG_ROUNDS - 1
+ * kfree calls. kmalloc flushes the pending frees when memory runs
+ * out.
+ *
+ * Blocks in magazines and pending frees count as allocated as far as
+ * the pages are concerned. All of this is touched only by its own
+ * cpu with interrupts off.
+ */
+
+/* How many blocks of type BLKTYPE a magazine may hold. */
+static
+unsigned
+kmag_capacity(unsigned blktype)
+{
+	unsigned max;
+
+	max = KMAG_BYTES / sizes[blktype];
+	return max < KMAG_ROUNDS ? max : KMAG_ROUNDS;
+}
+
+/* This cpu's state; interrupts must be off. */
+static
+struct kmalloc_cpu *
+kmag_mycpu(void)
+{
+	KASSERT(curthread->t_curspl > 0 || curthread->t_iplhigh_count > 0);
+	KASSERT(curcpu->c_number < KMAG_MAXCPUS);
+	return &kmalloc_cpus[curcpu->c_number];
+}
+
+/*
+ * Get a block of type BLKTYPE from this cpu's magazine, or NULL.
+ */
+static
+void *
+kmag_get(unsigned blktype)
+{
+	struct kmagazine *km;
+	void *ret = NULL;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	spl = splhigh();
+	km = &kmag_mycpu()->kc_mags[blktype];
+	if (km->km_count > 0) {
+		ret = km->km_rounds[--km->km_count];
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Fill this cpu's magazine halfway from PR, as far as it lasts.
+ * Called with kmalloc_spinlock held.
+ */
+static
+void
+kmag_refill(struct pageref *pr, unsigned blktype)
+{
+	struct kmagazine *km;
+	unsigned want;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+	km = &kmag_mycpu()->kc_mags[blktype];
+	want = kmag_capacity(blktype) / 2;
+	while (km->km_count < want && pr->nfree > 0) {
+		km->km_rounds[km->km_count++] = subpage_take(pr);
+	}
+}
+
+static void kmag_freebatch(void **ptrs, unsigned num);
+
+/*
+ * Take this cpu's pending frees and sort them out. Returns the number
+ * there were.
+ */
+static
+unsigned
+kmag_flush(void)
+{
+	struct kmalloc_cpu *kc;
+	void *batch[KMAG_ROUNDS];
+	unsigned num;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return 0;
+	}
+	spl = splhigh();
+	kc = kmag_mycpu();
+	num = kc->kc_npending;
+	memcpy(batch, kc->kc_pending, num * sizeof(batch[0]));
+	kc->kc_npending = 0;
+	splx(spl);
+
+	kmag_freebatch(batch, num);
+	return num;
+}
+
+/*
+ * Queue PTR to be freed. Returns false if that can't be done now
+ * (early in boot).
+ */
+static
+bool
+kmag_defer(void *ptr)
+{
+	struct kmalloc_cpu *kc;
+	bool full;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+	spl = splhigh();
+	kc = kmag_mycpu();
+	KASSERT(kc->kc_npending < KMAG_ROUNDS);
+	kc->kc_pending[kc->kc_npending++] = ptr;
+	full = (kc->kc_npending == KMAG_ROUNDS);
+	splx(spl);
+
+	if (full) {
+		kmag_flush();
+	}
+	return true;
+}
+
+#endif /* MAGAZINES */
+
 /*
  * Given a requested client size, return the block type, that is, the
  * index into the sizes[] array for the block size to use.
@@ -884,6 +1272,9 @@ subpage_kmalloc(size_t sz
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
+#ifdef MAGAZINES
+	bool flushed = false;
+#endif
 
 	volatile int i;
 
@@ -907,6 +1298,14 @@ subpage_kmalloc(size_t sz
 	sz = sizes[blktype];
 #endif
 
+#ifdef MAGAZINES
+ again:
+	retptr = kmag_get(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -921,25 +1320,10 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_take(pr);
+#ifdef MAGAZINES
+			kmag_refill(pr, blktype);
+#endif
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -966,11 +1350,23 @@ subpage_kmalloc(size_t sz
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
+#ifdef MAGAZINES
+		/* Pending frees might have what we need. */
+		if (!flushed && kmag_flush() > 0) {
+			flushed = true;
+			goto again;
+		}
+#endif
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
 		return NULL;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
+	if (!pagemap_reserve(prpage)) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't map page\n");
+		return NULL;
+	}
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
@@ -1013,28 +1409,21 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pagemap_set(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Convert a pointer from subpage_kmalloc back to the address of its
+ * block. Returns 0 if it can't be one of ours.
  */
 static
-int
-subpage_kfree(void *ptr)
+vaddr_t
+subpage_blockaddr(void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1049,43 +1438,36 @@ subpage_kfree(void *ptr)
 		 * a page we *do* own, and then we'll panic because
 		 * it's not a valid one.
 		 */
-		return -1;
+		return 0;
 	}
 	ptraddr -= GUARD_PTROFFSET;
 #endif
 #ifdef LABELS
 	if (ptraddr % PAGE_SIZE == 0) {
 		/* ditto */
-		return -1;
+		return 0;
 	}
 	ptraddr -= LABEL_PTROFFSET;
 #endif
+	return ptraddr;
+}
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+/*
+ * Check that the block at PTRADDR (from PTR) on page PR is a proper
+ * block, and return its offset in the page.
+ */
+static
+vaddr_t
+subpage_checkblock(struct pageref *pr, vaddr_t ptraddr, void *ptr)
+{
+	vaddr_t offset;		// offset into page
+	int blktype;
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
 
-	offset = ptraddr - prpage;
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - PR_PAGEADDR(pr);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
@@ -1096,13 +1478,37 @@ subpage_kfree(void *ptr)
 	blocksize = sizes[blktype];
 	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
 	checkguardband(ptraddr, smallerblocksize, blocksize);
+#else
+	(void)ptr;
 #endif
+	return offset;
+}
+
+/*
+ * Put the block at OFFSET back on page PR's free list. If that frees
+ * the whole page, drop the page from the heap and return its address,
+ * which the caller must pass to free_kpages once it lets go of
+ * kmalloc_spinlock; otherwise return 0.
+ */
+static
+vaddr_t
+subpage_release(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+	fill_deadbeef((void *)(prpage + offset), sizes[blktype]);
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -1137,13 +1543,49 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		pagemap_set(prpage, NULL);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		return prpage;
 	}
-	else {
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// block address
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// page to give back, if any
+
+	ptraddr = subpage_blockaddr(ptr);
+	if (ptraddr == 0) {
+		return -1;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	pr = subpage_findpage(ptraddr);
+	if (pr==NULL) {
+		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
+		return -1;
+	}
+
+	offset = subpage_checkblock(pr, ptraddr, ptr);
+	freepage = subpage_release(pr, offset);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1155,6 +1597,60 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+#ifdef MAGAZINES
+/*
+ * Free a batch of pointers from kmalloc, which may be subpage blocks
+ * or whole-page allocations, taking kmalloc_spinlock only once.
+ * Subpage blocks go into this cpu's magazines while they have room.
+ */
+static
+void
+kmag_freebatch(void **ptrs, unsigned num)
+{
+	vaddr_t pages[KMAG_ROUNDS];	// page allocations, freed pages
+	unsigned i, npages = 0;
+	struct pageref *pr;
+	struct kmagazine *km;
+	vaddr_t ptraddr, offset, freepage;
+	int blktype;
+
+	KASSERT(num <= KMAG_ROUNDS);
+	if (num == 0) {
+		return;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<num; i++) {
+		ptraddr = (vaddr_t)ptrs[i];
+		pr = subpage_findpage(ptraddr);
+		if (pr == NULL) {
+			KASSERT(ptraddr % PAGE_SIZE == 0);
+			pages[npages++] = ptraddr;
+			continue;
+		}
+		offset = subpage_checkblock(pr, ptraddr, ptrs[i]);
+
+		blktype = PR_BLOCKTYPE(pr);
+		km = &kmag_mycpu()->kc_mags[blktype];
+		if (km->km_count < kmag_capacity(blktype)) {
+			fill_deadbeef(ptrs[i], sizes[blktype]);
+			km->km_rounds[km->km_count++] = ptrs[i];
+			continue;
+		}
+		freepage = subpage_release(pr, offset);
+		if (freepage != 0) {
+			pages[npages++] = freepage;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<npages; i++) {
+		free_kpages(pages[i]);
+	}
+}
+#endif /* MAGAZINES */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1186,6 +1682,12 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+#ifdef MAGAZINES
+		if (address==0 && kmag_flush() > 0) {
+			/* Pending frees might have given pages back. */
+			address = alloc_kpages(npages);
+		}
+#endif
 		if (address==0) {
 			return NULL;
 		}
@@ -1212,9 +1714,144 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (kmag_defer(ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
 
+
+////////////////////////////////////////////////////////////
+// accounting by tag (see kheaptag.h)
+
+/* Most tags kheap_printtags can sort; more than this are left out. */
+#define KHEAP_MAXREPORT 64
+
+static struct kheap_tag *kheap_tags;
+static unsigned kheap_numtags;
+static struct spinlock kheap_tag_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * How many bytes of heap kmalloc(SZ) really uses.
+ */
+static
+size_t
+kheap_blocksize(size_t sz)
+{
+	size_t checksz;
+
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+		return ROUNDUP(sz, PAGE_SIZE);
+	}
+	return sizes[blocktype(checksz)];
+}
+
+void
+kheap_tag_init(struct kheap_tag *tag, const char *name)
+{
+	tag->kt_name = name;
+	tag->kt_ready = false;
+	if (percpu_counter_init(&tag->kt_objects)) {
+		kprintf("kheap: No counters left for tag %s\n", name);
+		return;
+	}
+	if (percpu_counter_init(&tag->kt_bytes)) {
+		percpu_counter_cleanup(&tag->kt_objects);
+		kprintf("kheap: No counters left for tag %s\n", name);
+		return;
+	}
+	tag->kt_ready = true;
+
+	spinlock_acquire(&kheap_tag_lock);
+	tag->kt_next = kheap_tags;
+	kheap_tags = tag;
+	kheap_numtags++;
+	spinlock_release(&kheap_tag_lock);
+}
+
+void *
+kmalloc_tagged(size_t sz, struct kheap_tag *tag)
+{
+	void *ptr;
+
+	ptr = kmalloc(sz);
+	if (ptr != NULL && tag->kt_ready) {
+		percpu_counter_inc(&tag->kt_objects);
+		percpu_counter_add(&tag->kt_bytes, kheap_blocksize(sz));
+	}
+	return ptr;
+}
+
+void
+kfree_tagged(void *ptr, size_t sz, struct kheap_tag *tag)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (tag->kt_ready) {
+		/* Adding the negation wraps around to subtracting */
+		percpu_counter_add(&tag->kt_objects, -1U);
+		percpu_counter_add(&tag->kt_bytes, -kheap_blocksize(sz));
+	}
+	kfree(ptr);
+}
+
+void
+kheap_printtags(unsigned max)
+{
+	struct {
+		struct kheap_tag *tag;
+		int objects;
+		int bytes;
+	} ents[KHEAP_MAXREPORT], tmp;
+	struct kheap_tag *tag;
+	unsigned i, j, num, total;
+	size_t inuse, heapsize;
+
+	/*
+	 * Take the counts first and sort afterwards, so we sort by
+	 * numbers that don't change underneath us. They can dip below
+	 * zero (see kheaptag.h), so treat them as signed.
+	 */
+	num = 0;
+	spinlock_acquire(&kheap_tag_lock);
+	total = kheap_numtags;
+	for (tag = kheap_tags; tag != NULL; tag = tag->kt_next) {
+		if (num == KHEAP_MAXREPORT) {
+			break;
+		}
+		ents[num].tag = tag;
+		ents[num].objects = percpu_counter_read(&tag->kt_objects);
+		ents[num].bytes = percpu_counter_read(&tag->kt_bytes);
+		num++;
+	}
+	spinlock_release(&kheap_tag_lock);
+
+	/* Insertion sort, biggest first; there aren't many. */
+	for (i=1; i<num; i++) {
+		tmp = ents[i];
+		for (j=i; j>0 && ents[j-1].bytes < tmp.bytes; j--) {
+			ents[j] = ents[j-1];
+		}
+		ents[j] = tmp;
+	}
+
+	if (max > num) {
+		max = num;
+	}
+	kheap_getusage(&inuse, &heapsize);
+	kprintf("Subpage heap: %zu of %zu bytes in use\n", inuse, heapsize);
+	kprintf("Top %u of %u tags:\n", max, total);
+	kprintf("%10s %10s  %s\n", "objects", "bytes", "tag");
+	for (i=0; i<max; i++) {
+		kprintf("%10d %10d  %s\n", ents[i].objects, ents[i].bytes,
+			ents[i].tag->kt_name);
+	}
+}
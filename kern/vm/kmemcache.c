@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Object caches; see kmemcache.h.
+ *
+ * Each slab is one page from alloc_kpages. It starts with a struct
+ * kmem_slab, followed by a stack of the indexes of its free objects,
+ * followed by the objects themselves. Since slabs are page-aligned,
+ * the slab an object belongs to is found by masking off the offset.
+ *
+ * A slab with some but not all of its objects free is on kc_partial;
+ * one with all of them free is on kc_empty; a full one is on neither
+ * and is found again when an object is freed. Allocation prefers
+ * partial slabs so empty ones can be given back.
+ *
+ * Constructors and destructors are called without the cache lock, as
+ * they may well allocate memory themselves.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;	/* Cache it belongs to */
+	struct kmem_slab *ks_next;	/* On kc_partial or kc_empty */
+	struct kmem_slab **ks_prevp;
+	unsigned ks_nfree;		/* Free objects */
+	uint16_t ks_free[];		/* Their indexes */
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;			/* Object size, rounded up */
+	unsigned kc_perslab;		/* Objects per slab */
+	size_t kc_offset;		/* Of the first object in a slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct spinlock kc_lock;	/* Protects everything below */
+	struct kmem_slab *kc_partial;	/* Slabs with some free */
+	struct kmem_slab *kc_empty;	/* Slabs with all free */
+	unsigned kc_nempty;		/* Number of those */
+	unsigned kc_nslabs;		/* Number of slabs in all */
+};
+
+/* Objects are aligned for anything */
+#define KMEM_ALIGN	8
+
+static
+void *
+kmem_slab_obj(struct kmem_slab *ks, unsigned index)
+{
+	return (char *)ks + ks->ks_cache->kc_offset +
+		index * ks->ks_cache->kc_size;
+}
+
+static
+void
+kmem_slab_insert(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_next = *list;
+	ks->ks_prevp = list;
+	if (*list != NULL) {
+		(*list)->ks_prevp = &ks->ks_next;
+	}
+	*list = ks;
+}
+
+static
+void
+kmem_slab_remove(struct kmem_slab *ks)
+{
+	*ks->ks_prevp = ks->ks_next;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prevp = ks->ks_prevp;
+	}
+	ks->ks_next = NULL;
+	ks->ks_prevp = NULL;
+}
+
+/*
+ * Destroy the first NUM objects of a slab, and give back its page.
+ */
+static
+void
+kmem_slab_release(struct kmem_slab *ks, unsigned num)
+{
+	struct kmem_cache *kc = ks->ks_cache;
+	unsigned i;
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<num; i++) {
+			kc->kc_dtor(kmem_slab_obj(ks, i));
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Make a new slab, with all its objects constructed.
+ */
+static
+int
+kmem_slab_create(struct kmem_cache *kc, struct kmem_slab **ret)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	unsigned i;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return ENOMEM;
+	}
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_next = NULL;
+	ks->ks_prevp = NULL;
+
+	for (i=0; i<kc->kc_perslab; i++) {
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(kmem_slab_obj(ks, i));
+			if (result) {
+				kmem_slab_release(ks, i);
+				return result;
+			}
+		}
+		/* Hand out low indexes first */
+		ks->ks_free[i] = kc->kc_perslab - 1 - i;
+	}
+	ks->ks_nfree = kc->kc_perslab;
+
+	*ret = ks;
+	return 0;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	size_t header;
+
+	KASSERT(size > 0 && size <= KMEM_CACHE_MAXSIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	kc->kc_size = ROUNDUP(size, KMEM_ALIGN);
+	/* Each object costs its size plus a free stack entry */
+	header = sizeof(struct kmem_slab);
+	kc->kc_perslab = (PAGE_SIZE - header - KMEM_ALIGN) /
+		(kc->kc_size + sizeof(uint16_t));
+	kc->kc_offset = ROUNDUP(header + kc->kc_perslab * sizeof(uint16_t),
+				KMEM_ALIGN);
+	KASSERT(kc->kc_perslab > 0);
+	KASSERT(kc->kc_offset + kc->kc_perslab * kc->kc_size <= PAGE_SIZE);
+
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_nslabs = 0;
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	kmem_cache_reap(kc);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_nslabs == 0);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks, *fresh = NULL;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (1) {
+		ks = kc->kc_partial;
+		if (ks != NULL) {
+			break;
+		}
+		ks = kc->kc_empty;
+		if (ks != NULL) {
+			kmem_slab_remove(ks);
+			kc->kc_nempty--;
+			kmem_slab_insert(&kc->kc_partial, ks);
+			break;
+		}
+		if (fresh != NULL) {
+			/* Made one last time around */
+			kc->kc_nslabs++;
+			kmem_slab_insert(&kc->kc_partial, fresh);
+			fresh = NULL;
+			continue;
+		}
+
+		spinlock_release(&kc->kc_lock);
+		if (kmem_slab_create(kc, &fresh)) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+	}
+
+	KASSERT(ks->ks_nfree > 0);
+	ks->ks_nfree--;
+	obj = kmem_slab_obj(ks, ks->ks_free[ks->ks_nfree]);
+	if (ks->ks_nfree == 0) {
+		/* Full slabs are on no list */
+		kmem_slab_remove(ks);
+	}
+
+	if (fresh != NULL) {
+		/* Someone else made one meanwhile; keep ours spare */
+		kc->kc_nslabs++;
+		kmem_slab_insert(&kc->kc_empty, fresh);
+		kc->kc_nempty++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *release = NULL;
+	vaddr_t offset;
+	unsigned index;
+
+	KASSERT(obj != NULL);
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(ks->ks_cache == kc);
+	offset = (vaddr_t)obj - (vaddr_t)ks - kc->kc_offset;
+	index = offset / kc->kc_size;
+	KASSERT(offset % kc->kc_size == 0);
+	KASSERT(index < kc->kc_perslab);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0) {
+		kmem_slab_insert(&kc->kc_partial, ks);
+	}
+	ks->ks_free[ks->ks_nfree++] = index;
+	if (ks->ks_nfree == kc->kc_perslab) {
+		kmem_slab_remove(ks);
+		if (kc->kc_nempty < KMEM_CACHE_MAXEMPTY) {
+			kmem_slab_insert(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else {
+			kc->kc_nslabs--;
+			release = ks;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (release != NULL) {
+		kmem_slab_release(release, kc->kc_perslab);
+	}
+}
+
+void
+kmem_cache_reap(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+
+	while (1) {
+		spinlock_acquire(&kc->kc_lock);
+		ks = kc->kc_empty;
+		if (ks != NULL) {
+			kmem_slab_remove(ks);
+			kc->kc_nempty--;
+			kc->kc_nslabs--;
+		}
+		spinlock_release(&kc->kc_lock);
+
+		if (ks == NULL) {
+			break;
+		}
+		kmem_slab_release(ks, kc->kc_perslab);
+	}
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Page cache for mapped files. See <pagecache.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PC_NBUCKETS	64
+
+struct pcpage {
+	struct vnode *pp_vnode;
+	off_t pp_offset;		/* page-aligned */
+	paddr_t pp_paddr;
+	bool pp_dirty;
+	bool pp_busy;			/* being read in */
+	struct pcpage *pp_next;		/* hash chain */
+};
+
+static struct pcpage *pagecache_buckets[PC_NBUCKETS];
+static struct lock *pagecache_lock;
+static struct cv *pagecache_cv;		/* for busy pages */
+static unsigned pagecache_hand;		/* next bucket to reclaim from */
+
+static
+unsigned
+pc_hash(struct vnode *vn, off_t offset)
+{
+	return ((uintptr_t)vn / sizeof(*vn) + (uint32_t)(offset / PAGE_SIZE))
+		% PC_NBUCKETS;
+}
+
+static
+struct pcpage *
+pc_find(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pp;
+
+	KASSERT(lock_do_i_hold(pagecache_lock));
+
+	for (pp = pagecache_buckets[pc_hash(vn, offset)];
+	     pp != NULL; pp = pp->pp_next) {
+		if (pp->pp_vnode == vn && pp->pp_offset == offset) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Read a page of file in. Past EOF is zero-filled.
+ */
+static
+int
+pc_readpage(struct vnode *vn, off_t offset, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio u;
+	char *kva;
+	int result;
+
+	kva = (char *)PADDR_TO_KVADDR(pa);
+	uio_kinit(&iov, &u, kva, PAGE_SIZE, offset, UIO_READ);
+	result = VOP_READ(vn, &u);
+	if (result) {
+		return result;
+	}
+	bzero(kva + PAGE_SIZE - u.uio_resid, u.uio_resid);
+	return 0;
+}
+
+/*
+ * Write a page back. Only the part of it that's within the file is
+ * written, so the file doesn't grow to a page boundary.
+ */
+static
+int
+pc_writepage(struct pcpage *pp)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(pp->pp_vnode, &st);
+	if (result) {
+		return result;
+	}
+	if (pp->pp_offset >= st.st_size) {
+		return 0;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - pp->pp_offset < PAGE_SIZE) {
+		len = st.st_size - pp->pp_offset;
+	}
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(pp->pp_paddr), len,
+		  pp->pp_offset, UIO_WRITE);
+	return VOP_WRITE(pp->pp_vnode, &u);
+}
+
+/*
+ * Write back a dirty page; it's clean afterwards only if no mapping
+ * is left that might write to it again.
+ */
+static
+void
+pc_clean(struct pcpage *pp)
+{
+	int result;
+
+	KASSERT(pp->pp_dirty);
+
+	result = pc_writepage(pp);
+	if (result) {
+		kprintf("pagecache: writeback: %s\n", strerror(result));
+		return;
+	}
+	if (coremap_refcount(pp->pp_paddr) == 1) {
+		pp->pp_dirty = false;
+	}
+}
+
+void
+pagecache_bootstrap(void)
+{
+	unsigned i;
+
+	pagecache_lock = lock_create("pagecache");
+	if (pagecache_lock == NULL) {
+		panic("Creating pagecache lock failed\n");
+	}
+	pagecache_cv = cv_create("pagecache");
+	if (pagecache_cv == NULL) {
+		panic("Creating pagecache cv failed\n");
+	}
+	for (i=0; i<PC_NBUCKETS; i++) {
+		pagecache_buckets[i] = NULL;
+	}
+}
+
+int
+pagecache_get(struct vnode *vn, off_t offset, paddr_t *ret)
+{
+	struct pcpage *pp, **ppp;
+	unsigned b;
+	paddr_t pa;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pagecache_lock);
+	while ((pp = pc_find(vn, offset)) != NULL && pp->pp_busy) {
+		/* someone else is reading it in */
+		cv_wait(pagecache_cv, pagecache_lock);
+	}
+	if (pp != NULL) {
+		coremap_share(pp->pp_paddr);
+		*ret = pp->pp_paddr;
+		lock_release(pagecache_lock);
+		return 0;
+	}
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		lock_release(pagecache_lock);
+		return ENOMEM;
+	}
+	pa = coremap_alloc(1);
+	if (pa == 0) {
+		kfree(pp);
+		lock_release(pagecache_lock);
+		return ENOMEM;
+	}
+
+	VOP_INCREF(vn);
+	pp->pp_vnode = vn;
+	pp->pp_offset = offset;
+	pp->pp_paddr = pa;
+	pp->pp_dirty = false;
+	pp->pp_busy = true;
+	b = pc_hash(vn, offset);
+	pp->pp_next = pagecache_buckets[b];
+	pagecache_buckets[b] = pp;
+
+	/*
+	 * Read without the lock, so faults on other pages (or other
+	 * files) don't wait for this one.
+	 */
+	lock_release(pagecache_lock);
+	result = pc_readpage(vn, offset, pa);
+	lock_acquire(pagecache_lock);
+
+	pp->pp_busy = false;
+	cv_broadcast(pagecache_cv, pagecache_lock);
+	if (result) {
+		for (ppp = &pagecache_buckets[b]; *ppp != pp;
+		     ppp = &(*ppp)->pp_next) {
+			KASSERT(*ppp != NULL);
+		}
+		*ppp = pp->pp_next;
+		coremap_free(pa);
+		VOP_DECREF(vn);
+		kfree(pp);
+		lock_release(pagecache_lock);
+		return result;
+	}
+
+	/* One reference for the cache, one for the caller */
+	coremap_share(pa);
+	*ret = pa;
+	lock_release(pagecache_lock);
+	return 0;
+}
+
+int
+pagecache_lookup(struct vnode *vn, off_t offset, paddr_t *ret)
+{
+	struct pcpage *pp;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pagecache_lock);
+	pp = pc_find(vn, offset);
+	if (pp == NULL || pp->pp_busy) {
+		lock_release(pagecache_lock);
+		return ENOENT;
+	}
+	coremap_share(pp->pp_paddr);
+	*ret = pp->pp_paddr;
+	lock_release(pagecache_lock);
+	return 0;
+}
+
+void
+pagecache_setdirty(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pp;
+
+	lock_acquire(pagecache_lock);
+	pp = pc_find(vn, offset);
+	KASSERT(pp != NULL);
+	pp->pp_dirty = true;
+	lock_release(pagecache_lock);
+}
+
+int
+pagecache_flush(struct vnode *vn)
+{
+	struct pcpage *pp;
+	unsigned i;
+	int result;
+
+	lock_acquire(pagecache_lock);
+	for (i=0; i<PC_NBUCKETS; i++) {
+		for (pp = pagecache_buckets[i]; pp != NULL;
+		     pp = pp->pp_next) {
+			if (pp->pp_vnode != vn || !pp->pp_dirty) {
+				continue;
+			}
+			result = pc_writepage(pp);
+			if (result) {
+				lock_release(pagecache_lock);
+				return result;
+			}
+			if (coremap_refcount(pp->pp_paddr) == 1) {
+				pp->pp_dirty = false;
+			}
+		}
+	}
+	lock_release(pagecache_lock);
+	return 0;
+}
+
+void
+pagecache_sync(void)
+{
+	struct pcpage *pp;
+	unsigned i;
+
+	if (lock_do_i_hold(pagecache_lock) ||
+	    !lock_tryacquire(pagecache_lock)) {
+		return;
+	}
+	for (i=0; i<PC_NBUCKETS; i++) {
+		for (pp = pagecache_buckets[i]; pp != NULL;
+		     pp = pp->pp_next) {
+			if (pp->pp_dirty) {
+				pc_clean(pp);
+			}
+		}
+	}
+	lock_release(pagecache_lock);
+}
+
+unsigned
+pagecache_reclaim(unsigned npages)
+{
+	struct pcpage *pp, **ppp;
+	unsigned i, freed;
+
+	if (lock_do_i_hold(pagecache_lock) ||
+	    !lock_tryacquire(pagecache_lock)) {
+		/* may be an allocation made with the lock held */
+		return 0;
+	}
+	freed = 0;
+	for (i=0; i<PC_NBUCKETS && freed < npages; i++) {
+		ppp = &pagecache_buckets[pagecache_hand];
+		pagecache_hand = (pagecache_hand + 1) % PC_NBUCKETS;
+		while (*ppp != NULL && freed < npages) {
+			pp = *ppp;
+			if (pp->pp_busy ||
+			    coremap_refcount(pp->pp_paddr) > 1) {
+				/* being read in, or still mapped */
+				ppp = &pp->pp_next;
+				continue;
+			}
+			if (pp->pp_dirty) {
+				pc_clean(pp);
+				if (pp->pp_dirty) {
+					ppp = &pp->pp_next;
+					continue;
+				}
+			}
+			*ppp = pp->pp_next;
+			coremap_free(pp->pp_paddr);
+			VOP_DECREF(pp->pp_vnode);
+			kfree(pp);
+			freed++;
+		}
+	}
+	lock_release(pagecache_lock);
+	return freed;
+}
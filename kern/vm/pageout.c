@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * The pageout daemon. See <swap.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
+
+/*
+ * The daemon wakes up when fewer than PAGEOUT_LOW pages are free and
+ * then evicts until PAGEOUT_HIGH are, or until it has gone round the
+ * coremap twice (once to clear the reference bits, once to evict).
+ */
+#define PAGEOUT_LOW	32
+#define PAGEOUT_HIGH	64
+
+/*
+ * Pages written through shared mappings are written back this often
+ * (seconds) even if memory isn't short.
+ */
+#define PAGEOUT_SYNCSECS	5
+
+static struct thread *pageout_thread;
+static struct lock *pageout_lock;
+static struct cv *pageout_cv;		/* daemon waits for work */
+static struct cv *pageout_donecv;	/* others wait for a pass */
+static bool pageout_kicked;		/* work requested */
+static unsigned pageout_passes;		/* passes completed */
+static unsigned pageout_lastfreed;	/* pages freed by last pass */
+
+/*
+ * Write out the page at VADDR in AS, with PTE *PTE, and after it as
+ * many of the pages following it as are also unused, up to
+ * SWAP_CLUSTER. The first page has been marked busy by the caller.
+ * Returns the number of pages freed.
+ */
+static
+unsigned
+pageout_cluster(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	pte_t *ptes[SWAP_CLUSTER];
+	pte_t oldptes[SWAP_CLUSTER];
+	paddr_t pages[SWAP_CLUSTER];
+	unsigned i, n, slot;
+	vaddr_t va;
+	pte_t *p;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	ptes[0] = pte;
+	pages[0] = *pte & PTE_FRAME;
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		va = vaddr + n * PAGE_SIZE;
+		if (va >= USERSPACETOP) {
+			break;
+		}
+		p = pt_lookup(as->as_pt, va, false);
+		if (p == NULL || (*p & (PTE_VALID | PTE_REF)) != PTE_VALID) {
+			break;
+		}
+		if (!coremap_trybusy(*p & PTE_FRAME)) {
+			break;
+		}
+		ptes[n] = p;
+		pages[n] = *p & PTE_FRAME;
+	}
+
+	slot = swap_alloc(n);
+	if (slot == SWAP_NOSLOT && n > 1) {
+		/* Fragmented; settle for the one page. */
+		for (i=1; i<n; i++) {
+			coremap_unbusy(pages[i]);
+		}
+		n = 1;
+		slot = swap_alloc(1);
+	}
+	if (slot == SWAP_NOSLOT) {
+		coremap_unbusy(pages[0]);
+		return 0;
+	}
+
+	/*
+	 * Unmap first so nobody changes the pages while we write them.
+	 * Faults on them wait for the address space lock, which we
+	 * hold until the new PTEs are final.
+	 */
+	for (i=0; i<n; i++) {
+		oldptes[i] = *ptes[i];
+		*ptes[i] = PTE_MKSWAP(slot + i);
+	}
+	as_shootdown(as, vaddr, n);
+
+	result = swap_io(slot, pages, n, UIO_WRITE);
+	if (result) {
+		kprintf("pageout: swap write: %s\n", strerror(result));
+		for (i=0; i<n; i++) {
+			*ptes[i] = oldptes[i];
+			swap_free(slot + i);
+			coremap_unbusy(pages[i]);
+		}
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		coremap_unbusy(pages[i]);
+		coremap_free(pages[i]);
+	}
+	return n;
+}
+
+/*
+ * Look at one page the clock hand has picked, which is marked busy:
+ * give it a second chance if it has been used, otherwise evict it.
+ * Returns the number of pages freed.
+ */
+static
+unsigned
+pageout_page(struct addrspace *as, vaddr_t vaddr, paddr_t pa)
+{
+	pte_t *pte;
+	unsigned freed;
+
+	/*
+	 * Never wait for the lock: its holder may be waiting for us.
+	 * The busy mark keeps AS from being destroyed meanwhile.
+	 */
+	if (!lock_tryacquire(as->as_lock)) {
+		coremap_unbusy(pa);
+		return 0;
+	}
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL || (*pte & PTE_VALID) == 0 ||
+	    (*pte & PTE_FRAME) != pa) {
+		/* The owner record is stale; skip it. */
+		freed = 0;
+		coremap_unbusy(pa);
+	}
+	else if (*pte & PTE_REF) {
+		/*
+		 * Clear the reference bit, and the TLB entry so that
+		 * the next use faults and sets it again.
+		 */
+		*pte &= ~PTE_REF;
+		as_shootdown(as, vaddr, 1);
+		freed = 0;
+		coremap_unbusy(pa);
+	}
+	else {
+		freed = pageout_cluster(as, vaddr, pte);
+	}
+
+	lock_release(as->as_lock);
+	return freed;
+}
+
+static
+unsigned
+pageout_scan(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t pa;
+	unsigned budget, freed;
+
+	/* Unmapped file pages are cheapest to get back. */
+	freed = 0;
+	if (coremap_freepages() < PAGEOUT_HIGH) {
+		freed = pagecache_reclaim(PAGEOUT_HIGH - coremap_freepages());
+	}
+
+	budget = 2 * coremap_totalpages();
+	while (coremap_freepages() < PAGEOUT_HIGH &&
+	       coremap_clock(&budget, &as, &vaddr, &pa)) {
+		freed += pageout_page(as, vaddr, pa);
+	}
+	return freed;
+}
+
+static
+void
+pageout_daemon(void *data1, unsigned long data2)
+{
+	struct timespec delay;
+	unsigned freed;
+
+	(void)data1;
+	(void)data2;
+
+	pageout_thread = curthread;
+	thread_setclass(SCHED_HIGH);
+	delay.tv_sec = PAGEOUT_SYNCSECS;
+	delay.tv_nsec = 0;
+
+	lock_acquire(pageout_lock);
+	while (1) {
+		while (!pageout_kicked) {
+			if (cv_wait_timeout(pageout_cv, pageout_lock,
+					    &delay) == ETIMEDOUT) {
+				lock_release(pageout_lock);
+				pagecache_sync();
+				lock_acquire(pageout_lock);
+			}
+		}
+		pageout_kicked = false;
+		lock_release(pageout_lock);
+
+		freed = pageout_scan();
+
+		lock_acquire(pageout_lock);
+		pageout_lastfreed = freed;
+		pageout_passes++;
+		cv_broadcast(pageout_donecv, pageout_lock);
+	}
+}
+
+void
+pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_lock = lock_create("pageout");
+	if (pageout_lock == NULL) {
+		panic("Creating pageout lock failed\n");
+	}
+	pageout_cv = cv_create("pageout");
+	if (pageout_cv == NULL) {
+		panic("Creating pageout_cv failed\n");
+	}
+	pageout_donecv = cv_create("pageout_done");
+	if (pageout_donecv == NULL) {
+		panic("Creating pageout_donecv failed\n");
+	}
+
+	result = thread_fork("pageout", NULL, pageout_daemon, NULL, 0);
+	if (result) {
+		panic("Starting pageout daemon failed\n");
+	}
+}
+
+void
+pageout_poke(void)
+{
+	if (pageout_lock == NULL || pageout_kicked ||
+	    coremap_freepages() >= PAGEOUT_LOW) {
+		return;
+	}
+	lock_acquire(pageout_lock);
+	pageout_kicked = true;
+	cv_signal(pageout_cv, pageout_lock);
+	lock_release(pageout_lock);
+}
+
+bool
+pageout_wait(void)
+{
+	unsigned pass;
+	bool ret;
+
+	if (pageout_lock == NULL || curthread == pageout_thread) {
+		/* No swap, or we are the daemon and waiting won't help */
+		return false;
+	}
+
+	lock_acquire(pageout_lock);
+	pageout_kicked = true;
+	cv_signal(pageout_cv, pageout_lock);
+	pass = pageout_passes;
+	while (pageout_passes == pass) {
+		cv_wait(pageout_donecv, pageout_lock);
+	}
+	ret = pageout_lastfreed > 0;
+	lock_release(pageout_lock);
+	return ret;
+}
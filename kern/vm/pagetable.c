@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Two-level user page tables. See <pagetable.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagetable.h>
+
+#define PT_LEAFBITS	10
+#define PT_LEAFSIZE	(1U << PT_LEAFBITS)	/* PTEs per leaf */
+#define PT_LEAFSPAN	(PT_LEAFSIZE * PAGE_SIZE)	/* bytes per leaf */
+#define PT_NDIR		(USERSPACETOP / PT_LEAFSPAN)
+
+#define PT_DIRINDEX(va)		((va) / PT_LEAFSPAN)
+#define PT_LEAFINDEX(va)	(((va) / PAGE_SIZE) & (PT_LEAFSIZE - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_NDIR];
+};
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NDIR; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+static
+pte_t *
+pt_leafcreate(void)
+{
+	vaddr_t va;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+	bzero((void *)va, PAGE_SIZE);
+	return (pte_t *)va;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	pte_t *leaf;
+	unsigned i, j;
+
+	for (i=0; i<PT_NDIR; i++) {
+		leaf = pt->pt_dir[i];
+		if (leaf == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_LEAFSIZE; j++) {
+			if (leaf[j] & PTE_VALID) {
+				coremap_free(leaf[j] & PTE_FRAME);
+			}
+			else if (leaf[j] & PTE_SWAP) {
+				swap_free(PTE_SLOT(leaf[j]));
+			}
+		}
+		free_kpages((vaddr_t)leaf);
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *leaf;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	leaf = pt->pt_dir[PT_DIRINDEX(vaddr)];
+	if (leaf == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		leaf = pt_leafcreate();
+		if (leaf == NULL) {
+			return NULL;
+		}
+		pt->pt_dir[PT_DIRINDEX(vaddr)] = leaf;
+	}
+	return &leaf[PT_LEAFINDEX(vaddr)];
+}
+
+int
+pt_copy(struct pagetable *src, struct pagetable **ret)
+{
+	struct pagetable *pt;
+	pte_t *from, *to;
+	unsigned i, j;
+
+	pt = pt_create();
+	if (pt == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<PT_NDIR; i++) {
+		from = src->pt_dir[i];
+		if (from == NULL) {
+			continue;
+		}
+		to = pt_leafcreate();
+		if (to == NULL) {
+			pt_destroy(pt);
+			return ENOMEM;
+		}
+		pt->pt_dir[i] = to;
+		for (j=0; j<PT_LEAFSIZE; j++) {
+			if (from[j] & PTE_VALID) {
+				coremap_share(from[j] & PTE_FRAME);
+				from[j] &= ~PTE_WRITE;
+			}
+			else if (from[j] & PTE_SWAP) {
+				swap_share(PTE_SLOT(from[j]));
+			}
+			to[j] = from[j];
+		}
+	}
+
+	*ret = pt;
+	return 0;
+}
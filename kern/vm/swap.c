@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Swap space. See <swap.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;
+static unsigned swap_nslots;
+static uint16_t *swap_refs;		/* per slot; 0 means free */
+static unsigned swap_nfree;
+static unsigned swap_hint;		/* where to start looking */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	unsigned i;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: VOP_STAT: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots > PTE_SLOT(PTE_FRAME)) {
+		/* can't name any more in a PTE */
+		swap_nslots = PTE_SLOT(PTE_FRAME);
+	}
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_refs == NULL) {
+		panic("swap: out of memory\n");
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_refs[i] = 0;
+	}
+	swap_nfree = swap_nslots;
+	swap_hint = 0;
+
+	kprintf("swap: %s, %uk\n", SWAP_DEVICE,
+		swap_nslots * (PAGE_SIZE / 1024));
+
+	pageout_bootstrap();
+}
+
+unsigned
+swap_alloc(unsigned nslots)
+{
+	unsigned start, run, i, n;
+
+	KASSERT(nslots > 0);
+
+	if (swap_vnode == NULL) {
+		return SWAP_NOSLOT;
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (swap_nfree < nslots) {
+		spinlock_release(&swap_lock);
+		return SWAP_NOSLOT;
+	}
+
+	/* Look for a long enough run, starting where we left off. */
+	start = swap_hint;
+	run = 0;
+	for (n=0; n < swap_nslots + nslots; n++) {
+		i = (swap_hint + n) % swap_nslots;
+		if (i == 0) {
+			/* runs don't wrap around */
+			run = 0;
+		}
+		if (swap_refs[i] != 0) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			start = i;
+		}
+		if (++run == nslots) {
+			for (i=start; i<start+nslots; i++) {
+				swap_refs[i] = 1;
+			}
+			swap_nfree -= nslots;
+			swap_hint = (start + nslots) % swap_nslots;
+			spinlock_release(&swap_lock);
+			return start;
+		}
+	}
+	spinlock_release(&swap_lock);
+	return SWAP_NOSLOT;
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		swap_nfree++;
+	}
+	spinlock_release(&swap_lock);
+}
+
+int
+swap_io(unsigned slot, const paddr_t *pages, unsigned npages,
+	enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	unsigned i;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	KASSERT(slot + npages <= swap_nslots);
+
+	for (i=0; i<npages; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pages[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = (off_t)slot * PAGE_SIZE;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+	u.uio_direct = true;
+	u.uio_dsync = false;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid > 0) {
+		return EIO;
+	}
+	return 0;
+}
@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Demand-paged VM system. (dumbvm replaces this file when enabled.)
+ *
+ * User pages are allocated from the coremap the first time they're
+ * touched and zero-filled; load_elf fills in the image pages by
+ * writing to them. TLB misses are refilled from the page table.
+ *
+ * A first touch that only reads maps the shared zero page, read-only,
+ * and the first write replaces it like a copy-on-write page, so big
+ * arrays that are mostly read while still zero take no memory. Idle
+ * cpus keep a small pool of pages zeroed ahead of time (see vm_idle)
+ * so that faults needing a fresh zero page don't have to clear one.
+ * The zero page has a coremap reference of its own and one per
+ * mapping, so it is never owned, paged out, or made writeable in
+ * place; when its count nears the coremap's limit a first read gets
+ * a page of its own instead.
+ *
+ * After fork, pages are shared copy-on-write (see pt_copy): a write
+ * to a page that's mapped without PTE_WRITE in a writeable region
+ * copies it, unless nobody else is left sharing it, in which case
+ * it's just made writeable again.
+ *
+ * Pages the pageout daemon has written to swap are read back on
+ * fault, together with the paged-out pages that follow them in the
+ * same swap cluster. Every fault sets PTE_REF, which the daemon's
+ * clock clears; see pageout.c.
+ *
+ * Pages of regions that map a file come from the page cache. They're
+ * mapped without PTE_WRITE at first: in a shared mapping the first
+ * write marks the cached page dirty and just enables writing, and in
+ * a private one it's copied like any other copy-on-write page. This
+ * is how executables are loaded too (see load_elf), except that the
+ * page a segment's file part ends in is always given a private copy
+ * with the rest zeroed. A fault on a file page also maps the next few
+ * pages of the file: ones already cached always, and when the faults
+ * look sequential, ones that have to be read in.
+ *
+ * When memory runs out we wait for the daemon and retry, without
+ * the address space lock so the daemon can evict from it too.
+ *
+ * The MIPS TLB only maps 4K pages, so there's no way to cover big
+ * regions with fewer entries, and kernel memory is in kseg0 and never
+ * uses the TLB anyway. What we can do is make refills cheap: a miss
+ * on a page whose PTE is valid and marked used is loaded straight
+ * from the page table, without the address space lock. See
+ * vm_tlbrefill.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <clock.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <vm.h>
+#include <buf.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <ktrace.h>
+
+/* How many pageout passes alloc_kpages waits for before giving up */
+#define VM_ALLOCTRIES	4
+
+/* Pages mapped by a fault on a file page, including that one */
+#define VM_FAULTAROUND	8
+
+/*
+ * Most mappings of the zero page made by faults. The coremap count is
+ * 16 bits; the rest is left for fork to copy them.
+ */
+#define VM_ZEROMAPS	0x8000
+
+/* Size of the pool of pre-zeroed pages, and free pages to leave be */
+#define VM_ZEROPOOL	16
+#define VM_ZEROMINFREE	128
+
+static paddr_t vm_zeropage;
+static paddr_t vm_zeropool[VM_ZEROPOOL];
+static unsigned vm_nzeroed;
+static struct spinlock vm_zeropool_lock = SPINLOCK_INITIALIZER;
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	pagecache_bootstrap();
+
+	vm_zeropage = coremap_alloc(1);
+	if (vm_zeropage == 0) {
+		panic("vm: Could not allocate the zero page\n");
+	}
+	bzero((void *)PADDR_TO_KVADDR(vm_zeropage), PAGE_SIZE);
+}
+
+/*
+ * Give back the pages in the zero pool, for when memory runs out.
+ * Returns how many there were.
+ */
+static
+unsigned
+vm_zeropool_drain(void)
+{
+	paddr_t pages[VM_ZEROPOOL];
+	unsigned i, n;
+
+	spinlock_acquire(&vm_zeropool_lock);
+	n = vm_nzeroed;
+	for (i=0; i<n; i++) {
+		pages[i] = vm_zeropool[i];
+	}
+	vm_nzeroed = 0;
+	spinlock_release(&vm_zeropool_lock);
+
+	for (i=0; i<n; i++) {
+		coremap_free(pages[i]);
+	}
+	return n;
+}
+
+/*
+ * Called from the idle loop, with interrupts off: zero a page for the
+ * pool if it isn't full, one page per call so as not to keep off
+ * interrupts for long. Leave memory that's getting short alone.
+ */
+bool
+vm_idle(void)
+{
+	paddr_t pa;
+
+	if (vm_zeropage == 0 || vm_nzeroed >= VM_ZEROPOOL ||
+	    coremap_freepages() < VM_ZEROMINFREE) {
+		/* vm_nzeroed is only a hint here */
+		return false;
+	}
+	pa = coremap_alloc(1);
+	if (pa == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&vm_zeropool_lock);
+	if (vm_nzeroed < VM_ZEROPOOL) {
+		vm_zeropool[vm_nzeroed++] = pa;
+		pa = 0;
+	}
+	spinlock_release(&vm_zeropool_lock);
+
+	if (pa != 0) {
+		/* Another cpu filled it first */
+		coremap_free(pa);
+	}
+	return true;
+}
+
+/*
+ * Check that we're in a context that can sleep; see the comment on
+ * the identical check in dumbvm.c.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+	unsigned tries;
+
+	vm_can_sleep();
+	for (tries = 0; ; tries++) {
+		pa = coremap_alloc(npages);
+		if (pa != 0) {
+			break;
+		}
+		/*
+		 * Ask the buffer cache and the page cache to give some
+		 * memory back, then the pageout daemon. The daemon frees
+		 * single pages, which may not add up to a large enough
+		 * block, so don't keep at it forever.
+		 */
+		if (vm_zeropool_drain() > 0 || buffer_shrink(npages) > 0 ||
+		    pagecache_reclaim(npages) > 0) {
+			pa = coremap_alloc(npages);
+			if (pa != 0) {
+				break;
+			}
+		}
+		if (tries == VM_ALLOCTRIES || !pageout_wait()) {
+			return 0;
+		}
+	}
+	pageout_poke();
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= PADDR_TO_KVADDR(0));
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+/* Report how many pages are still free */
+unsigned
+vm_freepages(void)
+{
+	return coremap_freepages();
+}
+
+/*
+ * Allocate a page for a user mapping. Doesn't wait for the pageout
+ * daemon; the caller does that once it has dropped its locks.
+ */
+static
+paddr_t
+vm_getpage(void)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc(1);
+	if (pa == 0) {
+		if (vm_zeropool_drain() == 0 && buffer_shrink(1) == 0) {
+			pagecache_reclaim(1);
+		}
+		pa = coremap_alloc(1);
+	}
+	pageout_poke();
+	return pa;
+}
+
+/*
+ * Same, but zero-filled: from the pool if there's one there, and
+ * otherwise cleared now.
+ */
+static
+paddr_t
+vm_getzeropage(void)
+{
+	paddr_t pa = 0;
+
+	spinlock_acquire(&vm_zeropool_lock);
+	if (vm_nzeroed > 0) {
+		pa = vm_zeropool[--vm_nzeroed];
+	}
+	spinlock_release(&vm_zeropool_lock);
+	if (pa != 0) {
+		pageout_poke();
+		return pa;
+	}
+
+	pa = vm_getpage();
+	if (pa != 0) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+	return pa;
+}
+
+/*
+ * Give the page *PTE maps a private, writeable copy if it is shared.
+ */
+static
+int
+vm_cowfault(pte_t *pte)
+{
+	paddr_t oldpa, pa;
+
+	oldpa = *pte & PTE_FRAME;
+	if (oldpa == vm_zeropage) {
+		/* No need to copy zeros */
+		pa = vm_getzeropage();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		*pte = pa | (*pte & ~PTE_FRAME);
+		coremap_free(oldpa);
+	}
+	else if (coremap_refcount(oldpa) > 1) {
+		pa = vm_getpage();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(pa),
+			(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+		*pte = pa | (*pte & ~PTE_FRAME);
+		coremap_free(oldpa);
+	}
+	*pte |= PTE_WRITE;
+	return 0;
+}
+
+/*
+ * Read the page at VADDR, whose PTE *PTE says it's in swap, back in,
+ * along with any following pages that went out in the same cluster.
+ * Only the faulting page is marked used. Pages come back private,
+ * but writeable only if WRITABLE and only the faulting one; the others
+ * get that on their first write the same way as copy-on-write pages.
+ */
+static
+int
+vm_swapin(struct addrspace *as, vaddr_t vaddr, pte_t *pte, bool writable)
+{
+	pte_t *ptes[SWAP_CLUSTER];
+	paddr_t pages[SWAP_CLUSTER];
+	unsigned i, n, slot;
+	vaddr_t va;
+	pte_t *p;
+	int result;
+
+	slot = PTE_SLOT(*pte);
+	pages[0] = vm_getpage();
+	if (pages[0] == 0) {
+		return ENOMEM;
+	}
+	ptes[0] = pte;
+
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		va = vaddr + n * PAGE_SIZE;
+		if (va >= USERSPACETOP) {
+			break;
+		}
+		p = pt_lookup(as->as_pt, va, false);
+		if (p == NULL || (*p & (PTE_VALID | PTE_SWAP)) != PTE_SWAP ||
+		    PTE_SLOT(*p) != slot + n) {
+			break;
+		}
+		/* Read-ahead is only worth it while memory's not short. */
+		pages[n] = coremap_alloc(1);
+		if (pages[n] == 0) {
+			break;
+		}
+		ptes[n] = p;
+	}
+
+	result = swap_io(slot, pages, n, UIO_READ);
+	if (result) {
+		for (i=0; i<n; i++) {
+			coremap_free(pages[i]);
+		}
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		*ptes[i] = pages[i] | PTE_VALID;
+		swap_free(slot + i);
+		coremap_setowner(pages[i], as, vaddr + i * PAGE_SIZE);
+	}
+	*pte |= PTE_REF;
+	if (writable) {
+		*pte |= PTE_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * After a fault on the file page at VADDR in VR, map the following
+ * pages of the file that aren't mapped yet, read-only like the first.
+ * Only pages already in the cache are used unless VADDR is where the
+ * last such run ended. Failures just end the run early.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct vm_region *vr, vaddr_t vaddr)
+{
+	bool readahead;
+	size_t pos;
+	unsigned i;
+	vaddr_t va;
+	pte_t *pte;
+	paddr_t pa;
+	int result;
+
+	readahead = (vaddr == vr->vr_nextfault);
+	for (i=1; i<VM_FAULTAROUND; i++) {
+		va = vaddr + i * PAGE_SIZE;
+		pos = va - vr->vr_base;
+		if (pos >= vr->vr_npages * PAGE_SIZE ||
+		    pos + PAGE_SIZE > vr->vr_filesize) {
+			break;
+		}
+		pte = pt_lookup(as->as_pt, va, true);
+		if (pte == NULL) {
+			break;
+		}
+		if (*pte != 0) {
+			continue;
+		}
+		if (readahead) {
+			result = pagecache_get(vr->vr_vnode,
+					       vr->vr_offset + pos, &pa);
+		}
+		else {
+			result = pagecache_lookup(vr->vr_vnode,
+						  vr->vr_offset + pos, &pa);
+		}
+		if (result) {
+			break;
+		}
+		*pte = pa | PTE_VALID;
+	}
+	vr->vr_nextfault = vaddr + i * PAGE_SIZE;
+}
+
+/*
+ * Fill in the PTE *PTE for a page of the file part of VR at VADDR.
+ */
+static
+int
+vm_filefault(struct addrspace *as, struct vm_region *vr, vaddr_t vaddr,
+	     pte_t *pte, bool writable)
+{
+	size_t pos, len;
+	paddr_t pa, cpa;
+	int result;
+
+	pos = vaddr - vr->vr_base;
+	if (pos + PAGE_SIZE <= vr->vr_filesize) {
+		result = pagecache_get(vr->vr_vnode, vr->vr_offset + pos,
+				       &pa);
+		if (result) {
+			return result;
+		}
+		*pte = pa | PTE_VALID;
+		vm_faultaround(as, vr, vaddr);
+		return 0;
+	}
+
+	/* The file part ends in this page; shared maps are whole pages. */
+	KASSERT(!vr->vr_shared);
+	pa = vm_getpage();
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	result = pagecache_get(vr->vr_vnode, vr->vr_offset + pos, &cpa);
+	if (result) {
+		coremap_free(pa);
+		return result;
+	}
+	len = vr->vr_filesize - pos;
+	memmove((void *)PADDR_TO_KVADDR(pa),
+		(const void *)PADDR_TO_KVADDR(cpa), len);
+	bzero((char *)PADDR_TO_KVADDR(pa) + len, PAGE_SIZE - len);
+	coremap_free(cpa);
+
+	*pte = pa | PTE_VALID;
+	if (writable) {
+		*pte |= PTE_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * Try to handle a TLB miss without the address space lock. Everyone
+ * else who changes a PTE that might be loaded holds the lock and then
+ * shoots the page down, and leaves are only freed with the address
+ * space. The shootdown interrupt can't get in while we're at splhigh,
+ * so if the PTE changes after we read it, the entry we load is gone
+ * again before we get back to user mode.
+ *
+ * Only PTEs that already have PTE_REF qualify; setting it would be a
+ * write that could overwrite the pageout daemon's. Returns false if
+ * the slow path is needed.
+ */
+static
+bool
+vm_tlbrefill(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	pte_t *pte, pteval;
+	bool ret;
+	int spl;
+
+	ret = false;
+	spl = splhigh();
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+	if (pte != NULL) {
+		pteval = *pte;
+		if ((pteval & (PTE_VALID | PTE_REF)) == (PTE_VALID | PTE_REF) &&
+		    (faulttype == VM_FAULT_READ || (pteval & PTE_WRITE))) {
+			tlb_load(faultaddress, pteval & PTE_FRAME,
+				 (pteval & PTE_WRITE) != 0);
+			curthread->t_usage.u_minflt++;
+			ret = true;
+		}
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Handle a fault with the address space lock held.
+ */
+static
+int
+vm_fault_locked(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	struct vm_region *vr;
+	unsigned perms;
+	bool writable, major;
+	pte_t *pte;
+	paddr_t pa;
+	int result;
+
+	perms = as_getperms(as, faultaddress);
+	writable = (perms & VR_WRITE) != 0 || as->as_loading;
+	if (perms == 0 || (faulttype != VM_FAULT_READ && !writable)) {
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+	vr = as_findregion(as, faultaddress);
+	KASSERT(vr != NULL);
+	major = false;
+
+	if (*pte & PTE_SWAP) {
+		result = vm_swapin(as, faultaddress, pte, writable);
+		if (result) {
+			return result;
+		}
+		major = true;
+	}
+	else if ((*pte & PTE_VALID) == 0 && vr->vr_vnode != NULL &&
+		 faultaddress - vr->vr_base < vr->vr_filesize) {
+		result = vm_filefault(as, vr, faultaddress, pte, writable);
+		if (result) {
+			return result;
+		}
+	}
+	else if ((*pte & PTE_VALID) == 0 && faulttype == VM_FAULT_READ &&
+		 coremap_refcount(vm_zeropage) < VM_ZEROMAPS) {
+		/* First touch is a read: share the zero page. */
+		coremap_share(vm_zeropage);
+		*pte = vm_zeropage | PTE_VALID;
+	}
+	else if ((*pte & PTE_VALID) == 0) {
+		/* First touch: demand zero-fill. */
+		pa = vm_getzeropage();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		*pte = pa | PTE_VALID;
+		if (writable) {
+			*pte |= PTE_WRITE;
+		}
+	}
+
+	if (faulttype != VM_FAULT_READ && (*pte & PTE_WRITE) == 0) {
+		if (vr->vr_shared) {
+			pagecache_setdirty(vr->vr_vnode,
+				vr->vr_offset + (faultaddress - vr->vr_base));
+			*pte |= PTE_WRITE;
+		}
+		else {
+			result = vm_cowfault(pte);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	*pte |= PTE_REF;
+	if (major) {
+		curthread->t_usage.u_majflt++;
+	}
+	else {
+		curthread->t_usage.u_minflt++;
+	}
+	if (coremap_refcount(*pte & PTE_FRAME) == 1) {
+		/* New page, or the last one left sharing it */
+		coremap_setowner(*pte & PTE_FRAME, as, faultaddress);
+	}
+
+	tlb_load(faultaddress, *pte & PTE_FRAME, (*pte & PTE_WRITE) != 0);
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+	KTRACE(KT_VMFAULT, faulttype, faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	if (faultaddress == TIMEPAGE_ADDR) {
+		/* Not in any region or page table; readable by everyone. */
+		if (faulttype != VM_FAULT_READ || timepage_paddr() == 0) {
+			return EFAULT;
+		}
+		tlb_load(faultaddress, timepage_paddr(), false);
+		return 0;
+	}
+
+	if (faulttype != VM_FAULT_READONLY &&
+	    vm_tlbrefill(as, faulttype, faultaddress)) {
+		return 0;
+	}
+
+	vm_can_sleep();
+	do {
+		lock_acquire(as->as_lock);
+		result = vm_fault_locked(as, faulttype, faultaddress);
+		lock_release(as->as_lock);
+	} while (result == ENOMEM && pageout_wait());
+
+	return result;
+}
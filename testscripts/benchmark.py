@@ -0,0 +1,316 @@
+#!/usr/pkg/bin/python2.7
+# benchmark.py - run a benchmark matrix and check for regressions
+# usage: testscripts/benchmark.py [options] [workloads...]
+# options:
+#    --conf=sys161.conf	Use alternate sys161 config
+#    --kernel=KERNEL	Choose kernel to run (default "kernel")
+#    --cpus=N,N,...	Cpu counts to run (default 1,2,4)
+#    --ram=N,N,...	RAM sizes to run (default 2M,8M)
+#    --disk=DEV		File system to run on (default lhd1:, mounted as SFS)
+#    --repeat=N		Runs of each configuration; keeps the median (default 1)
+#    --timeout=N	Per-run timeout, in seconds (default 3600)
+#    --output=FILE	Write the results as JSON (default bench.json)
+#    --baseline=FILE	Compare against results saved earlier
+#    --threshold=PCT	Change that counts as a regression (default 10)
+#    --list		List the workloads and exit
+#
+# Runs each workload (default all of them) once per combination of
+# cpu count and RAM size. The buffer cache is sized from the RAM size
+# (see buffer_bootstrap) so the RAM axis is also the cache size axis.
+#
+# Each run boots OS/161, mounts the disk, runs the workload from the
+# shell, unmounts (so the dirty buffers get written), prints the
+# buffer cache stats with "buf", and shuts down. The metrics kept are
+# the shell's subprocess time for the workload, the cycle and disk
+# counts System/161 prints on exit, and the buffer cache counters,
+# plus the wakeup latencies schedpong reports.
+# The results are written as JSON; with --baseline, every metric that
+# got worse by more than the threshold is reported and the exit status
+# is 1. The workloads write to the disk, so use a scratch disk image
+# and make a new one now and then; a fuller disk is a slower disk.
+#
+# See the top of runtest.py for an explanation of the other arguments.
+#
+
+import sys
+import re
+import json
+from optparse import OptionParser
+
+import runtest
+
+############################################################
+# workloads
+
+#
+# Each workload is a command to time and a list of commands that
+# clean up after it. These run in the shell, in the root directory of
+# the disk being tested.
+#
+workloads = {
+	"psort" : ("/testbin/psort", []),
+	"parallelvm" : ("/testbin/parallelvm", []),
+	"bigfile" : ("/testbin/bigfile bench.dat 4194304/8192",
+		     ["/bin/rm bench.dat"]),
+	"dirconc" : ("/testbin/dirconc .", []),
+	"frack" : ("/testbin/frack do rmtree", []),
+	"schedpong" : ("/testbin/schedpong -p 2", []),
+}
+workloadorder = ["psort", "parallelvm", "bigfile", "dirconc", "frack",
+		 "schedpong"]
+
+############################################################
+# metrics
+
+#
+# Each metric is a name, whether bigger is better, and a regular
+# expression whose groups are summed to get the value. (The sum is
+# for the per-cpu lines System/161 prints.) Metrics that don't show
+# up in the output are left out.
+#
+metrics = [
+	("time", False,
+	 r"subprocess time: ([0-9]+\.[0-9]+) seconds"),
+	("cycles", False,
+	 r"sys161: ([0-9]+) cycles \("),
+	("runcycles", False,
+	 r"sys161: [0-9]+ cycles \(([0-9]+) run"),
+	("kerncycles", False,
+	 r"cpu[0-9]+: ([0-9]+) kern, "),
+	("usercycles", False,
+	 r"cpu[0-9]+: [0-9]+ kern, ([0-9]+) user, "),
+	("diskreads", False,
+	 r" ([0-9]+)r/[0-9]+w disk"),
+	("diskwrites", False,
+	 r" [0-9]+r/([0-9]+)w disk"),
+	("bufgets", False,
+	 r" ([0-9]+) gets \([0-9]+ hits, "),
+	("bufhitrate", True,
+	 r" gets \([0-9]+ hits, ([0-9]+)% hit rate"),
+	("bufwriteouts", False,
+	 r" ([0-9]+) writeouts \("),
+	("bufevictions", False,
+	 r" ([0-9]+) evictions \("),
+	("wakemedian", False,
+	 r"All pong groups: [0-9]+ wakeups, median ([0-9]+) us"),
+	("wakep99", False,
+	 r"All pong groups: [0-9]+ wakeups, .* p99 ([0-9]+) us"),
+	("wakemax", False,
+	 r"All pong groups: [0-9]+ wakeups, .* max ([0-9]+) us"),
+]
+
+class Capture:
+	def __init__(self):
+		self.text = ""
+	def write(self, s):
+		self.text += s
+	def flush(self):
+		pass
+# end Capture
+
+#
+# Collect the metrics from the output of one run. The time is the one
+# printed after the workload command; everything else comes after
+# that.
+#
+def scrape(text, cmd):
+	pos = text.find(cmd)
+	if pos < 0:
+		return None
+	text = text[pos:]
+	results = {}
+	for (name, bigger, pat) in metrics:
+		if name == "time":
+			m = re.search(pat, text)
+			found = [] if m is None else [m.group(1)]
+		else:
+			found = re.findall(pat, text)
+		if len(found) == 0:
+			continue
+		if name == "time":
+			results[name] = float(found[0])
+		else:
+			results[name] = sum([int(f) for f in found])
+	return results
+# end scrape
+
+def median(vals):
+	vals = sorted(vals)
+	return vals[len(vals) / 2]
+# end median
+
+############################################################
+# running
+
+def runkey(workload, cpus, ram):
+	return "%s/%dcpu/%s" % (workload, cpus, ram)
+# end runkey
+
+#
+# Run one configuration once. Returns a dict of metrics, or None if
+# the run fell over.
+#
+def runone(options, workload, cpus, ram):
+	(cmd, cleanup) = workloads[workload]
+	commands = []
+	if options.disk != "emu0:":
+		commands.append("mount sfs %s" % options.disk)
+	commands.append("cd %s" % options.disk)
+	commands.append("s")
+	commands.append(cmd)
+	commands.extend(cleanup)
+	commands.append("exit")
+	commands.append("cd /")
+	if options.disk != "emu0:":
+		commands.append("unmount %s" % options.disk)
+	commands.append("buf")
+
+	out = Capture()
+	msg = runtest.run("; ".join(commands), out,
+		conf=options.conf,
+		ram=ram,
+		cpus=cpus,
+		progress=None,
+		timeout=options.timeout,
+		kernel=options.kernel)
+	if msg is not None:
+		sys.stderr.write("benchmark.py: %s: aborted with %s\n" %
+				 (runkey(workload, cpus, ram), msg))
+		return None
+	return scrape(out.text, cmd)
+# end runone
+
+#
+# Run one configuration REPEAT times and keep the median of each
+# metric.
+#
+def runconfig(options, workload, cpus, ram):
+	runs = []
+	for i in range(options.repeat):
+		r = runone(options, workload, cpus, ram)
+		if r is None:
+			return None
+		runs.append(r)
+	result = {}
+	for name in runs[0]:
+		vals = [r[name] for r in runs if name in r]
+		result[name] = median(vals)
+	return result
+# end runconfig
+
+############################################################
+# comparison
+
+#
+# Compare against the baseline. Returns the number of regressions.
+#
+def compare(results, baseline, threshold):
+	old = {}
+	for r in baseline["results"]:
+		old[runkey(r["workload"], r["cpus"], r["ram"])] = r["metrics"]
+
+	regressions = 0
+	for r in results:
+		key = runkey(r["workload"], r["cpus"], r["ram"])
+		if key not in old:
+			print "   %s: not in baseline" % key
+			continue
+		for (name, bigger, pat) in metrics:
+			if name not in r["metrics"] or name not in old[key]:
+				continue
+			was = old[key][name]
+			now = r["metrics"][name]
+			if was == 0:
+				continue
+			change = (now - was) * 100.0 / was
+			worse = -change if bigger else change
+			if worse > threshold:
+				what = "REGRESSION"
+				regressions += 1
+			elif worse < -threshold:
+				what = "improved"
+			else:
+				continue
+			print "   %s: %s %s -> %s (%+.1f%%) %s" % \
+				(key, name, was, now, change, what)
+	return regressions
+# end compare
+
+############################################################
+# main
+
+p = OptionParser()
+p.add_option("-b", "--baseline", dest="baseline")
+p.add_option("-c", "--conf", dest="conf")
+p.add_option("-d", "--disk", dest="disk", default="lhd1:")
+p.add_option("-j", "--cpus", dest="cpus", default="1,2,4")
+p.add_option("-k", "--kernel", dest="kernel")
+p.add_option("-l", "--list", dest="list", action="store_true")
+p.add_option("-n", "--repeat", dest="repeat", type="int", default=1)
+p.add_option("-o", "--output", dest="output", default="bench.json")
+p.add_option("-r", "--ram", dest="ram", default="2M,8M")
+p.add_option("-t", "--timeout", dest="timeout", type="int", default=3600)
+p.add_option("-T", "--threshold", dest="threshold", type="float",
+	     default=10.0)
+(options, args) = p.parse_args()
+
+if options.list:
+	for w in workloadorder:
+		print "%-12s %s" % (w, workloads[w][0])
+	exit(0)
+
+todo = args
+if len(todo) == 0:
+	todo = workloadorder
+for w in todo:
+	if w not in workloads:
+		sys.stderr.write("benchmark.py: unknown workload %s\n" % w)
+		exit(1)
+cpulist = [int(c) for c in options.cpus.split(",")]
+ramlist = options.ram.split(",")
+
+baseline = None
+if options.baseline is not None:
+	f = open(options.baseline)
+	baseline = json.load(f)
+	f.close()
+
+results = []
+failed = 0
+for w in todo:
+	for cpus in cpulist:
+		for ram in ramlist:
+			key = runkey(w, cpus, ram)
+			sys.stdout.write("%s ... " % key)
+			sys.stdout.flush()
+			m = runconfig(options, w, cpus, ram)
+			if m is None or "time" not in m:
+				print "FAILED"
+				failed += 1
+				continue
+			print "%.3f sec" % m["time"]
+			results.append({
+				"workload" : w,
+				"cpus" : cpus,
+				"ram" : ram,
+				"metrics" : m,
+			})
+
+f = open(options.output, "w")
+json.dump({ "kernel" : options.kernel or "kernel",
+	    "repeat" : options.repeat,
+	    "results" : results }, f, indent=1, sort_keys=True)
+f.write("\n")
+f.close()
+print "benchmark.py: %d results written to %s" % (len(results), options.output)
+
+regressions = 0
+if baseline is not None:
+	print "benchmark.py: comparing against %s (threshold %g%%)" % \
+		(options.baseline, options.threshold)
+	regressions = compare(results, baseline, options.threshold)
+	print "benchmark.py: %d regressions" % regressions
+
+if failed > 0 or regressions > 0:
+	exit(1)
+exit(0)
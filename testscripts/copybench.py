@@ -0,0 +1,104 @@
+#!/usr/pkg/bin/python2.7
+# copybench.py - measure file copy throughput
+# usage: testscripts/copybench.py [options] [megabytes...]
+# options:
+#    --conf=sys161.conf	Use alternate sys161 config
+#    --ram=N		Force RAM size (default from sys161 config)
+#    --kernel=KERNEL	Choose kernel to run (default "kernel")
+#    --disk=DEV		File system to copy on (default lhd1:, mounted
+#			as SFS; "emu0:" uses the host directory)
+#
+# Boots OS/161, makes a file of each size given (default 1 and 4
+# megabytes) with /testbin/bigfile, copies it with /bin/cp, and
+# reports MB/s. (The shell has no redirection, so cat can't be timed
+# the same way.) The times are the ones the shell prints after each
+# command ("subprocess time"), so the kernel's __time has to work.
+#
+# See the top of runtest.py for an explanation of the other arguments.
+#
+
+import sys
+import re
+from optparse import OptionParser
+
+import runtest
+
+############################################################
+# output capture
+
+class Capture:
+	def __init__(self):
+		self.text = ""
+	def write(self, s):
+		sys.stdout.write(s)
+		self.text += s
+	def flush(self):
+		sys.stdout.flush()
+# end Capture
+
+timepat = re.compile(r"subprocess time: ([0-9]+)\.([0-9]+) seconds")
+
+#
+# Find the time printed after the (first) command line containing CMD.
+#
+def findtime(text, cmd):
+	pos = text.find(cmd)
+	if pos < 0:
+		return None
+	m = timepat.search(text, pos)
+	if m is None:
+		return None
+	return int(m.group(1)) + float("0." + m.group(2))
+# end findtime
+
+############################################################
+# main
+
+p = OptionParser()
+p.add_option("-c", "--conf", dest="conf")
+p.add_option("-d", "--disk", dest="disk", default="lhd1:")
+p.add_option("-k", "--kernel", dest="kernel")
+p.add_option("-r", "--ram", dest="ram")
+(options, args) = p.parse_args()
+
+sizes = [int(a) for a in args]
+if len(sizes) == 0:
+	sizes = [1, 4]
+
+commands = []
+if options.disk != "emu0:":
+	commands.append("mount sfs %s" % options.disk)
+commands.append("cd %s" % options.disk)
+commands.append("s")
+for mb in sizes:
+	commands.append("/testbin/bigfile cb.src %d/8192" % (mb * 1048576))
+	commands.append("/bin/cp cb.src cb.cp%d" % mb)
+	commands.append("/bin/rm cb.src")
+	commands.append("/bin/rm cb.cp%d" % mb)
+commands.append("exit")
+commands.append("cd /")
+if options.disk != "emu0:":
+	commands.append("unmount %s" % options.disk)
+
+out = Capture()
+msg = runtest.run("; ".join(commands), out,
+	conf=options.conf,
+	ram=options.ram,
+	progress=None,
+	timeout=3600,
+	kernel=options.kernel)
+if msg is not None:
+	sys.stderr.write("copybench.py: aborted with %s\n" % msg)
+	exit(1)
+
+print
+print "copybench.py: copy throughput on %s" % options.disk
+for mb in sizes:
+	secs = findtime(out.text, "cp cb.src cb.cp%d" % mb)
+	if secs is None:
+		print "   %4d MB: no time reported" % mb
+	elif secs == 0:
+		print "   %4d MB: too fast to time" % mb
+	else:
+		print "   %4d MB: %.3f sec, %.2f MB/s" % (mb, secs, mb / secs)
+exit(0)
@@ -27,8 +27,12 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -38,38 +42,80 @@
 
 
 
+/* Most bytes asked for in one copy_file_range call */
+#define CAT_CHUNK	(1024*1024)
+
+/* Smallest buffer to use when copying through userspace */
+#define CAT_MINBUF	(64*1024)
+
+/*
+ * Print the rest of a file with read and write, for a kernel without
+ * copy_file_range. The buffer is sized as in cp: the larger preferred
+ * I/O size of the two files, but at least CAT_MINBUF. A short read
+ * (e.g. a line from the console) is written out right away.
+ */
+static
+void
+slowcat(const char *name, int fd)
+{
+	struct stat st;
+	size_t bufsize, done;
+	ssize_t len, r;
+	char *buf;
+
+	bufsize = CAT_MINBUF;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_blksize > bufsize) {
+		bufsize = st.st_blksize;
+	}
+	if (fstat(STDOUT_FILENO, &st) == 0 &&
+	    (size_t)st.st_blksize > bufsize) {
+		bufsize = st.st_blksize;
+	}
+	buf = malloc(bufsize);
+	if (buf == NULL) {
+		errx(1, "Out of memory");
+	}
+
+	while ((len = read(fd, buf, bufsize)) > 0) {
+		for (done = 0; done < (size_t)len; done += r) {
+			r = write(STDOUT_FILENO, buf + done, len - done);
+			if (r < 0) {
+				err(1, "stdout");
+			}
+		}
+	}
+	if (len < 0) {
+		err(1, "%s", name);
+	}
+	free(buf);
+}
+
 /* Print a file that's already been opened. */
 static
 void
 docat(const char *name, int fd)
 {
-	char buf[1024];
-	int len, wr, wrtot;
+	int len;
 
 	/*
-	 * As long as we get more than zero bytes, we haven't hit EOF.
-	 * Zero means EOF. Less than zero means an error occurred.
-	 * We may read less than we asked for, though, in various cases
-	 * for various reasons.
+	 * Have the kernel move the data, a chunk at a time. Zero means
+	 * EOF. Less than zero means an error occurred. A short count
+	 * just means that's what the input had for now (e.g. a line
+	 * from the console), so keep going.
 	 */
-	while ((len = read(fd, buf, sizeof(buf)))>0) {
-		/*
-		 * Likewise, we may actually write less than we attempted
-		 * to. So loop until we're done.
-		 */
-		wrtot = 0;
-		while (wrtot < len) {
-			wr = write(STDOUT_FILENO, buf+wrtot, len-wrtot);
-			if (wr<0) {
-				err(1, "stdout");
-			}
-			wrtot += wr;
-		}
+	while ((len = copy_file_range(fd, NULL, STDOUT_FILENO, NULL,
+				      CAT_CHUNK, 0)) > 0) {
+		/* nothing */
 	}
 	/*
-	 * If we got a read error, print it and exit.
+	 * If the kernel doesn't have copy_file_range, do it ourselves.
+	 * If we got some other error, print it and exit. It might have
+	 * been on either side.
 	 */
-	if (len<0) {
+	if (len<0 && errno == ENOSYS) {
+		slowcat(name, fd);
+	}
+	else if (len<0) {
 		err(1, "%s", name);
 	}
 }
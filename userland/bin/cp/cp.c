@@ -27,7 +27,11 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -36,6 +40,53 @@
  */
 
 
+/* Most bytes asked for in one copy_file_range call */
+#define COPY_CHUNK	(1024*1024)
+
+/* Smallest buffer to use when copying through userspace */
+#define COPY_MINBUF	(64*1024)
+
+/*
+ * Copy the rest of FROMFD to TOFD with read and write, for a kernel
+ * without copy_file_range. Size the buffer from the files' preferred
+ * I/O sizes, but use at least COPY_MINBUF; syscalls cost much more
+ * than the memory.
+ */
+static
+void
+slowcopy(int fromfd, const char *from, int tofd, const char *to)
+{
+	struct stat st;
+	size_t bufsize, done;
+	ssize_t len, r;
+	char *buf;
+
+	bufsize = COPY_MINBUF;
+	if (fstat(fromfd, &st) == 0 && (size_t)st.st_blksize > bufsize) {
+		bufsize = st.st_blksize;
+	}
+	if (fstat(tofd, &st) == 0 && (size_t)st.st_blksize > bufsize) {
+		bufsize = st.st_blksize;
+	}
+	buf = malloc(bufsize);
+	if (buf == NULL) {
+		errx(1, "Out of memory");
+	}
+
+	while ((len = read(fromfd, buf, bufsize)) > 0) {
+		for (done = 0; done < (size_t)len; done += r) {
+			r = write(tofd, buf + done, len - done);
+			if (r < 0) {
+				err(1, "%s", to);
+			}
+		}
+	}
+	if (len < 0) {
+		err(1, "%s", from);
+	}
+	free(buf);
+}
+
 /* Copy one file to another. */
 static
 void
@@ -43,8 +94,7 @@ copy(const char *from, const char *to)
 {
 	int fromfd;
 	int tofd;
-	char buf[1024];
-	int len, wr, wrtot;
+	int len;
 
 	/*
 	 * Open the files, and give up if they won't open
@@ -59,30 +109,21 @@ copy(const char *from, const char *to)
 	}
 
 	/*
-	 * As long as we get more than zero bytes, we haven't hit EOF.
-	 * Zero means EOF. Less than zero means an error occurred.
-	 * We may read less than we asked for, though, in various cases
-	 * for various reasons.
+	 * Have the kernel move the data, a chunk at a time, through
+	 * the files' own seek positions. Zero means EOF. Less than
+	 * zero means an error occurred; copy_file_range doesn't say
+	 * which file it was on. If the kernel doesn't have it, do it
+	 * ourselves.
 	 */
-	while ((len = read(fromfd, buf, sizeof(buf)))>0) {
-		/*
-		 * Likewise, we may actually write less than we attempted
-		 * to. So loop until we're done.
-		 */
-		wrtot = 0;
-		while (wrtot < len) {
-			wr = write(tofd, buf+wrtot, len-wrtot);
-			if (wr<0) {
-				err(1, "%s", to);
-			}
-			wrtot += wr;
-		}
+	while ((len = copy_file_range(fromfd, NULL, tofd, NULL,
+				      COPY_CHUNK, 0)) > 0) {
+		/* nothing */
 	}
-	/*
-	 * If we got a read error, print it and exit.
-	 */
-	if (len<0) {
-		err(1, "%s", from);
+	if (len<0 && errno == ENOSYS) {
+		slowcopy(fromfd, from, tofd, to);
+	}
+	else if (len<0) {
+		err(1, "%s to %s", from, to);
 	}
 
 	if (close(fromfd) < 0) {
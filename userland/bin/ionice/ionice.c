@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * ionice - show or set I/O priority classes.
+ * usage: ionice [-c class] [-p pid]
+ *        ionice -c class command [args...]
+ *
+ * With -p, shows the class of process PID, or with -c too, sets it.
+ * With a command, runs the command in CLASS. With neither, shows the
+ * class of this process (that is, the shell's). CLASS is a number,
+ * as for ionice on other systems, or a name:
+ *    1  realtime
+ *    2  best-effort (the default)
+ *    3  idle
+ *
+ * Disk transfers of realtime processes go ahead of best-effort ones,
+ * and those of idle processes only go when nothing else is waiting,
+ * so run bulk copies and backups with "ionice -c idle" to keep the
+ * rest of the system responsive.
+ *
+ * This program uses these system calls:
+ *    ioprio_get ioprio_set execv write _exit
+ */
+
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static const char *const classnames[] = {
+	[IOPRIO_CLASS_RT] = "realtime",
+	[IOPRIO_CLASS_BE] = "best-effort",
+	[IOPRIO_CLASS_IDLE] = "idle",
+};
+
+static
+int
+getclass(const char *s)
+{
+	int i;
+
+	for (i=IOPRIO_CLASS_RT; i<=IOPRIO_CLASS_IDLE; i++) {
+		if (!strcmp(s, classnames[i])) {
+			return i;
+		}
+	}
+	i = atoi(s);
+	if (i < IOPRIO_CLASS_RT || i > IOPRIO_CLASS_IDLE) {
+		errx(1, "%s: Unknown class", s);
+	}
+	return i;
+}
+
+static
+void
+showclass(pid_t pid)
+{
+	int ioclass;
+
+	ioclass = ioprio_get(pid);
+	if (ioclass < 0) {
+		err(1, "ioprio_get");
+	}
+	if (ioclass < IOPRIO_CLASS_RT || ioclass > IOPRIO_CLASS_IDLE) {
+		printf("unknown class %d\n", ioclass);
+	}
+	else {
+		printf("%s\n", classnames[ioclass]);
+	}
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: ionice [-c class] [-p pid] | -c class command...");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i, ioclass = -1;
+	pid_t pid = -1;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			ioclass = getclass(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+			pid = atoi(argv[++i]);
+			if (pid <= 0) {
+				errx(1, "%s: Invalid pid", argv[i]);
+			}
+		}
+		else {
+			usage();
+		}
+	}
+
+	if (i < argc) {
+		/* run a command */
+		if (pid != -1 || ioclass == -1) {
+			usage();
+		}
+		if (ioprio_set(0, ioclass) < 0) {
+			err(1, "ioprio_set");
+		}
+		execv(argv[i], argv + i);
+		err(1, "%s", argv[i]);
+	}
+
+	if (pid == -1) {
+		pid = 0;
+	}
+	if (ioclass == -1) {
+		showclass(pid);
+	}
+	else if (ioprio_set(pid, ioclass) < 0) {
+		err(1, "ioprio_set");
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * limit - show or set cpu share and I/O rate limits.
+ * usage: limit [-c percent] [-i rate] command [args...]
+ *        limit
+ *
+ * Runs the command with its cpu share limited to PERCENT of a cpu
+ * when other threads want it too, and its disk transfers limited
+ * to RATE bytes per second (a K or M suffix multiplies by 1024 or
+ * 1024*1024). The command's children get the same limits. With no
+ * arguments, shows the limits this process got from its parent.
+ *
+ * This program uses these system calls:
+ *    getrlimit setrlimit execv write _exit
+ */
+
+#include <sys/resource.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static
+rlim_t
+getnum(const char *s, bool suffixok)
+{
+	const char *p;
+	rlim_t val;
+
+	val = 0;
+	for (p = s; *p >= '0' && *p <= '9'; p++) {
+		val = val * 10 + (*p - '0');
+	}
+	if (p == s) {
+		errx(1, "%s: Invalid number", s);
+	}
+	if (suffixok && (*p == 'k' || *p == 'K')) {
+		val *= 1024;
+		p++;
+	}
+	else if (suffixok && (*p == 'm' || *p == 'M')) {
+		val *= 1024 * 1024;
+		p++;
+	}
+	if (*p != '\0') {
+		errx(1, "%s: Invalid number", s);
+	}
+	return val;
+}
+
+static
+void
+setlimit(int resource, const char *name, rlim_t val)
+{
+	struct rlimit rl;
+
+	if (getrlimit(resource, &rl) < 0) {
+		err(1, "getrlimit");
+	}
+	if (val > rl.rlim_max) {
+		errx(1, "%s: Can't raise the limit", name);
+	}
+	rl.rlim_cur = val;
+	if (setrlimit(resource, &rl) < 0) {
+		err(1, "setrlimit");
+	}
+}
+
+static
+void
+showlimit(int resource, const char *name, const char *units)
+{
+	struct rlimit rl;
+
+	if (getrlimit(resource, &rl) < 0) {
+		err(1, "getrlimit");
+	}
+	if (rl.rlim_cur == RLIM_INFINITY) {
+		printf("%-10s unlimited\n", name);
+	}
+	else {
+		printf("%-10s %llu %s\n", name,
+		       (unsigned long long)rl.rlim_cur, units);
+	}
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: limit [-c percent] [-i rate] command...");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			i++;
+			setlimit(RLIMIT_CPUSHARE, "cpu share",
+				 getnum(argv[i], false));
+		}
+		else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			i++;
+			setlimit(RLIMIT_IORATE, "I/O rate",
+				 getnum(argv[i], true));
+		}
+		else {
+			usage();
+		}
+	}
+
+	if (i < argc) {
+		/* run a command */
+		execv(argv[i], argv + i);
+		err(1, "%s", argv[i]);
+	}
+	if (i > 1) {
+		usage();
+	}
+	showlimit(RLIMIT_CPUSHARE, "cpu share", "percent");
+	showlimit(RLIMIT_IORATE, "I/O rate", "bytes/sec");
+	return 0;
+}
@@ -34,6 +34,8 @@
 #include <string.h>
 #include <errno.h>
 #include <err.h>
+#include <limits.h>
+#include <dirent.h>
 
 /*
  * ls - list files.
@@ -127,16 +129,56 @@ printheader(const char *file)
 }
 
 /*
- * Show a single file.
+ * Show a single file, given what stat says about it (which is only
+ * needed for -l or -s).
  * We don't do the neat multicolumn listing that Unix ls does.
  */
 static
 void
+printinfo(const char *file, const struct stat *statbuf)
+{
+	int typech;
+
+	if (sopt) {
+		printf("%3d ", statbuf->st_blocks);
+	}
+
+	if (lopt) {
+		if (S_ISREG(statbuf->st_mode)) {
+			typech = '-';
+		}
+		else if (S_ISDIR(statbuf->st_mode)) {
+			typech = 'd';
+		}
+		else if (S_ISLNK(statbuf->st_mode)) {
+			typech = 'l';
+		}
+		else if (S_ISCHR(statbuf->st_mode)) {
+			typech = 'c';
+		}
+		else if (S_ISBLK(statbuf->st_mode)) {
+			typech = 'b';
+		}
+		else {
+			typech = '?';
+		}
+
+		printf("%crwx------ %2d root  %-8llu",
+		       typech,
+		       statbuf->st_nlink,
+		       statbuf->st_size);
+	}
+	printf("%s\n", file);
+}
+
+/*
+ * Show a single file by pathname.
+ */
+static
+void
 print(const char *path)
 {
 	struct stat statbuf;
-	const char *file;
-	int typech;
 
 	if (lopt || sopt) {
 		int fd;
@@ -151,38 +193,99 @@ print(const char *path)
 		close(fd);
 	}
 
-	file = basename(path);
+	printinfo(basename(path), &statbuf);
+}
 
-	if (sopt) {
-		printf("%3d ", statbuf.st_blocks);
+/*
+ * Reading directories. getdirentries hands back many entries per
+ * call, each with what printinfo needs to know, so listing a big
+ * directory doesn't take a call, an open, and an fstat per entry.
+ * If the file system doesn't do that, fall back to getdirentry,
+ * one name at a time.
+ */
+#define DIRBUF_SIZE 2048
+
+struct dirreader {
+	const char *path;		/* for error messages */
+	int fd;				/* the open directory */
+	int plus;			/* getdirentries works */
+	off_t buf[DIRBUF_SIZE / sizeof(off_t)];	/* off_t, for alignment */
+	size_t len, pos;		/* valid and used bytes of buf */
+	char name[NAME_MAX+1];		/* name, from getdirentry */
+	struct stat statbuf;		/* info, from getdirentries */
+};
+
+/*
+ * Open the directory PATH for reading.
+ */
+static
+void
+diropen(struct dirreader *dr, const char *path)
+{
+	dr->path = path;
+	dr->fd = open(path, O_RDONLY);
+	if (dr->fd<0) {
+		err(1, "%s", path);
 	}
+	dr->plus = 1;
+	dr->len = dr->pos = 0;
+}
 
-	if (lopt) {
-		if (S_ISREG(statbuf.st_mode)) {
-			typech = '-';
-		}
-		else if (S_ISDIR(statbuf.st_mode)) {
-			typech = 'd';
-		}
-		else if (S_ISLNK(statbuf.st_mode)) {
-			typech = 'l';
-		}
-		else if (S_ISCHR(statbuf.st_mode)) {
-			typech = 'c';
+/*
+ * Get the next entry: its name in NAME and, if known, its info in
+ * STATBUF (otherwise NULL). Returns 0 at the end.
+ */
+static
+int
+dirread(struct dirreader *dr, const char **name,
+	const struct stat **statbuf)
+{
+	const struct direntplus *dp;
+	ssize_t len;
+
+	if (dr->plus && dr->pos == dr->len) {
+		len = getdirentries(dr->fd, dr->buf, sizeof(dr->buf));
+		if (len<0 && errno == ENOSYS && dr->len == 0) {
+			dr->plus = 0;
 		}
-		else if (S_ISBLK(statbuf.st_mode)) {
-			typech = 'b';
+		else if (len<0) {
+			err(1, "%s: getdirentries", dr->path);
 		}
 		else {
-			typech = '?';
+			dr->len = len;
+			dr->pos = 0;
+			if (len == 0) {
+				return 0;
+			}
 		}
+	}
 
-		printf("%crwx------ %2d root  %-8llu",
-		       typech,
-		       statbuf.st_nlink,
-		       statbuf.st_size);
+	if (dr->plus) {
+		dp = (const struct direntplus *)
+			((const char *)dr->buf + dr->pos);
+		dr->pos += dp->dp_reclen;
+
+		memset(&dr->statbuf, 0, sizeof(dr->statbuf));
+		dr->statbuf.st_mode = dp->dp_type;
+		dr->statbuf.st_nlink = dp->dp_nlink;
+		dr->statbuf.st_size = dp->dp_size;
+		dr->statbuf.st_ino = dp->dp_ino;
+		*name = dp->dp_name;
+		*statbuf = &dr->statbuf;
+		return 1;
 	}
-	printf("%s\n", file);
+
+	len = getdirentry(dr->fd, dr->name, sizeof(dr->name)-1);
+	if (len<0) {
+		err(1, "%s: getdirentry", dr->path);
+	}
+	if (len == 0) {
+		return 0;
+	}
+	dr->name[len] = 0;
+	*name = dr->name;
+	*statbuf = NULL;
+	return 1;
 }
 
 /*
@@ -192,82 +295,69 @@ static
 void
 listdir(const char *path, int showheader)
 {
-	int fd;
-	char buf[1024];
+	struct dirreader dr;
+	const struct stat *statbuf;
+	const char *name;
 	char newpath[1024];
-	ssize_t len;
 
 	if (showheader) {
 		printheader(path);
 	}
 
-	/*
-	 * Open it.
-	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
-	}
-
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
-
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+	diropen(&dr, path);
+	while (dirread(&dr, &name, &statbuf)) {
+		if (!aopt && name[0]=='.') {
+			continue;
+		}
 
-		if (aopt || buf[0]!='.') {
-			/* Print it */
+		/* Print it */
+		if (statbuf != NULL) {
+			printinfo(name, statbuf);
+		}
+		else {
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s",
+				 path, name);
 			print(newpath);
 		}
 	}
-	if (len<0) {
-		err(1, "%s: getdirentry", path);
-	}
 
 	/* Done */
-	close(fd);
+	close(dr.fd);
 }
 
 static
 void
 recursedir(const char *path)
 {
-	int fd;
-	char buf[1024];
+	struct dirreader dr;
+	const struct stat *statbuf;
+	const char *name;
 	char newpath[1024];
-	int len;
-
-	/*
-	 * Open it.
-	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
-	}
 
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
-
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
-
-		if (!aopt && buf[0]=='.') {
+	diropen(&dr, path);
+	while (dirread(&dr, &name, &statbuf)) {
+		if (!aopt && name[0]=='.') {
 			/* skip this one */
 			continue;
 		}
 
-		if (!strcmp(buf, ".") || !strcmp(buf, "..")) {
+		if (!strcmp(name, ".") || !strcmp(name, "..")) {
 			/* always skip these */
 			continue;
 		}
 
-		if (!isdir(newpath)) {
+		/* Assemble the full name of the new item */
+		snprintf(newpath, sizeof(newpath), "%s/%s", path, name);
+
+		if (statbuf != NULL ? !S_ISDIR(statbuf->st_mode) :
+		    !isdir(newpath)) {
 			continue;
 		}
 
@@ -276,11 +366,8 @@ recursedir(const char *path)
 			recursedir(newpath);
 		}
 	}
-	if (len<0) {
-		err(1, "%s", path);
-	}
 
-	close(fd);
+	close(dr.fd);
 }
 
 static
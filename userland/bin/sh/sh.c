@@ -37,6 +37,7 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -45,6 +46,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <err.h>
+#include <spawn.h>
 
 #ifdef HOST
 #include "hostcompat.h"
@@ -69,46 +71,97 @@ struct exitinfo {
 /* set to nonzero if __time syscall seems to work */
 static int timing = 0;
 
-/* array of backgrounded jobs (allows "foregrounding") */
+/*
+ * table of backgrounded jobs (allows "foregrounding"). free slots are
+ * on a list, and the ones in use hang off a hash on the pid, so
+ * starting or reaping a job never scans the table.
+ */
 #define MAXBG 128
-static pid_t bgpids[MAXBG];
+#define BGHASH 32
+struct job {
+	pid_t j_pid;
+	struct job *j_next;	/* in hash chain, or on free list */
+};
+static struct job jobs[MAXBG];
+static struct job *jobhash[BGHASH];
+static struct job *jobfree;
+static unsigned njobs;
 
 /*
- * can_bg
- * just checks for an open slot.
+ * jobs_init
+ * empties the job table.
  */
 static
-int
-can_bg(void)
+void
+jobs_init(void)
 {
 	int i;
 
+	for (i = 0; i < BGHASH; i++) {
+		jobhash[i] = NULL;
+	}
+	jobfree = NULL;
 	for (i = 0; i < MAXBG; i++) {
-		if (bgpids[i] == 0) {
-			return 1;
-		}
+		jobs[i].j_pid = 0;
+		jobs[i].j_next = jobfree;
+		jobfree = &jobs[i];
 	}
+	njobs = 0;
+}
 
-	return 0;
+/*
+ * can_bg
+ * just checks for an open slot.
+ */
+static
+int
+can_bg(void)
+{
+	return jobfree != NULL;
 }
 
 /*
  * remember_bg
- * sticks the pid in an open slot in the background array.  note the assert --
+ * sticks the pid in an open slot in the job table.  note the assert --
  * better check can_bg before calling this.
  */
 static
 void
 remember_bg(pid_t pid)
 {
-	int i;
-	for (i = 0; i < MAXBG; i++) {
-		if (bgpids[i] == 0) {
-			bgpids[i] = pid;
-			return;
+	struct job *j;
+
+	assert(jobfree != NULL);
+	j = jobfree;
+	jobfree = j->j_next;
+	j->j_pid = pid;
+	j->j_next = jobhash[(unsigned)pid % BGHASH];
+	jobhash[(unsigned)pid % BGHASH] = j;
+	njobs++;
+}
+
+/*
+ * forget_bg
+ * takes the pid out of the job table. returns true if it was there.
+ */
+static
+int
+forget_bg(pid_t pid)
+{
+	struct job **jp, *j;
+
+	for (jp = &jobhash[(unsigned)pid % BGHASH]; *jp; jp = &(*jp)->j_next) {
+		j = *jp;
+		if (j->j_pid == pid) {
+			*jp = j->j_next;
+			j->j_pid = 0;
+			j->j_next = jobfree;
+			jobfree = j;
+			njobs--;
+			return 1;
 		}
 	}
-	assert(0);
+	return 0;
 }
 
 /*
@@ -209,47 +262,49 @@ dowait(pid_t pid)
 	}
 }
 
-#ifdef WNOHANG
 /*
- * dowaitpoll
- * like dowait, but uses WNOHANG. returns true if we got something.
+ * waitany
+ * waits for whichever child exits first, with waitpid(WAIT_ANY), and
+ * prints and collects its exit info. returns its pid, or 0 if OPTIONS
+ * has WNOHANG and none has exited, or -1 if there are no children.
+ * the caller decides whether it was in the job table.
  */
 static
-int
-dowaitpoll(pid_t pid)
+pid_t
+waitany(int options, struct exitinfo *ei)
 {
-	struct exitinfo ei;
-	pid_t foundpid;
+	pid_t pid;
 	int status;
 
-	foundpid = waitpid(pid, &status, WNOHANG);
-	if (foundpid < 0) {
-		warn("pid %d", pid);
+	pid = waitpid(WAIT_ANY, &status, options);
+	if (pid < 0) {
+		if (errno != ECHILD) {
+			warn("waitpid");
+		}
+		return -1;
 	}
-	else if (foundpid != 0) {
+	if (pid > 0) {
 		printf("pid %d: ", pid);
-		readstatus(status, &ei);
-		printstatus(&ei, 1);
-		return 1;
+		readstatus(status, ei);
+		printstatus(ei, 1);
 	}
-	return 0;
+	return pid;
 }
 
+#ifdef WNOHANG
 /*
  * waitpoll
- * poll all background jobs for having exited.
+ * reap whichever background jobs have exited, without blocking.
  */
 static
 void
 waitpoll(void)
 {
-	int i;
-	for (i=0; i < MAXBG; i++) {
-		if (bgpids[i] != 0) {
-			if (dowaitpoll(bgpids[i])) {
-				bgpids[i] = 0;
-			}
-		}
+	struct exitinfo ei;
+	pid_t pid;
+
+	while (njobs > 0 && (pid = waitany(WNOHANG, &ei)) > 0) {
+		forget_bg(pid);
 	}
 }
 #endif /* WNOHANG */
@@ -264,26 +319,25 @@ static
 void
 cmd_wait(int ac, char *av[], struct exitinfo *ei)
 {
-	int i;
+	struct exitinfo jobei;
 	pid_t pid;
 
 	if (ac == 2) {
 		pid = atoi(av[1]);
 		dowait(pid);
-		for (i = 0; i < MAXBG; i++) {
-			if (bgpids[i]==pid) {
-				bgpids[i] = 0;
-			}
-		}
+		forget_bg(pid);
 		exitinfo_exit(ei, 0);
 		return;
 	}
 	else if (ac == 1) {
-		for (i=0; i < MAXBG; i++) {
-			if (bgpids[i] != 0) {
-				dowait(bgpids[i]);
-				bgpids[i] = 0;
+		while (njobs > 0) {
+			pid = waitany(0, &jobei);
+			if (pid < 0) {
+				/* they're gone somehow; so is the table */
+				jobs_init();
+				break;
 			}
+			forget_bg(pid);
 		}
 		exitinfo_exit(ei, 0);
 		return;
@@ -292,6 +346,328 @@ cmd_wait(int ac, char *av[], struct exitinfo *ei)
 	exitinfo_exit(ei, 1);
 }
 
+/*
+ * elapsed
+ * time from STARTSECS/STARTNSECS until now, in *SECS and *NSECS.
+ */
+static
+void
+elapsed(time_t startsecs, unsigned long startnsecs,
+	time_t *secs, unsigned long *nsecs)
+{
+	time_t endsecs;
+	unsigned long endnsecs;
+
+	__time(&endsecs, &endnsecs);
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	*secs = endsecs - startsecs;
+	*nsecs = endnsecs - startnsecs;
+}
+
+/*
+ * startcmd
+ * starts the command ARGS with posix_spawnp rather than fork and
+ * execvp, so the kernel never copies the shell's address space only
+ * to throw it away again. a command that can't be run is reported
+ * here, and gets exit status 1 as it would if execvp had failed in a
+ * child; then returns -1.
+ */
+static
+int
+startcmd(char *args[], pid_t *pid, struct exitinfo *ei)
+{
+	int result;
+
+	result = posix_spawnp(pid, args[0], NULL, NULL, args, NULL);
+	if (result) {
+		errno = result;
+		warn("%s", args[0]);
+		exitinfo_exit(ei, 1);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * waitcmd
+ * waits for the foreground command PID and collects its exit info.
+ */
+static
+void
+waitcmd(pid_t pid, struct exitinfo *ei)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		warn("waitpid");
+		exitinfo_exit(ei, 255);
+	}
+	else {
+		readstatus(status, ei);
+	}
+}
+
+/*
+ * startstage
+ * starts one command of a pipeline: like startcmd, but with INFD as
+ * its standard input and OUTFD as its standard output (-1 leaves
+ * either alone), and with CLOSEFD (if not -1), the read end of the
+ * pipe it writes to, closed so it doesn't hold its own pipe open.
+ */
+static
+int
+startstage(char *args[], int infd, int outfd, int closefd,
+	   pid_t *pid, struct exitinfo *ei)
+{
+	posix_spawn_file_actions_t fa;
+	int result;
+
+	result = posix_spawn_file_actions_init(&fa);
+	if (!result && infd >= 0) {
+		result = posix_spawn_file_actions_adddup2(&fa, infd,
+							  STDIN_FILENO);
+		if (!result) {
+			result = posix_spawn_file_actions_addclose(&fa, infd);
+		}
+	}
+	if (!result && outfd >= 0) {
+		result = posix_spawn_file_actions_adddup2(&fa, outfd,
+							  STDOUT_FILENO);
+		if (!result) {
+			result = posix_spawn_file_actions_addclose(&fa, outfd);
+		}
+	}
+	if (!result && closefd >= 0) {
+		result = posix_spawn_file_actions_addclose(&fa, closefd);
+	}
+	if (!result) {
+		result = posix_spawnp(pid, args[0], &fa, NULL, args, NULL);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	if (result) {
+		errno = result;
+		warn("%s", args[0]);
+		exitinfo_exit(ei, 1);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * runpipeline
+ * runs the commands in ARGS separated by "|" words, each one's
+ * standard output going through a pipe to the next one's standard
+ * input, and waits for all of them. the exit code is the last
+ * command's.
+ */
+static
+void
+runpipeline(char *args[], int nargs, struct exitinfo *ei)
+{
+	pid_t pids[NARG_MAX / 2 + 1];
+	pid_t lastpid = -1;
+	struct exitinfo junk;
+	int fds[2];
+	int infd, outfd, closefd;
+	int i, start, nstages, j;
+
+	infd = -1;
+	nstages = 0;
+	start = 0;
+	for (i=0; i<=nargs; i++) {
+		if (i < nargs && strcmp(args[i], "|")) {
+			continue;
+		}
+		if (i == start) {
+			printf("sh: Missing command in pipeline\n");
+			exitinfo_exit(ei, 1);
+			break;
+		}
+		args[i] = NULL;
+		if (i < nargs) {
+			if (pipe(fds) < 0) {
+				warn("pipe");
+				exitinfo_exit(ei, 1);
+				break;
+			}
+			outfd = fds[1];
+			closefd = fds[0];
+		}
+		else {
+			outfd = closefd = -1;
+		}
+
+		if (startstage(args + start, infd, outfd, closefd,
+			       &pids[nstages], ei) == 0) {
+			if (i == nargs) {
+				lastpid = pids[nstages];
+			}
+			nstages++;
+		}
+		/* the shell itself keeps only the next stage's input */
+		if (infd >= 0) {
+			close(infd);
+		}
+		if (outfd >= 0) {
+			close(outfd);
+		}
+		infd = closefd;
+		start = i + 1;
+	}
+	if (infd >= 0) {
+		close(infd);
+	}
+
+	for (j=0; j<nstages; j++) {
+		waitcmd(pids[j], pids[j] == lastpid ? ei : &junk);
+	}
+}
+
+/*
+ * tvdiff
+ * END - START for struct timevals, in microseconds.
+ */
+static
+unsigned long long
+tvdiff(const struct timeval *start, const struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000ULL
+		+ end->tv_usec - start->tv_usec;
+}
+
+static int dobuiltin(int ac, char *av[], struct exitinfo *ei);
+
+/*
+ * time
+ * runs a command (or a builtin, such as par) and reports how long it
+ * took, wall-clock, user and system, and the faults, block I/O and
+ * context switches it cost.
+ * the counts come from getrusage(RUSAGE_CHILDREN) before and after,
+ * so they include anything the command waited for in turn; on a
+ * kernel without getrusage only the wall time is shown.
+ */
+static
+void
+cmd_time(int ac, char *av[], struct exitinfo *ei)
+{
+	struct rusage before, after;
+	time_t startsecs, secs;
+	unsigned long startnsecs, nsecs;
+	unsigned long long utime, stime;
+	int haveusage;
+	pid_t pid;
+
+	if (ac < 2) {
+		printf("Usage: time command [args...]\n");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+
+	haveusage = getrusage(RUSAGE_CHILDREN, &before) == 0;
+	if (timing) {
+		__time(&startsecs, &startnsecs);
+	}
+	if (!dobuiltin(ac - 1, av + 1, ei)) {
+		if (startcmd(av + 1, &pid, ei)) {
+			return;
+		}
+		waitcmd(pid, ei);
+	}
+	if (timing) {
+		elapsed(startsecs, startnsecs, &secs, &nsecs);
+		fprintf(stderr, "%10lu.%06lu real\n",
+			(unsigned long) secs, nsecs / 1000);
+	}
+	if (!haveusage || getrusage(RUSAGE_CHILDREN, &after) < 0) {
+		return;
+	}
+
+	utime = tvdiff(&before.ru_utime, &after.ru_utime);
+	stime = tvdiff(&before.ru_stime, &after.ru_stime);
+	fprintf(stderr, "%10lu.%06lu user\n",
+		(unsigned long)(utime / 1000000),
+		(unsigned long)(utime % 1000000));
+	fprintf(stderr, "%10lu.%06lu sys\n",
+		(unsigned long)(stime / 1000000),
+		(unsigned long)(stime % 1000000));
+	fprintf(stderr, "%10lu minor faults\n",
+		(unsigned long)(after.ru_minflt - before.ru_minflt));
+	fprintf(stderr, "%10lu major faults\n",
+		(unsigned long)(after.ru_majflt - before.ru_majflt));
+	fprintf(stderr, "%10lu blocks read\n",
+		(unsigned long)(after.ru_inblock - before.ru_inblock));
+	fprintf(stderr, "%10lu blocks written\n",
+		(unsigned long)(after.ru_oublock - before.ru_oublock));
+	fprintf(stderr, "%10lu voluntary context switches\n",
+		(unsigned long)(after.ru_nvcsw - before.ru_nvcsw));
+	fprintf(stderr, "%10lu involuntary context switches\n",
+		(unsigned long)(after.ru_nivcsw - before.ru_nivcsw));
+	fprintf(stderr, "%10lu system calls\n",
+		(unsigned long)(after.ru_nsyscalls - before.ru_nsyscalls));
+}
+
+/*
+ * par
+ * runs the commands, separated by ";" words, N at a time: starts the
+ * first N, then another each time one exits, until all are done. so
+ * "par 4 ..." keeps four cpus busy. background jobs that exit in the
+ * meantime are reaped as usual. the exit code is 0 only if every
+ * command succeeded.
+ */
+static
+void
+cmd_par(int ac, char *av[], struct exitinfo *ei)
+{
+	struct exitinfo cmdei;
+	int n, next, end, running, failed;
+	pid_t pid;
+
+	if (ac < 3 || (n = atoi(av[1])) < 1) {
+		printf("Usage: par N command [; command ...]\n");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+
+	running = failed = 0;
+	next = 2;
+	while (next < ac || running > 0) {
+		if (next < ac && running < n) {
+			for (end = next; end < ac; end++) {
+				if (!strcmp(av[end], ";")) {
+					break;
+				}
+			}
+			av[end] = NULL;
+			if (end > next) {
+				if (startcmd(av + next, &pid, &cmdei)) {
+					failed = 1;
+				}
+				else {
+					running++;
+				}
+			}
+			next = end + 1;
+			continue;
+		}
+
+		pid = waitany(0, &cmdei);
+		if (pid < 0) {
+			break;
+		}
+		if (forget_bg(pid)) {
+			continue;
+		}
+		running--;
+		if (cmdei.signaled || cmdei.stopped || cmdei.val != 0) {
+			failed = 1;
+		}
+	}
+	exitinfo_exit(ei, failed);
+}
+
 /*
  * chdir
  * just an interface to the system call.  no concept of home directory, so
@@ -351,29 +727,50 @@ static struct {
 	{ "cd",    cmd_chdir },
 	{ "chdir", cmd_chdir },
 	{ "exit",  cmd_exit },
+	{ "par",   cmd_par },
+	{ "time",  cmd_time },
 	{ "wait",  cmd_wait },
 	{ NULL, NULL }
 };
 
+/*
+ * dobuiltin
+ * runs AV as a builtin if it names one. returns true if it did.
+ */
+static
+int
+dobuiltin(int ac, char *av[], struct exitinfo *ei)
+{
+	int i;
+
+	for (i=0; builtins[i].name; i++) {
+		if (!strcmp(builtins[i].name, av[0])) {
+			builtins[i].func(ac, av, ei);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
  * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * the job if possible, otherwise just run it and wait on it. a line
+ * with "|" in it is run as a pipeline.
  */
 static
 void
 docommand(char *buf, struct exitinfo *ei)
 {
 	char *args[NARG_MAX + 1];
-	int nargs, i;
+	int nargs;
 	char *s;
 	pid_t pid;
-	int status;
-	int bg=0;
-	time_t startsecs, endsecs;
-	unsigned long startnsecs, endnsecs;
+	int bg=0, pipeline=0;
+	time_t startsecs, secs;
+	unsigned long startnsecs, nsecs;
 
 	nargs = 0;
 	for (s = strtok(buf, " \t\r\n"); s; s = strtok(NULL, " \t\r\n")) {
@@ -384,6 +781,9 @@ docommand(char *buf, struct exitinfo *ei)
 			exitinfo_exit(ei, 1);
 			return;
 		}
+		if (!strcmp(s, "|")) {
+			pipeline = 1;
+		}
 		args[nargs++] = s;
 	}
 	args[nargs] = NULL;
@@ -394,11 +794,8 @@ docommand(char *buf, struct exitinfo *ei)
 		return;
 	}
 
-	for (i=0; builtins[i].name; i++) {
-		if (!strcmp(builtins[i].name, args[0])) {
-			builtins[i].func(nargs, args, ei);
-			return;
-		}
+	if (dobuiltin(nargs, args, ei)) {
+		return;
 	}
 
 	/* Not a builtin; run it */
@@ -421,30 +818,26 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			exitinfo_exit(ei, 255);
+	if (pipeline) {
+		if (bg) {
+			printf("sh: Pipelines can't be run in the "
+			       "background\n");
+			exitinfo_exit(ei, 1);
 			return;
-		case 0:
-			/* child */
-			execvp(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
-			break;
+		}
+		runpipeline(args, nargs, ei);
+		if (timing) {
+			elapsed(startsecs, startnsecs, &secs, &nsecs);
+			warnx("subprocess time: %lu.%09lu seconds",
+			      (unsigned long) secs, nsecs);
+		}
+		return;
+	}
+
+	if (startcmd(args, &pid, ei)) {
+		return;
 	}
 
-	/* parent */
 	if (bg) {
 		/* background this command */
 		remember_bg(pid);
@@ -453,24 +846,12 @@ docommand(char *buf, struct exitinfo *ei)
 		return;
 	}
 
-	if (waitpid(pid, &status, 0) < 0) {
-		warn("waitpid");
-		exitinfo_exit(ei, 255);
-	}
-	else {
-		readstatus(status, ei);
-	}
+	waitcmd(pid, ei);
 
 	if (timing) {
-		__time(&endsecs, &endnsecs);
-		if (endnsecs < startnsecs) {
-			endnsecs += 1000000000;
-			endsecs--;
-		}
-		endnsecs -= startnsecs;
-		endsecs -= startsecs;
+		elapsed(startsecs, startnsecs, &secs, &nsecs);
 		warnx("subprocess time: %lu.%09lu seconds",
-		      (unsigned long) endsecs, (unsigned long) endnsecs);
+		      (unsigned long) secs, nsecs);
 	}
 }
 
@@ -568,6 +949,7 @@ main(int argc, char *argv[])
 	hostcompat_init(argc, argv);
 #endif
 	check_timing();
+	jobs_init();
 
 	/*
 	 * Allow argc to be 0 in case we're running on a broken kernel,
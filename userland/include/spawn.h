@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SPAWN_H_
+#define _SPAWN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct spawn_action and the SPAWN_* definitions from the kernel.
+ */
+#include <kern/spawn.h>
+
+/*
+ * posix_spawn starts PATH with arguments ARGV in a new process and
+ * stores its pid in *PID; posix_spawnp looks PATH up on $PATH the way
+ * execvp does. Unlike fork and execv, the caller's address space is
+ * never copied. Both return 0 or an error number (not -1 and errno).
+ *
+ * The new process gets the caller's open files, changed by FA if it
+ * isn't NULL. Spawn attributes aren't supported (ATTR must be NULL)
+ * and ENVP is ignored, since there's no environment passing.
+ */
+
+typedef struct {
+	int __nactions;
+	struct spawn_action __actions[SPAWN_MAXACTIONS];
+} posix_spawn_file_actions_t;
+
+typedef struct {
+	int __unused;
+} posix_spawnattr_t;
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t *fa);
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *fa);
+int posix_spawn_file_actions_addopen(posix_spawn_file_actions_t *fa, int fd,
+				     const char *path, int flags, mode_t mode);
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *fa, int fd);
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *fa, int fd,
+				     int newfd);
+
+int posix_spawn(pid_t *pid, const char *path,
+		const posix_spawn_file_actions_t *fa,
+		const posix_spawnattr_t *attr,
+		char *const *argv, char *const *envp);
+int posix_spawnp(pid_t *pid, const char *file,
+		 const posix_spawn_file_actions_t *fa,
+		 const posix_spawnattr_t *attr,
+		 char *const *argv, char *const *envp);
+
+/* The system call underneath; returns the pid, or -1 and sets errno. */
+pid_t __spawn(const char *path, char *const *argv,
+	      const struct spawn_action *actions, int nactions);
+
+#endif /* _SPAWN_H_ */
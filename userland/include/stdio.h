@@ -41,6 +41,49 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/* Default buffer size */
+#define BUFSIZ 1024
+
+/* Buffering modes for setvbuf */
+#define _IOFBF 0	/* fully buffered */
+#define _IOLBF 1	/* line buffered */
+#define _IONBF 2	/* unbuffered */
+
+/*
+ * A stdio stream. Unless set with setvbuf, the buffering is picked on
+ * first use: stdout is line buffered on a terminal (anything isatty
+ * says yes to), stdin and stderr unbuffered there, and everything is
+ * fully buffered otherwise, except stderr, which never is. Reading
+ * from a stream that isn't fully buffered first flushes stdout, so
+ * prompts appear. exit(), fork(), execv(), and posix_spawn() flush
+ * all streams.
+ *
+ * The buffer holds either pending output or read-ahead input, never
+ * both. The fields are for libc internal use only.
+ */
+typedef struct __file {
+	int __fd;		/* file descriptor */
+	unsigned __flags;	/* __S* below */
+	int __bufmode;		/* _IO*BF, or -1 if not chosen yet */
+	char *__buf;		/* buffer, or NULL */
+	size_t __bufsize;	/* size of __buf */
+	size_t __pos;		/* output: bytes pending; input: next byte */
+	size_t __len;		/* input: bytes in buffer */
+	struct __file *__next;	/* all streams, for fflush(NULL) */
+} FILE;
+
+#define __SRD	0x01	/* open for reading */
+#define __SWR	0x02	/* open for writing */
+#define __SRDING 0x04	/* buffer holds input */
+#define __SEOF	0x08	/* end of file seen */
+#define __SERR	0x10	/* error seen */
+#define __SMBF	0x20	/* __buf is from malloc */
+#define __SSTD	0x40	/* stdin/stdout/stderr; not freed */
+
+extern FILE *stdin;
+extern FILE *stdout;
+extern FILE *stderr;
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -50,9 +93,42 @@ int __vprintf(void (*sendfunc)(void *clientdata, const char *, size_t len),
 	      const char *fmt,
 	      __va_list ap);
 
+/*
+ * The guts of stdio: move bytes through a stream's buffer, returning
+ * how many were moved; and the list of all streams.
+ * (for libc internal use only)
+ */
+size_t __stdio_read(FILE *f, char *buf, size_t len);
+size_t __stdio_write(FILE *f, const char *data, size_t len);
+FILE *__stdio_new(int fd, unsigned flags);
+extern FILE *__stdio_files;
+
+/* Opening, closing, and controlling streams */
+FILE *fopen(const char *path, const char *mode);
+FILE *fdopen(int fd, const char *mode);
+int fclose(FILE *f);
+int fflush(FILE *f);		/* all streams if F is NULL */
+int setvbuf(FILE *f, char *buf, int mode, size_t size);
+int feof(FILE *f);
+int ferror(FILE *f);
+void clearerr(FILE *f);
+int fileno(FILE *f);
+
+/* Stream I/O */
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *f);
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *f);
+int fgetc(FILE *f);
+int getc(FILE *f);
+char *fgets(char *buf, int len, FILE *f);
+int fputc(int c, FILE *f);
+int putc(int c, FILE *f);
+int fputs(const char *s, FILE *f);
+
 /* Printf calls for user programs */
 int printf(const char *fmt, ...);
 int vprintf(const char *fmt, __va_list ap);
+int fprintf(FILE *f, const char *fmt, ...);
+int vfprintf(FILE *f, const char *fmt, __va_list ap);
 int snprintf(char *buf, size_t len, const char *fmt, ...);
 int vsnprintf(char *buf, size_t len, const char *fmt, __va_list ap);
 
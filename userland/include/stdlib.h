@@ -70,6 +70,19 @@ void srandom(unsigned long seed);
 char *initstate(unsigned long, char *, size_t);
 char *setstate(char *);
 
+/*
+ * Much faster pseudo-random numbers, with the state passed in, so
+ * each thread or workload can have its own. xrand returns 32 random
+ * bits; xrand_fill makes N at once. (Not the sequence random() gives
+ * for the same seed.)
+ */
+struct xrand {
+	__u32 xr_s[4];
+};
+void xrand_seed(struct xrand *xr, unsigned long seed);
+__u32 xrand(struct xrand *xr);
+void xrand_fill(struct xrand *xr, __u32 *buf, size_t n);
+
 /*
  * Memory allocation functions.
  */
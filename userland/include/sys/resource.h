@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SYS_RESOURCE_H_
+#define _SYS_RESOURCE_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct rusage and the RUSAGE_*, RLIMIT_*, and IOPRIO_CLASS_*
+ * definitions from the kernel.
+ */
+#include <kern/time.h>
+#include <kern/resource.h>
+
+/*
+ * Filled in are the user and system times, the fault counts (ru_minflt
+ * counts TLB misses and page faults handled without I/O, ru_majflt
+ * page faults that read from swap), the file system blocks read and
+ * written, the context switches (ru_nivcsw counts preemptions), and
+ * the system calls made (ru_nsyscalls). The rest are zero.
+ * RUSAGE_CHILDREN covers the children that have been waited for, and
+ * their waited-for children.
+ */
+int getrusage(int who, struct rusage *usage);
+
+/*
+ * Get or set the I/O priority class (IOPRIO_CLASS_*) of process PID,
+ * or of the calling process if PID is 0. ioprio_get returns the class.
+ */
+int ioprio_get(pid_t pid);
+int ioprio_set(pid_t pid, int ioclass);
+
+/*
+ * Get or set a resource limit of the calling process. New processes
+ * get their parent's limits. Only RLIMIT_CPUSHARE and RLIMIT_IORATE
+ * are enforced (see <kern/resource.h>).
+ */
+int getrlimit(int resource, struct rlimit *rlp);
+int setrlimit(int resource, const struct rlimit *rlp);
+
+#endif /* _SYS_RESOURCE_H_ */
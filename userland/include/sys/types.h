@@ -58,6 +58,7 @@ typedef __ptrdiff_t ptrdiff_t;
 /* ...and machine-independent from <kern/types.h>. */
 typedef __blkcnt_t blkcnt_t;
 typedef __blksize_t blksize_t;
+typedef __clockid_t clockid_t;
 typedef __daddr_t daddr_t;
 typedef __dev_t dev_t;
 typedef __fsid_t fsid_t;
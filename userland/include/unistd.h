@@ -57,6 +57,11 @@
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
+ *     readv:    sys/uio.h
+ *     writev:   sys/uio.h
+ *     preadv:   sys/uio.h
+ *     pwritev:  sys/uio.h
+ *     getdirentries: dirent.h
  *
  * If this were standard Unix, more prototypes would go in other
  * header files as well, as follows:
@@ -133,6 +138,7 @@ pid_t getpid(void);
 int ioctl(int filehandle, int code, void *buf);
 off_t lseek(int filehandle, off_t pos, int code);
 int fsync(int filehandle);
+int fdatasync(int filehandle);
 int ftruncate(int filehandle, off_t size);
 int remove(const char *filename);
 int rename(const char *oldfile, const char *newfile);
@@ -143,11 +149,21 @@ int chdir(const char *path);
 /* Optional. */
 void *sbrk(__intptr_t change);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+int fallocate(int filehandle, off_t pos, off_t len);
+ssize_t copy_file_range(int infile, off_t *inpos, int outfile, off_t *outpos,
+			size_t len, unsigned flags);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int setaffinity(unsigned mask);
+int semop(int filehandle, int count);
+int futex_wait(const volatile int *addr, int val);
+int futex_wake(const volatile int *addr, int count);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -157,7 +173,9 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+int isatty(int filehandle);			/* calls fstat */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
-time_t time(time_t *seconds);			/* calls __time */
+time_t time(time_t *seconds);			/* calls clock_gettime */
+int clock_gettime(clockid_t clock, struct timespec *ts); /* may call __time */
 
 #endif /* _UNISTD_H_ */
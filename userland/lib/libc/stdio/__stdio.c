@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * The guts of stdio: the standard streams, the list of all streams,
+ * and moving data through a stream's buffer. See <stdio.h>.
+ *
+ * stdin and stdout have static buffers so that using them never
+ * calls malloc, which matters to programs that watch the heap.
+ */
+
+static char stdinbuf[BUFSIZ];
+static char stdoutbuf[BUFSIZ];
+
+static FILE stdfiles[3] = {
+	{ STDIN_FILENO, __SRD|__SSTD, -1, stdinbuf, BUFSIZ, 0, 0,
+	  &stdfiles[1] },
+	{ STDOUT_FILENO, __SWR|__SSTD, -1, stdoutbuf, BUFSIZ, 0, 0,
+	  &stdfiles[2] },
+	{ STDERR_FILENO, __SWR|__SSTD, _IONBF, NULL, 0, 0, 0,
+	  NULL },
+};
+
+FILE *stdin = &stdfiles[0];
+FILE *stdout = &stdfiles[1];
+FILE *stderr = &stdfiles[2];
+
+FILE *__stdio_files = &stdfiles[0];
+
+/*
+ * Make a stream for FD and put it on the list.
+ */
+FILE *
+__stdio_new(int fd, unsigned flags)
+{
+	FILE *f;
+
+	f = malloc(sizeof(*f));
+	if (f == NULL) {
+		return NULL;
+	}
+	f->__fd = fd;
+	f->__flags = flags;
+	f->__bufmode = -1;
+	f->__buf = NULL;
+	f->__bufsize = 0;
+	f->__pos = 0;
+	f->__len = 0;
+	f->__next = __stdio_files;
+	__stdio_files = f;
+	return f;
+}
+
+/*
+ * Pick F's buffering, and get it a buffer, if that hasn't been done.
+ */
+static
+void
+setup(FILE *f)
+{
+	if (f->__bufmode < 0) {
+		if (!isatty(f->__fd)) {
+			f->__bufmode = _IOFBF;
+		}
+		else if (f->__flags & __SWR) {
+			f->__bufmode = _IOLBF;
+		}
+		else {
+			f->__bufmode = _IONBF;
+		}
+	}
+	if (f->__bufmode != _IONBF && f->__buf == NULL) {
+		f->__buf = malloc(BUFSIZ);
+		if (f->__buf == NULL) {
+			f->__bufmode = _IONBF;
+			return;
+		}
+		f->__bufsize = BUFSIZ;
+		f->__flags |= __SMBF;
+	}
+}
+
+/*
+ * Write out F's pending output. Whatever can't be written stays.
+ */
+static
+int
+wflush(FILE *f)
+{
+	size_t done;
+	ssize_t r;
+
+	done = 0;
+	while (done < f->__pos) {
+		r = write(f->__fd, f->__buf + done, f->__pos - done);
+		if (r <= 0) {
+			f->__flags |= __SERR;
+			memmove(f->__buf, f->__buf + done, f->__pos - done);
+			f->__pos -= done;
+			return EOF;
+		}
+		done += r;
+	}
+	f->__pos = 0;
+	return 0;
+}
+
+/*
+ * Throw away F's read-ahead, moving the file offset back over it so
+ * the next read or write happens where the program thinks it will.
+ * (That fails harmlessly on things that can't seek.)
+ */
+static
+void
+rdiscard(FILE *f)
+{
+	if (f->__len > f->__pos) {
+		lseek(f->__fd, -(off_t)(f->__len - f->__pos), SEEK_CUR);
+	}
+	f->__flags &= ~__SRDING;
+	f->__pos = 0;
+	f->__len = 0;
+}
+
+int
+fflush(FILE *f)
+{
+	int ret;
+
+	if (f == NULL) {
+		ret = 0;
+		for (f = __stdio_files; f != NULL; f = f->__next) {
+			if (fflush(f)) {
+				ret = EOF;
+			}
+		}
+		return ret;
+	}
+
+	if (f->__flags & __SRDING) {
+		rdiscard(f);
+		return 0;
+	}
+	return wflush(f);
+}
+
+size_t
+__stdio_write(FILE *f, const char *data, size_t len)
+{
+	size_t done, n;
+	ssize_t r;
+
+	if (!(f->__flags & __SWR)) {
+		f->__flags |= __SERR;
+		errno = EBADF;
+		return 0;
+	}
+	setup(f);
+	if (f->__flags & __SRDING) {
+		rdiscard(f);
+	}
+
+	done = 0;
+	while (done < len) {
+		if (f->__bufmode == _IONBF ||
+		    (f->__pos == 0 && len - done >= f->__bufsize)) {
+			/* Nothing to gain by copying; write it directly */
+			r = write(f->__fd, data + done, len - done);
+			if (r <= 0) {
+				f->__flags |= __SERR;
+				return done;
+			}
+			done += r;
+			continue;
+		}
+
+		n = f->__bufsize - f->__pos;
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(f->__buf + f->__pos, data + done, n);
+		f->__pos += n;
+		done += n;
+		if (f->__pos == f->__bufsize && wflush(f)) {
+			return done;
+		}
+	}
+
+	if (f->__bufmode == _IOLBF && f->__pos > 0) {
+		for (n = 0; n < len; n++) {
+			if (data[n] == '\n') {
+				wflush(f);
+				break;
+			}
+		}
+	}
+	return done;
+}
+
+size_t
+__stdio_read(FILE *f, char *buf, size_t len)
+{
+	size_t done, n;
+	ssize_t r;
+
+	if (!(f->__flags & __SRD)) {
+		f->__flags |= __SERR;
+		errno = EBADF;
+		return 0;
+	}
+	setup(f);
+	if (!(f->__flags & __SRDING)) {
+		if (f->__pos > 0 && wflush(f)) {
+			return 0;
+		}
+		f->__flags |= __SRDING;
+		f->__pos = 0;
+		f->__len = 0;
+	}
+
+	done = 0;
+	while (done < len) {
+		if (f->__pos < f->__len) {
+			n = f->__len - f->__pos;
+			if (n > len - done) {
+				n = len - done;
+			}
+			memcpy(buf + done, f->__buf + f->__pos, n);
+			f->__pos += n;
+			done += n;
+			continue;
+		}
+
+		/* About to wait for input; show any prompt first. */
+		if (f->__bufmode != _IOFBF && f != stdout &&
+		    stdout->__bufmode == _IOLBF &&
+		    !(stdout->__flags & __SRDING)) {
+			wflush(stdout);
+		}
+
+		if (f->__bufmode == _IONBF || len - done >= f->__bufsize) {
+			r = read(f->__fd, buf + done, len - done);
+			if (r > 0) {
+				done += r;
+			}
+		}
+		else {
+			r = read(f->__fd, f->__buf, f->__bufsize);
+			if (r > 0) {
+				f->__pos = 0;
+				f->__len = r;
+			}
+		}
+		if (r == 0) {
+			f->__flags |= __SEOF;
+			break;
+		}
+		if (r < 0) {
+			f->__flags |= __SERR;
+			break;
+		}
+	}
+	return done;
+}
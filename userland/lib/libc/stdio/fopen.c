@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * C standard I/O functions: open and close streams.
+ */
+
+/*
+ * Turn an fopen mode string into open flags, and into the stream's
+ * __SRD/__SWR flags.
+ */
+static
+int
+parsemode(const char *mode, int *oflags, unsigned *sflags)
+{
+	int rw;
+	const char *s;
+
+	switch (mode[0]) {
+	    case 'r': rw = O_RDONLY; *oflags = 0; break;
+	    case 'w': rw = O_WRONLY; *oflags = O_CREAT|O_TRUNC; break;
+	    case 'a': rw = O_WRONLY; *oflags = O_CREAT|O_APPEND; break;
+	    default:
+		errno = EINVAL;
+		return -1;
+	}
+	for (s = mode + 1; *s != '\0'; s++) {
+		if (*s == '+') {
+			rw = O_RDWR;
+		}
+		/* 'b' means nothing here; skip anything else too */
+	}
+
+	*oflags |= rw;
+	switch (rw) {
+	    case O_RDONLY: *sflags = __SRD; break;
+	    case O_WRONLY: *sflags = __SWR; break;
+	    default: *sflags = __SRD|__SWR; break;
+	}
+	return 0;
+}
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+	FILE *f;
+	int fd, oflags;
+	unsigned sflags;
+
+	if (parsemode(mode, &oflags, &sflags) < 0) {
+		return NULL;
+	}
+	fd = open(path, oflags, 0664);
+	if (fd < 0) {
+		return NULL;
+	}
+	f = __stdio_new(fd, sflags);
+	if (f == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return f;
+}
+
+FILE *
+fdopen(int fd, const char *mode)
+{
+	FILE *f;
+	int oflags;
+	unsigned sflags;
+
+	if (parsemode(mode, &oflags, &sflags) < 0) {
+		return NULL;
+	}
+	f = __stdio_new(fd, sflags);
+	if (f == NULL) {
+		errno = ENOMEM;
+	}
+	return f;
+}
+
+/*
+ * Flush and close F, and take it off the list of streams.
+ */
+int
+fclose(FILE *f)
+{
+	FILE **fp;
+	int ret;
+
+	ret = fflush(f);
+	if (close(f->__fd) < 0) {
+		ret = EOF;
+	}
+
+	for (fp = &__stdio_files; *fp != NULL; fp = &(*fp)->__next) {
+		if (*fp == f) {
+			*fp = f->__next;
+			break;
+		}
+	}
+
+	if (f->__flags & __SMBF) {
+		free(f->__buf);
+	}
+	if (!(f->__flags & __SSTD)) {
+		free(f);
+	}
+	else {
+		f->__flags = 0;
+	}
+	return ret;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+
+/*
+ * fprintf - C standard I/O function.
+ */
+
+struct fprintf_data {
+	FILE *f;
+	int err;
+};
+
+/*
+ * Function passed to __vprintf to do the actual output.
+ */
+static
+void
+__fprintf_send(void *mydata, const char *data, size_t len)
+{
+	struct fprintf_data *fd = mydata;
+
+	if (__stdio_write(fd->f, data, len) != len) {
+		fd->err = errno;
+	}
+}
+
+/* fprintf: hand off to vfprintf */
+int
+fprintf(FILE *f, const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+
+	va_start(ap, fmt);
+	chars = vfprintf(f, fmt, ap);
+	va_end(ap);
+	return chars;
+}
+
+/* vfprintf: call __vprintf to do the work. */
+int
+vfprintf(FILE *f, const char *fmt, va_list ap)
+{
+	struct fprintf_data fd;
+	int chars;
+
+	fd.f = f;
+	fd.err = 0;
+	chars = __vprintf(__fprintf_send, &fd, fmt, ap);
+	if (fd.err) {
+		errno = fd.err;
+		return -1;
+	}
+	return chars;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+
+/*
+ * C standard I/O functions: read from a stream.
+ */
+
+size_t
+fread(void *ptr, size_t size, size_t nmemb, FILE *f)
+{
+	if (size == 0 || nmemb == 0) {
+		return 0;
+	}
+	return __stdio_read(f, ptr, size * nmemb) / size;
+}
+
+int
+fgetc(FILE *f)
+{
+	unsigned char ch;
+
+	if (__stdio_read(f, (char *)&ch, 1) != 1) {
+		return EOF;
+	}
+	/* like getchar, give back 0-255 so EOF is distinguishable */
+	return ch;
+}
+
+int
+getc(FILE *f)
+{
+	return fgetc(f);
+}
+
+/*
+ * Read a line, up to and including the newline, or LEN-1 characters,
+ * whichever is less, and null-terminate it. NULL at end of file.
+ */
+char *
+fgets(char *buf, int len, FILE *f)
+{
+	int i, ch;
+
+	if (len <= 0) {
+		return NULL;
+	}
+	for (i = 0; i < len - 1; i++) {
+		ch = fgetc(f);
+		if (ch == EOF) {
+			if (i == 0) {
+				return NULL;
+			}
+			break;
+		}
+		buf[i] = ch;
+		if (ch == '\n') {
+			i++;
+			break;
+		}
+	}
+	buf[i] = '\0';
+	return buf;
+}
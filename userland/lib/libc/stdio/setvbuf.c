@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/*
+ * C standard I/O functions: buffering control and stream state.
+ */
+
+/*
+ * Set F's buffering. Must come before any I/O on F. If BUF is NULL
+ * and a buffer is wanted, one of SIZE bytes (BUFSIZ if SIZE is 0) is
+ * allocated.
+ */
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		errno = EINVAL;
+		return EOF;
+	}
+
+	if (f->__flags & __SMBF) {
+		free(f->__buf);
+		f->__flags &= ~__SMBF;
+	}
+	f->__buf = NULL;
+	f->__bufsize = 0;
+	f->__bufmode = mode;
+
+	if (mode != _IONBF) {
+		if (size == 0) {
+			size = BUFSIZ;
+		}
+		if (buf == NULL) {
+			buf = malloc(size);
+			if (buf == NULL) {
+				f->__bufmode = _IONBF;
+				return EOF;
+			}
+			f->__flags |= __SMBF;
+		}
+		f->__buf = buf;
+		f->__bufsize = size;
+	}
+	return 0;
+}
+
+int
+feof(FILE *f)
+{
+	return (f->__flags & __SEOF) != 0;
+}
+
+int
+ferror(FILE *f)
+{
+	return (f->__flags & __SERR) != 0;
+}
+
+void
+clearerr(FILE *f)
+{
+	f->__flags &= ~(__SEOF|__SERR);
+}
+
+int
+fileno(FILE *f)
+{
+	return f->__fd;
+}
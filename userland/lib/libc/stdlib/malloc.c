@@ -30,16 +30,25 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator. Each block has a header giving
+ * the offsets to its neighbours (boundary tags), so a freed block is
+ * merged with free neighbours in constant time and no two free blocks
+ * are ever adjacent. Free blocks are found without walking the heap:
+ * small ones are on a list per size, with a bitmap saying which lists
+ * are nonempty; large ones are in a tree ordered by size, for best
+ * fit. Free space at the top of the heap is given back with sbrk.
+ *
+ * The heap is shared by all threads and protected by a spinlock. A
+ * free that finds the lock held doesn't wait for it: it pushes the
+ * block on a lock-free list that the lock holder drains on its way
+ * out.
  */
 
 #include <stdlib.h>
 #include <stdint.h>  // for uintptr_t on non-OS/161 platforms
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
 #include <assert.h>
 
 #undef MALLOCDEBUG
@@ -147,12 +156,53 @@ static size_t __malloc_pagesize;
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * Free block links. These live in the data area of a free block, which
+ * is never less than MBLOCKSIZE bytes, room for two pointers.
+ *
+ * A small block (MSMALLMAX bytes of data or less) is on the doubly
+ * linked list for its size. A large block is in a treap keyed on
+ * (size, address); the priorities are a hash of the address, so they
+ * take no space.
+ */
+struct mfree {
+	struct mfree *mf_link[2];
+};
+
+#define mf_next		mf_link[0]	/* small: list links */
+#define mf_prev		mf_link[1]
+#define mf_left		mf_link[0]	/* large: tree children */
+#define mf_right	mf_link[1]
+
+/*
+ * M_FREE:		return the free links of a (free) header
+ * F_HDR:		return the header of some free links
+ * F_SIZE:		return the data size of a free block
+ */
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+#define F_HDR(mf)	(((struct mheader *)(mf))-1)
+#define F_SIZE(mf)	M_SIZE(F_HDR(mf))
+
+/*
+ * Small size classes: one per block multiple up to MSMALLMAX.
+ */
+#define MSMALLMAX	512
+#define MNSMALL		(MSMALLMAX / MBLOCKSIZE)
+#define MSMALLIDX(sz)	((sz) / MBLOCKSIZE - 1)
+#define MMAPBITS	32
+#define MMAPWORDS	((MNSMALL + MMAPBITS - 1) / MMAPBITS)
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * topmost block, and the free lists and tree.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mfree *__malloc_small[MNSMALL];
+static uint32_t __malloc_smallmap[MMAPWORDS];
+static struct mfree *__malloc_tree;
 
 /*
  * Setup function.
@@ -175,6 +225,9 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mfree) > MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - free links too big");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -235,10 +288,13 @@ __malloc_dump(void)
 	struct mheader *mh;
 	uintptr_t i;
 	size_t rightprevblock;
+	int lastfree;
 
 	warnx("heap: ************************************************");
 
 	rightprevblock = 0;
+	lastfree = 0;
+	mh = NULL;
 	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
 		mh = (struct mheader *) i;
 		if (!M_OK(mh)) {
@@ -254,7 +310,13 @@ __malloc_dump(void)
 			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
 			     (unsigned long) rightprevblock << MBLOCKSHIFT);
 		}
+		if (lastfree && !mh->mh_inuse) {
+			errx(1, "malloc: Heap corrupt; free block at 0x%lx"
+			     " not merged with the one below",
+			     (unsigned long) i);
+		}
 		rightprevblock = mh->mh_nextblock;
+		lastfree = !mh->mh_inuse;
 
 		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
 		      (unsigned long) i + MBLOCKSIZE,
@@ -265,6 +327,10 @@ __malloc_dump(void)
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
+	if (mh != __heaplast) {
+		errx(1, "malloc: Heap corrupt; top block is %p, not %p",
+		     mh, __heaplast);
+	}
 
 	warnx("heap: ************************************************");
 }
@@ -273,6 +339,218 @@ __malloc_dump(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * The large block treap.
+ *
+ * Ordered on (size, address); each node's priority is at least its
+ * children's. With the priorities effectively random the expected
+ * depth is logarithmic no matter what order blocks are freed in.
+ * Blocks are few enough that recursing is fine.
+ */
+
+static
+uint32_t
+__malloc_prio(struct mfree *mf)
+{
+	/* Fibonacci hashing of the block number */
+	return (uint32_t)((uintptr_t)mf >> MBLOCKSHIFT) * 2654435761U;
+}
+
+/*
+ * Return 1 (the right side) if a goes after b, 0 if before.
+ */
+static
+int
+__malloc_side(struct mfree *a, struct mfree *b)
+{
+	size_t asize = F_SIZE(a), bsize = F_SIZE(b);
+
+	if (asize != bsize) {
+		return asize > bsize;
+	}
+	return (uintptr_t)a > (uintptr_t)b;
+}
+
+/*
+ * Insert MF into the subtree T; return the new subtree root.
+ */
+static
+struct mfree *
+__malloc_treeinsert(struct mfree *t, struct mfree *mf)
+{
+	struct mfree *c;
+	int side;
+
+	if (t == NULL) {
+		mf->mf_left = mf->mf_right = NULL;
+		return mf;
+	}
+	side = __malloc_side(mf, t);
+	c = __malloc_treeinsert(t->mf_link[side], mf);
+	t->mf_link[side] = c;
+	if (__malloc_prio(c) > __malloc_prio(t)) {
+		/* rotate C up */
+		t->mf_link[side] = c->mf_link[!side];
+		c->mf_link[!side] = t;
+		return c;
+	}
+	return t;
+}
+
+/*
+ * Join two subtrees, everything in L being before everything in R.
+ */
+static
+struct mfree *
+__malloc_treejoin(struct mfree *l, struct mfree *r)
+{
+	if (l == NULL) {
+		return r;
+	}
+	if (r == NULL) {
+		return l;
+	}
+	if (__malloc_prio(l) > __malloc_prio(r)) {
+		l->mf_right = __malloc_treejoin(l->mf_right, r);
+		return l;
+	}
+	r->mf_left = __malloc_treejoin(l, r->mf_left);
+	return r;
+}
+
+/*
+ * Remove MF from the subtree T; return the new subtree root.
+ */
+static
+struct mfree *
+__malloc_treeremove(struct mfree *t, struct mfree *mf)
+{
+	int side;
+
+	if (t == NULL) {
+		errx(1, "malloc: Heap corrupt; free block %p not in tree",
+		     F_HDR(mf));
+	}
+	if (t == mf) {
+		return __malloc_treejoin(t->mf_left, t->mf_right);
+	}
+	side = __malloc_side(mf, t);
+	t->mf_link[side] = __malloc_treeremove(t->mf_link[side], mf);
+	return t;
+}
+
+/*
+ * Find the smallest large block with at least SIZE bytes; the lowest
+ * such if there's a tie.
+ */
+static
+struct mfree *
+__malloc_bestfit(size_t size)
+{
+	struct mfree *t, *best;
+
+	best = NULL;
+	t = __malloc_tree;
+	while (t != NULL) {
+		if (F_SIZE(t) >= size) {
+			best = t;
+			t = t->mf_left;
+		}
+		else {
+			t = t->mf_right;
+		}
+	}
+	return best;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Find the first nonempty small list at or above index IX, or -1.
+ */
+static
+int
+__malloc_findsmall(unsigned ix)
+{
+	unsigned w;
+	uint32_t bits;
+
+	w = ix / MMAPBITS;
+	bits = __malloc_smallmap[w] & ~(((uint32_t)1 << (ix % MMAPBITS)) - 1);
+	while (bits == 0) {
+		if (++w == MMAPWORDS) {
+			return -1;
+		}
+		bits = __malloc_smallmap[w];
+	}
+	ix = w * MMAPBITS;
+	while ((bits & 1) == 0) {
+		bits >>= 1;
+		ix++;
+	}
+	return ix;
+}
+
+/*
+ * Put a free block on the list or in the tree where it belongs.
+ */
+static
+void
+__malloc_addfree(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	size_t size = M_SIZE(mh);
+	unsigned ix;
+
+	if (size > MSMALLMAX) {
+		__malloc_tree = __malloc_treeinsert(__malloc_tree, mf);
+		return;
+	}
+
+	ix = MSMALLIDX(size);
+	mf->mf_prev = NULL;
+	mf->mf_next = __malloc_small[ix];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__malloc_small[ix] = mf;
+	__malloc_smallmap[ix / MMAPBITS] |= (uint32_t)1 << (ix % MMAPBITS);
+}
+
+/*
+ * Take a free block off its list or out of the tree.
+ */
+static
+void
+__malloc_delfree(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	size_t size = M_SIZE(mh);
+	unsigned ix;
+
+	if (size > MSMALLMAX) {
+		__malloc_tree = __malloc_treeremove(__malloc_tree, mf);
+		return;
+	}
+
+	ix = MSMALLIDX(size);
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		__malloc_small[ix] = mf->mf_next;
+		if (mf->mf_next == NULL) {
+			__malloc_smallmap[ix / MMAPBITS] &=
+				~((uint32_t)1 << (ix % MMAPBITS));
+		}
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Get more memory (at the top of the heap) using sbrk, and
  * return a pointer to it.
@@ -298,10 +576,62 @@ __malloc_sbrk(size_t size)
 	return x;
 }
 
+/*
+ * Grow the heap to get a block with at least SIZE bytes of data,
+ * which is returned not on the free lists.
+ *
+ * If the top block is free, we can expand it. (It wasn't big enough,
+ * or the search would have found it.) Otherwise we need a new block.
+ */
+static
+struct mheader *
+__malloc_extend(size_t size)
+{
+	struct mheader *mh, *last;
+	size_t morespace;
+	void *p;
+
+	last = __heaplast;
+	if (last != NULL && !last->mh_inuse) {
+		assert(size > M_SIZE(last));
+		morespace = size - M_SIZE(last);
+	}
+	else {
+		morespace = MBLOCKSIZE + size;
+	}
+
+	/* Round the amount of space we ask for up to a whole page. */
+	morespace = PAGE_SIZE * ((morespace + PAGE_SIZE - 1) / PAGE_SIZE);
+
+	p = __malloc_sbrk(morespace);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	if (last != NULL && !last->mh_inuse) {
+		/* update old header */
+		__malloc_delfree(last);
+		last->mh_nextblock = M_MKFIELD(M_NEXTOFF(last) + morespace);
+		return last;
+	}
+
+	/* fill out new header */
+	mh = p;
+	mh->mh_prevblock = last != NULL ? last->mh_nextblock : 0;
+	mh->mh_magic1 = MMAGIC;
+	mh->mh_magic2 = MMAGIC;
+	mh->mh_pad = 0;
+	mh->mh_inuse = 0;
+	mh->mh_nextblock = M_MKFIELD(morespace);
+	__heaplast = mh;
+	return mh;
+}
+
 /*
  * Make a new (free) block from the block passed in, leaving size
  * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * MBLOCKSIZE. The current block must not be on the free lists; the
+ * new one goes on them.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -343,19 +673,27 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	/*
+	 * The block above was in use (free blocks are always merged)
+	 * so there's nothing to merge the new one with.
+	 */
+	__malloc_addfree(mhnew);
 }
 
 /*
- * malloc itself.
+ * malloc itself, with the lock held.
  */
+static
 void *
-malloc(size_t size)
+__malloc_alloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
-	size_t morespace;
-	void *p;
+	struct mfree *mf;
+	int ix;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -372,104 +710,60 @@ malloc(size_t size)
 	__malloc_dump();
 #endif
 
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	/* Refuse sizes the rounding below would overflow. */
+	if (size > (size_t)-1 - PAGE_SIZE - 2*MBLOCKSIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
+	 * Round size up to an integral number of blocks. Free blocks
+	 * need one block for their links, so that's the minimum.
 	 */
-	rightprevblock = 0;
-	mh = NULL;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i,
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
 	}
 
 	/*
-	 * Didn't find anything. Expand the heap.
-	 *
-	 * If the heap is nonempty and the top block (the one mh is
-	 * left pointing to after the above loop) is free, we can
-	 * expand it. Otherwise we need a new block.
+	 * A small request takes a block of exactly its size if there
+	 * is one, or else the next size up that there is. Failing
+	 * that, or for a large request, take the best fit from the
+	 * tree. Failing that, grow the heap.
 	 */
-	if (mh != NULL && !mh->mh_inuse) {
-		assert(size > M_SIZE(mh));
-		morespace = size - M_SIZE(mh);
-	}
-	else {
-		morespace = MBLOCKSIZE + size;
+	mh = NULL;
+	if (size <= MSMALLMAX) {
+		ix = __malloc_findsmall(MSMALLIDX(size));
+		if (ix >= 0) {
+			mh = F_HDR(__malloc_small[ix]);
+		}
 	}
-
-	/* Round the amount of space we ask for up to a whole page. */
-	morespace = PAGE_SIZE * ((morespace + PAGE_SIZE - 1) / PAGE_SIZE);
-
-	p = __malloc_sbrk(morespace);
-	if (p == NULL) {
-		return NULL;
+	if (mh == NULL) {
+		mf = __malloc_bestfit(size);
+		if (mf != NULL) {
+			mh = F_HDR(mf);
+		}
 	}
 
-	if (mh != NULL && !mh->mh_inuse) {
-		/* update old header */
-		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + morespace);
-		mh->mh_inuse = 1;
+	if (mh != NULL) {
+		if (!M_OK(mh) || mh->mh_inuse) {
+			errx(1, "malloc: Heap corrupt; free block at %p"
+			     " has bad header", mh);
+		}
+		__malloc_delfree(mh);
 	}
 	else {
-		/* fill out new header */
-		mh = p;
-		mh->mh_prevblock = rightprevblock;
-		mh->mh_magic1 = MMAGIC;
-		mh->mh_magic2 = MMAGIC;
-		mh->mh_pad = 0;
-		mh->mh_inuse = 1;
-		mh->mh_nextblock = M_MKFIELD(morespace);
+		mh = __malloc_extend(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
 
 	/*
-	 * Either way, try splitting the block we got as because of
-	 * the page rounding it might be quite a bit bigger than we
-	 * needed.
+	 * Now, allocate, and return what's left over, which may be
+	 * quite a bit if we grew the heap by whole pages.
 	 */
+	mh->mh_inuse = 1;
 	__malloc_split(mh, size);
 
 #ifdef MALLOCDEBUG
@@ -497,22 +791,29 @@ __malloc_deadbeef(void *ptr, size_t size)
 }
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Check if two adjacent blocks (mh below mhnext) can be merged.
  */
 static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+int
+__malloc_canmerge(struct mheader *mh, struct mheader *mhnext)
 {
-	struct mheader *mhnextnext;
-
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
+	if (!M_OK(mh) || !M_OK(mhnext) ||
+	    mh->mh_nextblock != mhnext->mh_prevblock) {
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
+	return !mh->mh_inuse && !mhnext->mh_inuse;
+}
+
+/*
+ * Merge two adjacent free blocks (mh below mhnext), neither of which
+ * is on the free lists.
+ */
+static
+void
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
+{
+	struct mheader *mhnextnext;
 
 	mhnextnext = M_NEXT(mhnext);
 
@@ -522,24 +823,62 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
 	/* Deadbeef out the memory used by the now-obsolete header */
-	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+	__malloc_deadbeef(mhnext, sizeof(struct mheader) +
+			  sizeof(struct mfree));
 }
 
 /*
- * The actual free() implementation.
+ * If the block at the top of the heap is free, give the whole pages
+ * at the end of it back with sbrk, so the heap shrinks as well as
+ * grows. The header stays and the block just gets smaller. Less than
+ * MTRIMPAGES pages isn't worth it; malloc and free at the top of the
+ * heap would keep moving the break back and forth.
  */
+#define MTRIMPAGES 4
+
+static
 void
-free(void *x)
+__malloc_trim(struct mheader *mh)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	uintptr_t newtop;
+	size_t amount;
 
-	if (x==NULL) {
-		/* safest practice */
+	if (mh->mh_inuse || mh != __heaplast) {
+		return;
+	}
+
+	newtop = (uintptr_t)M_DATA(mh) + MBLOCKSIZE;
+	newtop = PAGE_SIZE * ((newtop + PAGE_SIZE - 1) / PAGE_SIZE);
+	if (newtop >= __heaptop) {
+		return;
+	}
+	amount = __heaptop - newtop;
+	if (amount < MTRIMPAGES * PAGE_SIZE) {
 		return;
 	}
 
+	if (sbrk(-(__intptr_t)amount) == (void *)-1) {
+		/* no harm done; keep it */
+		return;
+	}
+	__heaptop = newtop;
+	mh->mh_nextblock = M_MKFIELD(newtop - (uintptr_t)mh);
+}
+
+/*
+ * The actual free() implementation, with the lock held.
+ */
+static
+void
+__malloc_release(void *x)
+{
+	struct mheader *mh, *mhnext, *mhprev;
+
 	/* Consistency check. */
 	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
 		warnx("free: Internal error - local data corrupt");
@@ -572,20 +911,166 @@ free(void *x)
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
 
-	/* Try merging with the block above (but not if we're at the top) */
+	/*
+	 * Merge with the block above (but not if we're at the top)
+	 * and the block below (but not if we're at the bottom),
+	 * taking each off the free lists first.
+	 */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mhnext != (struct mheader *)__heaptop &&
+	    __malloc_canmerge(mh, mhnext)) {
+		__malloc_delfree(mhnext);
+		__malloc_merge(mh, mhnext);
 	}
-
-	/* Try merging with the block below (but not if we're at the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (__malloc_canmerge(mhprev, mh)) {
+			__malloc_delfree(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
 	}
 
+	/* Shrink the heap if this left a lot free at the top */
+	__malloc_trim(mh);
+
+	__malloc_addfree(mh);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
 #endif
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Locking.
+ *
+ * __malloc_cas atomically sets *P to NEW if it is OLD, and returns
+ * whether it did. On MIPS this is LL/SC; see the kernel's spinlock.h
+ * for the rules (notably, no other memory access between the two).
+ * Elsewhere (host builds) there are no threads to worry about.
+ */
+static
+int
+__malloc_cas(volatile uintptr_t *p, uintptr_t old, uintptr_t new)
+{
+#ifdef __mips__
+	uintptr_t x, y;
+
+	y = new;
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot */
+		"ll %0, 0(%2);"		/*   x = *p */
+		"bne %0, %3, 1f;"	/*   if (x != old) fail */
+		"nop;"
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"1: .set pop"		/* restore assembler mode */
+		: "=&r" (x), "+r" (y) : "r" (p), "r" (old) : "memory");
+	return x == old && y != 0;
+#else
+	if (*p != old) {
+		return 0;
+	}
+	*p = new;
+	return 1;
+#endif
+}
+
+/*
+ * The lock, and the blocks freed while it was held (linked through
+ * their first word).
+ */
+static volatile uintptr_t __malloc_lockword;
+static volatile uintptr_t __malloc_pending;
+
+static
+int
+__malloc_trylock(void)
+{
+	return __malloc_cas(&__malloc_lockword, 0, 1);
+}
+
+static
+void
+__malloc_lock(void)
+{
+	while (!__malloc_trylock()) {
+		/* spin */
+	}
+}
+
+/*
+ * Release the lock. If frees were left for us, take it back and do
+ * them; a free that arrives after we check is left for whoever gets
+ * the lock next, which that free itself makes sure happens.
+ */
+static
+void
+__malloc_unlock(void)
+{
+	uintptr_t list;
+	struct mfree *mf;
+
+	while (1) {
+		__asm volatile("" ::: "memory");
+		__malloc_lockword = 0;
+		if (__malloc_pending == 0 || !__malloc_trylock()) {
+			return;
+		}
+		do {
+			list = __malloc_pending;
+		} while (!__malloc_cas(&__malloc_pending, list, 0));
+
+		while (list != 0) {
+			mf = (struct mfree *)list;
+			list = (uintptr_t)mf->mf_next;
+			__malloc_release(mf);
+		}
+	}
+}
+
+void *
+malloc(size_t size)
+{
+	void *p;
+
+	__malloc_lock();
+	p = __malloc_alloc(size);
+	__malloc_unlock();
+	return p;
+}
+
+void
+free(void *x)
+{
+	struct mfree *mf;
+	uintptr_t old;
+
+	if (x==NULL) {
+		/* safest practice */
+		return;
+	}
+
+	if (__malloc_trylock()) {
+		__malloc_release(x);
+		__malloc_unlock();
+		return;
+	}
+
+	/* Someone else has the heap; leave the block for them. */
+	mf = x;
+	do {
+		old = __malloc_pending;
+		mf->mf_next = (struct mfree *)old;
+	} while (!__malloc_cas(&__malloc_pending, old, (uintptr_t)mf));
+
+	/* If they let go before seeing it, do it ourselves. */
+	if (__malloc_trylock()) {
+		__malloc_unlock();
+	}
+}
@@ -28,118 +28,218 @@
  */
 
 #include <stdlib.h>
-#include <string.h>
-#include <assert.h>
+#include <stdint.h>
 
 /*
  * qsort() for OS/161, where it isn't in libc.
+ *
+ * This is an introsort. It's quicksort with a median-of-three pivot,
+ * looping on the larger partition and recursing only on the smaller,
+ * so the stack depth is logarithmic. Any part that is still being
+ * partitioned after 2 log2(n) levels is heapsorted instead, so no
+ * input can make it quadratic. Parts of QSORT_SMALL elements or
+ * fewer are insertion sorted.
  */
-void
-qsort(void *vdata, unsigned num, size_t size,
-      int (*f)(const void *, const void *))
-{
-	unsigned pivot, head, tail;
-	char *data = vdata;
-	char tmp[size];
 
-#define COMPARE(aa, bb) \
-		((aa) == (bb) ? 0 : f(data + (aa) * size, data + (bb) * size))
-#define EXCHANGE(aa, bb) \
-		memcpy(tmp, data + (aa) * size, size);			\
-		memcpy(data + (aa) * size, data + (bb) * size, size);	\
-		memcpy(data + (bb) * size, tmp, size)
+#define QSORT_SMALL 8
 
+struct qsort_info {
+	size_t size;				/* element size */
+	int words;				/* swap in words? */
+	int (*f)(const void *, const void *);	/* comparison */
+};
+
+/*
+ * Exchange two elements, a word at a time if they're aligned for it.
+ */
+static
+void
+qsort_swap(const struct qsort_info *qi, char *a, char *b)
+{
+	size_t n;
 
-	if (num <= 1) {
+	if (a == b) {
 		return;
 	}
-	if (num == 2) {
-		if (COMPARE(0, 1) > 0) {
-			EXCHANGE(0, 1);
-			return;
+	if (qi->words) {
+		unsigned long *x = (unsigned long *)a;
+		unsigned long *y = (unsigned long *)b;
+		unsigned long t;
+
+		for (n = qi->size / sizeof(unsigned long); n > 0; n--) {
+			t = *x;
+			*x++ = *y;
+			*y++ = t;
 		}
 	}
+	else {
+		char t;
 
-	/*
-	 * 1. Pick a pivot value. For simplicity, always use the
-	 * middle of the array.
-	 */
-	pivot = num / 2;
+		for (n = qi->size; n > 0; n--) {
+			t = *a;
+			*a++ = *b;
+			*b++ = t;
+		}
+	}
+}
 
-	/*
-	 * 2. Shift all values less than or equal to the pivot value
-	 * to the front of the array.
-	 */
-	head = 0;
-	tail = num - 1;
+/*
+ * Insertion sort NUM elements at DATA.
+ */
+static
+void
+qsort_insertion(const struct qsort_info *qi, char *data, size_t num)
+{
+	size_t size = qi->size;
+	char *p, *q;
 
-	while (head < tail) {
-		if (COMPARE(head, pivot) <= 0) {
-			head++;
+	for (p = data + size; p < data + num * size; p += size) {
+		for (q = p; q > data && qi->f(q - size, q) > 0; q -= size) {
+			qsort_swap(qi, q - size, q);
 		}
-		else if (COMPARE(tail, pivot) > 0) {
-			tail--;
+	}
+}
+
+/*
+ * Heapsort NUM elements at DATA.
+ */
+static
+void
+qsort_siftdown(const struct qsort_info *qi, char *data, size_t node,
+	       size_t num)
+{
+	size_t size = qi->size;
+	size_t child;
+
+	while ((child = 2 * node + 1) < num) {
+		if (child + 1 < num &&
+		    qi->f(data + child * size, data + (child + 1) * size) < 0) {
+			child++;
 		}
-		else {
-			EXCHANGE(head, tail);
-			if (pivot == head) {
-				pivot = tail;
-			}
-			else if (pivot == tail) {
-				pivot = head;
-			}
-			head++;
-			tail--;
+		if (qi->f(data + node * size, data + child * size) >= 0) {
+			return;
 		}
+		qsort_swap(qi, data + node * size, data + child * size);
+		node = child;
 	}
+}
 
-	/*
-	 * 3. If there's an even number of elements and we swapped the
-	 * last two, the head and tail indexes will cross. In this
-	 * case the first entry on the tail side is tail+1. If there's
-	 * an odd number of elements, we stop with head == tail, and
-	 * the first entry on the tail side is this value (hence,
-	 * tail) if it's is greater than the pivot value, and the next
-	 * element (hence, tail+1) if it's less than or equal to the
-	 * pivot value.
-	 *
-	 * Henceforth use "tail" to hold the index of the first entry
-	 * of the back portion of the array.
-	 */
-	if (head > tail || COMPARE(head, pivot) <= 0) {
-		tail++;
+static
+void
+qsort_heap(const struct qsort_info *qi, char *data, size_t num)
+{
+	size_t i;
+
+	for (i = num / 2; i > 0; i--) {
+		qsort_siftdown(qi, data, i - 1, num);
+	}
+	for (i = num - 1; i > 0; i--) {
+		qsort_swap(qi, data, data + i * qi->size);
+		qsort_siftdown(qi, data, 0, i);
+	}
+}
+
+/*
+ * Partition NUM elements at DATA around the median of the first,
+ * middle, and last, and return the pivot's final index. Everything
+ * before it is <= the pivot and everything after is >= it. Scans
+ * stop on elements equal to the pivot, so runs of equal keys split
+ * evenly instead of all landing on one side.
+ */
+static
+size_t
+qsort_partition(const struct qsort_info *qi, char *data, size_t num)
+{
+	size_t size = qi->size;
+	char *lo, *mid, *hi, *i, *j;
+
+	lo = data;
+	mid = data + (num / 2) * size;
+	hi = data + (num - 1) * size;
+
+	/* Order lo <= mid <= hi, then put the median (pivot) at lo. */
+	if (qi->f(mid, lo) < 0) {
+		qsort_swap(qi, mid, lo);
 	}
+	if (qi->f(hi, mid) < 0) {
+		qsort_swap(qi, hi, mid);
+		if (qi->f(mid, lo) < 0) {
+			qsort_swap(qi, mid, lo);
+		}
+	}
+	qsort_swap(qi, lo, mid);
 
 	/*
-	 * 4. If we got a bad pivot that gave us only one partition,
-	 * because of the order of the advances in the loop above it
-	 * will always put everything in the front portion of the
-	 * array (so tail == num). This happens if we picked the
-	 * largest value. Move the pivot to the end, if necessary, lop
-	 * off all values equal to it, and recurse on the rest.  (If
-	 * there is no rest, the array is already sorted and we're
-	 * done.)
+	 * hi is now >= the pivot, which stops the upward scan; the
+	 * pivot itself stops the downward one.
 	 */
-	if (tail == num) {
-		if (pivot < num - 1) {
-			if (COMPARE(pivot, num - 1) > 0) {
-				EXCHANGE(pivot, num - 1);
-			}
+	i = lo;
+	j = hi + size;
+	while (1) {
+		do {
+			i += size;
+		} while (qi->f(i, lo) < 0);
+		do {
+			j -= size;
+		} while (qi->f(j, lo) > 0);
+		if (i >= j) {
+			break;
+		}
+		qsort_swap(qi, i, j);
+	}
+	qsort_swap(qi, lo, j);
+	return (j - data) / size;
+}
+
+static
+void
+qsort_intro(const struct qsort_info *qi, char *data, size_t num,
+	    unsigned depth)
+{
+	size_t p;
+
+	while (num > QSORT_SMALL) {
+		if (depth == 0) {
+			qsort_heap(qi, data, num);
+			return;
 		}
-		tail = num - 1;
-		while (tail > 0 && COMPARE(tail - 1, tail) == 0) {
-			tail--;
+		depth--;
+
+		p = qsort_partition(qi, data, num);
+		if (p < num - p - 1) {
+			qsort_intro(qi, data, p, depth);
+			data += (p + 1) * qi->size;
+			num -= p + 1;
 		}
-		if (tail > 0) {
-			qsort(vdata, tail, size, f);
+		else {
+			qsort_intro(qi, data + (p + 1) * qi->size,
+				    num - p - 1, depth);
+			num = p;
 		}
+	}
+	qsort_insertion(qi, data, num);
+}
+
+void
+qsort(void *vdata, unsigned num, size_t size,
+      int (*f)(const void *, const void *))
+{
+	struct qsort_info qi;
+	unsigned depth, n;
+
+	if (num <= 1 || size == 0) {
 		return;
 	}
-	assert(tail > 0 && tail < num);
 
-	/*
-	 * 5. Recurse on each subpart of the array.
-	 */
-	qsort(vdata, tail, size, f);
-	qsort((char *)vdata + tail * size, num - tail, size, f);
+	qi.size = size;
+	qi.f = f;
+	qi.words = size % sizeof(unsigned long) == 0 &&
+		(uintptr_t)vdata % sizeof(unsigned long) == 0;
+
+	depth = 0;
+	for (n = num; n > 1; n >>= 1) {
+		depth += 2;
+	}
+
+	qsort_intro(&qi, vdata, num, depth);
 }
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <spawn.h>
 
 /*
  * system(): ANSI C
@@ -54,7 +55,8 @@ system(const char *cmd)
 	char *argv[MAXARGS+1];
 	int nargs=0;
 	char *s;
-	int pid, status;
+	pid_t pid;
+	int status, result;
 
 	if (strlen(cmd) >= sizeof(tmp)) {
 		errno = E2BIG;
@@ -74,18 +76,12 @@ system(const char *cmd)
 
 	argv[nargs] = NULL;
 
-	pid = fork();
-	switch (pid) {
-	    case -1:
+	/* No need to fork a copy of ourselves just to exec */
+	result = posix_spawn(&pid, argv[0], NULL, NULL, argv, NULL);
+	if (result) {
+		errno = result;
 		return -1;
-	    case 0:
-		/* child */
-		execv(argv[0], argv);
-		/* exec only returns if it fails */
-		_exit(255);
-	    default:
-		/* parent */
-		waitpid(pid, &status, 0);
-		return status;
 	}
+	waitpid(pid, &status, 0);
+	return status;
 }
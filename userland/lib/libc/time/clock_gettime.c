@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * POSIX C function: get the time of CLOCK, which in OS/161 is the
+ * time of day for both CLOCK_REALTIME and CLOCK_MONOTONIC.
+ *
+ * This reads the time page the kernel maps at TIMEPAGE_ADDR (see
+ * <kern/time.h>), so no system call is needed, unless the kernel
+ * says the page isn't being kept up to date; then it calls __time.
+ * The page only changes on clock ticks, so the nanoseconds from it
+ * are good to 1/100 of a second.
+ */
+
+int
+clock_gettime(clockid_t clock, struct timespec *ts)
+{
+	const struct timepage *tp = (const struct timepage *)TIMEPAGE_ADDR;
+	unsigned seq, valid;
+	unsigned long nsec;
+	time_t sec;
+
+	if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	do {
+		seq = tp->tp_seq;
+		if (seq & 1) {
+			/* being updated */
+			continue;
+		}
+		__asm volatile("sync" ::: "memory");
+		valid = tp->tp_valid;
+		ts->tv_sec = tp->tp_sec;
+		ts->tv_nsec = tp->tp_nsec;
+		__asm volatile("sync" ::: "memory");
+	} while ((seq & 1) || tp->tp_seq != seq);
+
+	if (valid) {
+		return 0;
+	}
+
+	if (__time(&sec, &nsec) < 0) {
+		return -1;
+	}
+	ts->tv_sec = sec;
+	ts->tv_nsec = nsec;
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <errno.h>
+#include <limits.h>
+
+/*
+ * POSIX C functions: posix_spawn, posix_spawnp, and the file action
+ * list they take. See <spawn.h>.
+ */
+
+int
+posix_spawn_file_actions_init(posix_spawn_file_actions_t *fa)
+{
+	fa->__nactions = 0;
+	return 0;
+}
+
+int
+posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *fa)
+{
+	int i;
+
+	for (i = 0; i < fa->__nactions; i++) {
+		if (fa->__actions[i].sa_op == SPAWN_OPEN) {
+			free((char *)fa->__actions[i].sa_path);
+		}
+	}
+	fa->__nactions = 0;
+	return 0;
+}
+
+/*
+ * Append an action to FA; returns NULL if it's full.
+ */
+static
+struct spawn_action *
+addaction(posix_spawn_file_actions_t *fa, int op, int fd)
+{
+	struct spawn_action *act;
+
+	if (fa->__nactions == SPAWN_MAXACTIONS) {
+		return NULL;
+	}
+	act = &fa->__actions[fa->__nactions];
+	act->sa_op = op;
+	act->sa_fd = fd;
+	act->sa_srcfd = -1;
+	act->sa_flags = 0;
+	act->sa_mode = 0;
+	act->sa_path = NULL;
+	return act;
+}
+
+int
+posix_spawn_file_actions_addopen(posix_spawn_file_actions_t *fa, int fd,
+				 const char *path, int flags, mode_t mode)
+{
+	struct spawn_action *act;
+	char *copy;
+
+	if (fd < 0) {
+		return EBADF;
+	}
+	act = addaction(fa, SPAWN_OPEN, fd);
+	if (act == NULL) {
+		return ENOMEM;
+	}
+	/* POSIX says the string is copied */
+	copy = malloc(strlen(path) + 1);
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+	strcpy(copy, path);
+	act->sa_path = copy;
+	act->sa_flags = flags;
+	act->sa_mode = mode;
+	fa->__nactions++;
+	return 0;
+}
+
+int
+posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *fa, int fd)
+{
+	if (fd < 0) {
+		return EBADF;
+	}
+	if (addaction(fa, SPAWN_CLOSE, fd) == NULL) {
+		return ENOMEM;
+	}
+	fa->__nactions++;
+	return 0;
+}
+
+int
+posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *fa, int fd,
+				 int newfd)
+{
+	struct spawn_action *act;
+
+	if (fd < 0 || newfd < 0) {
+		return EBADF;
+	}
+	act = addaction(fa, SPAWN_DUP2, newfd);
+	if (act == NULL) {
+		return ENOMEM;
+	}
+	act->sa_srcfd = fd;
+	fa->__nactions++;
+	return 0;
+}
+
+int
+posix_spawn(pid_t *pid, const char *path,
+	    const posix_spawn_file_actions_t *fa,
+	    const posix_spawnattr_t *attr,
+	    char *const *argv, char *const *envp)
+{
+	pid_t newpid;
+
+	(void)envp;
+
+	if (attr != NULL) {
+		return EINVAL;
+	}
+
+	/* otherwise the child's output could come out before ours */
+	fflush(NULL);
+
+	if (fa != NULL) {
+		newpid = __spawn(path, argv, fa->__actions, fa->__nactions);
+	}
+	else {
+		newpid = __spawn(path, argv, NULL, 0);
+	}
+	if (newpid < 0) {
+		return errno;
+	}
+	if (pid != NULL) {
+		*pid = newpid;
+	}
+	return 0;
+}
+
+/*
+ * Like posix_spawn, but search $PATH for FILE the way execvp does.
+ */
+int
+posix_spawnp(pid_t *pid, const char *file,
+	     const posix_spawn_file_actions_t *fa,
+	     const posix_spawnattr_t *attr,
+	     char *const *argv, char *const *envp)
+{
+	const char *searchpath, *s, *t;
+	char progpath[PATH_MAX];
+	size_t len;
+	int result;
+
+	if (strchr(file, '/') != NULL) {
+		return posix_spawn(pid, file, fa, attr, argv, envp);
+	}
+
+	searchpath = getenv("PATH");
+	if (searchpath == NULL) {
+		return ENOENT;
+	}
+
+	for (s = searchpath; s != NULL; s = t) {
+		t = strchr(s, ':');
+		if (t != NULL) {
+			len = t - s;
+			/* advance past the colon */
+			t++;
+		}
+		else {
+			len = strlen(s);
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (len >= sizeof(progpath)) {
+			continue;
+		}
+		memcpy(progpath, s, len);
+		snprintf(progpath + len, sizeof(progpath) - len, "/%s", file);
+		result = posix_spawn(pid, progpath, fa, attr, argv, envp);
+		switch (result) {
+		    case ENOENT:
+		    case ENOTDIR:
+		    case ENOEXEC:
+			/* routine errors, try next dir */
+			break;
+		    default:
+			/* worked, or failed for real */
+			return result;
+		}
+	}
+	return ENOENT;
+}
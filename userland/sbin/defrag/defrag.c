@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * defrag - move files' blocks together on disk.
+ * Usage: defrag [-v] file-or-directory...
+ *
+ * Each regular file named, and each one under each directory named,
+ * is handed to the IOC_DEFRAG ioctl, which moves the file into one
+ * run of free blocks if it's in pieces (SFS extent-mapped files
+ * only). Files that were moved are listed with how many extents they
+ * had and have; with -v, so is everything else that was looked at.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <err.h>
+
+static int verbose;
+static unsigned nfiles, nmoved;
+static int failed;
+
+static void dopath(const char *path);
+
+/*
+ * Defragment one open file.
+ */
+static
+void
+dofile(const char *path, int fd)
+{
+	struct defragstat ds;
+
+	if (ioctl(fd, IOC_DEFRAG, &ds) < 0) {
+		warn("%s", path);
+		failed = 1;
+		return;
+	}
+	nfiles++;
+	if (ds.ds_after < ds.ds_before) {
+		nmoved++;
+		printf("%s: %u extents -> %u\n", path,
+		       (unsigned)ds.ds_before, (unsigned)ds.ds_after);
+	}
+	else if (verbose) {
+		printf("%s: %u extents, left alone\n", path,
+		       (unsigned)ds.ds_before);
+	}
+}
+
+/*
+ * Do everything in an open directory.
+ */
+static
+void
+dodir(const char *path, int fd)
+{
+	char name[NAME_MAX+1];
+	char sub[PATH_MAX];
+	int len;
+
+	while ((len = getdirentry(fd, name, sizeof(name)-1)) > 0) {
+		name[len] = 0;
+		if (!strcmp(name, ".") || !strcmp(name, "..")) {
+			continue;
+		}
+		if (snprintf(sub, sizeof(sub), "%s/%s", path, name)
+		    >= (int)sizeof(sub)) {
+			warnx("%s/%s: Path too long", path, name);
+			failed = 1;
+			continue;
+		}
+		dopath(sub);
+	}
+	if (len < 0) {
+		warn("%s: getdirentry", path);
+		failed = 1;
+	}
+}
+
+/*
+ * Do a file, or a directory and everything in it.
+ */
+static
+void
+dopath(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s", path);
+		failed = 1;
+		return;
+	}
+	if (fstat(fd, &st) < 0) {
+		warn("%s: fstat", path);
+		failed = 1;
+	}
+	else if (S_ISDIR(st.st_mode)) {
+		dodir(path, fd);
+	}
+	else if (S_ISREG(st.st_mode)) {
+		dofile(path, fd);
+	}
+	else if (verbose) {
+		printf("%s: not a regular file\n", path);
+	}
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-v")) {
+			verbose = 1;
+		}
+		else {
+			errx(1, "Usage: defrag [-v] file-or-directory...");
+		}
+	}
+	if (i == argc) {
+		errx(1, "Usage: defrag [-v] file-or-directory...");
+	}
+
+	for (; i<argc; i++) {
+		dopath(argv[i]);
+	}
+	printf("defrag: moved %u of %u files\n", nmoved, nfiles);
+	return failed;
+}
@@ -199,10 +199,21 @@ readsb(void)
 {
 	struct sfs_superblock sb;
 
+	uint32_t blocksize;
+
 	diskread(&sb, SFS_SUPER_BLOCK);
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	/* 0 is from before the block size was recorded, and means 512 */
+	blocksize = SWAP32(sb.sb_blocksize);
+	if (blocksize == 0) {
+		blocksize = 512;
+	}
+	if (blocksize != SFS_BLOCKSIZE) {
+		errx(1, "Volume has %u-byte blocks; dumpsfs was built for %u",
+		     blocksize, SFS_BLOCKSIZE);
+	}
 	return SWAP32(sb.sb_nblocks);
 }
 
@@ -222,10 +233,31 @@ dumpsb(void)
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+	dumpvalf("Block size", "%u bytes%s", SFS_BLOCKSIZE,
+		 sb.sb_blocksize == 0 ? " (not recorded)" : "");
 	dumpvalf("Journal start", "%u", SWAP32(sb.sb_journalstart));
 	dumpvalf("Journal size", "%u blocks", SWAP32(sb.sb_journalblocks));
+	dumpvalf("Flags", "0x%x%s%s%s%s", SWAP32(sb.sb_flags),
+		 (SWAP32(sb.sb_flags) & SFS_SBF_EXTJOURNAL) ?
+		 " (external journal)" : "",
+		 (SWAP32(sb.sb_flags) & SFS_SBF_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sb.sb_flags) & SFS_SBF_DIRINDEX) ?
+		 " (directory index)" : "",
+		 (SWAP32(sb.sb_flags) & SFS_SBF_INLINE) ?
+		 " (inline files)" : "");
 	dumplval("Volume name", sb.sb_volname);
+	if (SWAP32(sb.sb_clean) == SFS_SB_CLEAN) {
+		dumpvalf("Clean unmount", "head %u (lsn %llu), "
+			 "tail %u (lsn %llu)",
+			 SWAP32(sb.sb_cleanheadjblock),
+			 (unsigned long long)SWAP64(sb.sb_cleanheadlsn),
+			 SWAP32(sb.sb_cleantailjblock),
+			 (unsigned long long)SWAP64(sb.sb_cleantaillsn));
+	}
+	else {
+		dumpvalf("Clean unmount", "no (0x%x)", SWAP32(sb.sb_clean));
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -371,11 +403,50 @@ dump_client_record(uint32_t myblock, unsigned myoffset, uint64_t mylsn,
 
 	    /* recovery-level records */
 
-		/*
-		 * You write this.
-		 */
-		(void)data;
-		(void)len;
+	    case SFS_JREC_BITSET:
+	    case SFS_JREC_BITCLEAR:
+		{
+			struct sfs_jrec_bitflip jbf;
+
+			copyandzero(&jbf, sizeof(jbf), data, len);
+			printf("%s %u\n",
+			       type == SFS_JREC_BITSET ? "BITSET" : "BITCLEAR",
+			       SWAP32(jbf.jbf_block));
+		}
+		break;
+	    case SFS_JREC_DINODE:
+		{
+			struct sfs_jrec_dinode jd;
+			struct sfs_jrec_delta dd;
+			size_t pos;
+
+			/* the deltas follow, so it's not too big */
+			copyandzero(&jd, sizeof(jd), data,
+				    len < sizeof(jd) ? len : sizeof(jd));
+			printf("DINODE %u:", SWAP32(jd.jd_ino));
+			for (pos = sizeof(jd); pos + sizeof(dd) <= len;
+			     pos += sizeof(dd) + SWAP16(dd.jdd_len)) {
+				memcpy(&dd, (char *)data + pos, sizeof(dd));
+				printf(" [%u+%u]", SWAP16(dd.jdd_offset),
+				       SWAP16(dd.jdd_len));
+			}
+			printf("\n");
+		}
+		break;
+	    case SFS_JREC_DATA:
+	    case SFS_JREC_DIRINDEX:
+		{
+			struct sfs_jrec_data jdt;
+
+			/* likewise */
+			copyandzero(&jdt, sizeof(jdt), data,
+				    len < sizeof(jdt) ? len : sizeof(jdt));
+			printf("%s block %u [%u+%u]\n",
+			       type == SFS_JREC_DATA ? "DATA" : "DIRINDEX",
+			       SWAP32(jdt.jdt_block),
+			       SWAP16(jdt.jdt_offset), SWAP16(jdt.jdt_len));
+		}
+		break;
 
 	    default:
 		/* XXX hexdump it */
@@ -385,95 +456,236 @@ dump_client_record(uint32_t myblock, unsigned myoffset, uint64_t mylsn,
 }
 
 /*
- * Find the physical location of an LSN.
+ * Check if the disk is a journal device rather than a volume.
  */
+static
+bool
+isjournaldev(void)
+{
+	struct sfs_jsuperblock jsb;
+
+	diskread(&jsb, SFS_JSUPER_BLOCK);
+	return SWAP32(jsb.jsb_magic) == SFS_JMAGIC;
+}
+
 static
 void
-findlsn(const uint64_t *firstlsns, uint32_t jstart, uint32_t jblocks,
-	uint64_t targetlsn,
-	uint32_t *block_ret, unsigned *offset_ret)
+dumpjsb(void)
 {
-	uint32_t block, nextblock;
-	uint8_t buf[SFS_BLOCKSIZE];
-	unsigned offset;
-	struct sfs_jphys_header jh;
-	uint64_t ci;
-	uint64_t lsn;
-	unsigned len;
+	struct sfs_jsuperblock jsb;
+	unsigned i;
 
-	for (block = 0; block < jblocks; block++) {
-		nextblock = (block + 1) % jblocks;
+	diskread(&jsb, SFS_JSUPER_BLOCK);
+	jsb.jsb_volname[sizeof(jsb.jsb_volname)-1] = 0;
 
-		if (targetlsn < firstlsns[block]) {
-			continue;
-		}
-		if (firstlsns[block] > firstlsns[nextblock] ||
-		    firstlsns[nextblock] == 0 ||
-		    targetlsn < firstlsns[nextblock]) {
-			goto found;
+	printf("Journal device superblock\n");
+	printf("-------------------------\n");
+	dumpvalf("Magic", "0x%8x", SWAP32(jsb.jsb_magic));
+	dumpvalf("Journal size", "%u blocks", SWAP32(jsb.jsb_journalblocks));
+	dumpvalf("Block size", "%u bytes%s", SFS_BLOCKSIZE,
+		 jsb.jsb_blocksize == 0 ? " (not recorded)" : "");
+	dumplval("Volume name", jsb.jsb_volname);
+
+	for (i=0; i<ARRAYCOUNT(jsb.reserved); i++) {
+		if (jsb.reserved[i] != 0) {
+			printf("    Word %u in reserved area: 0x%x\n",
+			       i, SWAP32(jsb.reserved[i]));
 		}
 	}
-	errx(1, "Cannot find block for tail LSN %llu",
-	     (unsigned long long)targetlsn);
+	printf("\n");
+}
 
- found:
+/*
+ * Find the journal: in the volume, or on a journal device. Returns
+ * false for a volume whose journal is on a separate device.
+ */
+static
+bool
+findjournal(uint32_t *jstart, uint32_t *jblocks)
+{
+	struct sfs_superblock sb;
+	struct sfs_jsuperblock jsb;
 
-	diskread(buf, jstart + block);
-	offset = 0;
-	while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
-		memcpy(&jh, buf + offset, sizeof(jh));
-		ci = SWAP64(jh.jh_coninfo);
-		assert(ci != 0);
-		lsn = SFS_CONINFO_LSN(ci);
-		len = SFS_CONINFO_LEN(ci);
+	if (isjournaldev()) {
+		diskread(&jsb, SFS_JSUPER_BLOCK);
+		*jstart = SFS_JDEV_JOURNALSTART;
+		*jblocks = SWAP32(jsb.jsb_journalblocks);
+		return true;
+	}
 
-		if (lsn == targetlsn) {
-			*block_ret = block;
-			*offset_ret = offset;
-			return;
+	diskread(&sb, SFS_SUPER_BLOCK);
+	if (SWAP32(sb.sb_flags) & SFS_SBF_EXTJOURNAL) {
+		printf("Journal is on a separate device; dump that instead\n");
+		return false;
+	}
+	*jstart = SWAP32(sb.sb_journalstart);
+	*jblocks = SWAP32(sb.sb_journalblocks);
+	return true;
+}
+
+/*
+ * The journal index: one entry for each record, made in one pass
+ * over a copy of the whole journal in memory. After the head and
+ * tail are found it's cut down to the live records and sorted by
+ * LSN, and byblock[] holds the same entries sorted by the disk block
+ * each record is about, so a query for an LSN range or for a block
+ * is a binary search rather than a walk over the whole journal.
+ */
+struct jentry {
+	uint64_t je_lsn;
+	uint32_t je_jblock;		/* journal block it's in */
+	unsigned je_offset;		/* offset in that block */
+	unsigned je_class, je_type;
+	uint32_t je_target;		/* disk block, or NOTARGET */
+};
+#define NOTARGET 0xffffffff
+
+/* Record types by name, for -T */
+static const struct {
+	const char *name;
+	unsigned class, type;
+} jtypenames[] = {
+	{ "PAD",	SFS_JPHYS_CONTAINER,	SFS_JPHYS_PAD },
+	{ "TRIM",	SFS_JPHYS_CONTAINER,	SFS_JPHYS_TRIM },
+	{ "BITSET",	SFS_JPHYS_CLIENT,	SFS_JREC_BITSET },
+	{ "BITCLEAR",	SFS_JPHYS_CLIENT,	SFS_JREC_BITCLEAR },
+	{ "DINODE",	SFS_JPHYS_CLIENT,	SFS_JREC_DINODE },
+	{ "DATA",	SFS_JPHYS_CLIENT,	SFS_JREC_DATA },
+	{ "DIRINDEX",	SFS_JPHYS_CLIENT,	SFS_JREC_DIRINDEX },
+};
+
+/* Journal query set up by the command line; all must match */
+static bool jq_bylsn, jq_byblock, jq_bytype;
+static uint64_t jq_lowlsn, jq_highlsn;
+static uint32_t jq_block;
+static unsigned jq_class, jq_type;
+
+static uint8_t *jdata;			/* the whole journal */
+static struct jentry *jindex;		/* by LSN, once trimmed */
+static struct jentry **byblock;		/* by target block, then LSN */
+static unsigned njindex, maxjindex;
+
+/*
+ * Get a new entry at the end of jindex[]. (No realloc on OS/161.)
+ */
+static
+struct jentry *
+newjentry(void)
+{
+	struct jentry *n;
+	unsigned newmax;
+
+	if (njindex == maxjindex) {
+		newmax = maxjindex ? maxjindex * 2 : 256;
+		n = malloc(newmax * sizeof(n[0]));
+		if (n == NULL) {
+			errx(1, "Out of memory for the journal index");
 		}
-		offset += len;
+		if (njindex > 0) {
+			memcpy(n, jindex, njindex * sizeof(n[0]));
+		}
+		free(jindex);
+		jindex = n;
+		maxjindex = newmax;
 	}
-	errx(1, "Cannot find offset for tail LSN %llu in block %u",
-	     (unsigned long long)targetlsn, block);
+	return &jindex[njindex++];
 }
 
+/*
+ * Find the disk block a client record touches: the block whose
+ * freemap bit flipped, the inode, or the block written.
+ */
 static
-void
-dumpjournal(void)
+uint32_t
+rectarget(unsigned type, const void *data, size_t len)
 {
-	struct sfs_superblock sb;
-	uint32_t jstart, jblocks;
-	struct sfs_jphys_header jh;
-	uint64_t ci;
-	unsigned len;
-	unsigned class, type;
-	struct sfs_jphys_trim jt;
-	uint8_t buf[SFS_BLOCKSIZE];
+	struct sfs_jrec_bitflip jbf;
+	struct sfs_jrec_dinode jd;
+	struct sfs_jrec_data jdt;
 
-	uint64_t bh_checkpoint_taillsn, eoj_checkpoint_taillsn;
-	//uint32_t bh_checkpoint_block, eoj_checkpoint_block;
-	//unsigned bh_checkpoint_offset, eoj_checkpoint_offset;
+	switch (type) {
+	    case SFS_JREC_BITSET:
+	    case SFS_JREC_BITCLEAR:
+		if (len < sizeof(jbf)) {
+			break;
+		}
+		memcpy(&jbf, data, sizeof(jbf));
+		return SWAP32(jbf.jbf_block);
+	    case SFS_JREC_DINODE:
+		if (len < sizeof(jd)) {
+			break;
+		}
+		memcpy(&jd, data, sizeof(jd));
+		return SWAP32(jd.jd_ino);
+	    case SFS_JREC_DATA:
+	    case SFS_JREC_DIRINDEX:
+		if (len < sizeof(jdt)) {
+			break;
+		}
+		memcpy(&jdt, data, sizeof(jdt));
+		return SWAP32(jdt.jdt_block);
+	}
+	return NOTARGET;
+}
 
-	uint64_t veryfirstlsn, prevlsn, headlsn, smallestlsn, taillsn;
-	uint32_t headblock, smallestlsn_block, tailblock;
-	unsigned tailoffset;
+static
+int
+jentry_bylsn(const void *av, const void *bv)
+{
+	const struct jentry *a = av;
+	const struct jentry *b = bv;
 
-	uint64_t *firstlsns;
+	if (a->je_lsn != b->je_lsn) {
+		return a->je_lsn < b->je_lsn ? -1 : 1;
+	}
+	return 0;
+}
 
-	uint64_t mylsn, lsn;
-	uint32_t myblock, block;
-	unsigned myoffset, offset;
-	void *mydata;
-	unsigned mylen;
+static
+int
+jentry_byblock(const void *av, const void *bv)
+{
+	const struct jentry *a = *(struct jentry *const *)av;
+	const struct jentry *b = *(struct jentry *const *)bv;
 
+	if (a->je_target != b->je_target) {
+		return a->je_target < b->je_target ? -1 : 1;
+	}
+	return jentry_bylsn(a, b);
+}
 
-	diskread(&sb, SFS_SUPER_BLOCK);
-	jstart = SWAP32(sb.sb_journalstart);
-	jblocks = SWAP32(sb.sb_journalblocks);
+/*
+ * Read the journal into memory with one large read per chunk, and
+ * index every record in it. Returns the head LSN and journal block,
+ * and the tail LSN.
+ */
+static
+void
+indexjournal(uint32_t jstart, uint32_t jblocks,
+	     uint64_t *headlsn_ret, uint32_t *headblock_ret,
+	     uint64_t *taillsn_ret)
+{
+	struct sfs_jphys_header jh;
+	struct sfs_jphys_trim jt;
+	struct jentry *je;
+	uint64_t ci, lsn;
+	unsigned len, offset;
+	uint32_t block, n;
+	uint8_t *buf;
 
-	printf("Journal (%u blocks at %u)\n", jblocks, jstart);
-	printf("--------------------------------\n");
+	uint64_t bh_checkpoint_taillsn, eoj_checkpoint_taillsn;
+	uint64_t veryfirstlsn, prevlsn, headlsn, smallestlsn;
+	uint32_t headblock;
+
+	jdata = malloc((size_t)jblocks * SFS_BLOCKSIZE);
+	if (jdata == NULL) {
+		errx(1, "Out of memory for the journal");
+	}
+	for (block=0; block<jblocks; block += n) {
+		n = jblocks - block < 128 ? jblocks - block : 128;
+		diskreadmany(jdata + (size_t)block * SFS_BLOCKSIZE,
+			     jstart + block, n);
+	}
 
 	/*
 	 * First pass: read the LSNs and find the head. If this
@@ -481,21 +693,15 @@ dumpjournal(void)
 	 */
 
 	bh_checkpoint_taillsn = eoj_checkpoint_taillsn = 0;
-	//bh_checkpoint_block = eoj_checkpoint_block = 0;
-	//bh_checkpoint_offset = eoj_checkpoint_offset = 0;
-
 	veryfirstlsn = 0;
 	prevlsn = 0;
 	headlsn = 0;
 	smallestlsn = 0;
 	headblock = 0;
-	smallestlsn_block = 0;
-	tailblock = 0;
-	tailoffset = 0;
-	firstlsns = malloc(jblocks * sizeof(firstlsns[0]));
+	njindex = 0;
 
 	for (block=0; block<jblocks; block++) {
-		diskread(buf, jstart + block);
+		buf = jdata + (size_t)block * SFS_BLOCKSIZE;
 		offset = 0;
 		while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
 			assert(offset % sizeof(uint16_t) == 0);
@@ -507,7 +713,6 @@ dumpjournal(void)
 					     "zero header\n", block, offset);
 				}
 				/* block hasn't been used yet */
-				firstlsns[block] = 0;
 				if (headlsn == 0) {
 					headlsn = prevlsn + 1;
 					headblock = block;
@@ -517,10 +722,6 @@ dumpjournal(void)
 			lsn = SFS_CONINFO_LSN(ci);
 			len = SFS_CONINFO_LEN(ci);
 
-			if (offset == 0) {
-				firstlsns[block] = lsn;
-			}
-
 			if (len == 0) {
 				errx(1, "At %u[%u] in journal: "
 				     "zero-length record", block, offset);
@@ -530,6 +731,11 @@ dumpjournal(void)
 				     "runt record (length %u)",
 				     block, offset, len);
 			}
+			if (offset + len > SFS_BLOCKSIZE) {
+				errx(1, "At %u[%u] in journal: "
+				     "record too large (length %u)",
+				     block, offset, len);
+			}
 
 			if (block == 0 && offset == 0) {
 				veryfirstlsn = lsn;
@@ -542,7 +748,6 @@ dumpjournal(void)
 					     (unsigned long long)lsn);
 				}
 				smallestlsn = lsn;
-				smallestlsn_block = block;
 				headlsn = prevlsn + 1;
 				headblock = block;
 			}
@@ -558,7 +763,7 @@ dumpjournal(void)
 			}
 
 			/*
-			 * Remember the location and save the contents of:
+			 * Remember the contents of:
 			 *    - the last checkpoint we see before we find
 			 *      the head
 			 *    - the last checkpoint we see before the
@@ -576,101 +781,219 @@ dumpjournal(void)
 				jt.jt_taillsn = SWAP64(jt.jt_taillsn);
 				if (headlsn == 0) {
 					bh_checkpoint_taillsn = jt.jt_taillsn;
-					//bh_checkpoint_block = block;
-					//bh_checkpoint_offset = offset;
 				}
 				else {
 					eoj_checkpoint_taillsn = jt.jt_taillsn;
-					//eoj_checkpoint_block = block;
-					//eoj_checkpoint_offset = offset;
 				}
 			}
 
+			je = newjentry();
+			je->je_lsn = lsn;
+			je->je_jblock = block;
+			je->je_offset = offset;
+			je->je_class = SFS_CONINFO_CLASS(ci);
+			je->je_type = SFS_CONINFO_TYPE(ci);
+			je->je_target = NOTARGET;
+			if (je->je_class == SFS_JPHYS_CLIENT) {
+				je->je_target = rectarget(je->je_type,
+						buf + offset + sizeof(jh),
+						len - sizeof(jh));
+			}
+
 			prevlsn = lsn;
 			offset += len;
 		}
 	}
+	if (headlsn == 0) {
+		/* the head is exactly at the rollover point */
+		headlsn = prevlsn + 1;
+	}
 
 	/*
-	 * Second: find the tail. We don't need to scan again; pick
-	 * either bh_checkpoint_taillsn or eoj_checkpoint_taillsn.
-	 * Or neither, in which case we use either veryfirstlsn or
-	 * smallestlsn.
+	 * Second: find the tail. Pick either bh_checkpoint_taillsn
+	 * or eoj_checkpoint_taillsn. Or neither, in which case we use
+	 * either veryfirstlsn or smallestlsn.
 	 */
 	if (bh_checkpoint_taillsn != 0) {
-		taillsn = bh_checkpoint_taillsn;
-		findlsn(firstlsns, jstart, jblocks, taillsn,
-			&tailblock, &tailoffset);
+		*taillsn_ret = bh_checkpoint_taillsn;
 	}
 	else if (eoj_checkpoint_taillsn != 0) {
-		taillsn = eoj_checkpoint_taillsn;
-		findlsn(firstlsns, jstart, jblocks, taillsn,
-			&tailblock, &tailoffset);
+		*taillsn_ret = eoj_checkpoint_taillsn;
 	}
 	else if (smallestlsn != 0) {
-		taillsn = smallestlsn;
-		tailblock = smallestlsn_block;
-		tailoffset = 0;
+		*taillsn_ret = smallestlsn;
 	}
 	else {
-		taillsn = veryfirstlsn;
-		tailblock = 0;
-		tailoffset = 0;
+		*taillsn_ret = veryfirstlsn;
 	}
+	*headlsn_ret = headlsn;
+	*headblock_ret = headblock;
+}
 
-	free(firstlsns);
-	firstlsns = NULL;
+/*
+ * Return the index of the first entry in jindex[] whose LSN isn't
+ * less than LSN.
+ */
+static
+unsigned
+findlsn(uint64_t lsn)
+{
+	unsigned lo = 0, hi = njindex, mid;
 
-	printf("    head: lsn %llu, at %u[0]\n",
-	       (unsigned long long)headlsn, headblock);
-	printf("    tail: lsn %llu, at %u[%u]\n",
-	       (unsigned long long)taillsn, tailblock, tailoffset);
-	printf("\n");
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (jindex[mid].je_lsn < lsn) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-	myblock = tailblock;
-	myoffset = tailoffset;
-	mylsn = taillsn;
-	diskread(buf, jstart + myblock);
-	while (mylsn < headlsn) {
-		while (myoffset + sizeof(jh) <= SFS_BLOCKSIZE) {
-			memcpy(&jh, buf + myoffset, sizeof(jh));
-			ci = SWAP64(jh.jh_coninfo);
-			class = SFS_CONINFO_CLASS(ci);
-			type = SFS_CONINFO_TYPE(ci);
-			len = SFS_CONINFO_LEN(ci);
-			lsn = SFS_CONINFO_LSN(ci);
+/*
+ * Return the index of the first entry in byblock[] whose target
+ * isn't less than BLOCK.
+ */
+static
+unsigned
+findblock(uint32_t block)
+{
+	unsigned lo = 0, hi = njindex, mid;
 
-			/* these have already been checked */
-			assert(lsn == mylsn);
-			assert(len >= sizeof(jh));
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (byblock[mid]->je_target < block) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-			mydata = buf + myoffset + sizeof(jh);
-			mylen = len - sizeof(jh);
+/*
+ * Check an entry against the query; print it if it matches.
+ * Returns true if printed.
+ */
+static
+bool
+dumpjentry(const struct jentry *je)
+{
+	struct sfs_jphys_header jh;
+	uint8_t *rec;
+	unsigned len;
 
-			if (class == SFS_JPHYS_CONTAINER) {
-				dump_container_record(myblock, myoffset, mylsn,
-						      type, mydata, mylen);
-			}
-			else {
-				dump_client_record(myblock, myoffset, mylsn,
-						   type, mydata, mylen);
-			}
+	if (jq_bylsn && (je->je_lsn < jq_lowlsn || je->je_lsn > jq_highlsn)) {
+		return false;
+	}
+	if (jq_byblock && je->je_target != jq_block) {
+		return false;
+	}
+	if (jq_bytype && (je->je_class != jq_class ||
+			  je->je_type != jq_type)) {
+		return false;
+	}
+
+	rec = jdata + (size_t)je->je_jblock * SFS_BLOCKSIZE + je->je_offset;
+	memcpy(&jh, rec, sizeof(jh));
+	len = SFS_CONINFO_LEN(SWAP64(jh.jh_coninfo));
+	if (je->je_class == SFS_JPHYS_CONTAINER) {
+		dump_container_record(je->je_jblock, je->je_offset,
+				      je->je_lsn, je->je_type,
+				      rec + sizeof(jh), len - sizeof(jh));
+	}
+	else {
+		dump_client_record(je->je_jblock, je->je_offset,
+				   je->je_lsn, je->je_type,
+				   rec + sizeof(jh), len - sizeof(jh));
+	}
+	return true;
+}
+
+static
+void
+dumpjournal(void)
+{
+	uint32_t jstart, jblocks;
+	uint64_t headlsn, taillsn;
+	uint32_t headblock;
+	unsigned i, j, shown;
+
+	if (!findjournal(&jstart, &jblocks)) {
+		return;
+	}
+
+	printf("Journal (%u blocks at %u)\n", jblocks, jstart);
+	printf("--------------------------------\n");
+
+	indexjournal(jstart, jblocks, &headlsn, &headblock, &taillsn);
 
-			myoffset += len;
-			mylsn++;
+	/* keep the live records, in LSN order */
+	for (i=j=0; i<njindex; i++) {
+		if (jindex[i].je_lsn >= taillsn && jindex[i].je_lsn < headlsn) {
+			jindex[j++] = jindex[i];
 		}
-		myblock = (myblock + 1) % jblocks;
-		myoffset = 0;
-		diskread(buf, jstart + myblock);
+	}
+	njindex = j;
+	qsort(jindex, njindex, sizeof(jindex[0]), jentry_bylsn);
+
+	printf("    head: lsn %llu, at %u[0]\n",
+	       (unsigned long long)headlsn, headblock);
+	if (njindex > 0 && jindex[0].je_lsn == taillsn) {
+		printf("    tail: lsn %llu, at %u[%u]\n",
+		       (unsigned long long)taillsn,
+		       jindex[0].je_jblock, jindex[0].je_offset);
+	}
+	else {
+		printf("    tail: lsn %llu\n", (unsigned long long)taillsn);
+	}
+	printf("\n");
+
+	shown = 0;
+	if (jq_byblock) {
+		byblock = malloc((njindex + 1) * sizeof(byblock[0]));
+		if (byblock == NULL) {
+			errx(1, "Out of memory for the journal index");
+		}
+		for (i=0; i<njindex; i++) {
+			byblock[i] = &jindex[i];
+		}
+		qsort(byblock, njindex, sizeof(byblock[0]), jentry_byblock);
+		for (i = findblock(jq_block);
+		     i < njindex && byblock[i]->je_target == jq_block; i++) {
+			shown += dumpjentry(byblock[i]);
+		}
+		free(byblock);
+		byblock = NULL;
+	}
+	else {
+		i = jq_bylsn ? findlsn(jq_lowlsn) : 0;
+		for (; i < njindex; i++) {
+			if (jq_bylsn && jindex[i].je_lsn > jq_highlsn) {
+				break;
+			}
+			shown += dumpjentry(&jindex[i]);
+		}
+	}
+	if (jq_bylsn || jq_byblock || jq_bytype) {
+		printf("    [%u of %u records]\n", shown, njindex);
 	}
 	printf("\n");
+
+	free(jindex);
+	free(jdata);
+	jindex = NULL;
+	jdata = NULL;
+	njindex = maxjindex = 0;
 }
 
 static
 void
 dumpphysjournal(void)
 {
-	struct sfs_superblock sb;
 	uint32_t jstart, jblocks;
 	uint8_t buf[SFS_BLOCKSIZE];
 	struct sfs_jphys_header jh;
@@ -690,9 +1013,9 @@ dumpphysjournal(void)
 	char pbuf[64];
 
 
-	diskread(&sb, SFS_SUPER_BLOCK);
-	jstart = SWAP32(sb.sb_journalstart);
-	jblocks = SWAP32(sb.sb_journalblocks);
+	if (!findjournal(&jstart, &jblocks)) {
+		return;
+	}
 
 	printf("Physical journal (%u blocks at %u)\n", jblocks, jstart);
 	printf("----------------------------------------\n");
@@ -826,6 +1149,62 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	return fileblock;
 }
 
+/*
+ * Get extent number IDX of an extent-mapped inode.
+ */
+static
+void
+getextent(const struct sfs_dinode *sfi, uint32_t idx, struct sfs_extent *x)
+{
+	struct sfs_extblock xb;
+	uint32_t block, k;
+
+	if (idx < SFS_NIEXTENTS) {
+		*x = sfi->sfi_extents[idx];
+	}
+	else {
+		idx -= SFS_NIEXTENTS;
+		block = SWAP32(sfi->sfi_extblock);
+		for (k = 0; k <= idx / SFS_EXTPERBLOCK; k++) {
+			if (block == 0) {
+				errx(1, "Extent block chain too short");
+			}
+			diskread(&xb, block);
+			block = SWAP32(xb.sxb_next);
+		}
+		*x = xb.sxb_extents[idx % SFS_EXTPERBLOCK];
+	}
+	x->sx_fileblock = SWAP32(x->sx_fileblock);
+	x->sx_diskblock = SWAP32(x->sx_diskblock);
+	x->sx_len = SWAP32(x->sx_len);
+}
+
+static
+void
+traverse_extents(const struct sfs_dinode *sfi, uint32_t numblocks,
+		 void (*doblock)(uint32_t, uint32_t))
+{
+	struct sfs_extent x;
+	uint32_t fileblock, i, j, n;
+
+	n = SWAP32(sfi->sfi_nextents);
+	fileblock = 0;
+	for (i=0; i<n && fileblock < numblocks; i++) {
+		getextent(sfi, i, &x);
+		while (fileblock < x.sx_fileblock && fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		for (j=0; j<SFS_XLEN(&x) && fileblock < numblocks; j++) {
+			/* unwritten blocks read as zeros, like holes */
+			doblock(fileblock++, (x.sx_len & SFS_XUNWRITTEN) ?
+				0 : x.sx_diskblock + j);
+		}
+	}
+	while (fileblock < numblocks) {
+		doblock(fileblock++, 0);
+	}
+}
+
 static
 void
 traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
@@ -836,6 +1215,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 
 	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
 
+	if (SWAP32(sfi->sfi_flags) & SFS_DIF_INLINE) {
+		/* no blocks */
+		return;
+	}
+	if (SWAP32(sfi->sfi_flags) & SFS_DIF_EXTENTS) {
+		traverse_extents(sfi, numblocks, doblock);
+		return;
+	}
+
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
@@ -937,23 +1325,19 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Hex dump LEN bytes of file data found at file offset POS.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpfiledata(uint32_t pos, const uint8_t *data, unsigned len)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", pos + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -963,9 +1347,13 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 			printf(" ");
 		}
 		printf("%02x", data[i]);
-		if (i % 16 == 15) {
+		if (i % 16 == 15 || i == len - 1) {
+			/* pad out a short last row */
+			for (j = i % 16 + 1; j < 16; j++) {
+				printf(j % 8 == 0 ? "    " : "   ");
+			}
 			printf("  ");
-			for (j = i-15; j<=i; j++) {
+			for (j = i - i % 16; j<=i; j++) {
 				if (data[j] < 32 || data[j] > 126) {
 					putchar('.');
 				}
@@ -978,11 +1366,46 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_BLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpfiledata(fileblock * SFS_BLOCKSIZE, data, SFS_BLOCKSIZE);
+}
+
+/*
+ * Dump the contents of an inline file.
+ */
+static
+void
+dumpinline(const struct sfs_dinode *sfi)
+{
+	uint32_t size;
+
+	size = SWAP32(sfi->sfi_size);
+	if (size > SFS_INLINE_MAX) {
+		printf("    [inline size %u too large]\n", size);
+		size = SFS_INLINE_MAX;
+	}
+	dumpfiledata(0, (const uint8_t *)sfi->sfi_extents, size);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_DIF_INLINE) {
+		dumpinline(sfi);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -1012,8 +1435,33 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_DIF_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_DIF_INLINE) ?
+		 " (inline)" : "");
 	printf("\n");
 
+	if (SWAP32(sfi.sfi_flags) & SFS_DIF_INLINE) {
+		printf("    Inline data: %u bytes\n", SWAP32(sfi.sfi_size));
+	}
+	else if (SWAP32(sfi.sfi_flags) & SFS_DIF_EXTENTS) {
+		struct sfs_extent x;
+		uint32_t n;
+
+		n = SWAP32(sfi.sfi_nextents);
+		printf("    Extents: %u (extent blocks start at %u)\n", n,
+		       SWAP32(sfi.sfi_extblock));
+		for (i=0; i<n; i++) {
+			getextent(&sfi, i, &x);
+			printf("      @%-6u %u blocks at %u (0x%x)%s\n",
+			       x.sx_fileblock, SFS_XLEN(&x),
+			       x.sx_diskblock, x.sx_diskblock,
+			       (x.sx_len & SFS_XUNWRITTEN) ?
+			       " unwritten" : "");
+		}
+	}
+
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -1043,6 +1491,10 @@ dumpinode(uint32_t ino, const char *name)
 	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
 	printf("    Triple indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	if (sfi.sfi_dirindex != 0) {
+		printf("    Directory index: %u (0x%x)\n",
+		       SWAP32(sfi.sfi_dirindex), SWAP32(sfi.sfi_dirindex));
+	}
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -1070,15 +1522,89 @@ dumpinode(uint32_t ino, const char *name)
 ////////////////////////////////////////////////////////////
 // main
 
+/*
+ * Parse a decimal number at S; set *END to just past it.
+ */
+static
+uint64_t
+parsenum(const char *s, const char **end)
+{
+	uint64_t val = 0;
+
+	if (*s < '0' || *s > '9') {
+		errx(1, "Invalid number %s", s);
+	}
+	while (*s >= '0' && *s <= '9') {
+		val = val * 10 + (*s - '0');
+		s++;
+	}
+	*end = s;
+	return val;
+}
+
+/*
+ * Set up the journal query for -L: LOW-HIGH, LOW-, or a single LSN.
+ */
+static
+void
+setlsnquery(const char *arg)
+{
+	const char *s;
+
+	jq_bylsn = true;
+	jq_lowlsn = parsenum(arg, &s);
+	if (*s == 0) {
+		jq_highlsn = jq_lowlsn;
+		return;
+	}
+	if (*s != '-') {
+		errx(1, "Invalid LSN range %s", arg);
+	}
+	s++;
+	if (*s == 0) {
+		jq_highlsn = (uint64_t)-1;
+		return;
+	}
+	jq_highlsn = parsenum(s, &s);
+	if (*s != 0 || jq_highlsn < jq_lowlsn) {
+		errx(1, "Invalid LSN range %s", arg);
+	}
+}
+
+/*
+ * Set up the journal query for -T.
+ */
+static
+void
+settypequery(const char *arg)
+{
+	unsigned i;
+
+	for (i=0; i<ARRAYCOUNT(jtypenames); i++) {
+		if (!strcmp(arg, jtypenames[i].name)) {
+			jq_bytype = true;
+			jq_class = jtypenames[i].class;
+			jq_type = jtypenames[i].type;
+			return;
+		}
+	}
+	errx(1, "Unknown journal record type %s", arg);
+}
+
 static
 void
 usage(void)
 {
 	warnx("Usage: dumpsfs [options] device/diskfile");
+	warnx("   (or an external journal device, for -s, -j, or -J)");
 	warnx("   -s: dump superblock");
 	warnx("   -b: dump free block bitmap");
 	warnx("   -j: dump journal");
 	warnx("   -J: physical dump of journal");
+	warnx("   -L lsn[-[lsn]]: dump only journal records in this range");
+	warnx("   -B block: dump only journal records about this block");
+	warnx("   -T type: dump only journal records of this type");
+	warnx("      (PAD, TRIM, BITSET, BITCLEAR, DINODE, DATA, DIRINDEX)");
 	warnx("   -i ino: dump specified inode");
 	warnx("   -I: dump indirect blocks");
 	warnx("   -f: dump file contents");
@@ -1097,6 +1623,9 @@ main(int argc, char **argv)
 	bool dophysjournal = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
+	const char *arg;
+	const char *s;
+	char opt;
 
 	int i, j;
 	uint32_t nblocks;
@@ -1116,12 +1645,39 @@ main(int argc, char **argv)
 				    case 'j': dojournal = true; break;
 				    case 'J': dophysjournal = true; break;
 				    case 'i':
-					if (argv[i][j+1] == 0) {
-						dumpino = atoi(argv[++i]);
+				    case 'L':
+				    case 'B':
+				    case 'T':
+					opt = argv[i][j];
+					if (argv[i][j+1] != 0) {
+						arg = argv[i]+j+1;
+					}
+					else if (i+1 < argc) {
+						arg = argv[++i];
 					}
 					else {
-						dumpino = atoi(argv[i]+j+1);
-						j = strlen(argv[i]);
+						usage();
+					}
+					switch (opt) {
+					    case 'i':
+						dumpino = atoi(arg);
+						break;
+					    case 'L':
+						setlsnquery(arg);
+						dojournal = true;
+						break;
+					    case 'B':
+						jq_byblock = true;
+						jq_block = parsenum(arg, &s);
+						if (*s != 0) {
+							usage();
+						}
+						dojournal = true;
+						break;
+					    case 'T':
+						settypequery(arg);
+						dojournal = true;
+						break;
 					}
 					/* XXX ugly */
 					goto nextarg;
@@ -1165,6 +1721,23 @@ main(int argc, char **argv)
 	}
 
 	opendisk(dumpdisk);
+	disksetblocksize(SFS_BLOCKSIZE);
+
+	if (isjournaldev()) {
+		/* A journal device has only the journal in it */
+		if (dosb || (!dojournal && !dophysjournal)) {
+			dumpjsb();
+		}
+		if (dophysjournal) {
+			dumpphysjournal();
+		}
+		if (dojournal) {
+			dumpjournal();
+		}
+		closedisk();
+		return 0;
+	}
+
 	nblocks = readsb();
 
 	if (dosb) {
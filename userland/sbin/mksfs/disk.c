@@ -27,6 +27,10 @@
  * SUCH DAMAGE.
  */
 
+#ifdef HOST
+#define _GNU_SOURCE	/* for SEEK_DATA and SEEK_HOLE on Linux */
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,18 +45,39 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
+
+/* Most bytes diskzero() writes with one call */
+#define ZEROBYTES 65536
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nsectors, blocksize, nblocks;
+
+/*
+ * File offset of block BLOCK. If we're built for the host OS, skip
+ * over the disk file header, which is one sector.
+ */
+static
+off_t
+blockoffset(uint32_t block)
+{
+	off_t pos;
+
+	pos = (off_t)block * blocksize;
+#ifdef HOST
+	pos += SECTORSIZE;
+#endif
+	return pos;
+}
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
- * System/161 disk image, and then ignore the header block.
+ * System/161 disk image, and then ignore the header block. Blocks
+ * are sectors until disksetblocksize() says otherwise.
  */
 void
 opendisk(const char *path)
@@ -68,10 +93,11 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nsectors = statbuf.st_size / SECTORSIZE;
+	blocksize = SECTORSIZE;
 
 #ifdef HOST
-	nblocks--;
+	nsectors--;
 
 	{
 		char buf[64];
@@ -92,16 +118,38 @@ opendisk(const char *path)
 		}
 	}
 #endif
+	nblocks = nsectors;
+}
+
+/*
+ * Count in blocks of SIZE bytes from now on, for a file system whose
+ * blocks are bigger than the disk's sectors. A partial block at the
+ * end of the disk is left out.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(fd>=0);
+	if (size == 0 || size % SECTORSIZE != 0) {
+		errx(1, "Block size %u is not a multiple of the sector size %u",
+		     size, SECTORSIZE);
+	}
+	if (size > ZEROBYTES) {
+		errx(1, "Block size %u is too large", size);
+	}
+	blocksize = size;
+	nblocks = nsectors / (size / SECTORSIZE);
 }
 
 /*
- * Return the block size. (This is fixed, but still...)
+ * Return the block size: the sector size, unless changed with
+ * disksetblocksize().
  */
 uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return blocksize;
 }
 
 /*
@@ -119,6 +167,16 @@ diskblocks(void)
  */
 void
 diskwrite(const void *data, uint32_t block)
+{
+	diskwritemany(data, block, 1);
+}
+
+/*
+ * Write NUM consecutive blocks starting at BLOCK, with as few write
+ * calls as the system allows.
+ */
+void
+diskwritemany(const void *data, uint32_t block, uint32_t num)
 {
 	const char *cdata = data;
 	uint32_t tot=0;
@@ -126,17 +184,12 @@ diskwrite(const void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, blockoffset(block), SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < num*blocksize) {
+		len = write(fd, cdata + tot, num*blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -150,11 +203,97 @@ diskwrite(const void *data, uint32_t block)
 	}
 }
 
+/*
+ * Write zeros to NUM blocks starting at BLOCK, ZEROBYTES at a time.
+ */
+static
+void
+zerorange(uint32_t block, uint32_t num)
+{
+	static const char zeros[ZEROBYTES];
+	uint32_t n, max;
+
+	max = ZEROBYTES / blocksize;
+	while (num > 0) {
+		n = num < max ? num : max;
+		diskwritemany(zeros, block, n);
+		block += n;
+		num -= n;
+	}
+}
+
+/*
+ * Zero NUM blocks starting at BLOCK.
+ *
+ * Disk images on the host are usually sparse files, and the holes
+ * in them read as zeros already, so where the host can tell us where
+ * the holes are, only write the parts that aren't holes. Zeroing a
+ * region of a fresh image then costs nothing no matter how big it is.
+ */
+void
+diskzero(uint32_t block, uint32_t num)
+{
+	assert(fd>=0);
+
+#if defined(HOST) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+	{
+		/* file offsets, from the start of block 0 */
+		off_t base, pos, end, data, hole;
+
+		base = blockoffset(0);
+		pos = blockoffset(block);
+		end = pos + (off_t)num * blocksize;
+		while (pos < end) {
+			data = lseek(fd, pos, SEEK_DATA);
+			if (data < 0 && errno == ENXIO) {
+				/* nothing but hole from here on */
+				return;
+			}
+			if (data < 0) {
+				/* can't tell; write all of what's left */
+				break;
+			}
+			if (data >= end) {
+				return;
+			}
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0 || hole > end) {
+				hole = end;
+			}
+			/* round out to whole blocks */
+			data -= (data - base) % blocksize;
+			hole += (blocksize - (hole - base) % blocksize) %
+				blocksize;
+			if (hole > end) {
+				hole = end;
+			}
+			zerorange((data - base) / blocksize,
+				  (hole - data) / blocksize);
+			pos = hole;
+		}
+		block = (pos - base) / blocksize;
+		num = (end - pos) / blocksize;
+	}
+#endif
+
+	zerorange(block, num);
+}
+
 /*
  * Read a block.
  */
 void
 diskread(void *data, uint32_t block)
+{
+	diskreadmany(data, block, 1);
+}
+
+/*
+ * Read NUM consecutive blocks starting at BLOCK, with as few read
+ * calls as the system allows.
+ */
+void
+diskreadmany(void *data, uint32_t block, uint32_t num)
 {
 	char *cdata = data;
 	uint32_t tot=0;
@@ -162,17 +301,12 @@ diskread(void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, blockoffset(block), SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < num*blocksize) {
+		len = read(fd, cdata + tot, num*blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
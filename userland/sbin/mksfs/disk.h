@@ -29,10 +29,14 @@
 
 void opendisk(const char *path);
 
+void disksetblocksize(uint32_t size);
 uint32_t diskblocksize(void);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
+void diskwritemany(const void *data, uint32_t block, uint32_t num);
+void diskzero(uint32_t block, uint32_t num);
 void diskread(void *data, uint32_t block);
+void diskreadmany(void *data, uint32_t block, uint32_t num);
 
 void closedisk(void);
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -63,8 +64,12 @@
 /* Block number for the initial root directory contents */
 static uint32_t rootdir_data_block;
 
-/* Journal location and size */
+/* Journal location and size, and whether it's on its own device */
 static uint32_t journalstart, journalblocks;
+static bool extjournal;
+static bool extents;
+static bool dirindex;
+static bool inlinedata;
 
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
@@ -79,6 +84,7 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(SFS_INLINE_MAX < SFS_BLOCKSIZE);
 }
 
 /*
@@ -96,11 +102,12 @@ allocblock(uint32_t block)
 }
 
 /*
- * Initialize the free block bitmap.
+ * Initialize the free block bitmap. JDEVBLOCKS is the size of the
+ * journal device, if the journal is going on one.
  */
 static
 void
-initfreemap(uint32_t fsblocks)
+initfreemap(uint32_t fsblocks, uint32_t jdevblocks)
 {
 	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
 	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
@@ -120,15 +127,28 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
-	/* journal goes after the freemap */
-	journalstart = SFS_FREEMAP_START + freemapblocks;
-	journalblocks = fsblocks / 20;
-	for (i=0; i<journalblocks; i++) {
-		allocblock(journalstart + i);
+	if (extjournal) {
+		/*
+		 * The journal gets the whole journal device, but is
+		 * numbered as if it came after the volume.
+		 */
+		journalstart = fsblocks;
+		journalblocks = jdevblocks - SFS_JDEV_JOURNALSTART;
+
+		/* root directory contents go after the freemap */
+		rootdir_data_block = SFS_FREEMAP_START + freemapblocks;
 	}
+	else {
+		/* journal goes after the freemap */
+		journalstart = SFS_FREEMAP_START + freemapblocks;
+		journalblocks = fsblocks / 20;
+		for (i=0; i<journalblocks; i++) {
+			allocblock(journalstart + i);
+		}
 
-	/* allocate a block for the root directory contents */
-	rootdir_data_block = journalstart + journalblocks;
+		/* root directory contents go after the journal */
+		rootdir_data_block = journalstart + journalblocks;
+	}
 	allocblock(rootdir_data_block);
 
 	/* all blocks in the freemap but past the volume end are "in use" */
@@ -156,14 +176,39 @@ writesuper(const char *volname, uint32_t nblocks)
 	/* Initialize the superblock structure */
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
+	sb.sb_blocksize = SWAP32(SFS_BLOCKSIZE);
 	strcpy(sb.sb_volname, volname);
 	sb.sb_journalstart = SWAP32(journalstart);
 	sb.sb_journalblocks = SWAP32(journalblocks);
+	sb.sb_flags = SWAP32((extjournal ? SFS_SBF_EXTJOURNAL : 0) |
+			     (extents ? SFS_SBF_EXTENTS : 0) |
+			     (dirindex ? SFS_SBF_DIRINDEX : 0) |
+			     (inlinedata ? SFS_SBF_INLINE : 0));
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
 }
 
+/*
+ * Initialize and write out the header of a journal device.
+ */
+static
+void
+writejsuper(const char *volname)
+{
+	struct sfs_jsuperblock jsb;
+
+	assert(sizeof(jsb) == SFS_BLOCKSIZE);
+	bzero((void *)&jsb, sizeof(jsb));
+
+	jsb.jsb_magic = SWAP32(SFS_JMAGIC);
+	jsb.jsb_journalblocks = SWAP32(journalblocks);
+	jsb.jsb_blocksize = SWAP32(SFS_BLOCKSIZE);
+	strcpy(jsb.jsb_volname, volname);
+
+	diskwrite(&jsb, SFS_JSUPER_BLOCK);
+}
+
 /*
  * Write out the free block bitmap.
  */
@@ -172,15 +217,10 @@ void
 writefreemap(uint32_t fsblocks)
 {
 	uint32_t freemapblocks;
-	char *ptr;
-	uint32_t i;
 
-	/* Write out each of the blocks in the free block bitmap. */
+	/* The free block bitmap is contiguous; write it all at once. */
 	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
-	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
-		diskwrite(ptr, SFS_FREEMAP_START+i);
-	}
+	diskwritemany(freemapbuf, SFS_FREEMAP_START, freemapblocks);
 }
 
 /*
@@ -202,7 +242,16 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(sizeof(struct sfs_direntry) * 2);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(2);
-	sfi.sfi_direct[0] = SWAP32(rootdir_data_block);
+	if (extents) {
+		sfi.sfi_flags = SWAP32(SFS_DIF_EXTENTS);
+		sfi.sfi_nextents = SWAP32(1);
+		sfi.sfi_extents[0].sx_fileblock = SWAP32(0);
+		sfi.sfi_extents[0].sx_diskblock = SWAP32(rootdir_data_block);
+		sfi.sfi_extents[0].sx_len = SWAP32(1);
+	}
+	else {
+		sfi.sfi_direct[0] = SWAP32(rootdir_data_block);
+	}
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -218,24 +267,27 @@ writerootdir(void)
 }
 
 /*
- * Write out the journal.
+ * Write out the journal, starting at block START of the disk.
  */
 static
 void
-writejournal(void)
+writejournal(uint32_t start)
 {
 	char block[SFS_BLOCKSIZE];
 	struct sfs_jphys_header hdr;
 	struct sfs_jphys_trim rec;
 	uint64_t coninfo;
-	unsigned i;
 
 	bzero((void *)block, sizeof(block));
 
-	/* Zero all of the journal but the first block */
-	for (i=1; i<journalblocks; i++) {
-		diskwrite(block, journalstart + i);
-	}
+	/*
+	 * Zero all of the journal but the first block. The journal
+	 * scan at mount takes any block that isn't zero as holding
+	 * records, so leftovers from whatever was on the device before
+	 * can't be left there; but on a fresh (sparse) disk image this
+	 * writes nothing.
+	 */
+	diskzero(start + 1, journalblocks - 1);
 
 	/* and write a trim record into the first block */
 	coninfo = SFS_MKCONINFO(SFS_JPHYS_CONTAINER,
@@ -257,7 +309,7 @@ writejournal(void)
 	hdr.jh_coninfo = SWAP64(coninfo);
 	memcpy(block + sizeof(hdr) + sizeof(rec), &hdr, sizeof(hdr));
 
-	diskwrite(block, journalstart);
+	diskwrite(block, start);
 }
 
 /*
@@ -266,16 +318,42 @@ writejournal(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, jsize;
+	const char *jdisk;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
-	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+	/*
+	 * -e: map files with extents instead of indirect blocks
+	 * -i: index large directories
+	 * -s: store small files inline in their inodes
+	 */
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-e")) {
+			extents = true;
+		}
+		else if (!strcmp(argv[1], "-i")) {
+			dirindex = true;
+		}
+		else if (!strcmp(argv[1], "-s")) {
+			inlinedata = true;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (argc!=3 && argc!=4) {
+		errx(1, "Usage: mksfs [-e] [-i] [-s] device/diskfile "
+		     "volume-name [journal-device/diskfile]");
 	}
+	jdisk = argc == 4 ? argv[3] : NULL;
+	extjournal = jdisk != NULL;
 
 	check();
 
@@ -296,24 +374,42 @@ main(int argc, char **argv)
 		errx(1, "Illegal volume name %s", volname);
 	}
 
-	opendisk(argv[1]);
-	blocksize = diskblocksize();
-
-	if (blocksize!=SFS_BLOCKSIZE) {
-		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+	/* Size up the journal device first, if there is one */
+	jsize = 0;
+	if (extjournal) {
+		opendisk(jdisk);
+		disksetblocksize(SFS_BLOCKSIZE);
+		jsize = diskblocks();
+		if (jsize < SFS_JDEV_JOURNALSTART + 2) {
+			errx(1, "Journal device too small");
+		}
+		closedisk();
 	}
+
+	/* The disks count in sectors; make them count in our blocks */
+	opendisk(argv[1]);
+	disksetblocksize(SFS_BLOCKSIZE);
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
-	initfreemap(size);
+	initfreemap(size, jsize);
 	writesuper(volname, size);
 	writefreemap(size);
-    writejournal();
+	if (!extjournal) {
+		writejournal(journalstart);
+	}
 	writerootdir();
 
 	closedisk();
 
+	if (extjournal) {
+		opendisk(jdisk);
+		disksetblocksize(SFS_BLOCKSIZE);
+		writejsuper(volname);
+		writejournal(SFS_JDEV_JOURNALSTART);
+		closedisk();
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "disk.h"
+
+#include "utils.h"
+#include "cache.h"
+
+/*
+ * The cache holds CACHE_SLOTS clusters of CACHE_CLUSTER blocks each,
+ * a cluster being the aligned run that one disk read brings in.
+ * It's direct-mapped: cluster C can only go in slot C % CACHE_SLOTS.
+ * So a sequential stretch of the disk up to the cache size fits
+ * without collisions, and nothing needs a replacement policy.
+ */
+#define CACHE_CLUSTER	32
+#define CACHE_SLOTS	64
+
+struct cacheslot {
+	int cs_valid;			/* holds a cluster */
+	uint32_t cs_cluster;		/* which one */
+	char *cs_data;			/* CACHE_CLUSTER blocks */
+};
+
+static struct cacheslot slots[CACHE_SLOTS];
+static uint32_t blocksize, diskblks;
+
+/*
+ * Allocate the slots.
+ */
+void
+cache_setup(void)
+{
+	unsigned i;
+
+	blocksize = diskblocksize();
+	diskblks = diskblocks();
+	for (i=0; i<CACHE_SLOTS; i++) {
+		slots[i].cs_valid = 0;
+		slots[i].cs_cluster = 0;
+		slots[i].cs_data = domalloc(CACHE_CLUSTER * blocksize);
+	}
+}
+
+/*
+ * Return the slot that holds the cluster with BLOCK in it, reading
+ * the cluster in if it isn't there yet, and set *LOADED if it had to.
+ * The last cluster stops at the end of the disk.
+ */
+static
+struct cacheslot *
+cache_get(uint32_t block, int *loaded)
+{
+	struct cacheslot *cs;
+	uint32_t cluster, first, num;
+
+	cluster = block / CACHE_CLUSTER;
+	cs = &slots[cluster % CACHE_SLOTS];
+	if (cs->cs_valid && cs->cs_cluster == cluster) {
+		*loaded = 0;
+		return cs;
+	}
+
+	first = cluster * CACHE_CLUSTER;
+	num = diskblks - first;
+	if (num > CACHE_CLUSTER) {
+		num = CACHE_CLUSTER;
+	}
+	diskreadmany(cs->cs_data, first, num);
+	cs->cs_valid = 1;
+	cs->cs_cluster = cluster;
+	*loaded = 1;
+	return cs;
+}
+
+void
+cache_read(void *data, uint32_t block)
+{
+	struct cacheslot *cs;
+	int loaded;
+
+	if (block >= diskblks) {
+		/* let the disk code complain */
+		diskread(data, block);
+		return;
+	}
+	cs = cache_get(block, &loaded);
+	memcpy(data, cs->cs_data + (block % CACHE_CLUSTER) * blocksize,
+	       blocksize);
+}
+
+void
+cache_write(const void *data, uint32_t block)
+{
+	struct cacheslot *cs;
+	uint32_t cluster;
+
+	diskwrite(data, block);
+
+	cluster = block / CACHE_CLUSTER;
+	cs = &slots[cluster % CACHE_SLOTS];
+	if (cs->cs_valid && cs->cs_cluster == cluster) {
+		memcpy(cs->cs_data + (block % CACHE_CLUSTER) * blocksize,
+		       data, blocksize);
+	}
+}
+
+/*
+ * qsort comparison function for block numbers.
+ */
+static
+int
+block_compare(const void *av, const void *bv)
+{
+	uint32_t a = *(const uint32_t *)av;
+	uint32_t b = *(const uint32_t *)bv;
+
+	if (a < b) {
+		return -1;
+	}
+	if (a > b) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Sort the blocks and load their clusters in one pass up the disk.
+ * Stop after filling half the cache, so that (with the clusters
+ * direct-mapped) the later ones are less likely to push out the
+ * earlier ones before they're used.
+ */
+void
+cache_prefetch(uint32_t *blocks, unsigned n)
+{
+	unsigned i, numloaded;
+	int loaded;
+
+	qsort(blocks, n, sizeof(blocks[0]), block_compare);
+	numloaded = 0;
+	for (i=0; i<n && numloaded < CACHE_SLOTS/2; i++) {
+		if (blocks[i] >= diskblks) {
+			break;
+		}
+		(void)cache_get(blocks[i], &loaded);
+		numloaded += loaded;
+	}
+}
@@ -41,12 +41,17 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "journal.h"
 #include "main.h"
 
 static unsigned long blocksinuse = 0;
 static uint8_t *freemapdata;
 static uint8_t *tofreedata;
 
+/* for incremental checks: which freemap blocks we've found usage in */
+static uint8_t *touched;
+static int setupdone;
+
 /*
  * Allocate space to keep track of the free block bitmap. This is
  * called after the superblock is loaded so we can ask how big the
@@ -70,14 +75,18 @@ freemap_setup(void)
 	for (i=0; i<mapbytes; i++) {
 		freemapdata[i] = tofreedata[i] = 0;
 	}
+	touched = domalloc(mapblocks * sizeof(uint8_t));
+	for (i=0; i<mapblocks; i++) {
+		touched[i] = 0;
+	}
 
 	/* Mark off what's in the freemap but past the volume end. */
 	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK; i++) {
 		freemap_blockinuse(i, B_PASTEND, 0);
 	}
 
-	/* Mark off the blocks that are in the journal */
-	for (i=0; i<jblocks; i++) {
+	/* Mark off the blocks that are in the journal, if it's here */
+	for (i=0; !sb_extjournal() && i<jblocks; i++) {
 		freemap_blockinuse(jstart + i, B_JOURNAL, i);
 	}
 
@@ -86,6 +95,7 @@ freemap_setup(void)
 	for (i=0; i < mapblocks; i++) {
 		freemap_blockinuse(SFS_FREEMAP_START+i, B_FREEMAPBLOCK, i);
 	}
+	setupdone = 1;
 }
 
 /*
@@ -153,6 +163,9 @@ freemap_blockinuse(uint32_t block, blockusage_t how, uint32_t howdesc)
 	}
 
 	freemapdata[index] |= mask;
+	if (setupdone) {
+		touched[block / SFS_BITSPERBLOCK] = 1;
+	}
 
 	if (how != B_PASTEND) {
 		blocksinuse++;
@@ -185,6 +198,7 @@ freemap_blockfree(uint32_t block)
 		return;
 	}
 	tofreedata[index] |= mask;
+	touched[block / SFS_BITSPERBLOCK] = 1;
 }
 
 /*
@@ -311,6 +325,95 @@ freemap_check(void)
 	}
 }
 
+/*
+ * Check the freemap after an incremental pass 1.
+ *
+ * We've only seen the blocks of the inodes that changed, so a bit
+ * that's set on disk but not expected proves nothing; it's probably
+ * some file we didn't look at. So only look at the freemap blocks
+ * where we found something, set the bits for blocks we found in use,
+ * and clear only the ones we dropped ourselves. Blocks the journal
+ * says were allocated but that we didn't find in use may have leaked;
+ * those take a full check to sort out.
+ */
+void
+freemap_check_partial(void)
+{
+	uint8_t actual[SFS_BLOCKSIZE], *expected, *tofree, tmp;
+	uint32_t alloccount=0, leakcount=0, i, j, block;
+	int bchanged;
+	uint32_t bitblocks;
+
+	bitblocks = sb_freemapblocks();
+
+	for (i=0; i<bitblocks; i++) {
+		if (!touched[i]) {
+			continue;
+		}
+		sfs_readfreemapblock(i, actual);
+		expected = freemapdata + i*SFS_BLOCKSIZE;
+		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		bchanged = 0;
+
+		for (j=0; j<SFS_BLOCKSIZE; j++) {
+			assert((expected[j] & tofree[j])==0);
+
+			tmp = expected[j] & ~actual[j];
+			if (tmp != 0) {
+				alloccount += countbits(tmp);
+				reportfreemap(i, j, tmp, "free");
+			}
+			tmp = (actual[j] | expected[j]) & ~tofree[j];
+			if (tmp != actual[j]) {
+				actual[j] = tmp;
+				bchanged = 1;
+			}
+		}
+
+		if (bchanged) {
+			sfs_writefreemapblock(i, actual);
+		}
+	}
+
+	for (i=0; i<journal_numallocs(); i++) {
+		block = journal_alloc(i);
+		if (block >= sb_totalblocks()) {
+			continue;
+		}
+		if ((freemapdata[block/8] & (1 << (block%8))) == 0 &&
+		    freemap_ondisk(block)) {
+			leakcount++;
+		}
+	}
+
+	if (alloccount > 0) {
+		warnx("%lu blocks erroneously shown free in freemap (fixed)",
+		      (unsigned long) alloccount);
+		setbadness(EXIT_RECOV);
+	}
+	if (leakcount > 0) {
+		warnx("%lu blocks allocated since the last checkpoint not "
+		      "found in use (NOT FIXED; do a full check)",
+		      (unsigned long) leakcount);
+		setbadness(EXIT_UNRECOV);
+	}
+}
+
+/*
+ * Return whether block BLOCK is marked in use in the on-disk freemap.
+ */
+int
+freemap_ondisk(uint32_t block)
+{
+	uint8_t bits[SFS_BLOCKSIZE];
+	uint32_t bit;
+
+	assert(block < sb_totalblocks());
+	sfs_readfreemapblock(block / SFS_BITSPERBLOCK, bits);
+	bit = block % SFS_BITSPERBLOCK;
+	return (bits[bit/8] & (1 << (bit%8))) != 0;
+}
+
 /*
  * Return the total number of blocks in use, which we count during
  * pass 1.
@@ -61,6 +61,12 @@ void freemap_blockfree(uint32_t block);
 /* Call this after all checks that call freemap_block{inuse,free}. */
 void freemap_check(void);
 
+/* Or this instead, if only the inodes in the journal were checked. */
+void freemap_check_partial(void);
+
+/* Return whether a block is in use according to the on-disk freemap. */
+int freemap_ondisk(uint32_t block);
+
 /* Return the number of blocks in use. Valid after freemap_check(). */
 unsigned long freemap_blocksused(void);
 
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "utils.h"
+#include "cache.h"
+#include "sb.h"
+#include "journal.h"
+
+/*
+ * One client record. We keep the inode or block number of inode
+ * changes and freemap bit flips; file data and directory index
+ * records don't say whose blocks they're writing, so all we keep of
+ * them is that they're there.
+ */
+struct jrec {
+	uint64_t jr_lsn;
+	uint32_t jr_num;		/* inode or block number */
+	unsigned jr_type;		/* SFS_JREC_* */
+};
+
+static struct jrec *jrecs;
+static unsigned njrecs, maxjrecs;
+static unsigned nrecords;
+
+static uint32_t *inodes;
+static unsigned ninodes;
+static uint32_t *allocs;
+static unsigned nallocs;
+
+/*
+ * Remember a client record.
+ */
+static
+void
+addrec(uint64_t lsn, unsigned type, uint32_t num)
+{
+	unsigned newmax;
+
+	if (njrecs == maxjrecs) {
+		newmax = maxjrecs ? maxjrecs * 2 : 64;
+		jrecs = dorealloc(jrecs, maxjrecs * sizeof(jrecs[0]),
+				  newmax * sizeof(jrecs[0]));
+		maxjrecs = newmax;
+	}
+	jrecs[njrecs].jr_lsn = lsn;
+	jrecs[njrecs].jr_num = num;
+	jrecs[njrecs].jr_type = type;
+	njrecs++;
+}
+
+/*
+ * Look at one client record and remember it if it's one we want.
+ * Returns false if it's malformed.
+ */
+static
+bool
+clientrec(uint64_t lsn, unsigned type, const void *data, unsigned len)
+{
+	struct sfs_jrec_bitflip jbf;
+	struct sfs_jrec_dinode jd;
+
+	switch (type) {
+	    case SFS_JREC_BITSET:
+	    case SFS_JREC_BITCLEAR:
+		if (len < sizeof(jbf)) {
+			return false;
+		}
+		memcpy(&jbf, data, sizeof(jbf));
+		addrec(lsn, type, SWAP32(jbf.jbf_block));
+		break;
+	    case SFS_JREC_DINODE:
+		if (len < sizeof(jd)) {
+			return false;
+		}
+		memcpy(&jd, data, sizeof(jd));
+		addrec(lsn, type, SWAP32(jd.jd_ino));
+		break;
+	    default:
+		addrec(lsn, type, 0);
+		break;
+	}
+	return true;
+}
+
+/*
+ * Which group a record sorts into: inode changes, then bit flips,
+ * then everything else.
+ */
+static
+int
+jrec_group(const struct jrec *jr)
+{
+	switch (jr->jr_type) {
+	    case SFS_JREC_DINODE:
+		return 0;
+	    case SFS_JREC_BITSET:
+	    case SFS_JREC_BITCLEAR:
+		return 1;
+	}
+	return 2;
+}
+
+/*
+ * Sort records by group, then by number, then by LSN, so the last
+ * flip of each block is the last state of its freemap bit.
+ */
+static
+int
+jrec_compare(const void *av, const void *bv)
+{
+	const struct jrec *a = av;
+	const struct jrec *b = bv;
+	int ag, bg;
+
+	ag = jrec_group(a);
+	bg = jrec_group(b);
+	if (ag != bg) {
+		return ag < bg ? -1 : 1;
+	}
+	if (a->jr_num != b->jr_num) {
+		return a->jr_num < b->jr_num ? -1 : 1;
+	}
+	if (a->jr_lsn != b->jr_lsn) {
+		return a->jr_lsn < b->jr_lsn ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Boil the records between TAILLSN and HEADLSN down to the list of
+ * changed inodes and the list of blocks left allocated.
+ */
+static
+void
+collect(uint64_t taillsn, uint64_t headlsn)
+{
+	unsigned i, j;
+
+	j = 0;
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].jr_lsn >= taillsn && jrecs[i].jr_lsn < headlsn) {
+			jrecs[j++] = jrecs[i];
+		}
+	}
+	njrecs = j;
+	nrecords = njrecs;
+	qsort(jrecs, njrecs, sizeof(jrecs[0]), jrec_compare);
+
+	inodes = domalloc((njrecs + 1) * sizeof(inodes[0]));
+	allocs = domalloc((njrecs + 1) * sizeof(allocs[0]));
+	ninodes = nallocs = 0;
+	for (i=0; i<njrecs; i++) {
+		if (i + 1 < njrecs && jrec_group(&jrecs[i]) == 1 &&
+		    jrec_group(&jrecs[i+1]) == 1 &&
+		    jrecs[i+1].jr_num == jrecs[i].jr_num) {
+			/* not the last flip of this block */
+			continue;
+		}
+		switch (jrecs[i].jr_type) {
+		    case SFS_JREC_DINODE:
+			if (ninodes == 0 ||
+			    inodes[ninodes-1] != jrecs[i].jr_num) {
+				inodes[ninodes++] = jrecs[i].jr_num;
+			}
+			break;
+		    case SFS_JREC_BITSET:
+			allocs[nallocs++] = jrecs[i].jr_num;
+			break;
+		}
+	}
+
+	free(jrecs);
+	jrecs = NULL;
+	njrecs = maxjrecs = 0;
+}
+
+////////////////////////////////////////////////////////////
+// public interface
+
+/*
+ * Scan the journal. This is the same walk dumpsfs does to find the
+ * head and tail: the head is where the LSNs stop increasing (or the
+ * journal stops being used), and the tail comes from the newest trim
+ * record, which is the last one before the head if there is one and
+ * otherwise the last one in the wrapped-around older part. With no
+ * trim record at all, the whole journal is live.
+ *
+ * Unlike dumpsfs we read each block only once and keep the records
+ * we want, then drop the ones before the tail afterwards.
+ */
+bool
+journal_scan(void)
+{
+	uint8_t buf[SFS_BLOCKSIZE];
+	struct sfs_jphys_header jh;
+	struct sfs_jphys_trim jt;
+	uint32_t jstart, jblocks, block;
+	unsigned offset, len;
+	uint64_t ci, lsn;
+	uint64_t veryfirstlsn, prevlsn, headlsn, smallestlsn, taillsn;
+	uint64_t bh_taillsn, eoj_taillsn;
+
+	if (sb_extjournal()) {
+		warnx("Journal is on another device");
+		return false;
+	}
+	jstart = sb_journalstart();
+	jblocks = sb_journalblocks();
+
+	veryfirstlsn = prevlsn = headlsn = smallestlsn = 0;
+	bh_taillsn = eoj_taillsn = 0;
+
+	for (block=0; block<jblocks; block++) {
+		cache_read(buf, jstart + block);
+		offset = 0;
+		while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
+			memcpy(&jh, buf + offset, sizeof(jh));
+			ci = SWAP64(jh.jh_coninfo);
+			if (ci == 0) {
+				if (offset != 0) {
+					warnx("At %u[%u] in journal: "
+					      "zero header", block, offset);
+					goto fail;
+				}
+				/* block hasn't been used yet */
+				if (headlsn == 0) {
+					headlsn = prevlsn + 1;
+				}
+				break;
+			}
+			lsn = SFS_CONINFO_LSN(ci);
+			len = SFS_CONINFO_LEN(ci);
+
+			if (len < sizeof(jh) || offset + len > SFS_BLOCKSIZE) {
+				warnx("At %u[%u] in journal: "
+				      "bad record length %u",
+				      block, offset, len);
+				goto fail;
+			}
+
+			if (block == 0 && offset == 0) {
+				veryfirstlsn = lsn;
+			}
+			else if (block > 0 && offset == 0 && lsn < prevlsn) {
+				if (lsn > veryfirstlsn || headlsn != 0) {
+					warnx("At %u[%u] in journal: "
+					      "duplicate lsn %llu",
+					      block, offset,
+					      (unsigned long long)lsn);
+					goto fail;
+				}
+				smallestlsn = lsn;
+				headlsn = prevlsn + 1;
+			}
+			else if (lsn != prevlsn + 1) {
+				warnx("At %u[%u] in journal: "
+				      "discontiguous lsn %llu, after %llu",
+				      block, offset,
+				      (unsigned long long)lsn,
+				      (unsigned long long)prevlsn);
+				goto fail;
+			}
+
+			if (SFS_CONINFO_CLASS(ci) == SFS_JPHYS_CONTAINER) {
+				if (SFS_CONINFO_TYPE(ci) == SFS_JPHYS_TRIM) {
+					if (len != sizeof(jh) + sizeof(jt)) {
+						warnx("At %u[%u] in journal: "
+						      "bad trim record size "
+						      "%u", block, offset,
+						      len);
+						goto fail;
+					}
+					memcpy(&jt, buf + offset + sizeof(jh),
+					       sizeof(jt));
+					if (headlsn == 0) {
+						bh_taillsn =
+							SWAP64(jt.jt_taillsn);
+					}
+					else {
+						eoj_taillsn =
+							SWAP64(jt.jt_taillsn);
+					}
+				}
+			}
+			else {
+				if (!clientrec(lsn, SFS_CONINFO_TYPE(ci),
+					       buf + offset + sizeof(jh),
+					       len - sizeof(jh))) {
+					warnx("At %u[%u] in journal: "
+					      "runt record (length %u)",
+					      block, offset, len);
+					goto fail;
+				}
+			}
+
+			prevlsn = lsn;
+			offset += len;
+		}
+	}
+	if (headlsn == 0) {
+		/* every block used and never wrapped */
+		headlsn = prevlsn + 1;
+	}
+
+	if (bh_taillsn != 0) {
+		taillsn = bh_taillsn;
+	}
+	else if (eoj_taillsn != 0) {
+		taillsn = eoj_taillsn;
+	}
+	else if (smallestlsn != 0) {
+		taillsn = smallestlsn;
+	}
+	else {
+		taillsn = veryfirstlsn;
+	}
+	if (taillsn > headlsn) {
+		warnx("Journal tail lsn %llu is past the head lsn %llu",
+		      (unsigned long long)taillsn,
+		      (unsigned long long)headlsn);
+		goto fail;
+	}
+
+	collect(taillsn, headlsn);
+	return true;
+
+ fail:
+	free(jrecs);
+	jrecs = NULL;
+	njrecs = maxjrecs = 0;
+	return false;
+}
+
+unsigned
+journal_numinodes(void)
+{
+	return ninodes;
+}
+
+uint32_t
+journal_inode(unsigned index)
+{
+	return inodes[index];
+}
+
+unsigned
+journal_numallocs(void)
+{
+	return nallocs;
+}
+
+uint32_t
+journal_alloc(unsigned index)
+{
+	return allocs[index];
+}
+
+unsigned
+journal_numrecords(void)
+{
+	return nrecords;
+}
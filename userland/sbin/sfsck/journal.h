@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The journal module reads the on-disk journal so an incremental
+ * check can look only at what changed since the last checkpoint:
+ * the inodes named by inode records and the blocks whose freemap
+ * bits flipped. Everything before the checkpoint's tail LSN was
+ * already on disk when the checkpoint was taken and doesn't need
+ * looking at again.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Scan the journal from the tail to the head. Returns false if the
+ * journal can't be used (it's on another device, or damaged), in
+ * which case the caller should fall back to a full check. Call after
+ * the superblock has been checked.
+ */
+bool journal_scan(void);
+
+/* After journal_scan: the inodes changed since the last checkpoint. */
+unsigned journal_numinodes(void);
+uint32_t journal_inode(unsigned index);
+
+/* After journal_scan: the blocks allocated since the last checkpoint. */
+unsigned journal_numallocs(void);
+uint32_t journal_alloc(unsigned index);
+
+/* After journal_scan: the number of records since the last checkpoint. */
+unsigned journal_numrecords(void);
+
+#endif /* JOURNAL_H */
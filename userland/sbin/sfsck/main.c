@@ -30,15 +30,18 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "compat.h"
 
 #include "disk.h"
+#include "cache.h"
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
 #include "inode.h"
+#include "journal.h"
 #include "passes.h"
 #include "main.h"
 
@@ -64,22 +67,60 @@ setbadness(int code)
 int
 main(int argc, char **argv)
 {
+	int incremental = 0;
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
 	/* FUTURE: add -n option */
+	if (argc==3 && !strcmp(argv[1], "-i")) {
+		incremental = 1;
+		argc--;
+		argv++;
+	}
 	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+		errx(EXIT_USAGE, "Usage: sfsck [-i] device/diskfile");
 	}
 
 	opendisk(argv[1]);
+	disksetblocksize(SFS_BLOCKSIZE);
+	cache_setup();
 
 	sfs_setup();
 	sb_load();
 	sb_check();
 	freemap_setup();
 
+	/*
+	 * With -i, check only what the journal says changed since the
+	 * last checkpoint; everything older was already on disk then.
+	 * This misses anything that went wrong outside the journal,
+	 * and doesn't check the directory tree or link counts, so if
+	 * in doubt do a full check.
+	 */
+	if (incremental && sb_isclean()) {
+		closedisk();
+		warnx("Volume was unmounted cleanly; nothing to check");
+		goto done;
+	}
+	if (incremental && journal_scan()) {
+		printf("Phase 1 -- check inodes changed since the last "
+		       "checkpoint\n");
+		pass1_incremental();
+		freemap_check_partial();
+
+		closedisk();
+
+		warnx("%u journal records; %lu directories; %lu files",
+		      journal_numrecords(),
+		      pass1_founddirs(), pass1_foundfiles());
+		goto done;
+	}
+	if (incremental) {
+		warnx("Cannot use the journal; doing a full check");
+	}
+
 	printf("Phase 1 -- check blocks and sizes\n");
 	pass1();
 	freemap_check();
@@ -97,6 +138,7 @@ main(int argc, char **argv)
 	      freemap_blocksused(), (unsigned long)sb_totalblocks(),
 	      pass1_founddirs(), pass1_foundfiles());
 
+ done:
 	switch (badness) {
 	    case EXIT_USAGE:
 	    case EXIT_FATAL:
@@ -38,12 +38,14 @@
 #include <kern/sfs.h>
 
 #include "disk.h"
+#include "cache.h"
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
 #include "inode.h"
+#include "journal.h"
 #include "passes.h"
 #include "main.h"
 
@@ -172,6 +174,186 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 }
 
+/*
+ * Check one extent X of inode INO. LASTEND is the file block after
+ * the end of the previous extent. Problems with extents are not
+ * fixed. Unwritten extents (SFS_XUNWRITTEN) own their blocks like
+ * any others.
+ */
+static
+void
+check_extent(struct ibstate *ibs, const struct sfs_extent *x,
+	     uint32_t *lastend)
+{
+	uint32_t j, len;
+
+	len = SFS_XLEN(x);
+	if (len == 0 || x->sx_fileblock < *lastend ||
+	    x->sx_fileblock + len < x->sx_fileblock) {
+		setbadness(EXIT_UNRECOV);
+		warnx("Inode %lu: bad extent at file block %lu "
+		      "(NOT FIXED)", (unsigned long)ibs->ino,
+		      (unsigned long)x->sx_fileblock);
+		return;
+	}
+	if (x->sx_diskblock == 0 || x->sx_diskblock >= ibs->volblocks ||
+	    len > ibs->volblocks - x->sx_diskblock) {
+		setbadness(EXIT_UNRECOV);
+		warnx("Inode %lu: extent at file block %lu outside of "
+		      "volume: %lu+%lu (NOT FIXED)", (unsigned long)ibs->ino,
+		      (unsigned long)x->sx_fileblock,
+		      (unsigned long)x->sx_diskblock,
+		      (unsigned long)len);
+		return;
+	}
+	for (j=0; j<len; j++) {
+		if (x->sx_fileblock + j >= ibs->fileblocks) {
+			ibs->pasteofcount++;
+		}
+		freemap_blockinuse(x->sx_diskblock + j, ibs->usagetype,
+				   ibs->ino);
+	}
+	*lastend = x->sx_fileblock + len;
+}
+
+/*
+ * Check the blocks of an extent-mapped inode; the extent version of
+ * check_inode_blocks.
+ */
+static
+int
+check_inode_extents(struct ibstate *ibs, struct sfs_dinode *sfi)
+{
+	struct sfs_extblock xb;
+	uint32_t i, n, num, block, lastend;
+	int changed = 0;
+
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			break;
+		}
+	}
+	if (i < NUM_D || GET_I(sfi, 0) != 0 || GET_II(sfi, 0) != 0 ||
+	    GET_III(sfi, 0) != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: extent-mapped but has block pointers "
+		      "(cleared)", (unsigned long)ibs->ino);
+		for (i=0; i<NUM_D; i++) {
+			SET_D(sfi, i) = 0;
+		}
+		SET_I(sfi, 0) = SET_II(sfi, 0) = SET_III(sfi, 0) = 0;
+		changed = 1;
+	}
+
+	n = sfi->sfi_nextents;
+	lastend = 0;
+	for (i=0; i<n && i<SFS_NIEXTENTS; i++) {
+		check_extent(ibs, &sfi->sfi_extents[i], &lastend);
+	}
+
+	block = sfi->sfi_extblock;
+	while (block != 0) {
+		if (block >= ibs->volblocks) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Inode %lu: extent block outside of volume: "
+			      "%lu (NOT FIXED)", (unsigned long)ibs->ino,
+			      (unsigned long)block);
+			break;
+		}
+		freemap_blockinuse(block, B_IBLOCK, ibs->ino);
+		sfs_readextblock(block, &xb);
+		num = n > i ? n - i : 0;
+		if (num > SFS_EXTPERBLOCK) {
+			num = SFS_EXTPERBLOCK;
+		}
+		if (xb.sxb_num != num) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Inode %lu: extent block %lu has %lu extents, "
+			      "should be %lu (NOT FIXED)",
+			      (unsigned long)ibs->ino, (unsigned long)block,
+			      (unsigned long)xb.sxb_num,
+			      (unsigned long)num);
+		}
+		for (num=0; num<SFS_EXTPERBLOCK && i<n; num++, i++) {
+			check_extent(ibs, &xb.sxb_extents[num], &lastend);
+		}
+		block = xb.sxb_next;
+	}
+	if (i < n) {
+		setbadness(EXIT_UNRECOV);
+		warnx("Inode %lu: %lu extents missing (NOT FIXED)",
+		      (unsigned long)ibs->ino, (unsigned long)(n - i));
+	}
+
+	if (ibs->pasteofcount > 0) {
+		warnx("Inode %lu: %u blocks after EOF (NOT FIXED)",
+		     (unsigned long) ibs->ino, ibs->pasteofcount);
+		setbadness(EXIT_UNRECOV);
+	}
+
+	return changed;
+}
+
+/*
+ * Check an inline file (SFS_DIF_INLINE), loaded into SFI. It has no
+ * blocks to mark in use; just make sure it's a regular file of a
+ * size that fits, with no block pointers or extents.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	int changed = 0;
+	int i;
+
+	if (isdir) {
+		setbadness(EXIT_UNRECOV);
+		warnx("Inode %lu: directory marked inline (NOT FIXED)",
+		      (unsigned long)ino);
+		return 0;
+	}
+
+	if (sfi->sfi_size > SFS_INLINE_MAX) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: inline file too large: %lu bytes "
+		      "(truncated)", (unsigned long)ino,
+		      (unsigned long)sfi->sfi_size);
+		sfi->sfi_size = SFS_INLINE_MAX;
+		changed = 1;
+	}
+
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			break;
+		}
+	}
+	if (i < NUM_D || GET_I(sfi, 0) != 0 || GET_II(sfi, 0) != 0 ||
+	    GET_III(sfi, 0) != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: inline but has block pointers (cleared)",
+		      (unsigned long)ino);
+		for (i=0; i<NUM_D; i++) {
+			SET_D(sfi, i) = 0;
+		}
+		SET_I(sfi, 0) = SET_II(sfi, 0) = SET_III(sfi, 0) = 0;
+		changed = 1;
+	}
+
+	if (sfi->sfi_nextents != 0 || sfi->sfi_extblock != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: inline but has extents (cleared)",
+		      (unsigned long)ino);
+		sfi->sfi_nextents = 0;
+		sfi->sfi_extblock = 0;
+		changed = 1;
+	}
+
+	return changed;
+}
+
 /*
  * Check the blocks belonging to inode INO, whose inode has already
  * been loaded into SFI. ISDIR is a shortcut telling us if the inode
@@ -198,6 +380,13 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
 
+	if (sfi->sfi_flags & SFS_DIF_INLINE) {
+		return check_inode_inline(ino, sfi, isdir);
+	}
+	if (sfi->sfi_flags & SFS_DIF_EXTENTS) {
+		return check_inode_extents(&ibs, sfi);
+	}
+
 	changed = 0;
 
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
@@ -247,6 +436,57 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Discard the hash index of inode INO (loaded into SFI), if it has
+ * one. We don't check directory indexes; we might change the
+ * directory anyway, and the kernel builds a new index when it needs
+ * one. So just mark the blocks to be freed. (If any of them turn out
+ * to be in use elsewhere, that use wins.)
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+drop_dirindex(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	uint32_t root[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t bucket[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t volblocks, block, count;
+	unsigned i;
+
+	if (sfi->sfi_dirindex == 0) {
+		return 0;
+	}
+	if (!isdir) {
+		warnx("Inode %lu: file has a directory index (cleared)",
+		      (unsigned long)ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	volblocks = sb_totalblocks();
+	if (sfi->sfi_dirindex < volblocks) {
+		freemap_blockfree(sfi->sfi_dirindex);
+		/* the root and bucket blocks are all 32-bit words */
+		sfs_readindirect(sfi->sfi_dirindex, root);
+		for (i=0; i<SFS_DIRINDEX_NBUCKETS; i++) {
+			/* count guards against loops */
+			block = root[i];
+			count = 0;
+			while (block != 0 && block < volblocks &&
+			       count++ < volblocks) {
+				freemap_blockfree(block);
+				sfs_readindirect(block, bucket);
+				block = bucket[0];	/* sdb_next */
+			}
+		}
+	}
+	sfi->sfi_dirindex = 0;
+	return 1;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -277,6 +517,10 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (drop_dirindex(ino, sfi, isdir)) {
+		changed = 1;
+	}
+
 	if (check_inode_blocks(ino, sfi, isdir)) {
 		changed = 1;
 	}
@@ -352,16 +596,19 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 
 /*
  * Check a directory. INO is the inode number; PATHSOFAR is the path
- * to this directory. This traverses the volume directory tree
- * recursively.
+ * to this directory. If RECURSE is set, this traverses the volume
+ * directory tree recursively; otherwise it checks that the entries
+ * name files or directories but doesn't check those.
  */
 static
 void
-pass1_dir(uint32_t ino, const char *pathsofar)
+pass1_dir(uint32_t ino, const char *pathsofar, int recurse)
 {
 	struct sfs_dinode sfi;
 	struct sfs_direntry *direntries;
 	uint32_t ndirentries, i;
+	uint32_t *subinos;
+	unsigned nsubinos;
 	int ichanged=0, dchanged=0;
 
 	sfs_readinode(ino, &sfi);
@@ -386,12 +633,21 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 
 	sfs_readdir(&sfi, direntries, ndirentries);
 
+	subinos = domalloc(ndirentries * sizeof(subinos[0]));
+	nsubinos = 0;
 	for (i=0; i<ndirentries; i++) {
 		if (pass1_direntry(pathsofar, i, &direntries[i])) {
 			dchanged = 1;
 		}
+		if (direntries[i].sfd_ino != SFS_NOINO) {
+			subinos[nsubinos++] = direntries[i].sfd_ino;
+		}
 	}
 
+	/* Read the inodes we're about to check in disk order. */
+	cache_prefetch(subinos, nsubinos);
+	free(subinos);
+
 	for (i=0; i<ndirentries; i++) {
 		if (direntries[i].sfd_ino == SFS_NOINO) {
 			/* nothing */
@@ -414,6 +670,9 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 
 			switch (subsfi.sfi_type) {
 			    case SFS_TYPE_FILE:
+				if (!recurse) {
+					break;
+				}
 				if (pass1_inode(subino, &subsfi, 0)) {
 					/* been here before */
 					break;
@@ -421,7 +680,9 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 				count_files++;
 				break;
 			    case SFS_TYPE_DIR:
-				pass1_dir(subino, path);
+				if (recurse) {
+					pass1_dir(subino, path, 1);
+				}
 				break;
 			    default:
 				setbadness(EXIT_RECOV);
@@ -471,7 +732,48 @@ pass1_rootdir(void)
 	}
 
 	snprintf(path, sizeof(path), "%s:", sb_volname());
-	pass1_dir(SFS_ROOTDIR_INO, path);
+	pass1_dir(SFS_ROOTDIR_INO, path, 1);
+}
+
+/*
+ * Check one inode named in the journal. It may since have been freed,
+ * or freed and its block reused for something else, in which case
+ * there's nothing to check. Otherwise check it as pass 1 would when
+ * reaching it, except that directories aren't traversed.
+ */
+static
+void
+pass1_changed(uint32_t ino)
+{
+	struct sfs_dinode sfi;
+	char path[32];
+
+	if (ino >= sb_totalblocks() || ino < SFS_ROOTDIR_INO) {
+		warnx("Journal names invalid inode %lu (ignored)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		return;
+	}
+	if (!freemap_ondisk(ino)) {
+		return;
+	}
+	sfs_readinode(ino, &sfi);
+
+	switch (sfi.sfi_type) {
+	    case SFS_TYPE_FILE:
+		if (pass1_inode(ino, &sfi, 0) == 0) {
+			count_files++;
+		}
+		break;
+	    case SFS_TYPE_DIR:
+		snprintf(path, sizeof(path), "(inode %lu)",
+			 (unsigned long) ino);
+		pass1_dir(ino, path, 0);
+		break;
+	    default:
+		/* not an inode any more */
+		break;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -483,6 +785,26 @@ pass1(void)
 	pass1_rootdir();
 }
 
+void
+pass1_incremental(void)
+{
+	unsigned i, n;
+	uint32_t *inos;
+
+	/* Read the inodes in disk order. */
+	n = journal_numinodes();
+	inos = domalloc((n + 1) * sizeof(inos[0]));
+	for (i=0; i<n; i++) {
+		inos[i] = journal_inode(i);
+	}
+	cache_prefetch(inos, n);
+	free(inos);
+
+	for (i=0; i<n; i++) {
+		pass1_changed(journal_inode(i));
+	}
+}
+
 unsigned long
 pass1_founddirs(void)
 {
@@ -39,9 +39,13 @@
  * checking for crosslinked and malformed directories and accumulating
  * link count information. Because it runs after we've fixed the free
  * block bitmap, we can (cautiously) allocate blocks if we need to.
+ *
+ * For an incremental check there's only pass 1, on just the inodes
+ * the journal says changed since the last checkpoint.
  */
 
 void pass1(void);
+void pass1_incremental(void);
 void pass2(void);
 
 /* After pass1 is done, return the number of dirs and files on the volume. */
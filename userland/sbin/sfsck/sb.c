@@ -50,10 +50,18 @@ static struct sfs_superblock sb;
 void
 sb_load(void)
 {
+	uint32_t blocksize;
+
 	sfs_readsb(SFS_SUPER_BLOCK, &sb);
 	if (sb.sb_magic != SFS_MAGIC) {
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
+	/* 0 is from before the block size was recorded, and means 512 */
+	blocksize = sb.sb_blocksize == 0 ? 512 : sb.sb_blocksize;
+	if (blocksize != SFS_BLOCKSIZE) {
+		errx(EXIT_FATAL, "Volume has %lu-byte blocks; sfsck was "
+		     "built for %u", (unsigned long)blocksize, SFS_BLOCKSIZE);
+	}
 
 	assert(sb.sb_nblocks > 0);
 	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
@@ -83,20 +91,42 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
-	if (sb.sb_journalstart <
+	if (sb.sb_flags & ~(uint32_t)SFS_SBF_ALL) {
+		warnx("Unknown superblock flags 0x%lx (NOT FIXED)",
+		      (unsigned long)sb.sb_flags);
+		setbadness(EXIT_UNRECOV);
+	}
+	if (sb_extjournal()) {
+		/* The journal is on its own device; we don't check it. */
+		if (sb.sb_journalstart != sb.sb_nblocks) {
+			warnx("External journal start %lu is not the volume "
+			      "size (NOT FIXED)",
+			      (unsigned long)sb.sb_journalstart);
+			setbadness(EXIT_UNRECOV);
+		}
+	}
+	else if (sb.sb_journalstart <
 	    SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb.sb_nblocks)) {
 		warnx("Journal begins at illegal block %lu (NOT FIXED)",
 		      (unsigned long)sb.sb_journalstart);
 		setbadness(EXIT_UNRECOV);
 	}
-	if (sb.sb_journalstart + sb.sb_journalblocks < sb.sb_journalstart) {
+	else if (sb.sb_journalstart + sb.sb_journalblocks <
+		 sb.sb_journalstart) {
 		warnx("Journal extends past block 0xffffffff (NOT FIXED)");
 		setbadness(EXIT_UNRECOV);
 	}
-	if (sb.sb_journalstart + sb.sb_journalblocks >= sb.sb_nblocks) {
+	else if (sb.sb_journalstart + sb.sb_journalblocks >= sb.sb_nblocks) {
 		warnx("Journal extends past volume end (NOT FIXED)");
 		setbadness(EXIT_UNRECOV);
 	}
+	if (sb.sb_clean != 0 && sb.sb_clean != SFS_SB_CLEAN) {
+		warnx("Invalid clean-unmount marker 0x%lx (fixed)",
+		      (unsigned long)sb.sb_clean);
+		setbadness(EXIT_RECOV);
+		sb.sb_clean = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -154,3 +184,21 @@ sb_journalblocks(void)
 {
 	return sb.sb_journalblocks;
 }
+
+/*
+ * Return whether the journal is on a separate device.
+ */
+bool
+sb_extjournal(void)
+{
+	return (sb.sb_flags & SFS_SBF_EXTJOURNAL) != 0;
+}
+
+/*
+ * Return whether the volume was last unmounted cleanly.
+ */
+bool
+sb_isclean(void)
+{
+	return sb.sb_clean == SFS_SB_CLEAN;
+}
@@ -35,6 +35,7 @@
  * information from the superblock to other modules.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Load the superblock. Should be done before virtually anything else. */
@@ -52,6 +53,10 @@ const char *sb_volname(void);
 /* After the superblock is loaded: return journal info. */
 uint32_t sb_journalstart(void);
 uint32_t sb_journalblocks(void);
+bool sb_extjournal(void);
+
+/* After the superblock is checked: return whether it was unmounted cleanly. */
+bool sb_isclean(void);
 
 /* Check the superblock. Must load it first. */
 void sb_check(void);
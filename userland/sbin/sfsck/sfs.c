@@ -36,7 +36,7 @@
 #include "compat.h"
 #include <kern/sfs.h>
 
-#include "disk.h"
+#include "cache.h"
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
@@ -64,6 +64,13 @@ swapsb(struct sfs_superblock *sb)
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
 	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
 	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_flags = SWAP32(sb->sb_flags);
+	sb->sb_clean = SWAP32(sb->sb_clean);
+	sb->sb_cleanheadlsn = SWAP64(sb->sb_cleanheadlsn);
+	sb->sb_cleantaillsn = SWAP64(sb->sb_cleantaillsn);
+	sb->sb_cleanheadjblock = SWAP32(sb->sb_cleanheadjblock);
+	sb->sb_cleantailjblock = SWAP32(sb->sb_cleantailjblock);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
 }
 
 static
@@ -74,6 +81,28 @@ swapbits(uint8_t *bits)
 	(void)bits;
 }
 
+static
+void
+swapextent(struct sfs_extent *x)
+{
+	x->sx_fileblock = SWAP32(x->sx_fileblock);
+	x->sx_diskblock = SWAP32(x->sx_diskblock);
+	x->sx_len = SWAP32(x->sx_len);
+}
+
+static
+void
+swapextblock(struct sfs_extblock *xb)
+{
+	unsigned i;
+
+	xb->sxb_next = SWAP32(xb->sxb_next);
+	xb->sxb_num = SWAP32(xb->sxb_num);
+	for (i=0; i<SFS_EXTPERBLOCK; i++) {
+		swapextent(&xb->sxb_extents[i]);
+	}
+}
+
 static
 void
 swapinode(struct sfs_dinode *sfi)
@@ -99,6 +128,19 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+	sfi->sfi_nextents = SWAP32(sfi->sfi_nextents);
+	sfi->sfi_extblock = SWAP32(sfi->sfi_extblock);
+	/*
+	 * This also swaps an inline file's data around, but as it's
+	 * swapped back on the way out and never looked at, it's
+	 * harmless.
+	 */
+	for (i=0; i<SFS_NIEXTENTS; i++) {
+		swapextent(&sfi->sfi_extents[i]);
+	}
+	sfi->sfi_dirindex = SWAP32(sfi->sfi_dirindex);
 }
 
 static
@@ -140,7 +182,7 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 		return 0;
 	}
 
-	diskread(entries, iblock);
+	cache_read(entries, iblock);
 	swapindir(entries);
 
 	if (entrysize > 1) {
@@ -154,6 +196,48 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	}
 }
 
+/*
+ * Extent bmap: look for the extent containing FILEBLOCK.
+ */
+static
+uint32_t
+xbmap(const struct sfs_dinode *sfi, uint32_t fileblock)
+{
+	struct sfs_extblock xb;
+	const struct sfs_extent *x;
+	uint32_t i, n, block;
+
+	n = sfi->sfi_nextents;
+	block = sfi->sfi_extblock;
+	for (i=0; i<n; i++) {
+		if (i < SFS_NIEXTENTS) {
+			x = &sfi->sfi_extents[i];
+		}
+		else {
+			if ((i - SFS_NIEXTENTS) % SFS_EXTPERBLOCK == 0) {
+				if (block == 0) {
+					return 0;
+				}
+				sfs_readextblock(block, &xb);
+				block = xb.sxb_next;
+			}
+			x = &xb.sxb_extents[(i - SFS_NIEXTENTS) %
+					    SFS_EXTPERBLOCK];
+		}
+		if (fileblock < x->sx_fileblock) {
+			return 0;
+		}
+		if (fileblock - x->sx_fileblock < SFS_XLEN(x)) {
+			if (x->sx_len & SFS_XUNWRITTEN) {
+				/* reads as zeros */
+				return 0;
+			}
+			return x->sx_diskblock + (fileblock - x->sx_fileblock);
+		}
+	}
+	return 0;
+}
+
 /*
  * bmap() for SFS.
  *
@@ -165,6 +249,10 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
 
+	if (sfi->sfi_flags & SFS_DIF_EXTENTS) {
+		return xbmap(sfi, fileblock);
+	}
+
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
 	}
@@ -196,7 +284,7 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	cache_read(sb, blocknum);
 	swapsb(sb);
 }
 
@@ -204,7 +292,7 @@ void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	cache_write(sb, blocknum);
 	swapsb(sb);
 }
 
@@ -216,7 +304,7 @@ sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 void
 sfs_readfreemapblock(uint32_t whichblock, uint8_t *bits)
 {
-	diskread(bits, SFS_FREEMAP_START + whichblock);
+	cache_read(bits, SFS_FREEMAP_START + whichblock);
 	swapbits(bits);
 }
 
@@ -224,7 +312,7 @@ void
 sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 {
 	swapbits(bits);
-	diskwrite(bits, SFS_FREEMAP_START + whichblock);
+	cache_write(bits, SFS_FREEMAP_START + whichblock);
 	swapbits(bits);
 }
 
@@ -235,7 +323,7 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	cache_read(sfi, ino);
 	swapinode(sfi);
 }
 
@@ -243,7 +331,7 @@ void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	cache_write(sfi, ino);
 	swapinode(sfi);
 }
 
@@ -254,7 +342,7 @@ sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 void
 sfs_readindirect(uint32_t blocknum, uint32_t *entries)
 {
-	diskread(entries, blocknum);
+	cache_read(entries, blocknum);
 	swapindir(entries);
 }
 
@@ -262,10 +350,21 @@ void
 sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 {
 	swapindir(entries);
-	diskwrite(entries, blocknum);
+	cache_write(entries, blocknum);
 	swapindir(entries);
 }
 
+/*
+ *  extent blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readextblock(uint32_t blocknum, struct sfs_extblock *xb)
+{
+	cache_read(xb, blocknum);
+	swapextblock(xb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -280,7 +379,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	unsigned j;
 
 	if (diskblock != 0) {
-		diskread(d, diskblock);
+		cache_read(d, diskblock);
 		for (j=0; j<atonce; j++) {
 			swapdir(&d[j]);
 		}
@@ -339,7 +438,7 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 		for (j=0; j<atonce; j++) {
 			swapdir(&d[j]);
 		}
-		diskwrite(d, diskblock);
+		cache_write(d, diskblock);
 	}
 	else {
 		for (j=bad=0; j<atonce; j++) {
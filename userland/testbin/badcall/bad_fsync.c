@@ -28,7 +28,7 @@
  */
 
 /*
- * fsync
+ * fsync, fdatasync
  */
 
 #include "test.h"
@@ -37,5 +37,6 @@ void
 test_fsync(void)
 {
 	test_fsync_fd();
+	test_fdatasync_fd();
 }
 
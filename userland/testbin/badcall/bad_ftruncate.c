@@ -28,7 +28,7 @@
  */
 
 /*
- * ftruncate
+ * ftruncate, fallocate
  */
 
 #include <sys/types.h>
@@ -85,6 +85,27 @@ ftruncate_size_neg(void)
 	remove(TESTFILE);
 }
 
+static
+void
+fallocate_badrange(off_t pos, off_t len, const char *desc)
+{
+	int rv, fd;
+
+	report_begin("fallocate with %s", desc);
+
+	fd = open_testfile(NULL);
+	if (fd<0) {
+		report_aborted();
+		return;
+	}
+
+	rv = fallocate(fd, pos, len);
+	report_check(rv, errno, EINVAL);
+
+	close(fd);
+	remove(TESTFILE);
+}
+
 void
 test_ftruncate(void)
 {
@@ -92,4 +113,10 @@ test_ftruncate(void)
 
 	ftruncate_fd_device();
 	ftruncate_size_neg();
+
+	test_fallocate_fd();
+
+	fallocate_badrange(-60, 60, "negative offset");
+	fallocate_badrange(0, 0, "zero length");
+	fallocate_badrange(0, -60, "negative length");
 }
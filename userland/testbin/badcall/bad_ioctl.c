@@ -68,10 +68,10 @@ void
 ioctl_badbuf(void)
 {
 	/*
-	 * Since we don't actually define any ioctls, this code won't
-	 * actually run. But if you do define ioctls, turn these tests
-	 * on for those that actually use the data buffer argument for
-	 * anything.
+	 * Turn these tests on for ioctls that actually use the data
+	 * buffer argument for anything. The only one so far,
+	 * IOC_DEFRAG, only works on files on an SFS volume, which the
+	 * current directory might not be; defragtest covers it.
 	 */
 
 	/* IOCTL(STDIN_FILENO, TIOCGETA); */
@@ -97,7 +97,6 @@ test_ioctl(void)
 {
 	test_ioctl_fd();
 
-	/* Since we don't actually define any ioctls, this is not meaningful */
 	ioctl_badcode();
 	ioctl_badbuf();
 }
@@ -97,6 +97,13 @@ fsync_badfd(int fd)
 	return fsync(fd);
 }
 
+static
+int
+fdatasync_badfd(int fd)
+{
+	return fdatasync(fd);
+}
+
 static
 int
 ftruncate_badfd(int fd)
@@ -104,6 +111,13 @@ ftruncate_badfd(int fd)
 	return ftruncate(fd, 60);
 }
 
+static
+int
+fallocate_badfd(int fd)
+{
+	return fallocate(fd, 0, 60);
+}
+
 static
 int
 fstat_badfd(int fd)
@@ -228,7 +242,9 @@ T(close, RW_TEST_NONE);
 T(ioctl, RW_TEST_NONE);
 T(lseek, RW_TEST_NONE);
 T(fsync, RW_TEST_NONE);
+T(fdatasync, RW_TEST_NONE);
 T(ftruncate, RW_TEST_RDONLY);
+T(fallocate, RW_TEST_RDONLY);
 T(fstat, RW_TEST_NONE);
 T(getdirentry, RW_TEST_WRONLY);
 TC(dup2, RW_TEST_NONE);
@@ -75,7 +75,9 @@ void test_close_fd(void);
 void test_ioctl_fd(void);
 void test_lseek_fd(void);
 void test_fsync_fd(void);
+void test_fdatasync_fd(void);
 void test_ftruncate_fd(void);
+void test_fallocate_fd(void);
 void test_fstat_fd(void);
 void test_getdirentry_fd(void);
 void test_dup2_fd(void);
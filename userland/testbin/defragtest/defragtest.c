@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+/*
+ * defragtest - check the IOC_DEFRAG ioctl. Two files are written a
+ * block at a time, taking turns and syncing after each block, so
+ * their blocks end up interleaved on disk; then one is defragmented,
+ * which should leave it in one extent with both files' contents
+ * intact.
+ *
+ * Usage: defragtest [directory]
+ *
+ * The directory (default the current one) has to be on an SFS volume
+ * with extent-mapped files for anything to be moved.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define NAME_A		"defragtest.a"
+#define NAME_B		"defragtest.b"
+
+#define BLOCKSIZE	512
+#define NBLOCKS		64		/* blocks in each file */
+
+static char buf[BLOCKSIZE];
+
+/*
+ * What block BLOCK of file WHICH (0 or 1) holds.
+ */
+static
+void
+fillblock(int which, unsigned block)
+{
+	unsigned i;
+
+	for (i=0; i<BLOCKSIZE; i++) {
+		buf[i] = (which ? 'a' : 'A') + (block + i) % 26;
+	}
+}
+
+static
+void
+writeblock(int fd, const char *file, int which, unsigned block)
+{
+	ssize_t r;
+
+	fillblock(which, block);
+	r = pwrite(fd, buf, BLOCKSIZE, (off_t)block * BLOCKSIZE);
+	if (r < 0) {
+		err(1, "%s: pwrite", file);
+	}
+	if (r != BLOCKSIZE) {
+		errx(1, "%s: short write (%zd of %d)", file, r, BLOCKSIZE);
+	}
+	if (fsync(fd) < 0) {
+		err(1, "%s: fsync", file);
+	}
+}
+
+static
+void
+checkfile(int fd, const char *file, int which, const char *when)
+{
+	char want[BLOCKSIZE];
+	unsigned block;
+	ssize_t r;
+
+	for (block=0; block<NBLOCKS; block++) {
+		r = pread(fd, want, BLOCKSIZE, (off_t)block * BLOCKSIZE);
+		if (r < 0) {
+			err(1, "%s: pread", file);
+		}
+		if (r != BLOCKSIZE) {
+			errx(1, "%s: %s: short read (%zd of %d)", file, when,
+			     r, BLOCKSIZE);
+		}
+		fillblock(which, block);
+		if (memcmp(want, buf, BLOCKSIZE) != 0) {
+			errx(1, "%s: %s: block %u is wrong", file, when,
+			     block);
+		}
+	}
+}
+
+static
+int
+openfile(const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", file);
+	}
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct defragstat ds;
+	unsigned block;
+	int fda, fdb;
+
+	if (argc > 2) {
+		errx(1, "Usage: defragtest [directory]");
+	}
+	if (argc == 2 && chdir(argv[1]) < 0) {
+		err(1, "%s", argv[1]);
+	}
+
+	printf("Writing two files a block at a time...\n");
+	fda = openfile(NAME_A);
+	fdb = openfile(NAME_B);
+	for (block=0; block<NBLOCKS; block++) {
+		writeblock(fda, NAME_A, 0, block);
+		writeblock(fdb, NAME_B, 1, block);
+	}
+
+	printf("Defragmenting one of them...\n");
+	if (ioctl(fda, IOC_DEFRAG, &ds) < 0) {
+		err(1, "%s: ioctl IOC_DEFRAG", NAME_A);
+	}
+	if (ds.ds_before == 0) {
+		printf("Files here aren't extent-mapped; nothing to test.\n");
+	}
+	else {
+		printf("%s: %u extents -> %u\n", NAME_A,
+		       (unsigned)ds.ds_before, (unsigned)ds.ds_after);
+		if (ds.ds_after != 1) {
+			errx(1, "%s: %u extents left, expected 1", NAME_A,
+			     (unsigned)ds.ds_after);
+		}
+	}
+	checkfile(fda, NAME_A, 0, "after defrag");
+	checkfile(fdb, NAME_B, 1, "after defrag");
+
+	printf("Defragmenting it again...\n");
+	if (ioctl(fda, IOC_DEFRAG, &ds) < 0) {
+		err(1, "%s: ioctl IOC_DEFRAG", NAME_A);
+	}
+	if (ds.ds_after != ds.ds_before) {
+		errx(1, "%s: moved again (%u extents -> %u)", NAME_A,
+		     (unsigned)ds.ds_before, (unsigned)ds.ds_after);
+	}
+	checkfile(fda, NAME_A, 0, "after second defrag");
+
+	printf("Passing a bad pointer...\n");
+	if (ioctl(fda, IOC_DEFRAG, NULL) == 0) {
+		errx(1, "%s: ioctl with NULL pointer succeeded", NAME_A);
+	}
+	if (errno != EFAULT) {
+		err(1, "%s: ioctl with NULL pointer: expected EFAULT",
+		    NAME_A);
+	}
+
+	close(fda);
+	close(fdb);
+	if (remove(NAME_A) < 0) {
+		err(1, "%s: remove", NAME_A);
+	}
+	if (remove(NAME_B) < 0) {
+		err(1, "%s: remove", NAME_B);
+	}
+
+	printf("Passed.\n");
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * falloctest - check that fallocate gives a file the requested size,
+ * that space allocated that way reads as zeros, and that writing
+ * into it and allocating over existing data leave the data intact.
+ *
+ * Usage: falloctest [filename]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define DEFAULT_FILE	"falloctest.dat"
+
+#define HEADLEN		100		/* bytes written before fallocate */
+#define ALLOCLEN	65536		/* size fallocate extends to */
+#define MIDPOS		20000		/* where the later write goes */
+#define MIDLEN		512
+#define TRUNCLEN	10000		/* size to cut back to */
+#define EXTLEN		5000		/* allocated past TRUNCLEN */
+
+static char buf[ALLOCLEN];
+
+/*
+ * What byte POS of the file should be, given what's been written to
+ * it so far (the head, and if MID is set the block in the middle).
+ */
+static
+char
+expected(off_t pos, int mid)
+{
+	if (pos < HEADLEN) {
+		return 'a';
+	}
+	if (mid && pos >= MIDPOS && pos < MIDPOS + MIDLEN) {
+		return 'b';
+	}
+	return 0;
+}
+
+static
+void
+checksize(int fd, const char *file, off_t size, const char *when)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		err(1, "%s: fstat", file);
+	}
+	if (st.st_size != size) {
+		errx(1, "%s: %s: size %lld, expected %lld", file, when,
+		     (long long)st.st_size, (long long)size);
+	}
+}
+
+static
+void
+checkdata(int fd, const char *file, off_t size, int mid, const char *when)
+{
+	ssize_t r;
+	off_t i;
+
+	r = pread(fd, buf, size, 0);
+	if (r < 0) {
+		err(1, "%s: pread", file);
+	}
+	if (r != size) {
+		errx(1, "%s: %s: short read (%zd of %lld)", file, when,
+		     r, (long long)size);
+	}
+	for (i=0; i<size; i++) {
+		if (buf[i] != expected(i, mid)) {
+			errx(1, "%s: %s: byte %lld is %d, expected %d",
+			     file, when, (long long)i, buf[i],
+			     expected(i, mid));
+		}
+	}
+}
+
+static
+void
+dowrite(int fd, const char *file, char ch, size_t len, off_t pos)
+{
+	ssize_t r;
+
+	memset(buf, ch, len);
+	r = pwrite(fd, buf, len, pos);
+	if (r < 0) {
+		err(1, "%s: pwrite", file);
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: short write (%zd of %zu)", file, r, len);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file;
+	int fd;
+
+	if (argc > 2) {
+		errx(1, "Usage: falloctest [filename]");
+	}
+	file = argc == 2 ? argv[1] : DEFAULT_FILE;
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", file);
+	}
+
+	printf("Allocating past the end of a short file...\n");
+	dowrite(fd, file, 'a', HEADLEN, 0);
+	if (fallocate(fd, 0, ALLOCLEN) < 0) {
+		err(1, "%s: fallocate", file);
+	}
+	checksize(fd, file, ALLOCLEN, "after fallocate");
+	checkdata(fd, file, ALLOCLEN, 0, "after fallocate");
+
+	printf("Writing into the allocated space...\n");
+	dowrite(fd, file, 'b', MIDLEN, MIDPOS);
+	checksize(fd, file, ALLOCLEN, "after write");
+	checkdata(fd, file, ALLOCLEN, 1, "after write");
+
+	printf("Allocating over existing data...\n");
+	if (fallocate(fd, 0, MIDPOS + MIDLEN) < 0) {
+		err(1, "%s: fallocate", file);
+	}
+	checksize(fd, file, ALLOCLEN, "after second fallocate");
+	checkdata(fd, file, ALLOCLEN, 1, "after second fallocate");
+
+	printf("Truncating and allocating again...\n");
+	if (ftruncate(fd, TRUNCLEN) < 0) {
+		err(1, "%s: ftruncate", file);
+	}
+	if (fallocate(fd, TRUNCLEN, EXTLEN) < 0) {
+		err(1, "%s: fallocate", file);
+	}
+	checksize(fd, file, TRUNCLEN + EXTLEN, "after third fallocate");
+	checkdata(fd, file, TRUNCLEN + EXTLEN, 0, "after third fallocate");
+
+	close(fd);
+	if (remove(file) < 0) {
+		err(1, "%s: remove", file);
+	}
+
+	printf("Passed.\n");
+	return 0;
+}
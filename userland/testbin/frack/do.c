@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <err.h>
@@ -38,41 +39,120 @@
 #include "data.h"
 #include "name.h"
 #include "do.h"
+#include "timing.h"
+
+/*
+ * Each operation is printed as it's done unless we're in quiet mode
+ * (for timing). If there's a log, each operation is also written to
+ * it in the form replay.c reads; file handles are logged as the file
+ * descriptor numbers they had when recorded.
+ */
+static int quiet;
+static FILE *logfile;
+
+void
+do_setquiet(void)
+{
+	quiet = 1;
+}
+
+void
+do_openlog(const char *path)
+{
+	logfile = fopen(path, "w");
+	if (logfile == NULL) {
+		err(1, "%s", path);
+	}
+}
+
+void
+do_closelog(void)
+{
+	if (logfile != NULL) {
+		if (fclose(logfile)) {
+			warn("log: close");
+		}
+		logfile = NULL;
+	}
+}
+
+static
+void
+say(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (quiet) {
+		return;
+	}
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static
+void
+logop(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (logfile == NULL) {
+		return;
+	}
+	va_start(ap, fmt);
+	vfprintf(logfile, fmt, ap);
+	va_end(ap);
+}
 
 int
 do_opendir(unsigned name)
 {
 	const char *namestr;
+	unsigned long long start;
 	int fd;
 
 	namestr = name_get(name);
+	start = timing_start();
 	fd = open(namestr, O_RDONLY);
+	timing_end(OPC_OPEN, start);
 	if (fd < 0) {
 		err(1, "%s: opendir", namestr);
 	}
+	logop("opendir %d %s\n", fd, namestr);
 	return fd;
 }
 
 void
 do_closedir(int fd, unsigned name)
 {
-	if (close(fd)) {
+	unsigned long long start;
+	int result;
+
+	start = timing_start();
+	result = close(fd);
+	timing_end(OPC_CLOSE, start);
+	if (result) {
 		warn("%s: closedir", name_get(name));
 	}
+	logop("closedir %d\n", fd);
 }
 
 int
 do_createfile(unsigned name)
 {
 	const char *namestr;
+	unsigned long long start;
 	int fd;
 
 	namestr = name_get(name);
+	start = timing_start();
 	fd = open(namestr, O_WRONLY|O_CREAT|O_EXCL, 0664);
+	timing_end(OPC_CREATE, start);
 	if (fd < 0) {
 		err(1, "%s: create", namestr);
 	}
-	printf("create %s\n", namestr);
+	say("create %s\n", namestr);
+	logop("create %d %s\n", fd, namestr);
 	return fd;
 }
 
@@ -80,22 +160,33 @@ int
 do_openfile(unsigned name, int dotrunc)
 {
 	const char *namestr;
+	unsigned long long start;
 	int fd;
 
 	namestr = name_get(name);
+	start = timing_start();
 	fd = open(namestr, O_WRONLY | (dotrunc ? O_TRUNC : 0), 0664);
+	timing_end(OPC_OPEN, start);
 	if (fd < 0) {
 		err(1, "%s: open", namestr);
 	}
+	logop("%s %d %s\n", dotrunc ? "opentrunc" : "open", fd, namestr);
 	return fd;
 }
 
 void
 do_closefile(int fd, unsigned name)
 {
-	if (close(fd)) {
+	unsigned long long start;
+	int result;
+
+	start = timing_start();
+	result = close(fd);
+	timing_end(OPC_CLOSE, start);
+	if (result) {
 		warn("%s: close", name_get(name));
 	}
+	logop("close %d\n", fd);
 }
 
 void
@@ -106,9 +197,11 @@ do_write(int fd, unsigned name, unsigned code, unsigned seq,
 	ssize_t ret;
 	char *buf;
 	const char *namestr;
+	unsigned long long start;
 
 	namestr = name_get(name);
 	buf = data_map(code, seq, len);
+	start = timing_start();
 	if (lseek(fd, pos, SEEK_SET) == -1) {
 		err(1, "%s: lseek to %lld", name_get(name), pos);
 	}
@@ -121,82 +214,120 @@ do_write(int fd, unsigned name, unsigned code, unsigned seq,
 		}
 		done += ret;
 	}
+	timing_end(OPC_WRITE, start);
 
-	printf("write %s: %lld at %lld\n", namestr, len, pos);
+	say("write %s: %lld at %lld\n", namestr, len, pos);
+	logop("write %d %lld %lld\n", fd, len, pos);
 }
 
 void
 do_truncate(int fd, unsigned name, off_t len)
 {
 	const char *namestr;
+	unsigned long long start;
+	int result;
 
 	namestr = name_get(name);
-	if (ftruncate(fd, len) == -1) {
+	start = timing_start();
+	result = ftruncate(fd, len);
+	timing_end(OPC_TRUNCATE, start);
+	if (result == -1) {
 		err(1, "%s: truncate to %lld", namestr, len);
 	}
-	printf("truncate %s: to %lld\n", namestr, len);
+	say("truncate %s: to %lld\n", namestr, len);
+	logop("truncate %d %lld\n", fd, len);
 }
 
 void
 do_mkdir(unsigned name)
 {
 	const char *namestr;
+	unsigned long long start;
+	int result;
 
 	namestr = name_get(name);
-	if (mkdir(namestr, 0775) == -1) {
+	start = timing_start();
+	result = mkdir(namestr, 0775);
+	timing_end(OPC_MKDIR, start);
+	if (result == -1) {
 		err(1, "%s: mkdir", namestr);
 	}
-	printf("mkdir %s\n", namestr);
+	say("mkdir %s\n", namestr);
+	logop("mkdir %s\n", namestr);
 }
 
 void
 do_rmdir(unsigned name)
 {
 	const char *namestr;
+	unsigned long long start;
+	int result;
 
 	namestr = name_get(name);
-	if (rmdir(namestr) == -1) {
+	start = timing_start();
+	result = rmdir(namestr);
+	timing_end(OPC_RMDIR, start);
+	if (result == -1) {
 		err(1, "%s: rmdir", namestr);
 	}
-	printf("rmdir %s\n", namestr);
+	say("rmdir %s\n", namestr);
+	logop("rmdir %s\n", namestr);
 }
 
 void
 do_unlink(unsigned name)
 {
 	const char *namestr;
+	unsigned long long start;
+	int result;
 
 	namestr = name_get(name);
-	if (remove(namestr) == -1) {
+	start = timing_start();
+	result = remove(namestr);
+	timing_end(OPC_REMOVE, start);
+	if (result == -1) {
 		err(1, "%s: remove", namestr);
 	}
-	printf("remove %s\n", namestr);
+	say("remove %s\n", namestr);
+	logop("remove %s\n", namestr);
 }
 
 void
 do_link(unsigned from, unsigned to)
 {
 	const char *fromstr, *tostr;
+	unsigned long long start;
+	int result;
 
 	fromstr = name_get(from);
 	tostr = name_get(to);
-	if (link(fromstr, tostr) == -1) {
+	start = timing_start();
+	result = link(fromstr, tostr);
+	timing_end(OPC_LINK, start);
+	if (result == -1) {
 		err(1, "link %s to %s", fromstr, tostr);
 	}
-	printf("link %s %s\n", fromstr, tostr);
+	say("link %s %s\n", fromstr, tostr);
+	logop("link %s %s\n", fromstr, tostr);
 }
 
 void
 do_rename(unsigned from, unsigned to)
 {
 	const char *fromstr, *tostr;
+	unsigned long long start;
+	int result;
 
 	fromstr = name_get(from);
 	tostr = name_get(to);
-	if (rename(fromstr, tostr) == -1) {
+	start = timing_start();
+	result = rename(fromstr, tostr);
+	timing_end(OPC_RENAME, start);
+	if (result == -1) {
 		err(1, "rename %s to %s", fromstr, tostr);
 	}
-	printf("rename %s %s\n", fromstr, tostr);
+	say("rename %s %s\n", fromstr, tostr);
+	logop("rename %s %s\n", fromstr, tostr);
 }
 
 void
@@ -204,6 +335,8 @@ do_renamexd(unsigned fromdir, unsigned from, unsigned todir, unsigned to)
 {
 	char frombuf[64];
 	char tobuf[64];
+	unsigned long long start;
+	int result;
 
 	strcpy(frombuf, name_get(fromdir));
 	strcat(frombuf, "/");
@@ -213,39 +346,64 @@ do_renamexd(unsigned fromdir, unsigned from, unsigned todir, unsigned to)
 	strcat(tobuf, "/");
 	strcat(tobuf, name_get(to));
 
-	if (rename(frombuf, tobuf) == -1) {
+	start = timing_start();
+	result = rename(frombuf, tobuf);
+	timing_end(OPC_RENAME, start);
+	if (result == -1) {
 		err(1, "rename %s to %s", frombuf, tobuf);
 	}
-	printf("rename %s %s\n", frombuf, tobuf);
+	say("rename %s %s\n", frombuf, tobuf);
+	logop("renamexd %s %s %s %s\n", name_get(fromdir), name_get(from),
+	      name_get(todir), name_get(to));
 }
 
 void
 do_chdir(unsigned name)
 {
 	const char *namestr;
+	unsigned long long start;
+	int result;
 
 	namestr = name_get(name);
-	if (chdir(namestr) == -1) {
+	start = timing_start();
+	result = chdir(namestr);
+	timing_end(OPC_CHDIR, start);
+	if (result == -1) {
 		err(1, "chdir: %s", namestr);
 	}
-	printf("chdir %s\n", namestr);
+	say("chdir %s\n", namestr);
+	logop("chdir %s\n", namestr);
 }
 
 void
 do_chdirup(void)
 {
-	if (chdir("..") == -1) {
+	unsigned long long start;
+	int result;
+
+	start = timing_start();
+	result = chdir("..");
+	timing_end(OPC_CHDIR, start);
+	if (result == -1) {
 		err(1, "chdir: ..");
 	}
-	printf("chdir ..\n");
+	say("chdir ..\n");
+	logop("chdirup\n");
 }
 
 void
 do_sync(void)
 {
-	if (sync()) {
+	unsigned long long start;
+	int result;
+
+	start = timing_start();
+	result = sync();
+	timing_end(OPC_SYNC, start);
+	if (result) {
 		warn("sync");
 	}
-	printf("sync\n");
-	printf("----------------------------------------\n");
+	say("sync\n");
+	say("----------------------------------------\n");
+	logop("sync\n");
 }
@@ -28,6 +28,9 @@
  * SUCH DAMAGE.
  */
 
+void do_setquiet(void);
+void do_openlog(const char *path);
+void do_closelog(void);
 
 int do_opendir(unsigned name);
 void do_closedir(int handle, unsigned name);
@@ -28,12 +28,16 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
 
 #include "workloads.h"
+#include "do.h"
+#include "replay.h"
+#include "timing.h"
 #include "main.h"
 
 struct workload {
@@ -142,32 +146,77 @@ printworkloads(void)
 	}
 }
 
+/*
+ * Actions:
+ *    do		run the workload, printing each operation
+ *    check		check the file system against the workload
+ *    time		run the workload quietly and time each operation
+ *    record LOG	like "do", but also log the operations to LOG
+ *    replay LOG	run the operations in LOG quietly and time them
+ */
+static
+void
+usage(const char *progname)
+{
+	warnx("Usage: %s do|check|time workload [arg]", progname);
+	warnx("   or: %s record logfile workload [arg]", progname);
+	warnx("   or: %s replay logfile", progname);
+	warnx("Use \"list\" for a list of workloads");
+	exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
-	const char *workloadname;
+	const char *progname, *action, *workloadname;
 	const struct workload *workload;
-	int checkmode = 0;
+	int checkmode = 0, timing = 0;
 
 	if (argc == 2 && !strcmp(argv[1], "list")) {
 		printworkloads();
 		exit(0);
 	}
 
+	progname = argv[0];
 	if (argc < 3) {
-		warnx("Usage: %s do|check workload [arg]", argv[0]);
-		warnx("Use \"list\" for a list of workloads");
-		exit(1);
+		usage(progname);
 	}
+	action = argv[1];
 
-	if (!strcmp(argv[1], "do")) {
+	if (!strcmp(action, "replay")) {
+		if (argc != 3) {
+			usage(progname);
+		}
+		do_setquiet();
+		replay(argv[2]);
+		printf("Operation times replaying %s:\n", argv[2]);
+		timing_report();
+		return 0;
+	}
+	if (!strcmp(action, "record")) {
+		if (argc < 4) {
+			usage(progname);
+		}
+		do_openlog(argv[2]);
+		/* Drop the log name and proceed as for "do". */
+		argv++;
+		argc--;
+	}
+
+	if (!strcmp(action, "do") || !strcmp(action, "record")) {
 		checkmode = 0;
 	}
-	else if (!strcmp(argv[1], "check")) {
+	else if (!strcmp(action, "check")) {
 		checkmode = 1;
 	}
+	else if (!strcmp(action, "time")) {
+		checkmode = 0;
+		timing = 1;
+		do_setquiet();
+	}
 	else {
-		errx(1, "Action must be \"do\" or \"check\"");
+		errx(1, "Action must be \"do\", \"check\", \"time\", "
+		     "\"record\", or \"replay\"");
 	}
 
 	workloadname = argv[2];
@@ -192,5 +241,10 @@ main(int argc, char *argv[])
 		workload->run.noarg();
 	}
 	complete();
+	do_closelog();
+	if (timing) {
+		printf("Operation times for %s:\n", workloadname);
+		timing_report();
+	}
 	return 0;
 }
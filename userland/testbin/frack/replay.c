@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "name.h"
+#include "do.h"
+#include "replay.h"
+
+/*
+ * Replay an operation log written by "frack record". This runs the
+ * operations straight through do.c with no checking; the open files
+ * and directories are looked up by the descriptor numbers they had
+ * when recorded. The data written is frack's usual generated data,
+ * but not necessarily what was written when recording.
+ */
+
+#define MAXHANDLES 64
+#define MAXWORDS 6
+
+static struct {
+	int fd;
+	unsigned name;
+} handles[MAXHANDLES];
+
+static unsigned lineno;
+
+static
+unsigned
+gethandle(const char *str)
+{
+	int h;
+
+	h = atoi(str);
+	if (h < 0 || h >= MAXHANDLES) {
+		errx(1, "log line %u: handle %s out of range", lineno, str);
+	}
+	return h;
+}
+
+static
+void
+sethandle(const char *str, int fd, unsigned name)
+{
+	unsigned h;
+
+	h = gethandle(str);
+	handles[h].fd = fd;
+	handles[h].name = name;
+}
+
+static
+void
+replay_line(char **words, unsigned nwords)
+{
+	static unsigned seq;
+	unsigned h, name;
+	int fd;
+
+#define OP(str, n) (!strcmp(words[0], str) && nwords == (n))
+	if (OP("opendir", 3)) {
+		name = name_find(words[2]);
+		fd = do_opendir(name);
+		sethandle(words[1], fd, name);
+	}
+	else if (OP("closedir", 2)) {
+		h = gethandle(words[1]);
+		do_closedir(handles[h].fd, handles[h].name);
+	}
+	else if (OP("create", 3)) {
+		name = name_find(words[2]);
+		fd = do_createfile(name);
+		sethandle(words[1], fd, name);
+	}
+	else if (OP("open", 3) || OP("opentrunc", 3)) {
+		name = name_find(words[2]);
+		fd = do_openfile(name, !strcmp(words[0], "opentrunc"));
+		sethandle(words[1], fd, name);
+	}
+	else if (OP("close", 2)) {
+		h = gethandle(words[1]);
+		do_closefile(handles[h].fd, handles[h].name);
+	}
+	else if (OP("write", 4)) {
+		h = gethandle(words[1]);
+		do_write(handles[h].fd, handles[h].name, 0, seq++,
+			 atoi(words[3]), atoi(words[2]));
+	}
+	else if (OP("truncate", 3)) {
+		h = gethandle(words[1]);
+		do_truncate(handles[h].fd, handles[h].name, atoi(words[2]));
+	}
+	else if (OP("mkdir", 2)) {
+		do_mkdir(name_find(words[1]));
+	}
+	else if (OP("rmdir", 2)) {
+		do_rmdir(name_find(words[1]));
+	}
+	else if (OP("remove", 2)) {
+		do_unlink(name_find(words[1]));
+	}
+	else if (OP("link", 3)) {
+		do_link(name_find(words[1]), name_find(words[2]));
+	}
+	else if (OP("rename", 3)) {
+		do_rename(name_find(words[1]), name_find(words[2]));
+	}
+	else if (OP("renamexd", 5)) {
+		do_renamexd(name_find(words[1]), name_find(words[2]),
+			    name_find(words[3]), name_find(words[4]));
+	}
+	else if (OP("chdir", 2)) {
+		do_chdir(name_find(words[1]));
+	}
+	else if (OP("chdirup", 1)) {
+		do_chdirup();
+	}
+	else if (OP("sync", 1)) {
+		do_sync();
+	}
+	else {
+		errx(1, "log line %u: bad operation %s", lineno, words[0]);
+	}
+#undef OP
+}
+
+void
+replay(const char *path)
+{
+	FILE *f;
+	char buf[128];
+	char *words[MAXWORDS];
+	char *s, *context;
+	unsigned nwords;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		err(1, "%s", path);
+	}
+	lineno = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		lineno++;
+		nwords = 0;
+		for (s = strtok_r(buf, " \n", &context); s != NULL;
+		     s = strtok_r(NULL, " \n", &context)) {
+			if (nwords == MAXWORDS) {
+				errx(1, "log line %u: too long", lineno);
+			}
+			words[nwords++] = s;
+		}
+		if (nwords > 0) {
+			replay_line(words, nwords);
+		}
+	}
+	if (ferror(f)) {
+		err(1, "%s: read", path);
+	}
+	fclose(f);
+}
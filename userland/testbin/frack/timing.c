@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "timing.h"
+
+static const char *const opcnames[OPC_NUM] = {
+	"create",
+	"open",
+	"write",
+	"truncate",
+	"close",
+	"mkdir",
+	"rmdir",
+	"remove",
+	"link",
+	"rename",
+	"chdir",
+	"sync",
+};
+
+static struct {
+	unsigned count;
+	unsigned long long usec;
+	unsigned long long maxusec;
+} opcstats[OPC_NUM];
+
+/*
+ * Current time in microseconds.
+ */
+unsigned long long
+timing_start(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+void
+timing_end(enum opclass opc, unsigned long long start)
+{
+	unsigned long long usec;
+
+	usec = timing_start() - start;
+	opcstats[opc].count++;
+	opcstats[opc].usec += usec;
+	if (usec > opcstats[opc].maxusec) {
+		opcstats[opc].maxusec = usec;
+	}
+}
+
+static
+void
+timing_print(const char *name, unsigned count, unsigned long long usec,
+	     unsigned long long maxusec)
+{
+	printf("   %-9s %6u %8llu.%03llu %8llu %8llu\n", name, count,
+	       usec / 1000, usec % 1000, usec / count, maxusec);
+}
+
+void
+timing_report(void)
+{
+	unsigned i, count;
+	unsigned long long usec, maxusec;
+
+	count = 0;
+	usec = maxusec = 0;
+	printf("   %-9s %6s %12s %8s %8s\n", "operation", "count",
+	       "total ms", "avg us", "max us");
+	for (i=0; i<OPC_NUM; i++) {
+		if (opcstats[i].count == 0) {
+			continue;
+		}
+		timing_print(opcnames[i], opcstats[i].count,
+			     opcstats[i].usec, opcstats[i].maxusec);
+		count += opcstats[i].count;
+		usec += opcstats[i].usec;
+		if (opcstats[i].maxusec > maxusec) {
+			maxusec = opcstats[i].maxusec;
+		}
+	}
+	if (count == 0) {
+		printf("   no operations\n");
+		return;
+	}
+	timing_print("total", count, usec, maxusec);
+}
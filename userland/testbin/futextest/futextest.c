@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * futextest - check the futex_wait and futex_wake system calls.
+ *
+ * There are no user-level threads to wait with, so this sticks to
+ * what one thread can see: futex_wait returns EAGAIN at once when
+ * the word doesn't hold the expected value, futex_wake with nobody
+ * waiting wakes nobody, and bad addresses and counts are rejected.
+ * Then it runs a futex-based mutex through some uncontended lock and
+ * unlock cycles, which should never enter the kernel.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define NLOOPS	10000
+
+static volatile int word;
+
+/*
+ * A mutex: 0 is unlocked, 1 locked, 2 locked with waiters.
+ */
+static volatile int mutex;
+
+static
+int
+cas(volatile int *p, int old, int new)
+{
+	/* single-threaded; good enough for the uncontended case here */
+	int cur;
+
+	cur = *p;
+	if (cur == old) {
+		*p = new;
+	}
+	return cur;
+}
+
+static
+void
+mutex_lock(volatile int *m)
+{
+	int c;
+
+	c = cas(m, 0, 1);
+	while (c != 0) {
+		if (c == 2 || cas(m, 1, 2) != 0) {
+			futex_wait(m, 2);
+		}
+		c = cas(m, 0, 2);
+	}
+}
+
+static
+void
+mutex_unlock(volatile int *m)
+{
+	int old;
+
+	old = *m;
+	*m = 0;
+	if (old == 2) {
+		futex_wake(m, 1);
+	}
+}
+
+static
+void
+expect_err(int r, int experr, const char *what)
+{
+	if (r != -1) {
+		errx(1, "%s: succeeded (returned %d), expected error", what, r);
+	}
+	if (errno != experr) {
+		err(1, "%s: wrong error", what);
+	}
+}
+
+int
+main(void)
+{
+	int i, r;
+
+	word = 5;
+	r = futex_wait(&word, 6);
+	expect_err(r, EAGAIN, "futex_wait with a stale value");
+
+	r = futex_wake(&word, 1);
+	if (r != 0) {
+		errx(1, "futex_wake with no waiters: returned %d", r);
+	}
+
+	r = futex_wait((volatile int *)((volatile char *)&word + 1), 5);
+	expect_err(r, EINVAL, "futex_wait on a misaligned address");
+
+	r = futex_wait(NULL, 0);
+	expect_err(r, EFAULT, "futex_wait on NULL");
+
+	r = futex_wake(&word, -1);
+	expect_err(r, EINVAL, "futex_wake with a negative count");
+
+	for (i=0; i<NLOOPS; i++) {
+		mutex_lock(&mutex);
+		if (mutex != 1) {
+			errx(1, "mutex is %d while held", mutex);
+		}
+		mutex_unlock(&mutex);
+	}
+	if (mutex != 0) {
+		errx(1, "mutex is %d at the end", mutex);
+	}
+
+	printf("futextest: passed\n");
+	return 0;
+}
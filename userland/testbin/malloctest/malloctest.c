@@ -39,9 +39,14 @@
  * Note that because the userlevel malloc is extremely dumb,
  * malloctest 3 is extremely slow and on most VM systems will run more
  * or less forever.
+ *
+ * Tests 8-11 are benchmarks rather than tests: each runs one pattern
+ * of allocation and reports operations per second and how big the
+ * heap got next to how many bytes were live at the time.
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -629,6 +634,292 @@ test7(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Benchmarks.
+ *
+ * Each one counts its mallocs and frees and the bytes it has live,
+ * and looks at the heap size (the break, relative to where it was
+ * when the program started) every BENCH_SAMPLE operations and
+ * whenever the live count reaches a new peak. Looking costs an sbrk
+ * call, so it isn't done on every operation. The data isn't checked;
+ * the tests above do that.
+ */
+
+#define BENCH_SAMPLE 64
+
+static char *heapbase;
+
+static struct {
+	unsigned long ops;
+	unsigned long live, peaklive;
+	unsigned long heap, peakheap;
+	unsigned long long start;
+} bench;
+
+static
+unsigned long long
+bench_now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+void
+bench_sample(void)
+{
+	bench.heap = (char *)sbrk(0) - heapbase;
+	if (bench.heap > bench.peakheap) {
+		bench.peakheap = bench.heap;
+	}
+}
+
+static
+void
+bench_start(int testno, const char *desc)
+{
+	printf("Beginning malloc test %d (%s)\n", testno, desc);
+	bzero(&bench, sizeof(bench));
+	bench_sample();
+	bench.start = bench_now();
+}
+
+static
+void *
+bench_malloc(size_t size)
+{
+	void *ptr;
+
+	ptr = malloc(size);
+	if (ptr == NULL) {
+		errx(1, "malloc %lu failed with %lu bytes live",
+		     (unsigned long)size, bench.live);
+	}
+	/* Touch it, as a real program would. */
+	*(volatile char *)ptr = 0;
+	bench.live += size;
+	bench.ops++;
+	if (bench.live > bench.peaklive) {
+		bench.peaklive = bench.live;
+		bench_sample();
+	}
+	else if (bench.ops % BENCH_SAMPLE == 0) {
+		bench_sample();
+	}
+	return ptr;
+}
+
+static
+void
+bench_free(void *ptr, size_t size)
+{
+	free(ptr);
+	bench.live -= size;
+	bench.ops++;
+	if (bench.ops % BENCH_SAMPLE == 0) {
+		bench_sample();
+	}
+}
+
+static
+void
+bench_end(int testno)
+{
+	unsigned long long usec;
+
+	usec = bench_now() - bench.start;
+	bench_sample();
+	if (usec == 0) {
+		usec = 1;
+	}
+	printf("   %lu operations in %llu.%03llu sec: %llu per second\n",
+	       bench.ops, usec / 1000000, (usec / 1000) % 1000,
+	       (unsigned long long)bench.ops * 1000000 / usec);
+	printf("   peak live %lu bytes, peak heap %lu bytes", bench.peaklive,
+	       bench.peakheap);
+	if (bench.peaklive > 0) {
+		printf(" (%lu%%)", (unsigned long)
+		       ((unsigned long long)bench.peakheap * 100 /
+			bench.peaklive));
+	}
+	printf("; heap %lu bytes at the end\n", bench.heap);
+	printf("Passed malloc test %d\n", testno);
+}
+
+/*
+ * Small-object churn: random sizes up to 256 bytes in a table of
+ * slots; each step frees the slot's block if it has one and
+ * allocates one if it doesn't.
+ */
+#define CHURN_SLOTS 1024
+#define CHURN_STEPS 200000
+
+static
+void
+test8(void)
+{
+	static void *ptrs[CHURN_SLOTS];
+	static size_t sizes[CHURN_SLOTS];
+	unsigned i, n;
+
+	bench_start(8, "small-object churn");
+	srandom(8);
+	for (i=0; i<CHURN_STEPS; i++) {
+		n = random() % CHURN_SLOTS;
+		if (ptrs[n] == NULL) {
+			sizes[n] = 8 + random() % 249;
+			ptrs[n] = bench_malloc(sizes[n]);
+		}
+		else {
+			bench_free(ptrs[n], sizes[n]);
+			ptrs[n] = NULL;
+		}
+	}
+	for (n=0; n<CHURN_SLOTS; n++) {
+		if (ptrs[n] != NULL) {
+			bench_free(ptrs[n], sizes[n]);
+			ptrs[n] = NULL;
+		}
+	}
+	bench_end(8);
+}
+
+/*
+ * Producer/consumer: blocks are freed in the order they were
+ * allocated, a queue's length behind, the way messages passed from
+ * one part of a program to another are. The queue length varies, so
+ * the heap sees bursts of both.
+ */
+#define QUEUE_MAX 512
+#define QUEUE_STEPS 100000
+
+static
+void
+test9(void)
+{
+	static void *ptrs[QUEUE_MAX];
+	static size_t sizes[QUEUE_MAX];
+	unsigned i, head, tail, count, want;
+
+	bench_start(9, "producer/consumer frees");
+	srandom(9);
+	head = tail = count = 0;
+	want = QUEUE_MAX / 2;
+	for (i=0; i<QUEUE_STEPS; i++) {
+		if (i % 1000 == 0) {
+			want = 1 + random() % QUEUE_MAX;
+		}
+		if (count < want) {
+			sizes[head] = 16 + random() % 1009;
+			ptrs[head] = bench_malloc(sizes[head]);
+			head = (head + 1) % QUEUE_MAX;
+			count++;
+		}
+		else {
+			bench_free(ptrs[tail], sizes[tail]);
+			tail = (tail + 1) % QUEUE_MAX;
+			count--;
+		}
+	}
+	while (count > 0) {
+		bench_free(ptrs[tail], sizes[tail]);
+		tail = (tail + 1) % QUEUE_MAX;
+		count--;
+	}
+	bench_end(9);
+}
+
+/*
+ * Large-block growth and shrink: a buffer is repeatedly replaced by
+ * one twice (then half) its size, as a growing array would be, from
+ * 4K up to 512K and back. All of it is at the top of the heap, so
+ * the heap should grow with sbrk and shrink again after each round.
+ */
+#define GROW_MIN (4 * 1024)
+#define GROW_MAX (512 * 1024)
+#define GROW_ROUNDS 20
+
+static
+void
+test10(void)
+{
+	void *ptr, *newptr;
+	size_t size;
+	unsigned i;
+
+	bench_start(10, "large-block growth and shrink");
+	for (i=0; i<GROW_ROUNDS; i++) {
+		size = GROW_MIN;
+		ptr = bench_malloc(size);
+		while (size < GROW_MAX) {
+			newptr = bench_malloc(size * 2);
+			memcpy(newptr, ptr, size);
+			bench_free(ptr, size);
+			ptr = newptr;
+			size *= 2;
+		}
+		while (size > GROW_MIN) {
+			newptr = bench_malloc(size / 2);
+			memcpy(newptr, ptr, size / 2);
+			bench_free(ptr, size);
+			ptr = newptr;
+			size /= 2;
+		}
+		bench_free(ptr, size);
+	}
+	bench_end(10);
+}
+
+/*
+ * Fragmentation stress: fill memory with alternating small and
+ * medium blocks, free the small ones, and then ask for blocks a bit
+ * bigger than the holes that leaves. An allocator that can't merge
+ * or reuse the holes grows the heap by the whole amount each round.
+ */
+#define FRAG_PAIRS 256
+#define FRAG_ROUNDS 20
+
+static
+void
+test11(void)
+{
+	static void *small[FRAG_PAIRS], *medium[FRAG_PAIRS];
+	static void *bigger[FRAG_PAIRS];
+	static size_t smallsz[FRAG_PAIRS], mediumsz[FRAG_PAIRS];
+	unsigned i, round;
+
+	bench_start(11, "fragmentation stress");
+	srandom(11);
+	for (round=0; round<FRAG_ROUNDS; round++) {
+		for (i=0; i<FRAG_PAIRS; i++) {
+			smallsz[i] = SMALLSIZE + random() % SMALLSIZE;
+			small[i] = bench_malloc(smallsz[i]);
+			mediumsz[i] = MEDIUMSIZE + random() % MEDIUMSIZE;
+			medium[i] = bench_malloc(mediumsz[i]);
+		}
+		for (i=0; i<FRAG_PAIRS; i++) {
+			bench_free(small[i], smallsz[i]);
+		}
+		for (i=0; i<FRAG_PAIRS; i++) {
+			bigger[i] = bench_malloc(2 * SMALLSIZE + 8);
+		}
+		for (i=0; i<FRAG_PAIRS; i++) {
+			bench_free(medium[i], mediumsz[i]);
+		}
+		for (i=0; i<FRAG_PAIRS; i++) {
+			bench_free(bigger[i], 2 * SMALLSIZE + 8);
+		}
+	}
+	bench_end(11);
+}
+
+////////////////////////////////////////////////////////////
+
 static struct {
 	int num;
 	const char *desc;
@@ -641,6 +932,10 @@ static struct {
 	{ 5, "Stress test", test5 },
 	{ 6, "Randomized stress test", test6 },
 	{ 7, "Stress test with particular seed", test7 },
+	{ 8, "Benchmark: small-object churn", test8 },
+	{ 9, "Benchmark: producer/consumer frees", test9 },
+	{ 10, "Benchmark: large-block growth and shrink", test10 },
+	{ 11, "Benchmark: fragmentation stress", test11 },
 	{ -1, NULL, NULL }
 };
 
@@ -663,6 +958,8 @@ main(int argc, char *argv[])
 {
 	int i, tn, menu=1;
 
+	heapbase = sbrk(0);
+
 	if (argc > 1) {
 		for (i=1; i<argc; i++) {
 			dotest(atoi(argv[i]));
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * meldbench - time meld on large files.
+ *
+ * Usage: meldbench [kilobytes]
+ *
+ * Makes two source files of the given size (by default, each of a
+ * range of sizes in turn), melds them, checks that the result is
+ * interleaved correctly, and reports how fast meld went. meld works
+ * through its inputs in fixed-size pieces, so this should hold up
+ * however big the files get.
+ *
+ * The files are made in the current directory and removed at the
+ * end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define SOURCE1		"meldbench.1"
+#define SOURCE2		"meldbench.2"
+#define MERGED		"meldbench.out"
+
+/* Buffer for making and checking files */
+#define BUFSIZE		4096
+
+static char buf[BUFSIZE];
+
+static const unsigned sizes[] = {
+	4, 64, 1024, 4096,
+};
+
+/*
+ * Current time in microseconds.
+ */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * Byte POS of source file WHICH (0 or 1).
+ */
+static
+char
+sourcebyte(unsigned which, unsigned pos)
+{
+	return (which ? 'a' : 'A') + pos % 26;
+}
+
+/*
+ * Make source file WHICH, SIZE bytes long.
+ */
+static
+void
+makesource(const char *name, unsigned which, unsigned size)
+{
+	unsigned pos, i, n;
+	int fd, r;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	for (pos = 0; pos < size; pos += n) {
+		n = size - pos < BUFSIZE ? size - pos : BUFSIZE;
+		for (i=0; i<n; i++) {
+			buf[i] = sourcebyte(which, pos + i);
+		}
+		r = write(fd, buf, n);
+		if (r < 0) {
+			err(1, "%s: write", name);
+		}
+		if ((unsigned)r != n) {
+			errx(1, "%s: write: short count %d", name, r);
+		}
+	}
+	if (close(fd) < 0) {
+		err(1, "%s: close", name);
+	}
+}
+
+/*
+ * Check that the merged file is the two SIZE-byte sources taken four
+ * bytes at a time from each in turn.
+ */
+static
+void
+checkmerged(unsigned size)
+{
+	unsigned pos, i, n, j;
+	int fd, r;
+
+	fd = open(MERGED, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", MERGED);
+	}
+	for (pos = 0; pos < 2 * size; pos += n) {
+		n = 2 * size - pos < BUFSIZE ? 2 * size - pos : BUFSIZE;
+		r = read(fd, buf, n);
+		if (r < 0) {
+			err(1, "%s: read", MERGED);
+		}
+		if ((unsigned)r != n) {
+			errx(1, "%s: read: short count %d at %u", MERGED,
+			     r, pos);
+		}
+		for (i=0; i<n; i++) {
+			j = pos + i;
+			if (buf[i] != sourcebyte(j % 8 >= 4,
+						 j / 8 * 4 + j % 4)) {
+				errx(1, "%s: wrong byte at %u", MERGED, j);
+			}
+		}
+	}
+	r = read(fd, buf, 1);
+	if (r != 0) {
+		errx(1, "%s: longer than %u bytes", MERGED, 2 * size);
+	}
+	close(fd);
+}
+
+/*
+ * Meld two source files of KB kilobytes each and report.
+ */
+static
+void
+bench(unsigned kb)
+{
+	unsigned long long start, usec;
+	unsigned size = kb * 1024;
+	int r;
+
+	makesource(SOURCE1, 0, size);
+	makesource(SOURCE2, 1, size);
+	/* meld won't overwrite; it might be left over from last time */
+	(void)remove(MERGED);
+
+	start = now();
+	r = meld(SOURCE1, SOURCE2, MERGED);
+	usec = now() - start;
+	if (r < 0) {
+		err(1, "meld");
+	}
+	if ((unsigned)r != 2 * size) {
+		errx(1, "meld: returned %d, expected %u", r, 2 * size);
+	}
+	checkmerged(size);
+
+	if (usec == 0) {
+		usec = 1;
+	}
+	printf("meld %5u KB + %5u KB: %8llu usec, %8llu KB/sec\n",
+	       kb, kb, usec, 2ULL * kb * 1000000ULL / usec);
+
+	if (remove(MERGED) < 0) {
+		warn("%s: remove", MERGED);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned i;
+
+	if (argc == 1) {
+		for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+			bench(sizes[i]);
+		}
+	}
+	else if (argc == 2) {
+		bench(atoi(argv[1]));
+	}
+	else {
+		errx(1, "Usage: meldbench [kilobytes]");
+	}
+
+	if (remove(SOURCE1) < 0) {
+		warn("%s: remove", SOURCE1);
+	}
+	if (remove(SOURCE2) < 0) {
+		warn("%s: remove", SOURCE2);
+	}
+	return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * membench - time memcpy, memmove, and memset.
+ *
+ * Usage: membench [kilobytes]
+ *
+ * Copies (or fills) a buffer of the given size (default 64K) over and
+ * over, with the source and destination aligned and misaligned, and
+ * reports the throughput of each case next to that of a plain byte
+ * loop doing the same job. Each result is checked, so this doubles as
+ * a test of the unaligned paths.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_KB	64
+#define TOTAL_KB	4096	/* bytes moved per case */
+
+static unsigned char *srcbuf, *dstbuf;
+
+/*
+ * Current time in microseconds.
+ */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * The byte loops to compare against. The volatile keeps the compiler
+ * from turning them into calls to the functions being measured.
+ */
+static
+void
+bytecopy(void *dst, const void *src, size_t len)
+{
+	volatile unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		d[i] = s[i];
+	}
+}
+
+static
+void
+byteset(void *dst, int ch, size_t len)
+{
+	volatile unsigned char *d = dst;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		d[i] = ch;
+	}
+}
+
+/*
+ * Run one case: OP moves SIZE bytes to dstbuf+DOFF from srcbuf+SOFF,
+ * with OP 0 for memcpy, 1 for memmove within dstbuf (destination SOFF
+ * bytes above the source, so it copies backwards), 2 for memset.
+ * BYTES says to use the byte loop instead, which for memmove only
+ * costs the same and doesn't get the right answer. Returns KB/s.
+ */
+static
+unsigned long
+run(int op, int bytes, unsigned soff, unsigned doff, size_t size)
+{
+	unsigned long long start, usec;
+	unsigned i, reps;
+	unsigned char *d = dstbuf + doff;
+
+	reps = TOTAL_KB * 1024 / size;
+	start = now();
+	for (i=0; i<reps; i++) {
+		switch (op) {
+		    case 0:
+			if (bytes) {
+				bytecopy(d, srcbuf + soff, size);
+			}
+			else {
+				memcpy(d, srcbuf + soff, size);
+			}
+			break;
+		    case 1:
+			if (bytes) {
+				bytecopy(d + soff, d, size);
+			}
+			else {
+				memmove(d + soff, d, size);
+			}
+			break;
+		    default:
+			if (bytes) {
+				byteset(d, i, size);
+			}
+			else {
+				memset(d, i, size);
+			}
+			break;
+		}
+	}
+	usec = now() - start;
+	if (usec == 0) {
+		usec = 1;
+	}
+	return (unsigned long)
+		((unsigned long long)TOTAL_KB * 1000000 / usec);
+}
+
+/*
+ * Check that memcpy from srcbuf+SOFF to dstbuf+DOFF worked.
+ */
+static
+void
+checkcopy(unsigned soff, unsigned doff, size_t size)
+{
+	size_t i;
+
+	memset(dstbuf, 0, size + 16);
+	memcpy(dstbuf + doff, srcbuf + soff, size);
+	for (i=0; i<size; i++) {
+		if (dstbuf[doff + i] != srcbuf[soff + i]) {
+			errx(1, "memcpy (src +%u, dst +%u): wrong byte at %u",
+			     soff, doff, (unsigned)i);
+		}
+	}
+	for (i=0; i<doff; i++) {
+		if (dstbuf[i] != 0) {
+			errx(1, "memcpy (src +%u, dst +%u): wrote before",
+			     soff, doff);
+		}
+	}
+	if (dstbuf[doff + size] != 0) {
+		errx(1, "memcpy (src +%u, dst +%u): wrote after", soff, doff);
+	}
+}
+
+static
+void
+report(const char *name, unsigned soff, unsigned doff,
+       unsigned long fast, unsigned long slow)
+{
+	printf("%-8s src+%u dst+%u: %8lu KB/s  (bytes: %8lu KB/s, %lux)\n",
+	       name, soff, doff, fast, slow, slow ? fast / slow : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned offs[][2] = {
+		{ 0, 0 }, { 1, 0 }, { 0, 3 }, { 2, 1 },
+	};
+	unsigned i, kb, soff, doff;
+	size_t size;
+
+	kb = DEFAULT_KB;
+	if (argc == 2) {
+		kb = atoi(argv[1]);
+	}
+	else if (argc > 2) {
+		errx(1, "Usage: %s [kilobytes]", argv[0]);
+	}
+	if (kb == 0 || kb > TOTAL_KB) {
+		errx(1, "size must be 1 to %u kilobytes", TOTAL_KB);
+	}
+	size = kb * 1024;
+
+	srcbuf = malloc(size + 16);
+	dstbuf = malloc(size + 16);
+	if (srcbuf == NULL || dstbuf == NULL) {
+		errx(1, "out of memory");
+	}
+	for (i=0; i<size + 16; i++) {
+		srcbuf[i] = i * 7 + i / 251;
+	}
+
+	printf("membench: %u KB buffers, %u KB per case\n", kb, TOTAL_KB);
+	for (i=0; i<sizeof(offs) / sizeof(offs[0]); i++) {
+		soff = offs[i][0];
+		doff = offs[i][1];
+		checkcopy(soff, doff, size);
+		report("memcpy", soff, doff,
+		       run(0, 0, soff, doff, size),
+		       run(0, 1, soff, doff, size));
+	}
+	for (i=1; i<sizeof(offs) / sizeof(offs[0]); i++) {
+		doff = offs[i][1];
+		report("memmove", 1 + i, doff,
+		       run(1, 0, 1 + i, doff, size - 16),
+		       run(1, 1, 1 + i, doff, size - 16));
+	}
+	for (doff = 0; doff < 2; doff++) {
+		report("memset", 0, doff,
+		       run(2, 0, 0, doff, size),
+		       run(2, 1, 0, doff, size));
+	}
+
+	free(srcbuf);
+	free(dstbuf);
+	return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * mmaptest - test file mapping.
+ *
+ * Writes a file, maps it shared and checks its contents, changes it
+ * through the mapping and checks with read() after munmap that the
+ * change reached the file. Then checks that writes through a private
+ * mapping don't. Needs a VM system with mmap.
+ *
+ * Usage: mmaptest [filename]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define NPAGES	5
+#define FILESIZE	(NPAGES * 4096 - 100)	/* not page-aligned */
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(int i, int pass)
+{
+	return 'a' + (i / 7 + pass) % 26;
+}
+
+static
+void
+checkfile(int fd, int pass)
+{
+	int i, r;
+
+	r = pread(fd, buf, FILESIZE, 0);
+	if (r < 0) {
+		err(1, "pread");
+	}
+	if (r != FILESIZE) {
+		errx(1, "pread: short count %d", r);
+	}
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != pattern(i, pass)) {
+			errx(1, "file byte %d is %d, expected %d", i,
+			     buf[i], pattern(i, pass));
+		}
+	}
+}
+
+static
+char *
+mapfile(int fd, int flags)
+{
+	char *p;
+
+	p = mmap(NULL, FILESIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename;
+	char *p;
+	int fd, i, r;
+
+	filename = argc > 1 ? argv[1] : "mmapfile";
+
+	fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i, 0);
+	}
+	r = write(fd, buf, FILESIZE);
+	if (r != FILESIZE) {
+		err(1, "%s: write", filename);
+	}
+
+	printf("Checking a shared mapping...\n");
+	p = mapfile(fd, MAP_SHARED);
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i, 0)) {
+			errx(1, "mapped byte %d is %d, expected %d", i,
+			     p[i], pattern(i, 0));
+		}
+	}
+	for (i=FILESIZE; i<NPAGES * 4096; i++) {
+		if (p[i] != 0) {
+			errx(1, "mapped byte %d past EOF is %d", i, p[i]);
+		}
+	}
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 1);
+	}
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+	checkfile(fd, 1);
+
+	printf("Checking a private mapping...\n");
+	p = mapfile(fd, MAP_PRIVATE);
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 2);
+	}
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i, 2)) {
+			errx(1, "private byte %d is %d, expected %d", i,
+			     p[i], pattern(i, 2));
+		}
+	}
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+	checkfile(fd, 1);
+
+	close(fd);
+	remove(filename);
+	printf("Passed mmaptest.\n");
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * pipetest - check the pipe system call.
+ *
+ * A small write and read within one process; then a forked child
+ * writes a large buffer in one write, which the kernel hands over
+ * by lending its pages rather than through the pipe's ring, while
+ * the parent reads it back in odd-sized pieces and checks it; then
+ * EOF once the writer is gone, EPIPE once the reader is, and ESPIPE
+ * from lseek.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define BIGSIZE		(64 * 1024 + 123)
+#define READSIZE	1000
+
+static char bigbuf[BIGSIZE];
+static char readbuf[READSIZE];
+
+static
+void
+expect_err(int r, int experr, const char *what)
+{
+	if (r != -1) {
+		errx(1, "%s: succeeded (returned %d), expected error", what, r);
+	}
+	if (errno != experr) {
+		err(1, "%s: wrong error", what);
+	}
+}
+
+static
+char
+pattern(size_t i)
+{
+	return (char)(i * 7 + i / 251);
+}
+
+/*
+ * One process: write a little, read it back.
+ */
+static
+void
+smalltest(void)
+{
+	static const char msg[] = "hello through a pipe";
+	char buf[sizeof(msg)];
+	int fds[2];
+	int r;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	r = write(fds[1], msg, sizeof(msg));
+	if (r != sizeof(msg)) {
+		err(1, "small write: returned %d", r);
+	}
+	r = read(fds[0], buf, sizeof(buf));
+	if (r != sizeof(msg)) {
+		err(1, "small read: returned %d", r);
+	}
+	if (memcmp(buf, msg, sizeof(msg))) {
+		errx(1, "small read: wrong data");
+	}
+
+	expect_err(lseek(fds[0], 0, SEEK_SET), ESPIPE, "lseek on a pipe");
+	expect_err(read(fds[1], buf, 1), EBADF, "read from the write end");
+	expect_err(write(fds[0], msg, 1), EBADF, "write to the read end");
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*
+ * A child writes BIGSIZE bytes in one call; read them back and check
+ * them, then check for EOF once the child is done.
+ */
+static
+void
+bigtest(void)
+{
+	int fds[2];
+	size_t pos, i;
+	pid_t pid;
+	int r, status;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		for (i=0; i<BIGSIZE; i++) {
+			bigbuf[i] = pattern(i);
+		}
+		r = write(fds[1], bigbuf, BIGSIZE);
+		if (r != BIGSIZE) {
+			err(1, "big write: returned %d", r);
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+
+	pos = 0;
+	while ((r = read(fds[0], readbuf, READSIZE)) > 0) {
+		for (i=0; i<(size_t)r; i++) {
+			if (readbuf[i] != pattern(pos + i)) {
+				errx(1, "big read: wrong data at byte %u",
+				     (unsigned)(pos + i));
+			}
+		}
+		pos += r;
+	}
+	if (r < 0) {
+		err(1, "big read");
+	}
+	if (pos != BIGSIZE) {
+		errx(1, "big read: got %u bytes, expected %u",
+		     (unsigned)pos, (unsigned)BIGSIZE);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "writer failed");
+	}
+	close(fds[0]);
+}
+
+/*
+ * With the read end closed, writes fail.
+ */
+static
+void
+epipetest(void)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	expect_err(write(fds[1], "x", 1), EPIPE, "write with no reader");
+	close(fds[1]);
+}
+
+int
+main(void)
+{
+	smalltest();
+	bigtest();
+	epipetest();
+	printf("pipetest: passed\n");
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * polltest - check the poll system call on pipes.
+ *
+ * An empty pipe isn't readable, and poll with a timeout waits about
+ * that long and returns 0; once there's data it's readable; a pipe
+ * with room is writable; closing the other end gives POLLHUP or
+ * POLLERR; a closed descriptor gives POLLNVAL. Then a forked child
+ * writes after a delay while the parent waits in poll with no time
+ * limit, which should sleep until the data arrives and not before.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <err.h>
+
+#define TIMEOUT_MS	200
+
+/* Milliseconds since some point */
+static
+unsigned long
+msecs(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+check(int got, int want, const char *what)
+{
+	if (got != want) {
+		errx(1, "%s: got 0x%x, expected 0x%x", what, got, want);
+	}
+}
+
+static
+void
+basictest(void)
+{
+	struct pollfd pfd[2];
+	unsigned long start, took;
+	int fds[2];
+	char ch;
+	int r;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	pfd[0].fd = fds[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fds[1];
+	pfd[1].events = POLLOUT;
+
+	r = poll(pfd, 1, 0);
+	check(r, 0, "poll of an empty pipe");
+
+	start = msecs();
+	r = poll(pfd, 1, TIMEOUT_MS);
+	took = msecs() - start;
+	check(r, 0, "poll of an empty pipe with a timeout");
+	if (took < TIMEOUT_MS - 20) {
+		errx(1, "poll timed out after %lu ms, not %d", took,
+		     TIMEOUT_MS);
+	}
+
+	r = poll(pfd, 2, -1);
+	check(r, 1, "poll of both ends");
+	check(pfd[0].revents, 0, "read end of an empty pipe");
+	check(pfd[1].revents, POLLOUT, "write end of an empty pipe");
+
+	if (write(fds[1], "x", 1) != 1) {
+		err(1, "write");
+	}
+	r = poll(pfd, 2, 0);
+	check(r, 2, "poll after a write");
+	check(pfd[0].revents, POLLIN, "read end with data");
+	if (read(fds[0], &ch, 1) != 1) {
+		err(1, "read");
+	}
+
+	close(fds[1]);
+	r = poll(pfd, 1, 0);
+	check(r, 1, "poll with no writer");
+	check(pfd[0].revents, POLLHUP, "read end with no writer");
+
+	r = poll(pfd + 1, 1, 0);
+	check(r, 1, "poll of a closed descriptor");
+	check(pfd[1].revents, POLLNVAL, "closed descriptor");
+
+	pfd[1].fd = -1;
+	r = poll(pfd + 1, 1, 0);
+	check(r, 0, "poll of a negative descriptor");
+	close(fds[0]);
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	pfd[0].fd = fds[1];
+	pfd[0].events = POLLOUT;
+	r = poll(pfd, 1, 0);
+	check(r, 1, "poll with no reader");
+	check(pfd[0].revents, POLLERR, "write end with no reader");
+	close(fds[1]);
+
+	r = poll(NULL, 1, 0);
+	if (r != -1 || errno != EFAULT) {
+		errx(1, "poll of NULL: got %d, expected EFAULT", r);
+	}
+}
+
+/*
+ * Block in poll until a child writes.
+ */
+static
+void
+waketest(void)
+{
+	struct pollfd pfd;
+	unsigned long start, took;
+	int fds[2], status;
+	pid_t pid;
+	int r;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		r = poll(NULL, 0, TIMEOUT_MS);
+		if (r != 0) {
+			err(1, "child: poll as sleep");
+		}
+		if (write(fds[1], "x", 1) != 1) {
+			err(1, "child: write");
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	start = msecs();
+	r = poll(&pfd, 1, -1);
+	took = msecs() - start;
+	check(r, 1, "poll waiting for the child");
+	check(pfd.revents, POLLIN, "read end after the child's write");
+	if (took < TIMEOUT_MS - 20) {
+		errx(1, "poll returned after %lu ms, before the write", took);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	close(fds[0]);
+}
+
+int
+main(void)
+{
+	basictest();
+	waketest();
+	printf("polltest: passed\n");
+	return 0;
+}
@@ -34,6 +34,10 @@
  * because of various limitations of OS/161 it is massively
  * inefficient. But that's ok; the goal is to stress the VM and buffer
  * cache.
+ *
+ * It also serves as a benchmark: each phase is timed, and at the end
+ * the times are printed along with the throughput of the phases that
+ * stream the whole data set through the file system.
  */
 
 #include <sys/types.h>
@@ -92,26 +96,29 @@
  * currently corresponds to about 13-14 minutes of real time.
  *
  * Note that the parent psort process serves as a director and doesn't
- * itself compute; it has a workspace (because it's a static buffer)
- * but doesn't use it. A VM system that doesn't do zerofill
- * optimization will be a lot slower because it has to copy this space
- * for every batch of forks.
+ * itself compute; it has a workspace (allocated before forking) but
+ * doesn't use it. A VM system that doesn't do zerofill optimization
+ * will be a lot slower because it has to copy this space for every
+ * batch of forks.
  *
- * Also note that you can set numprocs and numkeys on the command
- * line, but not WORKNUM.
+ * You can set numprocs (-p), numkeys (-k), and the workspace size in
+ * integers (-w) on the command line. The workspace is malloc'd, so
+ * this depends on malloc working.
  *
- * FUTURE: maybe make a build option to malloc the work space instead
- * of using a static buffer, which would allow choosing WORKNUM on the
- * command line too, at the cost of depending on malloc working.
+ * Each process also keeps a BINBUF-integer buffer for each bin when
+ * tossing keys into bins and when merging them, so those phases
+ * move data in blocks instead of one integer per system call.
  */
 
 /* Set the workload size. */
 #define WORKNUM      (96*1024)
+#define BINBUF       1024
 static int numprocs = 4;
 static int numkeys = 128*1024;
+static int worknum = WORKNUM;
 
 /* Per-process work buffer */
-static int workspace[WORKNUM];
+static int *workspace;
 
 /* Random seed for generating the data */
 static long randomseed = 15432753;
@@ -128,53 +135,20 @@ static const char *progname;
 ////////////////////////////////////////////////////////////
 
 static
-void
-sortints(int *v, int num)
+int
+compareints(const void *av, const void *bv)
 {
-	int pivotval, pivotpoint, pivotcount;
-	int frontpos, readpos, endpos, i, j;
-	int tmp;
-
-	if (num < 2) {
-		return;
-	}
-
-	pivotpoint = num/2;
-	pivotval = v[pivotpoint];
-	pivotcount = 0;
+	int a = *(const int *)av;
+	int b = *(const int *)bv;
 
-	frontpos = 0;
-	readpos = 0;
-	endpos = num;
-	while (readpos < endpos) {
-		if (v[readpos] < pivotval) {
-			v[frontpos++] = v[readpos++];
-		}
-		else if (v[readpos] == pivotval) {
-			readpos++;
-			pivotcount++;
-		}
-		else {
-			tmp = v[--endpos];
-			v[endpos] = v[readpos];
-			v[readpos] = tmp;
-		}
-	}
-	assert(readpos == endpos);
-	assert(frontpos + pivotcount == readpos);
-
-	for (i=frontpos; i<endpos; i++) {
-		v[i] = pivotval;
-	}
-
-	for (i=endpos, j=num-1; i<j; i++,j--) {
-		tmp = v[i];
-		v[i] = v[j];
-		v[j] = tmp;
-	}
+	return a < b ? -1 : a > b ? 1 : 0;
+}
 
-	sortints(v, frontpos);
-	sortints(&v[endpos], num-endpos);
+static
+void
+sortints(int *v, int num)
+{
+	qsort(v, num, sizeof(int), compareints);
 }
 
 ////////////////////////////////////////////////////////////
@@ -461,6 +435,98 @@ dofork(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Phase timing. PASSES is how many times the phase reads or writes
+ * the whole data set, counting reads and writes separately; it's 0
+ * for the sort, which is bound by computation and not I/O, so it gets
+ * no throughput figure.
+ */
+enum {
+	PH_GENKEYS,
+	PH_SUM,
+	PH_BIN,
+	PH_SORT,
+	PH_MERGE,
+	PH_ASSEMBLE,
+	PH_SUMSORTED,
+	PH_VALIDATE,
+	PH_NUM
+};
+
+static struct {
+	const char *name;
+	unsigned passes;
+	unsigned long long usec;
+} phases[PH_NUM] = {
+	{ "genkeys",	1, 0 },
+	{ "checksum",	1, 0 },
+	{ "bin",	2, 0 },
+	{ "sortbins",	0, 0 },
+	{ "mergebins",	2, 0 },
+	{ "assemble",	2, 0 },
+	{ "recheck",	1, 0 },
+	{ "validate",	1, 0 },
+};
+
+static unsigned long long phasestart;
+
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		complain("__time");
+		exit(1);
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+void
+phase_begin(void)
+{
+	phasestart = now();
+}
+
+static
+void
+phase_end(int ph)
+{
+	phases[ph].usec += now() - phasestart;
+}
+
+static
+void
+printtimes(void)
+{
+	unsigned long long usec, total, kbps;
+	int i;
+
+	printf("Phase times for %d keys (%lluK) using %d procs:\n",
+	       numkeys, (unsigned long long)correctsize / 1024, numprocs);
+	total = 0;
+	for (i=0; i<PH_NUM; i++) {
+		usec = phases[i].usec;
+		total += usec;
+		printf("   %-10s %6llu.%03llu sec", phases[i].name,
+		       usec / 1000000, (usec / 1000) % 1000);
+		if (phases[i].passes > 0 && usec > 0) {
+			kbps = (unsigned long long)correctsize *
+				phases[i].passes * 1000000 / usec / 1024;
+			printf("  %4llu.%02llu MB/s", kbps / 1024,
+			       (kbps % 1024) * 100 / 1024);
+		}
+		printf("\n");
+	}
+	printf("   %-10s %6llu.%03llu sec\n", "total",
+	       total / 1000000, (total / 1000) % 1000);
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 dowait(int guy, pid_t pid)
@@ -587,8 +653,8 @@ genkeys_sub(void)
 	keys_done = 0;
 	while (keys_done < mykeys) {
 		keys_to_do = mykeys - keys_done;
-		if (keys_to_do > WORKNUM) {
-			keys_to_do = WORKNUM;
+		if (keys_to_do > worknum) {
+			keys_to_do = worknum;
 		}
 
 		for (i=0; i<keys_to_do; i++) {
@@ -632,7 +698,9 @@ genkeys(void)
 	/* Do it. */
 	complainx("Generating %d integers using %d procs", numkeys, numprocs);
 	seeds = seedspace;
+	phase_begin();
 	doforkall("Initialization", genkeys_sub);
+	phase_end(PH_GENKEYS);
 	seeds = NULL;
 
 	/* Cross-check the size of the output. */
@@ -643,7 +711,9 @@ genkeys(void)
 
 	/* Checksum the output. */
 	complainx("Checksumming the data (using one proc)");
+	phase_begin();
 	checksum = checksum_file(PATH_KEYS);
+	phase_end(PH_SUM);
 	complainx("Checksum of unsorted keys: %ld", checksum);
 }
 
@@ -667,11 +737,30 @@ mergedname(int a)
 	return rv;
 }
 
+/*
+ * Allocate the per-bin buffers for bin() and mergebins().
+ */
+static
+int *
+allocbinbufs(void)
+{
+	int *bufs;
+
+	bufs = malloc(numprocs * BINBUF * sizeof(int));
+	if (bufs == NULL) {
+		complainx("Out of memory for bin buffers");
+		exit(1);
+	}
+	return bufs;
+}
+
 static
 void
 bin(void)
 {
 	int infd, outfds[numprocs];
+	int outcounts[numprocs];
+	int *outbufs;
 	const char *name;
 	int i, mykeys, keys_done, keys_to_do;
 	int key, pivot, binnum;
@@ -681,9 +770,11 @@ bin(void)
 	mykeys = getmykeys();
 	seekmyplace(PATH_KEYS, infd);
 
+	outbufs = allocbinbufs();
 	for (i=0; i<numprocs; i++) {
 		name = binname(me, i);
 		outfds[i] = doopen(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+		outcounts[i] = 0;
 	}
 
 	pivot = (RANDOM_MAX / numprocs);
@@ -691,8 +782,8 @@ bin(void)
 	keys_done = 0;
 	while (keys_done < mykeys) {
 		keys_to_do = mykeys - keys_done;
-		if (keys_to_do > WORKNUM) {
-			keys_to_do = WORKNUM;
+		if (keys_to_do > worknum) {
+			keys_to_do = worknum;
 		}
 
 		doexactread(PATH_KEYS, infd, workspace,
@@ -708,7 +799,13 @@ bin(void)
 			}
 			assert(binnum >= 0);
 			assert(binnum < numprocs);
-			dowrite("bin", outfds[binnum], &key, sizeof(key));
+			outbufs[binnum*BINBUF + outcounts[binnum]++] = key;
+			if (outcounts[binnum] == BINBUF) {
+				dowrite("bin", outfds[binnum],
+					&outbufs[binnum*BINBUF],
+					BINBUF * sizeof(int));
+				outcounts[binnum] = 0;
+			}
 		}
 
 		keys_done += keys_to_do;
@@ -716,8 +813,11 @@ bin(void)
 	doclose(PATH_KEYS, infd);
 
 	for (i=0; i<numprocs; i++) {
+		dowrite("bin", outfds[i], &outbufs[i*BINBUF],
+			outcounts[i] * sizeof(int));
 		doclose(binname(me, i), outfds[i]);
 	}
+	free(outbufs);
 }
 
 static
@@ -736,7 +836,7 @@ sortbins(void)
 				  (long) binsize);
 			exit(1);
 		}
-		if (binsize > (off_t) sizeof(workspace)) {
+		if (binsize > (off_t) (worknum * sizeof(int))) {
 			complainx("proc %d: %s: bin too large", me, name);
 			exit(1);
 		}
@@ -758,21 +858,27 @@ mergebins(void)
 {
 	int infds[numprocs], outfd;
 	int values[numprocs], ready[numprocs];
+	int inpos[numprocs], incounts[numprocs];
+	int *inbufs;
 	const char *name, *outname;
-	int i, result;
-	int numready, place, val, worknum;
+	int i;
+	size_t result;
+	int numready, place, val, numout;
 
 	outname = mergedname(me);
 	outfd = doopen(outname, O_WRONLY|O_CREAT|O_TRUNC, 0664);
 
+	inbufs = allocbinbufs();
 	for (i=0; i<numprocs; i++) {
 		name = binname(i, me);
 		infds[i] = doopen(name, O_RDONLY, 0);
 		values[i] = 0;
 		ready[i] = 0;
+		inpos[i] = 0;
+		incounts[i] = 0;
 	}
 
-	worknum = 0;
+	numout = 0;
 
 	while (1) {
 		numready = 0;
@@ -781,20 +887,25 @@ mergebins(void)
 				continue;
 			}
 
-			if (!ready[i]) {
+			if (!ready[i] && inpos[i] == incounts[i]) {
 				result = doread("bin", infds[i],
-						&val, sizeof(int));
+						&inbufs[i*BINBUF],
+						BINBUF * sizeof(int));
 				if (result == 0) {
 					doclose("bin", infds[i]);
 					infds[i] = -1;
 					continue;
 				}
-				if ((size_t) result != sizeof(int)) {
+				if (result % sizeof(int) != 0) {
 					complainx("%s: read: short count",
 						  binname(i, me));
 					exit(1);
 				}
-				values[i] = val;
+				inpos[i] = 0;
+				incounts[i] = result / sizeof(int);
+			}
+			if (!ready[i]) {
+				values[i] = inbufs[i*BINBUF + inpos[i]++];
 				ready[i] = 1;
 			}
 			numready++;
@@ -816,22 +927,23 @@ mergebins(void)
 		}
 		assert(place >= 0);
 
-		workspace[worknum++] = val;
-		if (worknum >= WORKNUM) {
-			assert(worknum == WORKNUM);
+		workspace[numout++] = val;
+		if (numout >= worknum) {
+			assert(numout == worknum);
 			dowrite(outname, outfd, workspace,
-				worknum * sizeof(int));
-			worknum = 0;
+				numout * sizeof(int));
+			numout = 0;
 		}
 		ready[place] = 0;
 	}
 
-	dowrite(outname, outfd, workspace, worknum * sizeof(int));
+	dowrite(outname, outfd, workspace, numout * sizeof(int));
 	doclose(outname, outfd);
 
 	for (i=0; i<numprocs; i++) {
 		assert(infds[i] < 0);
 	}
+	free(inbufs);
 }
 
 static
@@ -913,21 +1025,27 @@ sort(void)
 	/* Step 1. Toss into bins. */
 	complainx("Tossing into %d bins using %d procs",
 		  numprocs*numprocs, numprocs);
+	phase_begin();
 	doforkall("Tossing", bin);
+	phase_end(PH_BIN);
 	checksize_bins();
 	complainx("Done tossing into bins.");
 
 	/* Step 2: Sort the bins. */
 	complainx("Sorting %d bins using %d procs",
 		  numprocs*numprocs, numprocs);
+	phase_begin();
 	doforkall("Sorting", sortbins);
+	phase_end(PH_SORT);
 	checksize_bins();
 	complainx("Done sorting the bins.");
 
 	/* Step 3: Merge corresponding bins. */
 	complainx("Merging %d bins using %d procs",
 		  numprocs*numprocs, numprocs);
+	phase_begin();
 	doforkall("Merging", mergebins);
+	phase_end(PH_MERGE);
 	checksize_merge();
 	complainx("Done merging the bins.");
 
@@ -941,7 +1059,9 @@ sort(void)
 	/* Step 4: assemble output file */
 	complainx("Assembling output file using %d procs", numprocs);
 	docreate(PATH_SORTED);
+	phase_begin();
 	doforkall("Final assembly", assemble);
+	phase_end(PH_ASSEMBLE);
 	if (getsize(PATH_SORTED) != correctsize) {
 		complainx("%s: file is wrong size", PATH_SORTED);
 		exit(1);
@@ -954,7 +1074,9 @@ sort(void)
 
 	/* Step 5: Checksum the result. */
 	complainx("Checksumming the output (using one proc)");
+	phase_begin();
 	sortedsum = checksum_file(PATH_SORTED);
+	phase_end(PH_SUMSORTED);
 	complainx("Checksum of sorted keys: %ld", sortedsum);
 
 	if (sortedsum != checksum) {
@@ -1015,8 +1137,8 @@ dovalidate(void)
 	keys_done = 0;
 	while (keys_done < mykeys) {
 		keys_to_do = mykeys - keys_done;
-		if (keys_to_do > WORKNUM) {
-			keys_to_do = WORKNUM;
+		if (keys_to_do > worknum) {
+			keys_to_do = worknum;
 		}
 
 		doexactread(name, fd, workspace, keys_to_do * sizeof(int));
@@ -1065,7 +1187,9 @@ validate(void)
 	const char *name;
 
 	complainx("Validating the sorted data using %d procs", numprocs);
+	phase_begin();
 	doforkall("Validation", dovalidate);
+	phase_end(PH_VALIDATE);
 	checksize_valid();
 
 	prev_largest = 1;
@@ -1152,7 +1276,8 @@ static
 void
 usage(void)
 {
-	complain("Usage: %s [-p procs] [-k keys] [-s seed] [-r]", progname);
+	complainx("Usage: %s [-p procs] [-k keys] [-w worknum] [-s seed] [-r]",
+		  progname);
 	exit(1);
 }
 
@@ -1171,6 +1296,7 @@ doargs(int argc, char *argv[])
 		switch (ch) {
 		    case 'p': arg = 1; break;
 		    case 'k': arg = 1; break;
+		    case 'w': arg = 1; break;
 		    case 's': arg = 1; break;
 		    case 'r': arg = 0; break;
 		    default: usage(); return;
@@ -1191,6 +1317,7 @@ doargs(int argc, char *argv[])
 			switch (ch) {
 			    case 'p': numprocs = val; break;
 			    case 'k': numkeys = val; break;
+			    case 'w': worknum = val; break;
 			    case 's': randomseed = val; break;
 			    default: assert(0); break;
 			}
@@ -1210,14 +1337,24 @@ main(int argc, char *argv[])
 	initprogname(argc > 0 ? argv[0] : NULL);
 
 	doargs(argc, argv);
+	if (numprocs < 1 || numkeys < numprocs || worknum < 1) {
+		usage();
+	}
 	correctsize = (off_t) (numkeys*sizeof(int));
 
+	workspace = malloc(worknum * sizeof(int));
+	if (workspace == NULL) {
+		complainx("Out of memory for %d-integer workspace", worknum);
+		exit(1);
+	}
+
 	setdir();
 
 	genkeys();
 	sort();
 	validate();
 	complainx("Succeeded.");
+	printtimes();
 
 	unsetdir();
 
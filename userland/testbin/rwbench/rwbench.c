@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rwbench - read/write system call microbenchmark.
+ *
+ * Usage: rwbench [filename]
+ *
+ * For each of a range of transfer sizes, writes a file with calls of
+ * that size and then reads it back, and reports system calls per
+ * second and kilobytes per second for each. The small sizes measure
+ * the per-call overhead of the read/write path; the large ones its
+ * throughput. The file (default "rwbench.tmp") is removed at the end.
+ *
+ * Run it on the file system you care about, e.g. "rwbench emu0:x"
+ * or "rwbench lhd1:x".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/* Largest transfer, and how much data each size moves in all */
+#define MAXSIZE		(256*1024)
+#define TOTAL		(1024*1024)
+
+/* Most calls to make at one size, so the small sizes don't take forever */
+#define MAXCALLS	4096
+
+static char buf[MAXSIZE];
+
+static const unsigned sizes[] = {
+	1, 16, 512, 4096, 16384, 65536, MAXSIZE,
+};
+
+/*
+ * Current time in microseconds.
+ */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * Print one result line.
+ */
+static
+void
+report(const char *what, unsigned size, unsigned calls,
+       unsigned long long usec)
+{
+	unsigned long long kb;
+
+	if (usec == 0) {
+		usec = 1;
+	}
+	kb = (unsigned long long)size * calls / 1024;
+	printf("%-5s %7u bytes x %5u: %8llu calls/sec, %8llu KB/sec\n",
+	       what, size, calls, calls * 1000000ULL / usec,
+	       kb * 1000000ULL / usec);
+}
+
+/*
+ * Write and then read back the file in calls of SIZE bytes.
+ */
+static
+void
+bench(const char *filename, unsigned size)
+{
+	unsigned long long start;
+	unsigned calls, i;
+	int fd, r;
+
+	calls = TOTAL / size;
+	if (calls > MAXCALLS) {
+		calls = MAXCALLS;
+	}
+
+	fd = open(filename, O_RDWR|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+
+	start = now();
+	for (i=0; i<calls; i++) {
+		r = write(fd, buf, size);
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if ((unsigned)r != size) {
+			errx(1, "%s: write: short count %d", filename, r);
+		}
+	}
+	report("write", size, calls, now() - start);
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		err(1, "%s: lseek", filename);
+	}
+
+	start = now();
+	for (i=0; i<calls; i++) {
+		r = read(fd, buf, size);
+		if (r < 0) {
+			err(1, "%s: read", filename);
+		}
+		if ((unsigned)r != size) {
+			errx(1, "%s: read: short count %d", filename, r);
+		}
+	}
+	report("read", size, calls, now() - start);
+
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename;
+	unsigned i;
+
+	if (argc == 1) {
+		filename = "rwbench.tmp";
+	}
+	else if (argc == 2) {
+		filename = argv[1];
+	}
+	else {
+		errx(1, "Usage: rwbench [filename]");
+	}
+
+	memset(buf, 'x', sizeof(buf));
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		bench(filename, sizes[i]);
+	}
+
+	if (remove(filename) < 0) {
+		warn("%s: remove", filename);
+	}
+	return 0;
+}
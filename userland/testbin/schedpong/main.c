@@ -40,6 +40,7 @@
 #include "usem.h"
 #include "tasks.h"
 #include "results.h"
+#include "wakeups.h"
 
 #define STARTSEM "sem:start"
 
@@ -224,6 +225,7 @@ runit(unsigned numthinkers, unsigned numgrinders,
       unsigned numponggroups, unsigned ponggroupsize)
 {
 	pid_t pids[numponggroups + 2];
+	struct wakehist wh, total;
 	time_t startsecs;
 	unsigned long startnsecs;
 	char buf[32];
@@ -270,6 +272,20 @@ runit(unsigned numthinkers, unsigned numgrinders,
 
 	closeresultsfile();
 	destroyresultsfile();
+
+	if (numponggroups > 0) {
+		printf("--- Wakeup latency ---\n");
+		bzero(&total, sizeof(total));
+		for (i=0; i<numponggroups; i++) {
+			bzero(&wh, sizeof(wh));
+			getwakehist(i+2, &wh);
+			destroywakefile(i+2);
+			snprintf(buf, sizeof(buf), "Pong group %u", i);
+			printwakehist(buf, &wh);
+			addwakehist(&total, &wh);
+		}
+		printwakehist("All pong groups", &total);
+	}
 }
 
 static
@@ -38,8 +38,9 @@
 
 #include "usem.h"
 #include "tasks.h"
+#include "wakeups.h"
 
-#define MAXCOUNT 64
+#define MAXCOUNT WAKE_MAXPROCS
 #define PONGLOOPS 1000
 //#define VERBOSE_PONG
 
@@ -67,6 +68,7 @@ pong_prep(unsigned groupid, unsigned count)
 		usem_init(&sems[i], "sem:pong-%u-%u", groupid, i);
 	}
 	nsems = count;
+	createwakefile(groupid, count);
 }
 
 void
@@ -98,6 +100,7 @@ pong_cyclic(unsigned id)
 	for (i=0; i<PONGLOOPS; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			wakedone(id);
 		}
 #ifdef VERBOSE_PONG
 		printf(" %u", id);
@@ -106,10 +109,12 @@ pong_cyclic(unsigned id)
 			putchar('.');
 		}
 #endif
+		wakestamp(nextid);
 		V(&sems[nextid]);
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		wakedone(id);
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -149,6 +154,7 @@ pong_reciprocating(unsigned id)
 	for (i=0; i<n; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			wakedone(id);
 		}
 #ifdef VERBOSE_PONG
 		printf(" %u", id);
@@ -158,16 +164,19 @@ pong_reciprocating(unsigned id)
 		}
 #endif
 		if (gofwd) {
+			wakestamp(nextfwd);
 			V(&sems[nextfwd]);
 			gofwd = 0;
 		}
 		else {
+			wakestamp(nextback);
 			V(&sems[nextback]);
 			gofwd = 1;
 		}
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		wakedone(id);
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -186,13 +195,12 @@ pong(unsigned groupid, unsigned id)
 {
 	unsigned idfwd, idback;
 
-	(void)groupid;
-
 	idfwd = (id + 1) % nsems;
 	idback = (id + nsems - 1) % nsems;
 	usem_open(&sems[id]);
 	usem_open(&sems[idfwd]);
 	usem_open(&sems[idback]);
+	(void)mapwakefile(groupid);
 
 	waitstart();
 	pong_cyclic(id);
@@ -205,6 +213,7 @@ pong(unsigned groupid, unsigned id)
 #endif
 	pong_cyclic(id);
 
+	unmapwakefile();
 	usem_close(&sems[id]);
 	usem_close(&sems[idfwd]);
 	usem_close(&sems[idback]);
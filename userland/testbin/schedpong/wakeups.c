@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "wakeups.h"
+
+/*
+ * The histogram buckets are exact below WAKE_EXACT microseconds and
+ * then four to each power of two, so a bucket is within 25% of the
+ * values in it. 128 buckets reach past 2^31.
+ */
+#define WAKE_EXACT 8
+
+struct wakefile {
+	uint64_t wf_stamps[WAKE_MAXPROCS];	/* usec, at the V */
+	struct wakehist wf_hists[WAKE_MAXPROCS];
+};
+
+static struct wakefile *wakefile;
+
+static
+const char *
+wakefilename(unsigned groupid)
+{
+	static char name[32];
+
+	snprintf(name, sizeof(name), "wakeups-%u", groupid);
+	return name;
+}
+
+static
+uint64_t
+wakenow(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (uint64_t)secs * 1000000 + nsecs / 1000;
+}
+
+static
+unsigned
+wakebucket(unsigned usec)
+{
+	unsigned e, v;
+
+	if (usec < WAKE_EXACT) {
+		return usec;
+	}
+	/* e = floor(log2(usec)) */
+	for (e = 0, v = usec; v > 1; v >>= 1) {
+		e++;
+	}
+	return WAKE_EXACT + (e - 3) * 4 + ((usec >> (e - 2)) & 3);
+}
+
+/* The largest value that goes in bucket B. */
+static
+unsigned
+wakebucketmax(unsigned b)
+{
+	unsigned e, sub;
+
+	if (b < WAKE_EXACT) {
+		return b;
+	}
+	e = 3 + (b - WAKE_EXACT) / 4;
+	sub = (b - WAKE_EXACT) % 4;
+	return ((4 + sub + 1) << (e - 2)) - 1;
+}
+
+/*
+ * Create a group's file. This is done in the group's director
+ * process, before forking the group.
+ */
+void
+createwakefile(unsigned groupid, unsigned count)
+{
+	const char *name;
+	int fd;
+
+	if (count > WAKE_MAXPROCS) {
+		errx(1, "wakeups: too many pongers -- recompile wakeups.h");
+	}
+	name = wakefilename(groupid);
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	if (ftruncate(fd, sizeof(struct wakefile)) == -1) {
+		err(1, "%s: ftruncate", name);
+	}
+	if (close(fd) == -1) {
+		warn("%s: close", name);
+	}
+}
+
+/*
+ * Remove a group's file. This is done at the end, in the main
+ * process, after reading it.
+ */
+void
+destroywakefile(unsigned groupid)
+{
+	const char *name;
+
+	name = wakefilename(groupid);
+	if (remove(name) == -1) {
+		if (errno != ENOSYS) {
+			warn("%s: remove", name);
+		}
+	}
+}
+
+/*
+ * Map the group's file, in each pong process. Returns -1 if the
+ * kernel can't; then no times are kept.
+ */
+int
+mapwakefile(unsigned groupid)
+{
+	const char *name;
+	void *p;
+	int fd;
+
+	assert(wakefile == NULL);
+
+	name = wakefilename(groupid);
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	p = mmap(NULL, sizeof(struct wakefile), PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+	if (close(fd) == -1) {
+		warn("%s: close", name);
+	}
+	if (p == MAP_FAILED) {
+		warn("%s: mmap; not timing wakeups", name);
+		return -1;
+	}
+	wakefile = p;
+	return 0;
+}
+
+void
+unmapwakefile(void)
+{
+	if (wakefile == NULL) {
+		return;
+	}
+	if (munmap(wakefile, sizeof(struct wakefile)) == -1) {
+		warn("wakeups: munmap");
+	}
+	wakefile = NULL;
+}
+
+/*
+ * Called just before V on the semaphore of process ID.
+ */
+void
+wakestamp(unsigned id)
+{
+	if (wakefile != NULL) {
+		wakefile->wf_stamps[id] = wakenow();
+	}
+}
+
+/*
+ * Called by process ID just after its P returns.
+ */
+void
+wakedone(unsigned id)
+{
+	struct wakehist *wh;
+	uint64_t now, then;
+	unsigned usec;
+
+	if (wakefile == NULL) {
+		return;
+	}
+	now = wakenow();
+	then = wakefile->wf_stamps[id];
+	if (then == 0 || then > now) {
+		/* The first go, or the mapping isn't really shared */
+		return;
+	}
+	usec = now - then;
+	wakefile->wf_stamps[id] = 0;
+	wh = &wakefile->wf_hists[id];
+	wh->wh_count++;
+	wh->wh_buckets[wakebucket(usec)]++;
+	if (usec > wh->wh_max) {
+		wh->wh_max = usec;
+	}
+}
+
+/*
+ * Add one histogram into another.
+ */
+void
+addwakehist(struct wakehist *total, const struct wakehist *wh)
+{
+	unsigned b;
+
+	total->wh_count += wh->wh_count;
+	if (wh->wh_max > total->wh_max) {
+		total->wh_max = wh->wh_max;
+	}
+	for (b=0; b<WAKE_BUCKETS; b++) {
+		total->wh_buckets[b] += wh->wh_buckets[b];
+	}
+}
+
+/*
+ * Add up a group's histograms into TOTAL, in the main process.
+ */
+void
+getwakehist(unsigned groupid, struct wakehist *total)
+{
+	static struct wakefile wf;
+	const char *name;
+	ssize_t r;
+	unsigned i;
+	int fd;
+
+	name = wakefilename(groupid);
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	r = read(fd, &wf, sizeof(wf));
+	if (r < 0) {
+		err(1, "%s: read", name);
+	}
+	if ((size_t)r < sizeof(wf)) {
+		errx(1, "%s: read: Unexpected EOF", name);
+	}
+	if (close(fd) == -1) {
+		warn("%s: close", name);
+	}
+	for (i=0; i<WAKE_MAXPROCS; i++) {
+		addwakehist(total, &wf.wf_hists[i]);
+	}
+}
+
+/*
+ * The value at fraction NUM/DENOM of the way through the histogram.
+ */
+static
+unsigned
+wakepercentile(const struct wakehist *wh, unsigned num, unsigned denom)
+{
+	unsigned long long want, seen;
+	unsigned b;
+
+	want = ((unsigned long long)wh->wh_count * num + denom - 1) / denom;
+	seen = 0;
+	for (b=0; b<WAKE_BUCKETS; b++) {
+		seen += wh->wh_buckets[b];
+		if (seen >= want) {
+			break;
+		}
+	}
+	if (b == WAKE_BUCKETS || wakebucketmax(b) > wh->wh_max) {
+		return wh->wh_max;
+	}
+	return wakebucketmax(b);
+}
+
+void
+printwakehist(const char *name, const struct wakehist *wh)
+{
+	if (wh->wh_count == 0) {
+		printf("%s: no wakeups timed\n", name);
+		return;
+	}
+	printf("%s: %u wakeups, median %u us, p99 %u us, max %u us\n",
+	       name, wh->wh_count, wakepercentile(wh, 50, 100),
+	       wakepercentile(wh, 99, 100), wh->wh_max);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Wakeup latency: the time from a V to the process it wakes coming
+ * back from its P. Each pong group has a file of its own that its
+ * processes map shared; the one doing a V stamps the time in the
+ * wakee's slot first, and the wakee charges the difference to its
+ * histogram when it runs.
+ */
+
+#define WAKE_MAXPROCS	64	/* per group */
+#define WAKE_BUCKETS	128
+
+struct wakehist {
+	unsigned wh_count;
+	unsigned wh_max;			/* usec */
+	unsigned wh_buckets[WAKE_BUCKETS];
+};
+
+void createwakefile(unsigned groupid, unsigned count);
+void destroywakefile(unsigned groupid);
+int mapwakefile(unsigned groupid);
+void unmapwakefile(void);
+void wakestamp(unsigned id);
+void wakedone(unsigned id);
+void addwakehist(struct wakehist *total, const struct wakehist *wh);
+void getwakehist(unsigned groupid, struct wakehist *total);
+void printwakehist(const char *name, const struct wakehist *wh);
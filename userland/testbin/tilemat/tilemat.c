@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * tilemat - cache-blocked, multi-process matrix multiply.
+ *
+ * Usage: tilemat [-n dim] [-b block] [-p procs]
+ *
+ * Multiplies two dim x dim matrices (default 128) in blocks of
+ * block x block elements (default 16), with procs processes (default
+ * 1) each computing a band of rows of the result. The matrices are
+ * set up before forking, so the workers share them copy-on-write
+ * and each one copies just the pages of its own band of the result.
+ * A block size of 0 runs the plain triple loop instead, which walks
+ * down the columns of the second matrix the way matmult does; the
+ * difference between the two is the memory layout effect, and what's
+ * left in the blocked run is the VM system.
+ *
+ * Reports the elapsed time, the rate in millions of operations per
+ * second (a multiply and an add count as two), and the workers'
+ * fault counts from getrusage, in which every TLB miss counts as a
+ * minor fault. The arithmetic is unsigned integer arithmetic, as
+ * there is no floating point; each worker checks the sum of its band
+ * against one computed from the row and column sums.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_DIM	128
+#define DEFAULT_BLOCK	16
+#define DEFAULT_PROCS	1
+#define MAXPROCS	32
+
+static unsigned dim, block, nprocs;
+static unsigned *A, *B, *C;
+
+#define ELT(m, i, j) ((m)[(i) * dim + (j)])
+
+static
+unsigned
+min(unsigned a, unsigned b)
+{
+	return a < b ? a : b;
+}
+
+/*
+ * Current time in microseconds.
+ */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * Rows LO to HI of C = A * B, the plain way.
+ */
+static
+void
+mult_plain(unsigned lo, unsigned hi)
+{
+	unsigned i, j, k, sum;
+
+	for (i = lo; i < hi; i++) {
+		for (j = 0; j < dim; j++) {
+			sum = 0;
+			for (k = 0; k < dim; k++) {
+				sum += ELT(A, i, k) * ELT(B, k, j);
+			}
+			ELT(C, i, j) = sum;
+		}
+	}
+}
+
+/*
+ * C[i][j] += A[i][k] * B[k][j] over one block of each index. The
+ * inner loop runs along a row of B and a row of C.
+ */
+static
+void
+mult_block(unsigned ii, unsigned iend, unsigned kk, unsigned kend,
+	   unsigned jj, unsigned jend)
+{
+	unsigned i, j, k, a;
+
+	for (i = ii; i < iend; i++) {
+		for (k = kk; k < kend; k++) {
+			a = ELT(A, i, k);
+			for (j = jj; j < jend; j++) {
+				ELT(C, i, j) += a * ELT(B, k, j);
+			}
+		}
+	}
+}
+
+/*
+ * Rows LO to HI of C = A * B, a block at a time, so each block of B
+ * is used for a whole block of rows before moving on.
+ */
+static
+void
+mult_blocked(unsigned lo, unsigned hi)
+{
+	unsigned ii, jj, kk, i, j;
+
+	for (i = lo; i < hi; i++) {
+		for (j = 0; j < dim; j++) {
+			ELT(C, i, j) = 0;
+		}
+	}
+	for (ii = lo; ii < hi; ii += block) {
+		for (kk = 0; kk < dim; kk += block) {
+			for (jj = 0; jj < dim; jj += block) {
+				mult_block(ii, min(ii + block, hi),
+					   kk, min(kk + block, dim),
+					   jj, min(jj + block, dim));
+			}
+		}
+	}
+}
+
+/*
+ * Check rows LO to HI of C. Their sum is the sum over k of (the sum
+ * of column k of A over those rows) times (the sum of row k of B).
+ */
+static
+int
+check(unsigned lo, unsigned hi)
+{
+	unsigned i, j, k, colsum, rowsum, want, got;
+
+	want = got = 0;
+	for (k = 0; k < dim; k++) {
+		colsum = rowsum = 0;
+		for (i = lo; i < hi; i++) {
+			colsum += ELT(A, i, k);
+		}
+		for (j = 0; j < dim; j++) {
+			rowsum += ELT(B, k, j);
+		}
+		want += colsum * rowsum;
+	}
+	for (i = lo; i < hi; i++) {
+		for (j = 0; j < dim; j++) {
+			got += ELT(C, i, j);
+		}
+	}
+	return got == want;
+}
+
+static
+void
+worker(unsigned me)
+{
+	unsigned lo, hi;
+
+	lo = me * dim / nprocs;
+	hi = (me + 1) * dim / nprocs;
+	if (block == 0) {
+		mult_plain(lo, hi);
+	}
+	else {
+		mult_blocked(lo, hi);
+	}
+	if (!check(lo, hi)) {
+		warnx("worker %u: rows %u-%u are wrong", me, lo, hi - 1);
+		_exit(1);
+	}
+	_exit(0);
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: tilemat [-n dim] [-b block] [-p procs]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct rusage before, after;
+	unsigned long long start, usec, ops, rate;
+	pid_t pids[MAXPROCS];
+	unsigned i, j, failed;
+	int status, val;
+
+	dim = DEFAULT_DIM;
+	block = DEFAULT_BLOCK;
+	nprocs = DEFAULT_PROCS;
+	for (i = 1; i < (unsigned)argc; i++) {
+		if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0 ||
+		    i + 1 == (unsigned)argc) {
+			usage();
+		}
+		val = atoi(argv[i + 1]);
+		switch (argv[i][1]) {
+		    case 'n': dim = val; break;
+		    case 'b': block = val; break;
+		    case 'p': nprocs = val; break;
+		    default: usage(); break;
+		}
+		i++;
+	}
+	if (dim == 0 || nprocs == 0 || nprocs > MAXPROCS || nprocs > dim) {
+		errx(1, "need 1 to %u procs and at least one row each",
+		     MAXPROCS);
+	}
+
+	A = malloc(dim * dim * sizeof(unsigned));
+	B = malloc(dim * dim * sizeof(unsigned));
+	C = malloc(dim * dim * sizeof(unsigned));
+	if (A == NULL || B == NULL || C == NULL) {
+		errx(1, "out of memory for %ux%u matrices", dim, dim);
+	}
+	for (i = 0; i < dim; i++) {
+		for (j = 0; j < dim; j++) {
+			ELT(A, i, j) = i + 2 * j + 1;
+			ELT(B, i, j) = (i ^ j) + 3;
+		}
+	}
+
+	printf("tilemat: %ux%u, ", dim, dim);
+	if (block == 0) {
+		printf("unblocked");
+	}
+	else {
+		printf("%ux%u blocks", block, block);
+	}
+	printf(", %u procs\n", nprocs);
+
+	if (getrusage(RUSAGE_CHILDREN, &before) < 0) {
+		err(1, "getrusage");
+	}
+	start = now();
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			worker(i);
+		}
+	}
+	failed = 0;
+	for (i = 0; i < nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
+		}
+	}
+	usec = now() - start;
+	if (getrusage(RUSAGE_CHILDREN, &after) < 0) {
+		err(1, "getrusage");
+	}
+	if (usec == 0) {
+		usec = 1;
+	}
+
+	ops = 2ULL * dim * dim * dim;
+	rate = ops * 100 / usec;
+	printf("   %llu.%03llu sec, %llu.%02llu Mops/s\n",
+	       usec / 1000000, (usec / 1000) % 1000, rate / 100, rate % 100);
+	printf("   %lu minor faults (including TLB misses), "
+	       "%lu major faults\n",
+	       (unsigned long)(after.ru_minflt - before.ru_minflt),
+	       (unsigned long)(after.ru_majflt - before.ru_majflt));
+	if (failed > 0) {
+		errx(1, "%u workers FAILED", failed);
+	}
+	printf("Passed.\n");
+	return 0;
+}
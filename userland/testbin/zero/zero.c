@@ -129,6 +129,36 @@ check_sbrk(void)
 	}
 }
 
+/*
+ * Write to parts of the BSS we've so far only read, and check that
+ * the rest of it, and new sbrk memory, still reads as zero. A VM
+ * system that maps reads of untouched pages to one shared zero page
+ * must not let the writes show up anywhere else.
+ */
+static
+void
+check_writes(void)
+{
+	unsigned i, num, want;
+
+	num = sizeof(bss_stuff) / sizeof(bss_stuff[0]);
+	for (i=0; i<num; i++) {
+		if (i % 2048 < 1024) {
+			bss_stuff[i] = i + 1;
+		}
+	}
+	for (i=0; i<num; i++) {
+		want = (i % 2048 < 1024) ? i + 1 : 0;
+		if (bss_stuff[i] != want) {
+			warnx("BSS entry at index %u (address %p) wrong "
+			      "after writing", i, &bss_stuff[i]);
+			warnx("Found: 0x%x  Expected: 0x%x",
+			      bss_stuff[i], want);
+			errx(1, "FAILED");
+		}
+	}
+	check_sbrk();
+}
 
 int
 main(void)
@@ -140,6 +170,9 @@ main(void)
 	printf("zero: phase 2: checking sbrk()\n");
 	check_sbrk();
 
+	printf("zero: phase 3: checking writes to read pages\n");
+	check_writes();
+
 	printf("zero: passed\n");
 	return 0;
 }